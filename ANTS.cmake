@@ -61,6 +61,32 @@ if(USE_VTK)
   endif(VTK_FOUND)
 endif(USE_VTK)
 
+# Compile the scoped timers of antsUtilities.h into the programs, which then
+# print a flat profile of the instrumented hot paths when they exit.
+option(ANTS_ENABLE_PROFILING "Print a profile of the instrumented code paths at exit" OFF)
+mark_as_advanced(ANTS_ENABLE_PROFILING)
+if(ANTS_ENABLE_PROFILING)
+  add_definitions(-DANTS_ENABLE_PROFILING)
+endif()
+
+# Run the dense matrix products of sccan through an external BLAS.  The
+# implementation is chosen with the usual BLA_VENDOR of FindBLAS, e.g.
+# -DBLA_VENDOR=OpenBLAS or -DBLA_VENDOR=Intel10_64lp.
+option(ANTS_USE_BLAS "Use an external BLAS for the matrix products of sccan" OFF)
+mark_as_advanced(ANTS_USE_BLAS)
+set(ANTS_BLAS_LIBRARIES "")
+if(ANTS_USE_BLAS)
+  find_package(BLAS REQUIRED)
+  add_definitions(-DANTS_USE_BLAS)
+  set(ANTS_BLAS_LIBRARIES ${BLAS_LIBRARIES} ${BLAS_LINKER_FLAGS})
+endif()
+
+# The benchmarks link antsRegistration, N4BiasFieldCorrection and
+# antsJointFusion, so they also need BUILD_ALL_ANTS_APPS or
+# ANTS_BUILD_antsJointFusion.
+option(ANTS_BUILD_BENCHMARKS "Build the antsBenchmarks performance suite and the ants_benchmarks target" OFF)
+mark_as_advanced(ANTS_BUILD_BENCHMARKS)
+
 # With MS compilers on Win64, we need the /bigobj switch, else generated
 # code results in objects with number of sections exceeding object file
 # format.
@@ -11,6 +11,7 @@
 #include "itkImageIOBase.h"
 #include "itkImageIOFactory.h"
 #include <math.h>
+#include <cmath>
 #include <iostream>
 #include "ReadWriteData.h"
 #include "itkTransformFileWriter.h"
@@ -18,6 +19,8 @@
 #include <vnl/vnl_matrix.h>
 
 #include "vnl/algo/vnl_qr.h"
+#include "vnl/algo/vnl_svd.h"
+#include "itkMultiThreader.h"
 #include <algorithm>
 
 namespace ants
@@ -91,103 +94,349 @@ void DumpTransformForANTS3D(const typename TransformA::Pointer & transform, cons
 }
 
 // ////////
-// x: fixedLandmarks
-// y: movingLandmarks
+// x: points of the field, y = x + u(x)
 // (A,t,c) : affine transform, A:3*3, t: 3*1 c: 3*1 (c is the center of all points in x)
 // y-c = A*(x-c) + t;
-// steps:
-// 1. c = average of points of x
-// 2. let y1 = y-c; x1 = x - c; x11 = [x1; 1 ... 1] // extend x11
-// 3. minimize (y1-A1*x11)^2, A1 is a 3*4 matrix
-// 4. A = A1(1:3, 1:3), t = A1(1:3, 4);
-// step 3:
-//   A11 = (y1*x11')*(x11*x11')^(-1)
-// type info:
-//   assume PointContainerType is std::vector
-//   assume TrnasformPointerType is MatrixOffsetTransformBase
-
-template <class PointContainerType, class TransformType>
-void GetAffineTransformFromTwoPointSets3D(PointContainerType & fixedLandmarks, PointContainerType & movingLandmarks,
-                                          typename TransformType::Pointer & transform)
+// The points are not stored:  with x1 = x - o, y1 = y - o, o the center of
+// the field, and x11 = [x1; 1], each thread sums the (weighted) normal
+// equations
+//   M = sum w x11*x11',  R = sum w y1*x11'
+// and A11 = R*M^(-1) = [A, t_o];  c is the weighted mean of x, from the last
+// column of M, and t = A*(c-o) + t_o - (c-o).  The sums are compensated
+// (Kahan), so that millions of points do not lose the small terms.
+//
+// With a load ratio below 1 one voxel of each block of 1/ratio voxels is
+// taken, at a pseudo-random offset which only depends on the block, so the
+// samples cover the field evenly and do not depend on the number of threads.
+//
+// The robust fit is iteratively reweighted:  Huber weights min(1, k/r), r the
+// residual of the previous fit and k 1.345 times its RMS value.
+
+/** A sum with Kahan's compensation of the rounding errors. */
+struct CompensatedSum
+  {
+  double Sum;
+  double Compensation;
+
+  CompensatedSum() : Sum( 0.0 ), Compensation( 0.0 )
+  {
+  }
+
+  void Add( double value )
+  {
+    const double y = value - this->Compensation;
+    const double t = this->Sum + y;
+
+    this->Compensation = ( t - this->Sum ) - y;
+    this->Sum = t;
+  }
+
+  void Add( const CompensatedSum & other )
+  {
+    this->Add( other.Sum );
+    this->Add( -other.Compensation );
+  }
+  };
+
+template <unsigned int Dim>
+struct AffineNormalEquations
+  {
+  CompensatedSum Normal[Dim + 1][Dim + 1];
+  CompensatedSum RightHandSide[Dim][Dim + 1];
+  CompensatedSum SquaredResiduals;
+  CompensatedSum NumberOfPoints;
+  };
+
+template <unsigned int Dim>
+struct AffineFitThreadStruct
+  {
+  typedef itk::Vector<float, Dim> VectorType;
+
+  const VectorType * Displacements;
+  const float *      Mask;
+  itk::SizeValueType Size[Dim];
+  itk::SizeValueType NumberOfPixels;
+  itk::SizeValueType BlockSize;
+  itk::SizeValueType NumberOfBlocks;
+  double             IndexToPhysical[Dim][Dim];
+  double             Origin[Dim]; // relative to the center of the field
+
+  // the previous fit, y1 = A*x1 + t_o, for the residuals and weights
+  bool   UseFit;
+  double Matrix[Dim][Dim];
+  double Translation[Dim];
+  double HuberThreshold;           // 0 for unit weights
+  bool   AccumulateNormalEquations;
+
+  std::vector<AffineNormalEquations<Dim> > Partial;
+  };
+
+template <unsigned int Dim>
+ITK_THREAD_RETURN_TYPE AffineFitThreaderCallback( void *arg )
 {
-  const int Dim = 3;
-  int       n = fixedLandmarks.size();
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  AffineFitThreadStruct<Dim> *          str = static_cast<AffineFitThreadStruct<Dim> *>( info->UserData );
+  AffineNormalEquations<Dim> &          sums = str->Partial[info->ThreadID];
 
-  vnl_matrix<double> y(Dim, n), x(Dim, n);
-  for( int i = 0; i < n; i++ )
+  const itk::SizeValueType first = str->NumberOfBlocks * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType last = str->NumberOfBlocks * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  for( itk::SizeValueType b = first; b < last; b++ )
     {
-    for( int j = 0; j < Dim; j++ )
+    itk::SizeValueType n = b * str->BlockSize;
+    if( str->BlockSize > 1 )
       {
-      x(j, i) = fixedLandmarks[i][j];
-      y(j, i) = movingLandmarks[i][j];
+      itk::SizeValueType hash = ( b + 1 ) * 2654435761ul;
+      hash ^= ( hash >> 16 );
+      n += hash % str->BlockSize;
+      }
+    if( n >= str->NumberOfPixels || ( str->Mask && str->Mask[n] < 0.5 ) )
+      {
+      continue;
+      }
+
+    double             index[Dim];
+    itk::SizeValueType remainder = n;
+    for( unsigned int d = 0; d < Dim; d++ )
+      {
+      index[d] = static_cast<double>( remainder % str->Size[d] );
+      remainder /= str->Size[d];
+      }
+    double x[Dim + 1];
+    double y[Dim];
+    for( unsigned int i = 0; i < Dim; i++ )
+      {
+      x[i] = str->Origin[i];
+      for( unsigned int j = 0; j < Dim; j++ )
+        {
+        x[i] += str->IndexToPhysical[i][j] * index[j];
+        }
+      y[i] = x[i] + str->Displacements[n][i];
+      }
+    x[Dim] = 1.0;
+
+    double weight = 1.0;
+    if( str->UseFit )
+      {
+      double squaredResidual = 0.0;
+      for( unsigned int i = 0; i < Dim; i++ )
+        {
+        double residual = y[i] - str->Translation[i];
+        for( unsigned int j = 0; j < Dim; j++ )
+          {
+          residual -= str->Matrix[i][j] * x[j];
+          }
+        squaredResidual += residual * residual;
+        }
+      sums.SquaredResiduals.Add( squaredResidual );
+
+      const double residualNorm = std::sqrt( squaredResidual );
+      if( str->HuberThreshold > 0.0 && residualNorm > str->HuberThreshold )
+        {
+        weight = str->HuberThreshold / residualNorm;
+        }
+      }
+    sums.NumberOfPoints.Add( 1.0 );
+
+    if( str->AccumulateNormalEquations )
+      {
+      for( unsigned int i = 0; i <= Dim; i++ )
+        {
+        const double wx = weight * x[i];
+        for( unsigned int j = i; j <= Dim; j++ )
+          {
+          sums.Normal[i][j].Add( wx * x[j] );
+          }
+        }
+      for( unsigned int i = 0; i < Dim; i++ )
+        {
+        const double wy = weight * y[i];
+        for( unsigned int j = 0; j <= Dim; j++ )
+          {
+          sums.RightHandSide[i][j].Add( wy * x[j] );
+          }
+        }
       }
     }
+  return ITK_THREAD_RETURN_VALUE;
+}
 
-  vnl_vector<double> c(Dim);
-  for( int j = 0; j < Dim; j++ )
+/** One pass over the field, the partial sums of the threads reduced in order. */
+template <unsigned int Dim>
+AffineNormalEquations<Dim> AccumulateAffineNormalEquations( AffineFitThreadStruct<Dim> & str )
+{
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                      threader->GetNumberOfThreads() ), str.NumberOfBlocks ),
+                                          static_cast<itk::SizeValueType>( 1 ) ) );
+  str.Partial.assign( threader->GetNumberOfThreads(), AffineNormalEquations<Dim>() );
+  threader->SetSingleMethod( AffineFitThreaderCallback<Dim>, &str );
+  threader->SingleMethodExecute();
+
+  AffineNormalEquations<Dim> sums;
+  for( unsigned int t = 0; t < str.Partial.size(); t++ )
     {
-    c[j] = x.get_row(j).mean();
+    for( unsigned int i = 0; i <= Dim; i++ )
+      {
+      for( unsigned int j = i; j <= Dim; j++ )
+        {
+        sums.Normal[i][j].Add( str.Partial[t].Normal[i][j] );
+        }
+      }
+    for( unsigned int i = 0; i < Dim; i++ )
+      {
+      for( unsigned int j = 0; j <= Dim; j++ )
+        {
+        sums.RightHandSide[i][j].Add( str.Partial[t].RightHandSide[i][j] );
+        }
+      }
+    sums.SquaredResiduals.Add( str.Partial[t].SquaredResiduals );
+    sums.NumberOfPoints.Add( str.Partial[t].NumberOfPoints );
     }
+  return sums;
+}
 
-  vnl_matrix<double> y1(Dim, n), x11(Dim + 1, n);
-  for( int i = 0; i < n; i++ )
+/** A11 = R*M^(-1), into the fit of the thread struct. */
+template <unsigned int Dim>
+void SolveAffineNormalEquations( const AffineNormalEquations<Dim> & sums, AffineFitThreadStruct<Dim> & str )
+{
+  vnl_matrix<double> M( Dim + 1, Dim + 1 );
+  vnl_matrix<double> R( Dim, Dim + 1 );
+  for( unsigned int i = 0; i <= Dim; i++ )
     {
-    y1.set_column(i, y.get_column(i) - c);
+    for( unsigned int j = i; j <= Dim; j++ )
+      {
+      M( i, j ) = M( j, i ) = sums.Normal[i][j].Sum;
+      }
+    }
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    for( unsigned int j = 0; j <= Dim; j++ )
+      {
+      R( i, j ) = sums.RightHandSide[i][j].Sum;
+      }
+    }
 
-    vnl_vector<double> x_tmp(Dim), x1_tmp(Dim + 1);
-    x_tmp = x.get_column(i) - c;
-    for( int j = 0; j < Dim; j++ )
+  vnl_svd<double>    svd( M );
+  vnl_matrix<double> A11 = R * svd.inverse();
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    for( unsigned int j = 0; j < Dim; j++ )
       {
-      x1_tmp[j] = x_tmp[j];
+      str.Matrix[i][j] = A11( i, j );
       }
-    x1_tmp[Dim] = 1;
+    str.Translation[i] = A11( i, Dim );
+    }
+  str.UseFit = true;
+}
+
+template <class DisplacementFieldType, class MaskImageType, class TransformType>
+bool GetAffineTransformFromDisplacementField3D( const DisplacementFieldType *field, const MaskImageType *maskimg,
+                                                float load_ratio, unsigned int numberOfRobustIterations,
+                                                typename TransformType::Pointer & transform )
+{
+  const unsigned int Dim = 3;
 
-    x11.set_column(i, x1_tmp);
+  AffineFitThreadStruct<Dim> str;
+  str.Displacements = field->GetBufferPointer();
+  str.Mask = maskimg ? maskimg->GetBufferPointer() : ITK_NULLPTR;
+  str.NumberOfPixels = field->GetBufferedRegion().GetNumberOfPixels();
+  str.BlockSize = ( load_ratio > 0 && load_ratio < 1 ) ?
+    static_cast<itk::SizeValueType>( 1.0 / load_ratio + 0.5 ) : 1;
+  str.NumberOfBlocks = ( str.NumberOfPixels + str.BlockSize - 1 ) / str.BlockSize;
+
+  // the points relative to the center of the field, o
+  double center[Dim];
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    str.Size[i] = field->GetBufferedRegion().GetSize()[i];
+    center[i] = field->GetOrigin()[i];
+    for( unsigned int j = 0; j < Dim; j++ )
+      {
+      str.IndexToPhysical[i][j] = field->GetDirection()[i][j] * field->GetSpacing()[j];
+      center[i] += str.IndexToPhysical[i][j] * 0.5 * ( field->GetBufferedRegion().GetSize()[j] - 1.0 );
+      }
+    }
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    str.Origin[i] = field->GetOrigin()[i] - center[i];
     }
 
-  vnl_matrix<double> A11(Dim, Dim + 1);
-  vnl_matrix<double> x11t = x11.transpose();
-  // vnl_matrix_inverse<double> tmp(x11 * x11t); // BA -- removed this -- not used?
+  str.UseFit = false;
+  str.HuberThreshold = 0.0;
+  str.AccumulateNormalEquations = true;
+  AffineNormalEquations<Dim> sums = AccumulateAffineNormalEquations<Dim>( str );
+
+  std::cout << "total " << static_cast<itk::SizeValueType>( sums.NumberOfPoints.Sum )
+           << " points used from " << str.NumberOfPixels << "." << std::endl;
+  if( !( sums.Normal[Dim][Dim].Sum > 0.0 ) )
+    {
+    std::cerr << "No points in the mask." << std::endl;
+    return false;
+    }
+  SolveAffineNormalEquations<Dim>( sums, str );
 
-  vnl_svd<double> qr( x11t );   // can use vnl_qr
-  A11 = qr.inverse() * (y1.transpose() );
-  A11 = A11.transpose();
+  for( unsigned int iteration = 0; iteration < numberOfRobustIterations; iteration++ )
+    {
+    str.HuberThreshold = 0.0;
+    str.AccumulateNormalEquations = false;
+    const AffineNormalEquations<Dim> residuals = AccumulateAffineNormalEquations<Dim>( str );
+    const double rms = std::sqrt( residuals.SquaredResiduals.Sum / residuals.NumberOfPoints.Sum );
 
-  vnl_matrix<double> A(Dim, Dim);
-  A = A11.extract(Dim, Dim, 0, 0);
+    std::cout << " robust iteration " << iteration + 1 << ": RMS residual " << rms << std::endl;
+    if( !( rms > 0.0 ) )
+      {
+      break;
+      }
 
-  //    std::cout << "y=" << y << std::endl;
-  //    std::cout << "x=" << x << std::endl;
-  //
-  //    std::cout << "y1=" << y1 << std::endl;
-  //    std::cout << "x11=" << x11 << std::endl;
-  std::cout << "A11=" << A11 << std::endl;
+    str.HuberThreshold = 1.345 * rms;
+    str.AccumulateNormalEquations = true;
+    sums = AccumulateAffineNormalEquations<Dim>( str );
+    SolveAffineNormalEquations<Dim>( sums, str );
+    }
 
-  vnl_vector<double> t = A11.get_column(Dim);
+  // from the center of the field to the (weighted) center of the points
+  vnl_matrix<double> A( Dim, Dim );
+  vnl_vector<double> c( Dim );
+  vnl_vector<double> t( Dim );
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    c[i] = sums.Normal[i][Dim].Sum / sums.Normal[Dim][Dim].Sum;
+    }
+  for( unsigned int i = 0; i < Dim; i++ )
+    {
+    t[i] = str.Translation[i] - c[i];
+    for( unsigned int j = 0; j < Dim; j++ )
+      {
+      A( i, j ) = str.Matrix[i][j];
+      t[i] += str.Matrix[i][j] * c[j];
+      }
+    }
+  std::cout << "A=" << A << std::endl;
+  std::cout << "t=" << t << std::endl;
 
   typedef typename TransformType::InputPointType   PointType;
   typedef typename TransformType::OutputVectorType VectorType;
   typedef typename TransformType::MatrixType       MatrixType;
 
-  PointType center;
-  for( int i = 0; i < Dim; i++ )
+  PointType pointCenter;
+  for( unsigned int i = 0; i < Dim; i++ )
     {
-    center[i] = c[i];
+    pointCenter[i] = c[i] + center[i];
     }
 
   VectorType translation;
-  for( int i = 0; i < Dim; i++ )
+  for( unsigned int i = 0; i < Dim; i++ )
     {
     translation[i] = t[i];
     }
 
-  MatrixType matrix(A);
+  MatrixType matrix( A );
 
-  transform->SetCenter(center);
-  transform->SetTranslation(translation);
-  transform->SetMatrix(matrix);
+  transform->SetCenter( pointCenter );
+  transform->SetTranslation( translation );
+  transform->SetMatrix( matrix );
 
-  return;
+  return true;
 }
 
 template <class PointContainerType, class TTransform>
@@ -330,10 +579,13 @@ int DisplacementFieldBasedTransformInitializer3D(int argc, char * argv[])
     {
     maskfn = std::string(argv[5]);
     }
+  unsigned int numberOfRobustIterations = 0;
+  if( argc > 6 )
+    {
+    numberOfRobustIterations = atoi(argv[6]);
+    }
   std::cout << " mask " << maskfn << std::endl;
 
-  // input
-  PointContainerType fixedLandmarks, movingLandmarks;
   // output
   typedef itk::MatrixOffsetTransformBase<double, 3, 3> AffineTransformType;
   AffineTransformType::Pointer aff = AffineTransformType::New();
@@ -344,16 +596,31 @@ int DisplacementFieldBasedTransformInitializer3D(int argc, char * argv[])
     ReadImage<ImageType>(maskimg, maskfn.c_str() );
     }
 
-  FetchLandmarkMappingFromDisplacementField(deformation_field_file_name, load_ratio, fixedLandmarks, movingLandmarks,
-                                            maskimg);
-
   if( bRigid )
     {
+    PointContainerType fixedLandmarks, movingLandmarks;
+    FetchLandmarkMappingFromDisplacementField(deformation_field_file_name, load_ratio, fixedLandmarks,
+                                              movingLandmarks, maskimg);
     GetRigidTransformFromTwoPointSets3D<PointContainerType, AffineTransformType>(fixedLandmarks, movingLandmarks, aff);
     }
   else
     {
-    GetAffineTransformFromTwoPointSets3D<PointContainerType, AffineTransformType>(fixedLandmarks, movingLandmarks, aff);
+    typedef itk::Image<itk::Vector<float, Dim>, Dim> DisplacementFieldType;
+    DisplacementFieldType::Pointer field = ITK_NULLPTR;
+    if( !ReadImage<DisplacementFieldType>(field, deformation_field_file_name) )
+      {
+      return EXIT_FAILURE;
+      }
+    if( maskimg && maskimg->GetBufferedRegion().GetSize() != field->GetBufferedRegion().GetSize() )
+      {
+      std::cerr << "The mask is not on the grid of the deformation field." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( !GetAffineTransformFromDisplacementField3D<DisplacementFieldType, ImageType, AffineTransformType>(
+          field, maskimg, load_ratio, numberOfRobustIterations, aff) )
+      {
+      return EXIT_FAILURE;
+      }
     }
 
   std::cout << "affine:" << aff;
@@ -461,11 +728,14 @@ private:
   if( argc < 3 )
     {
     std::cout << "Usage:   " << argv[0]
-             << " zzzWarp.nii.gz load_ratio(ex: 0.01) [rigid | affine] OutAffine.txt [mask.nii.gz]" << std::endl;
+             << " zzzWarp.nii.gz load_ratio(ex: 0.01) [rigid | affine] OutAffine.txt [mask.nii.gz] "
+             << "[robust_iterations=0]" << std::endl;
     std::cout << " we expect the input deformation field in the same physical space as the images you want to "
              << std::endl;
     std::cout << "load_ratio: ratio of points to be loaded from deformation field (to save memory) " << std::endl;
     std::cout << " the mask gives the region from which points will be selected ... " << std::endl;
+    std::cout << "robust_iterations: reweighted (Huber) refits of the affine transform, to discount the "
+             << "outliers of the field " << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
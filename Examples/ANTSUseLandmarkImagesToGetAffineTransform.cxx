@@ -10,6 +10,7 @@
 #include <math.h>
 #include <iostream>
 #include "ReadWriteData.h"
+#include "antsLabelGeometry.h"
 #include "itkTransformFileWriter.h"
 
 #include <vnl/vnl_matrix.h>
@@ -188,181 +189,102 @@ int LandmarkBasedTransformInitializerBA(int, char * argv[])
   typedef itk::Image<PixelType, Dimension>             FixedImageType;
   typedef itk::Image<PixelType, Dimension>             MovingImageType;
   typedef itk::Image<PixelType, Dimension>             ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  typename ImageType::Pointer fixedimage;
-  typename ImageType::Pointer movingimage;
-  ReadImage<ImageType>(fixedimage, argv[1]);
-  ReadImage<ImageType>(movingimage, argv[2]);
 
   bool bRigid = (strcmp(argv[3], "rigid") == 0);
 
-  /** get all of the relevant labels in the fixed image and moving image */
-  typedef std::vector<PixelType> LabelSetType;
-  LabelSetType myFixLabelSet;
-  LabelSetType myMovLabelSet;
-  /** count the labels in the image */
-  Iterator It( fixedimage, fixedimage->GetLargestPossibleRegion() );
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    PixelType label = It.Get();
-    if( fabs(label) > 0 )
-      {
-      if( find( myFixLabelSet.begin(), myFixLabelSet.end(), label )
-          == myFixLabelSet.end() )
-        {
-        //          std::cout <<" f-label " << label << std::endl;
-        myFixLabelSet.push_back( label );
-        }
-      }
-    }
-  Iterator ItM( movingimage, movingimage->GetLargestPossibleRegion() );
-  for( ItM.GoToBegin(); !ItM.IsAtEnd(); ++ItM )
-    {
-    PixelType label = ItM.Get();
-    if( fabs(label) > 0 )
-      {
-      if( find( myMovLabelSet.begin(), myMovLabelSet.end(), label )
-          == myMovLabelSet.end() )
-        {
-        //          std::cout <<" m-label " << label << std::endl;
-        myMovLabelSet.push_back( label );
-        }
-      }
-    }
-
-  std::sort(myFixLabelSet.begin(), myFixLabelSet.end() );
-  std::sort(myMovLabelSet.begin(), myMovLabelSet.end() );
-
-  LabelSetType::const_iterator fit;
-  LabelSetType::const_iterator mit = myMovLabelSet.begin();
-  for( fit = myFixLabelSet.begin(); fit != myFixLabelSet.end(); ++fit )
-    {
-    float fixlabel = *fit;
-    float movlabel = *mit;
-    std::cout << " fix-label " << fixlabel << " movlabel " << movlabel << std::endl;
-    if( movlabel != fixlabel )
-      {
-      std::cout << " labels do not match -- exiting " << std::endl;
-      exit(1);
-      }
-    ++mit;
-    }
-
   // Set the transform type..
   typedef itk::AffineTransform<double,Dimension> TransformType;
-  typename TransformType::Pointer transform = TransformType::New();
   typedef itk::LandmarkBasedTransformInitializer<TransformType,
                                                  FixedImageType, MovingImageType> TransformInitializerType;
-                                                 typename TransformInitializerType::Pointer initializer = TransformInitializerType::New();
-
-  // Set fixed and moving landmarks
   typedef typename TransformInitializerType::LandmarkPointContainer PointsContainerType;
-  PointsContainerType fixedLandmarks;
-  PointsContainerType movingLandmarks;
+  typedef typename TransformInitializerType::LandmarkPointType      LandmarkPointType;
 
-  // compute the CoM's of all the landmarks
-  typename ImageType::SpacingType spacing = fixedimage->GetSpacing();
-  for( fit = myFixLabelSet.begin(); fit != myFixLabelSet.end(); ++fit )
+  /** the moving images of a batch are fitted to the same fixed landmarks */
+  const std::vector<std::string> movingFileNames = GetBatchFileNames( argv[2] );
+  const std::vector<std::string> outputFileNames = GetBatchFileNames( argv[4] );
+  if( movingFileNames.size() != outputFileNames.size() )
     {
-    float                                       currentlabel = *fit;
-    float                                       totalct = 0;
-    typename TransformInitializerType::LandmarkPointType myCenterOfMass;
-    myCenterOfMass.Fill(0);
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      PixelType label = It.Get();
-      if( fabs( label - currentlabel ) < 0.001  )
-        {
-        totalct++;
-        // compute center of mass
-        typename ImageType::PointType point;
-        fixedimage->TransformIndexToPhysicalPoint(It.GetIndex(), point);
-        for( unsigned int i = 0; i < spacing.Size(); i++ )
-          {
-          myCenterOfMass[i] += point[i];
-          }
-        std::cout << " point " << point << std::endl;
-        }
-      }
-    for( unsigned int i = 0; i < spacing.Size(); i++ )
-      {
-      myCenterOfMass[i] /= (float)totalct;
-      }
-    // std::cout << " pushing-fix " <<  myCenterOfMass << std::endl;
-    fixedLandmarks.push_back( myCenterOfMass );
+    std::cerr << " the numbers of moving images and output transforms differ -- exiting " << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  /** get all of the relevant labels in the fixed image and the CoM's of the landmarks */
+  typedef std::vector<PixelType> LabelSetType;
+  LabelSetType        myFixLabelSet;
+  PointsContainerType fixedLandmarks;
+    {
+    typename ImageType::Pointer fixedimage;
+    ReadImage<ImageType>(fixedimage, argv[1]);
+    GetLabelCentroids<ImageType, LandmarkPointType>( fixedimage, myFixLabelSet, fixedLandmarks );
     }
 
-  // compute the CoM's of all the landmarks
-  spacing = movingimage->GetSpacing();
-  for( mit = myMovLabelSet.begin(); mit != myMovLabelSet.end(); ++mit )
+  for( unsigned int b = 0; b < movingFileNames.size(); b++ )
     {
-    float                                       currentlabel = *mit;
-    float                                       totalct = 0;
-    typename TransformInitializerType::LandmarkPointType myCenterOfMass;
-    myCenterOfMass.Fill(0);
-    for( ItM.GoToBegin(); !ItM.IsAtEnd(); ++ItM )
+    typename ImageType::Pointer movingimage;
+    ReadImage<ImageType>(movingimage, movingFileNames[b].c_str() );
+
+    LabelSetType        myMovLabelSet;
+    PointsContainerType movingLandmarks;
+    GetLabelCentroids<ImageType, LandmarkPointType>( movingimage, myMovLabelSet, movingLandmarks );
+
+    if( myMovLabelSet.size() != myFixLabelSet.size() )
       {
-      PixelType label = ItM.Get();
-      if(  label == currentlabel  )
-        {
-        totalct++;
-        // compute center of mass
-        typename ImageType::PointType point;
-        movingimage->TransformIndexToPhysicalPoint(ItM.GetIndex(), point);
-        for( unsigned int i = 0; i < spacing.Size(); i++ )
-          {
-          myCenterOfMass[i] += point[i];
-          }
-        }
+      std::cout << " labels do not match -- exiting " << std::endl;
+      exit(1);
       }
-    for( unsigned int i = 0; i < spacing.Size(); i++ )
+    typename LabelSetType::const_iterator fit;
+    typename LabelSetType::const_iterator mit = myMovLabelSet.begin();
+    for( fit = myFixLabelSet.begin(); fit != myFixLabelSet.end(); ++fit )
       {
-      myCenterOfMass[i] /= (float)totalct;
+      float fixlabel = *fit;
+      float movlabel = *mit;
+      std::cout << " fix-label " << fixlabel << " movlabel " << movlabel << std::endl;
+      if( movlabel != fixlabel )
+        {
+        std::cout << " labels do not match -- exiting " << std::endl;
+        exit(1);
+        }
+      ++mit;
       }
-    //    std::cout << " pushing-mov " <<  myCenterOfMass << std::endl;
-    movingLandmarks.push_back( myCenterOfMass );
-    }
 
     typename TransformInitializerType::PointsContainerConstIterator
-    fitr = fixedLandmarks.begin();
+      fitr = fixedLandmarks.begin();
     typename TransformInitializerType::PointsContainerConstIterator
-    mitr = movingLandmarks.begin();
-  while( mitr != movingLandmarks.end() )
-    {
-    std::cout << "  Fixed Landmark: " << *fitr << " Moving landmark " << *mitr << std::endl;
-    ++fitr;
-    ++mitr;
-    }
-
-  initializer->SetFixedLandmarks(fixedLandmarks);
-  initializer->SetMovingLandmarks(movingLandmarks);
+      mitr = movingLandmarks.begin();
+    while( mitr != movingLandmarks.end() )
+      {
+      std::cout << "  Fixed Landmark: " << *fitr << " Moving landmark " << *mitr << std::endl;
+      ++fitr;
+      ++mitr;
+      }
 
-  //  initializer->SetFixedImage( fixedimage );
-  //  initializer->SetMovingImage( movingimage );
-  initializer->SetTransform( transform );
-  initializer->InitializeTransform();
+    typename TransformType::Pointer transform = TransformType::New();
+    typename TransformInitializerType::Pointer initializer = TransformInitializerType::New();
+    initializer->SetFixedLandmarks(fixedLandmarks);
+    initializer->SetMovingLandmarks(movingLandmarks);
+    initializer->SetTransform( transform );
+    initializer->InitializeTransform();
 
-  transform->Print(std::cout);
-  // to transform a point
-  //         transform->TransformPoint( *fitr ) << std::endl;
+    transform->Print(std::cout);
 
-  // transform the transform to ANTS format
-  std::string ANTS_prefix(argv[4]);
+    // transform the transform to ANTS format
+    std::string ANTS_prefix( outputFileNames[b] );
 
-  typedef itk::AffineTransform<double, Dimension> AffineTransformType;
-  typename AffineTransformType::Pointer aff = AffineTransformType::New();
+    typedef itk::AffineTransform<double, Dimension> AffineTransformType;
+    typename AffineTransformType::Pointer aff = AffineTransformType::New();
 
-  GetAffineTransformFromTwoPointSets<PointsContainerType, AffineTransformType,Dimension>(fixedLandmarks, movingLandmarks, aff);
+    GetAffineTransformFromTwoPointSets<PointsContainerType, AffineTransformType,Dimension>(fixedLandmarks, movingLandmarks, aff);
 
-  std::cout << "affine:" << aff;
+    std::cout << "affine:" << aff;
 
-  if( bRigid )
-    {
-    DumpTransformForANTS3D<TransformType,Dimension>(transform, ANTS_prefix);
-    }
-  else
-    {
-    DumpTransformForANTS3D<AffineTransformType,Dimension>(aff, ANTS_prefix);
+    if( bRigid )
+      {
+      DumpTransformForANTS3D<TransformType,Dimension>(transform, ANTS_prefix);
+      }
+    else
+      {
+      DumpTransformForANTS3D<AffineTransformType,Dimension>(aff, ANTS_prefix);
+      }
     }
   return EXIT_SUCCESS;
 }
@@ -421,6 +343,8 @@ private:
     std::cout << " register and (3 ) to have the same landmark points defined within them ... " << std::endl;
     std::cout << " landmarks will be defined from the center of mass of the labels in the input images . " << std::endl;
     std::cout << " You can use ITK-snap to generate the label images. " << std::endl;
+    std::cout << " Comma separated moving images and output transforms are fitted in turn to the landmarks "
+             << "of the fixed image, which are only computed once. " << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
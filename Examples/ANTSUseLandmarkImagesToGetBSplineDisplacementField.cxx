@@ -1,6 +1,7 @@
 /** ANTS Landmarks used to initialize an b-spline displacement field ... */
 
 #include "antsUtilities.h"
+#include "antsLabelGeometry.h"
 
 #include "itkBSplineScatteredDataPointSetToImageFilter.h"
 #include "itkContinuousIndex.h"
@@ -52,417 +53,337 @@ int LandmarkBasedDisplacementFieldTransformInitializer( int argc, char *argv[] )
 
   const typename ImporterType::OutputImageType * parametricInputImage = importer->GetOutput();
 
-  typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
-  movingReader->SetFileName( argv[2] );
-  movingReader->Update();
-  typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
-
-///////////////////////////////////////////////////////////////////////////////////////////
-
   typedef itk::Vector<RealType, ImageDimension>  VectorType;
   typedef itk::Image<VectorType, ImageDimension> DisplacementFieldType;
 
   typedef itk::PointSet<LabelType, ImageDimension> PointSetType;
 
-  typename PointSetType::Pointer fixedPoints = PointSetType::New();
-  fixedPoints->Initialize();
-
-  std::vector<LabelType> fixedLabels;
-
-  itk::ImageRegionIteratorWithIndex<LabelImageType> ItF( fixedImage, fixedImage->GetLargestPossibleRegion() );
+  // Get fixed center points, once for all of the moving images
+  std::vector<LabelType>                        fixedLabels;
+  std::vector<typename PointSetType::PointType> fixedCentroids;
+  GetLabelCentroids<LabelImageType, typename PointSetType::PointType>( fixedImage, fixedLabels, fixedCentroids );
 
-  unsigned int fixedCount = 0;
-  for( ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItF )
+  typename PointSetType::Pointer fixedCenters = PointSetType::New();
+  fixedCenters->Initialize();
+  for( unsigned int n = 0; n < fixedLabels.size(); n++ )
     {
-    if( ItF.Get() != 0 )
-      {
-      if( std::find( fixedLabels.begin(), fixedLabels.end(), ItF.Get() ) == fixedLabels.end() )
-        {
-        fixedLabels.push_back( ItF.Get() );
-        }
-      typename PointSetType::PointType fixedPoint;
-      fixedImage->TransformIndexToPhysicalPoint( ItF.GetIndex(), fixedPoint );
-      fixedPoints->SetPointData( fixedCount, ItF.Get() );
-      fixedPoints->SetPoint( fixedCount++, fixedPoint );
-      }
+    fixedCenters->SetPoint( n, fixedCentroids[n] );
+    fixedCenters->SetPointData( n, fixedLabels[n] );
     }
-  std::sort( fixedLabels.begin(), fixedLabels.end() );
-
-  typename PointSetType::Pointer movingPoints = PointSetType::New();
-  movingPoints->Initialize();
 
-  std::vector<LabelType> movingLabels;
+  itk::ImageRegionIteratorWithIndex<LabelImageType> ItF( fixedImage, fixedImage->GetLargestPossibleRegion() );
 
-  itk::ImageRegionIteratorWithIndex<LabelImageType> ItM( movingImage, movingImage->GetLargestPossibleRegion() );
-  unsigned int                                      movingCount = 0;
-  for( ItM.GoToBegin(); !ItM.IsAtEnd(); ++ItM )
+  const std::vector<std::string> movingFileNames = GetBatchFileNames( argv[2] );
+  const std::vector<std::string> outputFileNames = GetBatchFileNames( argv[3] );
+  if( movingFileNames.size() != outputFileNames.size() )
     {
-    if( ItM.Get() != 0 )
-      {
-      if( std::find( movingLabels.begin(), movingLabels.end(), ItM.Get() ) == movingLabels.end() )
-        {
-        movingLabels.push_back( ItM.Get() );
-        }
-      typename PointSetType::PointType movingPoint;
-      movingImage->TransformIndexToPhysicalPoint( ItM.GetIndex(), movingPoint );
-      movingPoints->SetPointData( movingCount, ItM.Get() );
-      movingPoints->SetPoint( movingCount++, movingPoint );
-      }
+    std::cerr << "The numbers of moving images and output fields must be the same." << std::endl;
+    return EXIT_FAILURE;
     }
-  std::sort( movingLabels.begin(), movingLabels.end() );
 
-  // Get moving center points
-  typename PointSetType::Pointer movingCenters = PointSetType::New();
-  movingCenters->Initialize();
-  for( unsigned int n = 0; n < movingLabels.size(); n++ )
+  for( unsigned int b = 0; b < movingFileNames.size(); b++ )
     {
-    LabelType currentLabel = movingLabels[n];
-    typename PointSetType::PointType center;
-    center.Fill( 0 );
-    float N = 0;
-    typename PointSetType::PointsContainerConstIterator ItP =
-      movingPoints->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator ItD =
-      movingPoints->GetPointData()->Begin();
-    while( ItP != movingPoints->GetPoints()->End() )
-      {
-      if( ItD.Value() == currentLabel )
-        {
-        typename PointSetType::PointType point = ItP.Value();
-        for( unsigned int d = 0; d < ImageDimension; d++ )
-          {
-          center[d] += point[d];
-          }
-        N += 1.0;
-        }
-      ++ItP;
-      ++ItD;
-      }
-    for( unsigned int d = 0; d < ImageDimension; d++ )
+    typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
+    movingReader->SetFileName( movingFileNames[b].c_str() );
+    movingReader->Update();
+    typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
+
+    // Get moving center points
+    std::vector<LabelType>                        movingLabels;
+    std::vector<typename PointSetType::PointType> movingCentroids;
+    GetLabelCentroids<LabelImageType, typename PointSetType::PointType>( movingImage, movingLabels, movingCentroids );
+
+    typename PointSetType::Pointer movingCenters = PointSetType::New();
+    movingCenters->Initialize();
+    for( unsigned int n = 0; n < movingLabels.size(); n++ )
       {
-      center[d] /= N;
+      movingCenters->SetPoint( n, movingCentroids[n] );
+      movingCenters->SetPointData( n, movingLabels[n] );
       }
-    movingCenters->SetPoint( n, center );
-    movingCenters->SetPointData( n, currentLabel );
-    }
 
-  // Get fixed center points
-  typename PointSetType::Pointer fixedCenters = PointSetType::New();
-  fixedCenters->Initialize();
-  for( unsigned int n = 0; n < fixedLabels.size(); n++ )
-    {
-    LabelType currentLabel = fixedLabels[n];
-    typename PointSetType::PointType center;
-    center.Fill( 0 );
-    float N = 0;
-    typename PointSetType::PointsContainerConstIterator ItP =
-      fixedPoints->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator ItD =
-      fixedPoints->GetPointData()->Begin();
-    while( ItP != fixedPoints->GetPoints()->End() )
+    if( fixedCenters->GetNumberOfPoints() != movingCenters->GetNumberOfPoints() )
       {
-      if( ItD.Value() == currentLabel )
-        {
-        typename PointSetType::PointType point = ItP.Value();
-        for( unsigned int d = 0; d < ImageDimension; d++ )
-          {
-          center[d] += point[d];
-          }
-        N += 1.0;
-        }
-      ++ItP;
-      ++ItD;
-      }
-    for( unsigned int d = 0; d < ImageDimension; d++ )
-      {
-      center[d] /= N;
+      std::cerr << "The number of fixed points and moving points must be the same." << std::endl;
+      return EXIT_FAILURE;
       }
-    fixedCenters->SetPoint( n, center );
-    fixedCenters->SetPointData( n, currentLabel );
-    }
-
-  if( fixedCenters->GetNumberOfPoints() != movingCenters->GetNumberOfPoints() )
-    {
-    std::cerr << "The number of fixed points and moving points must be the same." << std::endl;
-    return EXIT_FAILURE;
-    }
 
-  // Read in the optional label weights
+    // Read in the optional label weights
 
-  std::vector<float>     labelWeights;
-  std::vector<LabelType> userLabels;
+    std::vector<float>     labelWeights;
+    std::vector<LabelType> userLabels;
 
-  bool useWeights = false;
+    bool useWeights = false;
 
-  unsigned int labelCount = 0;
-  if( argc > 8 )
-    {
-    useWeights = true;
+    unsigned int labelCount = 0;
+    if( argc > 8 )
+      {
+      useWeights = true;
 
-    std::fstream labelStr( argv[8] );
+      std::fstream labelStr( argv[8] );
 
-    if( labelStr.is_open() )
-      {
-      while( !labelStr.eof() )
+      if( labelStr.is_open() )
         {
-        char line[256];
-        labelStr.getline( line, 256 );
+        while( !labelStr.eof() )
+          {
+          char line[256];
+          labelStr.getline( line, 256 );
 
-        std::string lineString = std::string( line );
-        std::size_t pos = lineString.find( ',' );
+          std::string lineString = std::string( line );
+          std::size_t pos = lineString.find( ',' );
 
-        RealType value;
-        if( pos == std::string::npos )
-          {
-          std::istringstream iss( lineString );
-          iss >> value;
-          labelWeights.push_back( value );
-          userLabels.push_back( movingLabels[labelCount++] );
-          }
-        else
-          {
-          unsigned int localLabel;
+          RealType value;
+          if( pos == std::string::npos )
+            {
+            std::istringstream iss( lineString );
+            iss >> value;
+            labelWeights.push_back( value );
+            userLabels.push_back( movingLabels[labelCount++] );
+            }
+          else
+            {
+            unsigned int localLabel;
 
-          std::string        element = lineString.substr( 0, pos );
-          std::istringstream iss( element );
-          iss >> localLabel;
-          userLabels.push_back( localLabel );
+            std::string        element = lineString.substr( 0, pos );
+            std::istringstream iss( element );
+            iss >> localLabel;
+            userLabels.push_back( localLabel );
 
-          element = lineString.substr( pos + 1, lineString.length() );
-          std::istringstream iss2( element );
-          iss2 >> value;
-          labelWeights.push_back( value );
+            element = lineString.substr( pos + 1, lineString.length() );
+            std::istringstream iss2( element );
+            iss2 >> value;
+            labelWeights.push_back( value );
+            }
           }
-        }
 
-      labelStr.close();
-      }
-    else
-      {
-      std::cerr << "File " << argv[8] << " cannot be opened." << std::endl;
-      return EXIT_FAILURE;
+        labelStr.close();
+        }
+      else
+        {
+        std::cerr << "File " << argv[8] << " cannot be opened." << std::endl;
+        return EXIT_FAILURE;
+        }
       }
-    }
 
-  // Now match up the center points
+    // Now match up the center points
 
-  typedef itk::PointSet<VectorType, ImageDimension> DisplacementFieldPointSetType;
-  typedef itk::BSplineScatteredDataPointSetToImageFilter
-    <DisplacementFieldPointSetType, DisplacementFieldType> BSplineFilterType;
-  typedef typename BSplineFilterType::WeightsContainerType WeightsContainerType;
+    typedef itk::PointSet<VectorType, ImageDimension> DisplacementFieldPointSetType;
+    typedef itk::BSplineScatteredDataPointSetToImageFilter
+      <DisplacementFieldPointSetType, DisplacementFieldType> BSplineFilterType;
+    typedef typename BSplineFilterType::WeightsContainerType WeightsContainerType;
 
-  typename WeightsContainerType::Pointer weights = WeightsContainerType::New();
-  weights->Initialize();
-  const typename WeightsContainerType::Element boundaryWeight = 1.0e10;
-  const typename WeightsContainerType::Element weight = 1.0;
+    typename WeightsContainerType::Pointer weights = WeightsContainerType::New();
+    weights->Initialize();
+    const typename WeightsContainerType::Element boundaryWeight = 1.0e10;
+    const typename WeightsContainerType::Element weight = 1.0;
 
-  typename DisplacementFieldPointSetType::Pointer fieldPoints = DisplacementFieldPointSetType::New();
-  fieldPoints->Initialize();
-  unsigned long count = 0;
+    typename DisplacementFieldPointSetType::Pointer fieldPoints = DisplacementFieldPointSetType::New();
+    fieldPoints->Initialize();
+    unsigned long count = 0;
 
-  typename PointSetType::PointsContainerConstIterator mIt =
-    movingCenters->GetPoints()->Begin();
-  typename PointSetType::PointDataContainerIterator mItD =
-    movingCenters->GetPointData()->Begin();
+    typename PointSetType::PointsContainerConstIterator mIt =
+      movingCenters->GetPoints()->Begin();
+    typename PointSetType::PointDataContainerIterator mItD =
+      movingCenters->GetPointData()->Begin();
 
-  while( mItD != movingCenters->GetPointData()->End() )
-    {
-    typename PointSetType::PointsContainerConstIterator fIt =
-      fixedCenters->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator fItD =
-      fixedCenters->GetPointData()->Begin();
-
-    while( fItD != fixedCenters->GetPointData()->End() )
+    while( mItD != movingCenters->GetPointData()->End() )
       {
-      if( fItD.Value() == mItD.Value() )
+      typename PointSetType::PointsContainerConstIterator fIt =
+        fixedCenters->GetPoints()->Begin();
+      typename PointSetType::PointDataContainerIterator fItD =
+        fixedCenters->GetPointData()->Begin();
+
+      while( fItD != fixedCenters->GetPointData()->End() )
         {
-        typename PointSetType::PointType fpoint = fIt.Value();
-        typename PointSetType::PointType mpoint = mIt.Value();
+        if( fItD.Value() == mItD.Value() )
+          {
+          typename PointSetType::PointType fpoint = fIt.Value();
+          typename PointSetType::PointType mpoint = mIt.Value();
 
-        VectorType vector;
+          VectorType vector;
 
-        typename LabelImageType::PointType fixedPhysicalPoint;
-        for( unsigned int i = 0; i < ImageDimension; i++ )
-          {
-          fixedPhysicalPoint[i] = fpoint[i];
-          vector[i] = mpoint[i] - fpoint[i];
-          }
+          typename LabelImageType::PointType fixedPhysicalPoint;
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            fixedPhysicalPoint[i] = fpoint[i];
+            vector[i] = mpoint[i] - fpoint[i];
+            }
 
-        itk::ContinuousIndex<double, ImageDimension> fixedCidx;
-        fixedImage->TransformPhysicalPointToContinuousIndex( fixedPhysicalPoint, fixedCidx );
+          itk::ContinuousIndex<double, ImageDimension> fixedCidx;
+          fixedImage->TransformPhysicalPointToContinuousIndex( fixedPhysicalPoint, fixedCidx );
 
-        typename DisplacementFieldType::PointType fieldPoint;
-        parametricInputImage->TransformContinuousIndexToPhysicalPoint( fixedCidx, fieldPoint );
+          typename DisplacementFieldType::PointType fieldPoint;
+          parametricInputImage->TransformContinuousIndexToPhysicalPoint( fixedCidx, fieldPoint );
 
-        fieldPoints->SetPoint( count, fieldPoint );
-        fieldPoints->SetPointData( count, vector );
+          fieldPoints->SetPoint( count, fieldPoint );
+          fieldPoints->SetPointData( count, vector );
 
-        if( useWeights )
-          {
-          std::vector<LabelType>::const_iterator it = std::find( userLabels.begin(), userLabels.end(), mItD.Value() );
-          if( it != userLabels.end() )
+          if( useWeights )
             {
-            weights->InsertElement( count, labelWeights[it - userLabels.begin()] );
+            std::vector<LabelType>::const_iterator it = std::find( userLabels.begin(), userLabels.end(), mItD.Value() );
+            if( it != userLabels.end() )
+              {
+              weights->InsertElement( count, labelWeights[it - userLabels.begin()] );
+              }
+            else
+              {
+              std::cerr << "Unspecified label " << mItD.Value() << " in specified user label weights." << std::endl;
+              return EXIT_FAILURE;
+              }
             }
           else
             {
-            std::cerr << "Unspecified label " << mItD.Value() << " in specified user label weights." << std::endl;
-            return EXIT_FAILURE;
+            weights->InsertElement( count, weight );
             }
-          }
-        else
-          {
-          weights->InsertElement( count, weight );
-          }
 
-        count++;
+          count++;
 
-        break;
+          break;
+          }
+        ++fItD;
+        ++fIt;
         }
-      ++fItD;
-      ++fIt;
-      }
-
-    ++mItD;
-    ++mIt;
-    }
 
-  bool enforceStationaryBoundary = true;
-  if( argc > 7 )
-    {
-    enforceStationaryBoundary = static_cast<bool>( atoi( argv[7] ) );
-    }
-  if( enforceStationaryBoundary )
-    {
-    typename LabelImageType::IndexType startIndex2 = fixedImage->GetLargestPossibleRegion().GetIndex();
+      ++mItD;
+      ++mIt;
+      }
 
-    typename LabelImageType::SizeType inputSize2 = fixedImage->GetLargestPossibleRegion().GetSize();
-    for( ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItF )
+    bool enforceStationaryBoundary = true;
+    if( argc > 7 )
+      {
+      enforceStationaryBoundary = static_cast<bool>( atoi( argv[7] ) );
+      }
+    if( enforceStationaryBoundary )
       {
-      typename LabelImageType::IndexType index = ItF.GetIndex();
+      typename LabelImageType::IndexType startIndex2 = fixedImage->GetLargestPossibleRegion().GetIndex();
 
-      bool isOnStationaryBoundary = false;
-      for( unsigned int d = 0; d < ImageDimension; d++ )
+      typename LabelImageType::SizeType inputSize2 = fixedImage->GetLargestPossibleRegion().GetSize();
+      for( ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItF )
         {
-        if( index[d] == startIndex2[d] || index[d] == startIndex2[d] + static_cast<int>( inputSize2[d] ) - 1 )
+        typename LabelImageType::IndexType index = ItF.GetIndex();
+
+        bool isOnStationaryBoundary = false;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
           {
-          isOnStationaryBoundary = true;
-          break;
+          if( index[d] == startIndex2[d] || index[d] == startIndex2[d] + static_cast<int>( inputSize2[d] ) - 1 )
+            {
+            isOnStationaryBoundary = true;
+            break;
+            }
           }
-        }
 
-      if( isOnStationaryBoundary )
-        {
-        VectorType vector;
+        if( isOnStationaryBoundary )
+          {
+          VectorType vector;
 
-        vector.Fill( 0.0 );
+          vector.Fill( 0.0 );
 
-        typename PointSetType::PointType fixedPoint;
-        parametricInputImage->TransformIndexToPhysicalPoint( index, fixedPoint );
+          typename PointSetType::PointType fixedPoint;
+          parametricInputImage->TransformIndexToPhysicalPoint( index, fixedPoint );
 
-        fieldPoints->SetPoint( count, fixedPoint );
-        fieldPoints->SetPointData( count, vector );
-        weights->InsertElement( count, boundaryWeight );
-        count++;
+          fieldPoints->SetPoint( count, fixedPoint );
+          fieldPoints->SetPointData( count, vector );
+          weights->InsertElement( count, boundaryWeight );
+          count++;
+          }
         }
       }
-    }
-
-  typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
-
-  unsigned int numberOfLevels = atoi( argv[5] );
 
-  unsigned int splineOrder = 3;
-  if( argc > 6 )
-    {
-    splineOrder = atoi( argv[6] );
-    }
+    typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
 
-  std::vector<unsigned int> meshSize = ConvertVector<unsigned int>( std::string( argv[4] ) );
-  typename BSplineFilterType::ArrayType ncps;
-  ncps.Fill( 0 );
+    unsigned int numberOfLevels = atoi( argv[5] );
 
-  if( meshSize.size() == 1 )
-    {
-    ncps.Fill( meshSize[0] + splineOrder );
-    }
-  else if( meshSize.size() == ImageDimension )
-    {
-    for( unsigned int d = 0; d < ImageDimension; d++ )
+    unsigned int splineOrder = 3;
+    if( argc > 6 )
       {
-      ncps[d] = meshSize[d] + splineOrder;
+      splineOrder = atoi( argv[6] );
       }
-    }
-  else
-    {
-    std::cerr << "Invalid meshSize format." << std::endl;
-    }
 
-//   std::cout << ncps << std::endl;
-//
-//   bspliner->DebugOn();
-  bspliner->SetOrigin( fixedImage->GetOrigin() );
-  bspliner->SetSpacing( fixedImage->GetSpacing() );
-  bspliner->SetSize( fixedImage->GetLargestPossibleRegion().GetSize() );
-  bspliner->SetDirection( fixedImage->GetDirection() );
-  bspliner->SetGenerateOutputImage( true );
-  bspliner->SetNumberOfLevels( numberOfLevels );
-  bspliner->SetSplineOrder( splineOrder );
-  bspliner->SetNumberOfControlPoints( ncps );
-  bspliner->SetInput( fieldPoints );
-  bspliner->SetPointWeights( weights );
-  bspliner->Update();
-
-  typedef itk::VectorLinearInterpolateImageFunction<DisplacementFieldType, RealType> InterpolatorType;
-  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-  interpolator->SetInputImage( bspliner->GetOutput() );
-
-  std::cout << "Distance errors:" << std::endl;
-
-  mIt = movingCenters->GetPoints()->Begin();
-  mItD = movingCenters->GetPointData()->Begin();
-
-  while( mItD != movingCenters->GetPointData()->End() )
-    {
-    typename PointSetType::PointsContainerConstIterator fIt =
-      fixedCenters->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator fItD =
-      fixedCenters->GetPointData()->Begin();
+    std::vector<unsigned int> meshSize = ConvertVector<unsigned int>( std::string( argv[4] ) );
+    typename BSplineFilterType::ArrayType ncps;
+    ncps.Fill( 0 );
 
-    while( fItD != fixedCenters->GetPointData()->End() )
+    if( meshSize.size() == 1 )
+      {
+      ncps.Fill( meshSize[0] + splineOrder );
+      }
+    else if( meshSize.size() == ImageDimension )
       {
-      if( fItD.Value() == mItD.Value() )
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        typename PointSetType::PointType fpoint = fIt.Value();
-        typename PointSetType::PointType mpoint = mIt.Value();
+        ncps[d] = meshSize[d] + splineOrder;
+        }
+      }
+    else
+      {
+      std::cerr << "Invalid meshSize format." << std::endl;
+      }
 
-        VectorType displacement = ( mpoint - fpoint );
+  //   std::cout << ncps << std::endl;
+  //
+  //   bspliner->DebugOn();
+    bspliner->SetOrigin( fixedImage->GetOrigin() );
+    bspliner->SetSpacing( fixedImage->GetSpacing() );
+    bspliner->SetSize( fixedImage->GetLargestPossibleRegion().GetSize() );
+    bspliner->SetDirection( fixedImage->GetDirection() );
+    bspliner->SetGenerateOutputImage( true );
+    bspliner->SetNumberOfLevels( numberOfLevels );
+    bspliner->SetSplineOrder( splineOrder );
+    bspliner->SetNumberOfControlPoints( ncps );
+    bspliner->SetInput( fieldPoints );
+    bspliner->SetPointWeights( weights );
+    bspliner->Update();
+
+    typedef itk::VectorLinearInterpolateImageFunction<DisplacementFieldType, RealType> InterpolatorType;
+    typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    interpolator->SetInputImage( bspliner->GetOutput() );
+
+    std::cout << "Distance errors:" << std::endl;
+
+    mIt = movingCenters->GetPoints()->Begin();
+    mItD = movingCenters->GetPointData()->Begin();
+
+    while( mItD != movingCenters->GetPointData()->End() )
+      {
+      typename PointSetType::PointsContainerConstIterator fIt =
+        fixedCenters->GetPoints()->Begin();
+      typename PointSetType::PointDataContainerIterator fItD =
+        fixedCenters->GetPointData()->Begin();
 
-        typename InterpolatorType::PointType point;
-        for( unsigned int i = 0; i < ImageDimension; i++ )
+      while( fItD != fixedCenters->GetPointData()->End() )
+        {
+        if( fItD.Value() == mItD.Value() )
           {
-          point[i] = fpoint[i];
-          }
-        VectorType vector = interpolator->Evaluate( point );
+          typename PointSetType::PointType fpoint = fIt.Value();
+          typename PointSetType::PointType mpoint = mIt.Value();
 
-        RealType error = ( vector - displacement ).GetNorm();
-        std::cout << "  " << fItD.Value() << ": " << error << std::endl;
+          VectorType displacement = ( mpoint - fpoint );
 
-        break;
+          typename InterpolatorType::PointType point;
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            point[i] = fpoint[i];
+            }
+          VectorType vector = interpolator->Evaluate( point );
+
+          RealType error = ( vector - displacement ).GetNorm();
+          std::cout << "  " << fItD.Value() << ": " << error << std::endl;
+
+          break;
+          }
+        ++fItD;
+        ++fIt;
         }
-      ++fItD;
-      ++fIt;
+
+      ++mItD;
+      ++mIt;
       }
 
-    ++mItD;
-    ++mIt;
+    typedef itk::ImageFileWriter<DisplacementFieldType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( outputFileNames[b].c_str() );
+    writer->SetInput( bspliner->GetOutput() );
+    writer->Update();
     }
-
-  typedef itk::ImageFileWriter<DisplacementFieldType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetFileName( argv[3] );
-  writer->SetInput( bspliner->GetOutput() );
-  writer->Update();
   return EXIT_SUCCESS;
 }
 
@@ -524,6 +445,8 @@ private:
     std::cerr << " register and (3 ) to have the same landmark points defined within them ... " << std::endl;
     std::cerr << " landmarks will be defined from the center of mass of the labels in the input images . " << std::endl;
     std::cerr << " You can use ITK-snap to generate the label images. " << std::endl;
+    std::cerr << " Comma separated moving images and output fields are fitted in turn to the landmarks " << std::endl;
+    std::cerr << " of the fixed image, which are only computed once. " << std::endl;
     std::cerr << " The optional landmarks weights are read from a text file where each row is either:" << std::endl;
     std::cerr << " \"label,labelWeight\" or " << std::endl;
     std::cerr << " \"labelWeight\" or " << std::endl;
@@ -8,8 +8,11 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkImageRegionIterator.h"
+#include "itkImageRegionSplitterSlowDimension.h"
 #include "itkMaskImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkNumericSeriesFileNames.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkSymmetricSecondRankTensor.h"
 #include "itkVectorImage.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
@@ -78,6 +81,205 @@ public:
   }
 };
 
+// Sparsify a prior probability image while it is read, chunk by chunk, so
+// that the full prior is never held when the file format supports streamed
+// reading.  Readers that can not stream read the whole image for the first
+// chunk and the remaining chunks are then already in memory.  In-memory,
+// cached and parallel gzip files are read in full.
+template <class TFilter>
+bool ReadSparsePriorProbabilityImage( const TFilter *segmenter, const std::string & fileName,
+                                      typename TFilter::SparseImageType *sparsePriorImage,
+                                      itk::SizeValueType maximumChunkBytes = 64 * 1024 * 1024 )
+{
+  typedef typename TFilter::RealImageType ImageType;
+  typedef typename ImageType::RegionType  RegionType;
+
+  if( fileName.substr( 0, 2 ) == std::string( "0x" ) ||
+      ants::ObjectCache::IsEnabled() || ants::IsParallelGzipFile( fileName ) )
+    {
+    typename ImageType::Pointer image;
+    if( !ReadImage<ImageType>( image, fileName.c_str() ) )
+      {
+      return false;
+      }
+    segmenter->AddToSparsePriorProbabilityImage( sparsePriorImage, image,
+                                                 image->GetLargestPossibleRegion() );
+    return true;
+    }
+
+  if( !ANTSFileExists( fileName ) )
+    {
+    std::cerr << " file " << fileName << " does not exist . " << std::endl;
+    return false;
+    }
+
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  try
+    {
+    reader->UpdateOutputInformation();
+    const RegionType largestRegion = reader->GetOutput()->GetLargestPossibleRegion();
+
+    const itk::SizeValueType numberOfBytes = largestRegion.GetNumberOfPixels()
+      * sizeof( typename ImageType::PixelType );
+    unsigned int numberOfChunks = 1;
+    if( maximumChunkBytes > 0 )
+      {
+      numberOfChunks = static_cast<unsigned int>( ( numberOfBytes + maximumChunkBytes - 1 ) / maximumChunkBytes );
+      numberOfChunks = std::max( numberOfChunks, 1u );
+      }
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    numberOfChunks = splitter->GetNumberOfSplits( largestRegion, numberOfChunks );
+
+    for( unsigned int n = 0; n < numberOfChunks; n++ )
+      {
+      RegionType chunk = largestRegion;
+      splitter->GetSplit( n, numberOfChunks, chunk );
+      reader->GetOutput()->SetRequestedRegion( chunk );
+      reader->Update();
+      segmenter->AddToSparsePriorProbabilityImage( sparsePriorImage, reader->GetOutput(), largestRegion );
+      }
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Exception caught during prior probability image reading " << std::endl;
+    std::cerr << e << " file " << fileName << std::endl;
+    return false;
+    }
+  return true;
+}
+
+// Same as above for a multi-component prior image with one component per
+// class.  Returns false if the number of components does not match the number
+// of sparse images.
+template <class TFilter, class TVectorImage>
+bool ReadSparsePriorProbabilityVectorImage( const TFilter *segmenter, const std::string & fileName,
+                                            std::vector<typename TFilter::SparseImagePointer> & sparsePriorImages,
+                                            itk::SizeValueType maximumChunkBytes = 64 * 1024 * 1024 )
+{
+  typedef TVectorImage                    VectorImageType;
+  typedef typename TFilter::RealImageType ImageType;
+  typedef typename ImageType::RegionType  RegionType;
+
+  typedef itk::VectorIndexSelectionCastImageFilter<VectorImageType, ImageType> CasterType;
+  typename CasterType::Pointer caster = CasterType::New();
+
+  typename VectorImageType::Pointer image = ITK_NULLPTR;
+  typedef itk::ImageFileReader<VectorImageType> ReaderType;
+  typename ReaderType::Pointer reader = ITK_NULLPTR;
+
+  if( fileName.substr( 0, 2 ) == std::string( "0x" ) ||
+      ants::ObjectCache::IsEnabled() || ants::IsParallelGzipFile( fileName ) )
+    {
+    if( !ReadImage<VectorImageType>( image, fileName.c_str() ) )
+      {
+      return false;
+      }
+    caster->SetInput( image );
+    }
+  else
+    {
+    if( !ANTSFileExists( fileName ) )
+      {
+      std::cerr << " file " << fileName << " does not exist . " << std::endl;
+      return false;
+      }
+    reader = ReaderType::New();
+    reader->SetFileName( fileName );
+    caster->SetInput( reader->GetOutput() );
+    }
+
+  try
+    {
+    if( reader )
+      {
+      reader->UpdateOutputInformation();
+      }
+    const VectorImageType *input = caster->GetInput();
+    if( input->GetNumberOfComponentsPerPixel() != sparsePriorImages.size() )
+      {
+      return false;
+      }
+    const RegionType largestRegion = input->GetLargestPossibleRegion();
+
+    const itk::SizeValueType numberOfBytes = largestRegion.GetNumberOfPixels()
+      * input->GetNumberOfComponentsPerPixel() * sizeof( typename ImageType::PixelType );
+    unsigned int numberOfChunks = 1;
+    if( reader && maximumChunkBytes > 0 )
+      {
+      numberOfChunks = static_cast<unsigned int>( ( numberOfBytes + maximumChunkBytes - 1 ) / maximumChunkBytes );
+      numberOfChunks = std::max( numberOfChunks, 1u );
+      }
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    numberOfChunks = splitter->GetNumberOfSplits( largestRegion, numberOfChunks );
+
+    for( unsigned int n = 0; n < numberOfChunks; n++ )
+      {
+      RegionType chunk = largestRegion;
+      splitter->GetSplit( n, numberOfChunks, chunk );
+      if( reader )
+        {
+        reader->GetOutput()->SetRequestedRegion( chunk );
+        reader->Update();
+        }
+      for( unsigned int k = 0; k < sparsePriorImages.size(); k++ )
+        {
+        caster->SetIndex( k );
+        caster->GetOutput()->SetRequestedRegion( chunk );
+        caster->Update();
+        segmenter->AddToSparsePriorProbabilityImage( sparsePriorImages[k], caster->GetOutput(), largestRegion );
+        }
+      }
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Exception caught during prior probability image reading " << std::endl;
+    std::cerr << e << " file " << fileName << std::endl;
+    return false;
+    }
+  return true;
+}
+
+// Structure shared by the threads reading the prior probability images of a
+// file series into their sparse representation.
+template <class TFilter>
+struct SparsePriorReaderThreadStruct
+  {
+  const TFilter                                     *Filter;
+  std::vector<std::string>                           FileNames;
+  std::vector<typename TFilter::SparseImagePointer>  SparseImages;
+  std::vector<int>                                   IsRead;
+  unsigned int                                       NextFile;
+  itk::SimpleFastMutexLock                           Mutex;
+  };
+
+template <class TFilter>
+ITK_THREAD_RETURN_TYPE SparsePriorReaderThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  SparsePriorReaderThreadStruct<TFilter> *str =
+    static_cast<SparsePriorReaderThreadStruct<TFilter> *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int n = str->NextFile++;
+    str->Mutex.Unlock();
+
+    if( n >= str->FileNames.size() )
+      {
+      break;
+      }
+    str->SparseImages[n] = TFilter::SparseImageType::New();
+    str->SparseImages[n]->Initialize();
+    str->IsRead[n] = ReadSparsePriorProbabilityImage<TFilter>( str->Filter, str->FileNames[n],
+                                                              str->SparseImages[n] ) ? 1 : 0;
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int AtroposSegmentation( itk::ants::CommandLineParser *parser )
 {
@@ -125,6 +327,14 @@ int AtroposSegmentation( itk::ants::CommandLineParser *parser )
                                          memoryOption->GetFunction( 0 )->GetName() ) );
     }
 
+  typename itk::ants::CommandLineParser::OptionType::Pointer compactOption =
+    parser->GetOption( "compact-probability-storage" );
+  if( compactOption && compactOption->GetNumberOfFunctions() )
+    {
+    segmenter->SetUseCompactProbabilityStorage( parser->Convert<bool>(
+                                                  compactOption->GetFunction( 0 )->GetName() ) );
+    }
+
   /**
    * Initialization
    */
@@ -218,11 +428,76 @@ int AtroposSegmentation( itk::ants::CommandLineParser *parser )
         fileNamesCreator->SetSeriesFormat( filename.c_str() );
         const std::vector<std::string> & imageNames
           = fileNamesCreator->GetFileNames();
-        for( unsigned int k = 0; k < imageNames.size(); k++ )
+        if( segmenter->GetMinimizeMemoryUsage() )
           {
-          typename InputImageType::Pointer image;
-          ReadImage<InputImageType>( image, imageNames[k].c_str() );
-          segmenter->SetPriorProbabilityImage( k + 1, image );
+          // Read the priors in parallel straight into their sparse
+          // representation.
+          SparsePriorReaderThreadStruct<SegmentationFilterType> str;
+          str.Filter = segmenter;
+          str.FileNames = imageNames;
+          str.SparseImages.resize( imageNames.size() );
+          str.IsRead.assign( imageNames.size(), 0 );
+          str.NextFile = 0;
+
+          unsigned int numberOfThreads = std::min( static_cast<unsigned int>(
+            itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+                                                   static_cast<unsigned int>( imageNames.size() ) );
+          numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+          numberOfThreads = std::max( numberOfThreads, 1u );
+
+          itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+          threader->SetNumberOfThreads( numberOfThreads );
+          threader->SetSingleMethod( SparsePriorReaderThreaderCallback<SegmentationFilterType>, &str );
+          threader->SingleMethodExecute();
+
+          for( unsigned int k = 0; k < imageNames.size(); k++ )
+            {
+            if( !str.IsRead[k] )
+              {
+              if( verbose )
+                {
+                std::cerr << "The prior probability image " << imageNames[k]
+                         << " could not be read." << std::endl;
+                }
+              return EXIT_FAILURE;
+              }
+            segmenter->SetPriorProbabilitySparseImage( k + 1, str.SparseImages[k] );
+            }
+          }
+        else
+          {
+          for( unsigned int k = 0; k < imageNames.size(); k++ )
+            {
+            typename InputImageType::Pointer image;
+            ReadImage<InputImageType>( image, imageNames[k].c_str() );
+            segmenter->SetPriorProbabilityImage( k + 1, image );
+            }
+          }
+        }
+      else if( segmenter->GetMinimizeMemoryUsage() )
+        {
+        typedef itk::VectorImage<PixelType, ImageDimension> VectorImageType;
+
+        std::vector<typename SegmentationFilterType::SparseImagePointer> sparsePriorImages(
+          segmenter->GetNumberOfTissueClasses() );
+        for( unsigned int k = 0; k < sparsePriorImages.size(); k++ )
+          {
+          sparsePriorImages[k] = SegmentationFilterType::SparseImageType::New();
+          sparsePriorImages[k]->Initialize();
+          }
+        if( !ReadSparsePriorProbabilityVectorImage<SegmentationFilterType, VectorImageType>(
+              segmenter, filename, sparsePriorImages ) )
+          {
+          if( verbose )
+            {
+            std::cerr << "The prior probability image could not be read or the number "
+                     << "of components does not match the number of classes." << std::endl;
+            }
+          return EXIT_FAILURE;
+          }
+        for( unsigned int k = 0; k < sparsePriorImages.size(); k++ )
+          {
+          segmenter->SetPriorProbabilitySparseImage( k + 1, sparsePriorImages[k] );
           }
         }
       else
@@ -1138,11 +1413,9 @@ int AtroposSegmentation( itk::ants::CommandLineParser *parser )
           probabilityImage = masker->GetOutput();
           }
 
-        typedef  itk::ImageFileWriter<InputImageType> WriterType;
-        typename WriterType::Pointer writer = WriterType::New();
-        writer->SetInput( probabilityImage );
-        writer->SetFileName( imageNames[i].c_str() );
-        writer->Update();
+        // through WriteImage, so that a later reader in the same process
+        // gets the posteriors from the object cache
+        WriteImage<InputImageType>( probabilityImage, imageNames[i].c_str() );
         }
       }
     if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
@@ -1570,6 +1843,22 @@ void AtroposInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Store the posterior and distance prior probability images " )
+    + std::string( "quantized to 16 bits and only inside the mask.  This cuts " )
+    + std::string( "the memory used by the probability images several-fold " )
+    + std::string( "without the recalculation cost of minimizing memory usage.  " )
+    + std::string( "Ignored if memory usage is minimized." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "compact-probability-storage" );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  option->AddFunction( std::string( "0" ) );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "To remove the effects of outliers in calculating the " )
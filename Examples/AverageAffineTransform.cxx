@@ -11,11 +11,13 @@
 
 #include "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
+#include "itkantsReadWriteTransform.h"
 
 namespace ants
 {
 static bool AverageAffineTransform_ParseInput(int argc, char * *argv, char *& output_transform_filename,
-                                              char *& reference_transform_filename, TRAN_OPT_QUEUE & opt_queue)
+                                              char *& reference_transform_filename, TRAN_OPT_QUEUE & opt_queue,
+                                              bool & use_geodesic_rotation)
 {
   opt_queue.clear();
   opt_queue.reserve(argc);
@@ -24,10 +26,16 @@ static bool AverageAffineTransform_ParseInput(int argc, char * *argv, char *& ou
 
   reference_transform_filename = ITK_NULLPTR;
 
+  use_geodesic_rotation = false;
+
   int ind = 1;
   while( ind < argc )
     {
-    if( strcmp(argv[ind], "-R") == 0 )
+    if( strcmp(argv[ind], "-G") == 0 )
+      {
+      use_geodesic_rotation = true;
+      }
+    else if( strcmp(argv[ind], "-R") == 0 )
       {
       ind++;
       if( ind >= argc )
@@ -107,7 +115,7 @@ static bool AverageAffineTransform_ParseInput(int argc, char * *argv, char *& ou
 
 template <int ImageDimension>
 void AverageAffineTransform(char *output_affine_txt, char *reference_affine_txt,
-                            TRAN_OPT_QUEUE & opt_queue)
+                            TRAN_OPT_QUEUE & opt_queue, bool use_geodesic_rotation)
 {
 //    typedef itk::Image<float, ImageDimension> ImageType;
 //    typedef itk::Vector<float, ImageDimension> VectorType;
@@ -129,6 +137,7 @@ void AverageAffineTransform(char *output_affine_txt, char *reference_affine_txt,
   // typename ImageFileReaderType::Pointer reader_img_ref = ImageFileReaderType::New();
 
   WarperType average_func;
+  average_func.SetUseGeodesicRotationAverage(use_geodesic_rotation);
   // warper->SetInput(img_mov);
   // warper->SetEdgePaddingValue( 0);
 //    VectorType pad;
@@ -139,8 +148,21 @@ void AverageAffineTransform(char *output_affine_txt, char *reference_affine_txt,
 
 //    typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
 
-  int       cnt_affine = 0;
-  const int kOptQueueSize = opt_queue.size();
+  // the affine files are read on all threads, then pushed in order
+  typedef itk::Transform<double, ImageDimension, ImageDimension> TransformType;
+  std::vector<std::string>                     affine_filenames;
+  std::vector<typename TransformType::Pointer> affine_transforms;
+  const int                                    kOptQueueSize = opt_queue.size();
+  for( int i = 0; i < kOptQueueSize; i++ )
+    {
+    if( opt_queue[i].file_type == AFFINE_FILE )
+      {
+      affine_filenames.push_back(opt_queue[i].filename);
+      }
+    }
+  itk::ants::ReadTransforms<double, ImageDimension>(affine_filenames, affine_transforms);
+
+  int cnt_affine = 0;
   for( int i = 0; i < kOptQueueSize; i++ )
     {
     const TRAN_OPT & opt = opt_queue[i];
@@ -149,12 +171,13 @@ void AverageAffineTransform(char *output_affine_txt, char *reference_affine_txt,
       {
       case AFFINE_FILE:
         {
-        typename TranReaderType::Pointer tran_reader =
-          TranReaderType::New();
-        tran_reader->SetFileName(opt.filename);
-        tran_reader->Update();
         typename AffineTransformType::Pointer aff =
-          dynamic_cast<AffineTransformType *>( (tran_reader->GetTransformList() )->front().GetPointer() );
+          dynamic_cast<AffineTransformType *>( affine_transforms[cnt_affine].GetPointer() );
+        if( aff.IsNull() )
+          {
+          std::cerr << "Could not read an affine transform from " << opt.filename << std::endl;
+          return;
+          }
 
         if(            opt_queue[i].do_affine_inv )
           {
@@ -272,7 +295,7 @@ private:
   if( argc <= 3 )
     {
     std::cerr
-      << "AverageAffineTransform ImageDimension output_affine_transform [-R reference_affine_transform] "
+      << "AverageAffineTransform ImageDimension output_affine_transform [-R reference_affine_transform] [-G] "
       << "{[-i] affine_transform_txt [weight(=1)] ]}"
       << std::endl
       << std::endl
@@ -294,6 +317,9 @@ private:
       << std::endl
       << " -i option takes the inverse of the affine mapping."
       << std::endl
+      << " -G averages the rotations on the rotation group (the Karcher mean) instead of "
+      "averaging the quaternions or angles, which only approximates it for rotations far apart."
+      << std::endl
       << " For example: "
       << std::endl
       << " 2 output_affine.txt -R A.txt A1.txt 1.0 -i A2.txt 2.0 A3.txt A4.txt 6.0 A5.txt"
@@ -310,8 +336,11 @@ private:
 
   int  kImageDim = atoi(argv[1]);
 
+  bool use_geodesic_rotation = false;
+
   const bool is_parsing_ok = AverageAffineTransform_ParseInput(argc - 2, argv + 2, output_transform_filename,
-                                                    reference_transform_filename, opt_queue);
+                                                    reference_transform_filename, opt_queue,
+                                                    use_geodesic_rotation);
 
   if( is_parsing_ok )
     {
@@ -335,13 +364,13 @@ private:
       case 2:
         {
         AverageAffineTransform<2>(output_transform_filename,
-                                  reference_transform_filename, opt_queue);
+                                  reference_transform_filename, opt_queue, use_geodesic_rotation);
         }
         break;
       case 3:
         {
         AverageAffineTransform<3>(output_transform_filename,
-                                  reference_transform_filename, opt_queue);
+                                  reference_transform_filename, opt_queue, use_geodesic_rotation);
         }
         break;
       }
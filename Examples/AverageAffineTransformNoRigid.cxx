@@ -11,6 +11,7 @@
 
 #include "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
+#include "itkantsReadWriteTransform.h"
 
 namespace ants
 {
@@ -139,8 +140,21 @@ void AverageAffineTransformNoRigid(char *output_affine_txt, char *reference_affi
 
 //    typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
 
-  int       cnt_affine = 0;
-  const int kOptQueueSize = opt_queue.size();
+  // the affine files are read on all threads, then pushed in order
+  typedef itk::Transform<double, ImageDimension, ImageDimension> TransformType;
+  std::vector<std::string>                     affine_filenames;
+  std::vector<typename TransformType::Pointer> affine_transforms;
+  const int                                    kOptQueueSize = opt_queue.size();
+  for( int i = 0; i < kOptQueueSize; i++ )
+    {
+    if( opt_queue[i].file_type == AFFINE_FILE )
+      {
+      affine_filenames.push_back(opt_queue[i].filename);
+      }
+    }
+  itk::ants::ReadTransforms<double, ImageDimension>(affine_filenames, affine_transforms);
+
+  int cnt_affine = 0;
   for( int i = 0; i < kOptQueueSize; i++ )
     {
     const TRAN_OPT & opt = opt_queue[i];
@@ -149,12 +163,13 @@ void AverageAffineTransformNoRigid(char *output_affine_txt, char *reference_affi
       {
       case AFFINE_FILE:
         {
-        typename TranReaderType::Pointer tran_reader =
-          TranReaderType::New();
-        tran_reader->SetFileName(opt.filename);
-        tran_reader->Update();
         typename AffineTransformType::Pointer aff =
-          dynamic_cast<AffineTransformType *>( (tran_reader->GetTransformList() )->front().GetPointer() );
+          dynamic_cast<AffineTransformType *>( affine_transforms[cnt_affine].GetPointer() );
+        if( aff.IsNull() )
+          {
+          std::cerr << "Could not read an affine transform from " << opt.filename << std::endl;
+          return;
+          }
 
         if(            opt_queue[i].do_affine_inv )
           {
@@ -30,17 +30,252 @@
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkOptimalSharpeningImageFilter.h"
 #include "itkLaplacianSharpeningImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkResampleImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
+
 #include <algorithm>
+#include <cstdlib>
 
 namespace ants
 {
+/** One input of AverageImages1.  Inputs on the grid of the reference are
+ * read slab by slab; the others are resampled once onto the reference grid
+ * and kept in memory. */
+template <class TImage>
+struct AverageImagesInput
+  {
+  std::string                    FileName;
+  itk::ImageIOBase::Pointer      ImageIO;
+  typename TImage::Pointer       ResampledImage;
+  double                         Scale;
+  };
+
+template <class TImage>
+struct AverageImagesThreadStruct
+  {
+  std::vector<AverageImagesInput<TImage> > *Inputs;
+  const TImage *                            Reference;
+  bool                                      Normalize;
+
+  // the current slab; Values holds the slab of input n at n * NumberOfSlabPixels
+  typename TImage::RegionType               Slab;
+  size_t                                    NumberOfSlabPixels;
+  std::vector<float> *                      Values;
+
+  // outputs, at the slab offset; null if not requested
+  float *                                   Mean;
+  float *                                   Variance;
+  float *                                   Median;
+
+  size_t                                    NextInput;
+  itk::SimpleFastMutexLock                  Mutex;
+  bool                                      Failed;
+  std::string                               ErrorMessage;
+  };
+
+/** Read region of input, resampled onto the reference grid if needed. */
+template <class TImage>
+typename TImage::Pointer ReadAverageImagesInputRegion( AverageImagesInput<TImage> & input,
+                                                       const typename TImage::RegionType & region )
+{
+  if( input.ResampledImage.IsNotNull() )
+    {
+    return input.ResampledImage;
+    }
+  typedef itk::ImageFileReader<TImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( input.FileName );
+  reader->SetImageIO( input.ImageIO );
+  reader->UpdateOutputInformation();
+  reader->GetOutput()->SetRequestedRegion( region );
+  reader->GetOutput()->Update();
+
+  typename TImage::Pointer image = reader->GetOutput();
+  image->DisconnectPipeline();
+  return image;
+}
+
+/** Reads whole inputs, one at a time per thread, to find their means. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE AverageImagesMeanThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  AverageImagesThreadStruct<TImage> *   str = static_cast<AverageImagesThreadStruct<TImage> *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const size_t n = str->NextInput++;
+    const bool   failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || n >= str->Inputs->size() )
+      {
+      break;
+      }
+
+    AverageImagesInput<TImage> & input = ( *str->Inputs )[n];
+    try
+      {
+      typename TImage::Pointer image =
+        ReadAverageImagesInputRegion<TImage>( input, str->Reference->GetLargestPossibleRegion() );
+
+      double        sum = 0.0;
+      unsigned long ct = 0;
+      itk::ImageRegionConstIterator<TImage> It( image, str->Reference->GetLargestPossibleRegion() );
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        sum += It.Get();
+        ct++;
+        }
+      double meanval = ( ct > 0 ) ? ( sum / static_cast<double>( ct ) ) : 0.0;
+      if( meanval <= 0 )
+        {
+        meanval = 1;
+        }
+      input.Scale = 1.0 / meanval;
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Reads the current slab of the inputs, one input at a time per thread. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE AverageImagesReadThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  AverageImagesThreadStruct<TImage> *   str = static_cast<AverageImagesThreadStruct<TImage> *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const size_t n = str->NextInput++;
+    const bool   failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || n >= str->Inputs->size() )
+      {
+      break;
+      }
+
+    AverageImagesInput<TImage> & input = ( *str->Inputs )[n];
+    try
+      {
+      typename TImage::Pointer image = ReadAverageImagesInputRegion<TImage>( input, str->Slab );
+
+      float *values = &( *str->Values )[n * str->NumberOfSlabPixels];
+      itk::ImageRegionConstIterator<TImage> It( image, str->Slab );
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        *values++ = static_cast<float>( It.Get() * input.Scale );
+        }
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The statistics of a contiguous range of the slab pixels.  Each pixel
+ * sums its inputs in input order, so the result does not depend on the
+ * number of threads. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE AverageImagesStatisticsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  AverageImagesThreadStruct<TImage> *   str = static_cast<AverageImagesThreadStruct<TImage> *>( info->UserData );
+
+  const size_t numberOfInputs = str->Inputs->size();
+  const size_t numberOfPixels = str->NumberOfSlabPixels;
+  const size_t begin = numberOfPixels * info->ThreadID / info->NumberOfThreads;
+  const size_t end = numberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  const float *      values = &( *str->Values )[0];
+  std::vector<float> pixelValues( numberOfInputs );
+  for( size_t p = begin; p < end; p++ )
+    {
+    // Kahan summation
+    double sum = 0.0;
+    double compensation = 0.0;
+    for( size_t n = 0; n < numberOfInputs; n++ )
+      {
+      const double y = values[n * numberOfPixels + p] - compensation;
+      const double t = sum + y;
+      compensation = ( t - sum ) - y;
+      sum = t;
+      }
+    const double mean = sum / static_cast<double>( numberOfInputs );
+    str->Mean[p] = static_cast<float>( mean );
+
+    if( str->Variance )
+      {
+      double sumOfSquares = 0.0;
+      for( size_t n = 0; n < numberOfInputs; n++ )
+        {
+        sumOfSquares += vnl_math_sqr( values[n * numberOfPixels + p] - mean );
+        }
+      str->Variance[p] = ( numberOfInputs > 1 ) ?
+        static_cast<float>( sumOfSquares / static_cast<double>( numberOfInputs - 1 ) ) : 0.0f;
+      }
+
+    if( str->Median )
+      {
+      for( size_t n = 0; n < numberOfInputs; n++ )
+        {
+        pixelValues[n] = values[n * numberOfPixels + p];
+        }
+      const size_t half = numberOfInputs / 2;
+      std::nth_element( pixelValues.begin(), pixelValues.begin() + half, pixelValues.end() );
+      float median = pixelValues[half];
+      if( numberOfInputs % 2 == 0 )
+        {
+        median = 0.5f * ( median + *std::max_element( pixelValues.begin(), pixelValues.begin() + half ) );
+        }
+      str->Median[p] = median;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Outputfname may be [mean,<variance>,<median>]. */
+static void GetAverageImagesOutputFileNames( const std::string & name, std::vector<std::string> & names )
+{
+  names.assign( 3, std::string() );
+  if( name.size() < 2 || name[0] != '[' || name[name.size() - 1] != ']' )
+    {
+    names[0] = name;
+    return;
+    }
+  std::string            list = name.substr( 1, name.size() - 2 );
+  std::string::size_type begin = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    const std::string::size_type end = list.find( ',', begin );
+    names[i] = list.substr( begin, end == std::string::npos ? std::string::npos : end - begin );
+    if( end == std::string::npos )
+      {
+      break;
+      }
+    begin = end + 1;
+    }
+}
+
 template <unsigned int ImageDimension, unsigned int NVectorComponents>
 int AverageImages1(unsigned int argc, char *argv[])
 {
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
   typedef itk::ImageFileReader<ImageType>              ImageFileReader;
   typedef itk::ImageFileWriter<ImageType>              writertype;
 
@@ -64,15 +299,31 @@ int AverageImages1(unsigned int argc, char *argv[])
   const bool  normalizei = atoi(argv[3]);
   const float numberofimages = (float)argc - 4.;
 
+  std::vector<std::string> outputFileNames;
+  GetAverageImagesOutputFileNames( argv[2], outputFileNames );
+  if( outputFileNames[0].empty() )
+    {
+    std::cerr << "ERROR:  No output file name for the average given" << std::endl;
+    return EXIT_FAILURE;
+    }
+
   typename ImageType::SizeType maxSize;
   maxSize.Fill( 0 );
   unsigned int bigimage = 0;
+
+  typedef AverageImagesInput<ImageType> InputType;
+  std::vector<InputType> inputs;
   for( unsigned int j = 4; j < argc; j++ )
     {
     // Get the image dimension
     const std::string fn = std::string(argv[j]);
     typename itk::ImageIOBase::Pointer imageIO =
       itk::ImageIOFactory::CreateImageIO(fn.c_str(), itk::ImageIOFactory::ReadMode);
+    if( imageIO.IsNull() )
+      {
+      std::cerr << "ERROR:  Could not read " << fn << std::endl;
+      return EXIT_FAILURE;
+      }
     imageIO->SetFileName(fn.c_str() );
     imageIO->ReadImageInformation();
 
@@ -86,65 +337,167 @@ int AverageImages1(unsigned int argc, char *argv[])
         bigimage = j;
         }
       }
+
+    InputType input;
+    input.FileName = fn;
+    input.ImageIO = imageIO;
+    input.Scale = 1.0;
+    inputs.push_back( input );
     }
   std::cout << " bigimage " << bigimage << " maxSize " << maxSize << std::endl;
 
   typename ImageFileReader::Pointer reader = ImageFileReader::New();
   reader->SetFileName(argv[bigimage]);
-  reader->Update();
-  typename ImageType::Pointer averageimage = reader->GetOutput();
+  reader->UpdateOutputInformation();
+  typename ImageType::Pointer reference = ImageType::New();
+  reference->CopyInformation( reader->GetOutput() );
+  reference->SetRegions( reader->GetOutput()->GetLargestPossibleRegion() );
   std::cout << " Setting physcal space of output average image based on largest image " << std::endl;
   unsigned int vectorlength = reader->GetImageIO()->GetNumberOfComponents();
   std::cout << " Averaging " << numberofimages << " images with dim = " << ImageDimension << " vector components "
            << vectorlength << std::endl;
-  PixelType meanval = 0;
-  averageimage->FillBuffer(meanval);  // Reset all images to a mean of zero on the accumulator buffer.
-  for( unsigned int j = 4; j < argc; j++ )
+
+  // inputs on another grid are resampled onto the reference once
+  for( size_t n = 0; n < inputs.size(); n++ )
     {
-    std::cout << " reading " << std::string(argv[j]) << std::endl;
     typename ImageFileReader::Pointer rdr = ImageFileReader::New();
-    rdr->SetFileName(argv[j]);
+    rdr->SetFileName( inputs[n].FileName );
+    rdr->UpdateOutputInformation();
+    const ImageType *header = rdr->GetOutput();
+
+    bool sameGrid = ( header->GetLargestPossibleRegion() == reference->GetLargestPossibleRegion() );
+    for( unsigned int d = 0; sameGrid && d < ImageDimension; d++ )
+      {
+      sameGrid = std::fabs( header->GetSpacing()[d] - reference->GetSpacing()[d] ) <= 1.0e-6 * reference->GetSpacing()[d]
+        && std::fabs( header->GetOrigin()[d] - reference->GetOrigin()[d] ) <= 1.0e-6 * reference->GetSpacing()[d];
+      for( unsigned int e = 0; sameGrid && e < ImageDimension; e++ )
+        {
+        sameGrid = std::fabs( header->GetDirection()(d, e) - reference->GetDirection()(d, e) ) <= 1.0e-6;
+        }
+      }
+    if( sameGrid )
+      {
+      continue;
+      }
+
+    std::cout << " resampling " << inputs[n].FileName << std::endl;
     rdr->Update();
     typedef itk::ResampleImageFilter<ImageType, ImageType, float> ResamplerType;
     typename ResamplerType::Pointer resampler = ResamplerType::New();
     // default to identity resampler->SetTransform( transform );
     // default to linearinterp resampler->SetInterpolator( interpolator );
     resampler->SetInput( rdr->GetOutput() );
-    resampler->SetOutputParametersFromImage( averageimage );
+    resampler->SetOutputParametersFromImage( reference );
     resampler->Update();
+    inputs[n].ResampledImage = resampler->GetOutput();
+    }
+
+  typedef AverageImagesThreadStruct<ImageType> ThreadStructType;
+  ThreadStructType str;
+  str.Inputs = &inputs;
+  str.Reference = reference.GetPointer();
+  str.Normalize = normalizei;
+  str.Failed = false;
 
-    typename ImageType::Pointer image2 = resampler->GetOutput();
-    Iterator      vfIter2( image2,  image2->GetLargestPossibleRegion() );
-    unsigned long ct = 0;
-    if( normalizei )
+  const unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const unsigned int numberOfReadThreads = std::max( std::min( numberOfThreads,
+                                                               static_cast<unsigned int>( inputs.size() ) ), 1u );
+
+  if( normalizei )
+    {
+    str.NextInput = 0;
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfReadThreads );
+    threader->SetSingleMethod( AverageImagesMeanThreaderCallback<ImageType>, &str );
+    threader->SingleMethodExecute();
+    if( str.Failed )
       {
-      meanval = 0;
-      for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-        {
-        const PixelType & localp = image2->GetPixel( vfIter2.GetIndex() );
-        meanval = meanval + localp;
-        ct++;
-        }
-      if( ct > 0 )
-        {
-        meanval = meanval / (float)ct;
-        }
-      if( meanval <= 0 )
-        {
-        meanval = (1);
-        }
+      std::cerr << str.ErrorMessage << std::endl;
+      return EXIT_FAILURE;
       }
-    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+    }
+
+  typename ImageType::Pointer averageimage = ImageType::New();
+  averageimage->CopyInformation( reference );
+  averageimage->SetRegions( reference->GetLargestPossibleRegion() );
+  averageimage->Allocate();
+
+  typename ImageType::Pointer varianceimage = ITK_NULLPTR;
+  if( !outputFileNames[1].empty() )
+    {
+    varianceimage = ImageType::New();
+    varianceimage->CopyInformation( reference );
+    varianceimage->SetRegions( reference->GetLargestPossibleRegion() );
+    varianceimage->Allocate();
+    }
+
+  typename ImageType::Pointer medianimage = ITK_NULLPTR;
+  if( !outputFileNames[2].empty() )
+    {
+    medianimage = ImageType::New();
+    medianimage->CopyInformation( reference );
+    medianimage->SetRegions( reference->GetLargestPossibleRegion() );
+    medianimage->Allocate();
+    }
+
+  // The inputs are read slab by slab (along the last dimension) so that the
+  // slabs of all the inputs fit in ANTS_AVERAGE_IMAGES_MEMORY_MB (2048 by
+  // default).
+  double memoryInMegabytes = 2048.0;
+  const char *memoryValue = std::getenv( "ANTS_AVERAGE_IMAGES_MEMORY_MB" );
+  if( memoryValue && atof( memoryValue ) > 0.0 )
+    {
+    memoryInMegabytes = atof( memoryValue );
+    }
+
+  const typename ImageType::RegionType largestRegion = reference->GetLargestPossibleRegion();
+  const unsigned int sliceDimension = ImageDimension - 1;
+  const size_t       numberOfSlices = largestRegion.GetSize()[sliceDimension];
+  const size_t       numberOfSlicePixels = largestRegion.GetNumberOfPixels() / std::max( numberOfSlices, static_cast<size_t>( 1 ) );
+  const size_t       slabBytes = static_cast<size_t>( memoryInMegabytes * 1024.0 * 1024.0 );
+  const size_t       slicesPerSlab = std::min( numberOfSlices, std::max( static_cast<size_t>( 1 ),
+    slabBytes / ( inputs.size() * numberOfSlicePixels * sizeof( float ) ) ) );
+
+  std::vector<float> values;
+  for( size_t firstSlice = 0; firstSlice < numberOfSlices; firstSlice += slicesPerSlab )
+    {
+    const size_t slabSlices = std::min( slicesPerSlab, numberOfSlices - firstSlice );
+
+    typename ImageType::RegionType slab = largestRegion;
+    slab.SetIndex( sliceDimension, largestRegion.GetIndex()[sliceDimension] + firstSlice );
+    slab.SetSize( sliceDimension, slabSlices );
+
+    str.Slab = slab;
+    str.NumberOfSlabPixels = slab.GetNumberOfPixels();
+    values.resize( inputs.size() * str.NumberOfSlabPixels );
+    str.Values = &values;
+
+    const size_t offset = firstSlice * numberOfSlicePixels;
+    str.Mean = averageimage->GetBufferPointer() + offset;
+    str.Variance = varianceimage.IsNotNull() ? varianceimage->GetBufferPointer() + offset : ITK_NULLPTR;
+    str.Median = medianimage.IsNotNull() ? medianimage->GetBufferPointer() + offset : ITK_NULLPTR;
+
+    if( slicesPerSlab < numberOfSlices )
       {
-      PixelType val = vfIter2.Get();
-      if( normalizei )
-        {
-        val /= meanval;
-        }
-      val = val / (float)numberofimages;
-      const PixelType & oldval = averageimage->GetPixel(vfIter2.GetIndex() );
-      averageimage->SetPixel(vfIter2.GetIndex(), val + oldval );
+      std::cout << " slab " << firstSlice << " - " << firstSlice + slabSlices - 1 << std::endl;
       }
+
+    str.NextInput = 0;
+    itk::MultiThreader::Pointer readThreader = itk::MultiThreader::New();
+    readThreader->SetNumberOfThreads( numberOfReadThreads );
+    readThreader->SetSingleMethod( AverageImagesReadThreaderCallback<ImageType>, &str );
+    readThreader->SingleMethodExecute();
+    if( str.Failed )
+      {
+      std::cerr << str.ErrorMessage << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    itk::MultiThreader::Pointer statisticsThreader = itk::MultiThreader::New();
+    statisticsThreader->SetNumberOfThreads( std::max( std::min( numberOfThreads,
+      static_cast<unsigned int>( str.NumberOfSlabPixels ) ), 1u ) );
+    statisticsThreader->SetSingleMethod( AverageImagesStatisticsThreaderCallback<ImageType>, &str );
+    statisticsThreader->SingleMethodExecute();
     }
 
   //  typedef itk::OptimalSharpeningImageFilter<ImageType,ImageType > sharpeningFilter;
@@ -160,10 +513,24 @@ int AverageImages1(unsigned int argc, char *argv[])
   std::cout << " writing output ";
     {
     typename writertype::Pointer writer = writertype::New();
-    writer->SetFileName(argv[2]);
+    writer->SetFileName( outputFileNames[0] );
     writer->SetInput( averageimage );
     writer->Update();
     }
+  if( varianceimage.IsNotNull() )
+    {
+    typename writertype::Pointer writer = writertype::New();
+    writer->SetFileName( outputFileNames[1] );
+    writer->SetInput( varianceimage );
+    writer->Update();
+    }
+  if( medianimage.IsNotNull() )
+    {
+    typename writertype::Pointer writer = writertype::New();
+    writer->SetFileName( outputFileNames[2] );
+    writer->SetInput( medianimage );
+    writer->Update();
+    }
 
   return EXIT_SUCCESS;
 }
@@ -308,7 +675,7 @@ private:
     std::cout << argv[0] << " ImageDimension Outputfname.nii.gz Normalize <images> \n" << std::endl;
     std::cout << " Compulsory arguments: \n" << std::endl;
     std::cout << " ImageDimension: 2 or 3 (for 2 or 3 dimensional input).\n " << std::endl;
-    std::cout << " Outputfname.nii.gz: the name of the resulting image.\n" << std::endl;
+    std::cout << " Outputfname.nii.gz: the name of the resulting image.  For scalar images, [mean.nii.gz,<variance.nii.gz>,<median.nii.gz>] also writes the voxelwise variance and/or median of the inputs.\n" << std::endl;
     std::cout
       <<
       " Normalize: 0 (false) or 1 (true); if true, the 2nd image is divided by its mean. This will select the largest image to average into.\n"
@@ -0,0 +1,1137 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+/**
+ * Performance benchmarks of ANTs.
+ *
+ * The micro benchmarks time the kernels which dominate the run time of the
+ * programs on synthetic phantoms generated from a fixed seed, so that they
+ * are reproducible without any data.  The macro benchmarks run whole programs,
+ * in process, on the images given on the command line, which the
+ * ants_benchmarks target takes from the test data.
+ *
+ * The results are written as JSON in the layout of Google Benchmark, one
+ * benchmark per line, and can be compared against the results of a previous
+ * build with --baseline.
+ */
+
+#include "antsUtilities.h"
+#include "antsAllocImage.h"
+#include "antsCommandLineParser.h"
+#include "ANTsVersion.h"
+#include "include/ants.h"
+
+#include "antsAtroposSegmentationImageFilter.h"
+#include "itkWeightedVotingFusionImageFilter.h"
+
+#include "itkAffineTransform.h"
+#include "itkANTSNeighborhoodCorrelationImageToImageMetricv4.h"
+#include "itkComposeDisplacementFieldsImageFilter.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkGaussianSmoothingOnUpdateDisplacementFieldTransform.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkMattesMutualInformationImageToImageMetricv4.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreader.h"
+#include "itkRealTimeClock.h"
+#include "itkResampleImageFilter.h"
+#include "itksys/SystemTools.hxx"
+
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace
+{
+const unsigned int ImageDimension = 3;
+
+typedef float                                               PixelType;
+typedef itk::Image<PixelType, ImageDimension>               ImageType;
+typedef unsigned int                                        LabelType;
+typedef itk::Image<LabelType, ImageDimension>               LabelImageType;
+typedef itk::Vector<double, ImageDimension>                 VectorType;
+typedef itk::Image<VectorType, ImageDimension>              DisplacementFieldType;
+typedef itk::DisplacementFieldTransform<double, ImageDimension> DisplacementFieldTransformType;
+typedef itk::AffineTransform<double, ImageDimension>        AffineTransformType;
+
+/**
+ * A phantom of three nested tissue shells around an offset center with
+ * Gaussian noise.  The label image holds the shell of each voxel.
+ */
+void CreatePhantom( unsigned int size, double offset, unsigned int seed,
+                    ImageType::Pointer & image, LabelImageType::Pointer & labels )
+{
+  ImageType::RegionType region;
+  ImageType::SizeType   imageSize;
+  imageSize.Fill( size );
+  region.SetSize( imageSize );
+
+  image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  labels = LabelImageType::New();
+  labels->CopyInformation( image );
+  labels->SetRegions( region );
+  labels->Allocate();
+
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator RandomizerType;
+  RandomizerType::Pointer randomizer = RandomizerType::New();
+  randomizer->Initialize( seed );
+
+  const double center = 0.5 * ( size - 1 ) + offset;
+
+  itk::ImageRegionIteratorWithIndex<ImageType> It( image, region );
+  itk::ImageRegionIterator<LabelImageType>     ItL( labels, region );
+  for( It.GoToBegin(), ItL.GoToBegin(); !It.IsAtEnd(); ++It, ++ItL )
+    {
+    double radius = 0.0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const double x = ( It.GetIndex()[d] - center ) / ( 0.5 * size );
+      // flatten the shells along the first axis so that they are not spheres
+      radius += ( d == 0 ? 1.5 : 1.0 ) * x * x;
+      }
+    radius = std::sqrt( radius );
+
+    LabelType label = 0;
+    if( radius < 0.3 )
+      {
+      label = 3;
+      }
+    else if( radius < 0.55 )
+      {
+      label = 2;
+      }
+    else if( radius < 0.8 )
+      {
+      label = 1;
+      }
+    ItL.Set( label );
+    // the noise has a variance of 400, i.e. a standard deviation of 20
+    It.Set( static_cast<PixelType>( 100.0 * label + randomizer->GetNormalVariate( 0.0, 400.0 ) ) );
+    }
+}
+
+/** A smooth displacement field with a peak displacement of amplitude voxels. */
+DisplacementFieldType::Pointer CreateDisplacementField( const ImageType * domain, double amplitude, double phase )
+{
+  VectorType zero;
+  zero.Fill( 0.0 );
+  DisplacementFieldType::Pointer field = AllocImage<DisplacementFieldType>( domain, zero );
+
+  const DisplacementFieldType::SizeType size = field->GetLargestPossibleRegion().GetSize();
+
+  itk::ImageRegionIteratorWithIndex<DisplacementFieldType> It( field, field->GetLargestPossibleRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    VectorType displacement;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const unsigned int e = ( d + 1 ) % ImageDimension;
+      displacement[d] = amplitude * std::sin( 2.0 * vnl_math::pi * It.GetIndex()[e] / size[e] + phase );
+      }
+    It.Set( displacement );
+    }
+  return field;
+}
+
+struct BenchmarkOptions
+  {
+  unsigned int size;
+  std::vector<std::string> registrationImages;
+  std::string n4Image;
+  std::vector<std::string> fusionImages;
+  std::string outputDirectory;
+  };
+
+/**
+ * A benchmark is set up once, outside of the timing, and then run as many
+ * times as the harness needs.  Every run must redo all of the work.
+ */
+class Benchmark
+{
+public:
+  virtual ~Benchmark()
+  {
+  }
+
+  virtual std::string GetName() const = 0;
+
+  virtual bool IsMacroBenchmark() const
+  {
+    return false;
+  }
+
+  /** Returns false if the benchmark cannot run with these options. */
+  virtual bool SetUp( const BenchmarkOptions & options ) = 0;
+
+  virtual bool Run() = 0;
+};
+
+class PhantomBenchmark : public Benchmark
+{
+public:
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    CreatePhantom( options.size, 0.0, 1, this->m_FixedImage, this->m_FixedLabels );
+    CreatePhantom( options.size, 0.05 * options.size, 2, this->m_MovingImage, this->m_MovingLabels );
+    return true;
+  }
+
+protected:
+  ImageType::Pointer      m_FixedImage;
+  LabelImageType::Pointer m_FixedLabels;
+  ImageType::Pointer      m_MovingImage;
+  LabelImageType::Pointer m_MovingLabels;
+};
+
+/** The neighborhood cross correlation of SyN, one dense metric evaluation. */
+class CCMetricBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::ANTSNeighborhoodCorrelationImageToImageMetricv4<ImageType, ImageType> MetricType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Metric/CC/GetValueAndDerivative";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    DisplacementFieldTransformType::Pointer transform = DisplacementFieldTransformType::New();
+    transform->SetDisplacementField( CreateDisplacementField( this->m_FixedImage, 1.0, 0.0 ) );
+
+    MetricType::RadiusType radius;
+    radius.Fill( 4 );
+
+    this->m_Metric = MetricType::New();
+    this->m_Metric->SetRadius( radius );
+    this->m_Metric->SetFixedImage( this->m_FixedImage );
+    this->m_Metric->SetMovingImage( this->m_MovingImage );
+    this->m_Metric->SetMovingTransform( transform );
+    this->m_Metric->Initialize();
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    MetricType::MeasureType    value;
+    MetricType::DerivativeType derivative( this->m_Metric->GetNumberOfParameters() );
+    this->m_Metric->GetValueAndDerivative( value, derivative );
+    return true;
+  }
+
+private:
+  MetricType::Pointer m_Metric;
+};
+
+/** Mattes mutual information of the linear stages, one evaluation over all the voxels. */
+class MIMetricBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType> MetricType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Metric/MI/GetValueAndDerivative";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    AffineTransformType::Pointer transform = AffineTransformType::New();
+    transform->SetIdentity();
+
+    this->m_Metric = MetricType::New();
+    this->m_Metric->SetNumberOfHistogramBins( 32 );
+    this->m_Metric->SetFixedImage( this->m_FixedImage );
+    this->m_Metric->SetMovingImage( this->m_MovingImage );
+    this->m_Metric->SetMovingTransform( transform );
+    this->m_Metric->Initialize();
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    MetricType::MeasureType    value;
+    MetricType::DerivativeType derivative( this->m_Metric->GetNumberOfParameters() );
+    this->m_Metric->GetValueAndDerivative( value, derivative );
+    return true;
+  }
+
+private:
+  MetricType::Pointer m_Metric;
+};
+
+class ComposeFieldsBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::ComposeDisplacementFieldsImageFilter<DisplacementFieldType, DisplacementFieldType> ComposerType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Field/Compose";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+    this->m_DisplacementField = CreateDisplacementField( this->m_FixedImage, 2.0, 0.0 );
+    this->m_WarpingField = CreateDisplacementField( this->m_FixedImage, 2.0, 1.0 );
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    ComposerType::Pointer composer = ComposerType::New();
+    composer->SetDisplacementField( this->m_DisplacementField );
+    composer->SetWarpingField( this->m_WarpingField );
+    composer->Update();
+    return true;
+  }
+
+private:
+  DisplacementFieldType::Pointer m_DisplacementField;
+  DisplacementFieldType::Pointer m_WarpingField;
+};
+
+/** The update of a SyN[0.1,3,0] transform, which smooths the update field. */
+class GaussianSmoothFieldBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::GaussianSmoothingOnUpdateDisplacementFieldTransform<double, ImageDimension> TransformType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Field/GaussianSmoothUpdate";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    this->m_Transform = TransformType::New();
+    this->m_Transform->SetDisplacementField( CreateDisplacementField( this->m_FixedImage, 0.0, 0.0 ) );
+    this->m_Transform->SetGaussianSmoothingVarianceForTheUpdateField( 3.0 );
+    this->m_Transform->SetGaussianSmoothingVarianceForTheTotalField( 0.0 );
+
+    DisplacementFieldType::Pointer update = CreateDisplacementField( this->m_FixedImage, 0.01, 0.0 );
+
+    this->m_Update.SetSize( this->m_Transform->GetNumberOfParameters() );
+    const VectorType * buffer = update->GetBufferPointer();
+    for( unsigned int n = 0; n < this->m_Update.GetSize(); n++ )
+      {
+      this->m_Update[n] = buffer[n / ImageDimension][n % ImageDimension];
+      }
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    this->m_Transform->UpdateTransformParameters( this->m_Update, 1.0 );
+    return true;
+  }
+
+private:
+  TransformType::Pointer        m_Transform;
+  TransformType::DerivativeType m_Update;
+};
+
+class ResampleBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::ResampleImageFilter<ImageType, ImageType, double>  ResamplerType;
+  typedef itk::LinearInterpolateImageFunction<ImageType, double>  InterpolatorType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Resample/Linear/Affine";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    this->m_Transform = AffineTransformType::New();
+    AffineTransformType::OutputVectorType axis;
+    axis.Fill( 1.0 );
+    AffineTransformType::InputPointType center;
+    center.Fill( 0.5 * options.size );
+    this->m_Transform->SetCenter( center );
+    this->m_Transform->Rotate3D( axis, 0.1 );
+    this->m_Transform->Scale( 1.05 );
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInput( this->m_MovingImage );
+    resampler->SetTransform( this->m_Transform );
+    resampler->SetInterpolator( InterpolatorType::New() );
+    resampler->SetOutputParametersFromImage( this->m_FixedImage );
+    resampler->Update();
+    return true;
+  }
+
+private:
+  AffineTransformType::Pointer m_Transform;
+};
+
+/** Atropos with a k-means initialization of three classes and a single EM iteration. */
+class AtroposIterationBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::ants::AtroposSegmentationImageFilter<ImageType, LabelImageType, LabelImageType> SegmenterType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Atropos/KMeans3/OneIteration";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    this->m_Mask = AllocImage<LabelImageType>( this->m_FixedImage, 1 );
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    SegmenterType::ArrayType radius;
+    radius.Fill( 1 );
+
+    SegmenterType::Pointer segmenter = SegmenterType::New();
+    segmenter->SetNumberOfTissueClasses( 3 );
+    segmenter->SetInitializationStrategy( SegmenterType::KMeans );
+    segmenter->SetMaximumNumberOfIterations( 1 );
+    segmenter->SetMRFSmoothingFactor( 0.1 );
+    segmenter->SetMRFRadius( radius );
+    segmenter->SetRandomizerInitializationSeed( 1 );
+    segmenter->SetIntensityImage( 0, this->m_FixedImage );
+    segmenter->SetMaskImage( this->m_Mask );
+    segmenter->Update();
+    return true;
+  }
+
+private:
+  LabelImageType::Pointer m_Mask;
+};
+
+/** Joint label fusion of four atlases over a slab one voxel thick. */
+class JointFusionSlabBenchmark : public PhantomBenchmark
+{
+public:
+  typedef itk::WeightedVotingFusionImageFilter<ImageType, LabelImageType> FusionFilterType;
+
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "JointFusion/FourAtlases/OneVoxelSlab";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    PhantomBenchmark::SetUp( options );
+
+    for( unsigned int n = 0; n < 4; n++ )
+      {
+      ImageType::Pointer      atlas;
+      LabelImageType::Pointer labels;
+      CreatePhantom( options.size, 0.02 * options.size * ( n % 2 ? 1.0 : -1.0 ), 10 + n, atlas, labels );
+      this->m_AtlasImages.push_back( atlas );
+      this->m_AtlasLabels.push_back( labels );
+      }
+
+    this->m_Mask = AllocImage<LabelImageType>( this->m_FixedImage, 0 );
+
+    LabelImageType::RegionType slab = this->m_Mask->GetLargestPossibleRegion();
+    slab.SetIndex( ImageDimension - 1, options.size / 2 );
+    slab.SetSize( ImageDimension - 1, 1 );
+    itk::ImageRegionIterator<LabelImageType> It( this->m_Mask, slab );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      It.Set( 1 );
+      }
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    FusionFilterType::NeighborhoodRadiusType patchRadius;
+    patchRadius.Fill( 2 );
+    FusionFilterType::NeighborhoodRadiusType searchRadius;
+    searchRadius.Fill( 3 );
+
+    FusionFilterType::Pointer fusionFilter = FusionFilterType::New();
+    fusionFilter->SetPatchNeighborhoodRadius( patchRadius );
+    fusionFilter->SetSearchNeighborhoodRadius( searchRadius );
+
+    FusionFilterType::InputImageList targetImageList( 1, this->m_FixedImage );
+    fusionFilter->SetTargetImage( targetImageList );
+    for( unsigned int n = 0; n < this->m_AtlasImages.size(); n++ )
+      {
+      FusionFilterType::InputImageList atlasImageList( 1, this->m_AtlasImages[n] );
+      fusionFilter->AddAtlas( atlasImageList, this->m_AtlasLabels[n] );
+      }
+    fusionFilter->SetMaskImage( this->m_Mask );
+    fusionFilter->Update();
+    return true;
+  }
+
+private:
+  std::vector<ImageType::Pointer>      m_AtlasImages;
+  std::vector<LabelImageType::Pointer> m_AtlasLabels;
+  LabelImageType::Pointer              m_Mask;
+};
+
+/** A macro benchmark runs an ANTs program in process with fixed arguments. */
+class ProgramBenchmark : public Benchmark
+{
+public:
+  virtual bool IsMacroBenchmark() const ITK_OVERRIDE
+  {
+    return true;
+  }
+
+  virtual bool Run() ITK_OVERRIDE
+  {
+    std::ostringstream log;
+    return this->RunProgram( this->m_Arguments, &log ) == EXIT_SUCCESS;
+  }
+
+protected:
+  virtual int RunProgram( const std::vector<std::string> & arguments, std::ostream * log ) = 0;
+
+  std::vector<std::string> m_Arguments;
+};
+
+/** The stages of antsRegistrationSyNQuick.sh -t s for two dimensional images. */
+class RegistrationSyNQuickBenchmark : public ProgramBenchmark
+{
+public:
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Program/antsRegistration/SyNQuick";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    if( options.registrationImages.size() != 2 )
+      {
+      return false;
+      }
+    const std::string & fixed = options.registrationImages[0];
+    const std::string & moving = options.registrationImages[1];
+    const std::string   linearMetric = "MI[" + fixed + "," + moving + ",1,32,Regular,0.25]";
+
+    const char * const arguments[] = {
+      "--dimensionality", "2", "--float", "1",
+      "--interpolation", "Linear", "--use-histogram-matching", "0",
+      "--winsorize-image-intensities", "[0.005,0.995]",
+      "--transform", "Rigid[0.1]", "--metric", "LINEAR_METRIC",
+      "--convergence", "[1000x500x250x0,1e-6,10]", "--shrink-factors", "8x4x2x1",
+      "--smoothing-sigmas", "3x2x1x0vox",
+      "--transform", "Affine[0.1]", "--metric", "LINEAR_METRIC",
+      "--convergence", "[1000x500x250x0,1e-6,10]", "--shrink-factors", "8x4x2x1",
+      "--smoothing-sigmas", "3x2x1x0vox",
+      "--transform", "SyN[0.1,3,0]", "--metric", "SYN_METRIC",
+      "--convergence", "[100x70x50x0,1e-6,10]", "--shrink-factors", "8x4x2x1",
+      "--smoothing-sigmas", "3x2x1x0vox",
+      "--output", "OUTPUT" };
+    const unsigned int numberOfArguments = sizeof( arguments ) / sizeof( arguments[0] );
+
+    this->m_Arguments.clear();
+    this->m_Arguments.push_back( "--initial-moving-transform" );
+    this->m_Arguments.push_back( "[" + fixed + "," + moving + ",1]" );
+    for( unsigned int n = 0; n < numberOfArguments; n++ )
+      {
+      const std::string argument( arguments[n] );
+      if( argument == "LINEAR_METRIC" )
+        {
+        this->m_Arguments.push_back( linearMetric );
+        }
+      else if( argument == "SYN_METRIC" )
+        {
+        this->m_Arguments.push_back( "MI[" + fixed + "," + moving + ",1,32]" );
+        }
+      else if( argument == "OUTPUT" )
+        {
+        this->m_Arguments.push_back( options.outputDirectory + "/benchmarkSyNQuick" );
+        }
+      else
+        {
+        this->m_Arguments.push_back( argument );
+        }
+      }
+    return true;
+  }
+
+protected:
+  virtual int RunProgram( const std::vector<std::string> & arguments, std::ostream * log ) ITK_OVERRIDE
+  {
+    return ants::antsRegistration( arguments, log );
+  }
+};
+
+class N4Benchmark : public ProgramBenchmark
+{
+public:
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Program/N4BiasFieldCorrection";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    if( options.n4Image.empty() )
+      {
+      return false;
+      }
+    this->m_Arguments.clear();
+    this->m_Arguments.push_back( "--image-dimensionality" );
+    this->m_Arguments.push_back( "2" );
+    this->m_Arguments.push_back( "--input-image" );
+    this->m_Arguments.push_back( options.n4Image );
+    this->m_Arguments.push_back( "--shrink-factor" );
+    this->m_Arguments.push_back( "2" );
+    this->m_Arguments.push_back( "--convergence" );
+    this->m_Arguments.push_back( "[50x50x50x50,0.0]" );
+    this->m_Arguments.push_back( "--bspline-fitting" );
+    this->m_Arguments.push_back( "[20]" );
+    this->m_Arguments.push_back( "--output" );
+    this->m_Arguments.push_back( options.outputDirectory + "/benchmarkN4.nii.gz" );
+    return true;
+  }
+
+protected:
+  virtual int RunProgram( const std::vector<std::string> & arguments, std::ostream * log ) ITK_OVERRIDE
+  {
+    return ants::N4BiasFieldCorrection( arguments, log );
+  }
+};
+
+/** Joint intensity fusion of the target image from the other images. */
+class JointFusionBenchmark : public ProgramBenchmark
+{
+public:
+  virtual std::string GetName() const ITK_OVERRIDE
+  {
+    return "Program/antsJointFusion";
+  }
+
+  virtual bool SetUp( const BenchmarkOptions & options ) ITK_OVERRIDE
+  {
+    if( options.fusionImages.size() < 3 )
+      {
+      return false;
+      }
+    this->m_Arguments.clear();
+    this->m_Arguments.push_back( "--image-dimensionality" );
+    this->m_Arguments.push_back( "2" );
+    this->m_Arguments.push_back( "--target-image" );
+    this->m_Arguments.push_back( options.fusionImages[0] );
+    for( unsigned int n = 1; n < options.fusionImages.size(); n++ )
+      {
+      this->m_Arguments.push_back( "--atlas-image" );
+      this->m_Arguments.push_back( options.fusionImages[n] );
+      }
+    this->m_Arguments.push_back( "--patch-radius" );
+    this->m_Arguments.push_back( "2x2" );
+    this->m_Arguments.push_back( "--search-radius" );
+    this->m_Arguments.push_back( "3x3" );
+    this->m_Arguments.push_back( "--output" );
+    this->m_Arguments.push_back( options.outputDirectory + "/benchmarkJointFusion%d.nii.gz" );
+    return true;
+  }
+
+protected:
+  virtual int RunProgram( const std::vector<std::string> & arguments, std::ostream * log ) ITK_OVERRIDE
+  {
+    return ants::antsJointFusion( arguments, log );
+  }
+};
+
+struct BenchmarkResult
+  {
+  std::string  name;
+  unsigned int iterations;
+  unsigned int repetitions;
+  // milliseconds per iteration
+  double       realTime;
+  double       minimumRealTime;
+  double       cpuTime;
+  };
+
+double GetMedian( std::vector<double> values )
+{
+  std::sort( values.begin(), values.end() );
+  const unsigned int n = values.size();
+  return ( n % 2 ) ? values[n / 2] : 0.5 * ( values[n / 2 - 1] + values[n / 2] );
+}
+
+/**
+ * Runs the benchmark once to warm up and then for each repetition as many
+ * times as fit in the minimum time, at least once.
+ */
+bool RunBenchmark( Benchmark * benchmark, unsigned int repetitions, double minimumTime, BenchmarkResult & result )
+{
+  if( !benchmark->Run() )
+    {
+    return false;
+    }
+
+  itk::RealTimeClock::Pointer clock = itk::RealTimeClock::New();
+
+  std::vector<double> realTimes;
+  std::vector<double> cpuTimes;
+  unsigned int        totalIterations = 0;
+  for( unsigned int r = 0; r < repetitions; r++ )
+    {
+    const double       startTime = clock->GetTimeInSeconds();
+    const std::clock_t startClock = std::clock();
+    unsigned int       iterations = 0;
+    double             elapsedTime = 0.0;
+    do
+      {
+      if( !benchmark->Run() )
+        {
+        return false;
+        }
+      iterations++;
+      elapsedTime = clock->GetTimeInSeconds() - startTime;
+      }
+    while( elapsedTime < minimumTime );
+
+    const double cpuTime = static_cast<double>( std::clock() - startClock ) / CLOCKS_PER_SEC;
+    realTimes.push_back( 1000.0 * elapsedTime / iterations );
+    cpuTimes.push_back( 1000.0 * cpuTime / iterations );
+    totalIterations += iterations;
+    }
+
+  result.name = benchmark->GetName();
+  result.iterations = totalIterations;
+  result.repetitions = repetitions;
+  result.realTime = GetMedian( realTimes );
+  result.minimumRealTime = *std::min_element( realTimes.begin(), realTimes.end() );
+  result.cpuTime = GetMedian( cpuTimes );
+  return true;
+}
+
+void WriteResults( std::ostream & os, const std::vector<BenchmarkResult> & results, unsigned int size )
+{
+  const std::time_t now = std::time( ITK_NULLPTR );
+  char              date[32];
+  std::strftime( date, sizeof( date ), "%Y-%m-%d %H:%M:%S", std::localtime( &now ) );
+
+  os << "{" << std::endl;
+  os << "  \"context\": {\"date\": \"" << date << "\", \"executable\": \"antsBenchmarks\", "
+     << "\"num_cpus\": " << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << ", "
+     << "\"phantom_size\": " << size << ", \"version\": \"" << ANTs::Version::ExtendedVersionString() << "\"},"
+     << std::endl;
+  os << "  \"benchmarks\": [" << std::endl;
+  os << std::setprecision( 6 );
+  for( unsigned int n = 0; n < results.size(); n++ )
+    {
+    const BenchmarkResult & result = results[n];
+    os << "    {\"name\": \"" << result.name << "\", \"run_type\": \"aggregate\", \"aggregate_name\": \"median\", "
+       << "\"iterations\": " << result.iterations << ", \"repetitions\": " << result.repetitions << ", "
+       << "\"real_time\": " << result.realTime << ", \"real_time_min\": " << result.minimumRealTime << ", "
+       << "\"cpu_time\": " << result.cpuTime << ", \"time_unit\": \"ms\"}"
+       << ( n + 1 < results.size() ? "," : "" ) << std::endl;
+    }
+  os << "  ]" << std::endl;
+  os << "}" << std::endl;
+}
+
+/** Reads the median real times of a file written by WriteResults. */
+bool ReadBaseline( const std::string & fileName, std::map<std::string, double> & realTimes )
+{
+  std::ifstream file( fileName.c_str() );
+  if( !file )
+    {
+    return false;
+    }
+
+  const std::string nameKey = "\"name\": \"";
+  const std::string timeKey = "\"real_time\": ";
+
+  std::string line;
+  while( std::getline( file, line ) )
+    {
+    const std::string::size_type namePosition = line.find( nameKey );
+    const std::string::size_type timePosition = line.find( timeKey );
+    if( namePosition == std::string::npos || timePosition == std::string::npos )
+      {
+      continue;
+      }
+    const std::string::size_type nameStart = namePosition + nameKey.size();
+    const std::string            name = line.substr( nameStart, line.find( '"', nameStart ) - nameStart );
+    realTimes[name] = atof( line.c_str() + timePosition + timeKey.size() );
+    }
+  return true;
+}
+
+void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  {
+  std::string description =
+    std::string( "Only run the benchmarks whose name contains this string." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "filter" );
+  option->SetShortName( 'f' );
+  option->SetUsageOption( 0, "substring" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The edge length in voxels of the synthetic phantoms of the micro " )
+    + std::string( "benchmarks (default = 64)." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "phantom-size" );
+  option->SetShortName( 's' );
+  option->SetUsageOption( 0, "64" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The number of timed repetitions of each benchmark, of which the median " )
+    + std::string( "is reported, and the minimum time in seconds of each repetition of a " )
+    + std::string( "micro benchmark (defaults = 5 and 0.5).  Macro benchmarks run once per " )
+    + std::string( "repetition." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "repetitions" );
+  option->SetShortName( 'r' );
+  option->SetUsageOption( 0, "numberOfRepetitions" );
+  option->SetUsageOption( 1, "[numberOfRepetitions,<minimumTime=0.5>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The fixed and moving images of the antsRegistration macro benchmark." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "registration-images" );
+  option->SetUsageOption( 0, "[fixedImage,movingImage]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The input image of the N4BiasFieldCorrection macro benchmark." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-image" );
+  option->SetUsageOption( 0, "inputImage" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The target image followed by at least two atlas images of the " )
+    + std::string( "antsJointFusion macro benchmark." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "fusion-images" );
+  option->SetUsageOption( 0, "[targetImage,atlasImage1,atlasImage2,...]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "The results in JSON, and the directory for the outputs of the macro " )
+    + std::string( "benchmarks (default = the current directory)." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "output" );
+  option->SetShortName( 'o' );
+  option->SetUsageOption( 0, "results.json" );
+  option->SetUsageOption( 1, "[results.json,<outputDirectory>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Compare the median times against the results of a previous run and " )
+    + std::string( "fail if any benchmark is slower than the baseline by more than the " )
+    + std::string( "tolerance (default = 0.1, i.e. 10%)." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "baseline" );
+  option->SetShortName( 'b' );
+  option->SetUsageOption( 0, "baseline.json" );
+  option->SetUsageOption( 1, "[baseline.json,<tolerance=0.1>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetShortName( 'h' );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "help" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+}
+} // end anonymous namespace
+
+int main( int argc, char *argv[] )
+{
+  itk::ants::CommandLineParser::Pointer parser = itk::ants::CommandLineParser::New();
+
+  parser->SetCommand( argv[0] );
+
+  std::string commandDescription =
+    std::string( "Runs the performance benchmarks of ANTs and writes their per-iteration " )
+    + std::string( "times in milliseconds, the median of the repetitions, as JSON." );
+
+  parser->SetCommandDescription( commandDescription );
+  InitializeCommandLineOptions( parser );
+
+  if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( ( parser->GetOption( "help" )->GetFunction() &&
+        parser->Convert<bool>( parser->GetOption( "help" )->GetFunction()->GetName() ) ) ||
+      ( parser->GetOption( 'h' )->GetFunction() &&
+        parser->Convert<bool>( parser->GetOption( 'h' )->GetFunction()->GetName() ) ) )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_SUCCESS;
+    }
+
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  BenchmarkOptions options;
+  options.size = 64;
+  options.outputDirectory = ".";
+
+  std::string filter;
+  OptionType::Pointer filterOption = parser->GetOption( "filter" );
+  if( filterOption && filterOption->GetNumberOfFunctions() )
+    {
+    filter = filterOption->GetFunction( 0 )->GetName();
+    }
+
+  OptionType::Pointer sizeOption = parser->GetOption( "phantom-size" );
+  if( sizeOption && sizeOption->GetNumberOfFunctions() )
+    {
+    options.size = parser->Convert<unsigned int>( sizeOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned int repetitions = 5;
+  double       minimumTime = 0.5;
+  OptionType::Pointer repetitionsOption = parser->GetOption( "repetitions" );
+  if( repetitionsOption && repetitionsOption->GetNumberOfFunctions() )
+    {
+    if( repetitionsOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+      {
+      repetitions = parser->Convert<unsigned int>( repetitionsOption->GetFunction( 0 )->GetName() );
+      }
+    else
+      {
+      repetitions = parser->Convert<unsigned int>( repetitionsOption->GetFunction( 0 )->GetParameter( 0 ) );
+      if( repetitionsOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        minimumTime = parser->Convert<double>( repetitionsOption->GetFunction( 0 )->GetParameter( 1 ) );
+        }
+      }
+    repetitions = std::max( repetitions, 1u );
+    }
+
+  OptionType::Pointer registrationOption = parser->GetOption( "registration-images" );
+  if( registrationOption && registrationOption->GetNumberOfFunctions() )
+    {
+    for( unsigned int n = 0; n < registrationOption->GetFunction( 0 )->GetNumberOfParameters(); n++ )
+      {
+      options.registrationImages.push_back( registrationOption->GetFunction( 0 )->GetParameter( n ) );
+      }
+    }
+
+  OptionType::Pointer n4Option = parser->GetOption( "n4-image" );
+  if( n4Option && n4Option->GetNumberOfFunctions() )
+    {
+    options.n4Image = n4Option->GetFunction( 0 )->GetName();
+    }
+
+  OptionType::Pointer fusionOption = parser->GetOption( "fusion-images" );
+  if( fusionOption && fusionOption->GetNumberOfFunctions() )
+    {
+    for( unsigned int n = 0; n < fusionOption->GetFunction( 0 )->GetNumberOfParameters(); n++ )
+      {
+      options.fusionImages.push_back( fusionOption->GetFunction( 0 )->GetParameter( n ) );
+      }
+    }
+
+  std::string resultsFileName;
+  OptionType::Pointer outputOption = parser->GetOption( "output" );
+  if( outputOption && outputOption->GetNumberOfFunctions() )
+    {
+    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+      {
+      resultsFileName = outputOption->GetFunction( 0 )->GetName();
+      }
+    else
+      {
+      resultsFileName = outputOption->GetFunction( 0 )->GetParameter( 0 );
+      if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        options.outputDirectory = outputOption->GetFunction( 0 )->GetParameter( 1 );
+        itksys::SystemTools::MakeDirectory( options.outputDirectory.c_str() );
+        }
+      }
+    }
+
+  std::vector<Benchmark *> benchmarks;
+  benchmarks.push_back( new CCMetricBenchmark );
+  benchmarks.push_back( new MIMetricBenchmark );
+  benchmarks.push_back( new ComposeFieldsBenchmark );
+  benchmarks.push_back( new GaussianSmoothFieldBenchmark );
+  benchmarks.push_back( new ResampleBenchmark );
+  benchmarks.push_back( new AtroposIterationBenchmark );
+  benchmarks.push_back( new JointFusionSlabBenchmark );
+  benchmarks.push_back( new RegistrationSyNQuickBenchmark );
+  benchmarks.push_back( new N4Benchmark );
+  benchmarks.push_back( new JointFusionBenchmark );
+
+  int                          status = EXIT_SUCCESS;
+  std::vector<BenchmarkResult> results;
+  for( unsigned int n = 0; n < benchmarks.size(); n++ )
+    {
+    Benchmark * benchmark = benchmarks[n];
+    if( !filter.empty() && benchmark->GetName().find( filter ) == std::string::npos )
+      {
+      continue;
+      }
+    if( !benchmark->SetUp( options ) )
+      {
+      std::cout << std::left << std::setw( 40 ) << benchmark->GetName() << " skipped (no input images)" << std::endl;
+      continue;
+      }
+
+    BenchmarkResult result;
+    bool            succeeded = false;
+    try
+      {
+      succeeded = RunBenchmark( benchmark, repetitions, benchmark->IsMacroBenchmark() ? 0.0 : minimumTime, result );
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      std::cerr << "Exception caught in " << benchmark->GetName() << ": " << e << std::endl;
+      }
+    if( !succeeded )
+      {
+      std::cout << std::left << std::setw( 40 ) << benchmark->GetName() << " failed" << std::endl;
+      status = EXIT_FAILURE;
+      continue;
+      }
+    std::cout << std::left << std::setw( 40 ) << result.name << std::right << std::fixed << std::setprecision( 3 )
+              << std::setw( 12 ) << result.realTime << " ms" << std::setw( 12 ) << result.cpuTime << " ms cpu"
+              << std::setw( 8 ) << result.iterations << " iterations" << std::endl;
+    results.push_back( result );
+    }
+
+  for( unsigned int n = 0; n < benchmarks.size(); n++ )
+    {
+    delete benchmarks[n];
+    }
+
+  if( !resultsFileName.empty() )
+    {
+    std::ofstream file( resultsFileName.c_str() );
+    if( !file )
+      {
+      std::cerr << "Unable to write " << resultsFileName << std::endl;
+      return EXIT_FAILURE;
+      }
+    WriteResults( file, results, options.size );
+    }
+
+  OptionType::Pointer baselineOption = parser->GetOption( "baseline" );
+  if( baselineOption && baselineOption->GetNumberOfFunctions() )
+    {
+    std::string baselineFileName = baselineOption->GetFunction( 0 )->GetName();
+    double      tolerance = 0.1;
+    if( baselineOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      baselineFileName = baselineOption->GetFunction( 0 )->GetParameter( 0 );
+      if( baselineOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        tolerance = parser->Convert<double>( baselineOption->GetFunction( 0 )->GetParameter( 1 ) );
+        }
+      }
+
+    std::map<std::string, double> baseline;
+    if( !ReadBaseline( baselineFileName, baseline ) )
+      {
+      std::cerr << "Unable to read the baseline " << baselineFileName << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    std::cout << std::endl << "Comparison with " << baselineFileName << ":" << std::endl;
+    for( unsigned int n = 0; n < results.size(); n++ )
+      {
+      std::map<std::string, double>::const_iterator it = baseline.find( results[n].name );
+      if( it == baseline.end() || it->second <= 0.0 )
+        {
+        continue;
+        }
+      const double change = results[n].realTime / it->second - 1.0;
+      const bool   isRegression = change > tolerance;
+      std::cout << std::left << std::setw( 40 ) << results[n].name << std::right << std::showpos
+                << std::setw( 10 ) << std::setprecision( 1 ) << 100.0 * change << std::noshowpos << "%"
+                << ( isRegression ? "  REGRESSION" : "" ) << std::endl;
+      if( isRegression )
+        {
+        status = EXIT_FAILURE;
+        }
+      }
+    }
+
+  return status;
+}
@@ -12,6 +12,7 @@
 
 #include "antsUtilities.h"
 #include "antsAllocImage.h"
+#include "antsDigitalTopology.h"
 #include <algorithm>
 #include <algorithm>
 #include <iostream>
@@ -27,12 +28,6 @@
 #include "itkImageRandomConstIteratorWithIndex.h"
 #include "itkImageLinearIteratorWithIndex.h"
 #include "itkShapedNeighborhoodIterator.h"
-#include "BinaryImageToMeshFilter.h"
-
-#include "vtkCallbackCommand.h"
-#include "vtkPointPicker.h"
-#include "vtkCellPicker.h"
-#include "vtkExtractEdges.h"
 
 #include "itkMinimumMaximumImageFilter.h"
 #include "itkConnectedComponentImageFilter.h"
@@ -48,53 +43,14 @@ float random_range(float lowest_number, float highest_number)
   return lowest_number + (float)(range * (float)rand() / (float)(RAND_MAX) );
 }
 
-float ComputeGenus(vtkPolyData* pd1)
-{
-  vtkExtractEdges* edgeex = vtkExtractEdges::New();
-
-  edgeex->SetInputData(pd1);
-  edgeex->Update();
-  vtkPolyData* edg1 = edgeex->GetOutput();
-  vtkIdType    nedg = edg1->GetNumberOfCells();
-  vtkIdType    vers = pd1->GetNumberOfPoints();
-  int          nfac = pd1->GetNumberOfPolys();
-  float        g = 0.5 * (2.0 - vers + nedg - nfac);
-  std::cout << " Genus " << g << std::endl;
-  std::cout << " face " << nfac << " edg " << nedg <<  " vert " << vers << std::endl;
-
-  // edg1->Delete(); //caused malloc err
-  edgeex->Delete();   // should be deleted b/c of New() above !!
-  return g;
-}
-
-float vtkComputeTopology(vtkPolyData* pd)
-{
-  vtkPolyDataConnectivityFilter* con = vtkPolyDataConnectivityFilter::New();
-
-  con->SetExtractionModeToLargestRegion();
-  con->SetInputData(pd);
-  float g = ComputeGenus(con->GetOutput() );
-  con->Delete();   // should be deleted b/c of New() above !!
-  return g;
-}
-
 template <class TImage>
 float GetImageTopology(typename TImage::Pointer image)
 {
-  typedef TImage      ImageType;
-  double aaParm = 0.024;
-  typedef BinaryImageToMeshFilter<ImageType> FilterType;
-  typename  FilterType::Pointer fltMesh = FilterType::New();
-  fltMesh->SetInput(image);
-  fltMesh->SetAntiAliasMaxRMSError(aaParm);
-  fltMesh->SetAntiAliasMaxRMSError( -1000.0 );   // to do nothing
-  fltMesh->SetSmoothingIterations(0);
-  fltMesh->Update();
-  vtkPolyData* vtkmesh = fltMesh->GetMesh();
+  // the genus of the surface from the Euler characteristic of the voxels,
+  // 26-connected as the components kept by GetLargestComponent
   std::cout << " start topo " << std::endl;
-  float genus =  vtkComputeTopology(vtkmesh);
+  float genus = DigitalTopology<TImage>::Genus( image.GetPointer() );
   std::cout << " Genus " << genus << std::endl;
-  //  vtkmesh->Delete();
   return genus;
 }
 
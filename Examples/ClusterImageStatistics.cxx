@@ -30,11 +30,10 @@
 #include "vnl/vnl_vector.h"
 
 #include "itkMinimumMaximumImageFilter.h"
-#include "itkConnectedComponentImageFilter.h"
-#include "itkRelabelComponentImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
 
 #include  "ReadWriteData.h"
+#include "antsConnectedComponentLabeler.h"
 
 namespace ants
 {
@@ -48,8 +47,7 @@ int  ClusterStatistics(unsigned int argc, char *argv[])
 
   typedef unsigned long                                                    ULPixelType;
   typedef itk::Image<ULPixelType, ImageDimension>                          labelimagetype;
-  typedef itk::ConnectedComponentImageFilter<ImageType, labelimagetype>    FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, labelimagetype> RelabelType;
+  typedef ConnectedComponentLabeler<ImageType, labelimagetype>             LabelerType;
 
   // want the average value in each cluster as defined by the mask and the value thresh and the clust thresh
 
@@ -81,129 +79,62 @@ int  ClusterStatistics(unsigned int argc, char *argv[])
     ReadImage<ImageType>(valimage, argv[filecount]);
 
     //  first, threshold the value image then get the clusters of min size
-    typedef itk::BinaryThresholdImageFilter<ImageType, ImageType> ThresholdFilterType;
-    typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
-    threshold->SetInput(valimage);
-    threshold->SetInsideValue(1);
-    threshold->SetOutsideValue(0);
-    threshold->SetLowerThreshold(valuethresh);
-    threshold->SetUpperThreshold(1.e9);
-    threshold->Update();
-    typename ImageType::Pointer thresh = threshold->GetOutput();
-    typedef itk::ImageRegionIteratorWithIndex<ImageType>      fIterator;
-    typedef itk::ImageRegionIteratorWithIndex<labelimagetype> Iterator;
-    fIterator tIter( thresh, thresh->GetLargestPossibleRegion() );
-    for(  tIter.GoToBegin(); !tIter.IsAtEnd(); ++tIter )
+    typename ImageType::Pointer thresh = MakeNewImage<ImageType>(valimage, 0);
+    const size_t     numberOfVoxels = valimage->GetBufferedRegion().GetNumberOfPixels();
+    const PixelType *values = valimage->GetBufferPointer();
+    const PixelType *roi = roiimage->GetBufferPointer();
+    const PixelType *labels = labelimage->GetBufferPointer();
+    PixelType *      threshValues = thresh->GetBufferPointer();
+    for( size_t n = 0; n < numberOfVoxels; n++ )
       {
-      if( roiimage->GetPixel(tIter.GetIndex() ) < 0.5 )
+      if( values[n] >= valuethresh && values[n] <= 1.e9 && roi[n] >= 0.5 )
         {
-        tIter.Set(0);
+        threshValues[n] = 1;
         }
       }
 
-    //  typename
-    typename FilterType::Pointer filter = FilterType::New();
-// typename
-    typename RelabelType::Pointer relabel = RelabelType::New();
-
-    filter->SetInput( thresh );
+    // the clusters and their sizes, sums and maxima in one pass
     int fullyConnected = 0; // atoi( argv[5] );
-    filter->SetFullyConnected( fullyConnected );
-    relabel->SetInput( filter->GetOutput() );
-    relabel->SetMinimumObjectSize( (unsigned int) minSize );
-
-    try
-      {
-      relabel->Update();
-      }
-    catch( itk::ExceptionObject & excep )
-      {
-      std::cerr << "Relabel: exception caught !" << std::endl;
-      std::cerr << excep << std::endl;
-      }
+    LabelerType labeler;
+    labeler.SetInput( thresh );
+    labeler.SetValueImage( valimage );
+    labeler.SetFullyConnected( fullyConnected );
+    labeler.SetMinimumComponentSize( (unsigned int) minSize );
+    labeler.Update();
+    const ULPixelType *clusterLabels = labeler.GetOutput()->GetBufferPointer();
 
     typename ImageType::Pointer Clusters = MakeNewImage<ImageType>(valimage, 0);
-    typename ImageType::Pointer Values = MakeNewImage<ImageType>(valimage, 0);
-    typename ImageType::Pointer Labels = MakeNewImage<ImageType>(valimage, 0);
-    Iterator vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
 
-    float maximum = relabel->GetNumberOfObjects();
+    float maximum = labeler.GetNumberOfComponents();
     //    std::cout << " #object " << maximum << std::endl;
-//    float maxtstat=0;
-    std::vector<unsigned long> histogram( (int)maximum + 1);
-    std::vector<long>          maxlabel( (int)maximum + 1);
+    std::vector<unsigned long> histogram( (int)maximum + 1, 0);
+    std::vector<long>          maxlabel( (int)maximum + 1, 0);
     std::vector<float>         suminlabel( (unsigned long) range + 1);
     std::vector<unsigned long> countinlabel( (unsigned long) range + 1);
-    std::vector<float>         sumofvalues( (int)maximum + 1);
-    std::vector<float>         maxvalue( (int)maximum + 1);
-    for( int i = 0; i <= maximum; i++ )
-      {
-      histogram[i] = 0;
-      sumofvalues[i] = 0;
-      maxvalue[i] = 0;
-      maxlabel[i] = 0;
-      }
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-      {
-      if( vfIter.Get() > 0 )
-        {
-        float vox = valimage->GetPixel(vfIter.GetIndex() );
-        if( vox >= valuethresh )
-          {
-          histogram[(unsigned long)vfIter.Get()] = histogram[(unsigned long)vfIter.Get()] + 1;
-          sumofvalues[(unsigned long)vfIter.Get()] = sumofvalues[(unsigned long)vfIter.Get()] + vox;
-          if( maxvalue[(unsigned long)vfIter.Get()]  < vox )
-            {
-            maxvalue[(unsigned long)vfIter.Get()] = vox;
-            maxlabel[(unsigned long)vfIter.Get()] = (long int)labelimage->GetPixel(vfIter.GetIndex() );
-            }
-
-          suminlabel[(unsigned long)(labelimage->GetPixel(vfIter.GetIndex() ) - min)] += vox;
-          countinlabel[(unsigned long)(labelimage->GetPixel(vfIter.GetIndex() ) - min)] += 1;
-          }
-        }
-      }
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-      {
-      if( vfIter.Get() > 0 )
-        {
-        Clusters->SetPixel( vfIter.GetIndex(), histogram[(unsigned long)vfIter.Get()]  );
-        Values->SetPixel( vfIter.GetIndex(), sumofvalues[(unsigned long)vfIter.Get()]
-                          / (float)histogram[(unsigned int)vfIter.Get()]  );
-        Labels->SetPixel( vfIter.GetIndex(), labelimage->GetPixel(vfIter.GetIndex() ) );
-        }
-      else
-        {
-        Clusters->SetPixel(vfIter.GetIndex(), 0);
-        Labels->SetPixel(vfIter.GetIndex(), 0);
-        Values->SetPixel(vfIter.GetIndex(), 0);
-        }
-      }
-
-    //  WriteImage<ImageType>(Values,std::string("temp.nii.gz").c_str());
-    // WriteImage<ImageType>(Clusters,std::string("temp2.nii.gz").c_str());
-
-    float maximgval = 0;
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+    std::vector<float>         sumofvalues( (int)maximum + 1, 0);
+    std::vector<float>         maxvalue( (int)maximum + 1, 0);
+    for( unsigned long i = 1; i <= labeler.GetNumberOfComponents(); i++ )
       {
-      if( Clusters->GetPixel( vfIter.GetIndex() ) > maximgval )
+      const typename LabelerType::ComponentStatistics & component = labeler.GetStatistics( i );
+      histogram[i] = component.NumberOfVoxels;
+      sumofvalues[i] = component.Sum;
+      if( component.Maximum > 0 )
         {
-        maximgval = Clusters->GetPixel( vfIter.GetIndex() );
+        maxvalue[i] = component.Maximum;
+        maxlabel[i] = (long int)labels[component.MaximumOffset];
         }
       }
-    //  std::cout << " max size " << maximgval << std::endl;
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+    PixelType *clusterSizes = Clusters->GetBufferPointer();
+    for( size_t n = 0; n < numberOfVoxels; n++ )
       {
-      if( Clusters->GetPixel( vfIter.GetIndex() ) < minSize )
+      if( clusterLabels[n] > 0 )
         {
-        Clusters->SetPixel( vfIter.GetIndex(), 0);
-        Values->SetPixel( vfIter.GetIndex(), 0);
-        Labels->SetPixel( vfIter.GetIndex(), 0);
+        clusterSizes[n] = histogram[clusterLabels[n]];
+        suminlabel[(unsigned long)(labels[n] - min)] += values[n];
+        countinlabel[(unsigned long)(labels[n] - min)] += 1;
         }
       }
 
-//  WriteImage<ImageType>(Values,(outname+"values.nii.gz").c_str());
-//  WriteImage<ImageType>(Labels,(outname+"labels.nii.gz").c_str());
     WriteImage<ImageType>(Clusters, (outname + "sizes.nii.gz").c_str() );
 
     // now begin output
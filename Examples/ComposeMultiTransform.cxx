@@ -160,6 +160,9 @@ void ComposeMultiTransform(char *output_image_filename,
       }
     }
 
+  // each voxel then goes through the composition of each run of affines
+  warper->CollapseAdjacentAffineTransforms();
+
   warper->SetOutputParametersFromImage( img_ref );
   std::cout << "output size: " << warper->GetOutputSize() << std::endl;
   std::cout << "output spacing: " << warper->GetOutputSpacing() << std::endl;
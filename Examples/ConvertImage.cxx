@@ -2,9 +2,7 @@
 
 #include "ReadWriteData.h"
 
-#include "itkCastImageFilter.h"
 #include "itkNumericTraits.h"
-#include "itkRescaleIntensityImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
 
 #include <string>
@@ -157,9 +155,6 @@ int ConvertImage( int argc, char *argv[] )
     typedef itk::Image<RealType, ImageDimension> InputImageType;
     typedef itk::Image<OutputPixelType, ImageDimension> OutputImageType;
 
-    typename InputImageType::Pointer inputImage;
-    ReadImage<InputImageType>( inputImage, argv[2] );
-
     std::vector<std::string> rescaleFileTypes;
     rescaleFileTypes.push_back( ".png" );
     rescaleFileTypes.push_back( ".jpeg" );
@@ -178,25 +173,13 @@ int ConvertImage( int argc, char *argv[] )
         }
       }
 
-    if( isRescaleType )
-      {
-      typedef itk::RescaleIntensityImageFilter<InputImageType, OutputImageType> FilterType;
-      typename FilterType::Pointer filter = FilterType::New();
-      filter->SetInput( inputImage );
-      filter->SetOutputMinimum( itk::NumericTraits<OutputPixelType>::min() );
-      filter->SetOutputMaximum( itk::NumericTraits<OutputPixelType>::max() );
-      filter->Update();
-
-      WriteImage<OutputImageType>( filter->GetOutput(), argv[3] );
-      }
-    else
+    // cast, or rescale to the range of the pixel type, and write in chunks
+    // without reading the whole image
+    if( !ConvertImageFile<InputImageType, OutputImageType>( argv[2], argv[3], isRescaleType,
+          static_cast<double>( itk::NumericTraits<OutputPixelType>::min() ),
+          static_cast<double>( itk::NumericTraits<OutputPixelType>::max() ) ) )
       {
-      typedef itk::CastImageFilter<InputImageType, OutputImageType> CasterType;
-      typename CasterType::Pointer caster = CasterType::New();
-      caster->SetInput( inputImage );
-      caster->Update();
-
-      WriteImage<OutputImageType>( caster->GetOutput(), argv[3] );
+      return EXIT_FAILURE;
       }
     }
 
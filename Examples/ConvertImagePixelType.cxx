@@ -14,76 +14,37 @@
 
 #include "antsUtilities.h"
 #include <algorithm>
-#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
 #include <limits.h>
 #include "itkImage.h"
-#include "itkImageFileWriter.h"
 #include "itkImageFileReader.h"
-#include "itkCastImageFilter.h"
-#include "itkRescaleIntensityImageFilter.h"
+#include "ReadWriteData.h"
 
 namespace ants
 {
 template <unsigned int ImageDimension, class TPIXELTYPE>
 int ConvertType(int argc, char *argv[], double MINVAL, double MAXVAL)
 {
-  typedef  TPIXELTYPE                                outPixelType;
-  typedef  float                                     floatPixelType;
-  typedef  float                                     inPixelType;
-  typedef itk::Image<inPixelType, ImageDimension>    ImageType;
-  typedef itk::Image<floatPixelType, ImageDimension> IntermediateType;
-  typedef itk::Image<outPixelType, ImageDimension>   OutImageType;
-  typedef itk::ImageFileReader<ImageType>            readertype;
-  typedef itk::ImageFileWriter<OutImageType>         writertype;
+  typedef  TPIXELTYPE                              outPixelType;
+  typedef  float                                   inPixelType;
+  typedef itk::Image<inPixelType, ImageDimension>  ImageType;
+  typedef itk::Image<outPixelType, ImageDimension> OutImageType;
 
-  typename readertype::Pointer reader = readertype::New();
-  if( argc < 2 )
+  if( argc < 3 )
     {
-    std::cout << "Missing input filename" << std::endl;
-    throw;
+    std::cout << "Missing input or output filename" << std::endl;
+    return EXIT_FAILURE;
     }
-  reader->SetFileName(argv[1]);
-  reader->Update();
-  std::cout << " Updated reader " << std::endl;
-
-  typedef itk::CastImageFilter<ImageType, IntermediateType> castertype;
-  typename   castertype::Pointer caster = castertype::New();
-  caster->SetInput(reader->GetOutput() );
-  caster->Update();
 
-  // Rescale the image intensities so that they fall between 0 and 255
-  typedef itk::RescaleIntensityImageFilter<IntermediateType, IntermediateType> FilterType;
-  typename   FilterType::Pointer fixedrescalefilter = FilterType::New();
-  fixedrescalefilter->SetInput(caster->GetOutput() );
-  const double desiredMinimum =  MINVAL;
-  double       desiredMaximum =  MAXVAL;
-  fixedrescalefilter->SetOutputMinimum( desiredMinimum );
-  fixedrescalefilter->SetOutputMaximum( desiredMaximum );
-  fixedrescalefilter->UpdateLargestPossibleRegion();
-
-  typedef itk::CastImageFilter<IntermediateType, OutImageType> castertype2;
-  typename castertype2::Pointer caster2 = castertype2::New();
-  caster2->SetInput(fixedrescalefilter->GetOutput() );
-  caster2->Update();
-
-  typename   OutImageType::Pointer outim = caster2->GetOutput();
-  typename   OutImageType::SpacingType spc = outim->GetSpacing();
-  outim->SetSpacing(spc);
-  std::cout << " Dire in " << reader->GetOutput()->GetDirection() << std::endl;
-  std::cout << " Dire out " << outim->GetDirection() << std::endl;
-  typename   writertype::Pointer writer = writertype::New();
-  if( argc < 3 )
+  // the intensity range is found in a first pass over the input and the
+  // rescaled image is written in a second, both in chunks, so that large
+  // (e.g. 4D) images are not held in memory
+  if( !ConvertImageFile<ImageType, OutImageType>( argv[1], argv[2], true, MINVAL, MAXVAL ) )
     {
-    std::cout << "Missing output filename" << std::endl;
-    throw;
+    return EXIT_FAILURE;
     }
-  writer->SetFileName(argv[2]);
-  writer->SetInput(outim);
-  writer->Update();
-  writer->Write();
 
   return EXIT_SUCCESS;
 }
@@ -188,6 +149,11 @@ private:
         ConvertType<3, char>(argc, argv,  SCHAR_MIN, SCHAR_MAX );
         }
         break;
+      case 4:
+        {
+        ConvertType<4, char>(argc, argv,  SCHAR_MIN, SCHAR_MAX );
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -207,6 +173,11 @@ private:
         ConvertType<3, unsigned char>(argc, argv,  0, UCHAR_MAX );
         }
         break;
+      case 4:
+        {
+        ConvertType<4, unsigned char>(argc, argv,  0, UCHAR_MAX );
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -226,6 +197,11 @@ private:
         ConvertType<3, short>(argc, argv,  SHRT_MIN, SHRT_MAX);
         }
         break;
+      case 4:
+        {
+        ConvertType<4, short>(argc, argv,  SHRT_MIN, SHRT_MAX);
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -245,6 +221,11 @@ private:
         ConvertType<3, unsigned short>(argc, argv,  0, USHRT_MAX );
         }
         break;
+      case 4:
+        {
+        ConvertType<4, unsigned short>(argc, argv,  0, USHRT_MAX );
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -264,6 +245,11 @@ private:
         ConvertType<3, int>(argc, argv,  INT_MIN, INT_MAX);
         }
         break;
+      case 4:
+        {
+        ConvertType<4, int>(argc, argv,  INT_MIN, INT_MAX);
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -283,6 +269,11 @@ private:
         ConvertType<3, unsigned int>(argc, argv,  0, UINT_MAX );
         }
         break;
+      case 4:
+        {
+        ConvertType<4, unsigned int>(argc, argv,  0, UINT_MAX );
+        }
+        break;
       default:
         std::cout << "Unsupported dimension" << std::endl;
         return EXIT_FAILURE;
@@ -1,7 +1,9 @@
 
 #include "antsUtilities.h"
+#include "antsAllocImage.h"
 #include <algorithm>
 #include <algorithm>
+#include <sstream>
 #include <string>
 #include <fstream>
 #include <iostream>
@@ -28,272 +30,256 @@
 #include "itkCustomColormapFunction.h"
 #include "itkOverUnderColormapFunction.h"
 
-#include "itkScalarToRGBColormapImageFilter.h"
+#include "antsColormapLookupTable.h"
 
 namespace ants
 {
-template <unsigned int ImageDimension>
-int ConvertScalarImageToRGB( int argc, char *argv[] )
+/** The colormap of the given name, with the channels of customColormapFile
+ * for "custom", or ITK_NULLPTR if the name is unknown or the file cannot be
+ * read. */
+template <class TScalar, class TRGBPixel>
+typename itk::Function::ColormapFunction<TScalar, TRGBPixel>::Pointer
+CreateColormap( const std::string & colormapString, const std::string & customColormapFile )
 {
-  typedef itk::RGBPixel<unsigned char> RGBPixelType;
-//  typedef itk::RGBAPixel<unsigned char> RGBPixelType;
-
-  typedef float RealType;
-
-  typedef itk::Image<float, ImageDimension>        RealImageType;
-  typedef itk::Image<RGBPixelType, ImageDimension> RGBImageType;
-
-  typedef itk::ImageFileReader<RealImageType> ReaderType;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName( argv[2] );
-  reader->Update();
-
-  typedef itk::Image<unsigned char, ImageDimension> MaskImageType;
-  typename MaskImageType::Pointer maskImage = ITK_NULLPTR;
-  typedef itk::ImageFileReader<MaskImageType> MaskReaderType;
-  typename MaskReaderType::Pointer maskreader = MaskReaderType::New();
-  maskreader->SetFileName( argv[4] );
-  try
-    {
-    maskreader->Update();
-    maskImage = maskreader->GetOutput();
-    }
-  catch( ... )
-    {
-    maskImage = ITK_NULLPTR;
-    }
-  ;
-
-  std::string colormapString( argv[5] );
-
-  typedef itk::ScalarToRGBColormapImageFilter<RealImageType,
-                                              RGBImageType> RGBFilterType;
-  typename RGBFilterType::Pointer rgbfilter = RGBFilterType::New();
-  rgbfilter->SetInput( reader->GetOutput() );
+  typedef itk::Function::ColormapFunction<TScalar, TRGBPixel> ColormapType;
+  typename ColormapType::Pointer colormap = ITK_NULLPTR;
 
   if( colormapString == "red" )
     {
-    rgbfilter->SetColormap( RGBFilterType::Red );
+    colormap = itk::Function::RedColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "green"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Green );
+    colormap = itk::Function::GreenColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "blue"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Blue );
+    colormap = itk::Function::BlueColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "grey"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Grey );
+    colormap = itk::Function::GreyColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "cool"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Cool );
+    colormap = itk::Function::CoolColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "hot"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Hot );
+    colormap = itk::Function::HotColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "spring"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Spring );
+    colormap = itk::Function::SpringColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "autumn"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Autumn );
+    colormap = itk::Function::AutumnColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "winter"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Winter );
+    colormap = itk::Function::WinterColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "copper"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Copper );
+    colormap = itk::Function::CopperColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "summer"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Summer );
+    colormap = itk::Function::SummerColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "jet"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::Jet );
-//    typedef itk::Function::JetColormapFunction<typename RealImageType::PixelType,
-//      typename RGBImageType::PixelType> ColormapType;
-//    typename ColormapType::Pointer colormap = ColormapType::New();
-//    rgbfilter->SetColormap( colormap );
+    colormap = itk::Function::JetColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "hsv"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::HSV );
-//    typedef itk::Function::HSVColormapFunction<typename RealImageType::PixelType,
-//      typename RGBImageType::PixelType> ColormapType;
-//    typename ColormapType::Pointer colormap = ColormapType::New();
-//    rgbfilter->SetColormap( colormap );
+    colormap = itk::Function::HSVColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "overunder"  )
     {
-    rgbfilter->SetColormap( RGBFilterType::OverUnder );
+    colormap = itk::Function::OverUnderColormapFunction<TScalar, TRGBPixel>::New();
     }
   else if( colormapString == "custom"  )
     {
-    typedef itk::Function::CustomColormapFunction<typename RealImageType::PixelType,
-                                                  typename RGBImageType::PixelType> ColormapType;
-    typename ColormapType::Pointer colormap = ColormapType::New();
-
-    std::ifstream str( argv[6] );
-    std::string   line;
+    typedef itk::Function::CustomColormapFunction<TScalar, TRGBPixel> CustomColormapType;
+    typedef typename CustomColormapType::ChannelType                  ChannelType;
 
-    // Get red values
+    CustomColormapChannels channels;
+    if( !GetCustomColormapChannels( customColormapFile, channels ) )
       {
-      std::getline( str, line );
-      std::istringstream iss( line );
-      float              value;
-      typename ColormapType::ChannelType channel;
-      while( iss >> value )
-        {
-        channel.push_back( value );
-        }
-
-      colormap->SetRedChannel( channel );
+      std::cerr << "Unable to read the custom colormap " << customColormapFile << std::endl;
+      return ITK_NULLPTR;
       }
+    typename CustomColormapType::Pointer customColormap = CustomColormapType::New();
+    customColormap->SetRedChannel( ChannelType( channels.Red.begin(), channels.Red.end() ) );
+    customColormap->SetGreenChannel( ChannelType( channels.Green.begin(), channels.Green.end() ) );
+    customColormap->SetBlueChannel( ChannelType( channels.Blue.begin(), channels.Blue.end() ) );
+    colormap = customColormap;
+    }
+  else
+    {
+    std::cerr << "Unknown colormap " << colormapString << std::endl;
+    }
+  return colormap;
+}
 
-    // Get green values
-      {
-      std::getline( str, line );
-      std::istringstream iss( line );
-      float              value;
-      typename ColormapType::ChannelType channel;
-      while( iss >> value )
-        {
-        channel.push_back( value );
-        }
+/** The mask, or ITK_NULLPTR if it cannot be read (e.g. "none"). */
+template <class TMaskImage>
+typename TMaskImage::Pointer ReadOptionalMask( const std::string & fileName )
+{
+  typedef itk::ImageFileReader<TMaskImage> MaskReaderType;
+  typename MaskReaderType::Pointer maskreader = MaskReaderType::New();
+  maskreader->SetFileName( fileName.c_str() );
+  try
+    {
+    maskreader->Update();
+    }
+  catch( ... )
+    {
+    return ITK_NULLPTR;
+    }
+  return maskreader->GetOutput();
+}
 
-      colormap->SetGreenChannel( channel );
-      }
-    // Get blue values
-      {
-      std::getline( str, line );
-      std::istringstream iss( line );
-      float              value;
-      typename ColormapType::ChannelType channel;
-      while( iss >> value )
-        {
-        channel.push_back( value );
-        }
+template <unsigned int ImageDimension>
+int ConvertScalarImageToRGB( int argc, char *argv[] )
+{
+  typedef itk::RGBPixel<unsigned char> RGBPixelType;
+//  typedef itk::RGBAPixel<unsigned char> RGBPixelType;
 
-      colormap->SetBlueChannel( channel );
-      }
-    rgbfilter->SetColormap( colormap );
-    }
+  typedef float RealType;
 
-  RealType minimumValue = itk::NumericTraits<RealType>::max();
-  RealType maximumValue = itk::NumericTraits<RealType>::NonpositiveMin();
+  typedef itk::Image<float, ImageDimension>         RealImageType;
+  typedef itk::Image<RGBPixelType, ImageDimension>  RGBImageType;
+  typedef itk::Image<unsigned char, ImageDimension> MaskImageType;
 
-  itk::ImageRegionIteratorWithIndex<RealImageType> ItS(
-    reader->GetOutput(), reader->GetOutput()->GetLargestPossibleRegion() );
-  for( ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItS )
+  typedef itk::ImageFileReader<RealImageType> ReaderType;
+  typedef itk::ImageFileWriter<RGBImageType>  WriterType;
+
+  typedef itk::Function::ColormapFunction<RealType, RGBPixelType> ColormapType;
+
+  // A batch is a comma separated list of inputs, the same number of outputs
+  // and one mask for all of them or one for each.  The images are colored
+  // with one table, over the range of all of them unless it is given.
+  const std::vector<std::string> inputFileNames = GetBatchFileNames( argv[2] );
+  const std::vector<std::string> outputFileNames = GetBatchFileNames( argv[3] );
+  const std::vector<std::string> maskFileNames = GetBatchFileNames( argv[4] );
+  if( inputFileNames.empty() || outputFileNames.size() != inputFileNames.size() ||
+      ( maskFileNames.size() != 1 && maskFileNames.size() != inputFileNames.size() ) )
     {
-    if( !maskImage || maskImage->GetPixel( ItS.GetIndex() ) != 0 )
-      {
-      if( minimumValue >= ItS.Get() )
-        {
-        minimumValue = ItS.Get();
-        }
-      if( maximumValue <= ItS.Get() )
-        {
-        maximumValue = ItS.Get();
-        }
-      }
+    std::cerr << "The numbers of input, output and mask images do not match." << std::endl;
+    return EXIT_FAILURE;
     }
 
-  rgbfilter->SetUseInputImageExtremaForScaling( false );
-  rgbfilter->GetModifiableColormap()->SetMinimumInputValue( minimumValue );
-  rgbfilter->GetModifiableColormap()->SetMaximumInputValue( maximumValue );
-
-  rgbfilter->GetModifiableColormap()->SetMinimumRGBComponentValue(
-    ( argc > 9 ) ? static_cast<
-      typename RGBPixelType::ComponentType>( atof( argv[9] ) ) : 0 );
-  rgbfilter->GetModifiableColormap()->SetMaximumRGBComponentValue(
-    ( argc > 10 ) ? static_cast<
-      typename RGBPixelType::ComponentType>( atof( argv[10] ) ) : 255 );
+  typename ColormapType::Pointer colormap = CreateColormap<RealType, RGBPixelType>(
+      std::string( argv[5] ), ( argc > 6 ) ? std::string( argv[6] ) : std::string() );
+  if( colormap.IsNull() )
+    {
+    return EXIT_FAILURE;
+    }
 
+  bool useMinimumValue = false;
+  bool useMaximumValue = false;
+  RealType minimumValue = itk::NumericTraits<RealType>::max();
+  RealType maximumValue = itk::NumericTraits<RealType>::NonpositiveMin();
   if( argc > 7 )
     {
     std::string argvString( argv[7] );
     if( argvString != "min" && argvString != "minimum" )
       {
-      rgbfilter->GetModifiableColormap()->SetMinimumInputValue(
-        static_cast<RealType>( atof( argv[7] ) ) );
+      useMinimumValue = true;
+      minimumValue = static_cast<RealType>( atof( argv[7] ) );
       }
     }
-
   if( argc > 8 )
     {
     std::string argvString( argv[8] );
     if( argvString != "max" && argvString != "maximum" )
       {
-      rgbfilter->GetModifiableColormap()->SetMaximumInputValue(
-        static_cast<RealType>( atof( argv[8] ) ) );
+      useMaximumValue = true;
+      maximumValue = static_cast<RealType>( atof( argv[8] ) );
       }
     }
 
-  try
+  typename MaskImageType::Pointer sharedMaskImage = ITK_NULLPTR;
+  if( maskFileNames.size() == 1 )
     {
-    rgbfilter->Update();
-    }
-  catch( ... )
-    {
-    return EXIT_FAILURE;
+    sharedMaskImage = ReadOptionalMask<MaskImageType>( maskFileNames[0] );
     }
 
-  if( maskImage )
+  // the range of the voxels in the masks
+  if( !useMinimumValue || !useMaximumValue )
     {
-    itk::ImageRegionIterator<MaskImageType> ItM( maskImage,
-                                                 maskImage->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<RGBImageType> ItC( rgbfilter->GetOutput(),
-                                                rgbfilter->GetOutput()->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<RealImageType> ItS2( reader->GetOutput(),
-                                                 reader->GetOutput()->GetLargestPossibleRegion() );
-
-    ItM.GoToBegin();
-    ItC.GoToBegin();
-    ItS2.GoToBegin();
-
-    while( !ItM.IsAtEnd() )
+    RealType batchMinimumValue = itk::NumericTraits<RealType>::max();
+    RealType batchMaximumValue = itk::NumericTraits<RealType>::NonpositiveMin();
+    for( unsigned int i = 0; i < inputFileNames.size(); i++ )
       {
-      if( ItM.Get() == 0 )
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( inputFileNames[i].c_str() );
+      reader->Update();
+
+      typename MaskImageType::Pointer maskImage = ( maskFileNames.size() == 1 ) ?
+        sharedMaskImage : ReadOptionalMask<MaskImageType>( maskFileNames[i] );
+
+      const RealType *         values = reader->GetOutput()->GetBufferPointer();
+      const unsigned char *    mask = maskImage ? maskImage->GetBufferPointer() : ITK_NULLPTR;
+      const itk::SizeValueType numberOfPixels = reader->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+      for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
         {
-        RGBPixelType rgbpixel;
-
-//        RealType minimumValue = rgbfilter->GetModifiableColormap()->GetMinimumInputValue();
-//        RealType maximumValue = rgbfilter->GetModifiableColormap()->GetMaximumInputValue();
-//
-//        RealType minimumRGBValue
-//          = rgbfilter->GetModifiableColormap()->GetMinimumRGBComponentValue();
-//        RealType maximumRGBValue
-//          = rgbfilter->GetModifiableColormap()->GetMaximumRGBComponentValue();
-//
-//        RealType ratio = ( ItS2.Get() - minimumValue ) / ( maximumValue - minimumValue );
-//
-//        rgbpixel.Fill( ratio * ( maximumRGBValue - minimumRGBValue )
-//          + minimumRGBValue );
-        rgbpixel.Fill( itk::NumericTraits<typename RGBPixelType::ComponentType>::ZeroValue() );
-
-        ItC.Set( rgbpixel );
+        if( !mask || mask[n] != 0 )
+          {
+          batchMinimumValue = std::min( batchMinimumValue, values[n] );
+          batchMaximumValue = std::max( batchMaximumValue, values[n] );
+          }
         }
-      ++ItM;
-      ++ItC;
-      ++ItS2;
+      }
+    if( !useMinimumValue )
+      {
+      minimumValue = batchMinimumValue;
+      }
+    if( !useMaximumValue )
+      {
+      maximumValue = batchMaximumValue;
       }
     }
 
-  typedef itk::ImageFileWriter<RGBImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetInput( rgbfilter->GetOutput() );
-  writer->SetFileName( argv[3] );
-  writer->Update();
+  colormap->SetMinimumInputValue( minimumValue );
+  colormap->SetMaximumInputValue( maximumValue );
+  colormap->SetMinimumRGBComponentValue(
+    ( argc > 9 ) ? static_cast<
+      typename RGBPixelType::ComponentType>( atof( argv[9] ) ) : 0 );
+  colormap->SetMaximumRGBComponentValue(
+    ( argc > 10 ) ? static_cast<
+      typename RGBPixelType::ComponentType>( atof( argv[10] ) ) : 255 );
+
+  ColormapLookupTable<RGBPixelType> lookupTable;
+  lookupTable.Build( colormap.GetPointer() );
+
+  for( unsigned int i = 0; i < inputFileNames.size(); i++ )
+    {
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( inputFileNames[i].c_str() );
+    try
+      {
+      reader->Update();
+      }
+    catch( ... )
+      {
+      return EXIT_FAILURE;
+      }
 
+    typename MaskImageType::Pointer maskImage = ( maskFileNames.size() == 1 ) ?
+      sharedMaskImage : ReadOptionalMask<MaskImageType>( maskFileNames[i] );
+
+    typename RGBImageType::Pointer rgbImage = AllocImage<RGBImageType>( reader->GetOutput() );
+    lookupTable.Apply( reader->GetOutput(), maskImage.GetPointer(), rgbImage.GetPointer() );
+
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput( rgbImage );
+    writer->SetFileName( outputFileNames[i].c_str() );
+    writer->Update();
+    }
 
   if( argc > 11 )
     {
@@ -301,8 +287,8 @@ int ConvertScalarImageToRGB( int argc, char *argv[] )
 
     std::ofstream str( argv[11] );
 
-    RealType minimumValue2 = rgbfilter->GetModifiableColormap()->GetMinimumInputValue();
-    RealType maximumValue2 = rgbfilter->GetModifiableColormap()->GetMaximumInputValue();
+    RealType minimumValue2 = colormap->GetMinimumInputValue();
+    RealType maximumValue2 = colormap->GetMaximumInputValue();
 
     RealType deltaValue = ( maximumValue2 - minimumValue2 ) / 255.0;
 
@@ -310,7 +296,7 @@ int ConvertScalarImageToRGB( int argc, char *argv[] )
       {
       RealType value = minimumValue2 + d * deltaValue;
 
-      RGBPixelType rgbPixel = rgbfilter->GetModifiableColormap()->operator()( value );
+      RGBPixelType rgbPixel = colormap->operator()( value );
 
       str << value << ","
                    << static_cast<int>( rgbPixel[0] ) << ","
@@ -374,6 +360,8 @@ private:
     std::cout << "Usage: " << argv[0] << " imageDimension inputImage outputImage "
              << "mask colormap [customColormapFile] [minimumInput] [maximumInput] "
              << "[minimumRGBOutput=0] [maximumRGBOutput=255] <vtkLookupTable>" << std::endl;
+    std::cout << "  Comma separated inputs, outputs and masks (one mask, or one per input) "
+             << "are colored with the same colormap and range." << std::endl;
     std::cout << "  Possible colormaps: grey, red, green, blue, copper, jet, hsv, ";
     std::cout << "spring, summer, autumn, winter, hot, cool, overunder, custom" << std::endl;
     if( argc >= 2 &&
@@ -16,17 +16,55 @@
 #include <algorithm>
 
 #include "itkImageFileReader.h"
+#include "itkByteSwapper.h"
 
-#include "itkImageRegionIteratorWithIndex.h"
-
-#include "vtkUnstructuredGrid.h"
-#include "vtkUnstructuredGridWriter.h"
-#include "vtkFloatArray.h"
-#include "vtkPoints.h"
-#include "vtkPointData.h"
+#include <fstream>
 
 namespace ants
 {
+/** Writes floats to the binary section of a legacy VTK file, which is
+ * big-endian, a chunk at a time. */
+class VTKBinaryChunkWriter
+{
+public:
+  enum { ChunkSize = 1 << 16 };
+
+  VTKBinaryChunkWriter( std::ostream & stream ) : m_Stream( stream )
+  {
+    this->m_Buffer.reserve( ChunkSize );
+  }
+
+  ~VTKBinaryChunkWriter()
+  {
+    this->Flush();
+  }
+
+  void Write( float value )
+  {
+    this->m_Buffer.push_back( value );
+    if( this->m_Buffer.size() == ChunkSize )
+      {
+      this->Flush();
+      }
+  }
+
+  void Flush()
+  {
+    if( this->m_Buffer.empty() )
+      {
+      return;
+      }
+    itk::ByteSwapper<float>::SwapRangeFromSystemToBigEndian( &this->m_Buffer[0], this->m_Buffer.size() );
+    this->m_Stream.write( reinterpret_cast<const char *>( &this->m_Buffer[0] ),
+                          this->m_Buffer.size() * sizeof( float ) );
+    this->m_Buffer.clear();
+  }
+
+private:
+  std::ostream &     m_Stream;
+  std::vector<float> m_Buffer;
+};
+
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
 // 'main()'
 int ConvertVectorFieldToVTK( std::vector<std::string> args, std::ostream* out_stream = NULL )
@@ -77,101 +115,197 @@ private:
     {
     std::cout << "Usage: " << argv[0]
              << " inputDisplacementField outputVTKFile maskImage(optional) slice(optional) whichAxis(optional)"
-             << std::endl;
+             << " decimation(optional)" << std::endl;
+    std::cout << "  The vectors of the voxels inside the mask (which may be given as 'none'), of the slice of"
+             << " whichAxis if given, and of every decimation'th voxel along the other axes are written as"
+             << " a binary legacy VTK unstructured grid.  The field is read a slab at a time." << std::endl;
     return EXIT_FAILURE;
     }
 
-  typedef float PixelType;
   const unsigned int ImageDimension = 3;
 
-  typedef itk::Image<PixelType, ImageDimension> ImageType;
-  typedef itk::Image<int, ImageDimension>       MaskImageType;
+  typedef itk::Image<int, ImageDimension> MaskImageType;
 
-  typedef double                                 RealType;
+  typedef float                                  RealType;
   typedef itk::Vector<RealType, ImageDimension>  VectorType;
   typedef itk::Image<VectorType, ImageDimension> DisplacementFieldType;
 
   typedef itk::ImageFileReader<DisplacementFieldType> ReaderType;
   ReaderType::Pointer reader = ReaderType::New();
   reader->SetFileName( argv[1] );
-  //  reader->SetUseAvantsNamingConvention( true );
-  reader->Update();
+  reader->UpdateOutputInformation();
+  DisplacementFieldType::Pointer field = reader->GetOutput();
+
+  typedef itk::ImageFileReader<MaskImageType> MaskReaderType;
+  MaskReaderType::Pointer maskReader;
+  if( argc > 3 && std::string( argv[3] ) != std::string( "none" ) )
+    {
+    maskReader = MaskReaderType::New();
+    maskReader->SetFileName( argv[3] );
+    maskReader->UpdateOutputInformation();
+    if( maskReader->GetOutput()->GetLargestPossibleRegion() != field->GetLargestPossibleRegion() )
+      {
+      std::cerr << "The mask and the displacement field must have the same size." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
 
-  MaskImageType::Pointer mask;
-  if( argc >= 4 )
+  int sliceAxis = -1;
+  int slice = 0;
+  if( argc > 5 )
     {
-    typedef itk::ImageFileReader<MaskImageType> MaskReaderType;
-    MaskReaderType::Pointer maskreader = MaskReaderType::New();
-    maskreader->SetFileName( argv[3] );
-    maskreader->Update();
-    mask = maskreader->GetOutput();
+    slice = atoi( argv[4] );
+    sliceAxis = atoi( argv[5] );
+    if( sliceAxis < 0 || sliceAxis >= static_cast<int>( ImageDimension ) )
+      {
+      std::cerr << "whichAxis must be in [0, " << ImageDimension - 1 << "]." << std::endl;
+      return EXIT_FAILURE;
+      }
     }
-  else
+  unsigned int decimation = 1;
+  if( argc > 6 )
     {
-    // ORIENTATION ALERT  -- the original code here
-    // set the region, spacing, and origin without setting directions.
-    mask = AllocImage<MaskImageType>(reader->GetOutput(), 1);
+    decimation = static_cast<unsigned int>( std::max( atoi( argv[6] ), 1 ) );
     }
 
-  int    size[ImageDimension];
-  int    totalsize = 1;
-  for( unsigned int i = 0; i < ImageDimension; i++ )
+  // the voxels written:  those of the slice, if any, and on the decimated
+  // lattice of the other axes, read in slabs of the slowest axis
+  const unsigned int                     slabAxis = ImageDimension - 1;
+  const DisplacementFieldType::RegionType largestRegion = field->GetLargestPossibleRegion();
+  DisplacementFieldType::RegionType      selectedRegion = largestRegion;
+  if( sliceAxis >= 0 )
     {
-    size[i] = reader->GetOutput()->GetLargestPossibleRegion().GetSize()[i];
-    if( argc > 4 && atoi( argv[5] ) == (int) i )
+    if( slice < largestRegion.GetIndex()[sliceAxis] ||
+        slice >= largestRegion.GetIndex()[sliceAxis] + static_cast<int>( largestRegion.GetSize()[sliceAxis] ) )
       {
-      size[i] = 1;
+      std::cerr << "Slice " << slice << " is outside of the field." << std::endl;
+      return EXIT_FAILURE;
       }
-    totalsize *= size[i];
+    selectedRegion.SetIndex( sliceAxis, slice );
+    selectedRegion.SetSize( sliceAxis, 1 );
     }
 
-  int totalPoints = totalsize;
-
-  vtkUnstructuredGrid *field = vtkUnstructuredGrid::New();
-  vtkPoints *          points = vtkPoints::New();
-  points->Allocate( totalPoints );
-  vtkFloatArray *vectors = vtkFloatArray::New();
-  vectors->SetNumberOfComponents( 3 );
-  vectors->SetNumberOfTuples( totalPoints );
+  itk::SizeValueType slabPixels = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( d != slabAxis )
+      {
+      slabPixels *= selectedRegion.GetSize()[d];
+      }
+    }
+  const itk::SizeValueType slabThickness = std::max( static_cast<itk::SizeValueType>( 1 << 22 ) / slabPixels,
+                                                     static_cast<itk::SizeValueType>( 1 ) );
 
-  float x[3], v[3];
-  int   offset = 0;
+  std::vector<DisplacementFieldType::RegionType> slabs;
+  const itk::IndexValueType slabBegin = selectedRegion.GetIndex()[slabAxis];
+  const itk::IndexValueType slabEnd = slabBegin + static_cast<itk::IndexValueType>( selectedRegion.GetSize()[slabAxis] );
+  for( itk::IndexValueType k = slabBegin; k < slabEnd; k += slabThickness )
+    {
+    DisplacementFieldType::RegionType slab = selectedRegion;
+    slab.SetIndex( slabAxis, k );
+    slab.SetSize( slabAxis, std::min( slabThickness, static_cast<itk::SizeValueType>( slabEnd - k ) ) );
+    slabs.push_back( slab );
+    }
 
-  itk::ImageRegionIteratorWithIndex<MaskImageType> It
-    ( mask, mask->GetLargestPossibleRegion() );
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+  // pass 0 selects and counts the points, pass 1 writes them and pass 2
+  // their vectors:  only the first reads the mask and only the last the field
+  std::ofstream stream( argv[2], std::ios::out | std::ios::binary );
+  if( !stream )
     {
-    DisplacementFieldType::IndexType idx = It.GetIndex();
+    std::cerr << "Unable to open " << argv[2] << std::endl;
+    return EXIT_FAILURE;
+    }
+  stream << "# vtk DataFile Version 3.0\n" << "vtk output\n" << "BINARY\n" << "DATASET UNSTRUCTURED_GRID\n";
 
-    if( ( argc > 4 && idx[atoi( argv[5] )] != atoi( argv[4] ) ) || It.Get() == 0 )
+  std::vector<char> selected;
+  itk::SizeValueType numberOfPoints = 0;
+  for( unsigned int pass = 0; pass < 3; pass++ )
+    {
+    if( pass == 1 )
       {
-      continue;
+      stream << "POINTS " << numberOfPoints << " float\n";
       }
-    DisplacementFieldType::PointType point;
-    reader->GetOutput()->TransformIndexToPhysicalPoint( idx, point );
-
-    VectorType V = reader->GetOutput()->GetPixel( idx );
-    for( unsigned int i = 0; i < ImageDimension; i++ )
+    else if( pass == 2 )
       {
-      x[i] = point[i];
-      v[i] = V[i];
+      stream << "\nPOINT_DATA " << numberOfPoints << "\n" << "VECTORS vectors float\n";
       }
-//    offset = idx[0] + idx[1]*(size[1]+1) + idx[2]*(size[1]+1)*(size[3]+1);
-    points->InsertPoint( offset, x );
-    vectors->InsertTuple( offset++, v );
-    }
 
-  field->SetPoints( points );
-  field->GetPointData()->SetVectors( vectors );
+    VTKBinaryChunkWriter writer( stream );
+    itk::SizeValueType   voxel = 0;
+    for( unsigned int s = 0; s < slabs.size(); s++ )
+      {
+      if( pass == 0 && maskReader.IsNotNull() )
+        {
+        maskReader->GetOutput()->SetRequestedRegion( slabs[s] );
+        maskReader->GetOutput()->Update();
+        }
+      if( pass == 2 )
+        {
+        field->SetRequestedRegion( slabs[s] );
+        field->Update();
+        }
+
+      // the index runs over the slab in buffer order, with the pixels taken
+      // by index since the reader may have buffered more than the slab
+      DisplacementFieldType::IndexType index = slabs[s].GetIndex();
+      const itk::SizeValueType         numberOfSlabPixels = slabs[s].GetNumberOfPixels();
+      for( itk::SizeValueType n = 0; n < numberOfSlabPixels; n++, voxel++ )
+        {
+        if( n > 0 )
+          {
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            if( ++index[d] < slabs[s].GetIndex()[d] + static_cast<itk::IndexValueType>( slabs[s].GetSize()[d] ) )
+              {
+              break;
+              }
+            index[d] = slabs[s].GetIndex()[d];
+            }
+          }
 
-  points->Delete();
-  vectors->Delete();
+        if( pass == 0 )
+          {
+          bool isSelected = maskReader.IsNull() || maskReader->GetOutput()->GetPixel( index ) != 0;
+          for( unsigned int d = 0; d < ImageDimension && isSelected; d++ )
+            {
+            isSelected = ( static_cast<int>( d ) == sliceAxis ||
+                           ( index[d] - largestRegion.GetIndex()[d] ) % decimation == 0 );
+            }
+          selected.push_back( isSelected );
+          numberOfPoints += isSelected;
+          continue;
+          }
+        if( !selected[voxel] )
+          {
+          continue;
+          }
+        if( pass == 1 )
+          {
+          DisplacementFieldType::PointType point;
+          field->TransformIndexToPhysicalPoint( index, point );
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            writer.Write( static_cast<float>( point[d] ) );
+            }
+          }
+        else
+          {
+          const VectorType & vector = field->GetPixel( index );
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            writer.Write( static_cast<float>( vector[d] ) );
+            }
+          }
+        }
+      }
+    }
+  stream << "\n";
 
-  vtkUnstructuredGridWriter *writer = vtkUnstructuredGridWriter::New();
-  writer->SetInput( field );
-//  writer->SetFileTypeToBinary();
-  writer->SetFileName( argv[2] );
-  writer->Write();
-  return 0;
+  if( !stream )
+    {
+    std::cerr << "Error writing " << argv[2] << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
 }
 } // namespace ants
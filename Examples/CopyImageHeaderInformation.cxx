@@ -24,6 +24,7 @@
 #include "itkCastImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "ReadWriteData.h"
+#include "antsNiftiHeaderUpdate.h"
 #include "TensorFunctions.h"
 
 namespace ants
@@ -37,7 +38,7 @@ int CopyImageHeaderInformation(int argc, char *argv[])
 
   typename readertype::Pointer reader = readertype::New();
   reader->SetFileName(argv[1]);
-  reader->Update();
+  reader->UpdateOutputInformation();
   //  std::cout << " Spacing " << reader->GetOutput()->GetSpacing() << std::endl;
   // std::cout << " Origin " << reader->GetOutput()->GetOrigin() << std::endl;
   // std::cout << " Direction " << std::endl << reader->GetOutput()->GetDirection() << std::endl;
@@ -88,6 +89,28 @@ int CopyImageHeaderInformation(int argc, char *argv[])
 
   typename readertype::Pointer reader2 = readertype::New();
   reader2->SetFileName(argv[2]);
+  reader2->UpdateOutputInformation();
+
+  // only the header changes, so rewrite just the header of NIfTI files
+  typename ImageType::Pointer headerImage = ImageType::New();
+  headerImage->CopyInformation( reader2->GetOutput() );
+  if( argc > 6 && atoi(argv[6]) )
+    {
+    headerImage->SetSpacing(  reader->GetOutput()->GetSpacing()  );
+    }
+  if( argc > 5 && atoi(argv[5]) )
+    {
+    headerImage->SetOrigin(  reader->GetOutput()->GetOrigin()  );
+    }
+  if( argc > 4 && atoi(argv[4]) )
+    {
+    headerImage->SetDirection(  reader->GetOutput()->GetDirection()  );
+    }
+  if( UpdateNiftiHeaderGeometry<ImageType>( argv[2], argv[3], headerImage ) )
+    {
+    return EXIT_SUCCESS;
+    }
+
   reader2->Update();
 
   // MakeNewImage(typename TImage::Pointer image1, typename TImage::PixelType initval)
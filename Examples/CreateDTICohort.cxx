@@ -7,14 +7,16 @@
 #include "itkArray2D.h"
 #include "itkDecomposeTensorFunction.h"
 #include "itkDiffusionTensor3D.h"
-#include "itkImageDuplicator.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
 #include "itkLabelGeometryImageFilter.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreader.h"
 #include "itkNumericSeriesFileNames.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkTimeProbe.h"
 #include "itkVariableSizeMatrix.h"
 
@@ -88,6 +90,375 @@ double CalculateMeanDiffusivity( TensorType tensor )
   return mean;
 }
 
+template <unsigned int ImageDimension>
+struct CreateDTICohortThreadStruct
+{
+  typedef float                                                    RealType;
+  typedef itk::SymmetricSecondRankTensor<RealType, ImageDimension> TensorType;
+  typedef itk::Image<RealType, ImageDimension>                     ImageType;
+  typedef unsigned int                                             LabelType;
+  typedef itk::Image<LabelType, ImageDimension>                    MaskImageType;
+  typedef itk::Image<TensorType, ImageDimension>                   TensorImageType;
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator   RandomizerType;
+
+  const TensorImageType *                   Atlas;
+  const MaskImageType *                     Mask;
+  const ImageType *                         B0;
+  const std::vector<LabelType> *            Labels;
+  const itk::Array2D<RealType> *            PathologyParameters;
+  const vnl_matrix<RealType> *              ISV;
+  bool                                      ApplyISV;
+  unsigned int                              TotalMaskVolume;
+  const std::vector<vnl_vector<RealType> > *Directions;
+  const std::vector<RealType> *             BValues;
+  RealType                                  NoiseSigma;
+  unsigned int                              NumberOfControls;
+  unsigned int                              NumberOfSubjects;
+  std::string                               OutputDirectory;
+  std::string                               RootOutputFileName;
+  const std::vector<typename RandomizerType::IntegerType> *Seeds;
+  itk::SimpleFastMutexLock                  Mutex;
+};
+
+/**
+ * Construct the DTI of subject n from the atlas:  apply pathology (only for
+ * the experimentals) and introduce subject intervariability.  Subject 0 is
+ * the atlas with pathology, used for the regional FA and MD statistics.
+ */
+template <unsigned int ImageDimension>
+typename CreateDTICohortThreadStruct<ImageDimension>::TensorImageType::Pointer
+CreateDTICohortSubject( const CreateDTICohortThreadStruct<ImageDimension> & str, unsigned int n,
+                        typename CreateDTICohortThreadStruct<ImageDimension>::RandomizerType *randomizer,
+                        itk::Array2D<typename CreateDTICohortThreadStruct<ImageDimension>::RealType> *meanFAandMD )
+{
+  typedef CreateDTICohortThreadStruct<ImageDimension> ThreadStructType;
+  typedef typename ThreadStructType::RealType         RealType;
+  typedef typename ThreadStructType::TensorType       TensorType;
+  typedef typename ThreadStructType::LabelType        LabelType;
+  typedef typename ThreadStructType::MaskImageType    MaskImageType;
+  typedef typename ThreadStructType::TensorImageType  TensorImageType;
+
+  const std::vector<LabelType> & labels = *str.Labels;
+  const itk::Array2D<RealType> & pathologyParameters = *str.PathologyParameters;
+
+  typename TensorImageType::Pointer dti = AllocImage<TensorImageType>( str.Atlas );
+
+  // If we are to apply intersubject variability, we calculate random
+  // projection.
+  vnl_vector<RealType> eigenISVProjection( 1 );
+  if( str.ApplyISV )
+    {
+    vnl_vector<RealType> R( str.ISV->cols() );
+    for( unsigned int d = 0; d < R.size(); d++ )
+      {
+      R[d] = randomizer->GetNormalVariate( 0.0, 1.0 );
+      }
+    eigenISVProjection = ( *str.ISV ) * R;
+    }
+
+  //
+  // Iterate through the image to apply pathology and inter-subject variability
+  //
+  unsigned long count = 0;
+
+  itk::ImageRegionConstIterator<TensorImageType> ItA( str.Atlas,
+                                                      str.Atlas->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator<MaskImageType> ItM( str.Mask,
+                                                    str.Mask->GetLargestPossibleRegion() );
+  itk::ImageRegionIterator<TensorImageType> It( dti,
+                                                dti->GetLargestPossibleRegion() );
+  for( ItA.GoToBegin(), ItM.GoToBegin(), It.GoToBegin(); !It.IsAtEnd(); ++ItA, ++ItM, ++It )
+    {
+    LabelType  label = ItM.Get();
+    TensorType tensor = ItA.Get();
+
+    typename TensorType::EigenValuesArrayType eigenvalues;
+    typename TensorType::EigenVectorsMatrixType eigenvectors;
+    tensor.ComputeEigenAnalysis( eigenvalues, eigenvectors );
+
+    if( eigenvalues[0] < 0 )
+      {
+      eigenvalues[0] = eigenvalues[1];
+      }
+    if( ImageDimension == 3 && eigenvalues[2] < 0 )
+      {
+      eigenvalues[2] = eigenvalues[1];
+      }
+
+    typename std::vector<LabelType>::const_iterator it = std::find( labels.begin(),
+                                                                    labels.end(), label );
+    if( it == labels.end() )
+      {
+      std::cout << "ERROR:  unknown label." << std::endl;
+      }
+    unsigned int labelIndex = it - labels.begin();
+
+    typename TensorType::EigenValuesArrayType newEigenvalues;
+
+    //
+    // Only apply pathology to a certain fraction of the voxels for a
+    // particular label.  We "throw the dice" to determine whether or not
+    // to apply to the current voxel.
+    //
+    RealType pathologyLongitudinalChange = 0.0;
+    RealType pathologyTransverseChange = 0.0;
+    if( ( n == 0 || n > str.NumberOfControls ) && randomizer->GetUniformVariate(
+          0.0, 1.0 ) <= pathologyParameters(labelIndex, 2) )
+      {
+      pathologyLongitudinalChange = pathologyParameters(labelIndex, 0);
+      pathologyTransverseChange = pathologyParameters(labelIndex, 1);
+      }
+
+    //
+    // Apply intersubject variability
+    //
+    RealType isvLongitudinalProjection = 0.0;
+    RealType isvTransverseProjection = 0.0;
+    if( label != 0 && str.ApplyISV )
+      {
+      isvLongitudinalProjection = eigenISVProjection(count);
+      isvTransverseProjection = eigenISVProjection(str.TotalMaskVolume + count);
+      count++;
+      }
+
+    //
+    // Reconstruct the tensor
+    //
+    if( ImageDimension == 2 )
+      {
+      newEigenvalues[1] = eigenvalues[1]
+        + eigenvalues[1] * pathologyLongitudinalChange
+        + isvLongitudinalProjection;
+      newEigenvalues[0] = eigenvalues[0] * ( 1.0 + eigenvalues[0] )
+        * pathologyTransverseChange + isvTransverseProjection;
+      if( newEigenvalues[0] >= newEigenvalues[1] )
+        {
+        newEigenvalues[0] = newEigenvalues[1] - 1.0e-6;
+        }
+      }
+    else
+      {
+      newEigenvalues[2] = eigenvalues[2]
+        + eigenvalues[2] * pathologyLongitudinalChange
+        + isvLongitudinalProjection;
+      RealType eigenAverage = 0.5 * ( eigenvalues[1] + eigenvalues[0] );
+      newEigenvalues[1] = ( 2.0 * eigenAverage
+                            * ( 1.0 + pathologyTransverseChange )
+                            + isvTransverseProjection ) / ( eigenvalues[0] / eigenvalues[1] + 1.0 );
+      if( newEigenvalues[1] >= newEigenvalues[2] )
+        {
+        newEigenvalues[1] = newEigenvalues[2] - 1.0e-6;
+        }
+      newEigenvalues[0] = ( eigenvalues[0] / eigenvalues[1] )
+        * newEigenvalues[1];
+      }
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( vnl_math_isnan( newEigenvalues[d] ) )
+        {
+        newEigenvalues[d] = 0.0;
+        }
+      }
+
+    if( newEigenvalues[0] < 0 )
+      {
+      newEigenvalues[0] = newEigenvalues[1];
+      }
+    if( ImageDimension == 3 && newEigenvalues[2] < 0 )
+      {
+      newEigenvalues[2] = newEigenvalues[1];
+      }
+
+    typename TensorType::MatrixType eigenvalueMatrix;
+    eigenvalueMatrix.Fill( 0.0 );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      eigenvalueMatrix(d, d) = newEigenvalues[d];
+      }
+
+    typename TensorType::MatrixType D( eigenvectors.GetTranspose() );
+    D *= eigenvalueMatrix;
+    D *= eigenvectors;
+
+    TensorType newTensor;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = i; j < ImageDimension; j++ )
+        {
+        newTensor(i, j) = D(i, j);
+        }
+      }
+
+    if( label != 0 && meanFAandMD )
+      {
+      ( *meanFAandMD )(labelIndex, 0) +=
+        CalculateFractionalAnisotropy<TensorType>( tensor );
+      ( *meanFAandMD )(labelIndex, 1) +=
+        CalculateMeanDiffusivity<TensorType>( tensor );
+      ( *meanFAandMD )(labelIndex, 2) +=
+        CalculateFractionalAnisotropy<TensorType>( newTensor );
+      ( *meanFAandMD )(labelIndex, 3) +=
+        CalculateMeanDiffusivity<TensorType>( newTensor );
+      ( *meanFAandMD )(labelIndex, 4)++;
+      }
+    It.Set( newTensor );
+    }
+
+  return dti;
+}
+
+/**
+ * For each direction, use the DTI of subject n to reconstruct the DWI in
+ * that direction, add Rician noise and write it.
+ */
+template <unsigned int ImageDimension>
+void WriteDTICohortSubject( const CreateDTICohortThreadStruct<ImageDimension> & str, unsigned int n,
+                            const typename CreateDTICohortThreadStruct<ImageDimension>::TensorImageType *dti,
+                            typename CreateDTICohortThreadStruct<ImageDimension>::RandomizerType *randomizer )
+{
+  typedef CreateDTICohortThreadStruct<ImageDimension> ThreadStructType;
+  typedef typename ThreadStructType::RealType         RealType;
+  typedef typename ThreadStructType::TensorType       TensorType;
+  typedef typename ThreadStructType::ImageType        ImageType;
+  typedef typename ThreadStructType::TensorImageType  TensorImageType;
+
+  const std::vector<vnl_vector<RealType> > & directions = *str.Directions;
+
+  std::string which;
+  if( n <= str.NumberOfControls )
+    {
+    which = std::string( "Control" );
+    }
+  else
+    {
+    which = std::string( "Experimental" );
+    }
+
+  std::stringstream istream;
+  if( n <= str.NumberOfControls )
+    {
+    istream << n;
+    }
+  else
+    {
+    istream << ( n - str.NumberOfControls );
+    }
+  std::string dwiSeriesFileNames = str.OutputDirectory + which + istream.str()
+    + str.RootOutputFileName + std::string( "Direction%03d.nii.gz" );
+
+  itk::NumericSeriesFileNames::Pointer dwiFileNamesCreator =
+    itk::NumericSeriesFileNames::New();
+  dwiFileNamesCreator->SetStartIndex( 0 );
+  dwiFileNamesCreator->SetEndIndex( directions.size() - 1 );
+  dwiFileNamesCreator->SetSeriesFormat( dwiSeriesFileNames.c_str() );
+  std::vector<std::string> dwiImageNames = dwiFileNamesCreator->GetFileNames();
+
+  itk::ImageRegionConstIterator<TensorImageType> It( dti,
+                                                     dti->GetLargestPossibleRegion() );
+  for( unsigned int d = 0; d < directions.size(); d++ )
+    {
+    vnl_vector<RealType> bk = directions[d];
+    RealType             bvalue = ( *str.BValues )[d];
+
+    typename ImageType::Pointer dwi =
+      AllocImage<ImageType>(dti, 0);
+
+    itk::ImageRegionConstIterator<ImageType> ItB( str.B0,
+                                                  str.B0->GetLargestPossibleRegion() );
+    itk::ImageRegionIterator<ImageType> ItD( dwi,
+                                             dwi->GetLargestPossibleRegion() );
+    for( It.GoToBegin(), ItB.GoToBegin(), ItD.GoToBegin(); !It.IsAtEnd();
+         ++It, ++ItB, ++ItD )
+      {
+      TensorType tensor = It.Get();
+      for( unsigned int i = 0; i < tensor.GetNumberOfComponents(); i++ )
+        {
+        if( vnl_math_isnan( tensor[i] ) )
+          {
+          tensor[i] = 0.0;
+          }
+        }
+
+      vnl_matrix<RealType> D(ImageDimension, ImageDimension);
+      for( unsigned int i = 0; i < ImageDimension; i++ )
+        {
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          D(i, j) = tensor(i, j);
+          }
+        }
+
+      vnl_vector<RealType> bkD = bk * D;
+
+      RealType signal = ItB.Get() * std::exp( -bvalue * inner_product( bkD, bk ) );
+
+      // Add Rician noise
+      RealType realNoise = 0.0;
+      RealType imagNoise = 0.0;
+      if( str.NoiseSigma > 0.0 )
+        {
+        realNoise = randomizer->GetNormalVariate( 0.0,
+                                                  vnl_math_sqr( str.NoiseSigma ) );
+        imagNoise = randomizer->GetNormalVariate( 0.0,
+                                                  vnl_math_sqr( str.NoiseSigma ) );
+        }
+      RealType realSignal = signal + realNoise;
+      RealType imagSignal = imagNoise;
+
+      std::complex<RealType> noisySignal( realSignal, imagSignal );
+
+      RealType finalSignal = std::sqrt( std::norm( noisySignal ) );
+
+      if( signal <= ItB.Get() )
+        {
+        ItD.Set( finalSignal );
+        }
+      }
+    typedef itk::ImageFileWriter<ImageType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( dwiImageNames[d].c_str() );
+    writer->SetInput( dwi );
+    writer->Update();
+    }
+}
+
+template <unsigned int ImageDimension>
+ITK_THREAD_RETURN_TYPE CreateDTICohortThreaderCallback( void *arg )
+{
+  typedef CreateDTICohortThreadStruct<ImageDimension> ThreadStructType;
+  typedef typename ThreadStructType::TensorImageType  TensorImageType;
+  typedef typename ThreadStructType::RandomizerType   RandomizerType;
+
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  // interleaved subjects, each drawing from its own seeded stream so that
+  // the cohort does not depend on the number of threads
+  for( unsigned int n = 1 + info->ThreadID; n <= str->NumberOfSubjects; n += info->NumberOfThreads )
+    {
+    typename RandomizerType::Pointer randomizer = RandomizerType::New();
+    randomizer->Initialize( ( *str->Seeds )[n] );
+
+    typename TensorImageType::Pointer dti =
+      CreateDTICohortSubject<ImageDimension>( *str, n, randomizer, ITK_NULLPTR );
+    WriteDTICohortSubject<ImageDimension>( *str, n, dti, randomizer );
+
+    str->Mutex.Lock();
+    if( n <= str->NumberOfControls )
+      {
+      std::cout << "Wrote control " << n
+               << " (of " << str->NumberOfControls << ") DWI images." << std::endl;
+      }
+    else
+      {
+      std::cout << "Wrote experimental " << n - str->NumberOfControls
+               << " (of " << str->NumberOfSubjects - str->NumberOfControls << ") DWI images." << std::endl;
+      }
+    str->Mutex.Unlock();
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int CreateDTICohort( itk::ants::CommandLineParser *parser )
 {
@@ -542,9 +913,19 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
     }
 
   //
-  // Create the simulated diffusion-weighted images.  For each image, we
-  // perform the following steps:
-  //   1. Copy the atlas
+  // Get the random seed
+  //
+  typename itk::ants::CommandLineParser::OptionType::Pointer seedOption =
+    parser->GetOption( "random-seed" );
+  if( seedOption && seedOption->GetNumberOfFunctions() )
+    {
+    randomizer->Initialize( parser->Convert<unsigned int>( seedOption->GetFunction()->GetName() ) );
+    }
+
+  //
+  // Create the simulated diffusion-weighted images.  The subjects are
+  // generated in parallel and for each one we perform the following steps:
+  //   1. Start from the atlas
   //   2. Construct new DTI
   //     2a. Apply pathology (only for the experimentals).
   //     2b. Introduce subject intervariability
@@ -554,325 +935,84 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
   //
   itksys::SystemTools::MakeDirectory( outputDirectory.c_str() );
 
-  itk::Array2D<RealType> meanFAandMD( labels.size(), 5 );
-  meanFAandMD.Fill( 0.0 );
-  for( unsigned n = 0; n <= numberOfControls + numberOfExperimentals; n++ )
-    {
-    if( n == 0 )
-      {
-      std::cout << "--- Calculating regional average FA and MD values (original and "
-               << "pathology + intersubject variability) ---" << std::endl << std::endl;
-      }
-    else if( n <= numberOfControls )
-      {
-      if( n == 1 )
-        {
-        std::cout << std::endl << "--- Writing images ---" << std::endl << std::endl;
-        }
-      std::cout << "Writing control " << n
-               << " (of " << numberOfControls << ") DWI images." << std::endl;
-      }
-    else
-      {
-      std::cout << "Writing experimental " << n - numberOfControls
-               << " (of " << numberOfExperimentals << ") DWI images." << std::endl;
-      }
-
-    // copy atlas
-    typedef itk::ImageDuplicator<TensorImageType> DuplicatorType;
-    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-    duplicator->SetInputImage( inputAtlas );
-    duplicator->Update();
-
-    typename TensorImageType::Pointer dti = duplicator->GetModifiableOutput();
-    dti->DisconnectPipeline();
-
-    // If we are to apply intersubject variability, we calculate random
-    // projection.
-    vnl_vector<RealType> eigenISVProjection( 1 );
-    if( applyISV )
-      {
-      vnl_vector<RealType> R( ISV.cols() );
-      for( unsigned int d = 0; d < R.size(); d++ )
-        {
-        R[d] = randomizer->GetNormalVariate( 0.0, 1.0 );
-        }
-      eigenISVProjection = ISV * R;
-      }
-
-    //
-    // Iterate through the image to apply pathology and inter-subject variability
-    //
-    unsigned long count = 0;
-
-    itk::ImageRegionIterator<TensorImageType> It( dti,
-                                                  dti->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<MaskImageType> ItM( maskImage,
-                                                 maskImage->GetLargestPossibleRegion() );
-    for( It.GoToBegin(), ItM.GoToBegin(); !It.IsAtEnd(); ++It, ++ItM )
-      {
-      LabelType  label = ItM.Get();
-      TensorType tensor = It.Get();
-
-      typename TensorType::EigenValuesArrayType eigenvalues;
-      typename TensorType::EigenVectorsMatrixType eigenvectors;
-      tensor.ComputeEigenAnalysis( eigenvalues, eigenvectors );
-
-      if( eigenvalues[0] < 0 )
-        {
-        eigenvalues[0] = eigenvalues[1];
-        }
-      if( ImageDimension == 3 && eigenvalues[2] < 0 )
-        {
-        eigenvalues[2] = eigenvalues[1];
-        }
-
-      std::vector<LabelType>::const_iterator it = std::find( labels.begin(),
-                                                             labels.end(), label );
-      if( it == labels.end() )
-        {
-        std::cout << "ERROR:  unknown label." << std::endl;
-        }
-      unsigned int labelIndex = it - labels.begin();
-
-      typename TensorType::EigenValuesArrayType newEigenvalues;
-
-      //
-      // Only apply pathology to a certain fraction of the voxels for a
-      // particular label.  We "throw the dice" to determine whether or not
-      // to apply to the current voxel.
-      //
-      RealType pathologyLongitudinalChange = 0.0;
-      RealType pathologyTransverseChange = 0.0;
-      if( ( n == 0 || n > numberOfControls ) && randomizer->GetUniformVariate(
-            0.0, 1.0 ) <= pathologyParameters(labelIndex, 2) )
-        {
-        pathologyLongitudinalChange = pathologyParameters(labelIndex, 0);
-        pathologyTransverseChange = pathologyParameters(labelIndex, 1);
-        }
-
-      //
-      // Apply intersubject variability
-      //
-      RealType isvLongitudinalProjection = 0.0;
-      RealType isvTransverseProjection = 0.0;
-      if( label != 0 && applyISV )
-        {
-        isvLongitudinalProjection = eigenISVProjection(count);
-        isvTransverseProjection = eigenISVProjection(totalMaskVolume + count);
-        count++;
-        }
-
-      //
-      // Reconstruct the tensor
-      //
-      if( ImageDimension == 2 )
-        {
-        newEigenvalues[1] = eigenvalues[1]
-          + eigenvalues[1] * pathologyLongitudinalChange
-          + isvLongitudinalProjection;
-        newEigenvalues[0] = eigenvalues[0] * ( 1.0 + eigenvalues[0] )
-          * pathologyTransverseChange + isvTransverseProjection;
-        if( newEigenvalues[0] >= newEigenvalues[1] )
-          {
-          newEigenvalues[0] = newEigenvalues[1] - 1.0e-6;
-          }
-        }
-      else
-        {
-        newEigenvalues[2] = eigenvalues[2]
-          + eigenvalues[2] * pathologyLongitudinalChange
-          + isvLongitudinalProjection;
-        RealType eigenAverage = 0.5 * ( eigenvalues[1] + eigenvalues[0] );
-        newEigenvalues[1] = ( 2.0 * eigenAverage
-                              * ( 1.0 + pathologyTransverseChange )
-                              + isvTransverseProjection ) / ( eigenvalues[0] / eigenvalues[1] + 1.0 );
-        if( newEigenvalues[1] >= newEigenvalues[2] )
-          {
-          newEigenvalues[1] = newEigenvalues[2] - 1.0e-6;
-          }
-        newEigenvalues[0] = ( eigenvalues[0] / eigenvalues[1] )
-          * newEigenvalues[1];
-        }
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        if( vnl_math_isnan( newEigenvalues[d] ) )
-          {
-          newEigenvalues[d] = 0.0;
-          }
-        }
-
-      if( newEigenvalues[0] < 0 )
-        {
-        newEigenvalues[0] = newEigenvalues[1];
-        }
-      if( ImageDimension == 3 && newEigenvalues[2] < 0 )
-        {
-        newEigenvalues[2] = newEigenvalues[1];
-        }
-
-      typename TensorType::MatrixType eigenvalueMatrix;
-      eigenvalueMatrix.Fill( 0.0 );
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        eigenvalueMatrix(d, d) = newEigenvalues[d];
-        }
-
-      typename TensorType::MatrixType D( eigenvectors.GetTranspose() );
-      D *= eigenvalueMatrix;
-      D *= eigenvectors;
-
-      TensorType newTensor;
-      for( unsigned int i = 0; i < ImageDimension; i++ )
-        {
-        for( unsigned int j = i; j < ImageDimension; j++ )
-          {
-          newTensor(i, j) = D(i, j);
-          }
-        }
-
-      if( label != 0 && n == 0 )
-        {
-        meanFAandMD(labelIndex, 0) +=
-          CalculateFractionalAnisotropy<TensorType>( tensor );
-        meanFAandMD(labelIndex, 1) +=
-          CalculateMeanDiffusivity<TensorType>( tensor );
-        meanFAandMD(labelIndex, 2) +=
-          CalculateFractionalAnisotropy<TensorType>( newTensor );
-        meanFAandMD(labelIndex, 3) +=
-          CalculateMeanDiffusivity<TensorType>( newTensor );
-        meanFAandMD(labelIndex, 4)++;
-        }
-      else if( n != 0 )
-        {
-        It.Set( newTensor );
-        }
-      }
-
-    if( n == 0 )
-      {
-      std::cout << "   " << std::left << std::setw( 7 ) << "Region"
-               << std::left << std::setw( 15 ) << "FA (original)"
-               << std::left << std::setw( 15 ) << "FA (path+isv)"
-               << std::left << std::setw( 15 ) << "FA (% change)"
-               << std::left << std::setw( 15 ) << "MD (original)"
-               << std::left << std::setw( 15 ) << "MD (path+isv)"
-               << std::left << std::setw( 15 ) << "MD (% change)"
-               << std::endl;
-      for( unsigned int l = 1; l < labels.size(); l++ )
-        {
-        std::cout << "   " << std::left << std::setw( 7 ) << labels[l]
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 0) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 2) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 )
-                 << ( meanFAandMD(l, 2) - meanFAandMD(l, 0) ) / meanFAandMD(l, 0)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 1) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 3) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 )
-                 << ( meanFAandMD(l, 3) - meanFAandMD(l, 1) ) / meanFAandMD(l, 1)
-                 << std::endl;
-        }
-      }
-    else
-      {
-      std::string which;
-      if( n <= numberOfControls )
-        {
-        which = std::string( "Control" );
-        }
-      else
-        {
-        which = std::string( "Experimental" );
-        }
-
-      std::stringstream istream;
-      if( n <= numberOfControls )
-        {
-        istream << n;
-        }
-      else
-        {
-        istream << ( n - numberOfControls );
-        }
-      std::string dwiSeriesFileNames = outputDirectory + which + istream.str()
-        + rootOutputFileName + std::string( "Direction%03d.nii.gz" );
-
-      itk::NumericSeriesFileNames::Pointer dwiFileNamesCreator =
-        itk::NumericSeriesFileNames::New();
-      dwiFileNamesCreator->SetStartIndex( 0 );
-      dwiFileNamesCreator->SetEndIndex( directions.size() - 1 );
-      dwiFileNamesCreator->SetSeriesFormat( dwiSeriesFileNames.c_str() );
-      std::vector<std::string> dwiImageNames = dwiFileNamesCreator->GetFileNames();
-      for( unsigned int d = 0; d < directions.size(); d++ )
-        {
-        vnl_vector<RealType> bk = directions[d];
-        RealType             bvalue = bvalues[d];
-
-        std::cout << "  Applying direction " << d << " (of "
-                 << directions.size() - 1 << "): [" << bk << "]"
-                 << ", bvalue = " << bvalue << std::endl;
-
-        typename ImageType::Pointer dwi =
-          AllocImage<ImageType>(dti, 0);
-
-        itk::ImageRegionConstIterator<ImageType> ItB( b0Image,
-                                                      b0Image->GetLargestPossibleRegion() );
-        itk::ImageRegionIterator<ImageType> ItD( dwi,
-                                                 dwi->GetLargestPossibleRegion() );
-        for( It.GoToBegin(), ItB.GoToBegin(), ItD.GoToBegin(); !It.IsAtEnd();
-             ++It, ++ItB, ++ItD )
-          {
-          TensorType tensor = It.Get();
-          for( unsigned int i = 0; i < tensor.GetNumberOfComponents(); i++ )
-            {
-            if( vnl_math_isnan( tensor[i] ) )
-              {
-              tensor[i] = 0.0;
-              }
-            }
-
-          vnl_matrix<RealType> D(ImageDimension, ImageDimension);
-          for( unsigned int i = 0; i < ImageDimension; i++ )
-            {
-            for( unsigned int j = 0; j < ImageDimension; j++ )
-              {
-              D(i, j) = tensor(i, j);
-              }
-            }
-
-          vnl_vector<RealType> bkD = bk * D;
+  //
+  // Each subject gets its own random stream.  The seeds are drawn up front
+  // so that the cohort is reproducible for a given --random-seed.
+  //
+  const unsigned int numberOfSubjects = numberOfControls + numberOfExperimentals;
 
-          RealType signal = ItB.Get() * std::exp( -bvalue * inner_product( bkD, bk ) );
+  std::vector<typename RandomizerType::IntegerType> seeds( numberOfSubjects + 1 );
+  for( unsigned int n = 0; n <= numberOfSubjects; n++ )
+    {
+    seeds[n] = randomizer->GetIntegerVariate();
+    }
 
-          // Add Rician noise
-          RealType realNoise = 0.0;
-          RealType imagNoise = 0.0;
-          if( noiseSigma > 0.0 )
-            {
-            realNoise = randomizer->GetNormalVariate( 0.0,
-                                                      vnl_math_sqr( noiseSigma ) );
-            imagNoise = randomizer->GetNormalVariate( 0.0,
-                                                      vnl_math_sqr( noiseSigma ) );
-            }
-          RealType realSignal = signal + realNoise;
-          RealType imagSignal = imagNoise;
+  CreateDTICohortThreadStruct<ImageDimension> str;
+  str.Atlas = inputAtlas.GetPointer();
+  str.Mask = maskImage.GetPointer();
+  str.B0 = b0Image.GetPointer();
+  str.Labels = &labels;
+  str.PathologyParameters = &pathologyParameters;
+  str.ISV = &ISV;
+  str.ApplyISV = applyISV;
+  str.TotalMaskVolume = totalMaskVolume;
+  str.Directions = &directions;
+  str.BValues = &bvalues;
+  str.NoiseSigma = noiseSigma;
+  str.NumberOfControls = numberOfControls;
+  str.NumberOfSubjects = numberOfSubjects;
+  str.OutputDirectory = outputDirectory;
+  str.RootOutputFileName = rootOutputFileName;
+  str.Seeds = &seeds;
+
+  std::cout << "--- Calculating regional average FA and MD values (original and "
+           << "pathology + intersubject variability) ---" << std::endl << std::endl;
 
-          std::complex<RealType> noisySignal( realSignal, imagSignal );
+  itk::Array2D<RealType> meanFAandMD( labels.size(), 5 );
+  meanFAandMD.Fill( 0.0 );
+    {
+    typename RandomizerType::Pointer subjectRandomizer = RandomizerType::New();
+    subjectRandomizer->Initialize( seeds[0] );
+    CreateDTICohortSubject<ImageDimension>( str, 0, subjectRandomizer, &meanFAandMD );
+    }
 
-          RealType finalSignal = std::sqrt( std::norm( noisySignal ) );
+  std::cout << "   " << std::left << std::setw( 7 ) << "Region"
+           << std::left << std::setw( 15 ) << "FA (original)"
+           << std::left << std::setw( 15 ) << "FA (path+isv)"
+           << std::left << std::setw( 15 ) << "FA (% change)"
+           << std::left << std::setw( 15 ) << "MD (original)"
+           << std::left << std::setw( 15 ) << "MD (path+isv)"
+           << std::left << std::setw( 15 ) << "MD (% change)"
+           << std::endl;
+  for( unsigned int l = 1; l < labels.size(); l++ )
+    {
+    std::cout << "   " << std::left << std::setw( 7 ) << labels[l]
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 0) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 2) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 )
+             << ( meanFAandMD(l, 2) - meanFAandMD(l, 0) ) / meanFAandMD(l, 0)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 1) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 3) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 )
+             << ( meanFAandMD(l, 3) - meanFAandMD(l, 1) ) / meanFAandMD(l, 1)
+             << std::endl;
+    }
 
-          if( signal <= ItB.Get() )
-            {
-            ItD.Set( finalSignal );
-            }
-          }
-        typedef itk::ImageFileWriter<ImageType> WriterType;
-        typename WriterType::Pointer writer = WriterType::New();
-        writer->SetFileName( dwiImageNames[d].c_str() );
-        writer->SetInput( dwi );
-        writer->Update();
-        }
-      }
+  if( numberOfSubjects > 0 )
+    {
+    std::cout << std::endl << "--- Writing images ---" << std::endl << std::endl;
+
+    // the image IO factories are registered on first use, do it before the
+    // threads start writing
+    itk::ImageIOFactory::CreateImageIO( ( outputDirectory + rootOutputFileName + ".nii.gz" ).c_str(),
+                                        itk::ImageIOFactory::WriteMode );
+
+    // the subjects only read the atlas, the mask and the PCA basis
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::min( static_cast<unsigned int>( threader->GetNumberOfThreads() ),
+                                            numberOfSubjects ) );
+    threader->SetSingleMethod( CreateDTICohortThreaderCallback<ImageDimension>, &str );
+    threader->SingleMethodExecute();
     }
   return EXIT_SUCCESS;
 }
@@ -1030,6 +1170,21 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
     parser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "Seed of the random number generator.  Each subject draws from " )
+      + std::string( "its own stream seeded from it, so that the cohort can be " )
+      + std::string( "reproduced regardless of the number of threads.  If not " )
+      + std::string( "specified, the generator is seeded from the clock." );
+
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "random-seed" );
+    option->SetShortName( 's' );
+    option->SetUsageOption( 0, "seed" );
+    option->SetDescription( description );
+    parser->AddOption( option );
+    }
+
     {
     std::string description = std::string( "Print the help menu (short version)." );
 
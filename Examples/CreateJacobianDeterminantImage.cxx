@@ -1,11 +1,15 @@
 #include "antsUtilities.h"
 #include <algorithm>
+#include <sstream>
 #include "ReadWriteData.h"
 #include "itkDeformationFieldGradientTensorImageFilter.h"
 #include "itkDeterminantTensorImageFilter.h"
 #include "itkGeometricJacobianDeterminantImageFilter.h"
 #include "itkLogImageFilter.h"
 #include "itkMaximumImageFilter.h"
+#include "itkTransformJacobianDeterminantImageFilter.h"
+#include "itkantsReadWriteTransform.h"
+#include "itkCompositeTransform.h"
 
 namespace ants
 {
@@ -17,6 +21,58 @@ int CreateJacobianDeterminantImage( int argc, char *argv[] )
   typedef itk::Vector<RealType, ImageDimension> VectorType;
   typedef itk::Image<VectorType, ImageDimension> VectorImageType;
 
+  bool calculateLogJacobian = false;
+  if ( argc > 4 )
+    {
+    calculateLogJacobian = static_cast<bool>( atoi( argv[4] ) );
+    }
+
+  /**
+   * With a reference image, evaluate the Jacobian straight from the
+   * transforms, given in the order of antsApplyTransforms
+   */
+  if( argc > 6 )
+    {
+    typedef itk::CompositeTransform<RealType, ImageDimension> CompositeTransformType;
+    typename CompositeTransformType::Pointer compositeTransform = CompositeTransformType::New();
+
+    std::istringstream transformNames( argv[2] );
+    std::string        transformName;
+    while( std::getline( transformNames, transformName, ',' ) )
+      {
+      typename CompositeTransformType::TransformType::Pointer transform =
+        itk::ants::ReadTransform<RealType, ImageDimension>( transformName );
+      if( transform.IsNull() )
+        {
+        std::cerr << "Can't read transform " << transformName << std::endl;
+        return EXIT_FAILURE;
+        }
+      compositeTransform->AddTransform( transform );
+      }
+
+    typename ImageType::Pointer referenceImage = ITK_NULLPTR;
+    ReadImage<ImageType>( referenceImage, argv[6] );
+
+    typedef itk::TransformJacobianDeterminantImageFilter<ImageType, RealType> JacobianFilterType;
+    typename JacobianFilterType::Pointer jacobianFilter = JacobianFilterType::New();
+    jacobianFilter->SetTransform( compositeTransform );
+    jacobianFilter->SetReferenceImage( referenceImage );
+    jacobianFilter->SetCalculateLogJacobian( calculateLogJacobian );
+    jacobianFilter->Update();
+
+    if( !calculateLogJacobian )
+      {
+      typename ImageType::Pointer jacobian = jacobianFilter->GetOutput();
+      for( itk::ImageRegionIterator<ImageType> It( jacobian, jacobian->GetLargestPossibleRegion() );
+           !It.IsAtEnd(); ++It )
+        {
+        It.Set( std::max( It.Get(), 0.0 ) );
+        }
+      }
+    WriteImage<ImageType>( jacobianFilter->GetOutput(), argv[3] );
+    return EXIT_SUCCESS;
+    }
+
   /**
    * Read in vector field
    */
@@ -33,12 +89,6 @@ int CreateJacobianDeterminantImage( int argc, char *argv[] )
   minimumConstantImage->Allocate();
   minimumConstantImage->FillBuffer( 0.001 );
 
-  bool calculateLogJacobian = false;
-  if ( argc > 4 )
-    {
-    calculateLogJacobian = static_cast<bool>( atoi( argv[4] ) );
-    }
-
   bool calculateGeometricJacobian = false;
   if ( argc > 5 )
     {
@@ -158,7 +208,10 @@ private:
 
   if( argc < 3 )
     {
-    std::cout << "Usage: " << argv[0] << " imageDimension deformationField outputImage [doLogJacobian=0] [useGeometric=0]" << std::endl;
+    std::cout << "Usage: " << argv[0] << " imageDimension deformationField outputImage [doLogJacobian=0] [useGeometric=0] [referenceImage]" << std::endl;
+    std::cout << "  With a reference image, deformationField may be a comma-separated list of transforms, "
+              << "in the order of antsApplyTransforms, whose Jacobian is evaluated over the reference lattice "
+              << "without composing them into a field; useGeometric is then ignored." << std::endl;
     return EXIT_FAILURE;
     }
 
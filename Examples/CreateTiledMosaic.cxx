@@ -3,25 +3,157 @@
 #include "ReadWriteData.h"
 
 #include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
 
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
 #include "itkCastImageFilter.h"
-#include "itkConstantPadImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkFlipImageFilter.h"
-#include "itkImageDuplicator.h"
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkLabelStatisticsImageFilter.h"
-#include "itkPermuteAxesImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkStatisticsImageFilter.h"
-#include "itkTileImageFilter.h"
 
 namespace ants
 {
-int CreateMosaic( itk::ants::CommandLineParser *parser )
+/** Functional overlays read by earlier mosaics of a batch, which are
+    usually shared, e.g. template-space labels drawn over every subject. */
+struct MosaicImageCache
+{
+  typedef itk::Image<float, 3>                        ImageType;
+  typedef itk::Image<itk::RGBPixel<unsigned char>, 3> RgbImageType;
+
+  std::map<std::string, RgbImageType::Pointer> RgbImages;
+  std::map<std::string, ImageType::Pointer>    MaskImages;
+};
+
+/** Everything the threads need to render the tiles straight into the
+    mosaic.  Cropping, padding, flipping and permuting a slice only
+    reorder its voxels, so they are folded into the buffer offsets of the
+    tile columns and rows (-1 for padded ones), which are the same for all
+    slices. */
+struct MosaicTileStruct
+{
+  typedef float                                  RealType;
+  typedef unsigned char                          RgbComponentType;
+  typedef itk::RGBPixel<RgbComponentType>        RgbPixelType;
+  typedef itk::Image<RealType, 3>                ImageType;
+  typedef itk::Image<RealType, 2>                SliceType;
+  typedef itk::Image<RgbPixelType, 3>            RgbImageType;
+  typedef itk::Image<RgbPixelType, 2>            RgbSliceType;
+
+  const RealType *                    InputBuffer;
+  std::vector<const RgbPixelType *>   RgbBuffers;
+  std::vector<const RealType *>       MaskBuffers;
+  std::vector<RealType>               AlphaValues;
+
+  std::vector<unsigned int>           Slices;
+  long                                SliceStride;
+  std::vector<long>                   ColumnOffsets;
+  std::vector<long>                   RowOffsets;
+  unsigned int                        NumberOfColumns;
+  unsigned int                        NumberOfTiles;
+
+  RealType                            PadValue;
+  RealType                            MinimumIntensity;
+  RealType                            MaximumIntensity;
+
+  SliceType *                         Mosaic;
+  RgbSliceType *                      RgbMosaic;
+};
+
+void RenderMosaicTile( const MosaicTileStruct & str, unsigned int tile )
+{
+  typedef MosaicTileStruct::RealType         RealType;
+  typedef MosaicTileStruct::RgbComponentType RgbComponentType;
+  typedef MosaicTileStruct::RgbPixelType     RgbPixelType;
+
+  const unsigned long tileWidth = str.ColumnOffsets.size();
+  const unsigned long tileHeight = str.RowOffsets.size();
+  const unsigned long mosaicWidth = tileWidth * str.NumberOfColumns;
+  const unsigned long firstPixel = ( tile / str.NumberOfColumns ) * tileHeight * mosaicWidth
+    + ( tile % str.NumberOfColumns ) * tileWidth;
+  const long          sliceOffset = static_cast<long>( str.Slices[tile] ) * str.SliceStride;
+
+  const RealType intensityScale = 255.0 / ( str.MaximumIntensity - str.MinimumIntensity );
+
+  for( unsigned long v = 0; v < tileHeight; v++ )
+    {
+    const unsigned long rowPixel = firstPixel + v * mosaicWidth;
+    for( unsigned long u = 0; u < tileWidth; u++ )
+      {
+      const bool isPadded = ( str.ColumnOffsets[u] < 0 || str.RowOffsets[v] < 0 );
+      const long offset = sliceOffset + str.ColumnOffsets[u] + str.RowOffsets[v];
+
+      const RealType value = isPadded ? str.PadValue : str.InputBuffer[offset];
+      if( !str.RgbMosaic )
+        {
+        str.Mosaic->GetBufferPointer()[rowPixel + u] = value;
+        continue;
+        }
+
+      // the padded voxels are outside all the masks
+      const RealType pixel = intensityScale * ( value - str.MinimumIntensity );
+      RgbPixelType   compositeRgbPixel;
+      compositeRgbPixel.Fill( static_cast<RgbComponentType>( pixel ) );
+      RealType compositeAlpha = 1.0;
+
+      for( unsigned int n = 0; n < str.RgbBuffers.size() && !isPadded; n++ )
+        {
+        const RealType functionalAlpha = str.AlphaValues[n];
+        const RealType backgroundAlpha = compositeAlpha;
+        const RealType currentAlpha = 1.0 - ( 1.0 - functionalAlpha ) * ( 1.0 - backgroundAlpha );
+        compositeAlpha = currentAlpha;
+
+        if( str.MaskBuffers[n][offset] == 0 )
+          {
+          continue;
+          }
+        const RgbPixelType rgbPixel = str.RgbBuffers[n][offset];
+
+        if( n == 0 )
+          {
+          for( unsigned int c = 0; c < 3; c++ )
+            {
+            compositeRgbPixel[c] = static_cast<RgbComponentType>(
+              ( 1.0 - functionalAlpha ) * pixel + functionalAlpha * rgbPixel[c] );
+            }
+          }
+        else
+          {
+          // http://stackoverflow.com/questions/726549/algorithm-for-additive-color-mixing-for-rgb-values
+          // or
+          // http://en.wikipedia.org/wiki/Alpha_compositing
+
+          for( unsigned int c = 0; c < 3; c++ )
+            {
+            const RealType functionalColor = rgbPixel[c] / 255.0;
+            const RealType backgroundColor = compositeRgbPixel[c] / 255.0;
+            const RealType currentColor = functionalColor * functionalAlpha / currentAlpha
+              + backgroundColor * backgroundAlpha * ( 1.0 - functionalAlpha ) / currentAlpha;
+            compositeRgbPixel[c] = static_cast<RgbComponentType>( currentColor * 255.0 );
+            }
+          }
+        }
+      str.RgbMosaic->GetBufferPointer()[rowPixel + u] = compositeRgbPixel;
+      }
+    }
+}
+
+ITK_THREAD_RETURN_TYPE MosaicTileThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  const MosaicTileStruct *              str = static_cast<MosaicTileStruct *>( info->UserData );
+
+  for( unsigned int tile = info->ThreadID; tile < str->NumberOfTiles; tile += info->NumberOfThreads )
+    {
+    RenderMosaicTile( *str, tile );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+int CreateMosaic( itk::ants::CommandLineParser *parser, MosaicImageCache & cache )
 {
   const unsigned int ImageDimension = 3;
 
@@ -174,37 +306,45 @@ int CreateMosaic( itk::ants::CommandLineParser *parser )
 
       std::string rgbFileName = functionalOverlayOption->GetFunction( n )->GetParameter( 0 );
 
-      typedef itk::ImageFileReader<RgbImageType> RgbReaderType;
-      RgbReaderType::Pointer rgbReader = RgbReaderType::New();
-      rgbReader->SetFileName( rgbFileName.c_str() );
-      try
+      if( cache.RgbImages.find( rgbFileName ) == cache.RgbImages.end() )
         {
-        rgbReader->Update();
-        }
-      catch( ... )
-        {
-        std::cerr << "Error reading RGB file " << rgbFileName << std::endl;
-        return EXIT_FAILURE;
+        typedef itk::ImageFileReader<RgbImageType> RgbReaderType;
+        RgbReaderType::Pointer rgbReader = RgbReaderType::New();
+        rgbReader->SetFileName( rgbFileName.c_str() );
+        try
+          {
+          rgbReader->Update();
+          }
+        catch( ... )
+          {
+          std::cerr << "Error reading RGB file " << rgbFileName << std::endl;
+          return EXIT_FAILURE;
+          }
+        cache.RgbImages[rgbFileName] = rgbReader->GetOutput();
         }
-      functionalRgbImages.push_back( rgbReader->GetOutput() );
+      functionalRgbImages.push_back( cache.RgbImages[rgbFileName] );
 
       // read mask
 
       std::string maskFileName = functionalOverlayOption->GetFunction( n )->GetParameter( 1 );
 
-      typedef itk::ImageFileReader<ImageType> MaskReaderType;
-      MaskReaderType::Pointer maskReader = MaskReaderType::New();
-      maskReader->SetFileName( maskFileName.c_str() );
-      try
-        {
-        maskReader->Update();
-        }
-      catch( ... )
+      if( cache.MaskImages.find( maskFileName ) == cache.MaskImages.end() )
         {
-        std::cerr << "Error reading mask file " << maskFileName << std::endl;
-        return EXIT_FAILURE;
+        typedef itk::ImageFileReader<ImageType> MaskReaderType;
+        MaskReaderType::Pointer maskReader = MaskReaderType::New();
+        maskReader->SetFileName( maskFileName.c_str() );
+        try
+          {
+          maskReader->Update();
+          }
+        catch( ... )
+          {
+          std::cerr << "Error reading mask file " << maskFileName << std::endl;
+          return EXIT_FAILURE;
+          }
+        cache.MaskImages[maskFileName] = maskReader->GetOutput();
         }
-      functionalMaskImages.push_back( maskReader->GetOutput() );
+      functionalMaskImages.push_back( cache.MaskImages[maskFileName] );
 
       if( functionalOverlayOption->GetFunction( n )->GetNumberOfParameters() > 2 )
         {
@@ -659,308 +799,154 @@ int CreateMosaic( itk::ants::CommandLineParser *parser )
   std::cout << "Rows:  " << numberOfRows << std::endl;
   std::cout << "Columns:  " << numberOfColumns << std::endl;
 
-
-  typedef itk::TileImageFilter<SliceType, SliceType> TileFilterType;
-  TileFilterType::LayoutArrayType array;
-
-  array[0] = numberOfColumns;
-  array[1] = numberOfRows;
-
-  ImageType::RegionType region;
-  size[direction] = 0;
-
-  TileFilterType::Pointer tileFilter = TileFilterType::New();
-  tileFilter->SetLayout( array );
-
-  typedef itk::TileImageFilter<RgbSliceType, RgbSliceType> RgbTileFilterType;
-  RgbTileFilterType::Pointer rgbTileFilter = RgbTileFilterType::New();
-  rgbTileFilter->SetLayout( array );
-
-  for( unsigned int i = 0; i < whichSlices.size(); i++ )
+  for( unsigned int n = 0; n < functionalRgbImages.size(); n++ )
     {
-    unsigned int whichSlice = whichSlices[i];
-
-    std::cout << "Processing slice " << whichSlice << std::endl;
+    if( functionalRgbImages[n]->GetBufferedRegion().GetSize() != size ||
+      functionalMaskImages[n]->GetBufferedRegion().GetSize() != size )
+      {
+      std::cerr << "The overlay images must have the same size as the input image." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
 
-    ImageType::IndexType index;
-    index.Fill( 0 );
-    index[direction] = static_cast<int>( whichSlice );
-    region.SetIndex( index );
-    region.SetSize( size );
+  // The slice axes, and the region of each after cropping or padding,
+  // as the extract and pad filters would index it.
 
-    typedef itk::ExtractImageFilter<ImageType, SliceType> ExtracterType;
-    ExtracterType::Pointer extracter = ExtracterType::New();
-    extracter->SetInput( inputImage );
-    extracter->SetExtractionRegion( region );
-    extracter->SetDirectionCollapseToIdentity();
+  unsigned int sliceAxes[ImageDimension - 1];
+  long         sliceRegionIndex[ImageDimension - 1];
+  long         sliceRegionSize[ImageDimension - 1];
+  long         strides[ImageDimension];
 
-    SliceType::Pointer outputSlice = ITK_NULLPTR;
-    SliceType::Pointer outputSlice2 = ITK_NULLPTR;
+  strides[0] = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    strides[d] = strides[d - 1] * static_cast<long>( size[d - 1] );
+    }
 
+  unsigned int count = 0;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( d == direction )
+      {
+      continue;
+      }
+    sliceAxes[count] = d;
     if( paddingType == -1 )
       {
-      typedef itk::ExtractImageFilter<SliceType, SliceType> ExtracterType2;
-      ExtracterType2::Pointer extracter2 = ExtracterType2::New();
-      extracter2->SetInput( extracter->GetOutput() );
-      extracter2->SetExtractionRegion( croppedSliceRegion );
-      extracter2->SetDirectionCollapseToIdentity();
-
-      outputSlice = extracter2->GetOutput();
-      outputSlice->Update();
-      outputSlice->DisconnectPipeline();
+      sliceRegionIndex[count] = croppedSliceRegion.GetIndex()[count];
+      sliceRegionSize[count] = croppedSliceRegion.GetSize()[count];
+      if( sliceRegionIndex[count] < 0 || sliceRegionSize[count] <= 0 ||
+        sliceRegionIndex[count] + sliceRegionSize[count] > static_cast<long>( size[d] ) )
+        {
+        std::cerr << "The cropped slice region is outside the image." << std::endl;
+        return EXIT_FAILURE;
+        }
       }
     else if( paddingType == 1 )
       {
-      typedef itk::ConstantPadImageFilter<SliceType, SliceType> PadderType;
-      PadderType::Pointer padder = PadderType::New();
-      padder->SetInput( extracter->GetOutput() );
-      padder->SetPadLowerBound( lowerBound );
-      padder->SetPadUpperBound( upperBound );
-      padder->SetConstant( static_cast<PixelType>( padValue ) );
-
-      outputSlice = padder->GetOutput();
-      outputSlice->Update();
-      outputSlice->DisconnectPipeline();
+      sliceRegionIndex[count] = -static_cast<long>( lowerBound[count] );
+      sliceRegionSize[count] = size[d] + lowerBound[count] + upperBound[count];
       }
-    else // paddingType == 0
+    else
       {
-      outputSlice = extracter->GetOutput();
-      outputSlice->Update();
-      outputSlice->DisconnectPipeline();
+      sliceRegionIndex[count] = 0;
+      sliceRegionSize[count] = size[d];
       }
+    count++;
+    }
 
-    typedef itk::FlipImageFilter<SliceType> FlipFilterType;
-    FlipFilterType::Pointer flipper = FlipFilterType::New();
-    FlipFilterType::FlipAxesArrayType flipArray;
-    flipArray[0] = doFlipHorizontally;
-    flipArray[1] = doFlipVertically;
-
-    flipper->SetInput( outputSlice );
-    flipper->SetFlipAxes( flipArray );
+  bool doFlip[ImageDimension - 1];
+  doFlip[0] = doFlipHorizontally;
+  doFlip[1] = doFlipVertically;
 
-    typedef itk::PermuteAxesImageFilter<SliceType> PermuteAxesImageFilterType;
-    itk::FixedArray<unsigned int, 2> order;
-    order[0] = 0;
-    order[1] = 1;
-    if( doPermute )
-      {
-      order[0] = 1;
-      order[1] = 0;
-      }
-    PermuteAxesImageFilterType::Pointer permuteAxesFilter = PermuteAxesImageFilterType::New();
-    permuteAxesFilter->SetInput( flipper->GetOutput() );
-    permuteAxesFilter->SetOrder( order );
+  MosaicTileStruct str;
 
-    outputSlice2 = permuteAxesFilter->GetOutput();
-    outputSlice2->Update();
-    outputSlice2->DisconnectPipeline();
+  // the flip is applied to the slice axes, the permutation after it
+  for( unsigned int t = 0; t < ImageDimension - 1; t++ )
+    {
+    const unsigned int k = doPermute ? 1 - t : t;
+    std::vector<long> & offsets = ( t == 0 ) ? str.ColumnOffsets : str.RowOffsets;
 
-    if( functionalRgbImages.size() > 0 )
+    offsets.resize( sliceRegionSize[k] );
+    for( long w = 0; w < sliceRegionSize[k]; w++ )
       {
-      RgbSliceType::Pointer compositeRgbSlice = ITK_NULLPTR;
-      RealType compositeAlpha = 1.0;
-
-      for( unsigned int n = 0; n < functionalRgbImages.size(); n++ )
+      long j = sliceRegionIndex[k] + w;
+      if( doFlip[k] )
         {
-        SliceType::Pointer outputMaskSlice = ITK_NULLPTR;
-        SliceType::Pointer outputMaskSlice2 = ITK_NULLPTR;
-
-        ExtracterType::Pointer maskExtracter = ExtracterType::New();
-        maskExtracter->SetInput( functionalMaskImages[n] );
-        maskExtracter->SetExtractionRegion( region );
-        maskExtracter->SetDirectionCollapseToIdentity();
-
-        if( paddingType == -1 )
-          {
-          typedef itk::ExtractImageFilter<SliceType, SliceType> ExtracterType2;
-          ExtracterType2::Pointer maskExtracter2 = ExtracterType2::New();
-          maskExtracter2->SetInput( maskExtracter->GetOutput() );
-          maskExtracter2->SetExtractionRegion( croppedSliceRegion );
-          maskExtracter2->SetDirectionCollapseToIdentity();
-
-          outputMaskSlice = maskExtracter2->GetOutput();
-          outputMaskSlice->Update();
-          outputMaskSlice->DisconnectPipeline();
-          }
-        else if( paddingType == 1 )
-          {
-          typedef itk::ConstantPadImageFilter<SliceType, SliceType> PadderType;
-          PadderType::Pointer maskPadder = PadderType::New();
-          maskPadder->SetInput( maskExtracter->GetOutput() );
-          maskPadder->SetPadLowerBound( lowerBound );
-          maskPadder->SetPadUpperBound( upperBound );
-          maskPadder->SetConstant( 0 );
-
-          outputMaskSlice = maskPadder->GetOutput();
-          outputMaskSlice->Update();
-          outputMaskSlice->DisconnectPipeline();
-          }
-        else // paddingType == 0
-          {
-          outputMaskSlice = maskExtracter->GetOutput();
-          outputMaskSlice->Update();
-          outputMaskSlice->DisconnectPipeline();
-          }
-
-        FlipFilterType::Pointer maskFlipper = FlipFilterType::New();
-        maskFlipper->SetInput( outputMaskSlice );
-        maskFlipper->SetFlipAxes( flipArray );
-
-        PermuteAxesImageFilterType::Pointer maskPermuteAxesFilter = PermuteAxesImageFilterType::New();
-        maskPermuteAxesFilter->SetInput( maskFlipper->GetOutput() );
-        maskPermuteAxesFilter->SetOrder( order );
-
-        outputMaskSlice2 = maskPermuteAxesFilter->GetOutput();
-        outputMaskSlice2->Update();
-        outputMaskSlice2->DisconnectPipeline();
-
-        typedef itk::ExtractImageFilter<RgbImageType, RgbSliceType> RgbExtracterType;
-        RgbExtracterType::Pointer rgbExtracter = RgbExtracterType::New();
-        rgbExtracter->SetInput( functionalRgbImages[n] );
-        rgbExtracter->SetExtractionRegion( region );
-        rgbExtracter->SetDirectionCollapseToIdentity();
-
-        RgbSliceType::Pointer outputRgbSlice = ITK_NULLPTR;
-        RgbSliceType::Pointer outputRgbSlice2 = ITK_NULLPTR;
-
-        if( paddingType == -1 )
-          {
-          typedef itk::ExtractImageFilter<RgbSliceType, RgbSliceType> RgbExtracterType2;
-          RgbExtracterType2::Pointer rgbExtracter2 = RgbExtracterType2::New();
-          rgbExtracter2->SetInput( rgbExtracter->GetOutput() );
-          rgbExtracter2->SetExtractionRegion( croppedSliceRegion );
-          rgbExtracter2->SetDirectionCollapseToIdentity();
-
-          outputRgbSlice = rgbExtracter2->GetOutput();
-          outputRgbSlice->Update();
-          outputRgbSlice->DisconnectPipeline();
-          }
-        else if( paddingType == 1 )
-          {
-          typedef itk::ConstantPadImageFilter<RgbSliceType, RgbSliceType> RgbPadderType;
-          RgbPadderType::Pointer rgbPadder = RgbPadderType::New();
-          rgbPadder->SetInput( rgbExtracter->GetOutput() );
-          rgbPadder->SetPadLowerBound( lowerBound );
-          rgbPadder->SetPadUpperBound( upperBound );
-          rgbPadder->SetConstant( static_cast<PixelType>( padValue ) );
-
-          outputRgbSlice = rgbPadder->GetOutput();
-          outputRgbSlice->Update();
-          outputRgbSlice->DisconnectPipeline();
-          }
-        else // paddingType == 0
-          {
-          outputRgbSlice = rgbExtracter->GetOutput();
-          outputRgbSlice->Update();
-          outputRgbSlice->DisconnectPipeline();
-          }
-
-        typedef itk::FlipImageFilter<RgbSliceType> RgbFlipFilterType;
-        RgbFlipFilterType::Pointer rgbFlipper = RgbFlipFilterType::New();
-        RgbFlipFilterType::FlipAxesArrayType rgbFlipArray;
-        rgbFlipArray[0] = doFlipHorizontally;
-        rgbFlipArray[1] = doFlipVertically;
-
-        rgbFlipper->SetInput( outputRgbSlice );
-        rgbFlipper->SetFlipAxes( rgbFlipArray );
-
-        typedef itk::PermuteAxesImageFilter<RgbSliceType> RgbPermuteAxesImageFilterType;
-        itk::FixedArray<unsigned int, 2> rgbOrder;
-        rgbOrder[0] = 0;
-        rgbOrder[1] = 1;
-        if( doPermute )
-          {
-          rgbOrder[0] = 1;
-          rgbOrder[1] = 0;
-          }
-        RgbPermuteAxesImageFilterType::Pointer rgbPermuteAxesFilter = RgbPermuteAxesImageFilterType::New();
-        rgbPermuteAxesFilter->SetInput( rgbFlipper->GetOutput() );
-        rgbPermuteAxesFilter->SetOrder( rgbOrder );
-
-        outputRgbSlice2 = rgbPermuteAxesFilter->GetOutput();
-        outputRgbSlice2->Update();
-        outputRgbSlice2->DisconnectPipeline();
-
-        RealType functionalAlpha = functionalAlphaValues[n];
-        RealType backgroundAlpha = compositeAlpha;
-        RealType currentAlpha = 1.0 - ( 1.0 - functionalAlpha ) * ( 1.0 - backgroundAlpha );
-
-        // combine grayscale slice and rgb slice
-        itk::ImageRegionConstIteratorWithIndex<SliceType> It( outputSlice2,
-          outputSlice2->GetRequestedRegion() );
-        itk::ImageRegionIterator<RgbSliceType> ItRgb( outputRgbSlice2,
-          outputRgbSlice2->GetRequestedRegion() );
-        for( It.GoToBegin(), ItRgb.GoToBegin(); !It.IsAtEnd(); ++It, ++ItRgb )
-          {
-          RgbPixelType rgbPixel = ItRgb.Get();
-
-          if( n == 0 )
-            {
-            PixelType pixel = 255 * ( It.Get() - minIntensityValue ) / ( maxIntensityValue - minIntensityValue );
-
-            if( outputMaskSlice2 && outputMaskSlice2->GetPixel( It.GetIndex() ) != 0 )
-              {
-              rgbPixel.SetRed( static_cast<RgbComponentType>( ( 1.0 - functionalAlpha ) * pixel + functionalAlpha * rgbPixel.GetRed() ) );
-              rgbPixel.SetGreen( static_cast<RgbComponentType>( ( 1.0 - functionalAlpha ) * pixel + functionalAlpha * rgbPixel.GetGreen() ) );
-              rgbPixel.SetBlue( static_cast<RgbComponentType>( ( 1.0 - functionalAlpha ) * pixel + functionalAlpha * rgbPixel.GetBlue() ) );
-              }
-            else
-              {
-              rgbPixel.SetRed( pixel );
-              rgbPixel.SetGreen( pixel );
-              rgbPixel.SetBlue( pixel );
-              }
-            ItRgb.Set( rgbPixel );
-            }
-          else
-            {
-            // http://stackoverflow.com/questions/726549/algorithm-for-additive-color-mixing-for-rgb-values
-            // or
-            // http://en.wikipedia.org/wiki/Alpha_compositing
-
-            if( outputMaskSlice2 && outputMaskSlice2->GetPixel( It.GetIndex() ) != 0 )
-              {
-
-              RealType functionalRed = rgbPixel.GetRed() / 255.0;
-              RealType functionalGreen = rgbPixel.GetGreen() / 255.0;
-              RealType functionalBlue = rgbPixel.GetBlue() / 255.0;
-
-              RgbPixelType backgroundRgbPixel = compositeRgbSlice->GetPixel( It.GetIndex() );
-
-              RealType backgroundRed   = backgroundRgbPixel.GetRed() / 255.0;
-              RealType backgroundGreen = backgroundRgbPixel.GetGreen() / 255.0;
-              RealType backgroundBlue  = backgroundRgbPixel.GetBlue() / 255.0;
-
-              RealType currentRed   = functionalRed   * functionalAlpha / currentAlpha + backgroundRed   * backgroundAlpha * ( 1.0 - functionalAlpha ) / currentAlpha;
-              RealType currentGreen = functionalGreen * functionalAlpha / currentAlpha + backgroundGreen * backgroundAlpha * ( 1.0 - functionalAlpha ) / currentAlpha;
-              RealType currentBlue  = functionalBlue  * functionalAlpha / currentAlpha + backgroundBlue  * backgroundAlpha * ( 1.0 - functionalAlpha ) / currentAlpha;
-
-              rgbPixel.SetRed( currentRed * 255.0 );
-              rgbPixel.SetGreen( currentGreen * 255.0 );
-              rgbPixel.SetBlue( currentBlue * 255.0 );
-
-              compositeRgbSlice->SetPixel( It.GetIndex(), rgbPixel );
-              }
-            }
-          }
-        if( n == 0 )
-          {
-          typedef itk::ImageDuplicator<RgbSliceType> DuplicatorType;
-          DuplicatorType::Pointer duplicator = DuplicatorType::New();
-          duplicator->SetInputImage( outputRgbSlice2 );
-          duplicator->Update();
-
-          compositeRgbSlice = duplicator->GetOutput();
-          }
-        compositeAlpha = currentAlpha;
+        j = 2 * sliceRegionIndex[k] + sliceRegionSize[k] - 1 - j;
         }
-      rgbTileFilter->SetInput( i, compositeRgbSlice );
+      offsets[w] = ( j < 0 || j >= static_cast<long>( size[sliceAxes[k]] ) ) ? -1 : j * strides[sliceAxes[k]];
       }
-    else
+    }
+
+  str.InputBuffer = inputImage->GetBufferPointer();
+  for( unsigned int n = 0; n < functionalRgbImages.size(); n++ )
+    {
+    str.RgbBuffers.push_back( functionalRgbImages[n]->GetBufferPointer() );
+    str.MaskBuffers.push_back( functionalMaskImages[n]->GetBufferPointer() );
+    }
+  str.AlphaValues = functionalAlphaValues;
+  str.Slices = whichSlices;
+  str.SliceStride = strides[direction];
+  str.NumberOfColumns = numberOfColumns;
+  str.NumberOfTiles = vnl_math_min( static_cast<unsigned long>( numberOfRows * numberOfColumns ), numberOfSlices );
+  str.PadValue = padValue;
+  str.MinimumIntensity = minIntensityValue;
+  str.MaximumIntensity = maxIntensityValue;
+
+  // The tiles are rendered into a single mosaic image, which is the only
+  // copy of the slices that is kept.
+
+  SliceType::IndexType mosaicIndex;
+  mosaicIndex.Fill( 0 );
+  SliceType::RegionType mosaicRegion;
+  mosaicRegion.SetIndex( mosaicIndex );
+  SliceType::SizeType mosaicSize;
+  mosaicSize[0] = str.ColumnOffsets.size() * numberOfColumns;
+  mosaicSize[1] = str.RowOffsets.size() * numberOfRows;
+  mosaicRegion.SetSize( mosaicSize );
+
+  SliceType::SpacingType mosaicSpacing;
+  mosaicSpacing[0] = inputImage->GetSpacing()[sliceAxes[doPermute ? 1 : 0]];
+  mosaicSpacing[1] = inputImage->GetSpacing()[sliceAxes[doPermute ? 0 : 1]];
+
+  SliceType::Pointer    mosaic = ITK_NULLPTR;
+  RgbSliceType::Pointer rgbMosaic = ITK_NULLPTR;
+  if( functionalRgbImages.size() > 0 )
+    {
+    rgbMosaic = RgbSliceType::New();
+    rgbMosaic->SetRegions( mosaicRegion );
+    rgbMosaic->SetSpacing( mosaicSpacing );
+    rgbMosaic->Allocate();
+    rgbMosaic->FillBuffer( itk::NumericTraits<RgbPixelType>::ZeroValue() );
+    }
+  else
+    {
+    mosaic = SliceType::New();
+    mosaic->SetRegions( mosaicRegion );
+    mosaic->SetSpacing( mosaicSpacing );
+    mosaic->Allocate();
+    mosaic->FillBuffer( 0 );
+    }
+  str.Mosaic = mosaic.GetPointer();
+  str.RgbMosaic = rgbMosaic.GetPointer();
+
+  const unsigned int numberOfThreads = vnl_math_min(
+    static_cast<unsigned int>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), str.NumberOfTiles );
+  if( numberOfThreads <= 1 )
+    {
+    for( unsigned int i = 0; i < str.NumberOfTiles; i++ )
       {
-      tileFilter->SetInput( i, outputSlice2 );
+      RenderMosaicTile( str, i );
       }
     }
+  else
+    {
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( MosaicTileThreaderCallback, &str );
+    threader->SingleMethodExecute();
+    }
 
   itk::ants::CommandLineParser::OptionType::Pointer outputOption =
     parser->GetOption( "output" );
@@ -969,13 +955,11 @@ int CreateMosaic( itk::ants::CommandLineParser *parser )
     std::string outputFile = outputOption->GetFunction( 0 )->GetName();
     if( functionalRgbImages.size() > 0 )
       {
-      rgbTileFilter->Update();
-      WriteImage<RgbSliceType>( rgbTileFilter->GetOutput(), outputFile.c_str() );
+      WriteImage<RgbSliceType>( rgbMosaic, outputFile.c_str() );
       }
     else
       {
-      tileFilter->Update();
-      WriteImage<SliceType>( tileFilter->GetOutput(), outputFile.c_str() );
+      WriteImage<SliceType>( mosaic, outputFile.c_str() );
       }
     }
   else
@@ -1178,6 +1162,22 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
     parser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "Render a mosaic for each line of the batch file, which holds the " )
+      + std::string( "options of one mosaic as they would be given on the command line, " )
+      + std::string( "e.g. \"-i subject1.nii.gz -o subject1.png -s 5\".  Empty lines and " )
+      + std::string( "lines starting with # are skipped.  Functional overlays shared " )
+      + std::string( "by several lines are only read once." );
+
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "batch" );
+    option->SetShortName( 'b' );
+    option->SetUsageOption( 0, "batchFile" );
+    option->SetDescription( description );
+    parser->AddOption( option );
+    }
+
     {
     std::string description = std::string( "Print the help menu (short version)." );
 
@@ -1197,9 +1197,57 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
     }
 }
 
+int CreateTiledMosaic( std::vector<std::string> args, MosaicImageCache & cache, bool isBatchLine );
+
+int CreateBatchOfMosaics( const std::string & batchFileName, MosaicImageCache & cache )
+{
+  std::ifstream batchFile( batchFileName.c_str() );
+  if( !batchFile )
+    {
+    std::cerr << "Unable to read the batch file " << batchFileName << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  unsigned int numberOfFailures = 0;
+  unsigned int lineNumber = 0;
+
+  std::string line;
+  while( std::getline( batchFile, line ) )
+    {
+    lineNumber++;
+
+    std::vector<std::string> args;
+    std::istringstream       stream( line );
+    std::string              arg;
+    while( stream >> arg )
+      {
+      args.push_back( arg );
+      }
+    if( args.empty() || args[0][0] == '#' )
+      {
+      continue;
+      }
+
+    std::cout << "Batch line " << lineNumber << std::endl;
+    if( CreateTiledMosaic( args, cache, true ) != EXIT_SUCCESS )
+      {
+      std::cerr << "Batch line " << lineNumber << " failed." << std::endl;
+      numberOfFailures++;
+      }
+    }
+
+  return ( numberOfFailures == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
 // 'main()'
 int CreateTiledMosaic( std::vector<std::string> args, std::ostream* /*out_stream = NULL */ )
+{
+  MosaicImageCache cache;
+  return CreateTiledMosaic( args, cache, false );
+}
+
+int CreateTiledMosaic( std::vector<std::string> args, MosaicImageCache & cache, bool isBatchLine )
 {
   // put the arguments coming in as 'args' into standard (argc,argv) format;
   // 'args' doesn't have the command name as first, argument, so add it manually;
@@ -1276,6 +1324,18 @@ private:
     return EXIT_SUCCESS;
     }
 
+  itk::ants::CommandLineParser::OptionType::Pointer batchOption =
+    parser->GetOption( "batch" );
+  if( batchOption && batchOption->GetNumberOfFunctions() )
+    {
+    if( isBatchLine )
+      {
+      std::cerr << "Batch files cannot be nested." << std::endl;
+      return EXIT_FAILURE;
+      }
+    return CreateBatchOfMosaics( batchOption->GetFunction( 0 )->GetName(), cache );
+    }
+
   // Get dimensionality
 
   std::string filename;
@@ -1292,7 +1352,7 @@ private:
 
     if( dimension == 3 )
       {
-      return CreateMosaic( parser );
+      return CreateMosaic( parser, cache );
       }
     else
       {
@@ -4,12 +4,97 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
-#include "itkMatrixOffsetTransformBase.h"
-#include "itkWarpImageMultiTransformFilter.h"
 #include "itkGridImageSource.h"
+#include "itkMultiThreader.h"
+
+#include <cmath>
 
 namespace ants
 {
+/** The grid of itk::GridImageSource is separable:  Scale * prod_i P_i[j_i]
+ * for the profiles P_i along the axes.  So is its multilinear interpolation,
+ * the product of the linear interpolations of the profiles, and the warped
+ * grid is evaluated at x + u(x) from the profiles alone, without the grid
+ * image or a resampling filter. */
+template <unsigned int ImageDimension>
+struct WarpedGridThreadStruct
+  {
+  typedef itk::Vector<float, ImageDimension> VectorType;
+
+  const VectorType *  Field;
+  float *             Output;
+  itk::SizeValueType  Size[ImageDimension];
+  double              PhysicalPointToIndex[ImageDimension][ImageDimension];
+  std::vector<double> Profiles[ImageDimension];
+  double              Scale;
+  double              EdgePaddingValue;
+  itk::SizeValueType  NumberOfLines;
+  };
+
+/** The warped grid along the lines of the fastest dimension of a range. */
+template <unsigned int ImageDimension>
+ITK_THREAD_RETURN_TYPE WarpedGridThreaderCallback( void *arg )
+{
+  typedef WarpedGridThreadStruct<ImageDimension> ThreadStructType;
+  typedef typename ThreadStructType::VectorType  VectorType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const itk::SizeValueType first = str->NumberOfLines * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType last = str->NumberOfLines * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  double index[ImageDimension];
+  for( itk::SizeValueType line = first; line < last; line++ )
+    {
+    itk::SizeValueType remainder = line;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      index[d] = static_cast<double>( remainder % str->Size[d] );
+      remainder /= str->Size[d];
+      }
+
+    const VectorType *field = str->Field + line * str->Size[0];
+    float *           output = str->Output + line * str->Size[0];
+    for( itk::SizeValueType i = 0; i < str->Size[0]; i++ )
+      {
+      index[0] = static_cast<double>( i );
+
+      double value = str->Scale;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        // the continuous index of the warped point, inside the buffer for
+        // the interpolator from -0.5 to size - 0.5
+        double c = index[d];
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          c += str->PhysicalPointToIndex[d][j] * field[i][j];
+          }
+        const double size = static_cast<double>( str->Size[d] );
+        if( !( c >= -0.5 && c < size - 0.5 ) )
+          {
+          value = str->EdgePaddingValue;
+          break;
+          }
+
+        // as itk::LinearInterpolateImageFunction at the borders
+        const std::vector<double> & profile = str->Profiles[d];
+        const itk::IndexValueType   base = std::max( static_cast<itk::IndexValueType>( std::floor( c ) ),
+                                                     static_cast<itk::IndexValueType>( 0 ) );
+        const double distance = c - static_cast<double>( base );
+        if( distance <= 0.0 || base + 1 >= static_cast<itk::IndexValueType>( str->Size[d] ) )
+          {
+          value *= profile[base];
+          }
+        else
+          {
+          value *= profile[base] + ( profile[base + 1] - profile[base] ) * distance;
+          }
+        }
+      output[i] = static_cast<float>( value );
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
 
 template <unsigned int ImageDimension>
 int CreateWarpedGridImage( int argc, char *argv[] )
@@ -27,11 +112,10 @@ int CreateWarpedGridImage( int argc, char *argv[] )
   reader->SetFileName( argv[2] );
   reader->Update();
 
+  typename VectorImageType::Pointer field = reader->GetOutput();
+  const typename VectorImageType::SizeType size = field->GetLargestPossibleRegion().GetSize();
+
   typedef itk::GridImageSource<RealImageType> GridSourceType;
-  typename GridSourceType::Pointer gridder = GridSourceType::New();
-  gridder->SetSpacing( reader->GetOutput()->GetSpacing() );
-  gridder->SetOrigin( reader->GetOutput()->GetOrigin() );
-  gridder->SetSize( reader->GetOutput()->GetLargestPossibleRegion().GetSize() );
 
   typename GridSourceType::ArrayType gridSpacing;
   typename GridSourceType::ArrayType gridSigma;
@@ -61,8 +145,7 @@ int CreateWarpedGridImage( int argc, char *argv[] )
     }
   for( unsigned int i = 0; i < ImageDimension; i++ )
     {
-    gridSpacing[i] = reader->GetOutput()->GetLargestPossibleRegion().GetSize()[i]
-      * reader->GetOutput()->GetSpacing()[i] / 25.0;
+    gridSpacing[i] = size[i] * field->GetSpacing()[i] / 25.0;
     gridSigma[i] = gridSpacing[i] / 10.0;
     }
   if( argc > 5 )
@@ -101,32 +184,84 @@ int CreateWarpedGridImage( int argc, char *argv[] )
       }
     }
 
-  gridder->SetGridSpacing( gridSpacing );
-  gridder->SetSigma( gridSigma );
-  gridder->SetWhichDimensions( which );
-  gridder->Update();
-  typename RealImageType::Pointer grid = gridder->GetOutput();
-  grid->SetDirection(reader->GetOutput()->GetDirection() );
-  grid->SetOrigin(reader->GetOutput()->GetOrigin() );
-  grid->SetSpacing(reader->GetOutput()->GetSpacing() );
-
-  typedef itk::MatrixOffsetTransformBase<double, ImageDimension,
-                                         ImageDimension>
-    TransformType;
-  typedef itk::WarpImageMultiTransformFilter<RealImageType, RealImageType, VectorImageType, TransformType> WarperType;
-  typename WarperType::Pointer  warper = WarperType::New();
-  warper->SetInput(grid);
-  warper->SetEdgePaddingValue( 0);
-  warper->SetSmoothScale(1);
-  warper->PushBackDisplacementFieldTransform(reader->GetOutput() );
-  warper->SetOutputParametersFromImage(  reader->GetOutput() );
-  warper->Update();
+  WarpedGridThreadStruct<ImageDimension> str;
+  str.Field = field->GetBufferPointer();
+  str.NumberOfLines = 1;
+
+  // the profile of each axis is the grid of a source which is one voxel
+  // thick along the other axes and unscaled
+  str.Scale = GridSourceType::New()->GetScale();
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    str.Size[i] = size[i];
+    if( i > 0 )
+      {
+      str.NumberOfLines *= size[i];
+      }
+
+    str.Profiles[i].assign( size[i], 1.0 );
+    if( !which[i] )
+      {
+      continue;
+      }
+
+    typename GridSourceType::SizeType profileSize;
+    profileSize.Fill( 1 );
+    profileSize[i] = size[i];
+
+    typename GridSourceType::BoolArrayType profileWhich;
+    profileWhich.Fill( false );
+    profileWhich[i] = true;
+
+    typename GridSourceType::Pointer gridder = GridSourceType::New();
+    gridder->SetSpacing( field->GetSpacing() );
+    gridder->SetOrigin( field->GetOrigin() );
+    gridder->SetSize( profileSize );
+    gridder->SetGridSpacing( gridSpacing );
+    gridder->SetSigma( gridSigma );
+    gridder->SetWhichDimensions( profileWhich );
+    gridder->SetScale( 1.0 );
+    gridder->Update();
+
+    const RealType *profile = gridder->GetOutput()->GetBufferPointer();
+    for( unsigned int j = 0; j < size[i]; j++ )
+      {
+      str.Profiles[i][j] = profile[j];
+      }
+    }
+
+  // the warped point x + u(x) in continuous index:  index + M u
+  const typename VectorImageType::DirectionType & physicalPointToIndex = field->GetPhysicalPointToIndex();
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      str.PhysicalPointToIndex[i][j] = physicalPointToIndex[i][j];
+      }
+    }
+
+  // itk::WarpImageMultiTransformFilter pads with the first voxel of the grid
+  str.EdgePaddingValue = str.Scale;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    str.EdgePaddingValue *= str.Profiles[i][0];
+    }
+
+  typename RealImageType::Pointer warpedGrid = AllocImage<RealImageType>( field );
+  str.Output = warpedGrid->GetBufferPointer();
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                      threader->GetNumberOfThreads() ), str.NumberOfLines ),
+                                          static_cast<itk::SizeValueType>( 1 ) ) );
+  threader->SetSingleMethod( WarpedGridThreaderCallback<ImageDimension>, &str );
+  threader->SingleMethodExecute();
 
   std::string file = std::string( argv[3] );
   typedef itk::ImageFileWriter<RealImageType> ImageWriterType;
   typename ImageWriterType::Pointer gridWriter = ImageWriterType::New();
   gridWriter->SetFileName( file.c_str() );
-  gridWriter->SetInput( warper->GetOutput() );
+  gridWriter->SetInput( warpedGrid );
   gridWriter->Update();
 
   return EXIT_SUCCESS;
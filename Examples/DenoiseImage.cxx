@@ -260,6 +260,34 @@ int Denoise( itk::ants::CommandLineParser *parser )
     }
   denoiser->SetNeighborhoodPatchRadius( neighborhoodPatchRadius );
 
+  typename OptionType::Pointer algorithmOption = parser->GetOption( "algorithm" );
+  if( algorithmOption && algorithmOption->GetNumberOfFunctions() )
+    {
+    std::string algorithm = algorithmOption->GetFunction( 0 )->GetName();
+    ConvertToLowerCase( algorithm );
+
+    if( std::strcmp( algorithm.c_str(), "blockwise" ) == 0 )
+      {
+      denoiser->SetDenoisingAlgorithm( DenoiserType::Blockwise );
+      if( algorithmOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+        {
+        denoiser->SetBlockStep( parser->Convert<unsigned int>( algorithmOption->GetFunction( 0 )->GetParameter( 0 ) ) );
+        }
+      }
+    else if( std::strcmp( algorithm.c_str(), "pixelwise" ) == 0 )
+      {
+      denoiser->SetDenoisingAlgorithm( DenoiserType::Pixelwise );
+      }
+    else
+      {
+      if( verbose )
+        {
+        std::cerr << "Unrecognized denoising algorithm:  " << algorithm << ".  See help menu." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    }
+
   /**
    * The parameters below are the default parameters taken from Jose's original
    *   code.  I don't have a good handle on them so I'm hiding them from the
@@ -467,6 +495,25 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Blockwise denoising averages whole patches and adds them to every " )
+    + std::string( "voxel they cover.  With a block step larger than 1, only every " )
+    + std::string( "step-th voxel (at most the patch width) is used as a patch center, " )
+    + std::string( "which reduces the computation time by about step^dimension.  " )
+    + std::string( "Pixelwise denoising only estimates the center voxel of each patch " )
+    + std::string( "and computes the patch distances with running sums, so the cost " )
+    + std::string( "does not depend on the patch radius.  Default = Blockwise[1]." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "algorithm" );
+  option->SetShortName( 'a' );
+  option->SetUsageOption( 0, "(Blockwise)[<blockStep=1>]" );
+  option->SetUsageOption( 1, "Pixelwise" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
 
   {
   std::string description =
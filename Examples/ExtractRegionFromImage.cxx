@@ -27,7 +27,6 @@ int ExtractRegionFromImage( int argc, char *argv[] )
   typedef itk::Image<PixelType, ImageDimension> ImageType;
 
   typename ImageType::Pointer inputImage = ImageType::New();
-  ReadImage<ImageType>( inputImage, argv[2] );
 
   typename ImageType::RegionType region;
   typename ImageType::RegionType::SizeType regionSize;
@@ -45,9 +44,17 @@ int ExtractRegionFromImage( int argc, char *argv[] )
       }
     region.SetSize( regionSize );
     region.SetIndex( regionIndex );
+
+    // only the extracted region has to be read
+    if( !ReadImageRegion<ImageType>( inputImage, argv[2], region ) )
+      {
+      return EXIT_FAILURE;
+      }
     }
   else if ( argc == 7 )
     {
+    ReadImage<ImageType>( inputImage, argv[2] );
+
     typename ImageType::Pointer labimg;
     ReadImage<ImageType>( labimg, argv[5] );
     typedef itk::Image<unsigned short, ImageDimension>      ShortImageType;
@@ -67,6 +74,8 @@ int ExtractRegionFromImage( int argc, char *argv[] )
     }
   else
     {
+    ReadImage<ImageType>( inputImage, argv[2] );
+
     typename ImageType::Pointer domainImage = ITK_NULLPTR;
     ReadImage<ImageType>( domainImage, argv[4] );
 
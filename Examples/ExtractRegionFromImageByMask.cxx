@@ -4,13 +4,11 @@
 
 #include <stdio.h>
 
-#include "itkCastImageFilter.h"
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkExtractImageFilter.h"
-#include "itkLabelStatisticsImageFilter.h"
+
+#include "antsCropRegion.h"
 
 #include <string>
 #include <vector>
@@ -29,81 +27,69 @@ int ExtractRegionFromImageByMask(int argc, char *argv[])
   reader->SetFileName(argv[2]);
   reader->Update();
 
-  typename ImageType::RegionType region;
-  typename ImageType::RegionType::SizeType size;
-  typename ImageType::RegionType::IndexType index;
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(argv[3]);
 
-  if( 0 )
+  CropRegion<ImageDimension> crop;
+
+  if( std::string( argv[4] ) == std::string( "--uncrop" ) )
     {
-    std::vector<int> minIndex;
-    std::vector<int> maxIndex;
-    minIndex = ConvertVector<int>(std::string(argv[4]) );
-    maxIndex = ConvertVector<int>(std::string(argv[5]) );
-    for( unsigned int i = 0; i < ImageDimension; i++ )
+    // paste a cropped image back into the grid it was cropped from
+    if( !ReadCropRegion<ImageDimension>( argv[5], crop ) )
       {
-      index[i] = minIndex[i];
-      size[i] = maxIndex[i] - minIndex[i] + 1;
+      std::cerr << "Unable to read the crop region " << argv[5] << std::endl;
+      return EXIT_FAILURE;
       }
-    region.SetSize(size);
-    region.SetIndex(index);
-    }
-  else
-    {
-    typedef itk::Image<unsigned short, ImageDimension> ShortImageType;
-//    typedef itk::CastImageFilter<ImageType, ShortImageType> CasterType;
-//    typename CasterType::Pointer caster = CasterType::New();
-//    caster->SetInput(reader->GetOutput());
-//    caster->Update();
-
-    typedef itk::ImageFileReader<ShortImageType> ShortImageReaderType;
-    typename ShortImageReaderType::Pointer shortReader = ShortImageReaderType::New();
-    shortReader->SetFileName(argv[4]);
-    shortReader->Update();
-
-    // typedef itk::LabelStatisticsImageFilter<ShortImageType, ShortImageType>
-    typedef itk::LabelStatisticsImageFilter<ImageType, ShortImageType>
-      StatsFilterType;
-    typename StatsFilterType::Pointer stats = StatsFilterType::New();
-//    stats->SetLabelInput(caster->GetOutput());
-    stats->SetLabelInput(shortReader->GetOutput() );
-//    stats->SetInput(caster->GetOutput());
-    stats->SetInput(reader->GetOutput() );
-    stats->Update();
+    if( reader->GetOutput()->GetBufferedRegion().GetSize() != crop.Region.GetSize() )
+      {
+      std::cerr << "The size of " << argv[2] << " is not that of the crop region "
+                << crop.Region.GetSize() << std::endl;
+      return EXIT_FAILURE;
+      }
+    const PixelType fillValue = (argc >= 7) ? atof(argv[6]) : 0;
 
-    const unsigned int label = (argc >= 6) ? atoi(argv[5]) : 1;
-    region = stats->GetRegion(label);
+    writer->SetInput( UncropImage<ImageType>( reader->GetOutput(), crop, fillValue ) );
+    writer->Update();
 
-    std::cout << "bounding box of label=" << label
-             << " : " << region << std::endl;
+    return EXIT_SUCCESS;
+    }
 
-    const unsigned int padWidth = (argc >= 7) ? atoi(argv[6]) : 0;
+  typedef itk::Image<unsigned short, ImageDimension> ShortImageType;
 
-    region.PadByRadius(padWidth);
+  typedef itk::ImageFileReader<ShortImageType> ShortImageReaderType;
+  typename ShortImageReaderType::Pointer shortReader = ShortImageReaderType::New();
+  shortReader->SetFileName(argv[4]);
+  shortReader->Update();
 
-    std::cout << "padding radius = " << padWidth
-             << " : " << region << std::endl;
+  if( shortReader->GetOutput()->GetBufferedRegion() != reader->GetOutput()->GetBufferedRegion() )
+    {
+    std::cerr << "The label image and the input image must have the same size." << std::endl;
+    return EXIT_FAILURE;
+    }
 
-    region.Crop(reader->GetOutput()->GetBufferedRegion() );
+  const unsigned int label = (argc >= 6) ? atoi(argv[5]) : 1;
+  const unsigned int padWidth = (argc >= 7) ? atoi(argv[6]) : 0;
 
-    std::cout << "crop with original image region " << reader->GetOutput()->GetBufferedRegion()
-             << " : " << region << std::endl;
+  if( !GetLabelCropRegion<ShortImageType>( shortReader->GetOutput(), label, padWidth, crop ) )
+    {
+    std::cerr << "Label " << label << " is not in " << argv[4] << std::endl;
+    return EXIT_FAILURE;
     }
 
-  std::cout << "final cropped region: " << region << std::endl;
-
-  typedef itk::ExtractImageFilter<ImageType, ImageType> CropperType;
-  typename CropperType::Pointer cropper = CropperType::New();
-  cropper->SetInput(reader->GetOutput() );
-  cropper->SetExtractionRegion(region);
-  cropper->SetDirectionCollapseToSubmatrix();
-  cropper->Update();
+  std::cout << "bounding box of label=" << label
+           << " padded by radius " << padWidth
+           << " and cropped to the image: " << crop.Region << std::endl;
 
-  typedef itk::ImageFileWriter<ImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetInput(cropper->GetOutput() );
-  writer->SetFileName(argv[3]);
+  writer->SetInput( CropImage<ImageType>( reader->GetOutput(), crop ) );
   writer->Update();
 
+  if( argc >= 8 && !WriteCropRegion<ImageDimension>( crop, argv[7] ) )
+    {
+    std::cerr << "Unable to write the crop region " << argv[7] << std::endl;
+    return EXIT_FAILURE;
+    }
+
   return EXIT_SUCCESS;
 }
 
@@ -153,13 +139,17 @@ private:
 
   // antscout->set_stream( out_stream );
 
-  if( argc < 6 || argc > 7 )
+  if( argc < 6 || argc > 8 )
     {
     std::cout << "Extract a sub-region from image using the bounding"
       " box from a label image, with optional padding radius."
              << std::endl << "Usage : " << argv[0] << " ImageDimension "
-             << "inputImage outputImage labelMaskImage [label=1] [padRadius=0]"
-             << std::endl;
+             << "inputImage outputImage labelMaskImage [label=1] [padRadius=0] [cropRegionFile]"
+             << std::endl << "  The bounding boxes of all labels are found in one pass.  If cropRegionFile is"
+             << " given, where the crop lies in the input grid is written to it as text, so that an image"
+             << " on the cropped grid can be restored to full size with" << std::endl
+             << "        " << argv[0] << " ImageDimension croppedImage outputImage --uncrop cropRegionFile"
+             << " [fillValue=0]" << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
@@ -1,12 +1,11 @@
 #include "antsUtilities.h"
 #include "ReadWriteData.h"
+#include "antsConnectedComponentLabeler.h"
 
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 
 #include "itkBinaryThresholdImageFilter.h"
-#include "itkConnectedComponentImageFilter.h"
-#include "itkRelabelComponentImageFilter.h"
 #include "itkLabelGeometryImageFilter.h"
 #include "itkLabelPerimeterEstimationCalculator.h"
 #include "itkLabelStatisticsImageFilter.h"
@@ -53,69 +52,58 @@ int GetConnectedComponentsFeatureImages(int itkNotUsed( argc ), char* argv[] )
     prefactor *= spacing[d];
     }
 
-  typedef itk::RelabelComponentImageFilter<ImageType, ImageType> RelabelerType;
-  typename RelabelerType::Pointer relabeler = RelabelerType::New();
-  relabeler->SetInput( inputImage );
-  relabeler->Update();
+  // the connected parts of all labels at once, each with its own number,
+  // so that the geometry of all of them comes from a single pass
+  typedef ConnectedComponentLabeler<ImageType, ImageType> LabelerType;
+  LabelerType labeler;
+  labeler.SetInput( inputImage );
+  labeler.SetConnectEqualValuesOnly( true );
+  labeler.Update();
+  typename ImageType::Pointer components = labeler.GetOutput();
+
+  typedef itk::LabelGeometryImageFilter<ImageType, RealImageType> GeometryFilterType;
+  typename GeometryFilterType::Pointer geometry = GeometryFilterType::New();
+  geometry->SetInput( components );
+  geometry->CalculatePixelIndicesOff();
+  geometry->CalculateOrientedBoundingBoxOff();
+  geometry->CalculateOrientedLabelRegionsOff();
+  geometry->Update();
+
+  typedef itk::LabelPerimeterEstimationCalculator<ImageType> AreaFilterType;
+  typename AreaFilterType::Pointer area = AreaFilterType::New();
+  area->SetImage( components );
+  area->Compute();
+
+  // the features of each component, then the voxels
+  const unsigned long numberOfComponents = labeler.GetNumberOfComponents();
+  std::vector<float>  volumes( numberOfComponents + 1, 0.0 );
+  std::vector<float>  ratios( numberOfComponents + 1, 0.0 );
+  std::vector<float>  eccentricities( numberOfComponents + 1, 0.0 );
+  std::vector<float>  elongations( numberOfComponents + 1, 0.0 );
+  for( unsigned long label = 1; label <= numberOfComponents; label++ )
+    {
+    volumes[label] = prefactor * static_cast<float>( geometry->GetVolume( label ) );
+    ratios[label] = area->GetPerimeter( label ) / volumes[label];
+    eccentricities[label] = geometry->GetEccentricity( label );
+    elongations[label] = geometry->GetElongation( label );
+    }
 
-  for( unsigned int i = 1; i <= relabeler->GetNumberOfObjects(); i++ )
+  const PixelType *labels = components->GetBufferPointer();
+  const size_t     numberOfVoxels = components->GetBufferedRegion().GetNumberOfPixels();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
     {
-    typedef itk::BinaryThresholdImageFilter<ImageType, ImageType> ThresholderType;
-    typename ThresholderType::Pointer thresholder = ThresholderType::New();
-    thresholder->SetInput( relabeler->GetOutput() );
-    thresholder->SetLowerThreshold( i );
-    thresholder->SetUpperThreshold( i );
-    thresholder->SetInsideValue( 1 );
-    thresholder->SetOutsideValue( 0 );
-    thresholder->Update();
-
-    typedef itk::ConnectedComponentImageFilter<ImageType, ImageType> ConnectedComponentType;
-    typename ConnectedComponentType::Pointer filter = ConnectedComponentType::New();
-    filter->SetInput( thresholder->GetOutput() );
-    filter->Update();
-
-    typename RelabelerType::Pointer relabeler2 = RelabelerType::New();
-    relabeler2->SetInput( filter->GetOutput() );
-    relabeler2->Update();
-
-    typedef itk::LabelGeometryImageFilter<ImageType, RealImageType> GeometryFilterType;
-    typename GeometryFilterType::Pointer geometry = GeometryFilterType::New();
-    geometry->SetInput( relabeler2->GetOutput() );
-    geometry->CalculatePixelIndicesOff();
-    geometry->CalculateOrientedBoundingBoxOff();
-    geometry->CalculateOrientedLabelRegionsOff();
-    geometry->Update();
-
-    typedef itk::LabelPerimeterEstimationCalculator<ImageType> AreaFilterType;
-    typename AreaFilterType::Pointer area = AreaFilterType::New();
-    area->SetImage( relabeler2->GetOutput() );
-    area->Compute();
-
-    itk::ImageRegionIteratorWithIndex<ImageType> It( relabeler->GetOutput(),
-      relabeler->GetOutput()->GetRequestedRegion() );
-    itk::ImageRegionIterator<ImageType> It2( relabeler2->GetOutput(),
-      relabeler2->GetOutput()->GetRequestedRegion() );
-
-    for( It.GoToBegin(), It2.GoToBegin(); !It.IsAtEnd(); ++It, ++It2 )
+    const int label = labels[n];
+    if( label != 0 )
       {
-      int label = It2.Get();
-      if( label != 0 )
-        {
-        typename ImageType::IndexType index = It.GetIndex();
-
-        // Output images:
-        // [0] = volume (in physical coordinates)
-        // [1] = volume / surface area
-        // [2] = eccentricity
-        // [3] = elongation
-
-        float volume = prefactor * static_cast<float>( geometry->GetVolume( label ) );
-
-        outputImages[0]->SetPixel( index, volume );
-        outputImages[1]->SetPixel( index, area->GetPerimeter( label ) / volume );
-        outputImages[2]->SetPixel( index, geometry->GetEccentricity( label ) );
-        outputImages[3]->SetPixel( index, geometry->GetElongation( label ) );
-        }
+      // Output images:
+      // [0] = volume (in physical coordinates)
+      // [1] = volume / surface area
+      // [2] = eccentricity
+      // [3] = elongation
+      outputImages[0]->GetBufferPointer()[n] = volumes[label];
+      outputImages[1]->GetBufferPointer()[n] = ratios[label];
+      outputImages[2]->GetBufferPointer()[n] = eccentricities[label];
+      outputImages[3]->GetBufferPointer()[n] = elongations[label];
       }
     }
 
@@ -11,6 +11,9 @@
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkExtractImageFilter.h"
 #include "itkTestingComparisonImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include <vector>
 
 namespace ants
 {
@@ -18,8 +21,72 @@ using namespace std;
 
 #define ITK_TEST_DIMENSION_MAX 6
 
+typedef itk::Image<double, ITK_TEST_DIMENSION_MAX> RegressionTestImageType;
+
 int RegressionTestImage(const char *, const char *, int, bool);
 
+int RegressionTestImage(const RegressionTestImageType *, const char *, const char *);
+
+struct RegressionTestThreadStruct
+  {
+  const RegressionTestImageType * TestImage;
+  const char *                    TestImageFilename;
+  std::vector<const char *>       BaselineFilenames;
+
+  // one entry per baseline; baselines that were not compared keep 2001
+  std::vector<int>                Statuses;
+
+  size_t                          NextBaseline;
+  bool                            FoundMatch;
+  itk::SimpleFastMutexLock        Mutex;
+  };
+
+/** Compares the test image to the baselines, one at a time per thread.
+ * The baselines are handed out in order and no new one is started after a
+ * match is found, so every baseline before the first match is compared. */
+ITK_THREAD_RETURN_TYPE RegressionTestThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  RegressionTestThreadStruct *          str = static_cast<RegressionTestThreadStruct *>( info->UserData );
+
+  // each comparison pipeline sets the requested region of its input, so
+  // every thread works on its own image sharing the pixels of the test image
+  RegressionTestImageType::Pointer testImage = RegressionTestImageType::New();
+  testImage->Graft( str->TestImage );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const size_t n = str->NextBaseline++;
+    const bool   foundMatch = str->FoundMatch;
+    str->Mutex.Unlock();
+    if( foundMatch || n >= str->BaselineFilenames.size() )
+      {
+      break;
+      }
+
+    int status = 1000;
+    try
+      {
+      status = RegressionTestImage( testImage, str->TestImageFilename, str->BaselineFilenames[n] );
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      std::cout << "Exception detected while comparing to " << str->BaselineFilenames[n] << " : "
+                << e.GetDescription() << std::endl;
+      }
+
+    str->Mutex.Lock();
+    str->Statuses[n] = status;
+    if( status == 0 )
+      {
+      str->FoundMatch = true;
+      }
+    str->Mutex.Unlock();
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
 // 'main()'
 int ImageCompare( std::vector<std::string> args, std::ostream* /*out_stream = NULL */ )
@@ -89,14 +156,53 @@ private:
       }
     else
       {
-      int currentStatus = 2001;
+      // read the test image once and compare it to the baselines in parallel
+      typedef itk::ImageFileReader<RegressionTestImageType> ReaderType;
+      ReaderType::Pointer testReader = ReaderType::New();
+      testReader->SetFileName(argv[1]);
+      try
+        {
+        testReader->UpdateLargestPossibleRegion();
+        }
+      catch( itk::ExceptionObject& e )
+        {
+        std::cout << "Exception detected while reading " << argv[1] << " : "  << e.GetDescription() << std::endl;
+        cout << 1000 << endl;
+        return 1000;
+        }
+
+      RegressionTestImageType::Pointer testImage = testReader->GetOutput();
+      testImage->DisconnectPipeline();
+
+      RegressionTestThreadStruct str;
+      str.TestImage = testImage;
+      str.TestImageFilename = argv[1];
       for( int i = 2; i < argc; i++ )
         {
-        currentStatus = RegressionTestImage(argv[1], argv[i], 0, false);
-        if( currentStatus < bestBaselineStatus )
+        str.BaselineFilenames.push_back( argv[i] );
+        }
+      str.Statuses.assign( str.BaselineFilenames.size(), 2001 );
+      str.NextBaseline = 0;
+      str.FoundMatch = false;
+
+      unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( str.BaselineFilenames.size() ) );
+      numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+      numberOfThreads = std::max( numberOfThreads, 1u );
+
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( RegressionTestThreaderCallback, &str );
+      threader->SingleMethodExecute();
+
+      // the first baseline with the smallest status, as a serial search
+      // would find
+      for( size_t n = 0; n < str.Statuses.size(); n++ )
+        {
+        if( str.Statuses[n] < bestBaselineStatus )
           {
-          bestBaselineStatus = currentStatus;
-          bestBaseline = i;
+          bestBaselineStatus = str.Statuses[n];
+          bestBaseline = static_cast<int>( n ) + 2;
           }
         if( bestBaselineStatus == 0 )
           {
@@ -136,12 +242,57 @@ private:
   return bestBaselineStatus;
 }
 
+// Compare an in-memory test image to a baseline file without reporting
+int RegressionTestImage(const RegressionTestImageType *testImage, const char *testImageFilename,
+                        const char *baselineImageFilename)
+{
+  typedef RegressionTestImageType         ImageType;
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+
+  ReaderType::Pointer baselineReader = ReaderType::New();
+  baselineReader->SetFileName(baselineImageFilename);
+  try
+    {
+    baselineReader->UpdateLargestPossibleRegion();
+    }
+  catch( itk::ExceptionObject& e )
+    {
+    std::cout << "Exception detected while reading " << baselineImageFilename << " : "  << e.GetDescription();
+    return 1000;
+    }
+
+  ImageType::SizeType baselineSize;
+  baselineSize = baselineReader->GetOutput()->GetLargestPossibleRegion().GetSize();
+  ImageType::SizeType testSize;
+  testSize = testImage->GetLargestPossibleRegion().GetSize();
+
+  if( baselineSize != testSize )
+    {
+    std::cout << "The size of the Baseline image and Test image do not match!" << std::endl;
+    std::cout << "Baseline image: " << baselineImageFilename
+             << " has size " << baselineSize << std::endl;
+    std::cout << "Test image:     " << testImageFilename
+             << " has size " << testSize << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  typedef itk::Testing::ComparisonImageFilter<ImageType, ImageType> DiffType;
+  DiffType::Pointer diff = DiffType::New();
+  diff->SetValidInput(baselineReader->GetOutput() );
+  diff->SetTestInput(testImage );
+  diff->SetDifferenceThreshold(2.0);
+  diff->UpdateLargestPossibleRegion();
+
+  double status = diff->GetTotalDifference();
+  return (status != EXIT_SUCCESS) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 // Regression Testing Code
 int RegressionTestImage(const char *testImageFilename, const char *baselineImageFilename,
                         int reportErrors, bool differences)
 {
   // Use the factory mechanism to read the test and baseline files and convert them to double
-  typedef itk::Image<double, ITK_TEST_DIMENSION_MAX>        ImageType;
+  typedef RegressionTestImageType                           ImageType;
   typedef itk::Image<unsigned char, ITK_TEST_DIMENSION_MAX> OutputType;
   typedef itk::Image<unsigned char, 2>                      DiffOutputType;
   typedef itk::ImageFileReader<ImageType>                   ReaderType;
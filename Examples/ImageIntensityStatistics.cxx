@@ -1,13 +1,10 @@
 #include "antsUtilities.h"
-#include "antsAllocImage.h"
-#include <algorithm>
 #include "ReadWriteData.h"
+#include "antsLabelIntensityStatistics.h"
 
-#include "itkImageRegionIterator.h"
-#include "itkLabelStatisticsImageFilter.h"
+#include <vnl/vnl_math.h>
 
-#include <vector>
-#include <algorithm>
+#include <cmath>
 #include <iomanip>
 
 namespace ants
@@ -15,103 +12,34 @@ namespace ants
 template <unsigned int ImageDimension>
 int ImageIntensityStatistics( int argc, char *argv[] )
 {
-  typedef int LabelType;
+  typedef int   LabelType;
   typedef float RealType;
 
   typedef itk::Image<LabelType, ImageDimension> LabelImageType;
-  typedef itk::Image<RealType, ImageDimension> RealImageType;
+  typedef itk::Image<RealType, ImageDimension>  RealImageType;
+
+  // the percentiles and the entropy are those of 200 bins over the range of
+  // the labeled intensities; the percentiles are read from a finer histogram
+  const unsigned int numberOfBins = 200;
+  const unsigned int numberOfBinsPerBin = 16;
 
   typename RealImageType::Pointer intensityImage = RealImageType::New();
   ReadImage<RealImageType>( intensityImage, argv[2] );
 
-  typename LabelImageType::Pointer labelImage = LabelImageType::New();
+  typename LabelImageType::Pointer labelImage = ITK_NULLPTR;
   if( argc > 3 )
     {
     ReadImage<LabelImageType>( labelImage, argv[3] );
     }
-  else
-    {
-    labelImage->CopyInformation( intensityImage );
-    labelImage->SetRegions( intensityImage->GetLargestPossibleRegion() );
-    labelImage->Allocate();
-    labelImage->FillBuffer( 1 );
-    }
-
-  std::vector<LabelType> labels;
-  itk::ImageRegionIterator<LabelImageType> It( labelImage, labelImage->GetLargestPossibleRegion() );
-
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    if( It.Get() != 0 &&
-      std::find( labels.begin(), labels.end(), It.Get() ) == labels.end() )
-      {
-      labels.push_back( It.Get() );
-      }
-    }
-  std::sort( labels.begin(), labels.end() );
-
-  RealType maxValue = itk::NumericTraits<RealType>::NonpositiveMin();
-  RealType minValue = itk::NumericTraits<RealType>::max();
-
-  itk::ImageRegionConstIterator<RealImageType> ItI( intensityImage, intensityImage->GetLargestPossibleRegion() );
-  for( ItI.GoToBegin(), It.GoToBegin(); !ItI.IsAtEnd(); ++ItI, ++It )
-    {
-    if( It.Get() == 0 )
-      {
-      continue;
-      }
-    RealType value = ItI.Get();
-
-    if( value < minValue )
-      {
-      minValue = value;
-      }
-    else if( value > maxValue )
-      {
-      maxValue = value;
-      }
-    }
 
-  typedef itk::LabelStatisticsImageFilter<RealImageType, LabelImageType> HistogramGeneratorType;
-  typename HistogramGeneratorType::Pointer stats = HistogramGeneratorType::New();
-  stats->SetInput( intensityImage );
-  stats->SetLabelInput( labelImage );
-  stats->UseHistogramsOn();
-  stats->SetHistogramParameters( 200, minValue, maxValue );
-  stats->Update();
+  typedef LabelIntensityStatisticsThreadStruct<LabelImageType, RealImageType> ThreadStructType;
+  typedef typename ThreadStructType::MapType                                   MapType;
 
-  // Calculate moments for skewness and kurtosis calculations
-
-  std::vector<RealType> m3( labels.size(), 0.0 );
-  std::vector<RealType> m4( labels.size(), 0.0 );
-  std::vector<RealType> N( labels.size(), 0.0 );
-  for( ItI.GoToBegin(), It.GoToBegin(); !ItI.IsAtEnd(); ++ItI, ++It )
-    {
-    LabelType label = It.Get();
-    if( label == 0 )
-      {
-      continue;
-      }
-    typename std::vector<LabelType>::iterator it =
-      std::find( labels.begin(), labels.end(), label );
-    if( it == labels.end() )
-      {
-      std::cerr << "Label not found.  Shouldn't get here." << std::endl;
-      return EXIT_FAILURE;
-      }
-    RealType difference = ItI.Get() - stats->GetMean( label );
-
-    unsigned long index = it - labels.begin();
-
-    m3[index] += ( difference * difference * difference );
-    m4[index] += ( m3[index] * difference );
-    N[index] += 1.0;
-    }
-  for( unsigned int n = 0; n < N.size(); n++ )
-    {
-    m3[n] /= N[n];
-    m4[n] /= N[n];
-    }
+  MapType statistics;
+  ComputeLabelIntensityStatistics<LabelImageType, RealImageType>( labelImage.GetPointer(),
+                                                                  intensityImage.GetPointer(), true,
+                                                                  numberOfBins * numberOfBinsPerBin,
+                                                                  statistics );
 
 //   std::cout << "                                       "
 //             << "************ Individual Labels *************" << std::endl;
@@ -127,52 +55,38 @@ int ImageIntensityStatistics( int argc, char *argv[] )
             << std::setw( 14 ) << "Min"
             << std::setw( 14 ) << "Max" << std::endl;
 
-  std::vector<LabelType>::iterator it;
-  for( it = labels.begin(); it != labels.end(); ++it )
+  for( typename MapType::const_iterator it = statistics.begin(); it != statistics.end(); ++it )
     {
-    typedef typename HistogramGeneratorType::HistogramType HistogramType;
-    const HistogramType *histogram = stats->GetHistogram( *it );
-
-    RealType fifthPercentileValue = histogram->Quantile( 0, 0.05 );
-    RealType ninetyFifthPercentileValue = histogram->Quantile( 0, 0.95 );
-    RealType entropy = 0.0;
-    for( unsigned int i = 0; i < histogram->Size(); i++ )
-      {
-      RealType p = static_cast<RealType>( histogram->GetFrequency( i, 0 )  )
-        / static_cast<RealType>( histogram->GetTotalFrequency() );
-      if ( p > 0 )
-        {
-        entropy += ( -p * std::log( p ) / std::log( 2.0 ) );
-        }
-      }
+    const LabelIntensityStatistics & labelStatistics = it->second;
 
-    typename std::vector<LabelType>::iterator it2 =
-      std::find( labels.begin(), labels.end(), *it );
-    unsigned long index = it2 - labels.begin();
+    const RealType N = static_cast<RealType>( labelStatistics.m_Count );
+    const RealType sigma = labelStatistics.GetSigma();
 
-    RealType m2 = vnl_math_sqr( stats->GetSigma( *it ) );
-    RealType k2 = ( N[index] ) / ( N[index] - 1.0 ) * m2;
+    RealType m2 = vnl_math_sqr( sigma );
+    RealType m3 = labelStatistics.GetCentralMoment( 3 );
+    RealType m4 = labelStatistics.GetCentralMoment( 4 );
+    RealType k2 = ( N ) / ( N - 1.0 ) * m2;
 
-    RealType prefactor3 = vnl_math_sqr( N[index] ) / ( ( N[index] - 1.0 ) * ( N[index] - 2.0 ) );
-    RealType k3 = prefactor3 * m3[index];
+    RealType prefactor3 = vnl_math_sqr( N ) / ( ( N - 1.0 ) * ( N - 2.0 ) );
+    RealType k3 = prefactor3 * m3;
 
-    RealType prefactor4 = vnl_math_sqr( N[index] ) / ( ( N[index] - 1.0 ) * ( N[index] - 2.0 ) * ( N[index] - 3.0 ) );
-    RealType k4 = prefactor4 * ( ( N[index] + 1 ) * m4[index] - 3 * ( N[index] - 1 ) * vnl_math_sqr( m2 ) );
+    RealType prefactor4 = vnl_math_sqr( N ) / ( ( N - 1.0 ) * ( N - 2.0 ) * ( N - 3.0 ) );
+    RealType k4 = prefactor4 * ( ( N + 1 ) * m4 - 3 * ( N - 1 ) * vnl_math_sqr( m2 ) );
 
     RealType skewness = k3 / std::sqrt( k2 * k2 * k2 );
     RealType kurtosis = k4 / vnl_math_sqr( k2 );
 
-    std::cout << std::setw( 8  ) << *it;
-    std::cout << std::setw( 14 ) << stats->GetMean( *it );
-    std::cout << std::setw( 14 ) << stats->GetSigma( *it );
+    std::cout << std::setw( 8  ) << it->first;
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.GetMean() );
+    std::cout << std::setw( 14 ) << sigma;
     std::cout << std::setw( 14 ) << skewness;
     std::cout << std::setw( 14 ) << kurtosis;
-    std::cout << std::setw( 14 ) << entropy;
-    std::cout << std::setw( 14 ) << stats->GetSum( *it );
-    std::cout << std::setw( 14 ) << fifthPercentileValue;
-    std::cout << std::setw( 14 ) << ninetyFifthPercentileValue;
-    std::cout << std::setw( 14 ) << stats->GetMinimum( *it );
-    std::cout << std::setw( 14 ) << stats->GetMaximum( *it );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.GetEntropy( numberOfBins ) );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.m_Sum );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.GetQuantile( 0.05 ) );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.GetQuantile( 0.95 ) );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.m_Minimum );
+    std::cout << std::setw( 14 ) << static_cast<RealType>( labelStatistics.m_Maximum );
     std::cout << std::endl;
     }
 
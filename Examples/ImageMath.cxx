@@ -18,6 +18,8 @@
 #include "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
 #include "antsAllocImage.h"
+#include "antsLabelGeometry.h"
+#include "antsLabelIntensityStatistics.h"
 #include "antsSCCANObject.h"
 #include "itkAlternatingValueDifferenceImageFilter.h"
 #include "itkAlternatingValueSimpleSubtractionImageFilter.h"
@@ -49,7 +51,6 @@
 #include "itkFastMarchingExtensionImageFilterBase.h"
 #include "itkFastMarchingExtensionImageFilter.h"
 #include "itkGaussianImageSource.h"
-#include "itkGradientAnisotropicDiffusionImageFilter.h"
 #include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
 #include "itkHessianRecursiveGaussianImageFilter.h"
 #include "itkHistogram.h"
@@ -107,7 +108,6 @@
 #include "itkSliceTimingCorrectionImageFilter.h"
 #include "itkSphereSpatialFunction.h"
 #include "itkSplitAlternatingTimeSeriesImageFilter.h"
-#include "itkSTAPLEImageFilter.h"
 #include "itkSubtractImageFilter.h"
 #include "itkSumProjectionImageFilter.h"
 #include "itkTDistribution.h"
@@ -131,6 +131,15 @@
 #include <string>
 
 #include "ReadWriteData.h"
+#include "iMathFunctions.h"
+#include "antsConnectedComponentLabeler.h"
+#include "antsGeodesicLabelPropagation.h"
+#include "antsLabelVotingFusion.h"
+#include "antsMaskedPoissonSolver.h"
+#include "antsVoxelMatrixFile.h"
+#include "itkMultiThreader.h"
+#include "itkMutexLockHolder.h"
+#include "itkSimpleFastMutexLock.h"
 #include "TensorFunctions.h"
 #include "antsMatrixUtilities.h"
 #include "antsFastMarchingImageFilter.h"
@@ -384,7 +393,6 @@ int GetLargestComponent(int argc, char *argv[])
 {
   typedef float                                                           PixelType;
   typedef itk::Image<PixelType, ImageDimension>                           ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                    Iterator;
 
   int               argct = 2;
   const std::string outname = std::string(argv[argct]);
@@ -406,104 +414,26 @@ int GetLargestComponent(int argc, char *argv[])
     volumeelement *= spacing[i];
     }
 
-  typedef itk::Image<unsigned long, ImageDimension>                          labelimagetype;
-  typedef ImageType                                                          InternalImageType;
-  typedef itk::BinaryThresholdImageFilter<InternalImageType, labelimagetype> ThresholdFilterType;
-  typedef itk::ConnectedComponentImageFilter<labelimagetype, labelimagetype> FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, ImageType>        RelabelType;
-
-  typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
-  typename FilterType::Pointer filter = FilterType::New();
-  typename RelabelType::Pointer relabel = RelabelType::New();
-
-  //  InternalPixelType threshold_low, threshold_hi;
-
-  threshold->SetInput(image1);
-  threshold->SetInsideValue(1);
-  threshold->SetOutsideValue(0);
-  threshold->SetLowerThreshold(0.25);
-  threshold->SetUpperThreshold(1.e9);
-  threshold->Update();
-
-  filter->SetInput(threshold->GetOutput() );
-  filter->SetFullyConnected( 0 );
-  filter->Update();
-  relabel->SetInput( filter->GetOutput() );
-  relabel->SetMinimumObjectSize( smallest );
-  //    relabel->SetUseHistograms(true);
-
-  try
-    {
-    relabel->Update();
-    }
-  catch( itk::ExceptionObject & excep )
-    {
-    // std::cout << "Relabel: exception caught !" << std::endl;
-    // std::cout << excep << std::endl;
-    }
-
-  //  WriteImage<ImageType>(relabel->GetOutput(),outname.c_str());
-  //  return 0;
-  typename ImageType::Pointer Clusters = MakeNewImage<ImageType>(relabel->GetOutput(), 0);
-  // typename ImageType::Pointer Clusters=relabel->GetOutput();
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  Iterator vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
-
-  float maximum = relabel->GetNumberOfObjects();
-  float                     maxtstat = 0;
-  std::vector<unsigned int> histogram( (int)maximum + 1);
-  std::vector<float>        clustersum( (int)maximum + 1);
-  for( int i = 0; i <= maximum; i++ )
-    {
-    histogram[i] = 0;
-    clustersum[i] = 0;
-    }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-    {
-    if( vfIter.Get() > 0 )
-      {
-      float vox = image1->GetPixel(vfIter.GetIndex() );
-      histogram[(unsigned int)vfIter.Get()] = histogram[(unsigned int)vfIter.Get()] + 1;
-      clustersum[(unsigned int)vfIter.Get()] += vox;
-      if( vox > maxtstat )
-        {
-        maxtstat = vox;
-        }
-      }
-    }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-    {
-    if( vfIter.Get() > 0 )
-      {
-      Clusters->SetPixel( vfIter.GetIndex(), histogram[(unsigned int)vfIter.Get()]  );
-      //  if ( Clusters->GetPixel( vfIter.GetIndex() ) > maximgval )
-      //    maximgval=Clusters->GetPixel( vfIter.GetIndex());
-      }
-    else
-      {
-      Clusters->SetPixel(vfIter.GetIndex(), 0);
-      }
-    }
+  // keep the largest of the components >= 0.25 (all of them if they tie)
+  ConnectedComponentLabeler<ImageType> labeler;
+  labeler.SetInput( image1 );
+  labeler.SetLowerThreshold( 0.25 );
+  labeler.SetFullyConnected( false );
+  labeler.SetMinimumComponentSize( smallest );
+  labeler.Update();
 
-  float maximgval = 0;
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  unsigned long largest = 0;
+  if( labeler.GetNumberOfComponents() > 0 )
     {
-    if( Clusters->GetPixel( vfIter.GetIndex() ) > maximgval )
-      {
-      maximgval = Clusters->GetPixel( vfIter.GetIndex() );
-      }
+    largest = labeler.GetStatistics( 1 ).NumberOfVoxels;
     }
-
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  const unsigned long *components = labeler.GetOutput()->GetBufferPointer();
+  PixelType *          values = image1->GetBufferPointer();
+  const size_t         numberOfVoxels = image1->GetBufferedRegion().GetNumberOfPixels();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
     {
-    if( Clusters->GetPixel( vfIter.GetIndex() ) >= maximgval )
-      {
-      image1->SetPixel( vfIter.GetIndex(), 1);
-      }
-    else
-      {
-      image1->SetPixel( vfIter.GetIndex(), 0);
-      }
+    const bool keep = components[n] > 0 && labeler.GetStatistics( components[n] ).NumberOfVoxels >= largest;
+    values[n] = keep ? 1 : 0;
     }
 
   if( outname.length() > 3 )
@@ -522,10 +452,6 @@ int ClusterThresholdVariate(int argc, char *argv[])
 
   typedef unsigned long                                                    ULPixelType;
   typedef itk::Image<ULPixelType, ImageDimension>                          labelimagetype;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                     fIterator;
-  typedef itk::ImageRegionIteratorWithIndex<labelimagetype>                labIterator;
-  typedef itk::ConnectedComponentImageFilter<ImageType, labelimagetype>    FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, labelimagetype> RelabelType;
 
   int               argct = 2;
   const std::string outname = std::string(argv[argct]);
@@ -541,75 +467,35 @@ int ClusterThresholdVariate(int argc, char *argv[])
   ReadImage<ImageType>(image, fn1.c_str() );
   typename ImageType::Pointer mask = ITK_NULLPTR;
   ReadImage<ImageType>(mask, maskfn.c_str() );
-  typename FilterType::Pointer filter = FilterType::New();
-  typename RelabelType::Pointer relabel = RelabelType::New();
-  filter->SetInput( image );
-  filter->SetFullyConnected( 0 );
-  relabel->SetInput( filter->GetOutput() );
-  relabel->SetMinimumObjectSize( 1 );
-  try
-    {
-    relabel->Update();
-    }
-  catch( itk::ExceptionObject & excep )
-    {
-    // std::cout << "Relabel: exception caught !" << std::endl;
-    // std::cout << excep << std::endl;
-    }
-
-  labIterator                vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
-  float                      maximum = relabel->GetNumberOfObjects();
-  std::vector<unsigned long> histogram( (int)maximum + 1);
-  for( int i = 0; i <= maximum; i++ )
-    {
-    histogram[i] = 0;
-    }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-    {
-    float vox = vfIter.Get();
-    if( vox > 0 )
-      {
-      if( vox > 0 )
-        {
-        histogram[(unsigned long)vox] = histogram[(unsigned long)vox] + 1;
-        }
-      }
-    }
+  ConnectedComponentLabeler<ImageType, labelimagetype> labeler;
+  labeler.SetInput( image );
+  labeler.SetFullyConnected( false );
+  labeler.Update();
 
-  // get the largest component's size
+  // the components are numbered by decreasing size
   unsigned long largest_component_size = 0;
-  for( int i = 0; i <= maximum; i++ )
+  if( labeler.GetNumberOfComponents() > 0 )
     {
-    if( largest_component_size < histogram[i] )
-      {
-      largest_component_size = histogram[i];
-      }
+    largest_component_size = labeler.GetStatistics( 1 ).NumberOfVoxels;
     }
 
   if(  largest_component_size < minclustersize )
     {
     minclustersize = largest_component_size - 1;
     }
-//  now create the output vector
-// iterate through the image and set the voxels where  countinlabel[(unsigned
-// long)(labelimage->GetPixel(vfIter.GetIndex()) - min)]
-// is < MinClusterSize
-  unsigned long vecind = 0;
-  fIterator     mIter( mask,  mask->GetLargestPossibleRegion() );
-  for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+//  now zero the voxels of the mask in clusters of at most MinClusterSize
+  const ULPixelType *components = labeler.GetOutput()->GetBufferPointer();
+  const PixelType *  maskValues = mask->GetBufferPointer();
+  PixelType *        values = image->GetBufferPointer();
+  const size_t       numberOfVoxels = image->GetBufferedRegion().GetNumberOfPixels();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
     {
-    if( mIter.Get() > 0 )
+    if( maskValues[n] > 0 )
       {
-      float vox = mask->GetPixel(vfIter.GetIndex() );
-      if( vox >= 0  )
+      const unsigned long clustersize = components[n] > 0 ? labeler.GetStatistics( components[n] ).NumberOfVoxels : 0;
+      if( clustersize <= minclustersize )
         {
-        const unsigned long clustersize =
-          histogram[(unsigned long)(relabel->GetOutput()->GetPixel(mIter.GetIndex() ) )];
-        if( clustersize <= minclustersize )
-          {
-          image->SetPixel( mIter.GetIndex(), 0 );
-          }
-        vecind++;
+        values[n] = 0;
         }
       }
     }
@@ -1842,6 +1728,11 @@ int NeighborhoodStats( int itkNotUsed( argc ), char * argv[] )
       indexSelectionFilter->SetIndex( 7 );
       break;
       }
+    case 8:
+      {
+      indexSelectionFilter->SetIndex( 8 );
+      break;
+      }
     default:
       {
       std::cerr << "Unrecognized option: " << whichStat << std::endl;
@@ -2614,12 +2505,6 @@ int SliceTimingCorrection(int argc, char *argv[])
 
   typedef itk::SliceTimingCorrectionImageFilter<InputImageType, OutputImageType> ImageFilterType;
 
-  typedef itk::BSplineInterpolateImageFunction<InputImageType, double> BSplineInterpolatorType;
-  typedef typename BSplineInterpolatorType::Pointer                    BSplineInterpolatorPointerType;
-
-  typedef itk::WindowedSincInterpolateImageFunction<InputImageType, ImageDimension - 1> SincInterpolatorType;
-  typedef typename SincInterpolatorType::Pointer                                        SincInterpolatorPointerType;
-
   if( argc < 5 )
     {
     std::cout
@@ -2656,8 +2541,8 @@ int SliceTimingCorrection(int argc, char *argv[])
         }
       // std::cout << "Using sinc interpolation of radius " << sincRadius << std::endl;
 
-      SincInterpolatorPointerType sInterp = SincInterpolatorType::New();
-      filter->SetInterpolator( sInterp );
+      filter->SetTimeInterpolation( ImageFilterType::WindowedSincInterpolation );
+      filter->SetSincRadius( sincRadius );
       filter->SetIndexPadding( sincRadius );
       }
     else if( strcmp( "bspline", interp.c_str() ) == 0 )
@@ -2669,10 +2554,8 @@ int SliceTimingCorrection(int argc, char *argv[])
         }
       // std::cout << "Using bspline interpolation of order " << order << std::endl;
 
-      BSplineInterpolatorPointerType interpB = BSplineInterpolatorType::New();
-      interpB->SetSplineOrder( order );
-
-      filter->SetInterpolator( interpB );
+      filter->SetTimeInterpolation( ImageFilterType::BSplineInterpolation );
+      filter->SetSplineOrder( order );
       filter->SetIndexPadding( 1 );
       }
     else
@@ -2946,6 +2829,55 @@ int TimeSeriesRegionSCCA(int argc, char *argv[])
   return 0;
 }
 
+struct TimeSeriesRegionCorrThreadStruct
+  {
+  const vnl_matrix<double> *TimeSignals; // demeaned, unit norm region time courses
+  const std::vector<bool> * UseLabel;
+  float *                   Connectivity;
+  };
+
+ITK_THREAD_RETURN_TYPE TimeSeriesRegionCorrThreadCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  TimeSeriesRegionCorrThreadStruct *    str = static_cast<TimeSeriesRegionCorrThreadStruct *>( info->UserData );
+
+  const vnl_matrix<double> & timeSig = *str->TimeSignals;
+  const unsigned int         nLabels = timeSig.rows();
+  const unsigned int         nTimes = timeSig.cols();
+
+  // rows are dealt out round robin as row i has nLabels - i - 1 pairs
+  for( unsigned int i = info->ThreadID; i < nLabels; i += info->NumberOfThreads )
+    {
+    if( !( *str->UseLabel )[i] )
+      {
+      continue;
+      }
+    const double *p = timeSig[i];
+    for( unsigned int j = i + 1; j < nLabels; j++ )
+      {
+      if( !( *str->UseLabel )[j] )
+        {
+        continue;
+        }
+      const double *q = timeSig[j];
+
+      double corr = 0.0;
+      for( unsigned int t = 0; t < nTimes; t++ )
+        {
+        corr += p[t] * q[t];
+        }
+      if( !vnl_math_isfinite( corr ) )
+        {
+        corr = 0.0;
+        }
+
+      str->Connectivity[i + static_cast<size_t>( j ) * nLabels] = corr;
+      str->Connectivity[j + static_cast<size_t>( i ) * nLabels] = corr;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int TimeSeriesRegionCorr(int argc, char *argv[])
 {
@@ -3002,81 +2934,74 @@ int TimeSeriesRegionCorr(int argc, char *argv[])
   connmat->Allocate();
   connmat->FillBuffer(-1);
 
+  // the region means in one pass over the voxels; each voxel's time course
+  // is a contiguous row of the time image
+  const unsigned int *labelBuffer = labels->GetBufferPointer();
+  const PixelType *   timeBuffer = time->GetBufferPointer();
+
   MatrixType timeSig( nLabels, nTimes, 0.0 );
-  for( unsigned int i = 0; i < nLabels; i++ )
+  for( unsigned int v = 0; v < nVoxels; v++ )
     {
-    typename LabelImageType::IndexType idx;
-    idx[1] = 0;
-    for( unsigned int v = 0; v < nVoxels; v++ )
+    const unsigned int label = labelBuffer[v];
+    if( label == 0 || label > nLabels )
       {
-      idx[0] = v;
-      if( labels->GetPixel(idx) == (i + 1) )
-        {
-        labelCounts[i]++;
-
-        typename InputImageType::IndexType timeIdx;
-        timeIdx[1] = v;
-        for( unsigned int t = 0; t < nTimes; t++ )
-          {
-          timeIdx[0] = t;
-          timeSig(i, t) += time->GetPixel(timeIdx);
-          }
-        }
+      continue;
       }
-    }
-  for( unsigned int i = 0; i < nLabels; i++ )
-    {
-    for( unsigned int j = 0; j < nTimes; j++ )
+    labelCounts[label - 1]++;
+
+    double *         row = timeSig[label - 1];
+    const PixelType *course = timeBuffer + static_cast<size_t>( v ) * nTimes;
+    for( unsigned int t = 0; t < nTimes; t++ )
       {
-      timeSig(i, j) /= labelCounts[i];
+      row[t] += course[t];
       }
     }
+
+  // demean and scale each region's mean time course to unit norm, so that
+  // the correlations are plain dot products of the rows
+  std::vector<bool> useLabel( nLabels, false );
   for( unsigned int i = 0; i < nLabels; i++ )
     {
-    for( unsigned int j = (i + 1); j < nLabels; j++ )
+    if( labelCounts[i] <= minRegionSize )
       {
+      continue;
+      }
+    useLabel[i] = true;
 
-      if( (labelCounts[i] > minRegionSize) && (labelCounts[j] > minRegionSize ) )
-        {
-        VectorType p = timeSig.get_row(i);
-        VectorType q = timeSig.get_row(j);
-
-        double corr = 0.0;
-        double xysum = 0;
-        for( unsigned int z = 0; z < p.size(); z++ )
-          {
-          xysum += (p[z] * q[z]);
-          }
-
-        double frac = 1.0 / (double)p.size();
-        double xsum = p.sum();
-        double ysum = q.sum();
-        double xsqr = p.squared_magnitude();
-        double ysqr = q.squared_magnitude();
-        double numer = xysum - frac * xsum * ysum;
-        double denom = sqrt( ( xsqr - frac * xsum * xsum) * ( ysqr - frac * ysum * ysum) );
-        if( denom > 0 )
-          {
-          corr = numer / denom;
-          }
-        if( !vnl_math_isfinite( corr ) )
-          {
-          corr = 0.0;
-          }
-
-        typename InputImageType::IndexType connIdx;
-        connIdx[0] = i;
-        connIdx[1] = j;
-        connmat->SetPixel( connIdx, corr );
-        connIdx[0] = j;
-        connIdx[1] = i;
-        connmat->SetPixel( connIdx, corr );
-
-        }
+    double *row = timeSig[i];
+    double  mean = 0.0;
+    for( unsigned int t = 0; t < nTimes; t++ )
+      {
+      row[t] /= labelCounts[i];
+      mean += row[t];
+      }
+    mean /= nTimes;
 
+    double norm = 0.0;
+    for( unsigned int t = 0; t < nTimes; t++ )
+      {
+      row[t] -= mean;
+      norm += row[t] * row[t];
+      }
+    norm = std::sqrt( norm );
+    for( unsigned int t = 0; t < nTimes; t++ )
+      {
+      row[t] = ( norm > 0 ) ? row[t] / norm : 0.0;
       }
     }
 
+  TimeSeriesRegionCorrThreadStruct str;
+  str.TimeSignals = &timeSig;
+  str.UseLabel = &useLabel;
+  str.Connectivity = connmat->GetBufferPointer();
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( 1u, std::min( nLabels,
+                                                        static_cast<unsigned int>(
+                                                          itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ) ) ) );
+  threader->SetSingleMethod( TimeSeriesRegionCorrThreadCallback, &str );
+  threader->SingleMethodExecute();
+
   WriteImage<InputImageType>(connmat, outname.c_str() );
 
   return 0;
@@ -3383,6 +3308,196 @@ int ComputeTimeSeriesLeverage(int argc, char *argv[])
   return 0;
 }
 
+/** The buffer offsets of the voxels of mask that are >= 0.5, i.e. the
+ * columns of a voxel matrix, in buffer order. */
+template <class TMaskImage>
+void GetVoxelMatrixMaskOffsets( const TMaskImage *mask, std::vector<unsigned long long> & offsets )
+{
+  offsets.clear();
+  const typename TMaskImage::PixelType *buffer = mask->GetBufferPointer();
+  const unsigned long long              numberOfVoxels = mask->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long long n = 0; n < numberOfVoxels; n++ )
+    {
+    if( buffer[n] >= 0.5 )
+      {
+      offsets.push_back( n );
+      }
+    }
+}
+
+template <class TImage>
+struct ImageSetToVoxelMatrixThreadStruct
+  {
+  char **                                 FileNames;
+  unsigned int                            NumberOfImages;
+  const TImage *                          Mask;
+  const std::vector<unsigned long long> * Offsets;
+
+  VoxelMatrixFileWriter *                 Writer;
+  unsigned int                            NextImage;
+  itk::SimpleFastMutexLock                Mutex;
+  bool                                    Failed;
+  std::string                             ErrorMessage;
+  };
+
+/** Reads the images, one at a time per thread, and writes their masked
+ * voxels as the row of the image. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE ImageSetToVoxelMatrixThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *      info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ImageSetToVoxelMatrixThreadStruct<TImage> * str =
+    static_cast<ImageSetToVoxelMatrixThreadStruct<TImage> *>( info->UserData );
+
+  const std::vector<unsigned long long> & offsets = *str->Offsets;
+  std::vector<float>                      row( offsets.size() );
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int n = str->NextImage++;
+    const bool         failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || n >= str->NumberOfImages )
+      {
+      break;
+      }
+
+    try
+      {
+      typedef itk::ImageFileReader<TImage> ReaderType;
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( str->FileNames[n] );
+      reader->Update();
+      const TImage *image = reader->GetOutput();
+
+      const typename TImage::RegionType & region = image->GetBufferedRegion();
+      if( region == str->Mask->GetBufferedRegion() )
+        {
+        const typename TImage::PixelType *buffer = image->GetBufferPointer();
+        for( size_t k = 0; k < offsets.size(); k++ )
+          {
+          row[k] = buffer[offsets[k]];
+          }
+        }
+      else
+        {
+        // a differently sized image is sampled at the mask indices, as the
+        // other output types do; voxels outside of it are 0
+        for( size_t k = 0; k < offsets.size(); k++ )
+          {
+          const typename TImage::IndexType index =
+            str->Mask->ComputeIndex( static_cast<typename TImage::OffsetValueType>( offsets[k] ) );
+          row[k] = region.IsInside( index ) ? image->GetPixel( index ) : 0;
+          }
+        }
+
+      str->Mutex.Lock();
+      const bool written = str->Writer->WriteRow( n, &row[0] );
+      if( !written )
+        {
+        str->Failed = true;
+        str->ErrorMessage = "can't write the row of " + std::string( str->FileNames[n] );
+        }
+      str->Mutex.Unlock();
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Writes a .vxm voxel matrix with one row per image file and one column
+ * per mask voxel; the mask offsets of the columns are stored in the file. */
+template <class TImage>
+int ConvertImageSetToVoxelMatrixFile( const std::string & outname, const TImage *mask, const std::string & maskfn,
+                                      char **fileNames, unsigned int numberOfImages )
+{
+  std::vector<unsigned long long> offsets;
+  GetVoxelMatrixMaskOffsets<TImage>( mask, offsets );
+  if( offsets.empty() || numberOfImages == 0 )
+    {
+    std::cerr << "ConvertImageSetToMatrix: the mask is empty or there are no images." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  VoxelMatrixFileWriter writer;
+  if( !writer.Open( outname, numberOfImages, offsets.size(), VoxelMatrixFloat, maskfn, offsets ) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  ImageSetToVoxelMatrixThreadStruct<TImage> str;
+  str.FileNames = fileNames;
+  str.NumberOfImages = numberOfImages;
+  str.Mask = mask;
+  str.Offsets = &offsets;
+  str.Writer = &writer;
+  str.NextImage = 0;
+  str.Failed = false;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::min( threader->GetNumberOfThreads(), numberOfImages ) );
+  threader->SetSingleMethod( ImageSetToVoxelMatrixThreaderCallback<TImage>, &str );
+  threader->SingleMethodExecute();
+
+  if( str.Failed )
+    {
+    std::cerr << "ConvertImageSetToMatrix: " << str.ErrorMessage << std::endl;
+    writer.Close();
+    return EXIT_FAILURE;
+    }
+  return writer.Close() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+template <class TPixel>
+struct TimeSeriesToVoxelMatrixThreadStruct
+  {
+  const TPixel *                          Buffer;
+  unsigned long long                      NumberOfSpatialVoxels;
+  unsigned int                            NumberOfTimePoints;
+  const std::vector<unsigned long long> * Offsets;
+
+  VoxelMatrixFileWriter *                 Writer;
+  itk::SimpleFastMutexLock                Mutex;
+  bool                                    Failed;
+  };
+
+/** Gathers the rows of a contiguous range of time points straight from the
+ * time series buffer. */
+template <class TPixel>
+ITK_THREAD_RETURN_TYPE TimeSeriesToVoxelMatrixThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *      info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  TimeSeriesToVoxelMatrixThreadStruct<TPixel> *str =
+    static_cast<TimeSeriesToVoxelMatrixThreadStruct<TPixel> *>( info->UserData );
+
+  const std::vector<unsigned long long> & offsets = *str->Offsets;
+  const unsigned int begin = str->NumberOfTimePoints * info->ThreadID / info->NumberOfThreads;
+  const unsigned int end = str->NumberOfTimePoints * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  std::vector<float> row( offsets.size() );
+  for( unsigned int t = begin; t < end; t++ )
+    {
+    const TPixel *volume = str->Buffer + t * str->NumberOfSpatialVoxels;
+    for( size_t k = 0; k < offsets.size(); k++ )
+      {
+      row[k] = volume[offsets[k]];
+      }
+    str->Mutex.Lock();
+    if( !str->Writer->WriteRow( t, &row[0] ) )
+      {
+      str->Failed = true;
+      }
+    str->Mutex.Unlock();
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int TimeSeriesToMatrix(int argc, char *argv[])
 {
@@ -3406,9 +3521,10 @@ int TimeSeriesToMatrix(int argc, char *argv[])
   int               argct = 2;
   const std::string outname = std::string(argv[argct]); argct++;
   std::string       ext = itksys::SystemTools::GetFilenameExtension( outname );
-  if( ( strcmp(ext.c_str(), ".csv") != 0 ) && (  strcmp(ext.c_str(), ".mha") != 0 )  )
+  const bool        tovxm = VoxelMatrixFile::IsVoxelMatrixFileName( outname );
+  if( ( strcmp(ext.c_str(), ".csv") != 0 ) && (  strcmp(ext.c_str(), ".mha") != 0 ) && !tovxm )
     {
-    // std::cout << " must use .csv or .mha as output file extension " << std::endl;
+    // std::cout << " must use .csv, .mha or .vxm as output file extension " << std::endl;
     return EXIT_FAILURE;
     }
   if( ( strcmp(ext.c_str(), ".csv") == 0 )  ) tomha = false;
@@ -3435,6 +3551,50 @@ int TimeSeriesToMatrix(int argc, char *argv[])
     return 1;
     }
   unsigned int  timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  if( tovxm )
+    {
+    // rows are read straight from the buffer, the volume of time point t
+    // starting at t * nSpatial, so the mask has to be on the same grid
+    const unsigned long long nSpatial = image1->GetBufferedRegion().GetNumberOfPixels() / timedims;
+    for( unsigned int d = 0; d < ImageDimension - 1; d++ )
+      {
+      if( mask->GetBufferedRegion().GetSize()[d] != image1->GetBufferedRegion().GetSize()[d] )
+        {
+        std::cerr << "TimeSeriesToMatrix: the mask and the time series have different sizes." << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    std::vector<unsigned long long> offsets;
+    GetVoxelMatrixMaskOffsets<OutImageType>( mask, offsets );
+    if( offsets.empty() )
+      {
+      std::cerr << "TimeSeriesToMatrix: the mask is empty." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    VoxelMatrixFileWriter writer;
+    if( !writer.Open( outname, timedims, offsets.size(), VoxelMatrixFloat, maskfn, offsets ) )
+      {
+      return EXIT_FAILURE;
+      }
+    TimeSeriesToVoxelMatrixThreadStruct<PixelType> str;
+    str.Buffer = image1->GetBufferPointer();
+    str.NumberOfSpatialVoxels = nSpatial;
+    str.NumberOfTimePoints = timedims;
+    str.Offsets = &offsets;
+    str.Writer = &writer;
+    str.Failed = false;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::min( threader->GetNumberOfThreads(), timedims ) );
+    threader->SetSingleMethod( TimeSeriesToVoxelMatrixThreaderCallback<PixelType>, &str );
+    threader->SingleMethodExecute();
+    if( !writer.Close() || str.Failed )
+      {
+      return EXIT_FAILURE;
+      }
+    return EXIT_SUCCESS;
+    }
   unsigned long voxct = 0;
   typedef itk::ExtractImageFilter<ImageType, OutImageType> ExtractFilterType;
   typedef itk::ImageRegionIteratorWithIndex<OutImageType>  SliceIt;
@@ -3982,10 +4142,237 @@ int MTR(int argc, char *argv[])
   return 0;
 }
 
-template <unsigned int ImageDimension>
-int CompCorrAuto(int argc, char *argv[])
+/** Work shared by the threads of CompCorrAuto and ThreeTissueConfounds.  The
+ * value of the voxel at spatial offset s at time t is
+ * Buffer[s + t * NumberOfVoxels]; each thread takes a contiguous part of
+ * Offsets and goes through it CompCorrBlockSize voxels at a time. */
+struct CompCorrThreadStruct
+  {
+  float *                           Buffer;
+  unsigned long                     NumberOfVoxels;
+  unsigned int                      NumberOfTimePoints;
+  const std::vector<unsigned long> *Offsets;
+
+  std::vector<float> *             StandardDeviations; // per offset, if not null
+  std::vector<vnl_vector<double> > Sums;               // per thread sum of the time courses
+
+  const vnl_matrix<double> *Basis;   // regressors for CompCorrRegressionThreadCallback
+
+  const vnl_matrix<double> *Samples; // time x voxels, for CompCorrGramThreadCallback
+  vnl_matrix<double> *      Gram;    // Samples Samples^T
+  };
+
+const unsigned int CompCorrBlockSize = 64;
+
+/** Copy the time courses of offsets [begin, end) into the columns of block. */
+void GetCompCorrBlock( const CompCorrThreadStruct *str, unsigned long begin, unsigned long end,
+                       vnl_matrix<double> & block )
 {
-  if( argc <= 2 )
+  const std::vector<unsigned long> & offsets = *str->Offsets;
+  for( unsigned int t = 0; t < str->NumberOfTimePoints; t++ )
+    {
+    const float *frame = str->Buffer + static_cast<size_t>( t ) * str->NumberOfVoxels;
+    double *     row = block[t];
+    for( unsigned long n = begin; n < end; n++ )
+      {
+      row[n - begin] = frame[offsets[n]];
+      }
+    }
+}
+
+void GetCompCorrThreadRange( const itk::MultiThreader::ThreadInfoStruct *info, unsigned long size,
+                             unsigned long & begin, unsigned long & end )
+{
+  begin = static_cast<unsigned long>( static_cast<unsigned long long>( size ) * info->ThreadID
+                                      / info->NumberOfThreads );
+  end = static_cast<unsigned long>( static_cast<unsigned long long>( size ) * ( info->ThreadID + 1 )
+                                    / info->NumberOfThreads );
+}
+
+/** Sums and standard deviations of the time courses. */
+ITK_THREAD_RETURN_TYPE CompCorrSummaryThreadCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  CompCorrThreadStruct *                str = static_cast<CompCorrThreadStruct *>( info->UserData );
+
+  const unsigned int nTimes = str->NumberOfTimePoints;
+  vnl_vector<double> & sum = str->Sums[info->ThreadID];
+  sum.set_size( nTimes );
+  sum.fill( 0 );
+
+  unsigned long begin, end;
+  GetCompCorrThreadRange( info, str->Offsets->size(), begin, end );
+
+  vnl_matrix<double> block( nTimes, CompCorrBlockSize );
+  for( unsigned long blockBegin = begin; blockBegin < end; blockBegin += CompCorrBlockSize )
+    {
+    const unsigned long blockEnd = std::min( blockBegin + CompCorrBlockSize, end );
+    const unsigned int  nColumns = blockEnd - blockBegin;
+    GetCompCorrBlock( str, blockBegin, blockEnd, block );
+
+    for( unsigned int t = 0; t < nTimes; t++ )
+      {
+      for( unsigned int b = 0; b < nColumns; b++ )
+        {
+        sum[t] += block( t, b );
+        }
+      }
+
+    if( str->StandardDeviations )
+      {
+      for( unsigned int b = 0; b < nColumns; b++ )
+        {
+        double mean = 0;
+        for( unsigned int t = 0; t < nTimes; t++ )
+          {
+          mean += block( t, b );
+          }
+        mean /= nTimes;
+        double var = 0;
+        for( unsigned int t = 0; t < nTimes; t++ )
+          {
+          var += ( block( t, b ) - mean ) * ( block( t, b ) - mean );
+          }
+        ( *str->StandardDeviations )[blockBegin + b] = sqrt( var / nTimes );
+        }
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Standardize each time course and replace it, in Buffer, by its residual
+ * after projection on the columns of Basis. */
+ITK_THREAD_RETURN_TYPE CompCorrRegressionThreadCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  CompCorrThreadStruct *                str = static_cast<CompCorrThreadStruct *>( info->UserData );
+
+  const std::vector<unsigned long> & offsets = *str->Offsets;
+  const vnl_matrix<double> &         basis = *str->Basis;
+  const unsigned int                 nTimes = str->NumberOfTimePoints;
+  const unsigned int                 nRegressors = basis.cols();
+
+  unsigned long begin, end;
+  GetCompCorrThreadRange( info, offsets.size(), begin, end );
+
+  vnl_matrix<double> block( nTimes, CompCorrBlockSize );
+  vnl_vector<double> sample( nTimes );
+  vnl_vector<double> coefficients( nRegressors );
+  for( unsigned long blockBegin = begin; blockBegin < end; blockBegin += CompCorrBlockSize )
+    {
+    const unsigned long blockEnd = std::min( blockBegin + CompCorrBlockSize, end );
+    GetCompCorrBlock( str, blockBegin, blockEnd, block );
+
+    for( unsigned long n = blockBegin; n < blockEnd; n++ )
+      {
+      const unsigned int b = n - blockBegin;
+
+      double mean = 0;
+      for( unsigned int t = 0; t < nTimes; t++ )
+        {
+        mean += block( t, b );
+        }
+      mean /= nTimes;
+      double ss = 0;
+      for( unsigned int t = 0; t < nTimes; t++ )
+        {
+        sample[t] = block( t, b ) - mean;
+        ss += sample[t] * sample[t];
+        }
+      const double sd = ( nTimes > 1 ) ? sqrt( ss / ( nTimes - 1 ) ) : 0;
+      if( sd > 0 )
+        {
+        sample /= sd;
+        }
+      else
+        {
+        sample.fill( 0 );
+        }
+
+      // sample - B B^T sample
+      for( unsigned int k = 0; k < nRegressors; k++ )
+        {
+        double dot = 0;
+        for( unsigned int t = 0; t < nTimes; t++ )
+          {
+          dot += basis( t, k ) * sample[t];
+          }
+        coefficients[k] = dot;
+        }
+      for( unsigned int t = 0; t < nTimes; t++ )
+        {
+        double fitted = 0;
+        for( unsigned int k = 0; k < nRegressors; k++ )
+          {
+          fitted += basis( t, k ) * coefficients[k];
+          }
+        str->Buffer[offsets[n] + static_cast<size_t>( t ) * str->NumberOfVoxels] = sample[t] - fitted;
+        }
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Samples Samples^T; the rows are dealt out round robin, row i has nTimes - i
+ * entries to compute. */
+ITK_THREAD_RETURN_TYPE CompCorrGramThreadCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  CompCorrThreadStruct *                str = static_cast<CompCorrThreadStruct *>( info->UserData );
+
+  const vnl_matrix<double> & samples = *str->Samples;
+  vnl_matrix<double> &       gram = *str->Gram;
+  for( unsigned int i = info->ThreadID; i < samples.rows(); i += info->NumberOfThreads )
+    {
+    const double *p = samples[i];
+    for( unsigned int j = i; j < samples.rows(); j++ )
+      {
+      const double *q = samples[j];
+      double        dot = 0;
+      for( unsigned int n = 0; n < samples.cols(); n++ )
+        {
+        dot += p[n] * q[n];
+        }
+      gram( i, j ) = dot;
+      gram( j, i ) = dot;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Run callback on all threads, at most one per CompCorrBlockSize work
+ * items, and return the sum of the per thread sums if there are any. */
+vnl_vector<double> RunCompCorrThreads( itk::ThreadFunctionType callback, CompCorrThreadStruct & str,
+                                       unsigned long numberOfItems )
+{
+  unsigned int        numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const unsigned long numberOfBlocks = ( numberOfItems + CompCorrBlockSize - 1 ) / CompCorrBlockSize;
+  if( static_cast<unsigned long>( numberOfThreads ) > numberOfBlocks )
+    {
+    numberOfThreads = std::max( static_cast<unsigned int>( numberOfBlocks ), 1u );
+    }
+  str.Sums.assign( numberOfThreads, vnl_vector<double>() );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( callback, &str );
+  threader->SingleMethodExecute();
+
+  vnl_vector<double> sum( str.NumberOfTimePoints, 0.0 );
+  for( unsigned int n = 0; n < str.Sums.size(); n++ )
+    {
+    if( str.Sums[n].size() == sum.size() )
+      {
+      sum += str.Sums[n];
+      }
+    }
+  return sum;
+}
+
+template <unsigned int ImageDimension>
+int CompCorrAuto(int argc, char *argv[])
+{
+  if( argc <= 2 )
     {
     // std::cout << " too few options " << std::endl;
     return 1;
@@ -3994,8 +4381,6 @@ int CompCorrAuto(int argc, char *argv[])
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
   typedef itk::Image<PixelType, ImageDimension - 1>    OutImageType;
-  typedef typename OutImageType::IndexType             OutIndexType;
-  typedef typename ImageType::IndexType                IndexType;
 
   typedef double                                            Scalar;
   typedef itk::ants::antsMatrixUtilities<ImageType, Scalar> matrixOpType;
@@ -4018,11 +4403,7 @@ int CompCorrAuto(int argc, char *argv[])
   std::string extension = outname.substr(idx, outname.length() );
 
   typename ImageType::Pointer image1 = ITK_NULLPTR;
-  typename OutImageType::Pointer outimage = ITK_NULLPTR;
-  typename OutImageType::Pointer outimage2 = ITK_NULLPTR;
   typename OutImageType::Pointer label_image = ITK_NULLPTR;
-  typename OutImageType::Pointer var_image = ITK_NULLPTR;
-
 
   if( fn1.length() > 3 )
     {
@@ -4040,99 +4421,69 @@ int CompCorrAuto(int argc, char *argv[])
     {
     return 1;
     }
-  if( fn_label.length() > 3 )
-    {
-    ReadImage<OutImageType>(outimage, fn_label.c_str() );
-    }
-  if( fn_label.length() > 3 )
-    {
-    ReadImage<OutImageType>(outimage2, fn_label.c_str() );
-    }
-  if( fn_label.length() > 3 )
+  typename OutImageType::Pointer var_image = AllocImage<OutImageType>( label_image, 0 );
+
+  const unsigned int  timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  const unsigned long nvox = label_image->GetLargestPossibleRegion().GetNumberOfPixels();
+  if( image1->GetLargestPossibleRegion().GetNumberOfPixels() != nvox * timedims )
     {
-    ReadImage<OutImageType>(var_image, fn_label.c_str() );
+    // std::cout << " the label image is not on the grid of the time series " << std::endl;
+    return 1;
     }
-  var_image->FillBuffer(0);
-  outimage->FillBuffer(0);
-  outimage2->FillBuffer(0);
-  // std::cout << " read images " << std::endl;
-  unsigned int timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
-  // std::cout << "timedims " << timedims << " size " << image1->GetLargestPossibleRegion().GetSize() << std::endl;
 
-  // first, count the label numbers
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType> labIterator;
-  labIterator   vfIter2( label_image,  label_image->GetLargestPossibleRegion() );
-  unsigned long ct_nuis = 0;
-  unsigned long ct_vox = 0;
-  // std::cout << " verify input " << std::endl;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  // the in-brain voxels, by offset in the buffer of a time point
+  const PixelType *          labels = label_image->GetBufferPointer();
+  std::vector<unsigned long> brainOffsets;
+  for( unsigned long s = 0; s < nvox; s++ )
     {
-    if( vfIter2.Get() == 1 )      // in brain
+    if( labels[s] > 0 )
       {
-      ct_vox++;
+      brainOffsets.push_back( s );
       }
     }
-  // std::cout << " counted " << ct_vox << " voxels " <<  std::endl;
-  if( ct_vox == 0 )
+  if( brainOffsets.empty() )
     {
-    // std::cout << ct_vox << " not enough voxels labeled as gm (or brain) " << std::endl;
+    // std::cout << " not enough voxels labeled as gm (or brain) " << std::endl;
     return 1;
     }
-  // step 1.  compute , in label 3 ( the nuisance region ), the representative value of the time series over the region.
-  //  at the same time, compute the average value in label 2 ( the reference region ).
-  // step 2.  factor out the nuisance region from the activation at each voxel in the ROI (nonzero labels).
-  // step 3.  compute the correlation of the reference region with every voxel in the roi.
+
   typedef vnl_matrix<Scalar> timeMatrixType;
   typedef vnl_vector<Scalar> timeVectorType;
-  timeMatrixType mSample(timedims, ct_vox, 0);
-  unsigned long  nuis_vox = 0;
-  timeVectorType sample(timedims, 0);
-  //  FIRST -- get high variance (in time) voxels
-  float maxvar = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+
+  CompCorrThreadStruct str;
+  str.Buffer = image1->GetBufferPointer();
+  str.NumberOfVoxels = nvox;
+  str.NumberOfTimePoints = timedims;
+  str.Offsets = &brainOffsets;
+  str.StandardDeviations = ITK_NULLPTR;
+  str.Basis = ITK_NULLPTR;
+  str.Samples = ITK_NULLPTR;
+  str.Gram = ITK_NULLPTR;
+
+  //  FIRST -- get high variance (in time) voxels, and the global signal on the way
+  std::vector<float> sds( brainOffsets.size(), 0 );
+  str.StandardDeviations = &sds;
+  timeVectorType vGlobal = RunCompCorrThreads( CompCorrSummaryThreadCallback, str, brainOffsets.size() )
+    / static_cast<Scalar>( brainOffsets.size() );
+  str.StandardDeviations = ITK_NULLPTR;
+
+  PixelType *variances = var_image->GetBufferPointer();
+  float      maxvar = 0;
+  for( unsigned long n = 0; n < brainOffsets.size(); n++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )      // in-brain
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      float total = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        sample(t) = pix;
-        total += pix;
-        }
-      float mean = total / (float)timedims;
-      float var = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        var += ( (sample(t) - mean) * (sample(t) - mean) );
-        }
-      var /= (float)(timedims);
-      var = sqrt(var);
-      if( var > maxvar )
-        {
-        maxvar = var;
-        }
-      var_image->SetPixel(ind, var);
-      }
+    variances[brainOffsets[n]] = sds[n];
+    maxvar = vnl_math_max( maxvar, sds[n] );
     }
-  // std::cout << " got var " << std::endl;
+
   // now build the histogram
   unsigned int   histsize = 50;
   float          binsize = maxvar / histsize;
   timeVectorType varhist(histsize, 0);
   float          varhistsum = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  for( unsigned long n = 0; n < brainOffsets.size(); n++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    float        var = var_image->GetPixel(ind);
-    if( vfIter2.Get() > 0 && var > 0 )      // in-brain
+    float var = sds[n];
+    if( var > 0 )
       {
       int bin = (int)( var / binsize ) - 1;
       if( bin < 0 )
@@ -4144,7 +4495,6 @@ int CompCorrAuto(int argc, char *argv[])
       }
     }
   varhist = varhist / varhistsum;
-  // std::cout << " got var hist " << std::endl;
   float temp = 0;
   float varval_csf = 0;
   for( unsigned int j = 0; j < histsize; j++ )
@@ -4156,69 +4506,53 @@ int CompCorrAuto(int argc, char *argv[])
       }
     }
 
-  // std::cout << " maxvar " << maxvar << " varval_csf " << varval_csf << std::endl;
-  ct_nuis = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  // the nuisance time courses, one voxel per column
+  std::vector<unsigned long> nuisanceOffsets;
+  for( unsigned long n = 0; n < brainOffsets.size(); n++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
+    if( sds[n] > varval_csf )
       {
-      ct_nuis++;
+      nuisanceOffsets.push_back( brainOffsets[n] );
       }
     }
-  timeMatrixType mNuisance(timedims, ct_nuis, 0);
-  nuis_vox = 0;
-  unsigned long brain_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  timeMatrixType mNuisance( timedims, nuisanceOffsets.size() );
+  for( unsigned int t = 0; t < timedims; t++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mNuisance(t, nuis_vox) = pix;
-        }
-      nuis_vox++;
-      }
-    if( vfIter2.Get() > 0  )      // in brain
+    const PixelType *frame = str.Buffer + static_cast<size_t>( t ) * nvox;
+    for( unsigned long n = 0; n < nuisanceOffsets.size(); n++ )
       {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mSample(t, brain_vox) = pix;
-        }
-      brain_vox++;
+      mNuisance(t, n) = frame[nuisanceOffsets[n]];
       }
     }
-  // factor out the nuisance variables by OLS
-  timeVectorType vGlobal = matrixOps->AverageColumns(mSample);
-  //  typedef itk::Array2D<double> csvMatrixType;
+
+  if( nuisanceOffsets.empty() )
+    {
+    n_comp_corr_vecs = 1;
+    }
+  n_comp_corr_vecs = std::min( n_comp_corr_vecs, timedims );
+
+  // the compcorr vectors are the leading eigenvectors of
+  // mNuisance mNuisance^T + 1e-3 I, which is only time x time: form it once
+  // and decompose it once for all the vectors
+  timeMatrixType cov( timedims, timedims );
+  str.Samples = &mNuisance;
+  str.Gram = &cov;
+  RunCompCorrThreads( CompCorrGramThreadCallback, str, nuisanceOffsets.size() );
+  for( unsigned int t = 0; t < timedims; t++ )
+    {
+    cov(t, t) += 1.e-3;
+    }
+  vnl_symmetric_eigensystem<Scalar> eig( cov );
+
   timeMatrixType           reducedNuisance(timedims, n_comp_corr_vecs + 1);
   std::vector<std::string> ColumnHeaders;
   std::string              colname = std::string("GlobalSignal");
   ColumnHeaders.push_back( colname );
   reducedNuisance.set_column(0, vGlobal);
-  if( ct_nuis == 0 )
-    {
-    n_comp_corr_vecs = 1;
-    }
   for( unsigned int i = 0; i < n_comp_corr_vecs; i++ )
     {
-    timeVectorType nuisi = matrixOps->GetCovMatEigenvector(mNuisance, i);
-    reducedNuisance.set_column(i + 1, nuisi);
+    // the eigenvalues are in increasing order
+    reducedNuisance.set_column(i + 1, eig.get_eigenvector( timedims - 1 - i ) );
     colname = std::string("CompCorrVec") + ants_to_string<unsigned int>(i + 1);
     ColumnHeaders.push_back( colname );
     }
@@ -4242,30 +4576,14 @@ int CompCorrAuto(int argc, char *argv[])
     return EXIT_FAILURE;
     }
 
-  timeMatrixType RRt = matrixOps->ProjectionMatrix(reducedNuisance);
-  mSample = matrixOps->NormalizeMatrix(mSample);
-  mSample = mSample - RRt * mSample;
-  brain_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )
-      {
-      timeVectorType samp = mSample.get_column(brain_vox);
-// correct the original image
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        image1->SetPixel(tind, samp[t]);
-        }
-      brain_vox++;
-      }
-    }
+  // factor out the nuisance variables by OLS: ProjectionMatrix is B B^T with
+  // B the normalized, whitened regressors, so each standardized voxel time
+  // course y is replaced by y - B ( B^T y ) without forming the time x time
+  // projection
+  timeMatrixType basis = matrixOps->WhitenMatrix( matrixOps->NormalizeMatrix( reducedNuisance ) );
+  str.Basis = &basis;
+  RunCompCorrThreads( CompCorrRegressionThreadCallback, str, brainOffsets.size() );
+
   kname = tempname + std::string("_corrected") + extension;
   WriteImage<ImageType>(image1, kname.c_str() );
   kname = tempname + std::string("_variance") + extension;
@@ -4284,12 +4602,8 @@ int ThreeTissueConfounds(int argc, char *argv[])
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
   typedef itk::Image<PixelType, ImageDimension - 1>    OutImageType;
-  typedef typename OutImageType::IndexType             OutIndexType;
-  typedef typename ImageType::IndexType                IndexType;
 
-  typedef double                                            Scalar;
-  typedef itk::ants::antsMatrixUtilities<ImageType, Scalar> matrixOpType;
-  typename matrixOpType::Pointer matrixOps = matrixOpType::New();
+  typedef double Scalar;
 
   int               argct = 2;
   const std::string outname = std::string(argv[argct]);
@@ -4314,11 +4628,7 @@ int ThreeTissueConfounds(int argc, char *argv[])
   std::string extension = outname.substr(idx, outname.length() );
 
   typename ImageType::Pointer image1 = ITK_NULLPTR;
-  typename OutImageType::Pointer outimage = ITK_NULLPTR;
-  typename OutImageType::Pointer outimage2 = ITK_NULLPTR;
   typename OutImageType::Pointer label_image = ITK_NULLPTR;
-  typename OutImageType::Pointer var_image = ITK_NULLPTR;
-
 
   if( fn1.length() > 3 )
     {
@@ -4336,238 +4646,90 @@ int ThreeTissueConfounds(int argc, char *argv[])
     {
     return 1;
     }
-  if( fn_label.length() > 3 )
-    {
-    ReadImage<OutImageType>(outimage, fn_label.c_str() );
-    }
-  if( fn_label.length() > 3 )
-    {
-    ReadImage<OutImageType>(outimage2, fn_label.c_str() );
-    }
-  if( fn_label.length() > 3 )
+
+  const unsigned int  timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  const unsigned long nvox = label_image->GetLargestPossibleRegion().GetNumberOfPixels();
+  if( image1->GetLargestPossibleRegion().GetNumberOfPixels() != nvox * timedims )
     {
-    ReadImage<OutImageType>(var_image, fn_label.c_str() );
+    // std::cout << " the label image is not on the grid of the time series " << std::endl;
+    return 1;
     }
-  var_image->FillBuffer(0);
-  outimage->FillBuffer(0);
-  outimage2->FillBuffer(0);
-  // std::cout << " read images " << std::endl;
-  unsigned int timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
-  // std::cout << "timedims " << timedims << " size " << image1->GetLargestPossibleRegion().GetSize() << std::endl;
 
-  // first, count the label numbers
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType> labIterator;
-  labIterator   vfIter2( label_image,  label_image->GetLargestPossibleRegion() );
-  unsigned long ct_nuis = 0;
-  unsigned long ct_ref = 0;
-  unsigned long ct_gm = 0;
-  // std::cout << " verify input " << std::endl;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  // the voxels of the three regions, by offset in the buffer of a time point
+  const PixelType *          labels = label_image->GetBufferPointer();
+  std::vector<unsigned long> gmOffsets;
+  std::vector<unsigned long> csfOffsets;
+  std::vector<unsigned long> wmOffsets;
+  for( unsigned long s = 0; s < nvox; s++ )
     {
-    if( vfIter2.Get() == csflabel )      // nuisance
+    if( labels[s] == csflabel )      // nuisance
       {
-      ct_nuis++;
+      csfOffsets.push_back( s );
       }
-    if( vfIter2.Get() == wmlabel )      // reference
+    if( labels[s] == wmlabel )      // reference
       {
-      ct_ref++;
+      wmOffsets.push_back( s );
       }
-    if( vfIter2.Get() > 0 )      // gm roi
+    if( labels[s] > 0 )      // gm roi
       {
-      ct_gm++;
+      gmOffsets.push_back( s );
       }
     }
-  // std::cout << " counted " << ct_gm << " gm voxels " << ct_ref << " reference region voxels " << std::endl;
-  if( ct_gm == 0 )
+  if( gmOffsets.empty() )
     {
-    // std::cout << ct_gm << " not enough voxels labeled as gm (or brain) " << ct_gm << std::endl;
+    // std::cout << " not enough voxels labeled as gm (or brain) " << std::endl;
     return 1;
     }
-  if( ct_ref == 0 )
+  if( wmOffsets.empty() )
     {
-    // std::cout << ct_ref << " not enough voxels labeled as reference region " << std::endl;
+    // std::cout << " not enough voxels labeled as reference region " << std::endl;
     return 1;
     }
-  // step 1.  compute , in label 3 ( the nuisance region ), the representative value of the time series over the region.
-  //  at the same time, compute the average value in label 2 ( the reference region ).
-  // step 2.  factor out the nuisance region from the activation at each voxel in the ROI (nonzero labels).
-  // step 3.  compute the correlation of the reference region with every voxel in the roi.
+
   typedef vnl_matrix<Scalar> timeMatrixType;
   typedef vnl_vector<Scalar> timeVectorType;
-  timeMatrixType mReference(timedims, ct_ref, 0);
-  timeMatrixType mSample(timedims, ct_gm, 0);
-  unsigned long  nuis_vox = 0;
-  unsigned long  ref_vox = 0;
-  unsigned long  gm_vox = 0;
-  timeVectorType smoother(timedims, 0);
-  timeVectorType smoother_out(timedims, 0);
-  //  FIRST -- get high variance (in time) voxels
-  float maxvar = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+
+  CompCorrThreadStruct str;
+  str.Buffer = image1->GetBufferPointer();
+  str.NumberOfVoxels = nvox;
+  str.NumberOfTimePoints = timedims;
+  str.StandardDeviations = ITK_NULLPTR;
+  str.Basis = ITK_NULLPTR;
+  str.Samples = ITK_NULLPTR;
+  str.Gram = ITK_NULLPTR;
+
+  // the average time course of each region; the csf one stays zero if there
+  // are no csf voxels
+  std::vector<unsigned long> *regions[3] = { &gmOffsets, &csfOffsets, &wmOffsets };
+  timeMatrixType              reducedNuisance(timedims, 3, 0.0);
+  for( unsigned int r = 0; r < 3; r++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )      // in-brain
+    if( regions[r]->empty() )
       {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      float total = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        smoother(t) = pix;
-        total += pix;
-        }
-      float mean = total / (float)timedims;
-      float var = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        var += ( (smoother(t) - mean) * (smoother(t) - mean) );
-        }
-      var /= (float)(timedims);
-      var = sqrt(var);
-      if( var > maxvar )
-        {
-        maxvar = var;
-        }
-      var_image->SetPixel(ind, var);
+      continue;
       }
+    str.Offsets = regions[r];
+    reducedNuisance.set_column( r, RunCompCorrThreads( CompCorrSummaryThreadCallback, str, regions[r]->size() )
+                                / static_cast<Scalar>( regions[r]->size() ) );
     }
-  // std::cout << " got var " << std::endl;
-  // now build the histogram
-  unsigned int   histsize = 50;
-  float          binsize = maxvar / histsize;
-  timeVectorType varhist(histsize, 0);
-  float          varhistsum = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    float        var = var_image->GetPixel(ind);
-    if( vfIter2.Get() > 0 && var > 0 )      // in-brain
-      {
-      int bin = (int)( var / binsize ) - 1;
-      if( bin < 0 )
-        {
-        bin = 0;
-        }
-      varhist[bin] += 1;
-      varhistsum += 1;
-      }
-    }
-  varhist = varhist / varhistsum;
-  // std::cout << " got var hist " << std::endl;
-  float temp = 0;
-  float varval_csf = 0;
-  for( unsigned int j = 0; j < histsize; j++ )
-    {
-    temp += varhist(j);
-    if( temp >= 0.95 && varval_csf <=  0 )
-      {
-      varval_csf = (float)j * binsize;
-      }
-    }
-
-  // std::cout << " maxvar " << maxvar << " varval_csf " << varval_csf << std::endl;
-  //  WriteImage<OutImageType>(var_image,"varimage.nii.gz");
-  //
-  ct_nuis = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    // OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() == csflabel )      // reference
-    //    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-      {
-      ct_nuis++;
-      }
-    }
-  timeMatrixType mNuisance(timedims, ct_nuis, 0);
-  ref_vox = 0; nuis_vox = 0; gm_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    //      if ( vfIter2.Get() == 3 ) { // nuisance
-    //    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-    if( vfIter2.Get() == csflabel )      // reference
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mNuisance(t, nuis_vox) = pix;
-        }
-      nuis_vox++;
-      }
-    if( vfIter2.Get() == wmlabel )      // reference
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mReference(t, ref_vox) = pix;
-        }
-      ref_vox++;
-      }
-    if( vfIter2.Get() > 0  )      // in brain
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mSample(t, gm_vox) = pix;
-        }
-      gm_vox++;
-      }
-    }
-
-  // factor out the nuisance variables by OLS
-  unsigned int nnuis = 3; // global , csf , wm
-  if( ct_nuis == 0 )
-    {
-    nnuis = 1;
-    }
-  timeMatrixType reducedNuisance(timedims, nnuis);
-  timeVectorType vGlobal = matrixOps->AverageColumns( mSample );
-  reducedNuisance.set_column( 0, vGlobal);
-  vGlobal = matrixOps->AverageColumns( mNuisance ); // csf
-  reducedNuisance.set_column( 1, vGlobal);
-  vGlobal = matrixOps->AverageColumns( mReference ); // wm
-  reducedNuisance.set_column( 2, vGlobal);
-
-  std::vector<std::string> ColumnHeaders;
-  std::string              colname = std::string("GlobalSignal");
-  ColumnHeaders.push_back( colname );
-  colname = std::string("CSF");
-  ColumnHeaders.push_back( colname );
-  colname = std::string("WM");
-  ColumnHeaders.push_back( colname );
-
-  // write out these nuisance variables
-  // write out the array2D object
-  typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
-  WriterType::Pointer writer = WriterType::New();
-  std::string         kname = tempname + std::string("_compcorr.csv");
-  writer->SetFileName( kname );
-  writer->SetInput( &reducedNuisance );
-  writer->SetColumnHeaders( ColumnHeaders );
-  try
+
+  std::vector<std::string> ColumnHeaders;
+  std::string              colname = std::string("GlobalSignal");
+  ColumnHeaders.push_back( colname );
+  colname = std::string("CSF");
+  ColumnHeaders.push_back( colname );
+  colname = std::string("WM");
+  ColumnHeaders.push_back( colname );
+
+  // write out these nuisance variables
+  // write out the array2D object
+  typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  std::string         kname = tempname + std::string("_compcorr.csv");
+  writer->SetFileName( kname );
+  writer->SetInput( &reducedNuisance );
+  writer->SetColumnHeaders( ColumnHeaders );
+  try
     {
     writer->Write();
     }
@@ -4579,62 +4741,6 @@ int ThreeTissueConfounds(int argc, char *argv[])
     }
 
   return 0;
-
-  timeMatrixType RRt = matrixOps->ProjectionMatrix(reducedNuisance);
-  mReference = matrixOps->NormalizeMatrix(mReference);
-  mReference = mReference - RRt * mReference;
-  mSample = matrixOps->NormalizeMatrix(mSample);
-  mSample = mSample - RRt * mSample;
-  // reduce your reference region to the first & second eigenvector
-  timeVectorType vReference = matrixOps->GetCovMatEigenvector(mReference, 0);
-  timeVectorType vReference2 = matrixOps->AverageColumns(mReference);
-  Scalar         testcorr = matrixOps->PearsonCorr(vReference, vReference2);
-  if( testcorr < 0 )
-    {
-    vReference = vReference * (-1);
-    }
-  if( vReference.size() != timedims )
-    {
-    // std::cout << " CompCorr Error exiting " << std::endl; throw std::exception();
-    }
-  gm_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )
-      {
-      timeVectorType samp = mSample.get_column(gm_vox);
-// correct the original image
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        image1->SetPixel(tind, samp[t]);
-        }
-// compute the gm-reference correlation
-      Scalar corr = matrixOps->PearsonCorr(samp, vReference);
-      //    Scalar corr2=matrixOps->PearsonCorr(samp,vReference2);
-      outimage->SetPixel(ind, corr);
-      //    outimage2->SetPixel(ind,corr2);
-      outimage2->SetPixel(ind, samp.two_norm() ); // the power of the time series
-      gm_vox++;
-      }
-    }
-  // std::cout << "write results" << std::endl;
-  kname = tempname + std::string("first_evec") + extension;
-  WriteImage<OutImageType>(outimage, kname.c_str() );
-  //  kname=tempname+std::string("second_evec")+extension;
-  kname = tempname + std::string("power") + extension;
-  WriteImage<OutImageType>(outimage2, kname.c_str() );
-  kname = tempname + std::string("_corrected") + extension;
-  WriteImage<ImageType>(image1, kname.c_str() );
-  kname = tempname + std::string("_variance") + extension;
-  WriteImage<OutImageType>(var_image, kname.c_str() );
-  return 0;
 }
 
 template <unsigned int ImageDimension>
@@ -6006,22 +6112,37 @@ int TensorFunctions(int argc, char *argv[])
   rgbZero[1] = 0;
   rgbZero[2] = 0;
 
-  Iterator tIter(timage, timage->GetLargestPossibleRegion() );
-  for(  tIter.GoToBegin(); !tIter.IsAtEnd(); ++tIter )
+  if( strcmp(operation.c_str(), "TensorFA") == 0 )
     {
-    IndexType ind = tIter.GetIndex();
-    float     result = 0;
+    // the eigenvalues of all tensors in one pass over the buffer
+    const TensorType *  tensors = timage->GetBufferPointer();
+    const unsigned long numberOfVoxels = timage->GetBufferedRegion().GetNumberOfPixels();
+    std::vector<double> evals( 3 * numberOfVoxels );
+    if( numberOfVoxels > 0 )
+      {
+      SymmetricEigenValues3x3( tensors[0].GetDataPointer(), numberOfVoxels, &evals[0] );
+      }
 
-    if( strcmp(operation.c_str(), "TensorFA") == 0 )
+    typename ImageType::PixelType *fa = vimage->GetBufferPointer();
+    for( unsigned long n = 0; n < numberOfVoxels; n++ )
       {
-      result = 0.0;
-      if( IsRealTensor<TensorType>( tIter.Value() ) )
+      fa[n] = 0.0;
+      if( IsRealTensor<TensorType>( tensors[n] ) && tensors[n][0] + tensors[n][3] + tensors[n][5] != 0.0f )
         {
-        result = GetTensorFA<TensorType>(tIter.Value() );
+        fa[n] = GetFAFromEigenValues( &evals[3 * n] );
         }
-      vimage->SetPixel(ind, result);
       }
-    else if( strcmp(operation.c_str(), "TensorMeanDiffusion") == 0 )
+    WriteImage<ImageType>(vimage, outname.c_str() );
+    return 0;
+    }
+
+  Iterator tIter(timage, timage->GetLargestPossibleRegion() );
+  for(  tIter.GoToBegin(); !tIter.IsAtEnd(); ++tIter )
+    {
+    IndexType ind = tIter.GetIndex();
+    float     result = 0;
+
+    if( strcmp(operation.c_str(), "TensorMeanDiffusion") == 0 )
       {
       result = GetTensorADC<TensorType>(tIter.Value(), 0);
       if( vnl_math_isnan(result) )
@@ -7721,6 +7842,60 @@ int FastMarchingSegmentation( unsigned int argc, char *argv[] )
 }
 
 
+/** The outputs of PropagateLabelsThroughMask for all labels from a single
+ * GeodesicLabelPropagation pass, instead of one fast marching per label. */
+template <class ImageType>
+int PropagateLabelsThroughMaskSinglePass( ImageType *speedimage, ImageType *labimage, float thresh, float stopval,
+                                          unsigned int maxlabel, const std::string & outname )
+{
+  typedef GeodesicLabelPropagation<ImageType>            PropagationType;
+  typedef typename PropagationType::StatusImageType      LabelImageType;
+
+  PropagationType propagation;
+  propagation.SetSpeedImage( speedimage );
+  propagation.SetLabelImage( labimage );
+  propagation.SetSpeedThreshold( thresh );
+  propagation.SetStoppingValue( stopval );
+  propagation.SetMaximumLabel( maxlabel );
+  propagation.Update();
+
+  typename ImageType::Pointer fastimage = AllocImage<ImageType>( labimage, 1.e9 );
+  typename ImageType::Pointer outlabimage = AllocImage<ImageType>( labimage );
+
+  const typename ImageType::PixelType *speed = speedimage->GetBufferPointer();
+  const typename ImageType::PixelType *labels = labimage->GetBufferPointer();
+  const typename ImageType::PixelType *times = propagation.GetArrivalTimes()->GetBufferPointer();
+  const typename ImageType::PixelType *propagated = propagation.GetOutput()->GetBufferPointer();
+  const unsigned char *                status = propagation.GetStatusImage()->GetBufferPointer();
+  typename ImageType::PixelType *      fast = fastimage->GetBufferPointer();
+  typename ImageType::PixelType *      outlab = outlabimage->GetBufferPointer();
+  const unsigned long                  numberOfVoxels = labimage->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long n = 0; n < numberOfVoxels; n++ )
+    {
+    outlab[n] = labels[n];
+    if( speed[n] < thresh )
+      {
+      outlab[n] = 0;
+      }
+    else if( labels[n] == 0 && status[n] != PropagationType::Far )
+      {
+      fast[n] = times[n];
+      outlab[n] = propagated[n];
+      }
+    }
+
+  std::string::size_type idx;
+  idx = outname.find_first_of('.');
+  std::string tempname = outname.substr(0, idx);
+  std::string extension = outname.substr(idx, outname.length() );
+  std::string kname = tempname + std::string("_speed") + extension;
+  std::string lname = tempname + std::string("_label") + extension;
+  WriteImage<ImageType>(fastimage, kname.c_str() );
+  WriteImage<ImageType>(outlabimage, outname.c_str() );
+  WriteImage<LabelImageType>(propagation.GetStatusImage(), lname.c_str() );
+  return 0;
+}
+
 template <unsigned int ImageDimension>
 int PropagateLabelsThroughMask(int argc, char *argv[])
 {
@@ -7756,11 +7931,6 @@ int PropagateLabelsThroughMask(int argc, char *argv[])
   ReadImage<ImageType>(speedimage, fn1.c_str() );
   typename ImageType::Pointer labimage = ITK_NULLPTR;
   ReadImage<ImageType>(labimage, fn2.c_str() );
-  typename ImageType::Pointer fastimage = ITK_NULLPTR;
-  ReadImage<ImageType>(fastimage, fn1.c_str() );
-  typename ImageType::Pointer outlabimage = ITK_NULLPTR;
-  ReadImage<ImageType>(outlabimage, fn2.c_str() );
-  fastimage->FillBuffer(1.e9);
   // compute max label
   double   maxlabel = 0;
   Iterator vfIter2( labimage,  labimage->GetLargestPossibleRegion() );
@@ -7781,6 +7951,17 @@ int PropagateLabelsThroughMask(int argc, char *argv[])
         }
       }
     }
+  if( topocheck == 0 )
+    {
+    // the labels don't depend on each other without a topology check
+    return PropagateLabelsThroughMaskSinglePass<ImageType>( speedimage, labimage, thresh, stopval,
+                                                            (unsigned int)maxlabel, outname );
+    }
+  typename ImageType::Pointer fastimage = ITK_NULLPTR;
+  ReadImage<ImageType>(fastimage, fn1.c_str() );
+  typename ImageType::Pointer outlabimage = ITK_NULLPTR;
+  ReadImage<ImageType>(outlabimage, fn2.c_str() );
+  fastimage->FillBuffer(1.e9);
   typedef  itk::FMarchingImageFilter<ImageType, ImageType> FastMarchingFilterType;
   typedef  typename FastMarchingFilterType::LabelImageType LabelImageType;
   typename FastMarchingFilterType::Pointer  fastMarching;
@@ -8035,11 +8216,6 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
   ReadImage<ImageType>(speedimage, fn1.c_str() );
   typename ImageType::Pointer labimage = ITK_NULLPTR;
   ReadImage<ImageType>(labimage, fn2.c_str() );
-  typename ImageType::Pointer fastimage = ITK_NULLPTR;
-  ReadImage<ImageType>(fastimage, fn1.c_str() );
-  typename ImageType::Pointer outlabimage = ITK_NULLPTR;
-  ReadImage<ImageType>(outlabimage, fn2.c_str() );
-  fastimage->FillBuffer(1.e9);
   // compute max label
   double   maxlabel = 0;
   Iterator vfIter2( labimage,  labimage->GetLargestPossibleRegion() );
@@ -8060,6 +8236,17 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
         }
       }
     }
+  if( topocheck == 0 )
+    {
+    // the labels don't depend on each other without a topology check
+    return PropagateLabelsThroughMaskSinglePass<ImageType>( speedimage, labimage, thresh, stopval,
+                                                            (unsigned int)maxlabel, outname );
+    }
+  typename ImageType::Pointer fastimage = ITK_NULLPTR;
+  ReadImage<ImageType>(fastimage, fn1.c_str() );
+  typename ImageType::Pointer outlabimage = ITK_NULLPTR;
+  ReadImage<ImageType>(outlabimage, fn2.c_str() );
+  fastimage->FillBuffer(1.e9);
   typedef itk::FastMarchingThresholdStoppingCriterion< ImageType, ImageType >
       CriterionType;
   typedef typename CriterionType::Pointer CriterionPointer;
@@ -8778,13 +8965,6 @@ int PoissonDiffusion( int argc, char *argv[])
   thresholder2->SetUpperThreshold( 1.e9 );
   thresholder2->Update();
 
-  float sigma = 1.0;
-  if( argc > 6 )
-    {
-    sigma = atof( argv[6] );
-    }
-
-  float convergence = itk::NumericTraits<float>::max();
   float convergenceThreshold = 1e-10;
   if( argc > 9 )
     {
@@ -8795,75 +8975,39 @@ int PoissonDiffusion( int argc, char *argv[])
     {
     maximumNumberOfIterations = atoi( argv[8] );
     }
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  float        lastmean = 0;
-  unsigned int iterations = 0;
-  while( iterations++ < maximumNumberOfIterations && convergence >= convergenceThreshold )
-    {
-    // std::cout << "  Iteration " << iterations << ": " << convergence << std::endl;
-    typedef itk::DiscreteGaussianImageFilter<ImageType, ImageType> SmootherType;
-    typename SmootherType::Pointer smoother = SmootherType::New();
-    smoother->SetVariance( vnl_math_sqr( sigma ) );
-    smoother->SetMaximumError( 0.01f );
-    smoother->SetInput( output );
 
-    /*
-    typedef itk::MaximumImageFilter<ImageType, ImageType, ImageType>
-      MaximumFilterType;
-    typename MaximumFilterType::Pointer maximumFilter = MaximumFilterType::New();
-    maximumFilter->SetInput1( smoother->GetOutput() );
-    maximumFilter->SetInput2( reader->GetOutput() );
-
-    typedef itk::MultiplyImageFilter<ImageType, LabelImageType, ImageType>
-      MultiplierType;
-    typename MultiplierType::Pointer multiplier = MultiplierType::New();
-    multiplier->SetInput1( maximumFilter->GetOutput() );
-    multiplier->SetInput2( thresholder->GetOutput() );
-
-    typedef itk::AddImageFilter<ImageType, ImageType, ImageType>
-     AdderType;
-    typename AdderType::Pointer adder = AdderType::New();
-    adder->SetInput1( reader->GetOutput() );
-    adder->SetInput2( multiplier->GetOutput() );
-
-    typedef itk::SubtractImageFilter<ImageType, ImageType, ImageType>
-      SubtracterType;
-    typename SubtracterType::Pointer subtracter = SubtracterType::New();
-    subtracter->SetInput1( adder->GetOutput() );
-    subtracter->SetInput2( output );
-    */
-    typedef itk::LabelStatisticsImageFilter<ImageType, LabelImageType>
-      StatsFilterType;
-    typename StatsFilterType::Pointer stats = StatsFilterType::New();
-    stats->SetInput( smoother->GetOutput() );
-    stats->SetLabelInput( thresholder->GetOutput() );
-    stats->Update();
-
-    convergence = stats->GetMean( 1 ) - lastmean;
-    lastmean = stats->GetMean( 1 );
-    output =  smoother->GetOutput();
-    output->DisconnectPipeline();
-
-    Iterator vfIter( output,  output->GetLargestPossibleRegion() );
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-      {
-      if(  thresholder2->GetOutput()->GetPixel(vfIter.GetIndex() ) == 1 )
-        {
-        vfIter.Set(reader->GetOutput()->GetPixel(vfIter.GetIndex() ) );
-        }
-      }
+  // the repeated smoothing with the sources reset converges to the harmonic
+  // function with the sources fixed; solve for it directly.  sigma (argv[6])
+  // only set the step of the smoothing and is not needed anymore.
+  typedef MaskedPoissonSolver<ImageType>            SolverType;
+  typedef typename SolverType::VoxelTypeImageType   VoxelTypeImageType;
+  typename VoxelTypeImageType::Pointer voxelTypes = VoxelTypeImageType::New();
+  voxelTypes->CopyInformation( output );
+  voxelTypes->SetRegions( output->GetBufferedRegion() );
+  voxelTypes->Allocate();
+  const size_t     numberOfVoxels = output->GetBufferedRegion().GetNumberOfPixels();
+  const PixelType *sources = thresholder2->GetOutput()->GetBufferPointer();
+  unsigned char *  types = voxelTypes->GetBufferPointer();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
+    {
+    types[n] = ( sources[n] == 1 ) ? SolverType::Fixed : SolverType::Unknown;
     }
 
-  Iterator vfIter( output,  output->GetLargestPossibleRegion() );
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  SolverType solver;
+  solver.SetInput( output );
+  solver.SetVoxelTypeImage( voxelTypes );
+  solver.SetTolerance( convergenceThreshold );
+  solver.SetMaximumNumberOfIterations( maximumNumberOfIterations );
+  solver.Update();
+  output = solver.GetOutput();
+
+  const typename LabelImageType::PixelType *region = thresholder->GetOutput()->GetBufferPointer();
+  PixelType *                               values = output->GetBufferPointer();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
     {
-    if(  thresholder2->GetOutput()->GetPixel(vfIter.GetIndex() ) == 1 )
-      {
-      vfIter.Set(reader->GetOutput()->GetPixel(vfIter.GetIndex() ) );
-      }
-    if(  thresholder->GetOutput()->GetPixel(vfIter.GetIndex() ) == 0 )
+    if( region[n] == 0 )
       {
-      vfIter.Set(0);
+      values[n] = 0;
       }
     }
 
@@ -10108,11 +10252,9 @@ int LabelStats(      int argc, char *argv[])
 {
   typedef float                                                           PixelType;
   typedef itk::Image<PixelType, ImageDimension>                           ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                    Iterator;
 
   int               argct = 2;
   const std::string outname = std::string(argv[argct]);
-  std::string       imagename = ANTSGetFilePrefix(outname.c_str() ) + std::string("_square.nii.gz");
   argct += 2;
   std::string fn1 = std::string(argv[argct]);   argct++;
   std::string fn2 = "";
@@ -10129,24 +10271,6 @@ int LabelStats(      int argc, char *argv[])
     ReadImage<ImageType>(valimage, fn2.c_str() );
     }
 
-  typedef float                  PixelType;
-  typedef std::vector<PixelType> LabelSetType;
-  LabelSetType myLabelSet;
-/** count the labels in the image */
-  Iterator It( image, image->GetLargestPossibleRegion() );
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    PixelType label = It.Get();
-    if( fabs(label) > 0 )
-      {
-      if( find( myLabelSet.begin(), myLabelSet.end(), label )
-          == myLabelSet.end() )
-        {
-        myLabelSet.push_back( label );
-        }
-      }
-    }
-
   // compute the voxel volume
   typename ImageType::SpacingType spacing = image->GetSpacing();
   float volumeelement = 1.0;
@@ -10155,80 +10279,30 @@ int LabelStats(      int argc, char *argv[])
     volumeelement *= spacing[i];
     }
 
+  // the count, mass and center of mass of every label in one pass
+  typedef typename LabelGeometryThreadStruct<ImageType, ImageType>::MapType GeometryMapType;
+  GeometryMapType geometry;
+  ComputeLabelGeometry<ImageType, ImageType>( image, valimage.GetPointer(), true, geometry );
+
   std::ofstream logfile;
   logfile.open(outname.c_str() );
   logfile << "x,y,z,t,label,mass,volume,count" << std::endl;
 
-  std::sort(myLabelSet.begin(), myLabelSet.end() );
-  typename LabelSetType::const_iterator it;
-  unsigned long labelcount = 0;
-  for( it = myLabelSet.begin(); it != myLabelSet.end(); ++it )
-    {
-    labelcount++;
-    }
-
-  float        temp = sqrt( (float)labelcount);
-  unsigned int squareimagesize = (unsigned int)(temp + 1);
-
-  typedef itk::Image<float, 2> TwoDImageType;
-  typename TwoDImageType::RegionType newregion;
-  typename TwoDImageType::SizeType size;
-  size[0] = size[1] = squareimagesize;
-  newregion.SetSize(size);
-  typename TwoDImageType::Pointer squareimage =
-    AllocImage<TwoDImageType>(newregion, 0);
-
-  labelcount = 0;
-  for( it = myLabelSet.begin(); it != myLabelSet.end(); ++it )
+  for( typename GeometryMapType::const_iterator it = geometry.begin(); it != geometry.end(); ++it )
     {
-    float currentlabel = *it;
-    float totalvolume = 0;
-    float totalmass = 0;
-    float totalct = 0;
-    typename ImageType::PointType myCenterOfMass;
-    myCenterOfMass.Fill(0);
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      PixelType label = It.Get();
-      if(  label == currentlabel  )
-        {
-        totalct += 1;
-        if( valimage )
-          {
-          totalmass += valimage->GetPixel( It.GetIndex() );
-          }
-
-        // compute center of mass
-        typename ImageType::PointType point;
-        image->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-        for( unsigned int i = 0; i < spacing.Size(); i++ )
-          {
-          myCenterOfMass[i] += point[i];
-          }
-        }
-      }
+    float currentlabel = it->first;
+    float totalct = it->second.m_Volume;
+    float totalmass = it->second.m_IntegratedIntensity;
+    float totalvolume = volumeelement * totalct;
 
-    totalvolume = volumeelement * totalct;
-
-    for( unsigned int i = 0; i < spacing.Size(); i++ )
-      {
-      myCenterOfMass[i] /= (float)totalct;
-      }
-
-    if( !valimage )
-      {
-//      // std::cout << " Volume Of Label " << *it << " is " << totalvolume <<   "  Avg-Location " << myCenterOfMass
-          //      << std::endl;
-      }
-    else // if ( totalvolume > 500 &&  totalmass/totalct > 1/500 )  {
+    itk::ContinuousIndex<double, ImageDimension> centroidIndex;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
       {
-//      // std::cout << " Volume Of Label " << *it << " is " << totalvolume <<   "  Avg-Location " << myCenterOfMass
-//                << " mass is " << totalmass << " average-val is " << totalmass / totalct << std::endl;
-//      //      // std::cout << *it << "  " <<  totalvolume <<  " & " <<  totalmass/totalct   << " \ " << std::endl;
+      centroidIndex[i] = it->second.m_Centroid[i];
       }
+    typename ImageType::PointType myCenterOfMass;
+    image->TransformContinuousIndexToPhysicalPoint( centroidIndex, myCenterOfMass );
 
-// square image
-    squareimage->GetBufferPointer()[labelcount] = totalmass / totalct;
     if( ImageDimension == 2 )
       {
       logfile << myCenterOfMass[0] << "," << myCenterOfMass[1] << ",0,0," << currentlabel << "," << totalmass << "," << totalvolume << "," << totalct << std::endl;
@@ -10242,13 +10316,10 @@ int LabelStats(      int argc, char *argv[])
       logfile << myCenterOfMass[0] << "," << myCenterOfMass[1] << "," << myCenterOfMass[2] << ","
               << myCenterOfMass[3] << "," << currentlabel << "," << totalmass << "," << totalvolume << "," << totalct << std::endl;
       }
-    labelcount++;
     }
 
   logfile.close();
 
-  //WriteImage<TwoDImageType>(squareimage, imagename.c_str() );
-
   return 0;
 }
 
@@ -10485,7 +10556,8 @@ int ROIStatistics(      int argc, char *argv[])
 {
   typedef float                                                           PixelType;
   typedef itk::Image<PixelType, ImageDimension>                           ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                    Iterator;
+  typedef int                                                             LabelType;
+  typedef itk::Image<LabelType, ImageDimension>                           LabelImageType;
 
   //  if(grade_list.find("Tim") == grade_list.end()) {  // std::cout<<"Tim is not in the map!"<<endl; }
   // mymap.find('a')->second
@@ -10499,7 +10571,6 @@ int ROIStatistics(      int argc, char *argv[])
     throw std::exception();
     }
   const std::string outname = std::string(argv[argct]);
-  typedef vnl_matrix<double> MatrixType;
   argct += 2;
   std::string fn0 = std::string(argv[argct]);   argct++;
   // std::cout << "  fn0 " << fn0 << std::endl;
@@ -10510,165 +10581,92 @@ int ROIStatistics(      int argc, char *argv[])
     {
     fn2 = std::string(argv[argct]);   argct++;
     }
-  std::string fn3 = "";
-  if(  argc > argct )
-    {
-    fn3 = std::string(argv[argct]);   argct++;
-    }
-  std::string fn4 = "";
-  if(  argc > argct )
-    {
-    fn4 = std::string(argv[argct]);   argct++;
-    }
-  std::string fn5 = "";
-  if(  argc > argct )
-    {
-    fn5 = std::string(argv[argct]);   argct++;
-    }
 
   typename ImageType::Pointer image = ITK_NULLPTR;
   typename ImageType::Pointer valimage = ITK_NULLPTR;
-  typename ImageType::Pointer valimage3 = ITK_NULLPTR;
-  typename ImageType::Pointer valimage4 = ITK_NULLPTR;
-  typename ImageType::Pointer valimage5 = ITK_NULLPTR;
   ReadImage<ImageType>(image, fn1.c_str() );
   if( fn2.length() > 3 )
     {
     ReadImage<ImageType>(valimage, fn2.c_str() );
     }
-  if( fn3.length() > 3 )
-    {
-    ReadImage<ImageType>(valimage3, fn3.c_str() );
-    }
-  if( fn4.length() > 3 )
-    {
-    ReadImage<ImageType>(valimage4, fn4.c_str() );
-    }
-  if( fn5.length() > 3 )
+
+  // the stat image at the voxels of the label image:  itself on the same
+  // grid, linearly interpolated otherwise
+  typename ImageType::Pointer statimage = image;
+  if( valimage )
     {
-    ReadImage<ImageType>(valimage5, fn5.c_str() );
+    statimage = valimage;
+    if( valimage->GetLargestPossibleRegion() != image->GetLargestPossibleRegion() ||
+        valimage->GetSpacing() != image->GetSpacing() ||
+        valimage->GetOrigin() != image->GetOrigin() ||
+        valimage->GetDirection() != image->GetDirection() )
+      {
+      typedef itk::LinearInterpolateImageFunction<ImageType, double> ScalarInterpolatorType;
+      typedef itk::ResampleImageFilter<ImageType, ImageType>         ResampleFilterType;
+      typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+      resampler->SetInput( valimage );
+      resampler->SetInterpolator( ScalarInterpolatorType::New() );
+      resampler->SetOutputParametersFromImage( image );
+      resampler->SetDefaultPixelValue( 0 );
+      resampler->Update();
+      statimage = resampler->GetOutput();
+      }
     }
 
-  typedef float                  PixelType;
-  typedef std::vector<PixelType> LabelSetType;
-  LabelSetType myLabelSet;
-/** count the labels in the image */
-  unsigned long maxlab = 0;
-  Iterator      It( image, image->GetLargestPossibleRegion() );
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+  // the clusters are the voxels of the positive labels where the stat is
+  // not zero; the centers of mass are those of all the voxels of the labels
+  typename LabelImageType::Pointer labelimage = AllocImage<LabelImageType>( image, 0 );
+  typename LabelImageType::Pointer clusterimage = AllocImage<LabelImageType>( image, 0 );
+  const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
     {
-    PixelType label = It.Get();
-    if( fabs(label) > 0 )
+    const PixelType label = image->GetBufferPointer()[n];
+    if( label > 0 )
       {
-      if( find( myLabelSet.begin(), myLabelSet.end(), label )
-          == myLabelSet.end() )
+      labelimage->GetBufferPointer()[n] = static_cast<LabelType>( label );
+      if( fabs( statimage->GetBufferPointer()[n] ) > 1.e-9 )
         {
-        myLabelSet.push_back( label );
-        }
-      if( label > maxlab )
-        {
-        maxlab = (unsigned long)label;
+        clusterimage->GetBufferPointer()[n] = static_cast<LabelType>( label );
         }
       }
     }
-  // define the output matrix
-  // for a csv file of  n_regions for rows
-  // with columns of   Volume,CenterOfMassX,CenterOfMassY,CenterOfMassZ,CenterOfMassTime,
-  MatrixType mCSVMatrix(maxlab, ImageDimension + 1, 0);
 
-  //  maxlab=32; // for cortical analysis
-  // compute the voxel volume
-  typename ImageType::SpacingType spacing = image->GetSpacing();
-  float volumeelement = 1.0;
-  for( unsigned int i = 0;  i < spacing.Size(); i++ )
-    {
-    volumeelement *= spacing[i];
-    }
+  typedef typename LabelIntensityStatisticsThreadStruct<LabelImageType, ImageType>::MapType StatisticsMapType;
+  StatisticsMapType statistics;
+  ComputeLabelIntensityStatistics<LabelImageType, ImageType>( clusterimage, statimage, true, 0, statistics );
 
-  vnl_vector<double> pvals(maxlab + 1, 1.0);
-  vnl_vector<double> pvals3(maxlab + 1, 1.0);
-  vnl_vector<double> pvals4(maxlab + 1, 1.0);
-  vnl_vector<double> pvals5(maxlab + 1, 1.0);
-  vnl_vector<double> clusters(maxlab + 1, 0.0);
-  vnl_vector<double> masses(maxlab + 1, 0.0);
-  //  typename ImageType::PointType mycomlist[33];
-  std::ofstream logfile;
-  logfile.open(outname.c_str() );
+  std::vector<LabelType>                     labels;
+  std::vector<typename ImageType::PointType> centroids;
+  GetLabelCentroids<LabelImageType, typename ImageType::PointType>( labelimage, labels, centroids );
 
-  std::sort(myLabelSet.begin(), myLabelSet.end() );
-  typename LabelSetType::const_iterator it;
-  unsigned long labelcount = 0;
-  for( it = myLabelSet.begin(); it != myLabelSet.end(); ++it )
+  unsigned int maxlab = 0;
+  if( !labels.empty() )
     {
-    labelcount++;
+    maxlab = labels.back();
     }
 
-  typedef itk::LinearInterpolateImageFunction<ImageType, float> ScalarInterpolatorType;
-  typename ScalarInterpolatorType::Pointer interp =  ScalarInterpolatorType::New();
-  if( valimage )
-    {
-    interp->SetInputImage(valimage);
-    }
-  else
-    {
-    interp->SetInputImage(image);
-    }
-  // iterate over the label image and index into the stat image
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    PixelType label = It.Get();
-    typename ImageType::PointType point;
-    image->TransformIndexToPhysicalPoint(It.GetIndex(), point);
-    float vv = interp->Evaluate( point );
-    //    float vv = valimage->GetPixel(It.GetIndex());
-    if(  label > 0  && fabs(vv) > 1.e-9 )
-      {
-      clusters[(unsigned long) label] = clusters[(unsigned long) label] + 1;
-      masses[(unsigned long) label] = masses[(unsigned long) label] + vv;
-      }
-    }
+  std::ofstream logfile;
+  logfile.open(outname.c_str() );
   logfile << "ROIName,ROINumber,ClusterSize,Mass,Mean,comX,comY,comZ,comT" << std::endl;
-  //  for( it = myLabelSet.begin(); it != myLabelSet.end(); ++it )
   for( unsigned int mylabel = 1; mylabel < maxlab + 1; mylabel++ )
     {
     unsigned int roi = mylabel - 1;
-    /* first count which roi it is by iterating through the label sets
-     it = myLabelSet.begin();
-    while (  (*it) != mylabel && it != myLabelSet.end() )
-  {
-    // std::cout << " it " << *it << " roi " << roi << " mylabel " << mylabel << std::endl;
-    roi++;
-    ++it;
-    }*/
 
-    typename ImageType::PointType myCenterOfMass;
-    myCenterOfMass.Fill(0);
-    unsigned long totalct = 0;
-    if( clusters[mylabel] > 0 )
-      {
-      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-        {
-        PixelType label = It.Get();
-        if(  label == mylabel )
-          {
-          totalct += 1;
-          // compute center of mass
-          typename ImageType::PointType point;
-          image->TransformIndexToPhysicalPoint(It.GetIndex(), point);
-          for( unsigned int i = 0; i < spacing.Size(); i++ )
-            {
-            myCenterOfMass[i] += point[i];
-            }
-          }
-        }
-      } // if clusters big enough
-    if( totalct == 0 )
+    double clusters = 0, masses = 0;
+    typename StatisticsMapType::const_iterator its = statistics.find( mylabel );
+    if( its != statistics.end() )
       {
-      totalct = 1;
+      clusters = its->second.m_Count;
+      masses = its->second.m_Sum;
       }
-    for( unsigned int i = 0; i < spacing.Size(); i++ )
+
+    typename ImageType::PointType myCenterOfMass;
+    myCenterOfMass.Fill(0);
+    typename std::vector<LabelType>::const_iterator itl = std::lower_bound( labels.begin(), labels.end(),
+                                                                            static_cast<LabelType>( mylabel ) );
+    if( clusters > 0 && itl != labels.end() && *itl == static_cast<LabelType>( mylabel ) )
       {
-      myCenterOfMass[i] /= (float)totalct;
+      myCenterOfMass = centroids[itl - labels.begin()];
       }
     double comy = 0, comz = 0, comt = 0;
     double comx = myCenterOfMass[0];
@@ -10687,146 +10685,14 @@ int ROIStatistics(      int argc, char *argv[])
     if( roi < roimap.size() )
       {
       logfile << roimap[roi] << "," << roi + 1 << ","
-              << clusters[roi
-                  + 1] << ","
-              << masses[roi
-                + 1] << ","
-              << masses[roi
-                + 1] / clusters[roi + 1] << "," << comx << "," << comy << "," << comz << "," << comt << std::endl;
+              << clusters << ","
+              << masses << ","
+              << masses / clusters << "," << comx << "," << comy << "," << comz << "," << comt << std::endl;
       }
     }
   logfile.close();
 
   return 0;
-
-  float        temp = sqrt( (float)labelcount);
-  unsigned int squareimagesize = (unsigned int)(temp + 1);
-
-  typedef itk::Image<float, 2> TwoDImageType;
-  typename TwoDImageType::RegionType newregion;
-  typename TwoDImageType::SizeType size;
-  size[0] = size[1] = squareimagesize;
-  newregion.SetSize(size);
-  typename TwoDImageType::Pointer squareimage =
-    AllocImage<TwoDImageType>(newregion, 0);
-
-  labelcount = 0;
-  typename ImageType::PointType myCenterOfMass;
-  myCenterOfMass.Fill(0);
-  //  for (unsigned int i=0; i<=maxlab; i++) mycomlist[i]=myCenterOfMass;
-  for( it = myLabelSet.begin(); it != myLabelSet.end(); ++it )
-    {
-    float currentlabel = *it;
-    float totalvolume = 0;
-    float totalmass = 0;
-    float totalct = 0;
-    float maxoneminuspval = 0.0;
-    float maxoneminuspval3 = 0.0;
-    float maxoneminuspval4 = 0.0;
-    float maxoneminuspval5 = 0.0;
-    myCenterOfMass.Fill(0);
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      PixelType label = It.Get();
-      if(  label == currentlabel  )
-        {
-        totalvolume += volumeelement;
-        totalct += 1;
-        float vv = valimage->GetPixel(It.GetIndex() );
-        if( valimage )
-          {
-          totalmass += vv;
-          }
-        if(  vv > maxoneminuspval )
-          {
-          maxoneminuspval = vv;
-          }
-        if( valimage3 )
-          {
-          vv = valimage3->GetPixel(It.GetIndex() );
-          if(  fabs(vv) > fabs(maxoneminuspval3) )
-            {
-            maxoneminuspval3 = vv;
-            }
-          }
-        if( valimage4 )
-          {
-          vv = valimage4->GetPixel(It.GetIndex() );
-          if(  vv > maxoneminuspval4 )
-            {
-            maxoneminuspval4 = vv;
-            }
-          }
-        if( valimage5 )
-          {
-          vv = valimage5->GetPixel(It.GetIndex() );
-          if(  vv > maxoneminuspval5 )
-            {
-            maxoneminuspval5 = vv;
-            }
-          }
-
-        // compute center of mass
-        typename ImageType::PointType point;
-        image->TransformIndexToPhysicalPoint(It.GetIndex(), point);
-        for( unsigned int i = 0; i < spacing.Size(); i++ )
-          {
-          myCenterOfMass[i] += point[i];
-          }
-        }
-      }
-    if( totalct == 0 )
-      {
-      totalct = 1;
-      }
-    for( unsigned int i = 0; i < spacing.Size(); i++ )
-      {
-      myCenterOfMass[i] /= (float)totalct;
-      }
-
-    clusters[(unsigned long)*it] = totalvolume;
-    masses[(unsigned long)*it] = totalmass / totalct;
-    pvals[(unsigned long)*it] = 1.0 - maxoneminuspval;
-    pvals3[(unsigned long)*it] = maxoneminuspval3;
-    pvals4[(unsigned long)*it] = 1.0 - maxoneminuspval4;
-    pvals5[(unsigned long)*it] = 1.0 - maxoneminuspval5;
-    // mycomlist[(unsigned long)*it]=myCenterOfMass;
-// square image
-    squareimage->GetBufferPointer()[labelcount] = totalmass / totalct;
-    labelcount++;
-    }
-  for( unsigned int roi = 1; roi <= maxlab; roi++ )
-    {
-    logfile << roimap.find(roi)->second << ",";
-    }
-  for( unsigned int roi = maxlab + 1; roi <= maxlab * 2; roi++ )
-    {
-    if( roi < maxlab * 2 )
-      {
-      logfile << roimap.find(roi - maxlab)->second + std::string("mass") << ",";
-      }
-    else
-      {
-      logfile << roimap.find(roi - maxlab)->second + std::string("mass") << std::endl;
-      }
-    }
-  for( unsigned int roi = 1; roi <= maxlab; roi++ )
-    {
-    logfile << clusters[roi] << ",";
-    }
-  for( unsigned int roi = maxlab + 1; roi <= maxlab * 2; roi++ )
-    {
-    if( roi < maxlab * 2 )
-      {
-      logfile << masses[roi - maxlab] << ",";
-      }
-    else
-      {
-      logfile << masses[roi - maxlab] << std::endl;
-      }
-    }
-  logfile.close();
-  return 0;
 }
 
 template <unsigned int ImageDimension>
@@ -10979,6 +10845,11 @@ int ConvertImageSetToMatrix(unsigned int argc, char *argv[])
   unsigned long xsize = xx1;
   unsigned long ysize = yy1;
 
+  if( VoxelMatrixFile::IsVoxelMatrixFileName( outname ) )
+    {
+    // always one row per image, the layout sccan reads
+    return ConvertImageSetToVoxelMatrixFile<ImageType>( outname, mask, maskfn, argv + argct, argc - argct );
+    }
   if( strcmp(ext.c_str(), ".csv") == 0 )
     {
     typedef itk::Array2D<double> MatrixType;
@@ -11517,10 +11388,9 @@ int CorrelationUpdate(      int argc, char *argv[])
 template <unsigned int ImageDimension>
 int MajorityVoting( int argc, char *argv[] )
 {
-  typedef int                                           PixelType;
-  typedef itk::Image<PixelType, ImageDimension>         ImageType;
-  typedef itk::MinimumMaximumImageCalculator<ImageType> CalculatorType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>  IteratorType;
+  typedef int                                   PixelType;
+  typedef itk::Image<PixelType, ImageDimension> ImageType;
+  typedef itk::Image<float, ImageDimension>     RealImageType;
 
   if( argc < 5 )
     {
@@ -11530,54 +11400,14 @@ int MajorityVoting( int argc, char *argv[] )
 
   std::string outputName = std::string( argv[2] );
 
-  // Read input segmentations
-  const unsigned long                               nImages = argc - 4;
-  typename std::vector<typename ImageType::Pointer> images(argc - 4);
-  for( int i = 4; i < argc; i++ )
-    {
-    ReadImage<ImageType>( images[i - 4], argv[i] );
-    }
-
-  // Find maximum label
-  int maxLabel = 0;
-  for( unsigned int i = 0; i < nImages; i++ )
-    {
-    typename CalculatorType::Pointer calc = CalculatorType::New();
-    calc->SetImage( images[i] );
-    calc->ComputeMaximum();
-    if( calc->GetMaximum() > maxLabel )
-      {
-      maxLabel = calc->GetMaximum();
-      }
-    }
-  unsigned long nLabels = maxLabel + 1; // account for label=0
-
-  typename ImageType::Pointer output =
-    AllocImage<ImageType>(images[0], 0);
-
-  IteratorType              it( output, output->GetLargestPossibleRegion() );
-  itk::Array<unsigned long> votes;
-  votes.SetSize( nLabels );
+  LabelVotingFusion<ImageType, RealImageType> fusion;
+  fusion.SetLabelFileNames( std::vector<std::string>( argv + 4, argv + argc ) );
 
-  while( !it.IsAtEnd() )
+  typename ImageType::Pointer output;
+  if( !fusion.ComputeMajorityVoting( output ) )
     {
-    votes.Fill(0);
-    unsigned long maxVotes = 0;
-    unsigned long votedLabel = 0;
-    for( unsigned long i = 0; i < nImages; i++ )
-      {
-      unsigned long label = images[i]->GetPixel( it.GetIndex() );
-      votes.SetElement(label, votes.GetElement(label) + 1 );
-
-      if( votes.GetElement(label) > maxVotes )
-        {
-        maxVotes = votes.GetElement(label);
-        votedLabel = label;
-        }
-      }
-
-    it.Set( votedLabel );
-    ++it;
+    std::cerr << "MajorityVoting: " << fusion.GetErrorMessage() << std::endl;
+    return EXIT_FAILURE;
     }
 
   WriteImage<ImageType>( output, outputName.c_str() );
@@ -11652,56 +11482,38 @@ int STAPLE( int argc, char *argv[] )
   typedef itk::Image<PixelType, ImageDimension> ImageType;
   typedef itk::Image<float, ImageDimension>     OutputImageType;
 
-  typedef itk::MinimumMaximumImageCalculator<ImageType>      CalculatorType;
-  typedef itk::STAPLEImageFilter<ImageType, OutputImageType> StapleFilterType;
-
   if( argc < 5 )
     {
     // std::cout << " Not enough inputs " << std::endl;
     return 1;
     }
 
-  std::string outputName = std::string( argv[2] );
-  typename StapleFilterType::Pointer stapler = StapleFilterType::New();
+  std::string            outputName = std::string( argv[2] );
   std::string::size_type idx;
   idx = outputName.find_first_of('.');
   std::string tempname = outputName.substr(0, idx);
   std::string extension = outputName.substr(idx, outputName.length() );
   float       confidence = atof( argv[4] ); // = 0.5
 
-  // stapler->SetForegroundValue( foreground );
-  stapler->SetConfidenceWeight( confidence );
-
   // Read input segmentations
-  typename ImageType::Pointer              nullimage( ITK_NULLPTR );
-  std::vector<typename ImageType::Pointer> images(argc - 5, nullimage );
-  typename CalculatorType::Pointer calc = CalculatorType::New();
-  int maxLabel = 0;
-  for( int i = 5; i < argc; i++ )
+  LabelVotingFusion<ImageType, OutputImageType> fusion;
+  fusion.SetLabelFileNames( std::vector<std::string>( argv + 5, argv + argc ) );
+  if( !fusion.ComputeLabelVotes() )
     {
-    images[i - 5] = ImageType::New();
-    ReadImage<ImageType>( images[i - 5], argv[i] );
-    stapler->SetInput( i - 5, images[i - 5] );
-    // std::cout << "Input image " << i - 5 << " " << argv[i] << std::endl;
-
-    calc->SetImage( images[i - 5] );
-    calc->ComputeMaximum();
-    if( calc->GetMaximum() > maxLabel )
-      {
-      maxLabel = calc->GetMaximum();
-      }
+    std::cerr << "STAPLE: " << fusion.GetErrorMessage() << std::endl;
+    return EXIT_FAILURE;
     }
 
-  // std::cout << "Examining " << maxLabel << " labels" << std::endl;
-  for( int label = 1; label <= maxLabel; label++ )
+  // std::cout << "Examining " << fusion.GetMaximumLabel() << " labels" << std::endl;
+  typename OutputImageType::Pointer output = AllocImage<OutputImageType>( fusion.GetReferenceImage() );
+  for( int label = 1; label <= fusion.GetMaximumLabel(); label++ )
     {
     char num[5];
     sprintf( num, "%04d", label );
 
     std::string oname = tempname + num + extension;
-    stapler->SetForegroundValue( label );
-    stapler->Update();
-    WriteImage<OutputImageType>( stapler->GetOutput(), oname.c_str() );
+    fusion.ComputeSTAPLE( label, confidence, output );
+    WriteImage<OutputImageType>( output, oname.c_str() );
     }
 
   return 0;
@@ -11714,9 +11526,6 @@ int AverageLabels( int argc, char *argv[] )
   typedef itk::Image<PixelType, ImageDimension> ImageType;
   typedef itk::Image<float, ImageDimension>     OutputImageType;
 
-  typedef itk::MinimumMaximumImageCalculator<ImageType> CalculatorType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>  IteratorType;
-
   if( argc < 5 )
     {
     // std::cout << " Not enough inputs " << std::endl;
@@ -11730,58 +11539,24 @@ int AverageLabels( int argc, char *argv[] )
   std::string extension = outputName.substr(idx, outputName.length() );
 
   // Read input segmentations
-  typename ImageType::Pointer              nullimage( ITK_NULLPTR );
-  std::vector<typename ImageType::Pointer> images(argc - 4, nullimage );
-
-  typename CalculatorType::Pointer calc = CalculatorType::New();
-  int maxLabel = 0;
-  for( int i = 4; i < argc; i++ )
+  LabelVotingFusion<ImageType, OutputImageType> fusion;
+  fusion.SetLabelFileNames( std::vector<std::string>( argv + 4, argv + argc ) );
+  if( !fusion.ComputeLabelVotes() )
     {
-    images[i - 4] = ImageType::New();
-    ReadImage<ImageType>( images[i - 4], argv[i] );
-    // std::cout << "Input image " << i - 4 << " " << argv[i] << std::endl;
-
-    calc->SetImage( images[i - 4] );
-    calc->ComputeMaximum();
-    if( calc->GetMaximum() > maxLabel )
-      {
-      maxLabel = calc->GetMaximum();
-      }
+    std::cerr << "AverageLabels: " << fusion.GetErrorMessage() << std::endl;
+    return EXIT_FAILURE;
     }
 
-  // std::cout << "Examining " << maxLabel << " labels" << std::endl;
-  typename OutputImageType::Pointer              nullout( ITK_NULLPTR );
-  std::vector<typename OutputImageType::Pointer> outimages;
-  for( int label = 0; label < maxLabel; label++ )
-    {
-    typename OutputImageType::Pointer img = OutputImageType::New();
-    img->SetRegions( images[0]->GetLargestPossibleRegion() );
-    img->SetDirection( images[0]->GetDirection() );
-    img->SetOrigin( images[0]->GetOrigin() );
-    img->SetSpacing( images[0]->GetSpacing() );
-    img->Allocate();
-    outimages.push_back( img );
-    }
-  for( unsigned int i = 0; i < images.size(); i++ )
-    {
-    IteratorType it( images[i], images[i]->GetLargestPossibleRegion() );
-    for( it.GoToBegin(); !it.IsAtEnd(); ++it )
-      {
-      if( it.Value() > 0 )
-        {
-        outimages[it.Value() - 1]->SetPixel( it.GetIndex(),
-                                             outimages[it.Value() - 1]->GetPixel( it.GetIndex() )
-                                             + 1.0 / images.size() );
-        }
-      }
-    }
-  for( int label = 1; label <= maxLabel; label++ )
+  // std::cout << "Examining " << fusion.GetMaximumLabel() << " labels" << std::endl;
+  typename OutputImageType::Pointer output = AllocImage<OutputImageType>( fusion.GetReferenceImage() );
+  for( int label = 1; label <= fusion.GetMaximumLabel(); label++ )
     {
     char num[5];
     sprintf( num, "%04d", label );
 
     std::string oname = tempname + num + extension;
-    WriteImage<OutputImageType>( outimages[label - 1], oname.c_str() );
+    fusion.ComputeAverageLabel( label, output );
+    WriteImage<OutputImageType>( output, oname.c_str() );
     }
 
   return 0;
@@ -11790,13 +11565,10 @@ int AverageLabels( int argc, char *argv[] )
 template <unsigned int ImageDimension>
 int CorrelationVoting( int argc, char *argv[] )
 {
-  typedef float                                              PixelType;
-  typedef int                                                LabelType;
-  typedef itk::Image<PixelType, ImageDimension>              ImageType;
-  typedef itk::Image<LabelType, ImageDimension>              LabelImageType;
-  typedef itk::MinimumMaximumImageCalculator<LabelImageType> CalculatorType;
-  typedef itk::ImageRegionIteratorWithIndex<LabelImageType>  IteratorType;
-  typedef itk::NeighborhoodIterator<ImageType>               NeighborhoodIteratorType;
+  typedef float                                 PixelType;
+  typedef int                                   LabelType;
+  typedef itk::Image<PixelType, ImageDimension> ImageType;
+  typedef itk::Image<LabelType, ImageDimension> LabelImageType;
 
   if( argc < 6 )
     {
@@ -11815,141 +11587,17 @@ int CorrelationVoting( int argc, char *argv[] )
     radius = atoi( argv[5 + 2 * nImages] );
     }
 
-  typename ImageType::Pointer target;
-  ReadImage<ImageType>( target, argv[4] );
-
-  typename std::vector<typename ImageType::Pointer>      images(nImages);
-  typename std::vector<typename LabelImageType::Pointer> labels(nImages);
-  for( int i = 5; i < (5 + nImages); i++ )
-    {
-    ReadImage<ImageType>( images[i - 5], argv[i] );
-    }
-  for( int i = 5 + nImages; i < (5 + 2 * nImages); i++ )
-    {
-    ReadImage<LabelImageType>( labels[i - 5 - nImages], argv[i] );
-    }
-
-  // Find maximum label
-  int maxLabel = 0;
-  for( int i = 0; i < nImages; i++ )
-    {
-    typename CalculatorType::Pointer calc = CalculatorType::New();
-    calc->SetImage( labels[i] );
-    calc->ComputeMaximum();
-    if( calc->GetMaximum() > maxLabel )
-      {
-      maxLabel = calc->GetMaximum();
-      }
-    }
-  unsigned long nLabels = maxLabel + 1; // account for label=0
-
-  typename LabelImageType::Pointer output =
-    AllocImage<LabelImageType>(images[0], 0);
+  LabelVotingFusion<LabelImageType, ImageType> fusion;
+  fusion.SetIntensityFileNames( argv[4], std::vector<std::string>( argv + 5, argv + 5 + nImages ) );
+  fusion.SetLabelFileNames( std::vector<std::string>( argv + 5 + nImages, argv + 5 + 2 * nImages ) );
+  fusion.SetNeighborhoodRadius( radius );
 
-  IteratorType      it( output, output->GetLargestPossibleRegion() );
-  itk::Array<float> votes;
-  votes.SetSize( nLabels );
-
-  typename NeighborhoodIteratorType::RadiusType rad;
-  for( unsigned int j = 0; j < ImageDimension; j++ )
+  typename LabelImageType::Pointer output;
+  if( !fusion.ComputeCorrelationVoting( output ) )
     {
-    rad[j] = radius;
+    std::cerr << "CorrelationVoting: " << fusion.GetErrorMessage() << std::endl;
+    return EXIT_FAILURE;
     }
-  NeighborhoodIteratorType metricIt(rad, target, target->GetLargestPossibleRegion() );
-
-  while( !it.IsAtEnd() )
-    {
-    votes.Fill(0);
-    float maxVotes = 0;
-    int   votedLabel = 0;
-    for( int i = 0; i < nImages; i++ )
-      {
-      int label = labels[i]->GetPixel( it.GetIndex() );
-      votes.SetElement(label, votes.GetElement(label) + 1 );
-
-      if( votes.GetElement(label) > maxVotes )
-        {
-        maxVotes = votes.GetElement(label);
-        votedLabel = label;
-        }
-      }
-
-    // If all agree, assign label immediately
-    if( maxVotes == nImages )
-      {
-      it.Set( votedLabel );
-      }
-    else
-      {
-      votes.Fill( 0.0 );
-      maxVotes = 0.0;
-      votedLabel = 0;
-
-      itk::VariableLengthVector<float> weights( nImages );
-      for( int i = 0; i < nImages; i++ )
-        {
-        metricIt.SetLocation( it.GetIndex() );
-        float targetMean = 0.0;
-        float targetVar = 0.0;
-        float imageMean = 0.0;
-        float imageVar = 0.0;
-        float k = 0;
-        float product = 0.0;
-        for( unsigned int j = 0; j < metricIt.Size(); j++ )
-          {
-          typename NeighborhoodIteratorType::OffsetType internal;
-          typename NeighborhoodIteratorType::OffsetType offset;
-          if( metricIt.IndexInBounds( j, internal, offset ) )
-            {
-            k++;
-            typename ImageType::IndexType idx = metricIt.GetIndex( j );
-            if( k == 1 )
-              {
-              targetMean = target->GetPixel( idx );
-              imageMean = images[i]->GetPixel( idx );
-              targetVar = 0.0;
-              imageVar = 0.0;
-              }
-            else
-              {
-              float oldMean = targetMean;
-              float value = target->GetPixel( idx );
-              targetMean = targetMean + (value - targetMean) / k;
-              targetVar = targetVar + (value - oldMean) * ( value - targetMean );
-
-              oldMean = imageMean;
-              float iValue = images[i]->GetPixel( idx );
-              imageMean = imageMean + ( iValue - imageMean ) / k;
-              imageVar = imageVar + ( iValue - oldMean) * ( iValue - imageMean );
-
-              product += value * iValue;
-              }
-            } // metricIt.IndexInBounds()
-          }   // j >= metricIt.Size()
-
-        targetVar /= (k - 1);
-        imageVar /= (k - 1);
-        float pearson =
-          ( product - k * targetMean * imageMean ) / ( (k - 1) * std::sqrt(targetVar) * std::sqrt(imageVar) );
-        weights.SetElement( i, std::fabs(pearson) );
-        } // i >= nImages
-      for( int i = 0; i < nImages; i++ )
-        {
-        int label = labels[i]->GetPixel( it.GetIndex() );
-        votes.SetElement(label, votes.GetElement(label) + weights.GetElement(i) );
-
-        if( votes.GetElement(label) > maxVotes )
-          {
-          maxVotes = votes.GetElement(label);
-          votedLabel = label;
-          }
-        }
-
-      it.Set(votedLabel);
-      } // else find weighted vote winner
-
-    ++it;
-    } // iterate over output image
 
   WriteImage<LabelImageType>( output, outputName.c_str() );
   return 0;
@@ -12585,25 +12233,7 @@ int PMSmoothImage(int argc, char *argv[])
   typename ImageType::Pointer image1 = ITK_NULLPTR;
   typename ImageType::Pointer varimage = ITK_NULLPTR;
   ReadImage<ImageType>(image1, fn1.c_str() );
-  PixelType     spacingsize = 0;
-  for( unsigned int d = 0; d < ImageDimension; d++ )
-    {
-    PixelType sp = image1->GetSpacing()[d];
-    spacingsize += sp * sp;
-    }
-  spacingsize = sqrt( spacingsize );
-  typedef itk::GradientAnisotropicDiffusionImageFilter< ImageType,
-							ImageType > FilterType;
-  typename FilterType::Pointer filter = FilterType::New();
-  filter->SetInput( image1 );
-  filter->SetNumberOfIterations( sigma );
-  PixelType mytimestep = spacingsize / std::pow( 2.0 , static_cast<double>(ImageDimension+1) );
-  PixelType reftimestep = 0.4 / std::pow( 2.0 , static_cast<double>(ImageDimension+1) );
-  if ( mytimestep > reftimestep ) mytimestep = reftimestep;
-  filter->SetTimeStep( mytimestep );
-  filter->SetConductanceParameter( conductance ); // might need to change this
-  filter->Update();
-  varimage = filter->GetOutput();
+  varimage = iMathPeronaMalik<ImageType>( image1, static_cast<unsigned long>( sigma ), conductance );
   WriteImage<ImageType>( varimage, outname.c_str() );
   return EXIT_SUCCESS;
 }
@@ -12652,113 +12282,44 @@ int ConvolveImage( int argc, char *argv[] )
 template <unsigned int ImageDimension>
 int InPaint(int argc, char *argv[])
 {
-  typedef float                                                           PixelType;
-  typedef itk::Image<PixelType, ImageDimension>                           ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                    Iterator;
-  int               argct = 2;
+  typedef float                                 PixelType;
+  typedef itk::Image<PixelType, ImageDimension> ImageType;
+  int               argct = 2;
   const std::string outname = std::string(argv[argct]);
   argct += 2;
-  std::string fn1 = std::string(argv[argct]);   argct++;
-  float       sigma = 1.0;
+  std::string  fn1 = std::string(argv[argct]);   argct++;
+  unsigned int iterations = 1;
   if( argc > argct )
     {
-    sigma = atof(argv[argct]); argct++;
+    iterations = static_cast<unsigned int>( atof(argv[argct]) ); argct++;
     }
   typename ImageType::Pointer image1 = ITK_NULLPTR;
-  typename ImageType::Pointer varimage = ITK_NULLPTR;
   ReadImage<ImageType>(image1, fn1.c_str() );
-  PixelType     spacingsize = 0;
-  PixelType     minsp = image1->GetSpacing()[0];
-  for( unsigned int d = 0; d < ImageDimension; d++ )
-    {
-    PixelType sp = image1->GetSpacing()[d];
-    if ( sp < minsp ) minsp = sp;
-    spacingsize += sp * sp;
-    }
-  spacingsize = sqrt( spacingsize );
-  float       inpow = spacingsize * 2.0;
-  if( argc > argct )
-    {
-    inpow = atof(argv[argct]); argct++;
-    }
-  // # 1 job - create a kernel
-  typename ImageType::Pointer kernel = ImageType::New();
-  typename ImageType::IndexType start;
-  typename ImageType::SizeType size;
-  typename ImageType::RegionType region;
-  start.Fill(0);
-  size.Fill(3);
-  region.SetSize(size);
-  region.SetIndex(start);
-  kernel->SetRegions(region);
-  kernel->Allocate();
-  kernel->SetSpacing( image1->GetSpacing() );
-  unsigned long kernelsize = region.GetNumberOfPixels();
-  itk::ImageRegionIterator<ImageType> imageIterator(kernel, region);
-  unsigned int ct = 0;
-  typename ImageType::PointType centerPoint;
-  centerPoint.Fill( 0 );
-  typename ImageType::PointType locPoint;
-  locPoint.Fill( 0 );
-  while(!imageIterator.IsAtEnd())
-    {
-    if ( ct == static_cast<unsigned int>( std::floor( (PixelType) kernelsize / 2.0 ) ) )
-      {
-      kernel->TransformIndexToPhysicalPoint(  imageIterator.GetIndex(), centerPoint );
-      }
-    ++ct;
-    ++imageIterator;
-    }
-  unsigned int ct2 = 0;
-  PixelType totalval = 0;
-  imageIterator.GoToBegin();
-  while(!imageIterator.IsAtEnd())
-    {
-    kernel->TransformIndexToPhysicalPoint(  imageIterator.GetIndex(), locPoint );
-    PixelType val = 0;
-    for ( unsigned int d = 0; d < ImageDimension; d++ )
-      {
-      PixelType delt = ( locPoint[d] - centerPoint[d] );
-      val += delt * delt;
-      }
-    PixelType distval = sqrt( val );
-    if ( distval > inpow ) val = 1.e8;
-    if ( val > 0 )
-      {
-      imageIterator.Set( 1.0 / val );
-      totalval += imageIterator.Get( );
-      }
-    if ( ct2 == static_cast<unsigned int>( std::floor( (PixelType) ct / 2.0 ) ) ) imageIterator.Set( 1.e-8 );
-    ++ct2;
-    ++imageIterator;
-    }
-  imageIterator.GoToBegin();
-  while(!imageIterator.IsAtEnd())
-    {
-    imageIterator.Set( imageIterator.Get() / totalval );
-    ++imageIterator;
-    }
-  typedef itk::ImageDuplicator<ImageType> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage( image1 );
-  duplicator->Update();
-  varimage =  duplicator->GetOutput();
-  for ( unsigned int i = 0; i < sigma; i++ )
-    {
-    typedef itk::ConvolutionImageFilter< ImageType, ImageType > FilterType;
-    typename FilterType::Pointer filter = FilterType::New();
-    filter->SetInput( varimage );
-    filter->SetKernelImage(kernel);
-    filter->Update();
-    varimage = filter->GetOutput();
-    Iterator vfIter( varimage,  varimage->GetLargestPossibleRegion() );
-    for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-      {
-      PixelType pixval = image1->GetPixel( vfIter.GetIndex() );
-      if ( pixval > 0 ) vfIter.Set( pixval );
-      }
-    }
-  WriteImage<ImageType>( varimage, outname.c_str() );
+
+  // the repeated averaging with the non-zero values reset converges to the
+  // harmonic interpolation of the non-zero values; each iteration of the
+  // solver does as much as many averaging passes, so #iterations now bounds
+  // the solver iterations.  The old kernel radius argument is not needed.
+  typedef MaskedPoissonSolver<ImageType>          SolverType;
+  typedef typename SolverType::VoxelTypeImageType VoxelTypeImageType;
+  typename VoxelTypeImageType::Pointer voxelTypes = VoxelTypeImageType::New();
+  voxelTypes->CopyInformation( image1 );
+  voxelTypes->SetRegions( image1->GetBufferedRegion() );
+  voxelTypes->Allocate();
+  const size_t     numberOfVoxels = image1->GetBufferedRegion().GetNumberOfPixels();
+  const PixelType *values = image1->GetBufferPointer();
+  unsigned char *  types = voxelTypes->GetBufferPointer();
+  for( size_t n = 0; n < numberOfVoxels; n++ )
+    {
+    types[n] = ( values[n] > 0 ) ? SolverType::Fixed : SolverType::Unknown;
+    }
+
+  SolverType solver;
+  solver.SetInput( image1 );
+  solver.SetVoxelTypeImage( voxelTypes );
+  solver.SetMaximumNumberOfIterations( std::max( iterations, 1u ) );
+  solver.Update();
+  WriteImage<ImageType>( solver.GetOutput(), outname.c_str() );
   return EXIT_SUCCESS;
 }
 
@@ -13716,898 +13277,764 @@ int MatchBlobs( int argc, char *argv[] )
   WriteImage<BlobRadiusImageType>( labimg, outname1.c_str() );
   std::string outname2 = outname + std::string("lm2.nii.gz");
   WriteImage<BlobRadiusImageType>( labimg2, outname2.c_str() );
-  std::string outname3 = outname + std::string("conf2.nii.gz");
-  WriteImage<BlobRadiusImageType>( confimg2, outname3.c_str() );
-  return EXIT_SUCCESS;
-}
-
-//
-// ImageMath was a gigantic switch statement that had 3 duplicated
-// lists of 'if (operation == <op>)' clauses for 2d, 3d, and 4d. I
-// figured out which functions were 2D only, 3D only and 4D Only,
-// which were valid for all dimensions,  which were 2d and 3d, and
-// which were 3d and 4d.
-// So there's a template method for each case, and they're assembled
-// for each dimension in an Explicit Template Function below.
-template<unsigned DIM>
-int
-ImageMathHelper2DOnly(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "TileImages" )
-    {
-    TileImages<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesRegionCorr" )
-    {
-    TimeSeriesRegionCorr<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesRegionSCCA" )
-    {
-    TimeSeriesRegionSCCA<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  return EXIT_FAILURE;
-}
-
-template <unsigned DIM>
-int
-ImageMathHelper2DOr3D(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "AverageLabels" )
-    {
-    AverageLabels<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Check3TissueLabeling" )
-    {
-    Check3TissueLabeling<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "oldPropagateLabelsThroughMask" )
-    {
-    PropagateLabelsThroughMask<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SetOrGetPixel" )
-    {
-    SetOrGetPixel<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "STAPLE" )
-    {
-    STAPLE<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  return EXIT_FAILURE;
-}
-
-template <unsigned DIM>
-int
-ImageMathHelper3DOr4D(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "ConvertLandmarkFile" )
-    {
-    ConvertLandmarkFile<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PASLQuantifyCBF" )
-    {
-    PASLQuantifyCBF<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PASL" )
-    {
-    PASL<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "pCASL" )
-    {
-    pCASL<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TriPlanarView" )
-    {
-    TriPlanarView<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  return EXIT_FAILURE;
-}
-
-template <unsigned DIM>
-int
-ImageMathHelper3DOnly(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "4DTensorTo3DTensor" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ComponentTo3DTensor" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "FuseNImagesIntoNDVectorField" )
-    {
-    FuseNImagesIntoNDVectorField<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ExtractComponentFrom3DTensor" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MTR" )
-    {
-    MTR<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SmoothTensorImage" )
-    {
-    SmoothTensorImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorAxialDiffusion" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorColor" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorEigenvalue" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorFA" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorFANumerator" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorFADenominator" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorIOTest" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorMask" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorMeanDiffusion" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorRadialDiffusion" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorToLocalSpace" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorToPhysicalSpace" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorToVectorComponent" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TensorToVector" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ValidTensor" )
-    {
-    TensorFunctions<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  return EXIT_FAILURE;
-}
-
-template <unsigned DIM>
-int
-ImageMathHelper4DOnly(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "AverageOverDimension" )
-    {
-    AverageOverDimension<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CompCorrAuto" )
-    {
-    CompCorrAuto<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ComputeTimeSeriesLeverage" )
-    {
-    ComputeTimeSeriesLeverage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "nvols" )
-    {
-    PrintHeader<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PCASLQuantifyCBF" )
-    {
-    // PCASLQuantifyCBF<4>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SliceTimingCorrection" )
-    {
-    SliceTimingCorrection<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SplitAlternatingTimeSeries" )
-    {
-    SplitAlternatingTimeSeries<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ThreeTissueConfounds" )
-    {
-    ThreeTissueConfounds<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesMask" )
-    {
-    TimeSeriesMask<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesAssemble" )
-    {
-    TimeSeriesAssemble<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesDisassemble" )
-    {
-    TimeSeriesDisassemble<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesInterpolationSubtraction" )
-    {
-    TimeSeriesInterpolationSubtraction<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesSimpleSubtraction" )
-    {
-    TimeSeriesSimpleSubtraction<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesSubset" )
-    {
-    TimeSeriesSubset<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TimeSeriesToMatrix" )
-    {
-    TimeSeriesToMatrix<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  return EXIT_FAILURE;
-}
-
-template <unsigned DIM>
-int
-ImageMathHelperAll(int argc, char **argv)
-{
-  std::string operation = std::string(argv[3]);
-  if( operation == "m")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "mresample")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "+")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "-")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "vm")
-    {
-    VImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "vmresample")
-    {
-    VImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "v+")
-    {
-    VImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "v-")
-    {
-    VImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "/")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "^")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "exp")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "max")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "abs")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "addtozero")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "overadd")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "total")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "vtotal")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "mean")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Decision")
-    {
-    ImageMath<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Neg")
-    {
-    NegativeImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "G")
-    {
-    SmoothImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Convolve")
-    {
-    ConvolveImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PeronaMalik")
-    {
-    PMSmoothImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "InPaint")
-    {
-    InPaint<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MD" || operation == "ME" )
-    {
-    MorphImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MO" || operation == "MC" )
-    {
-    MorphImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "GD" || operation == "GE" )
-    {
-    MorphImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "GO" || operation == "GC" )
-    {
-    MorphImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "D" )
-    {
-    DistanceMap<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MaurerDistance"  )
-    {
-    GenerateMaurerDistanceImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Normalize" )
-    {
-    NormalizeImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Grad" )
-    {
-    GradientImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Laplacian" )
-    {
-    LaplacianImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Canny" )
-    {
-      CannyImage<DIM>(argc, argv);
-      return EXIT_SUCCESS;
-    }
-  if( operation == "CropBinaryImage" )
-    {
-      CropBinaryImage<DIM>(argc, argv);
-      return EXIT_SUCCESS;
-    }
-  if( operation == "LabelSurfaceArea" )
-    {
-    LabelSurfaceArea<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PH" )
-    {
-    PrintHeader<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CenterImage2inImage1" )
-    {
-    CenterImage2inImage1<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Byte" )
-    {
-    ByteImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ReflectionMatrix" )
-    {
-    ReflectionMatrix<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MakeAffineTransform" )
-    {
-    MakeAffineTransform<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ClosestSimplifiedHeaderMatrix" )
-    {
-    ClosestSimplifiedHeaderMatrix<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "LabelStats" )
-    {
-    LabelStats<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ROIStatistics" )
-    {
-    ROIStatistics<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "LabelThickness" )
-    {
-    LabelThickness<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "LabelThickness2" )
-    {
-    LabelThickness2<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "DiceAndMinDistSum" )
-    {
-    DiceAndMinDistSum<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Lipschitz" )
-    {
-    Lipschitz<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "InvId" )
-    {
-    InvId<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ShiftImageSlicesInTime" )
-    {
-    ShiftImageSlicesInTime<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ReplicateImage" )
-    {
-    ReplicateImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ReplicateDisplacement" )
-    {
-    ReplicateDisplacement<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "GetLargestComponent" )
-    {
-    GetLargestComponent<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ExtractVectorComponent" )
-    {
-    ExtractVectorComponent<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ThresholdAtMean" )
-    {
-    ThresholdAtMean<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SetTimeSpacing" )
-    {
-    SetTimeSpacing<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SetTimeSpacingWarp" )
-    {
-    SetTimeSpacingWarp<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "FlattenImage" )
-    {
-    FlattenImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CorruptImage" )
-    {
-    CorruptImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Where" )
-    {
-    Where<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if(  operation == "Finite" )
-    {
-    Finite<DIM>( argc, argv );
-    return EXIT_SUCCESS;
-    }
-  if( operation == "FillHoles" )
-    {
-    FillHoles<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "HistogramMatch" )
-    {
-    HistogramMatching<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "RescaleImage" )
-    {
-    RescaleImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "WindowImage" )
-    {
-    WindowImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "WindowImage" )
-    {
-    WindowImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "NeighborhoodStats" )
-    {
-    NeighborhoodStats<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PadImage" )
-    {
-    PadImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "SigmoidImage" )
-    {
-    SigmoidImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "Sharpen" )
-    {
-    SharpenImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MakeImage" )
-    {
-    MakeImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "stack" )
-    {
-    StackImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "stack2" )
-    {
-    Stack2Images<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CompareHeadersAndImages" )
-    {
-    CompareHeadersAndImages<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CountVoxelDifference" )
-    {
-    CountVoxelDifference<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "RemoveLabelInterfaces" )
-    {
-    RemoveLabelInterfaces<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ReplaceVoxelValue" )
-    {
-    ReplaceVoxelValue<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PoissonDiffusion" )
-    {
-    PoissonDiffusion<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "EnumerateLabelInterfaces" )
-    {
-    EnumerateLabelInterfaces<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ConvertImageToFile" )
-    {
-    ConvertImageToFile<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PValueImage" )
-    {
-    PValueImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CorrelationUpdate" )
-    {
-    CorrelationUpdate<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ConvertImageSetToMatrix" )
-    {
-    ConvertImageSetToMatrix<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "RandomlySampleImageSetToCSV" )
-    {
-    RandomlySampleImageSetToCSV<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ConvertImageSetToEigenvectors" )
-    {
-    ConvertImageSetToEigenvectors<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ConvertVectorToImage" )
-    {
-    ConvertVectorToImage<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PropagateLabelsThroughMask" )
-    {
-    itkPropagateLabelsThroughMask<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "FastMarchingExtension" )
-    {
-    FastMarchingExtension<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "FastMarchingSegmentation" )
-    {
-    FastMarchingSegmentation<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "TruncateImageIntensity" )
-    {
-    TruncateImageIntensity<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ExtractSlice" )
-    {
-    ExtractSlice<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "ClusterThresholdVariate" )
-    {
-    ClusterThresholdVariate<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MajorityVoting" )
-    {
-    MajorityVoting<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "MostLikely" )
-    {
-    MostLikely<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "CorrelationVoting" )
-    {
-    CorrelationVoting<DIM>(argc, argv);
-    return EXIT_SUCCESS;
-    }
-  if( operation == "PearsonCorrelation" )
+  std::string outname3 = outname + std::string("conf2.nii.gz");
+  WriteImage<BlobRadiusImageType>( confimg2, outname3.c_str() );
+  return EXIT_SUCCESS;
+}
+
+// Pipeline: run a sequence of operations on one image in memory.  Each
+// step is given as "Operation[parameter1,parameter2,...]".  Consecutive
+// pointwise steps are queued and applied together in one threaded pass
+// over the voxels; the other steps call the iMath functions directly.
+enum ImageMathPointwiseOperationType
+  {
+  PointwiseMultiply,
+  PointwiseAdd,
+  PointwiseSubtract,
+  PointwiseDivide,
+  PointwisePower,
+  PointwiseExp,
+  PointwiseMax,
+  PointwiseAbs,
+  PointwiseAddToZero,
+  PointwiseOverAdd,
+  PointwiseDecision,
+  PointwiseNegative,
+  PointwiseThreshold
+  };
+
+struct ImageMathPointwiseOperation
+  {
+  ImageMathPointwiseOperationType Type;
+  float                           Value;   // scalar operand, or the maximum for Neg and
+                                           // the threshold for ThresholdAtMean
+  const float *                   Operand; // image operand, null if Value is used
+  };
+
+struct ImageMathPipelineStep
+  {
+  std::string              Operation;
+  std::vector<std::string> Parameters;
+  };
+
+struct ImageMathPointwiseThreadStruct
+  {
+  const std::vector<ImageMathPointwiseOperation> *Operations;
+  float *                                         Buffer;
+  unsigned long                                   NumberOfPixels;
+  };
+
+inline float ApplyImageMathPointwiseOperation( const ImageMathPointwiseOperation & operation, float pix1,
+                                               unsigned long offset )
+{
+  const float pix2 = operation.Operand ? operation.Operand[offset] : operation.Value;
+
+  switch( operation.Type )
     {
-    PearsonCorrelation<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    case PointwiseMultiply:
+      return pix1 * pix2;
+    case PointwiseAdd:
+      return pix1 + pix2;
+    case PointwiseSubtract:
+      return pix1 - pix2;
+    case PointwiseDivide:
+      return ( pix2 > 0 ) ? pix1 / pix2 : 0;
+    case PointwisePower:
+      return std::pow( pix1, pix2 );
+    case PointwiseExp:
+      return exp( pix1 * pix2 );
+    case PointwiseMax:
+      return vnl_math_max( pix1, pix2 );
+    case PointwiseAbs:
+      return fabs( pix1 );
+    case PointwiseAddToZero:
+      return ( pix1 == 0 ) ? pix1 + pix2 : pix1;
+    case PointwiseOverAdd:
+      return ( pix2 != 0 ) ? pix2 : pix1;
+    case PointwiseDecision:
+      return 1. / ( 1. + exp( -1.0 * ( pix1 - 0.25 ) / pix2 ) );
+    case PointwiseNegative:
+      // (1 - (pix - min) / (max - min)) * (max - min), as in NegativeImage
+      return pix2 - pix1;
+    case PointwiseThreshold:
+      return ( pix1 >= pix2 ) ? 1 : 0;
     }
-  if( operation == "Translate" )
+  return pix1;
+}
+
+ITK_THREAD_RETURN_TYPE ImageMathPointwiseThreadCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ImageMathPointwiseThreadStruct *      str = static_cast<ImageMathPointwiseThreadStruct *>( info->UserData );
+
+  const std::vector<ImageMathPointwiseOperation> & operations = *str->Operations;
+
+  const unsigned long long numberOfPixels = str->NumberOfPixels;
+  const unsigned long      begin = static_cast<unsigned long>( numberOfPixels * info->ThreadID
+                                                               / info->NumberOfThreads );
+  const unsigned long      end = static_cast<unsigned long>( numberOfPixels * ( info->ThreadID + 1 )
+                                                             / info->NumberOfThreads );
+  for( unsigned long n = begin; n < end; n++ )
     {
-    Translate<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    float pix = str->Buffer[n];
+    for( size_t k = 0; k < operations.size(); k++ )
+      {
+      pix = ApplyImageMathPointwiseOperation( operations[k], pix, n );
+      }
+    str->Buffer[n] = pix;
     }
-  if( operation == "NeighborhoodCorrelation" )
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Apply the queued pointwise operations to image in place and clear the queue. */
+template <class ImageType>
+void ApplyImageMathPointwiseOperations( ImageType *image, std::vector<ImageMathPointwiseOperation> & operations )
+{
+  if( operations.empty() )
     {
-    ImageMetrics<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    return;
     }
-  if( operation == "NormalizedCorrelation" )
+
+  ImageMathPointwiseThreadStruct str;
+  str.Operations = &operations;
+  str.Buffer = image->GetBufferPointer();
+  str.NumberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+
+  // a few thousand voxels per thread at least
+  unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if( static_cast<unsigned long>( numberOfThreads ) > str.NumberOfPixels / 4096 )
     {
-    ImageMetrics<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    numberOfThreads = static_cast<unsigned int>( std::max( str.NumberOfPixels / 4096, 1ul ) );
     }
-  if( operation == "Demons" )
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( ImageMathPointwiseThreadCallback, &str );
+  threader->SingleMethodExecute();
+
+  operations.clear();
+}
+
+/** Split "Operation[a,b,...]" into the operation and its parameters. */
+bool ParseImageMathPipelineStep( const std::string & text, ImageMathPipelineStep & step )
+{
+  step.Parameters.clear();
+
+  const std::string::size_type open = text.find( "[" );
+  if( open == std::string::npos )
     {
-    ImageMetrics<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    step.Operation = text;
+    return !text.empty();
     }
-  if( operation == "Mattes" )
+
+  const std::string::size_type close = text.rfind( "]" );
+  if( close == std::string::npos || close < open )
     {
-    return ImageMetrics<DIM>(argc, argv);
+    return false;
     }
-  if( operation == "MinMaxMean" )
+  step.Operation = text.substr( 0, open );
+
+  const std::string parameters = text.substr( open + 1, close - open - 1 );
+  std::string::size_type begin = 0;
+  while( !parameters.empty() )
     {
-    MinMaxMean<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    const std::string::size_type comma = parameters.find( ",", begin );
+    step.Parameters.push_back( parameters.substr( begin, comma == std::string::npos ? std::string::npos :
+                                                  comma - begin ) );
+    if( comma == std::string::npos )
+      {
+      break;
+      }
+    begin = comma + 1;
     }
-  if( operation == "PureTissueN4WeightMask" )
+  return !step.Operation.empty();
+}
+
+/** Overwrite value with parameter n of step if it was given. */
+template <class T>
+void GetImageMathPipelineParameter( const ImageMathPipelineStep & step, unsigned int n, T & value )
+{
+  if( n < step.Parameters.size() && !step.Parameters[n].empty() )
     {
-    PureTissueN4WeightMask<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    std::istringstream iss( step.Parameters[n] );
+    iss >> value;
     }
-  if( operation == "BlobDetector" )
+}
+
+template <unsigned int ImageDimension>
+int ImageMathPipeline( int argc, char *argv[] )
+{
+  typedef float                                 PixelType;
+  typedef itk::Image<PixelType, ImageDimension> ImageType;
+  typedef typename ImageType::Pointer           ImagePointer;
+
+  int               argct = 2;
+  const std::string outname = std::string( argv[argct] );
+  argct += 2;
+  const std::string fn1 = std::string( argv[argct] );   argct++;
+
+  ImagePointer image = ITK_NULLPTR;
+  ReadImage<ImageType>( image, fn1.c_str() );
+  if( image.IsNull() )
     {
-    BlobDetector<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    return EXIT_FAILURE;
     }
-  if( operation == "MatchBlobs" )
+
+  std::map<std::string, ImageMathPointwiseOperationType> pointwiseTypes;
+  pointwiseTypes["m"] = PointwiseMultiply;
+  pointwiseTypes["+"] = PointwiseAdd;
+  pointwiseTypes["-"] = PointwiseSubtract;
+  pointwiseTypes["/"] = PointwiseDivide;
+  pointwiseTypes["^"] = PointwisePower;
+  pointwiseTypes["exp"] = PointwiseExp;
+  pointwiseTypes["max"] = PointwiseMax;
+  pointwiseTypes["abs"] = PointwiseAbs;
+  pointwiseTypes["addtozero"] = PointwiseAddToZero;
+  pointwiseTypes["overadd"] = PointwiseOverAdd;
+  pointwiseTypes["Decision"] = PointwiseDecision;
+
+  // the image operands have to stay alive until the queue is applied
+  std::vector<ImagePointer>                operands;
+  std::vector<ImageMathPointwiseOperation> queue;
+
+  std::string stepText;
+  try
     {
-    MatchBlobs<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    for( ; argct < argc; argct++ )
+      {
+      stepText = std::string( argv[argct] );
+
+      ImageMathPipelineStep step;
+      if( !ParseImageMathPipelineStep( stepText, step ) )
+        {
+        std::cout << "Pipeline: could not parse the step " << stepText << std::endl;
+        return EXIT_FAILURE;
+        }
+      const std::string & operation = step.Operation;
+
+      std::map<std::string, ImageMathPointwiseOperationType>::const_iterator pointwise =
+        pointwiseTypes.find( operation );
+      if( pointwise != pointwiseTypes.end() )
+        {
+        ImageMathPointwiseOperation pointwiseOperation;
+        pointwiseOperation.Type = pointwise->second;
+        pointwiseOperation.Value = 1.0;
+        pointwiseOperation.Operand = ITK_NULLPTR;
+
+        const std::string fn2 = step.Parameters.empty() ? std::string( "" ) : step.Parameters[0];
+        if( pointwise->second != PointwiseAbs && fn2.empty() )
+          {
+          std::cout << "Pipeline: " << operation << " needs a value or an image" << std::endl;
+          return EXIT_FAILURE;
+          }
+        if( pointwise->second != PointwiseAbs && !from_string<float>( pointwiseOperation.Value, fn2, std::dec ) )
+          {
+          ImagePointer operand = ITK_NULLPTR;
+          ReadImage<ImageType>( operand, fn2.c_str() );
+          if( operand.IsNull() )
+            {
+            return EXIT_FAILURE;
+            }
+          if( operand->GetLargestPossibleRegion().GetSize() != image->GetLargestPossibleRegion().GetSize() )
+            {
+            std::cout << "Pipeline: " << fn2 << " does not have the size of the image at step "
+                      << stepText << std::endl;
+            return EXIT_FAILURE;
+            }
+          operands.push_back( operand );
+          pointwiseOperation.Operand = operand->GetBufferPointer();
+          }
+        queue.push_back( pointwiseOperation );
+        continue;
+        }
+
+      // everything else needs the current image
+      ApplyImageMathPointwiseOperations<ImageType>( image, queue );
+      operands.clear();
+
+      if( operation == "Neg" || operation == "ThresholdAtMean" )
+        {
+        const PixelType *   buffer = image->GetBufferPointer();
+        const unsigned long numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+
+        double mean = 0, mx = -1.e12, mn = 1.e12;
+        for( unsigned long n = 0; n < numberOfPixels; n++ )
+          {
+          mean += buffer[n];
+          mx = vnl_math_max( mx, static_cast<double>( buffer[n] ) );
+          mn = vnl_math_min( mn, static_cast<double>( buffer[n] ) );
+          }
+        if( numberOfPixels > 0 )
+          {
+          mean /= static_cast<double>( numberOfPixels );
+          }
+
+        ImageMathPointwiseOperation pointwiseOperation;
+        pointwiseOperation.Operand = ITK_NULLPTR;
+        if( operation == "Neg" )
+          {
+          pointwiseOperation.Type = PointwiseNegative;
+          pointwiseOperation.Value = ( mx == mn ) ? 1 : mx;
+          }
+        else
+          {
+          float percentofmean = 1.0;
+          GetImageMathPipelineParameter( step, 0, percentofmean );
+          pointwiseOperation.Type = PointwiseThreshold;
+          pointwiseOperation.Value = mean * percentofmean;
+          }
+        queue.push_back( pointwiseOperation );
+        }
+      else if( operation == "MD" || operation == "ME" || operation == "MO" || operation == "MC" )
+        {
+        unsigned long radius = iMathMDRadius;
+        PixelType     value = iMathMDValue;
+        GetImageMathPipelineParameter( step, 0, radius );
+        GetImageMathPipelineParameter( step, 1, value );
+        if( operation == "MD" )
+          {
+          image = iMathMD<ImageType>( image, radius, value );
+          }
+        else if( operation == "ME" )
+          {
+          image = iMathME<ImageType>( image, radius, value );
+          }
+        else if( operation == "MO" )
+          {
+          image = iMathMO<ImageType>( image, radius, value );
+          }
+        else
+          {
+          image = iMathMC<ImageType>( image, radius, value );
+          }
+        }
+      else if( operation == "GD" || operation == "GE" || operation == "GO" || operation == "GC" )
+        {
+        unsigned long radius = iMathGDRadius;
+        GetImageMathPipelineParameter( step, 0, radius );
+        if( operation == "GD" )
+          {
+          image = iMathGD<ImageType>( image, radius );
+          }
+        else if( operation == "GE" )
+          {
+          image = iMathGE<ImageType>( image, radius );
+          }
+        else if( operation == "GO" )
+          {
+          image = iMathGO<ImageType>( image, radius );
+          }
+        else
+          {
+          image = iMathGC<ImageType>( image, radius );
+          }
+        }
+      else if( operation == "GetLargestComponent" )
+        {
+        unsigned long minSize = iMathGetLargestComponentMinSize;
+        GetImageMathPipelineParameter( step, 0, minSize );
+        image = iMathGetLargestComponent<ImageType>( image, minSize );
+        }
+      else if( operation == "FillHoles" )
+        {
+        double holeParam = iMathFillHolesHoleParam;
+        GetImageMathPipelineParameter( step, 0, holeParam );
+        image = iMathFillHoles<ImageType>( image, holeParam );
+        }
+      else if( operation == "Normalize" )
+        {
+        image = iMathNormalize<ImageType>( image );
+        }
+      else if( operation == "Sharpen" )
+        {
+        image = iMathSharpen<ImageType>( image );
+        }
+      else if( operation == "Canny" )
+        {
+        double sigma = 1, lower = 0, upper = 1;
+        GetImageMathPipelineParameter( step, 0, sigma );
+        GetImageMathPipelineParameter( step, 1, lower );
+        GetImageMathPipelineParameter( step, 2, upper );
+        image = iMathCanny<ImageType>( image, sigma, lower, upper );
+        }
+      else if( operation == "DistanceMap" )
+        {
+        bool useSpacing = iMathDistanceMapUseSpacing;
+        GetImageMathPipelineParameter( step, 0, useSpacing );
+        image = iMathDistanceMap<ImageType>( image, useSpacing );
+        }
+      else if( operation == "MaurerDistance" )
+        {
+        PixelType foreground = iMathMaurerDistanceForeground;
+        GetImageMathPipelineParameter( step, 0, foreground );
+        image = iMathMaurerDistance<ImageType>( image, foreground );
+        }
+      else if( operation == "Grad" || operation == "Laplacian" )
+        {
+        double sigma = iMathGradSigma;
+        bool   normalize = iMathGradNormalize;
+        GetImageMathPipelineParameter( step, 0, sigma );
+        GetImageMathPipelineParameter( step, 1, normalize );
+        if( operation == "Grad" )
+          {
+          image = iMathGrad<ImageType>( image, sigma, normalize );
+          }
+        else
+          {
+          image = iMathLaplacian<ImageType>( image, sigma, normalize );
+          }
+        }
+      else if( operation == "PeronaMalik" )
+        {
+        unsigned long nIterations = iMathPeronaMalikNIterations;
+        double        conductance = iMathPeronaMalikConductance;
+        GetImageMathPipelineParameter( step, 0, nIterations );
+        GetImageMathPipelineParameter( step, 1, conductance );
+        image = iMathPeronaMalik<ImageType>( image, nIterations, conductance );
+        }
+      else if( operation == "HistogramEqualization" )
+        {
+        double       alpha = 0, beta = 0;
+        unsigned int r = 1;
+        GetImageMathPipelineParameter( step, 0, alpha );
+        GetImageMathPipelineParameter( step, 1, beta );
+        GetImageMathPipelineParameter( step, 2, r );
+        image = iMathHistogramEqualization<ImageType>( image, alpha, beta, r );
+        }
+      else if( operation == "Pad" )
+        {
+        int padding = 0;
+        GetImageMathPipelineParameter( step, 0, padding );
+        image = iMathPad<ImageType>( image, padding );
+        }
+      else if( operation == "Write" )
+        {
+        if( step.Parameters.empty() )
+          {
+          std::cout << "Pipeline: Write needs a file name" << std::endl;
+          return EXIT_FAILURE;
+          }
+        WriteImage<ImageType>( image, step.Parameters[0].c_str() );
+        }
+      else
+        {
+        std::cout << "Pipeline: unknown operation " << operation << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    ApplyImageMathPointwiseOperations<ImageType>( image, queue );
     }
-  if( operation == "Project" )
+  catch( itk::ExceptionObject & excep )
     {
-    Project<DIM>(argc, argv);
-    return EXIT_SUCCESS;
+    std::cout << "Pipeline: exception caught at step " << stepText << std::endl;
+    std::cout << excep << std::endl;
+    return EXIT_FAILURE;
     }
-  return EXIT_FAILURE;
+
+  WriteImage<ImageType>( image, outname.c_str() );
+  return EXIT_SUCCESS;
+}
+
+//
+// ImageMath used to look its operation up in 'if (operation == <op>)'
+// chains, one for the operations valid in all dimensions, one for those that
+// are 2D only, 2D and 3D, and so on.  The operations are now kept in a
+// registry per dimension that maps the name to the function; it is built
+// the first time a dimension is used, with only the groups that are valid
+// for that dimension, so only those functions are instantiated for it.
+// antsPipeline runs ImageMath from several threads at once, so the registry
+// is built under a lock and is only read once it is built.
+typedef int ( *ImageMathOperationType )( int argc, char *argv[] );
+typedef std::map<std::string, ImageMathOperationType> ImageMathRegistryType;
+
+// The operations do not all have the same signature and most of their return
+// values were never looked at, so they are registered through these adapters,
+// which call them and report success as the chains did.
+template <int (*TOperation)( int, char * * )>
+int ImageMathOperation( int argc, char *argv[] )
+{
+  TOperation( argc, argv );
+  return EXIT_SUCCESS;
+}
+
+template <int (*TOperation)( unsigned int, char * * )>
+int ImageMathOperation( int argc, char *argv[] )
+{
+  TOperation( static_cast<unsigned int>( argc ), argv );
+  return EXIT_SUCCESS;
+}
+
+template <void (*TOperation)( int, char * * )>
+int ImageMathOperation( int argc, char *argv[] )
+{
+  TOperation( argc, argv );
+  return EXIT_SUCCESS;
+}
+
+int ImageMathNoOperation( int, char * * )
+{
+  return EXIT_SUCCESS;
 }
 
 template <unsigned DIM>
-int
-ImageMathHelper(int , char **)
+void
+RegisterImageMathOperations2DOnly( ImageMathRegistryType & registry )
+{
+  registry["TileImages"] = &ImageMathOperation<&TileImages<DIM> >;
+  registry["TimeSeriesRegionCorr"] = &ImageMathOperation<&TimeSeriesRegionCorr<DIM> >;
+  registry["TimeSeriesRegionSCCA"] = &ImageMathOperation<&TimeSeriesRegionSCCA<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperations2DOr3D( ImageMathRegistryType & registry )
+{
+  registry["AverageLabels"] = &ImageMathOperation<&AverageLabels<DIM> >;
+  registry["Check3TissueLabeling"] = &ImageMathOperation<&Check3TissueLabeling<DIM> >;
+  registry["oldPropagateLabelsThroughMask"] = &ImageMathOperation<&PropagateLabelsThroughMask<DIM> >;
+  registry["SetOrGetPixel"] = &ImageMathOperation<&SetOrGetPixel<DIM> >;
+  registry["STAPLE"] = &ImageMathOperation<&STAPLE<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperations3DOr4D( ImageMathRegistryType & registry )
+{
+  registry["ConvertLandmarkFile"] = &ImageMathOperation<&ConvertLandmarkFile<DIM> >;
+  registry["PASLQuantifyCBF"] = &ImageMathOperation<&PASLQuantifyCBF<DIM> >;
+  registry["PASL"] = &ImageMathOperation<&PASL<DIM> >;
+  registry["pCASL"] = &ImageMathOperation<&pCASL<DIM> >;
+  registry["TriPlanarView"] = &ImageMathOperation<&TriPlanarView<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperations3DOnly( ImageMathRegistryType & registry )
+{
+  registry["4DTensorTo3DTensor"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["ComponentTo3DTensor"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["FuseNImagesIntoNDVectorField"] = &ImageMathOperation<&FuseNImagesIntoNDVectorField<DIM> >;
+  registry["ExtractComponentFrom3DTensor"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["MTR"] = &ImageMathOperation<&MTR<DIM> >;
+  registry["SmoothTensorImage"] = &ImageMathOperation<&SmoothTensorImage<DIM> >;
+  registry["TensorAxialDiffusion"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorColor"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorEigenvalue"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorFA"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorFANumerator"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorFADenominator"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorIOTest"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorMask"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorMeanDiffusion"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorRadialDiffusion"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorToLocalSpace"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorToPhysicalSpace"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorToVectorComponent"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["TensorToVector"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+  registry["ValidTensor"] = &ImageMathOperation<&TensorFunctions<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperations4DOnly( ImageMathRegistryType & registry )
+{
+  registry["AverageOverDimension"] = &ImageMathOperation<&AverageOverDimension<DIM> >;
+  registry["CompCorrAuto"] = &ImageMathOperation<&CompCorrAuto<DIM> >;
+  registry["ComputeTimeSeriesLeverage"] = &ImageMathOperation<&ComputeTimeSeriesLeverage<DIM> >;
+  registry["nvols"] = &ImageMathOperation<&PrintHeader<DIM> >;
+  registry["PCASLQuantifyCBF"] = &ImageMathNoOperation;
+  registry["SliceTimingCorrection"] = &ImageMathOperation<&SliceTimingCorrection<DIM> >;
+  registry["SplitAlternatingTimeSeries"] = &ImageMathOperation<&SplitAlternatingTimeSeries<DIM> >;
+  registry["ThreeTissueConfounds"] = &ImageMathOperation<&ThreeTissueConfounds<DIM> >;
+  registry["TimeSeriesMask"] = &ImageMathOperation<&TimeSeriesMask<DIM> >;
+  registry["TimeSeriesAssemble"] = &ImageMathOperation<&TimeSeriesAssemble<DIM> >;
+  registry["TimeSeriesDisassemble"] = &ImageMathOperation<&TimeSeriesDisassemble<DIM> >;
+  registry["TimeSeriesInterpolationSubtraction"] = &ImageMathOperation<&TimeSeriesInterpolationSubtraction<DIM> >;
+  registry["TimeSeriesSimpleSubtraction"] = &ImageMathOperation<&TimeSeriesSimpleSubtraction<DIM> >;
+  registry["TimeSeriesSubset"] = &ImageMathOperation<&TimeSeriesSubset<DIM> >;
+  registry["TimeSeriesToMatrix"] = &ImageMathOperation<&TimeSeriesToMatrix<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperationsAll( ImageMathRegistryType & registry )
+{
+  registry["Pipeline"] = &ImageMathPipeline<DIM>;
+  registry["m"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["mresample"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["+"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["-"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["vm"] = &ImageMathOperation<&VImageMath<DIM> >;
+  registry["vmresample"] = &ImageMathOperation<&VImageMath<DIM> >;
+  registry["v+"] = &ImageMathOperation<&VImageMath<DIM> >;
+  registry["v-"] = &ImageMathOperation<&VImageMath<DIM> >;
+  registry["/"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["^"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["exp"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["max"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["abs"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["addtozero"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["overadd"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["total"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["vtotal"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["mean"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["Decision"] = &ImageMathOperation<&ImageMath<DIM> >;
+  registry["Neg"] = &ImageMathOperation<&NegativeImage<DIM> >;
+  registry["G"] = &ImageMathOperation<&SmoothImage<DIM> >;
+  registry["Convolve"] = &ImageMathOperation<&ConvolveImage<DIM> >;
+  registry["PeronaMalik"] = &ImageMathOperation<&PMSmoothImage<DIM> >;
+  registry["InPaint"] = &ImageMathOperation<&InPaint<DIM> >;
+  registry["MD"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["ME"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["MO"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["MC"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["GD"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["GE"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["GO"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["GC"] = &ImageMathOperation<&MorphImage<DIM> >;
+  registry["D"] = &ImageMathOperation<&DistanceMap<DIM> >;
+  registry["MaurerDistance"] = &ImageMathOperation<&GenerateMaurerDistanceImage<DIM> >;
+  registry["Normalize"] = &ImageMathOperation<&NormalizeImage<DIM> >;
+  registry["Grad"] = &ImageMathOperation<&GradientImage<DIM> >;
+  registry["Laplacian"] = &ImageMathOperation<&LaplacianImage<DIM> >;
+  registry["Canny"] = &ImageMathOperation<&CannyImage<DIM> >;
+  registry["CropBinaryImage"] = &ImageMathOperation<&CropBinaryImage<DIM> >;
+  registry["LabelSurfaceArea"] = &ImageMathOperation<&LabelSurfaceArea<DIM> >;
+  registry["PH"] = &ImageMathOperation<&PrintHeader<DIM> >;
+  registry["CenterImage2inImage1"] = &ImageMathOperation<&CenterImage2inImage1<DIM> >;
+  registry["Byte"] = &ImageMathOperation<&ByteImage<DIM> >;
+  registry["ReflectionMatrix"] = &ImageMathOperation<&ReflectionMatrix<DIM> >;
+  registry["MakeAffineTransform"] = &ImageMathOperation<&MakeAffineTransform<DIM> >;
+  registry["ClosestSimplifiedHeaderMatrix"] = &ImageMathOperation<&ClosestSimplifiedHeaderMatrix<DIM> >;
+  registry["LabelStats"] = &ImageMathOperation<&LabelStats<DIM> >;
+  registry["ROIStatistics"] = &ImageMathOperation<&ROIStatistics<DIM> >;
+  registry["LabelThickness"] = &ImageMathOperation<&LabelThickness<DIM> >;
+  registry["LabelThickness2"] = &ImageMathOperation<&LabelThickness2<DIM> >;
+  registry["DiceAndMinDistSum"] = &ImageMathOperation<&DiceAndMinDistSum<DIM> >;
+  registry["Lipschitz"] = &ImageMathOperation<&Lipschitz<DIM> >;
+  registry["InvId"] = &ImageMathOperation<&InvId<DIM> >;
+  registry["ShiftImageSlicesInTime"] = &ImageMathOperation<&ShiftImageSlicesInTime<DIM> >;
+  registry["ReplicateImage"] = &ImageMathOperation<&ReplicateImage<DIM> >;
+  registry["ReplicateDisplacement"] = &ImageMathOperation<&ReplicateDisplacement<DIM> >;
+  registry["GetLargestComponent"] = &ImageMathOperation<&GetLargestComponent<DIM> >;
+  registry["ExtractVectorComponent"] = &ImageMathOperation<&ExtractVectorComponent<DIM> >;
+  registry["ThresholdAtMean"] = &ImageMathOperation<&ThresholdAtMean<DIM> >;
+  registry["SetTimeSpacing"] = &ImageMathOperation<&SetTimeSpacing<DIM> >;
+  registry["SetTimeSpacingWarp"] = &ImageMathOperation<&SetTimeSpacingWarp<DIM> >;
+  registry["FlattenImage"] = &ImageMathOperation<&FlattenImage<DIM> >;
+  registry["CorruptImage"] = &ImageMathOperation<&CorruptImage<DIM> >;
+  registry["Where"] = &ImageMathOperation<&Where<DIM> >;
+  registry["Finite"] = &ImageMathOperation<&Finite<DIM> >;
+  registry["FillHoles"] = &ImageMathOperation<&FillHoles<DIM> >;
+  registry["HistogramMatch"] = &ImageMathOperation<&HistogramMatching<DIM> >;
+  registry["RescaleImage"] = &ImageMathOperation<&RescaleImage<DIM> >;
+  registry["WindowImage"] = &ImageMathOperation<&WindowImage<DIM> >;
+  registry["NeighborhoodStats"] = &ImageMathOperation<&NeighborhoodStats<DIM> >;
+  registry["PadImage"] = &ImageMathOperation<&PadImage<DIM> >;
+  registry["SigmoidImage"] = &ImageMathOperation<&SigmoidImage<DIM> >;
+  registry["Sharpen"] = &ImageMathOperation<&SharpenImage<DIM> >;
+  registry["MakeImage"] = &ImageMathOperation<&MakeImage<DIM> >;
+  registry["stack"] = &ImageMathOperation<&StackImage<DIM> >;
+  registry["stack2"] = &ImageMathOperation<&Stack2Images<DIM> >;
+  registry["CompareHeadersAndImages"] = &ImageMathOperation<&CompareHeadersAndImages<DIM> >;
+  registry["CountVoxelDifference"] = &ImageMathOperation<&CountVoxelDifference<DIM> >;
+  registry["RemoveLabelInterfaces"] = &ImageMathOperation<&RemoveLabelInterfaces<DIM> >;
+  registry["ReplaceVoxelValue"] = &ImageMathOperation<&ReplaceVoxelValue<DIM> >;
+  registry["PoissonDiffusion"] = &ImageMathOperation<&PoissonDiffusion<DIM> >;
+  registry["EnumerateLabelInterfaces"] = &ImageMathOperation<&EnumerateLabelInterfaces<DIM> >;
+  registry["ConvertImageToFile"] = &ImageMathOperation<&ConvertImageToFile<DIM> >;
+  registry["PValueImage"] = &ImageMathOperation<&PValueImage<DIM> >;
+  registry["CorrelationUpdate"] = &ImageMathOperation<&CorrelationUpdate<DIM> >;
+  registry["ConvertImageSetToMatrix"] = &ImageMathOperation<&ConvertImageSetToMatrix<DIM> >;
+  registry["RandomlySampleImageSetToCSV"] = &ImageMathOperation<&RandomlySampleImageSetToCSV<DIM> >;
+  registry["ConvertImageSetToEigenvectors"] = &ImageMathOperation<&ConvertImageSetToEigenvectors<DIM> >;
+  registry["ConvertVectorToImage"] = &ImageMathOperation<&ConvertVectorToImage<DIM> >;
+  registry["PropagateLabelsThroughMask"] = &ImageMathOperation<&itkPropagateLabelsThroughMask<DIM> >;
+  registry["FastMarchingExtension"] = &ImageMathOperation<&FastMarchingExtension<DIM> >;
+  registry["FastMarchingSegmentation"] = &ImageMathOperation<&FastMarchingSegmentation<DIM> >;
+  registry["TruncateImageIntensity"] = &ImageMathOperation<&TruncateImageIntensity<DIM> >;
+  registry["ExtractSlice"] = &ImageMathOperation<&ExtractSlice<DIM> >;
+  registry["ClusterThresholdVariate"] = &ImageMathOperation<&ClusterThresholdVariate<DIM> >;
+  registry["MajorityVoting"] = &ImageMathOperation<&MajorityVoting<DIM> >;
+  registry["MostLikely"] = &ImageMathOperation<&MostLikely<DIM> >;
+  registry["CorrelationVoting"] = &ImageMathOperation<&CorrelationVoting<DIM> >;
+  registry["PearsonCorrelation"] = &ImageMathOperation<&PearsonCorrelation<DIM> >;
+  registry["Translate"] = &ImageMathOperation<&Translate<DIM> >;
+  registry["NeighborhoodCorrelation"] = &ImageMathOperation<&ImageMetrics<DIM> >;
+  registry["NormalizedCorrelation"] = &ImageMathOperation<&ImageMetrics<DIM> >;
+  registry["Demons"] = &ImageMathOperation<&ImageMetrics<DIM> >;
+  registry["Mattes"] = &ImageMetrics<DIM>;
+  registry["MinMaxMean"] = &ImageMathOperation<&MinMaxMean<DIM> >;
+  registry["PureTissueN4WeightMask"] = &ImageMathOperation<&PureTissueN4WeightMask<DIM> >;
+  registry["BlobDetector"] = &ImageMathOperation<&BlobDetector<DIM> >;
+  registry["MatchBlobs"] = &ImageMathOperation<&MatchBlobs<DIM> >;
+  registry["Project"] = &ImageMathOperation<&Project<DIM> >;
+}
+
+template <unsigned DIM>
+void
+RegisterImageMathOperations( ImageMathRegistryType & )
 {
-  return 1;
 }
 
 template <>
-int
-ImageMathHelper<2>(int argc, char **argv)
+void
+RegisterImageMathOperations<2>( ImageMathRegistryType & registry )
 {
-  int returnval = ImageMathHelperAll<2>(argc,argv);
-  if(returnval == EXIT_FAILURE)
-    {
-    returnval = ImageMathHelper2DOnly<2>(argc,argv);
-    }
-  if(returnval == EXIT_FAILURE)
-    {
-    returnval = ImageMathHelper2DOr3D<2>(argc,argv);
-    }
-  return returnval;
+  RegisterImageMathOperationsAll<2>( registry );
+  RegisterImageMathOperations2DOnly<2>( registry );
+  RegisterImageMathOperations2DOr3D<2>( registry );
 }
 
 template <>
-int
-ImageMathHelper<3>(int argc, char **argv)
+void
+RegisterImageMathOperations<3>( ImageMathRegistryType & registry )
 {
-  int returnval = ImageMathHelperAll<3>(argc,argv);
-  if(returnval == EXIT_FAILURE)
-    {
-    returnval = ImageMathHelper3DOnly<3>(argc,argv);
-    }
-  if(returnval == EXIT_FAILURE)
-    {
-    returnval = ImageMathHelper2DOr3D<3>(argc,argv);
-    }
-  if(returnval == EXIT_FAILURE)
-    {
-    returnval = ImageMathHelper3DOr4D<3>(argc,argv);
-    }
-  return returnval;
+  RegisterImageMathOperationsAll<3>( registry );
+  RegisterImageMathOperations3DOnly<3>( registry );
+  RegisterImageMathOperations2DOr3D<3>( registry );
+  RegisterImageMathOperations3DOr4D<3>( registry );
 }
 
 template <>
+void
+RegisterImageMathOperations<4>( ImageMathRegistryType & registry )
+{
+  RegisterImageMathOperationsAll<4>( registry );
+  RegisterImageMathOperations4DOnly<4>( registry );
+  RegisterImageMathOperations3DOr4D<4>( registry );
+}
+
+template <unsigned DIM>
+ImageMathRegistryType
+BuildImageMathRegistry()
+{
+  ImageMathRegistryType registry;
+  RegisterImageMathOperations<DIM>( registry );
+  return registry;
+}
+
+// Constructed before main, so before any thread looks an operation up.
+static itk::SimpleFastMutexLock ImageMathRegistryMutex;
+
+template <unsigned DIM>
 int
-ImageMathHelper<4>(int argc, char **argv)
+ImageMathHelper(int argc, char **argv)
 {
-  int returnval = ImageMathHelperAll<4>(argc,argv);
-  if(returnval == EXIT_FAILURE)
+  // The initialization of a local static is not guaranteed to be thread safe
+  // before C++11, so it is done under the lock.
+  const ImageMathRegistryType *registry = ITK_NULLPTR;
     {
-    returnval = ImageMathHelper4DOnly<4>(argc,argv);
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( ImageMathRegistryMutex );
+    static const ImageMathRegistryType dimensionRegistry = BuildImageMathRegistry<DIM>();
+    registry = &dimensionRegistry;
     }
-  if(returnval == EXIT_FAILURE)
+
+  ImageMathRegistryType::const_iterator it = registry->find( std::string( argv[3] ) );
+  if( it == registry->end() )
     {
-    returnval = ImageMathHelper3DOr4D<4>(argc,argv);
+    return EXIT_FAILURE;
     }
-  return returnval;
+  return ( *it->second )( argc, argv );
 }
 
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
@@ -14693,6 +14120,28 @@ private:
     std::cout << "  Decision        : Computes result=1./(1.+exp(-1.0*( pix1-0.25)/pix2))" << std::endl;
     std::cout << "  Neg            : Produce image negative" << std::endl;
 
+    std::cout << "\nPipelines:" << std::endl;
+    std::cout
+      <<
+      "  Pipeline Image1.ext Step1 Step2 ...   : Apply the steps one after the other in memory and write only the result."
+      << std::endl;
+    std::cout << "      Each step is Operation[parameters], e.g. m[Image2.ext] +[2] ThresholdAtMean[0.5] ME[1]"
+              << std::endl;
+    std::cout << "      Pointwise    : m + - / ^ exp max abs addtozero overadd Decision, then Neg and ThresholdAtMean[%ofMean]."
+              << std::endl;
+    std::cout << "                     Consecutive pointwise steps are fused into one pass over the voxels."
+              << std::endl;
+    std::cout << "      Filters      : MD ME MO MC[radius,value] GD GE GO GC[radius] GetLargestComponent[minSize]"
+              << std::endl;
+    std::cout << "                     FillHoles[holeParam] Normalize Sharpen Canny[sigma,lower,upper] DistanceMap[useSpacing]"
+              << std::endl;
+    std::cout << "                     MaurerDistance[foreground] Grad Laplacian[sigma,normalize] PeronaMalik[iterations,conductance]"
+              << std::endl;
+    std::cout << "                     HistogramEqualization[alpha,beta,radius] Pad[padding]" << std::endl;
+    std::cout << "      Write[file]  : write the image at this point of the pipeline" << std::endl;
+    std::cout << "    Example: ImageMath 3 mask.nii.gz Pipeline t1.nii.gz ThresholdAtMean[0.5] ME[2] GetLargestComponent MD[2] FillHoles"
+              << std::endl;
+
     std::cout << "\nSpatial Filtering:" <<  std::endl;
     std::cout << "  Project Image1.ext axis-a which-projection   : Project an image along axis a, which-projection=0(sum, 1=max, 2=min)" << std::endl;
     std::cout << "  G Image1.ext s    : Smooth with Gaussian of sigma = s" << std::endl;
@@ -14747,6 +14196,8 @@ private:
       " TimeSeriesToMatrix : Converts a 4D image + mask to matrix (stored as csv file) where rows are time and columns are space ."
       << std::endl;
     std::cout << "    Usage        : TimeSeriesToMatrix 4D_TimeSeries.nii.gz mask " << std::endl;
+    std::cout << "    An output ending in .vxm is written as a binary, memory-mappable matrix (as read by sccan)"
+              << " that also stores the mask offsets of the columns." << std::endl;
     std::cout
       << " TimeSeriesSimpleSubtraction : Outputs a 3D mean pair-wise difference list of 3D volumes."
       << std::endl;
@@ -14859,8 +14310,9 @@ private:
     std::cout << "    Note:  Gives probabilistic output (float)" << std::endl;
     std::cout << "  MostLikely : Select label from from maximum probabilistic segmentations" << std::endl;
     std::cout << "    Usage: MostLikely probabilityThreshold ProbabilityImages*" << std::endl;
-    std::cout << "  AverageLabels : Select label using STAPLE method" << std::endl;
-    std::cout << "    Usage: STAPLE LabelImages*" << std::endl;
+    std::cout << "  AverageLabels : Fraction of the label images voting for each label, one image per label"
+              << std::endl;
+    std::cout << "    Usage: AverageLabels LabelImages*" << std::endl;
     std::cout << "    Note:  Gives probabilistic output (float)" << std::endl;
 
     std::cout << "\nImage Metrics & Info:" <<  std::endl;
@@ -14899,6 +14351,9 @@ private:
       << std::endl;
     std::cout << "      Usage        : ConvertImageSetToMatrix rowcoloption Mask.nii *images.nii" << std::endl;
     std::cout << " ConvertImageSetToMatrix output can be an image type or csv file type." << std::endl;
+    std::cout << " A .vxm output is a binary, memory-mappable matrix (as read by sccan) with one row per image,"
+              << " whatever rowcoloption is; the images are read in parallel and the mask offsets of the columns"
+              << " are stored once in the file." << std::endl;
 
     std::cout << "\n  RandomlySampleImageSetToCSV: N random samples are selected from each image in a list "
               << std::endl;
@@ -14990,6 +14445,7 @@ private:
 
     std::cout << "\n  InPaint        : very simple inpainting --- assumes zero values should be inpainted  " << std::endl;
     std::cout << "      Usage        : InPaint #iterations" << std::endl;
+    std::cout << "                     solves for the harmonic interpolation of the non-zero values; #iterations bounds the solver iterations" << std::endl;
 
     std::cout << "\n  PeronaMalik       : anisotropic diffusion w/varying conductance param (0.25 in example below)" << std::endl;
     std::cout << "      Usage        : PeronaMalik image #iterations conductance " << std::endl;
@@ -15034,7 +14490,7 @@ private:
     std::cout
       <<
       "      Usage        : NeighborhoodStats inputImage whichStat radius"
-      "             whichStat:  1 = min, 2 = max, 3 = variance, 4 = sigma, 5 = skewness, 6 = kurtosis, 7 = entropy"
+      "             whichStat:  1 = min, 2 = max, 3 = variance, 4 = sigma, 5 = skewness, 6 = kurtosis, 7 = entropy, 8 = median"
       << std::endl;
 
     std::cout
@@ -15113,6 +14569,9 @@ private:
       <<
       "      Usage        : PoissonDiffusion inputImage labelImage [sigma=1.0] [regionLabel=1] [numberOfIterations=500] [convergenceThreshold=1e-10]"
       << std::endl;
+    std::cout
+      << "                     sources are the voxels >= 0.2; sigma is ignored, the convergenceThreshold is on the relative residual"
+      << std::endl;
 
     std::cout
       <<
@@ -15126,6 +14585,8 @@ private:
       <<
       "      0/1/2  =>  0, no topology constraint, 1 - strict topology constraint, 2 - no handles "
       << std::endl;
+    std::cout << "      Without a topology constraint all labels are propagated together in a single pass;"
+              << " with one, each label is marched separately." << std::endl;
 
     std::cout << "\n  PValueImage        : " << std::endl;
     std::cout << "      Usage        : PValueImage TValueImage dof" << std::endl;
@@ -28,6 +28,9 @@
 #include "itkRelabelComponentImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
 #include "itkNeighborhoodIterator.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
 
 //  RecursiveAverageImages img1  img2  weight
 
@@ -431,13 +434,13 @@ float median(std::vector<float> vec)
     }
   //            throw domain_error("median of an empty vector");
 
-  sort(vec.begin(), vec.end() );
-
   vec_sz mid = size / 2;
-
-  return size % 2 == 0
-         ? (vec[mid] + vec[mid - 1]) / 2
-         : vec[mid];
+  std::nth_element(vec.begin(), vec.begin() + mid, vec.end() );
+  if( size % 2 == 0 )
+    {
+    return ( vec[mid] + *std::max_element(vec.begin(), vec.begin() + mid) ) / 2;
+    }
+  return vec[mid];
 }
 
 float npdf(std::vector<float> vec, bool opt,  float www)
@@ -619,15 +622,182 @@ float myantssimilaritymaxlabel(std::vector<float> labelvec, std::vector<float> s
     }
 }
 
+/** The statistic whichstat of the samples of one voxel. */
+float ImageSetStatisticsValue( unsigned int whichstat, const std::vector<float> & voxels,
+                               const std::vector<float> & similarities, unsigned int maxval, float www )
+{
+  switch( whichstat )
+    {
+    case 1:
+      return npdf(voxels, true, www);
+    case 2:
+      return npdf(voxels, false, www);
+    case 3:
+      return trimmean(voxels);
+    case 4:
+      return myantsmax(voxels);
+    case 5:
+      return myantssimilaritymaxlabel(voxels, similarities, true);
+    case 6:
+      return myantssimilaritymaxlabel(voxels, similarities, false);
+    case 7:
+      return voxels[maxval];
+    default:
+      return median(voxels);
+    }
+}
+
+template <class TImage>
+struct ImageSetStatisticsThreadStruct
+  {
+  const std::vector<std::string> *FileNames;
+  const std::vector<std::string> *SimilarityFileNames;
+  const float *                   ROI; // null if there is no ROI image
+  unsigned int                    WhichStat;
+  float                           Width;
+
+  // the current slab, voxel-major: the samples of voxel p are at
+  // Values[p * FileNames->size()], those of the similarity images at
+  // Similarities[p * SimilarityFileNames->size()]
+  typename TImage::RegionType     Slab;
+  size_t                          NumberOfSlabPixels;
+  std::vector<float> *            Values;
+  std::vector<float> *            Similarities;
+  float *                         Output;
+  size_t                          SlabOffset;
+
+  size_t                          NextFile;
+  itk::SimpleFastMutexLock        Mutex;
+  bool                            Failed;
+  std::string                     ErrorMessage;
+  };
+
+/** Reads the current slab of the images and transposes it into the
+ * voxel-major buffers, one image at a time per thread. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE ImageSetStatisticsReadThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *     info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ImageSetStatisticsThreadStruct<TImage> *   str =
+    static_cast<ImageSetStatisticsThreadStruct<TImage> *>( info->UserData );
+
+  const size_t numberOfFiles = str->FileNames->size();
+  const size_t numberOfSimilarityFiles = str->SimilarityFileNames->size();
+  while( true )
+    {
+    str->Mutex.Lock();
+    const size_t n = str->NextFile++;
+    const bool   failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || n >= numberOfFiles + numberOfSimilarityFiles )
+      {
+      break;
+      }
+
+    const bool   similarity = ( n >= numberOfFiles );
+    const size_t j = similarity ? n - numberOfFiles : n;
+    const size_t stride = similarity ? numberOfSimilarityFiles : numberOfFiles;
+    float *      values = similarity ? &( *str->Similarities )[j] : &( *str->Values )[j];
+    try
+      {
+      typedef itk::ImageFileReader<TImage> ReaderType;
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( similarity ? ( *str->SimilarityFileNames )[j] : ( *str->FileNames )[j] );
+      reader->UpdateOutputInformation();
+      reader->GetOutput()->SetRequestedRegion( str->Slab );
+      reader->GetOutput()->Update();
+
+      itk::ImageRegionConstIterator<TImage> It( reader->GetOutput(), str->Slab );
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        *values = It.Get();
+        values += stride;
+        }
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The statistic of a contiguous range of the slab voxels. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE ImageSetStatisticsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *     info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ImageSetStatisticsThreadStruct<TImage> *   str =
+    static_cast<ImageSetStatisticsThreadStruct<TImage> *>( info->UserData );
+
+  const size_t numberOfFiles = str->FileNames->size();
+  const size_t numberOfSimilarityFiles = str->SimilarityFileNames->size();
+  const size_t begin = str->NumberOfSlabPixels * info->ThreadID / info->NumberOfThreads;
+  const size_t end = str->NumberOfSlabPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  std::vector<float> voxels( numberOfFiles );
+  std::vector<float> similarities( numberOfSimilarityFiles );
+
+  for( size_t p = begin; p < end; p++ )
+    {
+    unsigned int maxval = 0;
+    if( str->ROI )
+      {
+      const float roi = str->ROI[str->SlabOffset + p];
+      if( roi < 0.5 )
+        {
+        str->Output[p] = 0;
+        continue;
+        }
+      maxval = (unsigned int)( roi - 1 );
+      }
+    std::copy( &( *str->Values )[p * numberOfFiles], &( *str->Values )[p * numberOfFiles] + numberOfFiles,
+               voxels.begin() );
+    if( numberOfSimilarityFiles > 0 )
+      {
+      std::copy( &( *str->Similarities )[p * numberOfSimilarityFiles],
+                 &( *str->Similarities )[p * numberOfSimilarityFiles] + numberOfSimilarityFiles,
+                 similarities.begin() );
+      }
+    str->Output[p] = ImageSetStatisticsValue( str->WhichStat, voxels, similarities, maxval, str->Width );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The image file names listed in fn, one per line. */
+bool ReadImageSetFileNames( const std::string & fn, std::vector<std::string> & filenames )
+{
+  const unsigned int maxChar = 512;
+  char               lineBuffer[maxChar];
+  char               filenm[maxChar];
+
+  std::ifstream inputStreamA( fn.c_str(), std::ios::in );
+  if( !inputStreamA.is_open() )
+    {
+    std::cout << "Can't open parameter file: " << fn << std::endl;
+    return false;
+    }
+  while( !inputStreamA.eof() )
+    {
+    inputStreamA.getline( lineBuffer, maxChar, '\n' );
+    if( sscanf( lineBuffer, "%s ", filenm) == 1 )
+      {
+      filenames.push_back( std::string( filenm ) );
+      }
+    }
+  inputStreamA.close();
+  return true;
+}
+
 template <unsigned int ImageDimension>
 int ImageSetStatistics(int argc, char *argv[])
 {
   typedef float                                                           PixelType;
   typedef itk::Image<PixelType, ImageDimension>                           ImageType;
   typedef itk::ImageFileReader<ImageType>                                 readertype;
-  typedef typename ImageType::IndexType                                   IndexType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                    Iterator;
-  unsigned int mch = 0;
   int          argct = 2;
   std::string  fn1 = std::string(argv[argct]); argct++;
   std::string  outfn = std::string(argv[argct]); argct++;
@@ -644,14 +814,9 @@ int ImageSetStatistics(int argc, char *argv[])
     }
   float www = 0;
   // if (argc > argct) { www=atof(argv[argct]);argct++;}
-  //  unsigned int mchmax= 0;
-  // if (argc > argct) { mchmax=atoi(argv[argct]); argct++;}
-  unsigned int localmeanrad = 0;
-  // if (argc > argct) { localmeanrad=atoi(argv[argct]);argct++;}
 
   //  std::cout <<" roifn " << roifn << " fn1 " << fn1 << " whichstat " << whichstat << std::endl;
 
-  typename ImageType::Pointer outimage = ITK_NULLPTR;
   typename ImageType::Pointer ROIimg = ITK_NULLPTR;
 
   if( roifn.length() > 4 )
@@ -672,65 +837,26 @@ int ImageSetStatistics(int argc, char *argv[])
       }
     }
 
-  // now do the recursive average
-  const unsigned int maxChar = 512;
-  char               lineBuffer[maxChar];
-  char               filenm[maxChar];
-  unsigned int       filecount1 = 0;
+  std::vector<std::string> filenames;
+  if( !ReadImageSetFileNames( fn1, filenames ) )
     {
-    std::ifstream inputStreamA( fn1.c_str(), std::ios::in );
-    if( !inputStreamA.is_open() )
-      {
-      std::cout << "Can't open parameter file: " << fn1 << std::endl;
-      return EXIT_FAILURE;
-      }
-    while( !inputStreamA.eof() )
-      {
-      inputStreamA.getline( lineBuffer, maxChar, '\n' );
-
-      if( sscanf( lineBuffer, "%s ", filenm) != 1 )
-        {
-        //      std::cout << "Done.  read " << lineBuffer << " n " << ct1 << " files " << std::endl;
-        // std::cout << std::endl;
-        continue;
-        }
-      else
-        {
-        filecount1++;
-        }
-      }
-
-    inputStreamA.close();
+    return EXIT_FAILURE;
+    }
+  std::cout << " NFiles1 " << filenames.size() << std::endl;
+  if( filenames.empty() )
+    {
+    std::cout << " No images listed in " << fn1 << std::endl;
+    return EXIT_FAILURE;
     }
-  std::cout << " NFiles1 " << filecount1 << std::endl;
 
-  unsigned int filecount2 = 0;
+  std::vector<std::string> simfilenames;
   if( simimagelist.length() > 2 && ( whichstat == 5 || whichstat == 6 ) )
     {
-    std::ifstream inputStreamA( simimagelist.c_str(), std::ios::in );
-    if( !inputStreamA.is_open() )
+    if( !ReadImageSetFileNames( simimagelist, simfilenames ) )
       {
-      std::cout << "Can't open parameter file: " << fn1 << std::endl;
       return EXIT_FAILURE;
       }
-    while( !inputStreamA.eof() )
-      {
-      inputStreamA.getline( lineBuffer, maxChar, '\n' );
-
-      if( sscanf( lineBuffer, "%s ", filenm) != 1 )
-        {
-        //      std::cout << "Done.  read " << lineBuffer << " n " << ct1 << " files " << std::endl;
-        // std::cout << std::endl;
-        continue;
-        }
-      else
-        {
-        filecount2++;
-        }
-      }
-
-    inputStreamA.close();
-    if( filecount1 != filecount2 )
+    if( filenames.size() != simfilenames.size() )
       {
       std::cout
         <<
@@ -739,217 +865,119 @@ int ImageSetStatistics(int argc, char *argv[])
       return EXIT_FAILURE;
       }
     } // fi simimagelist
-  std::cout << " NFiles2 " << filecount2 << std::endl;
-
-  typename ImageType::Pointer meanimage;
-  std::vector<typename ImageType::Pointer> imagestack;
-  imagestack.resize(filecount1);
-  //  imagestack.fill(NULL);
-  std::vector<std::string> filenames(filecount1);
-  typename ImageType::Pointer StatImage;
-  unsigned int  ct = 0;
-  std::ifstream inputStreamA( fn1.c_str(), std::ios::in );
-  if( !inputStreamA.is_open() )
+  std::cout << " NFiles2 " << simfilenames.size() << std::endl;
+
+  // the output takes the geometry of the first image
+  typename ImageType::Pointer StatImage = ImageType::New();
     {
-    std::cout << "Can't open parameter file: " << fn1 << std::endl;
-    return EXIT_FAILURE;
+    typename readertype::Pointer reader = readertype::New();
+    reader->SetFileName( filenames[0].c_str() );
+    reader->UpdateOutputInformation();
+    StatImage->CopyInformation( reader->GetOutput() );
+    StatImage->SetRegions( reader->GetOutput()->GetLargestPossibleRegion() );
+    StatImage->Allocate();
     }
-  while( !inputStreamA.eof() )
+  if( ROIimg.IsNotNull() && ROIimg->GetLargestPossibleRegion() != StatImage->GetLargestPossibleRegion() )
     {
-    inputStreamA.getline( lineBuffer, maxChar, '\n' );
-
-    if( sscanf( lineBuffer, "%s ", filenm) != 1 )
-      {
-      //      std::cout << "Done.  read " << lineBuffer << " n " << ct1 << " files " << std::endl;
-      // std::cout << std::endl;
-      continue;
-      }
-    else
-      {
-      filenames[ct] = std::string(filenm);
-      ReadImage<ImageType>(imagestack[ct], filenm, false);
-      if( ct == 0 )
-        {
-        meanimage = MakeNewImage<ImageType>(imagestack[ct], 0);
-        }
-      if( localmeanrad > 0 )
-        {
-        LocalMean<ImageType>(imagestack[ct], localmeanrad, meanimage);
-        }
-      std::cout << " done reading " << (float) ct / (float ) filecount1 << std::endl;
-      ct++;
-      }
+    std::cout << " The roi image does not have the size of the images " << std::endl;
+    return EXIT_FAILURE;
     }
 
-  inputStreamA.close();
-
-  // read similarity images, if needed
-  std::vector<typename ImageType::Pointer> simimagestack;
-  simimagestack.resize(filecount2);
-  ct = 0;
-  if( simimagelist.length() > 2 && ( whichstat == 5 || whichstat == 6 ) )
+  switch( whichstat )
     {
-    inputStreamA.open( simimagelist.c_str() );
-    if( !inputStreamA.is_open() )
-      {
-      std::cout << "Can't open parameter file: " << fn1 << std::endl;
-      return -1;
-      }
-    while( !inputStreamA.eof() )
-      {
-      inputStreamA.getline( lineBuffer, maxChar, '\n' );
-      if( sscanf( lineBuffer, "%s ", filenm) != 1 )
-        {
-        continue;
-        }
-      else
-        {
-        ReadImage<ImageType>(simimagestack[ct], filenm, false);
-        ct++;
-        }
-      }
-
-    inputStreamA.close();
-    } // fi read similarity images
+    case 1:
+      std::cout << "the max prob appearance \n";
+      break;
+    case 2:
+      std::cout << "the probabilistically weighted appearance " << www << " \n";
+      break;
+    case 3:
+      std::cout << "the trimmed mean appearance \n";
+      break;
+    case 4:
+      std::cout << "the maximum appearance \n";
+      break;
+    case 5:
+      std::cout << "the maximum similarity-based label \n";
+      break;
+    case 6:
+    case 7:
+      std::cout << "which image provides the maximum similarity-based label \n";
+      break;
+    default:
+      std::cout << "the median appearance \n";
+      break;
+    }
 
-  ReadImage<ImageType>( StatImage, filenames[0].c_str(), false);
-  Iterator           vfIter(StatImage, StatImage->GetLargestPossibleRegion() );
-  std::vector<float> voxels(filecount1);
-  std::vector<float> similarities(filecount2);
-  unsigned long      nvox = 1;
-  for( unsigned int i = 0; i < ImageDimension; i++ )
+  // The images are read slab by slab (along the last dimension) so that the
+  // slabs of all the images fit in ANTS_IMAGE_SET_STATISTICS_MEMORY_MB (2048
+  // by default).  Each slab is stored voxel-major so that the samples of a
+  // voxel are contiguous.
+  double      memoryInMegabytes = 2048.0;
+  const char *memoryValue = std::getenv( "ANTS_IMAGE_SET_STATISTICS_MEMORY_MB" );
+  if( memoryValue && atof( memoryValue ) > 0.0 )
     {
-    nvox *= StatImage->GetLargestPossibleRegion().GetSize()[i];
+    memoryInMegabytes = atof( memoryValue );
     }
 
-  ct = 0;
-  unsigned long prog = nvox / 15;
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  const typename ImageType::RegionType largestRegion = StatImage->GetLargestPossibleRegion();
+  const unsigned int sliceDimension = ImageDimension - 1;
+  const size_t       numberOfSlices = largestRegion.GetSize()[sliceDimension];
+  const size_t       numberOfSlicePixels = largestRegion.GetNumberOfPixels()
+    / std::max( numberOfSlices, static_cast<size_t>( 1 ) );
+  const size_t       numberOfFiles = filenames.size() + simfilenames.size();
+  const size_t       slabBytes = static_cast<size_t>( memoryInMegabytes * 1024.0 * 1024.0 );
+  const size_t       slicesPerSlab = std::min( numberOfSlices, std::max( static_cast<size_t>( 1 ),
+    slabBytes / ( numberOfFiles * numberOfSlicePixels * sizeof( float ) ) ) );
+
+  typedef ImageSetStatisticsThreadStruct<ImageType> ThreadStructType;
+  ThreadStructType str;
+  str.FileNames = &filenames;
+  str.SimilarityFileNames = &simfilenames;
+  str.ROI = ROIimg.IsNotNull() ? ROIimg->GetBufferPointer() : ITK_NULLPTR;
+  str.WhichStat = whichstat;
+  str.Width = www;
+  str.Failed = false;
+
+  const unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  std::vector<float> values;
+  std::vector<float> similarities;
+  for( size_t firstSlice = 0; firstSlice < numberOfSlices; firstSlice += slicesPerSlab )
     {
-    if( ct % prog == 0 )
-      {
-      std::cout << " % " << (float) ct / (float) nvox << std::endl;
-      }
-    ct++;
-    IndexType    ind = vfIter.GetIndex();
-    unsigned int maxval = 0;
-    bool         takesample = true;
-    if( ROIimg )
+    const size_t slabSlices = std::min( slicesPerSlab, numberOfSlices - firstSlice );
+    std::cout << " % " << (float) firstSlice / (float) numberOfSlices << std::endl;
+
+    typename ImageType::RegionType slab = largestRegion;
+    slab.SetIndex( sliceDimension, largestRegion.GetIndex()[sliceDimension] + firstSlice );
+    slab.SetSize( sliceDimension, slabSlices );
+
+    str.Slab = slab;
+    str.NumberOfSlabPixels = slab.GetNumberOfPixels();
+    values.resize( filenames.size() * str.NumberOfSlabPixels );
+    similarities.resize( simfilenames.size() * str.NumberOfSlabPixels );
+    str.Values = &values;
+    str.Similarities = &similarities;
+    str.SlabOffset = firstSlice * numberOfSlicePixels;
+    str.Output = StatImage->GetBufferPointer() + str.SlabOffset;
+
+    str.NextFile = 0;
+    itk::MultiThreader::Pointer readThreader = itk::MultiThreader::New();
+    readThreader->SetNumberOfThreads( std::max( std::min( numberOfThreads,
+      static_cast<unsigned int>( numberOfFiles ) ), 1u ) );
+    readThreader->SetSingleMethod( ImageSetStatisticsReadThreaderCallback<ImageType>, &str );
+    readThreader->SingleMethodExecute();
+    if( str.Failed )
       {
-      if( ROIimg->GetPixel(ind) < 0.5 )
-        {
-        takesample = false;
-        }
-      else
-        {
-        maxval = (unsigned int)(ROIimg->GetPixel(ind) - 1);
-        }
+      std::cout << str.ErrorMessage << std::endl;
+      return EXIT_FAILURE;
       }
-    if( takesample )
-      {
-      if( mch == 0 )
-        {
-        meanimage->SetPixel(ind, meanimage->GetPixel(ind) / filecount1 );
-        }
-      for( unsigned int j = 0; j < filecount1; j++ )
-        {
-        voxels[j] = imagestack[j]->GetPixel(ind);
-        }
-      for( unsigned int j = 0; j < filecount2; j++ )
-        {
-        similarities[j] = simimagestack[j]->GetPixel(ind);
-        }
-      float stat = 0;
 
-      switch( whichstat )
-        {
-        case 1:
-          {
-          stat = npdf(voxels, true, www);
-          if( ct == 1 )
-            {
-            std::cout << "the max prob appearance \n";
-            }
-          }
-          break;
-        case 2:
-          {
-          stat = npdf(voxels, false, www);
-          if( ct == 1 )
-            {
-            std::cout << "the probabilistically weighted appearance " << www << " \n";
-            }
-          }
-          break;
-
-        case 3:
-          {
-          stat = trimmean(voxels);
-          if( ct == 1 )
-            {
-            std::cout << "the trimmed mean appearance \n";
-            }
-          }
-          break;
-
-        case 4:
-          {
-          stat = myantsmax(voxels);
-          if( ct == 1 )
-            {
-            std::cout << "the maximum appearance \n";
-            }
-          }
-          break;
-        case 5:
-          {
-          stat = myantssimilaritymaxlabel(voxels, similarities, true);
-          if( ct == 1 )
-            {
-            std::cout << "the maximum similarity-based label \n";
-            }
-          }
-          break;
-        case 6:
-          {
-          stat = myantssimilaritymaxlabel(voxels, similarities, false);
-          if( ct == 1 )
-            {
-            std::cout << "which image provides the maximum similarity-based label \n";
-            }
-          }
-          break;
-        case 7:
-          {
-          stat = voxels[maxval];
-          if( ct == 1 )
-            {
-            std::cout << "which image provides the maximum similarity-based label \n";
-            }
-          }
-          break;
-
-        default:
-          {
-          stat = median(voxels);
-          if( ct == 1 )
-            {
-            std::cout << "the median appearance \n";
-            }
-          }
-          break;
-        }
-      float sval = stat;
-      if( localmeanrad > 0 )
-        {
-        sval += meanimage->GetPixel(ind);
-        }
-      StatImage->SetPixel(ind, sval);
-      }
-    else
-      {
-      StatImage->SetPixel(ind, 0);
-      }
+    itk::MultiThreader::Pointer statisticsThreader = itk::MultiThreader::New();
+    statisticsThreader->SetNumberOfThreads( std::max( std::min( numberOfThreads,
+      static_cast<unsigned int>( str.NumberOfSlabPixels ) ), 1u ) );
+    statisticsThreader->SetSingleMethod( ImageSetStatisticsThreaderCallback<ImageType>, &str );
+    statisticsThreader->SingleMethodExecute();
     }
   WriteImage<ImageType>(StatImage, outfn.c_str() );
 
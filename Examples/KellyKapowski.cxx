@@ -340,6 +340,30 @@ int DiReCT( itk::ants::CommandLineParser *parser )
                                                                  numberOfInvertDisplacementFieldIterationsOption->GetFunction( 0 )->GetName() ) );
     }
 
+  //
+  // restrict the computation to the gm/wm bounding region
+  //
+  typename itk::ants::CommandLineParser::OptionType::Pointer
+    boundingRegionOption = parser->GetOption( "restrict-to-bounding-region" );
+  if( boundingRegionOption && boundingRegionOption->GetNumberOfFunctions() )
+    {
+    if( boundingRegionOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+      {
+      direct->SetRestrictToBoundingRegion( parser->Convert<bool>(
+                                             boundingRegionOption->GetFunction( 0 )->GetName() ) );
+      }
+    else
+      {
+      direct->SetRestrictToBoundingRegion( parser->Convert<bool>(
+                                             boundingRegionOption->GetFunction( 0 )->GetParameter( 0 ) ) );
+      if( boundingRegionOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        direct->SetBoundingRegionPadding( parser->Convert<unsigned int>(
+                                            boundingRegionOption->GetFunction( 0 )->GetParameter( 1 ) ) );
+        }
+      }
+    }
+
   if( verbose )
     {
     typedef CommandIterationUpdate<DiReCTFilterType> CommandType;
@@ -585,6 +609,21 @@ void KellyKapowskiInitializeCommandLineOptions( itk::ants::CommandLineParser *pa
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Restrict the computation to the bounding box of the gray and white " )
+    + std::string( "matters, padded by the given number of voxels.  The thickness is " )
+    + std::string( "zero outside of this region.  The padding should cover the smoothing " )
+    + std::string( "kernels and the expected thickness.  Default = false, padding = 10." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "restrict-to-bounding-region" );
+  option->SetUsageOption( 0, "1/(0)" );
+  option->SetUsageOption( 1, "[1/(0),<padding=10>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "The output consists of a thickness map defined in the " )
@@ -29,11 +29,10 @@
 #include "vnl/vnl_vector.h"
 
 #include "itkMinimumMaximumImageFilter.h"
-#include "itkConnectedComponentImageFilter.h"
-#include "itkRelabelComponentImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
 #include "itkCastImageFilter.h"
 #include  "ReadWriteData.h"
+#include "antsConnectedComponentLabeler.h"
 
 namespace ants
 {
@@ -49,8 +48,7 @@ int  LabelUniquely(int argc, char *argv[])
   typedef itk::CastImageFilter<ImageType, labelimagetype>  CastFilterType;
   typedef itk::CastImageFilter< labelimagetype, ImageType> CastFilterType2;
 
-  typedef itk::ConnectedComponentImageFilter<labelimagetype, labelimagetype> FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, labelimagetype>   RelabelType;
+  typedef ConnectedComponentLabeler<labelimagetype, labelimagetype> LabelerType;
 
   // want the average value in each cluster as defined by the mask and the value thresh and the clust thresh
 
@@ -81,30 +79,19 @@ int  LabelUniquely(int argc, char *argv[])
 
   ReadImage<ImageType>(image1, fn1.c_str() );
 
-  typename FilterType::Pointer filter = FilterType::New();
-  typename RelabelType::Pointer relabel = RelabelType::New();
-
   typename CastFilterType::Pointer castInput = CastFilterType::New();
   castInput->SetInput(image1);
+  castInput->Update();
 
-  filter->SetInput( castInput->GetOutput() );
-  filter->SetFullyConnected( fullyConnected ); // old default was false
-  relabel->SetInput( filter->GetOutput() );
-  relabel->SetMinimumObjectSize( (unsigned int) clusterthresh );
-
-  try
-    {
-    relabel->Update();
-    }
-  catch( itk::ExceptionObject & excep )
-    {
-    std::cout << "Relabel: exception caught !" << std::endl;
-    std::cout << excep << std::endl;
-    }
+  LabelerType labeler;
+  labeler.SetInput( castInput->GetOutput() );
+  labeler.SetFullyConnected( fullyConnected ); // old default was false
+  labeler.SetMinimumComponentSize( (unsigned int) clusterthresh );
+  labeler.Update();
 
 //  float maximum=relabel->GetNumberOfObjects();
   typename CastFilterType2::Pointer castRegions = CastFilterType2::New();
-  castRegions->SetInput( relabel->GetOutput() );
+  castRegions->SetInput( labeler.GetOutput() );
   castRegions->Update();
   WriteImage<ImageType>(   castRegions->GetOutput() , argv[2] );
 
@@ -2,6 +2,7 @@
 #include "antsAllocImage.h"
 #include <algorithm>
 #include "ReadWriteData.h"
+#include "antsLabelGeometry.h"
 
 #include "itkAffineTransform.h"
 #include "itkCSVArray2DDataObject.h"
@@ -18,7 +19,7 @@
 #include <vector>
 #include <cmath>
 #include <iomanip>
-#include <iostream>
+#include <map>
 #include <ostream>
 #include <sstream>
 
@@ -56,21 +57,17 @@ int LabelGeometryMeasures( int argc, char * argv[] )
     outputCSVFormat = true;
     }
 
-  typedef itk::LabelGeometryImageFilter<LabelImageType, RealImageType> FilterType;
-  typename FilterType::Pointer filter = FilterType::New();
-  filter->SetInput( labelImage );
-  if( intensityImageUsed )
+  // one threaded pass for the moments of all the labels
+  typedef typename LabelGeometryThreadStruct<LabelImageType, RealImageType>::MapType MapType;
+  MapType geometry;
+  ComputeLabelGeometry<LabelImageType, RealImageType>( labelImage,
+    intensityImageUsed ? intensityImage.GetPointer() : ITK_NULLPTR, false, geometry );
+
+  std::vector<LabelType> allLabels;
+  for( typename MapType::const_iterator it = geometry.begin(); it != geometry.end(); ++it )
     {
-    filter->SetIntensityInput( intensityImage );
+    allLabels.push_back( it->first );
     }
-  filter->CalculatePixelIndicesOff();
-  filter->CalculateOrientedBoundingBoxOff();
-  filter->CalculateOrientedLabelRegionsOff();
-  // These generate optional outputs.
-//   filter->CalculatePixelIndicesOn();
-//   filter->CalculateOrientedBoundingBoxOn();;
-//   filter->CalculateOrientedLabelRegionsOn();
-  filter->Update();
 
   typedef itk::LabelPerimeterEstimationCalculator<LabelImageType> AreaFilterType;
   typename AreaFilterType::Pointer areafilter = AreaFilterType::New();
@@ -78,12 +75,9 @@ int LabelGeometryMeasures( int argc, char * argv[] )
   areafilter->SetFullyConnected( false );
   areafilter->Compute();
 
-  typename FilterType::LabelsType allLabels = filter->GetLabels();
-  std::sort( allLabels.begin(), allLabels.end() );
-
   if( outputCSVFormat )
     {
-    typename FilterType::LabelsType::iterator allLabelsIt;
+    typename std::vector<LabelType>::iterator allLabelsIt;
 
     std::vector<std::string>   columnHeaders;
 
@@ -118,7 +112,7 @@ int LabelGeometryMeasures( int argc, char * argv[] )
       columnHeaders.push_back( std::string( "BoundingBoxUpper_z" ) );
       }
 
-    if( filter->GetIntensityInput() )
+    if( intensityImageUsed )
       {
       columnHeaders.push_back( std::string( "IntegratedIntensity" ) );
       columnHeaders.push_back( std::string( "WeightedCentroid_x" ) );
@@ -130,9 +124,9 @@ int LabelGeometryMeasures( int argc, char * argv[] )
       }
 
     std::vector<std::string>   rowHeaders;
-    std::ostringstream convert;// stream used for the conversion
     for( allLabelsIt = allLabels.begin(); allLabelsIt != allLabels.end(); allLabelsIt++ )
       {
+      std::ostringstream convert;// stream used for the conversion
       convert << *allLabelsIt;   // insert the textual representation of 'Number' in the characters in the stream
       rowHeaders.push_back( convert.str() ); // set 'Result' to the contents of the stream
       }
@@ -142,48 +136,38 @@ int LabelGeometryMeasures( int argc, char * argv[] )
     unsigned int rowIndex = 0;
     for( allLabelsIt = allLabels.begin(); allLabelsIt != allLabels.end(); allLabelsIt++ )
       {
+      const LabelGeometry<ImageDimension> & labelGeometry = geometry[*allLabelsIt];
+
       unsigned int columnIndex = 0;
-      measures( rowIndex, columnIndex++ ) = filter->GetVolume( *allLabelsIt );
+      measures( rowIndex, columnIndex++ ) = labelGeometry.m_Volume;
       measures( rowIndex, columnIndex++ ) = areafilter->GetPerimeter( *allLabelsIt );
-      measures( rowIndex, columnIndex++ ) = filter->GetEccentricity( *allLabelsIt );
-      measures( rowIndex, columnIndex++ ) = filter->GetElongation( *allLabelsIt );
-      measures( rowIndex, columnIndex++ ) = filter->GetOrientation( *allLabelsIt );
-      measures( rowIndex, columnIndex++ ) = filter->GetCentroid( *allLabelsIt )[0];
-      measures( rowIndex, columnIndex++ ) = filter->GetCentroid( *allLabelsIt )[1];
-      if( ImageDimension == 3 )
+      measures( rowIndex, columnIndex++ ) = labelGeometry.m_Eccentricity;
+      measures( rowIndex, columnIndex++ ) = labelGeometry.m_Elongation;
+      measures( rowIndex, columnIndex++ ) = labelGeometry.m_Orientation;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        measures( rowIndex, columnIndex++ ) = filter->GetCentroid( *allLabelsIt )[2];
+        measures( rowIndex, columnIndex++ ) = labelGeometry.m_Centroid[d];
         }
-      measures( rowIndex, columnIndex++ ) = filter->GetAxesLength( *allLabelsIt )[0];
-      measures( rowIndex, columnIndex++ ) = filter->GetAxesLength( *allLabelsIt )[1];
-      if( ImageDimension == 3 )
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        measures( rowIndex, columnIndex++ ) = filter->GetAxesLength( *allLabelsIt )[2];
+        measures( rowIndex, columnIndex++ ) = labelGeometry.m_AxesLength[d];
         }
-
-      unsigned int arrayIndex = 0;
-
-      measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
-      measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
-      if( ImageDimension == 3 )
+      // the bounding box columns are written in the order of the array, as before
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
+        measures( rowIndex, columnIndex++ ) = labelGeometry.m_BoundingBox[d];
         }
-      measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
-      measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
-      if( ImageDimension == 3 )
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        measures( rowIndex, columnIndex++ ) = filter->GetBoundingBox( *allLabelsIt )[arrayIndex++];
+        measures( rowIndex, columnIndex++ ) = labelGeometry.m_BoundingBox[ImageDimension + d];
         }
 
-      if( filter->GetIntensityInput() )
+      if( intensityImageUsed )
         {
-        measures( rowIndex, columnIndex++ ) = filter->GetIntegratedIntensity( *allLabelsIt );
-        measures( rowIndex, columnIndex++ ) = filter->GetWeightedCentroid( *allLabelsIt )[0];
-        measures( rowIndex, columnIndex++ ) = filter->GetWeightedCentroid( *allLabelsIt )[1];
-        if( ImageDimension == 3 )
+        measures( rowIndex, columnIndex++ ) = labelGeometry.m_IntegratedIntensity;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
           {
-          measures( rowIndex, columnIndex++ ) = filter->GetWeightedCentroid( *allLabelsIt )[2];
+          measures( rowIndex, columnIndex++ ) = labelGeometry.m_WeightedCentroid[d];
           }
         }
       rowIndex++;
@@ -208,7 +192,7 @@ int LabelGeometryMeasures( int argc, char * argv[] )
     }
   else
     {
-    typename FilterType::LabelsType::iterator allLabelsIt;
+    typename std::vector<LabelType>::iterator allLabelsIt;
   //   std::cout << "Number of labels: " << labelGeometryFilter->GetNumberOfLabels() << std::endl;
   //   std::cout << "Label geometry measures." << std::endl;
     std::cout << std::left << std::setw( 7 ) << "Label"
@@ -220,7 +204,7 @@ int LabelGeometryMeasures( int argc, char * argv[] )
              << std::left << std::setw( 30 ) << "Centroid"
              << std::left << std::setw( 30 ) << "Axes Length"
              << std::left << std::setw( 30 ) << "Bounding Box";
-    if( filter->GetIntensityInput() )
+    if( intensityImageUsed )
       {
       std::cout << std::left << std::setw( 20 )  << "Integrated Int."
                << std::left << std::setw( 30 ) << "Weighted Centroid";
@@ -232,35 +216,35 @@ int LabelGeometryMeasures( int argc, char * argv[] )
         {
         continue;
         }
+      const LabelGeometry<ImageDimension> & labelGeometry = geometry[*allLabelsIt];
+
       std::cout << std::setw( 7 ) << *allLabelsIt;
-      std::cout << std::setw( 10 ) << filter->GetVolume( *allLabelsIt );
+      std::cout << std::setw( 10 ) << labelGeometry.m_Volume;
       std::cout << std::setw( 15 ) << areafilter->GetPerimeter( *allLabelsIt );
-      std::cout << std::setw( 15 ) << filter->GetEccentricity( *allLabelsIt );
-      std::cout << std::setw( 15 ) << filter->GetElongation( *allLabelsIt );
-      std::cout << std::setw( 15 ) << filter->GetOrientation( *allLabelsIt );
+      std::cout << std::setw( 15 ) << labelGeometry.m_Eccentricity;
+      std::cout << std::setw( 15 ) << labelGeometry.m_Elongation;
+      std::cout << std::setw( 15 ) << labelGeometry.m_Orientation;
 
       std::stringstream oss;
-      oss << filter->GetCentroid( *allLabelsIt );
+      oss << labelGeometry.m_Centroid;
       std::cout << std::setw( 30 ) << ( oss.str() ).c_str();
       oss.str( "" );
 
-      oss << filter->GetAxesLength( *allLabelsIt );
+      oss << labelGeometry.m_AxesLength;
       std::cout << std::setw( 30 ) << ( oss.str() ).c_str();
       oss.str( "" );
 
-      oss << filter->GetBoundingBox( *allLabelsIt );
+      oss << labelGeometry.m_BoundingBox;
       std::cout << std::setw( 30 ) << ( oss.str() ).c_str();
       oss.str( "" );
 
-  //     std::cout << filter->GetMajorAxisLength( *allLabelsIt ) << "\t";
-  //     std::cout << filter->GetMinorAxisLength( *allLabelsIt ) << "\t";
-      if( filter->GetIntensityInput() )
+      if( intensityImageUsed )
         {
-        oss << filter->GetIntegratedIntensity( *allLabelsIt );
+        oss << labelGeometry.m_IntegratedIntensity;
         std::cout << std::setw( 20 ) << ( oss.str() ).c_str();
         oss.str( "" );
 
-        oss << filter->GetWeightedCentroid( *allLabelsIt );
+        oss << labelGeometry.m_WeightedCentroid;
         std::cout << std::setw( 30 ) << ( oss.str() ).c_str();
         oss.str( "" );
         }
@@ -43,31 +43,136 @@ int LabelOverlapMeasures( int argc, char * argv[] )
   typedef itk::ImageFileReader<ImageType> ReaderType;
   typename ReaderType::Pointer reader1 = ReaderType::New();
   reader1->SetFileName( argv[2] );
-  typename ReaderType::Pointer reader2 = ReaderType::New();
-  reader2->SetFileName( argv[3] );
+  reader1->Update();
 
-  typedef itk::LabelOverlapMeasuresImageFilter<ImageType> FilterType;
-  typename FilterType::Pointer filter = FilterType::New();
-  filter->SetSourceImage( reader1->GetOutput() );
-  filter->SetTargetImage( reader2->GetOutput() );
-  filter->Update();
+  // the target may be a comma separated list of images, each of which is
+  // compared to the source
+  std::vector<std::string> targetFileNames;
+    {
+    const std::string      targets( argv[3] );
+    std::string::size_type begin = 0;
+    while( true )
+      {
+      const std::string::size_type end = targets.find( ',', begin );
+      targetFileNames.push_back( targets.substr( begin, end == std::string::npos ? std::string::npos : end - begin ) );
+      if( end == std::string::npos )
+        {
+        break;
+        }
+      begin = end + 1;
+      }
+    }
+  const bool batch = ( targetFileNames.size() > 1 );
 
-  typename FilterType::MapType labelMap = filter->GetLabelSetMeasures();
+  typedef itk::LabelOverlapMeasuresImageFilter<ImageType> FilterType;
 
-  std::vector<int> allLabels;
-  allLabels.clear();
-  for( typename FilterType::MapType::const_iterator it = labelMap.begin();
-       it != labelMap.end(); ++it )
+  std::vector<std::string>         rowHeaders;
+  std::vector<std::vector<double> > rows;
+  for( unsigned int t = 0; t < targetFileNames.size(); t++ )
     {
-    if( (*it).first == 0 )
+    typename ReaderType::Pointer reader2 = ReaderType::New();
+    reader2->SetFileName( targetFileNames[t] );
+
+    typename FilterType::Pointer filter = FilterType::New();
+    filter->SetSourceImage( reader1->GetOutput() );
+    filter->SetTargetImage( reader2->GetOutput() );
+    filter->Update();
+
+    typename FilterType::MapType labelMap = filter->GetLabelSetMeasures();
+
+    std::vector<int> allLabels;
+    allLabels.clear();
+    for( typename FilterType::MapType::const_iterator it = labelMap.begin();
+         it != labelMap.end(); ++it )
       {
-      continue;
+      if( (*it).first == 0 )
+        {
+        continue;
+        }
+
+      const int label = (*it).first;
+      allLabels.push_back( label );
       }
+    std::sort( allLabels.begin(), allLabels.end() );
+
+    if( outputCSVFormat )
+      {
+      const std::string prefix = batch ? targetFileNames[t] + std::string( ":" ) : std::string( "" );
+      rowHeaders.push_back( prefix + std::string( "All" ) );
+
+      std::vector<double> row( 6 );
+      row[0] = filter->GetTotalOverlap();
+      row[1] = filter->GetUnionOverlap();
+      row[2] = filter->GetMeanOverlap();
+      row[3] = filter->GetVolumeSimilarity();
+      row[4] = filter->GetFalseNegativeError();
+      row[5] = filter->GetFalsePositiveError();
+      rows.push_back( row );
 
-    const int label = (*it).first;
-    allLabels.push_back( label );
+      for( std::vector<int>::const_iterator itL = allLabels.begin(); itL != allLabels.end(); ++itL )
+        {
+        std::ostringstream convert; // stream used for the conversion
+        convert << *itL;   // insert the textual representation of 'Number' in the characters in the stream
+        rowHeaders.push_back( prefix + convert.str() );
+
+        row[0] = filter->GetTargetOverlap( *itL );
+        row[1] = filter->GetUnionOverlap( *itL );
+        row[2] = filter->GetMeanOverlap( *itL );
+        row[3] = filter->GetVolumeSimilarity( *itL );
+        row[4] = filter->GetFalseNegativeError( *itL );
+        row[5] = filter->GetFalsePositiveError( *itL );
+        rows.push_back( row );
+        }
+      }
+    else
+      {
+      if( batch )
+        {
+        std::cout << "Target: " << targetFileNames[t] << std::endl;
+        }
+      std::cout << "                                          "
+                << "************ All Labels *************" << std::endl;
+      std::cout << std::setw( 10 ) << "   "
+                << std::setw( 17 ) << "Total"
+                << std::setw( 17 ) << "Union (jaccard)"
+                << std::setw( 17 ) << "Mean (dice)"
+                << std::setw( 17 ) << "Volume sim."
+                << std::setw( 17 ) << "False negative"
+                << std::setw( 17 ) << "False positive" << std::endl;
+      std::cout << std::setw( 10 ) << "   ";
+      std::cout << std::setw( 17 ) << filter->GetTotalOverlap();
+      std::cout << std::setw( 17 ) << filter->GetUnionOverlap();
+      std::cout << std::setw( 17 ) << filter->GetMeanOverlap();
+      std::cout << std::setw( 17 ) << filter->GetVolumeSimilarity();
+      std::cout << std::setw( 17 ) << filter->GetFalseNegativeError();
+      std::cout << std::setw( 17 ) << filter->GetFalsePositiveError();
+      std::cout << std::endl;
+
+      std::cout << "                                       "
+                << "************ Individual Labels *************" << std::endl;
+      std::cout << std::setw( 10 ) << "Label"
+                << std::setw( 17 ) << "Target"
+                << std::setw( 17 ) << "Union (jaccard)"
+                << std::setw( 17 ) << "Mean (dice)"
+                << std::setw( 17 ) << "Volume sim."
+                << std::setw( 17 ) << "False negative"
+                << std::setw( 17 ) << "False positive"
+                << std::endl;
+      for( unsigned int i = 0; i < allLabels.size(); i++ )
+        {
+        int label = allLabels[i];
+
+        std::cout << std::setw( 10 ) << label;
+        std::cout << std::setw( 17 ) << filter->GetTargetOverlap( label );
+        std::cout << std::setw( 17 ) << filter->GetUnionOverlap( label );
+        std::cout << std::setw( 17 ) << filter->GetMeanOverlap( label );
+        std::cout << std::setw( 17 ) << filter->GetVolumeSimilarity( label );
+        std::cout << std::setw( 17 ) << filter->GetFalseNegativeError( label );
+        std::cout << std::setw( 17 ) << filter->GetFalsePositiveError( label );
+        std::cout << std::endl;
+        }
+      }
     }
-  std::sort( allLabels.begin(), allLabels.end() );
 
   if( outputCSVFormat )
     {
@@ -81,37 +186,13 @@ int LabelOverlapMeasures( int argc, char * argv[] )
     columnHeaders.push_back( std::string( "FalseNegative" ) );
     columnHeaders.push_back( std::string( "FalsePositive" ) );
 
-    std::vector<std::string>   rowHeaders;
-    rowHeaders.push_back( std::string( "All" ) );
-
-    std::vector<int>::const_iterator itL = allLabels.begin();
-    while( itL != allLabels.end() )
+    vnl_matrix<double> measures( rows.size(), 6 );
+    for( unsigned int i = 0; i < rows.size(); i++ )
       {
-      std::ostringstream convert; // stream used for the conversion
-      convert << *itL;   // insert the textual representation of 'Number' in the characters in the stream
-      rowHeaders.push_back( convert.str() );
-      ++itL;
-      }
-
-    vnl_matrix<double> measures( allLabels.size() + 1, 6 );
-
-    measures( 0, 0 ) = filter->GetTotalOverlap();
-    measures( 0, 1 ) = filter->GetUnionOverlap();
-    measures( 0, 2 ) = filter->GetMeanOverlap();
-    measures( 0, 3 ) = filter->GetVolumeSimilarity();
-    measures( 0, 4 ) = filter->GetFalseNegativeError();
-    measures( 0, 5 ) = filter->GetFalsePositiveError();
-
-    unsigned int rowIndex = 1;
-    for( itL = allLabels.begin(); itL != allLabels.end(); ++itL )
-      {
-      measures( rowIndex, 0 ) = filter->GetTargetOverlap( *itL );
-      measures( rowIndex, 1 ) = filter->GetUnionOverlap( *itL );
-      measures( rowIndex, 2 ) = filter->GetMeanOverlap( *itL );
-      measures( rowIndex, 3 ) = filter->GetVolumeSimilarity( *itL );
-      measures( rowIndex, 4 ) = filter->GetFalseNegativeError( *itL );
-      measures( rowIndex, 5 ) = filter->GetFalsePositiveError( *itL );
-      rowIndex++;
+      for( unsigned int j = 0; j < 6; j++ )
+        {
+        measures( i, j ) = rows[i][j];
+        }
       }
 
     typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
@@ -131,50 +212,6 @@ int LabelOverlapMeasures( int argc, char * argv[] )
       return EXIT_FAILURE;
       }
     }
-  else
-    {
-    std::cout << "                                          "
-              << "************ All Labels *************" << std::endl;
-    std::cout << std::setw( 10 ) << "   "
-              << std::setw( 17 ) << "Total"
-              << std::setw( 17 ) << "Union (jaccard)"
-              << std::setw( 17 ) << "Mean (dice)"
-              << std::setw( 17 ) << "Volume sim."
-              << std::setw( 17 ) << "False negative"
-              << std::setw( 17 ) << "False positive" << std::endl;
-    std::cout << std::setw( 10 ) << "   ";
-    std::cout << std::setw( 17 ) << filter->GetTotalOverlap();
-    std::cout << std::setw( 17 ) << filter->GetUnionOverlap();
-    std::cout << std::setw( 17 ) << filter->GetMeanOverlap();
-    std::cout << std::setw( 17 ) << filter->GetVolumeSimilarity();
-    std::cout << std::setw( 17 ) << filter->GetFalseNegativeError();
-    std::cout << std::setw( 17 ) << filter->GetFalsePositiveError();
-    std::cout << std::endl;
-
-    std::cout << "                                       "
-              << "************ Individual Labels *************" << std::endl;
-    std::cout << std::setw( 10 ) << "Label"
-              << std::setw( 17 ) << "Target"
-              << std::setw( 17 ) << "Union (jaccard)"
-              << std::setw( 17 ) << "Mean (dice)"
-              << std::setw( 17 ) << "Volume sim."
-              << std::setw( 17 ) << "False negative"
-              << std::setw( 17 ) << "False positive"
-              << std::endl;
-    for( unsigned int i = 0; i < allLabels.size(); i++ )
-      {
-      int label = allLabels[i];
-
-      std::cout << std::setw( 10 ) << label;
-      std::cout << std::setw( 17 ) << filter->GetTargetOverlap( label );
-      std::cout << std::setw( 17 ) << filter->GetUnionOverlap( label );
-      std::cout << std::setw( 17 ) << filter->GetMeanOverlap( label );
-      std::cout << std::setw( 17 ) << filter->GetVolumeSimilarity( label );
-      std::cout << std::setw( 17 ) << filter->GetFalseNegativeError( label );
-      std::cout << std::setw( 17 ) << filter->GetFalsePositiveError( label );
-      std::cout << std::endl;
-      }
-    }
 
   return EXIT_SUCCESS;
 }
@@ -228,7 +265,9 @@ private:
   if( argc < 4 )
     {
     std::cout << "Usage: " << argv[0] << " imageDimension sourceImage "
-              << "targetImage [outputCSVFile]" << std::endl;
+              << "targetImage[,targetImage2,...] [outputCSVFile]" << std::endl;
+    std::cout << "  Each of a comma separated list of target images is compared to the source image; "
+              << "in the CSV file their rows are prefixed by the target file name." << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
@@ -9,6 +9,7 @@
 #include "itkImageFileWriter.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkLaplacianRecursiveGaussianImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkVectorCurvatureAnisotropicDiffusionImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
@@ -17,6 +18,7 @@
 #include "vnl/algo/vnl_determinant.h"
 
 #include "ReadWriteData.h"
+#include "antsMaskedPoissonSolver.h"
 
 namespace ants
 {
@@ -332,60 +334,46 @@ LaplacianGrad(typename TImage::Pointer wm, typename TImage::Pointer gm, float si
   typename TField::Pointer sfield =
     AllocImage<TField>(wm);
 
-  typename TImage::Pointer laplacian = SmoothImage<TImage>(wm, 1);
-  laplacian->FillBuffer(0);
+  // L(wm)=1 and L=2 outside wm and gm are fixed, L(gm) solves the Laplace
+  // equation in between.  This is what the old smooth-and-reset iterations
+  // converged to; numits now bounds the solver iterations and tolerance is
+  // on the relative residual.
+  typedef ants::MaskedPoissonSolver<ImageType>     SolverType;
+  typedef typename SolverType::VoxelTypeImageType  VoxelTypeImageType;
+  typename TImage::Pointer laplacian = AllocImage<TImage>(wm);
+  typename VoxelTypeImageType::Pointer voxelTypes = AllocImage<VoxelTypeImageType>(wm);
   typedef itk::ImageRegionIteratorWithIndex<TImage> IteratorType;
   IteratorType Iterator( wm, wm->GetLargestPossibleRegion().GetSize() );
-  Iterator.GoToBegin();
-
-  // initialize L(wm)=1, L(gm)=0.5, else 0
-  while(  !Iterator.IsAtEnd()  )
+  for( Iterator.GoToBegin(); !Iterator.IsAtEnd(); ++Iterator )
     {
     ind = Iterator.GetIndex();
     if( wm->GetPixel(ind) >= 0.5 )
       {
       laplacian->SetPixel(ind, 1);
+      voxelTypes->SetPixel(ind, SolverType::Fixed);
       }
-    else
+    else if( gm->GetPixel(ind) < 0.5 )
       {
       laplacian->SetPixel(ind, 2.);
+      voxelTypes->SetPixel(ind, SolverType::Fixed);
       }
-    ++Iterator;
-    }
-
-  // smooth and then reset the values
-  float        meanvalue = 0, lastmean = 1;
-  unsigned int iterations = 0;
-  while( fabs(meanvalue - lastmean) > tolerance  && iterations < numits )
-    {
-    iterations++;
-    std::cout << "  % " << (float) iterations
-      / (float)(numits + 1) << " delta-mean " << fabs(meanvalue - lastmean) <<  std::endl;
-    laplacian = SmoothImage<TImage>(laplacian, sqrt(sig) );
-    Iterator.GoToBegin();
-    unsigned int ct = 0;
-    lastmean = meanvalue;
-    while(  !Iterator.IsAtEnd()  )
+    else
       {
-      ind = Iterator.GetIndex();
-      if( wm->GetPixel(ind) >= 0.5 )
-        {
-        laplacian->SetPixel(ind, 1);
-        }
-      else if( gm->GetPixel(ind) < 0.5  && wm->GetPixel(ind) < 0.5 )
-        {
-        laplacian->SetPixel(ind, 2.);
-        }
-      else
-        {
-        meanvalue += laplacian->GetPixel(ind);  ct++;
-        }
-      ++Iterator;
+      laplacian->SetPixel(ind, 1.5);
+      voxelTypes->SetPixel(ind, SolverType::Unknown);
       }
-
-    meanvalue /= (float)ct;
     }
 
+  SolverType solver;
+  solver.SetInput( laplacian );
+  solver.SetVoxelTypeImage( voxelTypes );
+  solver.SetTolerance( tolerance );
+  solver.SetMaximumNumberOfIterations( numits );
+  solver.Update();
+  laplacian = solver.GetOutput();
+  std::cout << "  Laplacian solved in " << solver.GetNumberOfIterations() << " iterations, relative residual "
+            << solver.GetRelativeResidual() << std::endl;
+
   // /  WriteImage<ImageType>(laplacian, "laplacian.hdr");
 
   GradientImageFilterPointer filter = GradientImageFilterType::New();
@@ -395,18 +383,109 @@ LaplacianGrad(typename TImage::Pointer wm, typename TImage::Pointer gm, float si
   return filter->GetOutput();
 }
 
+/** Linear interpolation of a vector field at a continuous index, as
+ * itk::VectorLinearInterpolateImageFunction but straight from the buffer
+ * and clamped to it.  The streamlines sample the field four times per
+ * step, so this is where the integration spends its time. */
+template <class TField>
+class LinearFieldSampler
+{
+public:
+  typedef itk::VectorLinearInterpolateImageFunction<TField, float> InterpolatorType;
+  typedef typename InterpolatorType::OutputType                    OutputType;
+  typedef typename InterpolatorType::ContinuousIndexType           ContinuousIndexType;
+  typedef typename TField::PixelType                               PixelType;
+  typedef typename TField::OffsetValueType                         OffsetValueType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TField::ImageDimension );
+
+  explicit LinearFieldSampler( const TField *field ) :
+    m_Buffer( field->GetBufferPointer() )
+  {
+    OffsetValueType stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      this->m_Start[d] = field->GetBufferedRegion().GetIndex()[d];
+      this->m_Size[d] = static_cast<OffsetValueType>( field->GetBufferedRegion().GetSize()[d] );
+      this->m_Strides[d] = stride;
+      stride *= this->m_Size[d];
+      }
+  }
+
+  OutputType EvaluateAtContinuousIndex( const ContinuousIndexType & index ) const
+  {
+    OffsetValueType base = 0;
+    OffsetValueType steps[ImageDimension];
+    double          distances[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const double    x = index[d] - this->m_Start[d];
+      OffsetValueType lower = static_cast<OffsetValueType>( std::floor( x ) );
+      distances[d] = x - lower;
+      steps[d] = this->m_Strides[d];
+      if( lower < 0 )
+        {
+        lower = 0;
+        distances[d] = 0;
+        }
+      if( lower >= this->m_Size[d] - 1 )
+        {
+        lower = this->m_Size[d] - 1;
+        steps[d] = 0;
+        }
+      base += lower * this->m_Strides[d];
+      }
+
+    OutputType output;
+    output.Fill( 0 );
+    for( unsigned int corner = 0; corner < ( 1u << ImageDimension ); corner++ )
+      {
+      double          weight = 1.0;
+      OffsetValueType offset = base;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( corner & ( 1u << d ) )
+          {
+          weight *= distances[d];
+          offset += steps[d];
+          }
+        else
+          {
+          weight *= 1.0 - distances[d];
+          }
+        }
+      if( weight == 0.0 )
+        {
+        continue;
+        }
+      const PixelType & value = this->m_Buffer[offset];
+      for( unsigned int k = 0; k < PixelType::Dimension; k++ )
+        {
+        output[k] += weight * value[k];
+        }
+      }
+    return output;
+  }
+
+private:
+  const PixelType *m_Buffer;
+  OffsetValueType  m_Start[ImageDimension];
+  OffsetValueType  m_Size[ImageDimension];
+  OffsetValueType  m_Strides[ImageDimension];
+};
+
 template <class TImage, class TField, class TInterp, class TInterp2>
-float IntegrateLength( typename TImage::Pointer /* gmsurf */,  typename TImage::Pointer /* thickimage */,
-                       typename TImage::IndexType velind,  typename TField::Pointer lapgrad,  float itime,
+float IntegrateLength( const TImage * /* gmsurf */,  const TImage * /* thickimage */,
+                       typename TImage::IndexType velind,  const TField *lapgrad,  float itime,
                        float starttime, float /* finishtime */,
-                       bool timedone, float deltaTime, typename TInterp::Pointer vinterp,
-                       typename TInterp2::Pointer sinterp, unsigned int /* task */,
+                       bool timedone, float deltaTime, const TInterp *vinterp,
+                       const TInterp2 *sinterp, unsigned int /* task */,
                        bool /* propagate */, bool domeasure,   unsigned int m_NumberOfTimePoints,
                        typename TImage::SpacingType spacing, float vecsign,
-                       float timesign, float gradsign, unsigned int ct, typename TImage::Pointer wm,
-                       typename TImage::Pointer gm,
-                       float priorthickval,  typename TImage::Pointer smooththick, bool printprobability,
-                       typename TImage::Pointer /* sulci */ )
+                       float timesign, float gradsign, unsigned int ct, const TImage *wm,
+                       const TImage *gm,
+                       float priorthickval,  const TImage *smooththick, bool printprobability,
+                       const TImage * /* sulci */ )
 {
   typedef typename TField::PixelType                               VectorType;
   typedef typename TField::PointType                               DPointType;
@@ -608,6 +687,146 @@ float IntegrateLength( typename TImage::Pointer /* gmsurf */,  typename TImage::
   return totalmag;
 }
 
+template <class TImage, class TField, class TSampler, class TInterp2>
+struct LaplacianThicknessThreadStruct
+  {
+  typedef TImage   ImageType;
+  typedef TField   FieldType;
+  typedef TSampler SamplerType;
+  typedef TInterp2 ScalarInterpolatorType;
+
+  typename TImage::Pointer        WM;
+  typename TImage::Pointer        GM;
+  typename TImage::Pointer        GMSurface;
+  typename TImage::Pointer        Thickness;
+  typename TImage::Pointer        Thickness2;
+  typename TImage::Pointer        Sulci;
+  const TImage *                  SmoothThickness;
+  typename TField::Pointer        LaplacianGradient;
+  typename TField::Pointer        LaplacianGradient2;
+  const TSampler *                Sampler;
+  const TSampler *                Sampler2; // 0 without the sulcal prior
+  typename TInterp2::Pointer      ScalarInterpolator;
+  float                           StartTime;
+  float                           FinishTime;
+  float                           TimeSign;
+  double                          DeltaTime;
+  float                           PriorThickness;
+  unsigned int                    NumberOfTimePoints;
+  typename TImage::SpacingType    Spacing;
+  unsigned int                    SmoothIteration;
+  };
+
+/** The thickness of the voxels [begin, end) of the buffer, from the
+ * streamlines through each of them. */
+template <class TThreadStruct, class TImage, class TField, class TSampler, class TInterp2>
+void LaplacianThicknessRange( const TThreadStruct & str, unsigned long begin, unsigned long end, bool verbose )
+{
+  const TImage *wm = str.WM.GetPointer();
+  const TImage *gm = str.GM.GetPointer();
+  const TImage *smooththick = str.SmoothThickness;
+  TImage *      thickimage2 = str.Thickness2.GetPointer();
+  const bool    propagate = false;
+  unsigned long cter = 0;
+  for( unsigned long n = begin; n < end; n++ )
+    {
+    const typename TImage::IndexType velind = thickimage2->ComputeIndex( n );
+    const unsigned int task = 0;
+    float              itime = str.StartTime;
+    unsigned long      ct = 0;
+    bool               timedone = false;
+    double             deltaTime = str.DeltaTime, vecsign = 1.0;
+    bool               domeasure = false;
+    float              gradsign = 1.0;
+    bool               printprobability = false;
+    if( gm->GetPixel(velind) > 0.25 ) // && wmb->GetPixel(velind) < 1 )
+      {
+      cter++;
+      domeasure = true;
+      }
+    gradsign = -1.0; vecsign = -1.0;
+    float len1 = IntegrateLength<TImage, TField, TSampler, TInterp2>
+        (str.GMSurface, str.Thickness, velind, str.LaplacianGradient, itime, str.StartTime, str.FinishTime, timedone,
+        deltaTime, str.Sampler, str.ScalarInterpolator, task, propagate, domeasure, str.NumberOfTimePoints,
+        str.Spacing, vecsign, gradsign, str.TimeSign, ct, wm, gm,
+        str.PriorThickness, smooththick, printprobability,
+        str.Sulci );
+
+    gradsign = 1.0;  vecsign = 1;
+    float len2 = IntegrateLength<TImage, TField, TSampler, TInterp2>
+        (str.GMSurface, str.Thickness, velind, str.LaplacianGradient, itime, str.StartTime, str.FinishTime, timedone,
+        deltaTime, str.Sampler, str.ScalarInterpolator, task, propagate, domeasure, str.NumberOfTimePoints,
+        str.Spacing, vecsign, gradsign, str.TimeSign, ct, wm, gm,
+        str.PriorThickness - len1, smooththick, printprobability,
+        str.Sulci );
+
+    float len3 = 1.e9, len4 = 1.e9;
+    if( str.Sampler2 )
+      {
+      gradsign = -1.0; vecsign = -1.0;
+      len3 = IntegrateLength<TImage, TField, TSampler, TInterp2>
+          (str.GMSurface, str.Thickness, velind, str.LaplacianGradient2, itime, str.StartTime, str.FinishTime,
+          timedone, deltaTime, str.Sampler2, str.ScalarInterpolator, task, propagate, domeasure,
+          str.NumberOfTimePoints, str.Spacing, vecsign, gradsign, str.TimeSign, ct, wm, gm,
+          str.PriorThickness, smooththick, printprobability,
+          str.Sulci );
+
+      gradsign = 1.0;  vecsign = 1;
+      len4 = IntegrateLength<TImage, TField, TSampler, TInterp2>
+          (str.GMSurface, str.Thickness, velind, str.LaplacianGradient2, itime, str.StartTime, str.FinishTime,
+          timedone, deltaTime, str.Sampler2, str.ScalarInterpolator, task, propagate, domeasure,
+          str.NumberOfTimePoints, str.Spacing, vecsign, gradsign, str.TimeSign, ct, wm, gm,
+          str.PriorThickness - len3, smooththick, printprobability,
+          str.Sulci );
+      }
+    float totalength = len1 + len2;
+    if( len3 + len4 < totalength )
+      {
+      totalength = len3 + len4;
+      }
+
+    if( str.SmoothIteration == 0 )
+      {
+      if( thickimage2->GetPixel(velind) == 0  )
+        {
+        thickimage2->SetPixel(velind, totalength);
+        }
+      else if( (totalength) > 0 &&  thickimage2->GetPixel(velind) < (totalength) )
+        {
+        thickimage2->SetPixel(velind, totalength);
+        }
+      }
+    if( str.SmoothIteration > 0 && smooththick )
+      {
+      thickimage2->SetPixel(velind, (totalength) * 0.5 + smooththick->GetPixel(velind) * 0.5 );
+      }
+
+    if( verbose && domeasure && (totalength) > 0 && cter % 10000 == 0 )
+      {
+      std::cout << " len1 " << len1 << " len2 " << len2 << " ind " << velind << std::endl;
+      }
+    }
+}
+
+template <class TThreadStruct>
+ITK_THREAD_RETURN_TYPE LaplacianThicknessThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  const TThreadStruct *                 str = static_cast<const TThreadStruct *>( info->UserData );
+
+  // interleaved blocks of voxels, the gray matter is not evenly spread
+  const unsigned long numberOfVoxels = str->Thickness2->GetBufferedRegion().GetNumberOfPixels();
+  const unsigned long blockSize = 2048;
+  for( unsigned long begin = blockSize * info->ThreadID; begin < numberOfVoxels;
+       begin += blockSize * info->NumberOfThreads )
+    {
+    LaplacianThicknessRange<TThreadStruct, typename TThreadStruct::ImageType, typename TThreadStruct::FieldType,
+                            typename TThreadStruct::SamplerType, typename TThreadStruct::ScalarInterpolatorType>
+      ( *str, begin, std::min( begin + blockSize, numberOfVoxels ), info->ThreadID == 0 );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int LaplacianThickness(int argc, char *argv[])
 {
@@ -760,7 +979,6 @@ int LaplacianThickness(int argc, char *argv[])
   float finishtime = timeone; // s[ImageDimension]-1;//timeone;
   // std::cout << " MUCKING WITH START FINISH TIME " <<  finishtime <<  std::endl;
 
-  typename DisplacementFieldType::IndexType velind;
   typename ImageType::Pointer smooththick = ITK_NULLPTR;
   float timesign = 1.0;
   if( starttime  >  finishtime )
@@ -768,10 +986,6 @@ int LaplacianThickness(int argc, char *argv[])
     timesign = -1.0;
     }
   unsigned int m_NumberOfTimePoints = 2;
-  typedef   DisplacementFieldType                                                        TimeVaryingVelocityFieldType;
-  typedef typename DisplacementFieldType::PointType                                      DPointType;
-  typedef itk::VectorLinearInterpolateImageFunction<TimeVaryingVelocityFieldType, float> DefaultInterpolatorType;
-  typename DefaultInterpolatorType::Pointer vinterp =  DefaultInterpolatorType::New();
   typedef itk::LinearInterpolateImageFunction<ImageType, float> ScalarInterpolatorType;
   typename ScalarInterpolatorType::Pointer sinterp =  ScalarInterpolatorType::New();
   sinterp->SetInputImage(gm);
@@ -779,13 +993,6 @@ int LaplacianThickness(int argc, char *argv[])
     {
     sinterp->SetInputImage(sulci);
     }
-  VectorType zero;
-  zero.Fill(0);
-
-  DPointType pointIn1;
-  DPointType pointIn2;
-  typename DefaultInterpolatorType::ContinuousIndexType  vcontind;
-  DPointType pointIn3;
 
   typedef itk::ImageRegionIteratorWithIndex<DisplacementFieldType> VIteratorType;
   VIteratorType VIterator( lapgrad, lapgrad->GetLargestPossibleRegion().GetSize() );
@@ -822,101 +1029,41 @@ int LaplacianThickness(int argc, char *argv[])
     ++VIterator;
     }
 
-  bool propagate = false;
+  typedef LinearFieldSampler<DisplacementFieldType> SamplerType;
+  SamplerType sampler( lapgrad.GetPointer() );
+  SamplerType sampler2( lapgrad2 ? lapgrad2.GetPointer() : lapgrad.GetPointer() );
+
+  typedef LaplacianThicknessThreadStruct<ImageType, DisplacementFieldType, SamplerType, ScalarInterpolatorType>
+    ThreadStructType;
+  ThreadStructType str;
+  str.WM = wm;
+  str.GM = gm;
+  str.GMSurface = gmsurf;
+  str.Thickness = thickimage;
+  str.Thickness2 = thickimage2;
+  str.Sulci = sulci;
+  str.LaplacianGradient = lapgrad;
+  str.LaplacianGradient2 = lapgrad2;
+  str.Sampler = &sampler;
+  str.Sampler2 = lapgrad2 ? &sampler2 : ITK_NULLPTR;
+  str.ScalarInterpolator = sinterp;
+  str.StartTime = starttime;
+  str.FinishTime = finishtime;
+  str.TimeSign = timesign;
+  str.DeltaTime = dT;
+  str.PriorThickness = priorthickval;
+  str.NumberOfTimePoints = m_NumberOfTimePoints;
+  str.Spacing = spacing;
   for( unsigned int smoothit = 0; smoothit < nsmooth; smoothit++ )
     {
     std::cout << " smoothit " << smoothit << std::endl;
-    Iterator.GoToBegin();
-    unsigned int cter = 0;
-    while(  !Iterator.IsAtEnd()  )
-      {
-      velind = Iterator.GetIndex();
-      //      float thislength=0;
-      for( unsigned int task = 0; task < 1; task++ )
-        {
-        float itime = starttime;
-
-        unsigned long ct = 0;
-        bool          timedone = false;
-
-        VectorType disp;
-        disp.Fill(0.0);
-        double deltaTime = dT, vecsign = 1.0;
-        bool   domeasure = false;
-        float  gradsign = 1.0;
-        bool   printprobability = false;
-//    std::cout << " wmb " << wmb->GetPixel(velind) << " gm " << gm->GetPixel(velind) << std::endl;
-//    if (surf->GetPixel(velind) != 0) printprobability=true;
-        if( gm->GetPixel(velind) > 0.25 ) // && wmb->GetPixel(velind) < 1 )
-          {
-          cter++;
-          domeasure = true;
-          }
-        vinterp->SetInputImage(lapgrad);
-        gradsign = -1.0; vecsign = -1.0;
-        float len1 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-            (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-            sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm, gm,
-            priorthickval, smooththick, printprobability,
-            sulci );
-
-        gradsign = 1.0;  vecsign = 1;
-        float len2 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-            (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-            sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm, gm,
-            priorthickval - len1, smooththick, printprobability,
-            sulci );
-
-        float len3 = 1.e9, len4 = 1.e9;
-        if( lapgrad2 )
-          {
-          vinterp->SetInputImage(lapgrad2);
-          gradsign = -1.0; vecsign = -1.0;
-          len3 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-              (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-              sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm,
-              gm,
-              priorthickval, smooththick, printprobability,
-              sulci );
-
-          gradsign = 1.0;  vecsign = 1;
-          len4 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-              (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-              sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm,
-              gm,
-              priorthickval - len3, smooththick, printprobability,
-              sulci );
-          }
-        float totalength = len1 + len2;
-//    if (totalength > 5 && totalength <  8) std::cout<< " t1 " << len3+len4 << " t2 " << len1+len2 << std::endl;
-        if( len3 + len4 < totalength )
-          {
-          totalength = len3 + len4;
-          }
 
-        if( smoothit == 0 )
-          {
-          if( thickimage2->GetPixel(velind) == 0  )
-            {
-            thickimage2->SetPixel(velind, totalength);
-            }
-          else if( (totalength) > 0 &&  thickimage2->GetPixel(velind) < (totalength) )
-            {
-            thickimage2->SetPixel(velind, totalength);
-            }
-          }
-        if( smoothit > 0 && smooththick )
-          {
-          thickimage2->SetPixel(velind, (totalength) * 0.5 + smooththick->GetPixel(velind) * 0.5 );
-          }
-
-        if( domeasure && (totalength) > 0 && cter % 10000 == 0 )
-          {
-          std::cout << " len1 " << len1 << " len2 " << len2 << " ind " << velind << std::endl;
-          }
-        }
-      ++Iterator;
-      }
+    // the streamlines only read the fields and each writes its own voxel
+    str.SmoothThickness = smooththick.GetPointer();
+    str.SmoothIteration = smoothit;
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetSingleMethod( LaplacianThicknessThreaderCallback<ThreadStructType>, &str );
+    threader->SingleMethodExecute();
 
     smooththick = SmoothImage<ImageType>(thickimage2, 1.0);
 
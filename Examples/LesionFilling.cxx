@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <ostream>
 #include <sstream>
@@ -9,17 +10,120 @@
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkCastImageFilter.h"
-#include "itkSubtractImageFilter.h"
-#include "itkBinaryDilateImageFilter.h"
 #include "itkBinaryBallStructuringElement.h"
-#include "itkMaskImageFilter.h"
 #include "itkConnectedComponentImageFilter.h"
-#include "itkBinaryThresholdImageFilter.h"
+#include "itkImageDuplicator.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageRegionIterator.h"
+#include "itkMultiThreader.h"
+#include "vnl/vnl_random.h"
 //LesionFilling dimension t1.nii.gz lesionmask output.nii.gz
 namespace ants
 {
+  // Each lesion is filled within its bounding box, padded by the radius of
+  // the dilation kernel that gives the voxels surrounding it.  The lesions
+  // are independent, so they are spread over the threads; the surrounding
+  // voxels are read from the input so that no lesion sees another one
+  // half filled.
+  template <class TImage, class TLabelImage>
+  struct LesionFillingThreadStruct
+    {
+    const TImage *                                       Input;
+    TImage *                                             Output;
+    const TLabelImage *                                  Lesions;
+    const std::vector<typename TLabelImage::RegionType> *Regions;
+    const std::vector<typename TLabelImage::OffsetType> *Offsets;
+    };
+
+  template <class TImage, class TLabelImage>
+  void FillLesion( const LesionFillingThreadStruct<TImage, TLabelImage> *str, unsigned int lesion )
+  {
+    typedef itk::ImageRegionConstIteratorWithIndex<TLabelImage> LesionIteratorType;
+    typedef itk::ImageRegionConstIterator<TImage>               ConstIteratorType;
+    typedef itk::ImageRegionIterator<TImage>                    IteratorType;
+
+    const typename TLabelImage::RegionType & region = ( *str->Regions )[lesion - 1];
+    const std::vector<typename TLabelImage::OffsetType> & offsets = *str->Offsets;
+
+    //calculating mean lesion intesity
+    //Note: lesions should not be filled with values
+    //less than their originial values, this is a
+    //trick to exclude any CSF voxels in surronding voxels (if any)
+    int counter  = 0;
+    double meanInsideLesion = 0;
+    LesionIteratorType itL( str->Lesions, region );
+    ConstIteratorType  itT1( str->Input, region );
+    for( itL.GoToBegin(), itT1.GoToBegin(); !itL.IsAtEnd(); ++itL, ++itT1 )
+      {
+      if( itL.Get() == lesion && itT1.Get() != 0 )
+        {
+        //coutning number of voxels inside lesion
+        counter++;
+        meanInsideLesion += itT1.Get();
+        }
+      }
+    if( counter == 0 )
+      {
+      return;
+      }
+    meanInsideLesion /= (double) counter;
+
+    //the voxels surrounding the lesion are those of the dilated lesion
+    //outside the lesion itself; keep those that are more than the mean
+    //intensity of the lesion, i.e. not including CSF voxels
+    std::vector<double> outerWMVoxels;
+    for( itL.GoToBegin(), itT1.GoToBegin(); !itL.IsAtEnd(); ++itL, ++itT1 )
+      {
+      if( itL.Get() == lesion || itT1.Get() < meanInsideLesion )
+        {
+        continue;
+        }
+      const typename TLabelImage::IndexType index = itL.GetIndex();
+      for( unsigned int k = 0; k < offsets.size(); k++ )
+        {
+        const typename TLabelImage::IndexType neighbor = index + offsets[k];
+        if( region.IsInside( neighbor ) && str->Lesions->GetPixel( neighbor ) == lesion )
+          {
+          outerWMVoxels.push_back( itT1.Get() );
+          break;
+          }
+        }
+      }
+    if( outerWMVoxels.empty() )
+      {
+      return;
+      }
+
+    //change inside the lesion with a random pick from
+    //collected normal appearing WM voxels (outerWMVoxels)
+    vnl_random random( 19650218 + lesion );
+    const int max = outerWMVoxels.size();
+    IteratorType itOut( str->Output, region );
+    for( itL.GoToBegin(), itOut.GoToBegin(); !itL.IsAtEnd(); ++itL, ++itOut )
+      {
+      if( itL.Get() == lesion )
+        {
+        itOut.Set( outerWMVoxels[random.lrand32( 0, max - 1 )] );
+        }
+      }
+  }
+
+  template <class TImage, class TLabelImage>
+  ITK_THREAD_RETURN_TYPE LesionFillingThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const LesionFillingThreadStruct<TImage, TLabelImage> *str =
+      static_cast<LesionFillingThreadStruct<TImage, TLabelImage> *>( info->UserData );
+
+    const unsigned int numberOfLesions = str->Regions->size();
+    for( unsigned int lesion = info->ThreadID + 1; lesion <= numberOfLesions; lesion += info->NumberOfThreads )
+      {
+      FillLesion<TImage, TLabelImage>( str, lesion );
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
   template <unsigned int ImageDimension>
   int LesionFilling( int argc, char * argv[] )
   {
@@ -67,19 +171,11 @@ namespace ants
       std::cout << "no T1 image that can be read" << std::endl;
       return 0;
       }
-    typename T1ImageType::Pointer outImage = NULL ;
-    outImage = T1Reader->GetOutput() ;
-    typedef itk::ImageRegionIterator< T1ImageType> IteratorType;
-    typedef itk::BinaryThresholdImageFilter <T1ImageType, T1ImageType>
-                                 BinaryThresholdImageFilterType;
+    typedef itk::Image< unsigned int, ImageDimension> LabelImageType;
     typedef itk::BinaryBallStructuringElement<
                                  double,
                                  ImageDimension> StructuringElementType;
-    typedef itk::BinaryDilateImageFilter<
-                                 T1ImageType,
-                                 T1ImageType,
-                                 StructuringElementType >  DilateFilterType;
-    typedef itk::ConnectedComponentImageFilter <LesionImageType, LesionImageType>
+    typedef itk::ConnectedComponentImageFilter <LesionImageType, LabelImageType>
                 ConnectedComponentFilterType;
     typename ConnectedComponentFilterType::Pointer connected =
                 ConnectedComponentFilterType::New();
@@ -87,114 +183,90 @@ namespace ants
     connected->Update();
     const int LesionNumber = connected->GetObjectCount() ;
     std::cout << "Number of lesions: " << LesionNumber << std::endl;
-    for ( int i = 1;  i < LesionNumber + 1 ; i++)
-    {
-       typedef itk::CastImageFilter< LesionImageType, T1ImageType> FilterType;
-       typename FilterType::Pointer filter = FilterType::New();
-       filter->SetInput( connected->GetOutput() );
-       filter->Update() ;
-       typename BinaryThresholdImageFilterType::Pointer thresholdFilter
-                  = BinaryThresholdImageFilterType::New();
-       thresholdFilter->SetInput(filter->GetOutput());
-       thresholdFilter->SetLowerThreshold( (double) i - 0.1);
-       thresholdFilter->SetUpperThreshold( (double) i + 0.1);
-       thresholdFilter->SetInsideValue  ( 1 );
-       thresholdFilter->SetOutsideValue ( 0 );
-       thresholdFilter->Update() ;
-       //Neighbouring voxel
-       //filling lesions with the voxels surrounding them
-       //first finding the edges of lesions
-       //by subtracting dilated lesion map from lesion map itself
-       typename DilateFilterType::Pointer binaryDilate = DilateFilterType::New();
-  
-       StructuringElementType structuringElement;
-       structuringElement.SetRadius( 1 );  // 3x3 structuring element
-       structuringElement.CreateStructuringElement();
-       binaryDilate->SetKernel( structuringElement );
-       binaryDilate->SetInput( thresholdFilter->GetOutput() );
-       binaryDilate->SetDilateValue( 1 );
-       binaryDilate->Update() ;
-       // subtract dilated image form non-dilated one
-       typedef itk::SubtractImageFilter <T1ImageType, T1ImageType>
-                                    SubtractImageFilterType;
-       typename SubtractImageFilterType::Pointer subtractFilter
-                     = SubtractImageFilterType::New ();
-       //output = image1 - image2
-       subtractFilter->SetInput1( binaryDilate->GetOutput() );
-       subtractFilter->SetInput2( thresholdFilter->GetOutput() );
-       subtractFilter->Update();
-       //multiply the outer lesion mask with T1 to get only the neighbouring voxels
-       typedef itk::MaskImageFilter< T1ImageType, T1ImageType > MaskFilterType;
-       typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
-       maskFilter->SetInput( outImage ) ;
-       maskFilter->SetMaskImage( subtractFilter->GetOutput() );
-       maskFilter->Update() ;
-       typename T1ImageType::Pointer LesionEdge= NULL ;
-       LesionEdge = maskFilter->GetOutput() ;
-       
-       //calculating mean lesion intesity
-       //Note: lesions should not be filled with values
-       //less than their originial values, this is a
-       //trick to exclude any CSF voxels in surronding voxels (if any)
-       typename MaskFilterType::Pointer maskFilterLesion = MaskFilterType::New();
-       maskFilterLesion->SetInput( T1Reader->GetOutput() );
-       //do we need to pass a double lesion
-       maskFilterLesion->SetMaskImage(thresholdFilter->GetOutput() );
-       maskFilterLesion->Update() ;
-       IteratorType it( maskFilterLesion->GetOutput(),
-                         maskFilterLesion->GetOutput()->GetLargestPossibleRegion() );
-       it.GoToBegin();
-       /** Walk over the image. */
-       int counter  = 0;
-       double meanInsideLesion = 0;
-       while ( !it.IsAtEnd() )
-         {
-           if( it.Value() != 0)
-           {
-             //coutning number of voxels inside lesion
-             counter++;
-             meanInsideLesion += it.Get();
-           }
-           ++it;
-         }
-       meanInsideLesion /= (double) counter;
-       
-       //check that all outer voxels are more than the mean 
-       //intensity of the lesion, i.e. not including CSF voxels
-       IteratorType itNoCSF( maskFilter->GetOutput(),
-                         maskFilter->GetOutput()->GetLargestPossibleRegion() );
-       itNoCSF.GoToBegin();
-       std::vector<double> outerWMVoxels;
-       while ( !itNoCSF.IsAtEnd() )
-       {
-         if ( itNoCSF.Get() >= meanInsideLesion )
-         {
-           outerWMVoxels.push_back( itNoCSF.Get() );
-         }//end if
-         ++itNoCSF;
-      }//end while
-      //walk through original T1
-      //and change inside the lesion with a random pick from
-      //collected normal appearing WM voxels (outerWMVoxels)
-      IteratorType it4( outImage, 
-                        outImage->GetLargestPossibleRegion() );
-      IteratorType itL( thresholdFilter->GetOutput(),
-                        thresholdFilter->GetOutput()->GetLargestPossibleRegion() );
-      int max = outerWMVoxels.size();
-      int min = 0;
-      it4.GoToBegin();
-      itL.GoToBegin();
-      while ( !it4.IsAtEnd() )
+    typename LabelImageType::Pointer lesions = connected->GetOutput();
+
+    //the lesions are filled in a copy of the T1, which itself
+    //gives the voxels surrounding each lesion
+    typedef itk::ImageDuplicator<T1ImageType> DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    duplicator->SetInputImage( T1Reader->GetOutput() );
+    duplicator->Update();
+    typename T1ImageType::Pointer outImage = duplicator->GetModifiableOutput();
+
+    //Neighbouring voxel
+    //the edges of a lesion are the voxels added by dilating it
+    //with a 3x3 structuring element
+    StructuringElementType structuringElement;
+    structuringElement.SetRadius( 1 );
+    structuringElement.CreateStructuringElement();
+    std::vector<typename LabelImageType::OffsetType> offsets;
+    for( unsigned int k = 0; k < structuringElement.Size(); k++ )
       {
-        if (itL.Get() == 1)
+      if( structuringElement[k] && k != structuringElement.GetCenterNeighborhoodIndex() )
         {
-          int index = min  + (rand() % (int)(max - min )) ;
-          it4.Set( outerWMVoxels[ index ] );
-        }//end if
-        ++it4;
-        ++itL;
-      }//end while
-    }//end of loop for lesions
+        offsets.push_back( structuringElement.GetOffset( k ) );
+        }
+      }
+
+    //bounding box of each lesion, padded by the radius of the dilation
+    const typename LabelImageType::RegionType largestRegion = lesions->GetLargestPossibleRegion();
+    std::vector<typename LabelImageType::IndexType> lowerBounds( LesionNumber );
+    std::vector<typename LabelImageType::IndexType> upperBounds( LesionNumber );
+    std::vector<bool> found( LesionNumber, false );
+    itk::ImageRegionConstIteratorWithIndex<LabelImageType> itLabel( lesions, largestRegion );
+    for( itLabel.GoToBegin(); !itLabel.IsAtEnd(); ++itLabel )
+      {
+      const unsigned int label = itLabel.Get();
+      if( label == 0 )
+        {
+        continue;
+        }
+      const typename LabelImageType::IndexType index = itLabel.GetIndex();
+      if( !found[label - 1] )
+        {
+        lowerBounds[label - 1] = index;
+        upperBounds[label - 1] = index;
+        found[label - 1] = true;
+        continue;
+        }
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        lowerBounds[label - 1][d] = std::min( lowerBounds[label - 1][d], index[d] );
+        upperBounds[label - 1][d] = std::max( upperBounds[label - 1][d], index[d] );
+        }
+      }
+    std::vector<typename LabelImageType::RegionType> regions( LesionNumber );
+    for( int i = 0; i < LesionNumber; i++ )
+      {
+      if( !found[i] )
+        {
+        continue;
+        }
+      typename LabelImageType::SizeType size;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        size[d] = upperBounds[i][d] - lowerBounds[i][d] + 1;
+        }
+      regions[i].SetIndex( lowerBounds[i] );
+      regions[i].SetSize( size );
+      regions[i].PadByRadius( structuringElement.GetRadius() );
+      regions[i].Crop( largestRegion );
+      }
+
+    LesionFillingThreadStruct<T1ImageType, LabelImageType> str;
+    str.Input = T1Reader->GetOutput();
+    str.Output = outImage;
+    str.Lesions = lesions;
+    str.Regions = &regions;
+    str.Offsets = &offsets;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::ThreadIdType>( LesionNumber ),
+                                                      threader->GetNumberOfThreads() ),
+                                            static_cast<itk::ThreadIdType>( 1 ) ) );
+    threader->SetSingleMethod( LesionFillingThreaderCallback<T1ImageType, LabelImageType>, &str );
+    threader->SingleMethodExecute();
+
   typedef itk::ImageFileWriter< T1ImageType>  WriterType;
   typename WriterType::Pointer writer = WriterType::New();
   writer->SetInput( outImage);
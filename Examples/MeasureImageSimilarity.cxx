@@ -22,74 +22,61 @@
 #include "itkSpatialMutualInformationRegistrationFunction.h"
 #include "itkProbabilisticRegistrationFunction.h"
 #include "itkCrossCorrelationRegistrationFunction.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
 
 namespace ants
 {
-template <unsigned int ImageDimension>
-int MeasureImageSimilarity(unsigned int argc, char *argv[])
+/** Sum over the cross-correlation neighborhood of each voxel of the squared
+ * intensities, which batch mode computes once for the reference image. */
+template <class TImage, class TSumImage>
+typename TSumImage::Pointer ComputeLocalSumOfSquares( const TImage *image, const typename TImage::SizeType & radius )
 {
-  typedef float                                                  PixelType;
-  typedef itk::Vector<float, ImageDimension>                     VectorType;
-  typedef itk::Image<VectorType, ImageDimension>                 FieldType;
-  typedef itk::Image<PixelType, ImageDimension>                  ImageType;
-  typedef itk::ImageFileWriter<ImageType>                        writertype;
-  typedef typename ImageType::IndexType                          IndexType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>           Iterator;
+  typedef itk::ConstNeighborhoodIterator<TImage> ScanIteratorType;
+  typedef typename TImage::IndexType             IndexType;
 
-// get command line params
-  unsigned int argct = 2;
-  unsigned int whichmetric = atoi(argv[argct]); argct++;
-  std::string  fn1 = std::string(argv[argct]); argct++;
-  std::string  fn2 = std::string(argv[argct]); argct++;
-  std::string  logfilename = "";
-  if( argc > argct )
-    {
-    logfilename = std::string(argv[argct]);
-    }
-  argct++;
-  std::string imgfilename = "";
-  if( argc > argct )
-    {
-    imgfilename = std::string(argv[argct]);
-    }
-  argct++;
-  double targetvalue = 0;
-  if( argc > argct )
-    {
-    targetvalue = atof(argv[argct]);
-    }
-  argct++;
-  double epsilontolerance = 1.e20;
-  if( argc > argct )
-    {
-    epsilontolerance = atof(argv[argct]);
-    }
-  argct++;
-
-  typename ImageType::Pointer image1 = ITK_NULLPTR;
-  ReadImage<ImageType>(image1, fn1.c_str() );
-  typename ImageType::Pointer image2 = ITK_NULLPTR;
-  ReadImage<ImageType>(image2, fn2.c_str() );
+  typename TImage::RegionType region = image->GetLargestPossibleRegion();
+  typename TSumImage::Pointer sumImage = AllocImage<TSumImage>( image, 0 );
 
-/*
-  typedef itk::ImageRegionIteratorWithIndex<FieldType> VIterator;
-  typename FieldType::Pointer field=FieldType::New();
-  field->SetLargestPossibleRegion( image1->GetLargestPossibleRegion() );
-  field->SetBufferedRegion( image1->GetLargestPossibleRegion() );
-  field->SetLargestPossibleRegion( image1->GetLargestPossibleRegion() );
-  field->Allocate();
-  field->SetSpacing(image1->GetSpacing());
-  field->SetOrigin(image1->GetOrigin());
-  VectorType zero;
-  zero.Fill(0);
-  VIterator vfIter2( field,  field->GetLargestPossibleRegion() );
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  ScanIteratorType                           asamIt( radius, image, region );
+  itk::ImageRegionIteratorWithIndex<TSumImage> iter( sumImage, region );
+  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
     {
-      IndexType index=vfIter2.GetIndex();
-      vfIter2.Set(zero);
+    double ffip = 0;
+    asamIt.SetLocation( iter.GetIndex() );
+    for( unsigned int i = 0; i < asamIt.Size(); i++ )
+      {
+      IndexType locind = asamIt.GetIndex( i );
+      if( region.IsInside( locind ) )
+        {
+        double f = image->GetPixel( locind );
+        ffip += ( f * f );
+        }
+      }
+    iter.Set( ffip );
     }
-*/
-  typename ImageType::Pointer metricimg = AllocImage<ImageType>(image1, 0);
+  return sumImage;
+}
+
+/** Similarity of image2 to image1.  For the cross-correlation metric
+ * image1SumOfSquares is the output of ComputeLocalSumOfSquares for image1.
+ * metricimg, if not null, receives the voxelwise values of the MSQ and CC
+ * metrics. */
+template <class TImage, class TSumImage>
+double ComputeImageSimilarity( unsigned int whichmetric, TImage *image1, TImage *image2,
+                               const TSumImage *image1SumOfSquares, TImage *metricimg,
+                               std::string & metricname )
+{
+  enum { ImageDimension = TImage::ImageDimension };
+  typedef TImage                                       ImageType;
+  typedef itk::Vector<float, ImageDimension>           VectorType;
+  typedef itk::Image<VectorType, ImageDimension>       FieldType;
+  typedef typename ImageType::IndexType                IndexType;
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
 
   typedef ImageType FixedImageType;
   typedef ImageType MovingImageType;
@@ -100,71 +87,48 @@ int MeasureImageSimilarity(unsigned int argc, char *argv[])
                                                            DisplacementFieldType>  MIMetricType;
   typedef itk::SpatialMutualInformationRegistrationFunction<FixedImageType, MovingImageType,
                                                             DisplacementFieldType> SMIMetricType;
-  typedef itk::CrossCorrelationRegistrationFunction<FixedImageType, MovingImageType,
-                                                    DisplacementFieldType>         CCMetricType;
-  // typedef itk::LandmarkCrossCorrelationRegistrationFunction<FixedImageType,MovingImageType,DisplacementFieldType>
-  // MetricType;
-  // typename
-  typename MIMetricType::Pointer mimet = MIMetricType::New();
-  typename SMIMetricType::Pointer smimet = SMIMetricType::New();
-  typename CCMetricType::Pointer ccmet = CCMetricType::New();
-
-//  int nbins=32;
-
-  typename CCMetricType::RadiusType hradius;
-  typename CCMetricType::RadiusType ccradius;
+
+  typename MIMetricType::RadiusType ccradius;
   ccradius.Fill(4);
   typename MIMetricType::RadiusType miradius;
   miradius.Fill(0);
 
-//  mimet->SetDisplacementField(field);
-  mimet->SetFixedImage(image1);
-  mimet->SetMovingImage(image2);
-  mimet->SetRadius(miradius);
-  mimet->SetGradientStep(1.e2);
-  mimet->SetNormalizeGradient(false);
-
-//  ccmet->SetDisplacementField(field);
-  ccmet->SetFixedImage(image1);
-  ccmet->SetMovingImage(image2);
-  ccmet->SetRadius(ccradius);
-  ccmet->SetGradientStep(1.e2);
-  ccmet->SetNormalizeGradient(false);
-
-  double      metricvalue = 0;
-  std::string metricname = "";
+  const typename ImageType::RegionType region = image1->GetLargestPossibleRegion();
+
+  double metricvalue = 0;
+  metricname = "";
   if( whichmetric  == 0 )
     {
-    hradius = miradius;
     unsigned long ct = 0;
-    Iterator      iter( metricimg,  metricimg->GetLargestPossibleRegion() );
+    Iterator      iter( image1, region );
     for(  iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
       {
       IndexType index = iter.GetIndex();
       double    fval = image1->GetPixel(index);
       double    mval = image2->GetPixel(index);
       metricvalue += fabs(fval - mval);
-      metricimg->SetPixel(index, fabs(fval - mval) );
+      if( metricimg )
+        {
+        metricimg->SetPixel(index, fabs(fval - mval) );
+        }
       ct++;
       }
     metricvalue /= (float)ct;
-    metricname = "MSQ ";
+    metricname = "MSQ";
     }
   else if( whichmetric == 1 ) // imagedifference
     {
     double ccval = 0;
-    hradius = ccradius;
-    metricname = "CC ";
+    metricname = "CC";
     typedef itk::ConstNeighborhoodIterator<FixedImageType> ScanIteratorType;
-    typename FixedImageType::RegionType region = image1->GetLargestPossibleRegion();
-    ScanIteratorType asamIt( hradius, image1, region);
+    ScanIteratorType asamIt( ccradius, image1, region);
     unsigned long    ct = 0;
-    Iterator         iter( metricimg,  metricimg->GetLargestPossibleRegion() );
+    Iterator         iter( image1, region );
     for(  iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
       {
       IndexType index = iter.GetIndex();
       double    val = 0;
-      double    fmip = 0, mmip = 0, ffip = 0;
+      double    fmip = 0, mmip = 0;
       asamIt.SetLocation(index);
       for( unsigned int i = 0; i < asamIt.Size(); i++ )
         {
@@ -173,10 +137,10 @@ int MeasureImageSimilarity(unsigned int argc, char *argv[])
           {
           double f = image1->GetPixel(locind);
           double m = image2->GetPixel(locind);
-          fmip += (f * m);  mmip += (m * m);  ffip += (f * f);
+          fmip += (f * m);  mmip += (m * m);
           }
         }
-      double denom = mmip * ffip;
+      double denom = mmip * image1SumOfSquares->GetPixel(index);
       if( denom == 0 )
         {
         val = 1;
@@ -185,11 +149,10 @@ int MeasureImageSimilarity(unsigned int argc, char *argv[])
         {
         val = fmip / sqrt(denom);
         }
-      metricimg->SetPixel(index, val);
-      // if (ct % 10000 == 0)
-      //        std::cout << val << " index " << index << std::endl;
-      //      asamIt.SetLocation(index);
-      //      totval+=met->localProbabilistic;
+      if( metricimg )
+        {
+        metricimg->SetPixel(index, val);
+        }
       ccval += val;
       ct++;
       }
@@ -201,27 +164,269 @@ int MeasureImageSimilarity(unsigned int argc, char *argv[])
       {
       metricvalue = 0;
       }
-    /*
-    std::cout << metricname << std::endl;
-    ccmet->InitializeIteration();
-    metricimg=ccmet->MakeImage();
-    metricvalue=ccmet->ComputeCrossCorrelation()*(1.0);
-    */
     }
   else if( whichmetric == 2 )
     {
-    hradius = miradius;
+    typename MIMetricType::Pointer mimet = MIMetricType::New();
+    mimet->SetFixedImage(image1);
+    mimet->SetMovingImage(image2);
+    mimet->SetRadius(miradius);
+    mimet->SetGradientStep(1.e2);
+    mimet->SetNormalizeGradient(false);
     mimet->InitializeIteration();
     metricvalue = mimet->ComputeMutualInformation();
-    metricname = "MI ";
+    metricname = "MI";
     }
   else if( whichmetric == 3 )
     {
-    hradius = miradius;
+    typename SMIMetricType::Pointer smimet = SMIMetricType::New();
+    smimet->SetFixedImage(image1);
+    smimet->SetMovingImage(image2);
+    smimet->SetRadius(miradius);
+    smimet->SetGradientStep(1.e2);
+    smimet->SetNormalizeGradient(false);
     smimet->InitializeIteration();
     metricvalue = smimet->ComputeSpatialMutualInformation();
-    metricname = "SMI ";
+    metricname = "SMI";
+    }
+  return metricvalue;
+}
+
+template <class TImage, class TSumImage>
+struct SimilarityBatchThreadStruct
+  {
+  unsigned int                     WhichMetric;
+  typename TImage::Pointer         Reference;
+  typename TSumImage::Pointer      ReferenceSumOfSquares;
+  const std::vector<std::string> * Candidates;
+
+  // one entry per candidate
+  std::vector<double> *            Values;
+  std::vector<char> *              Valid;
+  std::string                      MetricName;
+
+  size_t                           NextCandidate;
+  itk::SimpleFastMutexLock         Mutex;
+  };
+
+/** Reads the candidates, one at a time per thread, and compares each to
+ * the shared reference. */
+template <class TImage, class TSumImage>
+ITK_THREAD_RETURN_TYPE SimilarityBatchThreaderCallback( void *arg )
+{
+  typedef SimilarityBatchThreadStruct<TImage, TSumImage> ThreadStructType;
+
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const size_t n = str->NextCandidate++;
+    str->Mutex.Unlock();
+    if( n >= str->Candidates->size() )
+      {
+      break;
+      }
+
+    try
+      {
+      typename TImage::Pointer candidate = ITK_NULLPTR;
+      if( !ReadImage<TImage>( candidate, ( *str->Candidates )[n].c_str() ) )
+        {
+        continue;
+        }
+      if( candidate->GetLargestPossibleRegion() != str->Reference->GetLargestPossibleRegion() )
+        {
+        std::cerr << ( *str->Candidates )[n] << " does not have the size of the reference image" << std::endl;
+        continue;
+        }
+      std::string metricname;
+      ( *str->Values )[n] = ComputeImageSimilarity<TImage, TSumImage>( str->WhichMetric, str->Reference, candidate,
+                                                                      str->ReferenceSumOfSquares, ITK_NULLPTR,
+                                                                      metricname );
+      ( *str->Valid )[n] = 1;
+
+      str->Mutex.Lock();
+      str->MetricName = metricname;
+      str->Mutex.Unlock();
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      std::cerr << "Exception caught comparing " << ( *str->Candidates )[n] << std::endl;
+      std::cerr << e << std::endl;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Compare one reference image to every image listed (one file name per
+ * line) in candidateList on all threads, and write the values to a CSV
+ * file.  The reference is read once and its statistics for the CC metric
+ * are computed once. */
+template <unsigned int ImageDimension>
+int MeasureImageSimilarityBatch( unsigned int whichmetric, const std::string & referenceFileName,
+                                 const std::string & candidateList, const std::string & csvFileName,
+                                 unsigned int numberOfThreads )
+{
+  typedef itk::Image<float, ImageDimension>  ImageType;
+  typedef itk::Image<double, ImageDimension> SumImageType;
+  typedef SimilarityBatchThreadStruct<ImageType, SumImageType> ThreadStructType;
+
+  std::vector<std::string> candidates;
+  std::ifstream            listFile( candidateList.c_str() );
+  if( !listFile.good() )
+    {
+    std::cerr << "Could not open the candidate list " << candidateList << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::string line;
+  while( std::getline( listFile, line ) )
+    {
+    const std::string::size_type first = line.find_first_not_of( " \t\r" );
+    if( first == std::string::npos )
+      {
+      continue;
+      }
+    const std::string::size_type last = line.find_last_not_of( " \t\r" );
+    candidates.push_back( line.substr( first, last - first + 1 ) );
+    }
+  listFile.close();
+
+  ThreadStructType str;
+  str.WhichMetric = whichmetric;
+  if( !ReadImage<ImageType>( str.Reference, referenceFileName.c_str() ) )
+    {
+    return EXIT_FAILURE;
+    }
+  if( whichmetric == 1 )
+    {
+    typename ImageType::SizeType ccradius;
+    ccradius.Fill( 4 );
+    str.ReferenceSumOfSquares = ComputeLocalSumOfSquares<ImageType, SumImageType>( str.Reference, ccradius );
+    }
+
+  std::vector<double> values( candidates.size(), 0.0 );
+  std::vector<char>   valid( candidates.size(), 0 );
+  str.Candidates = &candidates;
+  str.Values = &values;
+  str.Valid = &valid;
+  str.NextCandidate = 0;
+
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( candidates.size() ) );
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+  numberOfThreads = std::max( numberOfThreads, 1u );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( SimilarityBatchThreaderCallback<ImageType, SumImageType>, &str );
+  threader->SingleMethodExecute();
+
+  std::ofstream csvFile( csvFileName.c_str() );
+  if( !csvFile.good() )
+    {
+    std::cerr << "Could not open " << csvFileName << std::endl;
+    return EXIT_FAILURE;
+    }
+  csvFile.precision( 10 );
+  csvFile << "reference,candidate,metric,value" << std::endl;
+
+  int status = EXIT_SUCCESS;
+  for( size_t n = 0; n < candidates.size(); n++ )
+    {
+    csvFile << referenceFileName << "," << candidates[n] << "," << str.MetricName << ",";
+    if( valid[n] )
+      {
+      csvFile << values[n];
+      std::cout << referenceFileName << " : " << candidates[n] << " => " << str.MetricName << " " << values[n]
+                << std::endl;
+      }
+    else
+      {
+      status = EXIT_FAILURE;
+      }
+    csvFile << std::endl;
+    }
+  csvFile.close();
+
+  return status;
+}
+
+template <unsigned int ImageDimension>
+int MeasureImageSimilarity(unsigned int argc, char *argv[])
+{
+  typedef float                                                  PixelType;
+  typedef itk::Image<PixelType, ImageDimension>                  ImageType;
+  typedef itk::Image<double, ImageDimension>                     SumImageType;
+  typedef itk::ImageFileWriter<ImageType>                        writertype;
+
+// get command line params
+  unsigned int argct = 2;
+  unsigned int whichmetric = atoi(argv[argct]); argct++;
+  std::string  fn1 = std::string(argv[argct]); argct++;
+  std::string  fn2 = std::string(argv[argct]); argct++;
+  if( fn2 == std::string( "--batch" ) )
+    {
+    if( argc < argct + 2 )
+      {
+      std::cerr << "--batch needs a candidate list and an output csv file" << std::endl;
+      return EXIT_FAILURE;
+      }
+    const std::string  candidateList = std::string(argv[argct]); argct++;
+    const std::string  csvFileName = std::string(argv[argct]); argct++;
+    const unsigned int numberOfThreads = ( argc > argct ) ? atoi(argv[argct]) : 0;
+    return MeasureImageSimilarityBatch<ImageDimension>( whichmetric, fn1, candidateList, csvFileName,
+                                                        numberOfThreads );
+    }
+  std::string  logfilename = "";
+  if( argc > argct )
+    {
+    logfilename = std::string(argv[argct]);
+    }
+  argct++;
+  std::string imgfilename = "";
+  if( argc > argct )
+    {
+    imgfilename = std::string(argv[argct]);
+    }
+  argct++;
+  double targetvalue = 0;
+  if( argc > argct )
+    {
+    targetvalue = atof(argv[argct]);
     }
+  argct++;
+  double epsilontolerance = 1.e20;
+  if( argc > argct )
+    {
+    epsilontolerance = atof(argv[argct]);
+    }
+  argct++;
+
+  typename ImageType::Pointer image1 = ITK_NULLPTR;
+  ReadImage<ImageType>(image1, fn1.c_str() );
+  typename ImageType::Pointer image2 = ITK_NULLPTR;
+  ReadImage<ImageType>(image2, fn2.c_str() );
+
+  typename ImageType::Pointer metricimg = AllocImage<ImageType>(image1, 0);
+
+  typename SumImageType::Pointer image1SumOfSquares = ITK_NULLPTR;
+  if( whichmetric == 1 )
+    {
+    typename ImageType::SizeType ccradius;
+    ccradius.Fill(4);
+    image1SumOfSquares = ComputeLocalSumOfSquares<ImageType, SumImageType>( image1, ccradius );
+    }
+
+  std::string  metricname = "";
+  const double metricvalue = ComputeImageSimilarity<ImageType, SumImageType>( whichmetric, image1, image2,
+                                                                              image1SumOfSquares, metricimg,
+                                                                              metricname );
+  metricname += " ";
   std::cout << fn1 << " : " << fn2 << " => " <<  metricname << metricvalue << std::endl;
   if( logfilename.length() > 3 )
     {
@@ -245,31 +450,6 @@ int MeasureImageSimilarity(unsigned int argc, char *argv[])
     w->SetInput(metricimg);
     w->SetFileName(imgfilename.c_str() );
     w->Write(); //  met->WriteImages();
-
-/*
-  typename MetricType::NeighborhoodType   asamIt( hradius, field,field->GetLargestPossibleRegion());
-  unsigned long ct = 0;
-  double totval = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-      IndexType index=vfIter2.GetIndex();
-      double val=0;
-      asamIt.SetLocation(index);
-      //      met->ComputeUpdate( asamIt,  gd);
-      met->ComputeMetricAtPairB(index,  zero);
-      metricimg->SetPixel(index, val);
-      //if (ct % 10000 == 0)
-      //        std::cout << val << " index " << index << std::endl;
-      //      asamIt.SetLocation(index);
-      //      totval+=met->localProbabilistic;
-      ct++;
-    }
-
-  std::cout << " AvantsMI : " << totval/(double)ct << " E " <<  met->GetEnergy() <<  std::endl;
-  std::cout << " write begin " << std::endl;
-
-  std::cout << " write end " << std::endl;
-*/
     }
 
   double diff = ( (double)metricvalue - (double) targetvalue);
@@ -348,6 +528,13 @@ private:
         << std::endl;
       std::cout << "  Metric 0 - MeanSquareDifference, 1 - Cross-Correlation, 2-Mutual Information , 3-SMI "
                << std::endl;
+      std::cout << " Batch mode: " << std::endl;
+      std::cout << argv[0]
+               << " ImageDimension whichmetric reference.ext --batch candidateList.txt results.csv {numberOfThreads}"
+               << std::endl;
+      std::cout << "  compares the reference to each image listed (one per line) in candidateList.txt on all"
+               << std::endl;
+      std::cout << "  threads and writes reference,candidate,metric,value rows to results.csv " << std::endl;
       if( argc >= 2 &&
           ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
         {
@@ -15,9 +15,95 @@
 #include <algorithm>
 
 #include "ReadWriteData.h"
+#include "antsLabelIntensityStatistics.h"
 
 namespace ants
 {
+/** The statistics of a scalar image, from a single threaded pass of
+ * ComputeLabelIntensityStatistics over the voxels of the mask. */
+template <unsigned int ImageDimension>
+int MeasureMinMaxMeanScalar(int argc, char *argv[])
+{
+  typedef float                                     RealType;
+  typedef itk::Image<RealType, ImageDimension>      ImageType;
+  typedef itk::Image<unsigned char, ImageDimension> MaskImageType;
+  typedef itk::Vector<float, 1>                     PixelType;
+
+  typename ImageType::Pointer image = ITK_NULLPTR;
+  ReadImage<ImageType>(image, argv[2]);
+  bool takeabsval = false;
+  if( argc > 4 )
+    {
+    takeabsval = atoi(argv[4]);
+    }
+  if( takeabsval )
+    {
+    RealType *buffer = image->GetBufferPointer();
+    const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+    for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      buffer[n] = fabs(buffer[n]);
+      }
+    }
+
+  // the voxels inside the mask are those where it is at least 0.5 in magnitude
+  typename MaskImageType::Pointer maskImage = ITK_NULLPTR;
+  if( argc > 5 )
+    {
+    typename ImageType::Pointer mask = ITK_NULLPTR;
+    ReadImage<ImageType>(mask, argv[5]);
+    maskImage = AllocImage<MaskImageType>( mask, 0 );
+
+    const RealType *         maskBuffer = mask->GetBufferPointer();
+    unsigned char *          insideBuffer = maskImage->GetBufferPointer();
+    const itk::SizeValueType numberOfPixels = mask->GetBufferedRegion().GetNumberOfPixels();
+    for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      insideBuffer[n] = ( fabs(maskBuffer[n]) < 0.5 ) ? 0 : 1;
+      }
+    }
+
+  typedef LabelIntensityStatisticsThreadStruct<MaskImageType, ImageType> ThreadStructType;
+  typename ThreadStructType::MapType statistics;
+  ComputeLabelIntensityStatistics<MaskImageType, ImageType>( maskImage.GetPointer(), image.GetPointer(), true, 0,
+                                                             statistics );
+
+  LabelIntensityStatistics inside;
+  if( !statistics.empty() )
+    {
+    inside = statistics.begin()->second;
+    }
+  PixelType mean;  mean.Fill(0);
+  PixelType max;   max.Fill(0);
+  PixelType min;   min.Fill(0);
+  if( inside.m_Count > 0 )
+    {
+    mean[0] = inside.GetMean();
+    max[0] = inside.m_Maximum;
+    min[0] = inside.m_Minimum;
+    }
+
+  std::cout <<  argv[2] << " Max : " << max << " Min : " << min << " Mean : " << mean
+           << " Var : " <<  static_cast<float>( inside.GetCentralMoment( 2 ) )
+           << " SD : " << static_cast<float>( inside.GetSigma() ) << std::endl;
+
+  if( argc > 3 )
+    {
+    std::ofstream logfile;
+    logfile.open(argv[3], std::ofstream::app);
+    if( logfile.good() )
+      {
+      logfile << argv[2] <<  " Max : " << max << " Min : " << min << " Mean : " << mean << std::endl;
+      }
+    else
+      {
+      std::cout << " cant open file " << argv[3] << std::endl;
+      }
+    logfile.close();
+    }
+  return EXIT_SUCCESS;
+}
+
 template <unsigned int ImageDimension, unsigned int NVectorComponents>
 int MeasureMinMaxMean(int argc, char *argv[])
 {
@@ -213,7 +299,7 @@ private:
           break;
         default:
           {
-          returnValue = MeasureMinMaxMean<2, 1>(argc, argv);
+          returnValue = MeasureMinMaxMeanScalar<2>(argc, argv);
           }
           break;
         }
@@ -240,7 +326,7 @@ private:
           break;
         default:
           {
-          returnValue = MeasureMinMaxMean<3, 1>(argc, argv);
+          returnValue = MeasureMinMaxMeanScalar<3>(argc, argv);
           }
           break;
         }
@@ -277,7 +363,7 @@ private:
           break;
         default:
           {
-          returnValue = MeasureMinMaxMean<4, 1>(argc, argv);
+          returnValue = MeasureMinMaxMeanScalar<4>(argc, argv);
           }
           break;
         }
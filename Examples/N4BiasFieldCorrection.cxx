@@ -69,6 +69,118 @@ public:
   }
 };
 
+/**
+ * Evaluate a log bias field control point lattice over the domain of the
+ * reference image.  The lattice spans the whole domain, so lattices saved
+ * from a previous run can be evaluated on any image covering the same
+ * anatomy.
+ */
+template <class TCorrecter, class TImage>
+typename TImage::Pointer
+ReconstructLogBiasField( const typename TCorrecter::BiasFieldControlPointLatticeType *lattice,
+                         unsigned int splineOrder, const TImage *referenceImage,
+                         const typename TImage::PointType & origin )
+{
+  ANTS_PROFILE_SCOPE( "N4::ReconstructLogBiasField" );
+
+  typedef itk::BSplineControlPointImageFilter<typename
+                                              TCorrecter::BiasFieldControlPointLatticeType, typename
+                                              TCorrecter::ScalarImageType> BSplinerType;
+  typename BSplinerType::Pointer bspliner = BSplinerType::New();
+  bspliner->SetInput( lattice );
+  bspliner->SetSplineOrder( splineOrder );
+  bspliner->SetSize( referenceImage->GetLargestPossibleRegion().GetSize() );
+  bspliner->SetOrigin( origin );
+  bspliner->SetDirection( referenceImage->GetDirection() );
+  bspliner->SetSpacing( referenceImage->GetSpacing() );
+  bspliner->Update();
+
+  typename TImage::Pointer logField = AllocImage<TImage>( referenceImage );
+
+  itk::ImageRegionIterator<typename TCorrecter::ScalarImageType> ItB(
+    bspliner->GetOutput(),
+    bspliner->GetOutput()->GetLargestPossibleRegion() );
+  itk::ImageRegionIterator<TImage> ItF( logField,
+                                        logField->GetLargestPossibleRegion() );
+  for( ItB.GoToBegin(), ItF.GoToBegin(); !ItB.IsAtEnd(); ++ItB, ++ItF )
+    {
+    ItF.Set( ItB.Get()[0] );
+    }
+  return logField;
+}
+
+/**
+ * Add two log bias field lattices.  The coarser lattice is refined to the
+ * resolution of the other one first, which requires the number of spans of
+ * the two to differ by a power of two in each dimension.  Returns a null
+ * pointer if the lattices cannot be combined.
+ */
+template <class TCorrecter>
+typename TCorrecter::BiasFieldControlPointLatticeType::Pointer
+AddLogBiasFieldLattices( const typename TCorrecter::BiasFieldControlPointLatticeType *lattice1,
+                         const typename TCorrecter::BiasFieldControlPointLatticeType *lattice2,
+                         unsigned int splineOrder )
+{
+  typedef typename TCorrecter::BiasFieldControlPointLatticeType LatticeType;
+  typedef itk::BSplineControlPointImageFilter<LatticeType, typename TCorrecter::ScalarImageType> BSplinerType;
+
+  const unsigned int ImageDimension = LatticeType::ImageDimension;
+
+  typename LatticeType::ConstPointer coarse = lattice1;
+  typename LatticeType::ConstPointer fine = lattice2;
+  if( lattice1->GetLargestPossibleRegion().GetSize()[0] > lattice2->GetLargestPossibleRegion().GetSize()[0] )
+    {
+    coarse = lattice2;
+    fine = lattice1;
+    }
+
+  typename BSplinerType::ArrayType numberOfRefinementLevels;
+  bool needsRefinement = false;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    unsigned int coarseSpans = coarse->GetLargestPossibleRegion().GetSize()[d] - splineOrder;
+    const unsigned int fineSpans = fine->GetLargestPossibleRegion().GetSize()[d] - splineOrder;
+
+    numberOfRefinementLevels[d] = 1;
+    while( coarseSpans < fineSpans )
+      {
+      coarseSpans *= 2;
+      numberOfRefinementLevels[d]++;
+      }
+    if( coarseSpans != fineSpans )
+      {
+      return ITK_NULLPTR;
+      }
+    if( numberOfRefinementLevels[d] > 1 )
+      {
+      needsRefinement = true;
+      }
+    }
+
+  if( needsRefinement )
+    {
+    typename BSplinerType::Pointer bspliner = BSplinerType::New();
+    bspliner->SetInput( coarse );
+    bspliner->SetSplineOrder( splineOrder );
+    bspliner->SetSize( fine->GetLargestPossibleRegion().GetSize() );
+    bspliner->SetOrigin( fine->GetOrigin() );
+    bspliner->SetSpacing( fine->GetSpacing() );
+    bspliner->SetDirection( fine->GetDirection() );
+    coarse = bspliner->RefineControlPointLattice( numberOfRefinementLevels );
+    }
+
+  typename LatticeType::Pointer sum = AllocImage<LatticeType>( fine.GetPointer() );
+
+  itk::ImageRegionConstIterator<LatticeType> ItC( coarse, coarse->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator<LatticeType> ItF( fine, fine->GetLargestPossibleRegion() );
+  itk::ImageRegionIterator<LatticeType> ItS( sum, sum->GetLargestPossibleRegion() );
+  for( ItC.GoToBegin(), ItF.GoToBegin(), ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItC, ++ItF, ++ItS )
+    {
+    ItS.Set( ItC.Get() + ItF.Get() );
+    }
+  return sum;
+}
+
 template <unsigned int ImageDimension>
 int N4( itk::ants::CommandLineParser *parser )
 {
@@ -313,9 +425,130 @@ int N4( itk::ants::CommandLineParser *parser )
       }
     }
 
+  /**
+   * warm start from a previously estimated bias field.  The input is corrected with
+   * the initial field before fitting, so N4 only estimates the residual field.
+   */
+  typedef typename CorrecterType::BiasFieldControlPointLatticeType LatticeType;
+  typename LatticeType::Pointer initialLattice = ITK_NULLPTR;
+  typename ImageType::Pointer initialLogField = ITK_NULLPTR;
+  typename ImageType::Pointer fittingImage = inputImage;
+
+  typename itk::ants::CommandLineParser::OptionType::Pointer initialLatticeOption =
+    parser->GetOption( "initial-bias-field-lattice" );
+  if( initialLatticeOption && initialLatticeOption->GetNumberOfFunctions() )
+    {
+    std::string latticeFile = initialLatticeOption->GetFunction( 0 )->GetName();
+    bool skipCoarserLevels = true;
+    if( initialLatticeOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      latticeFile = initialLatticeOption->GetFunction( 0 )->GetParameter( 0 );
+      }
+    if( initialLatticeOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+      {
+      skipCoarserLevels = parser->Convert<bool>( initialLatticeOption->GetFunction( 0 )->GetParameter( 1 ) );
+      }
+    if( !ReadImage<LatticeType>( initialLattice, latticeFile.c_str() ) || initialLattice.IsNull() )
+      {
+      if( verbose )
+        {
+        std::cerr << "Initial bias field lattice " << latticeFile << " could not be read." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+
+    const unsigned int splineOrder = correcter->GetSplineOrder();
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( initialLattice->GetLargestPossibleRegion().GetSize()[d] <= splineOrder )
+        {
+        if( verbose )
+          {
+          std::cerr << "The initial bias field lattice is too small for a spline order of "
+                    << splineOrder << "." << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      }
+
+    initialLogField = ReconstructLogBiasField<CorrecterType, ImageType>( initialLattice,
+      splineOrder, inputImage, newOrigin );
+
+    typedef itk::ExpImageFilter<ImageType, ImageType> ExpFilterType;
+    typename ExpFilterType::Pointer expFilter = ExpFilterType::New();
+    expFilter->SetInput( initialLogField );
+
+    typedef itk::DivideImageFilter<ImageType, ImageType, ImageType> DividerType;
+    typename DividerType::Pointer divider = DividerType::New();
+    divider->SetInput1( inputImage );
+    divider->SetInput2( expFilter->GetOutput() );
+    divider->Update();
+
+    fittingImage = divider->GetOutput();
+    fittingImage->DisconnectPipeline();
+
+    // The initial field already accounts for the levels with a coarser mesh than
+    // the initial lattice.  If the lattice matches one of the fitting levels, start
+    // at that level.
+    if( skipCoarserLevels )
+      {
+      const typename CorrecterType::ArrayType numberOfControlPoints = correcter->GetNumberOfControlPoints();
+      const typename CorrecterType::ArrayType numberOfFittingLevels = correcter->GetNumberOfFittingLevels();
+      const typename CorrecterType::VariableSizeArrayType maximumNumberOfIterations =
+        correcter->GetMaximumNumberOfIterations();
+
+      const unsigned int numberOfLevels = maximumNumberOfIterations.Size();
+
+      int matchingLevel = -1;
+      for( unsigned int level = 0; level < numberOfLevels; level++ )
+        {
+        bool isMatch = true;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          const unsigned int levelSpans = ( numberOfControlPoints[d] - splineOrder ) << level;
+          if( numberOfFittingLevels[d] != numberOfLevels ||
+              initialLattice->GetLargestPossibleRegion().GetSize()[d] - splineOrder != levelSpans )
+            {
+            isMatch = false;
+            break;
+            }
+          }
+        if( isMatch )
+          {
+          matchingLevel = static_cast<int>( level );
+          break;
+          }
+        }
+
+      if( matchingLevel > 0 )
+        {
+        typename CorrecterType::ArrayType skippedNumberOfControlPoints;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          skippedNumberOfControlPoints[d] = initialLattice->GetLargestPossibleRegion().GetSize()[d];
+          }
+        typename CorrecterType::VariableSizeArrayType
+          skippedMaximumNumberOfIterations( numberOfLevels - matchingLevel );
+        for( unsigned int level = matchingLevel; level < numberOfLevels; level++ )
+          {
+          skippedMaximumNumberOfIterations[level - matchingLevel] = maximumNumberOfIterations[level];
+          }
+        correcter->SetNumberOfControlPoints( skippedNumberOfControlPoints );
+        correcter->SetMaximumNumberOfIterations( skippedMaximumNumberOfIterations );
+        correcter->SetNumberOfFittingLevels( numberOfLevels - matchingLevel );
+
+        if( verbose )
+          {
+          std::cout << "Initial bias field lattice matches fitting level " << matchingLevel + 1
+                    << ".  Skipping the " << matchingLevel << " coarser level(s)." << std::endl << std::endl;
+          }
+        }
+      }
+    }
+
   typedef itk::ShrinkImageFilter<ImageType, ImageType> ShrinkerType;
   typename ShrinkerType::Pointer shrinker = ShrinkerType::New();
-  shrinker->SetInput( inputImage );
+  shrinker->SetInput( fittingImage );
   shrinker->SetShrinkFactors( 1 );
 
   typedef itk::ShrinkImageFilter<MaskImageType, MaskImageType> MaskShrinkerType;
@@ -391,6 +624,7 @@ int N4( itk::ants::CommandLineParser *parser )
   try
     {
     // correcter->DebugOn();
+    ANTS_PROFILE_SCOPE( "N4::BiasFieldFit" );
     correcter->Update();
     }
   catch( itk::ExceptionObject & e )
@@ -425,28 +659,19 @@ int N4( itk::ants::CommandLineParser *parser )
                     * the original input image by the bias field to get the final
                     * corrected image.
                     */
-    typedef itk::BSplineControlPointImageFilter<typename
-                                                CorrecterType::BiasFieldControlPointLatticeType, typename
-                                                CorrecterType::ScalarImageType> BSplinerType;
-    typename BSplinerType::Pointer bspliner = BSplinerType::New();
-    bspliner->SetInput( correcter->GetLogBiasFieldControlPointLattice() );
-    bspliner->SetSplineOrder( correcter->GetSplineOrder() );
-    bspliner->SetSize( inputImage->GetLargestPossibleRegion().GetSize() );
-    bspliner->SetOrigin( newOrigin );
-    bspliner->SetDirection( inputImage->GetDirection() );
-    bspliner->SetSpacing( inputImage->GetSpacing() );
-    bspliner->Update();
-
-    typename ImageType::Pointer logField = AllocImage<ImageType>( inputImage );
+    typename ImageType::Pointer logField = ReconstructLogBiasField<CorrecterType, ImageType>(
+      correcter->GetLogBiasFieldControlPointLattice(), correcter->GetSplineOrder(), inputImage, newOrigin );
 
-    itk::ImageRegionIterator<typename CorrecterType::ScalarImageType> ItB(
-      bspliner->GetOutput(),
-      bspliner->GetOutput()->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<ImageType> ItF( logField,
-                                             logField->GetLargestPossibleRegion() );
-    for( ItB.GoToBegin(), ItF.GoToBegin(); !ItB.IsAtEnd(); ++ItB, ++ItF )
+    if( initialLogField )
       {
-      ItF.Set( ItB.Get()[0] );
+      itk::ImageRegionConstIterator<ImageType> ItI( initialLogField,
+                                                    initialLogField->GetLargestPossibleRegion() );
+      itk::ImageRegionIterator<ImageType> ItF( logField,
+                                               logField->GetLargestPossibleRegion() );
+      for( ItI.GoToBegin(), ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItI, ++ItF )
+        {
+        ItF.Set( ItF.Get() + ItI.Get() );
+        }
       }
 
     typedef itk::ExpImageFilter<ImageType, ImageType> ExpFilterType;
@@ -562,6 +787,26 @@ int N4( itk::ants::CommandLineParser *parser )
         {
         WriteImage<ImageType>( biasFieldCropper->GetOutput(),  ( outputOption->GetFunction( 0 )->GetParameter( 1 ) ).c_str() );
         }
+      if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
+        {
+        // the lattice is defined over the padded domain, so it is written as is
+        typename LatticeType::Pointer lattice = correcter->GetLogBiasFieldControlPointLattice();
+        if( initialLattice )
+          {
+          lattice = AddLogBiasFieldLattices<CorrecterType>( initialLattice,
+            correcter->GetLogBiasFieldControlPointLattice(), correcter->GetSplineOrder() );
+          if( lattice.IsNull() )
+            {
+            if( verbose )
+              {
+              std::cerr << "The initial and estimated bias field lattices cannot be combined "
+                        << "(their numbers of spans do not differ by a power of two)." << std::endl;
+              }
+            return EXIT_FAILURE;
+            }
+          }
+        WriteImage<LatticeType>( lattice,  ( outputOption->GetFunction( 0 )->GetParameter( 2 ) ).c_str() );
+        }
       }
     }
 
@@ -739,7 +984,27 @@ void N4InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   option->SetLongName( "output" );
   option->SetShortName( 'o' );
   option->SetUsageOption( 0, "correctedImage" );
-  option->SetUsageOption( 1, "[correctedImage,<biasField>]" );
+  option->SetUsageOption( 1, "[correctedImage,<biasField>,<biasFieldLattice>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Warm start from the B-spline control point lattice of a log bias " )
+    + std::string( "field saved by a previous run (third parameter of the output " )
+    + std::string( "option), e.g. for another echo or time point of the same subject. " )
+    + std::string( "The input is corrected by this field before fitting and N4 " )
+    + std::string( "estimates the residual field.  If the lattice resolution matches " )
+    + std::string( "one of the fitting levels, the coarser levels are skipped unless " )
+    + std::string( "skipCoarserLevels is set to 0.  The written bias field and lattice " )
+    + std::string( "include the initial field." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "initial-bias-field-lattice" );
+  option->SetShortName( 'l' );
+  option->SetUsageOption( 0, "biasFieldLattice" );
+  option->SetUsageOption( 1, "[biasFieldLattice,<skipCoarserLevels=1>]" );
   option->SetDescription( description );
   parser->AddOption( option );
   }
@@ -5,7 +5,8 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 
 #include <string>
 #include <vector>
@@ -29,7 +30,7 @@ int PasteImageIntoImage( unsigned int argc, char *argv[] )
 
   typename ReaderType::Pointer reader2 = ReaderType::New();
   reader2->SetFileName( argv[3] );
-  reader2->Update();
+  reader2->UpdateOutputInformation();
 
   PixelType backgroundValue = 0;
   if( argc > 6 )
@@ -47,32 +48,44 @@ int PasteImageIntoImage( unsigned int argc, char *argv[] )
     conflictLabel = static_cast<PixelType>( atof( argv[8] ) );
     }
 
-  itk::ImageRegionIteratorWithIndex<ImageType> It(
-    reader2->GetOutput(), reader2->GetOutput()->GetLargestPossibleRegion() );
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+  // only the part of the paint image landing on the canvas is read, and it
+  // is walked in step with the canvas instead of looking up every index
+  typename ImageType::RegionType canvasRegion = reader2->GetOutput()->GetLargestPossibleRegion();
+  typename ImageType::IndexType  canvasIndex = canvasRegion.GetIndex();
+  for( unsigned int d = 0; d < ImageDimension; d++ )
     {
-    typename ImageType::IndexType index = It.GetIndex();
-    PixelType paintValue = It.Get();
+    canvasIndex[d] += startIndex[d];
+    }
+  canvasRegion.SetIndex( canvasIndex );
+
+  if( canvasRegion.Crop( reader1->GetOutput()->GetLargestPossibleRegion() ) )
+    {
+    typename ImageType::RegionType paintRegion = canvasRegion;
+    typename ImageType::IndexType  paintIndex = canvasRegion.GetIndex();
     for( unsigned int d = 0; d < ImageDimension; d++ )
       {
-      index[d] += startIndex[d];
+      paintIndex[d] -= startIndex[d];
       }
-    if( paintValue != backgroundValue )
+    paintRegion.SetIndex( paintIndex );
+
+    reader2->GetOutput()->SetRequestedRegion( paintRegion );
+    reader2->Update();
+
+    itk::ImageRegionConstIterator<ImageType> ItP( reader2->GetOutput(), paintRegion );
+    itk::ImageRegionIterator<ImageType>      ItC( reader1->GetOutput(), canvasRegion );
+    for( ItP.GoToBegin(), ItC.GoToBegin(); !ItP.IsAtEnd(); ++ItP, ++ItC )
       {
-      if( reader1->GetOutput()->GetLargestPossibleRegion().IsInside( index ) )
+      const PixelType paintValue = ItP.Get();
+      if( paintValue != backgroundValue )
         {
-        PixelType canvasValue = reader1->GetOutput()->GetPixel( index );
+        const PixelType canvasValue = ItC.Get();
         if( canvasValue == backgroundValue || writeOver == 1 )
           {
-          reader1->GetOutput()->SetPixel( index, paintValue );
-          }
-        else if( canvasValue != backgroundValue && writeOver == 0 )
-          {
-          continue;
+          ItC.Set( paintValue );
           }
-        else
+        else if( writeOver != 0 )
           {
-          reader1->GetOutput()->SetPixel( index, conflictLabel );
+          ItC.Set( conflictLabel );
           }
         }
       }
@@ -24,6 +24,7 @@
 #include "itkFlipImageFilter.h"
 
 #include "ReadWriteData.h"
+#include "antsPermuteFlip.h"
 
 namespace ants
 {
@@ -39,12 +40,6 @@ int PermuteFlipImageOrientationAxes( int argc, char * argv[] )
   typename InputImageType::Pointer inputImage = ITK_NULLPTR;
   ReadImage<InputImageType>(inputImage, argv[1]);
 
-  // Create a filter
-  typedef OutputImageType ShortImage;
-  typename itk::PermuteAxesImageFilter<ShortImage>::Pointer permute;
-  permute = itk::PermuteAxesImageFilter<ShortImage>::New();
-  permute->SetInput( inputImage );
-
   unsigned int upperFactors[Dimension];
   unsigned int lowerFactors[Dimension];
   for( unsigned int q = 0; q < Dimension; ++q )
@@ -53,78 +48,51 @@ int PermuteFlipImageOrientationAxes( int argc, char * argv[] )
     lowerFactors[q] = 0;
     }
 
+  // the permutation of each axis, then the flip of each axis, then FlipAboutOrigin
   bool flipaboutorigin = false;
-  if( Dimension == 2 )
+  for( unsigned int q = 0; q < Dimension; ++q )
     {
-    if( argc > 3 )
-      {
-      upperFactors[0] = atoi(argv[3]);
-      }
-    if( argc > 4 )
+    if( argc > static_cast<int>( 3 + q ) )
       {
-      upperFactors[1] = atoi(argv[4]);
+      upperFactors[q] = atoi(argv[3 + q]);
       }
-    if( argc > 5 )
+    if( argc > static_cast<int>( 3 + Dimension + q ) )
       {
-      lowerFactors[0] = atoi(argv[5]);
-      }
-    if( argc > 6 )
-      {
-      lowerFactors[1] = atoi(argv[6]);
-      }
-    if( argc > 7 )
-      {
-      flipaboutorigin = atoi(argv[7]);
+      lowerFactors[q] = atoi(argv[3 + Dimension + q]);
       }
     }
-  else if( Dimension == 3 )
+  if( argc > static_cast<int>( 3 + 2 * Dimension ) )
     {
-    if( argc > 3 )
-      {
-      upperFactors[0] = atoi(argv[3]);
-      }
-    if( argc >  4 )
-      {
-      upperFactors[1] = atoi(argv[4]);
-      }
-    if( argc > 5 )
-      {
-      upperFactors[2] = atoi(argv[5]);
-      }
-    if( argc > 6 )
-      {
-      lowerFactors[0] = atoi(argv[6]);
-      }
-    if( argc > 7 )
-      {
-      lowerFactors[1] = atoi(argv[7]);
-      }
-    if( argc > 8  )
-      {
-      lowerFactors[2] = atoi(argv[8]);
-      }
-    if( argc > 9 )
-      {
-      flipaboutorigin = atoi(argv[9]);
-      }
+    flipaboutorigin = atoi(argv[3 + 2 * Dimension]);
     }
 
+  // The filters only give the output information (and check the order); the
+  // voxels are permuted and flipped in one blocked pass.
+  typedef OutputImageType ShortImage;
+  typename itk::PermuteAxesImageFilter<ShortImage>::Pointer permute;
+  permute = itk::PermuteAxesImageFilter<ShortImage>::New();
+  permute->SetInput( inputImage );
   permute->SetOrder( upperFactors );
-  permute->Update();
 
   typedef itk::FlipImageFilter<ShortImage> FlipType;
   typename FlipType::FlipAxesArrayType flip;
+  bool                                 flipAxes[Dimension];
   for( unsigned int i = 0; i < Dimension; i++ )
     {
     flip[i] = lowerFactors[i];
+    flipAxes[i] = ( lowerFactors[i] != 0 );
     }
   typename FlipType::Pointer flipper = FlipType::New();
   flipper->SetFlipAboutOrigin(flipaboutorigin);
   flipper->SetFlipAxes(flip);
   flipper->SetInput( permute->GetOutput() );
-  flipper->Update();
+  flipper->UpdateOutputInformation();
+
+  const ShortImage *reoriented = flipper->GetOutput();
+  typename OutputImageType::Pointer image = AllocImage<OutputImageType>( reoriented->GetLargestPossibleRegion(),
+    reoriented->GetSpacing(), reoriented->GetOrigin(), reoriented->GetDirection() );
+  PermuteFlip::Apply( inputImage.GetPointer(), upperFactors, flipAxes, image.GetPointer() );
 
-  typename InputImageType::Pointer image = flipper->GetOutput();
   WriteImage<OutputImageType>(image, argv[2]);
 
   return EXIT_SUCCESS;
@@ -181,7 +149,7 @@ private:
     std::cout << "Usage: " << std::endl;
     std::cout << argv[0]
              <<
-      " ImageDimension  inputImageFile  outputImageFile xperm yperm {zperm}  xflip yflip {zflip}  {FlipAboutOrigin}"
+      " ImageDimension  inputImageFile  outputImageFile xperm yperm {zperm} {tperm}  xflip yflip {zflip} {tflip}  {FlipAboutOrigin}"
              << std::endl;
     std::cout << " for 3D:  " << argv[0]
              << " 3  in.nii out.nii   2 0 1  1 1 1  \n would map z=>x, x=>y, y=>z and flip each " << std::endl;
@@ -214,6 +182,11 @@ private:
       return PermuteFlipImageOrientationAxes<3>(argc - 1, argv + 1);
       }
       break;
+    case 4:
+      {
+      return PermuteFlipImageOrientationAxes<4>(argc - 1, argv + 1);
+      }
+      break;
     default:
       std::cout << "Unsupported dimension" << std::endl;
       return EXIT_FAILURE;
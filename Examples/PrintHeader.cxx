@@ -121,12 +121,12 @@ int PrintHeader(int argc, char *argv[])
     throw;
     }
   reader->SetFileName(argv[1]);
-  reader->Update();
 
-  // Print only specific header information
+  // Print only specific header information, which only needs the header
 
   if( argc > 2 )
     {
+    reader->UpdateOutputInformation();
     switch( atoi( argv[2] ) )
       {
       case 0:
@@ -188,7 +188,9 @@ int PrintHeader(int argc, char *argv[])
     return EXIT_SUCCESS;
     }
 
-  // else print out entire header information
+  // else print out entire header information, with the intensity range
+
+  reader->Update();
 
   std::cout << " Spacing " << reader->GetOutput()->GetSpacing() << std::endl;
   std::cout << " Origin " << reader->GetOutput()->GetOrigin() << std::endl;
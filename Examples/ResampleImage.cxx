@@ -12,11 +12,8 @@
 
 #include "itkConstantBoundaryCondition.h"
 #include "itkIdentityTransform.h"
-#include "itkBSplineInterpolateImageFunction.h"
-#include "itkLinearInterpolateImageFunction.h"
 #include "itkGaussianInterpolateImageFunction.h"
-#include "itkNearestNeighborInterpolateImageFunction.h"
-#include "itkWindowedSincInterpolateImageFunction.h"
+#include "antsScanlineResampling.h"
 #include "ReadWriteData.h"
 #include <string>
 #include <vector>
@@ -38,52 +35,12 @@ int ResampleImage( int argc, char *argv[] )
   typename TransformType::Pointer transform = TransformType::New();
   transform->SetIdentity();
 
-  typedef itk::LinearInterpolateImageFunction<ImageType, RealType>
-    LinearInterpolatorType;
-  typename LinearInterpolatorType::Pointer interpolator
-    = LinearInterpolatorType::New();
-  interpolator->SetInputImage( image );
-
-  typedef itk::NearestNeighborInterpolateImageFunction<ImageType, RealType>
-    NearestNeighborInterpolatorType;
-  typename NearestNeighborInterpolatorType::Pointer nn_interpolator
-    = NearestNeighborInterpolatorType::New();
-  nn_interpolator->SetInputImage( image );
-
-  typedef itk::BSplineInterpolateImageFunction<ImageType, RealType>
-    BSplineInterpolatorType;
-  typename BSplineInterpolatorType::Pointer bs_interpolator
-    = BSplineInterpolatorType::New();
-  bs_interpolator->SetInputImage( image );
-
   typedef itk::GaussianInterpolateImageFunction<ImageType, RealType>
     GaussianInterpolatorType;
   typename GaussianInterpolatorType::Pointer g_interpolator
     = GaussianInterpolatorType::New();
   g_interpolator->SetInputImage( image );
 
-  typedef itk::WindowedSincInterpolateImageFunction<ImageType, 3> HammingInterpolatorType;
-  typename HammingInterpolatorType::Pointer sh_interpolator = HammingInterpolatorType::New();
-  sh_interpolator->SetInputImage( image );
-
-  typedef itk::WindowedSincInterpolateImageFunction<ImageType, 3,
-                                                    itk::Function::CosineWindowFunction<3> > Sinc1InterpolatorType;
-  typename Sinc1InterpolatorType::Pointer sc_interpolator = Sinc1InterpolatorType::New();
-  sc_interpolator->SetInputImage( image );
-
-  typedef itk::WindowedSincInterpolateImageFunction<ImageType, 3,
-                                                    itk::Function::WelchWindowFunction<3> > Sinc2InterpolatorType;
-  typename Sinc2InterpolatorType::Pointer sw_interpolator = Sinc2InterpolatorType::New();
-  sw_interpolator->SetInputImage( image );
-
-  typedef itk::WindowedSincInterpolateImageFunction<ImageType, 3,
-                                                    itk::Function::LanczosWindowFunction<3> > Sinc3InterpolatorType;
-  typename Sinc3InterpolatorType::Pointer sl_interpolator = Sinc3InterpolatorType::New();
-  sl_interpolator->SetInputImage( image );
-
-  typename Sinc3InterpolatorType::Pointer sb_interpolator = Sinc3InterpolatorType::New();
-  sb_interpolator->SetInputImage( image );
-
   typedef itk::ResampleImageFilter<ImageType, ImageType, RealType> ResamplerType;
   typename ResamplerType::Pointer resampler = ResamplerType::New();
   typename ResamplerType::SpacingType spacing;
@@ -155,20 +112,23 @@ typename ImageType::IndexType newStartIndex;
     arg7 = *argv[7];
     }
 
-  resampler->SetTransform( transform );
-  resampler->SetInterpolator( interpolator );
+  // all but the gaussian interpolation go through the scanline resampler
+  typedef ants::ScanlineResampling ScanlineResamplingType;
+  ScanlineResamplingType::InterpolationType interpolation = ScanlineResamplingType::Linear;
+  unsigned int                              parameter = 0;
+  bool                                      useGaussian = false;
   if( argc > 6 && atoi( argv[6] ) )
     {
     switch( atoi( argv[6] ) )
       {
       case 0: default:
         {
-        resampler->SetInterpolator( interpolator );
+        interpolation = ScanlineResamplingType::Linear;
         }
         break;
       case 1:
         {
-        resampler->SetInterpolator( nn_interpolator );
+        interpolation = ScanlineResamplingType::NearestNeighbor;
         }
         break;
       case 2:
@@ -194,64 +154,85 @@ typename ImageType::IndexType newStartIndex;
           }
         g_interpolator->SetParameters( sigma, alpha );
 
-        resampler->SetInterpolator( g_interpolator );
+        useGaussian = true;
         }
         break;
       case 3:
         {
+        interpolation = ScanlineResamplingType::WindowedSinc;
         switch( arg7 )
           {
           case 'h': default:
             {
-            resampler->SetInterpolator( sh_interpolator );
+            parameter = ScanlineResamplingType::Hamming;
             }
             break;
           case 'c':
             {
-            resampler->SetInterpolator( sc_interpolator );
+            parameter = ScanlineResamplingType::Cosine;
             }
             break;
           case 'l':
             {
-            resampler->SetInterpolator( sl_interpolator );
+            parameter = ScanlineResamplingType::Lanczos;
             }
             break;
           case 'w':
             {
-            resampler->SetInterpolator( sw_interpolator );
+            parameter = ScanlineResamplingType::Welch;
             }
             break;
           case 'b':
             {
-            resampler->SetInterpolator( sb_interpolator );
+            parameter = ScanlineResamplingType::Blackman;
             }
             break;
           }
         }
+        break;
       case 4:
         {
+        interpolation = ScanlineResamplingType::BSpline;
         if( argc > 7 && atoi( argv[7] ) >= 0 && atoi( argv[7] ) <= 5 )
           {
-          bs_interpolator->SetSplineOrder( atoi( argv[7] ) );
+          parameter = atoi( argv[7] );
           }
         else
           {
-          bs_interpolator->SetSplineOrder( 3 );
+          parameter = 3;
           }
-        resampler->SetInterpolator( bs_interpolator );
         }
         break;
       }
     }
-  resampler->SetInput( image );
-  resampler->SetSize( size );
-  resampler->SetOutputOrigin( image->GetOrigin() );
-  resampler->SetOutputDirection( image->GetDirection() );
-  resampler->SetOutputSpacing( spacing );
+
+  typename ImageType::Pointer outimage = ITK_NULLPTR;
+  if( useGaussian )
+    {
+    resampler->SetTransform( transform );
+    resampler->SetInterpolator( g_interpolator );
+    resampler->SetInput( image );
+    resampler->SetSize( size );
+    resampler->SetOutputOrigin( image->GetOrigin() );
+    resampler->SetOutputDirection( image->GetDirection() );
+    resampler->SetOutputSpacing( spacing );
 //  resampler->SetOutputStartIndex( newStartIndex );
-  resampler->SetDefaultPixelValue( 0 );
-  resampler->Update();
-  typename ImageType::Pointer outimage = resampler->GetOutput();
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->Update();
+    outimage = resampler->GetOutput();
+    }
+  else
+    {
+    typename ImageType::RegionType region;
+    region.SetSize( size );
+    outimage = ImageType::New();
+    outimage->SetRegions( region );
+    outimage->SetOrigin( image->GetOrigin() );
+    outimage->SetDirection( image->GetDirection() );
+    outimage->SetSpacing( spacing );
+    outimage->Allocate();
+    ScanlineResamplingType::Resample( image.GetPointer(), outimage.GetPointer(), interpolation, parameter, 0.0 );
+    }
 //  typename ImageType::RegionType region = outimage->GetLargestPossibleRegion();
 //  region.SetIndex( newStartIndex );
 //  outimage->SetLargestPossibleRegion( region );
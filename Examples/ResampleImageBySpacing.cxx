@@ -15,16 +15,39 @@
 #include <algorithm>
 #include "itkImage.h"
 #include "ReadWriteData.h"
-#include "itkResampleImageFilter.h"
-#include "itkIdentityTransform.h"
-#include "itkLinearInterpolateImageFunction.h"
-#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "antsScanlineResampling.h"
 #include "itkRecursiveGaussianImageFilter.h"
 #include "itkIntensityWindowingImageFilter.h"
 #include "itkDiscreteGaussianImageFilter.h"
 
 namespace ants
 {
+/** The input resampled through the identity onto the grid of reference,
+ * with the given spacing and size, by linear or nearest neighbor
+ * interpolation. */
+template <class TInputImage, class TOutputImage>
+typename TOutputImage::Pointer
+ResampleToSpacing( const TInputImage *input, const TInputImage *reference,
+                   const typename TOutputImage::SpacingType & spacing,
+                   const typename TOutputImage::SizeType & size, bool nn, double defaultValue )
+{
+  typename TOutputImage::RegionType region;
+  region.SetIndex( reference->GetLargestPossibleRegion().GetIndex() );
+  region.SetSize( size );
+
+  typename TOutputImage::Pointer output = TOutputImage::New();
+  output->SetRegions( region );
+  output->SetOrigin( reference->GetOrigin() );
+  output->SetDirection( reference->GetDirection() );
+  output->SetSpacing( spacing );
+  output->Allocate();
+
+  ScanlineResampling::Resample( input, output.GetPointer(),
+                                nn ? ScanlineResampling::NearestNeighbor : ScanlineResampling::Linear,
+                                0, defaultValue );
+  return output;
+}
+
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
 // 'main()'
 int ResampleImageBySpacing( std::vector<std::string> args, std::ostream* /*out_stream = NULL */ )
@@ -126,7 +149,7 @@ private:
     bool nn = false;
     if( argc > 8 )
       {
-      nn = atoi(argv[7]);
+      nn = atoi(argv[8]);
       }
 
     std::cout <<  " spacing2 " << spacing << std::endl;
@@ -168,37 +191,10 @@ private:
     // InternalImageType::ConstPointer smoothedImage = reader->GetOutput();
     // smoothedImage =SmoothImage<ImageType>(reader->GetOutput() , );
 
-    typedef itk::ResampleImageFilter<
-        InternalImageType, OutputImageType>  ResampleFilterType;
-
-    ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-
-    typedef itk::IdentityTransform<double, 2> TransformType;
-
-    typedef itk::LinearInterpolateImageFunction<
-        InternalImageType, double>  InterpolatorType;
-    typedef itk::NearestNeighborInterpolateImageFunction<
-        InternalImageType, double>  InterpolatorType2;
-
-    InterpolatorType::Pointer  interpolator = InterpolatorType::New();
-    InterpolatorType2::Pointer interpolator2 = InterpolatorType2::New();
-
-    resampler->SetInterpolator( interpolator );
-    if( nn == 1 )
-      {
-      resampler->SetInterpolator( interpolator2 );
-      }
-
     InternalImageType::IndexType ind;
     ind.Fill(1);
-    resampler->SetDefaultPixelValue( inputImage->GetPixel(ind) ); // zero regions without source
-
-    // Use the inputImage as initial template
-    resampler->SetOutputParametersFromImage( inputImage );
-    // Reset spacing by explicit specification
+    // the grid of the inputImage with the new spacing
     std::cout << " out space " << spacing << std::endl;
-    resampler->SetOutputSpacing( spacing );
-
     InputImageType::SizeType inputSize = inputImage->GetLargestPossibleRegion().GetSize();
     typedef InputImageType::SizeType::SizeValueType SizeValueType;
     InputImageType::SizeType size;
@@ -206,15 +202,12 @@ private:
       {
       size[i] = static_cast<SizeValueType>(inputSize[i] * inputSpacing[i] / spacing[i] + addvox);
       }
-
     std::cout << " output size " << size << " spc " << spacing << std::endl;
-    resampler->SetSize( size );
-    resampler->SetInput( smoothedImage );
-    TransformType::Pointer transform = TransformType::New();
-    transform->SetIdentity();
-    resampler->SetTransform( transform );
-    resampler->Update();
-    WriteImage<OutputImageType>( resampler->GetOutput(), argv[3] );
+    // zero regions without source
+    OutputImageType::Pointer output =
+      ResampleToSpacing<InternalImageType, OutputImageType>( smoothedImage, inputImage, spacing, size, nn,
+                                                             inputImage->GetPixel(ind) );
+    WriteImage<OutputImageType>( output, argv[3] );
     }
 
   if( Dimension == 3 )
@@ -306,37 +299,10 @@ private:
     // InternalImageType::ConstPointer smoothedImage = reader->GetOutput();
     // smoothedImage =SmoothImage<ImageType>(reader->GetOutput() , );
 
-    typedef itk::ResampleImageFilter<
-        InternalImageType, OutputImageType>  ResampleFilterType;
-
-    ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-
-    typedef itk::IdentityTransform<double, 3> TransformType;
-
-    typedef itk::LinearInterpolateImageFunction<
-        InternalImageType, double>  InterpolatorType;
-    typedef itk::NearestNeighborInterpolateImageFunction<
-        InternalImageType, double>  InterpolatorType2;
-
-    InterpolatorType::Pointer  interpolator = InterpolatorType::New();
-    InterpolatorType2::Pointer interpolator2 = InterpolatorType2::New();
-
-    resampler->SetInterpolator( interpolator );
-    if( nn == 1 )
-      {
-      resampler->SetInterpolator( interpolator2 );
-      }
-
     InternalImageType::IndexType ind;
     ind.Fill(1);
-    resampler->SetDefaultPixelValue( inputImage->GetPixel(ind) ); // zero regions without source
-
-    // Use the inputImage as initial template
-    resampler->SetOutputParametersFromImage( inputImage );
-    // Reset spacing by explicit specification
+    // the grid of the inputImage with the new spacing
     std::cout << " out space " << spacing << std::endl;
-    resampler->SetOutputSpacing( spacing );
-
     InputImageType::SizeType inputSize = inputImage->GetLargestPossibleRegion().GetSize();
     typedef InputImageType::SizeType::SizeValueType SizeValueType;
     InputImageType::SizeType size;
@@ -344,15 +310,12 @@ private:
       {
       size[i] = static_cast<SizeValueType>(inputSize[i] * inputSpacing[i] / spacing[i] + addvox);
       }
-
     std::cout << " output size " << size << " spc " << spacing << std::endl;
-    resampler->SetSize( size );
-    resampler->SetInput( smoothedImage );
-    TransformType::Pointer transform = TransformType::New();
-    transform->SetIdentity();
-    resampler->SetTransform( transform );
-    resampler->Update();
-    WriteImage<OutputImageType>( resampler->GetOutput(), argv[3] );
+    // zero regions without source
+    OutputImageType::Pointer output =
+      ResampleToSpacing<InternalImageType, OutputImageType>( smoothedImage, inputImage, spacing, size, nn,
+                                                             inputImage->GetPixel(ind) );
+    WriteImage<OutputImageType>( output, argv[3] );
    }
 /*ADDING 4-dimensional images */
 if( Dimension == 4 )
@@ -399,7 +362,7 @@ if( argc > 9 )
 addvox = atoi(argv[9]);
 }
 bool nn = false;
-if( argc > 9 )
+if( argc > 10 )
 {
 nn = atoi(argv[10]);
 }
@@ -437,29 +400,10 @@ smoothedImage = smootherX->GetOutput();
 // InternalImageType::ConstPointer smoothedImage = smootherY->GetOutput();
 // InternalImageType::ConstPointer smoothedImage = reader->GetOutput();
 // smoothedImage =SmoothImage<ImageType>(reader->GetOutput() , );
-typedef itk::ResampleImageFilter<
-InternalImageType, OutputImageType> ResampleFilterType;
-ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-typedef itk::IdentityTransform<double, 4> TransformType;
-typedef itk::LinearInterpolateImageFunction<
-InternalImageType, double> InterpolatorType;
-typedef itk::NearestNeighborInterpolateImageFunction<
-InternalImageType, double> InterpolatorType2;
-InterpolatorType::Pointer interpolator = InterpolatorType::New();
-InterpolatorType2::Pointer interpolator2 = InterpolatorType2::New();
-resampler->SetInterpolator( interpolator );
-if( nn == 1 )
-{
-resampler->SetInterpolator( interpolator2 );
-}
 InternalImageType::IndexType ind;
 ind.Fill(1);
-resampler->SetDefaultPixelValue( inputImage->GetPixel(ind) ); // zero regions without source
-// Use the inputImage as initial template
-resampler->SetOutputParametersFromImage( inputImage );
-// Reset spacing by explicit specification
+// the grid of the inputImage with the new spacing
 std::cout << " out space " << spacing << std::endl;
-resampler->SetOutputSpacing( spacing );
 InputImageType::SizeType inputSize = inputImage->GetLargestPossibleRegion().GetSize();
 typedef InputImageType::SizeType::SizeValueType SizeValueType;
 InputImageType::SizeType size;
@@ -468,13 +412,11 @@ for( int i = 0; i < 4; i++ )
 size[i] = static_cast<SizeValueType>(inputSize[i] * inputSpacing[i] / spacing[i] + addvox);
 }
 std::cout << " output size " << size << " spc " << spacing << std::endl;
-resampler->SetSize( size );
-resampler->SetInput( smoothedImage );
-TransformType::Pointer transform = TransformType::New();
-transform->SetIdentity();
-resampler->SetTransform( transform );
-resampler->Update();
-WriteImage<OutputImageType>( resampler->GetOutput(), argv[3] );
+// zero regions without source
+OutputImageType::Pointer output =
+  ResampleToSpacing<InternalImageType, OutputImageType>( smoothedImage, inputImage, spacing, size, nn,
+                                                         inputImage->GetPixel(ind) );
+WriteImage<OutputImageType>( output, argv[3] );
 }
 
   return EXIT_SUCCESS;
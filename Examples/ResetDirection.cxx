@@ -22,6 +22,7 @@
 #include "itkImage.h"
 #include "itkImageFileWriter.h"
 #include "itkImageFileReader.h"
+#include "antsNiftiHeaderUpdate.h"
 #include "itkCastImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 
@@ -50,12 +51,23 @@ int ResetDirection(int argc, char *argv[])
 
   typename readertype::Pointer reader = readertype::New();
   reader->SetFileName(argv[1]);
-  reader->Update();
+  reader->UpdateOutputInformation();
 
   typename OutImageType::Pointer outim = reader->GetOutput();
   typename OutImageType::DirectionType direction = outim->GetDirection();
   direction.SetIdentity();
 
+  // only the header changes, so rewrite just the header of NIfTI files
+  typename ImageType::Pointer headerImage = ImageType::New();
+  headerImage->CopyInformation( outim );
+  headerImage->SetDirection( direction );
+  if( UpdateNiftiHeaderGeometry<ImageType>( argv[1], argv[2], headerImage ) )
+    {
+    return EXIT_SUCCESS;
+    }
+
+  reader->Update();
+
   typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
   typename ImageType::Pointer varimage = AllocImage<ImageType>(outim);
   varimage->SetDirection( direction );
@@ -22,6 +22,7 @@
 #include "itkImage.h"
 #include "itkImageFileWriter.h"
 #include "itkImageFileReader.h"
+#include "antsNiftiHeaderUpdate.h"
 #include "itkCastImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 
@@ -39,7 +40,7 @@ int SetOrigin(int argc, char *argv[])
 
   typename readertype::Pointer reader = readertype::New();
   reader->SetFileName(argv[1]);
-  reader->Update();
+  reader->UpdateOutputInformation();
 
   typename OutImageType::Pointer outim = reader->GetOutput();
   typename OutImageType::PointType orig = outim->GetOrigin();
@@ -59,6 +60,16 @@ int SetOrigin(int argc, char *argv[])
     }
   std::cout << "  New Orig " << orig << std::endl;
 
+  // only the header changes, so rewrite just the header of NIfTI files
+  typename ImageType::Pointer headerImage = ImageType::New();
+  headerImage->CopyInformation( outim );
+  headerImage->SetOrigin( orig );
+  if( UpdateNiftiHeaderGeometry<ImageType>( argv[1], argv[2], headerImage ) )
+    {
+    return EXIT_SUCCESS;
+    }
+
+  reader->Update();
   outim->SetOrigin(orig);
 
   typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
@@ -29,6 +29,7 @@
 #include "itkImage.h"
 #include "itkImageFileWriter.h"
 #include "itkImageFileReader.h"
+#include "antsNiftiHeaderUpdate.h"
 #include "itkCastImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 
@@ -46,7 +47,7 @@ int SetSpacing(int argc, char *argv[])
 
   typename readertype::Pointer reader = readertype::New();
   reader->SetFileName(argv[1]);
-  reader->Update();
+  reader->UpdateOutputInformation();
 
   typename OutImageType::Pointer outim = reader->GetOutput();
   typename OutImageType::SpacingType spacing = outim->GetSpacing();
@@ -66,6 +67,17 @@ int SetSpacing(int argc, char *argv[])
     }
   std::cout << "  New Spacing " << spacing << std::endl;
 
+  // only the header changes, so rewrite just the header of NIfTI files
+  typename ImageType::Pointer headerImage = ImageType::New();
+  headerImage->CopyInformation( outim );
+  headerImage->SetSpacing( spacing );
+  if( UpdateNiftiHeaderGeometry<ImageType>( argv[1], argv[2], headerImage ) )
+    {
+    return EXIT_SUCCESS;
+    }
+
+  reader->Update();
+
   typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
   typename ImageType::Pointer varimage = AllocImage<ImageType>(outim);
   varimage->SetSpacing(spacing);
@@ -15,15 +15,14 @@
 #include "antsUtilities.h"
 #include <algorithm>
 #include "ReadWriteData.h"
+#include "antsSeparableGaussianSmoothing.h"
 
 #include "itkDisplacementFieldToBSplineImageFilter.h"
-#include "itkGaussianOperator.h"
 #include "itkImage.h"
 #include "itkImageDuplicator.h"
 #include "itkTimeProbe.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
-#include "itkVectorNeighborhoodOperatorImageFilter.h"
 
 namespace ants
 {
@@ -49,40 +48,20 @@ int SmoothDisplacementField( int argc, char *argv[] )
     {
     float variance = var[0];
 
-    typedef itk::GaussianOperator<float, ImageDimension>                                             GaussianSmoothingOperatorType;
-    typedef itk::VectorNeighborhoodOperatorImageFilter<DisplacementFieldType, DisplacementFieldType> GaussianSmoothingSmootherType;
-
-    GaussianSmoothingOperatorType gaussianSmoothingOperator;
-
     typedef itk::ImageDuplicator<DisplacementFieldType> DuplicatorType;
     typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
     duplicator->SetInputImage( field );
     duplicator->Update();
 
-    smoothField = duplicator->GetOutput();
+    smoothField = duplicator->GetModifiableOutput();
 
     itk::TimeProbe timer;
     timer.Start();
-    typename GaussianSmoothingSmootherType::Pointer smoother = GaussianSmoothingSmootherType::New();
 
-    for( unsigned int dimension = 0; dimension < ImageDimension; ++dimension )
-      {
-      // smooth along this dimension
-      gaussianSmoothingOperator.SetDirection( dimension );
-      gaussianSmoothingOperator.SetVariance( variance );
-      gaussianSmoothingOperator.SetMaximumError( 0.001 );
-      gaussianSmoothingOperator.SetMaximumKernelWidth( smoothField->GetRequestedRegion().GetSize()[dimension] );
-      gaussianSmoothingOperator.CreateDirectional();
-
-      // todo: make sure we only smooth within the buffered region
-      smoother->SetOperator( gaussianSmoothingOperator );
-      smoother->SetInput( smoothField );
-      smoother->Update();
-
-      smoothField = smoother->GetOutput();
-      smoothField->Update();
-      smoothField->DisconnectPipeline();
-      }
+    // all the components at once, along each dimension in turn
+    itk::FixedArray<double, ImageDimension> varianceArray;
+    varianceArray.Fill( variance );
+    SeparableGaussianSmoothing::Smooth<DisplacementFieldType>( smoothField, varianceArray, 0.001 );
 
     const VectorType zeroVector( 0.0 );
 
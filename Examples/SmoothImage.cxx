@@ -15,9 +15,10 @@
 #include "antsUtilities.h"
 #include <algorithm>
 
+#include "itkImageDuplicator.h"
 #include "itkMedianImageFilter.h"
-#include "itkDiscreteGaussianImageFilter.h"
 #include "ReadWriteData.h"
+#include "antsSeparableGaussianSmoothing.h"
 
 namespace ants
 {
@@ -33,9 +34,7 @@ int SmoothImage(int argc, char *argv[])
   typename ImageType::Pointer varimage = ITK_NULLPTR;
   ReadImage<ImageType>(image1, argv[2]);
 
-  typedef itk::DiscreteGaussianImageFilter<ImageType, ImageType> dgf;
   typedef itk::MedianImageFilter<ImageType, ImageType>           medf;
-  typename dgf::Pointer filter = dgf::New();
   typename medf::Pointer filter2 = medf::New();
   bool usespacing = false;
   if( argc  >  5 )
@@ -47,38 +46,47 @@ int SmoothImage(int argc, char *argv[])
     {
     usemedian = atoi(argv[6]);
     }
-  if( !usespacing )
-    {
-    filter->SetUseImageSpacingOff();
-    }
-  else
-    {
-    filter->SetUseImageSpacingOn();
-    }
 
   if( !usemedian )
     {
+    // smoothed in place, so an in-memory input (see ReadImage), which
+    // belongs to the caller, is copied first
+    if( std::string( argv[2] ).substr( 0, 2 ) == std::string( "0x" ) )
+      {
+      typedef itk::ImageDuplicator<ImageType> DuplicatorType;
+      typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+      duplicator->SetInputImage( image1 );
+      duplicator->Update();
+      image1 = duplicator->GetModifiableOutput();
+      }
+
+    itk::FixedArray<double, ImageDimension> varianceArray;
     if( sigmaVector.size() == 1 )
       {
-      filter->SetVariance( vnl_math_sqr( sigmaVector[0] ) );
+      varianceArray.Fill( vnl_math_sqr( sigmaVector[0] ) );
       }
     else if( sigmaVector.size() == ImageDimension )
       {
-      typename dgf::ArrayType varianceArray;
       for( unsigned int d = 0; d < ImageDimension; d++ )
         {
         varianceArray[d] = vnl_math_sqr( sigmaVector[d] );
         }
-      filter->SetVariance( varianceArray );
       }
     else
       {
       std::cerr << "Incorrect sigma vector size.  Must either be of size 1 or ImageDimension." << std::endl;
+      varianceArray.Fill( 0.0 );
+      }
+    // the variance is in voxels unless sigma is in spacing coordinates
+    if( usespacing )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        varianceArray[d] /= vnl_math_sqr( image1->GetSpacing()[d] );
+        }
       }
-    filter->SetMaximumError( 0.01f );
-    filter->SetInput( image1 );
-    filter->Update();
-    varimage = filter->GetOutput();
+    SeparableGaussianSmoothing::Smooth<ImageType>( image1, varianceArray, 0.01 );
+    varimage = image1;
     }
   else
     {
@@ -13,21 +13,135 @@
 
 #include "antsUtilities.h"
 #include "antsAllocImage.h"
+#include "antsCopyImageRegion.h"
 #include <algorithm>
 
 #include <stdio.h>
 
-#include "itkBinaryThresholdImageFilter.h"
-#include "itkExtractImageFilter.h"
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkLabelStatisticsImageFilter.h"
+#include "itkMultiThreader.h"
 #include "ReadWriteData.h"
 
 namespace ants
 {
+namespace
+{
+typedef float                         StackPixelType;
+typedef itk::Image<StackPixelType, 3> StackImageType;
+
+/** Divide a slice of the stack by the mean of its positive pixels. */
+void NormalizeStackSlice( StackPixelType *slice, const itk::OffsetValueType *strides, const itk::SizeValueType *size )
+{
+  double        sum = 0.0;
+  unsigned long count = 0;
+
+  for( itk::SizeValueType y = 0; y < size[1]; y++ )
+    {
+    const StackPixelType *line = slice + y * strides[1];
+    for( itk::SizeValueType x = 0; x < size[0]; x++ )
+      {
+      const StackPixelType value = line[x * strides[0]];
+      if( value > 0 )
+        {
+        sum += value;
+        count++;
+        }
+      }
+    }
+  const StackPixelType sliceMean = static_cast<StackPixelType>( count > 0 ? sum / count : 0.0 );
+
+  for( itk::SizeValueType y = 0; y < size[1]; y++ )
+    {
+    StackPixelType *line = slice + y * strides[1];
+    for( itk::SizeValueType x = 0; x < size[0]; x++ )
+      {
+      line[x * strides[0]] /= sliceMean;
+      }
+    }
+}
+
+struct StackThreadStruct
+{
+  const std::vector<std::string> *FileNames;
+  int                             Dimension;
+  int                             Slice;
+  StackImageType *                Stack;
+  std::vector<std::string> *      Errors;
+};
+
+/** Each thread streams the chosen slice of its share of the input volumes
+ * straight into its slab of the stack. */
+ITK_THREAD_RETURN_TYPE StackThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  const StackThreadStruct *str = static_cast<StackThreadStruct *>( info->UserData );
+
+  const unsigned long numberOfInputs = str->FileNames->size();
+  const unsigned long first = numberOfInputs * info->ThreadID / info->NumberOfThreads;
+  const unsigned long last = numberOfInputs * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  const int                        dim = str->Dimension;
+  const StackImageType::RegionType stackRegion = str->Stack->GetBufferedRegion();
+  const unsigned int               axes[2] = { dim == 0 ? 1u : 0u, dim == 2 ? 1u : 2u };
+
+  itk::OffsetValueType stackStrides[2];
+  itk::SizeValueType   size[2];
+  for( unsigned int k = 0; k < 2; k++ )
+    {
+    stackStrides[k] = str->Stack->GetOffsetTable()[axes[k]];
+    size[k] = stackRegion.GetSize()[axes[k]];
+    }
+
+  typedef itk::ImageFileReader<StackImageType> ReaderType;
+  for( unsigned long i = first; i < last; i++ )
+    {
+    try
+      {
+      ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( ( *str->FileNames )[i] );
+      reader->UpdateOutputInformation();
+
+      StackImageType::RegionType sliceRegion = reader->GetOutput()->GetLargestPossibleRegion();
+      if( sliceRegion.GetSize()[axes[0]] != size[0] || sliceRegion.GetSize()[axes[1]] != size[1] )
+        {
+        ( *str->Errors )[i] = "slice size does not match the first volume";
+        continue;
+        }
+      sliceRegion.SetSize( dim, 1 );
+      sliceRegion.SetIndex( dim, str->Slice );
+      if( !reader->GetOutput()->GetLargestPossibleRegion().IsInside( sliceRegion ) )
+        {
+        ( *str->Errors )[i] = "slice is outside of the volume";
+        continue;
+        }
+      reader->GetOutput()->SetRequestedRegion( sliceRegion );
+      reader->Update();
+
+      const StackImageType *volume = reader->GetOutput();
+      itk::OffsetValueType  sliceStrides[2];
+      for( unsigned int k = 0; k < 2; k++ )
+        {
+        sliceStrides[k] = volume->GetOffsetTable()[axes[k]];
+        }
+
+      StackImageType::IndexType stackIndex = stackRegion.GetIndex();
+      stackIndex[dim] = i;
+      StackPixelType *target = str->Stack->GetBufferPointer() + str->Stack->ComputeOffset( stackIndex );
+      CopyPixelBlock( volume->GetBufferPointer() + volume->ComputeOffset( sliceRegion.GetIndex() ), sliceStrides,
+                      target, stackStrides, size, 2 );
+      NormalizeStackSlice( target, stackStrides, size );
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      ( *str->Errors )[i] = e.GetDescription();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+} // namespace
+
 /* FlipScalarVolume
  * This program takes a volume and flips it along the
  * indicated axes
@@ -85,16 +199,10 @@ private:
   typedef itk::Image<PixelType, 4> ImageSeriesType;
   typedef itk::Image<PixelType, 3> ImageType;
   typedef itk::Image<PixelType, 2> SliceType;
-  typedef itk::Image<unsigned int, 2> LabelSliceType;
 
   typedef itk::ImageFileReader<ImageType> ReaderType;
   typedef itk::ImageFileReader<ImageSeriesType> Reader4DType;
 
-  typedef itk::ExtractImageFilter<ImageType, SliceType> ExtractFilterType;
-  typedef itk::ExtractImageFilter<ImageSeriesType, SliceType> ExtractFilterType2;
-
-  typedef itk::ImageRegionIteratorWithIndex<SliceType> SliceIt;
-
   // Check for valid input parameters
   if( argc < 5 )
     {
@@ -160,9 +268,10 @@ private:
 
     // std::cout << nSlices << std::endl;
 
+    // only the header is needed for the size of the stack
     ReaderType::Pointer firstReader = ReaderType::New();
     firstReader->SetFileName( argv[5] );
-    firstReader->Update();
+    firstReader->UpdateOutputInformation();
     if( dim == 0 )
       {
       size[0] = firstReader->GetOutput()->GetLargestPossibleRegion().GetSize()[1];
@@ -185,8 +294,20 @@ private:
     }
   else
     {
+    // only the slab holding the slice at every time point is read
     Reader4DType::Pointer reader4D = Reader4DType::New();
     reader4D->SetFileName( argv[5] );
+    reader4D->UpdateOutputInformation();
+
+    ImageSeriesType::RegionType slabRegion = reader4D->GetOutput()->GetLargestPossibleRegion();
+    slabRegion.SetSize( dim, 1 );
+    slabRegion.SetIndex( dim, slice );
+    if( !reader4D->GetOutput()->GetLargestPossibleRegion().IsInside( slabRegion ) )
+      {
+      std::cout << "Slice " << slice << " is outside of " << argv[5] << std::endl;
+      return EXIT_FAILURE;
+      }
+    reader4D->GetOutput()->SetRequestedRegion( slabRegion );
     imageSeries = reader4D->GetOutput();
     imageSeries->Update();
     imageSeries->DisconnectPipeline();
@@ -235,94 +356,61 @@ private:
 
   // Start stacking the slices while normalizing by the mean at each slice.
 
-  for( unsigned int i = 0; i < nSlices; i++ )
+  if( !inputIsA4DImage )
     {
-    SliceType::Pointer stackSlice = ITK_NULLPTR;
-
-    if( !inputIsA4DImage )
+    std::vector<std::string> fileNames;
+    for( unsigned int i = 0; i < nSlices; i++ )
       {
       std::cout << " Slice " << i << " :: " << std::string(argv[5 + i]) << std::endl;
-
-      ReaderType::Pointer reader = ReaderType::New();
-      reader->SetFileName( argv[5 + i] );
-      reader->Update();
-
-      ImageType::RegionType extractRegion = reader->GetOutput()->GetLargestPossibleRegion();
-      extractRegion.SetSize( dim, 0 );
-      extractRegion.SetIndex( dim, slice );
-
-      ExtractFilterType::Pointer extracter = ExtractFilterType::New();
-      extracter->SetInput( reader->GetOutput() );
-      extracter->SetDirectionCollapseToIdentity();
-      extracter->SetExtractionRegion( extractRegion );
-
-      stackSlice = extracter->GetOutput();
-      stackSlice->Update();
-      stackSlice->DisconnectPipeline();
+      fileNames.push_back( argv[5 + i] );
       }
-    else
-      {
-      std::cout << " Slice " << i << " :: " << std::endl;
+    std::vector<std::string> errors( nSlices );
 
-      ImageSeriesType::RegionType extractRegion = imageSeries->GetLargestPossibleRegion();
-      extractRegion.SetSize( dim, 0 );
-      extractRegion.SetIndex( dim, slice );
-      extractRegion.SetSize( 3, 0 );
-      extractRegion.SetIndex( 3, i );
+    StackThreadStruct str;
+    str.FileNames = &fileNames;
+    str.Dimension = dim;
+    str.Slice = slice;
+    str.Stack = stack.GetPointer();
+    str.Errors = &errors;
 
-      ExtractFilterType2::Pointer extracter2 = ExtractFilterType2::New();
-      extracter2->SetInput( imageSeries );
-      extracter2->SetDirectionCollapseToIdentity();
-      extracter2->SetExtractionRegion( extractRegion );
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::min( static_cast<unsigned long>( threader->GetNumberOfThreads() ), nSlices ) );
+    threader->SetSingleMethod( StackThreaderCallback, &str );
+    threader->SingleMethodExecute();
 
-      stackSlice = extracter2->GetOutput();
-      stackSlice->Update();
-      stackSlice->DisconnectPipeline();
+    for( unsigned int i = 0; i < nSlices; i++ )
+      {
+      if( !errors[i].empty() )
+        {
+        std::cout << "Could not read slice " << slice << " of " << fileNames[i] << ": " << errors[i] << std::endl;
+        return EXIT_FAILURE;
+        }
       }
+    }
+  else
+    {
+    const unsigned int axes[2] = { dim == 0 ? 1u : 0u, dim == 2 ? 1u : 2u };
 
-    typedef itk::BinaryThresholdImageFilter<SliceType, LabelSliceType> ThresholderType;
-    ThresholderType::Pointer thresholder = ThresholderType::New();
-    thresholder->SetInput( stackSlice );
-    thresholder->SetInsideValue( 0 );
-    thresholder->SetOutsideValue( 1 );
-    thresholder->SetLowerThreshold( itk::NumericTraits<PixelType>::NonpositiveMin() );
-    thresholder->SetUpperThreshold( 0 );
-
-    typedef itk::LabelStatisticsImageFilter<SliceType, LabelSliceType> StatsFilterType;
-    StatsFilterType::Pointer stats = StatsFilterType::New();
-    stats->SetInput( stackSlice );
-    stats->SetLabelInput( thresholder->GetOutput() );
-    stats->Update();
-
-    PixelType sliceMean = stats->GetMean( 1 );
-
-    SliceIt It( stackSlice, stackSlice->GetLargestPossibleRegion() );
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    itk::OffsetValueType seriesStrides[2];
+    itk::OffsetValueType stackStrides[2];
+    itk::SizeValueType   sliceSize[2] = { size[0], size[1] };
+    for( unsigned int k = 0; k < 2; k++ )
       {
-      PixelType value = It.Get();
-
-      ImageType::IndexType index;
-      index.Fill( 0 );
-
-      index[dim] = i;
+      seriesStrides[k] = imageSeries->GetOffsetTable()[axes[k]];
+      stackStrides[k] = stack->GetOffsetTable()[axes[k]];
+      }
+    const PixelType *series = imageSeries->GetBufferPointer();
+    for( unsigned int i = 0; i < nSlices; i++ )
+      {
+      std::cout << " Slice " << i << " :: " << std::endl;
 
-      if( dim == 0 )
-        {
-        index[1] = It.GetIndex()[0];
-        index[2] = It.GetIndex()[1];
-        }
-      if( dim == 1 )
-        {
-        index[0] = It.GetIndex()[0];
-        index[2] = It.GetIndex()[1];
-        }
-      if( dim == 2 )
-        {
-        index[0] = It.GetIndex()[0];
-        index[1] = It.GetIndex()[1];
-        }
-      stack->SetPixel( index, value / sliceMean );
+      ImageType::IndexType stackIndex = region3D.GetIndex();
+      stackIndex[dim] = i;
+      PixelType *target = stack->GetBufferPointer() + stack->ComputeOffset( stackIndex );
+      CopyPixelBlock( series + i * imageSeries->GetOffsetTable()[3], seriesStrides, target, stackStrides, sliceSize, 2 );
+      NormalizeStackSlice( target, stackStrides, sliceSize );
       }
+    imageSeries = ITK_NULLPTR;
     }
 
   WriteImage<ImageType>( stack, stackName );
@@ -20,6 +20,10 @@
 #include <itkArray.h>
 #include <itkMatrix.h>
 #include <itkImageRegionIteratorWithIndex.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+#include <itkMersenneTwisterRandomVariateGenerator.h>
 
 #include "itkTDistribution.h"
 #include "vnl/vnl_math.h"
@@ -421,35 +425,338 @@ double TTest(int numSubjects,   int* groupLabel, double * featureValue )
   return tt;
 }
 
+/** \class TTestPermutationEngine
+ *
+ * Two sample t-statistics (TTest, i.e. unequal variances with biased
+ * variance estimates) of all voxels for many group assignments.
+ *
+ * The data are kept as a subjects x voxels matrix, centered per voxel.  The
+ * statistics of a group assignment are computed slab by slab: the rows of
+ * the subjects of group A are added to the sums of the slab, and the sums
+ * of group B follow from the totals, which do not depend on the assignment.
+ * The permutations are spread over the threads; each gives the maximum
+ * absolute t-statistic over the voxels, from which family-wise error
+ * corrected p-values are found.
+ */
+class TTestPermutationEngine
+{
+public:
+  itkStaticConstMacro( SlabSize, unsigned long, 4096 );
+
+  TTestPermutationEngine( unsigned int numSubjectsA, unsigned int numSubjectsB, unsigned long numVoxels ) :
+    m_NumSubjectsA( numSubjectsA ),
+    m_NumSubjectsB( numSubjectsB ),
+    m_NumVoxels( numVoxels ),
+    m_Data( static_cast<size_t>( numSubjectsA + numSubjectsB ) * numVoxels ),
+    m_Sum( numVoxels ),
+    m_SumOfSquares( numVoxels ),
+    m_GroupA( ITK_NULLPTR ),
+    m_Statistics( ITK_NULLPTR ),
+    m_Permutations( ITK_NULLPTR ),
+    m_MaximumStatistics( ITK_NULLPTR ),
+    m_NextPermutation( 0 )
+  {
+  }
+
+  /** The row of subject, to be filled with its voxel values. */
+  float * GetSubjectRow( unsigned int subject )
+  {
+    return &this->m_Data[static_cast<size_t>( subject ) * this->m_NumVoxels];
+  }
+
+  /** Center the data per voxel and find the totals; call once the rows are
+   * filled. */
+  void Initialize();
+
+  /** The t-statistics of the assignment putting groupA (numSubjectsA
+   * subject indices) in group A and the others in group B. */
+  void ComputeStatistics( const std::vector<unsigned int> & groupA, float *statistics );
+
+  /** The maximum absolute t-statistic of each permutation. */
+  void ComputeMaximumStatistics( const std::vector<std::vector<unsigned int> > & permutations,
+                                 std::vector<float> & maximumStatistics );
+
+private:
+  /** The statistics of the voxels [begin, end) into statistics[begin, end),
+   * sum and squares being scratch space of SlabSize. */
+  void ComputeSlabStatistics( const std::vector<unsigned int> & groupA, unsigned long begin, unsigned long end,
+                              double *sum, double *squares, float *statistics ) const;
+
+  static ITK_THREAD_RETURN_TYPE StatisticsThreaderCallback( void *arg );
+
+  static ITK_THREAD_RETURN_TYPE PermutationsThreaderCallback( void *arg );
+
+  unsigned int        m_NumSubjectsA;
+  unsigned int        m_NumSubjectsB;
+  unsigned long       m_NumVoxels;
+  std::vector<float>  m_Data;
+  std::vector<double> m_Sum;
+  std::vector<double> m_SumOfSquares;
+
+  // state of the threaded calls
+  const std::vector<unsigned int> *               m_GroupA;
+  float *                                         m_Statistics;
+  const std::vector<std::vector<unsigned int> > * m_Permutations;
+  std::vector<float> *                            m_MaximumStatistics;
+  size_t                                          m_NextPermutation;
+  itk::SimpleFastMutexLock                        m_Mutex;
+};
+
+void TTestPermutationEngine::Initialize()
+{
+  const unsigned int numSubjects = this->m_NumSubjectsA + this->m_NumSubjectsB;
+  for( unsigned long v = 0; v < this->m_NumVoxels; v++ )
+    {
+    double mean = 0;
+    for( unsigned int subj = 0; subj < numSubjects; subj++ )
+      {
+      mean += this->m_Data[subj * this->m_NumVoxels + v];
+      }
+    mean /= static_cast<double>( numSubjects );
+
+    // centering keeps sum of squares minus squared mean well conditioned
+    double sum = 0;
+    double sumOfSquares = 0;
+    for( unsigned int subj = 0; subj < numSubjects; subj++ )
+      {
+      float & value = this->m_Data[subj * this->m_NumVoxels + v];
+      value = static_cast<float>( value - mean );
+      sum += value;
+      sumOfSquares += value * value;
+      }
+    this->m_Sum[v] = sum;
+    this->m_SumOfSquares[v] = sumOfSquares;
+    }
+}
+
+void TTestPermutationEngine::ComputeSlabStatistics( const std::vector<unsigned int> & groupA, unsigned long begin,
+                                                    unsigned long end, double *sum, double *squares,
+                                                    float *statistics ) const
+{
+  const unsigned long n = end - begin;
+  std::fill( sum, sum + n, 0.0 );
+  std::fill( squares, squares + n, 0.0 );
+  for( size_t s = 0; s < groupA.size(); s++ )
+    {
+    const float *row = &this->m_Data[static_cast<size_t>( groupA[s] ) * this->m_NumVoxels + begin];
+    for( unsigned long v = 0; v < n; v++ )
+      {
+      sum[v] += row[v];
+      squares[v] += row[v] * row[v];
+      }
+    }
+
+  const double n1 = this->m_NumSubjectsA;
+  const double n2 = this->m_NumSubjectsB;
+  for( unsigned long v = 0; v < n; v++ )
+    {
+    const double meanA = sum[v] / n1;
+    const double meanB = ( this->m_Sum[begin + v] - sum[v] ) / n2;
+    const double varA = std::max( squares[v] / n1 - meanA * meanA, 0.0 );
+    const double varB = std::max( ( this->m_SumOfSquares[begin + v] - squares[v] ) / n2 - meanB * meanB, 0.0 );
+    const double denom = varA / n1 + varB / n2;
+    statistics[v] = ( denom > 0 ) ? static_cast<float>( ( meanA - meanB ) / std::sqrt( denom ) ) : 0.0f;
+    }
+}
+
+ITK_THREAD_RETURN_TYPE TTestPermutationEngine::StatisticsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  TTestPermutationEngine *              self = static_cast<TTestPermutationEngine *>( info->UserData );
+
+  const unsigned long numSlabs = ( self->m_NumVoxels + SlabSize - 1 ) / SlabSize;
+  const unsigned long firstSlab = numSlabs * info->ThreadID / info->NumberOfThreads;
+  const unsigned long lastSlab = numSlabs * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  std::vector<double> sum( SlabSize );
+  std::vector<double> squares( SlabSize );
+  for( unsigned long slab = firstSlab; slab < lastSlab; slab++ )
+    {
+    const unsigned long begin = slab * SlabSize;
+    const unsigned long end = std::min( begin + SlabSize, self->m_NumVoxels );
+    self->ComputeSlabStatistics( *self->m_GroupA, begin, end, &sum[0], &squares[0], self->m_Statistics + begin );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+ITK_THREAD_RETURN_TYPE TTestPermutationEngine::PermutationsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  TTestPermutationEngine *              self = static_cast<TTestPermutationEngine *>( info->UserData );
+
+  std::vector<double> sum( SlabSize );
+  std::vector<double> squares( SlabSize );
+  std::vector<float>  statistics( SlabSize );
+  while( true )
+    {
+    self->m_Mutex.Lock();
+    const size_t perm = self->m_NextPermutation++;
+    self->m_Mutex.Unlock();
+    if( perm >= self->m_Permutations->size() )
+      {
+      break;
+      }
+
+    float maximum = 0;
+    for( unsigned long begin = 0; begin < self->m_NumVoxels; begin += SlabSize )
+      {
+      const unsigned long end = std::min( begin + SlabSize, self->m_NumVoxels );
+      self->ComputeSlabStatistics( ( *self->m_Permutations )[perm], begin, end, &sum[0], &squares[0],
+                                   &statistics[0] );
+      for( unsigned long v = 0; v < end - begin; v++ )
+        {
+        maximum = std::max( maximum, std::fabs( statistics[v] ) );
+        }
+      }
+    ( *self->m_MaximumStatistics )[perm] = maximum;
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void TTestPermutationEngine::ComputeStatistics( const std::vector<unsigned int> & groupA, float *statistics )
+{
+  this->m_GroupA = &groupA;
+  this->m_Statistics = statistics;
+
+  const unsigned long numSlabs = ( this->m_NumVoxels + SlabSize - 1 ) / SlabSize;
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( static_cast<unsigned long>(
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), numSlabs ), 1ul ) );
+  threader->SetSingleMethod( StatisticsThreaderCallback, this );
+  threader->SingleMethodExecute();
+}
+
+void TTestPermutationEngine::ComputeMaximumStatistics( const std::vector<std::vector<unsigned int> > & permutations,
+                                                       std::vector<float> & maximumStatistics )
+{
+  maximumStatistics.assign( permutations.size(), 0.0f );
+  this->m_Permutations = &permutations;
+  this->m_MaximumStatistics = &maximumStatistics;
+  this->m_NextPermutation = 0;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( static_cast<size_t>(
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), permutations.size() ), static_cast<size_t>( 1 ) ) );
+  threader->SetSingleMethod( PermutationsThreaderCallback, this );
+  threader->SingleMethodExecute();
+}
+
+template <class TImage>
+struct StudentsTestReadThreadStruct
+  {
+  char * *                 FileNames;
+  unsigned int             NumSubjects;
+  typename TImage::RegionType Region;
+  TTestPermutationEngine * Engine;
+
+  unsigned int             NextSubject;
+  itk::SimpleFastMutexLock Mutex;
+  bool                     Failed;
+  std::string              ErrorMessage;
+  };
+
+/** Reads the subject images into the rows of the engine, one image at a
+ * time per thread. */
+template <class TImage>
+ITK_THREAD_RETURN_TYPE StudentsTestReadThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *  info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  StudentsTestReadThreadStruct<TImage> *  str = static_cast<StudentsTestReadThreadStruct<TImage> *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int subj = str->NextSubject++;
+    const bool         failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || subj >= str->NumSubjects )
+      {
+      break;
+      }
+
+    try
+      {
+      typename TImage::Pointer image;
+      ReadImage<TImage>( image, str->FileNames[subj], false );
+      if( image->GetLargestPossibleRegion().GetSize() != str->Region.GetSize() )
+        {
+        itkGenericExceptionMacro( << str->FileNames[subj] << " is not the size of the first image" );
+        }
+
+      float *row = str->Engine->GetSubjectRow( subj );
+      itk::ImageRegionConstIterator<TImage> It( image, image->GetLargestPossibleRegion() );
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        *row++ = It.Get();
+        }
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** OutName may be [tstat,<fwePValue>,<numberOfPermutations=1000>]. */
+void GetStudentsTestOutputNames( const std::string & name, std::string & statName, std::string & pValueName,
+                                 unsigned int & numPermutations )
+{
+  statName = name;
+  pValueName = "";
+  numPermutations = 1000;
+  if( name.size() < 2 || name[0] != '[' || name[name.size() - 1] != ']' )
+    {
+    return;
+    }
+  std::vector<std::string> fields;
+  std::string              list = name.substr( 1, name.size() - 2 );
+  std::string::size_type   begin = 0;
+  while( true )
+    {
+    const std::string::size_type end = list.find( ',', begin );
+    fields.push_back( list.substr( begin, end == std::string::npos ? std::string::npos : end - begin ) );
+    if( end == std::string::npos )
+      {
+      break;
+      }
+    begin = end + 1;
+    }
+  statName = fields[0];
+  if( fields.size() > 1 )
+    {
+    pValueName = fields[1];
+    }
+  if( fields.size() > 2 )
+    {
+    numPermutations = atoi( fields[2].c_str() );
+    }
+}
+
 template <unsigned int ImageDimension>
 int StudentsTestOnImages(int argc, char *argv[])
 {
   typedef float                                 PixelType;
   typedef itk::Image<PixelType, ImageDimension> ImageType;
 
-  typename ImageType::Pointer mask = NULL;
-//  ReadImage<ImageType>(mask, argv[1], false);
-
   unsigned int numSubjectsA = atoi(argv[3]);
   unsigned int numSubjectsB = atoi(argv[4]);
   unsigned int numSubjects = numSubjectsA + numSubjectsB;
-  std::string  outname = std::string(argv[2]);
   unsigned int numvals = numSubjects;
-  int*         groupLabel = new int[numSubjects];
-  for( unsigned int i = 0; i < numSubjectsA; i++ )
-    {
-    groupLabel[i] = 0;
-    }
-  for( unsigned int i = numSubjectsA; i < numSubjects; i++ )
-    {
-    groupLabel[i] = 1;
-    }
-  double* feature = new double[numvals];
-  for( unsigned int i = 0; i < numvals; i++ )
+  if( numSubjectsA == 0 || numSubjectsB == 0 || 5 + numSubjects > static_cast<unsigned int>( argc ) )
     {
-    feature[i] = 0;
+    std::cout << " Expected " << numSubjectsA << " + " << numSubjectsB << " images " << std::endl;
+    return EXIT_FAILURE;
     }
 
+  std::string  outname;
+  std::string  pvaluename;
+  unsigned int numPermutations;
+  GetStudentsTestOutputNames( argv[2], outname, pvaluename, numPermutations );
+
   std::cout << " Numvals " << numvals << std::endl;
   // Get the image dimension
   std::string               fn = std::string(argv[5]);
@@ -465,12 +772,6 @@ int StudentsTestOnImages(int argc, char *argv[])
   for( unsigned int i = 0; i < ImageDimension; i++ )
     {
     size[i] = imageIO->GetDimensions(i);
-//       if (size[i] !=  mask->GetLargestPossibleRegion().GetSize()[i])
-    // {
-    //  std::cout <<  " mask not same size as data !! " << std::endl;
-    //  throw std::exception();
-    // }
-
     spacing[i] = imageIO->GetSpacing(i);
     origin[i]  = imageIO->GetOrigin(i);
     axis = imageIO->GetDirection(i);
@@ -498,64 +799,92 @@ int StudentsTestOnImages(int argc, char *argv[])
                                                                 origin,
                                                                 direction,
                                                                 0);
-  typename ImageType::Pointer PImage = AllocImage<ImageType>(region,
-                                                             spacing,
-                                                             origin,
-                                                             direction,
-                                                             0);
 
-//   unsigned int sizeofpixel=sizeof(PixelType);
+  const unsigned long    nvox = region.GetNumberOfPixels();
+  TTestPermutationEngine engine( numSubjectsA, numSubjectsB, nvox );
 
-  std::vector<typename ImageType::Pointer> imagestack;
-  imagestack.resize(numvals);
-  for( unsigned int j = 0; j < numvals; j++ )
+  typedef StudentsTestReadThreadStruct<ImageType> ReadThreadStructType;
+  ReadThreadStructType str;
+  str.FileNames = argv + 5;
+  str.NumSubjects = numSubjects;
+  str.Region = region;
+  str.Engine = &engine;
+  str.NextSubject = 0;
+  str.Failed = false;
+
+  std::cout << " reading " << numSubjects << " images " << std::endl;
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min(
+    static_cast<unsigned int>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), numSubjects ), 1u ) );
+  threader->SetSingleMethod( StudentsTestReadThreaderCallback<ImageType>, &str );
+  threader->SingleMethodExecute();
+  if( str.Failed )
     {
-    std::string ifn = std::string(argv[5 + j]);
-    std::cout << "reading " << ifn << std::endl;
-    ReadImage<ImageType>(imagestack[j], ifn.c_str(), false);
+    std::cout << str.ErrorMessage << std::endl;
+    return EXIT_FAILURE;
     }
+  engine.Initialize();
 
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  Iterator      vfIter(PImage, PImage->GetLargestPossibleRegion() );
-  unsigned long nvox = 1;
-  for( unsigned int i = 0; i < ImageDimension; i++ )
+  std::cout << " NVals " << numvals << " NSub " << numSubjects <<  std::endl;
+  std::vector<unsigned int> groupA( numSubjectsA );
+  for( unsigned int i = 0; i < numSubjectsA; i++ )
     {
-    nvox *= PImage->GetLargestPossibleRegion().GetSize()[i];
+    groupA[i] = i;
     }
+  engine.ComputeStatistics( groupA, StatImage->GetBufferPointer() );
 
-  unsigned long ct = 0;
-  unsigned long prog = nvox / 20;
-  std::cout << " NVals " << numvals << " NSub " << numSubjects <<  std::endl;
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  WriteImage(StatImage, outname.c_str() );
+
+  if( !pvaluename.empty() && numPermutations > 0 )
     {
-    typename ImageType::IndexType index = vfIter.GetIndex();
-    for( unsigned int subj = 0; subj < numSubjects; subj++ )
-      {
-      feature[subj] = imagestack[subj]->GetPixel(index);
-      }
-    if( ct % prog == 0 )
+    // the permutations are drawn up front, with a fixed seed, so that the
+    // result does not depend on the number of threads
+    typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+    GeneratorType::Pointer generator = GeneratorType::New();
+    generator->SetSeed( 19650218 );
+
+    std::vector<unsigned int>               subjects( numSubjects );
+    std::vector<std::vector<unsigned int> > permutations( numPermutations );
+    for( unsigned int perm = 0; perm < numPermutations; perm++ )
       {
-      std::cout << " % " << (float) ct / (float) nvox << std::endl;
+      for( unsigned int i = 0; i < numSubjects; i++ )
+        {
+        subjects[i] = i;
+        }
+      // partial Fisher-Yates shuffle of the first numSubjectsA subjects
+      for( unsigned int i = 0; i < numSubjectsA; i++ )
+        {
+        const unsigned int j = i + generator->GetIntegerVariate( numSubjects - i - 1 );
+        std::swap( subjects[i], subjects[j] );
+        }
+      permutations[perm].assign( subjects.begin(), subjects.begin() + numSubjectsA );
       }
 
-    double stat = 0;
-//      if (mask->GetPixel(index) >= 0.5)
-    if( true )
+    std::cout << " running " << numPermutations << " permutations " << std::endl;
+    std::vector<float> maximumStatistics;
+    engine.ComputeMaximumStatistics( permutations, maximumStatistics );
+    std::sort( maximumStatistics.begin(), maximumStatistics.end() );
+
+    // p = ( 1 + #{ permutations with max |t| >= |t| } ) / ( 1 + #permutations )
+    typename ImageType::Pointer PImage = AllocImage<ImageType>(region,
+                                                               spacing,
+                                                               origin,
+                                                               direction,
+                                                               0);
+    const float *stat = StatImage->GetBufferPointer();
+    float *      pval = PImage->GetBufferPointer();
+    for( unsigned long v = 0; v < nvox; v++ )
       {
-      stat = TTest(numSubjects, groupLabel, feature);
+      const size_t larger = maximumStatistics.end()
+        - std::lower_bound( maximumStatistics.begin(), maximumStatistics.end(), std::fabs( stat[v] ) );
+      pval[v] = static_cast<float>( 1 + larger ) / static_cast<float>( 1 + numPermutations );
       }
-    ct++;
-    StatImage->SetPixel(  index,   stat);
+    std::cout << " FWE 0.05 threshold |t| >= "
+              << maximumStatistics[std::min( static_cast<size_t>( 0.95 * numPermutations ),
+                                 maximumStatistics.size() - 1 )] << std::endl;
+    WriteImage(PImage, pvaluename.c_str() );
     }
 
-  typedef itk::Statistics::TDistribution DistributionType;
-  typename DistributionType::Pointer distributionFunction = DistributionType::New();
-
-  WriteImage(StatImage, outname.c_str() );
-
-  delete [] feature;
-  delete [] groupLabel;
-
   return 1;
 }
 
@@ -628,6 +957,9 @@ private:
              << std::endl;
     std::cout << " Assume all images the same size " << std::endl;
     std::cout << " Writes out an F-Statistic image " << std::endl;
+    std::cout << " OutName may be [tstat.nii.gz,<fwePValue.nii.gz>,<numberOfPermutations=1000>] to also write "
+             << "family-wise error corrected p-values from the permutation distribution of the maximum |t| "
+             << std::endl;
     std::cout <<  " \n example call \n  \n ";
     std::cout << argv[0] << "  2  TEST.nii.gz 4 8 FawtJandADCcon/*SUB.nii  FawtJandADCsub/*SUB.nii  \n ";
     return 1;
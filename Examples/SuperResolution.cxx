@@ -2,13 +2,14 @@
 #include <algorithm>
 
 #include "itkAddImageFilter.h"
-#include "itkBSplineScatteredDataPointSetToImageFilter.h"
+#include "itkBSplineControlPointLatticeAccumulator.h"
 #include "itkContinuousIndex.h"
 #include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImportImageFilter.h"
-#include "itkPointSet.h"
+#include "itkMultiThreader.h"
 #include "itkRescaleIntensityImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkTimeProbe.h"
 #include "itkVector.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
@@ -17,33 +18,121 @@
 
 namespace ants
 {
+/** The input image whose voxels the threads add to their accumulator, each
+ * thread taking its own slab of the last dimension. */
+template <class TImage, class TAccumulator>
+struct SuperResolutionThreadStruct
+  {
+  const TImage *                                     InputImage;
+  const TImage *                                     GradientImage;
+  const TImage *                                     DomainImage;
+  const TImage *                                     ParametricDomainImage;
+  typename TImage::IndexType                         DomainBeginIndex;
+  typename TImage::IndexType                         DomainEndIndex;
+  float                                              AverageIntensity;
+  std::vector<typename TAccumulator::Pointer>        Accumulators;
+
+  itk::SimpleFastMutexLock Mutex;
+  std::string              ErrorMessage;
+  };
+
+template <class TImage, class TAccumulator>
+ITK_THREAD_RETURN_TYPE SuperResolutionThreaderCallback( void *arg )
+{
+  typedef SuperResolutionThreadStruct<TImage, TAccumulator> ThreadStructType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const unsigned int ImageDimension = TImage::ImageDimension;
+  typedef typename TImage::PixelType RealType;
+
+  // the slab of the thread
+  typename TImage::RegionType region = str->InputImage->GetRequestedRegion();
+  const itk::SizeValueType    numberOfSlices = region.GetSize()[ImageDimension - 1];
+  const itk::SizeValueType    begin = numberOfSlices * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType    end = numberOfSlices * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  if( end <= begin )
+    {
+    return ITK_THREAD_RETURN_VALUE;
+    }
+  region.SetIndex( ImageDimension - 1, region.GetIndex()[ImageDimension - 1] + static_cast<itk::IndexValueType>( begin ) );
+  region.SetSize( ImageDimension - 1, end - begin );
+
+  TAccumulator *accumulator = str->Accumulators[info->ThreadID];
+
+  try
+    {
+    itk::ImageRegionConstIteratorWithIndex<TImage> It( str->InputImage, region );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      typename TImage::PointType imagePoint;
+      str->InputImage->TransformIndexToPhysicalPoint( It.GetIndex(), imagePoint );
+
+      itk::ContinuousIndex<RealType, ImageDimension> cidx;
+      bool isInside = str->DomainImage->TransformPhysicalPointToContinuousIndex( imagePoint, cidx );
+
+      if( isInside )
+        {
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          if( cidx[d] <= str->DomainBeginIndex[d] || cidx[d] >= str->DomainEndIndex[d] )
+            {
+            isInside = false;
+            break;
+            }
+          }
+        }
+
+      if( !isInside )
+        {
+        continue;
+        }
+
+      RealType weight = 1.0;
+      if( str->GradientImage )
+        {
+        weight = str->GradientImage->GetPixel( It.GetIndex() );
+        }
+      if( weight == 0.0 )
+        {
+        continue;
+        }
+
+      str->ParametricDomainImage->TransformContinuousIndexToPhysicalPoint( cidx, imagePoint );
+
+      typename TAccumulator::PixelType scalar;
+      scalar[0] = It.Get() - str->AverageIntensity;
+
+      accumulator->AddPoint( imagePoint, scalar, weight );
+      }
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    str->Mutex.Lock();
+    str->ErrorMessage = e.what();
+    str->Mutex.Unlock();
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int SuperResolution( unsigned int argc, char *argv[] )
 {
   typedef float                                   RealType;
   typedef itk::Image<RealType, ImageDimension>    ImageType;
 
-  typedef itk::Vector<RealType, 1>                         ScalarType;
-  typedef itk::Image<ScalarType, ImageDimension>           ScalarImageType;
-  typedef itk::PointSet<ScalarType, ImageDimension>        PointSetType;
-  typedef itk::BSplineScatteredDataPointSetToImageFilter
-    <PointSetType, ScalarImageType>                        BSplineFilterType;
+  typedef itk::Vector<RealType, 1>                               ScalarType;
+  typedef itk::Image<ScalarType, ImageDimension>                 ScalarImageType;
+  typedef itk::BSplineControlPointLatticeAccumulator<ScalarImageType> BSplineAccumulatorType;
 
   typename ImageType::Pointer domainImage = ITK_NULLPTR;
   ReadImage<ImageType>( domainImage, argv[3] );
 
-  typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
-
-  typename PointSetType::Pointer bsplinePoints = PointSetType::New();
-  bsplinePoints->Initialize();
-
-  typename BSplineFilterType::WeightsContainerType::Pointer weights =
-    BSplineFilterType::WeightsContainerType::New();
-  weights->Initialize();
+  typename BSplineAccumulatorType::Pointer bspliner = BSplineAccumulatorType::New();
 
   unsigned int splineOrder = 3;
-  typename BSplineFilterType::ArrayType numberOfLevels;
-  typename BSplineFilterType::ArrayType ncps;
+  typename BSplineAccumulatorType::ArrayType numberOfLevels;
+  typename BSplineAccumulatorType::ArrayType ncps;
 
   bool useGradientWeighting = true;
   RealType gradientSigma = atof( argv[4] );
@@ -156,104 +245,94 @@ int SuperResolution( unsigned int argc, char *argv[] )
 
   const typename ImporterType::OutputImageType * parametricDomainImage = importer->GetOutput();
 
-  N = 0;
-  for( unsigned int n = 7; n < argc; n++ )
+  typename ScalarImageType::PointType parametricOrigin = domainImage->GetOrigin();
+  for( unsigned int d = 0; d < ImageDimension; d++ )
     {
-    typename ImageType::Pointer inputImage = ITK_NULLPTR;
-    ReadImage<ImageType>( inputImage, argv[n] );
+    parametricOrigin[d] += (
+        domainImage->GetSpacing()[d] *
+        domainImage->GetLargestPossibleRegion().GetIndex()[d] );
+    }
 
-    typename ImageType::Pointer gradientImage = ITK_NULLPTR;
-    if( useGradientWeighting )
-      {
-      typedef itk::GradientMagnitudeRecursiveGaussianImageFilter<ImageType, ImageType> GradientFilterType;
-      typename GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
-      gradientFilter->SetSigma( gradientSigma );
-      gradientFilter->SetInput( inputImage );
-
-      typedef itk::RescaleIntensityImageFilter<ImageType, ImageType> RescaleFilterType;
-      typename RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
-      rescaler->SetOutputMinimum( 0.0 );
-      rescaler->SetOutputMaximum( 1.0 );
-      rescaler->SetInput( gradientFilter->GetOutput() );
-
-      gradientImage = rescaler->GetOutput();
-      gradientImage->Update();
-      gradientImage->DisconnectPipeline();
-      }
+  bspliner->SetOrigin( parametricOrigin );
+  bspliner->SetSpacing( domainImage->GetSpacing() );
+  bspliner->SetSize( domainImage->GetRequestedRegion().GetSize() );
+  bspliner->SetDirection( domainImage->GetDirection() );
+  bspliner->SetNumberOfLevels( numberOfLevels );
+  bspliner->SetSplineOrder( splineOrder );
+  bspliner->SetNumberOfControlPoints( ncps );
 
-    itk::ImageRegionConstIteratorWithIndex<ImageType> It( inputImage, inputImage->GetRequestedRegion() );
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      typename ImageType::PointType imagePoint;
-      inputImage->TransformIndexToPhysicalPoint( It.GetIndex(), imagePoint );
+  itk::TimeProbe timer;
+  timer.Start();
 
-      itk::ContinuousIndex<RealType, ImageDimension> cidx;
-      bool isInside = domainImage->TransformPhysicalPointToContinuousIndex( imagePoint, cidx );
+  // The voxels are not kept as a point set but passed to the fit level by level, so the
+  // memory only depends on the control point lattice.  The input images are read again
+  // at each level and their voxels are added by several threads, each to its own lattice.
+  typedef SuperResolutionThreadStruct<ImageType, BSplineAccumulatorType> ThreadStructType;
+  for( unsigned int level = 0; level < bspliner->GetMaximumNumberOfLevels(); level++ )
+    {
+    bspliner->InitializeLevel( level );
 
-      if( isInside )
+    for( unsigned int n = 7; n < argc; n++ )
+      {
+      typename ImageType::Pointer inputImage = ITK_NULLPTR;
+      ReadImage<ImageType>( inputImage, argv[n] );
+
+      typename ImageType::Pointer gradientImage = ITK_NULLPTR;
+      if( useGradientWeighting )
         {
-        for( unsigned int d = 0; d < ImageDimension; d++ )
-          {
-          if( cidx[d] <= domainBeginIndex[d] || cidx[d] >= domainEndIndex[d] )
-            {
-            isInside = false;
-            break;
-            }
-          }
+        typedef itk::GradientMagnitudeRecursiveGaussianImageFilter<ImageType, ImageType> GradientFilterType;
+        typename GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
+        gradientFilter->SetSigma( gradientSigma );
+        gradientFilter->SetInput( inputImage );
+
+        typedef itk::RescaleIntensityImageFilter<ImageType, ImageType> RescaleFilterType;
+        typename RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
+        rescaler->SetOutputMinimum( 0.0 );
+        rescaler->SetOutputMaximum( 1.0 );
+        rescaler->SetInput( gradientFilter->GetOutput() );
+
+        gradientImage = rescaler->GetOutput();
+        gradientImage->Update();
+        gradientImage->DisconnectPipeline();
         }
 
-      if( !isInside )
+      ThreadStructType str;
+      str.InputImage = inputImage;
+      str.GradientImage = gradientImage;
+      str.DomainImage = domainImage;
+      str.ParametricDomainImage = parametricDomainImage;
+      str.DomainBeginIndex = domainBeginIndex;
+      str.DomainEndIndex = domainEndIndex;
+      str.AverageIntensity = averageIntensity;
+
+      const itk::ThreadIdType numberOfThreads = std::max( std::min( static_cast<itk::SizeValueType>(
+        itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+        inputImage->GetRequestedRegion().GetSize()[ImageDimension - 1] ), static_cast<itk::SizeValueType>( 1 ) );
+      for( itk::ThreadIdType t = 0; t < numberOfThreads; t++ )
         {
-        continue;
+        str.Accumulators.push_back( bspliner->NewThreadAccumulator() );
         }
 
-      RealType weight = 1.0;
-      if( gradientImage.IsNotNull() )
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( SuperResolutionThreaderCallback<ImageType, BSplineAccumulatorType>, &str );
+      threader->SingleMethodExecute();
+      if( !str.ErrorMessage.empty() )
         {
-        weight = gradientImage->GetPixel( It.GetIndex() );
+        std::cerr << "Exception caught: " << str.ErrorMessage << std::endl;
+        return EXIT_FAILURE;
         }
-      if( weight == 0.0 )
+
+      for( itk::ThreadIdType t = 0; t < numberOfThreads; t++ )
         {
-        continue;
+        bspliner->Merge( str.Accumulators[t] );
         }
-
-//       domainImage->SetPixel( index, 1 );
-
-      parametricDomainImage->TransformContinuousIndexToPhysicalPoint( cidx, imagePoint );
-
-      ScalarType scalar;
-      scalar[0] = It.Get() - averageIntensity;
-
-      bsplinePoints->SetPointData( N, scalar );
-      bsplinePoints->SetPoint( N, imagePoint );
-      weights->InsertElement( N, weight );
-
-      N++;
       }
-    }
 
-  itk::TimeProbe timer;
-  timer.Start();
-
-  typename ScalarImageType::PointType parametricOrigin = domainImage->GetOrigin();
-  for( unsigned int d = 0; d < ImageDimension; d++ )
-    {
-    parametricOrigin[d] += (
-        domainImage->GetSpacing()[d] *
-        domainImage->GetLargestPossibleRegion().GetIndex()[d] );
+    bspliner->FinalizeLevel();
     }
 
-  bspliner->SetOrigin( parametricOrigin );
-  bspliner->SetSpacing( domainImage->GetSpacing() );
-  bspliner->SetSize( domainImage->GetRequestedRegion().GetSize() );
-  bspliner->SetDirection( domainImage->GetDirection() );
-  bspliner->SetGenerateOutputImage( true );
-  bspliner->SetNumberOfLevels( numberOfLevels );
-  bspliner->SetSplineOrder( splineOrder );
-  bspliner->SetNumberOfControlPoints( ncps );
-  bspliner->SetInput( bsplinePoints );
-  bspliner->SetPointWeights( weights );
-  bspliner->Update();
+  typename ScalarImageType::Pointer bsplineImage = bspliner->GenerateOutputImage();
 
   timer.Stop();
 
@@ -261,7 +340,7 @@ int SuperResolution( unsigned int argc, char *argv[] )
 
   typedef itk::VectorIndexSelectionCastImageFilter<ScalarImageType, ImageType> SelectorType;
   typename SelectorType::Pointer selector = SelectorType::New();
-  selector->SetInput( bspliner->GetOutput() );
+  selector->SetInput( bsplineImage );
   selector->SetIndex( 0 );
   selector->Update();
 
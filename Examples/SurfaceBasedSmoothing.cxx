@@ -56,12 +56,14 @@ private:
 
   if( argc < 3 )
     {
-    std::cout << " usage :  " << argv[0] << " ImageToSmooth  sigma SurfaceImage  outname  {numrepeatsofsmoothing}"
+    std::cout << " usage :  " << argv[0] << " ImageToSmooth  sigma SurfaceImage  outname  {numrepeatsofsmoothing} {heatkerneltime}"
              << std::endl;
     std::cout << " We assume the SurfaceImage has a label == 1 that defines the surface " << std::endl;
     std::cout <<   " sigma  defines the geodesic n-hood radius --- numrepeats allows one to use " << std::endl;
     std::cout << " a small geodesic n-hood repeatedly applied many times -- faster computation, same effect "
              << std::endl;
+    std::cout << " heatkerneltime > 0 applies exp(-t(I-W)) of the n-hood average W instead of the repeats "
+             << std::endl;
     return 0;
     }
   typedef itk::Image<float, 3> ImageType;
@@ -84,6 +86,11 @@ private:
     {
     numrepeats = atoi(argv[5]);
     }
+  float heattime = 0;
+  if( argc > 6 )
+    {
+    heattime = atof(argv[6]);
+    }
 
   ImageType::Pointer input;
   ReadImage<ImageType>(input, argv[1]);
@@ -107,10 +114,15 @@ private:
 
   Parameterizer->SetNeighborhoodRadius( sig );
   std::cout << " begin integration NOW " << std::endl;
-  Parameterizer->IntegrateFunctionOverSurface(true);
-  for( unsigned int i = 0; i < numrepeats; i++ )
+  // the n-hoods are searched once and the averaging is then applied as a sparse operator
+  Parameterizer->BuildSmoothingOperator(true);
+  if( heattime > 0 )
+    {
+    Parameterizer->ApplyHeatKernel(heattime);
+    }
+  else
     {
-    Parameterizer->IntegrateFunctionOverSurface(true);
+    Parameterizer->ApplySmoothingOperator(numrepeats + 1);
     }
   std::cout << " end integration  " << std::endl;
   // Parameterizer->PostProcessGeometry();
@@ -0,0 +1,266 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "itkBSplineControlPointDisplacementFieldTransform.h"
+#include "itkMultiThreader.h"
+#include "vnl/vnl_math.h"
+
+#include <sstream>
+
+// The control point gradient of BSplineControlPointDisplacementFieldTransform,
+// accumulated on the support of each voxel, against the gradient of the
+// BSplineTransform from its Jacobian, the sum over the voxels of J(x)^T u(x)
+// as the ITKv4 metrics accumulate it, on anisotropic grids within the
+// transform domain in 2-D and 3-D.  The update of the control points is that
+// gradient scaled so that the largest update of the field is the largest
+// update given, and the field is the displacement of the B-spline after it.
+
+namespace
+{
+template <class TTransform>
+typename TTransform::Pointer MakeTransform( const typename TTransform::DisplacementFieldType::SizeType & size,
+                                            const typename TTransform::BSplineTransformType::MeshSizeType & meshSize,
+                                            const typename TTransform::BSplineTransformType::ParametersType &
+                                            parameters )
+{
+  typedef typename TTransform::BSplineTransformType  BSplineTransformType;
+  typedef typename TTransform::DisplacementFieldType FieldType;
+  const unsigned int Dimension = FieldType::ImageDimension;
+
+  typename FieldType::SpacingType spacing;
+  typename FieldType::PointType   origin;
+  for( unsigned int d = 0; d < Dimension; d++ )
+    {
+    spacing[d] = 1.0 + 0.3 * d;
+    origin[d] = 2.0 - d;
+    }
+
+  // a domain a little larger than the grid, so that no grid point is on its
+  // boundary
+  typename BSplineTransformType::OriginType             domainOrigin;
+  typename BSplineTransformType::PhysicalDimensionsType physicalDimensions;
+  typename BSplineTransformType::DirectionType          direction;
+  direction.SetIdentity();
+  for( unsigned int d = 0; d < Dimension; d++ )
+    {
+    domainOrigin[d] = origin[d] - 0.25 * spacing[d];
+    physicalDimensions[d] = spacing[d] * ( size[d] - 1 ) + 0.5 * spacing[d];
+    }
+
+  typename BSplineTransformType::Pointer bspline = BSplineTransformType::New();
+  bspline->SetTransformDomainOrigin( domainOrigin );
+  bspline->SetTransformDomainPhysicalDimensions( physicalDimensions );
+  bspline->SetTransformDomainMeshSize( meshSize );
+  bspline->SetTransformDomainDirection( direction );
+  bspline->SetParametersByValue( parameters );
+
+  typename FieldType::PixelType zero( 0.0 );
+  typename FieldType::Pointer   field = antsEngineTest::MakeImage<FieldType>( size );
+  field->SetSpacing( spacing );
+  field->SetOrigin( origin );
+  field->FillBuffer( zero );
+
+  typename TTransform::Pointer transform = TTransform::New();
+  transform->SetBSplineTransform( bspline );
+  transform->SetDisplacementField( field );
+  transform->UpdateDisplacementField();
+  return transform;
+}
+
+/** The largest difference of the field and the displacement of the B-spline
+ * transform at the grid points. */
+template <class TTransform>
+double GetFieldError( TTransform *transform )
+{
+  typedef typename TTransform::DisplacementFieldType FieldType;
+  const unsigned int Dimension = FieldType::ImageDimension;
+
+  const FieldType *                                 field = transform->GetDisplacementField();
+  double                                            maximum = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    typename FieldType::PointType point;
+    field->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    const typename FieldType::PointType mapped = transform->GetModifiableBSplineTransform()->TransformPoint( point );
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      maximum = std::max( maximum, std::fabs( it.Get()[d] - ( mapped[d] - point[d] ) ) );
+      }
+    }
+  return maximum;
+}
+
+template <unsigned int VDimension>
+bool TestControlPointGradient( const itk::Size<VDimension> & size, const itk::Size<VDimension> & mesh,
+                               unsigned int seed )
+{
+  typedef itk::BSplineControlPointDisplacementFieldTransform<double, VDimension, 3> TransformType;
+  typedef typename TransformType::BSplineTransformType                              BSplineTransformType;
+  typedef typename TransformType::DisplacementFieldType                             FieldType;
+  typedef typename BSplineTransformType::ParametersType                             ParametersType;
+  typedef typename BSplineTransformType::JacobianType                               JacobianType;
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator                    GeneratorType;
+
+  typename BSplineTransformType::MeshSizeType meshSize;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    meshSize[d] = mesh[d];
+    }
+
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( seed );
+
+  // a B-spline transform away from the identity and a random update field
+  unsigned int       numberOfParameters = VDimension;
+  itk::SizeValueType numberOfPixels = 1;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    numberOfParameters *= mesh[d] + 3;
+    numberOfPixels *= size[d];
+    }
+  ParametersType parameters( numberOfParameters );
+  for( unsigned int p = 0; p < numberOfParameters; p++ )
+    {
+    parameters[p] = generator->GetVariate() - 0.5;
+    }
+
+  const double             factor = 0.7;
+  typename TransformType::DerivativeType update( numberOfPixels * VDimension );
+  double                   maximumUpdateNorm = 0.0;
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    double squaredNorm = 0.0;
+    for( unsigned int d = 0; d < VDimension; d++ )
+      {
+      update[n * VDimension + d] = 2.0 * generator->GetVariate() - 1.0;
+      squaredNorm += vnl_math_sqr( factor * update[n * VDimension + d] );
+      }
+    maximumUpdateNorm = std::max( maximumUpdateNorm, std::sqrt( squaredNorm ) );
+    }
+
+  // the gradient from the Jacobian of the B-spline transform
+  typename TransformType::Pointer reference = MakeTransform<TransformType>( size, meshSize, parameters );
+  BSplineTransformType *          bspline = reference->GetModifiableBSplineTransform();
+  const FieldType *               field = reference->GetDisplacementField();
+  ParametersType                  gradient( numberOfParameters );
+  gradient.Fill( 0.0 );
+  JacobianType                                      jacobian;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+  itk::SizeValueType                                n = 0;
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it, n++ )
+    {
+    typename FieldType::PointType point;
+    field->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    bspline->ComputeJacobianWithRespectToParameters( point, jacobian );
+    for( unsigned int p = 0; p < numberOfParameters; p++ )
+      {
+      for( unsigned int d = 0; d < VDimension; d++ )
+        {
+        gradient[p] += jacobian( d, p ) * factor * update[n * VDimension + d];
+        }
+      }
+    }
+
+  // the largest displacement of the gradient on the grid sets the scale
+  typename BSplineTransformType::Pointer gradientTransform = BSplineTransformType::New();
+  gradientTransform->SetFixedParameters( bspline->GetFixedParameters() );
+  gradientTransform->SetParametersByValue( gradient );
+  double maximumGradientNorm = 0.0;
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    typename FieldType::PointType point;
+    field->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    maximumGradientNorm = std::max( maximumGradientNorm,
+                                    ( gradientTransform->TransformPoint( point ) - point ).GetNorm() );
+    }
+  const double scale = maximumUpdateNorm / maximumGradientNorm;
+
+  ParametersType expected( numberOfParameters );
+  double         maximumExpected = 0.0;
+  for( unsigned int p = 0; p < numberOfParameters; p++ )
+    {
+    expected[p] = parameters[p] + scale * gradient[p];
+    maximumExpected = std::max( maximumExpected, std::fabs( expected[p] ) );
+    }
+  const double tolerance = 1.e-9 * ( 1.0 + maximumExpected );
+
+  const int previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int threadCounts[] = { 1, 4 };
+  bool      passed = true;
+  for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+    {
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+
+    std::ostringstream what;
+    what << VDimension << "-D, " << threadCounts[t] << " threads";
+
+    typename TransformType::Pointer transform = MakeTransform<TransformType>( size, meshSize, parameters );
+    std::ostringstream              initialWhat;
+    initialWhat << what.str() << ": field error before the update " << GetFieldError( transform.GetPointer() );
+    passed = antsEngineTest::Check( GetFieldError( transform.GetPointer() ) <= tolerance, initialWhat.str() )
+      && passed;
+
+    transform->UpdateTransformParameters( update, factor );
+
+    const ParametersType & updated = transform->GetModifiableBSplineTransform()->GetParameters();
+    double                 maximumDifference = 0.0;
+    for( unsigned int p = 0; p < numberOfParameters; p++ )
+      {
+      maximumDifference = std::max( maximumDifference, std::fabs( updated[p] - expected[p] ) );
+      }
+    std::ostringstream parametersWhat;
+    parametersWhat << what.str() << ": control points differ by " << maximumDifference;
+    passed = antsEngineTest::Check( maximumDifference <= tolerance, parametersWhat.str() ) && passed;
+
+    std::ostringstream fieldWhat;
+    fieldWhat << what.str() << ": field error after the update " << GetFieldError( transform.GetPointer() );
+    passed = antsEngineTest::Check( GetFieldError( transform.GetPointer() ) <= tolerance, fieldWhat.str() )
+      && passed;
+    }
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+} // anonymous namespace
+
+int antsBSplineControlPointGradientTest( int, char * [] )
+{
+  bool passed = true;
+
+  itk::Size<2> size2;
+  size2[0] = 23;
+  size2[1] = 19;
+  itk::Size<2> mesh2;
+  mesh2[0] = 4;
+  mesh2[1] = 3;
+  passed = TestControlPointGradient<2>( size2, mesh2, 2016 ) && passed;
+
+  itk::Size<3> size3;
+  size3[0] = 11;
+  size3[1] = 9;
+  size3[2] = 7;
+  itk::Size<3> mesh3;
+  mesh3[0] = 3;
+  mesh3[1] = 2;
+  mesh3[2] = 2;
+  passed = TestControlPointGradient<3>( size3, mesh3, 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsBSplineControlPointGradientTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
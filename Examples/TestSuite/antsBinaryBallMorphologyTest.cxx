@@ -0,0 +1,149 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsBinaryBallMorphology.h"
+
+#include "itkBinaryBallStructuringElement.h"
+#include "itkBinaryDilateImageFilter.h"
+#include "itkBinaryErodeImageFilter.h"
+#include "itkBinaryMorphologicalClosingImageFilter.h"
+#include "itkBinaryMorphologicalOpeningImageFilter.h"
+#include "itkMultiThreader.h"
+
+#include <sstream>
+
+// ants::BinaryBallMorphology against the ITK filters with a
+// BinaryBallStructuringElement, set up as iMath MD, ME, MO and MC set them up
+// for radius 0 and 1, on random three-label images so that the voxels which
+// are neither foreground nor background are checked as well.
+
+namespace
+{
+template <unsigned int VDimension>
+bool TestMorphology( const typename itk::Image<float, VDimension>::SizeType & size, unsigned int seed )
+{
+  typedef itk::Image<float, VDimension>                                 ImageType;
+  typedef itk::BinaryBallStructuringElement<float, VDimension>          StructuringElementType;
+  typedef itk::BinaryDilateImageFilter<ImageType, ImageType, StructuringElementType>
+    DilateFilterType;
+  typedef itk::BinaryErodeImageFilter<ImageType, ImageType, StructuringElementType>
+    ErodeFilterType;
+  typedef itk::BinaryMorphologicalOpeningImageFilter<ImageType, ImageType, StructuringElementType>
+    OpeningFilterType;
+  typedef itk::BinaryMorphologicalClosingImageFilter<ImageType, ImageType, StructuringElementType>
+    ClosingFilterType;
+  typedef ants::BinaryBallMorphology MorphologyType;
+
+  // labels 1 and 2 in blobs of label 0
+  typename ImageType::Pointer blobs = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 2, seed );
+  typename ImageType::Pointer labels = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 1, seed + 1 );
+  typename ImageType::Pointer image = antsEngineTest::MakeImage<ImageType>( size );
+  for( itk::SizeValueType n = 0; n < image->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    image->GetBufferPointer()[n] = blobs->GetBufferPointer()[n] * ( 1.0f + labels->GetBufferPointer()[n] );
+    }
+  const float foregroundValue = 1.0f;
+
+  const int previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int threadCounts[] = { 1, 4 };
+  bool      passed = true;
+  for( unsigned long radius = 2; radius <= 4; radius++ )
+    {
+    StructuringElementType structuringElement;
+    structuringElement.SetRadius( radius );
+    structuringElement.CreateStructuringElement();
+
+    typename DilateFilterType::Pointer dilate = DilateFilterType::New();
+    dilate->SetInput( image );
+    dilate->SetKernel( structuringElement );
+    dilate->SetDilateValue( foregroundValue );
+    dilate->SetBackgroundValue( 0 );
+    dilate->Update();
+
+    typename ErodeFilterType::Pointer erode = ErodeFilterType::New();
+    erode->SetInput( image );
+    erode->SetKernel( structuringElement );
+    erode->SetErodeValue( foregroundValue );
+    erode->SetBackgroundValue( 0 );
+    erode->Update();
+
+    typename OpeningFilterType::Pointer opening = OpeningFilterType::New();
+    opening->SetInput( image );
+    opening->SetKernel( structuringElement );
+    opening->SetForegroundValue( foregroundValue );
+    opening->SetBackgroundValue( 0 );
+    opening->Update();
+
+    typename ClosingFilterType::Pointer closing = ClosingFilterType::New();
+    closing->SetInput( image );
+    closing->SetKernel( structuringElement );
+    closing->SetForegroundValue( foregroundValue );
+    closing->Update();
+
+    for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+      {
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+
+      std::ostringstream what;
+      what << VDimension << "-D radius " << radius << ", " << threadCounts[t] << " threads, ";
+
+      typename ImageType::Pointer dilated = MorphologyType::Dilate<ImageType>( image, radius, foregroundValue );
+      passed = antsEngineTest::Check( antsEngineTest::CountDifferences( dilate->GetOutput(), dilated.GetPointer(),
+                                                                        0.0, what.str() + "MD" ) == 0,
+                                      what.str() + "MD" ) && passed;
+
+      typename ImageType::Pointer eroded = MorphologyType::Erode<ImageType>( image, radius, foregroundValue, 0 );
+      passed = antsEngineTest::Check( antsEngineTest::CountDifferences( erode->GetOutput(), eroded.GetPointer(),
+                                                                        0.0, what.str() + "ME" ) == 0,
+                                      what.str() + "ME" ) && passed;
+
+      typename ImageType::Pointer opened = MorphologyType::Open<ImageType>( image, radius, foregroundValue, 0 );
+      passed = antsEngineTest::Check( antsEngineTest::CountDifferences( opening->GetOutput(), opened.GetPointer(),
+                                                                        0.0, what.str() + "MO" ) == 0,
+                                      what.str() + "MO" ) && passed;
+
+      typename ImageType::Pointer closed = MorphologyType::Close<ImageType>( image, radius, foregroundValue );
+      passed = antsEngineTest::Check( antsEngineTest::CountDifferences( closing->GetOutput(), closed.GetPointer(),
+                                                                        0.0, what.str() + "MC" ) == 0,
+                                      what.str() + "MC" ) && passed;
+      }
+    }
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+} // anonymous namespace
+
+int antsBinaryBallMorphologyTest( int, char * [] )
+{
+  bool passed = true;
+
+  itk::Size<2> size2;
+  size2[0] = 61;
+  size2[1] = 47;
+  passed = TestMorphology<2>( size2, 2016 ) && passed;
+
+  itk::Size<3> size3;
+  size3[0] = 29;
+  size3[1] = 23;
+  size3[2] = 31;
+  passed = TestMorphology<3>( size3, 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsBinaryBallMorphologyTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
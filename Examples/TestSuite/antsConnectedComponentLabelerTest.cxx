@@ -0,0 +1,225 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsConnectedComponentLabeler.h"
+
+#include "itkBinaryThresholdImageFilter.h"
+#include "itkConnectedComponentImageFilter.h"
+#include "itkRelabelComponentImageFilter.h"
+#include "itkScalarConnectedComponentImageFilter.h"
+
+#include <sstream>
+#include <vector>
+
+// ants::ConnectedComponentLabeler against ConnectedComponentImageFilter (or
+// ScalarConnectedComponentImageFilter with ConnectEqualValuesOnly) followed by
+// RelabelComponentImageFilter, on random images cut into one and several slabs.
+
+namespace
+{
+template <unsigned int VDimension>
+bool TestLabeler( const typename itk::Image<float, VDimension>::SizeType & size, unsigned int seed )
+{
+  typedef itk::Image<float, VDimension>         ImageType;
+  typedef itk::Image<unsigned long, VDimension> LabelImageType;
+
+  typedef ants::ConnectedComponentLabeler<ImageType, LabelImageType>             LabelerType;
+  typedef itk::ConnectedComponentImageFilter<ImageType, LabelImageType>          ConnectedFilterType;
+  typedef itk::ScalarConnectedComponentImageFilter<ImageType, LabelImageType>    ScalarConnectedFilterType;
+  typedef itk::RelabelComponentImageFilter<LabelImageType, LabelImageType>       RelabelFilterType;
+  typedef itk::BinaryThresholdImageFilter<ImageType, ImageType>                  ThresholdFilterType;
+
+  bool passed = true;
+
+  // blobs with a few values, so that ConnectEqualValuesOnly splits them
+  typename ImageType::Pointer blobs = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 2, seed );
+  typename ImageType::Pointer values = antsEngineTest::MakeRandomImage<ImageType>( size, 0.0, 4.0, seed + 1 );
+  typename ImageType::Pointer labels = antsEngineTest::MakeImage<ImageType>( size );
+  for( itk::SizeValueType n = 0; n < blobs->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    labels->GetBufferPointer()[n] = blobs->GetBufferPointer()[n]
+      * ( 1.0f + std::floor( values->GetBufferPointer()[n] ) );
+    }
+
+  const unsigned int threadCounts[] = { 1, 3, 8 };
+  for( unsigned int fully = 0; fully < 2; fully++ )
+    {
+    for( unsigned int minimumSize = 0; minimumSize <= 5; minimumSize += 5 )
+      {
+      for( unsigned int equalOnly = 0; equalOnly < 2; equalOnly++ )
+        {
+        // the reference
+        typename LabelImageType::Pointer components;
+        if( equalOnly )
+          {
+          typename ScalarConnectedFilterType::Pointer connected = ScalarConnectedFilterType::New();
+          connected->SetInput( labels );
+          connected->SetDistanceThreshold( 0 );
+          connected->SetFullyConnected( fully != 0 );
+          connected->SetBackgroundValue( 0 );
+          connected->Update();
+          components = connected->GetOutput();
+          }
+        else
+          {
+          typename ConnectedFilterType::Pointer connected = ConnectedFilterType::New();
+          connected->SetInput( labels );
+          connected->SetFullyConnected( fully != 0 );
+          connected->Update();
+          components = connected->GetOutput();
+          }
+        typename RelabelFilterType::Pointer relabel = RelabelFilterType::New();
+        relabel->SetInput( components );
+        relabel->SetMinimumObjectSize( minimumSize );
+        relabel->Update();
+
+        for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+          {
+          LabelerType labeler;
+          labeler.SetInput( labels );
+          labeler.SetFullyConnected( fully != 0 );
+          labeler.SetConnectEqualValuesOnly( equalOnly != 0 );
+          labeler.SetMinimumComponentSize( minimumSize );
+          labeler.SetNumberOfThreads( threadCounts[t] );
+          labeler.Update();
+
+          std::ostringstream what;
+          what << VDimension << "-D labels, fully connected " << fully << ", equal values only " << equalOnly
+               << ", minimum size " << minimumSize << ", " << threadCounts[t] << " threads";
+
+          passed = antsEngineTest::Check( antsEngineTest::CountDifferences( relabel->GetOutput(),
+                                                                            labeler.GetOutput(), 0.0,
+                                                                            what.str() ) == 0,
+                                          what.str() + ": labels" ) && passed;
+          passed = antsEngineTest::Check( labeler.GetNumberOfComponents() == relabel->GetNumberOfObjects(),
+                                          what.str() + ": number of components" ) && passed;
+          for( unsigned long c = 1; c <= labeler.GetNumberOfComponents() && c <= relabel->GetNumberOfObjects();
+               c++ )
+            {
+            passed = antsEngineTest::Check( labeler.GetStatistics( c ).NumberOfVoxels ==
+                                            relabel->GetSizeOfObjectsInPixels()[c - 1],
+                                            what.str() + ": component sizes" ) && passed;
+            }
+          }
+        }
+      }
+    }
+
+  // the statistics of the value image, and the threshold
+  {
+  LabelerType labeler;
+  labeler.SetInput( values );
+  labeler.SetLowerThreshold( 2.5 );
+  labeler.Update();
+
+  typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
+  threshold->SetInput( values );
+  threshold->SetLowerThreshold( 2.5 );
+  threshold->SetInsideValue( 1 );
+  threshold->SetOutsideValue( 0 );
+  typename ConnectedFilterType::Pointer connected = ConnectedFilterType::New();
+  connected->SetInput( threshold->GetOutput() );
+  typename RelabelFilterType::Pointer relabel = RelabelFilterType::New();
+  relabel->SetInput( connected->GetOutput() );
+  relabel->Update();
+
+  std::ostringstream what;
+  what << VDimension << "-D threshold 2.5";
+  passed = antsEngineTest::Check( antsEngineTest::CountDifferences( relabel->GetOutput(), labeler.GetOutput(), 0.0,
+                                                                    what.str() ) == 0, what.str() + ": labels" )
+    && passed;
+
+  std::vector<double>        sums( labeler.GetNumberOfComponents() + 1, 0.0 );
+  std::vector<double>        maxima( labeler.GetNumberOfComponents() + 1, -1.0 );
+  const unsigned long *      output = relabel->GetOutput()->GetBufferPointer();
+  const float *              buffer = values->GetBufferPointer();
+  for( itk::SizeValueType n = 0; n < values->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    if( output[n] > 0 && output[n] < sums.size() )
+      {
+      sums[output[n]] += buffer[n];
+      maxima[output[n]] = std::max( maxima[output[n]], static_cast<double>( buffer[n] ) );
+      }
+    }
+  for( unsigned long c = 1; c <= labeler.GetNumberOfComponents(); c++ )
+    {
+    passed = antsEngineTest::Check( std::fabs( labeler.GetStatistics( c ).Sum - sums[c] ) <= 1.e-6 * sums[c] &&
+                                    labeler.GetStatistics( c ).Maximum == maxima[c],
+                                    what.str() + ": component sums and maxima" ) && passed;
+    }
+  }
+
+  // the largest component at each threshold, from the single sweep
+  {
+  std::vector<double> thresholds;
+  thresholds.push_back( 3.5 );
+  thresholds.push_back( 1.0 );
+  thresholds.push_back( 2.0 );
+  thresholds.push_back( 3.0 );
+  std::vector<unsigned long> sizes;
+  std::vector<double>        sums;
+
+  LabelerType sweep;
+  sweep.SetInput( values );
+  sweep.SetFullyConnected( true );
+  sweep.ComputeMaximumComponentSizes( thresholds, sizes, sums );
+  for( unsigned int t = 0; t < thresholds.size(); t++ )
+    {
+    typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
+    threshold->SetInput( values );
+    threshold->SetLowerThreshold( thresholds[t] );
+    threshold->SetInsideValue( 1 );
+    threshold->SetOutsideValue( 0 );
+    typename ConnectedFilterType::Pointer connected = ConnectedFilterType::New();
+    connected->SetInput( threshold->GetOutput() );
+    connected->SetFullyConnected( true );
+    typename RelabelFilterType::Pointer relabel = RelabelFilterType::New();
+    relabel->SetInput( connected->GetOutput() );
+    relabel->Update();
+
+    const unsigned long largest = relabel->GetNumberOfObjects() > 0 ? relabel->GetSizeOfObjectsInPixels()[0] : 0;
+    std::ostringstream  what;
+    what << VDimension << "-D largest component at threshold " << thresholds[t] << ": " << sizes[t] << " != "
+         << largest;
+    passed = antsEngineTest::Check( sizes[t] == largest, what.str() ) && passed;
+    }
+  }
+
+  return passed;
+}
+} // anonymous namespace
+
+int antsConnectedComponentLabelerTest( int, char * [] )
+{
+  bool passed = true;
+
+  itk::Size<2> size2;
+  size2[0] = 67;
+  size2[1] = 53;
+  passed = TestLabeler<2>( size2, 2016 ) && passed;
+
+  itk::Size<3> size3;
+  size3[0] = 31;
+  size3[1] = 27;
+  size3[2] = 41;
+  passed = TestLabeler<3>( size3, 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsConnectedComponentLabelerTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
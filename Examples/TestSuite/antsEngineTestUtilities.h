@@ -0,0 +1,188 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsEngineTestUtilities_h
+#define antsEngineTestUtilities_h
+
+#include "itkImage.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+/**
+ * Helpers of the tests which compare the threaded engines of ANTs, voxel for
+ * voxel, with the ITK filters and loops they replace.  The images are
+ * synthetic and seeded, so the tests need no data and are reproducible.
+ */
+namespace antsEngineTest
+{
+template <class TImage>
+typename TImage::Pointer MakeImage( const typename TImage::SizeType & size )
+{
+  typename TImage::Pointer image = TImage::New();
+  image->SetRegions( size );
+  image->Allocate();
+  return image;
+}
+
+/** Uniform values in [minimum, maximum) from the seed. */
+template <class TImage>
+typename TImage::Pointer MakeRandomImage( const typename TImage::SizeType & size, double minimum, double maximum,
+                                          unsigned int seed )
+{
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( seed );
+
+  typename TImage::Pointer image = MakeImage<TImage>( size );
+  typename TImage::PixelType *buffer = image->GetBufferPointer();
+  const itk::SizeValueType    numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    buffer[n] = static_cast<typename TImage::PixelType>( minimum + ( maximum - minimum ) * generator->GetVariate() );
+    }
+  return image;
+}
+
+/** A random image smoothed by a box of the given radius, so that it has
+ * structure at that scale rather than single voxels:  the sum of the uniform
+ * [0, 1) noise over the ( 2 radius + 1 )^D voxels around each voxel, with the
+ * values of the boundary repeated outside. */
+template <class TImage>
+typename TImage::Pointer MakeRandomSmoothImage( const typename TImage::SizeType & size, unsigned int radius,
+                                                unsigned int seed )
+{
+  typedef itk::Image<double, TImage::ImageDimension> RealImageType;
+  typename RealImageType::Pointer noise = MakeRandomImage<RealImageType>( size, 0.0, 1.0, seed );
+
+  // separable box sums, one axis at a time
+  typename RealImageType::Pointer smoothed = MakeImage<RealImageType>( size );
+  for( unsigned int d = 0; d < TImage::ImageDimension; d++ )
+    {
+    itk::ImageRegionConstIteratorWithIndex<RealImageType> it( noise, noise->GetBufferedRegion() );
+    for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+      {
+      typename RealImageType::IndexType index = it.GetIndex();
+      double                            sum = 0.0;
+      for( int k = -static_cast<int>( radius ); k <= static_cast<int>( radius ); k++ )
+        {
+        typename RealImageType::IndexType neighbor = index;
+        neighbor[d] = std::min( std::max( index[d] + k, static_cast<itk::IndexValueType>( 0 ) ),
+                                static_cast<itk::IndexValueType>( size[d] ) - 1 );
+        sum += noise->GetPixel( neighbor );
+        }
+      smoothed->SetPixel( index, sum );
+      }
+    std::swap( noise, smoothed );
+    }
+
+  typename TImage::Pointer image = MakeImage<TImage>( size );
+  const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    image->GetBufferPointer()[n] = static_cast<typename TImage::PixelType>( noise->GetBufferPointer()[n] );
+    }
+  return image;
+}
+
+/** Binary blobs:  1 where MakeRandomSmoothImage is above its mean and 0
+ * elsewhere. */
+template <class TImage>
+typename TImage::Pointer MakeRandomBlobImage( const typename TImage::SizeType & size, unsigned int radius,
+                                              unsigned int seed )
+{
+  typedef itk::Image<double, TImage::ImageDimension> RealImageType;
+  typename RealImageType::Pointer smooth = MakeRandomSmoothImage<RealImageType>( size, radius, seed );
+
+  typename TImage::Pointer image = MakeImage<TImage>( size );
+  const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  const double             mean = std::pow( 2.0 * radius + 1.0, static_cast<double>( TImage::ImageDimension ) ) * 0.5;
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    image->GetBufferPointer()[n] = ( smooth->GetBufferPointer()[n] > mean ) ? 1 : 0;
+    }
+  return image;
+}
+
+/** The number of voxels whose values differ by more than tolerance, the first
+ * few of which are printed. */
+template <class TImageA, class TImageB>
+itk::SizeValueType CountDifferences( const TImageA *a, const TImageB *b, double tolerance,
+                                     const std::string & what )
+{
+  if( a->GetBufferedRegion().GetSize() != b->GetBufferedRegion().GetSize() )
+    {
+    std::cerr << what << ": the sizes differ, " << a->GetBufferedRegion().GetSize() << " and "
+              << b->GetBufferedRegion().GetSize() << std::endl;
+    return itk::NumericTraits<itk::SizeValueType>::max();
+    }
+
+  itk::SizeValueType                                numberOfDifferences = 0;
+  itk::ImageRegionConstIteratorWithIndex<TImageA> itA( a, a->GetBufferedRegion() );
+  const typename TImageB::PixelType *               bufferB = b->GetBufferPointer();
+  for( itA.GoToBegin(); !itA.IsAtEnd(); ++itA, ++bufferB )
+    {
+    const double difference = std::fabs( static_cast<double>( itA.Get() ) - static_cast<double>( *bufferB ) );
+    if( !( difference <= tolerance ) )
+      {
+      if( numberOfDifferences < 5 )
+        {
+        std::cerr << what << ": " << itA.Get() << " != " << static_cast<double>( *bufferB ) << " at "
+                  << itA.GetIndex() << std::endl;
+        }
+      numberOfDifferences++;
+      }
+    }
+  if( numberOfDifferences > 0 )
+    {
+    std::cerr << what << ": " << numberOfDifferences << " voxels differ" << std::endl;
+    }
+  return numberOfDifferences;
+}
+
+/** The largest difference of the components of two vector images, e.g.
+ * displacement fields. */
+template <class TImage>
+double MaximumVectorDifference( const TImage *a, const TImage *b )
+{
+  const itk::SizeValueType            numberOfPixels = a->GetBufferedRegion().GetNumberOfPixels();
+  const typename TImage::PixelType *  bufferA = a->GetBufferPointer();
+  const typename TImage::PixelType *  bufferB = b->GetBufferPointer();
+  double                              maximum = 0.0;
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int c = 0; c < TImage::PixelType::Dimension; c++ )
+      {
+      maximum = std::max( maximum, std::fabs( static_cast<double>( bufferA[n][c] ) - bufferB[n][c] ) );
+      }
+    }
+  return maximum;
+}
+
+/** Prints what failed, for the tests which go on to check the other cases. */
+inline bool Check( bool condition, const std::string & what )
+{
+  if( !condition )
+    {
+    std::cerr << "FAILED: " << what << std::endl;
+    }
+  return condition;
+}
+} // namespace antsEngineTest
+
+#endif // antsEngineTestUtilities_h
@@ -0,0 +1,258 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsAllocImage.h"
+#include "antsInMemory.h"
+
+#include "itkTranslationTransform.h"
+#include "vnl/vnl_math.h"
+
+#include <sstream>
+
+// Each wrapper of ants::inmemory run once on small synthetic 2-D images, so
+// that the types of the images and transforms it hands over as in-memory
+// names are the types the tool reads them back as:  N4 on a ramped image,
+// DenoiseImage on a noisy one within an unsigned char mask, antsApplyTransforms
+// with a translation of whole voxels, Atropos on two classes and
+// antsJointFusion with atlases which are copies of the target.
+
+namespace
+{
+const unsigned int Dimension = 2;
+
+typedef itk::Image<float, Dimension>         ImageType;
+typedef itk::Image<unsigned int, Dimension>  LabelImageType;
+typedef itk::Image<unsigned char, Dimension> ByteImageType;
+
+/** Two classes, 100 in the blobs and 200 elsewhere, with uniform noise of
+ * the given amplitude. */
+ImageType::Pointer MakeTwoClassImage( const ImageType::SizeType & size, double noise, unsigned int seed )
+{
+  ImageType::Pointer image = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 3, seed );
+  ImageType::Pointer noiseImage = antsEngineTest::MakeRandomImage<ImageType>( size, -noise, noise, seed + 1 );
+  for( itk::SizeValueType n = 0; n < image->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    image->GetBufferPointer()[n] = 200.0f - 100.0f * image->GetBufferPointer()[n]
+      + noiseImage->GetBufferPointer()[n];
+    }
+  return image;
+}
+
+/** The root mean square of log( a / b ) about its mean. */
+double GetLogRatioDeviation( const ImageType *a, const ImageType *b )
+{
+  const itk::SizeValueType numberOfPixels = a->GetBufferedRegion().GetNumberOfPixels();
+  double                   sum = 0.0;
+  double                   sumOfSquares = 0.0;
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    const double logRatio = std::log( a->GetBufferPointer()[n] / b->GetBufferPointer()[n] );
+    sum += logRatio;
+    sumOfSquares += logRatio * logRatio;
+    }
+  const double mean = sum / numberOfPixels;
+  return std::sqrt( std::max( sumOfSquares / numberOfPixels - mean * mean, 0.0 ) );
+}
+
+bool TestN4BiasFieldCorrection( const ImageType::SizeType & size )
+{
+  ImageType::Pointer clean = MakeTwoClassImage( size, 0.0, 2016 );
+  ImageType::Pointer input = AllocImage<ImageType>( clean );
+  itk::ImageRegionConstIteratorWithIndex<ImageType> it( clean, clean->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    const double bias = 1.0 + 0.3 * it.GetIndex()[0] / size[0] - 0.2 * it.GetIndex()[1] / size[1];
+    input->SetPixel( it.GetIndex(), it.Get() * bias );
+    }
+  ImageType::Pointer mask = AllocImage<ImageType>( clean, 1.0f );
+
+  std::vector<std::string> options;
+  options.push_back( "-s" );
+  options.push_back( "1" );
+  options.push_back( "-c" );
+  options.push_back( "[20x20,0]" );
+  options.push_back( "-b" );
+  options.push_back( "[16]" );
+
+  ImageType::Pointer biasField = ITK_NULLPTR;
+  ImageType::Pointer corrected =
+    ants::inmemory::N4BiasFieldCorrection<Dimension>( input, mask, options, &biasField );
+  if( !antsEngineTest::Check( corrected.IsNotNull() && biasField.IsNotNull(), "N4BiasFieldCorrection: outputs" ) )
+    {
+    return false;
+    }
+
+  std::ostringstream what;
+  what << "N4BiasFieldCorrection: deviation of the log ratio to the clean image, "
+       << GetLogRatioDeviation( corrected, clean ) << " after and " << GetLogRatioDeviation( input, clean )
+       << " before";
+  return antsEngineTest::Check( corrected->GetBufferedRegion() == input->GetBufferedRegion()
+                                && GetLogRatioDeviation( corrected, clean ) < GetLogRatioDeviation( input, clean ),
+                                what.str() );
+}
+
+bool TestDenoiseImage( const ImageType::SizeType & size )
+{
+  ImageType::Pointer     clean = MakeTwoClassImage( size, 0.0, 2016 );
+  ImageType::Pointer     input = MakeTwoClassImage( size, 20.0, 2016 );
+  ByteImageType::Pointer mask = AllocImage<ByteImageType>( clean, 1 );
+
+  ImageType::Pointer denoised = ants::inmemory::DenoiseImage<Dimension>( input, mask );
+  if( !antsEngineTest::Check( denoised.IsNotNull(), "DenoiseImage: output" ) )
+    {
+    return false;
+    }
+
+  double inputError = 0.0;
+  double denoisedError = 0.0;
+  for( itk::SizeValueType n = 0; n < clean->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    inputError += vnl_math_sqr( input->GetBufferPointer()[n] - clean->GetBufferPointer()[n] );
+    denoisedError += vnl_math_sqr( denoised->GetBufferPointer()[n] - clean->GetBufferPointer()[n] );
+    }
+
+  std::ostringstream what;
+  what << "DenoiseImage: squared error " << denoisedError << " after and " << inputError << " before";
+  return antsEngineTest::Check( denoised->GetBufferedRegion() == input->GetBufferedRegion()
+                                && denoisedError < inputError, what.str() );
+}
+
+bool TestApplyTransforms( const ImageType::SizeType & size )
+{
+  typedef itk::Transform<float, Dimension, Dimension> TransformType;
+  typedef itk::TranslationTransform<float, Dimension> TranslationTransformType;
+
+  ImageType::Pointer input = antsEngineTest::MakeRandomImage<ImageType>( size, 0.0, 100.0, 2016 );
+
+  // points of the output are mapped to the input, so that the output at x is
+  // the input at x + offset
+  TranslationTransformType::OutputVectorType offset;
+  offset[0] = 2.0;
+  offset[1] = -3.0;
+  TranslationTransformType::Pointer translation = TranslationTransformType::New();
+  translation->SetOffset( offset );
+  std::vector<TransformType::Pointer> transforms( 1, translation.GetPointer() );
+
+  ImageType::Pointer warped = ants::inmemory::ApplyTransforms<float, Dimension>( input, input, transforms );
+  if( !antsEngineTest::Check( warped.IsNotNull(), "antsApplyTransforms: output" ) )
+    {
+    return false;
+    }
+
+  bool                                              passed = true;
+  itk::ImageRegionConstIteratorWithIndex<ImageType> it( warped, warped->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    ImageType::IndexType index = it.GetIndex();
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      index[d] += static_cast<itk::IndexValueType>( offset[d] );
+      }
+    if( input->GetBufferedRegion().IsInside( index )
+        && std::fabs( it.Get() - input->GetPixel( index ) ) > 1.e-3 )
+      {
+      std::ostringstream what;
+      what << "antsApplyTransforms: " << it.Get() << " != " << input->GetPixel( index ) << " at " << it.GetIndex();
+      passed = antsEngineTest::Check( false, what.str() );
+      break;
+      }
+    }
+  return passed;
+}
+
+bool TestAtropos( const ImageType::SizeType & size )
+{
+  ImageType::Pointer              image = MakeTwoClassImage( size, 10.0, 2016 );
+  std::vector<ImageType::Pointer> images( 1, image );
+  LabelImageType::Pointer         mask = AllocImage<LabelImageType>( image, 1 );
+
+  std::vector<std::string> options;
+  options.push_back( "-i" );
+  options.push_back( "kmeans[2]" );
+  options.push_back( "-c" );
+  options.push_back( "[3,0]" );
+  options.push_back( "-m" );
+  options.push_back( "[0.1,1x1]" );
+
+  LabelImageType::Pointer segmentation = ants::inmemory::Atropos<Dimension>( images, mask, options );
+  if( !antsEngineTest::Check( segmentation.IsNotNull(), "Atropos: output" ) )
+    {
+    return false;
+    }
+
+  // the k-means classes are ordered by their means
+  itk::SizeValueType numberOfMislabeled = 0;
+  for( itk::SizeValueType n = 0; n < image->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    const unsigned int label = image->GetBufferPointer()[n] < 150.0f ? 1 : 2;
+    if( segmentation->GetBufferPointer()[n] != label )
+      {
+      numberOfMislabeled++;
+      }
+    }
+
+  std::ostringstream what;
+  what << "Atropos: " << numberOfMislabeled << " voxels mislabeled";
+  return antsEngineTest::Check( numberOfMislabeled <= image->GetBufferedRegion().GetNumberOfPixels() / 50,
+                                what.str() );
+}
+
+bool TestJointFusion( const ImageType::SizeType & size )
+{
+  // the noise makes the best match of each patch of the atlases the patch at
+  // the same place, so the fusion is the segmentation of the atlases
+  ImageType::Pointer                               image = MakeTwoClassImage( size, 10.0, 2016 );
+  std::vector<ImageType::Pointer>                  target( 1, image );
+  std::vector<std::vector<ImageType::Pointer> >    atlasImages( 2, target );
+  LabelImageType::Pointer                          segmentation = AllocImage<LabelImageType>( image );
+  for( itk::SizeValueType n = 0; n < image->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    segmentation->GetBufferPointer()[n] = image->GetBufferPointer()[n] < 150.0f ? 1 : 2;
+    }
+  std::vector<LabelImageType::Pointer> atlasSegmentations( 2, segmentation );
+  LabelImageType::Pointer              mask = AllocImage<LabelImageType>( image, 1 );
+
+  LabelImageType::Pointer fusion =
+    ants::inmemory::JointFusion<Dimension>( target, atlasImages, atlasSegmentations, mask );
+  if( !antsEngineTest::Check( fusion.IsNotNull(), "antsJointFusion: output" ) )
+    {
+    return false;
+    }
+  return antsEngineTest::Check( antsEngineTest::CountDifferences( segmentation.GetPointer(), fusion.GetPointer(),
+                                                                  0.0, "antsJointFusion" ) == 0,
+                                "antsJointFusion: fusion" );
+}
+} // anonymous namespace
+
+int antsInMemoryTest( int, char * [] )
+{
+  ImageType::SizeType size;
+  size[0] = 48;
+  size[1] = 41;
+
+  bool passed = true;
+  passed = TestN4BiasFieldCorrection( size ) && passed;
+  passed = TestDenoiseImage( size ) && passed;
+  passed = TestApplyTransforms( size ) && passed;
+  passed = TestAtropos( size ) && passed;
+  passed = TestJointFusion( size ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsInMemoryTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
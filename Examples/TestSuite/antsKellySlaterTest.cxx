@@ -0,0 +1,187 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "KellySlater.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "vnl/vnl_math.h"
+
+#include <sstream>
+#include <vector>
+
+// KellySlater on a synthetic 2-D phantom, a disk of white matter within a
+// ring of gray matter five voxels thick, with its positional arguments of
+// earlier versions:  the thickness is only in the gray matter, close to that
+// of the ring and below the prior, and the batch mode of two time points
+// gives the thickness of two single runs.
+
+namespace
+{
+const unsigned int Dimension = 2;
+
+typedef itk::Image<unsigned int, Dimension> LabelImageType;
+typedef itk::Image<float, Dimension>        ImageType;
+
+const double WhiteMatterRadius = 10.0;
+const double GrayMatterRadius = 15.0;
+
+template <class TImage>
+void WriteTestImage( const TImage *image, const std::string & fileName )
+{
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput( image );
+  writer->SetFileName( fileName );
+  writer->Update();
+}
+
+ImageType::Pointer ReadTestImage( const std::string & fileName )
+{
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  reader->Update();
+  return reader->GetOutput();
+}
+
+int RunKellySlater( const std::string & segmentation, const std::string & whiteMatter,
+                    const std::string & grayMatter, const std::string & output )
+{
+  // dimension, images, gradient step, iterations, thickness prior,
+  // curvature prior, smoothing and Euclidean initialization
+  std::vector<std::string> args;
+  args.push_back( "2" );
+  args.push_back( segmentation );
+  args.push_back( whiteMatter );
+  args.push_back( grayMatter );
+  args.push_back( output );
+  args.push_back( "0.025" );
+  args.push_back( "50" );
+  args.push_back( "6" );
+  args.push_back( "0" );
+  args.push_back( "1.5" );
+  args.push_back( "1" );
+  return ants::KellySlater( args, ITK_NULLPTR );
+}
+} // anonymous namespace
+
+int antsKellySlaterTest( int argc, char * argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Usage: " << argv[0] << " outputDirectory" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string directory = std::string( argv[1] ) + "/antsKellySlaterTest";
+
+  ImageType::SizeType size;
+  size.Fill( 48 );
+
+  // labels 3 in the white matter and 2 in the gray matter, with binary
+  // probabilities
+  LabelImageType::Pointer segmentation = antsEngineTest::MakeImage<LabelImageType>( size );
+  ImageType::Pointer      whiteMatter = antsEngineTest::MakeImage<ImageType>( size );
+  ImageType::Pointer      grayMatter = antsEngineTest::MakeImage<ImageType>( size );
+  itk::ImageRegionConstIteratorWithIndex<LabelImageType> it( segmentation, segmentation->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    double squaredRadius = 0.0;
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      squaredRadius += vnl_math_sqr( it.GetIndex()[d] - 0.5 * ( size[d] - 1 ) );
+      }
+    const double       radius = std::sqrt( squaredRadius );
+    const unsigned int label = radius < WhiteMatterRadius ? 3 : ( radius < GrayMatterRadius ? 2 : 0 );
+    segmentation->SetPixel( it.GetIndex(), label );
+    whiteMatter->SetPixel( it.GetIndex(), label == 3 ? 1.0f : 0.0f );
+    grayMatter->SetPixel( it.GetIndex(), label == 2 ? 1.0f : 0.0f );
+    }
+  WriteTestImage<LabelImageType>( segmentation, directory + "Segmentation.nii.gz" );
+  WriteTestImage<ImageType>( whiteMatter, directory + "WhiteMatter.nii.gz" );
+  WriteTestImage<ImageType>( grayMatter, directory + "GrayMatter.nii.gz" );
+
+  bool passed = true;
+
+  const std::string thicknessName = directory + "Thickness.nii.gz";
+  passed = antsEngineTest::Check( RunKellySlater( directory + "Segmentation.nii.gz", directory + "WhiteMatter.nii.gz",
+                                                  directory + "GrayMatter.nii.gz", thicknessName ) == EXIT_SUCCESS,
+                                  "KellySlater: single time point" ) && passed;
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  ImageType::Pointer thickness = ReadTestImage( thicknessName );
+
+  double             sum = 0.0;
+  double             maximum = 0.0;
+  itk::SizeValueType numberOfGrayMatterVoxels = 0;
+  itk::SizeValueType numberOfThickVoxels = 0;
+  itk::SizeValueType numberOfMisplacedVoxels = 0;
+  for( itk::SizeValueType n = 0; n < thickness->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    const double value = thickness->GetBufferPointer()[n];
+    if( segmentation->GetBufferPointer()[n] == 2 )
+      {
+      sum += value;
+      maximum = std::max( maximum, value );
+      numberOfGrayMatterVoxels++;
+      if( value > 0.0 )
+        {
+        numberOfThickVoxels++;
+        }
+      }
+    else if( value != 0.0 )
+      {
+      numberOfMisplacedVoxels++;
+      }
+    }
+  const double mean = sum / numberOfGrayMatterVoxels;
+
+  std::ostringstream what;
+  what << "KellySlater: mean thickness " << mean << " and maximum " << maximum << " of a ring "
+       << GrayMatterRadius - WhiteMatterRadius << " thick, " << numberOfThickVoxels << " of "
+       << numberOfGrayMatterVoxels << " gray matter voxels with a thickness, " << numberOfMisplacedVoxels
+       << " voxels with a thickness outside the gray matter";
+  passed = antsEngineTest::Check( mean > 1.5 && maximum <= 6.0 + 1.e-3
+                                  && numberOfThickVoxels >= 0.9 * numberOfGrayMatterVoxels
+                                  && numberOfMisplacedVoxels == 0, what.str() ) && passed;
+
+  // the batch mode, on two time points with the same domain
+  const std::string batchNames[2] = { directory + "Thickness0.nii.gz", directory + "Thickness1.nii.gz" };
+  const int         exitCode = RunKellySlater(
+      directory + "Segmentation.nii.gz," + directory + "Segmentation.nii.gz",
+      directory + "WhiteMatter.nii.gz," + directory + "WhiteMatter.nii.gz",
+      directory + "GrayMatter.nii.gz," + directory + "GrayMatter.nii.gz",
+      batchNames[0] + "," + batchNames[1] );
+  passed = antsEngineTest::Check( exitCode == EXIT_SUCCESS, "KellySlater: two time points" ) && passed;
+  for( unsigned int t = 0; exitCode == EXIT_SUCCESS && t < 2; t++ )
+    {
+    std::ostringstream batchWhat;
+    batchWhat << "KellySlater: time point " << t;
+    ImageType::Pointer batchThickness = ReadTestImage( batchNames[t] );
+    passed = antsEngineTest::Check( antsEngineTest::CountDifferences( thickness.GetPointer(),
+                                                                      batchThickness.GetPointer(), 1.e-4,
+                                                                      batchWhat.str() ) == 0, batchWhat.str() )
+      && passed;
+    }
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsKellySlaterTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,351 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsMarchingCubesSurface.h"
+
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <set>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+// ants::MarchingCubesSurface against a plain walk over the edges of the
+// sampling grid, which places the same points vtkMarchingCubes does, and
+// against the properties of the surface it must have whatever the case
+// table: closed and consistently oriented around objects off the boundary,
+// the genus of the shape, the enclosed volume, and the same mesh for any
+// number of threads.
+
+namespace
+{
+typedef itk::Image<float, 3>                  ImageType;
+typedef ants::MarchingCubesSurface<ImageType> SurfaceType;
+
+ImageType::Pointer MakeShapeImage( bool torus, double radius, double offset )
+{
+  ImageType::SizeType size;
+  size[0] = 37;
+  size[1] = 33;
+  size[2] = 45;
+  ImageType::Pointer image = antsEngineTest::MakeImage<ImageType>( size );
+
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 1.5;
+  spacing[2] = 0.8;
+  image->SetSpacing( spacing );
+  ImageType::PointType origin;
+  origin[0] = -3.0;
+  origin[1] = 2.5;
+  origin[2] = 10.0;
+  image->SetOrigin( origin );
+
+  // the signed distance, in physical units, positive inside
+  const double center[3] = { origin[0] + 18.3 + offset, origin[1] + 24.1, origin[2] + 17.7 };
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, image->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    ImageType::PointType point;
+    image->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    const double x = point[0] - center[0];
+    const double y = point[1] - center[1];
+    const double z = point[2] - center[2];
+    double       distance;
+    if( torus )
+      {
+      const double ring = std::sqrt( x * x + y * y ) - 9.0;
+      distance = std::sqrt( ring * ring + z * z );
+      }
+    else
+      {
+      distance = std::sqrt( x * x + y * y + z * z );
+      }
+    it.Set( static_cast<float>( radius - distance ) );
+    }
+  return image;
+}
+
+/** A point on each edge of the grid whose ends are on either side of the
+ * iso-value, interpolated linearly, in the raster order of the edges. */
+std::vector<float> ComputeReferencePoints( const ImageType *image, double iso )
+{
+  std::vector<float>        points;
+  const ImageType::SizeType size = image->GetBufferedRegion().GetSize();
+  for( long z = 0; z < static_cast<long>( size[2] ); z++ )
+    {
+    for( long y = 0; y < static_cast<long>( size[1] ); y++ )
+      {
+      for( long x = 0; x < static_cast<long>( size[0] ); x++ )
+        {
+        ImageType::IndexType index = { { x, y, z } };
+        const double         value = image->GetPixel( index );
+        for( unsigned int d = 0; d < 3; d++ )
+          {
+          ImageType::IndexType next = index;
+          next[d]++;
+          if( next[d] >= static_cast<long>( size[d] ) )
+            {
+            continue;
+            }
+          const double neighbor = image->GetPixel( next );
+          if( ( value >= iso ) == ( neighbor >= iso ) )
+            {
+            continue;
+            }
+          double continuous[3] = { static_cast<double>( x ), static_cast<double>( y ), static_cast<double>( z ) };
+          continuous[d] += ( iso - value ) / ( neighbor - value );
+          for( unsigned int i = 0; i < 3; i++ )
+            {
+            points.push_back( static_cast<float>( image->GetOrigin()[i] + image->GetSpacing()[i] * continuous[i] ) );
+            }
+          }
+        }
+      }
+    }
+  return points;
+}
+
+/** Every directed edge of the triangles once, and its reverse as well. */
+bool IsClosedAndOriented( const SurfaceType & surface )
+{
+  const std::vector<SurfaceType::PointIdentifierType> & triangles = surface.GetTriangles();
+  std::vector<std::pair<unsigned long, unsigned long> > edges;
+  for( unsigned long t = 0; t < triangles.size(); t += 3 )
+    {
+    for( unsigned int k = 0; k < 3; k++ )
+      {
+      edges.push_back( std::make_pair( triangles[t + k], triangles[t + ( k + 1 ) % 3] ) );
+      }
+    }
+  std::sort( edges.begin(), edges.end() );
+  if( std::adjacent_find( edges.begin(), edges.end() ) != edges.end() )
+    {
+    return false;
+    }
+  for( unsigned long e = 0; e < edges.size(); e++ )
+    {
+    if( !std::binary_search( edges.begin(), edges.end(), std::make_pair( edges[e].second, edges[e].first ) ) )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+/** The volume enclosed, positive if the triangles face outwards. */
+double ComputeVolume( const SurfaceType & surface )
+{
+  const std::vector<float> &                            points = surface.GetPoints();
+  const std::vector<SurfaceType::PointIdentifierType> & triangles = surface.GetTriangles();
+  double                                                volume = 0.0;
+  for( unsigned long t = 0; t < triangles.size(); t += 3 )
+    {
+    const float *a = &points[3 * triangles[t]];
+    const float *b = &points[3 * triangles[t + 1]];
+    const float *c = &points[3 * triangles[t + 2]];
+    volume += ( a[0] * ( b[1] * c[2] - b[2] * c[1] ) - a[1] * ( b[0] * c[2] - b[2] * c[0] )
+                + a[2] * ( b[0] * c[1] - b[1] * c[0] ) ) / 6.0;
+    }
+  return volume;
+}
+
+bool ArePointsEqual( const std::vector<float> & a, const std::vector<float> & b, const std::string & what )
+{
+  if( a.size() != b.size() )
+    {
+    std::cerr << what << ": " << a.size() / 3 << " points != " << b.size() / 3 << std::endl;
+    return false;
+    }
+  for( unsigned long n = 0; n < a.size(); n++ )
+    {
+    if( std::fabs( a[n] - b[n] ) > 1.e-4 * ( 1.0 + std::fabs( b[n] ) ) )
+      {
+      std::cerr << what << ": coordinate " << n % 3 << " of point " << n / 3 << " is " << a[n] << " != " << b[n]
+                << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+bool TestSurface( const ImageType *image, double iso, double genus, double volume, const std::string & name )
+{
+  bool passed = true;
+
+  const std::vector<float> referencePoints = ComputeReferencePoints( image, iso );
+
+  SurfaceType single;
+  single.SetInput( image );
+  single.SetIsoValue( iso );
+  single.SetNumberOfThreads( 1 );
+  single.Update();
+
+  passed = antsEngineTest::Check( ArePointsEqual( single.GetPoints(), referencePoints, name ), name + ": points" )
+    && passed;
+  passed = antsEngineTest::Check( single.GetNumberOfTriangles() > 0 && IsClosedAndOriented( single ),
+                                  name + ": closed and oriented" ) && passed;
+
+  std::set<SurfaceType::PointIdentifierType> used( single.GetTriangles().begin(), single.GetTriangles().end() );
+  passed = antsEngineTest::Check( used.size() == single.GetNumberOfPoints(), name + ": every point is used" )
+    && passed;
+
+  if( genus >= 0.0 )
+    {
+    std::ostringstream what;
+    what << name << ": genus " << single.GetGenus() << " != " << genus;
+    passed = antsEngineTest::Check( single.GetGenus() == genus, what.str() ) && passed;
+    }
+  if( volume > 0.0 )
+    {
+    std::ostringstream what;
+    what << name << ": volume " << ComputeVolume( single ) << " != " << volume;
+    passed = antsEngineTest::Check( std::fabs( ComputeVolume( single ) - volume ) < 0.05 * volume, what.str() )
+      && passed;
+    }
+
+  const unsigned int threadCounts[] = { 3, 8 };
+  for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+    {
+    SurfaceType threaded;
+    threaded.SetInput( image );
+    threaded.SetIsoValue( iso );
+    threaded.SetNumberOfThreads( threadCounts[t] );
+    threaded.Update();
+
+    std::ostringstream what;
+    what << name << ", " << threadCounts[t] << " threads";
+    passed = antsEngineTest::Check( threaded.GetPoints() == single.GetPoints()
+                                    && threaded.GetTriangles() == single.GetTriangles(),
+                                    what.str() + ": the mesh of 1 thread" ) && passed;
+    }
+  return passed;
+}
+
+/** Laplacian smoothing over the neighbors sharing an edge, as
+ * vtkSmoothPolyDataFilter does without its feature edges. */
+bool TestSmoothing( const ImageType *image )
+{
+  SurfaceType surface;
+  surface.SetInput( image );
+  surface.SetNumberOfThreads( 3 );
+  surface.Update();
+
+  const unsigned long                                   numberOfPoints = surface.GetNumberOfPoints();
+  const std::vector<SurfaceType::PointIdentifierType> & triangles = surface.GetTriangles();
+  std::vector<std::set<SurfaceType::PointIdentifierType> > neighbors( numberOfPoints );
+  for( unsigned long t = 0; t < triangles.size(); t += 3 )
+    {
+    for( unsigned int k = 0; k < 3; k++ )
+      {
+      neighbors[triangles[t + k]].insert( triangles[t + ( k + 1 ) % 3] );
+      neighbors[triangles[t + ( k + 1 ) % 3]].insert( triangles[t + k] );
+      }
+    }
+
+  const unsigned int numberOfIterations = 5;
+  const double       relaxation = 0.1;
+  std::vector<float> points = surface.GetPoints();
+  for( unsigned int i = 0; i < numberOfIterations; i++ )
+    {
+    std::vector<float> smoothed( points.size() );
+    for( unsigned long n = 0; n < numberOfPoints; n++ )
+      {
+      for( unsigned int c = 0; c < 3; c++ )
+        {
+        double mean = 0.0;
+        for( std::set<SurfaceType::PointIdentifierType>::const_iterator it = neighbors[n].begin();
+             it != neighbors[n].end(); ++it )
+          {
+          mean += points[3 * *it + c];
+          }
+        smoothed[3 * n + c] = neighbors[n].empty() ? points[3 * n + c]
+          : static_cast<float>( points[3 * n + c] + relaxation * ( mean / neighbors[n].size() - points[3 * n + c] ) );
+        }
+      }
+    points.swap( smoothed );
+    }
+
+  surface.Smooth( numberOfIterations, relaxation );
+  return antsEngineTest::Check( ArePointsEqual( surface.GetPoints(), points, "smoothing" ), "smoothing" );
+}
+} // anonymous namespace
+
+int antsMarchingCubesSurfaceTest( int, char * [] )
+{
+  bool passed = true;
+
+  const double       radius = 7.3;
+  ImageType::Pointer sphere = MakeShapeImage( false, radius, 0.0 );
+  passed = TestSurface( sphere, 0.0, 0.0, 4.0 / 3.0 * vnl_math::pi * radius * radius * radius, "sphere" ) && passed;
+  passed = TestSurface( sphere, 2.0, 0.0, -1.0, "sphere at iso-value 2" ) && passed;
+
+  ImageType::Pointer torus = MakeShapeImage( true, 3.0, 0.0 );
+  passed = TestSurface( torus, 0.0, 1.0, 2.0 * vnl_math::pi * vnl_math::pi * 9.0 * 3.0 * 3.0, "torus" ) && passed;
+
+  // blobs off the boundary, with many ambiguous faces
+  ImageType::SizeType size;
+  size[0] = 29;
+  size[1] = 31;
+  size[2] = 37;
+  ImageType::Pointer blobs = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 1, 2016 );
+  itk::ImageRegionIteratorWithIndex<ImageType> it( blobs, blobs->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      if( it.GetIndex()[d] == 0 || it.GetIndex()[d] + 1 == static_cast<long>( size[d] ) )
+        {
+        it.Set( 0 );
+        }
+      }
+    }
+  passed = TestSurface( blobs, 0.5, -1.0, -1.0, "blobs" ) && passed;
+
+  // the largest of two spheres is the mesh of the larger one alone
+  {
+  ImageType::Pointer larger = MakeShapeImage( false, 6.0, -9.0 );
+  ImageType::Pointer smaller = MakeShapeImage( false, 4.0, 9.0 );
+  ImageType::Pointer both = antsEngineTest::MakeImage<ImageType>( larger->GetBufferedRegion().GetSize() );
+  both->CopyInformation( larger );
+  for( itk::SizeValueType n = 0; n < both->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    both->GetBufferPointer()[n] = std::max( larger->GetBufferPointer()[n], smaller->GetBufferPointer()[n] );
+    }
+
+  SurfaceType largest;
+  largest.SetInput( both );
+  largest.SetNumberOfThreads( 3 );
+  largest.Update();
+  largest.KeepLargestComponent();
+
+  SurfaceType alone;
+  alone.SetInput( larger );
+  alone.Update();
+
+  passed = antsEngineTest::Check( ArePointsEqual( largest.GetPoints(), alone.GetPoints(), "largest component" )
+                                  && largest.GetTriangles() == alone.GetTriangles(), "largest component" ) && passed;
+  }
+
+  passed = TestSmoothing( sphere ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsMarchingCubesSurfaceTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsPermuteFlip.h"
+
+#include "itkFlipImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkPermuteAxesImageFilter.h"
+
+#include <sstream>
+
+// ants::PermuteFlip against PermuteAxesImageFilter followed by
+// FlipImageFilter, for every order and every combination of flips in 2-D, 3-D
+// and 4-D, on sizes which are not multiples of the tile and, in 2-D and 3-D,
+// span several tiles.
+
+namespace
+{
+template <unsigned int VDimension>
+bool TestPermuteFlip( const typename itk::Image<short, VDimension>::SizeType & size, unsigned int seed )
+{
+  typedef itk::Image<short, VDimension>              ImageType;
+  typedef itk::PermuteAxesImageFilter<ImageType>     PermuteFilterType;
+  typedef itk::FlipImageFilter<ImageType>            FlipFilterType;
+
+  typename ImageType::Pointer input = antsEngineTest::MakeRandomImage<ImageType>( size, -1000.0, 1000.0, seed );
+
+  const int    previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int    threadCounts[] = { 1, 4 };
+  bool         passed = true;
+  unsigned int order[VDimension];
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    order[d] = d;
+    }
+  do
+    {
+    for( unsigned int flips = 0; flips < ( 1u << VDimension ); flips++ )
+      {
+      typename PermuteFilterType::PermuteOrderArrayType permuteOrder;
+      typename FlipFilterType::FlipAxesArrayType        flipAxes;
+      bool                                              flip[VDimension];
+      for( unsigned int d = 0; d < VDimension; d++ )
+        {
+        permuteOrder[d] = order[d];
+        flip[d] = ( flips & ( 1u << d ) ) != 0;
+        flipAxes[d] = flip[d];
+        }
+
+      typename PermuteFilterType::Pointer permute = PermuteFilterType::New();
+      permute->SetInput( input );
+      permute->SetOrder( permuteOrder );
+      typename FlipFilterType::Pointer flipper = FlipFilterType::New();
+      flipper->SetInput( permute->GetOutput() );
+      flipper->SetFlipAxes( flipAxes );
+      flipper->Update();
+
+      for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+        {
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+
+        typename ImageType::Pointer output =
+          antsEngineTest::MakeImage<ImageType>( flipper->GetOutput()->GetBufferedRegion().GetSize() );
+        ants::PermuteFlip::Apply( input.GetPointer(), order, flip, output.GetPointer() );
+
+        std::ostringstream what;
+        what << VDimension << "-D order";
+        for( unsigned int d = 0; d < VDimension; d++ )
+          {
+          what << " " << order[d];
+          }
+        what << ", flips " << flips << ", " << threadCounts[t] << " threads";
+        passed = antsEngineTest::Check( antsEngineTest::CountDifferences( flipper->GetOutput(), output.GetPointer(),
+                                                                          0.0, what.str() ) == 0, what.str() )
+          && passed;
+        }
+      }
+    }
+  while( std::next_permutation( order, order + VDimension ) );
+
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+} // anonymous namespace
+
+int antsPermuteFlipTest( int, char * [] )
+{
+  bool passed = true;
+
+  itk::Size<2> size2;
+  size2[0] = 150;
+  size2[1] = 97;
+  passed = TestPermuteFlip<2>( size2, 2016 ) && passed;
+
+  itk::Size<3> size3;
+  size3[0] = 70;
+  size3[1] = 67;
+  size3[2] = 5;
+  passed = TestPermuteFlip<3>( size3, 2017 ) && passed;
+
+  itk::Size<4> size4;
+  size4[0] = 9;
+  size4[1] = 7;
+  size4[2] = 5;
+  size4[3] = 3;
+  passed = TestPermuteFlip<4>( size4, 2018 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsPermuteFlipTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
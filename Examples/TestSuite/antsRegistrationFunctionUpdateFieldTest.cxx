@@ -0,0 +1,257 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsAllocImage.h"
+
+#include "itkAvantsMutualInformationRegistrationFunction.h"
+#include "itkCrossCorrelationRegistrationFunction.h"
+#include "itkProbabilisticRegistrationFunction.h"
+
+#include "itkMultiThreader.h"
+#include "itkNeighborhoodAlgorithm.h"
+
+#include <sstream>
+
+// ComputeUpdateField of the CC, probabilistic and MI registration functions
+// against the neighborhood loop of ANTSImageRegistrationOptimizer, which
+// calls ComputeUpdate and ComputeUpdateInv voxel by voxel over the
+// non-boundary face of the update field, with and without the inverse field
+// and the mask, in 2-D and 3-D.
+
+namespace
+{
+template <class TMetric>
+void ConfigureMetric( TMetric *metric )
+{
+  typename TMetric::RadiusType radius;
+  radius.Fill( 2 );
+  metric->SetRadius( radius );
+  metric->SetNormalizeGradient( false );
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void ConfigureMetric( itk::AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TField> *metric )
+{
+  typedef itk::AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TField> MetricType;
+
+  typename MetricType::RadiusType radius;
+  radius.Fill( 0 );
+  metric->SetRadius( radius );
+  metric->SetNormalizeGradient( false );
+  metric->SetNumberOfHistogramBins( 32 );
+}
+
+/** The largest component of the field, to scale the tolerance. */
+template <class TField>
+double GetMaximumNorm( const TField *field )
+{
+  const itk::SizeValueType            numberOfPixels = field->GetBufferedRegion().GetNumberOfPixels();
+  const typename TField::PixelType *  buffer = field->GetBufferPointer();
+  double                              maximum = 0.0;
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int d = 0; d < TField::ImageDimension; d++ )
+      {
+      maximum = std::max( maximum, std::fabs( static_cast<double>( buffer[n][d] ) ) );
+      }
+    }
+  return maximum;
+}
+
+template <class TMetric>
+bool TestMetric( const typename TMetric::FixedImageType *fixedImage,
+                 const typename TMetric::MovingImageType *movingImage,
+                 const typename TMetric::FixedImageType *mask, bool useInverse, const std::string & name )
+{
+  typedef typename TMetric::DisplacementFieldType                       FieldType;
+  typedef typename TMetric::NeighborhoodType                            NeighborhoodType;
+  typedef typename TMetric::VectorType                                  VectorType;
+  typedef itk::ImageRegionIterator<FieldType>                           UpdateIteratorType;
+  typedef itk::NeighborhoodAlgorithm::ImageBoundaryFacesCalculator<FieldType> FaceCalculatorType;
+
+  VectorType zero;
+  zero.Fill( 0.0 );
+
+  // the neighborhood loop of the optimizer
+  typename TMetric::Pointer reference = TMetric::New();
+  ConfigureMetric( reference.GetPointer() );
+  reference->SetFixedImage( fixedImage );
+  reference->SetMovingImage( movingImage );
+  reference->InitializeIteration();
+  void *referenceGlobalData = reference->GetGlobalDataPointer();
+
+  typename FieldType::Pointer referenceUpdate = AllocImage<FieldType>( fixedImage, zero );
+  typename FieldType::Pointer referenceUpdateInv = AllocImage<FieldType>( fixedImage, zero );
+
+  FaceCalculatorType                           faceCalculator;
+  typename FaceCalculatorType::FaceListType    faceList =
+    faceCalculator( referenceUpdate, referenceUpdate->GetLargestPossibleRegion(), reference->GetRadius() );
+  const typename FieldType::RegionType         region = *faceList.begin();
+
+  NeighborhoodType   nD( reference->GetRadius(), referenceUpdate, region );
+  UpdateIteratorType nU( referenceUpdate, region );
+  for( nD.GoToBegin(), nU.GoToBegin(); !nD.IsAtEnd(); ++nD, ++nU )
+    {
+    float maskprob = 1.0;
+    if( mask )
+      {
+      maskprob = std::min( mask->GetPixel( nD.GetIndex() ), 1.0f );
+      if( maskprob < 0.1 )
+        {
+        continue;
+        }
+      }
+    nU.Value() += reference->ComputeUpdate( nD, referenceGlobalData ) * maskprob;
+    if( useInverse )
+      {
+      const typename FieldType::IndexType index = nD.GetIndex();
+      referenceUpdateInv->SetPixel( index, reference->ComputeUpdateInv( nD, referenceGlobalData ) * maskprob
+                                    + referenceUpdateInv->GetPixel( index ) );
+      }
+    }
+
+  const double tolerance = 1.e-5 * std::max( GetMaximumNorm( referenceUpdate.GetPointer() ),
+                                             GetMaximumNorm( referenceUpdateInv.GetPointer() ) ) + 1.e-12;
+
+  const int previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int threadCounts[] = { 1, 4 };
+  bool      passed = true;
+  for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+    {
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+
+    typename TMetric::Pointer metric = TMetric::New();
+    ConfigureMetric( metric.GetPointer() );
+    metric->SetFixedImage( fixedImage );
+    metric->SetMovingImage( movingImage );
+    metric->InitializeIteration();
+
+    typename FieldType::Pointer update = AllocImage<FieldType>( fixedImage, zero );
+    typename FieldType::Pointer updateInv = AllocImage<FieldType>( fixedImage, zero );
+
+    std::ostringstream what;
+    what << name << ( useInverse ? ", inverse" : "" ) << ( mask ? ", mask" : "" ) << ", " << threadCounts[t]
+         << " threads";
+
+    const bool updated = metric->ComputeUpdateField( update, useInverse ? updateInv.GetPointer() : ITK_NULLPTR,
+                                                     mask, region, metric->GetGlobalDataPointer() );
+    passed = antsEngineTest::Check( updated, what.str() + ": whole-field update" ) && passed;
+    if( !updated )
+      {
+      continue;
+      }
+
+    std::ostringstream updateWhat;
+    updateWhat << what.str() << ": update, difference "
+               << antsEngineTest::MaximumVectorDifference( referenceUpdate.GetPointer(), update.GetPointer() );
+    passed = antsEngineTest::Check( antsEngineTest::MaximumVectorDifference( referenceUpdate.GetPointer(),
+                                                                             update.GetPointer() ) <= tolerance,
+                                    updateWhat.str() ) && passed;
+
+    std::ostringstream updateInvWhat;
+    updateInvWhat << what.str() << ": inverse update, difference "
+                  << antsEngineTest::MaximumVectorDifference( referenceUpdateInv.GetPointer(),
+                                                              updateInv.GetPointer() );
+    passed = antsEngineTest::Check( antsEngineTest::MaximumVectorDifference( referenceUpdateInv.GetPointer(),
+                                                                             updateInv.GetPointer() ) <= tolerance,
+                                    updateInvWhat.str() ) && passed;
+
+    std::ostringstream energyWhat;
+    energyWhat << what.str() << ": energy " << metric->GetEnergy() << " != " << reference->GetEnergy();
+    passed = antsEngineTest::Check( std::fabs( metric->GetEnergy() - reference->GetEnergy() )
+                                    <= 1.e-6 * ( 1.0 + std::fabs( reference->GetEnergy() ) ), energyWhat.str() )
+      && passed;
+    }
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+
+template <unsigned int VDimension>
+bool TestRegistrationFunctions( const typename itk::Image<float, VDimension>::SizeType & size, unsigned int seed )
+{
+  typedef itk::Image<float, VDimension>                 ImageType;
+  typedef itk::Vector<float, VDimension>                VectorType;
+  typedef itk::Image<VectorType, VDimension>            FieldType;
+
+  typedef itk::CrossCorrelationRegistrationFunction<ImageType, ImageType, FieldType>        CCMetricType;
+  typedef itk::ProbabilisticRegistrationFunction<ImageType, ImageType, FieldType>           ProbabilisticMetricType;
+  typedef itk::AvantsMutualInformationRegistrationFunction<ImageType, ImageType, FieldType> MIMetricType;
+
+  // a moving image which is partly the fixed one, on an anisotropic grid
+  typename ImageType::SpacingType spacing;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    spacing[d] = 1.0 + 0.2 * d;
+    }
+  typename ImageType::Pointer fixedImage = antsEngineTest::MakeRandomSmoothImage<ImageType>( size, 2, seed );
+  typename ImageType::Pointer other = antsEngineTest::MakeRandomSmoothImage<ImageType>( size, 2, seed + 1 );
+  typename ImageType::Pointer movingImage = antsEngineTest::MakeImage<ImageType>( size );
+  // a mask of blobs, with weights below 0.1 which are skipped and above 1
+  // which are clamped
+  typename ImageType::Pointer mask = antsEngineTest::MakeRandomBlobImage<ImageType>( size, 2, seed + 2 );
+  typename ImageType::Pointer weights = antsEngineTest::MakeRandomImage<ImageType>( size, 0.05, 1.25, seed + 3 );
+  for( itk::SizeValueType n = 0; n < fixedImage->GetBufferedRegion().GetNumberOfPixels(); n++ )
+    {
+    movingImage->GetBufferPointer()[n] = 0.6f * fixedImage->GetBufferPointer()[n]
+      + 0.4f * other->GetBufferPointer()[n];
+    mask->GetBufferPointer()[n] *= weights->GetBufferPointer()[n];
+    }
+  fixedImage->SetSpacing( spacing );
+  movingImage->SetSpacing( spacing );
+  mask->SetSpacing( spacing );
+
+  bool passed = true;
+  for( unsigned int useInverse = 0; useInverse < 2; useInverse++ )
+    {
+    for( unsigned int useMask = 0; useMask < 2; useMask++ )
+      {
+      const ImageType *maskImage = useMask ? mask.GetPointer() : ITK_NULLPTR;
+
+      std::ostringstream dimension;
+      dimension << VDimension << "-D ";
+      passed = TestMetric<CCMetricType>( fixedImage, movingImage, maskImage, useInverse != 0,
+                                         dimension.str() + "CC" ) && passed;
+      passed = TestMetric<ProbabilisticMetricType>( fixedImage, movingImage, maskImage, useInverse != 0,
+                                                    dimension.str() + "probabilistic" ) && passed;
+      passed = TestMetric<MIMetricType>( fixedImage, movingImage, maskImage, useInverse != 0,
+                                         dimension.str() + "MI" ) && passed;
+      }
+    }
+  return passed;
+}
+} // anonymous namespace
+
+int antsRegistrationFunctionUpdateFieldTest( int, char * [] )
+{
+  bool passed = true;
+
+  itk::Size<2> size2;
+  size2[0] = 47;
+  size2[1] = 39;
+  passed = TestRegistrationFunctions<2>( size2, 2016 ) && passed;
+
+  itk::Size<3> size3;
+  size3[0] = 23;
+  size3[1] = 19;
+  size3[2] = 21;
+  passed = TestRegistrationFunctions<3>( size3, 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsRegistrationFunctionUpdateFieldTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsScalingAndSquaring.h"
+
+#include "itkComposeDisplacementFieldsImageFilter.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+#include "itkVector.h"
+
+#include <sstream>
+
+// ants::ScalingAndSquaring against ExponentialDisplacementFieldImageFilter,
+// with a given and the automatic number of squarings, forwards and inverse,
+// and its composition against ComposeDisplacementFieldsImageFilter, on smooth
+// fields over rotated, anisotropic grids which move points out of the field.
+
+namespace
+{
+template <class TField>
+typename TField::Pointer MakeVelocityField( double amplitude, unsigned int seed )
+{
+  const unsigned int Dimension = TField::ImageDimension;
+
+  typename TField::SizeType      size;
+  typename TField::SpacingType   spacing;
+  typename TField::PointType     origin;
+  typename TField::DirectionType direction;
+  for( unsigned int d = 0; d < Dimension; d++ )
+    {
+    size[d] = 19 + 3 * d;
+    spacing[d] = 1.2 - 0.25 * d;
+    origin[d] = 4.0 - 1.5 * d;
+    }
+  const double angle = 0.3;
+  direction.SetIdentity();
+  direction[0][0] = std::cos( angle );
+  direction[0][1] = -std::sin( angle );
+  direction[1][0] = std::sin( angle );
+  direction[1][1] = std::cos( angle );
+
+  typename TField::Pointer field = antsEngineTest::MakeImage<TField>( size );
+  field->SetSpacing( spacing );
+  field->SetOrigin( origin );
+  field->SetDirection( direction );
+
+  // a few random sinusoids along each axis
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( seed );
+  double frequencies[3][3];
+  double phases[3];
+  for( unsigned int i = 0; i < Dimension; i++ )
+    {
+    for( unsigned int j = 0; j < Dimension; j++ )
+      {
+      frequencies[i][j] = 0.4 * generator->GetVariate() - 0.2;
+      }
+    phases[i] = 6.0 * generator->GetVariate();
+    }
+
+  itk::ImageRegionIteratorWithIndex<TField> it( field, field->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    typename TField::PixelType velocity;
+    for( unsigned int i = 0; i < Dimension; i++ )
+      {
+      double phase = phases[i];
+      for( unsigned int j = 0; j < Dimension; j++ )
+        {
+        phase += frequencies[i][j] * it.GetIndex()[j];
+        }
+      velocity[i] = amplitude * std::sin( phase );
+      }
+    it.Set( velocity );
+    }
+  return field;
+}
+
+template <unsigned int VDimension>
+bool TestScalingAndSquaring( unsigned int seed )
+{
+  typedef itk::Vector<double, VDimension>                                           VectorType;
+  typedef itk::Image<VectorType, VDimension>                                        FieldType;
+  typedef itk::ExponentialDisplacementFieldImageFilter<FieldType, FieldType>        ExponentialFilterType;
+  typedef itk::ComposeDisplacementFieldsImageFilter<FieldType, FieldType>           ComposeFilterType;
+  typedef ants::ScalingAndSquaring                                                  ScalingAndSquaringType;
+
+  const double tolerance = 1.e-9;
+  const int    previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int    threadCounts[] = { 1, 4 };
+  bool         passed = true;
+
+  // amplitudes of about a tenth of a voxel and of several voxels
+  const double amplitudes[] = { 0.1, 4.0 };
+  for( unsigned int a = 0; a < sizeof( amplitudes ) / sizeof( amplitudes[0] ); a++ )
+    {
+    typename FieldType::Pointer velocity = MakeVelocityField<FieldType>( amplitudes[a], seed + a );
+
+    for( unsigned int inverse = 0; inverse < 2; inverse++ )
+      {
+      for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+        {
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+
+        std::ostringstream what;
+        what << VDimension << "-D amplitude " << amplitudes[a] << ( inverse ? ", inverse" : "" ) << ", "
+             << threadCounts[t] << " threads";
+
+        const unsigned int numbersOfSquarings[] = { 0, 1, 3, 6 };
+        for( unsigned int s = 0; s < sizeof( numbersOfSquarings ) / sizeof( numbersOfSquarings[0] ); s++ )
+          {
+          typename ExponentialFilterType::Pointer exponential = ExponentialFilterType::New();
+          exponential->SetInput( velocity );
+          exponential->SetAutomaticNumberOfIterations( false );
+          exponential->SetMaximumNumberOfIterations( numbersOfSquarings[s] );
+          exponential->SetComputeInverse( inverse != 0 );
+          exponential->Update();
+
+          typename FieldType::Pointer field = ScalingAndSquaringType::Exponentiate<FieldType>(
+              velocity, numbersOfSquarings[s], inverse != 0 );
+
+          const double       difference = antsEngineTest::MaximumVectorDifference( exponential->GetOutput(),
+                                                                                   field.GetPointer() );
+          std::ostringstream squarings;
+          squarings << what.str() << ", " << numbersOfSquarings[s] << " squarings: difference " << difference;
+          passed = antsEngineTest::Check( difference <= tolerance * ( 1.0 + amplitudes[a] ), squarings.str() )
+            && passed;
+          }
+
+        // the automatic number of squarings
+        {
+        const unsigned int                      maximumNumberOfSquarings = 10;
+        typename ExponentialFilterType::Pointer exponential = ExponentialFilterType::New();
+        exponential->SetInput( velocity );
+        exponential->SetAutomaticNumberOfIterations( true );
+        exponential->SetMaximumNumberOfIterations( maximumNumberOfSquarings );
+        exponential->SetComputeInverse( inverse != 0 );
+        exponential->Update();
+
+        typename FieldType::Pointer field = ScalingAndSquaringType::Exponentiate<FieldType>(
+            velocity, ScalingAndSquaringType::ComputeNumberOfSquarings<FieldType>( velocity,
+                                                                                   maximumNumberOfSquarings ),
+            inverse != 0 );
+
+        const double       difference = antsEngineTest::MaximumVectorDifference( exponential->GetOutput(),
+                                                                                 field.GetPointer() );
+        std::ostringstream automatic;
+        automatic << what.str() << ", automatic squarings: difference " << difference;
+        passed = antsEngineTest::Check( difference <= tolerance * ( 1.0 + amplitudes[a] ), automatic.str() )
+          && passed;
+        }
+
+        // one composition, of two different fields
+        {
+        typename FieldType::Pointer displacement = MakeVelocityField<FieldType>( amplitudes[a], seed + 7 );
+
+        typename ComposeFilterType::Pointer compose = ComposeFilterType::New();
+        compose->SetWarpingField( velocity );
+        compose->SetDisplacementField( displacement );
+        compose->Update();
+
+        typename FieldType::Pointer composed = AllocImage<FieldType>( velocity );
+        ScalingAndSquaringType::Compose<FieldType>( velocity, displacement, composed );
+
+        const double       difference = antsEngineTest::MaximumVectorDifference( compose->GetOutput(),
+                                                                                 composed.GetPointer() );
+        std::ostringstream composition;
+        composition << what.str() << ", composition: difference " << difference;
+        passed = antsEngineTest::Check( difference <= tolerance * ( 1.0 + amplitudes[a] ), composition.str() )
+          && passed;
+        }
+        }
+      }
+    }
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+} // anonymous namespace
+
+int antsScalingAndSquaringTest( int, char * [] )
+{
+  bool passed = true;
+
+  passed = TestScalingAndSquaring<2>( 2016 ) && passed;
+  passed = TestScalingAndSquaring<3>( 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsScalingAndSquaringTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,253 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsEngineTestUtilities.h"
+
+#include "antsScanlineResampling.h"
+
+#include "itkAffineTransform.h"
+#include "itkBSplineInterpolateImageFunction.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkMultiThreader.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkResampleImageFilter.h"
+#include "itkWindowedSincInterpolateImageFunction.h"
+#include "vnl/vnl_math.h"
+
+#include <sstream>
+
+// ants::ScanlineResampling against ResampleImageFilter with an
+// AffineTransform and the interpolator each of its options stands for, on
+// grids which are aligned with the input (the tabulated path), flipped, and
+// rotated (the stepped path), partly outside the input so that the default
+// value and the boundaries of the interpolators are exercised.
+
+namespace
+{
+template <class TImage>
+typename itk::InterpolateImageFunction<TImage, double>::Pointer
+MakeInterpolator( ants::ScanlineResampling::InterpolationType interpolation, unsigned int parameter )
+{
+  typename itk::InterpolateImageFunction<TImage, double>::Pointer interpolator;
+  switch( interpolation )
+    {
+    case ants::ScanlineResampling::NearestNeighbor:
+      {
+      interpolator = itk::NearestNeighborInterpolateImageFunction<TImage, double>::New();
+      }
+      break;
+    case ants::ScanlineResampling::Linear:
+      {
+      interpolator = itk::LinearInterpolateImageFunction<TImage, double>::New();
+      }
+      break;
+    case ants::ScanlineResampling::BSpline:
+      {
+      typename itk::BSplineInterpolateImageFunction<TImage, double>::Pointer bspline =
+        itk::BSplineInterpolateImageFunction<TImage, double>::New();
+      bspline->SetSplineOrder( parameter );
+      interpolator = bspline;
+      }
+      break;
+    default:
+      {
+      switch( parameter )
+        {
+        case ants::ScanlineResampling::Cosine:
+          {
+          interpolator = itk::WindowedSincInterpolateImageFunction<TImage, 3,
+                                                                   itk::Function::CosineWindowFunction<3> >::New();
+          }
+          break;
+        case ants::ScanlineResampling::Welch:
+          {
+          interpolator = itk::WindowedSincInterpolateImageFunction<TImage, 3,
+                                                                   itk::Function::WelchWindowFunction<3> >::New();
+          }
+          break;
+        case ants::ScanlineResampling::Lanczos:
+          {
+          interpolator = itk::WindowedSincInterpolateImageFunction<TImage, 3,
+                                                                   itk::Function::LanczosWindowFunction<3> >::New();
+          }
+          break;
+        case ants::ScanlineResampling::Blackman:
+          {
+          interpolator = itk::WindowedSincInterpolateImageFunction<TImage, 3,
+                                                                   itk::Function::BlackmanWindowFunction<3> >::New();
+          }
+          break;
+        default:
+          {
+          interpolator = itk::WindowedSincInterpolateImageFunction<TImage, 3>::New();
+          }
+        }
+      }
+    }
+  return interpolator;
+}
+
+template <unsigned int VDimension>
+bool TestResampling( const itk::Matrix<double, VDimension, VDimension> & matrix,
+                     const itk::Vector<double, VDimension> & offset, const std::string & name, unsigned int seed )
+{
+  typedef itk::Image<float, VDimension>                      ImageType;
+  typedef itk::AffineTransform<double, VDimension>           TransformType;
+  typedef itk::ResampleImageFilter<ImageType, ImageType>     ResampleFilterType;
+  typedef ants::ScanlineResampling                           ResamplingType;
+
+  // an input with its own grid, and a buffer which does not start at 0
+  typename ImageType::SizeType inputSize;
+  typename ImageType::SpacingType inputSpacing;
+  typename ImageType::PointType inputOrigin;
+  typename ImageType::IndexType inputStart;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    inputSize[d] = 23 + 4 * d;
+    inputSpacing[d] = 1.1 - 0.13 * d;
+    inputOrigin[d] = -2.3 + 1.7 * d;
+    inputStart[d] = 3 - static_cast<long>( d );
+    }
+  typename ImageType::Pointer input = antsEngineTest::MakeRandomImage<ImageType>( inputSize, 0.0, 100.0, seed );
+  typename ImageType::RegionType inputRegion( inputStart, inputSize );
+  input->SetRegions( inputRegion );
+  input->SetSpacing( inputSpacing );
+  input->SetOrigin( inputOrigin );
+
+  // an output grid which covers the input and some of its surroundings
+  typename ImageType::SizeType outputSize;
+  typename ImageType::SpacingType outputSpacing;
+  typename ImageType::PointType outputOrigin;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    outputSize[d] = 31 - 3 * d;
+    outputSpacing[d] = 0.93 + 0.21 * d;
+    outputOrigin[d] = -5.17 + 2.03 * d;
+    }
+  typename ImageType::Pointer output = antsEngineTest::MakeImage<ImageType>( outputSize );
+  output->SetSpacing( outputSpacing );
+  output->SetOrigin( outputOrigin );
+
+  typename TransformType::Pointer transform = TransformType::New();
+  transform->SetMatrix( matrix );
+  transform->SetOffset( offset );
+
+  struct Case
+    {
+    ResamplingType::InterpolationType Interpolation;
+    unsigned int                      Parameter;
+    const char *                      Name;
+    };
+  const Case cases[] = {
+    { ResamplingType::NearestNeighbor, 0, "nearest neighbor" },
+    { ResamplingType::Linear, 0, "linear" },
+    { ResamplingType::BSpline, 0, "B-spline 0" },
+    { ResamplingType::BSpline, 1, "B-spline 1" },
+    { ResamplingType::BSpline, 2, "B-spline 2" },
+    { ResamplingType::BSpline, 3, "B-spline 3" },
+    { ResamplingType::BSpline, 5, "B-spline 5" },
+    { ResamplingType::WindowedSinc, ResamplingType::Hamming, "Hamming sinc" },
+    { ResamplingType::WindowedSinc, ResamplingType::Cosine, "cosine sinc" },
+    { ResamplingType::WindowedSinc, ResamplingType::Welch, "Welch sinc" },
+    { ResamplingType::WindowedSinc, ResamplingType::Lanczos, "Lanczos sinc" },
+    { ResamplingType::WindowedSinc, ResamplingType::Blackman, "Blackman sinc" }
+    };
+
+  const int    previousNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const int    threadCounts[] = { 1, 4 };
+  const double defaultValue = -7.0;
+  bool         passed = true;
+  for( unsigned int c = 0; c < sizeof( cases ) / sizeof( cases[0] ); c++ )
+    {
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetInput( input );
+    resampler->SetTransform( transform );
+    resampler->SetInterpolator( MakeInterpolator<ImageType>( cases[c].Interpolation, cases[c].Parameter ) );
+    resampler->SetOutputParametersFromImage( output );
+    resampler->SetDefaultPixelValue( defaultValue );
+    resampler->Update();
+
+    for( unsigned int t = 0; t < sizeof( threadCounts ) / sizeof( threadCounts[0] ); t++ )
+      {
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadCounts[t] );
+      output->FillBuffer( 0.0 );
+      ResamplingType::Resample( input.GetPointer(), output.GetPointer(), cases[c].Interpolation, cases[c].Parameter,
+                                defaultValue, matrix, offset );
+
+      std::ostringstream what;
+      what << VDimension << "-D " << name << ", " << cases[c].Name << ", " << threadCounts[t] << " threads";
+      passed = antsEngineTest::Check( antsEngineTest::CountDifferences( resampler->GetOutput(), output.GetPointer(),
+                                                                        2.e-3, what.str() ) == 0, what.str() )
+        && passed;
+      }
+    }
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( previousNumberOfThreads );
+  return passed;
+}
+
+template <unsigned int VDimension>
+bool TestAllMaps( unsigned int seed )
+{
+  typedef itk::Matrix<double, VDimension, VDimension> MatrixType;
+  typedef itk::Vector<double, VDimension>             VectorType;
+
+  bool passed = true;
+
+  MatrixType identity;
+  identity.SetIdentity();
+  VectorType zero;
+  zero.Fill( 0.0 );
+  passed = TestResampling<VDimension>( identity, zero, "identity", seed ) && passed;
+
+  MatrixType flipped;
+  flipped.SetIdentity();
+  flipped[0][0] = -1.0;
+  flipped[VDimension - 1][VDimension - 1] = 0.87;
+  VectorType shift;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    shift[d] = 0.31 + 0.5 * d;
+    }
+  shift[0] = 19.61;
+  passed = TestResampling<VDimension>( flipped, shift, "flipped and scaled", seed + 1 ) && passed;
+
+  // a rotation of 17 degrees in the plane of the first and last axes, and
+  // a shear of the first two
+  const double angle = 17.0 * vnl_math::pi / 180.0;
+  MatrixType   rotated;
+  rotated.SetIdentity();
+  rotated[0][0] = std::cos( angle );
+  rotated[0][VDimension - 1] = -std::sin( angle );
+  rotated[VDimension - 1][0] = std::sin( angle );
+  rotated[VDimension - 1][VDimension - 1] = std::cos( angle );
+  rotated[1][0] += 0.12;
+  passed = TestResampling<VDimension>( rotated, shift, "rotated", seed + 2 ) && passed;
+
+  return passed;
+}
+} // anonymous namespace
+
+int antsScanlineResamplingTest( int, char * [] )
+{
+  bool passed = true;
+
+  passed = TestAllMaps<2>( 2016 ) && passed;
+  passed = TestAllMaps<3>( 2017 ) && passed;
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "antsScanlineResamplingTest passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -7,6 +7,10 @@
 
 #include "itkImage.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkFlatStructuringElement.h"
+#include "itkNeighborhood.h"
+#include "itkNeighborhoodCooccurrenceTextureImageFilter.h"
+#include "itkVectorImage.h"
 
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkScalarImageToTextureFeaturesFilter.h"
@@ -48,7 +52,7 @@ int TextureCooccurrenceFeatures( int argc, char *argv[] )
 
   typename ImageType::Pointer mask = NULL;
   PixelType label = itk::NumericTraits<PixelType>::OneValue();
-  if ( argc > 4 )
+  if ( argc > 4 && std::string( argv[4] ) != std::string( "none" ) )
     {
     ReadImage<ImageType>( mask, argv[4] );
     textureFilter->SetMaskImage( mask );
@@ -88,6 +92,78 @@ int TextureCooccurrenceFeatures( int argc, char *argv[] )
       }
     }
 
+  if( argc > 7 )
+    {
+    // Per-pixel texture maps.  The gray levels are binned, and each pixel is
+    // given the bins of its neighbors at the offsets of the first half of a
+    // radius 1 neighborhood (as the global features use), so that the moving
+    // histograms only need to add and remove pixels as the window slides.
+    typedef unsigned short                                     BinType;
+    typedef itk::VectorImage<BinType, ImageDimension>          BinImageType;
+    typedef itk::VectorImage<RealType, ImageDimension>         FeatureImageType;
+    typedef itk::FlatStructuringElement<ImageDimension>        KernelType;
+    typedef itk::NeighborhoodCooccurrenceTextureImageFilter<BinImageType, FeatureImageType, KernelType>
+      LocalTextureFilterType;
+
+    const unsigned int radiusValue = static_cast<unsigned int>( atoi( argv[6] ) );
+    const BinType      outside = itk::NumericTraits<BinType>::max();
+    numberOfBins = std::min( numberOfBins, static_cast<unsigned int>( outside ) );
+
+    const ImageType *image = rescaler->GetOutput();
+    const typename ImageType::RegionType region = image->GetLargestPossibleRegion();
+
+    std::vector<typename ImageType::OffsetType> offsets;
+      {
+      itk::Neighborhood<PixelType, ImageDimension> neighborhood;
+      neighborhood.SetRadius( 1 );
+      for( unsigned int d = 0; d < neighborhood.GetCenterNeighborhoodIndex(); d++ )
+        {
+        offsets.push_back( neighborhood.GetOffset( d ) );
+        }
+      }
+
+    typename BinImageType::Pointer binImage = BinImageType::New();
+    binImage->CopyInformation( image );
+    binImage->SetRegions( region );
+    binImage->SetNumberOfComponentsPerPixel( offsets.size() + 1 );
+    binImage->Allocate();
+
+    const RealType range = ( maxValue > minValue ) ? ( maxValue - minValue ) : 1.0;
+    itk::VariableLengthVector<BinType> bins( offsets.size() + 1 );
+    for( ItI.GoToBegin(); !ItI.IsAtEnd(); ++ItI )
+      {
+      const typename ImageType::IndexType index = ItI.GetIndex();
+      for( unsigned int k = 0; k <= offsets.size(); k++ )
+        {
+        typename ImageType::IndexType neighbor = index;
+        if( k > 0 )
+          {
+          neighbor += offsets[k - 1];
+          }
+        if( !region.IsInside( neighbor ) || ( mask && mask->GetPixel( neighbor ) != label ) )
+          {
+          bins[k] = outside;
+          continue;
+          }
+        const RealType fraction = ( image->GetPixel( neighbor ) - minValue ) / range;
+        bins[k] = static_cast<BinType>( std::max( 0, std::min( static_cast<int>( numberOfBins ) - 1,
+                                                             static_cast<int>( fraction * numberOfBins ) ) ) );
+        }
+      binImage->SetPixel( index, bins );
+      }
+
+    typename KernelType::SizeType radius;
+    radius.Fill( radiusValue );
+
+    typename LocalTextureFilterType::Pointer localTextureFilter = LocalTextureFilterType::New();
+    localTextureFilter->SetKernel( KernelType::Box( radius ) );
+    localTextureFilter->SetInput( binImage );
+    localTextureFilter->Update();
+
+    WriteImage<FeatureImageType>( localTextureFilter->GetOutput(), argv[7] );
+    return EXIT_SUCCESS;
+    }
+
   textureFilter->SetPixelValueMinMax( minValue, maxValue );
   textureFilter->SetNumberOfBinsPerAxis( numberOfBins );
   textureFilter->FastCalculationsOff();
@@ -198,8 +274,10 @@ private:
   if ( argc < 3 )
     {
     std::cerr << "Usage: " << argv[0] << " imageDimension inputImage "
-     << "[numberOfBinsPerAxis=256] [maskImage] [maskLabel=1]" << std::endl;
+     << "[numberOfBinsPerAxis=256] [maskImage|none] [maskLabel=1] [neighborhoodRadius outputFeatureImage]" << std::endl;
     std::cerr << "Features: Energy,Entropy,InverseDifferenceMoment,Inertia,ClusterShade,ClusterProminence" << std::endl;
+    std::cerr << "Given a neighborhood radius and an output image, the features of the neighborhood of each "
+              << "pixel are written as the components of a vector image instead." << std::endl;
     exit( 1 );
     }
 
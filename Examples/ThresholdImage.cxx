@@ -21,22 +21,21 @@
 #include <iostream>
 #include <fstream>
 
-#include "itkArray.h"
+#include "itkBinaryThresholdImageFilter.h"
 #include "itkExtractImageFilter.h"
+#include "itkHistogram.h"
 #include "itkImage.h"
 #include "ReadWriteData.h"
+#include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
-#include "itkKdTreeBasedKmeansEstimator.h"
-#include "itkLabelStatisticsImageFilter.h"
 #include "itkLinearInterpolateImageFunction.h"
-#include "itkListSample.h"
-#include "itkMinimumDecisionRule.h"
 #include "itkMultiplyImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkNeighborhoodIterator.h"
-#include "itkOtsuMultipleThresholdsImageFilter.h"
+#include "itkOtsuMultipleThresholdsCalculator.h"
 #include "itkResampleImageFilter.h"
-#include "itkSampleClassifierFilter.h"
-#include "itkWeightedCentroidKdTreeGenerator.h"
+
+#include <vector>
 
 namespace ants
 {
@@ -151,283 +150,369 @@ LabelSurface(typename TImage::PixelType foreground,
   return Image;
 }
 
+// Otsu and k-means both work on a histogram of the intensities within the
+// mask.  The histogram is built on all threads, each binning a slab along
+// the last dimension, and the labels are assigned the same way.
 template <class TImage, class TMaskImage>
-typename TImage::Pointer OtsuThreshold(
-  int NumberOfThresholds, typename TImage::Pointer input, typename TMaskImage::Pointer maskImage )
+struct ThresholdImageThreadStruct
+  {
+  enum { RangePass = 0, HistogramPass, OtsuLabelPass, MaskedOtsuLabelPass, KmeansLabelPass };
+
+  const TImage *                    Input;
+  const TMaskImage *                Mask;
+  typename TMaskImage::PixelType    MaskLabel;
+  TImage *                          Output;
+  unsigned int                      Pass;
+  unsigned int                      NumberOfThreads;
+
+  // per thread intensity range and histograms
+  std::vector<double>               Minima;
+  std::vector<double>               Maxima;
+  std::vector<std::vector<double> > Counts;
+  std::vector<std::vector<double> > Sums;
+
+  double                            Minimum;
+  double                            Maximum;
+  unsigned int                      NumberOfBins;
+
+  // thresholds or sorted cluster means, for the label passes
+  std::vector<double>               Values;
+  };
+
+template <class TImage>
+bool GetThresholdImageSlab( const TImage *image, itk::ThreadIdType threadId, itk::ThreadIdType numberOfThreads,
+                            typename TImage::RegionType & slab )
 {
-  std::cout << " Otsu Thresh with " << NumberOfThresholds << " thresholds" << std::endl;
+  const unsigned int lastDimension = TImage::ImageDimension - 1;
+
+  slab = image->GetLargestPossibleRegion();
+
+  const itk::SizeValueType numberOfSlices = slab.GetSize()[lastDimension];
+  const itk::SizeValueType firstSlice = numberOfSlices * threadId / numberOfThreads;
+  const itk::SizeValueType endSlice = numberOfSlices * ( threadId + 1 ) / numberOfThreads;
+
+  slab.SetIndex( lastDimension, slab.GetIndex()[lastDimension] + firstSlice );
+  slab.SetSize( lastDimension, endSlice - firstSlice );
+  return endSlice > firstSlice;
+}
+
+/** whether the voxel of the mask iterator is in the mask, moving it on */
+template <class TImage, class TMaskImage>
+inline bool IsInThresholdMask( const ThresholdImageThreadStruct<TImage, TMaskImage> *str,
+                               itk::ImageRegionConstIterator<TMaskImage> & ItM )
+{
+  if( !str->Mask )
+    {
+    return true;
+    }
+  const bool inside = ( ItM.Get() == str->MaskLabel );
+  ++ItM;
+  return inside;
+}
+
+template <class TImage, class TMaskImage>
+ITK_THREAD_RETURN_TYPE ThresholdImageThreaderCallback( void *arg )
+{
+  typedef ThresholdImageThreadStruct<TImage, TMaskImage> ThreadStructType;
 
-  if( maskImage.IsNull() )
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *str = static_cast<ThreadStructType *>( info->UserData );
+  const itk::ThreadIdType threadId = info->ThreadID;
+
+  typename TImage::RegionType slab;
+  if( !GetThresholdImageSlab<TImage>( str->Input, threadId, str->NumberOfThreads, slab ) )
     {
-    // Begin Threshold Image
-    typedef itk::OtsuMultipleThresholdsImageFilter<TImage, TImage> InputThresholderType;
-    typename InputThresholderType::Pointer inputThresholder =
-      InputThresholderType::New();
-
-    inputThresholder->SetInput( input );
-    /*
-    inputThresholder->SetInsideValue(  replaceval );
-    int outval=0;
-    if ((float) replaceval == (float) -1) outval=1;
-    inputThresholder->SetOutsideValue( outval );
-    */
-    inputThresholder->SetNumberOfThresholds( NumberOfThresholds );
-
-    inputThresholder->Update();
-
-    return inputThresholder->GetOutput();
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  itk::ImageRegionConstIterator<TImage> ItI( str->Input, slab );
+  itk::ImageRegionConstIterator<TMaskImage> ItM;
+  if( str->Mask )
+    {
+    ItM = itk::ImageRegionConstIterator<TMaskImage>( str->Mask, slab );
+    }
+
+  if( str->Pass == ThreadStructType::RangePass )
+    {
+    double minValue = itk::NumericTraits<double>::max();
+    double maxValue = itk::NumericTraits<double>::NonpositiveMin();
+    for( ; !ItI.IsAtEnd(); ++ItI )
+      {
+      if( IsInThresholdMask( str, ItM ) )
+        {
+        minValue = std::min( minValue, static_cast<double>( ItI.Get() ) );
+        maxValue = std::max( maxValue, static_cast<double>( ItI.Get() ) );
+        }
+      }
+    str->Minima[threadId] = minValue;
+    str->Maxima[threadId] = maxValue;
+    }
+  else if( str->Pass == ThreadStructType::HistogramPass )
+    {
+    std::vector<double> & counts = str->Counts[threadId];
+    std::vector<double> & sums = str->Sums[threadId];
+    counts.assign( str->NumberOfBins, 0.0 );
+    sums.assign( str->NumberOfBins, 0.0 );
+
+    const double range = str->Maximum - str->Minimum;
+    const double scale = ( range > 0.0 ) ? str->NumberOfBins / range : 0.0;
+    for( ; !ItI.IsAtEnd(); ++ItI )
+      {
+      if( IsInThresholdMask( str, ItM ) )
+        {
+        const double value = ItI.Get();
+        const unsigned int bin = std::min( static_cast<unsigned int>( ( value - str->Minimum ) * scale ),
+                                           str->NumberOfBins - 1 );
+        counts[bin] += 1.0;
+        sums[bin] += value;
+        }
+      }
     }
   else
     {
-    typedef TImage                                    ImageType;
-    typedef TMaskImage                                MaskImageType;
-    typedef float                                     PixelType;
-
-    unsigned int numberOfBins = 200;
-    int maskLabel = 1;
-
-    itk::ImageRegionIterator<ImageType> ItI( input,
-      input->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<MaskImageType> ItM( maskImage,
-      maskImage->GetLargestPossibleRegion() );
-    PixelType maxValue = itk::NumericTraits<PixelType>::min();
-    PixelType minValue = itk::NumericTraits<PixelType>::max();
-    for ( ItM.GoToBegin(), ItI.GoToBegin(); !ItI.IsAtEnd(); ++ItM, ++ItI )
+    const std::vector<double> & values = str->Values;
+
+    itk::ImageRegionIterator<TImage> ItO( str->Output, slab );
+    for( ; !ItI.IsAtEnd(); ++ItI, ++ItO )
       {
-      if ( ItM.Get() == maskLabel )
+      if( !IsInThresholdMask( str, ItM ) )
+        {
+        ItO.Set( 0 );
+        continue;
+        }
+      const double value = ItI.Get();
+      unsigned int label = 0;
+      if( str->Pass == ThreadStructType::OtsuLabelPass )
         {
-        if ( ItI.Get() < minValue )
+        // as itk::OtsuMultipleThresholdsImageFilter, labels 0 to the number of thresholds
+        while( label < values.size() && value > values[label] )
           {
-          minValue = ItI.Get();
+          label++;
           }
-        else if ( ItI.Get() > maxValue )
+        }
+      else if( str->Pass == ThreadStructType::MaskedOtsuLabelPass )
+        {
+        while( label < values.size() && value >= values[label] )
           {
-          maxValue = ItI.Get();
+          label++;
           }
+        label++;
         }
-      }
-
-    typedef itk::LabelStatisticsImageFilter<ImageType, MaskImageType> StatsType;
-    typename StatsType::Pointer stats = StatsType::New();
-    stats->SetInput( input );
-    stats->SetLabelInput( maskImage );
-    stats->UseHistogramsOn();
-    stats->SetHistogramParameters( numberOfBins, minValue, maxValue );
-    stats->Update();
-
-    typedef itk::OtsuMultipleThresholdsCalculator<typename StatsType::HistogramType>
-      OtsuType;
-    typename OtsuType::Pointer otsu = OtsuType::New();
-    otsu->SetInputHistogram( stats->GetHistogram( maskLabel ) );
-    otsu->SetNumberOfThresholds( NumberOfThresholds );
-    otsu->Update();
-
-    typename OtsuType::OutputType thresholds = otsu->GetOutput();
-
-    typename ImageType::Pointer output = ImageType::New();
-    output->CopyInformation( maskImage );
-    output->SetRegions( maskImage->GetLargestPossibleRegion() );
-    output->Allocate();
-    output->FillBuffer( 0 );
-
-    itk::ImageRegionIterator<ImageType> ItO( output,
-      output->GetLargestPossibleRegion() );
-    for ( unsigned int i = 0; i < thresholds.size(); i++ )
-      {
-
-      ItI.GoToBegin();
-      ItM.GoToBegin();
-      ItO.GoToBegin();
-      while ( !ItM.IsAtEnd() )
+      else
         {
-        if ( ItM.Get() == maskLabel )
+        for( unsigned int n = 1; n < values.size(); n++ )
           {
-          if ( ItO.Get() == 0 && ItI.Get() < thresholds[i] )
+          if( vnl_math_abs( value - values[n] ) < vnl_math_abs( value - values[label] ) )
             {
-            ItO.Set( i+1 );
+            label = n;
             }
           }
-        ++ItI;
-        ++ItM;
-        ++ItO;
-        }
-      }
-
-    ItI.GoToBegin();
-    ItM.GoToBegin();
-    ItO.GoToBegin();
-    while ( !ItM.IsAtEnd() )
-      {
-      if ( ItM.Get() == maskLabel && ItO.Get() == 0 )
-        {
-        ItO.Set( thresholds.size()+1 );
+        label++;
         }
-      ++ItI;
-      ++ItM;
-      ++ItO;
+      ItO.Set( label );
       }
-    return output;
     }
+  return ITK_THREAD_RETURN_VALUE;
+}
 
+template <class TImage, class TMaskImage>
+void ThresholdImageExecute( ThresholdImageThreadStruct<TImage, TMaskImage> & str, unsigned int pass )
+{
+  str.Pass = pass;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( str.NumberOfThreads );
+  threader->SetSingleMethod( ThresholdImageThreaderCallback<TImage, TMaskImage>, &str );
+  threader->SingleMethodExecute();
 }
 
+/** Histogram of the intensities of input within the mask (all voxels if there
+ * is none) over numberOfBins bins from the minimum to the maximum.  The sum
+ * of the intensities of each bin is kept as well.  Returns false if the mask
+ * is empty. */
 template <class TImage, class TMaskImage>
-typename TImage::Pointer KmeansThreshold(
-  int NumberOfThresholds, typename TImage::Pointer input, typename TMaskImage::Pointer maskImage )
+bool BuildThresholdHistogram( ThresholdImageThreadStruct<TImage, TMaskImage> & str, unsigned int numberOfBins,
+                              std::vector<double> & counts, std::vector<double> & sums )
 {
-  std::cout << " Kmeans with " << NumberOfThresholds << " thresholds" << std::endl;
+  const unsigned int numberOfSlices = str.Input->GetLargestPossibleRegion().GetSize()[TImage::ImageDimension - 1];
 
-  typedef TImage                                    ImageType;
-  typedef TImage                                    LabelImageType;
-  typedef TMaskImage                                MaskImageType;
-  typedef float                                     RealType;
-  typedef int                                       LabelType;
+  str.NumberOfThreads = std::max( std::min( static_cast<unsigned int>(
+                                              itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+                                            numberOfSlices ), 1u );
+  str.Minima.assign( str.NumberOfThreads, itk::NumericTraits<double>::max() );
+  str.Maxima.assign( str.NumberOfThreads, itk::NumericTraits<double>::NonpositiveMin() );
+  str.Counts.assign( str.NumberOfThreads, std::vector<double>( numberOfBins, 0.0 ) );
+  str.Sums.assign( str.NumberOfThreads, std::vector<double>( numberOfBins, 0.0 ) );
 
-  typedef itk::Array<RealType>                            MeasurementVectorType;
-  typedef typename itk::Statistics::ListSample
-    <MeasurementVectorType>                               SampleType;
+  ThresholdImageExecute( str, ThresholdImageThreadStruct<TImage, TMaskImage>::RangePass );
 
-  int maskLabel = 1;
-  if( maskImage.IsNull() )
+  str.Minimum = *std::min_element( str.Minima.begin(), str.Minima.end() );
+  str.Maximum = *std::max_element( str.Maxima.begin(), str.Maxima.end() );
+  if( str.Minimum > str.Maximum )
     {
-    maskImage = AllocImage<MaskImageType>( input, maskLabel );
+    return false;
     }
 
-  unsigned int numberOfTissueClasses = NumberOfThresholds + 1;
-  typename LabelImageType::Pointer output = AllocImage<LabelImageType>( input, 0 );
-
-  typedef itk::LabelStatisticsImageFilter<ImageType, MaskImageType> StatsType;
-  typename StatsType::Pointer stats = StatsType::New();
-  stats->SetInput( input );
-  stats->SetLabelInput( maskImage );
-  stats->UseHistogramsOff();
-  stats->Update();
-
-  RealType minValue = stats->GetMinimum( maskLabel );
-  RealType maxValue = stats->GetMaximum( maskLabel );
-
-  // The code below can be replaced by itkListSampleToImageFilter when we
-  // migrate over to the Statistics classes current in the Review/ directory.
-  //
-  typename SampleType::Pointer sample = SampleType::New();
-  sample->SetMeasurementVectorSize( 1 );
+  str.NumberOfBins = numberOfBins;
+  ThresholdImageExecute( str, ThresholdImageThreadStruct<TImage, TMaskImage>::HistogramPass );
 
-  itk::ImageRegionConstIteratorWithIndex<ImageType> ItI( input,
-                                                    input->GetRequestedRegion() );
-  for( ItI.GoToBegin(); !ItI.IsAtEnd(); ++ItI )
+  counts.assign( numberOfBins, 0.0 );
+  sums.assign( numberOfBins, 0.0 );
+  for( unsigned int t = 0; t < str.NumberOfThreads; t++ )
     {
-    if( !maskImage || maskImage->GetPixel( ItI.GetIndex() ) == maskLabel )
+    for( unsigned int b = 0; b < numberOfBins; b++ )
       {
-      typename SampleType::MeasurementVectorType measurement;
-      measurement.SetSize( 1 );
-      measurement[0] = ItI.Get();
-      sample->PushBack( measurement );
+      counts[b] += str.Counts[t][b];
+      sums[b] += str.Sums[t][b];
       }
     }
+  str.Counts.clear();
+  str.Sums.clear();
+  return true;
+}
 
-  typedef itk::Statistics::WeightedCentroidKdTreeGenerator<SampleType> TreeGeneratorType;
-  typename TreeGeneratorType::Pointer treeGenerator = TreeGeneratorType::New();
-  treeGenerator->SetSample( sample );
-  treeGenerator->SetBucketSize( 16 );
-  treeGenerator->Update();
+template <class TImage, class TMaskImage>
+typename TImage::Pointer OtsuThreshold(
+  int NumberOfThresholds, typename TImage::Pointer input, typename TMaskImage::Pointer maskImage )
+{
+  std::cout << " Otsu Thresh with " << NumberOfThresholds << " thresholds" << std::endl;
 
-  typedef typename TreeGeneratorType::KdTreeType                TreeType;
-  typedef itk::Statistics::KdTreeBasedKmeansEstimator<TreeType> EstimatorType;
-  typename EstimatorType::Pointer estimator = EstimatorType::New();
-  estimator->SetKdTree( treeGenerator->GetOutput() );
-  estimator->SetMaximumIteration( 200 );
-  estimator->SetCentroidPositionChangesThreshold( 0.0 );
+  typedef ThresholdImageThreadStruct<TImage, TMaskImage> ThreadStructType;
 
-  typename EstimatorType::ParametersType initialMeans( numberOfTissueClasses );
+  ThreadStructType str;
+  str.Input = input;
+  str.Mask = maskImage;
+  str.MaskLabel = 1;
 
-  for( unsigned int n = 0; n < numberOfTissueClasses; n++ )
+  // as itk::OtsuMultipleThresholdsImageFilter without a mask, as the former
+  // histogram of itk::LabelStatisticsImageFilter with one
+  const unsigned int numberOfBins = maskImage.IsNull() ? 128 : 200;
+
+  typename TImage::Pointer output = AllocImage<TImage>( input, 0 );
+
+  std::vector<double> counts;
+  std::vector<double> sums;
+  if( !BuildThresholdHistogram( str, numberOfBins, counts, sums ) )
+    {
+    return output;
+    }
+
+  typedef itk::Statistics::Histogram<double> HistogramType;
+  HistogramType::Pointer histogram = HistogramType::New();
+  histogram->SetMeasurementVectorSize( 1 );
+
+  HistogramType::SizeType size( 1 );
+  size[0] = numberOfBins;
+  HistogramType::MeasurementVectorType lowerBound( 1 );
+  HistogramType::MeasurementVectorType upperBound( 1 );
+  lowerBound[0] = str.Minimum;
+  upperBound[0] = str.Maximum;
+  histogram->Initialize( size, lowerBound, upperBound );
+  for( unsigned int b = 0; b < numberOfBins; b++ )
     {
-    initialMeans[n] = minValue + ( maxValue - minValue )
-      * ( static_cast<RealType>( n ) + 0.5 )
-      / static_cast<RealType>( numberOfTissueClasses );
+    histogram->SetFrequency( b, static_cast<HistogramType::AbsoluteFrequencyType>( counts[b] ) );
     }
-  estimator->SetParameters( initialMeans );
-  estimator->StartOptimization();
 
-  //
-  // Classify the samples
-  //
-  typedef itk::Statistics::MinimumDecisionRule DecisionRuleType;
-  typename DecisionRuleType::Pointer decisionRule = DecisionRuleType::New();
+  typedef itk::OtsuMultipleThresholdsCalculator<HistogramType> OtsuType;
+  OtsuType::Pointer otsu = OtsuType::New();
+  otsu->SetInputHistogram( histogram );
+  otsu->SetNumberOfThresholds( NumberOfThresholds );
+  otsu->Update();
 
-  typedef itk::Statistics::SampleClassifierFilter<SampleType> ClassifierType;
-  typename ClassifierType::Pointer classifier = ClassifierType::New();
-  classifier->SetDecisionRule( decisionRule );
-  classifier->SetInput( sample );
-  classifier->SetNumberOfClasses( numberOfTissueClasses );
+  const OtsuType::OutputType & thresholds = otsu->GetOutput();
+  str.Values.assign( thresholds.begin(), thresholds.end() );
+  str.Output = output;
+  ThresholdImageExecute( str, maskImage.IsNull() ? ThreadStructType::OtsuLabelPass :
+                         ThreadStructType::MaskedOtsuLabelPass );
 
-  typename ClassifierType::ClassLabelVectorObjectType::Pointer classLabels =
-    ClassifierType::ClassLabelVectorObjectType::New();
-  classifier->SetClassLabels( classLabels );
-  typename ClassifierType::ClassLabelVectorType & classLabelVector =
-    classLabels->Get();
+  return output;
+}
 
-  //
-  // Order the cluster means so that the lowest mean of the input image
-  // corresponds to label '1', the second lowest to label '2', etc.
-  //
-  std::vector<RealType> estimatorParameters;
-  for( unsigned int n = 0; n < numberOfTissueClasses; n++ )
+template <class TImage, class TMaskImage>
+typename TImage::Pointer KmeansThreshold(
+  int NumberOfThresholds, typename TImage::Pointer input, typename TMaskImage::Pointer maskImage )
+{
+  std::cout << " Kmeans with " << NumberOfThresholds << " thresholds" << std::endl;
+
+  typedef ThresholdImageThreadStruct<TImage, TMaskImage> ThreadStructType;
+
+  ThreadStructType str;
+  str.Input = input;
+  str.Mask = maskImage;
+  str.MaskLabel = 1;
+
+  const unsigned int numberOfTissueClasses = NumberOfThresholds + 1;
+  typename TImage::Pointer output = AllocImage<TImage>( input, 0 );
+
+  // The bins are fine enough, and clustered by the mean intensity of their
+  // voxels, so that the means are those of clustering the voxels themselves.
+  const unsigned int numberOfBins = 4096;
+
+  std::vector<double> counts;
+  std::vector<double> sums;
+  if( !BuildThresholdHistogram( str, numberOfBins, counts, sums ) )
     {
-    estimatorParameters.push_back( estimator->GetParameters()[n] );
+    return output;
     }
-  std::sort( estimatorParameters.begin(), estimatorParameters.end() );
 
-  typedef itk::Statistics::DistanceToCentroidMembershipFunction
-    <MeasurementVectorType> MembershipFunctionType;
-  typename ClassifierType::MembershipFunctionVectorObjectType::Pointer
-  membershipFunctions = ClassifierType::MembershipFunctionVectorObjectType::New();
-  typename ClassifierType::MembershipFunctionVectorType & membershipFunctionsVector =
-    membershipFunctions->Get();
-
-  classifier->SetMembershipFunctions( membershipFunctions );
+  std::vector<double> means( numberOfTissueClasses );
   for( unsigned int n = 0; n < numberOfTissueClasses; n++ )
     {
-    typename MembershipFunctionType::Pointer
-    membershipFunction = MembershipFunctionType::New();
-    membershipFunction->SetMeasurementVectorSize(
-      sample->GetMeasurementVectorSize() );
-    typename MembershipFunctionType::CentroidType centroid;
-    itk::NumericTraits<typename MembershipFunctionType::CentroidType>::SetLength(
-      centroid, sample->GetMeasurementVectorSize() );
-    centroid[0] = estimatorParameters[n];
-    membershipFunction->SetCentroid( centroid );
-    membershipFunctionsVector.push_back( membershipFunction.GetPointer() );
-
-    classLabelVector.push_back(
-      static_cast<typename ClassifierType::ClassLabelType>( n + 1 ) );
+    means[n] = str.Minimum + ( str.Maximum - str.Minimum )
+      * ( static_cast<double>( n ) + 0.5 ) / static_cast<double>( numberOfTissueClasses );
     }
-  classifier->Update();
 
-  //
-  // Classify the voxels
-  //
-  typedef typename ClassifierType::MembershipSampleType ClassifierOutputType;
-  typedef typename ClassifierOutputType::ConstIterator  LabelIterator;
-
-  itk::ImageRegionIteratorWithIndex<LabelImageType> ItO( output,
-                                                         output->GetRequestedRegion() );
-  ItO.GoToBegin();
-  LabelIterator it = classifier->GetOutput()->Begin();
-  while( it != classifier->GetOutput()->End() )
+  // Lloyd iterations on the weighted bins until the means no longer move
+  std::vector<double> classCounts( numberOfTissueClasses );
+  std::vector<double> classSums( numberOfTissueClasses );
+  for( unsigned int iteration = 0; iteration < 200; iteration++ )
     {
-    if( !maskImage || maskImage->GetPixel( ItO.GetIndex() ) == maskLabel )
+    std::fill( classCounts.begin(), classCounts.end(), 0.0 );
+    std::fill( classSums.begin(), classSums.end(), 0.0 );
+    for( unsigned int b = 0; b < numberOfBins; b++ )
       {
-      ItO.Set( it.GetClassLabel() );
-      ++it;
+      if( counts[b] == 0.0 )
+        {
+        continue;
+        }
+      const double value = sums[b] / counts[b];
+      unsigned int nearest = 0;
+      for( unsigned int n = 1; n < numberOfTissueClasses; n++ )
+        {
+        if( vnl_math_abs( value - means[n] ) < vnl_math_abs( value - means[nearest] ) )
+          {
+          nearest = n;
+          }
+        }
+      classCounts[nearest] += counts[b];
+      classSums[nearest] += sums[b];
+      }
+
+    bool changed = false;
+    for( unsigned int n = 0; n < numberOfTissueClasses; n++ )
+      {
+      if( classCounts[n] > 0.0 && classSums[n] / classCounts[n] != means[n] )
+        {
+        means[n] = classSums[n] / classCounts[n];
+        changed = true;
+        }
       }
-    else
+    if( !changed )
       {
-      ItO.Set( itk::NumericTraits<LabelType>::ZeroValue() );
+      break;
       }
-    ++ItO;
     }
 
+  //
+  // Order the cluster means so that the lowest mean of the input image
+  // corresponds to label '1', the second lowest to label '2', etc.
+  //
+  std::sort( means.begin(), means.end() );
+
+  str.Values = means;
+  str.Output = output;
+  ThresholdImageExecute( str, ThreadStructType::KmeansLabelPass );
+
   return output;
 }
 
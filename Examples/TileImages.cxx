@@ -1,7 +1,11 @@
 #include "antsUtilities.h"
 #include <algorithm>
 
+#include "antsAllocImage.h"
+#include "antsCopyImageRegion.h"
+#include "antsPrefetchImageReader.h"
 #include "itkExtractImageFilter.h"
+#include "itkImageFileReader.h"
 #include "itkTileImageFilter.h"
 #include "ReadWriteData.h"
 
@@ -11,6 +15,74 @@
 namespace ants
 {
 
+/** The tiles of TileImageFilter for inputs of the given sizes: the tile
+ * along every axis is as large as the largest input in its row, and if the
+ * layout has a 0 in the last dimension enough tiles are added for all of
+ * the inputs.  Inputs past the last tile are not used. */
+template <unsigned int ImageDimension>
+void ComputeTileIndices( const std::vector<itk::Size<ImageDimension> > & inputSizes,
+                         itk::FixedArray<unsigned int, ImageDimension> layout,
+                         std::vector<itk::Index<ImageDimension> > & tileIndices,
+                         itk::Size<ImageDimension> & outputSize )
+{
+  const unsigned long numberOfInputs = inputSizes.size();
+
+  if( layout[ImageDimension - 1] == 0 )
+    {
+    unsigned long used = 1;
+    for( unsigned int d = 0; d < ImageDimension - 1; d++ )
+      {
+      used *= layout[d];
+      }
+    layout[ImageDimension - 1] = ( used > 0 && numberOfInputs > 0 ) ? ( numberOfInputs - 1 ) / used + 1 : 1;
+    }
+  unsigned long numberOfTiles = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    numberOfTiles *= layout[d];
+    }
+
+  std::vector<std::vector<itk::SizeValueType> > sizes( ImageDimension );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    sizes[d].assign( layout[d], 0 );
+    }
+  const unsigned long numberOfTiledInputs = std::min( numberOfInputs, numberOfTiles );
+  for( unsigned long n = 0; n < numberOfTiledInputs; n++ )
+    {
+    unsigned long tile = n;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const unsigned long t = tile % layout[d];
+      tile /= layout[d];
+      sizes[d][t] = std::max( sizes[d][t], inputSizes[n][d] );
+      }
+    }
+
+  std::vector<std::vector<itk::IndexValueType> > offsets( ImageDimension );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    offsets[d].assign( layout[d], 0 );
+    outputSize[d] = 0;
+    for( unsigned int t = 0; t < layout[d]; t++ )
+      {
+      offsets[d][t] = outputSize[d];
+      outputSize[d] += sizes[d][t];
+      }
+    }
+
+  tileIndices.resize( numberOfTiledInputs );
+  for( unsigned long n = 0; n < numberOfTiledInputs; n++ )
+    {
+    unsigned long tile = n;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      tileIndices[n][d] = offsets[d][tile % layout[d]];
+      tile /= layout[d];
+      }
+    }
+}
+
 template <unsigned int ImageDimension>
 int TileImages( unsigned int argc, char *argv[] )
 {
@@ -27,16 +99,77 @@ int TileImages( unsigned int argc, char *argv[] )
     array[d] = layout[d];
     }
   filter->SetLayout( array );
+
+  // only the headers are read here, the filter gives the geometry of the output
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  std::vector<std::string>                         fileNames;
+  std::vector<itk::Size<ImageDimension> >          inputSizes;
   for( unsigned int n = 4; n < argc; n++ )
     {
-    typename ImageType::Pointer inputImage;
-    ReadImage<ImageType>( inputImage, argv[n] );
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( argv[n] );
+    try
+      {
+      reader->UpdateOutputInformation();
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      std::cerr << "Exception caught during reading " << argv[n] << std::endl;
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+      }
+    fileNames.push_back( argv[n] );
+    inputSizes.push_back( reader->GetOutput()->GetLargestPossibleRegion().GetSize() );
+    filter->SetInput( n - 4, reader->GetOutput() );
+    }
+  filter->UpdateOutputInformation();
+
+  std::vector<itk::Index<ImageDimension> > tileIndices;
+  itk::Size<ImageDimension>                outputSize;
+  ComputeTileIndices<ImageDimension>( inputSizes, array, tileIndices, outputSize );
+
+  const typename ImageType::RegionType outputRegion = filter->GetOutput()->GetLargestPossibleRegion();
+  if( outputRegion.GetSize() != outputSize )
+    {
+    // not the tiling computed above, let the filter read and paste everything
+    filter->Update();
+    WriteImage<ImageType>( filter->GetOutput(), argv[2] );
+    return EXIT_SUCCESS;
+    }
 
-    filter->SetInput( n - 4, inputImage );
+  // the inputs are read ahead on two threads and pasted one at a time, so
+  // only a few of them are held with the output
+  typename ImageType::Pointer output = AllocImage<ImageType>( outputRegion,
+                                                             filter->GetOutput()->GetSpacing(),
+                                                             filter->GetOutput()->GetOrigin(),
+                                                             filter->GetOutput()->GetDirection(), 0 );
+  fileNames.resize( tileIndices.size() );
+  filter = ITK_NULLPTR;
+
+  PrefetchImageReader<ImageType> tileReader;
+  tileReader.SetFileNames( fileNames );
+  tileReader.SetNumberOfThreads( 2 );
+  tileReader.SetQueueSize( 2 );
+  tileReader.Start();
+  for( unsigned long n = 0; n < tileIndices.size(); n++ )
+    {
+    typename ImageType::Pointer inputImage = tileReader.GetNextImage();
+    if( inputImage.IsNull() )
+      {
+      std::cerr << "Could not read " << fileNames[n] << std::endl;
+      return EXIT_FAILURE;
+      }
+    typename ImageType::IndexType targetIndex;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      targetIndex[d] = outputRegion.GetIndex()[d] + tileIndices[n][d];
+      }
+    CopyImageRegion( inputImage.GetPointer(), inputImage->GetLargestPossibleRegion(), output.GetPointer(),
+                     targetIndex );
     }
-  filter->Update();
+  tileReader.Stop();
 
-  WriteImage<ImageType>( filter->GetOutput(), argv[2] );
+  WriteImage<ImageType>( output, argv[2] );
 
   return EXIT_SUCCESS;
 }
@@ -122,6 +255,10 @@ int CreateMosaic( unsigned int argc, char *argv[] )
   FilterType::Pointer filter = FilterType::New();
   filter->SetLayout( array );
 
+  // the slices are not extracted, the filter only gives the geometry of the
+  // output and the slices are copied into their tiles from the volume
+  typedef itk::ExtractImageFilter<ImageType, SliceType> ExtracterType;
+  std::vector<ExtracterType::Pointer> extracters( numberOfSlices );
   for( unsigned int n = 0; n < numberOfSlices; n++ )
     {
     ImageType::IndexType index;
@@ -130,18 +267,77 @@ int CreateMosaic( unsigned int argc, char *argv[] )
     region.SetIndex( index );
     region.SetSize( size );
 
-    typedef itk::ExtractImageFilter<ImageType, SliceType> ExtracterType;
-    ExtracterType::Pointer extracter = ExtracterType::New();
-    extracter->SetInput( inputImage );
-    extracter->SetExtractionRegion( region );
-    extracter->SetDirectionCollapseToIdentity();
-    extracter->Update();
+    extracters[n] = ExtracterType::New();
+    extracters[n]->SetInput( inputImage );
+    extracters[n]->SetExtractionRegion( region );
+    extracters[n]->SetDirectionCollapseToIdentity();
 
-    filter->SetInput( n, extracter->GetOutput() );
+    filter->SetInput( n, extracters[n]->GetOutput() );
+    }
+  filter->UpdateOutputInformation();
+
+  // the axes of the volume along the slices
+  unsigned int sliceAxes[ImageDimension - 1];
+  for( unsigned int d = 0, k = 0; d < ImageDimension; d++ )
+    {
+    if( d != static_cast<unsigned int>( layout[0] ) )
+      {
+      sliceAxes[k++] = d;
+      }
+    }
+  itk::SizeValueType   sliceSize[ImageDimension - 1];
+  itk::OffsetValueType sourceStrides[ImageDimension - 1];
+  for( unsigned int k = 0; k < ImageDimension - 1; k++ )
+    {
+    sliceSize[k] = size[sliceAxes[k]];
+    sourceStrides[k] = inputImage->GetOffsetTable()[sliceAxes[k]];
+    }
+
+  std::vector<SliceType::SizeType> inputSizes( numberOfSlices );
+  for( unsigned int n = 0; n < numberOfSlices; n++ )
+    {
+    for( unsigned int k = 0; k < ImageDimension - 1; k++ )
+      {
+      inputSizes[n][k] = sliceSize[k];
+      }
+    }
+  std::vector<SliceType::IndexType> tileIndices;
+  SliceType::SizeType               outputSize;
+  ComputeTileIndices<ImageDimension - 1>( inputSizes, array, tileIndices, outputSize );
+
+  const SliceType::RegionType outputRegion = filter->GetOutput()->GetLargestPossibleRegion();
+  if( outputRegion.GetSize() != outputSize )
+    {
+    filter->Update();
+    WriteImage<SliceType>( filter->GetOutput(), argv[2] );
+    return EXIT_SUCCESS;
+    }
+
+  SliceType::Pointer output = AllocImage<SliceType>( outputRegion, filter->GetOutput()->GetSpacing(),
+                                                     filter->GetOutput()->GetOrigin(),
+                                                     filter->GetOutput()->GetDirection(), 0 );
+  filter = ITK_NULLPTR;
+  extracters.clear();
+
+  itk::OffsetValueType targetStrides[ImageDimension - 1];
+  for( unsigned int k = 0; k < ImageDimension - 1; k++ )
+    {
+    targetStrides[k] = output->GetOffsetTable()[k];
+    }
+  for( unsigned long n = 0; n < tileIndices.size(); n++ )
+    {
+    SliceType::IndexType targetIndex;
+    for( unsigned int k = 0; k < ImageDimension - 1; k++ )
+      {
+      targetIndex[k] = outputRegion.GetIndex()[k] + tileIndices[n][k];
+      }
+    const PixelType *source = inputImage->GetBufferPointer()
+      + static_cast<itk::OffsetValueType>( n ) * inputImage->GetOffsetTable()[layout[0]];
+    CopyPixelBlock( source, sourceStrides, output->GetBufferPointer() + output->ComputeOffset( targetIndex ),
+                    targetStrides, sliceSize, ImageDimension - 1 );
     }
-  filter->Update();
 
-  WriteImage<SliceType>( filter->GetOutput(), argv[2] );
+  WriteImage<SliceType>( output, argv[2] );
 
   return EXIT_SUCCESS;
 }
@@ -21,6 +21,10 @@
 #include "antsSCCANObject.h"
 #include "ReadWriteData.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
 #include <vnl/vnl_vector.h>
 #include <vnl/vnl_matrix.h>
 #include "itkVariableLengthVector.h"
@@ -51,6 +55,103 @@ double vnl_pearson_corr( vnl_vector<TComp> v1, vnl_vector<TComp> v2 )
   return numer / denom;
 }
 
+template <class NetworkType>
+struct RegionSCCAThreadStruct
+  {
+  typedef itk::ants::antsSCCANObject<NetworkType, double> SCCANType;
+  typedef typename SCCANType::MatrixType                  MatrixType;
+
+  typename NetworkType::Pointer                       Network;
+  const std::vector<MatrixType> *                     RegionMatrices;
+  std::vector<std::pair<unsigned int, unsigned int> > Pairs;
+  unsigned int                                        NEvec;
+  unsigned int                                        Iterations;
+  float                                               Sparsity;
+  bool                                                UseL1;
+  float                                               GradStep;
+  bool                                                KeepPositive;
+  unsigned int                                        MinClusterSize;
+  unsigned int                                        NextPair;
+  itk::SimpleFastMutexLock                            Mutex;
+  };
+
+template <class NetworkType>
+ITK_THREAD_RETURN_TYPE RegionSCCAThreaderCallback( void *arg )
+{
+  typedef itk::ants::antsSCCANObject<NetworkType, double> SCCANType;
+  typedef typename SCCANType::MatrixType                  MatrixType;
+  typedef typename SCCANType::VectorType                  VectorType;
+
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  RegionSCCAThreadStruct<NetworkType> * str = static_cast<RegionSCCAThreadStruct<NetworkType> *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int n = str->NextPair++;
+    str->Mutex.Unlock();
+    if( n >= str->Pairs.size() )
+      {
+      break;
+      }
+    const unsigned int i = str->Pairs[n].first;
+    const unsigned int j = str->Pairs[n].second;
+    const MatrixType & P = ( *str->RegionMatrices )[i];
+    const MatrixType & Q = ( *str->RegionMatrices )[j];
+
+    // Correlation magic goes here
+    typename SCCANType::Pointer cca = SCCANType::New();
+    // the region pairs are already spread over the threads
+    cca->SetNumberOfThreads( 1 );
+    cca->SetSilent( true );
+    cca->SetMaximumNumberOfIterations( str->Iterations );
+    cca->SetUseL1( str->UseL1 );
+    cca->SetGradStep( str->GradStep );
+    cca->SetKeepPositiveP( str->KeepPositive );
+    cca->SetKeepPositiveQ( str->KeepPositive );
+    cca->SetFractionNonZeroP( str->Sparsity );
+    cca->SetFractionNonZeroQ( str->Sparsity );
+    cca->SetMinClusterSizeP( str->MinClusterSize );
+    cca->SetMinClusterSizeQ( str->MinClusterSize );
+    cca->SetMatrixP( P );
+    cca->SetMatrixQ( Q );
+
+    // is truecorr just sccancorrs[0]?
+    cca->SparsePartialArnoldiCCA( str->NEvec );
+
+    VectorType pVec = cca->GetVariateP();
+    for ( unsigned int ip=0; ip<pVec.size(); ip++)
+      {
+      pVec[ip] = vnl_math_abs( pVec[ip] );
+      }
+    pVec = P * pVec;
+
+    VectorType qVec = cca->GetVariateQ();
+    for ( unsigned int iq=0; iq<qVec.size(); iq++)
+      {
+      qVec[iq] = vnl_math_abs( qVec[iq] );
+      }
+    qVec = Q * qVec;
+
+    double final_corr = vnl_pearson_corr(pVec,qVec);
+    if ( ! vnl_math_isfinite( final_corr ) )
+      {
+      final_corr = 0.0;
+      }
+
+    // each pair writes its own two pixels of the preallocated network
+    typename NetworkType::IndexType connIdx;
+    connIdx[0] = i;
+    connIdx[1] = j;
+    str->Network->SetPixel( connIdx, final_corr );
+    connIdx[0] = j;
+    connIdx[1] = i;
+    str->Network->SetPixel( connIdx, final_corr );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <class NetworkType>
 bool RegionSCCA(typename NetworkType::Pointer network, typename NetworkType::Pointer time, typename NetworkType::Pointer labels,
                 unsigned int nLabels, unsigned int minRegionSize, unsigned int n_evec, unsigned int iterct, float sparsity,
@@ -58,7 +159,6 @@ bool RegionSCCA(typename NetworkType::Pointer network, typename NetworkType::Poi
 {
   typedef itk::ants::antsSCCANObject<NetworkType, double>  SCCANType;
   typedef typename SCCANType::MatrixType                   MatrixType;
-  typedef typename SCCANType::VectorType                   VectorType;
 
   // Determine the number of regions to examine
   std::set<unsigned int> labelset;
@@ -130,8 +230,15 @@ bool RegionSCCA(typename NetworkType::Pointer network, typename NetworkType::Poi
   // used to rankify matrices if using robust
   typename SCCANType::Pointer cca_rankify = SCCANType::New();
 
+  // extract each region's time x voxel matrix once rather than once per pair
+  std::vector<MatrixType> regionMatrices( N );
   for (unsigned int i=0; i<N; i++)
     {
+    if ( labelCounts[i] < minRegionSize )
+      {
+      continue;
+      }
+
     typename NetworkType::IndexType idx;
     idx[1] = 0;
 
@@ -155,114 +262,279 @@ bool RegionSCCA(typename NetworkType::Pointer network, typename NetworkType::Poi
         }
       }
 
-    if ( robust && ( labelCounts[i] >= minRegionSize)  )
+    if ( robust )
       {
       P = cca_rankify->RankifyMatrixColumns(P);
       }
+    regionMatrices[i] = P;
+    }
 
-
-    if ( labelCounts[i] >= minRegionSize )
+  RegionSCCAThreadStruct<NetworkType> str;
+  str.Network = network;
+  str.RegionMatrices = &regionMatrices;
+  str.NEvec = n_evec;
+  str.Iterations = iterct;
+  str.Sparsity = sparsity;
+  str.UseL1 = useL1;
+  str.GradStep = gradstep;
+  str.KeepPositive = keepPositive;
+  str.MinClusterSize = minClusterSize;
+  str.NextPair = 0;
+  for (unsigned int i=0; i<N; i++)
+    {
+    for ( unsigned int j=i+1; j<N; j++)
       {
-      for ( unsigned int j=i+1; j<N; j++)
+      if ( ( labelCounts[i] >= minRegionSize ) && ( labelCounts[j] >= minRegionSize ) )
         {
-        MatrixType Q(nTimes, labelCounts[j], 0.0);
-        typename NetworkType::IndexType idx2;
-        idx2[1] = 0;
+        str.Pairs.push_back( std::make_pair( i, j ) );
+        }
+      }
+    }
 
-        unsigned int jCount = 0;
-        for (unsigned int v2=0; v2<nVoxels; v2++)
-          {
-          idx2[0] = v2;
-          typename NetworkType::IndexType timeIdx2;
-          timeIdx2[1] = v2;
-
-          if ( labels->GetPixel(idx2) == (j+1) )
-            {
-            for ( unsigned int t2=0; t2<nTimes; t2++)
-              {
-              timeIdx2[0] = t2;
-              Q(t2,jCount) = time->GetPixel(timeIdx2);
-              }
-            ++jCount;
-            }
-          }
+  if( !str.Pairs.empty() )
+    {
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    unsigned int numberOfThreads = std::min( static_cast<unsigned int>( str.Pairs.size() ),
+                                             static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    numberOfThreads = std::min( numberOfThreads,
+                                static_cast<unsigned int>( threader->GetGlobalDefaultNumberOfThreads() ) );
+    threader->SetNumberOfThreads( std::max( numberOfThreads, 1u ) );
+    threader->SetSingleMethod( RegionSCCAThreaderCallback<NetworkType>, &str );
+    threader->SingleMethodExecute();
+    }
 
-        if ( robust )
-          {
-          Q = cca_rankify->RankifyMatrixColumns(Q);
-          }
+  delete []labelCounts;
 
-        if ( labelCounts[j] >= minRegionSize)
-          {
+  return true;
+}
 
-          // Correlation magic goes here
-          typename SCCANType::Pointer cca = SCCANType::New();
-          cca->SetSilent( true );
-          cca->SetMaximumNumberOfIterations(iterct);
-          cca->SetUseL1( useL1 );
-          cca->SetGradStep( gradstep );
-          cca->SetKeepPositiveP( keepPositive );
-          cca->SetKeepPositiveQ( keepPositive );
-          cca->SetFractionNonZeroP( sparsity );
-          cca->SetFractionNonZeroQ( sparsity );
-          cca->SetMinClusterSizeP( minClusterSize );
-          cca->SetMinClusterSizeQ( minClusterSize );
-          cca->SetMatrixP( P );
-          cca->SetMatrixQ( Q );
-
-          // is truecorr just sccancorrs[0]?
-          cca->SparsePartialArnoldiCCA(n_evec);
-          VectorType sccancorrs = cca->GetCanonicalCorrelations();
-
-          VectorType pVec = cca->GetVariateP();
-          for ( unsigned int ip=0; ip<pVec.size(); ip++)
-            {
-            pVec[ip] = vnl_math_abs( pVec[ip] );
-            }
-          // pVec = pVec.normalize();
-          pVec = P * pVec;
-
-          VectorType qVec = cca->GetVariateQ();
-          for ( unsigned int iq=0; iq<qVec.size(); iq++)
-            {
-            qVec[iq] = vnl_math_abs( qVec[iq] );
-            }
-          //qVec = qVec.normalize();
-          qVec = Q * qVec;
-
-          double final_corr = vnl_pearson_corr(pVec,qVec);
-          if ( ! vnl_math_isfinite( final_corr ) )
-            {
-            final_corr = 0.0;
-            }
-
-          typename NetworkType::IndexType connIdx;
-          connIdx[0] = i;
-          connIdx[1] = j;
-          network->SetPixel( connIdx, final_corr );
-          connIdx[0] = j;
-          connIdx[1] = i;
-          network->SetPixel( connIdx, final_corr );
 
-          }
+// Add the time series of the voxels in the requested chunk of the time matrix
+// ( time x voxel ) to the sums of their regions, stored as time x region.
+template <class NetworkType>
+void AccumulateRegionTimeSeries( const NetworkType *timeChunk, const std::vector<unsigned int> & voxelLabels,
+                                 vnl_matrix<double> & timeSig )
+{
+  itk::ImageRegionConstIteratorWithIndex<NetworkType> it( timeChunk, timeChunk->GetRequestedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    const typename NetworkType::IndexType & idx = it.GetIndex();
+    const unsigned int label = voxelLabels[idx[1]];
+    if( label > 0 && label <= timeSig.cols() )
+      {
+      timeSig( idx[0], label - 1 ) += it.Get();
+      }
+    }
+}
+
+// Read the time matrix in slabs of voxels and sum the time series of each
+// region, so only the region signals, not the voxel time series, are held in
+// memory.
+template <class NetworkType>
+bool ReadRegionTimeSeries( const std::string & timeMatrixName, const std::vector<unsigned int> & voxelLabels,
+                           unsigned int N, vnl_matrix<double> & timeSig,
+                           itk::SizeValueType maximumChunkBytes = 64 * 1024 * 1024 )
+{
+  typedef typename NetworkType::RegionType RegionType;
+
+  const unsigned int nVoxels = voxelLabels.size();
+
+  if( timeMatrixName.substr( 0, 2 ) == std::string( "0x" ) ||
+      ants::ObjectCache::IsEnabled() || ants::IsParallelGzipFile( timeMatrixName ) )
+    {
+    typename NetworkType::Pointer timeMat = ITK_NULLPTR;
+    if( !ReadImage<NetworkType>( timeMat, timeMatrixName.c_str() ) )
+      {
+      return false;
+      }
+    if ( nVoxels != timeMat->GetLargestPossibleRegion().GetSize()[1] )
+      {
+      std::cout << "number of labels does not match number of voxels" << std::endl;
+      return false;
+      }
+    timeSig.set_size( timeMat->GetLargestPossibleRegion().GetSize()[0], N );
+    timeSig.fill( 0.0 );
+    AccumulateRegionTimeSeries<NetworkType>( timeMat, voxelLabels, timeSig );
+    return true;
+    }
+
+  if( !ANTSFileExists( timeMatrixName ) )
+    {
+    std::cerr << " file " << timeMatrixName << " does not exist . " << std::endl;
+    return false;
+    }
+
+  typedef itk::ImageFileReader<NetworkType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( timeMatrixName );
+  try
+    {
+    reader->UpdateOutputInformation();
+    const RegionType largestRegion = reader->GetOutput()->GetLargestPossibleRegion();
+    if ( nVoxels != largestRegion.GetSize()[1] )
+      {
+      std::cout << "number of labels does not match number of voxels" << std::endl;
+      return false;
+      }
+    timeSig.set_size( largestRegion.GetSize()[0], N );
+    timeSig.fill( 0.0 );
+
+    const itk::SizeValueType numberOfBytes = largestRegion.GetNumberOfPixels()
+      * sizeof( typename NetworkType::PixelType );
+    unsigned int numberOfChunks = 1;
+    if( maximumChunkBytes > 0 )
+      {
+      numberOfChunks = static_cast<unsigned int>( ( numberOfBytes + maximumChunkBytes - 1 ) / maximumChunkBytes );
+      numberOfChunks = std::max( numberOfChunks, 1u );
+      }
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    numberOfChunks = splitter->GetNumberOfSplits( largestRegion, numberOfChunks );
+
+    for( unsigned int n = 0; n < numberOfChunks; n++ )
+      {
+      RegionType chunk = largestRegion;
+      splitter->GetSplit( n, numberOfChunks, chunk );
+      reader->GetOutput()->SetRequestedRegion( chunk );
+      reader->Update();
+      AccumulateRegionTimeSeries<NetworkType>( reader->GetOutput(), voxelLabels, timeSig );
+      }
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Exception caught during time matrix reading " << std::endl;
+    std::cerr << e << " file " << timeMatrixName << std::endl;
+    return false;
+    }
+  return true;
+}
 
+// Sums and cross products of the region signals over a window of time points.
+// Time points are added to and removed from the window as it slides, so a step
+// costs O( N^2 ) per time point entering or leaving the window instead of a
+// pass over the whole window for every region pair.  The rows of the cross
+// products are updated in parallel.
+struct WindowedCovarianceThreadStruct
+  {
+  const vnl_matrix<double> *Signals;
+  vnl_vector<double>        Sum;
+  vnl_matrix<double>        CrossProduct;
+  unsigned int              NumberOfTimePoints;
+  unsigned int              AddBegin;
+  unsigned int              AddEnd;
+  unsigned int              RemoveBegin;
+  unsigned int              RemoveEnd;
+  unsigned int              NextRow;
+  itk::SimpleFastMutexLock  Mutex;
+  };
+
+static ITK_THREAD_RETURN_TYPE WindowedCovarianceThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  WindowedCovarianceThreadStruct *      str = static_cast<WindowedCovarianceThreadStruct *>( info->UserData );
+
+  const vnl_matrix<double> & S = *str->Signals;
+  const unsigned int         N = S.cols();
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int i = str->NextRow++;
+    str->Mutex.Unlock();
+    if( i >= N )
+      {
+      break;
+      }
+    double *cross = str->CrossProduct[i];
+    for( unsigned int t = str->AddBegin; t < str->AddEnd; t++ )
+      {
+      const double *x = S[t];
+      str->Sum[i] += x[i];
+      for( unsigned int j = i; j < N; j++ )
+        {
+        cross[j] += x[i] * x[j];
+        }
+      }
+    for( unsigned int t = str->RemoveBegin; t < str->RemoveEnd; t++ )
+      {
+      const double *x = S[t];
+      str->Sum[i] -= x[i];
+      for( unsigned int j = i; j < N; j++ )
+        {
+        cross[j] -= x[i] * x[j];
         }
       }
     }
 
-  delete []labelCounts;
+  return ITK_THREAD_RETURN_VALUE;
+}
 
-  return network;
+static void UpdateWindowedCovariance( WindowedCovarianceThreadStruct & str, unsigned int addBegin, unsigned int addEnd,
+                                      unsigned int removeBegin, unsigned int removeEnd )
+{
+  str.AddBegin = addBegin;
+  str.AddEnd = addEnd;
+  str.RemoveBegin = removeBegin;
+  str.RemoveEnd = removeEnd;
+  str.NumberOfTimePoints += ( addEnd - addBegin );
+  str.NumberOfTimePoints -= ( removeEnd - removeBegin );
+  str.NextRow = 0;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  unsigned int numberOfThreads = std::min( static_cast<unsigned int>( str.Signals->cols() ),
+                                           static_cast<unsigned int>( ITK_MAX_THREADS ) );
+  numberOfThreads = std::min( numberOfThreads,
+                              static_cast<unsigned int>( threader->GetGlobalDefaultNumberOfThreads() ) );
+  threader->SetNumberOfThreads( std::max( numberOfThreads, 1u ) );
+  threader->SetSingleMethod( WindowedCovarianceThreaderCallback, &str );
+  threader->SingleMethodExecute();
 }
 
+// Pearson correlation of the region signals over the current window, as in
+// vnl_pearson_corr.  Regions at or below minSize voxels are left at 0.
+static void GetWindowedCorrelation( const WindowedCovarianceThreadStruct & str, const vnl_vector<double> & labelCounts,
+                                    unsigned int minSize, vnl_matrix<double> & corr )
+{
+  const unsigned int N = str.Sum.size();
+  const double       frac = 1.0 / static_cast<double>( str.NumberOfTimePoints );
 
-template <class NetworkType>
-bool RegionAveraging(typename NetworkType::Pointer network, typename NetworkType::Pointer time, typename NetworkType::Pointer labels,
-                     unsigned int nLabels, unsigned int minSize )
+  corr.set_size( N, N );
+  corr.fill( 0.0 );
+  for (unsigned int i=0; i<N; i++)
+    {
+    for ( unsigned int j=(i+1); j<N; j++ )
+      {
+      if ( (labelCounts[i] > minSize) && (labelCounts[j] > minSize ) )
+        {
+        double numer = str.CrossProduct(i,j) - frac * str.Sum[i] * str.Sum[j];
+        double denom = sqrt( ( str.CrossProduct(i,i) - frac * str.Sum[i] * str.Sum[i] )
+                             * ( str.CrossProduct(j,j) - frac * str.Sum[j] * str.Sum[j] ) );
+        double r = 0.0;
+        if ( denom > 0 )
+          {
+          r = numer / denom;
+          }
+        if ( ! vnl_math_isfinite( r ) )
+          {
+          r = 0.0;
+          }
+        corr(i,j) = r;
+        corr(j,i) = r;
+        }
+      }
+    }
+}
+
+// Correlate the average time series of the regions, either over the whole
+// series ( windowLength == 0, network is N x N ) or over sliding windows of
+// windowLength time points every windowStep time points ( windowNetworks is
+// N x N x number of windows ).
+template <class NetworkType, class WindowNetworkType>
+bool RegionAveraging(typename NetworkType::Pointer network, typename WindowNetworkType::Pointer windowNetworks,
+                     const std::string & timeMatrixName, typename NetworkType::Pointer labels,
+                     unsigned int nLabels, unsigned int minSize, unsigned int windowLength, unsigned int windowStep )
 {
 
-  typedef vnl_vector<float>                                     VectorType;
-  typedef vnl_matrix<float>                                     MatrixType;
+  typedef vnl_vector<double>                                    VectorType;
+  typedef vnl_matrix<double>                                    MatrixType;
 
   // Determine the number of regions to examine
   std::set<unsigned int> labelset;
@@ -291,100 +563,129 @@ bool RegionAveraging(typename NetworkType::Pointer network, typename NetworkType
   unsigned int N = labelset.size();
   std::cout << "Network Size = " << N << " x " << N << std::endl;
 
-  typename NetworkType::RegionType region;
-  typename NetworkType::RegionType::SizeType size;
-  size[0] = N;
-  size[1] = N;
-  region.SetSize( size );
-  network->SetRegions( region );
-  network->Allocate();
-  network->FillBuffer( 0.0 );
-
   unsigned int nVoxels = labels->GetLargestPossibleRegion().GetSize()[0];
-  unsigned int nTimes = time->GetLargestPossibleRegion().GetSize()[0];
 
-  if ( nVoxels != time->GetLargestPossibleRegion().GetSize()[1] )
+  VectorType                labelCounts( N, 0 );
+  std::vector<unsigned int> voxelLabels( nVoxels, 0 );
+  typename NetworkType::IndexType idx;
+  idx[1] = 0;
+  for ( unsigned int v=0; v<nVoxels; v++)
     {
-    std::cout << "number of labels does not match number of voxels" << std::endl;
-    return EXIT_FAILURE;
+    idx[0] = v;
+    const float        label = labels->GetPixel(idx);
+    const unsigned int i = static_cast<unsigned int>( label );
+    if ( ( i >= 1 ) && ( i <= N ) && ( label == i ) )
+      {
+      voxelLabels[v] = i;
+      labelCounts[i-1]++;
+      }
+    }
+
+  MatrixType timeSig;
+  if( !ReadRegionTimeSeries<NetworkType>( timeMatrixName, voxelLabels, N, timeSig ) )
+    {
+    return false;
     }
+  unsigned int nTimes = timeSig.rows();
 
   std::cout << "Examining " << N << " regions, covering "
             << nVoxels << " voxels with " << nTimes << " time points each" << std::endl;
 
-  VectorType labelCounts( N, 0 );
-  MatrixType timeSig( N, nTimes, 0.0 );
-  for ( unsigned int i=0; i<N; i++)
+  // average, and center on the mean of the whole series to keep the
+  // sliding sums well conditioned
+  for ( unsigned int i=0; i<N; i++ )
     {
-    typename NetworkType::IndexType idx;
-    idx[1] = 0;
-
-    for ( unsigned int v=0; v<nVoxels; v++)
+    if ( labelCounts[i] > 0 )
       {
-      idx[0] = v;
-      if ( labels->GetPixel(idx) == (i+1) )
-        {
-        labelCounts[i]++;
-
-        typename NetworkType::IndexType timeIdx;
-        timeIdx[1] = v;
-        for ( unsigned int t=0; t<nTimes; t++)
-          {
-          timeIdx[0] = t;
-          timeSig(i,t) += time->GetPixel(timeIdx);
-          }
-        }
+      timeSig.set_column( i, timeSig.get_column( i ) / labelCounts[i] );
       }
+    timeSig.set_column( i, timeSig.get_column( i ) - timeSig.get_column( i ).mean() );
     }
 
-  for ( unsigned int i=0; i<N; i++ )
+  WindowedCovarianceThreadStruct str;
+  str.Signals = &timeSig;
+  str.Sum.set_size( N );
+  str.Sum.fill( 0.0 );
+  str.CrossProduct.set_size( N, N );
+  str.CrossProduct.fill( 0.0 );
+  str.NumberOfTimePoints = 0;
+
+  MatrixType corr;
+  if ( windowLength == 0 )
     {
-    for ( unsigned int j=0; j<nTimes; j++ )
+    typename NetworkType::RegionType region;
+    typename NetworkType::RegionType::SizeType size;
+    size[0] = N;
+    size[1] = N;
+    region.SetSize( size );
+    network->SetRegions( region );
+    network->Allocate();
+
+    UpdateWindowedCovariance( str, 0, nTimes, 0, 0 );
+    GetWindowedCorrelation( str, labelCounts, minSize, corr );
+    for ( itk::ImageRegionIteratorWithIndex<NetworkType> nIt( network, region ); !nIt.IsAtEnd(); ++nIt )
       {
-      if ( labelCounts[i] > 0 )
-        {
-        timeSig(i,j) /= labelCounts[i];
-        }
+      nIt.Set( corr( nIt.GetIndex()[0], nIt.GetIndex()[1] ) );
       }
+    return true;
     }
 
-for (unsigned int i=0; i<N; i++)
+  if ( windowLength > nTimes )
     {
-    for ( unsigned int j=(i+1); j<N; j++ )
-      {
-
-      if ( (labelCounts[i] > minSize) && (labelCounts[j] > minSize ) )
-        {
-        VectorType p = timeSig.get_row(i);
-        VectorType q = timeSig.get_row(j);
+    std::cout << "window length " << windowLength << " exceeds the " << nTimes << " time points" << std::endl;
+    return false;
+    }
+  windowStep = std::max( windowStep, 1u );
+  unsigned int nWindows = ( nTimes - windowLength ) / windowStep + 1;
+  std::cout << "Sliding " << nWindows << " windows of " << windowLength
+            << " time points every " << windowStep << " time points" << std::endl;
 
-        double corr = vnl_pearson_corr(p,q);
+  typename WindowNetworkType::RegionType region;
+  typename WindowNetworkType::RegionType::SizeType size;
+  size[0] = N;
+  size[1] = N;
+  size[2] = nWindows;
+  region.SetSize( size );
+  windowNetworks->SetRegions( region );
+  windowNetworks->Allocate();
 
-        if ( ! vnl_math_isfinite( corr ) )
-          {
-          corr = 0.0;
-          }
+  for ( unsigned int w=0; w<nWindows; w++ )
+    {
+    const unsigned int start = w * windowStep;
+    if ( w == 0 || windowStep >= windowLength )
+      {
+      // no overlap with the previous window
+      UpdateWindowedCovariance( str, start, start + windowLength,
+                                ( w == 0 ) ? 0 : start - windowStep, ( w == 0 ) ? 0 : start - windowStep + windowLength );
+      }
+    else
+      {
+      UpdateWindowedCovariance( str, start - windowStep + windowLength, start + windowLength,
+                                start - windowStep, start );
+      }
+    GetWindowedCorrelation( str, labelCounts, minSize, corr );
 
-        typename NetworkType::IndexType connIdx;
+    typename WindowNetworkType::IndexType connIdx;
+    connIdx[2] = w;
+    for ( unsigned int i=0; i<N; i++ )
+      {
+      for ( unsigned int j=0; j<N; j++ )
+        {
         connIdx[0] = i;
         connIdx[1] = j;
-        network->SetPixel( connIdx, corr );
-        connIdx[0] = j;
-        connIdx[1] = i;
-        network->SetPixel( connIdx, corr );
-
+        windowNetworks->SetPixel( connIdx, corr(i,j) );
         }
       }
     }
 
-  return network;
-
+  return true;
 }
 
 int timesccan( itk::ants::CommandLineParser *parser )
 {
 
   typedef itk::Image<float,2>               NetworkType;
+  typedef itk::Image<float,3>               WindowNetworkType;
 
 
   std::string                                       outname = "output.nii.gz";
@@ -508,6 +809,24 @@ int timesccan( itk::ants::CommandLineParser *parser )
     robustify = parser->Convert<unsigned int>( robust_option->GetFunction()->GetName() );
     }
 
+  unsigned int                                      windowLength = 0;
+  unsigned int                                      windowStep = 1;
+  itk::ants::CommandLineParser::OptionType::Pointer window_option =
+    parser->GetOption( "sliding-window" );
+  if( window_option && window_option->GetNumberOfFunctions() != 0 )
+    {
+    std::vector<unsigned int> window =
+      parser->ConvertVector<unsigned int>( window_option->GetFunction()->GetName() );
+    if( !window.empty() )
+      {
+      windowLength = window[0];
+      }
+    if( window.size() > 1 )
+      {
+      windowStep = window[1];
+      }
+    }
+
   itk::ants::CommandLineParser::OptionType::Pointer evecg_option =
     parser->GetOption( "EvecGradPenalty" );
   if( evecg_option && evecg_option->GetNumberOfFunctions() != 0 )
@@ -541,6 +860,10 @@ int timesccan( itk::ants::CommandLineParser *parser )
 
     if ( connectivityStrategy == "scca" )
       {
+      if ( windowLength > 0 )
+        {
+        std::cout << "Warning: sliding windows are only used with region-averaging" << std::endl;
+        }
       std::cout << "Time Series Data: " << timeMatrixName << std::endl;
       std::cout << "Time Series Labels: " << labelMatrixName << std::endl;
 
@@ -560,13 +883,21 @@ int timesccan( itk::ants::CommandLineParser *parser )
       std::cout << "Time Series Data: " << timeMatrixName << std::endl;
       std::cout << "Time Series Labels: " << labelMatrixName << std::endl;
 
-      NetworkType::Pointer timeMat = ITK_NULLPTR;
-      ReadImage<NetworkType>( timeMat, timeMatrixName.c_str() );
-
       NetworkType::Pointer labelMat = ITK_NULLPTR;
       ReadImage<NetworkType>( labelMat, labelMatrixName.c_str() );
 
-      RegionAveraging<NetworkType>( network, timeMat, labelMat, nLabels, roiSize );
+      // the time matrix is streamed, only the region averages are kept
+      WindowNetworkType::Pointer windowNetworks = WindowNetworkType::New();
+      if( !RegionAveraging<NetworkType, WindowNetworkType>( network, windowNetworks, timeMatrixName, labelMat,
+                                                            nLabels, roiSize, windowLength, windowStep ) )
+        {
+        return EXIT_FAILURE;
+        }
+      if( windowLength > 0 )
+        {
+        WriteImage<WindowNetworkType>( windowNetworks, outname.c_str() );
+        return 0;
+        }
       }
     else
       {
@@ -752,6 +1083,18 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Correlate the region averages over sliding windows of windowLength time points, " )
+    + std::string( "moved by windowStep time points.  The output is then a 3D image with one " )
+    + std::string( "connectivity matrix per window." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "sliding-window" );
+  option->SetUsageOption( 0, "windowLengthxwindowStep" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "Build the network connectivity matrix" );
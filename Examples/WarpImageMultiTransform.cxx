@@ -5,11 +5,14 @@
 #include "itkMatrixOffsetTransformBase.h"
 #include "itkTransformFactory.h"
 #include "itkWarpImageMultiTransformFilter.h"
+#include "itkDisplacementFieldFromMultiTransformFilter.h"
 #include "itkTransformFileReader.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkBSplineInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "antsUtilities.h"
+#include "ReadWriteData.h"
+#include "itksys/SystemTools.hxx"
 // Needed for the LabelImageGaussianInterpolateImageFunction to work on
 // vector images
 #include "itkLabelImageGaussianInterpolateImageFunction.h"
@@ -43,6 +46,8 @@ static bool WarpImageMultiTransform_ParseInput(int argc, char * *argv, char *& m
   misc_opt.use_BSpline_interpolator = false;
   misc_opt.use_TightestBoundingBox = false;
   misc_opt.use_RotationHeader = false;
+  misc_opt.composed_field_cache_directory = ITK_NULLPTR;
+  misc_opt.time_points_per_slab = 0;
 
   misc_opt.use_NN_interpolator = false;
   misc_opt.use_MultiLabel_interpolator = false;
@@ -130,6 +135,14 @@ static bool WarpImageMultiTransform_ParseInput(int argc, char * *argv, char *& m
         }
       misc_opt.reference_image_filename = argv[ind];
       }
+    else if( strcmp(argv[ind], "--cache-composed-warp") == 0 )
+      {
+      ind++; if( ind >= argc )
+        {
+        return false;
+        }
+      misc_opt.composed_field_cache_directory = argv[ind];
+      }
     else if( (strcmp(argv[ind], "--tightest-bounding-box") == 0) &&  (strcmp(argv[ind], "-R") != 0)  )
       {
       misc_opt.use_TightestBoundingBox = true;
@@ -413,148 +426,182 @@ void WarpImageMultiTransform(char *moving_image_filename, char *output_image_fil
 
   typedef itk::TransformFileReader                    TranReaderType;
   typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
-  bool         takeaffinv = false;
-  unsigned int transcount = 0;
-  const int    kOptQueueSize = opt_queue.size();
-  for( int i = 0; i < kOptQueueSize; i++ )
+  // a chain that was already composed on the same reference grid is read back
+  // from the cache instead of reading (and evaluating) each of its transforms
+  std::string composedFieldCacheFileName;
+  bool        useComposedFieldCache = false;
+  bool        isComposedFieldCached = false;
+  if( misc_opt.composed_field_cache_directory )
+    {
+    if( img_ref.IsNull() )
+      {
+      std::cout << " --cache-composed-warp requires a reference image (-R) and is ignored. " << std::endl;
+      }
+    else
+      {
+      composedFieldCacheFileName = GetComposedDisplacementFieldCacheFileName( opt_queue,
+                                                                               misc_opt.reference_image_filename,
+                                                                               misc_opt.composed_field_cache_directory );
+      useComposedFieldCache = true;
+      isComposedFieldCached = itksys::SystemTools::FileExists( composedFieldCacheFileName.c_str(), true );
+      }
+    }
+
+  if( isComposedFieldCached )
     {
-    const TRAN_OPT & opt = opt_queue[i];
+    std::cout << " Reading the composed warp from the cache: " << composedFieldCacheFileName << std::endl;
+    typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+    field_reader->SetFileName( composedFieldCacheFileName );
+    field_reader->Update();
+    typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
 
-    switch( opt.file_type )
+    warper->PushBackDisplacementFieldTransform(field);
+    }
+  else
+    {
+    bool         takeaffinv = false;
+    unsigned int transcount = 0;
+    const int    kOptQueueSize = opt_queue.size();
+    for( int i = 0; i < kOptQueueSize; i++ )
       {
-      case AFFINE_FILE:
+      const TRAN_OPT & opt = opt_queue[i];
+
+      switch( opt.file_type )
         {
-        typename TranReaderType::Pointer tran_reader = TranReaderType::New();
-        tran_reader->SetFileName(opt.filename);
-        tran_reader->Update();
-        typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
-          ( (tran_reader->GetTransformList() )->front().GetPointer() );
-        if( opt.do_affine_inv )
+        case AFFINE_FILE:
           {
-          typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-          aff->GetInverse(aff_inv);
-          aff = aff_inv;
-          takeaffinv = true;
+          typename TranReaderType::Pointer tran_reader = TranReaderType::New();
+          tran_reader->SetFileName(opt.filename);
+          tran_reader->Update();
+          typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
+            ( (tran_reader->GetTransformList() )->front().GetPointer() );
+          if( opt.do_affine_inv )
+            {
+            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+            aff->GetInverse(aff_inv);
+            aff = aff_inv;
+            takeaffinv = true;
+            }
+          // std::cout <<" aff " << transcount <<  std::endl;
+          warper->PushBackAffineTransform(aff);
+          if( transcount == 0 )
+            {
+            warper->SetOutputParametersFromImage( img_mov );
+            }
+          transcount++;
+          break;
           }
-        // std::cout <<" aff " << transcount <<  std::endl;
-        warper->PushBackAffineTransform(aff);
-        if( transcount == 0 )
+
+        case IDENTITY_TRANSFORM:
           {
-          warper->SetOutputParametersFromImage( img_mov );
+          typename AffineTransformType::Pointer aff;
+          GetIdentityTransform(aff);
+          // std::cout << " aff id" << transcount << std::endl;
+          warper->PushBackAffineTransform(aff);
+          transcount++;
+          break;
           }
-        transcount++;
-        break;
-        }
 
-      case IDENTITY_TRANSFORM:
-        {
-        typename AffineTransformType::Pointer aff;
-        GetIdentityTransform(aff);
-        // std::cout << " aff id" << transcount << std::endl;
-        warper->PushBackAffineTransform(aff);
-        transcount++;
-        break;
-        }
-
-      case IMAGE_AFFINE_HEADER:
-        {
-        typename AffineTransformType::Pointer aff = AffineTransformType::New();
-        typename ImageFileReaderType::Pointer reader_image_affine = ImageFileReaderType::New();
-        reader_image_affine->SetFileName(opt.filename);
-        reader_image_affine->Update();
-        typename ImageType::Pointer img_affine = reader_image_affine->GetOutput();
+        case IMAGE_AFFINE_HEADER:
+          {
+          typename AffineTransformType::Pointer aff = AffineTransformType::New();
+          typename ImageFileReaderType::Pointer reader_image_affine = ImageFileReaderType::New();
+          reader_image_affine->SetFileName(opt.filename);
+          reader_image_affine->Update();
+          typename ImageType::Pointer img_affine = reader_image_affine->GetOutput();
 
-        GetAffineTransformFromImage<ImageType, AffineTransformType>(img_affine, aff);
+          GetAffineTransformFromImage<ImageType, AffineTransformType>(img_affine, aff);
 
-        if( opt.do_affine_inv )
-          {
-          typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-          aff->GetInverse(aff_inv);
-          aff = aff_inv;
-          takeaffinv = true;
-          }
+          if( opt.do_affine_inv )
+            {
+            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+            aff->GetInverse(aff_inv);
+            aff = aff_inv;
+            takeaffinv = true;
+            }
 
-        // std::cout <<" aff from image header " << transcount <<  std::endl;
-        warper->PushBackAffineTransform(aff);
+          // std::cout <<" aff from image header " << transcount <<  std::endl;
+          warper->PushBackAffineTransform(aff);
 
-        //            if (transcount==0){
-        //                warper->SetOutputParametersFromImage( img_mov);
-        //            }
+          //            if (transcount==0){
+          //                warper->SetOutputParametersFromImage( img_mov);
+          //            }
 
-        transcount++;
-        break;
-        }
+          transcount++;
+          break;
+          }
 
-      case DEFORMATION_FILE:
-        {
-        typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
-        field_reader->SetFileName( opt.filename );
-        field_reader->Update();
-        typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
+        case DEFORMATION_FILE:
+          {
+          typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+          field_reader->SetFileName( opt.filename );
+          field_reader->Update();
+          typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
 
-        warper->PushBackDisplacementFieldTransform(field);
-        warper->SetOutputParametersFromImage(field );
+          warper->PushBackDisplacementFieldTransform(field);
+          warper->SetOutputParametersFromImage(field );
 
-        transcount++;
-        break;
+          transcount++;
+          break;
+          }
+        default:
+          std::cout << "Unknown file type!" << std::endl;
         }
-      default:
-        std::cout << "Unknown file type!" << std::endl;
       }
-    }
-
-  // std::cout << " transcount " << transcount << std::endl; warper->PrintTransformList();
-  if( transcount == 2 )
-    {
-    std::cout << "  We check the syntax of your call .... " << std::endl;
-    const TRAN_OPT & opt1 = opt_queue[0];
-    const TRAN_OPT & opt2 = opt_queue[1];
 
-    if( opt1.file_type == AFFINE_FILE  && opt2.file_type == DEFORMATION_FILE   )
+    // std::cout << " transcount " << transcount << std::endl; warper->PrintTransformList();
+    if( transcount == 2 )
       {
-      bool defisinv = IsInverseDeformation(opt2.filename.c_str() );
-      if( !takeaffinv )
+      std::cout << "  We check the syntax of your call .... " << std::endl;
+      const TRAN_OPT & opt1 = opt_queue[0];
+      const TRAN_OPT & opt2 = opt_queue[1];
+
+      if( opt1.file_type == AFFINE_FILE  && opt2.file_type == DEFORMATION_FILE   )
         {
-        std::cout
-          <<
-          " Your 1st parameter should be an inverse affine map and the 2nd an InverseWarp  --- exiting without applying warp.  Check that , if using an inverse affine map, you pass the -i option before the Affine.txt."
-          << std::endl;
-        return;
+        bool defisinv = IsInverseDeformation(opt2.filename.c_str() );
+        if( !takeaffinv )
+          {
+          std::cout
+            <<
+            " Your 1st parameter should be an inverse affine map and the 2nd an InverseWarp  --- exiting without applying warp.  Check that , if using an inverse affine map, you pass the -i option before the Affine.txt."
+            << std::endl;
+          return;
+          }
+        if( !defisinv )
+          {
+          std::cout
+            <<
+            " Your 2nd  parameter should be an InverseWarp when your 1st parameter is an inverse affine map  --- exiting without applying warp.  "
+            << std::endl;
+          return;
+          }
         }
-      if( !defisinv )
+      if( opt2.file_type == AFFINE_FILE  && opt1.file_type == DEFORMATION_FILE   )
         {
-        std::cout
-          <<
-          " Your 2nd  parameter should be an InverseWarp when your 1st parameter is an inverse affine map  --- exiting without applying warp.  "
-          << std::endl;
-        return;
+        bool defisinv = IsInverseDeformation(opt1.filename.c_str() );
+        if(  defisinv )
+          {
+          std::cout
+            <<
+            " Your 1st parameter should be a Warp (not Inverse) when your 2nd parameter is an affine map --- exiting without applying warp.  "
+            << std::endl;
+          return;
+          }
+        if(  takeaffinv )
+          {
+          std::cout
+            <<
+            " Your 2nd parameter should be a regular affine map (not inverted) if the 1st is a Warp --- exiting without applying warp. "
+            << std::endl;
+          return;
+          }
         }
+      std::cout << " syntax probably ok. " << std::endl;
       }
-    if( opt2.file_type == AFFINE_FILE  && opt1.file_type == DEFORMATION_FILE   )
+    else
       {
-      bool defisinv = IsInverseDeformation(opt1.filename.c_str() );
-      if(  defisinv )
-        {
-        std::cout
-          <<
-          " Your 1st parameter should be a Warp (not Inverse) when your 2nd parameter is an affine map --- exiting without applying warp.  "
-          << std::endl;
-        return;
-        }
-      if(  takeaffinv )
-        {
-        std::cout
-          <<
-          " Your 2nd parameter should be a regular affine map (not inverted) if the 1st is a Warp --- exiting without applying warp. "
-          << std::endl;
-        return;
-        }
+      std::cout << " You are doing something more complex -- we wont check syntax in this case " << std::endl;
       }
-    std::cout << " syntax probably ok. " << std::endl;
-    }
-  else
-    {
-    std::cout << " You are doing something more complex -- we wont check syntax in this case " << std::endl;
     }
 
   if( img_ref.IsNotNull() )
@@ -588,6 +635,21 @@ void WarpImageMultiTransform(char *moving_image_filename, char *output_image_fil
   std::cout << "output spacing: " << warper->GetOutputSpacing() << std::endl;
   std::cout << "output direction: " << warper->GetOutputDirection() << std::endl;
 
+  if( useComposedFieldCache && !isComposedFieldCached )
+    {
+    typedef itk::DisplacementFieldFromMultiTransformFilter<DisplacementFieldType, DisplacementFieldType,
+                                                           AffineTransformType> ComposerType;
+    typename DisplacementFieldType::Pointer field =
+      ComposeWarperTransformList<ComposerType>( warper.GetPointer(), img_ref.GetPointer() );
+
+    std::cout << " Writing the composed warp to the cache: " << composedFieldCacheFileName << std::endl;
+    itksys::SystemTools::MakeDirectory( misc_opt.composed_field_cache_directory );
+    WriteImage<DisplacementFieldType>( field, composedFieldCacheFileName.c_str() );
+
+    warper->GetTransformList().clear();
+    warper->PushBackDisplacementFieldTransform(field);
+    }
+
   // warper->PrintTransformList();
   warper->DetermineFirstDeformNoInterp();
   warper->Update();
@@ -743,6 +805,10 @@ private:
 
     std::cout << " --use-NN: Use Nearest Neighbor Interpolation. \n " << std::endl;
     std::cout << " --use-BSpline: Use 3rd order B-Spline Interpolation. \n " << std::endl;
+    std::cout
+      <<
+      " --cache-composed-warp cache_directory: Collapse the series of transformations into one displacement field on the grid of the reference image and store it in cache_directory, keyed by a hash of the transformation files and the reference image. Later calls with the same series and reference image read the field from the cache and need a single lookup per voxel. Requires -R. \n "
+      << std::endl;
     std::cout
       <<
       " --use-ML sigma: Use anti-aliasing interpolation for multi-label images, with Gaussian smoothing with standard deviation sigma. \n "
@@ -9,16 +9,14 @@
 #include "itkTransformFactory.h"
 #include "itkWarpTensorImageMultiTransformFilter.h"
 #include "itkTransformFileReader.h"
-#include "itkVectorNearestNeighborInterpolateImageFunction.h"
 #include "ReadWriteData.h"
-#include "itkWarpImageMultiTransformFilter.h"
-#include "itkExpTensorImageFilter.h"
 
 namespace ants
 {
 static bool WarpTensorImageMultiTransform_ParseInput(int argc, char * *argv, char *& moving_image_filename,
                                                      char *& output_image_filename,
-                                                     TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt)
+                                                     TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt,
+                                                     unsigned int & reorientation)
 {
   opt_queue.clear();
   opt_queue.reserve(argc - 2);
@@ -27,6 +25,9 @@ static bool WarpTensorImageMultiTransform_ParseInput(int argc, char * *argv, cha
   misc_opt.use_NN_interpolator = false;
   misc_opt.use_TightestBoundingBox = false;
   misc_opt.use_RotationHeader = false;
+  misc_opt.composed_field_cache_directory = ITK_NULLPTR;
+  misc_opt.time_points_per_slab = 0;
+  reorientation = 0;
 
   moving_image_filename = argv[0];
   output_image_filename = argv[1];
@@ -40,6 +41,14 @@ static bool WarpTensorImageMultiTransform_ParseInput(int argc, char * *argv, cha
       {
       misc_opt.use_NN_interpolator = true;
       }
+    else if( strcmp(argv[ind], "--reorient-ppd") == 0 )
+      {
+      reorientation = 1;
+      }
+    else if( strcmp(argv[ind], "--reorient-fs") == 0 )
+      {
+      reorientation = 2;
+      }
     else if( strcmp(argv[ind], "-R") == 0 )
       {
       ind++; if( ind >= argc )
@@ -270,7 +279,7 @@ DirectionCorrect( typename TensorImageType::Pointer img_mov, typename ImageType:
 
 template <int ImageDimension>
 static void WarpImageMultiTransform(char *moving_image_filename, char *output_image_filename,
-                                    TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt)
+                                    TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt, unsigned int reorientation)
 {
   // typedef itk::Vector<float,6> PixelType;
   typedef itk::SymmetricSecondRankTensor<float,
@@ -285,17 +294,14 @@ static void WarpImageMultiTransform(char *moving_image_filename, char *output_im
                      ImageDimension>                              DisplacementFieldType;
   typedef itk::MatrixOffsetTransformBase<double, ImageDimension,
                                          ImageDimension>          AffineTransformType;
-  typedef itk::WarpImageMultiTransformFilter<ImageType, ImageType, DisplacementFieldType,
-                                             AffineTransformType> WarperType;
+  typedef itk::WarpTensorImageMultiTransformFilter<TensorImageType, TensorImageType, DisplacementFieldType,
+                                                   AffineTransformType> WarperType;
 
   itk::TransformFactory<AffineTransformType>::RegisterTransform();
 
   typedef itk::ImageFileReader<ImageType> ImageFileReaderType;
-  // typename ImageFileReaderType::Pointer reader_img = ImageFileReaderType::New();
-  // reader_img->SetFileName(moving_image_filename);
-  // reader_img->Update();
-  // typename ImageType::Pointer img_mov = ImageType::New();
-  // img_mov = reader_img->GetOutput();
+
+  // the log tensors are warped, and exponentiated when written
   typename TensorImageType::Pointer img_mov;
   ReadTensorImage<TensorImageType>(img_mov, moving_image_filename, true);
 
@@ -309,173 +315,136 @@ static void WarpImageMultiTransform(char *moving_image_filename, char *output_im
     img_ref = reader_img_ref->GetOutput();
     }
 
-  // Convert to reference image tensor basis
-  // DirectionCorrect<TensorImageType, ImageType>(img_mov, img_ref);
-
-  typename TensorImageType::Pointer img_output =
-    AllocImage<TensorImageType>(img_ref);
-  for( unsigned int tensdim = 0;  tensdim < 6;  tensdim++ )
+  // one pass for all components: each output voxel is mapped once, and the
+  // Jacobian of the same chain reorients the interpolated tensor
+  typename WarperType::Pointer warper = WarperType::New();
+  warper->SetInput(img_mov);
+  PixelType nullPix;
+  nullPix.Fill(0);
+  warper->SetEdgePaddingValue(nullPix);
+  if( misc_opt.use_NN_interpolator )
     {
-    typedef itk::VectorIndexSelectionCastImageFilter<TensorImageType, ImageType> IndexSelectCasterType;
-    typename IndexSelectCasterType::Pointer fieldCaster = IndexSelectCasterType::New();
-    fieldCaster->SetInput( img_mov );
-    fieldCaster->SetIndex( tensdim );
-    fieldCaster->Update();
-    typename ImageType::Pointer tenscomponent = fieldCaster->GetOutput();
-    tenscomponent->SetSpacing(img_mov->GetSpacing() );
-    tenscomponent->SetOrigin(img_mov->GetOrigin() );
-    tenscomponent->SetDirection(img_mov->GetDirection() );
-
-    typename WarperType::Pointer  warper = WarperType::New();
-    warper->SetInput(tenscomponent);
-    //      PixelType nullPix;
-    // nullPix.Fill(0);
-    warper->SetEdgePaddingValue(0);
-
-    if( misc_opt.use_NN_interpolator )
-      {
-      typedef typename itk::NearestNeighborInterpolateImageFunction<ImageType,
-                                                                    typename WarperType::CoordRepType>
-        NNInterpolateType;
-      typename NNInterpolateType::Pointer interpolator_NN = NNInterpolateType::New();
-      std::cout << "Haha" << std::endl;
-      warper->SetInterpolator(interpolator_NN);
-      }
+    warper->UseNearestNeighborInterpolationOn();
+    }
+  if( reorientation == 1 )
+    {
+    warper->SetReorientation( WarperType::PreservationOfPrincipalDirection );
+    }
+  else if( reorientation == 2 )
+    {
+    warper->SetReorientation( WarperType::FiniteStrain );
+    }
 
-    typedef itk::TransformFileReader                    TranReaderType;
-    typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
+  typedef itk::TransformFileReader                    TranReaderType;
+  typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
 
-    unsigned int transcount = 0;
-    const int    kOptQueueSize = opt_queue.size();
-    for( int i = 0; i < kOptQueueSize; i++ )
-      {
-      const TRAN_OPT & opt = opt_queue[i];
+  unsigned int transcount = 0;
+  const int    kOptQueueSize = opt_queue.size();
+  for( int i = 0; i < kOptQueueSize; i++ )
+    {
+    const TRAN_OPT & opt = opt_queue[i];
 
-      switch( opt.file_type )
+    switch( opt.file_type )
+      {
+      case AFFINE_FILE:
         {
-        case AFFINE_FILE:
+        typename TranReaderType::Pointer tran_reader = TranReaderType::New();
+        tran_reader->SetFileName(opt.filename);
+        tran_reader->Update();
+        typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
+          ( (tran_reader->GetTransformList() )->front().GetPointer() );
+        if( opt.do_affine_inv )
           {
-          typename TranReaderType::Pointer tran_reader = TranReaderType::New();
-          tran_reader->SetFileName(opt.filename);
-          tran_reader->Update();
-          typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
-            ( (tran_reader->GetTransformList() )->front().GetPointer() );
-          if( opt.do_affine_inv )
-            {
-            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-            aff->GetInverse(aff_inv);
-            aff = aff_inv;
-            }
-          // std::cout <<" aff " << transcount <<  std::endl;
-          warper->PushBackAffineTransform(aff);
-          if( transcount == 0 )
-            {
-            warper->SetOutputParametersFromImage( img_mov );
-            }
-          transcount++;
+          typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+          aff->GetInverse(aff_inv);
+          aff = aff_inv;
           }
-          break;
-        case IDENTITY_TRANSFORM:
+        // std::cout <<" aff " << transcount <<  std::endl;
+        warper->PushBackAffineTransform(aff);
+        if( transcount == 0 )
           {
-          typename AffineTransformType::Pointer aff;
-          GetIdentityTransform<AffineTransformType>(aff);
-          // std::cout << " aff id" << transcount << std::endl;
-          warper->PushBackAffineTransform(aff);
-          transcount++;
+          warper->SetOutputParametersFromImage( img_mov );
           }
-          break;
-        case IMAGE_AFFINE_HEADER:
-          {
-          typename AffineTransformType::Pointer aff = AffineTransformType::New();
-          typename ImageFileReaderType::Pointer reader_image_affine = ImageFileReaderType::New();
-          reader_image_affine->SetFileName(opt.filename);
-          reader_image_affine->Update();
-          typename ImageType::Pointer img_affine = reader_image_affine->GetOutput();
-
-          GetAffineTransformFromImage<ImageType, AffineTransformType>(img_affine, aff);
-
-          if( opt.do_affine_inv )
-            {
-            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-            aff->GetInverse(aff_inv);
-            aff = aff_inv;
-            }
-
-          // std::cout <<" aff from image header " << transcount <<  std::endl;
-          warper->PushBackAffineTransform(aff);
+        transcount++;
+        }
+        break;
+      case IDENTITY_TRANSFORM:
+        {
+        typename AffineTransformType::Pointer aff;
+        GetIdentityTransform<AffineTransformType>(aff);
+        // std::cout << " aff id" << transcount << std::endl;
+        warper->PushBackAffineTransform(aff);
+        transcount++;
+        }
+        break;
+      case IMAGE_AFFINE_HEADER:
+        {
+        typename AffineTransformType::Pointer aff = AffineTransformType::New();
+        typename ImageFileReaderType::Pointer reader_image_affine = ImageFileReaderType::New();
+        reader_image_affine->SetFileName(opt.filename);
+        reader_image_affine->Update();
+        typename ImageType::Pointer img_affine = reader_image_affine->GetOutput();
 
-          //            if (transcount==0){
-          //                warper->SetOutputParametersFromImage( img_mov );
-          //            }
+        GetAffineTransformFromImage<ImageType, AffineTransformType>(img_affine, aff);
 
-          transcount++;
-          }
-          break;
-        case DEFORMATION_FILE:
+        if( opt.do_affine_inv )
           {
-          typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
-          field_reader->SetFileName( opt.filename );
-          field_reader->Update();
-          typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
-          warper->PushBackDisplacementFieldTransform(field);
-          warper->SetOutputParametersFromImage( field );
-          transcount++;
+          typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+          aff->GetInverse(aff_inv);
+          aff = aff_inv;
           }
-          break;
-        default:
-          {
-          std::cout << "Unknown file type!" << std::endl;
-          }
-        }
-      }
 
-    // warper->PrintTransformList();
-
-    if( img_ref.IsNotNull() )
-      {
-      warper->SetOutputParametersFromImage( img_ref );
-      }
-    else
-      {
-      if( misc_opt.use_TightestBoundingBox == true )
+        // std::cout <<" aff from image header " << transcount <<  std::endl;
+        warper->PushBackAffineTransform(aff);
+        transcount++;
+        }
+        break;
+      case DEFORMATION_FILE:
         {
-        // compute the desired spacking after inputting all the transform files using the
-
-        typename ImageType::SizeType largest_size;
-        typename ImageType::PointType origin_warped;
-        GetLargestSizeAfterWarp<WarperType, TensorImageType>(warper, img_mov, largest_size, origin_warped);
-        warper->SetOutputParametersFromImage( img_mov );
-        warper->SetOutputSize(largest_size);
-        warper->SetOutputOrigin(origin_warped);
-          {
-          typename ImageType::DirectionType d;
-          d.SetIdentity();
-          warper->SetOutputDirection(d);
-          }
+        typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+        field_reader->SetFileName( opt.filename );
+        field_reader->Update();
+        typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
+        warper->PushBackDisplacementFieldTransform(field);
+        warper->SetOutputParametersFromImage( field );
+        transcount++;
+        }
+        break;
+      default:
+        {
+        std::cout << "Unknown file type!" << std::endl;
         }
       }
+    }
 
-    // std::cout << "output origin: " << warper->GetOutputOrigin() << std::endl;
-    // std::cout << "output size: " << warper->GetOutputSize() << std::endl;
-    // std::cout << "output spacing: " << warper->GetOutputSpacing() << std::endl;
-    //    std::cout << "output direction: " << warper->GetOutputDirection() << std::endl;
-
-    // warper->PrintTransformList();
-    warper->DetermineFirstDeformNoInterp();
-    warper->Update();
-
-    typedef itk::ImageRegionIteratorWithIndex<TensorImageType> Iterator;
-    Iterator vfIter2( img_output, img_output->GetLargestPossibleRegion() );
-    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  if( img_ref.IsNotNull() )
+    {
+    warper->SetOutputParametersFromImage( img_ref );
+    }
+  else
+    {
+    if( misc_opt.use_TightestBoundingBox == true )
       {
-      PixelType tens = vfIter2.Get();
-      tens[tensdim] = warper->GetOutput()->GetPixel(vfIter2.GetIndex() );
-      vfIter2.Set(tens);
+      // compute the desired spacking after inputting all the transform files using the
+
+      typename ImageType::SizeType largest_size;
+      typename ImageType::PointType origin_warped;
+      GetLargestSizeAfterWarp<WarperType, TensorImageType>(warper, img_mov, largest_size, origin_warped);
+      warper->SetOutputParametersFromImage( img_mov );
+      warper->SetOutputSize(largest_size);
+      warper->SetOutputOrigin(origin_warped);
+        {
+        typename ImageType::DirectionType d;
+        d.SetIdentity();
+        warper->SetOutputDirection(d);
+        }
       }
     }
 
-  // DirectionCorrect<TensorImageType>(img_output, img_mov);
+  warper->DetermineFirstDeformNoInterp();
+  warper->Update();
 
+  typename TensorImageType::Pointer img_output = warper->GetOutput();
   WriteTensorImage<TensorImageType>(img_output, output_image_filename, true);
 }
 
@@ -547,6 +516,9 @@ private:
       << std::endl
       << "--Id uses the identity transform." << std::endl
       <<
+      "--reorient-ppd or --reorient-fs reorient the warped tensors by preservation of principal direction or finite strain, with the Jacobian of the same transforms, so that ReorientTensorImage is not needed afterwards."
+      << std::endl
+      <<
       "--moving-image-header or -mh in short will use the orientation header of the moving image file. This is typically not used with --reslice-by-header."
       << std::endl
       <<
@@ -588,10 +560,11 @@ private:
   MISC_OPT misc_opt;
 
   const int  kImageDim = atoi(argv[1]);
-  const bool is_parsing_ok =
+  unsigned int reorientation = 0;
+  const bool   is_parsing_ok =
     WarpTensorImageMultiTransform_ParseInput(argc - 2, argv + 2, moving_image_filename, output_image_filename,
                                              opt_queue,
-                                             misc_opt);
+                                             misc_opt, reorientation);
 
   if( is_parsing_ok )
     {
@@ -612,12 +585,12 @@ private:
       {
       case 2:
         {
-        WarpImageMultiTransform<2>(moving_image_filename, output_image_filename, opt_queue, misc_opt);
+        WarpImageMultiTransform<2>(moving_image_filename, output_image_filename, opt_queue, misc_opt, reorientation);
         }
         break;
       case 3:
         {
-        WarpImageMultiTransform<3>(moving_image_filename, output_image_filename, opt_queue, misc_opt);
+        WarpImageMultiTransform<3>(moving_image_filename, output_image_filename, opt_queue, misc_opt, reorientation);
         }
         break;
       }
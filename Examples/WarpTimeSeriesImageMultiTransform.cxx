@@ -9,7 +9,10 @@
 #include "itkVectorNearestNeighborInterpolateImageFunction.h"
 #include "ReadWriteData.h"
 #include "itkWarpImageMultiTransformFilter.h"
+#include "itkDisplacementFieldFromMultiTransformFilter.h"
 #include "itkExtractImageFilter.h"
+#include "itkWarpTimeSeriesImageFilter.h"
+#include "itksys/SystemTools.hxx"
 
 namespace ants
 {
@@ -24,6 +27,8 @@ static bool WarpTimeSeriesImageMultiTransform_ParseInput(int argc, char * *argv,
   misc_opt.use_NN_interpolator = false;
   misc_opt.use_TightestBoundingBox = false;
   misc_opt.use_RotationHeader = false;
+  misc_opt.composed_field_cache_directory = ITK_NULLPTR;
+  misc_opt.time_points_per_slab = 0;
 
   moving_image_filename = argv[0];
   output_image_filename = argv[1];
@@ -45,6 +50,22 @@ static bool WarpTimeSeriesImageMultiTransform_ParseInput(int argc, char * *argv,
         }
       misc_opt.reference_image_filename = argv[ind];
       }
+    else if( strcmp(argv[ind], "--cache-composed-warp") == 0 )
+      {
+      ind++; if( ind >= argc )
+        {
+        return false;
+        }
+      misc_opt.composed_field_cache_directory = argv[ind];
+      }
+    else if( strcmp(argv[ind], "--stream") == 0 )
+      {
+      ind++; if( ind >= argc )
+        {
+        return false;
+        }
+      misc_opt.time_points_per_slab = atoi( argv[ind] );
+      }
     else if( (strcmp(argv[ind], "--tightest-bounding-box") == 0) &&  (strcmp(argv[ind], "-R") != 0)  )
       {
       misc_opt.use_TightestBoundingBox = true;
@@ -299,6 +320,22 @@ void WarpImageMultiTransformFourD(char *moving_image_filename, char *output_imag
   std::cout << " 4D-Out-Dir " << transformedvecimage->GetDirection() << std::endl;
 
   unsigned int timedims = img_mov->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+
+  // the series of transformations is the same for every time point so, if a cache is
+  // given, it is collapsed once into a displacement field on the reference grid
+  typename DisplacementFieldType::Pointer composedField = ITK_NULLPTR;
+  std::string composedFieldCacheFileName;
+  if( misc_opt.composed_field_cache_directory && misc_opt.reference_image_filename )
+    {
+    composedFieldCacheFileName = GetComposedDisplacementFieldCacheFileName( opt_queue,
+                                                                             misc_opt.reference_image_filename,
+                                                                             misc_opt.composed_field_cache_directory );
+    if( itksys::SystemTools::FileExists( composedFieldCacheFileName.c_str(), true ) )
+      {
+      std::cout << " Reading the composed warp from the cache: " << composedFieldCacheFileName << std::endl;
+      ReadImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+      }
+    }
   for( unsigned int timedim = 0;  timedim < timedims;  timedim++ )
     {
     typename WarperType::Pointer  warper = WarperType::New();
@@ -317,64 +354,71 @@ void WarpImageMultiTransformFourD(char *moving_image_filename, char *output_imag
     typedef itk::TransformFileReader                    TranReaderType;
     typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
 
-    unsigned int transcount = 0;
-    const int    kOptQueueSize = opt_queue.size();
-    for( int i = 0; i < kOptQueueSize; i++ )
+    if( composedField.IsNull() )
       {
-      const TRAN_OPT & opt = opt_queue[i];
-
-      switch( opt.file_type )
+      unsigned int transcount = 0;
+      const int    kOptQueueSize = opt_queue.size();
+      for( int i = 0; i < kOptQueueSize; i++ )
         {
-        case AFFINE_FILE:
+        const TRAN_OPT & opt = opt_queue[i];
+
+        switch( opt.file_type )
           {
-          typename TranReaderType::Pointer tran_reader = TranReaderType::New();
-          tran_reader->SetFileName(opt.filename);
-          tran_reader->Update();
-          typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
-            ( (tran_reader->GetTransformList() )->front().GetPointer() );
-          if( opt.do_affine_inv )
+          case AFFINE_FILE:
             {
-            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-            aff->GetInverse(aff_inv);
-            aff = aff_inv;
+            typename TranReaderType::Pointer tran_reader = TranReaderType::New();
+            tran_reader->SetFileName(opt.filename);
+            tran_reader->Update();
+            typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
+              ( (tran_reader->GetTransformList() )->front().GetPointer() );
+            if( opt.do_affine_inv )
+              {
+              typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+              aff->GetInverse(aff_inv);
+              aff = aff_inv;
+              }
+            // std::cout <<" aff " << transcount <<  std::endl;
+            warper->PushBackAffineTransform(aff);
+            if( transcount == 0 )
+              {
+              warper->SetOutputParametersFromImage( img_ref );
+              }
+            transcount++;
             }
-          // std::cout <<" aff " << transcount <<  std::endl;
-          warper->PushBackAffineTransform(aff);
-          if( transcount == 0 )
+            break;
+          case IDENTITY_TRANSFORM:
             {
-            warper->SetOutputParametersFromImage( img_ref );
+            typename AffineTransformType::Pointer aff;
+            GetIdentityTransform(aff);
+            // std::cout << " aff id" << transcount << std::endl;
+            warper->PushBackAffineTransform(aff);
+            transcount++;
             }
-          transcount++;
-          }
-          break;
-        case IDENTITY_TRANSFORM:
-          {
-          typename AffineTransformType::Pointer aff;
-          GetIdentityTransform(aff);
-          // std::cout << " aff id" << transcount << std::endl;
-          warper->PushBackAffineTransform(aff);
-          transcount++;
-          }
-          break;
-        case DEFORMATION_FILE:
-          {
-          typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
-          field_reader->SetFileName( opt.filename );
-          field_reader->Update();
-          typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
+            break;
+          case DEFORMATION_FILE:
+            {
+            typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+            field_reader->SetFileName( opt.filename );
+            field_reader->Update();
+            typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
 
-          warper->PushBackDisplacementFieldTransform(field);
-          warper->SetOutputParametersFromImage( field );
+            warper->PushBackDisplacementFieldTransform(field);
+            warper->SetOutputParametersFromImage( field );
 
-          transcount++;
-          }
-          break;
-        default:
-          {
-          std::cout << "Unknown file type!" << std::endl;
+            transcount++;
+            }
+            break;
+          default:
+            {
+            std::cout << "Unknown file type!" << std::endl;
+            }
           }
         }
       }
+    else
+      {
+      warper->PushBackDisplacementFieldTransform( composedField );
+      }
 
     // warper->PrintTransformList();
     if( img_ref.IsNotNull() )
@@ -434,6 +478,19 @@ void WarpImageMultiTransformFourD(char *moving_image_filename, char *output_imag
     warpthisimage->SetDirection(qdir);
 
     warper->SetInput( warpthisimage );
+    if( !composedFieldCacheFileName.empty() && composedField.IsNull() )
+      {
+      typedef itk::DisplacementFieldFromMultiTransformFilter<DisplacementFieldType, DisplacementFieldType,
+                                                             AffineTransformType> ComposerType;
+      composedField = ComposeWarperTransformList<ComposerType>( warper.GetPointer(), img_ref.GetPointer() );
+
+      std::cout << " Writing the composed warp to the cache: " << composedFieldCacheFileName << std::endl;
+      itksys::SystemTools::MakeDirectory( misc_opt.composed_field_cache_directory );
+      WriteImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+
+      warper->GetTransformList().clear();
+      warper->PushBackDisplacementFieldTransform( composedField );
+      }
     warper->DetermineFirstDeformNoInterp();
     warper->Update();
 
@@ -462,6 +519,171 @@ void WarpImageMultiTransformFourD(char *moving_image_filename, char *output_imag
   WriteImage<VectorImageType>( transformedvecimage, output_image_filename);
 }
 
+// streamed version of WarpImageMultiTransformFourD:  the transforms are read once and the
+// time series is read, warped and written a slab of time points at a time
+template <int ImageDimension>
+void WarpImageMultiTransformFourDStreaming(char *moving_image_filename, char *output_image_filename,
+                                           TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt)
+{
+  typedef itk::Image<float,
+                     ImageDimension>                              VectorImageType; // 4D contains functional image
+  typedef itk::Image<float, ImageDimension
+                     - 1>                                         ImageType; // 3D image domain -R option
+  typedef itk::Vector<float, ImageDimension
+                      - 1>                                        VectorType; // 3D warp
+  typedef itk::Image<VectorType, ImageDimension
+                     - 1>                                         DisplacementFieldType; // 3D Field
+  typedef itk::MatrixOffsetTransformBase<double, ImageDimension - 1, ImageDimension
+                                         - 1>                     AffineTransformType;
+  typedef itk::WarpImageMultiTransformFilter<ImageType, ImageType, DisplacementFieldType,
+                                             AffineTransformType> WarperType;
+  typedef itk::WarpTimeSeriesImageFilter<VectorImageType, VectorImageType, WarperType> TimeSeriesWarperType;
+
+  itk::TransformFactory<AffineTransformType>::RegisterTransform();
+
+  if( !misc_opt.reference_image_filename )
+    {
+    std::cout << " A reference image (-R) is required to stream a time series." << std::endl;
+    return;
+    }
+  typename ImageType::Pointer img_ref;
+  ReadImage<ImageType>( img_ref, misc_opt.reference_image_filename );
+
+  // only the header is read here, the time points are read as they are requested downstream
+  typedef itk::ImageFileReader<VectorImageType> MovingReaderType;
+  typename MovingReaderType::Pointer movingReader = MovingReaderType::New();
+  movingReader->SetFileName( moving_image_filename );
+  movingReader->UpdateOutputInformation();
+  std::cout << " Four-D image size: " << movingReader->GetOutput()->GetLargestPossibleRegion().GetSize() << std::endl;
+
+  const unsigned int timedims =
+    movingReader->GetOutput()->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+
+  typename WarperType::Pointer  warper = WarperType::New();
+  warper->SetEdgePaddingValue(0);
+
+  if( misc_opt.use_NN_interpolator )
+    {
+    typedef typename itk::NearestNeighborInterpolateImageFunction<ImageType,
+                                                                  typename WarperType::CoordRepType>
+      NNInterpolateType;
+    typename NNInterpolateType::Pointer interpolator_NN = NNInterpolateType::New();
+    std::cout <<  " Use Nearest Neighbor interpolation " << std::endl;
+    warper->SetInterpolator(interpolator_NN);
+    }
+
+  typename DisplacementFieldType::Pointer composedField = ITK_NULLPTR;
+  std::string composedFieldCacheFileName;
+  if( misc_opt.composed_field_cache_directory )
+    {
+    composedFieldCacheFileName = GetComposedDisplacementFieldCacheFileName( opt_queue,
+                                                                             misc_opt.reference_image_filename,
+                                                                             misc_opt.composed_field_cache_directory );
+    if( itksys::SystemTools::FileExists( composedFieldCacheFileName.c_str(), true ) )
+      {
+      std::cout << " Reading the composed warp from the cache: " << composedFieldCacheFileName << std::endl;
+      ReadImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+      }
+    }
+
+  typedef itk::TransformFileReader                    TranReaderType;
+  typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
+
+  if( composedField.IsNull() )
+    {
+    const int kOptQueueSize = opt_queue.size();
+    for( int i = 0; i < kOptQueueSize; i++ )
+      {
+      const TRAN_OPT & opt = opt_queue[i];
+
+      switch( opt.file_type )
+        {
+        case AFFINE_FILE:
+          {
+          typename TranReaderType::Pointer tran_reader = TranReaderType::New();
+          tran_reader->SetFileName(opt.filename);
+          tran_reader->Update();
+          typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
+            ( (tran_reader->GetTransformList() )->front().GetPointer() );
+          if( opt.do_affine_inv )
+            {
+            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+            aff->GetInverse(aff_inv);
+            aff = aff_inv;
+            }
+          warper->PushBackAffineTransform(aff);
+          }
+          break;
+        case IDENTITY_TRANSFORM:
+          {
+          typename AffineTransformType::Pointer aff;
+          GetIdentityTransform(aff);
+          warper->PushBackAffineTransform(aff);
+          }
+          break;
+        case DEFORMATION_FILE:
+          {
+          typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+          field_reader->SetFileName( opt.filename );
+          field_reader->Update();
+          typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
+
+          warper->PushBackDisplacementFieldTransform(field);
+          }
+          break;
+        default:
+          {
+          std::cout << "Unknown file type!" << std::endl;
+          }
+        }
+      }
+    }
+  else
+    {
+    warper->PushBackDisplacementFieldTransform( composedField );
+    }
+  warper->SetOutputParametersFromImage( img_ref );
+
+  if( !composedFieldCacheFileName.empty() && composedField.IsNull() )
+    {
+    typedef itk::DisplacementFieldFromMultiTransformFilter<DisplacementFieldType, DisplacementFieldType,
+                                                           AffineTransformType> ComposerType;
+    composedField = ComposeWarperTransformList<ComposerType>( warper.GetPointer(), img_ref.GetPointer() );
+
+    std::cout << " Writing the composed warp to the cache: " << composedFieldCacheFileName << std::endl;
+    itksys::SystemTools::MakeDirectory( misc_opt.composed_field_cache_directory );
+    WriteImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+
+    warper->GetTransformList().clear();
+    warper->PushBackDisplacementFieldTransform( composedField );
+    }
+
+  typename TimeSeriesWarperType::Pointer timeSeriesWarper = TimeSeriesWarperType::New();
+  timeSeriesWarper->SetInput( movingReader->GetOutput() );
+  timeSeriesWarper->SetWarper( warper );
+
+  const unsigned int numberOfSlabs = ( timedims + misc_opt.time_points_per_slab - 1 ) / misc_opt.time_points_per_slab;
+  std::cout << " Warping " << timedims << " time points in " << numberOfSlabs << " slab(s) of at most "
+            << misc_opt.time_points_per_slab << " time points" << std::endl;
+
+  typedef itk::ImageFileWriter<VectorImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName( output_image_filename );
+  writer->SetInput( timeSeriesWarper->GetOutput() );
+  writer->SetNumberOfStreamDivisions( numberOfSlabs );
+  try
+    {
+    writer->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Exception caught while streaming the time series: " << std::endl;
+    std::cout << err << std::endl;
+    return;
+    }
+  std::cout << " 100 % complete " << std::endl;
+}
+
 template <int ImageDimension>
 void WarpImageMultiTransform(char *moving_image_filename, char *output_image_filename,
                              TRAN_OPT_QUEUE & opt_queue, MISC_OPT & misc_opt)
@@ -507,6 +729,21 @@ void WarpImageMultiTransform(char *moving_image_filename, char *output_image_fil
   typename VectorImageType::PixelType vec = img_mov->GetPixel(index);
   vec.Fill(0);
   img_output->FillBuffer( vec );
+  // the series of transformations is the same for every component so, if a cache is
+  // given, it is collapsed once into a displacement field on the reference grid
+  typename DisplacementFieldType::Pointer composedField = ITK_NULLPTR;
+  std::string composedFieldCacheFileName;
+  if( misc_opt.composed_field_cache_directory && misc_opt.reference_image_filename )
+    {
+    composedFieldCacheFileName = GetComposedDisplacementFieldCacheFileName( opt_queue,
+                                                                             misc_opt.reference_image_filename,
+                                                                             misc_opt.composed_field_cache_directory );
+    if( itksys::SystemTools::FileExists( composedFieldCacheFileName.c_str(), true ) )
+      {
+      std::cout << " Reading the composed warp from the cache: " << composedFieldCacheFileName << std::endl;
+      ReadImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+      }
+    }
   for( unsigned int tensdim = 0;  tensdim < veclength;  tensdim++ )
     {
     typedef itk::VectorIndexSelectionCastImageFilter<VectorImageType, ImageType> IndexSelectCasterType;
@@ -538,64 +775,71 @@ void WarpImageMultiTransform(char *moving_image_filename, char *output_image_fil
     typedef itk::TransformFileReader                    TranReaderType;
     typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
 
-    unsigned int transcount = 0;
-    const int    kOptQueueSize = opt_queue.size();
-    for( int i = 0; i < kOptQueueSize; i++ )
+    if( composedField.IsNull() )
       {
-      const TRAN_OPT & opt = opt_queue[i];
-
-      switch( opt.file_type )
+      unsigned int transcount = 0;
+      const int    kOptQueueSize = opt_queue.size();
+      for( int i = 0; i < kOptQueueSize; i++ )
         {
-        case AFFINE_FILE:
+        const TRAN_OPT & opt = opt_queue[i];
+
+        switch( opt.file_type )
           {
-          typename TranReaderType::Pointer tran_reader = TranReaderType::New();
-          tran_reader->SetFileName(opt.filename);
-          tran_reader->Update();
-          typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
-            ( (tran_reader->GetTransformList() )->front().GetPointer() );
-          if( opt.do_affine_inv )
+          case AFFINE_FILE:
             {
-            typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
-            aff->GetInverse(aff_inv);
-            aff = aff_inv;
+            typename TranReaderType::Pointer tran_reader = TranReaderType::New();
+            tran_reader->SetFileName(opt.filename);
+            tran_reader->Update();
+            typename AffineTransformType::Pointer aff = dynamic_cast<AffineTransformType *>
+              ( (tran_reader->GetTransformList() )->front().GetPointer() );
+            if( opt.do_affine_inv )
+              {
+              typename AffineTransformType::Pointer aff_inv = AffineTransformType::New();
+              aff->GetInverse(aff_inv);
+              aff = aff_inv;
+              }
+            // std::cout <<" aff " << transcount <<  std::endl;
+            warper->PushBackAffineTransform(aff);
+            if( transcount == 0 )
+              {
+              warper->SetOutputParametersFromImage( img_mov );
+              }
+            transcount++;
             }
-          // std::cout <<" aff " << transcount <<  std::endl;
-          warper->PushBackAffineTransform(aff);
-          if( transcount == 0 )
+            break;
+          case IDENTITY_TRANSFORM:
             {
-            warper->SetOutputParametersFromImage( img_mov );
+            typename AffineTransformType::Pointer aff;
+            GetIdentityTransform(aff);
+            // std::cout << " aff id" << transcount << std::endl;
+            warper->PushBackAffineTransform(aff);
+            transcount++;
             }
-          transcount++;
-          }
-          break;
-        case IDENTITY_TRANSFORM:
-          {
-          typename AffineTransformType::Pointer aff;
-          GetIdentityTransform(aff);
-          // std::cout << " aff id" << transcount << std::endl;
-          warper->PushBackAffineTransform(aff);
-          transcount++;
-          }
-          break;
-        case DEFORMATION_FILE:
-          {
-          typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
-          field_reader->SetFileName( opt.filename );
-          field_reader->Update();
-          typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
+            break;
+          case DEFORMATION_FILE:
+            {
+            typename FieldReaderType::Pointer field_reader = FieldReaderType::New();
+            field_reader->SetFileName( opt.filename );
+            field_reader->Update();
+            typename DisplacementFieldType::Pointer field = field_reader->GetOutput();
 
-          warper->PushBackDisplacementFieldTransform(field);
-          warper->SetOutputParametersFromImage( field );
+            warper->PushBackDisplacementFieldTransform(field);
+            warper->SetOutputParametersFromImage( field );
 
-          transcount++;
-          }
-          break;
-        default:
-          {
-          std::cout << "Unknown file type!" << std::endl;
+            transcount++;
+            }
+            break;
+          default:
+            {
+            std::cout << "Unknown file type!" << std::endl;
+            }
           }
         }
       }
+    else
+      {
+      warper->PushBackDisplacementFieldTransform( composedField );
+      }
 
     // warper->PrintTransformList();
 
@@ -623,6 +867,19 @@ void WarpImageMultiTransform(char *moving_image_filename, char *output_image_fil
         }
       }
 
+    if( !composedFieldCacheFileName.empty() && composedField.IsNull() )
+      {
+      typedef itk::DisplacementFieldFromMultiTransformFilter<DisplacementFieldType, DisplacementFieldType,
+                                                             AffineTransformType> ComposerType;
+      composedField = ComposeWarperTransformList<ComposerType>( warper.GetPointer(), img_ref.GetPointer() );
+
+      std::cout << " Writing the composed warp to the cache: " << composedFieldCacheFileName << std::endl;
+      itksys::SystemTools::MakeDirectory( misc_opt.composed_field_cache_directory );
+      WriteImage<DisplacementFieldType>( composedField, composedFieldCacheFileName.c_str() );
+
+      warper->GetTransformList().clear();
+      warper->PushBackDisplacementFieldTransform( composedField );
+      }
     warper->DetermineFirstDeformNoInterp();
     warper->Update();
 
@@ -728,6 +985,14 @@ private:
 
     std::cout << "\nInterpolation:" << std::endl;
     std::cout << " --use-NN            : Use Nearest Neighbor Interpolator" << std::endl;
+    std::cout
+      <<
+      " --cache-composed-warp <cache_directory> : Collapse the series of transformations once into a displacement field on the reference grid, stored in <cache_directory> for reuse, and warp every time point with it"
+      << std::endl;
+    std::cout
+      <<
+      " --stream <numberOfTimePoints> : 4D only.  Read, warp and write the time series in slabs of <numberOfTimePoints> time points so that memory does not grow with the length of the run.  The output must be a format that can be written in pieces (e.g. uncompressed .nii or .mha); otherwise it is assembled in memory."
+      << std::endl;
     std::cout << " --use-BSpline            : Use 3rd order B-Spline Interpolation." << std::endl;
 
     std::cout << "\n " << std::endl;
@@ -781,7 +1046,14 @@ private:
         break;
       case 4:
         {
-        WarpImageMultiTransformFourD<4>(moving_image_filename, output_image_filename, opt_queue, misc_opt);
+        if( misc_opt.time_points_per_slab > 0 )
+          {
+          WarpImageMultiTransformFourDStreaming<4>(moving_image_filename, output_image_filename, opt_queue, misc_opt);
+          }
+        else
+          {
+          WarpImageMultiTransformFourD<4>(moving_image_filename, output_image_filename, opt_queue, misc_opt);
+          }
         }
         break;
       }
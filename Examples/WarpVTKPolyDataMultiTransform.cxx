@@ -14,6 +14,7 @@
 #include "itkLabeledPointSetFileReader.h"
 #include "itkLabeledPointSetFileWriter.h"
 #include "itkMesh.h"
+#include "itkMultiThreader.h"
 #include <vtkPolyData.h>
 #include <vtkUnstructuredGrid.h>
 #include <vtkUnstructuredGridReader.h>
@@ -22,6 +23,8 @@
 #include <vtkPolyDataWriter.h>
 #include <vtkPoints.h>
 
+#include <algorithm>
+
 namespace ants
 {
 vnl_matrix_fixed<double, 4, 4> ConstructNiftiSform(
@@ -135,6 +138,81 @@ static bool WarpVTKPolyDataMultiTransform_ParseInput(int argc, char * *argv, cha
   return true;
 }
 
+/** Comma separated list of mesh files, e.g. "lh.vtk,rh.vtk". */
+static std::vector<std::string> SplitVTKFileNameList( const char *filenames )
+{
+  std::vector<std::string> list;
+  std::string              s( filenames );
+  std::string::size_type   begin = 0;
+  while( true )
+    {
+    const std::string::size_type end = s.find( ',', begin );
+    const std::string            name = s.substr( begin, end == std::string::npos ? std::string::npos : end - begin );
+    if( !name.empty() )
+      {
+      list.push_back( name );
+      }
+    if( end == std::string::npos )
+      {
+      break;
+      }
+    begin = end + 1;
+    }
+  return list;
+}
+
+template <class TWarper, class TImage>
+struct WarpVTKPointsThreadStruct
+  {
+  TWarper *                      Warper;
+  const TImage *                 Reference;
+  vnl_matrix_fixed<double, 4, 4> MeshToIndex;
+  const double *                 Input;
+  double *                       Output;
+  unsigned char *                IsInside;
+  vtkIdType                      NumberOfPoints;
+  };
+
+/** Warp the vertices of one thread's range.  MultiTransformSinglePoint only
+ * evaluates the transforms and interpolators, so it may run concurrently. */
+template <class TWarper, class TImage>
+ITK_THREAD_RETURN_TYPE WarpVTKPointsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  WarpVTKPointsThreadStruct<TWarper, TImage> *str =
+    static_cast<WarpVTKPointsThreadStruct<TWarper, TImage> *>( info->UserData );
+
+  const itk::SizeValueType numberOfPoints = static_cast<itk::SizeValueType>( str->NumberOfPoints );
+  const vtkIdType          begin = static_cast<vtkIdType>( numberOfPoints * info->ThreadID / info->NumberOfThreads );
+  const vtkIdType          end = static_cast<vtkIdType>( numberOfPoints * ( info->ThreadID + 1 )
+                                                         / info->NumberOfThreads );
+
+  typename TImage::PointType point;
+  typename TImage::PointType warpedPoint;
+  for( vtkIdType k = begin; k < end; k++ )
+    {
+    // Map the point from mesh to IJK coordinates (continuous index)
+    vnl_vector_fixed<double, 4> x_mesh, x_ijk;
+    x_mesh[0] = str->Input[3 * k]; x_mesh[1] = str->Input[3 * k + 1]; x_mesh[2] = str->Input[3 * k + 2];
+    x_mesh[3] = 1.0;
+    x_ijk = str->MeshToIndex * x_mesh;
+
+    itk::ContinuousIndex<double, TImage::ImageDimension> ind;
+    for( unsigned int d = 0; d < TImage::ImageDimension; d++ )
+      {
+      ind[d] = x_ijk[d];
+      }
+    str->Reference->TransformContinuousIndexToPhysicalPoint( ind, point );
+
+    str->IsInside[k] = str->Warper->MultiTransformSinglePoint( point, warpedPoint );
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      str->Output[3 * k + d] = d < TImage::ImageDimension ? warpedPoint[d] : str->Input[3 * k + d];
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <int ImageDimension>
 void WarpLabeledPointSetFileMultiTransform(char *input_vtk_filename, char *output_vtk_filename,
                                            char *reference_image_filename, TRAN_OPT_QUEUE & opt_queue)
@@ -148,7 +226,6 @@ void WarpLabeledPointSetFileMultiTransform(char *input_vtk_filename, char *outpu
   // WarperType;
   typedef itk::DisplacementFieldFromMultiTransformFilter<DisplacementFieldType,
                                                          DisplacementFieldType, AffineTransformType> WarperType;
-  typedef itk::LinearInterpolateImageFunction<ImageType> FuncType;
 
   itk::TransformFactory<AffineTransformType>::RegisterTransform();
 
@@ -232,108 +309,96 @@ void WarpLabeledPointSetFileMultiTransform(char *input_vtk_filename, char *outpu
 
   // warper->PrintTransformList();
   warper->DetermineFirstDeformNoInterp();
-  warper->Update();
-
-  typename DisplacementFieldType::Pointer field_output =
-    DisplacementFieldType::New();
-  field_output = warper->GetOutput();
-
-  /**
-   * Code to read the mesh
-   */
-  typename ImageType::PointType point;
-  typename ImageType::PointType warpedPoint;
 
-  typedef itk::Mesh<float, ImageDimension> MeshType;
-  //  typedef itk::LabeledPointSetFileReader<MeshType> VTKReaderType;
-  vtkPolyDataReader *vtkreader = vtkPolyDataReader::New();
-  vtkreader->SetFileName( input_vtk_filename );
-  vtkreader->Update();
-  vtkPolyData *mesh = vtkreader->GetOutput();
-
-  /*
-  typename VTKReaderType::Pointer vtkreader = VTKReaderType::New();
-  vtkreader->SetFileName( input_vtk_filename );
-  vtkreader->Update();
-  typename MeshType::PointsContainerIterator It
-    = vtkreader->GetOutput()->GetPoints()->Begin();
-
-  while( It != vtkreader->GetOutput()->GetPoints()->End() )
-    {
-    point.CastFrom( It.Value() );
-  */
-  vnl_matrix_fixed<double, 4, 4> ijk2ras, vtk2ras, lps2ras;
-  vtk2ras = ConstructVTKtoNiftiTransform(
-      field_output->GetDirection().GetVnlMatrix(),
-      field_output->GetOrigin().GetVnlVector(),
-      field_output->GetSpacing().GetVnlVector() );
-  ijk2ras.set_identity();
-  vtk2ras.set_identity();
-  lps2ras.set_identity();
-  lps2ras(0, 0) = -1; lps2ras(1, 1) = -1;
+  // The vertices are pushed through the transform list directly, so the
+  // composed field itself is never needed; the reference image gives the
+  // geometry that the field output would have had.
+  vnl_matrix_fixed<double, 4, 4> ijk2ras, vtk2ras;
 
   // Set up the transforms
   ijk2ras = ConstructNiftiSform(
-      field_output->GetDirection().GetVnlMatrix(),
-      field_output->GetOrigin().GetVnlVector(),
-      field_output->GetSpacing().GetVnlVector() );
+      img_ref->GetDirection().GetVnlMatrix(),
+      img_ref->GetOrigin().GetVnlVector(),
+      img_ref->GetSpacing().GetVnlVector() );
 
   vtk2ras = ConstructVTKtoNiftiTransform(
-      field_output->GetDirection().GetVnlMatrix(),
-      field_output->GetOrigin().GetVnlVector(),
-      field_output->GetSpacing().GetVnlVector() );
+      img_ref->GetDirection().GetVnlMatrix(),
+      img_ref->GetOrigin().GetVnlVector(),
+      img_ref->GetSpacing().GetVnlVector() );
 
   vnl_matrix_fixed<double, 4, 4> ras2ijk = vnl_inverse(ijk2ras);
-  vnl_matrix_fixed<double, 4, 4> ras2vtk = vnl_inverse(vtk2ras);
-  vnl_matrix_fixed<double, 4, 4> ras2lps = vnl_inverse(lps2ras);
-  // Update the coordinates
-  for( int k = 0; k < mesh->GetNumberOfPoints(); k++ )
+
+  typedef WarpVTKPointsThreadStruct<WarperType, ImageType> ThreadStructType;
+  ThreadStructType str;
+  str.Warper = warper.GetPointer();
+  str.Reference = img_ref.GetPointer();
+  str.MeshToIndex = ras2ijk * vtk2ras;
+
+  // the transforms are read once and reused for all the meshes
+  const std::vector<std::string> input_filenames = SplitVTKFileNameList( input_vtk_filename );
+  const std::vector<std::string> output_filenames = SplitVTKFileNameList( output_vtk_filename );
+  if( input_filenames.size() != output_filenames.size() )
     {
-    // Get the point (in whatever format that it's stored)
-    vnl_vector_fixed<double, 4> x_mesh, x_ras, x_ijk, v_warp, v_ras;
-    vnl_vector_fixed<double, 4> y_ras, y_mesh;
-    x_mesh[0] = mesh->GetPoint(k)[0]; x_mesh[1] = mesh->GetPoint(k)[1]; x_mesh[2] = mesh->GetPoint(k)[2];
-    x_mesh[3] = 1.0;
+    std::cout << "the number of input (" << input_filenames.size() << ") and output ("
+              << output_filenames.size() << ") meshes differ!!!" << std::endl;
+    return;
+    }
 
-    // Map the point into RAS coordinates
-    //    if(parm.mesh_coord == RAS)  x_ras = x_mesh;
-    //    else if(parm.mesh_coord == LPS) x_ras = lps2ras * x_mesh;
-    //    else if(parm.mesh_coord == IJKOS)
-    x_ras = vtk2ras * x_mesh;
-    //    else   x_ras = ijk2ras * x_mesh;
-
-    // Map the point to IJK coordinates (continuous index)
-    x_ijk = ras2ijk * x_ras;
-
-    typename FuncType::ContinuousIndexType ind;
-    ind[0] = x_ijk[0];
-    ind[1] = x_ijk[1];
-    ind[2] = x_ijk[2];
-    field_output->TransformContinuousIndexToPhysicalPoint(ind, point);
-    //      std::cout << " point " << point << std::endl;
-    // std::cout << " point-t " << point << std::endl;
-    bool isInside = warper->MultiTransformSinglePoint( point, warpedPoint );
-    // if ( isInside ) std::cout << " point-w " << warpedPoint << std::endl;
-    if( isInside )
+  for( size_t m = 0; m < input_filenames.size(); m++ )
+    {
+    vtkPolyDataReader *vtkreader = vtkPolyDataReader::New();
+    vtkreader->SetFileName( input_filenames[m].c_str() );
+    vtkreader->Update();
+    vtkPolyData *mesh = vtkreader->GetOutput();
+
+    const vtkIdType numberOfPoints = mesh->GetNumberOfPoints();
+    std::vector<double>        coordinates( 3 * numberOfPoints );
+    std::vector<double>        warpedCoordinates( 3 * numberOfPoints );
+    std::vector<unsigned char> isInside( numberOfPoints );
+    for( vtkIdType k = 0; k < numberOfPoints; k++ )
       {
-      typename MeshType::PointType newPoint;
-      newPoint.CastFrom( warpedPoint );
-      //      vtkreader->GetOutput()->SetPoint( It.Index(), newPoint );
-      if( ImageDimension == 3 )
+      mesh->GetPoint( k, &coordinates[3 * k] );
+      }
+
+    str.Input = numberOfPoints > 0 ? &coordinates[0] : ITK_NULLPTR;
+    str.Output = numberOfPoints > 0 ? &warpedCoordinates[0] : ITK_NULLPTR;
+    str.IsInside = numberOfPoints > 0 ? &isInside[0] : ITK_NULLPTR;
+    str.NumberOfPoints = numberOfPoints;
+
+    // Update the coordinates, each thread takes a contiguous range of vertices
+    unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if( static_cast<vtkIdType>( numberOfThreads ) > numberOfPoints )
+      {
+      numberOfThreads = std::max( static_cast<unsigned int>( numberOfPoints ), 1u );
+      }
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( WarpVTKPointsThreaderCallback<WarperType, ImageType>, &str );
+    threader->SingleMethodExecute();
+
+    if( ImageDimension == 3 )
+      {
+      vtkPoints *points = mesh->GetPoints();
+      for( vtkIdType k = 0; k < numberOfPoints; k++ )
         {
-        mesh->GetPoints()->SetPoint(k, warpedPoint[0], warpedPoint[1], warpedPoint[2]);
+        if( isInside[k] )
+          {
+          points->SetPoint( k, &warpedCoordinates[3 * k] );
+          }
         }
+      points->Modified();
       }
-    //    ++It;
-    }
 
-  std::string fn = std::string(output_vtk_filename);
-  if( fn.rfind(".vtk") == fn.length() - 4 )
-    {
-    vtkPolyDataWriter *writer = vtkPolyDataWriter::New();
-    writer->SetFileName(output_vtk_filename);
-    writer->SetInputData(mesh);
-    writer->Update();
+    const std::string & fn = output_filenames[m];
+    if( fn.length() >= 4 && fn.rfind(".vtk") == fn.length() - 4 )
+      {
+      vtkPolyDataWriter *writer = vtkPolyDataWriter::New();
+      writer->SetFileName( fn.c_str() );
+      writer->SetInputData(mesh);
+      writer->Update();
+      writer->Delete();
+      }
+    vtkreader->Delete();
     }
 
   /*
@@ -536,6 +601,11 @@ private:
       << "outputVTKFile [-R reference_image] "
       << "{[deformation_field | [-i] affine_transform_txt ]}"
       << std::endl;
+    std::cout
+      << "  inputVTKFile and outputVTKFile may be comma separated lists of the same length, "
+      << "e.g. lh.vtk,rh.vtk lh_warped.vtk,rh_warped.vtk; the transforms are then read once "
+      << "and applied to every mesh."
+      << std::endl;
     return EXIT_FAILURE;
     }
 
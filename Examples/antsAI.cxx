@@ -4,22 +4,31 @@
 #include "ReadWriteData.h"
 
 #include "itkAffineTransform.h"
+#include "itkCastImageFilter.h"
 #include "itkConjugateGradientLineSearchOptimizerv4.h"
 #include "itkEuler2DTransform.h"
 #include "itkEuler3DTransform.h"
 #include "itkCorrelationImageToImageMetricv4.h"
+#include "itkDiscreteGaussianImageFilter.h"
+#include "itkImageDuplicator.h"
 #include "itkImageMaskSpatialObject.h"
 #include "itkImageMomentsCalculator.h"
 #include "itkImageToImageMetricv4.h"
 #include "itkJointHistogramMutualInformationImageToImageMetricv4.h"
 #include "itkLandmarkBasedTransformInitializer.h"
 #include "itkLinearInterpolateImageFunction.h"
+#include "itkMaskedFFTNormalizedCorrelationImageFilter.h"
+#include "itkMatrixOffsetTransformBase.h"
 #include "itkMattesMutualInformationImageToImageMetricv4.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
 #include "itkMultiScaleLaplacianBlobDetectorImageFilter.h"
-#include "itkMultiStartOptimizerv4.h"
+#include "itkMultiThreader.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkRegistrationParameterScalesFromPhysicalShift.h"
+#include "itkResampleImageFilter.h"
 #include "itkRigid2DTransform.h"
+#include "itkShrinkImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkSimilarity2DTransform.h"
 #include "itkSimilarity3DTransform.h"
 #include "itkVersorRigid3DTransform.h"
@@ -28,6 +37,8 @@
 #include "vnl/vnl_cross.h"
 #include "vnl/vnl_inverse.h"
 
+#include <algorithm>
+
 namespace ants
 {
 
@@ -153,14 +164,30 @@ typedef itk::Similarity3DTransform<float> TransformType;
 // ##########################################################################
 // ##########################################################################
 
-template<class TImage, class TGradientImage, class TInterpolator, class TReal>
-TReal PatchCorrelation( itk::NeighborhoodIterator<TImage> fixedNeighborhood,
-                        itk::NeighborhoodIterator<TImage> movingNeighborhood,
-                        std::vector<unsigned int> activeIndex,
-                        std::vector<TReal> weights,
-                        typename TGradientImage::Pointer fixedGradientImage,
-                        typename TGradientImage::Pointer movingGradientImage,
-                        typename TInterpolator::Pointer movingInterpolator )
+/** The parts of the patch correlation that depend on one blob only,
+ * extracted once per blob instead of once per blob pair. */
+template<class TReal, unsigned int VDimension>
+struct BlobPatchDescriptor
+  {
+  bool                                      IsValid;
+  // fixed blobs: the mean-subtracted patch samples and their norm
+  vnl_vector<TReal>                         Samples;
+  TReal                                     SamplesNorm;
+  // principal axes of the patch gradients
+  vnl_vector<TReal>                         PrimaryEigenVector;
+  vnl_vector<TReal>                         SecondaryEigenVector;
+  // moving blobs: the patch centroid and the patch offsets from it, as
+  // continuous indices
+  itk::ContinuousIndex<double, VDimension>      CentroidIndex;
+  std::vector<itk::Vector<double, VDimension> > CentroidOffsets;
+  };
+
+template<class TImage, class TGradientImage, class TReal>
+BlobPatchDescriptor<TReal, TImage::ImageDimension>
+GetBlobPatchDescriptor( const TImage *image, const TGradientImage *gradientImage,
+                        const typename TImage::IndexType & center,
+                        const std::vector<typename TImage::OffsetType> & offsets,
+                        const std::vector<TReal> & weights, bool isMovingBlob )
 {
   typedef TReal                                          RealType;
   typedef TImage                                         ImageType;
@@ -169,136 +196,213 @@ TReal PatchCorrelation( itk::NeighborhoodIterator<TImage> fixedNeighborhood,
 
   typedef typename ImageType::PointType                  PointType;
   typedef itk::CovariantVector<RealType, ImageDimension> GradientPixelType;
-  typedef vnl_vector<RealType>                           VectorType;
   typedef typename ImageType::IndexType                  IndexType;
 
-  unsigned int           numberOfIndices = activeIndex.size();
-  std::vector<PointType> movingImagePatchPoints;
-  VectorType             fixedSamples( numberOfIndices, 0 );
-  VectorType             movingSamples( numberOfIndices, 0 );
+  BlobPatchDescriptor<RealType, ImageDimension> descriptor;
+  descriptor.IsValid = false;
+  descriptor.SamplesNorm = 0.0;
+
+  if( image->GetPixel( center ) <= 1.0e-4 )
+    {
+    return descriptor;
+    }
+
+  const unsigned int numberOfIndices = offsets.size();
 
-  vnl_matrix<RealType> fixedGradientMatrix( numberOfIndices, ImageDimension, 0.0 );
-  vnl_matrix<RealType> movingGradientMatrix( numberOfIndices, ImageDimension, 0.0 );
+  vnl_matrix<RealType> gradientMatrix( numberOfIndices, ImageDimension, 0.0 );
+  descriptor.Samples.set_size( numberOfIndices );
 
-  PointType movingPointCentroid( 0.0 );
+  PointType pointCentroid( 0.0 );
 
-  RealType weight = 1.0 / static_cast<RealType>( numberOfIndices );
+  const RealType weight = 1.0 / static_cast<RealType>( numberOfIndices );
   for( unsigned int i = 0; i < numberOfIndices; i++ )
     {
-    fixedSamples[i] = fixedNeighborhood.GetPixel( activeIndex[i] );
-    movingSamples[i] = movingNeighborhood.GetPixel( activeIndex[i] );
+    const IndexType index = center + offsets[i];
+    if( !gradientImage->GetRequestedRegion().IsInside( index ) )
+      {
+      return descriptor;
+      }
 
-    IndexType fixedIndex = fixedNeighborhood.GetIndex( activeIndex[i] );
-    IndexType movingIndex = movingNeighborhood.GetIndex( activeIndex[i] );
+    descriptor.Samples[i] = image->GetPixel( index );
 
-    if( fixedGradientImage->GetRequestedRegion().IsInside( fixedIndex ) &&
-        movingGradientImage->GetRequestedRegion().IsInside( movingIndex ) )
+    GradientPixelType gradient = gradientImage->GetPixel( index ) * weights[i];
+    for( unsigned int j = 0; j < ImageDimension; j++ )
       {
-      GradientPixelType fixedGradient = fixedGradientImage->GetPixel( fixedIndex ) * weights[i];
-      GradientPixelType movingGradient = movingGradientImage->GetPixel( movingIndex ) * weights[i];
-      for( unsigned int j = 0; j < ImageDimension; j++ )
-        {
-        fixedGradientMatrix(i, j) = fixedGradient[j];
-        movingGradientMatrix(i, j) = movingGradient[j];
-        }
-      PointType movingPoint( 0.0 );
-      movingGradientImage->TransformIndexToPhysicalPoint( movingIndex, movingPoint );
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        movingPointCentroid[d] += movingPoint[d] * weight;
-        }
-      movingImagePatchPoints.push_back( movingPoint );
+      gradientMatrix(i, j) = gradient[j];
       }
-    else
+    PointType point( 0.0 );
+    gradientImage->TransformIndexToPhysicalPoint( index, point );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
       {
-      return 0.0;
+      pointCentroid[d] += point[d] * weight;
       }
     }
 
-  fixedSamples -= fixedSamples.mean();
-  movingSamples -= movingSamples.mean();
-
-  RealType fixedSd = std::sqrt( fixedSamples.squared_magnitude() );
+  descriptor.Samples -= descriptor.Samples.mean();
+  descriptor.SamplesNorm = std::sqrt( descriptor.Samples.squared_magnitude() );
 
   // compute patch orientation
 
-  vnl_matrix<RealType> fixedCovariance = fixedGradientMatrix.transpose() * fixedGradientMatrix;
-  vnl_matrix<RealType> movingCovariance = movingGradientMatrix.transpose() * movingGradientMatrix;
+  vnl_matrix<RealType> covariance = gradientMatrix.transpose() * gradientMatrix;
+  vnl_symmetric_eigensystem<RealType> principalAxes( covariance );
 
-  vnl_symmetric_eigensystem<RealType> fixedImagePrincipalAxes( fixedCovariance );
-  vnl_symmetric_eigensystem<RealType> movingImagePrincipalAxes( movingCovariance );
+  if( ImageDimension == 2 )
+    {
+    descriptor.PrimaryEigenVector = principalAxes.get_eigenvector( 1 );
+    }
+  else if( ImageDimension == 3 )
+    {
+    descriptor.PrimaryEigenVector = principalAxes.get_eigenvector( 2 );
+    descriptor.SecondaryEigenVector = principalAxes.get_eigenvector( 1 );
+    }
+
+  if( isMovingBlob )
+    {
+    // the moving samples are taken from the rotated patch, only the
+    // geometry is needed
+    descriptor.Samples.clear();
+
+    image->TransformPhysicalPointToContinuousIndex( pointCentroid, descriptor.CentroidIndex );
+    descriptor.CentroidOffsets.resize( numberOfIndices );
+    for( unsigned int i = 0; i < numberOfIndices; i++ )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        descriptor.CentroidOffsets[i][d] = static_cast<double>( center[d] + offsets[i][d] )
+          - descriptor.CentroidIndex[d];
+        }
+      }
+    }
 
-  vnl_vector<RealType> fixedPrimaryEigenVector;
-  vnl_vector<RealType> fixedSecondaryEigenVector;
-  vnl_vector<RealType> fixedTertiaryEigenVector;
-  vnl_vector<RealType> movingPrimaryEigenVector;
-  vnl_vector<RealType> movingSecondaryEigenVector;
+  descriptor.IsValid = true;
+  return descriptor;
+}
+
+/** Correlation of a fixed patch with the moving patch rotated so that the
+ * principal axes of their gradients agree. */
+template<class TImage, class TInterpolator, class TReal>
+TReal PatchCorrelation( const BlobPatchDescriptor<TReal, TImage::ImageDimension> & fixedDescriptor,
+                        const BlobPatchDescriptor<TReal, TImage::ImageDimension> & movingDescriptor,
+                        const vnl_matrix<double> & indexToPhysical,
+                        const vnl_matrix<double> & physicalToIndex,
+                        const TInterpolator *movingInterpolator,
+                        vnl_vector<TReal> & movingSamples )
+{
+  typedef TReal                                          RealType;
+  typedef TImage                                         ImageType;
+
+  const unsigned int ImageDimension = ImageType::ImageDimension;
 
   vnl_matrix<RealType> B;
 
   if( ImageDimension == 2 )
     {
-    fixedPrimaryEigenVector = fixedImagePrincipalAxes.get_eigenvector( 1 );
-    movingPrimaryEigenVector = movingImagePrincipalAxes.get_eigenvector( 1 );
-
-    B = outer_product( movingPrimaryEigenVector, fixedPrimaryEigenVector );
+    B = outer_product( movingDescriptor.PrimaryEigenVector, fixedDescriptor.PrimaryEigenVector );
     }
   else if( ImageDimension == 3 )
     {
-    fixedPrimaryEigenVector = fixedImagePrincipalAxes.get_eigenvector( 2 );
-    fixedSecondaryEigenVector = fixedImagePrincipalAxes.get_eigenvector( 1 );
-
-    movingPrimaryEigenVector = movingImagePrincipalAxes.get_eigenvector( 2 );
-    movingSecondaryEigenVector = movingImagePrincipalAxes.get_eigenvector( 1 );
-
-    B = outer_product( movingPrimaryEigenVector, fixedPrimaryEigenVector ) +
-      outer_product( movingSecondaryEigenVector, fixedSecondaryEigenVector );
+    B = outer_product( movingDescriptor.PrimaryEigenVector, fixedDescriptor.PrimaryEigenVector ) +
+      outer_product( movingDescriptor.SecondaryEigenVector, fixedDescriptor.SecondaryEigenVector );
     }
 
   vnl_svd<RealType> wahba( B );
   vnl_matrix<RealType> A = wahba.V() * wahba.U().transpose();
 
-  bool patchIsInside = true;
-  for( unsigned int i = 0; i < numberOfIndices; i++ )
+  // the rotation about the patch centroid, in continuous index coordinates
+  vnl_matrix<double> physicalRotation( ImageDimension, ImageDimension );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
     {
-    PointType movingImagePoint = movingImagePatchPoints[i];
-    vnl_vector<RealType> movingImageVector( ImageDimension, 0.0 );
-    for( unsigned int d = 0; d < ImageDimension; d++ )
+    for( unsigned int e = 0; e < ImageDimension; e++ )
       {
-      movingImagePoint[d] -= movingPointCentroid[d];
-      movingImageVector[d] = movingImagePoint[d];
+      physicalRotation(d, e) = A(d, e);
       }
+    }
+  const vnl_matrix<double> indexRotation = physicalToIndex * physicalRotation * indexToPhysical;
+
+  const unsigned int numberOfIndices = movingDescriptor.CentroidOffsets.size();
+  movingSamples.set_size( numberOfIndices );
 
-    vnl_vector<RealType> movingImagePointRotated = A * movingImageVector;
+  typename TInterpolator::ContinuousIndexType movingIndex;
+  for( unsigned int i = 0; i < numberOfIndices; i++ )
+    {
+    const itk::Vector<double, ImageDimension> & offset = movingDescriptor.CentroidOffsets[i];
     for( unsigned int d = 0; d < ImageDimension; d++ )
       {
-      movingImagePoint[d] = movingImagePointRotated[d] + movingPointCentroid[d];
-      }
-    if( movingInterpolator->IsInsideBuffer( movingImagePoint ) )
-      {
-      movingSamples[i] = movingInterpolator->Evaluate( movingImagePoint );
+      double value = movingDescriptor.CentroidIndex[d];
+      for( unsigned int e = 0; e < ImageDimension; e++ )
+        {
+        value += indexRotation(d, e) * offset[e];
+        }
+      movingIndex[d] = value;
       }
-    else
+    if( !movingInterpolator->IsInsideBuffer( movingIndex ) )
       {
-      patchIsInside = false;
-      break;
+      return 0.0;
       }
+    movingSamples[i] = movingInterpolator->EvaluateAtContinuousIndex( movingIndex );
     }
 
-  RealType correlation = 0.0;
-  if( patchIsInside )
+  movingSamples -= movingSamples.mean();
+  RealType movingSd = std::sqrt( movingSamples.squared_magnitude() );
+  RealType correlation = inner_product( fixedDescriptor.Samples, movingSamples ) /
+    ( fixedDescriptor.SamplesNorm * movingSd );
+
+  if( vnl_math_isnan( correlation ) || vnl_math_isinf( correlation )  )
     {
-    movingSamples -= movingSamples.mean();
-    RealType movingSd = std::sqrt( movingSamples.squared_magnitude() );
-    correlation = inner_product( fixedSamples, movingSamples ) / ( fixedSd * movingSd );
+    correlation = 0.0;
+    }
+
+  return correlation;
+}
+
+template<class TImage, class TInterpolator, class TReal>
+struct BlobCorrespondenceThreadStruct
+  {
+  const std::vector<BlobPatchDescriptor<TReal, TImage::ImageDimension> > *FixedDescriptors;
+  const std::vector<BlobPatchDescriptor<TReal, TImage::ImageDimension> > *MovingDescriptors;
+  vnl_matrix<double>                                                       IndexToPhysical;
+  vnl_matrix<double>                                                       PhysicalToIndex;
+  const TInterpolator *                                                    MovingInterpolator;
+  vnl_matrix<TReal> *                                                      CorrespondenceMatrix;
+  };
+
+template<class TImage, class TInterpolator, class TReal>
+ITK_THREAD_RETURN_TYPE BlobCorrespondenceThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  BlobCorrespondenceThreadStruct<TImage, TInterpolator, TReal> *str =
+    static_cast<BlobCorrespondenceThreadStruct<TImage, TInterpolator, TReal> *>( info->UserData );
+
+  const unsigned int numberOfFixedBlobs = str->FixedDescriptors->size();
+  const unsigned int begin = numberOfFixedBlobs * info->ThreadID / info->NumberOfThreads;
+  const unsigned int end = numberOfFixedBlobs * ( info->ThreadID + 1 ) / info->NumberOfThreads;
 
-    if( vnl_math_isnan( correlation ) || vnl_math_isinf( correlation )  )
+  vnl_vector<TReal> movingSamples;
+  for( unsigned int i = begin; i < end; i++ )
+    {
+    if( !( *str->FixedDescriptors )[i].IsValid )
       {
-      correlation = 0.0;
+      continue;
       }
-    }
+    for( unsigned int j = 0; j < str->MovingDescriptors->size(); j++ )
+      {
+      if( !( *str->MovingDescriptors )[j].IsValid )
+        {
+        continue;
+        }
+      TReal correlation = PatchCorrelation<TImage, TInterpolator, TReal>( ( *str->FixedDescriptors )[i],
+        ( *str->MovingDescriptors )[j], str->IndexToPhysical, str->PhysicalToIndex, str->MovingInterpolator,
+        movingSamples );
 
-  return correlation;
+      if( correlation < 0.0 )
+        {
+        correlation = 0.0;
+        }
+
+      ( *str->CorrespondenceMatrix )(i, j) = correlation;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 template<class TImage, class TBlobFilter>
@@ -310,6 +414,7 @@ void GetBlobCorrespondenceMatrix( typename TImage::Pointer fixedImage,  typename
   typedef TImage                                 ImageType;
   typedef float                                  RealType;
   typedef typename ImageType::IndexType          IndexType;
+  typedef typename ImageType::OffsetType         OffsetType;
   typedef itk::NeighborhoodIterator<ImageType>   NeighborhoodIteratorType;
 
   const unsigned int ImageDimension = ImageType::ImageDimension;
@@ -343,13 +448,12 @@ void GetBlobCorrespondenceMatrix( typename TImage::Pointer fixedImage,  typename
   radius.Fill( radiusValue );
 
   NeighborhoodIteratorType ItF( radius, fixedImage, fixedImage->GetLargestPossibleRegion() );
-  NeighborhoodIteratorType ItM( radius, movingImage, movingImage->GetLargestPossibleRegion() );
 
   IndexType zeroIndex;
   zeroIndex.Fill( radiusValue );
   ItF.SetLocation( zeroIndex );
 
-  std::vector<unsigned int> activeIndex;
+  std::vector<OffsetType> activeOffsets;
   std::vector<RealType> weights;
   RealType weightSum = 0.0;
   for( unsigned int i = 0; i < ItF.Size(); i++ )
@@ -363,7 +467,7 @@ void GetBlobCorrespondenceMatrix( typename TImage::Pointer fixedImage,  typename
     distance = std::sqrt( distance );
     if( distance <= radiusValue )
       {
-      activeIndex.push_back( i );
+      activeOffsets.push_back( ItF.GetOffset( i ) );
       RealType weight = std::exp( -1.0 * distance / vnl_math_sqr( radiusValue ) );
       weights.push_back( weight );
       weightSum += ( weight );
@@ -378,32 +482,49 @@ void GetBlobCorrespondenceMatrix( typename TImage::Pointer fixedImage,  typename
   typename ScalarInterpolatorType::Pointer movingInterpolator =  ScalarInterpolatorType::New();
   movingInterpolator->SetInputImage( movingImage );
 
+  // the patch samples, orientations and geometry of every blob, once
+
+  typedef BlobPatchDescriptor<RealType, ImageDimension> DescriptorType;
+
+  std::vector<DescriptorType> fixedDescriptors;
   for( unsigned int i = 0; i < fixedBlobs.size(); i++ )
     {
-    IndexType fixedIndex = fixedBlobs[i]->GetCenter();
-    if( fixedImage->GetPixel( fixedIndex ) > 1.0e-4 )
-      {
-      ItF.SetLocation( fixedIndex );
-      for( unsigned int j = 0; j < movingBlobs.size(); j++ )
-        {
-        IndexType movingIndex = movingBlobs[j]->GetCenter();
-        if( movingImage->GetPixel( movingIndex ) > 1.0e-4 )
-          {
-          ItM.SetLocation( movingIndex );
+    fixedDescriptors.push_back( GetBlobPatchDescriptor<ImageType, GradientImageType, RealType>(
+      fixedImage, fixedGradientImage, fixedBlobs[i]->GetCenter(), activeOffsets, weights, false ) );
+    }
+  std::vector<DescriptorType> movingDescriptors;
+  for( unsigned int j = 0; j < movingBlobs.size(); j++ )
+    {
+    movingDescriptors.push_back( GetBlobPatchDescriptor<ImageType, GradientImageType, RealType>(
+      movingImage, movingGradientImage, movingBlobs[j]->GetCenter(), activeOffsets, weights, true ) );
+    }
 
-          RealType correlation = PatchCorrelation<ImageType, GradientImageType, ScalarInterpolatorType, RealType>
-            ( ItF, ItM, activeIndex, weights, fixedGradientImage, movingGradientImage, movingInterpolator );
+  typedef BlobCorrespondenceThreadStruct<ImageType, ScalarInterpolatorType, RealType> ThreadStructType;
+  ThreadStructType str;
+  str.FixedDescriptors = &fixedDescriptors;
+  str.MovingDescriptors = &movingDescriptors;
+  str.MovingInterpolator = movingInterpolator.GetPointer();
+  str.CorrespondenceMatrix = &correspondenceMatrix;
 
-          if( correlation < 0.0 )
-            {
-            correlation = 0.0;
-            }
-
-          correspondenceMatrix(i, j) = correlation;
-          }
-        }
+  str.IndexToPhysical.set_size( ImageDimension, ImageDimension );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    for( unsigned int e = 0; e < ImageDimension; e++ )
+      {
+      str.IndexToPhysical(d, e) = movingImage->GetDirection()(d, e) * movingImage->GetSpacing()[e];
       }
     }
+  str.PhysicalToIndex = vnl_inverse( str.IndexToPhysical );
+
+  // each thread fills in the correlations of a range of fixed blobs
+  const unsigned int numberOfThreads = std::max( std::min(
+    static_cast<unsigned int>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+    static_cast<unsigned int>( fixedBlobs.size() ) ), 1u );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( BlobCorrespondenceThreaderCallback<ImageType, ScalarInterpolatorType, RealType>, &str );
+  threader->SingleMethodExecute();
 
   return;
 }
@@ -588,15 +709,633 @@ typename TTransform::Pointer GetTransformFromFeatureMatching( typename TImage::P
   //
   /////////////////////////////////////////////////////////////////
 
-  typename TransformInitializerType::Pointer transformInitializer = TransformInitializerType::New();
-  transformInitializer->SetFixedLandmarks( fixedLandmarks );
-  transformInitializer->SetMovingLandmarks( movingLandmarks );
+  typename TransformInitializerType::Pointer transformInitializer = TransformInitializerType::New();
+  transformInitializer->SetFixedLandmarks( fixedLandmarks );
+  transformInitializer->SetMovingLandmarks( movingLandmarks );
+
+  transformInitializer->SetTransform( transform );
+  transformInitializer->InitializeTransform();
+
+  return transform;
+}
+
+enum SamplingStrategyType { NONE, REGULAR, RANDOM };
+
+// ##########################################################################
+//      Metric set up, shared by all the workers and levels of the search
+// ##########################################################################
+
+template <class TImage, class TMaskSpatialObject>
+typename itk::ImageToImageMetricv4<TImage, TImage, TImage, double>::Pointer
+CreateSearchMetric( const std::string & metric, unsigned int numberOfBins,
+                    TImage *fixedImage, TImage *movingImage,
+                    TMaskSpatialObject *fixedMaskSpatialObject, TMaskSpatialObject *movingMaskSpatialObject,
+                    SamplingStrategyType samplingStrategy, double samplingPercentage,
+                    itk::ThreadIdType numberOfThreads,
+                    itk::ImageToImageMetricv4<TImage, TImage, TImage, double> *sharedGradientsMetric,
+                    bool verbose )
+{
+  typedef TImage                                                            ImageType;
+  typedef itk::ImageToImageMetricv4<ImageType, ImageType, ImageType, double> ImageMetricType;
+
+  const unsigned int ImageDimension = ImageType::ImageDimension;
+
+  typename ImageMetricType::Pointer imageMetric = ITK_NULLPTR;
+
+  if( std::strcmp( metric.c_str(), "mattes" ) == 0 )
+    {
+    if( verbose )
+      {
+      std::cout << "Using the Mattes MI metric (number of bins = " << numberOfBins << ")" << std::endl;
+      }
+    typedef itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType, ImageType, double> MutualInformationMetricType;
+    typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
+    mutualInformationMetric = mutualInformationMetric;
+    mutualInformationMetric->SetNumberOfHistogramBins( numberOfBins );
+    mutualInformationMetric->SetUseMovingImageGradientFilter( true );
+    mutualInformationMetric->SetUseFixedImageGradientFilter( true );
+
+    imageMetric = mutualInformationMetric;
+    }
+  else if( std::strcmp( metric.c_str(), "mi" ) == 0 )
+    {
+    if( verbose )
+      {
+      std::cout << "Using the joint histogram MI metric (number of bins = " << numberOfBins << ")" << std::endl;
+      }
+    typedef itk::JointHistogramMutualInformationImageToImageMetricv4<ImageType, ImageType, ImageType,
+                                                                     double> MutualInformationMetricType;
+    typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
+    mutualInformationMetric = mutualInformationMetric;
+    mutualInformationMetric->SetNumberOfHistogramBins( numberOfBins );
+    mutualInformationMetric->SetUseMovingImageGradientFilter( true );
+    mutualInformationMetric->SetUseFixedImageGradientFilter( true );
+    mutualInformationMetric->SetVarianceForJointPDFSmoothing( 1.0 );
+
+    imageMetric = mutualInformationMetric;
+    }
+  else if( std::strcmp( metric.c_str(), "gc" ) == 0 )
+    {
+    if( verbose )
+      {
+      std::cout << "Using the global correlation metric " << std::endl;
+      }
+    typedef itk::CorrelationImageToImageMetricv4<ImageType, ImageType, ImageType, double> corrMetricType;
+    typename corrMetricType::Pointer corrMetric = corrMetricType::New();
+
+    imageMetric = corrMetric;
+    }
+  else
+    {
+    if( verbose )
+      {
+      std::cerr << "ERROR: Unrecognized metric. " << std::endl;
+      }
+    return ITK_NULLPTR;
+    }
+
+  imageMetric->SetMaximumNumberOfThreads( numberOfThreads );
+  imageMetric->SetFixedImage( fixedImage );
+  imageMetric->SetVirtualDomainFromImage( fixedImage );
+  imageMetric->SetMovingImage( movingImage );
+  imageMetric->SetFixedImageMask( fixedMaskSpatialObject );
+  imageMetric->SetMovingImageMask( movingMaskSpatialObject );
+  imageMetric->SetUseFixedSampledPointSet( false );
+
+  // Metrics on the same images use the gradient filters (which are already
+  // up to date) of the first one so that the gradient images are computed
+  // and held only once.
+  if( sharedGradientsMetric )
+    {
+    typedef typename ImageMetricType::FixedImageGradientFilterType  FixedImageGradientFilterType;
+    typedef typename ImageMetricType::MovingImageGradientFilterType MovingImageGradientFilterType;
+
+    imageMetric->SetFixedImageGradientFilter( const_cast<FixedImageGradientFilterType *>(
+      sharedGradientsMetric->GetFixedImageGradientFilter() ) );
+    imageMetric->SetMovingImageGradientFilter( const_cast<MovingImageGradientFilterType *>(
+      sharedGradientsMetric->GetMovingImageGradientFilter() ) );
+    }
+
+  /** Sample the image domain **/
+
+  if( samplingStrategy != NONE )
+    {
+    const typename ImageType::SpacingType oneThirdVirtualSpacing = fixedImage->GetSpacing() / 3.0;
+
+    typedef typename ImageMetricType::FixedSampledPointSetType MetricSamplePointSetType;
+    typename MetricSamplePointSetType::Pointer samplePointSet = MetricSamplePointSetType::New();
+    samplePointSet->Initialize();
+
+    typedef typename MetricSamplePointSetType::PointType SamplePointType;
+
+    typedef typename itk::Statistics::MersenneTwisterRandomVariateGenerator RandomizerType;
+    typename RandomizerType::Pointer randomizer = RandomizerType::New();
+    randomizer->SetSeed( 1234 );
+
+    unsigned long index = 0;
+
+    switch( samplingStrategy )
+      {
+      case REGULAR:
+        {
+        const unsigned long sampleCount = static_cast<unsigned long>( std::ceil( 1.0 / samplingPercentage ) );
+        unsigned long count = sampleCount; //Start at sampleCount to keep behavior backwards identical, using first element.
+        itk::ImageRegionConstIteratorWithIndex<ImageType> It( fixedImage, fixedImage->GetRequestedRegion() );
+        for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+          {
+          if( count == sampleCount )
+            {
+            count = 0; //Reset counter
+            SamplePointType point;
+            fixedImage->TransformIndexToPhysicalPoint( It.GetIndex(), point );
+
+            // randomly perturb the point within a voxel (approximately)
+            for( unsigned int d = 0; d < ImageDimension; d++ )
+              {
+              point[d] += randomizer->GetNormalVariate() * oneThirdVirtualSpacing[d];
+              }
+            if( !fixedMaskSpatialObject || fixedMaskSpatialObject->IsInside( point ) )
+              {
+              samplePointSet->SetPoint( index, point );
+              ++index;
+              }
+            }
+          ++count;
+          }
+        break;
+        }
+      case RANDOM:
+        {
+        const unsigned long totalVirtualDomainVoxels = fixedImage->GetRequestedRegion().GetNumberOfPixels();
+        const unsigned long sampleCount = static_cast<unsigned long>( static_cast<float>( totalVirtualDomainVoxels ) * samplingPercentage );
+        itk::ImageRandomConstIteratorWithIndex<ImageType> ItR( fixedImage, fixedImage->GetRequestedRegion() );
+        ItR.SetNumberOfSamples( sampleCount );
+        for( ItR.GoToBegin(); !ItR.IsAtEnd(); ++ItR )
+          {
+          SamplePointType point;
+          fixedImage->TransformIndexToPhysicalPoint( ItR.GetIndex(), point );
+
+          // randomly perturb the point within a voxel (approximately)
+          for ( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            point[d] += randomizer->GetNormalVariate() * oneThirdVirtualSpacing[d];
+            }
+          if( !fixedMaskSpatialObject || fixedMaskSpatialObject->IsInside( point ) )
+            {
+            samplePointSet->SetPoint( index, point );
+            ++index;
+            }
+          }
+        break;
+        }
+      case NONE:
+        break;
+      }
+    imageMetric->SetFixedSampledPointSet( samplePointSet );
+    imageMetric->SetUseFixedSampledPointSet( true );
+    }
+
+  imageMetric->Initialize();
+
+  return imageMetric;
+}
+
+/** Smooth (sigma = shrinkFactor / 2 voxels) and shrink an image for the
+ * coarse levels of the search. */
+template <class TImage>
+typename TImage::Pointer ShrinkSearchImage( TImage *image, unsigned int shrinkFactor )
+{
+  if( shrinkFactor <= 1 )
+    {
+    return image;
+    }
+
+  typedef itk::DiscreteGaussianImageFilter<TImage, TImage> SmootherType;
+  typename SmootherType::Pointer smoother = SmootherType::New();
+  smoother->SetInput( image );
+  smoother->SetUseImageSpacingOff();
+  smoother->SetVariance( vnl_math_sqr( 0.5 * shrinkFactor ) );
+  smoother->SetMaximumError( 0.01 );
+
+  typedef itk::ShrinkImageFilter<TImage, TImage> ShrinkerType;
+  typename ShrinkerType::Pointer shrinker = ShrinkerType::New();
+  shrinker->SetInput( smoother->GetOutput() );
+  shrinker->SetShrinkFactors( shrinkFactor );
+  shrinker->Update();
+
+  typename TImage::Pointer shrunkImage = shrinker->GetOutput();
+  shrunkImage->DisconnectPipeline();
+  return shrunkImage;
+}
+
+template <class TOptimizer, class TScales>
+typename TOptimizer::Pointer CreateSearchLocalOptimizer( double learningRate, unsigned int numberOfIterations,
+                                                         double convergenceThreshold, unsigned int convergenceWindowSize,
+                                                         const TScales & scales, itk::ThreadIdType numberOfThreads )
+{
+  typename TOptimizer::Pointer localOptimizer = TOptimizer::New();
+  localOptimizer->SetLowerLimit( 0 );
+  localOptimizer->SetUpperLimit( 2 );
+  localOptimizer->SetEpsilon( 0.1 );
+  localOptimizer->SetMaximumLineSearchIterations( 10 );
+  localOptimizer->SetLearningRate( learningRate );
+  localOptimizer->SetMaximumStepSizeInPhysicalUnits( learningRate );
+  localOptimizer->SetNumberOfIterations( numberOfIterations );
+  localOptimizer->SetMinimumConvergenceValue( convergenceThreshold );
+  localOptimizer->SetConvergenceWindowSize( convergenceWindowSize );
+  localOptimizer->SetDoEstimateLearningRateOnce( true );
+  localOptimizer->SetScales( scales );
+  localOptimizer->SetNumberOfThreads( numberOfThreads );
+  return localOptimizer;
+}
+
+/** \class MultiStartSearch
+ *
+ * Evaluates the starting parameters of the rotation search concurrently,
+ * in the way MultiStartOptimizerv4 does one after the other: each start is
+ * set on the metric, optionally refined by the local optimizer, and scored
+ * with the metric value at the resulting parameters.  Every worker owns a
+ * metric (with its own copy of the transform) and a local optimizer; the
+ * starts are handed out one at a time since their cost varies.
+ */
+template <class TMetric>
+class MultiStartSearch
+{
+public:
+  typedef TMetric                                     MetricType;
+  typedef typename MetricType::MeasureType            MeasureType;
+  typedef itk::ConjugateGradientLineSearchOptimizerv4 LocalOptimizerType;
+  typedef typename LocalOptimizerType::ParametersType ParametersType;
+  typedef std::vector<ParametersType>                 ParametersListType;
+
+  MultiStartSearch() :
+    m_ParametersList( ITK_NULLPTR ),
+    m_Values( ITK_NULLPTR ),
+    m_NextStart( 0 )
+  {
+  }
+
+  /** localOptimizer may be null to only score the starts. */
+  void AddWorker( MetricType *metric, LocalOptimizerType *localOptimizer )
+  {
+    Worker worker;
+    worker.Metric = metric;
+    worker.LocalOptimizer = localOptimizer;
+    this->m_Workers.push_back( worker );
+  }
+
+  unsigned int GetNumberOfWorkers() const
+  {
+    return this->m_Workers.size();
+  }
+
+  /** Replaces the parameters by the refined ones and fills in their values. */
+  void Evaluate( ParametersListType & parametersList, std::vector<MeasureType> & values )
+  {
+    values.assign( parametersList.size(), itk::NumericTraits<MeasureType>::max() );
+    this->m_ParametersList = &parametersList;
+    this->m_Values = &values;
+    this->m_NextStart = 0;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( this->GetNumberOfWorkers(), 1u ) );
+    threader->SetSingleMethod( Self::ThreaderCallback, this );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  typedef MultiStartSearch Self;
+
+  struct Worker
+    {
+    typename MetricType::Pointer         Metric;
+    typename LocalOptimizerType::Pointer LocalOptimizer;
+    };
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+    Worker &                              worker = self->m_Workers[info->ThreadID];
+
+    while( true )
+      {
+      self->m_Mutex.Lock();
+      const size_t n = self->m_NextStart++;
+      self->m_Mutex.Unlock();
+      if( n >= self->m_ParametersList->size() )
+        {
+        break;
+        }
+
+      ParametersType & parameters = ( *self->m_ParametersList )[n];
+      try
+        {
+        worker.Metric->SetParameters( parameters );
+        if( worker.LocalOptimizer.IsNotNull() )
+          {
+          worker.LocalOptimizer->StartOptimization();
+          }
+        ( *self->m_Values )[n] = worker.Metric->GetValue();
+        parameters = worker.Metric->GetParameters();
+        }
+      catch( itk::ExceptionObject & )
+        {
+        // leave this start at the worst value
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  std::vector<Worker>       m_Workers;
+  ParametersListType *      m_ParametersList;
+  std::vector<MeasureType> *m_Values;
+  size_t                    m_NextStart;
+  itk::SimpleFastMutexLock  m_Mutex;
+};
+
+/** Keep the numberOfStartsToKeep starts with the lowest values, in their
+ * original order. */
+template <class TParametersList, class TMeasure>
+void KeepBestSearchStarts( TParametersList & parametersList, const std::vector<TMeasure> & values,
+                           unsigned int numberOfStartsToKeep )
+{
+  std::vector<std::pair<TMeasure, size_t> > ranking;
+  for( size_t n = 0; n < values.size(); n++ )
+    {
+    ranking.push_back( std::make_pair( values[n], n ) );
+    }
+  std::sort( ranking.begin(), ranking.end() );
+  ranking.resize( std::min( ranking.size(), static_cast<size_t>( std::max( numberOfStartsToKeep, 1u ) ) ) );
+
+  std::vector<size_t> survivors;
+  for( size_t n = 0; n < ranking.size(); n++ )
+    {
+    survivors.push_back( ranking[n].second );
+    }
+  std::sort( survivors.begin(), survivors.end() );
+
+  TParametersList survivingParametersList;
+  for( size_t n = 0; n < survivors.size(); n++ )
+    {
+    survivingParametersList.push_back( parametersList[survivors[n]] );
+    }
+  parametersList = survivingParametersList;
+}
+
+/** \class FFTTranslationSearch
+ *
+ * Covers all the translations of a rotation sample with one FFT: the moving
+ * image is resampled through the sample onto a shrunk fixed grid and the
+ * normalized cross correlation with the fixed image is computed for every
+ * shift at once (MaskedFFTNormalizedCorrelationImageFilter).  The offset of
+ * the sample is moved by the shift at the correlation peak and the peak is
+ * returned as the score of the sample.  Rotation samples are processed
+ * concurrently, one per thread at a time.
+ */
+template <class TImage, class TMaskImage>
+class FFTTranslationSearch
+{
+public:
+  typedef TImage                                                                 ImageType;
+  typedef TMaskImage                                                             MaskImageType;
+  itkStaticConstMacro( ImageDimension, unsigned int, ImageType::ImageDimension );
+  typedef itk::Transform<double, ImageDimension, ImageDimension>                 TransformType;
+  typedef itk::MatrixOffsetTransformBase<double, ImageDimension, ImageDimension> MatrixOffsetTransformType;
+  typedef typename TransformType::ParametersType                                 ParametersType;
+  typedef std::vector<ParametersType>                                            ParametersListType;
+
+  FFTTranslationSearch() :
+    m_RequiredFractionOfOverlappingPixels( 0.5 ),
+    m_ParametersList( ITK_NULLPTR ),
+    m_Correlations( ITK_NULLPTR ),
+    m_NextStart( 0 )
+  {
+  }
+
+  /** Set up the shrunk grids; the masks may be null. */
+  void Initialize( ImageType *fixedImage, ImageType *movingImage, MaskImageType *fixedMask,
+                   MaskImageType *movingMask, unsigned int shrinkFactor )
+  {
+    this->m_FixedImage = ShrinkSearchImage<ImageType>( fixedImage, shrinkFactor );
+    this->m_MovingImage = ShrinkSearchImage<ImageType>( movingImage, shrinkFactor );
+
+    this->m_FixedMask = ITK_NULLPTR;
+    if( fixedMask )
+      {
+      this->m_FixedMask = this->ResampleMask( fixedMask, ITK_NULLPTR, this->m_FixedImage );
+      }
+
+    // without a moving mask, the shifts are scored only where the moving
+    // image is defined
+    if( movingMask )
+      {
+      typedef itk::CastImageFilter<MaskImageType, ImageType> CasterType;
+      typename CasterType::Pointer caster = CasterType::New();
+      caster->SetInput( movingMask );
+      caster->Update();
+      this->m_MovingMask = caster->GetOutput();
+      this->m_MovingMask->DisconnectPipeline();
+      }
+    else
+      {
+      this->m_MovingMask = ImageType::New();
+      this->m_MovingMask->CopyInformation( this->m_MovingImage );
+      this->m_MovingMask->SetRegions( this->m_MovingImage->GetLargestPossibleRegion() );
+      this->m_MovingMask->Allocate();
+      this->m_MovingMask->FillBuffer( 1 );
+      }
+  }
+
+  /** Replaces the translation of each start by the best one and fills in
+   * the peak correlations. */
+  void Evaluate( const TransformType *transform, ParametersListType & parametersList,
+                 std::vector<double> & correlations, itk::ThreadIdType numberOfThreads )
+  {
+    correlations.assign( parametersList.size(), -itk::NumericTraits<double>::max() );
+    this->m_ParametersList = &parametersList;
+    this->m_Correlations = &correlations;
+    this->m_NextStart = 0;
+
+    // the images are duplicated for each thread so that no pipeline
+    // information is shared between the threads
+    numberOfThreads = std::max( std::min( numberOfThreads,
+                                          static_cast<itk::ThreadIdType>( parametersList.size() ) ), 1u );
+    this->m_Workers.clear();
+    for( itk::ThreadIdType n = 0; n < numberOfThreads; n++ )
+      {
+      Worker worker;
+      worker.Transform = transform->Clone();
+      worker.FixedImage = Self::Duplicate( this->m_FixedImage.GetPointer() );
+      worker.FixedMask = Self::Duplicate( this->m_FixedMask.GetPointer() );
+      worker.MovingImage = Self::Duplicate( this->m_MovingImage.GetPointer() );
+      worker.MovingMask = Self::Duplicate( this->m_MovingMask.GetPointer() );
+      this->m_Workers.push_back( worker );
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( Self::ThreaderCallback, this );
+    threader->SingleMethodExecute();
+
+    this->m_Workers.clear();
+  }
+
+private:
+  typedef FFTTranslationSearch Self;
+
+  struct Worker
+    {
+    typename TransformType::Pointer Transform;
+    typename ImageType::Pointer     FixedImage;
+    typename ImageType::Pointer     FixedMask;
+    typename ImageType::Pointer     MovingImage;
+    typename ImageType::Pointer     MovingMask;
+    };
+
+  static typename ImageType::Pointer Duplicate( ImageType *image )
+  {
+    if( !image )
+      {
+      return ITK_NULLPTR;
+      }
+    typedef itk::ImageDuplicator<ImageType> DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    duplicator->SetInputImage( image );
+    duplicator->Update();
+    return duplicator->GetModifiableOutput();
+  }
+
+  /** Nearest neighbor resampling of a mask onto the grid of reference. */
+  template <class TInputMask>
+  static typename ImageType::Pointer ResampleMask( TInputMask *mask, const TransformType *transform,
+                                                   ImageType *reference )
+  {
+    typedef itk::ResampleImageFilter<TInputMask, ImageType, double>                     ResamplerType;
+    typedef itk::NearestNeighborInterpolateImageFunction<TInputMask, double>             InterpolatorType;
+    typename ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInput( mask );
+    if( transform )
+      {
+      resampler->SetTransform( transform );
+      }
+    resampler->SetInterpolator( InterpolatorType::New() );
+    resampler->SetUseReferenceImage( true );
+    resampler->SetReferenceImage( reference );
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->SetNumberOfThreads( 1 );
+    resampler->Update();
+    return resampler->GetOutput();
+  }
+
+  void EvaluateStart( Worker & worker, ParametersType & parameters, double & correlation ) const
+  {
+    worker.Transform->SetParameters( parameters );
+
+    typedef itk::ResampleImageFilter<ImageType, ImageType, double> ResamplerType;
+    typename ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInput( worker.MovingImage );
+    resampler->SetTransform( worker.Transform );
+    resampler->SetUseReferenceImage( true );
+    resampler->SetReferenceImage( worker.FixedImage );
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->SetNumberOfThreads( 1 );
+    resampler->Update();
+
+    typename ImageType::Pointer movingMask = Self::ResampleMask( worker.MovingMask.GetPointer(),
+                                                                 worker.Transform.GetPointer(),
+                                                                 worker.FixedImage.GetPointer() );
+
+    typedef itk::MaskedFFTNormalizedCorrelationImageFilter<ImageType, ImageType, ImageType> CorrelationFilterType;
+    typename CorrelationFilterType::Pointer correlationFilter = CorrelationFilterType::New();
+    correlationFilter->SetFixedImage( worker.FixedImage );
+    correlationFilter->SetMovingImage( resampler->GetOutput() );
+    if( worker.FixedMask.IsNotNull() )
+      {
+      correlationFilter->SetFixedImageMask( worker.FixedMask );
+      }
+    correlationFilter->SetMovingImageMask( movingMask );
+    correlationFilter->SetRequiredFractionOfOverlappingPixels( this->m_RequiredFractionOfOverlappingPixels );
+    correlationFilter->SetNumberOfThreads( 1 );
+    correlationFilter->Update();
+
+    const ImageType *correlationImage = correlationFilter->GetOutput();
+    const typename ImageType::RegionType correlationRegion = correlationImage->GetLargestPossibleRegion();
+
+    typename ImageType::IndexType peakIndex = correlationRegion.GetIndex();
+    double                        peak = -itk::NumericTraits<double>::max();
+    itk::ImageRegionConstIteratorWithIndex<ImageType> It( correlationImage, correlationRegion );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      if( It.Get() > peak )
+        {
+        peak = It.Get();
+        peakIndex = It.GetIndex();
+        }
+      }
+
+    // the zero shift lies at index movingSize - 1; a peak at shift s means
+    // fixed( x ) ~ resampledMoving( x - s )
+    const typename ImageType::SizeType size = worker.FixedImage->GetLargestPossibleRegion().GetSize();
+    itk::Vector<double, ImageDimension> shift;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      shift[d] = ( peakIndex[d] - correlationRegion.GetIndex()[d] - ( static_cast<itk::IndexValueType>( size[d] ) - 1 ) )
+        * worker.FixedImage->GetSpacing()[d];
+      }
+    shift = worker.FixedImage->GetDirection() * shift;
+
+    // T'( x ) = T( x - shift ) = A x + offset - A shift
+    MatrixOffsetTransformType *matrixOffsetTransform =
+      dynamic_cast<MatrixOffsetTransformType *>( worker.Transform.GetPointer() );
+    if( matrixOffsetTransform )
+      {
+      matrixOffsetTransform->SetOffset( matrixOffsetTransform->GetOffset()
+                                        - matrixOffsetTransform->GetMatrix() * shift );
+      parameters = matrixOffsetTransform->GetParameters();
+      }
+    correlation = peak;
+  }
 
-  transformInitializer->SetTransform( transform );
-  transformInitializer->InitializeTransform();
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+    Worker &                              worker = self->m_Workers[info->ThreadID];
 
-  return transform;
-}
+    while( true )
+      {
+      self->m_Mutex.Lock();
+      const size_t n = self->m_NextStart++;
+      self->m_Mutex.Unlock();
+      if( n >= self->m_ParametersList->size() )
+        {
+        break;
+        }
+      try
+        {
+        self->EvaluateStart( worker, ( *self->m_ParametersList )[n], ( *self->m_Correlations )[n] );
+        }
+      catch( itk::ExceptionObject & )
+        {
+        // leave this start at the worst correlation
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  double                      m_RequiredFractionOfOverlappingPixels;
+  typename ImageType::Pointer m_FixedImage;
+  typename ImageType::Pointer m_FixedMask;
+  typename ImageType::Pointer m_MovingImage;
+  typename ImageType::Pointer m_MovingMask;
+
+  std::vector<Worker>       m_Workers;
+  ParametersListType *      m_ParametersList;
+  std::vector<double> *     m_Correlations;
+  size_t                    m_NextStart;
+  itk::SimpleFastMutexLock  m_Mutex;
+};
 
 template <unsigned int ImageDimension>
 int antsAI( itk::ants::CommandLineParser *parser )
@@ -613,8 +1352,6 @@ int antsAI( itk::ants::CommandLineParser *parser )
   typedef typename SimilarityTransformTraits<RealType, ImageDimension>::TransformType    SimilarityTransformType;
   typedef typename LandmarkRigidTransformTraits<RealType, ImageDimension>::TransformType LandmarkRigidTransformType;
 
-  enum SamplingStrategyType { NONE, REGULAR, RANDOM };
-
   bool verbose = false;
   itk::ants::CommandLineParser::OptionType::Pointer verboseOption = parser->GetOption( "verbose" );
   if( verboseOption && verboseOption->GetNumberOfFunctions() )
@@ -733,6 +1470,9 @@ int antsAI( itk::ants::CommandLineParser *parser )
   std::string transform = "";
   std::string outputTransformTypeName = "";
   RealType learningRate = 0.1;
+  std::string translationSearch = "none";
+  unsigned int fftShrinkFactor = 4;
+  unsigned int fftNumberOfStartsToKeep = 10;
   RealType searchFactor = 10.0 * vnl_math::pi / 180.0;
   RealType arcFraction = 1.0;
 
@@ -753,6 +1493,36 @@ int antsAI( itk::ants::CommandLineParser *parser )
       }
     }
 
+  std::vector<unsigned int> coarseShrinkFactors;
+  std::vector<unsigned int> coarseNumberOfStarts;
+  RealType coarseSamplingPercentage = 0.1;
+  unsigned int coarseNumberOfIterations = 0;
+
+  itk::ants::CommandLineParser::OptionType::Pointer coarseSearchOption = parser->GetOption( "coarse-search" );
+  if( coarseSearchOption && coarseSearchOption->GetNumberOfFunctions() )
+    {
+    if( coarseSearchOption->GetFunction( 0 )->GetNumberOfParameters() < 2 )
+      {
+      std::cerr << "The coarse search needs the shrink factors and the numbers of starts to keep." << std::endl;
+      return EXIT_FAILURE;
+      }
+    coarseShrinkFactors = parser->ConvertVector<unsigned int>( coarseSearchOption->GetFunction( 0 )->GetParameter( 0 ) );
+    coarseNumberOfStarts = parser->ConvertVector<unsigned int>( coarseSearchOption->GetFunction( 0 )->GetParameter( 1 ) );
+    if( coarseSearchOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
+      {
+      coarseSamplingPercentage = parser->Convert<RealType>( coarseSearchOption->GetFunction( 0 )->GetParameter( 2 ) );
+      }
+    if( coarseSearchOption->GetFunction( 0 )->GetNumberOfParameters() > 3 )
+      {
+      coarseNumberOfIterations = parser->Convert<unsigned int>( coarseSearchOption->GetFunction( 0 )->GetParameter( 3 ) );
+      }
+    if( coarseShrinkFactors.size() != coarseNumberOfStarts.size() )
+      {
+      std::cerr << "The number of coarse search shrink factors and numbers of starts to keep differ." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
   itk::ants::CommandLineParser::OptionType::Pointer transformOption = parser->GetOption( "transform" );
   if( transformOption && transformOption->GetNumberOfFunctions() )
     {
@@ -762,6 +1532,24 @@ int antsAI( itk::ants::CommandLineParser *parser )
       {
       learningRate = parser->Convert<RealType>( transformOption->GetFunction( 0 )->GetParameter( 0 ) );
       }
+    if( transformOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+      {
+      translationSearch = transformOption->GetFunction( 0 )->GetParameter( 1 );
+      ConvertToLowerCase( translationSearch );
+      }
+    if( transformOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
+      {
+      fftShrinkFactor = parser->Convert<unsigned int>( transformOption->GetFunction( 0 )->GetParameter( 2 ) );
+      }
+    if( transformOption->GetFunction( 0 )->GetNumberOfParameters() > 3 )
+      {
+      fftNumberOfStartsToKeep = parser->Convert<unsigned int>( transformOption->GetFunction( 0 )->GetParameter( 3 ) );
+      }
+    }
+  if( strcmp( translationSearch.c_str(), "none" ) != 0 && strcmp( translationSearch.c_str(), "fft" ) != 0 )
+    {
+    std::cerr << "Unrecognized translation search " << translationSearch << "." << std::endl;
+    return EXIT_FAILURE;
     }
 
   typename AffineTransformType::Pointer affineSearchTransform = AffineTransformType::New();
@@ -1083,148 +1871,19 @@ int antsAI( itk::ants::CommandLineParser *parser )
   /////////////////////////////////////////////////////////////////
 
   typedef itk::ImageToImageMetricv4<ImageType, ImageType, ImageType, RealType> ImageMetricType;
-  typename ImageMetricType::Pointer imageMetric = ITK_NULLPTR;
-
-  if( std::strcmp( metric.c_str(), "mattes" ) == 0 )
-    {
-    if( verbose )
-      {
-      std::cout << "Using the Mattes MI metric (number of bins = " << numberOfBins << ")" << std::endl;
-      }
-    typedef itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType, ImageType, RealType> MutualInformationMetricType;
-    typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
-    mutualInformationMetric = mutualInformationMetric;
-    mutualInformationMetric->SetNumberOfHistogramBins( numberOfBins );
-    mutualInformationMetric->SetUseMovingImageGradientFilter( true );
-    mutualInformationMetric->SetUseFixedImageGradientFilter( true );
-
-    imageMetric = mutualInformationMetric;
-    }
-  else if( std::strcmp( metric.c_str(), "mi" ) == 0 )
-    {
-    if( verbose )
-      {
-      std::cout << "Using the joint histogram MI metric (number of bins = " << numberOfBins << ")" << std::endl;
-      }
-    typedef itk::JointHistogramMutualInformationImageToImageMetricv4<ImageType, ImageType, ImageType,
-                                                                     RealType> MutualInformationMetricType;
-    typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
-    mutualInformationMetric = mutualInformationMetric;
-    mutualInformationMetric->SetNumberOfHistogramBins( numberOfBins );
-    mutualInformationMetric->SetUseMovingImageGradientFilter( true );
-    mutualInformationMetric->SetUseFixedImageGradientFilter( true );
-    mutualInformationMetric->SetVarianceForJointPDFSmoothing( 1.0 );
 
-    imageMetric = mutualInformationMetric;
-    }
-  else if( std::strcmp( metric.c_str(), "gc" ) == 0 )
-    {
-    if( verbose )
-      {
-      std::cout << "Using the global correlation metric " << std::endl;
-      }
-    typedef itk::CorrelationImageToImageMetricv4<ImageType, ImageType, ImageType, RealType> corrMetricType;
-    typename corrMetricType::Pointer corrMetric = corrMetricType::New();
+  // the search runs one worker per thread, each with a metric using its share
+  // of the threads
+  const itk::ThreadIdType numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
 
-    imageMetric = corrMetric;
-    }
-  else
+  typename ImageMetricType::Pointer imageMetric = CreateSearchMetric<ImageType, ImageMaskSpatialObjectType>(
+    metric, numberOfBins, fixedImage, movingImage, fixedMaskSpatialObject, movingMaskSpatialObject,
+    samplingStrategy, samplingPercentage, numberOfThreads, ITK_NULLPTR, verbose );
+  if( imageMetric.IsNull() )
     {
-    if( verbose )
-      {
-      std::cerr << "ERROR: Unrecognized metric. " << std::endl;
-      }
     return EXIT_FAILURE;
     }
 
-  imageMetric->SetFixedImage( fixedImage );
-  imageMetric->SetVirtualDomainFromImage( fixedImage );
-  imageMetric->SetMovingImage( movingImage );
-  imageMetric->SetFixedImageMask( fixedMaskSpatialObject );
-  imageMetric->SetMovingImageMask( movingMaskSpatialObject );
-  imageMetric->SetUseFixedSampledPointSet( false );
-
-  /** Sample the image domain **/
-
-  if( samplingStrategy != NONE )
-    {
-    const typename ImageType::SpacingType oneThirdVirtualSpacing = fixedImage->GetSpacing() / 3.0;
-
-    typedef typename ImageMetricType::FixedSampledPointSetType MetricSamplePointSetType;
-    typename MetricSamplePointSetType::Pointer samplePointSet = MetricSamplePointSetType::New();
-    samplePointSet->Initialize();
-
-    typedef typename MetricSamplePointSetType::PointType SamplePointType;
-
-    typedef typename itk::Statistics::MersenneTwisterRandomVariateGenerator RandomizerType;
-    typename RandomizerType::Pointer randomizer = RandomizerType::New();
-    randomizer->SetSeed( 1234 );
-
-    unsigned long index = 0;
-
-    switch( samplingStrategy )
-      {
-      case REGULAR:
-        {
-        const unsigned long sampleCount = static_cast<unsigned long>( std::ceil( 1.0 / samplingPercentage ) );
-        unsigned long count = sampleCount; //Start at sampleCount to keep behavior backwards identical, using first element.
-        itk::ImageRegionConstIteratorWithIndex<ImageType> It( fixedImage, fixedImage->GetRequestedRegion() );
-        for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-          {
-          if( count == sampleCount )
-            {
-            count = 0; //Reset counter
-            SamplePointType point;
-            fixedImage->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-
-            // randomly perturb the point within a voxel (approximately)
-            for( unsigned int d = 0; d < ImageDimension; d++ )
-              {
-              point[d] += randomizer->GetNormalVariate() * oneThirdVirtualSpacing[d];
-              }
-            if( !fixedMaskSpatialObject || fixedMaskSpatialObject->IsInside( point ) )
-              {
-              samplePointSet->SetPoint( index, point );
-              ++index;
-              }
-            }
-          ++count;
-          }
-        break;
-        }
-      case RANDOM:
-        {
-        const unsigned long totalVirtualDomainVoxels = fixedImage->GetRequestedRegion().GetNumberOfPixels();
-        const unsigned long sampleCount = static_cast<unsigned long>( static_cast<float>( totalVirtualDomainVoxels ) * samplingPercentage );
-        itk::ImageRandomConstIteratorWithIndex<ImageType> ItR( fixedImage, fixedImage->GetRequestedRegion() );
-        ItR.SetNumberOfSamples( sampleCount );
-        for( ItR.GoToBegin(); !ItR.IsAtEnd(); ++ItR )
-          {
-          SamplePointType point;
-          fixedImage->TransformIndexToPhysicalPoint( ItR.GetIndex(), point );
-
-          // randomly perturb the point within a voxel (approximately)
-          for ( unsigned int d = 0; d < ImageDimension; d++ )
-            {
-            point[d] += randomizer->GetNormalVariate() * oneThirdVirtualSpacing[d];
-            }
-          if( !fixedMaskSpatialObject || fixedMaskSpatialObject->IsInside( point ) )
-            {
-            samplePointSet->SetPoint( index, point );
-            ++index;
-            }
-          }
-        break;
-        }
-      case NONE:
-        break;
-      }
-    imageMetric->SetFixedSampledPointSet( samplePointSet );
-    imageMetric->SetUseFixedSampledPointSet( true );
-    }
-
-  imageMetric->Initialize();
-
   if( strcmp( transform.c_str(), "affine" ) == 0 )
     {
     imageMetric->SetMovingTransform( affineSearchTransform );
@@ -1253,27 +1912,12 @@ int antsAI( itk::ants::CommandLineParser *parser )
   typename RegistrationParameterScalesFromPhysicalShiftType::ScalesType movingScales( numberOfTransformParameters );
   scalesEstimator->EstimateScales( movingScales );
 
-  typedef  itk::ConjugateGradientLineSearchOptimizerv4 LocalOptimizerType;
-  typename LocalOptimizerType::Pointer localOptimizer = LocalOptimizerType::New();
-  localOptimizer->SetLowerLimit( 0 );
-  localOptimizer->SetUpperLimit( 2 );
-  localOptimizer->SetEpsilon( 0.1 );
-  localOptimizer->SetMaximumLineSearchIterations( 10 );
-  localOptimizer->SetLearningRate( learningRate );
-  localOptimizer->SetMaximumStepSizeInPhysicalUnits( learningRate );
-  localOptimizer->SetNumberOfIterations( numberOfIterations );
-  localOptimizer->SetMinimumConvergenceValue( convergenceThreshold );
-  localOptimizer->SetConvergenceWindowSize( convergenceWindowSize );
-  localOptimizer->SetDoEstimateLearningRateOnce( true );
-  localOptimizer->SetScales( movingScales );
-  localOptimizer->SetMetric( imageMetric );
-
-  typedef itk::MultiStartOptimizerv4 MultiStartOptimizerType;
-  typename MultiStartOptimizerType::Pointer multiStartOptimizer = MultiStartOptimizerType::New();
-  multiStartOptimizer->SetScales( movingScales );
-  multiStartOptimizer->SetMetric( imageMetric );
+  typedef MultiStartSearch<ImageMetricType>                 MultiStartSearchType;
+  typedef typename MultiStartSearchType::LocalOptimizerType LocalOptimizerType;
+  typedef typename MultiStartSearchType::ParametersListType ParametersListType;
+  typedef typename MultiStartSearchType::MeasureType        MeasureType;
 
-  typename MultiStartOptimizerType::ParametersListType parametersList = multiStartOptimizer->GetParametersList();
+  ParametersListType parametersList;
   for( RealType angle1 = ( vnl_math::pi * -arcFraction ); angle1 <= ( vnl_math::pi * arcFraction + 0.000001 ); angle1 += searchFactor )
     {
     if( ImageDimension == 2 )
@@ -1349,9 +1993,127 @@ int antsAI( itk::ants::CommandLineParser *parser )
         }
       }
     }
-  multiStartOptimizer->SetParametersList( parametersList );
-  multiStartOptimizer->SetLocalOptimizer( localOptimizer );
-  multiStartOptimizer->StartOptimization();
+
+  typedef typename ImageMetricType::MovingTransformType SearchTransformType;
+  typename SearchTransformType::Pointer searchTransform = ITK_NULLPTR;
+  if( strcmp( transform.c_str(), "affine" ) == 0 )
+    {
+    searchTransform = affineSearchTransform.GetPointer();
+    }
+  else if( strcmp( transform.c_str(), "rigid" ) == 0 )
+    {
+    searchTransform = rigidSearchTransform.GetPointer();
+    }
+  else if( strcmp( transform.c_str(), "similarity" ) == 0 )
+    {
+    searchTransform = similaritySearchTransform.GetPointer();
+    }
+
+  // Move each rotation sample to its best translation with one FFT
+  // correlation per sample and go on with the best samples only.
+  if( strcmp( translationSearch.c_str(), "fft" ) == 0 )
+    {
+    if( verbose )
+      {
+      std::cout << "FFT translation search of " << parametersList.size() << " rotations at shrink factor "
+                << fftShrinkFactor << ", keeping " << fftNumberOfStartsToKeep << std::endl;
+      }
+
+    FFTTranslationSearch<ImageType, MaskImageType> fftSearch;
+    fftSearch.Initialize( fixedImage, movingImage, fixedMask, movingMask, fftShrinkFactor );
+
+    std::vector<RealType> correlations;
+    fftSearch.Evaluate( searchTransform, parametersList, correlations, numberOfThreads );
+    for( size_t n = 0; n < correlations.size(); n++ )
+      {
+      correlations[n] = -correlations[n];
+      }
+    KeepBestSearchStarts( parametersList, correlations, fftNumberOfStartsToKeep );
+    }
+
+  // The coarse levels score all the remaining starts cheaply and keep the
+  // best ones, the last level refines the survivors at full resolution with
+  // the metric and convergence settings given on the command line.
+  typename MultiStartSearchType::ParametersType bestParameters = parametersList.front();
+  for( unsigned int level = 0; level <= coarseShrinkFactors.size(); level++ )
+    {
+    const bool isFinestLevel = ( level == coarseShrinkFactors.size() );
+
+    const unsigned int numberOfWorkers = std::max( std::min( static_cast<unsigned int>( numberOfThreads ),
+                                                             static_cast<unsigned int>( parametersList.size() ) ), 1u );
+    const itk::ThreadIdType numberOfThreadsPerWorker = std::max( numberOfThreads / numberOfWorkers, 1u );
+
+    typename ImageType::Pointer levelFixedImage = fixedImage;
+    typename ImageType::Pointer levelMovingImage = movingImage;
+    if( !isFinestLevel )
+      {
+      levelFixedImage = ShrinkSearchImage<ImageType>( fixedImage, coarseShrinkFactors[level] );
+      levelMovingImage = ShrinkSearchImage<ImageType>( movingImage, coarseShrinkFactors[level] );
+      }
+    if( verbose )
+      {
+      std::cout << "Search level " << level << ": " << parametersList.size() << " starts ";
+      if( isFinestLevel )
+        {
+        std::cout << "at full resolution";
+        }
+      else
+        {
+        std::cout << "at shrink factor " << coarseShrinkFactors[level];
+        }
+      std::cout << " (" << numberOfWorkers << " workers)" << std::endl;
+      }
+
+    const unsigned int levelNumberOfIterations = isFinestLevel ? numberOfIterations : coarseNumberOfIterations;
+
+    MultiStartSearchType search;
+    typename ImageMetricType::Pointer levelGradientsMetric = ITK_NULLPTR;
+    if( isFinestLevel )
+      {
+      levelGradientsMetric = imageMetric;
+      }
+    for( unsigned int n = 0; n < numberOfWorkers; n++ )
+      {
+      typename ImageMetricType::Pointer workerMetric = CreateSearchMetric<ImageType, ImageMaskSpatialObjectType>(
+        metric, numberOfBins, levelFixedImage, levelMovingImage, fixedMaskSpatialObject, movingMaskSpatialObject,
+        isFinestLevel ? samplingStrategy : RANDOM, isFinestLevel ? samplingPercentage : coarseSamplingPercentage,
+        numberOfThreadsPerWorker, levelGradientsMetric, false );
+      if( levelGradientsMetric.IsNull() )
+        {
+        levelGradientsMetric = workerMetric;
+        }
+
+      typename SearchTransformType::Pointer workerTransform = searchTransform->Clone();
+      workerMetric->SetMovingTransform( workerTransform );
+
+      typename LocalOptimizerType::Pointer workerOptimizer = ITK_NULLPTR;
+      if( levelNumberOfIterations > 0 )
+        {
+        workerOptimizer = CreateSearchLocalOptimizer<LocalOptimizerType>( learningRate, levelNumberOfIterations,
+          convergenceThreshold, convergenceWindowSize, movingScales, numberOfThreadsPerWorker );
+        workerOptimizer->SetMetric( workerMetric );
+        }
+      search.AddWorker( workerMetric, workerOptimizer );
+      }
+
+    std::vector<MeasureType> values;
+    search.Evaluate( parametersList, values );
+
+    if( isFinestLevel )
+      {
+      // the first of the best values, as MultiStartOptimizerv4 picks it
+      const size_t bestIndex = std::min_element( values.begin(), values.end() ) - values.begin();
+      bestParameters = parametersList[bestIndex];
+      if( verbose )
+        {
+        std::cout << "  best metric value = " << values[bestIndex] << std::endl;
+        }
+      }
+    else
+      {
+      KeepBestSearchStarts( parametersList, values, coarseNumberOfStarts[level] );
+      }
+    }
 
   /////////////////////////////////////////////////////////////////
   //
@@ -1379,21 +2141,21 @@ int antsAI( itk::ants::CommandLineParser *parser )
       {
       typename AffineTransformType::Pointer bestAffineTransform = AffineTransformType::New();
       bestAffineTransform->SetCenter( initialTransform->GetCenter() );
-      bestAffineTransform->SetParameters( multiStartOptimizer->GetBestParameters() );
+      bestAffineTransform->SetParameters( bestParameters );
       transformWriter->SetInput( bestAffineTransform );
       }
     else if( strcmp( transform.c_str(), "rigid" ) == 0 )
       {
       typename RigidTransformType::Pointer bestRigidTransform = RigidTransformType::New();
       bestRigidTransform->SetCenter( initialTransform->GetCenter() );
-      bestRigidTransform->SetParameters( multiStartOptimizer->GetBestParameters() );
+      bestRigidTransform->SetParameters( bestParameters );
       transformWriter->SetInput( bestRigidTransform );
       }
     else if( strcmp( transform.c_str(), "similarity" ) == 0 )
       {
       typename SimilarityTransformType::Pointer bestSimilarityTransform = SimilarityTransformType::New();
       bestSimilarityTransform->SetCenter( initialTransform->GetCenter() );
-      bestSimilarityTransform->SetParameters( multiStartOptimizer->GetBestParameters() );
+      bestSimilarityTransform->SetParameters( bestParameters );
       transformWriter->SetInput( bestSimilarityTransform );
       }
 
@@ -1445,14 +2207,17 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   {
   std::string description = std::string( "Several transform options are available.  The gradientStep or " )
     + std::string( "learningRate characterizes the gradient descent optimization and is scaled appropriately " )
-    + std::string( "for each transform using the shift scales estimator. " );
+    + std::string( "for each transform using the shift scales estimator.  With the fft translation search, " )
+    + std::string( "all translations of each rotation sample are scored at once by FFT normalized cross " )
+    + std::string( "correlation on the images shrunk by fftShrinkFactor; each sample is moved to its best " )
+    + std::string( "translation and only the numberOfStartsToKeep best samples are optimized. " );
 
   OptionType::Pointer option = OptionType::New();
   option->SetLongName( "transform" );
   option->SetShortName( 't' );
-  option->SetUsageOption(  0, "Rigid[gradientStep]" );
-  option->SetUsageOption(  1, "Affine[gradientStep]" );
-  option->SetUsageOption(  2, "Similarity[gradientStep]" );
+  option->SetUsageOption(  0, "Rigid[gradientStep,<translationSearch={none,fft}>,<fftShrinkFactor=4>,<numberOfStartsToKeep=10>]" );
+  option->SetUsageOption(  1, "Affine[gradientStep,<translationSearch={none,fft}>,<fftShrinkFactor=4>,<numberOfStartsToKeep=10>]" );
+  option->SetUsageOption(  2, "Similarity[gradientStep,<translationSearch={none,fft}>,<fftShrinkFactor=4>,<numberOfStartsToKeep=10>]" );
   option->SetDescription( description );
   parser->AddOption( option );
   }
@@ -1494,6 +2259,22 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description = std::string( "Coarse-to-fine pruning of the search.  At each coarse level " )
+   + std::string( "every remaining start is scored on the images smoothed and shrunk by the " )
+   + std::string( "given factor with a sparse random sampling (optionally after a few iterations " )
+   + std::string( "of local optimization) and only the best numberOfStartsToKeep are retained.  " )
+   + std::string( "The surviving starts are then optimized at full resolution.  " )
+   + std::string( "Example:  -g [8x4,200x20,0.05]." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "coarse-search" );
+  option->SetShortName( 'g' );
+  option->SetUsageOption( 0, "[shrinkFactors,numberOfStartsToKeep,<samplingPercentage=0.1>,<numberOfIterations=0>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "Number of iterations." );
@@ -1,8 +1,10 @@
 #include "antsUtilities.h"
 #include "antsAllocImage.h"
+#include "antsPrefetchImageReader.h"
 #include "itkantsRegistrationHelper.h"
 #include "ReadWriteData.h"
 #include "TensorFunctions.h"
+#include "itkCachedMappingResampleImageFilter.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkExtractImageFilter.h"
@@ -24,9 +26,12 @@
 #include "itkInterpolateImageFunction.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkWindowedSincInterpolateImageFunction.h"
-#include "itkLabelImageGaussianInterpolateImageFunction.h"
+#include "itkFastLabelImageGaussianInterpolateImageFunction.h"
 #include "itkLabelImageGenericInterpolateImageFunction.h"
 
+#include <fstream>
+#include <sstream>
+
 namespace ants
 {
 template <typename TensorImageType, typename ImageType>
@@ -327,10 +332,31 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
     useStaticCastForR = parser->Convert<bool>(  rOption->GetFunction( 0 )->GetName() );
     }
 
+  unsigned int brickSize = 0;
+  unsigned int maximumNumberOfBricks = 64;
+  typename itk::ants::CommandLineParser::OptionType::Pointer onDemandOption =
+    parser->GetOption( "on-demand-displacement-fields" );
+  if( onDemandOption && onDemandOption->GetNumberOfFunctions() )
+    {
+    if( onDemandOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+      {
+      brickSize = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetName() );
+      }
+    else
+      {
+      brickSize = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetParameter( 0 ) );
+      if( onDemandOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        maximumNumberOfBricks = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetParameter( 1 ) );
+        }
+      }
+    }
+
   std::vector<bool> isDerivedTransform;
   typename CompositeTransformType::Pointer compositeTransform =
     GetCompositeTransformFromParserOption<RealType, Dimension>( parser, transformOption, isDerivedTransform,
-                                                                useStaticCastForR );
+                                                                useStaticCastForR, brickSize,
+                                                                maximumNumberOfBricks );
   if( compositeTransform.IsNull() )
     {
     return EXIT_FAILURE;
@@ -355,18 +381,6 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
     ConvertToLowerCase( whichInterpolator );
     }
 
-  const size_t VImageDimension = Dimension;
-  typename ImageType::SpacingType
-    cache_spacing_for_smoothing_sigmas(itk::NumericTraits<typename ImageType::SpacingType::ValueType>::ZeroValue());
-  if( !std::strcmp( whichInterpolator.c_str(), "gaussian" )
-      ||   !std::strcmp( whichInterpolator.c_str(), "multilabel" )
-      )
-    {
-    cache_spacing_for_smoothing_sigmas = inputImages[0]->GetSpacing();
-    }
-
-#include "make_interpolator_snip.tmpl"
-
   /**
    * Default voxel value
    */
@@ -381,8 +395,228 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
     {
     std::cout << "Default pixel value: " << defaultValue << std::endl;
     }
+
+  /**
+   * Batch option:  warp a list of scalar images to the same reference image
+   * with the transform(s) read only once.  Each line of the batch file is
+   *   inputFileName outputFileName <interpolation>
+   * where the optional interpolation uses the same syntax as -n (without spaces).
+   */
+  typename itk::ants::CommandLineParser::OptionType::Pointer batchOption = parser->GetOption( "batch" );
+  if( batchOption && batchOption->GetNumberOfFunctions() )
+    {
+    if( inputImageType != 0 )
+      {
+      if( verbose )
+        {
+        std::cerr << "The batch option is only available for scalar images." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+
+    std::vector<std::string> batchInputFileNames;
+    std::vector<std::string> batchOutputFileNames;
+    std::vector<std::string> batchInterpolators;
+
+    std::ifstream batchFile( batchOption->GetFunction( 0 )->GetName().c_str() );
+    if( !batchFile )
+      {
+      if( verbose )
+        {
+        std::cerr << "Unable to open batch file " << batchOption->GetFunction( 0 )->GetName() << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    std::string line;
+    while( std::getline( batchFile, line ) )
+      {
+      std::istringstream lineStream( line );
+      std::string        inputFileName;
+      std::string        outputFileName;
+      std::string        lineInterpolator;
+      lineStream >> inputFileName;
+      if( inputFileName.empty() || inputFileName[0] == '#' )
+        {
+        continue;
+        }
+      lineStream >> outputFileName >> lineInterpolator;
+      if( outputFileName.empty() )
+        {
+        if( verbose )
+          {
+          std::cerr << "No output file name given for " << inputFileName << " in the batch file." << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      batchInputFileNames.push_back( inputFileName );
+      batchOutputFileNames.push_back( outputFileName );
+      batchInterpolators.push_back( lineInterpolator );
+      }
+    batchFile.close();
+
+    // When the chain contains non-linear transforms, it can be composed once into a
+    // displacement field sampled on the reference grid.  Since the resampler only
+    // evaluates the transform at the reference voxel centers, which coincide with the
+    // field nodes, every image then costs a single field lookup per voxel instead of
+    // an evaluation of the whole chain.
+    typedef itk::Transform<RealType, Dimension, Dimension> TransformType;
+    typename TransformType::Pointer batchTransform = compositeTransform.GetPointer();
+
+    bool precomputeDisplacementField = false;
+    typename itk::ants::CommandLineParser::OptionType::Pointer precomputeOption =
+      parser->GetOption( "precompute-displacement-field" );
+    if( precomputeOption && precomputeOption->GetNumberOfFunctions() )
+      {
+      precomputeDisplacementField = parser->Convert<bool>( precomputeOption->GetFunction( 0 )->GetName() );
+      }
+    if( precomputeDisplacementField && !compositeTransform->IsLinear() && batchInputFileNames.size() > 1 )
+      {
+      if( verbose )
+        {
+        std::cout << "Composing the transform(s) into a displacement field on the reference grid." << std::endl;
+        }
+      typedef typename itk::TransformToDisplacementFieldFilter<DisplacementFieldType, RealType> ConverterType;
+      typename ConverterType::Pointer converter = ConverterType::New();
+      converter->SetOutputOrigin( referenceImage->GetOrigin() );
+      converter->SetOutputStartIndex( referenceImage->GetBufferedRegion().GetIndex() );
+      converter->SetSize( referenceImage->GetBufferedRegion().GetSize() );
+      converter->SetOutputSpacing( referenceImage->GetSpacing() );
+      converter->SetOutputDirection( referenceImage->GetDirection() );
+      converter->SetTransform( compositeTransform );
+      converter->Update();
+
+      typedef itk::DisplacementFieldTransform<RealType, Dimension> DisplacementFieldTransformType;
+      typename DisplacementFieldTransformType::Pointer displacementFieldTransform =
+        DisplacementFieldTransformType::New();
+      displacementFieldTransform->SetDisplacementField( converter->GetOutput() );
+      batchTransform = displacementFieldTransform.GetPointer();
+      }
+
+    // read the next images while the current one is being resampled
+    PrefetchImageReader<ImageType> batchReader;
+    batchReader.SetFileNames( batchInputFileNames );
+    batchReader.SetNumberOfThreads( 2 );
+    batchReader.SetQueueSize( 2 );
+    batchReader.Start();
+
+    for( unsigned int n = 0; n < batchInputFileNames.size(); n++ )
+      {
+      typename ImageType::Pointer batchImage = batchReader.GetNextImage();
+      if( batchImage.IsNull() )
+        {
+        if( verbose )
+          {
+          std::cerr << "Unable to read input image " << batchInputFileNames[n] << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+
+      // the interpolator snippet below reads the interpolation option and its name
+      // so these are shadowed with the per-image values given in the batch file.
+      typename itk::ants::CommandLineParser::OptionType::Pointer interpolationOption =
+        parser->GetOption( "interpolation" );
+      std::string whichInterpolator( "linear" );
+      if( !batchInterpolators[n].empty() )
+        {
+        interpolationOption = itk::ants::CommandLineParser::OptionType::New();
+        interpolationOption->SetLongName( "interpolation" );
+        interpolationOption->AddFunction( batchInterpolators[n] );
+        }
+      if( interpolationOption && interpolationOption->GetNumberOfFunctions() )
+        {
+        whichInterpolator = interpolationOption->GetFunction( 0 )->GetName();
+        ConvertToLowerCase( whichInterpolator );
+        }
+
+      const size_t VImageDimension = Dimension;
+      typename ImageType::SpacingType
+        cache_spacing_for_smoothing_sigmas(itk::NumericTraits<typename ImageType::SpacingType::ValueType>::ZeroValue());
+      if( !std::strcmp( whichInterpolator.c_str(), "gaussian" )
+          ||   !std::strcmp( whichInterpolator.c_str(), "multilabel" )
+          )
+        {
+        cache_spacing_for_smoothing_sigmas = batchImage->GetSpacing();
+        }
+
+#include "make_interpolator_snip.tmpl"
+
+      typedef itk::ResampleImageFilter<ImageType, ImageType, RealType> ResamplerType;
+      typename ResamplerType::Pointer resampleFilter = ResamplerType::New();
+      resampleFilter->SetInput( batchImage );
+      resampleFilter->SetOutputParametersFromImage( referenceImage );
+      resampleFilter->SetTransform( batchTransform );
+      resampleFilter->SetDefaultPixelValue( defaultValue );
+      interpolator->SetInputImage( batchImage );
+      resampleFilter->SetInterpolator( interpolator );
+
+      if( verbose )
+        {
+        std::cout << "  Applying transform(s) to " << batchInputFileNames[n] << " (" << n + 1 << " out of "
+                  << batchInputFileNames.size() << ", interpolation type: "
+                  << resampleFilter->GetInterpolator()->GetNameOfClass() << ")." << std::endl;
+        }
+      resampleFilter->Update();
+
+      WriteImage<ImageType>( resampleFilter->GetOutput(), batchOutputFileNames[n].c_str() );
+      }
+    batchReader.Stop();
+
+    if( verbose )
+      {
+      std::cout << "Total read time: " << batchReader.GetTotalReadTime() << " s, time spent waiting on reads: "
+                << batchReader.GetWaitTime() << " s" << std::endl;
+      }
+    return EXIT_SUCCESS;
+    }
+
+  const size_t VImageDimension = Dimension;
+  typename ImageType::SpacingType
+    cache_spacing_for_smoothing_sigmas(itk::NumericTraits<typename ImageType::SpacingType::ValueType>::ZeroValue());
+  if( !std::strcmp( whichInterpolator.c_str(), "gaussian" )
+      ||   !std::strcmp( whichInterpolator.c_str(), "multilabel" )
+      )
+    {
+    cache_spacing_for_smoothing_sigmas = inputImages[0]->GetSpacing();
+    }
+
+#include "make_interpolator_snip.tmpl"
+
+  // The time points of a time series share a grid, so with a non-linear transform the
+  // mapping of the reference voxels into the input grid is computed for the first time
+  // point and only the interpolation is repeated for the others.
+  typedef itk::CachedMappingResampleImageFilter<ImageType, ImageType, RealType> CachedMappingResamplerType;
+  typename CachedMappingResamplerType::Pointer timeSeriesResampler = ITK_NULLPTR;
+  if( inputImageType == 3 && inputImages.size() > 1 && !compositeTransform->IsLinear() )
+    {
+    timeSeriesResampler = CachedMappingResamplerType::New();
+    timeSeriesResampler->SetOutputParametersFromImage( referenceImage );
+    timeSeriesResampler->SetTransform( compositeTransform );
+    timeSeriesResampler->SetDefaultPixelValue( defaultValue );
+    timeSeriesResampler->SetInterpolator( interpolator );
+    if( verbose )
+      {
+      std::cout << "Interpolation type: " << interpolator->GetNameOfClass() << std::endl;
+      }
+    }
+
   for( unsigned int n = 0; n < inputImages.size(); n++ )
     {
+    if( timeSeriesResampler.IsNotNull() )
+      {
+      timeSeriesResampler->SetInput( inputImages[n] );
+      if( verbose )
+        {
+        std::cout << "  Applying transform(s) to time point " << n << " (out of " << inputImages.size() << ")";
+        std::cout << ( timeSeriesResampler->IsMappingValid() ? " with the stored mapping." : "." ) << std::endl;
+        }
+      timeSeriesResampler->Update();
+
+      typename ImageType::Pointer outputImage = timeSeriesResampler->GetOutput();
+      outputImage->DisconnectPipeline();
+      outputImages.push_back( outputImage );
+      continue;
+      }
+
     typedef itk::ResampleImageFilter<ImageType, ImageType, RealType> ResamplerType;
     typename ResamplerType::Pointer resampleFilter = ResamplerType::New();
     resampleFilter->SetInput( inputImages[n] );
@@ -734,6 +968,38 @@ static void antsApplyTransformsInitializeCommandLineOptions( itk::ants::CommandL
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Warp a list of scalar images to the same reference image while " )
+    + std::string( "reading the transform(s) only once.  Each line of the batch file " )
+    + std::string( "contains an input file name, an output file name and, optionally, " )
+    + std::string( "an interpolator specified as for the -n option (without spaces), " )
+    + std::string( "e.g. \"labels.nii.gz warpedLabels.nii.gz GenericLabel\".  Lines starting " )
+    + std::string( "with '#' are ignored.  Images without their own interpolator use -n. " )
+    + std::string( "The -i and -o options are ignored in batch mode. " );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "batch" );
+  option->SetUsageOption( 0, "batchFileName" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "In batch mode, compose the transform(s) once into a displacement " )
+    + std::string( "field on the reference grid and warp every image with that field " )
+    + std::string( "instead of evaluating the full transform chain for each image. " )
+    + std::string( "This trades the memory of one displacement field for speed when " )
+    + std::string( "the chain contains non-linear transforms. " );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "precompute-displacement-field" );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "Several interpolation options are available in ITK. " )
@@ -809,6 +1075,21 @@ static void antsApplyTransformsInitializeCommandLineOptions( itk::ants::CommandL
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Read displacement field transforms on demand, in bricks of brickSize^N voxels " )
+    + std::string( "of which at most maximumNumberOfBricks are kept in memory, instead of reading " )
+    + std::string( "whole fields.  Useful when only a small region or a few points are warped. " )
+    + std::string( "Inverted transforms are still read whole.  A brickSize of 0 (default) disables this." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "on-demand-displacement-fields" );
+  option->SetUsageOption( 0, "brickSize" );
+  option->SetUsageOption( 1, "[brickSize,<maximumNumberOfBricks=64>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description = std::string( "Use 'float' instead of 'double' for computations." );
 
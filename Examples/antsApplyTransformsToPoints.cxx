@@ -20,9 +20,214 @@
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkWindowedSincInterpolateImageFunction.h"
 #include "itkLabelImageGaussianInterpolateImageFunction.h"
+#include "antsTransformPoints.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 
 namespace ants
 {
+/** A legacy VTK file split around its POINTS section, so that the points can
+ * be replaced and everything else written back unchanged. */
+struct VTKPointsFile
+  {
+  std::string   Before;
+  std::string   After;
+  std::string   DataType;
+  bool          IsBinary;
+  unsigned long NumberOfPoints;
+  };
+
+static bool ReadVTKPoints( const std::string & fileName, VTKPointsFile & file, std::vector<double> & points )
+{
+  std::ifstream is( fileName.c_str(), std::ios::in | std::ios::binary );
+  if( !is )
+    {
+    return false;
+    }
+  std::ostringstream contents;
+  contents << is.rdbuf();
+  const std::string data = contents.str();
+
+  // the third line of the header is ASCII or BINARY
+  std::string::size_type position = 0;
+  for( unsigned int line = 0; line < 2 && position != std::string::npos; line++ )
+    {
+    position = data.find( '\n', position );
+    position = ( position == std::string::npos ) ? position : position + 1;
+    }
+  if( position == std::string::npos )
+    {
+    return false;
+    }
+  file.IsBinary = data.compare( position, 6, "BINARY" ) == 0;
+
+  const std::string::size_type pointsStart = data.find( "\nPOINTS " );
+  const std::string::size_type pointsLineEnd = ( pointsStart == std::string::npos ) ? pointsStart :
+    data.find( '\n', pointsStart + 1 );
+  if( pointsLineEnd == std::string::npos )
+    {
+    return false;
+    }
+  std::istringstream header( data.substr( pointsStart + 1, pointsLineEnd - pointsStart - 1 ) );
+  std::string        keyword;
+  header >> keyword >> file.NumberOfPoints >> file.DataType;
+  if( !header || ( file.DataType != "float" && file.DataType != "double" ) )
+    {
+    return false;
+    }
+  file.Before = data.substr( 0, pointsLineEnd + 1 );
+
+  points.resize( 3 * file.NumberOfPoints );
+  std::string::size_type end = pointsLineEnd + 1;
+  if( file.IsBinary )
+    {
+    // big endian
+    const unsigned int valueSize = ( file.DataType == "float" ) ? 4 : 8;
+    if( data.size() < end + points.size() * valueSize )
+      {
+      return false;
+      }
+    for( size_t n = 0; n < points.size(); n++, end += valueSize )
+      {
+      unsigned long long bits = 0;
+      for( unsigned int b = 0; b < valueSize; b++ )
+        {
+        bits = ( bits << 8 ) | static_cast<unsigned char>( data[end + b] );
+        }
+      if( valueSize == 4 )
+        {
+        const unsigned int floatBits = static_cast<unsigned int>( bits );
+        float              value;
+        std::memcpy( &value, &floatBits, sizeof( value ) );
+        points[n] = value;
+        }
+      else
+        {
+        std::memcpy( &points[n], &bits, sizeof( double ) );
+        }
+      }
+    }
+  else
+    {
+    const char *begin = data.c_str() + end;
+    char *      next = ITK_NULLPTR;
+    for( size_t n = 0; n < points.size(); n++ )
+      {
+      points[n] = std::strtod( begin, &next );
+      if( next == begin )
+        {
+        return false;
+        }
+      begin = next;
+      }
+    end = begin - data.c_str();
+    }
+  file.After = data.substr( end );
+  return true;
+}
+
+static bool WriteVTKPoints( const std::string & fileName, const VTKPointsFile & file,
+                            const std::vector<double> & points )
+{
+  std::ofstream os( fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !os )
+    {
+    return false;
+    }
+  os << file.Before;
+  if( file.IsBinary )
+    {
+    const unsigned int valueSize = ( file.DataType == "float" ) ? 4 : 8;
+    std::string        bytes( points.size() * valueSize, '\0' );
+    for( size_t n = 0; n < points.size(); n++ )
+      {
+      unsigned long long bits = 0;
+      if( valueSize == 4 )
+        {
+        const float  value = static_cast<float>( points[n] );
+        unsigned int floatBits;
+        std::memcpy( &floatBits, &value, sizeof( value ) );
+        bits = floatBits;
+        }
+      else
+        {
+        std::memcpy( &bits, &points[n], sizeof( double ) );
+        }
+      for( unsigned int b = 0; b < valueSize; b++ )
+        {
+        bytes[n * valueSize + b] = static_cast<char>( ( bits >> ( 8 * ( valueSize - 1 - b ) ) ) & 0xff );
+        }
+      }
+    os << bytes;
+    }
+  else
+    {
+    os << std::setprecision( file.DataType == "float" ? 9 : 17 );
+    for( size_t n = 0; n < points.size(); n += 3 )
+      {
+      os << points[n] << " " << points[n + 1] << " " << points[n + 2] << "\n";
+      }
+    }
+  os << file.After;
+  return !os.fail();
+}
+
+template <class RealType>
+static bool ReadBinaryPoints( const std::string & fileName, unsigned int dimension, vnl_matrix<RealType> & points )
+{
+  std::ifstream is( fileName.c_str(), std::ios::in | std::ios::binary );
+  if( !is )
+    {
+    return false;
+    }
+  is.seekg( 0, std::ios::end );
+  const std::streamoff size = is.tellg();
+  is.seekg( 0, std::ios::beg );
+  if( size % ( dimension * sizeof( float ) ) != 0 )
+    {
+    return false;
+    }
+  std::vector<float> values( size / sizeof( float ) );
+  if( !values.empty() && !is.read( reinterpret_cast<char *>( &values[0] ), size ) )
+    {
+    return false;
+    }
+  points.set_size( values.size() / dimension, dimension );
+  for( size_t n = 0; n < values.size(); n++ )
+    {
+    points.data_block()[n] = values[n];
+    }
+  return true;
+}
+
+template <class RealType>
+static bool WriteBinaryPoints( const std::string & fileName, unsigned int dimension,
+                               const vnl_matrix<RealType> & points )
+{
+  std::ofstream os( fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !os )
+    {
+    return false;
+    }
+  std::vector<float> values( points.rows() * dimension );
+  for( unsigned int r = 0; r < points.rows(); r++ )
+    {
+    for( unsigned int d = 0; d < dimension; d++ )
+      {
+      values[r * dimension + d] = static_cast<float>( points( r, d ) );
+      }
+    }
+  if( !values.empty() )
+    {
+    os.write( reinterpret_cast<const char *>( &values[0] ), values.size() * sizeof( float ) );
+    }
+  return !os.fail();
+}
+
 template <unsigned int Dimension, class RealType>
 int antsApplyTransformsToPoints(
   itk::ants::CommandLineParser::Pointer & parser )
@@ -37,6 +242,11 @@ int antsApplyTransformsToPoints(
   StringVectorType colheadernames;
   typename ImageType::Pointer pointimage = ITK_NULLPTR;
 
+  // legacy VTK input keeps all three coordinates, also in 2D
+  VTKPointsFile       vtkFile;
+  std::vector<double> vtkPoints;
+  bool                isVTKInput = false;
+
   itk::ants::CommandLineParser::OptionType::Pointer antsrOption =
     parser->GetOption( "forantsr" );
   unsigned int forANTsR = 0;
@@ -87,6 +297,34 @@ int antsApplyTransformsToPoints(
       points_in = dfo->GetMatrix();
       points_out.set_size( points_in.rows(),  points_in.cols() );
       }
+    else if( strcmp( ext.c_str(), ".vtk" ) == 0 )
+      {
+      if( !ReadVTKPoints( inputOption->GetFunction( 0 )->GetName(), vtkFile, vtkPoints ) )
+        {
+        std::cerr << "Could not read the POINTS of the legacy VTK file "
+                  << inputOption->GetFunction( 0 )->GetName() << std::endl;
+        return EXIT_FAILURE;
+        }
+      isVTKInput = true;
+      points_in.set_size( vtkFile.NumberOfPoints, Dimension );
+      for( unsigned int n = 0; n < points_in.rows(); n++ )
+        {
+        for( unsigned int d = 0; d < Dimension; d++ )
+          {
+          points_in( n, d ) = vtkPoints[3 * n + d];
+          }
+        }
+      points_out.set_size( points_in.rows(),  points_in.cols() );
+      }
+    else if( strcmp( ext.c_str(), ".bin" ) == 0 )
+      {
+      if( !ReadBinaryPoints<RealType>( inputOption->GetFunction( 0 )->GetName(), Dimension, points_in ) )
+        {
+        std::cerr << "A .bin input must hold float32 coordinates, " << Dimension << " per point." << std::endl;
+        return EXIT_FAILURE;
+        }
+      points_out.set_size( points_in.rows(),  points_in.cols() );
+      }
     else if( strcmp(ext.c_str(), ".mha" ) == 0 || forANTsR )
       {
       std::string fn1 = inputOption->GetFunction( 0 )->GetName();
@@ -110,7 +348,7 @@ int antsApplyTransformsToPoints(
       }
     else
       {
-      std::cerr << "An input csv or mha file is required." << std::endl;
+      std::cerr << "An input csv, mha, vtk or bin file is required." << std::endl;
       return EXIT_FAILURE;
       }
 
@@ -152,14 +390,33 @@ int antsApplyTransformsToPoints(
     aff->SetIdentity();
 
     typedef itk::CompositeTransform<RealType, Dimension> CompositeTransformType;
-    typename CompositeTransformType::InputPointType point_in;
-    typename CompositeTransformType::OutputPointType point_out;
     typename itk::ants::CommandLineParser::OptionType::Pointer
       transformOption = parser->GetOption( "transform" );
 
+    unsigned int brickSize = 0;
+    unsigned int maximumNumberOfBricks = 64;
+    typename itk::ants::CommandLineParser::OptionType::Pointer onDemandOption =
+      parser->GetOption( "on-demand-displacement-fields" );
+    if( onDemandOption && onDemandOption->GetNumberOfFunctions() )
+      {
+      if( onDemandOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+        {
+        brickSize = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetName() );
+        }
+      else
+        {
+        brickSize = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetParameter( 0 ) );
+        if( onDemandOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+          {
+          maximumNumberOfBricks = parser->Convert<unsigned int>( onDemandOption->GetFunction( 0 )->GetParameter( 1 ) );
+          }
+        }
+      }
+
     std::vector<bool> isDerivedTransform;
     typename CompositeTransformType::Pointer compositeTransform =
-      GetCompositeTransformFromParserOption<RealType, Dimension>( parser, transformOption, isDerivedTransform, forANTsR );
+      GetCompositeTransformFromParserOption<RealType, Dimension>( parser, transformOption, isDerivedTransform, forANTsR,
+                                                                  brickSize, maximumNumberOfBricks );
 
     if ( compositeTransform->GetNumberOfTransforms() == 0 )
       compositeTransform->AddTransform( aff );
@@ -168,23 +425,14 @@ int antsApplyTransformsToPoints(
       {
       return EXIT_FAILURE;
       }
-    for( unsigned int pointct = 0; pointct < points_in.rows(); pointct++ )
+    // the extra columns (t, label, ...) are passed through
+    points_out = points_in;
+    PointBatchTransformer<RealType, Dimension> transformer;
+    transformer.SetTransform( compositeTransform );
+    if( points_in.rows() > 0 )
       {
-      point_in.Fill( 0 );
-      point_out.Fill( 0 );
-      for( unsigned int p = 0; p < Dimension; p++ )
-        {
-        point_in[p] = points_in( pointct, p );
-        }
-      point_out = compositeTransform->TransformPoint( point_in );
-      for( unsigned int p = 0; p < Dimension; p++ )
-        {
-        points_out( pointct, p ) = point_out[p];
-        }
-      for( unsigned int p = Dimension; p < points_in.cols(); p++ )
-        {
-        points_out( pointct, p ) = points_in( pointct, p );
-        }
+      transformer.TransformPoints( points_in.data_block(), points_out.data_block(), points_in.rows(),
+                                   points_in.cols() );
       }
     /**
      * output
@@ -204,6 +452,38 @@ int antsApplyTransformsToPoints(
       std::size_t lengthOutputFileName = std::strlen( outputFileName.c_str() );
       std::string exto = outputFileName.substr( lengthOutputFileName - 4 );
 
+      if( strcmp( exto.c_str(), ".vtk" ) == 0 )
+        {
+        if( !isVTKInput )
+          {
+          vtkFile.Before = std::string( "# vtk DataFile Version 3.0\nantsApplyTransformsToPoints\nASCII\n" )
+            + "DATASET POLYDATA\n";
+          std::ostringstream pointsLine;
+          pointsLine << "POINTS " << points_out.rows() << " double\n";
+          vtkFile.Before += pointsLine.str();
+          vtkFile.After = "";
+          vtkFile.DataType = "double";
+          vtkFile.IsBinary = false;
+          vtkPoints.assign( 3 * points_out.rows(), 0.0 );
+          }
+        for( unsigned int n = 0; n < points_out.rows(); n++ )
+          {
+          for( unsigned int d = 0; d < Dimension; d++ )
+            {
+            vtkPoints[3 * n + d] = points_out( n, d );
+            }
+          }
+        if( !WriteVTKPoints( outputFileName, vtkFile, vtkPoints ) )
+          {
+          std::cerr << "Could not write " << outputFileName << std::endl;
+          return EXIT_FAILURE;
+          }
+        }
+      if( strcmp( exto.c_str(), ".bin" ) == 0 && !WriteBinaryPoints<RealType>( outputFileName, Dimension, points_out ) )
+        {
+        std::cerr << "Could not write " << outputFileName << std::endl;
+        return EXIT_FAILURE;
+        }
       if( strcmp(exto.c_str(), ".csv" ) == 0 )
         {
         StringVectorType ColumnHeaders = colheadernames;
@@ -307,7 +587,10 @@ static void antsApplyTransformsToPointsInitializeCommandLineOptions( itk::ants::
       + std::string( "Write down the voxel coordinates. Then use ImageMaths LabelStats to find " )
       + std::string( "out what coordinates for this voxel antsApplyTransformsToPoints is " )
       + std::string( "expecting.  ITK uses a LPS coordinate system.  See http://sourceforge.net/p/advants/discussion/840261/thread/2a1e9307/" )
-      + std::string(" ***Or pass in a 2D mha (meta format) binary image file.");
+      + std::string(" ***Or pass in a 2D mha (meta format) binary image file.")
+      + std::string( " ***Or a legacy VTK file (e.g. streamlines or a surface), whose POINTS are " )
+      + std::string( "transformed and everything else is copied to a .vtk output unchanged." )
+      + std::string( " ***Or a .bin file of float32 coordinates, N-Spatial-Dimensions values per point." );
 
     OptionType::Pointer option = OptionType::New();
     option->SetLongName( "input" );
@@ -357,6 +640,21 @@ static void antsApplyTransformsToPointsInitializeCommandLineOptions( itk::ants::
     parser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "Read displacement field transforms on demand, in bricks of brickSize^N voxels " )
+      + std::string( "of which at most maximumNumberOfBricks are kept in memory, instead of reading " )
+      + std::string( "whole fields.  Useful when only a small region or a few points are warped. " )
+      + std::string( "Inverted transforms are still read whole.  A brickSize of 0 (default) disables this." );
+
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "on-demand-displacement-fields" );
+    option->SetUsageOption( 0, "brickSize" );
+    option->SetUsageOption( 1, "[brickSize,<maximumNumberOfBricks=64>]" );
+    option->SetDescription( description );
+    parser->AddOption( option );
+    }
+
     {
     std::string description = std::string( "Print the help menu (short version)." );
 
@@ -0,0 +1,1073 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#include "antsUtilities.h"
+#include "antsCommandLineParser.h"
+#include "antsObjectCache.h"
+#include "ReadWriteData.h"
+
+#include "include/Atropos.h"
+#include "include/DenoiseImage.h"
+#include "include/ImageMath.h"
+#include "include/N4BiasFieldCorrection.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkN4BiasFieldCorrectionImageFilter.h"
+#include "itkNumericSeriesFileNames.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+// The settings of the N4 <-> Atropos iterations, with the defaults of
+// antsAtroposN4.sh.  The strings are passed to N4BiasFieldCorrection and
+// Atropos as they are given.
+struct AtroposN4Parameters
+  {
+  std::vector<std::string>  AnatomicalImages;
+  std::string               MaskImage;
+  unsigned int              NumberOfClasses;
+  std::string               Priors;
+  double                    PriorWeight;
+  std::string               Likelihood;
+  std::string               PosteriorFormulation;
+  std::string               MRF;
+  std::vector<std::string>  LabelPropagation;
+  std::vector<unsigned int> N4WeightMaskLabels;
+  std::string               N4Convergence;
+  std::string               N4ShrinkFactor;
+  std::string               N4BSplineParameters;
+  unsigned int              NumberOfIterations;
+  unsigned int              NumberOfAtroposIterations;
+  double                    LabelChangeTolerance;
+  std::string               OutputPrefix;
+  std::string               OutputSuffix;
+  bool                      UseRandomSeeding;
+  bool                      Denoise;
+  bool                      KeepIntermediates;
+  bool                      Verbose;
+  };
+
+// The name by which ReadImage takes an image in memory instead of a file,
+// and WriteImage stores its image, i.e. the address of its smart pointer.
+template <class TImage>
+static std::string GetImagePointerName( typename TImage::Pointer * image )
+{
+  std::stringstream name;
+  name << static_cast<void *>( image );
+  return name.str();
+}
+
+// The option function as it was given, e.g. 'Socrates[1]' or '[0.1,1x1x1]'.
+static std::string GetOptionFunctionString( itk::ants::CommandLineParser::OptionType::OptionFunctionType *function )
+{
+  std::string value = function->GetName();
+  if( function->GetNumberOfParameters() > 0 )
+    {
+    value += "[";
+    for( unsigned int p = 0; p < function->GetNumberOfParameters(); p++ )
+      {
+      value += ( p > 0 ? "," : "" ) + function->GetParameter( p );
+      }
+    value += "]";
+    }
+  return value;
+}
+
+// The '%0Nd' of the file names of the priors, which the posteriors keep.
+static std::string GetSeriesFormat( const std::string & priors )
+{
+  const std::string::size_type percent = priors.find( '%' );
+  if( percent != std::string::npos )
+    {
+    const std::string::size_type d = priors.find( 'd', percent );
+    if( d != std::string::npos )
+      {
+      return priors.substr( percent, d - percent + 1 );
+      }
+    }
+  return std::string( "%d" );
+}
+
+static std::vector<std::string> GetSeriesFileNames( const std::string & format, unsigned int numberOfClasses )
+{
+  itk::NumericSeriesFileNames::Pointer fileNamesCreator = itk::NumericSeriesFileNames::New();
+  fileNamesCreator->SetStartIndex( 1 );
+  fileNamesCreator->SetEndIndex( numberOfClasses );
+  fileNamesCreator->SetSeriesFormat( format.c_str() );
+  return fileNamesCreator->GetFileNames();
+}
+
+static bool RunCommand( int ( *command )( std::vector<std::string>, std::ostream * ), const std::string & name,
+                        const std::vector<std::string> & args )
+{
+  int exitCode = EXIT_FAILURE;
+  try
+    {
+    exitCode = ( *command )( args, &std::cout );
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "Exception caught in " << name << ": " << err << std::endl;
+    exitCode = EXIT_FAILURE;
+    }
+  if( exitCode != EXIT_SUCCESS )
+    {
+    std::cerr << name << " failed." << std::endl;
+    return false;
+    }
+  return true;
+}
+
+// The fraction of the voxels labeled in either segmentation whose label
+// differs.
+template <class TLabelImage>
+static double GetChangedLabelFraction( const TLabelImage *segmentation, const TLabelImage *previousSegmentation )
+{
+  itk::ImageRegionConstIterator<TLabelImage> It( segmentation, segmentation->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator<TLabelImage> ItP( previousSegmentation,
+                                                  previousSegmentation->GetLargestPossibleRegion() );
+
+  unsigned long numberOfLabeledVoxels = 0;
+  unsigned long numberOfChangedVoxels = 0;
+  for( It.GoToBegin(), ItP.GoToBegin(); !It.IsAtEnd(); ++It, ++ItP )
+    {
+    if( It.Get() != 0 || ItP.Get() != 0 )
+      {
+      numberOfLabeledVoxels++;
+      if( It.Get() != ItP.Get() )
+        {
+        numberOfChangedVoxels++;
+        }
+      }
+    }
+  if( numberOfLabeledVoxels == 0 )
+    {
+    return 0.0;
+    }
+  return static_cast<double>( numberOfChangedVoxels ) / static_cast<double>( numberOfLabeledVoxels );
+}
+
+template <unsigned int ImageDimension>
+static int AtroposN4Segmentation( const AtroposN4Parameters & parameters )
+{
+  // the pixel types with which N4BiasFieldCorrection, Atropos and ImageMath
+  // read their images, since an image in memory is taken as it is
+  typedef float                                 RealType;
+  typedef itk::Image<RealType, ImageDimension>  ImageType;
+  typedef unsigned int                          LabelType;
+  typedef itk::Image<LabelType, ImageDimension> LabelImageType;
+
+  typedef itk::N4BiasFieldCorrectionImageFilter<ImageType, ImageType, ImageType> CorrecterType;
+  typedef typename CorrecterType::BiasFieldControlPointLatticeType               LatticeType;
+
+  const unsigned int numberOfImages = parameters.AnatomicalImages.size();
+
+  std::stringstream dimensionStream;
+  dimensionStream << ImageDimension;
+  const std::string dimension = dimensionStream.str();
+  const std::string verbose = parameters.Verbose ? "1" : "0";
+
+  const std::string seriesFormat = GetSeriesFormat( parameters.Priors );
+
+  // Use the priors if all of them exist, else k-means as the script does.
+  std::vector<std::string> priorFileNames;
+  if( !parameters.Priors.empty() )
+    {
+    priorFileNames = GetSeriesFileNames( parameters.Priors, parameters.NumberOfClasses );
+    unsigned int numberOfPriors = 0;
+    for( unsigned int k = 0; k < priorFileNames.size(); k++ )
+      {
+      if( itksys::SystemTools::FileExists( priorFileNames[k].c_str(), true ) )
+        {
+        numberOfPriors++;
+        }
+      }
+    if( numberOfPriors == 0 )
+      {
+      priorFileNames.clear();
+      }
+    else if( numberOfPriors != parameters.NumberOfClasses )
+      {
+      std::cerr << "Expected " << parameters.NumberOfClasses << " prior images (" << numberOfPriors
+                << " are specified)." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  const bool initializeWithKMeans = priorFileNames.empty();
+  if( initializeWithKMeans )
+    {
+    std::cout << "Initializing with kmeans segmentation." << std::endl;
+    }
+  for( unsigned int i = 0; i < parameters.N4WeightMaskLabels.size(); i++ )
+    {
+    if( parameters.N4WeightMaskLabels[i] < 1 || parameters.N4WeightMaskLabels[i] > parameters.NumberOfClasses )
+      {
+      std::cerr << "The posterior label " << parameters.N4WeightMaskLabels[i] << " of the N4 weight mask is "
+                << "not one of the classes." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // The posteriors of the last round, read back from the cache by the next
+  // one, and the outputs.
+  const std::string              posteriorFormat = parameters.OutputPrefix + "SegmentationPosteriorsCurrent"
+    + seriesFormat + ".nii";
+  const std::vector<std::string> posteriorFileNames = GetSeriesFileNames( posteriorFormat,
+                                                                          parameters.NumberOfClasses );
+  const std::vector<std::string> outputPosteriorFileNames = GetSeriesFileNames(
+      parameters.OutputPrefix + "SegmentationPosteriors" + seriesFormat + "." + parameters.OutputSuffix,
+      parameters.NumberOfClasses );
+  const std::string segmentationFileName = parameters.OutputPrefix + "Segmentation." + parameters.OutputSuffix;
+  const std::string convergenceFileName = parameters.OutputPrefix + "SegmentationConvergence.txt";
+
+  // Everything below stays in memory across the rounds.
+  typename ImageType::Pointer      n4MaskImage;
+  typename LabelImageType::Pointer atroposMaskImage;
+  if( !ReadImage<ImageType>( n4MaskImage, parameters.MaskImage.c_str() ) ||
+      !ReadImage<LabelImageType>( atroposMaskImage, parameters.MaskImage.c_str() ) )
+    {
+    std::cerr << "Could not read the mask " << parameters.MaskImage << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::vector<typename ImageType::Pointer>   preprocessedImages( numberOfImages );
+  std::vector<typename ImageType::Pointer>   correctedImages( numberOfImages );
+  std::vector<typename ImageType::Pointer>   biasFields( numberOfImages );
+  std::vector<typename LatticeType::Pointer> biasFieldLattices( numberOfImages );
+  typename ImageType::Pointer                weightMaskImage;
+  typename LabelImageType::Pointer           segmentation;
+  typename LabelImageType::Pointer           previousSegmentation;
+
+  // The truncation and denoising of the first image do not change from one
+  // round to the next, so unlike in the script they are done once.
+  for( unsigned int j = 0; j < numberOfImages; j++ )
+    {
+    if( j == 0 )
+      {
+      std::vector<std::string> args;
+      args.push_back( dimension );
+      args.push_back( GetImagePointerName<ImageType>( &preprocessedImages[j] ) );
+      args.push_back( "TruncateImageIntensity" );
+      args.push_back( parameters.AnatomicalImages[j] );
+      args.push_back( "0.025" );
+      args.push_back( "0.995" );
+      args.push_back( "256" );
+      args.push_back( parameters.MaskImage );
+      args.push_back( "1" );
+      if( !RunCommand( ImageMath, "ImageMath TruncateImageIntensity", args ) )
+        {
+        return EXIT_FAILURE;
+        }
+      if( parameters.Denoise )
+        {
+        args.clear();
+        args.push_back( "--image-dimensionality" );
+        args.push_back( dimension );
+        args.push_back( "--input-image" );
+        args.push_back( GetImagePointerName<ImageType>( &preprocessedImages[j] ) );
+        args.push_back( "--output" );
+        args.push_back( GetImagePointerName<ImageType>( &preprocessedImages[j] ) );
+        args.push_back( "--verbose" );
+        args.push_back( verbose );
+        if( !RunCommand( DenoiseImage, "DenoiseImage", args ) )
+          {
+          return EXIT_FAILURE;
+          }
+        }
+      }
+    else if( !ReadImage<ImageType>( preprocessedImages[j], parameters.AnatomicalImages[j].c_str() ) )
+      {
+      std::cerr << "Could not read " << parameters.AnatomicalImages[j] << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  if( !initializeWithKMeans && !parameters.N4WeightMaskLabels.empty() )
+    {
+    std::vector<std::string> args;
+    args.push_back( dimension );
+    args.push_back( GetImagePointerName<ImageType>( &weightMaskImage ) );
+    args.push_back( "PureTissueN4WeightMask" );
+    for( unsigned int i = 0; i < parameters.N4WeightMaskLabels.size(); i++ )
+      {
+      args.push_back( priorFileNames[parameters.N4WeightMaskLabels[i] - 1] );
+      }
+    if( !RunCommand( ImageMath, "ImageMath PureTissueN4WeightMask", args ) )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::ofstream convergenceFile( convergenceFileName.c_str() );
+  convergenceFile << "Iteration,ChangedLabelFraction" << std::endl;
+
+  std::stringstream classes;
+  classes << parameters.NumberOfClasses;
+  std::stringstream priorWeight;
+  priorWeight << parameters.PriorWeight;
+  std::stringstream atroposConvergence;
+  atroposConvergence << "[" << parameters.NumberOfAtroposIterations << ",0.0]";
+
+  bool converged = false;
+  for( unsigned int i = 0; i < parameters.NumberOfIterations && !converged; i++ )
+    {
+    std::cout << "N4 <-> Atropos iteration " << i + 1 << " of " << parameters.NumberOfIterations << std::endl;
+
+    // N4, warm started from the lattice of the last round
+    for( unsigned int j = 0; j < numberOfImages; j++ )
+      {
+      const std::string corrected = GetImagePointerName<ImageType>( &correctedImages[j] );
+
+      std::vector<std::string> args;
+      args.push_back( "--image-dimensionality" );
+      args.push_back( dimension );
+      args.push_back( "--input-image" );
+      args.push_back( GetImagePointerName<ImageType>( &preprocessedImages[j] ) );
+      args.push_back( "--mask-image" );
+      args.push_back( GetImagePointerName<ImageType>( &n4MaskImage ) );
+      args.push_back( "--shrink-factor" );
+      args.push_back( parameters.N4ShrinkFactor );
+      args.push_back( "--convergence" );
+      args.push_back( parameters.N4Convergence );
+      args.push_back( "--bspline-fitting" );
+      args.push_back( parameters.N4BSplineParameters );
+      args.push_back( "--output" );
+      args.push_back( "[" + corrected + "," + GetImagePointerName<ImageType>( &biasFields[j] ) + ","
+                      + GetImagePointerName<LatticeType>( &biasFieldLattices[j] ) + "]" );
+      if( weightMaskImage.IsNotNull() )
+        {
+        args.push_back( "--weight-image" );
+        args.push_back( GetImagePointerName<ImageType>( &weightMaskImage ) );
+        }
+      if( biasFieldLattices[j].IsNotNull() )
+        {
+        args.push_back( "--initial-bias-field-lattice" );
+        args.push_back( GetImagePointerName<LatticeType>( &biasFieldLattices[j] ) );
+        }
+      args.push_back( "--verbose" );
+      args.push_back( verbose );
+      if( !RunCommand( N4BiasFieldCorrection, "N4BiasFieldCorrection", args ) )
+        {
+        return EXIT_FAILURE;
+        }
+
+      args.clear();
+      args.push_back( dimension );
+      args.push_back( corrected );
+      args.push_back( "Normalize" );
+      args.push_back( corrected );
+      if( !RunCommand( ImageMath, "ImageMath Normalize", args ) )
+        {
+        return EXIT_FAILURE;
+        }
+      args.clear();
+      args.push_back( dimension );
+      args.push_back( corrected );
+      args.push_back( "m" );
+      args.push_back( corrected );
+      args.push_back( "1000" );
+      if( !RunCommand( ImageMath, "ImageMath m", args ) )
+        {
+        return EXIT_FAILURE;
+        }
+      }
+
+    // Atropos, warm started from the posteriors of the last round unless
+    // the priors also weigh in the posteriors
+    std::string initialization;
+    if( i > 0 && ( initializeWithKMeans || parameters.PriorWeight == 0.0 ) )
+      {
+      initialization = "PriorProbabilityImages[" + classes.str() + "," + posteriorFormat + ","
+        + priorWeight.str() + "]";
+      }
+    else if( initializeWithKMeans )
+      {
+      initialization = "kmeans[" + classes.str() + "]";
+      }
+    else
+      {
+      initialization = "PriorProbabilityImages[" + classes.str() + "," + parameters.Priors + ","
+        + priorWeight.str() + "]";
+      }
+
+    std::vector<std::string> args;
+    args.push_back( "--image-dimensionality" );
+    args.push_back( dimension );
+    args.push_back( "--mask-image" );
+    args.push_back( GetImagePointerName<LabelImageType>( &atroposMaskImage ) );
+    args.push_back( "--convergence" );
+    args.push_back( atroposConvergence.str() );
+    for( unsigned int j = 0; j < numberOfImages; j++ )
+      {
+      args.push_back( "--intensity-image" );
+      args.push_back( GetImagePointerName<ImageType>( &correctedImages[j] ) );
+      }
+    for( unsigned int l = 0; l < parameters.LabelPropagation.size(); l++ )
+      {
+      args.push_back( "--label-propagation" );
+      args.push_back( parameters.LabelPropagation[l] );
+      }
+    args.push_back( "--initialization" );
+    args.push_back( initialization );
+    args.push_back( "--likelihood-model" );
+    args.push_back( parameters.Likelihood );
+    args.push_back( "--mrf" );
+    args.push_back( parameters.MRF );
+    args.push_back( "--output" );
+    args.push_back( "[" + GetImagePointerName<LabelImageType>( &segmentation ) + "," + posteriorFormat + "]" );
+    args.push_back( "--use-random-seed" );
+    args.push_back( parameters.UseRandomSeeding ? "1" : "0" );
+    args.push_back( "--posterior-formulation" );
+    args.push_back( i == 0 ? std::string( "Socrates[0]" ) : parameters.PosteriorFormulation );
+    args.push_back( "--verbose" );
+    args.push_back( verbose );
+    if( !RunCommand( Atropos, "Atropos", args ) )
+      {
+      return EXIT_FAILURE;
+      }
+
+    // stop once the labels are stable
+    if( previousSegmentation.IsNotNull() )
+      {
+      const double changedLabelFraction = GetChangedLabelFraction<LabelImageType>( segmentation,
+                                                                                   previousSegmentation );
+      std::cout << "  fraction of the labels changed = " << changedLabelFraction << std::endl;
+      convergenceFile << i << "," << changedLabelFraction << std::endl;
+      converged = ( changedLabelFraction <= parameters.LabelChangeTolerance );
+      }
+    previousSegmentation = segmentation;
+
+    if( !converged && i + 1 < parameters.NumberOfIterations && !parameters.N4WeightMaskLabels.empty() )
+      {
+      args.clear();
+      args.push_back( dimension );
+      args.push_back( GetImagePointerName<ImageType>( &weightMaskImage ) );
+      args.push_back( "PureTissueN4WeightMask" );
+      for( unsigned int l = 0; l < parameters.N4WeightMaskLabels.size(); l++ )
+        {
+        args.push_back( posteriorFileNames[parameters.N4WeightMaskLabels[l] - 1] );
+        }
+      if( !RunCommand( ImageMath, "ImageMath PureTissueN4WeightMask", args ) )
+        {
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  std::cout << ( converged ? "Done with segmentation (labels converged)." :
+                 "Done with segmentation (exceeded max. iterations)." ) << std::endl;
+
+  WriteImage<LabelImageType>( segmentation, segmentationFileName.c_str() );
+  for( unsigned int k = 0; k < parameters.NumberOfClasses; k++ )
+    {
+    typename ImageType::Pointer posterior;
+    if( !ReadImage<ImageType>( posterior, posteriorFileNames[k].c_str() ) )
+      {
+      std::cerr << "Could not read the posterior " << posteriorFileNames[k] << std::endl;
+      return EXIT_FAILURE;
+      }
+    WriteImage<ImageType>( posterior, outputPosteriorFileNames[k].c_str() );
+    if( !parameters.KeepIntermediates )
+      {
+      ObjectCache::Invalidate( posteriorFileNames[k] );
+      itksys::SystemTools::RemoveFile( posteriorFileNames[k].c_str() );
+      }
+    }
+  for( unsigned int j = 0; j < numberOfImages; j++ )
+    {
+    std::stringstream fileName;
+    fileName << parameters.OutputPrefix << "Segmentation" << j << "N4." << parameters.OutputSuffix;
+    WriteImage<ImageType>( correctedImages[j], fileName.str().c_str() );
+    }
+
+  return EXIT_SUCCESS;
+}
+static void antsAtroposN4InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  {
+  std::string description = std::string( "The dimensionality of the images." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "dimensionality" );
+  option->SetShortName( 'd' );
+  option->SetUsageOption( 0, "2/(3)/4" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Anatomical image, typically T1.  If more than one anatomical image is specified, " )
+    + std::string( "subsequently specified images are used during the segmentation process." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "anatomical-image" );
+  option->SetShortName( 'a' );
+  option->SetUsageOption( 0, "inputImage" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Binary mask defining the region of interest." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "mask-image" );
+  option->SetShortName( 'x' );
+  option->SetUsageOption( 0, "maskImage" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Number of classes defining the segmentation." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "number-of-classes" );
+  option->SetShortName( 'c' );
+  option->SetUsageOption( 0, "3" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Prior probability images initializing the segmentation, specified using c-style " )
+    + std::string( "formatting.  Without them the segmentation is initialized with k-means." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "priors" );
+  option->SetShortName( 'p' );
+  option->SetUsageOption( 0, "segmentationPriors%02d.nii.gz" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Atropos spatial prior probability weight for the segmentation.  With a weight of 0 " )
+    + std::string( "the priors only initialize the first round, after which each round starts from the " )
+    + std::string( "posteriors of the previous one." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "prior-weight" );
+  option->SetShortName( 'w' );
+  option->SetUsageOption( 0, "0.0" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The likelihood model of Atropos." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "likelihood-model" );
+  option->SetShortName( 'k' );
+  option->SetUsageOption( 0, "Gaussian" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Posterior formulation and whether or not to use mixture model proportions, e.g. " )
+    + std::string( "'Socrates[1]' or 'Aristotle[1]'.  The first round uses 'Socrates[0]'." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "posterior-formulation" );
+  option->SetShortName( 'b' );
+  option->SetUsageOption( 0, "Socrates[1]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The MRF prior of Atropos, '[weight,neighborhood]'." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "mrf" );
+  option->SetShortName( 'r' );
+  option->SetUsageOption( 0, "[0.1,1x1x1]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Incorporate a distance prior on the posterior formulation, as with the option of " )
+    + std::string( "the same name of Atropos.  Can be given multiple times." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "label-propagation" );
+  option->SetShortName( 'l' );
+  option->SetUsageOption( 0, "label[lambda,boundaryProbability]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Which posterior probability image should be used to define the N4 weight mask.  " )
+    + std::string( "Can be given multiple times, in which case the chosen posteriors are combined." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-weight-mask-label" );
+  option->SetShortName( 'y' );
+  option->SetUsageOption( 0, "label" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The convergence of N4." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-convergence" );
+  option->SetShortName( 't' );
+  option->SetUsageOption( 0, "[50x50x50x50,0.0000000001]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The shrink factor of N4." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-shrink-factor" );
+  option->SetShortName( 'f' );
+  option->SetUsageOption( 0, "2" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The B-spline fitting parameters of N4." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-bspline-fitting" );
+  option->SetShortName( 'q' );
+  option->SetUsageOption( 0, "[200]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Maximum number of (outer loop) iterations between N4 <-> Atropos." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "n4-atropos-iterations" );
+  option->SetShortName( 'm' );
+  option->SetUsageOption( 0, "15" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Maximum number of (inner loop) iterations in Atropos." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "atropos-iterations" );
+  option->SetShortName( 'n' );
+  option->SetUsageOption( 0, "5" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The iterations stop once the fraction of the labeled voxels whose label changed " )
+    + std::string( "from one round to the next is at most this tolerance." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "label-change-tolerance" );
+  option->SetShortName( 'e' );
+  option->SetUsageOption( 0, "0.001" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Denoise the first anatomical image." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "denoise" );
+  option->SetShortName( 'g' );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Use random number generated from system clock in Atropos." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "use-random-seeding" );
+  option->SetShortName( 'u' );
+  option->SetUsageOption( 0, "0/(1)" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The prefix of the outputs: the segmentation 'prefix'Segmentation.'suffix', its " )
+    + std::string( "posteriors 'prefix'SegmentationPosteriors<k>.'suffix', the corrected images " )
+    + std::string( "'prefix'Segmentation<j>N4.'suffix' and the changed label fraction of each round, " )
+    + std::string( "'prefix'SegmentationConvergence.txt." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "output" );
+  option->SetShortName( 'o' );
+  option->SetUsageOption( 0, "outputPrefix" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Any of the standard ITK IO formats e.g. nrrd, nii.gz, mhd." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "output-suffix" );
+  option->SetShortName( 's' );
+  option->SetUsageOption( 0, "nii.gz" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Keep the posteriors of the last round, 'prefix'SegmentationPosteriorsCurrent<k>.nii, " )
+    + std::string( "which the rounds pass on to each other." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "keep-intermediates" );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The memory, in megabytes, of the cache keeping the posteriors and the priors " )
+    + std::string( "between the rounds." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "cache-memory" );
+  option->SetUsageOption( 0, "4096" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the progress of N4 and Atropos." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "verbose" );
+  option->SetShortName( 'v' );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu (short version)." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetShortName( 'h' );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "help" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+}
+
+// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
+// 'main()'
+int antsAtroposN4( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+{
+  // put the arguments coming in as 'args' into standard (argc,argv) format;
+  // 'args' doesn't have the command name as first, argument, so add it manually;
+  // 'args' may have adjacent arguments concatenated into one argument,
+  // which the parser should handle
+  args.insert( args.begin(), "antsAtroposN4" );
+  int     argc = args.size();
+  char* * argv = new char *[args.size() + 1];
+  for( unsigned int i = 0; i < args.size(); ++i )
+    {
+    // allocate space for the string plus a null character
+    argv[i] = new char[args[i].length() + 1];
+    std::strncpy( argv[i], args[i].c_str(), args[i].length() );
+    // place the null character in the end
+    argv[i][args[i].length()] = '\0';
+    }
+  argv[argc] = ITK_NULLPTR;
+  // class to automatically cleanup argv upon destruction
+  class Cleanup_argv
+  {
+public:
+    Cleanup_argv( char* * argv_, int argc_plus_one_ ) : argv( argv_ ), argc_plus_one( argc_plus_one_ )
+    {
+    }
+
+    ~Cleanup_argv()
+    {
+      for( unsigned int i = 0; i < argc_plus_one; ++i )
+        {
+        delete[] argv[i];
+        }
+      delete[] argv;
+    }
+
+private:
+    char* *      argv;
+    unsigned int argc_plus_one;
+  };
+  Cleanup_argv cleanup_argv( argv, argc + 1 );
+
+  itk::ants::CommandLineParser::Pointer parser = itk::ants::CommandLineParser::New();
+
+  parser->SetCommand( argv[0] );
+
+  std::string commandDescription = std::string( "Iterates between N4 <-> Atropos to improve segmentation " )
+    + std::string( "results, as antsAtroposN4.sh does, in one process.  N4BiasFieldCorrection, Atropos and " )
+    + std::string( "ImageMath are run through their library entry points on images kept in memory; each " )
+    + std::string( "N4 fit starts from the bias field lattice of the previous round and each Atropos run " )
+    + std::string( "from its posteriors, and the iterations stop once the labels are stable." );
+
+  parser->SetCommandDescription( commandDescription );
+  antsAtroposN4InitializeCommandLineOptions( parser );
+
+  if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( argc == 1 )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_FAILURE;
+    }
+  else if( parser->GetOption( "help" )->GetFunction() && parser->Convert<bool>( parser->GetOption( "help" )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_SUCCESS;
+    }
+  else if( parser->GetOption( 'h' )->GetFunction() && parser->Convert<bool>( parser->GetOption( 'h' )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, true );
+    return EXIT_SUCCESS;
+    }
+
+  AtroposN4Parameters parameters;
+
+  // the functions of an option are stored last first
+  itk::ants::CommandLineParser::OptionType::Pointer anatomicalOption = parser->GetOption( "anatomical-image" );
+  for( int n = ( anatomicalOption ? static_cast<int>( anatomicalOption->GetNumberOfFunctions() ) : 0 ) - 1; n >= 0;
+       n-- )
+    {
+    parameters.AnatomicalImages.push_back( anatomicalOption->GetFunction( n )->GetName() );
+    }
+  if( parameters.AnatomicalImages.empty() )
+    {
+    std::cerr << "No anatomical image specified.  See command line option --anatomical-image." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer maskOption = parser->GetOption( "mask-image" );
+  if( !maskOption || maskOption->GetNumberOfFunctions() == 0 )
+    {
+    std::cerr << "No mask specified.  See command line option --mask-image." << std::endl;
+    return EXIT_FAILURE;
+    }
+  parameters.MaskImage = maskOption->GetFunction( 0 )->GetName();
+
+  parameters.OutputPrefix = "antsAtroposN4";
+  itk::ants::CommandLineParser::OptionType::Pointer outputOption = parser->GetOption( "output" );
+  if( outputOption && outputOption->GetNumberOfFunctions() )
+    {
+    parameters.OutputPrefix = outputOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.OutputSuffix = "nii.gz";
+  itk::ants::CommandLineParser::OptionType::Pointer suffixOption = parser->GetOption( "output-suffix" );
+  if( suffixOption && suffixOption->GetNumberOfFunctions() )
+    {
+    parameters.OutputSuffix = suffixOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.NumberOfClasses = 3;
+  itk::ants::CommandLineParser::OptionType::Pointer classesOption = parser->GetOption( "number-of-classes" );
+  if( classesOption && classesOption->GetNumberOfFunctions() )
+    {
+    parameters.NumberOfClasses = parser->Convert<unsigned int>( classesOption->GetFunction( 0 )->GetName() );
+    }
+  if( parameters.NumberOfClasses == 0 )
+    {
+    std::cerr << "The number of classes must be at least 1." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer priorsOption = parser->GetOption( "priors" );
+  if( priorsOption && priorsOption->GetNumberOfFunctions() )
+    {
+    parameters.Priors = priorsOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.PriorWeight = 0.0;
+  itk::ants::CommandLineParser::OptionType::Pointer priorWeightOption = parser->GetOption( "prior-weight" );
+  if( priorWeightOption && priorWeightOption->GetNumberOfFunctions() )
+    {
+    parameters.PriorWeight = parser->Convert<double>( priorWeightOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.Likelihood = "Gaussian";
+  itk::ants::CommandLineParser::OptionType::Pointer likelihoodOption = parser->GetOption( "likelihood-model" );
+  if( likelihoodOption && likelihoodOption->GetNumberOfFunctions() )
+    {
+    parameters.Likelihood = GetOptionFunctionString( likelihoodOption->GetFunction( 0 ) );
+    }
+
+  parameters.PosteriorFormulation = "Socrates[1]";
+  itk::ants::CommandLineParser::OptionType::Pointer posteriorOption = parser->GetOption( "posterior-formulation" );
+  if( posteriorOption && posteriorOption->GetNumberOfFunctions() )
+    {
+    parameters.PosteriorFormulation = GetOptionFunctionString( posteriorOption->GetFunction( 0 ) );
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer mrfOption = parser->GetOption( "mrf" );
+  if( mrfOption && mrfOption->GetNumberOfFunctions() )
+    {
+    parameters.MRF = GetOptionFunctionString( mrfOption->GetFunction( 0 ) );
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer propagationOption = parser->GetOption( "label-propagation" );
+  for( int n = ( propagationOption ? static_cast<int>( propagationOption->GetNumberOfFunctions() ) : 0 ) - 1;
+       n >= 0; n-- )
+    {
+    parameters.LabelPropagation.push_back( GetOptionFunctionString( propagationOption->GetFunction( n ) ) );
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer weightMaskOption = parser->GetOption( "n4-weight-mask-label" );
+  for( int n = ( weightMaskOption ? static_cast<int>( weightMaskOption->GetNumberOfFunctions() ) : 0 ) - 1;
+       n >= 0; n-- )
+    {
+    parameters.N4WeightMaskLabels.push_back(
+      parser->Convert<unsigned int>( weightMaskOption->GetFunction( n )->GetName() ) );
+    }
+
+  parameters.N4Convergence = "[50x50x50x50,0.0000000001]";
+  itk::ants::CommandLineParser::OptionType::Pointer n4ConvergenceOption = parser->GetOption( "n4-convergence" );
+  if( n4ConvergenceOption && n4ConvergenceOption->GetNumberOfFunctions() )
+    {
+    parameters.N4Convergence = GetOptionFunctionString( n4ConvergenceOption->GetFunction( 0 ) );
+    }
+
+  parameters.N4ShrinkFactor = "2";
+  itk::ants::CommandLineParser::OptionType::Pointer n4ShrinkOption = parser->GetOption( "n4-shrink-factor" );
+  if( n4ShrinkOption && n4ShrinkOption->GetNumberOfFunctions() )
+    {
+    parameters.N4ShrinkFactor = n4ShrinkOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.N4BSplineParameters = "[200]";
+  itk::ants::CommandLineParser::OptionType::Pointer n4BSplineOption = parser->GetOption( "n4-bspline-fitting" );
+  if( n4BSplineOption && n4BSplineOption->GetNumberOfFunctions() )
+    {
+    parameters.N4BSplineParameters = GetOptionFunctionString( n4BSplineOption->GetFunction( 0 ) );
+    }
+
+  parameters.NumberOfIterations = 15;
+  itk::ants::CommandLineParser::OptionType::Pointer iterationsOption = parser->GetOption( "n4-atropos-iterations" );
+  if( iterationsOption && iterationsOption->GetNumberOfFunctions() )
+    {
+    parameters.NumberOfIterations = parser->Convert<unsigned int>( iterationsOption->GetFunction( 0 )->GetName() );
+    }
+  parameters.NumberOfIterations = std::max( parameters.NumberOfIterations, 1u );
+
+  parameters.NumberOfAtroposIterations = 5;
+  itk::ants::CommandLineParser::OptionType::Pointer atroposIterationsOption =
+    parser->GetOption( "atropos-iterations" );
+  if( atroposIterationsOption && atroposIterationsOption->GetNumberOfFunctions() )
+    {
+    parameters.NumberOfAtroposIterations =
+      parser->Convert<unsigned int>( atroposIterationsOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.LabelChangeTolerance = 0.001;
+  itk::ants::CommandLineParser::OptionType::Pointer toleranceOption = parser->GetOption( "label-change-tolerance" );
+  if( toleranceOption && toleranceOption->GetNumberOfFunctions() )
+    {
+    parameters.LabelChangeTolerance = parser->Convert<double>( toleranceOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.Denoise = false;
+  itk::ants::CommandLineParser::OptionType::Pointer denoiseOption = parser->GetOption( "denoise" );
+  if( denoiseOption && denoiseOption->GetNumberOfFunctions() )
+    {
+    parameters.Denoise = parser->Convert<bool>( denoiseOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.UseRandomSeeding = true;
+  itk::ants::CommandLineParser::OptionType::Pointer seedingOption = parser->GetOption( "use-random-seeding" );
+  if( seedingOption && seedingOption->GetNumberOfFunctions() )
+    {
+    parameters.UseRandomSeeding = parser->Convert<bool>( seedingOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.KeepIntermediates = false;
+  itk::ants::CommandLineParser::OptionType::Pointer keepOption = parser->GetOption( "keep-intermediates" );
+  if( keepOption && keepOption->GetNumberOfFunctions() )
+    {
+    parameters.KeepIntermediates = parser->Convert<bool>( keepOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.Verbose = false;
+  itk::ants::CommandLineParser::OptionType::Pointer verboseOption = parser->GetOption( "verbose" );
+  if( verboseOption && verboseOption->GetNumberOfFunctions() )
+    {
+    parameters.Verbose = parser->Convert<bool>( verboseOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned long cacheMemory = 4096;
+  itk::ants::CommandLineParser::OptionType::Pointer cacheMemoryOption = parser->GetOption( "cache-memory" );
+  if( cacheMemoryOption && cacheMemoryOption->GetNumberOfFunctions() )
+    {
+    cacheMemory = parser->Convert<unsigned long>( cacheMemoryOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned int dimension = 3;
+  itk::ants::CommandLineParser::OptionType::Pointer dimensionOption = parser->GetOption( "dimensionality" );
+  if( dimensionOption && dimensionOption->GetNumberOfFunctions() )
+    {
+    dimension = parser->Convert<unsigned int>( dimensionOption->GetFunction( 0 )->GetName() );
+    }
+
+  if( parameters.MRF.empty() )
+    {
+    parameters.MRF = ( dimension == 2 ) ? "[0.1,1x1]" : ( dimension == 4 ? "[0.1,1x1x1x1]" : "[0.1,1x1x1]" );
+    }
+
+  const std::string outputDirectory = itksys::SystemTools::GetFilenamePath( parameters.OutputPrefix );
+  if( !outputDirectory.empty() && !itksys::SystemTools::FileIsDirectory( outputDirectory.c_str() ) )
+    {
+    std::cout << "The output directory \"" << outputDirectory << "\" does not exist. Making it." << std::endl;
+    itksys::SystemTools::MakeDirectory( outputDirectory.c_str() );
+    }
+
+  // The posteriors written by Atropos are kept for the next round.
+  const unsigned long previousCacheMemory = ObjectCache::GetMaximumMemory();
+  ObjectCache::SetMaximumMemory( cacheMemory * 1024 * 1024 );
+
+  int exitCode = EXIT_FAILURE;
+  switch( dimension )
+    {
+    case 2:
+      exitCode = AtroposN4Segmentation<2>( parameters );
+      break;
+    case 3:
+      exitCode = AtroposN4Segmentation<3>( parameters );
+      break;
+    case 4:
+      exitCode = AtroposN4Segmentation<4>( parameters );
+      break;
+    default:
+      std::cerr << "Unsupported dimension " << dimension << std::endl;
+      break;
+    }
+
+  ObjectCache::SetMaximumMemory( previousCacheMemory );
+  return exitCode;
+}
+} // namespace ants
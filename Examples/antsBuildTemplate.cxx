@@ -0,0 +1,1254 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#include "antsUtilities.h"
+#include "antsCommandLineParser.h"
+#include "antsObjectCache.h"
+#include "ReadWriteData.h"
+#include "itkantsReadWriteTransform.h"
+
+#include "include/antsRegistration.h"
+
+#include "itkAffineTransform.h"
+#include "itkCompositeTransform.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkMultiThreader.h"
+#include "itkMutexLockHolder.h"
+#include "itkResampleImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkTransformFactoryBase.h"
+#include "itkVectorLinearInterpolateImageFunction.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+// The settings of the template construction.  Subjects[n][k] is the image of
+// modality k of subject n.
+struct TemplateBuilderParameters
+  {
+  std::vector<std::vector<std::string> > Subjects;
+  std::vector<std::string>               InitialTemplates;
+  std::vector<double>                    Weights;
+  std::string                            OutputPrefix;
+  std::string                            TransformationModel;
+  std::string                            SimilarityMetric;
+  std::string                            MaximumIterations;
+  std::string                            ShrinkFactors;
+  std::string                            SmoothingSigmas;
+  double                                 TransformStep;
+  double                                 GradientStep;
+  unsigned int                           NumberOfIterations;
+  unsigned int                           NumberOfJobs;
+  bool                                   Normalize;
+  bool                                   Resume;
+  bool                                   WriteWarpedImages;
+  };
+
+static std::string GetTemplateFileName( const TemplateBuilderParameters & parameters, unsigned int modality )
+{
+  std::stringstream fileName;
+  fileName << parameters.OutputPrefix << "template" << modality << ".nii.gz";
+  return fileName.str();
+}
+
+static std::string GetTemplateStateFileName( const TemplateBuilderParameters & parameters )
+{
+  return parameters.OutputPrefix + "templateState.txt";
+}
+
+// The prefix of the transforms of subject n, i.e. the output prefix, the name
+// of its first image without directory and extension and its number.
+static std::string GetSubjectPrefix( const TemplateBuilderParameters & parameters, unsigned int n )
+{
+  std::string baseName = parameters.Subjects[n][0];
+  const std::string::size_type slash = baseName.find_last_of( "/\\" );
+  if( slash != std::string::npos )
+    {
+    baseName = baseName.substr( slash + 1 );
+    }
+  const std::string::size_type dot = baseName.find( '.' );
+  if( dot != std::string::npos && dot > 0 )
+    {
+    baseName = baseName.substr( 0, dot );
+    }
+
+  std::stringstream prefix;
+  prefix << parameters.OutputPrefix << baseName << n;
+  return prefix.str();
+}
+
+static bool IsDeformableTransformationModel( const std::string & model )
+{
+  return model == "SyN" || model == "BSplineSyN";
+}
+
+// The name by which ReadImage takes an image in memory instead of a file,
+// i.e. the address of its smart pointer.
+template <class TImage>
+static std::string GetImagePointerName( typename TImage::Pointer * image )
+{
+  std::stringstream name;
+  name << static_cast<void *>( image );
+  return name.str();
+}
+
+// The metric of modality k between the template and the subject.
+static std::string GetMetricArgument( const std::string & metric, const std::string & fixed, const std::string & moving,
+                                      double weight )
+{
+  std::stringstream argument;
+  if( metric == "MI" )
+    {
+    argument << "MI[" << fixed << "," << moving << "," << weight << ",32,Regular,0.25]";
+    }
+  else if( metric == "MSQ" )
+    {
+    argument << "MeanSquares[" << fixed << "," << moving << "," << weight << ",0]";
+    }
+  else if( metric == "DEMONS" )
+    {
+    argument << "Demons[" << fixed << "," << moving << "," << weight << ",0]";
+    }
+  else
+    {
+    argument << "CC[" << fixed << "," << moving << "," << weight << ",4]";
+    }
+  return argument.str();
+}
+
+template <unsigned int ImageDimension>
+struct TemplateBuilderThreadStruct
+  {
+  typedef itk::Image<float, ImageDimension>                       ImageType;
+  typedef itk::Vector<float, ImageDimension>                      VectorType;
+  typedef itk::Image<VectorType, ImageDimension>                  DisplacementFieldType;
+  typedef itk::Image<double, ImageDimension>                      SumImageType;
+  typedef itk::Matrix<double, ImageDimension, ImageDimension>     MatrixType;
+  typedef itk::Vector<double, ImageDimension>                     OffsetType;
+  typedef itk::Image<itk::Vector<double, ImageDimension>, ImageDimension> WarpSumType;
+
+  const TemplateBuilderParameters *         Parameters;
+  std::vector<typename ImageType::Pointer>  Templates;
+  unsigned int                              Iteration;
+  bool                                      LastIteration;
+
+  // the running sums of the subjects registered in the current iteration
+  std::vector<typename SumImageType::Pointer> ImageSums;
+  typename WarpSumType::Pointer               WarpSum;
+  MatrixType                                  MatrixSum;
+  OffsetType                                  OffsetSum;
+  unsigned int                                NumberOfRegisteredSubjects;
+  unsigned int                                NumberOfFailedSubjects;
+
+  unsigned int             NextSubject;
+  itk::SimpleFastMutexLock Mutex;
+  };
+
+// Divide the image by its mean, as AverageImages does before averaging.
+template <class TImage>
+static void NormalizeImageByMean( TImage *image )
+{
+  double                                 sum = 0.0;
+  unsigned long                          count = 0;
+  itk::ImageRegionIterator<TImage> It( image, image->GetBufferedRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    sum += It.Get();
+    count++;
+    }
+  const double mean = ( count > 0 ) ? sum / count : 0.0;
+  if( mean == 0.0 )
+    {
+    return;
+    }
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    It.Set( static_cast<typename TImage::PixelType>( It.Get() / mean ) );
+    }
+}
+
+template <class TSumImage, class TImage>
+static typename TSumImage::Pointer AllocateSumImage( const TImage *reference )
+{
+  typename TSumImage::Pointer sum = TSumImage::New();
+  sum->CopyInformation( reference );
+  sum->SetRegions( reference->GetLargestPossibleRegion() );
+  sum->Allocate();
+  sum->FillBuffer( itk::NumericTraits<typename TSumImage::PixelType>::ZeroValue() );
+  return sum;
+}
+
+template <class TSumImage, class TImage>
+static void AddToSumImage( TSumImage *sum, const TImage *image )
+{
+  itk::ImageRegionIterator<TSumImage>   ItS( sum, sum->GetBufferedRegion() );
+  itk::ImageRegionConstIterator<TImage> ItI( image, sum->GetBufferedRegion() );
+  for( ItS.GoToBegin(), ItI.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItI )
+    {
+    ItS.Set( ItS.Get() + ItI.Get() );
+    }
+}
+
+template <class TWarpSum, class TDisplacementField>
+static void AddToWarpSum( TWarpSum *sum, const TDisplacementField *field )
+{
+  itk::ImageRegionIterator<TWarpSum>                ItS( sum, sum->GetBufferedRegion() );
+  itk::ImageRegionConstIterator<TDisplacementField> ItF( field, sum->GetBufferedRegion() );
+  for( ItS.GoToBegin(), ItF.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItF )
+    {
+    typename TWarpSum::PixelType vector = ItS.Get();
+    for( unsigned int d = 0; d < TWarpSum::PixelType::Dimension; d++ )
+      {
+      vector[d] += ItF.Get()[d];
+      }
+    ItS.Set( vector );
+    }
+}
+
+// The image of the subject resampled into the template domain through the
+// transform taking the template points to the subject points.
+template <class TImage, class TTransform>
+static typename TImage::Pointer ResampleToTemplate( const TImage *image, const TImage *templateImage,
+                                                    const TTransform *transform )
+{
+  typedef itk::ResampleImageFilter<TImage, TImage, double, typename TTransform::ScalarType> ResamplerType;
+  typename ResamplerType::Pointer resampler = ResamplerType::New();
+  resampler->SetInput( image );
+  resampler->SetTransform( transform );
+  resampler->SetOutputParametersFromImage( templateImage );
+  resampler->SetDefaultPixelValue( 0 );
+  resampler->SetNumberOfThreads( 1 );
+  resampler->Update();
+
+  typename TImage::Pointer output = resampler->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+// The antsRegistration arguments of subject n.  The templates are passed in
+// memory, by the addresses of the smart pointers in templatePointers.
+template <unsigned int ImageDimension>
+static std::vector<std::string> GetRegistrationArguments(
+  const TemplateBuilderParameters & parameters,
+  std::vector<typename TemplateBuilderThreadStruct<ImageDimension>::ImageType::Pointer> & templatePointers,
+  unsigned int n )
+{
+  typedef typename TemplateBuilderThreadStruct<ImageDimension>::ImageType ImageType;
+
+  const std::vector<std::string> & subject = parameters.Subjects[n];
+
+  std::vector<std::string> fixedNames;
+  for( unsigned int k = 0; k < templatePointers.size(); k++ )
+    {
+    fixedNames.push_back( GetImagePointerName<ImageType>( &templatePointers[k] ) );
+    }
+
+  std::stringstream dimension;
+  dimension << ImageDimension;
+
+  std::vector<std::string> args;
+  args.push_back( "--dimensionality" );
+  args.push_back( dimension.str() );
+  args.push_back( "--float" );
+  args.push_back( "1" );
+  args.push_back( "--collapse-output-transforms" );
+  args.push_back( "1" );
+  args.push_back( "--output" );
+  args.push_back( GetSubjectPrefix( parameters, n ) );
+  args.push_back( "--initial-moving-transform" );
+  args.push_back( "[" + fixedNames[0] + "," + subject[0] + ",1]" );
+
+  // the linear stages, as antsMultivariateTemplateConstruction2.sh does
+  const char *linearTransforms[2] = { "Rigid[0.1]", "Affine[0.1]" };
+  const unsigned int numberOfLinearStages = ( parameters.TransformationModel == "Rigid" ) ? 1 : 2;
+  for( unsigned int s = 0; s < numberOfLinearStages; s++ )
+    {
+    args.push_back( "--transform" );
+    args.push_back( linearTransforms[s] );
+    for( unsigned int k = 0; k < subject.size(); k++ )
+      {
+      args.push_back( "--metric" );
+      args.push_back( GetMetricArgument( "MI", fixedNames[k], subject[k], parameters.Weights[k] ) );
+      }
+    args.push_back( "--convergence" );
+    args.push_back( "[1000x500x250x0,1e-6,10]" );
+    args.push_back( "--shrink-factors" );
+    args.push_back( "6x4x2x1" );
+    args.push_back( "--smoothing-sigmas" );
+    args.push_back( "4x2x1x0vox" );
+    }
+
+  if( IsDeformableTransformationModel( parameters.TransformationModel ) )
+    {
+    std::stringstream transform;
+    if( parameters.TransformationModel == "BSplineSyN" )
+      {
+      transform << "BSplineSyN[" << parameters.TransformStep << ",26,0,3]";
+      }
+    else
+      {
+      transform << "SyN[" << parameters.TransformStep << ",3,0]";
+      }
+    args.push_back( "--transform" );
+    args.push_back( transform.str() );
+    for( unsigned int k = 0; k < subject.size(); k++ )
+      {
+      args.push_back( "--metric" );
+      args.push_back( GetMetricArgument( parameters.SimilarityMetric, fixedNames[k], subject[k],
+                                         parameters.Weights[k] ) );
+      }
+    args.push_back( "--convergence" );
+    args.push_back( "[" + parameters.MaximumIterations + ",1e-9,10]" );
+    args.push_back( "--shrink-factors" );
+    args.push_back( parameters.ShrinkFactors );
+    args.push_back( "--smoothing-sigmas" );
+    args.push_back( parameters.SmoothingSigmas );
+    }
+
+  args.push_back( "--verbose" );
+  args.push_back( "0" );
+
+  return args;
+}
+
+// Register subject n to the current templates and add its warped images,
+// affine transform and warp to the sums of the iteration.
+template <unsigned int ImageDimension>
+static bool RegisterSubject( TemplateBuilderThreadStruct<ImageDimension> *str, unsigned int n )
+{
+  typedef TemplateBuilderThreadStruct<ImageDimension>               StructType;
+  typedef typename StructType::ImageType                            ImageType;
+  typedef typename StructType::DisplacementFieldType                DisplacementFieldType;
+  typedef itk::CompositeTransform<float, ImageDimension>            CompositeTransformType;
+  typedef itk::DisplacementFieldTransform<float, ImageDimension>    DisplacementFieldTransformType;
+  typedef itk::MatrixOffsetTransformBase<float, ImageDimension, ImageDimension> MatrixOffsetTransformType;
+  typedef itk::Transform<float, ImageDimension, ImageDimension>     TransformType;
+
+  const TemplateBuilderParameters & parameters = *str->Parameters;
+  const std::vector<std::string> &  subject = parameters.Subjects[n];
+
+  // Each job reads the templates through images of its own which share their
+  // buffers, so that the concurrent pipelines do not touch the same objects.
+  std::vector<typename ImageType::Pointer> templatePointers;
+  for( unsigned int k = 0; k < str->Templates.size(); k++ )
+    {
+    typename ImageType::Pointer templateImage = ImageType::New();
+    templateImage->CopyInformation( str->Templates[k] );
+    templateImage->SetRegions( str->Templates[k]->GetLargestPossibleRegion() );
+    templateImage->SetPixelContainer( str->Templates[k]->GetPixelContainer() );
+    templatePointers.push_back( templateImage );
+    }
+
+  const std::string subjectPrefix = GetSubjectPrefix( parameters, n );
+  const std::vector<std::string> args = GetRegistrationArguments<ImageDimension>( parameters, templatePointers, n );
+
+  int exitCode = EXIT_FAILURE;
+  try
+    {
+    exitCode = antsRegistration( args, &std::cout );
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "Exception caught in the registration of " << subject[0] << ": " << err << std::endl;
+    }
+  if( exitCode != EXIT_SUCCESS )
+    {
+    std::cerr << "The registration of " << subject[0] << " failed." << std::endl;
+    return false;
+    }
+
+  // The transform taking the template points to the subject points, in the
+  // order of the output of antsRegistration.
+  typename CompositeTransformType::Pointer composite = CompositeTransformType::New();
+
+  typename TransformType::Pointer affine =
+    itk::ants::ReadTransform<float, ImageDimension>( subjectPrefix + "0GenericAffine.mat" );
+  const MatrixOffsetTransformType *matrixOffset = dynamic_cast<const MatrixOffsetTransformType *>( affine.GetPointer() );
+  if( matrixOffset == ITK_NULLPTR )
+    {
+    std::cerr << "Could not read the affine transform of " << subject[0] << std::endl;
+    return false;
+    }
+  composite->AddTransform( affine );
+
+  typename DisplacementFieldType::Pointer warp = ITK_NULLPTR;
+  if( IsDeformableTransformationModel( parameters.TransformationModel ) )
+    {
+    if( !ReadImage<DisplacementFieldType>( warp, ( subjectPrefix + "1Warp.nii.gz" ).c_str() ) || warp.IsNull() )
+      {
+      std::cerr << "Could not read the warp of " << subject[0] << std::endl;
+      return false;
+      }
+    typename DisplacementFieldTransformType::Pointer warpTransform = DisplacementFieldTransformType::New();
+    warpTransform->SetDisplacementField( warp );
+    composite->AddTransform( warpTransform );
+    }
+
+  std::vector<typename ImageType::Pointer> warpedImages;
+  for( unsigned int k = 0; k < subject.size(); k++ )
+    {
+    typename ImageType::Pointer subjectImage;
+    if( !ReadImage<ImageType>( subjectImage, subject[k].c_str() ) || subjectImage.IsNull() )
+      {
+      return false;
+      }
+    typename ImageType::Pointer warpedImage = ResampleToTemplate<ImageType, CompositeTransformType>(
+        subjectImage, str->Templates[k], composite );
+    if( str->LastIteration && parameters.WriteWarpedImages )
+      {
+      std::stringstream warpedFileName;
+      warpedFileName << subjectPrefix << "WarpedToTemplate" << k << ".nii.gz";
+      WriteImage<ImageType>( warpedImage, warpedFileName.str().c_str() );
+      }
+    if( parameters.Normalize )
+      {
+      NormalizeImageByMean<ImageType>( warpedImage );
+      }
+    warpedImages.push_back( warpedImage );
+    }
+
+  // Stream the subject into the averages of the iteration.
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->Mutex );
+  for( unsigned int k = 0; k < warpedImages.size(); k++ )
+    {
+    AddToSumImage<typename StructType::SumImageType, ImageType>( str->ImageSums[k], warpedImages[k] );
+    }
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      str->MatrixSum[i][j] += matrixOffset->GetMatrix()[i][j];
+      }
+    str->OffsetSum[i] += matrixOffset->GetOffset()[i];
+    }
+  if( warp.IsNotNull() )
+    {
+    AddToWarpSum<typename StructType::WarpSumType, DisplacementFieldType>( str->WarpSum, warp );
+    }
+  str->NumberOfRegisteredSubjects++;
+
+  std::cout << "  registered " << subject[0] << " (" << str->NumberOfRegisteredSubjects << " of "
+            << parameters.Subjects.size() << ")" << std::endl;
+  return true;
+}
+
+// Every thread registers the next subject until all are done, so there are
+// as many registrations running at once as there are threads.
+template <unsigned int ImageDimension>
+static ITK_THREAD_RETURN_TYPE TemplateBuilderThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *threadInfo = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  TemplateBuilderThreadStruct<ImageDimension> *str =
+    static_cast<TemplateBuilderThreadStruct<ImageDimension> *>( threadInfo->UserData );
+
+  while( true )
+    {
+    unsigned int n;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->Mutex );
+      if( str->NextSubject >= str->Parameters->Subjects.size() )
+        {
+        break;
+        }
+      n = str->NextSubject++;
+      }
+    if( !RegisterSubject<ImageDimension>( str, n ) )
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->Mutex );
+      str->NumberOfFailedSubjects++;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+// The new templates: the average of the warped subjects moved along the
+// inverse of the average transform, as in antsMultivariateTemplateConstruction2.sh.
+template <unsigned int ImageDimension>
+static void UpdateTemplates( TemplateBuilderThreadStruct<ImageDimension> *str )
+{
+  typedef TemplateBuilderThreadStruct<ImageDimension>            StructType;
+  typedef typename StructType::ImageType                         ImageType;
+  typedef typename StructType::DisplacementFieldType             DisplacementFieldType;
+  typedef itk::AffineTransform<float, ImageDimension>            AffineTransformType;
+  typedef itk::CompositeTransform<float, ImageDimension>         CompositeTransformType;
+  typedef itk::DisplacementFieldTransform<float, ImageDimension> DisplacementFieldTransformType;
+  typedef itk::VectorLinearInterpolateImageFunction<typename StructType::WarpSumType, double> WarpInterpolatorType;
+
+  const TemplateBuilderParameters & parameters = *str->Parameters;
+  const double                      numberOfSubjects = str->NumberOfRegisteredSubjects;
+
+  // the average affine transform and its inverse
+  typename AffineTransformType::MatrixType averageMatrix;
+  typename AffineTransformType::OutputVectorType averageOffset;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      averageMatrix[i][j] = str->MatrixSum[i][j] / numberOfSubjects;
+      }
+    averageOffset[i] = str->OffsetSum[i] / numberOfSubjects;
+    }
+  typename AffineTransformType::Pointer averageAffine = AffineTransformType::New();
+  averageAffine->SetMatrix( averageMatrix );
+  averageAffine->SetOffset( averageOffset );
+  typename AffineTransformType::Pointer inverseAverageAffine = AffineTransformType::New();
+  averageAffine->GetInverse( inverseAverageAffine );
+
+  typename CompositeTransformType::Pointer update = CompositeTransformType::New();
+  update->AddTransform( inverseAverageAffine );
+
+  if( str->WarpSum.IsNotNull() )
+    {
+    // -gradientStep times the average warp, moved through the inverse average affine
+    typename WarpInterpolatorType::Pointer interpolator = WarpInterpolatorType::New();
+    interpolator->SetInputImage( str->WarpSum );
+
+    typename DisplacementFieldType::Pointer updateField =
+      AllocateSumImage<DisplacementFieldType, typename StructType::WarpSumType>( str->WarpSum );
+    const double scale = -parameters.GradientStep / numberOfSubjects;
+
+    itk::ImageRegionIteratorWithIndex<DisplacementFieldType> It( updateField, updateField->GetBufferedRegion() );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      typename DisplacementFieldType::PointType point;
+      updateField->TransformIndexToPhysicalPoint( It.GetIndex(), point );
+      typename AffineTransformType::InputPointType affinePoint;
+      affinePoint.CastFrom( point );
+      const typename AffineTransformType::OutputPointType warpPoint = inverseAverageAffine->TransformPoint( affinePoint );
+      typename WarpInterpolatorType::PointType interpolatorPoint;
+      interpolatorPoint.CastFrom( warpPoint );
+      if( interpolator->IsInsideBuffer( interpolatorPoint ) )
+        {
+        const typename WarpInterpolatorType::OutputType displacement = interpolator->Evaluate( interpolatorPoint );
+        typename DisplacementFieldType::PixelType vector;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          vector[d] = static_cast<float>( scale * displacement[d] );
+          }
+        It.Set( vector );
+        }
+      }
+
+    typename DisplacementFieldTransformType::Pointer updateTransform = DisplacementFieldTransformType::New();
+    updateTransform->SetDisplacementField( updateField );
+    for( unsigned int i = 0; i < 4; i++ )
+      {
+      update->AddTransform( updateTransform );
+      }
+    }
+
+  for( unsigned int k = 0; k < str->Templates.size(); k++ )
+    {
+    typename ImageType::Pointer averageImage =
+      AllocateSumImage<ImageType, typename StructType::SumImageType>( str->ImageSums[k] );
+    itk::ImageRegionIterator<ImageType>                                 ItA( averageImage,
+                                                                             averageImage->GetBufferedRegion() );
+    itk::ImageRegionConstIterator<typename StructType::SumImageType> ItS( str->ImageSums[k],
+                                                                          averageImage->GetBufferedRegion() );
+    for( ItA.GoToBegin(), ItS.GoToBegin(); !ItA.IsAtEnd(); ++ItA, ++ItS )
+      {
+      ItA.Set( static_cast<float>( ItS.Get() / numberOfSubjects ) );
+      }
+
+    typedef itk::ResampleImageFilter<ImageType, ImageType, double, float> ResamplerType;
+    typename ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInput( averageImage );
+    resampler->SetTransform( update );
+    resampler->SetOutputParametersFromImage( averageImage );
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->Update();
+
+    str->Templates[k] = resampler->GetOutput();
+    str->Templates[k]->DisconnectPipeline();
+    }
+}
+
+// The average of the subjects, with the identity, in the domain of the first
+// one, when no initial template is given.
+template <unsigned int ImageDimension>
+static bool InitializeTemplates(
+  const TemplateBuilderParameters & parameters,
+  std::vector<typename TemplateBuilderThreadStruct<ImageDimension>::ImageType::Pointer> & templates )
+{
+  typedef typename TemplateBuilderThreadStruct<ImageDimension>::ImageType    ImageType;
+  typedef typename TemplateBuilderThreadStruct<ImageDimension>::SumImageType SumImageType;
+  typedef itk::CompositeTransform<float, ImageDimension>                     CompositeTransformType;
+
+  const unsigned int numberOfModalities = parameters.Subjects[0].size();
+  templates.clear();
+
+  if( !parameters.InitialTemplates.empty() )
+    {
+    for( unsigned int k = 0; k < numberOfModalities; k++ )
+      {
+      typename ImageType::Pointer templateImage;
+      if( !ReadImage<ImageType>( templateImage, parameters.InitialTemplates[k].c_str() ) || templateImage.IsNull() )
+        {
+        return false;
+        }
+      templateImage->DisconnectPipeline();
+      templates.push_back( templateImage );
+      }
+    return true;
+    }
+
+  typename CompositeTransformType::Pointer identity = CompositeTransformType::New();
+  for( unsigned int k = 0; k < numberOfModalities; k++ )
+    {
+    typename ImageType::Pointer reference;
+    if( !ReadImage<ImageType>( reference, parameters.Subjects[0][k].c_str() ) || reference.IsNull() )
+      {
+      return false;
+      }
+    typename SumImageType::Pointer sum = AllocateSumImage<SumImageType, ImageType>( reference );
+    for( unsigned int n = 0; n < parameters.Subjects.size(); n++ )
+      {
+      typename ImageType::Pointer subjectImage;
+      if( !ReadImage<ImageType>( subjectImage, parameters.Subjects[n][k].c_str() ) || subjectImage.IsNull() )
+        {
+        return false;
+        }
+      typename ImageType::Pointer resampled =
+        ResampleToTemplate<ImageType, CompositeTransformType>( subjectImage, reference, identity );
+      if( parameters.Normalize )
+        {
+        NormalizeImageByMean<ImageType>( resampled );
+        }
+      AddToSumImage<SumImageType, ImageType>( sum, resampled );
+      }
+
+    typename ImageType::Pointer templateImage = AllocateSumImage<ImageType, ImageType>( reference );
+    itk::ImageRegionIterator<ImageType>          ItT( templateImage, templateImage->GetBufferedRegion() );
+    itk::ImageRegionConstIterator<SumImageType>  ItS( sum, templateImage->GetBufferedRegion() );
+    for( ItT.GoToBegin(), ItS.GoToBegin(); !ItT.IsAtEnd(); ++ItT, ++ItS )
+      {
+      ItT.Set( static_cast<float>( ItS.Get() / parameters.Subjects.size() ) );
+      }
+    templates.push_back( templateImage );
+    }
+  return true;
+}
+
+template <unsigned int ImageDimension>
+static int BuildTemplate( const TemplateBuilderParameters & parameters )
+{
+  typedef TemplateBuilderThreadStruct<ImageDimension> StructType;
+  typedef typename StructType::ImageType              ImageType;
+
+  const unsigned int numberOfModalities = parameters.Subjects[0].size();
+
+  StructType str;
+  str.Parameters = &parameters;
+  str.Iteration = 0;
+
+  // Resume after the last completed iteration.
+  if( parameters.Resume )
+    {
+    std::ifstream stateFile( GetTemplateStateFileName( parameters ).c_str() );
+    std::string   keyword;
+    unsigned int  completedIterations = 0;
+    if( stateFile && ( stateFile >> keyword >> completedIterations ) && keyword == "iteration" )
+      {
+      bool haveTemplates = true;
+      for( unsigned int k = 0; k < numberOfModalities && haveTemplates; k++ )
+        {
+        typename ImageType::Pointer templateImage;
+        haveTemplates = ReadImage<ImageType>( templateImage, GetTemplateFileName( parameters, k ).c_str() ) &&
+          templateImage.IsNotNull();
+        if( haveTemplates )
+          {
+          templateImage->DisconnectPipeline();
+          str.Templates.push_back( templateImage );
+          }
+        }
+      if( haveTemplates )
+        {
+        str.Iteration = completedIterations;
+        std::cout << "Resuming after iteration " << completedIterations << std::endl;
+        }
+      else
+        {
+        str.Templates.clear();
+        }
+      }
+    }
+
+  if( str.Templates.empty() )
+    {
+    if( !InitializeTemplates<ImageDimension>( parameters, str.Templates ) )
+      {
+      std::cerr << "Could not initialize the templates." << std::endl;
+      return EXIT_FAILURE;
+      }
+    for( unsigned int k = 0; k < numberOfModalities; k++ )
+      {
+      WriteImage<ImageType>( str.Templates[k], GetTemplateFileName( parameters, k ).c_str() );
+      }
+    }
+
+  for( ; str.Iteration < parameters.NumberOfIterations; str.Iteration++ )
+    {
+    std::cout << "Iteration " << str.Iteration + 1 << " of " << parameters.NumberOfIterations << std::endl;
+
+    str.LastIteration = ( str.Iteration + 1 == parameters.NumberOfIterations );
+    str.NextSubject = 0;
+    str.NumberOfRegisteredSubjects = 0;
+    str.NumberOfFailedSubjects = 0;
+    str.MatrixSum.Fill( 0.0 );
+    str.OffsetSum.Fill( 0.0 );
+    str.ImageSums.clear();
+    for( unsigned int k = 0; k < numberOfModalities; k++ )
+      {
+      str.ImageSums.push_back(
+        AllocateSumImage<typename StructType::SumImageType, ImageType>( str.Templates[k] ) );
+      }
+    str.WarpSum = ITK_NULLPTR;
+    if( IsDeformableTransformationModel( parameters.TransformationModel ) )
+      {
+      str.WarpSum = AllocateSumImage<typename StructType::WarpSumType, ImageType>( str.Templates[0] );
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( parameters.NumberOfJobs );
+    threader->SetSingleMethod( TemplateBuilderThreaderCallback<ImageDimension>, &str );
+    threader->SingleMethodExecute();
+
+    if( str.NumberOfRegisteredSubjects == 0 )
+      {
+      std::cerr << "No subject could be registered to the template." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( str.NumberOfFailedSubjects > 0 )
+      {
+      std::cerr << "Warning: " << str.NumberOfFailedSubjects << " subjects were left out of iteration "
+                << str.Iteration + 1 << std::endl;
+      }
+
+    UpdateTemplates<ImageDimension>( &str );
+
+    for( unsigned int k = 0; k < numberOfModalities; k++ )
+      {
+      WriteImage<ImageType>( str.Templates[k], GetTemplateFileName( parameters, k ).c_str() );
+      }
+    std::ofstream stateFile( GetTemplateStateFileName( parameters ).c_str() );
+    stateFile << "iteration " << str.Iteration + 1 << std::endl;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+static void antsBuildTemplateInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  {
+  std::string description = std::string( "The dimensionality of the images." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "dimensionality" );
+  option->SetShortName( 'd' );
+  option->SetUsageOption( 0, "2/(3)" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The images of a subject, one per modality.  The option is given " )
+    + std::string( "once per subject, with the modalities in the same order." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "input" );
+  option->SetShortName( 'i' );
+  option->SetUsageOption( 0, "subjectImage" );
+  option->SetUsageOption( 1, "[subjectModality0,subjectModality1,...]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The initial templates, one per modality.  By default they are the " )
+    + std::string( "average of the subjects in the domain of the first one." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "initial-template" );
+  option->SetShortName( 'z' );
+  option->SetUsageOption( 0, "[template0,template1,...]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The prefix of the outputs: the templates 'prefix'template<k>.nii.gz, " )
+    + std::string( "the transforms of each subject and the state of the construction, which is resumed " )
+    + std::string( "from after a restart." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "output" );
+  option->SetShortName( 'o' );
+  option->SetUsageOption( 0, "antsBT" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The number of iterations of the template construction." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "iterations" );
+  option->SetShortName( 'n' );
+  option->SetUsageOption( 0, "4" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The number of registrations run at the same time.  The threads of " )
+    + std::string( "the process (ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS, or the number of cores) are shared " )
+    + std::string( "between them." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "jobs" );
+  option->SetShortName( 'j' );
+  option->SetUsageOption( 0, "1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The transformation model: Rigid, Affine, or a Rigid and an Affine " )
+    + std::string( "stage followed by SyN or BSplineSyN." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "transformation-model" );
+  option->SetShortName( 't' );
+  option->SetUsageOption( 0, "Rigid/Affine/(SyN)/BSplineSyN" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The similarity metric of the deformable stage; the linear stages " )
+    + std::string( "use MI." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "similarity-metric" );
+  option->SetShortName( 'm' );
+  option->SetUsageOption( 0, "(CC)/MI/MSQ/DEMONS" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The weights of the metrics of the modalities." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "modality-weights" );
+  option->SetShortName( 'w' );
+  option->SetUsageOption( 0, "1x1x..." );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The iterations of each level of the deformable stage." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "max-iterations" );
+  option->SetShortName( 'q' );
+  option->SetUsageOption( 0, "100x100x70x20" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The shrink factors of the levels of the deformable stage." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "shrink-factors" );
+  option->SetShortName( 'f' );
+  option->SetUsageOption( 0, "6x4x2x1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The smoothing sigmas of the levels of the deformable stage." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "smoothing-factors" );
+  option->SetShortName( 's' );
+  option->SetUsageOption( 0, "3x2x1x0vox" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The gradient step of the deformable transform." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "transform-step" );
+  option->SetUsageOption( 0, "0.1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The step of the shape update of the template." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "gradient-step" );
+  option->SetShortName( 'g' );
+  option->SetUsageOption( 0, "0.25" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Divide the warped subjects by their mean before averaging them." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "normalize" );
+  option->SetUsageOption( 0, "0/(1)" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Resume from the last completed iteration of a previous run with " )
+    + std::string( "the same output prefix." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "resume" );
+  option->SetShortName( 'r' );
+  option->SetUsageOption( 0, "0/(1)" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Write the subjects warped to the template in the last iteration." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "write-warped" );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The memory, in megabytes, of the cache keeping the subject images " )
+    + std::string( "between the iterations." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "cache-memory" );
+  option->SetUsageOption( 0, "4096" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu (short version)." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetShortName( 'h' );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "help" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+}
+
+// The file names of an option given as 'name' or '[name0,name1,...]'.
+static std::vector<std::string> GetOptionFileNames( itk::ants::CommandLineParser::OptionType::OptionFunctionType *function )
+{
+  std::vector<std::string> fileNames;
+  if( function->GetNumberOfParameters() == 0 )
+    {
+    fileNames.push_back( function->GetName() );
+    }
+  for( unsigned int p = 0; p < function->GetNumberOfParameters(); p++ )
+    {
+    fileNames.push_back( function->GetParameter( p ) );
+    }
+  return fileNames;
+}
+
+// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
+// 'main()'
+int antsBuildTemplate( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+{
+  // put the arguments coming in as 'args' into standard (argc,argv) format;
+  // 'args' doesn't have the command name as first, argument, so add it manually;
+  // 'args' may have adjacent arguments concatenated into one argument,
+  // which the parser should handle
+  args.insert( args.begin(), "antsBuildTemplate" );
+  int     argc = args.size();
+  char* * argv = new char *[args.size() + 1];
+  for( unsigned int i = 0; i < args.size(); ++i )
+    {
+    // allocate space for the string plus a null character
+    argv[i] = new char[args[i].length() + 1];
+    std::strncpy( argv[i], args[i].c_str(), args[i].length() );
+    // place the null character in the end
+    argv[i][args[i].length()] = '\0';
+    }
+  argv[argc] = ITK_NULLPTR;
+  // class to automatically cleanup argv upon destruction
+  class Cleanup_argv
+  {
+public:
+    Cleanup_argv( char* * argv_, int argc_plus_one_ ) : argv( argv_ ), argc_plus_one( argc_plus_one_ )
+    {
+    }
+
+    ~Cleanup_argv()
+    {
+      for( unsigned int i = 0; i < argc_plus_one; ++i )
+        {
+        delete[] argv[i];
+        }
+      delete[] argv;
+    }
+
+private:
+    char* *      argv;
+    unsigned int argc_plus_one;
+  };
+  Cleanup_argv cleanup_argv( argv, argc + 1 );
+
+  itk::ants::CommandLineParser::Pointer parser = itk::ants::CommandLineParser::New();
+
+  parser->SetCommand( argv[0] );
+
+  std::string commandDescription = std::string( "Builds an unbiased (multivariate) template of a set of " )
+    + std::string( "subjects, as antsMultivariateTemplateConstruction2.sh does, in one process.  The " )
+    + std::string( "subjects are registered to the current template with the antsRegistration library " )
+    + std::string( "entry point, several at a time, and each one is added to the running average of the " )
+    + std::string( "iteration as soon as it is registered; the templates stay in memory.  The templates " )
+    + std::string( "and the number of completed iterations are written after each iteration, and a run " )
+    + std::string( "with the same output prefix resumes from there." );
+
+  parser->SetCommandDescription( commandDescription );
+  antsBuildTemplateInitializeCommandLineOptions( parser );
+
+  if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( argc == 1 )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_FAILURE;
+    }
+  else if( parser->GetOption( "help" )->GetFunction() && parser->Convert<bool>( parser->GetOption( "help" )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_SUCCESS;
+    }
+  else if( parser->GetOption( 'h' )->GetFunction() && parser->Convert<bool>( parser->GetOption( 'h' )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, true );
+    return EXIT_SUCCESS;
+    }
+
+  TemplateBuilderParameters parameters;
+
+  // the functions of an option are stored last first
+  itk::ants::CommandLineParser::OptionType::Pointer inputOption = parser->GetOption( "input" );
+  for( int n = ( inputOption ? static_cast<int>( inputOption->GetNumberOfFunctions() ) : 0 ) - 1; n >= 0; n-- )
+    {
+    parameters.Subjects.push_back( GetOptionFileNames( inputOption->GetFunction( n ) ) );
+    }
+  if( parameters.Subjects.size() < 2 )
+    {
+    std::cerr << "At least two subjects are needed.  See command line option --input." << std::endl;
+    return EXIT_FAILURE;
+    }
+  const unsigned int numberOfModalities = parameters.Subjects[0].size();
+  for( unsigned int n = 1; n < parameters.Subjects.size(); n++ )
+    {
+    if( parameters.Subjects[n].size() != numberOfModalities )
+      {
+      std::cerr << "All the subjects must have " << numberOfModalities << " modalities." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer initialTemplateOption = parser->GetOption( "initial-template" );
+  if( initialTemplateOption && initialTemplateOption->GetNumberOfFunctions() )
+    {
+    parameters.InitialTemplates = GetOptionFileNames( initialTemplateOption->GetFunction( 0 ) );
+    if( parameters.InitialTemplates.size() != numberOfModalities )
+      {
+      std::cerr << "There must be one initial template per modality." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  parameters.Weights = std::vector<double>( numberOfModalities, 1.0 );
+  itk::ants::CommandLineParser::OptionType::Pointer weightsOption = parser->GetOption( "modality-weights" );
+  if( weightsOption && weightsOption->GetNumberOfFunctions() )
+    {
+    parameters.Weights = parser->ConvertVector<double>( weightsOption->GetFunction( 0 )->GetName() );
+    if( parameters.Weights.size() != numberOfModalities )
+      {
+      std::cerr << "There must be one weight per modality." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  parameters.OutputPrefix = "antsBT";
+  itk::ants::CommandLineParser::OptionType::Pointer outputOption = parser->GetOption( "output" );
+  if( outputOption && outputOption->GetNumberOfFunctions() )
+    {
+    parameters.OutputPrefix = outputOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.TransformationModel = "SyN";
+  itk::ants::CommandLineParser::OptionType::Pointer modelOption = parser->GetOption( "transformation-model" );
+  if( modelOption && modelOption->GetNumberOfFunctions() )
+    {
+    parameters.TransformationModel = modelOption->GetFunction( 0 )->GetName();
+    }
+  if( parameters.TransformationModel != "Rigid" && parameters.TransformationModel != "Affine" &&
+      !IsDeformableTransformationModel( parameters.TransformationModel ) )
+    {
+    std::cerr << "Unknown transformation model " << parameters.TransformationModel << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  parameters.SimilarityMetric = "CC";
+  itk::ants::CommandLineParser::OptionType::Pointer metricOption = parser->GetOption( "similarity-metric" );
+  if( metricOption && metricOption->GetNumberOfFunctions() )
+    {
+    parameters.SimilarityMetric = metricOption->GetFunction( 0 )->GetName();
+    std::transform( parameters.SimilarityMetric.begin(), parameters.SimilarityMetric.end(),
+                    parameters.SimilarityMetric.begin(), ::toupper );
+    }
+
+  parameters.MaximumIterations = "100x100x70x20";
+  itk::ants::CommandLineParser::OptionType::Pointer iterationsOption = parser->GetOption( "max-iterations" );
+  if( iterationsOption && iterationsOption->GetNumberOfFunctions() )
+    {
+    parameters.MaximumIterations = iterationsOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.ShrinkFactors = "6x4x2x1";
+  itk::ants::CommandLineParser::OptionType::Pointer shrinkOption = parser->GetOption( "shrink-factors" );
+  if( shrinkOption && shrinkOption->GetNumberOfFunctions() )
+    {
+    parameters.ShrinkFactors = shrinkOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.SmoothingSigmas = "3x2x1x0vox";
+  itk::ants::CommandLineParser::OptionType::Pointer smoothingOption = parser->GetOption( "smoothing-factors" );
+  if( smoothingOption && smoothingOption->GetNumberOfFunctions() )
+    {
+    parameters.SmoothingSigmas = smoothingOption->GetFunction( 0 )->GetName();
+    }
+
+  parameters.TransformStep = 0.1;
+  itk::ants::CommandLineParser::OptionType::Pointer transformStepOption = parser->GetOption( "transform-step" );
+  if( transformStepOption && transformStepOption->GetNumberOfFunctions() )
+    {
+    parameters.TransformStep = parser->Convert<double>( transformStepOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.GradientStep = 0.25;
+  itk::ants::CommandLineParser::OptionType::Pointer gradientStepOption = parser->GetOption( "gradient-step" );
+  if( gradientStepOption && gradientStepOption->GetNumberOfFunctions() )
+    {
+    parameters.GradientStep = parser->Convert<double>( gradientStepOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.NumberOfIterations = 4;
+  itk::ants::CommandLineParser::OptionType::Pointer numberOfIterationsOption = parser->GetOption( "iterations" );
+  if( numberOfIterationsOption && numberOfIterationsOption->GetNumberOfFunctions() )
+    {
+    parameters.NumberOfIterations =
+      parser->Convert<unsigned int>( numberOfIterationsOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.NumberOfJobs = 1;
+  itk::ants::CommandLineParser::OptionType::Pointer jobsOption = parser->GetOption( "jobs" );
+  if( jobsOption && jobsOption->GetNumberOfFunctions() )
+    {
+    parameters.NumberOfJobs = std::max( parser->Convert<unsigned int>( jobsOption->GetFunction( 0 )->GetName() ), 1u );
+    }
+  parameters.NumberOfJobs = std::min( parameters.NumberOfJobs, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+
+  parameters.Normalize = true;
+  itk::ants::CommandLineParser::OptionType::Pointer normalizeOption = parser->GetOption( "normalize" );
+  if( normalizeOption && normalizeOption->GetNumberOfFunctions() )
+    {
+    parameters.Normalize = parser->Convert<bool>( normalizeOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.Resume = true;
+  itk::ants::CommandLineParser::OptionType::Pointer resumeOption = parser->GetOption( "resume" );
+  if( resumeOption && resumeOption->GetNumberOfFunctions() )
+    {
+    parameters.Resume = parser->Convert<bool>( resumeOption->GetFunction( 0 )->GetName() );
+    }
+
+  parameters.WriteWarpedImages = false;
+  itk::ants::CommandLineParser::OptionType::Pointer writeWarpedOption = parser->GetOption( "write-warped" );
+  if( writeWarpedOption && writeWarpedOption->GetNumberOfFunctions() )
+    {
+    parameters.WriteWarpedImages = parser->Convert<bool>( writeWarpedOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned long cacheMemory = 4096;
+  itk::ants::CommandLineParser::OptionType::Pointer cacheMemoryOption = parser->GetOption( "cache-memory" );
+  if( cacheMemoryOption && cacheMemoryOption->GetNumberOfFunctions() )
+    {
+    cacheMemory = parser->Convert<unsigned long>( cacheMemoryOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned int dimension = 3;
+  itk::ants::CommandLineParser::OptionType::Pointer dimensionOption = parser->GetOption( "dimensionality" );
+  if( dimensionOption && dimensionOption->GetNumberOfFunctions() )
+    {
+    dimension = parser->Convert<unsigned int>( dimensionOption->GetFunction( 0 )->GetName() );
+    }
+
+  // The registrations share the threads of the process.
+  const itk::ThreadIdType numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(
+    std::max( numberOfThreads / parameters.NumberOfJobs, static_cast<itk::ThreadIdType>( 1 ) ) );
+
+  // Register the transforms once, before the registrations run in parallel.
+  itk::TransformFactoryBase::RegisterDefaultTransforms();
+
+  // The subjects are read once and kept for the following iterations.
+  ObjectCache::SetMaximumMemory( cacheMemory * 1024 * 1024 );
+
+  int exitCode = EXIT_FAILURE;
+  switch( dimension )
+    {
+    case 2:
+      exitCode = BuildTemplate<2>( parameters );
+      break;
+    case 3:
+      exitCode = BuildTemplate<3>( parameters );
+      break;
+    default:
+      std::cerr << "Unsupported dimension " << dimension << std::endl;
+      break;
+    }
+
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( numberOfThreads );
+  return exitCode;
+}
+} // namespace ants
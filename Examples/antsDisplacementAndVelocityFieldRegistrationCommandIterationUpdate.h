@@ -55,6 +55,12 @@ protected:
     this->m_ComputeFullScaleCCInterval = 0;
     this->m_WriteInterationsOutputsInIntervals = 0;
     this->m_CurrentStageNumber = 0;
+    this->m_MinimumRelativeLevelGain = 0.0;
+    this->m_CarryOverUnusedIterations = false;
+    this->m_SkipRemainingLevels = false;
+    this->m_FirstLevelMetricValue = 0.0;
+    this->m_LastLevelMetricValue = 0.0;
+    this->m_LastLevelIteration = 0;
   }
 
 public:
@@ -72,6 +78,14 @@ public:
       {
       const unsigned int currentLevel = filter->GetCurrentLevel();
 
+      if( currentLevel > 0 && currentLevel < this->m_NumberOfIterations.size() )
+        {
+        this->ScheduleLevel( const_cast<TFilter *>( filter ), currentLevel );
+        }
+      this->m_FirstLevelMetricValue = 0.0;
+      this->m_LastLevelMetricValue = 0.0;
+      this->m_LastLevelIteration = 0;
+
       typename TFilter::ShrinkFactorsPerDimensionContainerType shrinkFactors = filter->GetShrinkFactorsPerDimension( currentLevel );
       typename TFilter::SmoothingSigmasArrayType smoothingSigmas = filter->GetSmoothingSigmasPerLevel();
       typename TFilter::TransformParametersAdaptorsContainerType adaptors =
@@ -97,6 +111,10 @@ public:
                      << std::flush << std::endl;
       // this->Logger() << "\n  LEVEL_TIME_INDEX: " << now << " SINCE_LAST: " << (now-this->m_lastTotalTime) <<
       // std::endl;
+      if( this->m_Telemetry )
+        {
+        this->m_Telemetry->BeginLevel( currentLevel );
+        }
       this->m_lastTotalTime = now;
       m_clock.Start();
 
@@ -128,6 +146,13 @@ public:
                          << std::endl;
           }
         }
+      if( lCurrentIteration == 1 )
+        {
+        this->m_FirstLevelMetricValue = filter->GetCurrentMetricValue();
+        }
+      this->m_LastLevelMetricValue = filter->GetCurrentMetricValue();
+      this->m_LastLevelIteration = lCurrentIteration;
+
       m_clock.Stop();
       const itk::RealTimeClock::TimeStampType now = m_clock.GetTotal();
 
@@ -178,6 +203,11 @@ public:
       this->Logger() << std::setprecision( ss );
       this->Logger().unsetf( std::ios::fixed | std::ios::scientific );
 
+      if( this->m_Telemetry )
+        {
+        this->m_Telemetry->RecordIteration( currentLevel, lCurrentIteration, filter->GetCurrentMetricValue(),
+                                            filter->GetCurrentConvergenceValue(), now - this->m_lastTotalTime );
+        }
       this->m_lastTotalTime = now;
       m_clock.Start();
       }
@@ -194,6 +224,18 @@ public:
 
   itkSetMacro( CurrentStageNumber, unsigned int );
 
+  /**
+   * Adaptive level schedule.  Once a level improves the metric by less than
+   * MinimumRelativeLevelGain (relative to its value at the first iteration),
+   * the remaining finer levels get no iterations.  With
+   * CarryOverUnusedIterations, iterations left over by a level that
+   * converged early are added to the next one.  A gain of 0 (the default)
+   * keeps the given schedule.
+   */
+  itkSetMacro( MinimumRelativeLevelGain, double );
+
+  itkSetMacro( CarryOverUnusedIterations, bool );
+
   void SetNumberOfIterations( const std::vector<unsigned int> & iterations )
   {
     this->m_NumberOfIterations = iterations;
@@ -204,6 +246,11 @@ public:
     this->m_LogStream = &logStream;
   }
 
+  void SetTelemetry( RegistrationTelemetry * telemetry )
+  {
+    this->m_Telemetry = telemetry;
+  }
+
   void SetOrigFixedImage(typename FixedImageType::Pointer origFixedImage)
   {
     this->m_origFixedImage = origFixedImage;
@@ -461,20 +508,11 @@ public:
       }
     std::cout << "*"; // The star befor each DIAGNOSTIC shows that its output is writtent out.
 
-    typedef itk::ImageFileWriter<MovingImageType> WarpedImageWriterType;
-    typename WarpedImageWriterType::Pointer writer = WarpedImageWriterType::New();
-    writer->SetFileName( currentFileName.str().c_str() );
-    writer->SetInput( resampler->GetOutput() );
-    try
-      {
-      writer->Update();
-      }
-    catch( itk::ExceptionObject & err )
-      {
-      std::cout << "Can't write warped image " << currentFileName.str().c_str() << std::endl;
-      std::cout << "Exception Object caught: " << std::endl;
-      std::cout << err << std::endl;
-      }
+    // the warped image is written on the background writer while the
+    // optimization goes on
+    typename MovingImageType::Pointer warpedImage = resampler->GetOutput();
+    warpedImage->DisconnectPipeline();
+    BackgroundWriter::Submit( new ImageWriteJob<MovingImageType>( warpedImage, currentFileName.str() ), std::cout );
   }
 
 private:
@@ -483,6 +521,49 @@ private:
     return *m_LogStream;
   }
 
+  /** Set the iterations of currentLevel from what the previous level achieved. */
+  void ScheduleLevel( TFilter *filter, unsigned int currentLevel )
+  {
+    const unsigned int previousLevel = currentLevel - 1;
+
+    if( !this->m_SkipRemainingLevels && this->m_MinimumRelativeLevelGain > 0.0 && this->m_LastLevelIteration > 0 )
+      {
+      double gain = 0.0;
+      if( std::fabs( this->m_FirstLevelMetricValue ) > 0.0 )
+        {
+        gain = ( this->m_FirstLevelMetricValue - this->m_LastLevelMetricValue )
+          / std::fabs( this->m_FirstLevelMetricValue );
+        }
+      if( gain < this->m_MinimumRelativeLevelGain )
+        {
+        this->Logger() << "  Level " << previousLevel + 1 << " improved the metric by " << gain
+                       << " (< " << this->m_MinimumRelativeLevelGain << "), skipping the remaining levels."
+                       << std::endl;
+        this->m_SkipRemainingLevels = true;
+        }
+      }
+
+    if( this->m_SkipRemainingLevels )
+      {
+      this->m_NumberOfIterations[currentLevel] = 0;
+      }
+    else if( this->m_CarryOverUnusedIterations
+             && this->m_LastLevelIteration < this->m_NumberOfIterations[previousLevel] )
+      {
+      this->m_NumberOfIterations[currentLevel] +=
+        this->m_NumberOfIterations[previousLevel] - this->m_LastLevelIteration;
+      }
+    else
+      {
+      return;
+      }
+
+    // the filter reads the iterations of the current level at every iteration
+    typename TFilter::NumberOfIterationsArrayType iterations = filter->GetNumberOfIterationsPerLevel();
+    iterations[currentLevel] = this->m_NumberOfIterations[currentLevel];
+    filter->SetNumberOfIterationsPerLevel( iterations );
+  }
+
   /**
    *  WeakPointer to the Optimizer
    */
@@ -490,6 +571,7 @@ private:
 
   std::vector<unsigned int>         m_NumberOfIterations;
   std::ostream *                    m_LogStream;
+  RegistrationTelemetry::Pointer    m_Telemetry;
   itk::TimeProbe                    m_clock;
   itk::RealTimeClock::TimeStampType m_lastTotalTime;
 
@@ -497,6 +579,13 @@ private:
   unsigned int m_WriteInterationsOutputsInIntervals;
   unsigned int m_CurrentStageNumber;
 
+  double       m_MinimumRelativeLevelGain;
+  bool         m_CarryOverUnusedIterations;
+  bool         m_SkipRemainingLevels;
+  double       m_FirstLevelMetricValue;
+  double       m_LastLevelMetricValue;
+  unsigned int m_LastLevelIteration;
+
   typename FixedImageType::Pointer  m_origFixedImage;
   typename MovingImageType::Pointer m_origMovingImage;
 };
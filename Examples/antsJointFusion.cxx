@@ -2,14 +2,20 @@
 #include "antsUtilities.h"
 #include "antsAllocImage.h"
 #include "ReadWriteData.h"
+#include "antsPrefetchImageReader.h"
 
+#include "itkImageFileReader.h"
+#include "itkImageIOFactory.h"
+#include "itkImageRegionSplitterSlowDimension.h"
 #include "itkNumericSeriesFileNames.h"
+#include "itkStreamingImageFilter.h"
 #include "itkTimeProbe.h"
 #include "itkWeightedVotingFusionImageFilter.h"
 
 #include "stdio.h"
 
 #include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -83,6 +89,101 @@ public:
     }
 };
 
+/** The buffer of image, whose buffered region is a shard of the target
+ * domain, as an image of its own:  indexed from 0, with the origin at the
+ * first voxel of the shard.  This is what a --shard job writes and what
+ * MergeJointFusionShards() places back on the target grid. */
+template <class TImage>
+typename TImage::Pointer GetShardImage( TImage *image )
+{
+  typename TImage::RegionType region = image->GetBufferedRegion();
+
+  typename TImage::PointType origin;
+  image->TransformIndexToPhysicalPoint( region.GetIndex(), origin );
+
+  typename TImage::IndexType zeroIndex;
+  zeroIndex.Fill( 0 );
+  region.SetIndex( zeroIndex );
+
+  typename TImage::Pointer shardImage = TImage::New();
+  shardImage->CopyInformation( image );
+  shardImage->SetRegions( region );
+  shardImage->SetOrigin( origin );
+  shardImage->SetPixelContainer( image->GetPixelContainer() );
+  return shardImage;
+}
+
+/** Pastes the shard images written by --shard jobs into one image on the
+ * grid of the reference (the header of the target image), each at the voxel
+ * of its origin.  Voxels covered by none of the shards are 0, e.g. those of
+ * the shards which have no posterior image for a label.  Only the merged
+ * image and one shard are held in memory. */
+template <class TImage>
+int MergeJointFusionShards( const itk::ImageBase<TImage::ImageDimension> *reference,
+                            const std::vector<std::string> & shardFileNames, const std::string & outputFileName,
+                            bool verbose )
+{
+  const unsigned int ImageDimension = TImage::ImageDimension;
+
+  typename TImage::Pointer mergedImage = AllocImage<TImage>( reference->GetLargestPossibleRegion(),
+    reference->GetSpacing(), reference->GetOrigin(), reference->GetDirection(),
+    itk::NumericTraits<typename TImage::PixelType>::ZeroValue() );
+
+  for( unsigned int n = 0; n < shardFileNames.size(); n++ )
+    {
+    typename TImage::Pointer shardImage = ITK_NULLPTR;
+    if( !ReadImage<TImage>( shardImage, shardFileNames[n].c_str() ) )
+      {
+      if( verbose )
+        {
+        std::cerr << "Unable to read shard " << shardFileNames[n] << "." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+
+    itk::ContinuousIndex<double, ImageDimension> shardStart;
+    mergedImage->TransformPhysicalPointToContinuousIndex( shardImage->GetOrigin(), shardStart );
+
+    typename TImage::RegionType shardRegion = shardImage->GetLargestPossibleRegion();
+    typename TImage::IndexType  shardIndex;
+    bool                        isOnGrid = true;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      shardIndex[d] = static_cast<itk::IndexValueType>( std::floor( shardStart[d] + 0.5 ) );
+      if( std::fabs( shardStart[d] - shardIndex[d] ) > 1e-3 ||
+          std::fabs( shardImage->GetSpacing()[d] - mergedImage->GetSpacing()[d] ) >
+          1e-5 * mergedImage->GetSpacing()[d] )
+        {
+        isOnGrid = false;
+        }
+      }
+    shardRegion.SetIndex( shardIndex );
+    if( !isOnGrid || !mergedImage->GetLargestPossibleRegion().IsInside( shardRegion ) )
+      {
+      if( verbose )
+        {
+        std::cerr << "Shard " << shardFileNames[n] << " is not a region of the target grid." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+
+    itk::ImageRegionConstIterator<TImage> ItS( shardImage, shardImage->GetLargestPossibleRegion() );
+    itk::ImageRegionIterator<TImage>      ItM( mergedImage, shardRegion );
+    for( ItS.GoToBegin(), ItM.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItM )
+      {
+      ItM.Set( ItS.Get() );
+      }
+
+    if( verbose )
+      {
+      std::cout << "  Pasted shard " << shardFileNames[n] << " at index " << shardIndex << std::endl;
+      }
+    }
+
+  WriteImage<TImage>( mergedImage, outputFileName.c_str() );
+  return EXIT_SUCCESS;
+}
+
 template <unsigned int ImageDimension>
 int antsJointFusion( itk::ants::CommandLineParser *parser )
 {
@@ -108,6 +209,100 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
              << ImageDimension << "-dimensional images." << std::endl << std::endl;
     }
 
+  // Merge the outputs of --shard jobs instead of fusing.  Each function of
+  // the option is one output:  [mergedImage,shard1,shard2,...].
+
+  typename OptionType::Pointer mergeShardsOption = parser->GetOption( "merge-shards" );
+  if( mergeShardsOption && mergeShardsOption->GetNumberOfFunctions() )
+    {
+    typename OptionType::Pointer targetOption = parser->GetOption( "target-image" );
+    if( !targetOption || !targetOption->GetNumberOfFunctions() )
+      {
+      if( verbose )
+        {
+        std::cerr << "Merging shards requires the target image for the output grid." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    std::string referenceFile = targetOption->GetFunction( 0 )->GetName();
+    if( targetOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      referenceFile = targetOption->GetFunction( 0 )->GetParameter( 0 );
+      }
+
+    typedef itk::ImageFileReader<ImageType> ReferenceReaderType;
+    typename ReferenceReaderType::Pointer referenceReader = ReferenceReaderType::New();
+    referenceReader->SetFileName( referenceFile );
+    try
+      {
+      referenceReader->UpdateOutputInformation();
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      if( verbose )
+        {
+        std::cerr << "Unable to read the target image header:  " << e << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+
+    for( unsigned int n = 0; n < mergeShardsOption->GetNumberOfFunctions(); n++ )
+      {
+      const unsigned int numberOfParameters = mergeShardsOption->GetFunction( n )->GetNumberOfParameters();
+      if( numberOfParameters < 2 )
+        {
+        if( verbose )
+          {
+          std::cerr << "Merging shards requires an output image and at least one shard." << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      const std::string outputFile = mergeShardsOption->GetFunction( n )->GetParameter( 0 );
+      std::vector<std::string> shardFiles;
+      for( unsigned int p = 1; p < numberOfParameters; p++ )
+        {
+        shardFiles.push_back( mergeShardsOption->GetFunction( n )->GetParameter( p ) );
+        }
+
+      // the labels are merged as labels, the posteriors, voting weights and
+      // intensities as real images
+      itk::ImageIOBase::Pointer imageIO =
+        itk::ImageIOFactory::CreateImageIO( shardFiles[0].c_str(), itk::ImageIOFactory::ReadMode );
+      if( imageIO.IsNull() )
+        {
+        if( verbose )
+          {
+          std::cerr << "Unable to read shard " << shardFiles[0] << "." << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      imageIO->SetFileName( shardFiles[0].c_str() );
+      imageIO->ReadImageInformation();
+
+      if( verbose )
+        {
+        std::cout << "Merging " << shardFiles.size() << " shards into " << outputFile << std::endl;
+        }
+
+      int status = EXIT_FAILURE;
+      if( imageIO->GetComponentType() == itk::ImageIOBase::FLOAT ||
+          imageIO->GetComponentType() == itk::ImageIOBase::DOUBLE )
+        {
+        status = MergeJointFusionShards<ImageType>( referenceReader->GetOutput(), shardFiles, outputFile, verbose );
+        }
+      else
+        {
+        status = MergeJointFusionShards<LabelImageType>( referenceReader->GetOutput(), shardFiles, outputFile,
+                                                         verbose );
+        }
+      if( status != EXIT_SUCCESS )
+        {
+        return status;
+        }
+      }
+    return EXIT_SUCCESS;
+    }
+
   // Instantiate the joint fusion filter
 
   typedef itk::WeightedVotingFusionImageFilter<ImageType, LabelImageType> FusionFilterType;
@@ -349,11 +544,14 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
     numberOfAtlasSegmentations = 0;
     }
 
+  // Collect the atlas file names and check the number of modalities before
+  // any of the images are read.
+
+  std::vector<std::string> atlasImageFileNames;
+  std::vector<std::string> atlasSegmentationFileNames;
+
   for( unsigned int m = 0; m < numberOfAtlases; m++ )
     {
-    typename FusionFilterType::InputImageList atlasImageList;
-    typename LabelImageType::Pointer atlasSegmentation = ITK_NULLPTR;
-
     if( atlasImageOption->GetFunction( m )->GetNumberOfParameters() == 0 )
       {
       numberOfAtlasModalities = 1;
@@ -366,11 +564,7 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
           }
         return EXIT_FAILURE;
         }
-      typename ImageType::Pointer atlasImage = ITK_NULLPTR;
-
-      std::string atlasFile = atlasImageOption->GetFunction( m )->GetName();
-      ReadImage<ImageType>( atlasImage, atlasFile.c_str() );
-      atlasImageList.push_back( atlasImage );
+      atlasImageFileNames.push_back( atlasImageOption->GetFunction( m )->GetName() );
       }
     else
       {
@@ -389,20 +583,218 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
         }
       for( unsigned int n = 0; n < numberOfAtlasModalities; n++ )
         {
-        typename ImageType::Pointer atlasImage = ITK_NULLPTR;
+        atlasImageFileNames.push_back( atlasImageOption->GetFunction( m )->GetParameter( n ) );
+        }
+      }
+    if( numberOfAtlasSegmentations > 0 )
+      {
+      atlasSegmentationFileNames.push_back( atlasSegmentationOption->GetFunction( m )->GetName() );
+      }
+    }
 
-        std::string atlasFile = atlasImageOption->GetFunction( m )->GetParameter( n );
-        ReadImage<ImageType>( atlasImage, atlasFile.c_str() );
+  // Get the number of tiles.  With more than one tile, the atlases are not
+  // loaded up front but connected to the fusion filter through readers so
+  // that only the region needed for the current tile (padded by the search
+  // and patch radii) is held in memory.
 
-        atlasImageList.push_back( atlasImage );
+  unsigned int numberOfTiles = 1;
+
+  typename OptionType::Pointer tilesOption = parser->GetOption( "number-of-tiles" );
+  if( tilesOption && tilesOption->GetNumberOfFunctions() )
+    {
+    numberOfTiles = parser->Convert<unsigned int>( tilesOption->GetFunction( 0 )->GetName() );
+    if( numberOfTiles < 1 )
+      {
+      numberOfTiles = 1;
+      }
+    }
+
+  // Get the shard.  Shard k of n is the k-th of n slabs of the target domain
+  // along its slowest dimension; the job fuses and writes only that region,
+  // reading only the matching (padded) regions of the atlases, so that the
+  // shards can be run as independent jobs and merged with --merge-shards.
+
+  unsigned int shardIndex = 1;
+  unsigned int numberOfShards = 1;
+
+  typename OptionType::Pointer shardOption = parser->GetOption( "shard" );
+  if( shardOption && shardOption->GetNumberOfFunctions() )
+    {
+    if( shardOption->GetFunction( 0 )->GetNumberOfParameters() != 2 )
+      {
+      if( verbose )
+        {
+        std::cerr << "The shard is specified as [shardIndex,numberOfShards]." << std::endl;
         }
+      return EXIT_FAILURE;
       }
+    shardIndex = parser->Convert<unsigned int>( shardOption->GetFunction( 0 )->GetParameter( 0 ) );
+    numberOfShards = parser->Convert<unsigned int>( shardOption->GetFunction( 0 )->GetParameter( 1 ) );
+    if( numberOfShards < 1 || shardIndex < 1 || shardIndex > numberOfShards )
+      {
+      if( verbose )
+        {
+        std::cerr << "The shard index must be between 1 and the number of shards." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    }
+
+  typename LabelImageType::RegionType shardRegion = targetImageList[0]->GetLargestPossibleRegion();
+  if( numberOfShards > 1 )
+    {
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    const unsigned int numberOfSplits = splitter->GetNumberOfSplits( shardRegion, numberOfShards );
+    if( shardIndex > numberOfSplits )
+      {
+      if( verbose )
+        {
+        std::cerr << "The target image can only be split into " << numberOfSplits << " shards." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    splitter->GetSplit( shardIndex - 1, numberOfSplits, shardRegion );
+    fusionFilter->SetStreamedRegion( shardRegion );
+    }
+
+  typedef itk::ImageFileReader<ImageType>      AtlasImageReaderType;
+  typedef itk::ImageFileReader<LabelImageType> AtlasSegmentationReaderType;
+
+  std::vector<typename AtlasImageReaderType::Pointer>        atlasImageFileReaders;
+  std::vector<typename AtlasSegmentationReaderType::Pointer> atlasSegmentationFileReaders;
+
+  if( numberOfTiles > 1 || numberOfShards > 1 )
+    {
+    for( unsigned int m = 0; m < numberOfAtlases; m++ )
+      {
+      typename FusionFilterType::InputImageList atlasImageList;
+      typename LabelImageType::Pointer atlasSegmentation = ITK_NULLPTR;
+
+      try
+        {
+        for( unsigned int n = 0; n < numberOfAtlasModalities; n++ )
+          {
+          typename AtlasImageReaderType::Pointer reader = AtlasImageReaderType::New();
+          reader->SetFileName( atlasImageFileNames[m * numberOfAtlasModalities + n] );
+          reader->UpdateOutputInformation();
+          atlasImageFileReaders.push_back( reader );
+          atlasImageList.push_back( reader->GetOutput() );
+          }
+        if( numberOfAtlasSegmentations > 0 )
+          {
+          typename AtlasSegmentationReaderType::Pointer reader = AtlasSegmentationReaderType::New();
+          reader->SetFileName( atlasSegmentationFileNames[m] );
+          reader->UpdateOutputInformation();
+          atlasSegmentationFileReaders.push_back( reader );
+          atlasSegmentation = reader->GetOutput();
+          }
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        if( verbose )
+          {
+          std::cerr << "Unable to read atlas " << m + 1 << ":  " << e << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      fusionFilter->AddAtlas( atlasImageList, atlasSegmentation );
+      }
+    if( verbose )
+      {
+      std::cout << "  Streaming " << numberOfAtlases << " atlases over " << numberOfTiles << " tiles";
+      if( numberOfShards > 1 )
+        {
+        std::cout << " of shard " << shardIndex << " of " << numberOfShards << " (region " << shardRegion.GetIndex()
+                  << ", " << shardRegion.GetSize() << ")";
+        }
+      std::cout << "." << std::endl << std::endl;
+      }
+    }
+  else
+    {
+    // Read the atlases on a pool of threads.  The images are handed to the
+    // fusion filter in command line order while the next ones are being read.
+
+    const unsigned int numberOfReaderThreads =
+      std::min( static_cast<unsigned int>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), 8u );
+
+    PrefetchImageReader<ImageType> atlasImageReader;
+    atlasImageReader.SetFileNames( atlasImageFileNames );
+    atlasImageReader.SetNumberOfThreads( numberOfReaderThreads );
+    atlasImageReader.SetQueueSize( 2 * numberOfReaderThreads );
+
+    PrefetchImageReader<LabelImageType> atlasSegmentationReader;
+    atlasSegmentationReader.SetFileNames( atlasSegmentationFileNames );
+    atlasSegmentationReader.SetNumberOfThreads( std::max( numberOfReaderThreads / 2, 1u ) );
+    atlasSegmentationReader.SetQueueSize( numberOfReaderThreads );
+
+    itk::TimeProbe atlasReadTimer;
+    atlasReadTimer.Start();
+
+    atlasImageReader.Start();
     if( numberOfAtlasSegmentations > 0 )
       {
-      std::string atlasSegmentationFile = atlasSegmentationOption->GetFunction( m )->GetName();
-      ReadImage<LabelImageType>( atlasSegmentation, atlasSegmentationFile.c_str() );
+      atlasSegmentationReader.Start();
+      }
+
+    for( unsigned int m = 0; m < numberOfAtlases; m++ )
+      {
+      typename FusionFilterType::InputImageList atlasImageList;
+      typename LabelImageType::Pointer atlasSegmentation = ITK_NULLPTR;
+
+      for( unsigned int n = 0; n < numberOfAtlasModalities; n++ )
+        {
+        typename ImageType::Pointer atlasImage = atlasImageReader.GetNextImage();
+        if( atlasImage.IsNull() )
+          {
+          if( verbose )
+            {
+            std::cerr << "Unable to read atlas image " << atlasImageFileNames[m * numberOfAtlasModalities + n]
+                      << "." << std::endl;
+            }
+          return EXIT_FAILURE;
+          }
+        atlasImageList.push_back( atlasImage );
+        }
+      if( numberOfAtlasSegmentations > 0 )
+        {
+        atlasSegmentation = atlasSegmentationReader.GetNextImage();
+        if( atlasSegmentation.IsNull() )
+          {
+          if( verbose )
+            {
+            std::cerr << "Unable to read atlas segmentation " << atlasSegmentationFileNames[m] << "." << std::endl;
+            }
+          return EXIT_FAILURE;
+          }
+        }
+      fusionFilter->AddAtlas( atlasImageList, atlasSegmentation );
+
+      if( verbose )
+        {
+        double readTime = 0.0;
+        for( unsigned int n = 0; n < numberOfAtlasModalities; n++ )
+          {
+          readTime += atlasImageReader.GetReadTime( m * numberOfAtlasModalities + n );
+          }
+        if( numberOfAtlasSegmentations > 0 )
+          {
+          readTime += atlasSegmentationReader.GetReadTime( m );
+          }
+        std::cout << "  Atlas " << m + 1 << " of " << numberOfAtlases << " read in " << readTime << " s" << std::endl;
+        }
+      }
+
+    atlasReadTimer.Stop();
+
+    if( verbose )
+      {
+      std::cout << "  Read " << numberOfAtlases << " atlases in " << atlasReadTimer.GetTotal() << " s using "
+                << atlasImageReader.GetNumberOfThreadsUsed() << " reader thread(s) (total read time = "
+                << atlasImageReader.GetTotalReadTime() + atlasSegmentationReader.GetTotalReadTime()
+                << " s, waited " << atlasImageReader.GetWaitTime() + atlasSegmentationReader.GetWaitTime()
+                << " s)" << std::endl << std::endl;
       }
-    fusionFilter->AddAtlas( atlasImageList, atlasSegmentation );
     }
 
   // Get the exclusion images
@@ -447,9 +839,30 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
     fusionFilter->AddObserver( itk::ProgressEvent(), observer );
     }
 
+  typename LabelImageType::Pointer fusionLabelImage = ITK_NULLPTR;
+
   try
     {
-    fusionFilter->Update();
+    if( numberOfTiles > 1 )
+      {
+      typedef itk::StreamingImageFilter<LabelImageType, LabelImageType> StreamerType;
+      typename StreamerType::Pointer streamer = StreamerType::New();
+      streamer->SetInput( fusionFilter->GetOutput() );
+      streamer->SetNumberOfStreamDivisions( numberOfTiles );
+      streamer->UpdateOutputInformation();
+      streamer->GetOutput()->SetRequestedRegion( shardRegion );
+      streamer->GetOutput()->Update();
+
+      fusionLabelImage = streamer->GetOutput();
+      }
+    else
+      {
+      fusionFilter->UpdateOutputInformation();
+      fusionFilter->GetOutput()->SetRequestedRegion( shardRegion );
+      fusionFilter->GetOutput()->Update();
+
+      fusionLabelImage = fusionFilter->GetOutput();
+      }
     }
   catch( itk::ExceptionObject & e )
     {
@@ -518,7 +931,11 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
 
     if( !labelFusionName.empty() )
       {
-      WriteImage<LabelImageType>( fusionFilter->GetOutput(), labelFusionName.c_str() );
+      if( numberOfShards > 1 )
+        {
+        fusionLabelImage = GetShardImage<LabelImageType>( fusionLabelImage );
+        }
+      WriteImage<LabelImageType>( fusionLabelImage, labelFusionName.c_str() );
       }
     if( !intensityFusionName.empty() )
       {
@@ -536,6 +953,10 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
           }
         typename ImageType::Pointer jointIntensityFusionImage
           = fusionFilter->GetJointIntensityFusionImage( i );
+        if( numberOfShards > 1 )
+          {
+          jointIntensityFusionImage = GetShardImage<ImageType>( jointIntensityFusionImage );
+          }
         WriteImage<ImageType>( jointIntensityFusionImage, imageNames[i].c_str() );
         }
       }
@@ -557,7 +978,13 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
 
         char buffer[256];
         std::snprintf( buffer, sizeof( buffer ), labelPosteriorName.c_str(), *labelIt );
-        WriteImage<typename FusionFilterType::ProbabilityImageType>( fusionFilter->GetLabelPosteriorProbabilityImage( *labelIt ), buffer );
+        typename FusionFilterType::ProbabilityImageType::Pointer labelPosteriorImage =
+          fusionFilter->GetLabelPosteriorProbabilityImage( *labelIt );
+        if( numberOfShards > 1 )
+          {
+          labelPosteriorImage = GetShardImage<typename FusionFilterType::ProbabilityImageType>( labelPosteriorImage );
+          }
+        WriteImage<typename FusionFilterType::ProbabilityImageType>( labelPosteriorImage, buffer );
         }
       }
     if( !atlasVotingName.empty() && fusionFilter->GetRetainAtlasVotingWeightImages() )
@@ -574,7 +1001,13 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
           {
           std::cout << "  Writing atlas voting image (atlas " << i+1 << ")" << std::endl;
           }
-        WriteImage<typename FusionFilterType::ProbabilityImageType>( fusionFilter->GetAtlasVotingWeightImage( i ), imageNames[i].c_str() );
+        typename FusionFilterType::ProbabilityImageType::Pointer atlasVotingImage =
+          fusionFilter->GetAtlasVotingWeightImage( i );
+        if( numberOfShards > 1 )
+          {
+          atlasVotingImage = GetShardImage<typename FusionFilterType::ProbabilityImageType>( atlasVotingImage );
+          }
+        WriteImage<typename FusionFilterType::ProbabilityImageType>( atlasVotingImage, imageNames[i].c_str() );
         }
       }
     }
@@ -772,6 +1205,56 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Process the target image in the specified number of tiles.  Instead of " )
+    + std::string( "loading all the atlases in memory, only the region of each atlas needed " )
+    + std::string( "for the current tile (padded by the search and patch radii) is read so " )
+    + std::string( "that memory use scales with the tile size rather than with the number of " )
+    + std::string( "atlases.  Image formats which support streamed reading (e.g., uncompressed " )
+    + std::string( "nifti, nrrd, or mha) are strongly recommended.  The output is identical " )
+    + std::string( "to the non-tiled output.  Default = 1" );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "number-of-tiles" );
+  option->SetUsageOption( 0, "1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Process only one shard of the target domain, e.g. as one of several " )
+    + std::string( "independent cluster jobs.  The target is split into numberOfShards slabs " )
+    + std::string( "along its slowest dimension and only the shardIndex-th (1-based) is fused, " )
+    + std::string( "reading only the matching regions of the atlases (padded by the search and " )
+    + std::string( "patch radii) as with --number-of-tiles, which can be combined with it.  The " )
+    + std::string( "outputs cover the shard only; each is merged from the shards with " )
+    + std::string( "--merge-shards.  A shard only has the posterior images of the labels found " )
+    + std::string( "near it." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "shard" );
+  option->SetUsageOption( 0, "[shardIndex,numberOfShards]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Instead of fusing, merge the outputs of --shard jobs into one image on " )
+    + std::string( "the grid of the target image, each shard at the location of its origin.  " )
+    + std::string( "The option is repeated for every output to merge (labels, intensities, " )
+    + std::string( "posteriors or voting weights); voxels covered by none of the listed shards " )
+    + std::string( "are 0.  Only the target image is read, for its header." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "merge-shards" );
+  option->SetUsageOption( 0, "[mergedImage,shardImage1,shardImage2,...]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "The output is the intensity and/or label fusion image.  Additional " )
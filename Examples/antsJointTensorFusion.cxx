@@ -8,13 +8,11 @@
 #include "itkWeightedVotingFusionImageFilter.h"
 
 #include "itkDiffusionTensor3D.h"
-#include "itkNthElementImageAdaptor.h"
-#include "itkCastImageFilter.h"
-#include "itkImageRegionIteratorWithIndex.h"
 
 #include "stdio.h"
 
 #include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -88,6 +86,77 @@ public:
     }
 };
 
+// The fusion filter compares the tensors through their 6 unique components,
+// each held in its own image.  The off-diagonal components are scaled by
+// sqrt(2) so that the sum of the squared component differences is the
+// Frobenius norm of the tensor difference, i.e. the log-Euclidean distance
+// when the tensors are read with their logarithm.
+
+inline bool IsOffDiagonalTensorComponent( unsigned int n )
+{
+  return n == 1 || n == 2 || n == 4;
+}
+
+template <class TTensorImage, class TImage>
+void SplitTensorImageComponents( const TTensorImage *tensorImage,
+                                 std::vector<typename TImage::Pointer> & componentImages )
+{
+  typedef typename TImage::PixelType RealType;
+
+  const unsigned int numberOfComponents = TTensorImage::PixelType::InternalDimension;
+  const RealType     offDiagonalWeight = static_cast<RealType>( std::sqrt( 2.0 ) );
+
+  std::vector<RealType *> componentBuffers( numberOfComponents );
+  componentImages.clear();
+  for( unsigned int n = 0; n < numberOfComponents; n++ )
+    {
+    typename TImage::Pointer componentImage = TImage::New();
+    componentImage->CopyInformation( tensorImage );
+    componentImage->SetRegions( tensorImage->GetBufferedRegion() );
+    componentImage->Allocate();
+    componentBuffers[n] = componentImage->GetBufferPointer();
+    componentImages.push_back( componentImage );
+    }
+
+  const typename TTensorImage::PixelType *tensors = tensorImage->GetBufferPointer();
+  const itk::SizeValueType numberOfPixels = tensorImage->GetBufferedRegion().GetNumberOfPixels();
+  for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+    {
+    for( unsigned int n = 0; n < numberOfComponents; n++ )
+      {
+      const RealType value = static_cast<RealType>( tensors[i][n] );
+      componentBuffers[n][i] = IsOffDiagonalTensorComponent( n ) ? value * offDiagonalWeight : value;
+      }
+    }
+}
+
+template <class TTensorImage, class TImage>
+typename TTensorImage::Pointer MergeTensorImageComponents( const std::vector<typename TImage::Pointer> & componentImages )
+{
+  typedef typename TTensorImage::PixelType::ValueType RealType;
+
+  const unsigned int numberOfComponents = TTensorImage::PixelType::InternalDimension;
+  const RealType     offDiagonalWeight = static_cast<RealType>( 1.0 / std::sqrt( 2.0 ) );
+
+  typename TTensorImage::Pointer tensorImage = TTensorImage::New();
+  tensorImage->CopyInformation( componentImages[0] );
+  tensorImage->SetRegions( componentImages[0]->GetBufferedRegion() );
+  tensorImage->Allocate();
+
+  typename TTensorImage::PixelType *tensors = tensorImage->GetBufferPointer();
+  const itk::SizeValueType numberOfPixels = tensorImage->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned int n = 0; n < numberOfComponents; n++ )
+    {
+    const typename TImage::PixelType *component = componentImages[n]->GetBufferPointer();
+    const RealType weight = IsOffDiagonalTensorComponent( n ) ? offDiagonalWeight : itk::NumericTraits<RealType>::OneValue();
+    for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+      {
+      tensors[i][n] = static_cast<RealType>( component[i] ) * weight;
+      }
+    }
+  return tensorImage;
+}
+
 template <unsigned int ImageDimension>
 int antsJointTensorFusion( itk::ants::CommandLineParser *parser )
 {
@@ -95,8 +164,6 @@ int antsJointTensorFusion( itk::ants::CommandLineParser *parser )
   typedef itk::DiffusionTensor3D<RealType>                      TensorType;
   typedef itk::Image<RealType, ImageDimension>                  ImageType;
   typedef itk::Image<TensorType, ImageDimension>                TensorImageType;
-  typedef itk::NthElementImageAdaptor<TensorImageType,RealType> TensorAdaptorType;
-  typedef itk::CastImageFilter<TensorAdaptorType,ImageType>     CastFilterType;
 
   typedef itk::Image<unsigned int, ImageDimension>              LabelImageType;
   typedef LabelImageType                                        MaskImageType;
@@ -277,21 +344,7 @@ int antsJointTensorFusion( itk::ants::CommandLineParser *parser )
       ReadTensorImage<TensorImageType>( targetImage, targetFile.c_str(), logEuclidean );
 
       numberOfTargetModalities = 6;
-      for( unsigned int n = 0; n < numberOfTargetModalities; n++ )
-        {
-        typename TensorAdaptorType::Pointer targetAdaptorImage = TensorAdaptorType::New();
-        targetAdaptorImage->SetImage( targetImage );
-        targetAdaptorImage->SelectNthElement( n );
-
-        // Can't use image adaptor directly, get error due to missing "ImageType::NeighborhoodAccessorFunctorType" in
-        // itk::ConstNeighborhoodIterator<itk::NthElementImageAdaptor<itk::Image<itk::DiffusionTensor3D<float>, 2>, float>
-        typename CastFilterType::Pointer castTensor = CastFilterType::New();
-        castTensor->SetInput( targetAdaptorImage );
-        castTensor->Update();
-
-        targetImageList.push_back( castTensor->GetOutput() );
-        }
-
+      SplitTensorImageComponents<TensorImageType, ImageType>( targetImage, targetImageList );
       }
     else
       {
@@ -366,18 +419,7 @@ int antsJointTensorFusion( itk::ants::CommandLineParser *parser )
 
       std::string atlasFile = atlasImageOption->GetFunction( m )->GetName();
       ReadTensorImage<TensorImageType>( atlasImage, atlasFile.c_str(), logEuclidean );
-      for( unsigned int n = 0; n < numberOfAtlasModalities; n++ )
-        {
-        typename TensorAdaptorType::Pointer atlasAdaptorImage = TensorAdaptorType::New();
-        atlasAdaptorImage->SetImage( atlasImage );
-        atlasAdaptorImage->SelectNthElement( n );
-
-        typename CastFilterType::Pointer castTensor = CastFilterType::New();
-        castTensor->SetInput( atlasAdaptorImage );
-        castTensor->Update();
-
-        atlasImageList.push_back( castTensor->GetOutput() );
-        }
+      SplitTensorImageComponents<TensorImageType, ImageType>( atlasImage, atlasImageList );
       }
     else
       {
@@ -508,41 +550,23 @@ int antsJointTensorFusion( itk::ants::CommandLineParser *parser )
       }
     if( !intensityFusionName.empty() )
       {
-      typename TensorImageType::Pointer jointTensorImage = TensorImageType::New();
-      jointTensorImage->SetRegions(fusionFilter->GetJointIntensityFusionImage( 0 )->GetRequestedRegion().GetSize() );
-      jointTensorImage->SetSpacing( fusionFilter->GetJointIntensityFusionImage( 0 )->GetSpacing() );
-      jointTensorImage->SetOrigin( fusionFilter->GetJointIntensityFusionImage( 0 )->GetOrigin() );
-      jointTensorImage->SetDirection( fusionFilter->GetJointIntensityFusionImage( 0 )->GetDirection() );
-      jointTensorImage->Allocate();
-      TensorType nullDT;
-      nullDT.Fill(0.0);
-      jointTensorImage->FillBuffer(nullDT);
-
+      if( verbose )
+        {
+        std::cout << "  Merging tensor fusion image channels " << std::endl;
+        }
+      typename FusionFilterType::InputImageList jointIntensityFusionImages;
       for( unsigned int i = 0; i < 6; i++ )
         {
-        if( verbose )
-          {
-          std::cout << "  Merging tensor fusion image channels " << std::endl;
-          }
-        typename ImageType::Pointer jointIntensityFusionImage
-          = fusionFilter->GetJointIntensityFusionImage( i );
-
-        typename itk::ImageRegionIteratorWithIndex<ImageType> valueIt(
-          jointIntensityFusionImage, jointIntensityFusionImage->GetLargestPossibleRegion() );
+        jointIntensityFusionImages.push_back( fusionFilter->GetJointIntensityFusionImage( i ) );
+        }
+      typename TensorImageType::Pointer jointTensorImage =
+        MergeTensorImageComponents<TensorImageType, ImageType>( jointIntensityFusionImages );
 
-        while ( !valueIt.IsAtEnd() )
-          {
-          TensorType dt = jointTensorImage->GetPixel(valueIt.GetIndex());
-          dt[i] = valueIt.Value();
-          jointTensorImage->SetPixel(valueIt.GetIndex(), dt);
-          ++valueIt;
-          }
+      if( verbose )
+        {
+        std::cout << "  Writing tensor fusion image" << std::endl;
         }
-        if( verbose )
-          {
-          std::cout << "  Writing tensor fusion image" << std::endl;
-          }
-        WriteTensorImage<TensorImageType>( jointTensorImage, intensityFusionName.c_str() );
+      WriteTensorImage<TensorImageType>( jointTensorImage, intensityFusionName.c_str() );
       }
     if( !labelPosteriorName.empty() && fusionFilter->GetRetainLabelPosteriorProbabilityImages() )
       {
@@ -711,7 +735,9 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   }
 
   {
-  std::string description = std::string( "Use log Euclidean space for tensor math" );
+  std::string description = std::string( "Use log Euclidean space for tensor math, i.e. the patches are " )
+    + std::string( "compared and fused through the matrix logarithm of the tensors.  The off-diagonal " )
+    + std::string( "components are weighted so that the component differences sum to the Frobenius norm." );
 
   OptionType::Pointer option = OptionType::New();
   option->SetShortName( 'u' );
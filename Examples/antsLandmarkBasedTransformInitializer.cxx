@@ -1,6 +1,7 @@
 /** ANTS Landmarks used to initialize an b-spline displacement field ... */
 
 #include "antsUtilities.h"
+#include "antsLabelGeometry.h"
 
 #include "itkAffineTransform.h"
 #include "itkBSplineScatteredDataPointSetToImageFilter.h"
@@ -21,66 +22,19 @@
 namespace ants
 {
 
+/** The landmarks of a label image:  the centroids of its labels other than
+ * 0, in ascending order of the labels, with the labels as point data. */
 template<class ImageType, class PointSetType>
 void ReadLabeledPointSetFromImage( typename ImageType::Pointer image, typename PointSetType::Pointer pointSet, std::vector<typename ImageType::PixelType> & labels )
 {
-  labels.clear();
-
-  typename PointSetType::Pointer allPoints = PointSetType::New();
-  allPoints->Initialize();
-
-  itk::ImageRegionIteratorWithIndex<ImageType> It( image, image->GetLargestPossibleRegion() );
-
-  unsigned int count = 0;
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    typename ImageType::PixelType value = It.Get();
-    if( value != 0 )
-      {
-      if( std::find( labels.begin(), labels.end(), value ) == labels.end() )
-        {
-        labels.push_back( value );
-        }
-      typename PointSetType::PointType point;
-      image->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-      allPoints->SetPointData( count, value );
-      allPoints->SetPoint( count++, point );
-      }
-    }
-  std::sort( labels.begin(), labels.end() );
+  std::vector<typename PointSetType::PointType> centroids;
+  GetLabelCentroids<ImageType, typename PointSetType::PointType>( image, labels, centroids );
 
   pointSet->Initialize();
-
   for( unsigned int n = 0; n < labels.size(); n++ )
     {
-    typename ImageType::PixelType currentLabel = labels[n];
-    typename PointSetType::PointType center;
-    center.Fill( 0 );
-    float N = 0;
-    typename PointSetType::PointsContainerConstIterator ItP =
-      allPoints->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator ItD =
-      allPoints->GetPointData()->Begin();
-    while( ItP != allPoints->GetPoints()->End() )
-      {
-      if( ItD.Value() == currentLabel )
-        {
-        typename PointSetType::PointType point = ItP.Value();
-        for( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
-          {
-          center[d] += point[d];
-          }
-        N += 1.0;
-        }
-      ++ItP;
-      ++ItD;
-      }
-    for( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
-      {
-      center[d] /= N;
-      }
-    pointSet->SetPoint( n, center );
-    pointSet->SetPointData( n, currentLabel );
+    pointSet->SetPoint( n, centroids[n] );
+    pointSet->SetPointData( n, labels[n] );
     }
 }
 
@@ -96,8 +50,16 @@ int InitializeLinearTransform( int itkNotUsed( argc ), char *argv[] )
 
   typedef itk::PointSet<LabelType, ImageDimension> PointSetType;
 
+  const std::vector<std::string> movingFileNames = GetBatchFileNames( argv[3] );
+  const std::vector<std::string> outputFileNames = GetBatchFileNames( argv[5] );
+  if( movingFileNames.size() != outputFileNames.size() )
+    {
+    std::cerr << "The numbers of moving images and output transforms must be the same." << std::endl;
+    return EXIT_FAILURE;
+    }
+
   //
-  // Read in the fixed and moving images and convert to point sets
+  // Read in the fixed image and convert to a point set, once for the batch
   //
 
   typedef itk::ImageFileReader<LabelImageType> ImageReaderType;
@@ -110,16 +72,6 @@ int InitializeLinearTransform( int itkNotUsed( argc ), char *argv[] )
   std::vector<LabelType> fixedLabels;
   ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( fixedImage, fixedPoints, fixedLabels );
 
-  typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
-  movingReader->SetFileName( argv[3] );
-  movingReader->Update();
-  typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
-
-  typename PointSetType::Pointer movingPoints = PointSetType::New();
-  std::vector<LabelType> movingLabels;
-  ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( movingImage, movingPoints, movingLabels );
-
-
   LandmarkContainerType fixedLandmarks;
   typename PointSetType::PointsContainerConstIterator ItF = fixedPoints->GetPoints()->Begin();
   while( ItF != fixedPoints->GetPoints()->End() )
@@ -128,60 +80,76 @@ int InitializeLinearTransform( int itkNotUsed( argc ), char *argv[] )
     ++ItF;
     }
 
-
-  LandmarkContainerType movingLandmarks;
-  typename PointSetType::PointsContainerConstIterator ItM = movingPoints->GetPoints()->Begin();
-  while( ItM != movingPoints->GetPoints()->End() )
+  for( unsigned int i = 0; i < movingFileNames.size(); i++ )
     {
-    movingLandmarks.push_back( ItM.Value() );
-    ++ItM;
-    }
-
-  if( fixedLandmarks.size() != movingLandmarks.size() )
-    {
-    std::cerr << "The number of fixed points and moving points must be the same." << std::endl;
-    return EXIT_FAILURE;
-    }
+    //
+    // Read in the moving image and convert to a point set
+    //
+
+    typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
+    movingReader->SetFileName( movingFileNames[i].c_str() );
+    movingReader->Update();
+    typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
+
+    typename PointSetType::Pointer movingPoints = PointSetType::New();
+    std::vector<LabelType> movingLabels;
+    ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( movingImage, movingPoints, movingLabels );
+
+    LandmarkContainerType movingLandmarks;
+    typename PointSetType::PointsContainerConstIterator ItM = movingPoints->GetPoints()->Begin();
+    while( ItM != movingPoints->GetPoints()->End() )
+      {
+      movingLandmarks.push_back( ItM.Value() );
+      ++ItM;
+      }
 
-  typename std::vector<LabelType>::const_iterator itf;
-  for( itf = fixedLabels.begin(); itf != fixedLabels.end(); ++itf )
-    {
-    if( std::find( movingLabels.begin(), movingLabels.end(), *itf ) == movingLabels.end() )
+    if( fixedLandmarks.size() != movingLandmarks.size() )
       {
-      std::cerr << "Labels do not match." << std::endl;
+      std::cerr << "The number of fixed points and moving points must be the same ("
+        << movingFileNames[i] << ")." << std::endl;
       return EXIT_FAILURE;
       }
-    }
 
-  //
-  // Calculate the transform
-  //
+    typename std::vector<LabelType>::const_iterator itf;
+    for( itf = fixedLabels.begin(); itf != fixedLabels.end(); ++itf )
+      {
+      if( std::find( movingLabels.begin(), movingLabels.end(), *itf ) == movingLabels.end() )
+        {
+        std::cerr << "Labels do not match (" << movingFileNames[i] << ")." << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
 
-  typename TransformType::Pointer transform = TransformType::New();
-  transform->SetIdentity();
+    //
+    // Calculate the transform
+    //
 
-  typename TransformInitializerType::Pointer initializer = TransformInitializerType::New();
-  initializer->SetFixedLandmarks( fixedLandmarks );
-  initializer->SetMovingLandmarks( movingLandmarks );
-  initializer->SetTransform( transform );
-  initializer->InitializeTransform();
+    typename TransformType::Pointer transform = TransformType::New();
+    transform->SetIdentity();
 
-  //
-  // Write the transform
-  //
+    typename TransformInitializerType::Pointer initializer = TransformInitializerType::New();
+    initializer->SetFixedLandmarks( fixedLandmarks );
+    initializer->SetMovingLandmarks( movingLandmarks );
+    initializer->SetTransform( transform );
+    initializer->InitializeTransform();
 
-  typename itk::TransformFileWriter::Pointer transformWriter = itk::TransformFileWriter::New();
-  transformWriter->SetFileName( argv[5] );
-  transformWriter->SetInput( transform );
+    //
+    // Write the transform
+    //
 
-  try
-    {
-    transformWriter->Update();
-    }
-  catch( itk::ExceptionObject & err )
-    {
-    std::cerr << "Exception in writing tranform file: " << argv[5] << std::endl;
-    return EXIT_FAILURE;
+    typename itk::TransformFileWriter::Pointer transformWriter = itk::TransformFileWriter::New();
+    transformWriter->SetFileName( outputFileNames[i].c_str() );
+    transformWriter->SetInput( transform );
+
+    try
+      {
+      transformWriter->Update();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << "Exception in writing tranform file: " << outputFileNames[i] << std::endl;
+      return EXIT_FAILURE;
+      }
     }
 
   return EXIT_SUCCESS;
@@ -196,8 +164,16 @@ int InitializeBSplineTransform( int argc, char *argv[] )
 
   typedef itk::PointSet<LabelType, ImageDimension> PointSetType;
 
+  const std::vector<std::string> movingFileNames = GetBatchFileNames( argv[3] );
+  const std::vector<std::string> outputFileNames = GetBatchFileNames( argv[5] );
+  if( movingFileNames.size() != outputFileNames.size() )
+    {
+    std::cerr << "The numbers of moving images and output transforms must be the same." << std::endl;
+    return EXIT_FAILURE;
+    }
+
   //
-  // Read in the fixed and moving images and convert to point sets
+  // Read in the fixed image and convert to a point set, once for the batch
   //
 
   typedef itk::ImageFileReader<LabelImageType> ImageReaderType;
@@ -213,34 +189,7 @@ int InitializeBSplineTransform( int argc, char *argv[] )
 
   ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( fixedImage, fixedLandmarks, fixedLabels );
 
-  typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
-  movingReader->SetFileName( argv[3] );
-  movingReader->Update();
-  typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
-
-  typename PointSetType::Pointer movingLandmarks = PointSetType::New();
-  typename std::vector<LabelType> movingLabels;
-  ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( movingImage, movingLandmarks, movingLabels );
-
-  if( fixedLandmarks->GetNumberOfPoints() != movingLandmarks->GetNumberOfPoints() )
-    {
-    std::cerr << "The number of fixed points and moving points must be the same." << std::endl;
-    return EXIT_FAILURE;
-    }
-
-  typename std::vector<LabelType>::const_iterator itf;
-  for( itf = fixedLabels.begin(); itf != fixedLabels.end(); ++itf )
-    {
-    if( std::find( movingLabels.begin(), movingLabels.end(), *itf ) == movingLabels.end() )
-      {
-      std::cerr << "Labels do not match." << std::endl;
-      return EXIT_FAILURE;
-      }
-    }
-
-  //
-  // Calculate the transform
-  //
+  // the parametric space of the fixed image, for the field points
 
   typename LabelImageType::DirectionType fixedDirection = fixedImage->GetDirection();
   typename LabelImageType::DirectionType fixedDirectionInverse( fixedDirection.GetInverse() );
@@ -267,243 +216,271 @@ int InitializeBSplineTransform( int argc, char *argv[] )
   typedef itk::Vector<RealType, ImageDimension>  VectorType;
   typedef itk::Image<VectorType, ImageDimension> DisplacementFieldType;
 
-  // Read in the optional label weights
+  for( unsigned int i = 0; i < movingFileNames.size(); i++ )
+    {
+    typename ImageReaderType::Pointer movingReader = ImageReaderType::New();
+    movingReader->SetFileName( movingFileNames[i].c_str() );
+    movingReader->Update();
+    typename LabelImageType::Pointer movingImage = movingReader->GetOutput();
 
-  std::vector<float>     labelWeights;
-  std::vector<LabelType> userLabels;
+    typename PointSetType::Pointer movingLandmarks = PointSetType::New();
+    typename std::vector<LabelType> movingLabels;
+    ReadLabeledPointSetFromImage<LabelImageType, PointSetType>( movingImage, movingLandmarks, movingLabels );
 
-  bool useWeights = false;
+    if( fixedLandmarks->GetNumberOfPoints() != movingLandmarks->GetNumberOfPoints() )
+      {
+      std::cerr << "The number of fixed points and moving points must be the same." << std::endl;
+      return EXIT_FAILURE;
+      }
 
-  unsigned int labelCount = 0;
-  if( argc > 10 )
-    {
-    useWeights = true;
+    typename std::vector<LabelType>::const_iterator itf;
+    for( itf = fixedLabels.begin(); itf != fixedLabels.end(); ++itf )
+      {
+      if( std::find( movingLabels.begin(), movingLabels.end(), *itf ) == movingLabels.end() )
+        {
+        std::cerr << "Labels do not match." << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+
+    // Read in the optional label weights
+
+    std::vector<float>     labelWeights;
+    std::vector<LabelType> userLabels;
 
-    std::fstream labelStr( argv[10] );
+    bool useWeights = false;
 
-    if( labelStr.is_open() )
+    unsigned int labelCount = 0;
+    if( argc > 10 )
       {
-      while( !labelStr.eof() )
-        {
-        char line[256];
-        labelStr.getline( line, 256 );
+      useWeights = true;
 
-        std::string lineString = std::string( line );
-        std::size_t pos = lineString.find( ',' );
+      std::fstream labelStr( argv[10] );
 
-        RealType value;
-        if( pos == std::string::npos )
-          {
-          std::istringstream iss( lineString );
-          iss >> value;
-          labelWeights.push_back( value );
-          userLabels.push_back( movingLabels[labelCount++] );
-          }
-        else
+      if( labelStr.is_open() )
+        {
+        while( !labelStr.eof() )
           {
-          unsigned int localLabel;
+          char line[256];
+          labelStr.getline( line, 256 );
+
+          std::string lineString = std::string( line );
+          std::size_t pos = lineString.find( ',' );
+
+          RealType value;
+          if( pos == std::string::npos )
+            {
+            std::istringstream iss( lineString );
+            iss >> value;
+            labelWeights.push_back( value );
+            userLabels.push_back( movingLabels[labelCount++] );
+            }
+          else
+            {
+            unsigned int localLabel;
 
-          std::string        element = lineString.substr( 0, pos );
-          std::istringstream iss( element );
-          iss >> localLabel;
-          userLabels.push_back( localLabel );
+            std::string        element = lineString.substr( 0, pos );
+            std::istringstream iss( element );
+            iss >> localLabel;
+            userLabels.push_back( localLabel );
 
-          element = lineString.substr( pos + 1, lineString.length() );
-          std::istringstream iss2( element );
-          iss2 >> value;
-          labelWeights.push_back( value );
+            element = lineString.substr( pos + 1, lineString.length() );
+            std::istringstream iss2( element );
+            iss2 >> value;
+            labelWeights.push_back( value );
+            }
           }
-        }
 
-      labelStr.close();
-      }
-    else
-      {
-      std::cerr << "File " << argv[10] << " cannot be opened." << std::endl;
-      return EXIT_FAILURE;
+        labelStr.close();
+        }
+      else
+        {
+        std::cerr << "File " << argv[10] << " cannot be opened." << std::endl;
+        return EXIT_FAILURE;
+        }
       }
-    }
 
-  // Now match up the center points
+    // Now match up the center points
 
-  typedef itk::PointSet<VectorType, ImageDimension> DisplacementFieldPointSetType;
-  typedef itk::BSplineScatteredDataPointSetToImageFilter
-    <DisplacementFieldPointSetType, DisplacementFieldType> BSplineFilterType;
-  typedef typename BSplineFilterType::WeightsContainerType WeightsContainerType;
+    typedef itk::PointSet<VectorType, ImageDimension> DisplacementFieldPointSetType;
+    typedef itk::BSplineScatteredDataPointSetToImageFilter
+      <DisplacementFieldPointSetType, DisplacementFieldType> BSplineFilterType;
+    typedef typename BSplineFilterType::WeightsContainerType WeightsContainerType;
 
-  typename WeightsContainerType::Pointer weights = WeightsContainerType::New();
-  weights->Initialize();
-  const typename WeightsContainerType::Element boundaryWeight = 1.0e10;
-  const typename WeightsContainerType::Element weight = 1.0;
+    typename WeightsContainerType::Pointer weights = WeightsContainerType::New();
+    weights->Initialize();
+    const typename WeightsContainerType::Element boundaryWeight = 1.0e10;
+    const typename WeightsContainerType::Element weight = 1.0;
 
-  typename DisplacementFieldPointSetType::Pointer fieldPoints = DisplacementFieldPointSetType::New();
-  fieldPoints->Initialize();
-  unsigned long count = 0;
+    typename DisplacementFieldPointSetType::Pointer fieldPoints = DisplacementFieldPointSetType::New();
+    fieldPoints->Initialize();
+    unsigned long count = 0;
 
-  typename PointSetType::PointsContainerConstIterator mIt =
-    movingLandmarks->GetPoints()->Begin();
-  typename PointSetType::PointDataContainerIterator mItD =
-    movingLandmarks->GetPointData()->Begin();
-
-  while( mItD != movingLandmarks->GetPointData()->End() )
-    {
-    typename PointSetType::PointsContainerConstIterator fIt =
-      fixedLandmarks->GetPoints()->Begin();
-    typename PointSetType::PointDataContainerIterator fItD =
-      fixedLandmarks->GetPointData()->Begin();
+    typename PointSetType::PointsContainerConstIterator mIt =
+      movingLandmarks->GetPoints()->Begin();
+    typename PointSetType::PointDataContainerIterator mItD =
+      movingLandmarks->GetPointData()->Begin();
 
-    while( fItD != fixedLandmarks->GetPointData()->End() )
+    while( mItD != movingLandmarks->GetPointData()->End() )
       {
-      if( fItD.Value() == mItD.Value() )
+      typename PointSetType::PointsContainerConstIterator fIt =
+        fixedLandmarks->GetPoints()->Begin();
+      typename PointSetType::PointDataContainerIterator fItD =
+        fixedLandmarks->GetPointData()->Begin();
+
+      while( fItD != fixedLandmarks->GetPointData()->End() )
         {
-        typename PointSetType::PointType fpoint = fIt.Value();
-        typename PointSetType::PointType mpoint = mIt.Value();
+        if( fItD.Value() == mItD.Value() )
+          {
+          typename PointSetType::PointType fpoint = fIt.Value();
+          typename PointSetType::PointType mpoint = mIt.Value();
 
-        VectorType vector;
+          VectorType vector;
 
-        typename LabelImageType::PointType fixedPhysicalPoint;
-        for( unsigned int i = 0; i < ImageDimension; i++ )
-          {
-          fixedPhysicalPoint[i] = fpoint[i];
-          vector[i] = mpoint[i] - fpoint[i];
-          }
+          typename LabelImageType::PointType fixedPhysicalPoint;
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            fixedPhysicalPoint[i] = fpoint[i];
+            vector[i] = mpoint[i] - fpoint[i];
+            }
 
-        itk::ContinuousIndex<double, ImageDimension> fixedCidx;
-        fixedImage->TransformPhysicalPointToContinuousIndex( fixedPhysicalPoint, fixedCidx );
+          itk::ContinuousIndex<double, ImageDimension> fixedCidx;
+          fixedImage->TransformPhysicalPointToContinuousIndex( fixedPhysicalPoint, fixedCidx );
 
-        typename DisplacementFieldType::PointType fieldPoint;
-        parametricInputImage->TransformContinuousIndexToPhysicalPoint( fixedCidx, fieldPoint );
+          typename DisplacementFieldType::PointType fieldPoint;
+          parametricInputImage->TransformContinuousIndexToPhysicalPoint( fixedCidx, fieldPoint );
 
-        fieldPoints->SetPoint( count, fieldPoint );
-        fieldPoints->SetPointData( count, vector );
+          fieldPoints->SetPoint( count, fieldPoint );
+          fieldPoints->SetPointData( count, vector );
 
-        if( useWeights )
-          {
-          std::vector<LabelType>::const_iterator it = std::find( userLabels.begin(), userLabels.end(), mItD.Value() );
-          if( it != userLabels.end() )
+          if( useWeights )
             {
-            weights->InsertElement( count, labelWeights[it - userLabels.begin()] );
+            std::vector<LabelType>::const_iterator it = std::find( userLabels.begin(), userLabels.end(), mItD.Value() );
+            if( it != userLabels.end() )
+              {
+              weights->InsertElement( count, labelWeights[it - userLabels.begin()] );
+              }
+            else
+              {
+              std::cerr << "Unspecified label " << mItD.Value() << " in specified user label weights." << std::endl;
+              return EXIT_FAILURE;
+              }
             }
           else
             {
-            std::cerr << "Unspecified label " << mItD.Value() << " in specified user label weights." << std::endl;
-            return EXIT_FAILURE;
+            weights->InsertElement( count, weight );
             }
-          }
-        else
-          {
-          weights->InsertElement( count, weight );
-          }
 
-        count++;
+          count++;
 
-        break;
+          break;
+          }
+        ++fItD;
+        ++fIt;
         }
-      ++fItD;
-      ++fIt;
-      }
-
-    ++mItD;
-    ++mIt;
-    }
 
-  bool enforceStationaryBoundary = true;
-  if( argc > 9 )
-    {
-    enforceStationaryBoundary = static_cast<bool>( atoi( argv[9] ) );
-    }
-  if( enforceStationaryBoundary )
-    {
-    typename LabelImageType::IndexType startIndex2 = fixedImage->GetLargestPossibleRegion().GetIndex();
+      ++mItD;
+      ++mIt;
+      }
 
-    typename LabelImageType::SizeType inputSize2 = fixedImage->GetLargestPossibleRegion().GetSize();
-    for( ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItF )
+    bool enforceStationaryBoundary = true;
+    if( argc > 9 )
+      {
+      enforceStationaryBoundary = static_cast<bool>( atoi( argv[9] ) );
+      }
+    if( enforceStationaryBoundary )
       {
-      typename LabelImageType::IndexType index = ItF.GetIndex();
+      typename LabelImageType::IndexType startIndex2 = fixedImage->GetLargestPossibleRegion().GetIndex();
 
-      bool isOnStationaryBoundary = false;
-      for( unsigned int d = 0; d < ImageDimension; d++ )
+      typename LabelImageType::SizeType inputSize2 = fixedImage->GetLargestPossibleRegion().GetSize();
+      for( ItF.GoToBegin(); !ItF.IsAtEnd(); ++ItF )
         {
-        if( index[d] == startIndex2[d] || index[d] == startIndex2[d] + static_cast<int>( inputSize2[d] ) - 1 )
+        typename LabelImageType::IndexType index = ItF.GetIndex();
+
+        bool isOnStationaryBoundary = false;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
           {
-          isOnStationaryBoundary = true;
-          break;
+          if( index[d] == startIndex2[d] || index[d] == startIndex2[d] + static_cast<int>( inputSize2[d] ) - 1 )
+            {
+            isOnStationaryBoundary = true;
+            break;
+            }
           }
-        }
 
-      if( isOnStationaryBoundary )
-        {
-        VectorType vector;
+        if( isOnStationaryBoundary )
+          {
+          VectorType vector;
 
-        vector.Fill( 0.0 );
+          vector.Fill( 0.0 );
 
-        typename PointSetType::PointType fixedPoint;
-        parametricInputImage->TransformIndexToPhysicalPoint( index, fixedPoint );
+          typename PointSetType::PointType fixedPoint;
+          parametricInputImage->TransformIndexToPhysicalPoint( index, fixedPoint );
 
-        fieldPoints->SetPoint( count, fixedPoint );
-        fieldPoints->SetPointData( count, vector );
-        weights->InsertElement( count, boundaryWeight );
-        count++;
+          fieldPoints->SetPoint( count, fixedPoint );
+          fieldPoints->SetPointData( count, vector );
+          weights->InsertElement( count, boundaryWeight );
+          count++;
+          }
         }
       }
-    }
 
-  typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
+    typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
 
-  unsigned int numberOfLevels = 4;
-  if( argc > 7 )
-    {
-    numberOfLevels = atoi( argv[7] );
-    }
-
-  unsigned int splineOrder = 3;
-  if( argc > 8 )
-    {
-    splineOrder = atoi( argv[8] );
-    }
+    unsigned int numberOfLevels = 4;
+    if( argc > 7 )
+      {
+      numberOfLevels = atoi( argv[7] );
+      }
 
+    unsigned int splineOrder = 3;
+    if( argc > 8 )
+      {
+      splineOrder = atoi( argv[8] );
+      }
 
-  typename BSplineFilterType::ArrayType ncps;
-  ncps.Fill( 1 + splineOrder );
 
-  if( argc > 6 )
-    {
-    std::vector<unsigned int> meshSize = ConvertVector<unsigned int>( std::string( argv[6] ) );
+    typename BSplineFilterType::ArrayType ncps;
+    ncps.Fill( 1 + splineOrder );
 
-    if( meshSize.size() == 1 )
+    if( argc > 6 )
       {
-      ncps.Fill( meshSize[0] + splineOrder );
-      }
-    else if( meshSize.size() == ImageDimension )
-      {
-      for( unsigned int d = 0; d < ImageDimension; d++ )
+      std::vector<unsigned int> meshSize = ConvertVector<unsigned int>( std::string( argv[6] ) );
+
+      if( meshSize.size() == 1 )
         {
-        ncps[d] = meshSize[d] + splineOrder;
+        ncps.Fill( meshSize[0] + splineOrder );
+        }
+      else if( meshSize.size() == ImageDimension )
+        {
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          ncps[d] = meshSize[d] + splineOrder;
+          }
+        }
+      else
+        {
+        std::cerr << "Invalid meshSize format." << std::endl;
         }
       }
-    else
-      {
-      std::cerr << "Invalid meshSize format." << std::endl;
-      }
-    }
 
-  bspliner->SetOrigin( fixedImage->GetOrigin() );
-  bspliner->SetSpacing( fixedImage->GetSpacing() );
-  bspliner->SetSize( fixedImage->GetLargestPossibleRegion().GetSize() );
-  bspliner->SetDirection( fixedImage->GetDirection() );
-  bspliner->SetGenerateOutputImage( true );
-  bspliner->SetNumberOfLevels( numberOfLevels );
-  bspliner->SetSplineOrder( splineOrder );
-  bspliner->SetNumberOfControlPoints( ncps );
-  bspliner->SetInput( fieldPoints );
-  bspliner->SetPointWeights( weights );
-  bspliner->Update();
-
-  typedef itk::ImageFileWriter<DisplacementFieldType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetFileName( argv[5] );
-  writer->SetInput( bspliner->GetOutput() );
-  writer->Update();
+    bspliner->SetOrigin( fixedImage->GetOrigin() );
+    bspliner->SetSpacing( fixedImage->GetSpacing() );
+    bspliner->SetSize( fixedImage->GetLargestPossibleRegion().GetSize() );
+    bspliner->SetDirection( fixedImage->GetDirection() );
+    bspliner->SetGenerateOutputImage( true );
+    bspliner->SetNumberOfLevels( numberOfLevels );
+    bspliner->SetSplineOrder( splineOrder );
+    bspliner->SetNumberOfControlPoints( ncps );
+    bspliner->SetInput( fieldPoints );
+    bspliner->SetPointWeights( weights );
+    bspliner->Update();
+
+    typedef itk::ImageFileWriter<DisplacementFieldType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( outputFileNames[i].c_str() );
+    writer->SetInput( bspliner->GetOutput() );
+    writer->Update();
+    }
 
   return EXIT_SUCCESS;
 }
@@ -566,6 +543,8 @@ private:
     std::cerr << "     \"labelWeight\" " << std::endl;
     std::cerr << "    If the latter format is used, the label weights are assumed to be arranged in ascending order by label."
       << std::endl;
+    std::cerr << " 4) Comma separated moving images and output transforms are fitted in turn to the" << std::endl;
+    std::cerr << "    landmarks of the fixed image, which are only computed once." << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
@@ -19,6 +19,7 @@
 #include "antsAllocImage.h"
 #include "ReadWriteData.h"
 #include "antsCommandLineParser.h"
+#include "antsDiffusionDirections.h"
 #include "itkCSVNumericObjectFileWriter.h"
 #include "itkImageRegistrationMethodv4.h"
 #include "itkSyNImageRegistrationMethod.h"
@@ -64,6 +65,8 @@
 #include "itkResampleImageFilter.h"
 #include "itkShrinkImageFilter.h"
 #include "itkTimeProbe.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
 #include "itkSimilarity2DTransform.h"
@@ -428,6 +431,910 @@ AverageTimeImages( typename TImageIn::Pointer image_in,  typename TImageOut::Poi
   return;
 }
 
+/** \class MotionCorrectionStage
+ * \brief Registration of the volumes of the time series for one stage of ants_motion.
+ *
+ * The members hold the state that is shared by all the volumes of a stage.  They keep
+ * the names of the ants_motion variables that RegisterTimePoint() used when it was the
+ * body of the time point loop.  With a fixed reference (and also when each volume is
+ * registered to its neighbor) the volumes only read the shared state, so they can be
+ * registered on several workers.  Each volume writes to its own row of param_values and
+ * to its own slice of the outputs which keeps the results independent of the order in
+ * which the workers pick up the volumes.
+ */
+template <unsigned int ImageDimension>
+class MotionCorrectionStage
+{
+public:
+  typedef MotionCorrectionStage Self;
+
+  typedef float                                       PixelType;
+  typedef double                                      RealType;
+  typedef itk::Image<PixelType, ImageDimension>       FixedImageType;
+  typedef itk::Image<PixelType, ImageDimension + 1>   MovingIOImageType;
+  typedef itk::Image<PixelType, ImageDimension + 1>   MovingImageType;
+  typedef itk::Vector<RealType, ImageDimension+1>     VectorIOType;
+  typedef itk::Image<VectorIOType, ImageDimension+1>  DisplacementIOFieldType;
+  typedef itk::Vector<RealType, ImageDimension>       VectorType;
+  typedef itk::Image<VectorType, ImageDimension>      DisplacementFieldType;
+  typedef vnl_matrix<RealType>                        vMatrix;
+  typedef itk::CompositeTransform<RealType, ImageDimension>                                   CompositeTransformType;
+  typedef itk::AffineTransform<RealType, ImageDimension>                                      AffineTransformType;
+  typedef itk::ImageRegistrationMethodv4<FixedImageType, FixedImageType, AffineTransformType> AffineRegistrationType;
+  typedef itk::ants::CommandLineParser ParserType;
+  typedef ParserType::OptionType       OptionType;
+
+  MotionCorrectionStage( vMatrix & _param_values, unsigned int & _nparams,
+                         std::vector<typename CompositeTransformType::Pointer> & _CompositeTransformVector ) :
+    param_values( _param_values ),
+    nparams( _nparams ),
+    CompositeTransformVector( _CompositeTransformVector ),
+    m_IsParallel( false ),
+    m_NextTimePoint( 0 ),
+    m_Status( EXIT_SUCCESS )
+  {
+  }
+
+  /** Register a single volume of the time series. */
+  int RegisterTimePoint( unsigned int timedim )
+  {
+    typename FixedImageType::Pointer fixed_time_slice = ITK_NULLPTR;
+    typename FixedImageType::Pointer moving_time_slice = ITK_NULLPTR;
+
+    typename CompositeTransformType::Pointer compositeTransform = ITK_NULLPTR;
+    if( CompositeTransformVector.size() == timedims && !CompositeTransformVector[timedim].IsNull() )
+      {
+      compositeTransform = CompositeTransformVector[timedim];
+      if( timedim == 0 && currentStage != static_cast<int>(numberOfStages) - 1 )
+        {
+        if ( verbose ) std::cout << " use existing transform " << compositeTransform->GetParameters() << std::endl;
+        }
+      }
+    typedef itk::IdentityTransform<RealType, ImageDimension> IdentityTransformType;
+    typename IdentityTransformType::Pointer identityTransform = IdentityTransformType::New();
+    //
+    // the time series (and the fixed image) are shared by the workers so the filters
+    // which read them, and hence modify their requested regions, are run one at a time
+    if( this->m_IsParallel )
+      {
+      this->m_ExtractionMutex.Lock();
+      }
+    typedef itk::ExtractImageFilter<MovingImageType, FixedImageType> ExtractFilterType;
+    typename MovingImageType::RegionType extractRegion = movingImage->GetLargestPossibleRegion();
+    extractRegion.SetSize(ImageDimension, 0);
+    bool maptoneighbor = true;
+    typename OptionType::Pointer fixedOption =
+      parser->GetOption( "useFixedReferenceImage" );
+    if( fixedOption && fixedOption->GetNumberOfFunctions() )
+      {
+      std::string fixedFunction = fixedOption->GetFunction( 0 )->GetName();
+      ConvertToLowerCase( fixedFunction );
+      if( fixedFunction.compare( "1" ) == 0 || fixedFunction.compare( "true" ) == 0 )
+        {
+        if( timedim == 0 )
+          {
+          if ( verbose ) std::cout << "using fixed reference image for all frames " << std::endl;
+          }
+        fixed_time_slice = fixedImage;
+        extractRegion.SetIndex(ImageDimension, timedim );
+        typename ExtractFilterType::Pointer extractFilter2 = ExtractFilterType::New();
+        extractFilter2->SetInput( movingImage );
+        extractFilter2->SetDirectionCollapseToSubmatrix();
+        if( ImageDimension == 2 )
+          {
+          extractFilter2->SetDirectionCollapseToIdentity();
+          }
+        extractFilter2->SetExtractionRegion( extractRegion );
+        extractFilter2->Update();
+        moving_time_slice = extractFilter2->GetOutput();
+        maptoneighbor = false;
+        }
+      }
+
+    if( maptoneighbor )
+      {
+      extractRegion.SetIndex(ImageDimension, timedim );
+      typename ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
+      extractFilter->SetInput( movingImage );
+      extractFilter->SetDirectionCollapseToSubmatrix();
+      if( ImageDimension == 2 )
+        {
+        extractFilter->SetDirectionCollapseToIdentity();
+        }
+      extractFilter->SetExtractionRegion( extractRegion );
+      extractFilter->Update();
+      fixed_time_slice = extractFilter->GetOutput();
+      unsigned int td = timedim + 1;
+      if( td > timedims - 1 )
+        {
+        td = timedims - 1;
+        }
+      extractRegion.SetIndex(ImageDimension, td );
+      typename ExtractFilterType::Pointer extractFilter2 = ExtractFilterType::New();
+      extractFilter2->SetInput( movingImage );
+      extractFilter2->SetDirectionCollapseToSubmatrix();
+      if( ImageDimension == 2 )
+        {
+        extractFilter->SetDirectionCollapseToIdentity();
+        }
+      extractFilter2->SetExtractionRegion( extractRegion );
+      extractFilter2->Update();
+      moving_time_slice = extractFilter2->GetOutput();
+      }
+
+    typename FixedImageType::Pointer preprocessFixedImage =
+      PreprocessImage<FixedImageType>( fixed_time_slice, 0,
+                                       1, 0.001, 0.999,
+                                       ITK_NULLPTR );
+
+    typename FixedImageType::Pointer preprocessMovingImage =
+      PreprocessImage<FixedImageType>( moving_time_slice,
+                                       0, 1,
+                                       0.001, 0.999,
+                                       preprocessFixedImage );
+    if( this->m_IsParallel )
+      {
+      this->m_ExtractionMutex.Unlock();
+      }
+
+    typedef itk::ImageToImageMetricv4<FixedImageType, FixedImageType> MetricType;
+    typename MetricType::Pointer metric;
+
+    std::string whichMetric = metricOption->GetFunction( currentStage )->GetName();
+    ConvertToLowerCase( whichMetric );
+
+    float samplingPercentage = 1.0;
+    if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 5 )
+      {
+      samplingPercentage = parser->Convert<float>( metricOption->GetFunction( currentStage )->GetParameter(  5 ) );
+      }
+
+    std::string samplingStrategy = "";
+    if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 4 )
+      {
+      samplingStrategy = metricOption->GetFunction( currentStage )->GetParameter(  4 );
+      }
+    ConvertToLowerCase( samplingStrategy );
+    typename AffineRegistrationType::MetricSamplingStrategyType metricSamplingStrategy = AffineRegistrationType::NONE;
+    if( std::strcmp( samplingStrategy.c_str(), "random" ) == 0 )
+      {
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "  random sampling (percentage = " << samplingPercentage << ")" << std::endl;
+        }
+      metricSamplingStrategy = AffineRegistrationType::RANDOM;
+      }
+    if( std::strcmp( samplingStrategy.c_str(), "regular" ) == 0 )
+      {
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "  regular sampling (percentage = " << samplingPercentage << ")" << std::endl;
+        }
+      metricSamplingStrategy = AffineRegistrationType::REGULAR;
+      }
+
+    if( std::strcmp( whichMetric.c_str(), "cc" ) == 0 )
+      {
+      unsigned int radiusOption = parser->Convert<unsigned int>( metricOption->GetFunction( currentStage )->GetParameter(  3 ) );
+
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "  using the CC metric (radius = " << radiusOption << ")." << std::endl;
+        }
+      typedef itk::ANTSNeighborhoodCorrelationImageToImageMetricv4<FixedImageType,
+        FixedImageType> CorrelationMetricType;
+      typename CorrelationMetricType::Pointer correlationMetric = CorrelationMetricType::New();
+      typename CorrelationMetricType::RadiusType radius;
+      radius.Fill( radiusOption );
+      correlationMetric->SetRadius( radius );
+      correlationMetric->SetUseMovingImageGradientFilter( false );
+      correlationMetric->SetUseFixedImageGradientFilter( false );
+
+      metric = correlationMetric;
+      }
+    else if( std::strcmp( whichMetric.c_str(), "mi" ) == 0 )
+      {
+      unsigned int binOption =
+        parser->Convert<unsigned int>( metricOption->GetFunction( currentStage )->GetParameter(  3 ) );
+      typedef itk::MattesMutualInformationImageToImageMetricv4<FixedImageType,
+                                                               FixedImageType> MutualInformationMetricType;
+      typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
+      mutualInformationMetric = mutualInformationMetric;
+      mutualInformationMetric->SetNumberOfHistogramBins( binOption );
+      mutualInformationMetric->SetUseMovingImageGradientFilter( false );
+      mutualInformationMetric->SetUseFixedImageGradientFilter( false );
+      metric = mutualInformationMetric;
+      }
+    else if( std::strcmp( whichMetric.c_str(), "demons" ) == 0 )
+      {
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "  using the Demons metric." << std::endl;
+        }
+      typedef itk::MeanSquaresImageToImageMetricv4<FixedImageType, FixedImageType> DemonsMetricType;
+      typename DemonsMetricType::Pointer demonsMetric = DemonsMetricType::New();
+      demonsMetric = demonsMetric;
+      metric = demonsMetric;
+      }
+    else if( std::strcmp( whichMetric.c_str(), "gc" ) == 0 )
+      {
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "  using the global correlation metric." << std::endl;
+        }
+      typedef itk::CorrelationImageToImageMetricv4<FixedImageType, FixedImageType> corrMetricType;
+      typename corrMetricType::Pointer corrMetric = corrMetricType::New();
+      metric = corrMetric;
+      if ( verbose ) std::cout << " global corr metric set " << std::endl;
+      }
+    else
+      {
+      std::cerr << "ERROR: Unrecognized image metric: " << whichMetric << std::endl;
+      return EXIT_FAILURE;
+      }
+    metric->SetVirtualDomainFromImage(  fixed_time_slice );
+
+    typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType> ScalesEstimatorType;
+    typename ScalesEstimatorType::Pointer scalesEstimator = ScalesEstimatorType::New();
+    scalesEstimator->SetMetric( metric );
+    scalesEstimator->SetTransformForward( true );
+
+    float learningRate = parser->Convert<float>( transformOption->GetFunction( currentStage )->GetParameter(  0 ) );
+
+    typedef itk::ConjugateGradientLineSearchOptimizerv4 OptimizerType;
+    OptimizerType::Pointer optimizer = OptimizerType::New();
+    optimizer->SetNumberOfIterations( iterations[0] );
+    optimizer->SetMinimumConvergenceValue( 1.e-7 );
+    optimizer->SetConvergenceWindowSize( 10 );
+    optimizer->SetLowerLimit( 0 );
+    optimizer->SetUpperLimit( 2 );
+    optimizer->SetEpsilon( 0.1 );
+
+    typename OptionType::Pointer scalesOption = parser->GetOption( "useScalesEstimator" );
+    if( scalesOption && scalesOption->GetNumberOfFunctions() )
+      {
+      std::string scalesFunction = scalesOption->GetFunction( 0 )->GetName();
+      ConvertToLowerCase( scalesFunction );
+      if( scalesFunction.compare( "1" ) == 0 || scalesFunction.compare( "true" ) == 0 )
+        {
+        if( timedim == 0 )
+          {
+          if ( verbose ) std::cout << " employing scales estimator " << std::endl;
+          }
+        optimizer->SetScalesEstimator( scalesEstimator );
+        }
+      else
+        {
+        if( timedim == 0 )
+          {
+          if ( verbose ) std::cout << " not employing scales estimator " << scalesFunction << std::endl;
+          }
+        }
+      }
+    optimizer->SetMaximumStepSizeInPhysicalUnits( learningRate );
+    optimizer->SetDoEstimateLearningRateOnce( doEstimateLearningRateOnce );
+    optimizer->SetDoEstimateLearningRateAtEachIteration( !doEstimateLearningRateOnce );
+    //    optimizer->SetMaximumNewtonStepSizeInPhysicalUnits(sqrt(small_step)*learningR);
+
+    // Set up the image registration methods along with the transforms
+    std::string whichTransform = transformOption->GetFunction( currentStage )->GetName();
+    ConvertToLowerCase( whichTransform );
+
+    // initialize with moments
+    typedef typename itk::ImageMomentsCalculator<FixedImageType> ImageCalculatorType;
+    typename ImageCalculatorType::Pointer calculator1 =
+      ImageCalculatorType::New();
+    typename ImageCalculatorType::Pointer calculator2 =
+      ImageCalculatorType::New();
+    calculator1->SetImage(  fixed_time_slice );
+    calculator2->SetImage(  moving_time_slice );
+    typename ImageCalculatorType::VectorType fixed_center;
+    fixed_center.Fill(0);
+    typename ImageCalculatorType::VectorType moving_center;
+    moving_center.Fill(0);
+    try
+      {
+      calculator1->Compute();
+      fixed_center = calculator1->GetCenterOfGravity();
+      try
+        {
+        calculator2->Compute();
+        moving_center = calculator2->GetCenterOfGravity();
+        }
+      catch( ... )
+        {
+        fixed_center.Fill(0);
+        }
+      }
+    catch( ... )
+      {
+      // Rcpp::Rcerr << " zero image1 error ";
+      }
+    typename AffineTransformType::OffsetType trans;
+    itk::Point<RealType, ImageDimension> trans2;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      trans[i] = moving_center[i] - fixed_center[i];
+      trans2[i] =  fixed_center[i];
+      }
+    if( std::strcmp( whichTransform.c_str(), "affine" ) == 0 )
+      {
+      typename AffineRegistrationType::Pointer affineRegistration = AffineRegistrationType::New();
+      typename AffineTransformType::Pointer affineTransform = AffineTransformType::New();
+      affineTransform->SetIdentity();
+      affineTransform->SetOffset( trans );
+      affineTransform->SetCenter( trans2 );
+      nparams = affineTransform->GetNumberOfParameters() + 2;
+      metric->SetFixedImage( preprocessFixedImage );
+      metric->SetVirtualDomainFromImage( preprocessFixedImage );
+      metric->SetMovingImage( preprocessMovingImage );
+      metric->SetMovingTransform( affineTransform );
+      typename ScalesEstimatorType::ScalesType scales(affineTransform->GetNumberOfParameters() );
+      typename MetricType::ParametersType      newparams(  affineTransform->GetParameters() );
+      metric->SetParameters( newparams );
+      metric->Initialize();
+      scalesEstimator->SetMetric(metric);
+      scalesEstimator->EstimateScales(scales);
+      optimizer->SetScales(scales);
+      if( compositeTransform->GetNumberOfTransforms() > 0 )
+        {
+        affineRegistration->SetMovingInitialTransform( compositeTransform );
+        }
+      affineRegistration->SetFixedImage( preprocessFixedImage );
+      affineRegistration->SetMovingImage( preprocessMovingImage );
+      affineRegistration->SetNumberOfLevels( numberOfLevels );
+      affineRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
+      affineRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
+      affineRegistration->SetMetricSamplingStrategy( metricSamplingStrategy );
+      affineRegistration->SetMetricSamplingPercentage( samplingPercentage );
+      if( this->m_IsParallel )
+        {
+        affineRegistration->MetricSamplingReinitializeSeed( Self::GetRandomSeedForTimePoint( timedim ) );
+        }
+      affineRegistration->SetMetric( metric );
+      affineRegistration->SetOptimizer( optimizer );
+
+      typedef CommandIterationUpdate<AffineRegistrationType> AffineCommandType;
+      typename AffineCommandType::Pointer affineObserver = AffineCommandType::New();
+      affineObserver->SetNumberOfIterations( iterations );
+
+      affineRegistration->AddObserver( itk::IterationEvent(), affineObserver );
+
+      try
+        {
+        if ( verbose ) std::cout << std::endl << "*** Running affine registration ***" << timedim << std::endl << std::endl;
+        affineRegistration->Update();
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        std::cerr << "Exception caught: " << e << std::endl;
+        return EXIT_FAILURE;
+        }
+      compositeTransform->AddTransform( affineRegistration->GetModifiableTransform() );
+      // Write out the affine transform
+      std::string filename = outputPrefix + std::string("TimeSlice") + ants_moco_to_string<unsigned int>(timedim)
+        + std::string( "Affine.txt" );
+      typedef itk::TransformFileWriter TransformWriterType;
+      typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
+      transformWriter->SetInput( affineRegistration->GetOutput()->Get() );
+      transformWriter->SetFileName( filename.c_str() );
+      //      transformWriter->Update();
+      if( timedim == 0 )
+        {
+        param_values.set_size(timedims, nparams);
+        param_values.fill(0);
+        }
+      for( unsigned int i = 0; i < nparams - 2; i++ )
+        {
+        param_values(timedim, i + 2) = affineRegistration->GetOutput()->Get()->GetParameters()[i];
+        }
+      }
+    else if( std::strcmp( whichTransform.c_str(), "rigid" ) == 0 )
+      {
+      typedef typename RigidTransformTraits<ImageDimension>::TransformType RigidTransformType;
+      typename RigidTransformType::Pointer rigidTransform = RigidTransformType::New();
+      rigidTransform->SetOffset( trans );
+      rigidTransform->SetCenter( trans2 );
+      nparams = rigidTransform->GetNumberOfParameters() + 2;
+      typedef itk::ImageRegistrationMethodv4<FixedImageType, FixedImageType,
+                                             RigidTransformType> RigidRegistrationType;
+      typename RigidRegistrationType::Pointer rigidRegistration = RigidRegistrationType::New();
+      metric->SetFixedImage( preprocessFixedImage );
+      metric->SetVirtualDomainFromImage( preprocessFixedImage );
+      metric->SetMovingImage( preprocessMovingImage );
+      metric->SetMovingTransform( rigidTransform );
+      typename ScalesEstimatorType::ScalesType
+        scales(  rigidTransform->GetNumberOfParameters() );
+      typename MetricType::ParametersType
+        newparams(  rigidTransform->GetParameters() );
+      metric->SetParameters( newparams );
+      metric->Initialize();
+      scalesEstimator->SetMetric(metric);
+      scalesEstimator->EstimateScales(scales);
+      optimizer->SetScales(scales);
+      rigidRegistration->SetFixedImage( preprocessFixedImage );
+      rigidRegistration->SetMovingImage( preprocessMovingImage );
+      rigidRegistration->SetNumberOfLevels( numberOfLevels );
+      rigidRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
+      rigidRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
+      rigidRegistration->SetMetric( metric );
+      rigidRegistration->SetMetricSamplingStrategy(
+        static_cast<typename RigidRegistrationType::MetricSamplingStrategyType>( metricSamplingStrategy ) );
+      rigidRegistration->SetMetricSamplingPercentage( samplingPercentage );
+      if( this->m_IsParallel )
+        {
+        rigidRegistration->MetricSamplingReinitializeSeed( Self::GetRandomSeedForTimePoint( timedim ) );
+        }
+      rigidRegistration->SetOptimizer( optimizer );
+      if( compositeTransform->GetNumberOfTransforms() > 0 )
+        {
+        rigidRegistration->SetMovingInitialTransform( compositeTransform );
+        }
+
+      typedef CommandIterationUpdate<RigidRegistrationType> RigidCommandType;
+      typename RigidCommandType::Pointer rigidObserver = RigidCommandType::New();
+      rigidObserver->SetNumberOfIterations( iterations );
+      rigidRegistration->AddObserver( itk::IterationEvent(), rigidObserver );
+      try
+        {
+        if ( verbose ) std::cout << std::endl << "*** Running rigid registration ***" << timedim  << std::endl << std::endl;
+        rigidRegistration->Update();
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        std::cerr << "Exception caught: " << e << std::endl;
+        return EXIT_FAILURE;
+        }
+      compositeTransform->AddTransform( rigidRegistration->GetModifiableTransform() );
+      // Write out the rigid transform
+      std::string filename = outputPrefix + std::string("TimeSlice") + ants_moco_to_string<unsigned int>(timedim)
+        + std::string( "Rigid.txt" );
+      typedef itk::TransformFileWriter TransformWriterType;
+      typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
+      transformWriter->SetInput( rigidRegistration->GetOutput()->Get() );
+      transformWriter->SetFileName( filename.c_str() );
+      //      transformWriter->Update();
+      if( timedim == 0 )
+        {
+        param_values.set_size(timedims, nparams);
+        param_values.fill(0);
+        }
+      for( unsigned int i = 0; i < nparams - 2; i++ )
+        {
+        param_values(timedim, i + 2) = rigidRegistration->GetOutput()->Get()->GetParameters()[i];
+        }
+      }
+    else if( std::strcmp( whichTransform.c_str(),
+                          "gaussiandisplacementfield" ) == 0 ||  std::strcmp( whichTransform.c_str(), "gdf" ) == 0 )
+      {
+      RealType sigmaForUpdateField = parser->Convert<float>( transformOption->GetFunction(
+                                                               currentStage )->GetParameter(  1 ) );
+      RealType sigmaForTotalField = parser->Convert<float>( transformOption->GetFunction(
+                                                              currentStage )->GetParameter(  2 ) );
+      const unsigned int VImageDimension = ImageDimension;
+      typedef itk::Vector<RealType, VImageDimension> VectorType;
+      VectorType zeroVector( 0.0 );
+      typedef itk::Image<VectorType, VImageDimension> DisplacementFieldType;
+      // ORIENTATION ALERT: Original code set image size to
+      // fixedImage buffered region, & if fixedImage BufferedRegion
+      // != LargestPossibleRegion, this code would be wrong.
+      typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>(
+          preprocessFixedImage, zeroVector );
+      typedef itk::GaussianSmoothingOnUpdateDisplacementFieldTransform<RealType,
+                                                                       VImageDimension>
+        GaussianDisplacementFieldTransformType;
+
+      typedef itk::ImageRegistrationMethodv4<FixedImageType, FixedImageType,
+                                             GaussianDisplacementFieldTransformType>
+        DisplacementFieldRegistrationType;
+      typename DisplacementFieldRegistrationType::Pointer displacementFieldRegistration =
+        DisplacementFieldRegistrationType::New();
+
+      typename GaussianDisplacementFieldTransformType::Pointer outputDisplacementFieldTransform =
+                                                                    displacementFieldRegistration->GetModifiableTransform();
+
+      // Create the transform adaptors
+
+      typedef itk::GaussianSmoothingOnUpdateDisplacementFieldTransformParametersAdaptor<GaussianDisplacementFieldTransformType> DisplacementFieldTransformAdaptorType;
+      typename DisplacementFieldRegistrationType::TransformParametersAdaptorsContainerType adaptors;
+
+      // Extract parameters
+      outputDisplacementFieldTransform->SetGaussianSmoothingVarianceForTheUpdateField( sigmaForUpdateField );
+      outputDisplacementFieldTransform->SetGaussianSmoothingVarianceForTheTotalField( sigmaForTotalField );
+      outputDisplacementFieldTransform->SetDisplacementField( displacementField );
+      for( unsigned int level = 0; level < numberOfLevels; level++ )
+        {
+        typedef itk::ShrinkImageFilter<DisplacementFieldType, DisplacementFieldType> ShrinkFilterType;
+        typename ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
+        shrinkFilter->SetShrinkFactors( shrinkFactorsPerLevel[level] );
+        shrinkFilter->SetInput( displacementField );
+        shrinkFilter->Update();
+        typename DisplacementFieldTransformAdaptorType::Pointer fieldTransformAdaptor =
+          DisplacementFieldTransformAdaptorType::New();
+        fieldTransformAdaptor->SetRequiredSpacing( shrinkFilter->GetOutput()->GetSpacing() );
+        fieldTransformAdaptor->SetRequiredSize( shrinkFilter->GetOutput()->GetBufferedRegion().GetSize() );
+        fieldTransformAdaptor->SetRequiredDirection( shrinkFilter->GetOutput()->GetDirection() );
+        fieldTransformAdaptor->SetRequiredOrigin( shrinkFilter->GetOutput()->GetOrigin() );
+        fieldTransformAdaptor->SetTransform( outputDisplacementFieldTransform );
+        adaptors.push_back( fieldTransformAdaptor.GetPointer() );
+        }
+      displacementFieldRegistration->SetFixedImage( 0, preprocessFixedImage );
+      displacementFieldRegistration->SetMovingImage( 0, preprocessMovingImage );
+      displacementFieldRegistration->SetMetric( metric );
+      displacementFieldRegistration->SetNumberOfLevels( numberOfLevels );
+      displacementFieldRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
+      displacementFieldRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
+      displacementFieldRegistration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits( false );
+      displacementFieldRegistration->SetMetricSamplingStrategy(
+        static_cast<typename DisplacementFieldRegistrationType::MetricSamplingStrategyType>( metricSamplingStrategy ) );
+      displacementFieldRegistration->SetMetricSamplingPercentage( samplingPercentage );
+      if( this->m_IsParallel )
+        {
+        displacementFieldRegistration->MetricSamplingReinitializeSeed( Self::GetRandomSeedForTimePoint( timedim ) );
+        }
+      displacementFieldRegistration->SetOptimizer( optimizer );
+      displacementFieldRegistration->SetTransformParametersAdaptorsPerLevel( adaptors );
+      if( compositeTransform->GetNumberOfTransforms() > 0 )
+        {
+        displacementFieldRegistration->SetMovingInitialTransform( compositeTransform );
+        }
+      try
+        {
+        displacementFieldRegistration->Update();
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        std::cerr << "Exception caught: " << e << std::endl;
+        return EXIT_FAILURE;
+        }
+      compositeTransform->AddTransform( outputDisplacementFieldTransform );
+      if( timedim == 0 )
+        {
+        param_values.set_size(timedims, nparams);
+        param_values.fill(0);
+        }
+      }
+    else if( std::strcmp( whichTransform.c_str(),
+                          "SyN" ) == 0 ||  std::strcmp( whichTransform.c_str(), "syn" ) == 0 )
+      {
+      RealType sigmaForUpdateField = parser->Convert<float>( transformOption->GetFunction(
+                                                               currentStage )->GetParameter(  1 ) );
+      RealType sigmaForTotalField = parser->Convert<float>( transformOption->GetFunction(
+                                                              currentStage )->GetParameter(  2 ) );
+      const unsigned int VImageDimension = ImageDimension;
+      typedef itk::Vector<RealType, VImageDimension> VectorType;
+      VectorType zeroVector( 0.0 );
+      typedef itk::Image<VectorType, VImageDimension> DisplacementFieldType;
+
+      typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>(
+          preprocessFixedImage, zeroVector );
+
+      typename DisplacementFieldType::Pointer inverseDisplacementField = AllocImage<DisplacementFieldType>(
+          preprocessFixedImage, zeroVector );
+
+      typedef itk::DisplacementFieldTransform<RealType, VImageDimension> DisplacementFieldTransformType;
+      typedef itk::SyNImageRegistrationMethod<FixedImageType, FixedImageType,
+                                              DisplacementFieldTransformType> DisplacementFieldRegistrationType;
+      typename DisplacementFieldRegistrationType::Pointer displacementFieldRegistration =
+        DisplacementFieldRegistrationType::New();
+
+      typename DisplacementFieldTransformType::Pointer outputDisplacementFieldTransform =
+                                                                displacementFieldRegistration->GetModifiableTransform();
+
+      // Create the transform adaptors
+
+      typedef itk::DisplacementFieldTransformParametersAdaptor<DisplacementFieldTransformType>
+        DisplacementFieldTransformAdaptorType;
+      typename DisplacementFieldRegistrationType::TransformParametersAdaptorsContainerType adaptors;
+      // Create the transform adaptors
+      // For the gaussian displacement field, the specified variances are in image spacing terms
+      // and, in normal practice, we typically don't change these values at each level.  However,
+      // if the user wishes to add that option, they can use the class
+      // GaussianSmoothingOnUpdateDisplacementFieldTransformAdaptor
+      for( unsigned int level = 0; level < numberOfLevels; level++ )
+        {
+        // TODO:
+        // We use the shrink image filter to calculate the fixed parameters of the virtual
+        // domain at each level.  To speed up calculation and avoid unnecessary memory
+        // usage, we could calculate these fixed parameters directly.
+        typedef itk::ShrinkImageFilter<DisplacementFieldType, DisplacementFieldType> ShrinkFilterType;
+        typename ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
+        shrinkFilter->SetShrinkFactors( shrinkFactorsPerLevel[level] );
+        shrinkFilter->SetInput( displacementField );
+        shrinkFilter->Update();
+
+        typename DisplacementFieldTransformAdaptorType::Pointer fieldTransformAdaptor =
+          DisplacementFieldTransformAdaptorType::New();
+        fieldTransformAdaptor->SetRequiredSpacing( shrinkFilter->GetOutput()->GetSpacing() );
+        fieldTransformAdaptor->SetRequiredSize( shrinkFilter->GetOutput()->GetBufferedRegion().GetSize() );
+        fieldTransformAdaptor->SetRequiredDirection( shrinkFilter->GetOutput()->GetDirection() );
+        fieldTransformAdaptor->SetRequiredOrigin( shrinkFilter->GetOutput()->GetOrigin() );
+        fieldTransformAdaptor->SetTransform( outputDisplacementFieldTransform );
+
+        adaptors.push_back( fieldTransformAdaptor.GetPointer() );
+        }
+
+      // Extract parameters
+      typename DisplacementFieldRegistrationType::NumberOfIterationsArrayType numberOfIterationsPerLevel;
+      numberOfIterationsPerLevel.SetSize( numberOfLevels );
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << "SyN iterations:";
+        }
+      for( unsigned int d = 0; d < numberOfLevels; d++ )
+        {
+        numberOfIterationsPerLevel[d] = iterations[d]; // currentStageIterations[d];
+        if( timedim == 0 )
+          {
+          if ( verbose ) std::cout << numberOfIterationsPerLevel[d] << " ";
+          }
+        }
+      if( timedim == 0 )
+        {
+        if ( verbose ) std::cout << std::endl;
+        }
+
+      const RealType varianceForUpdateField = sigmaForUpdateField;
+      const RealType varianceForTotalField = sigmaForTotalField;
+      displacementFieldRegistration->SetFixedImage( 0, preprocessFixedImage );
+      displacementFieldRegistration->SetMovingImage( 0, preprocessMovingImage );
+      displacementFieldRegistration->SetMetric( metric );
+
+      if( compositeTransform->GetNumberOfTransforms() > 0 )
+        {
+        displacementFieldRegistration->SetMovingInitialTransform( compositeTransform );
+        }
+      displacementFieldRegistration->SetDownsampleImagesForMetricDerivatives( true );
+      displacementFieldRegistration->SetAverageMidPointGradients( false );
+      displacementFieldRegistration->SetNumberOfLevels( numberOfLevels );
+      displacementFieldRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
+      displacementFieldRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
+      displacementFieldRegistration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits( false );
+      displacementFieldRegistration->SetLearningRate( learningRate );
+      displacementFieldRegistration->SetConvergenceThreshold( 1.e-8 );
+      displacementFieldRegistration->SetConvergenceWindowSize( 10 );
+      displacementFieldRegistration->SetNumberOfIterationsPerLevel( numberOfIterationsPerLevel );
+      displacementFieldRegistration->SetTransformParametersAdaptorsPerLevel( adaptors );
+      displacementFieldRegistration->SetGaussianSmoothingVarianceForTheUpdateField( varianceForUpdateField );
+      displacementFieldRegistration->SetGaussianSmoothingVarianceForTheTotalField( varianceForTotalField );
+      outputDisplacementFieldTransform->SetDisplacementField( displacementField );
+      outputDisplacementFieldTransform->SetInverseDisplacementField( inverseDisplacementField );
+      try
+        {
+        displacementFieldRegistration->Update();
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        std::cerr << "Exception caught: " << e << std::endl;
+        return EXIT_FAILURE;
+        }
+      // Add calculated transform to the composite transform
+      compositeTransform->AddTransform( outputDisplacementFieldTransform );
+      if( timedim == 0 )
+        {
+        param_values.set_size(timedims, nparams);
+        param_values.fill(0);
+        }
+      }
+    else
+      {
+      std::cerr << "ERROR:  Unrecognized transform option - " << whichTransform << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( currentStage == static_cast<int>(numberOfStages) - 1 )
+      {
+      param_values(timedim, 1) = metric->GetValue();
+      }
+    // resample the moving image and then put it in its place
+    typedef itk::ResampleImageFilter<FixedImageType, FixedImageType> ResampleFilterType;
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetTransform( compositeTransform );
+    resampler->SetInput( moving_time_slice );
+    resampler->SetOutputParametersFromImage( fixed_time_slice );
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->Update();
+    if ( verbose ) std::cout << " done resampling timepoint : " << timedim << std::endl;
+
+    /** Here, we put the resampled 3D image into the 4D volume */
+    typedef itk::ImageRegionIteratorWithIndex<FixedImageType> Iterator;
+    Iterator vfIter2(  resampler->GetOutput(), resampler->GetOutput()->GetLargestPossibleRegion() );
+    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+      {
+      typename FixedImageType::PixelType  fval = vfIter2.Get();
+      typename MovingImageType::IndexType ind;
+      for( unsigned int xx = 0; xx < ImageDimension; xx++ )
+        {
+        ind[xx] = vfIter2.GetIndex()[xx];
+        }
+      unsigned int tdim = timedim;
+      if( tdim > ( timedims - 1 ) )
+        {
+        tdim = timedims - 1;
+        }
+      ind[ImageDimension] = tdim;
+      outputImage->SetPixel(ind, fval);
+      }
+    if ( writeDisplacementField > 0 )
+      {
+      typedef typename
+      itk::TransformToDisplacementFieldFilter<DisplacementFieldType, RealType>
+        ConverterType;
+      typename ConverterType::Pointer converter = ConverterType::New();
+      converter->SetOutputOrigin( fixed_time_slice->GetOrigin() );
+      converter->SetOutputStartIndex(
+        fixed_time_slice->GetBufferedRegion().GetIndex() );
+      converter->SetSize( fixed_time_slice->GetBufferedRegion().GetSize() );
+      converter->SetOutputSpacing( fixed_time_slice->GetSpacing() );
+      converter->SetOutputDirection( fixed_time_slice->GetDirection() );
+      converter->SetTransform( compositeTransform );
+      converter->Update();
+      /** Here, we put the 3d tx into a 4d displacement field */
+      for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+        {
+        VectorType vec =
+          converter->GetOutput()->GetPixel( vfIter2.GetIndex() );
+        VectorIOType vecout;
+        vecout.Fill( 0 );
+        typename MovingIOImageType::IndexType ind;
+        for( unsigned int xx = 0; xx < ImageDimension; xx++ )
+          {
+          ind[xx] = vfIter2.GetIndex()[xx];
+          vecout[xx] = vec[xx];
+          }
+        unsigned int tdim = timedim;
+        if( tdim > ( timedims - 1 ) )
+          {
+          tdim = timedims - 1;
+          }
+        ind[ImageDimension] = tdim;
+        displacementout->SetPixel( ind, vecout );
+        }
+#
+      typename ConverterType::Pointer converter2 = ConverterType::New();
+      converter2->SetOutputOrigin( moving_time_slice->GetOrigin() );
+      converter2->SetOutputStartIndex(
+        moving_time_slice->GetBufferedRegion().GetIndex() );
+      converter2->SetSize( moving_time_slice->GetBufferedRegion().GetSize() );
+      converter2->SetOutputSpacing( moving_time_slice->GetSpacing() );
+      converter2->SetOutputDirection( moving_time_slice->GetDirection() );
+      converter2->SetTransform( compositeTransform->GetInverseTransform() );
+      converter2->Update();
+      /** Here, we put the 3d tx into a 4d displacement field */
+      typedef itk::ImageRegionIteratorWithIndex<FixedImageType> Iterator;
+      Iterator vfIterInv(  moving_time_slice,
+        moving_time_slice->GetLargestPossibleRegion() );
+      for(  vfIterInv.GoToBegin(); !vfIterInv.IsAtEnd(); ++vfIterInv )
+        {
+        VectorType vec =
+          converter2->GetOutput()->GetPixel( vfIterInv.GetIndex() );
+        VectorIOType vecout;
+        vecout.Fill( 0 );
+        typename MovingIOImageType::IndexType ind;
+        for( unsigned int xx = 0; xx < ImageDimension; xx++ )
+          {
+          ind[xx] = vfIterInv.GetIndex()[xx];
+          vecout[xx] = vec[xx];
+          }
+        unsigned int tdim = timedim;
+        if( tdim > ( timedims - 1 ) )
+          {
+          tdim = timedims - 1;
+          }
+        ind[ImageDimension] = tdim;
+        displacementinv->SetPixel( ind, vecout );
+        }
+      }
+    if( timedim == timedims - 1 )
+      {
+      this->last_fixed_time_slice = fixed_time_slice;
+      }
+    return EXIT_SUCCESS;
+  }
+
+  /** Register the volumes firstTimePoint, ..., timedims - 1 on numberOfWorkers threads
+   * which share the volumes dynamically.  Each worker runs its registrations with at
+   * most numberOfThreadsPerWorker threads. */
+  int RegisterTimePointsInParallel( unsigned int firstTimePoint, unsigned int numberOfWorkers,
+                                    unsigned int numberOfThreadsPerWorker )
+  {
+    this->m_IsParallel = true;
+    this->m_NextTimePoint = firstTimePoint;
+    this->m_Status = EXIT_SUCCESS;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfWorkers );
+    threader->SetSingleMethod( Self::RegisterTimePointsThreaderCallback, this );
+
+    // the filters, metrics and registration methods created by the workers
+    // take their number of threads from the global default
+    const itk::ThreadIdType defaultNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( numberOfThreadsPerWorker );
+    threader->SingleMethodExecute();
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( defaultNumberOfThreads );
+
+    this->m_IsParallel = false;
+    return this->m_Status;
+  }
+
+  itk::ants::CommandLineParser *                         parser;
+  unsigned int                                           verbose;
+  int                                                    currentStage;
+  unsigned int                                           numberOfStages;
+  typename OptionType::Pointer                           metricOption;
+  typename OptionType::Pointer                           transformOption;
+  std::vector<unsigned int>                              iterations;
+  unsigned int                                           numberOfLevels;
+  typename AffineRegistrationType::ShrinkFactorsArrayType   shrinkFactorsPerLevel;
+  typename AffineRegistrationType::SmoothingSigmasArrayType smoothingSigmasPerLevel;
+  bool                                                   doEstimateLearningRateOnce;
+  std::string                                            outputPrefix;
+  unsigned int                                           writeDisplacementField;
+  typename FixedImageType::Pointer                       fixedImage;
+  typename MovingImageType::Pointer                      movingImage;
+  unsigned int                                           timedims;
+  typename MovingIOImageType::Pointer                    outputImage;
+  typename DisplacementIOFieldType::Pointer              displacementout;
+  typename DisplacementIOFieldType::Pointer              displacementinv;
+  vMatrix &                                              param_values;
+  unsigned int &                                         nparams;
+  std::vector<typename CompositeTransformType::Pointer> & CompositeTransformVector;
+
+  /** The fixed time slice of the last volume, used as the average image. */
+  typename FixedImageType::Pointer last_fixed_time_slice;
+private:
+  MotionCorrectionStage( const Self & ); // purposely not implemented
+  void operator=( const Self & );        // purposely not implemented
+
+  /** Random sampling is seeded per volume so that the results do not depend on
+   * the order in which the workers create their registration methods. */
+  static int GetRandomSeedForTimePoint( unsigned int timedim )
+  {
+    return 19650218 + static_cast<int>( timedim );
+  }
+
+  static ITK_THREAD_RETURN_TYPE RegisterTimePointsThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                stage = static_cast<Self *>( info->UserData );
+
+    while( true )
+      {
+      stage->m_SchedulerMutex.Lock();
+      const unsigned int timedim = stage->m_NextTimePoint++;
+      const bool         hasFailed = ( stage->m_Status != EXIT_SUCCESS );
+      stage->m_SchedulerMutex.Unlock();
+
+      if( hasFailed || timedim >= stage->timedims )
+        {
+        break;
+        }
+
+      int status = EXIT_FAILURE;
+      try
+        {
+        status = stage->RegisterTimePoint( timedim );
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        std::cerr << "Exception caught while registering time point " << timedim << ": " << e << std::endl;
+        }
+      if( status != EXIT_SUCCESS )
+        {
+        stage->m_SchedulerMutex.Lock();
+        stage->m_Status = status;
+        stage->m_SchedulerMutex.Unlock();
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  bool                     m_IsParallel;
+  unsigned int             m_NextTimePoint;
+  int                      m_Status;
+  itk::SimpleFastMutexLock m_SchedulerMutex;
+  itk::SimpleFastMutexLock m_ExtractionMutex;
+};
+
 template <unsigned int ImageDimension>
 int ants_motion( itk::ants::CommandLineParser *parser )
 {
@@ -568,6 +1475,31 @@ int ants_motion( itk::ants::CommandLineParser *parser )
     writeDisplacementField = parser->Convert<unsigned int>( wdopt->GetFunction( 0 )->GetName() );
     }
 
+  unsigned int numberOfVolumeWorkers = 1;
+  unsigned int numberOfThreadsPerVolumeWorker = 1;
+  itk::ants::CommandLineParser::OptionType::Pointer parallelOption = parser->GetOption( "parallel-volumes" );
+  if( parallelOption && parallelOption->GetNumberOfFunctions() )
+    {
+    if( parallelOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      numberOfVolumeWorkers = parser->Convert<unsigned int>( parallelOption->GetFunction( 0 )->GetParameter( 0 ) );
+      }
+    else
+      {
+      numberOfVolumeWorkers = parser->Convert<unsigned int>( parallelOption->GetFunction( 0 )->GetName() );
+      }
+    numberOfVolumeWorkers = std::max( numberOfVolumeWorkers, 1u );
+    numberOfThreadsPerVolumeWorker = std::max(
+        static_cast<unsigned int>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ) / numberOfVolumeWorkers, 1u );
+    if( parallelOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+      {
+      numberOfThreadsPerVolumeWorker = std::max(
+          parser->Convert<unsigned int>( parallelOption->GetFunction( 0 )->GetParameter( 1 ) ), 1u );
+      }
+    if ( verbose ) std::cout << " registering " << numberOfVolumeWorkers << " volumes in parallel with "
+                             << numberOfThreadsPerVolumeWorker << " threads each" << std::endl;
+    }
+
   bool                doEstimateLearningRateOnce(false);
   OptionType::Pointer rateOption = parser->GetOption( "use-estimate-learning-rate-once" );
   if( rateOption && rateOption->GetNumberOfFunctions() )
@@ -591,6 +1523,10 @@ int ants_motion( itk::ants::CommandLineParser *parser )
   typename DisplacementIOFieldType::Pointer displacementout = ITK_NULLPTR;
   typename DisplacementIOFieldType::Pointer displacementinv = ITK_NULLPTR;
 
+  // the diffusion directions are given along the axes of the fixed image of the last stage
+  itk::Matrix<double, 3, 3> bvecPhysicalDirection;
+  bvecPhysicalDirection.SetIdentity();
+
   for( int currentStage = numberOfStages - 1; currentStage >= 0; currentStage-- )
     {
     if ( verbose ) std::cout << std::endl << "Stage " << numberOfStages - currentStage << std::endl;
@@ -604,13 +1540,19 @@ int ants_motion( itk::ants::CommandLineParser *parser )
     if ( verbose ) std::cout << "  fixed image: " << fixedImageFileName << std::endl;
     if ( verbose ) std::cout << "  moving image: " << movingImageFileName << std::endl;
     typename FixedImageType::Pointer fixed_time_slice = ITK_NULLPTR;
-    typename FixedImageType::Pointer moving_time_slice = ITK_NULLPTR;
     typename FixedIOImageType::Pointer fixedInImage;
     ReadImage<FixedIOImageType>( fixedInImage, fixedImageFileName.c_str() );
     fixedInImage->Update();
     fixedInImage->DisconnectPipeline();
     typename FixedImageType::Pointer fixedImage;
     fixedImage = arCastImage<FixedIOImageType, FixedImageType>( fixedInImage );
+    for( unsigned int d = 0; d < ImageDimension && d < 3; d++ )
+      {
+      for( unsigned int e = 0; e < ImageDimension && e < 3; e++ )
+        {
+        bvecPhysicalDirection(d, e) = fixedImage->GetDirection()(d, e);
+        }
+      }
 
     typename MovingIOImageType::Pointer movingInImage;
     typename MovingImageType::Pointer movingImage;
@@ -745,736 +1687,58 @@ int ants_motion( itk::ants::CommandLineParser *parser )
       {
       timelist.push_back(timedim);
       }
-    for( unsigned int timedim = 0; timedim < timedims; timedim++ )
+    MotionCorrectionStage<ImageDimension> stage( param_values, nparams, CompositeTransformVector );
+    stage.parser = parser;
+    stage.verbose = verbose;
+    stage.currentStage = currentStage;
+    stage.numberOfStages = numberOfStages;
+    stage.metricOption = metricOption;
+    stage.transformOption = transformOption;
+    stage.iterations = iterations;
+    stage.numberOfLevels = numberOfLevels;
+    stage.shrinkFactorsPerLevel = shrinkFactorsPerLevel;
+    stage.smoothingSigmasPerLevel = smoothingSigmasPerLevel;
+    stage.doEstimateLearningRateOnce = doEstimateLearningRateOnce;
+    stage.outputPrefix = outputPrefix;
+    stage.writeDisplacementField = writeDisplacementField;
+    stage.fixedImage = fixedImage;
+    stage.movingImage = movingImage;
+    stage.timedims = timedims;
+    stage.outputImage = outputImage;
+    stage.displacementout = displacementout;
+    stage.displacementinv = displacementinv;
+
+    if( currentStage == static_cast<int>(numberOfStages) - 1 )
       {
-      typename CompositeTransformType::Pointer compositeTransform = ITK_NULLPTR;
-      if( currentStage == static_cast<int>(numberOfStages) - 1 )
-        {
-        compositeTransform = CompositeTransformType::New();
-        CompositeTransformVector.push_back(compositeTransform);
-        }
-      else if( CompositeTransformVector.size() == timedims && !CompositeTransformVector[timedim].IsNull() )
-        {
-        compositeTransform = CompositeTransformVector[timedim];
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << " use existing transform " << compositeTransform->GetParameters() << std::endl;
-          }
-        }
-      typedef itk::IdentityTransform<RealType, ImageDimension> IdentityTransformType;
-      typename IdentityTransformType::Pointer identityTransform = IdentityTransformType::New();
-      //
-      typedef itk::ExtractImageFilter<MovingImageType, FixedImageType> ExtractFilterType;
-      typename MovingImageType::RegionType extractRegion = movingImage->GetLargestPossibleRegion();
-      extractRegion.SetSize(ImageDimension, 0);
-      bool maptoneighbor = true;
-      typename OptionType::Pointer fixedOption =
-        parser->GetOption( "useFixedReferenceImage" );
-      if( fixedOption && fixedOption->GetNumberOfFunctions() )
-        {
-        std::string fixedFunction = fixedOption->GetFunction( 0 )->GetName();
-        ConvertToLowerCase( fixedFunction );
-        if( fixedFunction.compare( "1" ) == 0 || fixedFunction.compare( "true" ) == 0 )
-          {
-          if( timedim == 0 )
-            {
-            if ( verbose ) std::cout << "using fixed reference image for all frames " << std::endl;
-            }
-          fixed_time_slice = fixedImage;
-          extractRegion.SetIndex(ImageDimension, timedim );
-          typename ExtractFilterType::Pointer extractFilter2 = ExtractFilterType::New();
-          extractFilter2->SetInput( movingImage );
-          extractFilter2->SetDirectionCollapseToSubmatrix();
-          if( ImageDimension == 2 )
-            {
-            extractFilter2->SetDirectionCollapseToIdentity();
-            }
-          extractFilter2->SetExtractionRegion( extractRegion );
-          extractFilter2->Update();
-          moving_time_slice = extractFilter2->GetOutput();
-          maptoneighbor = false;
-          }
-        }
-
-      if( maptoneighbor )
-        {
-        extractRegion.SetIndex(ImageDimension, timedim );
-        typename ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
-        extractFilter->SetInput( movingImage );
-        extractFilter->SetDirectionCollapseToSubmatrix();
-        if( ImageDimension == 2 )
-          {
-          extractFilter->SetDirectionCollapseToIdentity();
-          }
-        extractFilter->SetExtractionRegion( extractRegion );
-        extractFilter->Update();
-        fixed_time_slice = extractFilter->GetOutput();
-        unsigned int td = timedim + 1;
-        if( td > timedims - 1 )
-          {
-          td = timedims - 1;
-          }
-        extractRegion.SetIndex(ImageDimension, td );
-        typename ExtractFilterType::Pointer extractFilter2 = ExtractFilterType::New();
-        extractFilter2->SetInput( movingImage );
-        extractFilter2->SetDirectionCollapseToSubmatrix();
-        if( ImageDimension == 2 )
-          {
-          extractFilter->SetDirectionCollapseToIdentity();
-          }
-        extractFilter2->SetExtractionRegion( extractRegion );
-        extractFilter2->Update();
-        moving_time_slice = extractFilter2->GetOutput();
-        }
-
-      typename FixedImageType::Pointer preprocessFixedImage =
-        PreprocessImage<FixedImageType>( fixed_time_slice, 0,
-                                         1, 0.001, 0.999,
-                                         ITK_NULLPTR );
-
-      typename FixedImageType::Pointer preprocessMovingImage =
-        PreprocessImage<FixedImageType>( moving_time_slice,
-                                         0, 1,
-                                         0.001, 0.999,
-                                         preprocessFixedImage );
-
-      typedef itk::ImageToImageMetricv4<FixedImageType, FixedImageType> MetricType;
-      typename MetricType::Pointer metric;
-
-      std::string whichMetric = metricOption->GetFunction( currentStage )->GetName();
-      ConvertToLowerCase( whichMetric );
-
-      float samplingPercentage = 1.0;
-      if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 5 )
-        {
-        samplingPercentage = parser->Convert<float>( metricOption->GetFunction( currentStage )->GetParameter(  5 ) );
-        }
-
-      std::string samplingStrategy = "";
-      if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 4 )
-        {
-        samplingStrategy = metricOption->GetFunction( currentStage )->GetParameter(  4 );
-        }
-      ConvertToLowerCase( samplingStrategy );
-      typename AffineRegistrationType::MetricSamplingStrategyType metricSamplingStrategy = AffineRegistrationType::NONE;
-      if( std::strcmp( samplingStrategy.c_str(), "random" ) == 0 )
-        {
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "  random sampling (percentage = " << samplingPercentage << ")" << std::endl;
-          }
-        metricSamplingStrategy = AffineRegistrationType::RANDOM;
-        }
-      if( std::strcmp( samplingStrategy.c_str(), "regular" ) == 0 )
-        {
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "  regular sampling (percentage = " << samplingPercentage << ")" << std::endl;
-          }
-        metricSamplingStrategy = AffineRegistrationType::REGULAR;
-        }
-
-      if( std::strcmp( whichMetric.c_str(), "cc" ) == 0 )
-        {
-        unsigned int radiusOption = parser->Convert<unsigned int>( metricOption->GetFunction( currentStage )->GetParameter(  3 ) );
-
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "  using the CC metric (radius = " << radiusOption << ")." << std::endl;
-          }
-        typedef itk::ANTSNeighborhoodCorrelationImageToImageMetricv4<FixedImageType,
-          FixedImageType> CorrelationMetricType;
-        typename CorrelationMetricType::Pointer correlationMetric = CorrelationMetricType::New();
-        typename CorrelationMetricType::RadiusType radius;
-        radius.Fill( radiusOption );
-        correlationMetric->SetRadius( radius );
-        correlationMetric->SetUseMovingImageGradientFilter( false );
-        correlationMetric->SetUseFixedImageGradientFilter( false );
-
-        metric = correlationMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "mi" ) == 0 )
-        {
-        unsigned int binOption =
-          parser->Convert<unsigned int>( metricOption->GetFunction( currentStage )->GetParameter(  3 ) );
-        typedef itk::MattesMutualInformationImageToImageMetricv4<FixedImageType,
-                                                                 FixedImageType> MutualInformationMetricType;
-        typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
-        mutualInformationMetric = mutualInformationMetric;
-        mutualInformationMetric->SetNumberOfHistogramBins( binOption );
-        mutualInformationMetric->SetUseMovingImageGradientFilter( false );
-        mutualInformationMetric->SetUseFixedImageGradientFilter( false );
-        metric = mutualInformationMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "demons" ) == 0 )
-        {
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "  using the Demons metric." << std::endl;
-          }
-        typedef itk::MeanSquaresImageToImageMetricv4<FixedImageType, FixedImageType> DemonsMetricType;
-        typename DemonsMetricType::Pointer demonsMetric = DemonsMetricType::New();
-        demonsMetric = demonsMetric;
-        metric = demonsMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "gc" ) == 0 )
+      for( unsigned int timedim = 0; timedim < timedims; timedim++ )
         {
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "  using the global correlation metric." << std::endl;
-          }
-        typedef itk::CorrelationImageToImageMetricv4<FixedImageType, FixedImageType> corrMetricType;
-        typename corrMetricType::Pointer corrMetric = corrMetricType::New();
-        metric = corrMetric;
-        if ( verbose ) std::cout << " global corr metric set " << std::endl;
+        CompositeTransformVector.push_back( CompositeTransformType::New() );
         }
-      else
+      }
+    if( numberOfVolumeWorkers > 1 && timedims > 1 )
+      {
+      // the first volume sets up param_values
+      if( stage.RegisterTimePoint( 0 ) != EXIT_SUCCESS ||
+          stage.RegisterTimePointsInParallel( 1, numberOfVolumeWorkers, numberOfThreadsPerVolumeWorker ) != EXIT_SUCCESS )
         {
-        std::cerr << "ERROR: Unrecognized image metric: " << whichMetric << std::endl;
         return EXIT_FAILURE;
         }
-      metric->SetVirtualDomainFromImage(  fixed_time_slice );
-
-      typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType> ScalesEstimatorType;
-      typename ScalesEstimatorType::Pointer scalesEstimator = ScalesEstimatorType::New();
-      scalesEstimator->SetMetric( metric );
-      scalesEstimator->SetTransformForward( true );
-
-      float learningRate = parser->Convert<float>( transformOption->GetFunction( currentStage )->GetParameter(  0 ) );
-
-      typedef itk::ConjugateGradientLineSearchOptimizerv4 OptimizerType;
-      OptimizerType::Pointer optimizer = OptimizerType::New();
-      optimizer->SetNumberOfIterations( iterations[0] );
-      optimizer->SetMinimumConvergenceValue( 1.e-7 );
-      optimizer->SetConvergenceWindowSize( 10 );
-      optimizer->SetLowerLimit( 0 );
-      optimizer->SetUpperLimit( 2 );
-      optimizer->SetEpsilon( 0.1 );
-
-      typename OptionType::Pointer scalesOption = parser->GetOption( "useScalesEstimator" );
-      if( scalesOption && scalesOption->GetNumberOfFunctions() )
-        {
-        std::string scalesFunction = scalesOption->GetFunction( 0 )->GetName();
-        ConvertToLowerCase( scalesFunction );
-        if( scalesFunction.compare( "1" ) == 0 || scalesFunction.compare( "true" ) == 0 )
-          {
-          if( timedim == 0 )
-            {
-            if ( verbose ) std::cout << " employing scales estimator " << std::endl;
-            }
-          optimizer->SetScalesEstimator( scalesEstimator );
-          }
-        else
-          {
-          if( timedim == 0 )
-            {
-            if ( verbose ) std::cout << " not employing scales estimator " << scalesFunction << std::endl;
-            }
-          }
-        }
-      optimizer->SetMaximumStepSizeInPhysicalUnits( learningRate );
-      optimizer->SetDoEstimateLearningRateOnce( doEstimateLearningRateOnce );
-      optimizer->SetDoEstimateLearningRateAtEachIteration( !doEstimateLearningRateOnce );
-      //    optimizer->SetMaximumNewtonStepSizeInPhysicalUnits(sqrt(small_step)*learningR);
-
-      // Set up the image registration methods along with the transforms
-      std::string whichTransform = transformOption->GetFunction( currentStage )->GetName();
-      ConvertToLowerCase( whichTransform );
-
-      // initialize with moments
-      typedef typename itk::ImageMomentsCalculator<FixedImageType> ImageCalculatorType;
-      typename ImageCalculatorType::Pointer calculator1 =
-        ImageCalculatorType::New();
-      typename ImageCalculatorType::Pointer calculator2 =
-        ImageCalculatorType::New();
-      calculator1->SetImage(  fixed_time_slice );
-      calculator2->SetImage(  moving_time_slice );
-      typename ImageCalculatorType::VectorType fixed_center;
-      fixed_center.Fill(0);
-      typename ImageCalculatorType::VectorType moving_center;
-      moving_center.Fill(0);
-      try
-        {
-        calculator1->Compute();
-        fixed_center = calculator1->GetCenterOfGravity();
-        try
-          {
-          calculator2->Compute();
-          moving_center = calculator2->GetCenterOfGravity();
-          }
-        catch( ... )
-          {
-          fixed_center.Fill(0);
-          }
-        }
-      catch( ... )
-        {
-        // Rcpp::Rcerr << " zero image1 error ";
-        }
-      typename AffineTransformType::OffsetType trans;
-      itk::Point<RealType, ImageDimension> trans2;
-      for( unsigned int i = 0; i < ImageDimension; i++ )
-        {
-        trans[i] = moving_center[i] - fixed_center[i];
-        trans2[i] =  fixed_center[i];
-        }
-      if( std::strcmp( whichTransform.c_str(), "affine" ) == 0 )
-        {
-        typename AffineRegistrationType::Pointer affineRegistration = AffineRegistrationType::New();
-        typename AffineTransformType::Pointer affineTransform = AffineTransformType::New();
-        affineTransform->SetIdentity();
-        affineTransform->SetOffset( trans );
-        affineTransform->SetCenter( trans2 );
-        nparams = affineTransform->GetNumberOfParameters() + 2;
-        metric->SetFixedImage( preprocessFixedImage );
-        metric->SetVirtualDomainFromImage( preprocessFixedImage );
-        metric->SetMovingImage( preprocessMovingImage );
-        metric->SetMovingTransform( affineTransform );
-        typename ScalesEstimatorType::ScalesType scales(affineTransform->GetNumberOfParameters() );
-        typename MetricType::ParametersType      newparams(  affineTransform->GetParameters() );
-        metric->SetParameters( newparams );
-        metric->Initialize();
-        scalesEstimator->SetMetric(metric);
-        scalesEstimator->EstimateScales(scales);
-        optimizer->SetScales(scales);
-        if( compositeTransform->GetNumberOfTransforms() > 0 )
-          {
-          affineRegistration->SetMovingInitialTransform( compositeTransform );
-          }
-        affineRegistration->SetFixedImage( preprocessFixedImage );
-        affineRegistration->SetMovingImage( preprocessMovingImage );
-        affineRegistration->SetNumberOfLevels( numberOfLevels );
-        affineRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
-        affineRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-        affineRegistration->SetMetricSamplingStrategy( metricSamplingStrategy );
-        affineRegistration->SetMetricSamplingPercentage( samplingPercentage );
-        affineRegistration->SetMetric( metric );
-        affineRegistration->SetOptimizer( optimizer );
-
-        typedef CommandIterationUpdate<AffineRegistrationType> AffineCommandType;
-        typename AffineCommandType::Pointer affineObserver = AffineCommandType::New();
-        affineObserver->SetNumberOfIterations( iterations );
-
-        affineRegistration->AddObserver( itk::IterationEvent(), affineObserver );
-
-        try
-          {
-          if ( verbose ) std::cout << std::endl << "*** Running affine registration ***" << timedim << std::endl << std::endl;
-          affineRegistration->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          std::cerr << "Exception caught: " << e << std::endl;
-          return EXIT_FAILURE;
-          }
-        compositeTransform->AddTransform( affineRegistration->GetModifiableTransform() );
-        // Write out the affine transform
-        std::string filename = outputPrefix + std::string("TimeSlice") + ants_moco_to_string<unsigned int>(timedim)
-          + std::string( "Affine.txt" );
-        typedef itk::TransformFileWriter TransformWriterType;
-        typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
-        transformWriter->SetInput( affineRegistration->GetOutput()->Get() );
-        transformWriter->SetFileName( filename.c_str() );
-        //      transformWriter->Update();
-        if( timedim == 0 )
-          {
-          param_values.set_size(timedims, nparams);
-          param_values.fill(0);
-          }
-        for( unsigned int i = 0; i < nparams - 2; i++ )
-          {
-          param_values(timedim, i + 2) = affineRegistration->GetOutput()->Get()->GetParameters()[i];
-          }
-        }
-      else if( std::strcmp( whichTransform.c_str(), "rigid" ) == 0 )
-        {
-        typedef typename RigidTransformTraits<ImageDimension>::TransformType RigidTransformType;
-        typename RigidTransformType::Pointer rigidTransform = RigidTransformType::New();
-        rigidTransform->SetOffset( trans );
-        rigidTransform->SetCenter( trans2 );
-        nparams = rigidTransform->GetNumberOfParameters() + 2;
-        typedef itk::ImageRegistrationMethodv4<FixedImageType, FixedImageType,
-                                               RigidTransformType> RigidRegistrationType;
-        typename RigidRegistrationType::Pointer rigidRegistration = RigidRegistrationType::New();
-        metric->SetFixedImage( preprocessFixedImage );
-        metric->SetVirtualDomainFromImage( preprocessFixedImage );
-        metric->SetMovingImage( preprocessMovingImage );
-        metric->SetMovingTransform( rigidTransform );
-        typename ScalesEstimatorType::ScalesType
-          scales(  rigidTransform->GetNumberOfParameters() );
-        typename MetricType::ParametersType
-          newparams(  rigidTransform->GetParameters() );
-        metric->SetParameters( newparams );
-        metric->Initialize();
-        scalesEstimator->SetMetric(metric);
-        scalesEstimator->EstimateScales(scales);
-        optimizer->SetScales(scales);
-        rigidRegistration->SetFixedImage( preprocessFixedImage );
-        rigidRegistration->SetMovingImage( preprocessMovingImage );
-        rigidRegistration->SetNumberOfLevels( numberOfLevels );
-        rigidRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
-        rigidRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-        rigidRegistration->SetMetric( metric );
-        rigidRegistration->SetMetricSamplingStrategy(
-          static_cast<typename RigidRegistrationType::MetricSamplingStrategyType>( metricSamplingStrategy ) );
-        rigidRegistration->SetMetricSamplingPercentage( samplingPercentage );
-        rigidRegistration->SetOptimizer( optimizer );
-        if( compositeTransform->GetNumberOfTransforms() > 0 )
-          {
-          rigidRegistration->SetMovingInitialTransform( compositeTransform );
-          }
-
-        typedef CommandIterationUpdate<RigidRegistrationType> RigidCommandType;
-        typename RigidCommandType::Pointer rigidObserver = RigidCommandType::New();
-        rigidObserver->SetNumberOfIterations( iterations );
-        rigidRegistration->AddObserver( itk::IterationEvent(), rigidObserver );
-        try
-          {
-          if ( verbose ) std::cout << std::endl << "*** Running rigid registration ***" << timedim  << std::endl << std::endl;
-          rigidRegistration->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          std::cerr << "Exception caught: " << e << std::endl;
-          return EXIT_FAILURE;
-          }
-        compositeTransform->AddTransform( rigidRegistration->GetModifiableTransform() );
-        // Write out the rigid transform
-        std::string filename = outputPrefix + std::string("TimeSlice") + ants_moco_to_string<unsigned int>(timedim)
-          + std::string( "Rigid.txt" );
-        typedef itk::TransformFileWriter TransformWriterType;
-        typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
-        transformWriter->SetInput( rigidRegistration->GetOutput()->Get() );
-        transformWriter->SetFileName( filename.c_str() );
-        //      transformWriter->Update();
-        if( timedim == 0 )
-          {
-          param_values.set_size(timedims, nparams);
-          param_values.fill(0);
-          }
-        for( unsigned int i = 0; i < nparams - 2; i++ )
-          {
-          param_values(timedim, i + 2) = rigidRegistration->GetOutput()->Get()->GetParameters()[i];
-          }
-        }
-      else if( std::strcmp( whichTransform.c_str(),
-                            "gaussiandisplacementfield" ) == 0 ||  std::strcmp( whichTransform.c_str(), "gdf" ) == 0 )
-        {
-        RealType sigmaForUpdateField = parser->Convert<float>( transformOption->GetFunction(
-                                                                 currentStage )->GetParameter(  1 ) );
-        RealType sigmaForTotalField = parser->Convert<float>( transformOption->GetFunction(
-                                                                currentStage )->GetParameter(  2 ) );
-        const unsigned int VImageDimension = ImageDimension;
-        typedef itk::Vector<RealType, VImageDimension> VectorType;
-        VectorType zeroVector( 0.0 );
-        typedef itk::Image<VectorType, VImageDimension> DisplacementFieldType;
-        // ORIENTATION ALERT: Original code set image size to
-        // fixedImage buffered region, & if fixedImage BufferedRegion
-        // != LargestPossibleRegion, this code would be wrong.
-        typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>(
-            preprocessFixedImage, zeroVector );
-        typedef itk::GaussianSmoothingOnUpdateDisplacementFieldTransform<RealType,
-                                                                         VImageDimension>
-          GaussianDisplacementFieldTransformType;
-
-        typedef itk::ImageRegistrationMethodv4<FixedImageType, FixedImageType,
-                                               GaussianDisplacementFieldTransformType>
-          DisplacementFieldRegistrationType;
-        typename DisplacementFieldRegistrationType::Pointer displacementFieldRegistration =
-          DisplacementFieldRegistrationType::New();
-
-        typename GaussianDisplacementFieldTransformType::Pointer outputDisplacementFieldTransform =
-                                                                      displacementFieldRegistration->GetModifiableTransform();
-
-        // Create the transform adaptors
-
-        typedef itk::GaussianSmoothingOnUpdateDisplacementFieldTransformParametersAdaptor<GaussianDisplacementFieldTransformType> DisplacementFieldTransformAdaptorType;
-        typename DisplacementFieldRegistrationType::TransformParametersAdaptorsContainerType adaptors;
-
-        // Extract parameters
-        outputDisplacementFieldTransform->SetGaussianSmoothingVarianceForTheUpdateField( sigmaForUpdateField );
-        outputDisplacementFieldTransform->SetGaussianSmoothingVarianceForTheTotalField( sigmaForTotalField );
-        outputDisplacementFieldTransform->SetDisplacementField( displacementField );
-        for( unsigned int level = 0; level < numberOfLevels; level++ )
-          {
-          typedef itk::ShrinkImageFilter<DisplacementFieldType, DisplacementFieldType> ShrinkFilterType;
-          typename ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
-          shrinkFilter->SetShrinkFactors( shrinkFactorsPerLevel[level] );
-          shrinkFilter->SetInput( displacementField );
-          shrinkFilter->Update();
-          typename DisplacementFieldTransformAdaptorType::Pointer fieldTransformAdaptor =
-            DisplacementFieldTransformAdaptorType::New();
-          fieldTransformAdaptor->SetRequiredSpacing( shrinkFilter->GetOutput()->GetSpacing() );
-          fieldTransformAdaptor->SetRequiredSize( shrinkFilter->GetOutput()->GetBufferedRegion().GetSize() );
-          fieldTransformAdaptor->SetRequiredDirection( shrinkFilter->GetOutput()->GetDirection() );
-          fieldTransformAdaptor->SetRequiredOrigin( shrinkFilter->GetOutput()->GetOrigin() );
-          fieldTransformAdaptor->SetTransform( outputDisplacementFieldTransform );
-          adaptors.push_back( fieldTransformAdaptor.GetPointer() );
-          }
-        displacementFieldRegistration->SetFixedImage( 0, preprocessFixedImage );
-        displacementFieldRegistration->SetMovingImage( 0, preprocessMovingImage );
-        displacementFieldRegistration->SetMetric( metric );
-        displacementFieldRegistration->SetNumberOfLevels( numberOfLevels );
-        displacementFieldRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
-        displacementFieldRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-        displacementFieldRegistration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits( false );
-        displacementFieldRegistration->SetMetricSamplingStrategy(
-          static_cast<typename DisplacementFieldRegistrationType::MetricSamplingStrategyType>( metricSamplingStrategy ) );
-        displacementFieldRegistration->SetMetricSamplingPercentage( samplingPercentage );
-        displacementFieldRegistration->SetOptimizer( optimizer );
-        displacementFieldRegistration->SetTransformParametersAdaptorsPerLevel( adaptors );
-        if( compositeTransform->GetNumberOfTransforms() > 0 )
-          {
-          displacementFieldRegistration->SetMovingInitialTransform( compositeTransform );
-          }
-        try
-          {
-          displacementFieldRegistration->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          std::cerr << "Exception caught: " << e << std::endl;
-          return EXIT_FAILURE;
-          }
-        compositeTransform->AddTransform( outputDisplacementFieldTransform );
-        if( timedim == 0 )
-          {
-          param_values.set_size(timedims, nparams);
-          param_values.fill(0);
-          }
-        }
-      else if( std::strcmp( whichTransform.c_str(),
-                            "SyN" ) == 0 ||  std::strcmp( whichTransform.c_str(), "syn" ) == 0 )
+      }
+    else
+      {
+      for( unsigned int timedim = 0; timedim < timedims; timedim++ )
         {
-        RealType sigmaForUpdateField = parser->Convert<float>( transformOption->GetFunction(
-                                                                 currentStage )->GetParameter(  1 ) );
-        RealType sigmaForTotalField = parser->Convert<float>( transformOption->GetFunction(
-                                                                currentStage )->GetParameter(  2 ) );
-        const unsigned int VImageDimension = ImageDimension;
-        typedef itk::Vector<RealType, VImageDimension> VectorType;
-        VectorType zeroVector( 0.0 );
-        typedef itk::Image<VectorType, VImageDimension> DisplacementFieldType;
-
-        typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>(
-            preprocessFixedImage, zeroVector );
-
-        typename DisplacementFieldType::Pointer inverseDisplacementField = AllocImage<DisplacementFieldType>(
-            preprocessFixedImage, zeroVector );
-
-        typedef itk::DisplacementFieldTransform<RealType, VImageDimension> DisplacementFieldTransformType;
-        typedef itk::SyNImageRegistrationMethod<FixedImageType, FixedImageType,
-                                                DisplacementFieldTransformType> DisplacementFieldRegistrationType;
-        typename DisplacementFieldRegistrationType::Pointer displacementFieldRegistration =
-          DisplacementFieldRegistrationType::New();
-
-        typename DisplacementFieldTransformType::Pointer outputDisplacementFieldTransform =
-                                                                  displacementFieldRegistration->GetModifiableTransform();
-
-        // Create the transform adaptors
-
-        typedef itk::DisplacementFieldTransformParametersAdaptor<DisplacementFieldTransformType>
-          DisplacementFieldTransformAdaptorType;
-        typename DisplacementFieldRegistrationType::TransformParametersAdaptorsContainerType adaptors;
-        // Create the transform adaptors
-        // For the gaussian displacement field, the specified variances are in image spacing terms
-        // and, in normal practice, we typically don't change these values at each level.  However,
-        // if the user wishes to add that option, they can use the class
-        // GaussianSmoothingOnUpdateDisplacementFieldTransformAdaptor
-        for( unsigned int level = 0; level < numberOfLevels; level++ )
-          {
-          // TODO:
-          // We use the shrink image filter to calculate the fixed parameters of the virtual
-          // domain at each level.  To speed up calculation and avoid unnecessary memory
-          // usage, we could calculate these fixed parameters directly.
-          typedef itk::ShrinkImageFilter<DisplacementFieldType, DisplacementFieldType> ShrinkFilterType;
-          typename ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
-          shrinkFilter->SetShrinkFactors( shrinkFactorsPerLevel[level] );
-          shrinkFilter->SetInput( displacementField );
-          shrinkFilter->Update();
-
-          typename DisplacementFieldTransformAdaptorType::Pointer fieldTransformAdaptor =
-            DisplacementFieldTransformAdaptorType::New();
-          fieldTransformAdaptor->SetRequiredSpacing( shrinkFilter->GetOutput()->GetSpacing() );
-          fieldTransformAdaptor->SetRequiredSize( shrinkFilter->GetOutput()->GetBufferedRegion().GetSize() );
-          fieldTransformAdaptor->SetRequiredDirection( shrinkFilter->GetOutput()->GetDirection() );
-          fieldTransformAdaptor->SetRequiredOrigin( shrinkFilter->GetOutput()->GetOrigin() );
-          fieldTransformAdaptor->SetTransform( outputDisplacementFieldTransform );
-
-          adaptors.push_back( fieldTransformAdaptor.GetPointer() );
-          }
-
-        // Extract parameters
-        typename DisplacementFieldRegistrationType::NumberOfIterationsArrayType numberOfIterationsPerLevel;
-        numberOfIterationsPerLevel.SetSize( numberOfLevels );
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << "SyN iterations:";
-          }
-        for( unsigned int d = 0; d < numberOfLevels; d++ )
-          {
-          numberOfIterationsPerLevel[d] = iterations[d]; // currentStageIterations[d];
-          if( timedim == 0 )
-            {
-            if ( verbose ) std::cout << numberOfIterationsPerLevel[d] << " ";
-            }
-          }
-        if( timedim == 0 )
-          {
-          if ( verbose ) std::cout << std::endl;
-          }
-
-        const RealType varianceForUpdateField = sigmaForUpdateField;
-        const RealType varianceForTotalField = sigmaForTotalField;
-        displacementFieldRegistration->SetFixedImage( 0, preprocessFixedImage );
-        displacementFieldRegistration->SetMovingImage( 0, preprocessMovingImage );
-        displacementFieldRegistration->SetMetric( metric );
-
-        if( compositeTransform->GetNumberOfTransforms() > 0 )
-          {
-          displacementFieldRegistration->SetMovingInitialTransform( compositeTransform );
-          }
-        displacementFieldRegistration->SetDownsampleImagesForMetricDerivatives( true );
-        displacementFieldRegistration->SetAverageMidPointGradients( false );
-        displacementFieldRegistration->SetNumberOfLevels( numberOfLevels );
-        displacementFieldRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
-        displacementFieldRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-        displacementFieldRegistration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits( false );
-        displacementFieldRegistration->SetLearningRate( learningRate );
-        displacementFieldRegistration->SetConvergenceThreshold( 1.e-8 );
-        displacementFieldRegistration->SetConvergenceWindowSize( 10 );
-        displacementFieldRegistration->SetNumberOfIterationsPerLevel( numberOfIterationsPerLevel );
-        displacementFieldRegistration->SetTransformParametersAdaptorsPerLevel( adaptors );
-        displacementFieldRegistration->SetGaussianSmoothingVarianceForTheUpdateField( varianceForUpdateField );
-        displacementFieldRegistration->SetGaussianSmoothingVarianceForTheTotalField( varianceForTotalField );
-        outputDisplacementFieldTransform->SetDisplacementField( displacementField );
-        outputDisplacementFieldTransform->SetInverseDisplacementField( inverseDisplacementField );
-        try
+        if( stage.RegisterTimePoint( timedim ) != EXIT_SUCCESS )
           {
-          displacementFieldRegistration->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          std::cerr << "Exception caught: " << e << std::endl;
           return EXIT_FAILURE;
           }
-        // Add calculated transform to the composite transform
-        compositeTransform->AddTransform( outputDisplacementFieldTransform );
-        if( timedim == 0 )
-          {
-          param_values.set_size(timedims, nparams);
-          param_values.fill(0);
-          }
-        }
-      else
-        {
-        std::cerr << "ERROR:  Unrecognized transform option - " << whichTransform << std::endl;
-        return EXIT_FAILURE;
-        }
-      if( currentStage == static_cast<int>(numberOfStages) - 1 )
-        {
-        param_values(timedim, 1) = metric->GetValue();
         }
+      }
+    fixed_time_slice = stage.last_fixed_time_slice;
+    for( unsigned int timedim = 0; timedim < timedims; timedim++ )
+      {
       metriclist.push_back( param_values(timedim, 1) );
       metricmean +=  param_values(timedim, 1) / ( double ) timedims;
-      // resample the moving image and then put it in its place
-      typedef itk::ResampleImageFilter<FixedImageType, FixedImageType> ResampleFilterType;
-      typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-      resampler->SetTransform( compositeTransform );
-      resampler->SetInput( moving_time_slice );
-      resampler->SetOutputParametersFromImage( fixed_time_slice );
-      resampler->SetDefaultPixelValue( 0 );
-      resampler->Update();
-      if ( verbose ) std::cout << " done resampling timepoint : " << timedim << std::endl;
-
-      /** Here, we put the resampled 3D image into the 4D volume */
-      typedef itk::ImageRegionIteratorWithIndex<FixedImageType> Iterator;
-      Iterator vfIter2(  resampler->GetOutput(), resampler->GetOutput()->GetLargestPossibleRegion() );
-      for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-        {
-        typename FixedImageType::PixelType  fval = vfIter2.Get();
-        typename MovingImageType::IndexType ind;
-        for( unsigned int xx = 0; xx < ImageDimension; xx++ )
-          {
-          ind[xx] = vfIter2.GetIndex()[xx];
-          }
-        unsigned int tdim = timedim;
-        if( tdim > ( timedims - 1 ) )
-          {
-          tdim = timedims - 1;
-          }
-        ind[ImageDimension] = tdim;
-        outputImage->SetPixel(ind, fval);
-        }
-      if ( writeDisplacementField > 0 )
-        {
-        typedef typename
-        itk::TransformToDisplacementFieldFilter<DisplacementFieldType, RealType>
-          ConverterType;
-        typename ConverterType::Pointer converter = ConverterType::New();
-        converter->SetOutputOrigin( fixed_time_slice->GetOrigin() );
-        converter->SetOutputStartIndex(
-          fixed_time_slice->GetBufferedRegion().GetIndex() );
-        converter->SetSize( fixed_time_slice->GetBufferedRegion().GetSize() );
-        converter->SetOutputSpacing( fixed_time_slice->GetSpacing() );
-        converter->SetOutputDirection( fixed_time_slice->GetDirection() );
-        converter->SetTransform( compositeTransform );
-        converter->Update();
-        /** Here, we put the 3d tx into a 4d displacement field */
-        for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-          {
-          VectorType vec =
-            converter->GetOutput()->GetPixel( vfIter2.GetIndex() );
-          VectorIOType vecout;
-          vecout.Fill( 0 );
-          typename MovingIOImageType::IndexType ind;
-          for( unsigned int xx = 0; xx < ImageDimension; xx++ )
-            {
-            ind[xx] = vfIter2.GetIndex()[xx];
-            vecout[xx] = vec[xx];
-            }
-          unsigned int tdim = timedim;
-          if( tdim > ( timedims - 1 ) )
-            {
-            tdim = timedims - 1;
-            }
-          ind[ImageDimension] = tdim;
-          displacementout->SetPixel( ind, vecout );
-          }
-#
-        typename ConverterType::Pointer converter2 = ConverterType::New();
-        converter2->SetOutputOrigin( moving_time_slice->GetOrigin() );
-        converter2->SetOutputStartIndex(
-          moving_time_slice->GetBufferedRegion().GetIndex() );
-        converter2->SetSize( moving_time_slice->GetBufferedRegion().GetSize() );
-        converter2->SetOutputSpacing( moving_time_slice->GetSpacing() );
-        converter2->SetOutputDirection( moving_time_slice->GetDirection() );
-        converter2->SetTransform( compositeTransform->GetInverseTransform() );
-        converter2->Update();
-        /** Here, we put the 3d tx into a 4d displacement field */
-        typedef itk::ImageRegionIteratorWithIndex<FixedImageType> Iterator;
-        Iterator vfIterInv(  moving_time_slice,
-          moving_time_slice->GetLargestPossibleRegion() );
-        for(  vfIterInv.GoToBegin(); !vfIterInv.IsAtEnd(); ++vfIterInv )
-          {
-          VectorType vec =
-            converter2->GetOutput()->GetPixel( vfIterInv.GetIndex() );
-          VectorIOType vecout;
-          vecout.Fill( 0 );
-          typename MovingIOImageType::IndexType ind;
-          for( unsigned int xx = 0; xx < ImageDimension; xx++ )
-            {
-            ind[xx] = vfIterInv.GetIndex()[xx];
-            vecout[xx] = vec[xx];
-            }
-          unsigned int tdim = timedim;
-          if( tdim > ( timedims - 1 ) )
-            {
-            tdim = timedims - 1;
-            }
-          ind[ImageDimension] = tdim;
-          displacementinv->SetPixel( ind, vecout );
-          }
-        }
       }
     if( outputOption && outputOption->GetFunction( 0 )->GetNumberOfParameters() > 1  && currentStage == 0 )
       {
@@ -1575,6 +1839,27 @@ int ants_motion( itk::ants::CommandLineParser *parser )
       }
     }
 
+  // reorient the diffusion directions with the parameters of the last stage
+  OptionType::Pointer bvecOption = parser->GetOption( "bvec" );
+  if( bvecOption && bvecOption->GetNumberOfFunctions() )
+    {
+    if( ImageDimension != 3 || bvecOption->GetFunction( 0 )->GetNumberOfParameters() < 2 )
+      {
+      std::cerr << "The bvec option needs 3D volumes and [inputBvec,outputBvec]." << std::endl;
+      return EXIT_FAILURE;
+      }
+    DiffusionDirectionTable directions;
+    DiffusionDirectionTable outputDirections;
+    if( !ReadDiffusionDirections( bvecOption->GetFunction( 0 )->GetParameter( 0 ), directions )
+        || !ReorientDiffusionDirections( directions, param_values, bvecPhysicalDirection, outputDirections,
+                                         verbose > 0 )
+        || !WriteDiffusionDirections( bvecOption->GetFunction( 0 )->GetParameter( 1 ), outputDirections ) )
+      {
+      return EXIT_FAILURE;
+      }
+    if ( verbose ) std::cout << " wrote " << bvecOption->GetFunction( 0 )->GetParameter( 1 ) << std::endl;
+    }
+
   return EXIT_SUCCESS;
 }
 
@@ -1754,6 +2039,32 @@ void antsMotionCorrInitializeCommandLineOptions( itk::ants::CommandLineParser *p
   parser->AddOption( option );
   }
 
+  {
+  std::string description = std::string( "Register several volumes of the time series at the same time.  " )
+    + std::string( "The volumes are shared dynamically among numberOfWorkers workers and each worker " )
+    + std::string( "uses at most numberOfThreadsPerWorker threads (default:  the number of threads " )
+    + std::string( "divided by the number of workers).  The output order does not depend on the number " )
+    + std::string( "of workers and random sampling is seeded for each volume." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "parallel-volumes" );
+  option->SetUsageOption( 0, "numberOfWorkers" );
+  option->SetUsageOption( 1, "[numberOfWorkers,<numberOfThreadsPerWorker>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Reorient the diffusion directions of a bvec file, one per volume, " )
+    + std::string( "with the rigid or affine parameters of the last stage and write them to outputBvec, as " )
+    + std::string( "antsMotionCorrDiffusionDirection does, in the same run as the motion correction. " )
+    + std::string( "The directions are taken along the axes of the fixed image of the last stage." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "bvec" );
+  option->SetUsageOption( 0, "[inputBvec,outputBvec]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description = std::string( "Verbose output." );
 
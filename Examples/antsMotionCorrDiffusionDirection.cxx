@@ -19,6 +19,7 @@
 #include "antsAllocImage.h"
 #include "ReadWriteData.h"
 #include "antsCommandLineParser.h"
+#include "antsDiffusionDirections.h"
 #include "itkCSVNumericObjectFileWriter.h"
 #include "itkCSVArray2DFileReader.h"
 #include "itkImageRegistrationMethodv4.h"
@@ -162,8 +163,6 @@ int ants_motion_directions( itk::ants::CommandLineParser *parser )
 
   std::vector<CompositeTransformType::Pointer> CompositeTransformVector;
 
-  typedef itk::Euler3DTransform<RealType>                   RigidTransformType;
-  typedef itk::AffineTransform<RealType, ImageDimension>    AffineTransformType;
 
   typedef itk::ants::CommandLineParser ParserType;
   typedef ParserType::OptionType       OptionType;
@@ -224,7 +223,9 @@ int ants_motion_directions( itk::ants::CommandLineParser *parser )
     return EXIT_FAILURE;
     }
 
-  DirectionArrayType directionArray;
+  DiffusionDirectionTable directions;
+  directions.Transposed = true;
+  DirectionArrayType & directionArray = directions.Directions;
 
   if( schemeOption && schemeOption->GetNumberOfFunctions() )
     {
@@ -257,56 +258,17 @@ int ants_motion_directions( itk::ants::CommandLineParser *parser )
     
     }
 
-  bool transposeArray = true;
   if( bvecOption && bvecOption->GetNumberOfFunctions() )
     {
     std::string bvecName = bvecOption->GetFunction(0)->GetName();
     //std::cout << "bvec file: " << bvecName << std::endl;
-
-    MocoReaderType::Pointer bvecReader = MocoReaderType::New();
-    bvecReader->SetFileName( bvecName.c_str() ) ;
-    bvecReader->SetFieldDelimiterCharacter( ' ' );
-    bvecReader->HasColumnHeadersOff();
-    bvecReader->HasRowHeadersOff();
-    bvecReader->Update();
-    MocoDataArrayType::MatrixType bvecMatrix = bvecReader->GetOutput()->GetMatrix();
-
-    //std::cout << "BVEC data array size = " << bvecMatrix.rows() << " x " << bvecMatrix.cols() << std::endl;
-    if ( bvecMatrix.cols() == 3 )
-      {
-      transposeArray = false;
-      std::cout << "Column based format" << std::endl;
-      }
-
-    // Transpose the array
-    if ( transposeArray )
-      {
-      directionArray.SetSize( bvecMatrix.cols(), bvecMatrix.rows() );
-      }
-    else
+    if( !ReadDiffusionDirections( bvecName, directions ) )
       {
-      directionArray.SetSize( bvecMatrix.rows(), bvecMatrix.cols() );
-      }
-
-    if ( transposeArray )
-      {
-      for ( unsigned int i=0; i < bvecMatrix.cols(); i++ )
-        {
-        for ( unsigned int j=0; j < bvecMatrix.rows(); j++ )
-          {
-          directionArray(i,j) = bvecMatrix(j,i);
-          }
-        }
+      return EXIT_FAILURE;
       }
-    else
+    if ( !directions.Transposed )
       {
-      for ( unsigned int i=0; i < bvecMatrix.cols(); i++ )
-        {
-        for ( unsigned int j=0; j < bvecMatrix.rows(); j++ )
-          {
-          directionArray(j,i) = bvecMatrix(j,i);
-          }
-        }
+      std::cout << "Column based format" << std::endl;
       }
     }
 
@@ -340,9 +302,6 @@ int ants_motion_directions( itk::ants::CommandLineParser *parser )
   imageReader->SetFileName(physicalName.c_str());
   imageReader->Update();
 
-  DirectionArrayType outputDirectionArray;
-  outputDirectionArray.SetSize( directionArray.rows(), directionArray.cols() );
-
   MocoReaderType::Pointer mocoReader = MocoReaderType::New();
   mocoReader->SetFileName( mocoName.c_str() );
   mocoReader->SetFieldDelimiterCharacter( ',' );
@@ -354,134 +313,30 @@ int ants_motion_directions( itk::ants::CommandLineParser *parser )
   std::cout << "Read motion correction data of size: " << mocoDataArray->GetMatrix().rows() << " x "
             << mocoDataArray->GetMatrix().cols() << std::endl;
 
- // [-0.231374, -0.0543334, 0.677384]
-
-  unsigned int nTransformParams = mocoDataArray->GetMatrix().cols() - 2;
-  //std::cout << "# Transform parameters = " << nTransformParams << std::endl;
-
-  AffineTransformType::Pointer toPhysical = AffineTransformType::New();
-  toPhysical->SetIdentity();
-  AffineTransformType::Pointer toIndex = AffineTransformType::New();
-  toIndex->SetIdentity();
-
-  AffineTransformType::MatrixType toPhysicalMatrix = toPhysical->GetMatrix();
+  itk::Matrix<double, 3, 3> physicalDirection;
   for ( unsigned int i=0; i < ImageDimension; i++)
     {
     for ( unsigned int j=0; j < ImageDimension; j++)
       {
-      toPhysicalMatrix(i,j) = imageReader->GetOutput()->GetDirection()(i,j);
+      physicalDirection(i,j) = imageReader->GetOutput()->GetDirection()(i,j);
       }
     }
-  toPhysical->SetMatrix(toPhysicalMatrix);
-  toPhysical->GetInverse(toIndex);
 
-  for ( unsigned int i=0; i<directionArray.rows(); i++ )
+  DiffusionDirectionTable outputDirections;
+  if ( !ReorientDiffusionDirections( directions, mocoDataArray->GetMatrix(), physicalDirection,
+                                     outputDirections, true ) )
     {
-
-    AffineTransformType::Pointer affineTransform = AffineTransformType::New();
-    AffineTransformType::Pointer directionTransform = AffineTransformType::New();
-    AffineTransformType::ParametersType params;
-
-    if (nTransformParams == 6) { 
-      RigidTransformType::Pointer rigid = RigidTransformType::New();
-      RigidTransformType::ParametersType rParams;
-
-      rParams.SetSize( nTransformParams );
-      for ( unsigned int t=0; t<nTransformParams; t++ )
-        {
-          rParams[t] = mocoDataArray->GetMatrix()(i,t+2);
-        }
-      rigid->SetParameters( rParams );
-      affineTransform->SetMatrix( rigid->GetMatrix() );
-      affineTransform->SetTranslation( rigid->GetTranslation() );
-    }
-    else if (nTransformParams == 12) { 
-      params.SetSize( nTransformParams );
-      for ( unsigned int t=0; t<nTransformParams; t++ )
-        {
-          params[t] = mocoDataArray->GetMatrix()(i,t+2);
-        }
-      affineTransform->SetParameters( params );
-      affineTransform->GetInverse( directionTransform );
-    }
-    else {
-      // Not rigid (6 params) or affine (12), something is wrong
-      return EXIT_FAILURE;
-    }
-
-    //std::cout << affineTransform->GetTranslation() << std::endl;
-
-    AffineTransformType::InputVectorType dir;
-    AffineTransformType::OutputVectorType rotatedDir;
-
-
-
-    for ( unsigned int j=0; j<directionArray.cols(); j++ )
-      {
-      dir[j] = directionArray(i,j);
-      }
-    if ( dir.GetNorm() > 0 )
-      {
-      dir.Normalize();
-      rotatedDir = toPhysical->TransformVector( dir );
-      rotatedDir = affineTransform->TransformVector( rotatedDir );
-      rotatedDir.Normalize();
-      rotatedDir = toIndex->TransformVector( rotatedDir );
-
-      //rotatedDir = affineTransform->TransformVector( dir );
-      //rotatedDir.Normalize();
-
-      }
-    else
-      {
-      for ( unsigned int j=0; j<directionArray.cols(); j++)
-        {
-        rotatedDir[j] = dir[j];
-        }
-      }
-
-    for ( unsigned int j=0; j<directionArray.cols(); j++ )
-      {
-      outputDirectionArray(i,j) = rotatedDir[j];
-      }
-
-    std::cout << dir << " -> " << rotatedDir << std::endl;
+    return EXIT_FAILURE;
     }
 
-
   // Write new directions to output file
   if ( outputName.find( ".bvec" ) != std::string::npos )
     {
     //std::cout << "Writing bvec file " << outputName << std::endl;
-    std::ofstream outfile( outputName.c_str() );
-
-
-    if ( transposeArray )
-      {
-      for ( unsigned int i=0; i<outputDirectionArray.cols(); i++ )
-        {
-        for ( unsigned int j=0; j<outputDirectionArray.rows(); j++)
-          {
-          outfile << outputDirectionArray(j,i) << " ";
-          }
-        outfile << std::endl;
-        }
-      }
-    else
+    if ( !WriteDiffusionDirections( outputName, outputDirections ) )
       {
-      for ( unsigned int i=0; i<outputDirectionArray.rows(); i++ )
-        {
-        for ( unsigned int j=0; j<outputDirectionArray.cols(); j++)
-          {
-          outfile << outputDirectionArray(i,j) << " ";
-          }
-        outfile << std::endl;
-        }
+      return EXIT_FAILURE;
       }
-
-
-    outfile.close();
-
     }
   else
     {
@@ -27,148 +27,102 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkTransformFileWriter.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "vnl/vnl_matrix_fixed.h"
+#include "vnl/vnl_vector_fixed.h"
 #include <sstream>
+#include <vector>
 
 namespace ants
 {
 
+typedef itk::Image<double, 3>                  MotionStatsImageType;
+typedef itk::Image<double, 4>                  MotionStatsTimeSeriesImageType;
+typedef itk::AffineTransform<double, 3>        MotionStatsAffineTransformType;
+typedef vnl_matrix_fixed<double, 3, 3>         MotionStatsMatrixType;
+typedef vnl_vector_fixed<double, 3>            MotionStatsVectorType;
 
+// The voxels of a mask, as the physical points the displacements are
+// computed at, with their offsets in the mask buffer and their indices.
+struct MotionStatsMaskPoints
+  {
+  std::vector<MotionStatsVectorType>               Points;
+  std::vector<itk::OffsetValueType>                Offsets;
+  std::vector<MotionStatsImageType::IndexType>     Indices;
+  };
 
-int ants_motion_stats( itk::ants::CommandLineParser *parser )
+static void ants_motion_stats_mask_points( const MotionStatsImageType *mask, MotionStatsMaskPoints & maskPoints )
 {
+  typedef itk::ImageRegionConstIteratorWithIndex<MotionStatsImageType> IteratorType;
 
-  const unsigned int ImageDimension = 3;
-
-  typedef double                                    RealType;
-
-  typedef itk::Image<RealType, ImageDimension>      ImageType;
-  typedef vnl_matrix<RealType>                      vMatrix;
-  vMatrix param_values;
-  typedef itk::Image<RealType, 4>                   TimeSeriesImageType; 
-  typedef TimeSeriesImageType::RegionType           TimeSeriesRegionType; 
-  typedef TimeSeriesImageType::IndexType            TimeSeriesIndexType;
-  typedef TimeSeriesImageType::SizeType             TimeSeriesSizeType; 
-  typedef itk::ImageRegionIterator< TimeSeriesImageType > TimeSeriesIteratorType;
- 
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>      IteratorType;
-  typedef itk::AffineTransform<RealType, ImageDimension>    AffineTransformType;
-  typedef itk::Euler3DTransform<RealType>                   RigidTransformType;
-  typedef itk::TransformFileWriterTemplate<RealType>        TransformWriterType;
-
-  typedef itk::ants::CommandLineParser ParserType;
-  typedef ParserType::OptionType       OptionType;
-
-  typedef double                                        ParameterValueType;
-  typedef itk::CSVArray2DFileReader<ParameterValueType> MocoReaderType;
-  typedef MocoReaderType::Array2DDataObjectType         MocoDataArrayType;
-
-  typedef itk::CSVNumericObjectFileWriter<ParameterValueType> WriterType;
-  typedef WriterType::vnlMatrixType                           WriterMatrixType;
-
-
-  std::string outputName = "";
-  std::string mocoName = "";
-  std::string spatialName = "";
-  std::string timeseriesDisplacementName = ""; 
-  unsigned long transformIndex = 0;
-  bool writeMap = false;
-  bool writeTransform = false;
-  bool timeseriesDisplacement = false; 
-
-  OptionType::Pointer outputOption = parser->GetOption( "output" );
-  if( outputOption && outputOption->GetNumberOfFunctions() )
-    {
-    outputName = outputOption->GetFunction(0)->GetName();
-    std::cout << "Output: " << outputName << std::endl;
-    }
-  else
+  maskPoints.Points.clear();
+  maskPoints.Offsets.clear();
+  maskPoints.Indices.clear();
+  for( IteratorType it( mask, mask->GetLargestPossibleRegion() ); !it.IsAtEnd(); ++it )
     {
-    std::cerr << "Output option not specified." << std::endl;
-    return EXIT_FAILURE;
+    if ( it.Value() > 0 )
+      {
+      const MotionStatsImageType::IndexType idx = it.GetIndex();
+      MotionStatsImageType::PointType pt;
+      mask->TransformIndexToPhysicalPoint( idx, pt );
+      maskPoints.Points.push_back( MotionStatsVectorType( pt[0], pt[1], pt[2] ) );
+      maskPoints.Offsets.push_back( mask->ComputeOffset( idx ) );
+      maskPoints.Indices.push_back( idx );
+      }
     }
+}
 
-  OptionType::Pointer spatialOption = parser->GetOption( "spatial-map" );
-  if( spatialOption && spatialOption->GetNumberOfFunctions() )
-    {
-    spatialName = spatialOption->GetFunction(0)->GetName();
-    std::cout << "Spatial map output: " << spatialName << std::endl;
-    writeMap = true;
-    }
+// The transform of the parameters of row i of the motion correction data,
+// which has two columns before them.
+static bool ants_motion_stats_get_transform( const vnl_matrix<double> & mocoMatrix, unsigned int i,
+                                             MotionStatsAffineTransformType *affineTransform )
+{
+  typedef itk::Euler3DTransform<double> RigidTransformType;
 
-  OptionType::Pointer timeseriesDisplacementOption = 
-    parser->GetOption("timeseries-displacement"); 
-  if(timeseriesDisplacementOption && timeseriesDisplacementOption->GetNumberOfFunctions())
-  {
-    timeseriesDisplacementName = timeseriesDisplacementOption->GetFunction(0)->GetName(); 
-    std::cout << "Time-series displacement map input 4d image: " << timeseriesDisplacementName << std::endl; 
-    timeseriesDisplacement = true; 
-  }
-  OptionType::Pointer transformOption = parser->GetOption( "transform" );
-  if( transformOption && transformOption->GetNumberOfFunctions() )
+  const unsigned int nTransformParams = mocoMatrix.cols() - 2;
+  MotionStatsAffineTransformType::ParametersType params;
+  params.SetSize( nTransformParams );
+  for ( unsigned int t=0; t<nTransformParams; t++ )
     {
-    transformIndex = atoi( transformOption->GetFunction(0)->GetName().c_str() );
-    std::cout << "Index of transform to output: " << transformIndex << std::endl;
-    writeTransform = true;
+    params[t] = mocoMatrix(i,t+2);
     }
 
-  OptionType::Pointer mocoOption = parser->GetOption( "moco" );
-  if( mocoOption && mocoOption->GetNumberOfFunctions() )
+  // If rigid motion correction
+  if ( nTransformParams == 6 )
     {
-    mocoName = mocoOption->GetFunction(0)->GetName();
-    std::cout << "Moco file: " << mocoName << std::endl;
+    RigidTransformType::Pointer rigid = RigidTransformType::New();
+    rigid->SetParameters( params );
+    affineTransform->SetMatrix( rigid->GetMatrix() );
+    affineTransform->SetTranslation( rigid->GetTranslation() );
     }
-  else
+  else if ( nTransformParams == 12 )
     {
-    std::cerr << "Motion parameter file not specified" << std::endl;
-    return EXIT_FAILURE;
+    affineTransform->SetParameters( params );
     }
-
-  OptionType::Pointer maskOption = parser->GetOption( "mask" );
-
-  ImageType::Pointer mask = ImageType::New();
-  if ( maskOption && maskOption->GetNumberOfFunctions() )
-    {
-    ReadImage<ImageType>( mask, maskOption->GetFunction(0)->GetName().c_str()  );
-    }
-  else {
-    if ( !writeTransform )
-      {
-      std::cerr << "Must use mask image" << std::endl;
-      return EXIT_FAILURE;
-      }
-    }
-
-  ImageType::Pointer map = ImageType::New();
-  if ( writeMap )
+  else
     {
-    map->SetRegions( mask->GetLargestPossibleRegion() );
-    map->Allocate();
-    map->FillBuffer(0);
-
-    map->SetOrigin( mask->GetOrigin() );
-    map->SetSpacing( mask->GetSpacing() );
-    map->SetDirection( mask->GetDirection() );
-
+    std::cout << "Unknown transform type! - Exiting" << std::endl;
+    return false;
     }
+  return true;
+}
 
+// The summary stats of one motion correction file, with the points of its
+// mask.  The displacement of a point p between two affine transforms is
+// A p + b with A and b the differences of their matrices and offsets, so the
+// transforms of a time point are applied to all the points at once.
+static int ants_motion_stats_subject( const std::string & mocoName, const MotionStatsImageType *mask,
+                                      const MotionStatsMaskPoints & maskPoints, const std::string & outputName,
+                                      const std::string & spatialName, const std::string & timeseriesDisplacementName,
+                                      bool doFramewise )
+{
+  typedef double                                              ParameterValueType;
+  typedef itk::CSVArray2DFileReader<ParameterValueType>       MocoReaderType;
+  typedef MocoReaderType::Array2DDataObjectType               MocoDataArrayType;
+  typedef itk::CSVNumericObjectFileWriter<ParameterValueType> WriterType;
+  typedef WriterType::vnlMatrixType                           WriterMatrixType;
 
-  TimeSeriesImageType::Pointer timeseriesImage = TimeSeriesImageType::New(); 
-  TimeSeriesImageType::Pointer timeseriesDisplacementImage = TimeSeriesImageType::New();
-  if ( timeseriesDisplacement )
-    {
-	  ReadImage<TimeSeriesImageType>(timeseriesImage, timeseriesDisplacementName.c_str());
-	  timeseriesDisplacementImage->SetRegions(timeseriesImage->GetLargestPossibleRegion());
-	  timeseriesDisplacementImage->Allocate();
-	  timeseriesDisplacementImage->FillBuffer(0.0);
-	  timeseriesDisplacementImage->SetOrigin(timeseriesImage->GetOrigin());
-	  timeseriesDisplacementImage->SetSpacing(timeseriesImage->GetSpacing());
-	  timeseriesDisplacementImage->SetDirection(timeseriesImage->GetDirection());
-    }
-
-  
-  bool doFramewise = 0;
-  doFramewise = parser->Convert<bool>( parser->GetOption( "framewise" )->GetFunction()->GetName() );
-  std::cout << "Framewise = " << doFramewise << std::endl;
+  std::cout << "Moco file: " << mocoName << std::endl;
 
   MocoReaderType::Pointer mocoReader = MocoReaderType::New();
   mocoReader->SetFileName( mocoName.c_str() );
@@ -178,205 +132,247 @@ int ants_motion_stats( itk::ants::CommandLineParser *parser )
   mocoReader->Update();
 
   MocoDataArrayType::Pointer mocoDataArray = mocoReader->GetOutput();
-  std::cout << "Read motion correction data of size: " << mocoDataArray->GetMatrix().rows() << " x "
-            << mocoDataArray->GetMatrix().cols() << std::endl;
-
-  unsigned int nTransformParams = mocoDataArray->GetMatrix().cols() - 2;
-  //std::cout << "# Transform parameters = " << nTransformParams << std::endl;
+  const vnl_matrix<double> & mocoMatrix = mocoDataArray->GetMatrix();
+  std::cout << "Read motion correction data of size: " << mocoMatrix.rows() << " x "
+            << mocoMatrix.cols() << std::endl;
 
-  WriterMatrixType dataMatrix( mocoDataArray->GetMatrix().rows(), 2 );
+  const unsigned int nRows = mocoMatrix.rows();
 
-  // Extract a single 3D transform and write to file
-  if ( writeTransform  ) {
-
-    AffineTransformType::Pointer affineTransform1 = AffineTransformType::New();
-    AffineTransformType::ParametersType params1;
-    params1.SetSize( nTransformParams );
-
-    for ( unsigned int t=0; t<nTransformParams; t++ )
-      {
-      params1[t] = mocoDataArray->GetMatrix()(transformIndex,t+2);
-      }
-
-    // If rigid motion corretion
-    if ( nTransformParams == 6 )
-      {
-      RigidTransformType::Pointer rigid1 = RigidTransformType::New();
-      rigid1->SetParameters( params1 );
-      affineTransform1->SetMatrix( rigid1->GetMatrix() );
-      affineTransform1->SetTranslation( rigid1->GetTranslation() );
-      }
-    else if ( nTransformParams == 12 )
-      {
-      affineTransform1->SetParameters( params1 );
-      }
-    else
+  std::vector<MotionStatsMatrixType> matrices( nRows );
+  std::vector<MotionStatsVectorType> offsets( nRows );
+  for ( unsigned int i=0; i<nRows; i++ )
+    {
+    MotionStatsAffineTransformType::Pointer affineTransform = MotionStatsAffineTransformType::New();
+    if ( !ants_motion_stats_get_transform( mocoMatrix, i, affineTransform ) )
       {
-      std::cout << "Unknown transform type! - Exiting" << std::endl;
       return EXIT_FAILURE;
       }
+    matrices[i] = affineTransform->GetMatrix().GetVnlMatrix();
+    const MotionStatsAffineTransformType::OutputVectorType offset = affineTransform->GetOffset();
+    offsets[i] = MotionStatsVectorType( offset[0], offset[1], offset[2] );
+    }
 
-    TransformWriterType::Pointer transformWriter = TransformWriterType::New();
-    transformWriter->SetInput( affineTransform1 );
-    transformWriter->SetFileName( outputName.c_str() );
-    transformWriter->Update();
-
-    return EXIT_SUCCESS;
-  }
-
-  for ( unsigned int i=0; i<mocoDataArray->GetMatrix().rows(); i++ )
+  const bool writeMap = !spatialName.empty();
+  MotionStatsImageType::Pointer map = ITK_NULLPTR;
+  if ( writeMap )
     {
+    map = AllocImage<MotionStatsImageType>( mask, 0 );
+    }
 
-    AffineTransformType::Pointer affineTransform1 = AffineTransformType::New();
-    AffineTransformType::Pointer affineTransform2 = AffineTransformType::New();
-    AffineTransformType::ParametersType params1;
-    AffineTransformType::ParametersType params2;
-    params1.SetSize( nTransformParams );
-    params2.SetSize( nTransformParams );
-
-    for ( unsigned int t=0; t<nTransformParams; t++ )
-      {
-      params1[t] = mocoDataArray->GetMatrix()(i,t+2);
-      if ( i < (mocoDataArray->GetMatrix().rows()-1) )
-        {
-        params2[t] = mocoDataArray->GetMatrix()(i+1,t+2);
-        }
-      }
-
-    // If rigid motion correction
-    if ( nTransformParams == 6 )
-      {
-      RigidTransformType::Pointer rigid1 = RigidTransformType::New();
-      RigidTransformType::Pointer rigid2 = RigidTransformType::New();
-      rigid1->SetParameters( params1 );
-      rigid2->SetParameters( params2 );
-
-      affineTransform1->SetMatrix( rigid1->GetMatrix() );
-      affineTransform1->SetTranslation( rigid1->GetTranslation() );
+  const bool timeseriesDisplacement = !timeseriesDisplacementName.empty();
+  MotionStatsTimeSeriesImageType::Pointer timeseriesDisplacementImage = ITK_NULLPTR;
+  if ( timeseriesDisplacement )
+    {
+    std::cout << "Time-series displacement map input 4d image: " << timeseriesDisplacementName << std::endl;
+    MotionStatsTimeSeriesImageType::Pointer timeseriesImage = ITK_NULLPTR;
+    ReadImage<MotionStatsTimeSeriesImageType>( timeseriesImage, timeseriesDisplacementName.c_str() );
+    timeseriesDisplacementImage = AllocImage<MotionStatsTimeSeriesImageType>( timeseriesImage, 0.0 );
+    }
 
-      affineTransform2->SetMatrix( rigid2->GetMatrix() );
-      affineTransform2->SetTranslation( rigid2->GetTranslation() );
+  MotionStatsMatrixType identity;
+  identity.set_identity();
 
-      }
-    else if ( nTransformParams == 12 )
+  WriterMatrixType dataMatrix( nRows, 2 );
+  for ( unsigned int i=0; i<nRows; i++ )
+    {
+    MotionStatsMatrixType A;
+    MotionStatsVectorType b;
+    double                mapWeight;
+    if ( doFramewise && ( i < nRows-1 ) )
       {
-      affineTransform1->SetParameters( params1 );
-      affineTransform2->SetParameters( params2 );
+      A = matrices[i] - matrices[i+1];
+      b = offsets[i] - offsets[i+1];
+      mapWeight = 1.0 / ( nRows-1 );
       }
     else
       {
-      std::cout << "Unknown transform type! - Exiting" << std::endl;
-      return EXIT_FAILURE;
+      A = matrices[i] - identity;
+      b = offsets[i];
+      mapWeight = 1.0 / nRows;
       }
-
-
+    const bool zeroDisplacement = doFramewise && ( i == nRows-1 );
 
     double meanDisplacement = 0.0;
     double maxDisplacement = 0.0;
     double count = 0;
-    
-    // we iterate over the time-series one time volume at a time
-    TimeSeriesRegionType timeSeriesRegion; 
-    TimeSeriesIndexType timeSeriesIndex; 
-    TimeSeriesSizeType timeSeriesSize; 
-    if(timeseriesDisplacement){
-      for(int jj=0; jj<3; jj++){
-        timeSeriesIndex[jj] = mask->GetLargestPossibleRegion().GetIndex()[jj]; 
-        timeSeriesSize[jj] = mask->GetLargestPossibleRegion().GetSize()[jj]; 
-      }
-      timeSeriesIndex[3] = i; 
-      timeSeriesSize[3] = 1;
-      timeSeriesRegion.SetIndex(timeSeriesIndex); 
-      timeSeriesRegion.SetSize(timeSeriesSize);
-    }  
-    TimeSeriesIteratorType timeseriesIterator(timeseriesDisplacementImage, timeSeriesRegion); 
-    IteratorType it( mask, mask->GetLargestPossibleRegion() );
-    while( !it.IsAtEnd() )
-      {
 
-      if ( it.Value() > 0 )
+    MotionStatsTimeSeriesImageType::IndexType timeSeriesIndex;
+    timeSeriesIndex[3] = i;
+    for ( unsigned long n=0; n<maskPoints.Points.size(); n++ )
+      {
+      double dist = ( A * maskPoints.Points[n] + b ).magnitude();
+      if ( writeMap )
         {
+        map->GetBufferPointer()[maskPoints.Offsets[n]] += dist * mapWeight;
+        }
+      if ( zeroDisplacement )
+        {
+        dist = 0.0;
+        }
 
-        ImageType::IndexType idx = it.GetIndex();
-        ImageType::PointType pt;
-        mask->TransformIndexToPhysicalPoint(idx,pt);
-
-        ImageType::PointType pt1 = affineTransform1->TransformPoint( pt );
-
-        double dist = 0;
-        if ( doFramewise && ( i < (mocoDataArray->GetMatrix().rows()-1) ) )
-          {
-          ImageType::PointType pt2 = affineTransform2->TransformPoint( pt );
-          dist = pt1.EuclideanDistanceTo(pt2);
-          if ( writeMap )
-            {
-            map->SetPixel( idx, map->GetPixel(idx) + dist / (mocoDataArray->GetMatrix().rows()-1) );
-            }
-          }
-        else
-          {
-          dist = pt.EuclideanDistanceTo(pt1);
-          if ( writeMap )
-            {
-            map->SetPixel( idx, map->GetPixel(idx) + dist / mocoDataArray->GetMatrix().rows() );
-            }
-          }
-
-        if ( doFramewise && ( i == mocoDataArray->GetMatrix().rows()-1) )
-          {
-          dist = 0.0;
-          }
-
-
-
-        if ( dist > maxDisplacement )
+      if ( dist > maxDisplacement )
+        {
+        maxDisplacement = dist;
+        }
+      meanDisplacement += dist;
+      ++count;
+      if ( timeseriesDisplacement )
+        {
+        for ( unsigned int jj=0; jj<3; jj++ )
           {
-          maxDisplacement = dist;
+          timeSeriesIndex[jj] = maskPoints.Indices[n][jj];
           }
-        meanDisplacement += dist;
-        ++count;
-        if(timeseriesDisplacement) {
-          timeseriesIterator.Set(dist);
-        } 
+        timeseriesDisplacementImage->SetPixel( timeSeriesIndex, dist );
         }
-      ++it;
-      if(timeseriesDisplacement) {
-        ++timeseriesIterator; 
-      }
       }
 
     meanDisplacement /= count;
     dataMatrix(i,0) = meanDisplacement;
     dataMatrix(i,1) = maxDisplacement;
     //std::cout << i << "," << maxDisplacement << "," << meanDisplacement << std::endl;
-
-  }
+    }
 
   // Write summary stats to output file
   WriterType::Pointer writer = WriterType::New();
   writer->ColumnHeadersPushBack("Mean");
   writer->ColumnHeadersPushBack("Max");
   writer->SetInput( &dataMatrix );
-  writer->SetFileName( outputOption->GetFunction(0)->GetName().c_str() );
+  writer->SetFileName( outputName.c_str() );
   writer->Write();
 
   if (writeMap)
     {
-    WriteImage<ImageType>( map, spatialOption->GetFunction(0)->GetName().c_str()  );
+    WriteImage<MotionStatsImageType>( map, spatialName.c_str() );
     }
-  
+
   if(timeseriesDisplacement){
-	std::string tsOutImageName = outputName;
+    std::string tsOutImageName = outputName;
     std::size_t lastdot = outputName.find_last_of(".");
     if (lastdot != std::string::npos)
-    	tsOutImageName = outputName.substr(0, lastdot);
+      tsOutImageName = outputName.substr(0, lastdot);
     tsOutImageName += ".nii.gz";
-    WriteImage<TimeSeriesImageType>(timeseriesDisplacementImage, tsOutImageName.c_str());
+    WriteImage<MotionStatsTimeSeriesImageType>(timeseriesDisplacementImage, tsOutImageName.c_str());
   }
 
   return EXIT_SUCCESS;
 }
 
+// The names given to an option, in the order of the command line.
+static std::vector<std::string> ants_motion_stats_option_names( itk::ants::CommandLineParser *parser,
+                                                                const std::string & name )
+{
+  std::vector<std::string> names;
+  itk::ants::CommandLineParser::OptionType::Pointer option = parser->GetOption( name );
+  if( option )
+    {
+    for( unsigned int n = option->GetNumberOfFunctions(); n > 0; n-- )
+      {
+      names.push_back( option->GetFunction( n - 1 )->GetName() );
+      }
+    }
+  return names;
+}
+
+int ants_motion_stats( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::TransformFileWriterTemplate<double> TransformWriterType;
+  typedef itk::CSVArray2DFileReader<double>        MocoReaderType;
+
+  typedef itk::ants::CommandLineParser ParserType;
+  typedef ParserType::OptionType       OptionType;
+
+  // several subjects are processed with one moco, output and, if any, mask,
+  // spatial-map and timeseries-displacement option per subject, in order; a
+  // single mask is shared by all of them
+  const std::vector<std::string> outputNames = ants_motion_stats_option_names( parser, "output" );
+  const std::vector<std::string> mocoNames = ants_motion_stats_option_names( parser, "moco" );
+  const std::vector<std::string> maskNames = ants_motion_stats_option_names( parser, "mask" );
+  const std::vector<std::string> spatialNames = ants_motion_stats_option_names( parser, "spatial-map" );
+  const std::vector<std::string> timeseriesNames = ants_motion_stats_option_names( parser, "timeseries-displacement" );
+
+  if( outputNames.empty() )
+    {
+    std::cerr << "Output option not specified." << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( mocoNames.empty() )
+    {
+    std::cerr << "Motion parameter file not specified" << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int n = 0; n < outputNames.size(); n++ )
+    {
+    std::cout << "Output: " << outputNames[n] << std::endl;
+    }
+
+  // Extract a single 3D transform and write to file
+  OptionType::Pointer transformOption = parser->GetOption( "transform" );
+  if( transformOption && transformOption->GetNumberOfFunctions() )
+    {
+    const unsigned long transformIndex = atoi( transformOption->GetFunction(0)->GetName().c_str() );
+    std::cout << "Index of transform to output: " << transformIndex << std::endl;
+
+    MocoReaderType::Pointer mocoReader = MocoReaderType::New();
+    mocoReader->SetFileName( mocoNames[0].c_str() );
+    mocoReader->SetFieldDelimiterCharacter( ',' );
+    mocoReader->HasColumnHeadersOn();
+    mocoReader->HasRowHeadersOff();
+    mocoReader->Update();
+
+    MotionStatsAffineTransformType::Pointer affineTransform1 = MotionStatsAffineTransformType::New();
+    if( !ants_motion_stats_get_transform( mocoReader->GetOutput()->GetMatrix(), transformIndex, affineTransform1 ) )
+      {
+      return EXIT_FAILURE;
+      }
+
+    TransformWriterType::Pointer transformWriter = TransformWriterType::New();
+    transformWriter->SetInput( affineTransform1 );
+    transformWriter->SetFileName( outputNames[0].c_str() );
+    transformWriter->Update();
+
+    return EXIT_SUCCESS;
+    }
+
+  if( maskNames.empty() )
+    {
+    std::cerr << "Must use mask image" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( outputNames.size() != mocoNames.size()
+      || ( maskNames.size() != 1 && maskNames.size() != mocoNames.size() )
+      || ( !spatialNames.empty() && spatialNames.size() != mocoNames.size() )
+      || ( !timeseriesNames.empty() && timeseriesNames.size() != mocoNames.size() ) )
+    {
+    std::cerr << "Each motion parameter file needs its own output, spatial map and time-series displacement "
+              << "options, and a mask unless a single one is given." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  bool doFramewise = 0;
+  doFramewise = parser->Convert<bool>( parser->GetOption( "framewise" )->GetFunction()->GetName() );
+  std::cout << "Framewise = " << doFramewise << std::endl;
+
+  MotionStatsImageType::Pointer mask = ITK_NULLPTR;
+  MotionStatsMaskPoints         maskPoints;
+  for( unsigned int n = 0; n < mocoNames.size(); n++ )
+    {
+    if( n == 0 || maskNames.size() > 1 )
+      {
+      ReadImage<MotionStatsImageType>( mask, maskNames[n < maskNames.size() ? n : 0].c_str() );
+      ants_motion_stats_mask_points( mask, maskPoints );
+      }
+    if( ants_motion_stats_subject( mocoNames[n], mask, maskPoints, outputNames[n],
+                                   spatialNames.empty() ? std::string( "" ) : spatialNames[n],
+                                   timeseriesNames.empty() ? std::string( "" ) : timeseriesNames[n],
+                                   doFramewise ) == EXIT_FAILURE )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
+  return EXIT_SUCCESS;
+}
+
 void antsMotionCorrStatsInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
 {
   typedef itk::ants::CommandLineParser::OptionType OptionType;
@@ -526,7 +522,7 @@ private:
 
   parser->SetCommand( argv[0] );
 
-  std::string commandDescription = std::string( "antsMotionCorrStats - create summary measures of the parameters that are output by antsMotionCorr. Currently only works for linear transforms. Outputs the mean and max displacements for the voxels within a provided mask, at each time point. By default the displacements are relative to the reference space, but the framewise option may be used to provide displacements between consecutive time points" );
+  std::string commandDescription = std::string( "antsMotionCorrStats - create summary measures of the parameters that are output by antsMotionCorr. Currently only works for linear transforms. Outputs the mean and max displacements for the voxels within a provided mask, at each time point. By default the displacements are relative to the reference space, but the framewise option may be used to provide displacements between consecutive time points. Several sessions may be processed at once by repeating the moco and output options, and the mask, spatial-map and timeseries-displacement options unless a single mask is shared" );
   parser->SetCommandDescription( commandDescription );
   antsMotionCorrStatsInitializeCommandLineOptions( parser );
 
@@ -0,0 +1,694 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#include "antsUtilities.h"
+#include "antsCommandLineParser.h"
+#include "antsObjectCache.h"
+
+#include "include/Atropos.h"
+#include "include/CopyImageHeaderInformation.h"
+#include "include/ImageMath.h"
+#include "include/KellyKapowski.h"
+#include "include/MultiplyImages.h"
+#include "include/N4BiasFieldCorrection.h"
+#include "include/ResampleImageBySpacing.h"
+#include "include/SmoothImage.h"
+#include "include/ThresholdImage.h"
+#include "include/antsApplyTransforms.h"
+#include "include/antsRegistration.h"
+
+#include "itkConditionVariable.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleMutexLock.h"
+#include "itkTransformFactoryBase.h"
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+typedef int ( *PipelineCommandType )( std::vector<std::string>, std::ostream * );
+
+struct PipelineCommandEntry
+  {
+  const char *        Name;
+  PipelineCommandType Command;
+  };
+
+// The programs a pipeline can run, i.e. those of antsBrainExtraction.sh and
+// antsCorticalThickness.sh.
+static const PipelineCommandEntry pipelineCommands[] =
+{
+  { "antsApplyTransforms",        antsApplyTransforms        },
+  { "antsRegistration",           antsRegistration           },
+  { "Atropos",                    Atropos                    },
+  { "CopyImageHeaderInformation", CopyImageHeaderInformation },
+  { "ImageMath",                  ImageMath                  },
+  { "KellyKapowski",              KellyKapowski              },
+  { "MultiplyImages",             MultiplyImages             },
+  { "N4BiasFieldCorrection",      N4BiasFieldCorrection      },
+  { "ResampleImageBySpacing",     ResampleImageBySpacing     },
+  { "SmoothImage",                SmoothImage                },
+  { "ThresholdImage",             ThresholdImage             }
+};
+
+static PipelineCommandType GetPipelineCommand( const std::string & name )
+{
+  const unsigned int numberOfCommands = sizeof( pipelineCommands ) / sizeof( pipelineCommands[0] );
+  for( unsigned int n = 0; n < numberOfCommands; n++ )
+    {
+    if( name == pipelineCommands[n].Name )
+      {
+      return pipelineCommands[n].Command;
+      }
+    }
+  return ITK_NULLPTR;
+}
+
+enum PipelineStepState { STEP_WAITING, STEP_RUNNING, STEP_DONE, STEP_FAILED };
+
+struct PipelineStep
+  {
+  unsigned int              LineNumber;
+  std::string               CommandName;
+  PipelineCommandType       Command;
+  std::vector<std::string>  Arguments;
+  std::vector<unsigned int> Dependencies;
+  PipelineStepState         State;
+  };
+
+struct PipelineThreadStruct
+  {
+  std::vector<PipelineStep> Steps;
+  unsigned int              NumberOfRunningSteps;
+  bool                      Failed;
+  bool                      Verbose;
+  itk::SimpleMutexLock      Mutex;
+  itk::ConditionVariable::Pointer StepDone;
+  };
+
+// The file of an intermediate, written uncompressed to the scratch directory.
+static std::string GetIntermediateFileName( const std::string & scratchDirectory, std::string name )
+{
+  const std::string compressedExtension = ".gz";
+  if( name.size() > compressedExtension.size() &&
+      name.compare( name.size() - compressedExtension.size(), compressedExtension.size(), compressedExtension ) == 0 )
+    {
+    name.erase( name.size() - compressedExtension.size() );
+    }
+  return scratchDirectory + "/" + name;
+}
+
+// Replace the {name} intermediates of an argument by their file names and
+// collect their names.
+static bool SubstituteIntermediates( const std::string & scratchDirectory, std::string & argument,
+                                     std::set<std::string> & intermediates )
+{
+  std::string            substituted;
+  std::string::size_type position = 0;
+  while( position < argument.size() )
+    {
+    const std::string::size_type open = argument.find( '{', position );
+    if( open == std::string::npos )
+      {
+      substituted += argument.substr( position );
+      break;
+      }
+    const std::string::size_type close = argument.find( '}', open );
+    if( close == std::string::npos || close == open + 1 )
+      {
+      return false;
+      }
+    const std::string name = argument.substr( open + 1, close - open - 1 );
+    substituted += argument.substr( position, open - position );
+    substituted += GetIntermediateFileName( scratchDirectory, name );
+    intermediates.insert( name );
+    position = close + 1;
+    }
+  argument = substituted;
+  return true;
+}
+
+// The pieces of the arguments which may name files, e.g. the fixed and moving
+// images of 'CC[fixed,moving,1,4]'.
+static void GetFileNamePieces( const std::vector<std::string> & arguments, std::set<std::string> & pieces )
+{
+  for( unsigned int n = 0; n < arguments.size(); n++ )
+    {
+    std::string piece;
+    for( std::string::size_type i = 0; i <= arguments[n].size(); i++ )
+      {
+      const char c = ( i < arguments[n].size() ) ? arguments[n][i] : ',';
+      if( c == '[' || c == ']' || c == ',' )
+        {
+        bool hasLetter = false;
+        bool hasSeparator = false;
+        for( std::string::size_type j = 0; j < piece.size(); j++ )
+          {
+          hasLetter = hasLetter || std::isalpha( static_cast<unsigned char>( piece[j] ) );
+          hasSeparator = hasSeparator || piece[j] == '/' || piece[j] == '.' || piece[j] == '_';
+          }
+        if( hasLetter && hasSeparator )
+          {
+          pieces.insert( piece );
+          }
+        piece.clear();
+        }
+      else
+        {
+        piece += c;
+        }
+      }
+    }
+}
+
+// Whether a step reading 'piece' may read what a step writing 'written'
+// produced, i.e. the same file or a file of the output prefix 'written'.
+static bool IsProducedBy( const std::string & piece, const std::string & written )
+{
+  return piece.compare( 0, written.size(), written ) == 0;
+}
+
+// Read the steps of the pipeline file.  A step depends on the earlier steps
+// which share an intermediate or a file which did not exist before the
+// pipeline started, so that the steps using a file run in the order of the
+// file.
+static bool ReadPipeline( const std::string & fileName, const std::string & scratchDirectory,
+                          std::vector<PipelineStep> & steps )
+{
+  std::ifstream pipelineFile( fileName.c_str() );
+  if( !pipelineFile )
+    {
+    std::cerr << "Could not read the pipeline " << fileName << std::endl;
+    return false;
+    }
+
+  std::vector<std::set<std::string> > stepIntermediates;
+  std::vector<std::set<std::string> > stepProducedFiles;
+
+  std::string  line;
+  unsigned int lineNumber = 0;
+  while( std::getline( pipelineFile, line ) )
+    {
+    lineNumber++;
+    const std::string::size_type comment = line.find( '#' );
+    if( comment != std::string::npos )
+      {
+      line.erase( comment );
+      }
+
+    std::istringstream       lineStream( line );
+    std::vector<std::string> words;
+    std::string              word;
+    while( lineStream >> word )
+      {
+      words.push_back( word );
+      }
+    if( words.empty() )
+      {
+      continue;
+      }
+
+    PipelineStep step;
+    step.LineNumber = lineNumber;
+    step.CommandName = words[0];
+    step.Command = GetPipelineCommand( words[0] );
+    step.State = STEP_WAITING;
+    if( step.Command == ITK_NULLPTR )
+      {
+      std::cerr << fileName << ":" << lineNumber << ": unknown command " << words[0] << std::endl;
+      return false;
+      }
+
+    std::set<std::string> intermediates;
+    for( unsigned int n = 1; n < words.size(); n++ )
+      {
+      if( !SubstituteIntermediates( scratchDirectory, words[n], intermediates ) )
+        {
+        std::cerr << fileName << ":" << lineNumber << ": bad intermediate in " << words[n] << std::endl;
+        return false;
+        }
+      step.Arguments.push_back( words[n] );
+      }
+
+    std::set<std::string> pieces;
+    GetFileNamePieces( step.Arguments, pieces );
+    std::set<std::string> producedFiles;
+    for( std::set<std::string>::const_iterator it = pieces.begin(); it != pieces.end(); ++it )
+      {
+      if( !itksys::SystemTools::FileExists( it->c_str() ) )
+        {
+        producedFiles.insert( *it );
+        }
+      }
+
+    for( unsigned int s = 0; s < steps.size(); s++ )
+      {
+      bool depends = false;
+      for( std::set<std::string>::const_iterator it = intermediates.begin(); !depends && it != intermediates.end();
+           ++it )
+        {
+        depends = ( stepIntermediates[s].count( *it ) > 0 );
+        }
+      for( std::set<std::string>::const_iterator it = producedFiles.begin(); !depends && it != producedFiles.end();
+           ++it )
+        {
+        for( std::set<std::string>::const_iterator itW = stepProducedFiles[s].begin();
+             !depends && itW != stepProducedFiles[s].end(); ++itW )
+          {
+          depends = IsProducedBy( *it, *itW ) || IsProducedBy( *itW, *it );
+          }
+        }
+      if( depends )
+        {
+        step.Dependencies.push_back( s );
+        }
+      }
+
+    steps.push_back( step );
+    stepIntermediates.push_back( intermediates );
+    stepProducedFiles.push_back( producedFiles );
+    }
+  return true;
+}
+
+static std::string GetStepDescription( const PipelineStep & step )
+{
+  std::string description = step.CommandName;
+  for( unsigned int n = 0; n < step.Arguments.size(); n++ )
+    {
+    description += " " + step.Arguments[n];
+    }
+  return description;
+}
+
+// Every thread runs the first step whose dependencies are done, until all
+// are done or one failed.
+static ITK_THREAD_RETURN_TYPE PipelineThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *threadInfo = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  PipelineThreadStruct *                str = static_cast<PipelineThreadStruct *>( threadInfo->UserData );
+
+  str->Mutex.Lock();
+  while( !str->Failed )
+    {
+    bool         waiting = false;
+    unsigned int next = str->Steps.size();
+    for( unsigned int s = 0; s < str->Steps.size() && next == str->Steps.size(); s++ )
+      {
+      if( str->Steps[s].State != STEP_WAITING )
+        {
+        continue;
+        }
+      waiting = true;
+      bool ready = true;
+      for( unsigned int d = 0; d < str->Steps[s].Dependencies.size() && ready; d++ )
+        {
+        ready = ( str->Steps[str->Steps[s].Dependencies[d]].State == STEP_DONE );
+        }
+      if( ready )
+        {
+        next = s;
+        }
+      }
+    if( !waiting )
+      {
+      break;
+      }
+    if( next == str->Steps.size() )
+      {
+      // the dependencies are earlier steps which are running
+      str->StepDone->Wait( &str->Mutex );
+      continue;
+      }
+
+    PipelineStep & step = str->Steps[next];
+    step.State = STEP_RUNNING;
+    str->NumberOfRunningSteps++;
+    if( str->Verbose )
+      {
+      std::cout << "Running line " << step.LineNumber << ": " << GetStepDescription( step ) << std::endl;
+      }
+    str->Mutex.Unlock();
+
+    int exitCode = EXIT_FAILURE;
+    try
+      {
+      exitCode = ( *step.Command )( step.Arguments, &std::cout );
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << "Exception caught in " << step.CommandName << ": " << err << std::endl;
+      exitCode = EXIT_FAILURE;
+      }
+
+    str->Mutex.Lock();
+    str->NumberOfRunningSteps--;
+    if( exitCode == EXIT_SUCCESS )
+      {
+      step.State = STEP_DONE;
+      }
+    else
+      {
+      step.State = STEP_FAILED;
+      str->Failed = true;
+      std::cerr << "Line " << step.LineNumber << " failed: " << GetStepDescription( step ) << std::endl;
+      }
+    str->StepDone->Broadcast();
+    }
+  str->Mutex.Unlock();
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+static void antsPipelineInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  {
+  std::string description = std::string( "The pipeline: one command per line (antsApplyTransforms, " )
+    + std::string( "antsRegistration, Atropos, CopyImageHeaderInformation, ImageMath, KellyKapowski, " )
+    + std::string( "MultiplyImages, N4BiasFieldCorrection, ResampleImageBySpacing, SmoothImage or " )
+    + std::string( "ThresholdImage) followed by its arguments, as on the command line.  '#' starts a " )
+    + std::string( "comment.  {name} in an argument is an intermediate, e.g. {mask.nii.gz} or the output " )
+    + std::string( "prefix {reg_} and its transform {reg_}0GenericAffine.mat; intermediates are written " )
+    + std::string( "uncompressed to the scratch directory and removed at the end.  A command runs once " )
+    + std::string( "the earlier commands sharing one of its intermediates, or a file which did not exist " )
+    + std::string( "before the pipeline started, are done." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "pipeline" );
+  option->SetShortName( 'p' );
+  option->SetUsageOption( 0, "pipelineFileName" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The directory of the intermediates, e.g. on a memory file system.  " )
+    + std::string( "By default a new directory next to the pipeline file." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "scratch-directory" );
+  option->SetShortName( 's' );
+  option->SetUsageOption( 0, "directory" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Keep the intermediates at the end." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "keep-intermediates" );
+  option->SetShortName( 'k' );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The number of commands run at the same time.  The threads of the " )
+    + std::string( "process (ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS, or the number of cores) are shared " )
+    + std::string( "between them." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "jobs" );
+  option->SetShortName( 'j' );
+  option->SetUsageOption( 0, "1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The memory, in megabytes, of the cache keeping the images and " )
+    + std::string( "transforms written and read by the commands for the following ones." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "cache-memory" );
+  option->SetUsageOption( 0, "4096" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the commands as they start." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "verbose" );
+  option->SetShortName( 'v' );
+  option->SetUsageOption( 0, "(0)/1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu (short version)." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetShortName( 'h' );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "help" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+}
+
+// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
+// 'main()'
+int antsPipeline( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+{
+  // put the arguments coming in as 'args' into standard (argc,argv) format;
+  // 'args' doesn't have the command name as first, argument, so add it manually;
+  // 'args' may have adjacent arguments concatenated into one argument,
+  // which the parser should handle
+  args.insert( args.begin(), "antsPipeline" );
+  int     argc = args.size();
+  char* * argv = new char *[args.size() + 1];
+  for( unsigned int i = 0; i < args.size(); ++i )
+    {
+    // allocate space for the string plus a null character
+    argv[i] = new char[args[i].length() + 1];
+    std::strncpy( argv[i], args[i].c_str(), args[i].length() );
+    // place the null character in the end
+    argv[i][args[i].length()] = '\0';
+    }
+  argv[argc] = ITK_NULLPTR;
+  // class to automatically cleanup argv upon destruction
+  class Cleanup_argv
+  {
+public:
+    Cleanup_argv( char* * argv_, int argc_plus_one_ ) : argv( argv_ ), argc_plus_one( argc_plus_one_ )
+    {
+    }
+
+    ~Cleanup_argv()
+    {
+      for( unsigned int i = 0; i < argc_plus_one; ++i )
+        {
+        delete[] argv[i];
+        }
+      delete[] argv;
+    }
+
+private:
+    char* *      argv;
+    unsigned int argc_plus_one;
+  };
+  Cleanup_argv cleanup_argv( argv, argc + 1 );
+
+  itk::ants::CommandLineParser::Pointer parser = itk::ants::CommandLineParser::New();
+
+  parser->SetCommand( argv[0] );
+
+  std::string commandDescription = std::string( "Runs a pipeline of ANTs commands, such as the steps of " )
+    + std::string( "antsBrainExtraction.sh or antsCorticalThickness.sh, in one process through the " )
+    + std::string( "library entry points.  The images and transforms a command writes are kept in memory " )
+    + std::string( "for the following commands, the intermediates are written uncompressed to a scratch " )
+    + std::string( "directory and removed at the end, and the commands which do not depend on each other " )
+    + std::string( "(e.g. the warps of the priors) run at the same time." );
+
+  parser->SetCommandDescription( commandDescription );
+  antsPipelineInitializeCommandLineOptions( parser );
+
+  if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( argc == 1 )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_FAILURE;
+    }
+  else if( parser->GetOption( "help" )->GetFunction() && parser->Convert<bool>( parser->GetOption( "help" )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_SUCCESS;
+    }
+  else if( parser->GetOption( 'h' )->GetFunction() && parser->Convert<bool>( parser->GetOption( 'h' )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, true );
+    return EXIT_SUCCESS;
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer pipelineOption = parser->GetOption( "pipeline" );
+  if( !pipelineOption || pipelineOption->GetNumberOfFunctions() == 0 )
+    {
+    std::cerr << "No pipeline specified.  See command line option --pipeline." << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string pipelineFileName = pipelineOption->GetFunction( 0 )->GetName();
+
+  std::string scratchDirectory;
+  bool        createdScratchDirectory = false;
+  itk::ants::CommandLineParser::OptionType::Pointer scratchOption = parser->GetOption( "scratch-directory" );
+  if( scratchOption && scratchOption->GetNumberOfFunctions() )
+    {
+    scratchDirectory = scratchOption->GetFunction( 0 )->GetName();
+    }
+  else
+    {
+    std::string pipelineDirectory = itksys::SystemTools::GetFilenamePath( pipelineFileName );
+    if( pipelineDirectory.empty() )
+      {
+      pipelineDirectory = ".";
+      }
+    for( unsigned int n = 0; scratchDirectory.empty() || itksys::SystemTools::FileExists( scratchDirectory.c_str() );
+         n++ )
+      {
+      std::stringstream name;
+      name << pipelineDirectory << "/antsPipelineScratch" << n;
+      scratchDirectory = name.str();
+      }
+    createdScratchDirectory = true;
+    }
+  if( !itksys::SystemTools::MakeDirectory( scratchDirectory.c_str() ) )
+    {
+    std::cerr << "Could not create the scratch directory " << scratchDirectory << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  bool keepIntermediates = false;
+  itk::ants::CommandLineParser::OptionType::Pointer keepOption = parser->GetOption( "keep-intermediates" );
+  if( keepOption && keepOption->GetNumberOfFunctions() )
+    {
+    keepIntermediates = parser->Convert<bool>( keepOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned int numberOfJobs = 1;
+  itk::ants::CommandLineParser::OptionType::Pointer jobsOption = parser->GetOption( "jobs" );
+  if( jobsOption && jobsOption->GetNumberOfFunctions() )
+    {
+    numberOfJobs = std::max( parser->Convert<unsigned int>( jobsOption->GetFunction( 0 )->GetName() ), 1u );
+    }
+  numberOfJobs = std::min( numberOfJobs, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+
+  unsigned long cacheMemory = 4096;
+  itk::ants::CommandLineParser::OptionType::Pointer cacheMemoryOption = parser->GetOption( "cache-memory" );
+  if( cacheMemoryOption && cacheMemoryOption->GetNumberOfFunctions() )
+    {
+    cacheMemory = parser->Convert<unsigned long>( cacheMemoryOption->GetFunction( 0 )->GetName() );
+    }
+
+  PipelineThreadStruct str;
+  str.NumberOfRunningSteps = 0;
+  str.Failed = false;
+  str.Verbose = false;
+  str.StepDone = itk::ConditionVariable::New();
+  itk::ants::CommandLineParser::OptionType::Pointer verboseOption = parser->GetOption( "verbose" );
+  if( verboseOption && verboseOption->GetNumberOfFunctions() )
+    {
+    str.Verbose = parser->Convert<bool>( verboseOption->GetFunction( 0 )->GetName() );
+    }
+
+  if( !ReadPipeline( pipelineFileName, scratchDirectory, str.Steps ) )
+    {
+    if( createdScratchDirectory )
+      {
+      itksys::SystemTools::RemoveADirectory( scratchDirectory.c_str() );
+      }
+    return EXIT_FAILURE;
+    }
+
+  // The commands share the threads of the process.
+  const itk::ThreadIdType numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(
+    std::max( numberOfThreads / numberOfJobs, static_cast<itk::ThreadIdType>( 1 ) ) );
+
+  // Register the transforms once, before the commands run in parallel.
+  itk::TransformFactoryBase::RegisterDefaultTransforms();
+
+  // The images written by a command are kept for the commands reading them.
+  const unsigned long previousCacheMemory = ObjectCache::GetMaximumMemory();
+  ObjectCache::SetMaximumMemory( cacheMemory * 1024 * 1024 );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfJobs );
+  threader->SetSingleMethod( PipelineThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  ObjectCache::SetMaximumMemory( previousCacheMemory );
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( numberOfThreads );
+
+  if( !keepIntermediates )
+    {
+    if( createdScratchDirectory )
+      {
+      itksys::SystemTools::RemoveADirectory( scratchDirectory.c_str() );
+      }
+    else
+      {
+      itksys::Directory directory;
+      directory.Load( scratchDirectory.c_str() );
+      std::set<std::string> removed;
+      for( unsigned int s = 0; s < str.Steps.size(); s++ )
+        {
+        const std::vector<std::string> & arguments = str.Steps[s].Arguments;
+        for( unsigned long f = 0; f < directory.GetNumberOfFiles(); f++ )
+          {
+          const std::string file = directory.GetFile( f );
+          const std::string path = scratchDirectory + "/" + file;
+          for( unsigned int n = 0; n < arguments.size() && removed.count( path ) == 0; n++ )
+            {
+            // the files of the intermediates, including those of output prefixes
+            std::set<std::string> pieces;
+            GetFileNamePieces( std::vector<std::string>( 1, arguments[n] ), pieces );
+            for( std::set<std::string>::const_iterator it = pieces.begin(); it != pieces.end(); ++it )
+              {
+              if( it->compare( 0, scratchDirectory.size() + 1, scratchDirectory + "/" ) == 0 &&
+                  IsProducedBy( path, *it ) && itksys::SystemTools::FileExists( path.c_str(), true ) )
+                {
+                itksys::SystemTools::RemoveFile( path.c_str() );
+                removed.insert( path );
+                break;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+  return str.Failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+} // namespace ants
@@ -17,9 +17,11 @@
 *=========================================================================*/
 
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <string>
 #include "antsRegistrationTemplateHeader.h"
+#include "itksys/SystemTools.hxx"
 
 #include "ANTsVersion.h"
 
@@ -102,6 +104,82 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
   parser->AddOption( option );
   }
 
+  {
+  std::string description = std::string( "Adaptive level schedule for SyN stages.  Once a level improves the " )
+    + std::string( "metric by less than minimumRelativeGain (relative to its value at the first iteration of " )
+    + std::string( "that level), the remaining finer levels get no iterations.  If carryOverUnusedIterations " )
+    + std::string( "is set, iterations left over by a level that converged early are added to the next level. " )
+    + std::string( "The default gain of 0 keeps the iterations given with --convergence." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "adaptive-level-schedule" );
+  option->SetUsageOption( 0, "[minimumRelativeGain,<carryOverUnusedIterations=0>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Write a checkpoint of the transforms computed so far after every stage. " )
+    + std::string( "The files are checkpointPrefixCheckpointStage<n>.h5, its inverse, and the index " )
+    + std::string( "checkpointPrefixCheckpoint.txt.  Together with --resume, a run which was interrupted " )
+    + std::string( "continues after the last completed stage." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "checkpoint" );
+  option->SetUsageOption( 0, "checkpointPrefix" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Write a machine-readable record of every stage, level and iteration: " )
+    + std::string( "the metric and convergence values, the wall time and the time of each iteration, and per " )
+    + std::string( "stage the time spent in each level and the peak resident set size.  The records are JSON " )
+    + std::string( "Lines, or CSV if the file name ends in .csv.  The text output is unchanged." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "telemetry" );
+  option->SetUsageOption( 0, "telemetryFileName" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Memory budget in megabytes.  The peak memory of the images and " )
+    + std::string( "fields is estimated from the image headers and, if it is over the budget, speed is traded " )
+    + std::string( "for memory: the computations use single precision, then the preprocessed images are no " )
+    + std::string( "longer cached between stages and the output transforms are collapsed in place.  The " )
+    + std::string( "estimated, the tracked and the actual peak memory are reported at the end (with --verbose)." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "memory-limit" );
+  option->SetUsageOption( 0, "megabytes" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Directory in which the preprocessed (winsorized and rescaled) fixed " )
+    + std::string( "image is kept between runs, e.g. when many subjects are registered to the same template.  " )
+    + std::string( "The file is named after a hash of the image and of the winsorization quantiles, so a " )
+    + std::string( "changed image or command line does not use a stale file.  Fixed images which are " )
+    + std::string( "histogram matched are not cached." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "fixed-image-cache" );
+  option->SetUsageOption( 0, "cacheDirectory" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Resume from the checkpoint written by a previous run with the same " )
+    + std::string( "--checkpoint prefix and the same command line.  The stages completed in that run are " )
+    + std::string( "skipped.  If there is no checkpoint yet, the registration starts from the first stage, so " )
+    + std::string( "the same call can be repeated until it succeeds.  Mutually exclusive with restore-state." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "resume" );
+  option->SetUsageOption( 0, "1/(0)" );
+  option->SetDescription( description );
+  option->AddFunction( std::string( "0" ) );
+  parser->AddOption( option );
+  }
+
   {
   std::string description = std::string( "Boolean specifying whether or not the " )
     + std::string( "composite transform (and its inverse, if it exists) should " )
@@ -290,7 +368,10 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
     + std::string( "one sample per voxel), otherwise it defines a point set over which to optimize the metric. " )
     + std::string( "The point set can be on a regular lattice or a random lattice of points slightly " )
     + std::string( "perturbed to minimize aliasing artifacts. samplingPercentage defines the " )
-    + std::string( "fraction of points to select from the domain. " )
+    + std::string( "fraction of points to select from the domain.  Importance sampling draws the points of the " )
+    + std::string( "linear stages where the fixed image has edges, stratified over blocks of the domain so that " )
+    + std::string( "every region keeps its share of the points; it works with lower percentages than random " )
+    + std::string( "sampling.  The deformable stages sample it as Random. " )
     + std::string( "In addition, three point set metrics are available:  Euclidean " )
     + std::string( "(ICP), Point-set expectation (PSE), and Jensen-Havrda-Charvet-Tsallis (JHCT)." );
 
@@ -299,22 +380,22 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
   option->SetShortName( 'm' );
   option->SetUsageOption(
     0,
-    "CC[fixedImage,movingImage,metricWeight,radius,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "CC[fixedImage,movingImage,metricWeight,radius,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     1,
-    "MI[fixedImage,movingImage,metricWeight,numberOfBins,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "MI[fixedImage,movingImage,metricWeight,numberOfBins,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     2,
-    "Mattes[fixedImage,movingImage,metricWeight,numberOfBins,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "Mattes[fixedImage,movingImage,metricWeight,numberOfBins,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     3,
-    "MeanSquares[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "MeanSquares[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     4,
-    "Demons[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "Demons[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     5,
-    "GC[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
+    "GC[fixedImage,movingImage,metricWeight,radius=NA,<samplingStrategy={None,Regular,Random,Importance}>,<samplingPercentage=[0,1]>]" );
   option->SetUsageOption(
     6,
     "ICP[fixedPointSet,movingPointSet,metricWeight,<samplingPercentage=[0,1]>,<boundaryPointsOnly=0>]" );
@@ -336,7 +417,11 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
     + std::string( "learningRate characterizes the gradient descent optimization and is scaled appropriately " )
     + std::string( "for each transform using the shift scales estimator.  Subsequent parameters are " )
     + std::string( "transform-specific and can be determined from the usage. For the B-spline transforms " )
-    + std::string( "one can also specify the smoothing in terms of spline distance (i.e. knot spacing). " );
+    + std::string( "one can also specify the smoothing in terms of spline distance (i.e. knot spacing). " )
+    + std::string( "With controlPointSupportGradient, the BSpline gradient is accumulated on the support of " )
+    + std::string( "the control points of each voxel rather than over the whole mesh, which is much faster for " )
+    + std::string( "fine meshes; the stage is then optimized by gradient descent, whose largest step is the " )
+    + std::string( "gradientStep, instead of the conjugate gradient line search. " );
 
   OptionType::Pointer option = OptionType::New();
   option->SetLongName( "transform" );
@@ -346,7 +431,7 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
   option->SetUsageOption(  2, "CompositeAffine[gradientStep]" );
   option->SetUsageOption(  3, "Similarity[gradientStep]" );
   option->SetUsageOption(  4, "Translation[gradientStep]" );
-  option->SetUsageOption(  5, "BSpline[gradientStep,meshSizeAtBaseLevel]" );
+  option->SetUsageOption(  5, "BSpline[gradientStep,meshSizeAtBaseLevel,<controlPointSupportGradient=0>]" );
   option->SetUsageOption(
     6, "GaussianDisplacementField[gradientStep,updateFieldVarianceInVoxelSpace,totalFieldVarianceInVoxelSpace]" );
   option->SetUsageOption(
@@ -473,6 +558,22 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
   parser->AddOption( option );
   }
 
+  {
+  std::string description = std::string( "Run the leading linear stages in double precision and the other " )
+    + std::string( "stages, e.g. SyN, in single precision, so that the linear parameters are estimated with " )
+    + std::string( "double precision accumulation while the fields and images of the deformable stages take " )
+    + std::string( "the memory and time of single precision.  The linear transforms are handed to the single " )
+    + std::string( "precision stages through a checkpoint, the one of --checkpoint if it is given.  Overrides " )
+    + std::string( "--float." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "mixed-precision" );
+  option->SetUsageOption( 0, "1/(0)" );
+  option->SetDescription( description );
+  option->AddFunction( std::string( "0" ) );
+  parser->AddOption( option );
+  }
+
   {
   std::string description = std::string( "Use MINC file formats for transformations." );
 
@@ -516,57 +617,144 @@ static void antsRegistrationInitializeCommandLineOptions( itk::ants::CommandLine
 
 
 
-// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
-// 'main()'
+/** The number of stages, from the first, with a linear transform. */
+static unsigned int GetNumberOfLeadingLinearStages( ParserType::Pointer & parser )
+{
+  OptionType::Pointer transformOption = parser->GetOption( "transform" );
+  if( !transformOption )
+    {
+    return 0;
+    }
 
-int antsRegistration( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+  // the stages are stored as a stack, the first stage last
+  const unsigned int numberOfStages = transformOption->GetNumberOfFunctions();
+  unsigned int       numberOfLinearStages = 0;
+  for( int currentStage = numberOfStages - 1; currentStage >= 0; currentStage-- )
+    {
+    std::string whichTransform = transformOption->GetFunction( currentStage )->GetName();
+    ConvertToLowerCase( whichTransform );
+    if( whichTransform != "rigid" && whichTransform != "affine" && whichTransform != "compositeaffine"
+        && whichTransform != "compaff" && whichTransform != "similarity" && whichTransform != "translation" )
+      {
+      break;
+      }
+    numberOfLinearStages++;
+    }
+  return numberOfLinearStages;
+}
+
+static int antsRegistrationPass( ParserType::Pointer & parser, unsigned int dimension, bool useDoublePrecision,
+                                 const RegistrationPass & pass )
 {
-  try
+  switch( dimension )
     {
-    // put the arguments coming in as 'args' into standard (argc,argv) format;
-    // 'args' doesn't have the command name as first, argument, so add it manually;
-    // 'args' may have adjacent arguments concatenated into one argument,
-    // which the parser should handle
-    args.insert( args.begin(), "antsRegistration" );
-    int     argc = args.size();
-    char* * argv = new char *[args.size() + 1];
-    for( unsigned int i = 0; i < args.size(); ++i )
+    case 2:
+      return useDoublePrecision ? antsRegistration2DDouble( parser, pass ) : antsRegistration2DFloat( parser, pass );
+    case 3:
+      return useDoublePrecision ? antsRegistration3DDouble( parser, pass ) : antsRegistration3DFloat( parser, pass );
+    case 4:
+      return useDoublePrecision ? antsRegistration4DDouble( parser, pass ) : antsRegistration4DFloat( parser, pass );
+    default:
+      return EXIT_FAILURE;
+    }
+}
+
+/** Run the leading linear stages in double and the others in float. */
+static int antsRegistrationMixedPrecision( ParserType::Pointer & parser, unsigned int dimension, bool verbose )
+{
+  if( dimension < 2 || dimension > 4 )
+    {
+    if( verbose )
       {
-      // allocate space for the string plus a null character
-      argv[i] = new char[args[i].length() + 1];
-      std::strncpy( argv[i], args[i].c_str(), args[i].length() );
-      // place the null character in the end
-      argv[i][args[i].length()] = '\0';
+      std::cerr << "bad image dimension " << dimension << std::endl;
       }
-    argv[argc] = ITK_NULLPTR;
-    // class to automatically cleanup argv upon destruction
-    class Cleanup_argv
+    return EXIT_FAILURE;
+    }
+
+  OptionType::Pointer transformOption = parser->GetOption( "transform" );
+  const unsigned int  numberOfStages = transformOption ? transformOption->GetNumberOfFunctions() : 0;
+  const unsigned int  numberOfLinearStages = GetNumberOfLeadingLinearStages( parser );
+  if( numberOfLinearStages == 0 || numberOfLinearStages == numberOfStages )
     {
-public:
-      Cleanup_argv( char* * argv_, int argc_plus_one_ ) : argv( argv_ ), argc_plus_one( argc_plus_one_ )
+    if( verbose )
       {
+      std::cout << "Using " << ( numberOfLinearStages > 0 ? "double" : "single" )
+                << " precision for computations." << std::endl;
       }
+    return antsRegistrationPass( parser, dimension, numberOfLinearStages > 0, RegistrationPass() );
+    }
 
-      ~Cleanup_argv()
+  // Without a user checkpoint, the hand-over goes through one next to the
+  // outputs, which is removed at the end.
+  RegistrationPass   linearPass;
+  OptionType::Pointer checkpointOption = parser->GetOption( "checkpoint" );
+  const bool          hasUserCheckpoint = checkpointOption && checkpointOption->GetNumberOfFunctions();
+  if( hasUserCheckpoint )
+    {
+    linearPass.CheckpointPrefix = checkpointOption->GetFunction( 0 )->GetName();
+    }
+  else
+    {
+    OptionType::Pointer outputOption = parser->GetOption( "output" );
+    if( !outputOption || outputOption->GetNumberOfFunctions() == 0 )
       {
-        for( unsigned int i = 0; i < argc_plus_one; ++i )
-          {
-          delete[] argv[i];
-          }
-        delete[] argv;
+      if( verbose )
+        {
+        std::cerr << "Output option not specified." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    linearPass.CheckpointPrefix = outputOption->GetFunction( 0 )->GetName();
+    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      linearPass.CheckpointPrefix = outputOption->GetFunction( 0 )->GetParameter( 0 );
       }
+    linearPass.CheckpointPrefix += std::string( "MixedPrecision" );
+    }
+  linearPass.NumberOfStages = numberOfLinearStages;
+
+  if( verbose )
+    {
+    std::cout << "Using double precision for the first " << numberOfLinearStages
+              << " (linear) stage(s) and single precision for the others." << std::endl;
+    }
+  int result = antsRegistrationPass( parser, dimension, true, linearPass );
+  if( result == EXIT_SUCCESS )
+    {
+    RegistrationPass deformablePass;
+    deformablePass.CheckpointPrefix = linearPass.CheckpointPrefix;
+    result = antsRegistrationPass( parser, dimension, false, deformablePass );
+    }
+
+  if( !hasUserCheckpoint )
+    {
+    std::stringstream stageString;
+    stageString << linearPass.CheckpointPrefix << "CheckpointStage" << numberOfLinearStages;
+    itksys::SystemTools::RemoveFile( ( linearPass.CheckpointPrefix + std::string( "Checkpoint.txt" ) ).c_str() );
+    itksys::SystemTools::RemoveFile( ( stageString.str() + std::string( ".h5" ) ).c_str() );
+    itksys::SystemTools::RemoveFile( ( stageString.str() + std::string( "Inverse.h5" ) ).c_str() );
+    }
+  return result;
+}
 
-private:
-      char* *      argv;
-      unsigned int argc_plus_one;
-    };
-    Cleanup_argv cleanup_argv( argv, argc + 1 );
+// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
+// 'main()'
+
+int antsRegistration( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+{
+  try
+    {
+    // 'args' doesn't have the command name as first, argument, so add it manually;
+    // 'args' may have adjacent arguments concatenated into one argument,
+    // which the parser should handle.  The strings are parsed directly, with
+    // no copy into an (argc,argv) array.
+    args.insert( args.begin(), "antsRegistration" );
 
     //    // antscout->set_stream( out_stream );
 
     ParserType::Pointer parser = ParserType::New();
 
-    parser->SetCommand( argv[0] );
+    parser->SetCommand( args[0] );
 
     std::string commandDescription = std::string( "This program is a user-level " )
       + std::string( "registration application meant to utilize ITKv4-only classes. The user can specify " )
@@ -578,7 +766,7 @@ private:
     parser->SetCommandDescription( commandDescription );
     antsRegistrationInitializeCommandLineOptions( parser );
 
-    if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    if( parser->Parse( args ) == EXIT_FAILURE )
       {
       return EXIT_FAILURE;
       }
@@ -622,7 +810,7 @@ private:
       std::cout << "All_Command_lines_OK" << std::endl;
       }
 
-    if( argc == 1 )
+    if( args.size() == 1 )
       {
       parser->PrintMenu( std::cout, 5, false );
       return EXIT_FAILURE;
@@ -668,7 +856,13 @@ private:
 
     std::string precisionType;
     OptionType::Pointer typeOption = parser->GetOption( "float" );
-    if( typeOption && parser->Convert<bool>( typeOption->GetFunction( 0 )->GetName() ) )
+    OptionType::Pointer mixedPrecisionOption = parser->GetOption( "mixed-precision" );
+    if( mixedPrecisionOption && mixedPrecisionOption->GetNumberOfFunctions()
+        && parser->Convert<bool>( mixedPrecisionOption->GetFunction( 0 )->GetName() ) )
+      {
+      precisionType = "mixed";
+      }
+    else if( typeOption && parser->Convert<bool>( typeOption->GetFunction( 0 )->GetName() ) )
       {
       if( verbose )
         {
@@ -685,6 +879,29 @@ private:
       precisionType = "double";
       }
 
+    OptionType::Pointer memoryLimitOption = parser->GetOption( "memory-limit" );
+    if( memoryLimitOption && memoryLimitOption->GetNumberOfFunctions() )
+      {
+      ImageMemoryAccounting::SetEnabled( true );
+
+      const double memoryLimit = parser->Convert<double>( memoryLimitOption->GetFunction( 0 )->GetName() );
+      if( precisionType == "double" &&
+          EstimateRegistrationMemoryFootprint( parser, dimension, sizeof( double ), false ) > memoryLimit )
+        {
+        if( verbose )
+          {
+          std::cout << "Using single precision for computations to fit the memory limit of "
+                    << memoryLimit << " MB." << std::endl;
+          }
+        precisionType = "float";
+        }
+      }
+
+    if( precisionType == "mixed" )
+      {
+      return antsRegistrationMixedPrecision( parser, dimension, verbose );
+      }
+
     switch( dimension )
       {
       case 2:
@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 2DDouble version
-int antsRegistration2DDouble(ParserType::Pointer & parser)
+int antsRegistration2DDouble(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<double, 2>( parser );
+    return  DoRegistration<double, 2>( parser, pass );
 }
 
 } //end namespace ants
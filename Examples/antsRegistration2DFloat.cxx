@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 2DFloat version
-int antsRegistration2DFloat(ParserType::Pointer & parser)
+int antsRegistration2DFloat(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<float, 2>( parser );
+    return  DoRegistration<float, 2>( parser, pass );
 }
 
 } //end namespace ants
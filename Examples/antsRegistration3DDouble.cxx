@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 3DDouble version
-int antsRegistration3DDouble(ParserType::Pointer & parser)
+int antsRegistration3DDouble(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<double, 3>( parser );
+    return  DoRegistration<double, 3>( parser, pass );
 }
 
 } //end namespace ants
@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 3DFloat version
-int antsRegistration3DFloat(ParserType::Pointer & parser)
+int antsRegistration3DFloat(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<float, 3>( parser );
+    return  DoRegistration<float, 3>( parser, pass );
 }
 
 } //end namespace ants
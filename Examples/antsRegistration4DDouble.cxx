@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 4DDouble version
-int antsRegistration4DDouble(ParserType::Pointer & parser)
+int antsRegistration4DDouble(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<double, 4>( parser );
+    return  DoRegistration<double, 4>( parser, pass );
 }
 
 } //end namespace ants
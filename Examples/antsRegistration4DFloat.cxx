@@ -3,9 +3,9 @@
 namespace ants {
 
 //Instantiate the 4DFloat version
-int antsRegistration4DFloat(ParserType::Pointer & parser)
+int antsRegistration4DFloat(ParserType::Pointer & parser, const RegistrationPass & pass)
 {
-    return  DoRegistration<float, 4>( parser );
+    return  DoRegistration<float, 4>( parser, pass );
 }
 
 } //end namespace ants
@@ -65,6 +65,10 @@ public:
                      << std::flush << std::endl;
       // this->Logger() << "\n  LEVEL_TIME_INDEX: " << now << " SINCE_LAST: " << (now-this->m_lastTotalTime) <<
       // std::endl;
+      if( this->m_Telemetry )
+        {
+        this->m_Telemetry->BeginLevel( currentLevel );
+        }
       this->m_lastTotalTime = now;
       m_clock.Start();
 
@@ -94,6 +98,12 @@ public:
                      << std::setprecision(4) << now << ", "
                      << std::setprecision(4) << (now - this->m_lastTotalTime) << ", "
                      << std::flush << std::endl;
+      if( this->m_Telemetry )
+        {
+        this->m_Telemetry->RecordIteration( filter->GetCurrentLevel(), lCurrentIteration,
+                                            filter->GetCurrentMetricValue(), filter->GetCurrentConvergenceValue(),
+                                            now - this->m_lastTotalTime );
+        }
       this->m_lastTotalTime = now;
       m_clock.Start();
       }
@@ -109,6 +119,11 @@ public:
     this->m_LogStream = &logStream;
   }
 
+  void SetTelemetry( RegistrationTelemetry * telemetry )
+  {
+    this->m_Telemetry = telemetry;
+  }
+
 private:
   std::ostream & Logger() const
   {
@@ -117,6 +132,7 @@ private:
 
   std::vector<unsigned int>         m_NumberOfIterations;
   std::ostream *                    m_LogStream;
+  RegistrationTelemetry::Pointer    m_Telemetry;
   itk::TimeProbe                    m_clock;
   itk::RealTimeClock::TimeStampType m_lastTotalTime;
 
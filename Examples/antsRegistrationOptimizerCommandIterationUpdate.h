@@ -163,6 +163,11 @@ public:
 
       this->m_Optimizer->SetNumberOfIterations( this->m_NumberOfIterations[this->m_CurLevel] );
 
+      if( this->m_Telemetry )
+        {
+        this->m_Telemetry->RecordIteration( this->m_CurLevel, lCurrentIteration, this->m_Optimizer->GetValue(),
+                                            this->m_Optimizer->GetConvergenceValue(), now - this->m_lastTotalTime );
+        }
       this->m_lastTotalTime = now;
       m_clock.Start();
       }
@@ -189,6 +194,11 @@ public:
     this->m_LogStream = &logStream;
   }
 
+  void SetTelemetry( RegistrationTelemetry * telemetry )
+  {
+    this->m_Telemetry = telemetry;
+  }
+
   /**
    * Type defining the optimizer
    */
@@ -369,20 +379,11 @@ public:
       }
     std::cout << "*"; // The star befor each DIAGNOSTIC shows that its output is writtent out.
 
-    typedef itk::ImageFileWriter<ImageType> WarpedImageWriterType;
-    typename WarpedImageWriterType::Pointer writer = WarpedImageWriterType::New();
-    writer->SetFileName( currentFileName.str().c_str() );
-    writer->SetInput( resampler->GetOutput() );
-    try
-      {
-      writer->Update();
-      }
-    catch( itk::ExceptionObject & err )
-      {
-      std::cout << "Can't write warped image " << currentFileName.str().c_str() << std::endl;
-      std::cout << "Exception Object caught: " << std::endl;
-      std::cout << err << std::endl;
-      }
+    // the warped image is written on the background writer while the
+    // optimization goes on
+    typename ImageType::Pointer warpedImage = resampler->GetOutput();
+    warpedImage->DisconnectPipeline();
+    BackgroundWriter::Submit( new ImageWriteJob<ImageType>( warpedImage, currentFileName.str() ), std::cout );
   }
 
 private:
@@ -398,6 +399,7 @@ private:
 
   std::vector<unsigned int>         m_NumberOfIterations;
   std::ostream *                    m_LogStream;
+  RegistrationTelemetry::Pointer    m_Telemetry;
   itk::TimeProbe                    m_clock;
   itk::RealTimeClock::TimeStampType m_lastTotalTime;
 
@@ -0,0 +1,312 @@
+#ifndef antsRegistrationTelemetry__h_
+#define antsRegistrationTelemetry__h_
+
+#include "itkLightObject.h"
+#include "itkObjectFactory.h"
+#include "itkRealTimeClock.h"
+#include "vnl/vnl_math.h"
+
+#if defined( _WIN32 )
+#include "itkMemoryUsageObserver.h"
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/** \class RegistrationTelemetry
+ *  \brief machine-readable record of the progress of a registration
+ *
+ * The command iteration updates write a record for every level and every
+ * iteration of a stage next to their text table, and the registration
+ * helper writes one when a stage starts and one when it ends, with the
+ * time spent in each level and the peak resident set size of the process.
+ * All the times are wall times in seconds since the file was opened.
+ *
+ * The records are JSON Lines, or CSV if the file name ends in ".csv".  On
+ * POSIX systems a file name such as /dev/fd/3 writes to an open descriptor.
+ */
+class RegistrationTelemetry : public itk::LightObject
+{
+public:
+  typedef RegistrationTelemetry         Self;
+  typedef itk::LightObject              Superclass;
+  typedef itk::SmartPointer<Self>       Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+  itkNewMacro( Self );
+
+  bool Open( const std::string & fileName )
+  {
+    this->m_Stream.open( fileName.c_str(), std::ios::out | std::ios::trunc );
+    if( !this->m_Stream )
+      {
+      return false;
+      }
+    const std::string csvExtension( ".csv" );
+    this->m_IsCSV = fileName.size() >= csvExtension.size() &&
+      fileName.compare( fileName.size() - csvExtension.size(), csvExtension.size(), csvExtension ) == 0;
+    if( this->m_IsCSV )
+      {
+      for( unsigned int n = 0; n < NumberOfColumns; n++ )
+        {
+        this->m_Stream << ( n > 0 ? "," : "" ) << GetColumnName( n );
+        }
+      this->m_Stream << std::endl;
+      }
+    this->m_StartTime = this->m_Clock->GetTimeInSeconds();
+    return true;
+  }
+
+  bool IsOpen() const
+  {
+    return this->m_Stream.is_open();
+  }
+
+  void BeginStage( unsigned int stage, const std::string & transformName )
+  {
+    this->m_Stage = stage;
+    this->m_TransformName = transformName;
+    this->m_StageStartTime = this->GetWallTime();
+    this->m_NumberOfIterations = 0;
+    this->m_LevelTimes.clear();
+    this->m_CurrentLevel = -1;
+    this->m_LevelStartTime = this->m_StageStartTime;
+
+    this->BeginRecord( "stage" );
+    this->WriteField( "wallTime", this->m_StageStartTime );
+    this->EndRecord();
+  }
+
+  /** Levels which are not announced are started by their first iteration. */
+  void BeginLevel( unsigned int level )
+  {
+    this->CloseLevel();
+    this->m_CurrentLevel = level;
+    this->m_LevelStartTime = this->GetWallTime();
+
+    this->BeginRecord( "level" );
+    this->WriteField( "level", level );
+    this->WriteField( "wallTime", this->m_LevelStartTime );
+    this->EndRecord();
+  }
+
+  void RecordIteration( unsigned int level, unsigned int iteration, double metricValue,
+                        double convergenceValue, double iterationTime )
+  {
+    if( static_cast<int>( level ) != this->m_CurrentLevel )
+      {
+      this->BeginLevel( level );
+      }
+    this->m_NumberOfIterations++;
+
+    this->BeginRecord( "iteration" );
+    this->WriteField( "level", level );
+    this->WriteField( "iteration", iteration );
+    this->WriteField( "metricValue", metricValue );
+    this->WriteField( "convergenceValue", convergenceValue );
+    this->WriteField( "wallTime", this->GetWallTime() );
+    this->WriteField( "iterationTime", iterationTime );
+    this->EndRecord();
+  }
+
+  void EndStage()
+  {
+    this->CloseLevel();
+
+    this->BeginRecord( "stageSummary" );
+    this->WriteField( "wallTime", this->GetWallTime() );
+    this->WriteField( "numberOfIterations", this->m_NumberOfIterations );
+    this->WriteField( "elapsedTime", this->GetWallTime() - this->m_StageStartTime );
+    this->WriteField( "peakRSSKB", GetPeakResidentSetSize() );
+    if( !this->m_IsCSV )
+      {
+      this->m_Stream << ",\"levelTimes\":[";
+      for( unsigned int n = 0; n < this->m_LevelTimes.size(); n++ )
+        {
+        this->m_Stream << ( n > 0 ? "," : "" ) << this->m_LevelTimes[n];
+        }
+      this->m_Stream << "]";
+      }
+    this->EndRecord();
+  }
+
+  /** The peak resident set size of the process in kB, or on Windows the
+      largest working set seen by this object. */
+  static unsigned long GetPeakResidentSetSize()
+  {
+#if defined( _WIN32 )
+    static unsigned long              peakSize = 0;
+    itk::MemoryUsageObserver::Pointer observer = itk::MemoryUsageObserver::New();
+    const unsigned long               size = observer->GetMemoryUsage();
+    peakSize = std::max( peakSize, size );
+    return peakSize;
+#else
+    struct rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) != 0 )
+      {
+      return 0;
+      }
+#if defined( __APPLE__ )
+    return static_cast<unsigned long>( usage.ru_maxrss / 1024 );
+#else
+    return static_cast<unsigned long>( usage.ru_maxrss );
+#endif
+#endif
+  }
+
+protected:
+  RegistrationTelemetry() :
+    m_Clock( itk::RealTimeClock::New() ),
+    m_IsCSV( false ),
+    m_StartTime( 0.0 ),
+    m_Stage( 0 ),
+    m_StageStartTime( 0.0 ),
+    m_NumberOfIterations( 0 ),
+    m_CurrentLevel( -1 ),
+    m_LevelStartTime( 0.0 ),
+    m_FieldIndex( 0 )
+  {
+  }
+
+  ~RegistrationTelemetry()
+  {
+  }
+
+private:
+  RegistrationTelemetry( const Self & );
+  void operator=( const Self & );
+
+  double GetWallTime() const
+  {
+    return this->m_Clock->GetTimeInSeconds() - this->m_StartTime;
+  }
+
+  void CloseLevel()
+  {
+    if( this->m_CurrentLevel >= 0 )
+      {
+      this->m_LevelTimes.resize( this->m_CurrentLevel + 1, 0.0 );
+      this->m_LevelTimes[this->m_CurrentLevel] += this->GetWallTime() - this->m_LevelStartTime;
+      }
+  }
+
+  // The fields of all the records, which are the CSV columns in this order.
+  itkStaticConstMacro( NumberOfColumns, unsigned int, 12 );
+
+  static const char * GetColumnName( unsigned int column )
+  {
+    static const char * const columns[NumberOfColumns] = {
+      "record", "stage", "transform", "level", "iteration", "metricValue", "convergenceValue",
+      "wallTime", "iterationTime", "numberOfIterations", "elapsedTime", "peakRSSKB" };
+    return columns[column];
+  }
+
+  static int GetColumn( const std::string & name )
+  {
+    for( unsigned int n = 0; n < NumberOfColumns; n++ )
+      {
+      if( name == GetColumnName( n ) )
+        {
+        return n;
+        }
+      }
+    return -1;
+  }
+
+  void BeginRecord( const char * record )
+  {
+    if( !this->m_Stream.is_open() )
+      {
+      return;
+      }
+    this->m_Stream << std::setprecision( 12 );
+    if( this->m_IsCSV )
+      {
+      this->m_Stream << record << "," << this->m_Stage << "," << this->m_TransformName;
+      this->m_FieldIndex = 3;
+      }
+    else
+      {
+      this->m_Stream << "{\"record\":\"" << record << "\",\"stage\":" << this->m_Stage
+                     << ",\"transform\":\"" << this->m_TransformName << "\"";
+      }
+  }
+
+  /** NaN and infinite values, which JSON does not have, are left empty. */
+  void WriteField( const char * name, double value )
+  {
+    if( vnl_math_isfinite( value ) )
+      {
+      this->WriteField<double>( name, value );
+      }
+    else if( !this->m_IsCSV )
+      {
+      this->WriteField<const char *>( name, "null" );
+      }
+  }
+
+  template <class TValue>
+  void WriteField( const char * name, const TValue & value )
+  {
+    if( !this->m_Stream.is_open() )
+      {
+      return;
+      }
+    if( this->m_IsCSV )
+      {
+      // skip to the column of the field, leaving the ones in between empty
+      for( const int column = GetColumn( name ); this->m_FieldIndex <= column; this->m_FieldIndex++ )
+        {
+        this->m_Stream << ",";
+        }
+      this->m_Stream << value;
+      }
+    else
+      {
+      this->m_Stream << ",\"" << name << "\":" << value;
+      }
+  }
+
+  void EndRecord()
+  {
+    if( !this->m_Stream.is_open() )
+      {
+      return;
+      }
+    if( this->m_IsCSV )
+      {
+      for( ; this->m_FieldIndex < static_cast<int>( NumberOfColumns ); this->m_FieldIndex++ )
+        {
+        this->m_Stream << ",";
+        }
+      this->m_Stream << std::endl;
+      }
+    else
+      {
+      this->m_Stream << "}" << std::endl;
+      }
+  }
+
+  itk::RealTimeClock::Pointer m_Clock;
+  std::ofstream               m_Stream;
+  bool                        m_IsCSV;
+  double                      m_StartTime;
+
+  unsigned int                m_Stage;
+  std::string                 m_TransformName;
+  double                      m_StageStartTime;
+  unsigned int                m_NumberOfIterations;
+  std::vector<double>         m_LevelTimes;
+  int                         m_CurrentLevel;
+  double                      m_LevelStartTime;
+
+  int                         m_FieldIndex;
+};
+} // end namespace ants
+#endif // antsRegistrationTelemetry__h_
@@ -1,4 +1,7 @@
 #include "antsRegistrationTemplateHeader.h"
+#include "itkImageIOFactory.h"
+
+#include <set>
 
 namespace ants{
 const char *
@@ -110,4 +113,133 @@ RegTypeToFileName(const std::string & type, bool & writeInverse, bool & writeVel
     }
   return "BOGUS.XXXX";
 }
+
+// The number of voxels of an image, read from its header, or 0 if the file
+// is not an image (e.g. a point set).
+static double GetNumberOfVoxelsFromImageHeader( const std::string & fileName )
+{
+  itk::ImageIOBase::Pointer imageIO =
+    itk::ImageIOFactory::CreateImageIO( fileName.c_str(), itk::ImageIOFactory::ReadMode );
+  if( imageIO.IsNull() )
+    {
+    return 0.0;
+    }
+  imageIO->SetFileName( fileName.c_str() );
+  try
+    {
+    imageIO->ReadImageInformation();
+    }
+  catch( itk::ExceptionObject & )
+    {
+    return 0.0;
+    }
+  return static_cast<double>( imageIO->GetImageSizeInPixels() );
+}
+
+double
+EstimateRegistrationMemoryFootprint( ParserType * parser, unsigned int dimension, unsigned int sizeOfRealType,
+                                     bool reduceMemoryFootprint )
+{
+  const double bytesPerVoxel = sizeOfRealType;
+  const double bytesPerFieldVoxel = static_cast<double>( sizeOfRealType ) * dimension;
+
+  // The input images are read once each.  Each metric of the current stage
+  // also holds a preprocessed copy and the smoothed and shrunk images of the
+  // current level, and the cache keeps the preprocessed images of the other
+  // stages.  The virtual domain is the largest fixed image.
+  std::set<std::string> fileNames;
+  double inputBytes = 0.0;
+  double largestMetricBytes = 0.0;
+  double virtualDomainVoxels = 0.0;
+
+  OptionType::Pointer metricOption = parser->GetOption( "metric" );
+  for( unsigned int n = 0; metricOption && n < metricOption->GetNumberOfFunctions(); n++ )
+    {
+    OptionType::OptionFunctionType::Pointer function = metricOption->GetFunction( n );
+    if( function->GetNumberOfParameters() < 2 )
+      {
+      continue;
+      }
+    double metricBytes = 0.0;
+    for( unsigned int p = 0; p < 2; p++ )
+      {
+      const std::string fileName = function->GetParameter( p );
+      const double numberOfVoxels = GetNumberOfVoxelsFromImageHeader( fileName );
+      if( fileNames.insert( fileName ).second )
+        {
+        inputBytes += bytesPerVoxel * numberOfVoxels;
+        }
+      metricBytes += bytesPerVoxel * numberOfVoxels;
+      if( p == 0 )
+        {
+        virtualDomainVoxels = std::max( virtualDomainVoxels, numberOfVoxels );
+        }
+      }
+    largestMetricBytes = std::max( largestMetricBytes, metricBytes );
+    }
+
+  const double cacheLimitInBytes = 2048.0 * 1024.0 * 1024.0;
+  const double preprocessedBytes = reduceMemoryFootprint ? largestMetricBytes :
+    std::max( largestMetricBytes, std::min( inputBytes, cacheLimitInBytes ) );
+  const double imageBytes = inputBytes + preprocessedBytes + 2.0 * largestMetricBytes;
+
+  // The fields each dense stage keeps in the output transform, and the
+  // fields it needs while it runs on top of those.
+  double numberOfOutputFields = 0.0;
+  double numberOfWorkingFields = 0.0;
+
+  OptionType::Pointer transformOption = parser->GetOption( "transform" );
+  for( unsigned int n = 0; transformOption && n < transformOption->GetNumberOfFunctions(); n++ )
+    {
+    OptionType::OptionFunctionType::Pointer function = transformOption->GetFunction( n );
+    std::string transformName = function->GetName();
+    ConvertToLowerCase( transformName );
+
+    double numberOfTimePoints = 4.0;
+    if( ( transformName == "timevaryingvelocityfield" || transformName == "tvf" ) &&
+        function->GetNumberOfParameters() > 1 )
+      {
+      numberOfTimePoints = parser->Convert<double>( function->GetParameter( 1 ) );
+      }
+
+    if( transformName == "syn" || transformName == "symmetricnormalization" || transformName == "bsplinesyn" )
+      {
+      // the output field and its inverse, and while the stage runs the fixed
+      // and moving to middle fields with their inverses and the update fields
+      numberOfOutputFields += 2.0;
+      numberOfWorkingFields = std::max( numberOfWorkingFields, 6.0 );
+      }
+    else if( transformName == "gaussiandisplacementfield" || transformName == "gdf" ||
+             transformName == "bsplinedisplacementfield" || transformName == "dmffd" )
+      {
+      numberOfOutputFields += 1.0;
+      numberOfWorkingFields = std::max( numberOfWorkingFields, 3.0 );
+      }
+    else if( transformName == "exponential" || transformName == "exp" || transformName == "bsplineexponential" )
+      {
+      numberOfOutputFields += 3.0;
+      numberOfWorkingFields = std::max( numberOfWorkingFields, 3.0 );
+      }
+    else if( transformName == "timevaryingvelocityfield" || transformName == "tvf" ||
+             transformName == "timevaryingbsplinevelocityfield" || transformName == "tvdmffd" )
+      {
+      numberOfOutputFields += 2.0 + numberOfTimePoints;
+      numberOfWorkingFields = std::max( numberOfWorkingFields, 4.0 + numberOfTimePoints );
+      }
+    }
+
+  // Collapsing the output transforms composes the forward and inverse fields
+  // through intermediate fields, or in place into one copy of each.
+  OptionType::Pointer collapseOutputTransformsOption = parser->GetOption( "collapse-output-transforms" );
+  if( numberOfOutputFields > 0.0 && collapseOutputTransformsOption &&
+      collapseOutputTransformsOption->GetNumberOfFunctions() &&
+      parser->Convert<bool>( collapseOutputTransformsOption->GetFunction( 0 )->GetName() ) )
+    {
+    numberOfWorkingFields = std::max( numberOfWorkingFields, reduceMemoryFootprint ? 2.0 : 4.0 );
+    }
+
+  const double fieldBytes = bytesPerFieldVoxel * virtualDomainVoxels * ( numberOfOutputFields + numberOfWorkingFields );
+
+  return ( imageBytes + fieldBytes ) / ( 1024.0 * 1024.0 );
+}
 }// end namespace ants
@@ -17,19 +17,43 @@
 #include "itkGaussianInterpolateImageFunction.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkWindowedSincInterpolateImageFunction.h"
-#include "itkLabelImageGaussianInterpolateImageFunction.h"
+#include "itkFastLabelImageGaussianInterpolateImageFunction.h"
 #include "itkLabelImageGenericInterpolateImageFunction.h"
 #include "include/antsRegistration.h"
 #include "ReadWriteData.h"
+#include <map>
 
 namespace ants
 {
 
 extern const char * RegTypeToFileName(const std::string & type, bool & writeInverse, bool & writeVelocityField,bool minc);
 
+/** An estimate, in megabytes, of the peak memory taken by the images and
+    fields of the registration described on the command line, computed from
+    the image headers. */
+extern double EstimateRegistrationMemoryFootprint( ParserType * parser, unsigned int dimension,
+                                                   unsigned int sizeOfRealType, bool reduceMemoryFootprint );
+
+/** The part of the stages of the command line run by one call of
+    DoRegistration().  A mixed precision registration runs its leading linear
+    stages in double, stopping after NumberOfStages stages and leaving their
+    transforms in the checkpoint with CheckpointPrefix, and then the other
+    stages in float, resuming from that checkpoint.  The default runs all the
+    stages. */
+struct RegistrationPass
+  {
+  RegistrationPass() :
+    NumberOfStages( 0 )
+  {
+  }
+
+  unsigned int NumberOfStages;
+  std::string  CheckpointPrefix;
+  };
+
 template <class TComputeType, unsigned VImageDimension>
 int
-DoRegistration(typename ParserType::Pointer & parser)
+DoRegistration(typename ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() )
 {
   typedef TComputeType                                                     RealType;
   typedef typename ants::RegistrationHelper<TComputeType, VImageDimension> RegistrationHelperType;
@@ -305,6 +329,122 @@ DoRegistration(typename ParserType::Pointer & parser)
       }
     }
 
+  ParserType::OptionType::Pointer adaptiveLevelScheduleOption = parser->GetOption( "adaptive-level-schedule" );
+  if( adaptiveLevelScheduleOption && adaptiveLevelScheduleOption->GetNumberOfFunctions() )
+    {
+    TComputeType minimumRelativeGain = 0.0;
+    bool         carryOverUnusedIterations = false;
+    if( adaptiveLevelScheduleOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      minimumRelativeGain =
+        parser->Convert<TComputeType>( adaptiveLevelScheduleOption->GetFunction( 0 )->GetParameter( 0 ) );
+      }
+    else
+      {
+      minimumRelativeGain =
+        parser->Convert<TComputeType>( adaptiveLevelScheduleOption->GetFunction( 0 )->GetName() );
+      }
+    if( adaptiveLevelScheduleOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+      {
+      carryOverUnusedIterations =
+        parser->Convert<bool>( adaptiveLevelScheduleOption->GetFunction( 0 )->GetParameter( 1 ) );
+      }
+    regHelper->SetAdaptiveLevelSchedule( minimumRelativeGain, carryOverUnusedIterations );
+    }
+
+  ParserType::OptionType::Pointer telemetryOption = parser->GetOption( "telemetry" );
+  if( telemetryOption && telemetryOption->GetNumberOfFunctions() )
+    {
+    regHelper->SetTelemetryFileName( telemetryOption->GetFunction( 0 )->GetName() );
+    }
+
+  ParserType::OptionType::Pointer fixedImageCacheOption = parser->GetOption( "fixed-image-cache" );
+  if( fixedImageCacheOption && fixedImageCacheOption->GetNumberOfFunctions() )
+    {
+    regHelper->SetFixedImageCacheDirectory( fixedImageCacheOption->GetFunction( 0 )->GetName() );
+    }
+
+  double memoryLimit = 0.0;
+  double estimatedMemoryFootprint = 0.0;
+  ParserType::OptionType::Pointer memoryLimitOption = parser->GetOption( "memory-limit" );
+  if( memoryLimitOption && memoryLimitOption->GetNumberOfFunctions() )
+    {
+    memoryLimit = parser->Convert<double>( memoryLimitOption->GetFunction( 0 )->GetName() );
+    estimatedMemoryFootprint =
+      EstimateRegistrationMemoryFootprint( parser, VImageDimension, sizeof( TComputeType ), false );
+    if( estimatedMemoryFootprint > memoryLimit )
+      {
+      regHelper->ReduceMemoryFootprintOn();
+      estimatedMemoryFootprint =
+        EstimateRegistrationMemoryFootprint( parser, VImageDimension, sizeof( TComputeType ), true );
+      if( verbose )
+        {
+        std::cout << "Reducing the memory footprint to fit the memory limit of " << memoryLimit
+                  << " MB:  the preprocessed images are not cached and the output transforms are"
+                  << " collapsed in place." << std::endl;
+        if( estimatedMemoryFootprint > memoryLimit )
+          {
+          std::cerr << "WARNING:  the estimated peak memory of " << estimatedMemoryFootprint
+                    << " MB is still over the memory limit." << std::endl;
+          }
+        }
+      }
+    }
+
+  ParserType::OptionType::Pointer checkpointOption = parser->GetOption( "checkpoint" );
+  ParserType::OptionType::Pointer resumeOption = parser->GetOption( "resume" );
+
+  const bool resume = resumeOption && resumeOption->GetNumberOfFunctions()
+    && parser->Convert<bool>( resumeOption->GetFunction( 0 )->GetName() );
+  if( checkpointOption && checkpointOption->GetNumberOfFunctions() )
+    {
+    const std::string checkpointPrefix = checkpointOption->GetFunction( 0 )->GetName();
+    regHelper->SetCheckpointPrefix( checkpointPrefix );
+    if( resume )
+      {
+      if( restoreStateOption && restoreStateOption->GetNumberOfFunctions() )
+        {
+        if( verbose )
+          {
+          std::cerr << "ERROR:  resume and restore-state options are mutually exclusive." << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      // the checkpoint already contains the moving initial transforms set above
+      if( regHelper->RestoreCheckpoint( checkpointPrefix ) == EXIT_FAILURE )
+        {
+        return EXIT_FAILURE;
+        }
+      }
+    }
+  else if( resume )
+    {
+    if( verbose )
+      {
+      std::cerr << "ERROR:  --resume requires --checkpoint" << std::endl;
+      }
+    return EXIT_FAILURE;
+    }
+
+  if( !pass.CheckpointPrefix.empty() )
+    {
+    if( pass.NumberOfStages > 0 )
+      {
+      regHelper->SetCheckpointPrefix( pass.CheckpointPrefix );
+      regHelper->SetNumberOfStagesToRun( pass.NumberOfStages );
+      if( regHelper->GetNumberOfCompletedStages() >= pass.NumberOfStages )
+        {
+        // resumed past the stages of this pass
+        return EXIT_SUCCESS;
+        }
+      }
+    else if( regHelper->GetNumberOfCompletedStages() == 0 &&
+             regHelper->RestoreCheckpoint( pass.CheckpointPrefix ) == EXIT_FAILURE )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
   if( maskOption && maskOption->GetNumberOfFunctions() )
     {
     if( verbose )
@@ -690,7 +830,13 @@ DoRegistration(typename ParserType::Pointer & parser)
           meshSizeAtBaseLevel = regHelper->CalculateMeshSizeForSpecifiedKnotSpacing(
               fixedImage, meshSizeAtBaseLevel[0], 3 );
           }
-        regHelper->AddBSplineTransform( learningRate, meshSizeAtBaseLevel );
+        bool useControlPointSupportGradient = false;
+        if( transformOption->GetFunction( currentStage )->GetNumberOfParameters() > 2 )
+          {
+          useControlPointSupportGradient =
+            parser->Convert<bool>( transformOption->GetFunction( currentStage )->GetParameter( 2 ) );
+          }
+        regHelper->AddBSplineTransform( learningRate, meshSizeAtBaseLevel, useControlPointSupportGradient );
         }
         break;
       case RegistrationHelperType::TimeVaryingVelocityField:
@@ -916,6 +1062,17 @@ DoRegistration(typename ParserType::Pointer & parser)
   // ID to the added metric.  Multiple metrics for a single stage are specified
   // on the command line by being specified adjacently.
 
+  // Stages commonly reuse the same fixed and moving image files.  Read each
+  // file only once so that the registration helper sees the same image object
+  // and can share the preprocessed images between stages.
+  typedef std::map<std::string, typename ImageType::Pointer> ImageFileCacheType;
+  ImageFileCacheType imageFileCache;
+
+  // Likewise, the IGDM point set of an image, mask, neighborhood radius and
+  // gradient sigma is only extracted once for all the stages using it.
+  typedef std::map<std::string, typename IntensityPointSetType::Pointer> IntensityPointSetCacheType;
+  IntensityPointSetCacheType intensityPointSetCache;
+
   unsigned int numberOfMetrics = metricOption->GetNumberOfFunctions();
   for( int currentMetricNumber = numberOfMetrics - 1; currentMetricNumber >= 0; currentMetricNumber-- )
     {
@@ -993,10 +1150,28 @@ DoRegistration(typename ParserType::Pointer & parser)
         std::cout << "  moving image: " << movingFileName << std::endl;
         }
 
-      ReadImage<ImageType>( fixedImage, fixedFileName.c_str() );
-      ReadImage<ImageType>( movingImage, movingFileName.c_str() );
-      fixedImage->DisconnectPipeline();
-      movingImage->DisconnectPipeline();
+      typename ImageFileCacheType::const_iterator itCache = imageFileCache.find( fixedFileName );
+      if( itCache != imageFileCache.end() )
+        {
+        fixedImage = itCache->second;
+        }
+      else
+        {
+        ReadImage<ImageType>( fixedImage, fixedFileName.c_str() );
+        fixedImage->DisconnectPipeline();
+        imageFileCache[fixedFileName] = fixedImage;
+        }
+      itCache = imageFileCache.find( movingFileName );
+      if( itCache != imageFileCache.end() )
+        {
+        movingImage = itCache->second;
+        }
+      else
+        {
+        ReadImage<ImageType>( movingImage, movingFileName.c_str() );
+        movingImage->DisconnectPipeline();
+        imageFileCache[movingFileName] = movingImage;
+        }
 
       std::string strategy = "none";
       if( metricOption->GetFunction( currentMetricNumber )->GetNumberOfParameters() > 4 )
@@ -1013,6 +1188,10 @@ DoRegistration(typename ParserType::Pointer & parser)
         {
         samplingStrategy = RegistrationHelperType::regular;
         }
+      else if( strategy == "importance" )
+        {
+        samplingStrategy = RegistrationHelperType::importance;
+        }
       else if( ( strategy == "none" ) || ( strategy == "" ) )
         {
         samplingStrategy = RegistrationHelperType::none;
@@ -1113,16 +1292,43 @@ DoRegistration(typename ParserType::Pointer & parser)
           return EXIT_FAILURE;
           }
 
-        ReadImageIntensityPointSet<ImageType, MaskImageType, IntensityPointSetType>(
-          fixedIntensityPointSet, fixedFileName.c_str(), fixedPointSetMaskFile.c_str(),
-          neighborhoodRadius, gradientPointSetSigma );
+        std::stringstream pointSetParameters;
+        pointSetParameters << "|" << gradientPointSetSigma;
+        for( unsigned int d = 0; d < neighborhoodRadius.size(); d++ )
+          {
+          pointSetParameters << "|" << neighborhoodRadius[d];
+          }
+        const std::string fixedPointSetKey = fixedFileName + "|" + fixedPointSetMaskFile + pointSetParameters.str();
+        const std::string movingPointSetKey = movingFileName + "|" + movingPointSetMaskFile + pointSetParameters.str();
 
-        ReadImageIntensityPointSet<ImageType, MaskImageType, IntensityPointSetType>(
-          movingIntensityPointSet, movingFileName.c_str(), movingPointSetMaskFile.c_str(),
-          neighborhoodRadius, gradientPointSetSigma );
+        typename IntensityPointSetCacheType::const_iterator itPointSetCache =
+          intensityPointSetCache.find( fixedPointSetKey );
+        if( itPointSetCache != intensityPointSetCache.end() )
+          {
+          fixedIntensityPointSet = itPointSetCache->second;
+          }
+        else
+          {
+          ReadImageIntensityPointSet<ImageType, MaskImageType, IntensityPointSetType>(
+            fixedIntensityPointSet, fixedFileName.c_str(), fixedPointSetMaskFile.c_str(),
+            neighborhoodRadius, gradientPointSetSigma );
+          fixedIntensityPointSet->DisconnectPipeline();
+          intensityPointSetCache[fixedPointSetKey] = fixedIntensityPointSet;
+          }
 
-        fixedIntensityPointSet->DisconnectPipeline();
-        movingIntensityPointSet->DisconnectPipeline();
+        itPointSetCache = intensityPointSetCache.find( movingPointSetKey );
+        if( itPointSetCache != intensityPointSetCache.end() )
+          {
+          movingIntensityPointSet = itPointSetCache->second;
+          }
+        else
+          {
+          ReadImageIntensityPointSet<ImageType, MaskImageType, IntensityPointSetType>(
+            movingIntensityPointSet, movingFileName.c_str(), movingPointSetMaskFile.c_str(),
+            neighborhoodRadius, gradientPointSetSigma );
+          movingIntensityPointSet->DisconnectPipeline();
+          intensityPointSetCache[movingPointSetKey] = movingIntensityPointSet;
+          }
         }
       else
         {
@@ -1202,6 +1408,12 @@ DoRegistration(typename ParserType::Pointer & parser)
     return EXIT_FAILURE;
     }
 
+  // the transforms of a partial pass are written by the pass which completes it
+  if( pass.NumberOfStages > 0 )
+    {
+    return EXIT_SUCCESS;
+    }
+
   // write out transforms stored in the composite
   typename CompositeTransformType::Pointer resultTransform = regHelper->GetModifiableCompositeTransform();
   unsigned int numTransforms = resultTransform->GetNumberOfTransforms();
@@ -1455,20 +1667,28 @@ DoRegistration(typename ParserType::Pointer & parser)
       }
     }
 
+  if( memoryLimit > 0.0 && verbose )
+    {
+    std::cout << "Peak memory (limit " << memoryLimit << " MB):  estimated " << estimatedMemoryFootprint
+              << " MB, images and fields " << ImageMemoryAccounting::GetPeakBytes() / ( 1024.0 * 1024.0 )
+              << " MB, resident set size " << RegistrationTelemetry::GetPeakResidentSetSize() / 1024.0
+              << " MB" << std::endl;
+    }
+
   return EXIT_SUCCESS;
 }
 
-extern int antsRegistration2DDouble(ParserType::Pointer & parser);
+extern int antsRegistration2DDouble(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
-extern int antsRegistration3DDouble(ParserType::Pointer & parser);
+extern int antsRegistration3DDouble(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
-extern int antsRegistration4DDouble(ParserType::Pointer & parser);
+extern int antsRegistration4DDouble(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
-extern int antsRegistration2DFloat(ParserType::Pointer & parser);
+extern int antsRegistration2DFloat(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
-extern int antsRegistration3DFloat(ParserType::Pointer & parser);
+extern int antsRegistration3DFloat(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
-extern int antsRegistration4DFloat(ParserType::Pointer & parser);
+extern int antsRegistration4DFloat(ParserType::Pointer & parser, const RegistrationPass & pass = RegistrationPass() );
 
 } // End namespace
 
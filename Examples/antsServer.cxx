@@ -0,0 +1,576 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#include "antsUtilities.h"
+#include "antsCommandLineParser.h"
+#include "antsObjectCache.h"
+#include "ReadWriteData.h"
+
+#include "include/antsApplyTransforms.h"
+#include "include/antsRegistration.h"
+
+#include "itkMultiThreader.h"
+#include "itkMutexLockHolder.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkTransformFactoryBase.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+// A job is sent as its command and arguments, one per line, and ends with an
+// empty line.  The reply is the exit code of the command on one line.
+
+static bool SendAll( int socketDescriptor, const std::string & message )
+{
+  std::string::size_type sent = 0;
+  while( sent < message.size() )
+    {
+    const ssize_t n = send( socketDescriptor, message.data() + sent, message.size() - sent, 0 );
+    if( n < 0 && errno == EINTR )
+      {
+      continue;
+      }
+    if( n <= 0 )
+      {
+      return false;
+      }
+    sent += static_cast<std::string::size_type>( n );
+    }
+  return true;
+}
+
+// The lines up to the first empty one, or up to the end of the stream.
+static bool ReceiveLines( int socketDescriptor, std::vector<std::string> & lines )
+{
+  lines.clear();
+  std::string line;
+  char        buffer[4096];
+  while( true )
+    {
+    const ssize_t n = recv( socketDescriptor, buffer, sizeof( buffer ), 0 );
+    if( n < 0 && errno == EINTR )
+      {
+      continue;
+      }
+    if( n <= 0 )
+      {
+      if( !line.empty() )
+        {
+        lines.push_back( line );
+        }
+      return !lines.empty();
+      }
+    for( ssize_t i = 0; i < n; i++ )
+      {
+      if( buffer[i] != '\n' )
+        {
+        line += buffer[i];
+        }
+      else if( line.empty() )
+        {
+        return true;
+        }
+      else
+        {
+        lines.push_back( line );
+        line.clear();
+        }
+      }
+    }
+}
+
+static bool GetSocketAddress( const std::string & socketName, struct sockaddr_un & address )
+{
+  if( socketName.size() >= sizeof( address.sun_path ) )
+    {
+    std::cerr << "The socket name " << socketName << " is too long." << std::endl;
+    return false;
+    }
+  std::memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  std::strncpy( address.sun_path, socketName.c_str(), sizeof( address.sun_path ) - 1 );
+  return true;
+}
+
+static int SubmitJob( const std::string & socketName, const std::vector<std::string> & job )
+{
+  struct sockaddr_un address;
+  if( !GetSocketAddress( socketName, address ) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  const int socketDescriptor = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( socketDescriptor < 0 ||
+      connect( socketDescriptor, reinterpret_cast<struct sockaddr *>( &address ), sizeof( address ) ) != 0 )
+    {
+    std::cerr << "Could not connect to the server at " << socketName << ": " << std::strerror( errno ) << std::endl;
+    if( socketDescriptor >= 0 )
+      {
+      close( socketDescriptor );
+      }
+    return EXIT_FAILURE;
+    }
+
+  std::string request;
+  for( unsigned int n = 0; n < job.size(); n++ )
+    {
+    request += job[n] + "\n";
+    }
+  request += "\n";
+
+  std::vector<std::string> reply;
+  const bool received = SendAll( socketDescriptor, request ) && ReceiveLines( socketDescriptor, reply );
+  close( socketDescriptor );
+  if( !received )
+    {
+    std::cerr << "The server at " << socketName << " did not reply." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  for( unsigned int n = 1; n < reply.size(); n++ )
+    {
+    std::cout << reply[n] << std::endl;
+    }
+  return std::atoi( reply[0].c_str() );
+}
+
+// Restores the number of threads and the cache memory of the process on
+// every return of the server, since the server may run within another tool.
+class ServerSettingsGuard
+{
+public:
+  ServerSettingsGuard() :
+    m_NumberOfThreads( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+    m_CacheMemory( ObjectCache::GetMaximumMemory() )
+  {
+  }
+
+  ~ServerSettingsGuard()
+  {
+    ObjectCache::SetMaximumMemory( this->m_CacheMemory );
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( this->m_NumberOfThreads );
+  }
+
+  itk::ThreadIdType GetNumberOfThreads() const
+  {
+    return this->m_NumberOfThreads;
+  }
+
+private:
+  ServerSettingsGuard( const ServerSettingsGuard & ); // purposely not implemented
+  void operator=( const ServerSettingsGuard & );      // purposely not implemented
+
+  const itk::ThreadIdType m_NumberOfThreads;
+  const unsigned long     m_CacheMemory;
+};
+
+struct ServerThreadStruct
+  {
+  int                      m_SocketDescriptor;
+  bool                     m_ShuttingDown;
+  unsigned long            m_NumberOfCompletedJobs;
+  unsigned long            m_NumberOfFailedJobs;
+  itk::SimpleFastMutexLock m_Mutex;
+  };
+
+static std::string RunJob( ServerThreadStruct *str, const std::vector<std::string> & job )
+{
+  const std::string              command = job[0];
+  const std::vector<std::string> args( job.begin() + 1, job.end() );
+
+  std::stringstream reply;
+  if( command == "shutdown" )
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->m_Mutex );
+    str->m_ShuttingDown = true;
+    // wake up the threads waiting for a connection
+    shutdown( str->m_SocketDescriptor, SHUT_RDWR );
+    reply << EXIT_SUCCESS << "\n";
+    return reply.str();
+    }
+  if( command == "status" )
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->m_Mutex );
+    reply << EXIT_SUCCESS << "\n"
+          << "completed jobs: " << str->m_NumberOfCompletedJobs << "\n"
+          << "failed jobs: " << str->m_NumberOfFailedJobs << "\n"
+          << "cache memory in use: " << ObjectCache::GetMemoryInUse() / ( 1024 * 1024 ) << " MB\n";
+    return reply.str();
+    }
+
+  int exitCode = EXIT_FAILURE;
+  try
+    {
+    if( command == "antsRegistration" )
+      {
+      exitCode = antsRegistration( args, &std::cout );
+      }
+    else if( command == "antsApplyTransforms" )
+      {
+      exitCode = antsApplyTransforms( args, &std::cout );
+      }
+    else
+      {
+      std::cerr << "Unknown command " << command << std::endl;
+      }
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "Exception caught in " << command << ": " << err << std::endl;
+    exitCode = EXIT_FAILURE;
+    }
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->m_Mutex );
+  str->m_NumberOfCompletedJobs++;
+  if( exitCode != EXIT_SUCCESS )
+    {
+    str->m_NumberOfFailedJobs++;
+    }
+  reply << exitCode << "\n";
+  return reply.str();
+}
+
+// Every thread takes the next connection and runs its job, so there are as
+// many jobs running at once as there are threads.
+static ITK_THREAD_RETURN_TYPE ServerThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *threadInfo = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ServerThreadStruct *                  str = static_cast<ServerThreadStruct *>( threadInfo->UserData );
+
+  while( true )
+    {
+    const int connection = accept( str->m_SocketDescriptor, ITK_NULLPTR, ITK_NULLPTR );
+    const int acceptError = errno;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( str->m_Mutex );
+      if( str->m_ShuttingDown )
+        {
+        if( connection >= 0 )
+          {
+          close( connection );
+          }
+        break;
+        }
+      }
+    if( connection < 0 )
+      {
+      if( acceptError == EINTR || acceptError == ECONNABORTED )
+        {
+        continue;
+        }
+      std::cerr << "Could not accept a connection: " << std::strerror( acceptError ) << std::endl;
+      break;
+      }
+
+    std::vector<std::string> job;
+    if( ReceiveLines( connection, job ) )
+      {
+      SendAll( connection, RunJob( str, job ) );
+      }
+    close( connection );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <unsigned int ImageDimension>
+static void PreloadImage( const std::string & fileName )
+{
+  // load the image in the pixel types antsRegistration and antsApplyTransforms read
+  typedef itk::Image<float, ImageDimension>  FloatImageType;
+  typedef itk::Image<double, ImageDimension> DoubleImageType;
+
+  typename FloatImageType::Pointer floatImage;
+  ReadImage<FloatImageType>( floatImage, fileName.c_str() );
+  typename DoubleImageType::Pointer doubleImage;
+  ReadImage<DoubleImageType>( doubleImage, fileName.c_str() );
+}
+
+static void antsServerInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
+{
+  typedef itk::ants::CommandLineParser::OptionType OptionType;
+
+  {
+  std::string description = std::string( "The local (Unix domain) socket on which the jobs are accepted." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "socket" );
+  option->SetShortName( 's' );
+  option->SetUsageOption( 0, "socketFileName" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The number of jobs run at the same time.  The threads of the " )
+    + std::string( "process (ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS, or the number of cores) are shared " )
+    + std::string( "between them." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "jobs" );
+  option->SetShortName( 'j' );
+  option->SetUsageOption( 0, "1" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The memory, in megabytes, of the cache keeping the images and " )
+    + std::string( "transforms read by the jobs for the following ones." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "cache-memory" );
+  option->SetUsageOption( 0, "4096" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Images, e.g. a template, read into the cache before the first " )
+    + std::string( "job.  The option can be given several times." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "preload" );
+  option->SetShortName( 'p' );
+  option->SetUsageOption( 0, "imageFileName" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "The dimensionality of the preloaded images." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "dimensionality" );
+  option->SetShortName( 'd' );
+  option->SetUsageOption( 0, "2/(3)/4" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu (short version)." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetShortName( 'h' );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description = std::string( "Print the help menu." );
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "help" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+}
+
+// entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
+// 'main()'
+int antsServer( std::vector<std::string> args, std::ostream * /*out_stream = NULL */ )
+{
+  // antsServer --submit socketFileName command arguments...
+  if( args.size() >= 3 && args[0] == "--submit" )
+    {
+    return SubmitJob( args[1], std::vector<std::string>( args.begin() + 2, args.end() ) );
+    }
+
+  // put the arguments coming in as 'args' into standard (argc,argv) format;
+  // 'args' doesn't have the command name as first, argument, so add it manually;
+  // 'args' may have adjacent arguments concatenated into one argument,
+  // which the parser should handle
+  args.insert( args.begin(), "antsServer" );
+  int     argc = args.size();
+  char* * argv = new char *[args.size() + 1];
+  for( unsigned int i = 0; i < args.size(); ++i )
+    {
+    // allocate space for the string plus a null character
+    argv[i] = new char[args[i].length() + 1];
+    std::strncpy( argv[i], args[i].c_str(), args[i].length() );
+    // place the null character in the end
+    argv[i][args[i].length()] = '\0';
+    }
+  argv[argc] = ITK_NULLPTR;
+  // class to automatically cleanup argv upon destruction
+  class Cleanup_argv
+  {
+public:
+    Cleanup_argv( char* * argv_, int argc_plus_one_ ) : argv( argv_ ), argc_plus_one( argc_plus_one_ )
+    {
+    }
+
+    ~Cleanup_argv()
+    {
+      for( unsigned int i = 0; i < argc_plus_one; ++i )
+        {
+        delete[] argv[i];
+        }
+      delete[] argv;
+    }
+
+private:
+    char* *      argv;
+    unsigned int argc_plus_one;
+  };
+  Cleanup_argv cleanup_argv( argv, argc + 1 );
+
+  itk::ants::CommandLineParser::Pointer parser = itk::ants::CommandLineParser::New();
+
+  parser->SetCommand( argv[0] );
+
+  std::string commandDescription = std::string( "Long-running server which runs antsRegistration and " )
+    + std::string( "antsApplyTransforms jobs sent to a local socket in one process, so that the images " )
+    + std::string( "they share (e.g. a template) are read once and the start-up cost is paid once.  " )
+    + std::string( "Submit a job with 'antsServer --submit socketFileName antsRegistration <arguments>'; " )
+    + std::string( "it returns the exit code of the job, whose output goes to the output of the server.  " )
+    + std::string( "The commands 'status' and 'shutdown' print the state of the server and stop it." );
+
+  parser->SetCommandDescription( commandDescription );
+  antsServerInitializeCommandLineOptions( parser );
+
+  if( parser->Parse( argc, argv ) == EXIT_FAILURE )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( argc == 1 )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_FAILURE;
+    }
+  else if( parser->GetOption( "help" )->GetFunction() && parser->Convert<bool>( parser->GetOption( "help" )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, false );
+    return EXIT_SUCCESS;
+    }
+  else if( parser->GetOption( 'h' )->GetFunction() && parser->Convert<bool>( parser->GetOption( 'h' )->GetFunction()->GetName() ) )
+    {
+    parser->PrintMenu( std::cout, 5, true );
+    return EXIT_SUCCESS;
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer socketOption = parser->GetOption( "socket" );
+  if( !socketOption || socketOption->GetNumberOfFunctions() == 0 )
+    {
+    std::cerr << "No socket specified.  See command line option --socket." << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string socketName = socketOption->GetFunction( 0 )->GetName();
+
+  unsigned int numberOfJobs = 1;
+  itk::ants::CommandLineParser::OptionType::Pointer jobsOption = parser->GetOption( "jobs" );
+  if( jobsOption && jobsOption->GetNumberOfFunctions() )
+    {
+    numberOfJobs = std::max( parser->Convert<unsigned int>( jobsOption->GetFunction( 0 )->GetName() ), 1u );
+    }
+  numberOfJobs = std::min( numberOfJobs, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+
+  unsigned long cacheMemory = 4096;
+  itk::ants::CommandLineParser::OptionType::Pointer cacheMemoryOption = parser->GetOption( "cache-memory" );
+  if( cacheMemoryOption && cacheMemoryOption->GetNumberOfFunctions() )
+    {
+    cacheMemory = parser->Convert<unsigned long>( cacheMemoryOption->GetFunction( 0 )->GetName() );
+    }
+
+  unsigned int dimension = 3;
+  itk::ants::CommandLineParser::OptionType::Pointer dimensionOption = parser->GetOption( "dimensionality" );
+  if( dimensionOption && dimensionOption->GetNumberOfFunctions() )
+    {
+    dimension = parser->Convert<unsigned int>( dimensionOption->GetFunction( 0 )->GetName() );
+    }
+
+  // The jobs share the threads of the process.
+  const ServerSettingsGuard settingsGuard;
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(
+    std::max( settingsGuard.GetNumberOfThreads() / numberOfJobs, static_cast<itk::ThreadIdType>( 1 ) ) );
+
+  // Register the transforms once, before the jobs run in parallel.
+  itk::TransformFactoryBase::RegisterDefaultTransforms();
+
+  ObjectCache::SetMaximumMemory( cacheMemory * 1024 * 1024 );
+
+  itk::ants::CommandLineParser::OptionType::Pointer preloadOption = parser->GetOption( "preload" );
+  for( unsigned int n = 0; preloadOption && n < preloadOption->GetNumberOfFunctions(); n++ )
+    {
+    const std::string fileName = preloadOption->GetFunction( n )->GetName();
+    std::cout << "Preloading " << fileName << std::endl;
+    switch( dimension )
+      {
+      case 2:
+        PreloadImage<2>( fileName );
+        break;
+      case 3:
+        PreloadImage<3>( fileName );
+        break;
+      case 4:
+        PreloadImage<4>( fileName );
+        break;
+      default:
+        std::cerr << "Unsupported dimension " << dimension << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+  struct sockaddr_un address;
+  if( !GetSocketAddress( socketName, address ) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  // a client which goes away must not kill the server
+  signal( SIGPIPE, SIG_IGN );
+
+  ServerThreadStruct str;
+  str.m_SocketDescriptor = socket( AF_UNIX, SOCK_STREAM, 0 );
+  str.m_ShuttingDown = false;
+  str.m_NumberOfCompletedJobs = 0;
+  str.m_NumberOfFailedJobs = 0;
+
+  unlink( socketName.c_str() );
+  if( str.m_SocketDescriptor < 0 ||
+      bind( str.m_SocketDescriptor, reinterpret_cast<struct sockaddr *>( &address ), sizeof( address ) ) != 0 ||
+      listen( str.m_SocketDescriptor, 64 ) != 0 )
+    {
+    std::cerr << "Could not listen on " << socketName << ": " << std::strerror( errno ) << std::endl;
+    if( str.m_SocketDescriptor >= 0 )
+      {
+      close( str.m_SocketDescriptor );
+      }
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Accepting jobs on " << socketName << " (" << numberOfJobs << " at a time, "
+            << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << " threads each)" << std::endl;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfJobs );
+  threader->SetSingleMethod( ServerThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  close( str.m_SocketDescriptor );
+  unlink( socketName.c_str() );
+
+  std::cout << "Completed " << str.m_NumberOfCompletedJobs << " jobs (" << str.m_NumberOfFailedJobs
+            << " failed)" << std::endl;
+
+  return EXIT_SUCCESS;
+}
+} // namespace ants
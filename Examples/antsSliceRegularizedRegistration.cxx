@@ -54,9 +54,11 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkMacro.h"
+#include "itkMultiThreader.h"
 #include "itkRegistrationParameterScalesFromPhysicalShift.h"
 #include "itkResampleImageFilter.h"
 #include "itkShrinkImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkTimeProbe.h"
 #include "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
@@ -67,8 +69,9 @@
 #include "itkGaussianInterpolateImageFunction.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkWindowedSincInterpolateImageFunction.h"
-#include "itkLabelImageGaussianInterpolateImageFunction.h"
+#include "itkFastLabelImageGaussianInterpolateImageFunction.h"
 #include "itkLabelImageGenericInterpolateImageFunction.h"
+#include <algorithm>
 #include <sstream>
 
 namespace ants
@@ -302,6 +305,228 @@ private:
   std::vector<unsigned int> m_NumberOfIterations;
 };
 
+/** The settings and slices shared by the threads which register the slices.
+ * Each thread takes the next slice of SliceIndices until all are done. */
+template <unsigned int ImageDimension>
+struct SliceRegularizedRegistrationThreadStruct
+  {
+  typedef itk::Image<float, ImageDimension-1>                                   SliceType;
+  typedef itk::Image<unsigned char, ImageDimension-1>                           MaskSliceType;
+  typedef itk::TranslationTransform<double, ImageDimension-1>                   TransformType;
+  typedef itk::ImageRegistrationMethodv4<SliceType, SliceType, TransformType>   RegistrationType;
+
+  std::string                                           WhichMetric;
+  unsigned int                                          MetricParameter;
+  typename RegistrationType::MetricSamplingStrategyType SamplingStrategy;
+  float                                                 SamplingPercentage;
+  float                                                 LearningRate;
+  bool                                                  DoEstimateLearningRateOnce;
+  std::vector<unsigned int>                             Iterations;
+  typename RegistrationType::ShrinkFactorsArrayType     ShrinkFactors;
+  typename RegistrationType::SmoothingSigmasArrayType   SmoothingSigmas;
+
+  // start from the regularized transforms instead of the identity
+  bool                                          StartFromTransforms;
+  itk::ThreadIdType                             NumberOfThreadsPerSlice;
+
+  std::vector<typename SliceType::Pointer> *     FixedSlices;
+  std::vector<typename SliceType::Pointer> *     MovingSlices;
+  std::vector<typename MaskSliceType::Pointer> * MaskSlices;
+  std::vector<typename TransformType::Pointer> * Transforms;
+  std::vector<typename TransformType::Pointer> * UpdateTransforms;
+  std::vector<double> *                          MetricValues;
+  std::vector<unsigned int>                      SliceIndices;
+
+  unsigned int             NextSlice;
+  itk::SimpleFastMutexLock Mutex;
+  bool                     Failed;
+  std::string              ErrorMessage;
+  };
+
+/** Registers the moving slice timedim to the fixed one and stores the
+ * resulting transform and metric value. */
+template <unsigned int ImageDimension>
+void ants_slice_regularized_register_slice( SliceRegularizedRegistrationThreadStruct<ImageDimension> *str,
+                                            unsigned int timedim )
+{
+  typedef SliceRegularizedRegistrationThreadStruct<ImageDimension> ThreadStructType;
+  typedef typename ThreadStructType::SliceType                     FixedImageType;
+  typedef typename ThreadStructType::TransformType                 TranslationTransformType;
+  typedef typename ThreadStructType::RegistrationType              TranslationRegistrationType;
+  typedef itk::ImageToImageMetricv4<FixedImageType, FixedImageType> MetricType;
+
+  typename FixedImageType::Pointer fixedSlice = ( *str->FixedSlices )[timedim];
+  typename FixedImageType::Pointer movingSlice = ( *str->MovingSlices )[timedim];
+
+  bool skipThisTimePoint = false;
+  typename FixedImageType::Pointer preprocessFixedImage =
+    sliceRegularizedPreprocessImage<FixedImageType>( fixedSlice, 0,
+                                     1, 0.005, 0.995,
+                                     ITK_NULLPTR );
+
+  typename FixedImageType::Pointer preprocessMovingImage =
+    sliceRegularizedPreprocessImage<FixedImageType>( movingSlice,
+                                     0, 1,
+                                     0.005, 0.995,
+                                     preprocessFixedImage );
+  if(  preprocessFixedImage.IsNull() || preprocessMovingImage.IsNull() )
+    {
+    preprocessFixedImage = fixedSlice;
+    preprocessMovingImage = movingSlice;
+    skipThisTimePoint = true;
+    }
+
+  typename MetricType::Pointer metric;
+  if( std::strcmp( str->WhichMetric.c_str(), "cc" ) == 0 )
+    {
+    typedef itk::ANTSNeighborhoodCorrelationImageToImageMetricv4<FixedImageType,
+                                                                 FixedImageType> CorrelationMetricType;
+    typename CorrelationMetricType::Pointer correlationMetric = CorrelationMetricType::New();
+    typename CorrelationMetricType::RadiusType radius;
+    radius.Fill( str->MetricParameter );
+    correlationMetric->SetRadius( radius );
+    correlationMetric->SetUseMovingImageGradientFilter( false );
+    correlationMetric->SetUseFixedImageGradientFilter( false );
+    metric = correlationMetric;
+    }
+  else if( std::strcmp( str->WhichMetric.c_str(), "mi" ) == 0 )
+    {
+    typedef itk::MattesMutualInformationImageToImageMetricv4<FixedImageType,
+                                                             FixedImageType> MutualInformationMetricType;
+    typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
+    mutualInformationMetric->SetNumberOfHistogramBins( str->MetricParameter );
+    mutualInformationMetric->SetUseMovingImageGradientFilter( false );
+    mutualInformationMetric->SetUseFixedImageGradientFilter( false );
+    metric = mutualInformationMetric;
+    }
+  else if( std::strcmp( str->WhichMetric.c_str(), "meansquares" ) == 0 )
+    {
+    typedef itk::MeanSquaresImageToImageMetricv4<FixedImageType, FixedImageType> MSQMetricType;
+    typename MSQMetricType::Pointer demonsMetric = MSQMetricType::New();
+    metric = demonsMetric;
+    }
+  else
+    {
+    typedef itk::CorrelationImageToImageMetricv4<FixedImageType, FixedImageType> corrMetricType;
+    typename corrMetricType::Pointer corrMetric = corrMetricType::New();
+    metric = corrMetric;
+    }
+  metric->SetMaximumNumberOfThreads( str->NumberOfThreadsPerSlice );
+  if( !str->MaskSlices->empty() )
+    {
+    typedef itk::ImageMaskSpatialObject<ImageDimension-1> spMaskType;
+    typename spMaskType::Pointer  spatialObjectMask = spMaskType::New();
+    spatialObjectMask->SetImage( ( *str->MaskSlices )[timedim] );
+    metric->SetFixedImageMask( spatialObjectMask );
+    }
+  typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType> ScalesEstimatorType;
+  typename ScalesEstimatorType::Pointer scalesEstimator = ScalesEstimatorType::New();
+  scalesEstimator->SetMetric( metric );
+  scalesEstimator->SetTransformForward( true );
+
+  typedef itk::ConjugateGradientLineSearchOptimizerv4 OptimizerType;
+  typename OptimizerType::Pointer optimizer = OptimizerType::New();
+  optimizer->SetNumberOfIterations( str->Iterations[0] );
+  optimizer->SetMinimumConvergenceValue( 1.e-7 );
+  optimizer->SetConvergenceWindowSize( 8 );
+  optimizer->SetLowerLimit( 0 );
+  optimizer->SetUpperLimit( 2 );
+  optimizer->SetEpsilon( 0.1 );
+  optimizer->SetScalesEstimator( scalesEstimator );
+  optimizer->SetMaximumStepSizeInPhysicalUnits( str->LearningRate );
+  optimizer->SetDoEstimateLearningRateOnce( str->DoEstimateLearningRateOnce );
+  optimizer->SetDoEstimateLearningRateAtEachIteration( !str->DoEstimateLearningRateOnce );
+  optimizer->SetNumberOfThreads( str->NumberOfThreadsPerSlice );
+
+  typename TranslationTransformType::Pointer initialTransform = ( *str->Transforms )[timedim];
+  metric->SetFixedImage( preprocessFixedImage );
+  metric->SetVirtualDomainFromImage( preprocessFixedImage );
+  metric->SetMovingImage( preprocessMovingImage );
+  metric->SetMovingTransform( initialTransform );
+  typename ScalesEstimatorType::ScalesType scales( initialTransform->GetNumberOfParameters() );
+  typename MetricType::ParametersType      newparams( initialTransform->GetParameters() );
+  metric->SetParameters( newparams );
+  metric->Initialize();
+  scalesEstimator->SetMetric( metric );
+  scalesEstimator->EstimateScales( scales );
+  optimizer->SetScales( scales );
+
+  typename TranslationRegistrationType::Pointer translationRegistration = TranslationRegistrationType::New();
+  translationRegistration->SetFixedImage( preprocessFixedImage );
+  translationRegistration->SetMovingImage( preprocessMovingImage );
+  translationRegistration->SetNumberOfLevels( str->Iterations.size() );
+  translationRegistration->SetShrinkFactorsPerLevel( str->ShrinkFactors );
+  translationRegistration->SetSmoothingSigmasPerLevel( str->SmoothingSigmas );
+  translationRegistration->SetMetricSamplingStrategy( str->SamplingStrategy );
+  translationRegistration->SetMetricSamplingPercentage( str->SamplingPercentage );
+  translationRegistration->SetMetric( metric );
+  translationRegistration->SetOptimizer( optimizer );
+  translationRegistration->SetNumberOfThreads( str->NumberOfThreadsPerSlice );
+  if( str->StartFromTransforms )
+    {
+    translationRegistration->SetMovingInitialTransform( initialTransform );
+    }
+
+  typedef CommandIterationUpdate<TranslationRegistrationType> TranslationCommandType;
+  typename TranslationCommandType::Pointer translationObserver = TranslationCommandType::New();
+  translationObserver->SetNumberOfIterations( str->Iterations );
+  translationRegistration->AddObserver( itk::IterationEvent(), translationObserver );
+  if( !skipThisTimePoint )
+    {
+    translationRegistration->Update();
+    }
+
+  // the registration optimizes the translation on top of the initial one
+  typename TranslationTransformType::Pointer updateTransform = TranslationTransformType::New();
+  typename TranslationTransformType::ParametersType pu =
+    translationRegistration->GetModifiableTransform()->GetParameters();
+  if( str->StartFromTransforms )
+    {
+    pu += initialTransform->GetParameters();
+    }
+  updateTransform->SetParameters( pu );
+
+  const double metricValue = metric->GetValue();
+
+  str->Mutex.Lock();
+  ( *str->UpdateTransforms )[timedim] = updateTransform;
+  ( *str->MetricValues )[timedim] = metricValue;
+  str->Mutex.Unlock();
+}
+
+template <unsigned int ImageDimension>
+ITK_THREAD_RETURN_TYPE ants_slice_regularized_registration_threader_callback( void *arg )
+{
+  typedef SliceRegularizedRegistrationThreadStruct<ImageDimension> ThreadStructType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int next = str->NextSlice++;
+    const bool         failed = str->Failed;
+    str->Mutex.Unlock();
+    if( failed || next >= str->SliceIndices.size() )
+      {
+      break;
+      }
+
+    try
+      {
+      ants_slice_regularized_register_slice<ImageDimension>( str, str->SliceIndices[next] );
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      str->Mutex.Lock();
+      str->Failed = true;
+      str->ErrorMessage = e.what();
+      str->Mutex.Unlock();
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <unsigned int ImageDimension>
 int ants_slice_regularized_registration( itk::ants::CommandLineParser *parser )
 {
@@ -419,7 +644,7 @@ int ants_slice_regularized_registration( itk::ants::CommandLineParser *parser )
   std::vector<typename FixedImageType::Pointer>            movingSliceList;
   typename FixedIOImageType::Pointer                       maskImage;
   typedef itk::Image< unsigned char, ImageDimension-1 >    ImageMaskType;
-  typename ImageMaskType::Pointer mask_time_slice = ITK_NULLPTR;
+  std::vector<typename ImageMaskType::Pointer>            maskSliceList;
   if ( maskfn.length() > 3 )
     ReadImage<FixedIOImageType>( maskImage, maskfn.c_str() );
 
@@ -551,7 +776,7 @@ int ants_slice_regularized_registration( itk::ants::CommandLineParser *parser )
         if ( toidentity ) extractFilterX->SetDirectionCollapseToIdentity();
         extractFilterX->SetExtractionRegion( extractRegion );
         extractFilterX->Update();
-        mask_time_slice = extractFilterX->GetOutput();
+        maskSliceList.push_back( extractFilterX->GetOutput() );
         }
 
 
@@ -566,186 +791,132 @@ int ants_slice_regularized_registration( itk::ants::CommandLineParser *parser )
       transformUList.push_back( translationTransformU );
       }
 
-    // implement a gradient descent on the polynomial parameters by looping over registration results
-    typedef itk::ImageToImageMetricv4<FixedImageType, FixedImageType> MetricType;
-    typename MetricType::Pointer metric;
-    unsigned int maxloop = 2;
-    for ( unsigned int loop = 0; loop < maxloop; loop++ )
-    {
-    RealType metricval = 0;
-    bool skipThisTimePoint = false;
-    for( unsigned int timedim = 0; timedim < timedims; timedim++ )
+    std::string whichTransform = transformOption->GetFunction( currentStage )->GetName();
+    ConvertToLowerCase( whichTransform );
+    if( std::strcmp( whichTransform.c_str(), "translation" ) != 0 )
       {
-      typename FixedImageType::Pointer preprocessFixedImage =
-        sliceRegularizedPreprocessImage<FixedImageType>( fixedSliceList[timedim], 0,
-                                         1, 0.005, 0.995,
-                                         ITK_NULLPTR );
-
-      typename FixedImageType::Pointer preprocessMovingImage =
-        sliceRegularizedPreprocessImage<FixedImageType>( movingSliceList[timedim],
-                                         0, 1,
-                                         0.005, 0.995,
-                                         preprocessFixedImage );
-      if (  preprocessFixedImage.IsNull() || preprocessMovingImage.IsNull() )
-        {
-        preprocessFixedImage = fixedSliceList[timedim];
-        preprocessMovingImage = movingSliceList[timedim];
-        skipThisTimePoint = true;
-        }
+      std::cerr << "ERROR:  Unrecognized transform option - " << whichTransform << std::endl;
+      return EXIT_FAILURE;
+      }
 
+    // the settings of the registration of every slice
+    typedef SliceRegularizedRegistrationThreadStruct<ImageDimension> ThreadStructType;
+    ThreadStructType str;
+    str.WhichMetric = metricOption->GetFunction( currentStage )->GetName();
+    ConvertToLowerCase( str.WhichMetric );
+    str.MetricParameter = 0;
+    if( std::strcmp( str.WhichMetric.c_str(), "cc" ) == 0 || std::strcmp( str.WhichMetric.c_str(), "mi" ) == 0 )
+      {
+      str.MetricParameter = parser->Convert<unsigned int>( metricOption->GetFunction(
+                                                             currentStage )->GetParameter(  3 ) );
+      }
+    else if( std::strcmp( str.WhichMetric.c_str(), "meansquares" ) != 0 &&
+             std::strcmp( str.WhichMetric.c_str(), "gc" ) != 0 )
+      {
+      std::cerr << "ERROR: Unrecognized image metric: " << str.WhichMetric << std::endl;
+      return EXIT_FAILURE;
+      }
 
-      std::string whichMetric = metricOption->GetFunction( currentStage )->GetName();
-      ConvertToLowerCase( whichMetric );
+    str.SamplingPercentage = 1.0;
+    if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 5 )
+      {
+      str.SamplingPercentage = parser->Convert<float>( metricOption->GetFunction( currentStage )->GetParameter(  5 ) );
+      }
 
-      float samplingPercentage = 1.0;
-      if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 5 )
-        {
-        samplingPercentage = parser->Convert<float>( metricOption->GetFunction( currentStage )->GetParameter(  5 ) );
-        }
+    std::string samplingStrategy = "";
+    if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 4 )
+      {
+      samplingStrategy = metricOption->GetFunction( currentStage )->GetParameter(  4 );
+      }
+    ConvertToLowerCase( samplingStrategy );
+    str.SamplingStrategy = TranslationRegistrationType::NONE;
+    if( std::strcmp( samplingStrategy.c_str(), "random" ) == 0 )
+      {
+      str.SamplingStrategy = TranslationRegistrationType::RANDOM;
+      }
+    if( std::strcmp( samplingStrategy.c_str(), "regular" ) == 0 )
+      {
+      str.SamplingStrategy = TranslationRegistrationType::REGULAR;
+      }
 
-      std::string samplingStrategy = "";
-      if( metricOption->GetFunction( 0 )->GetNumberOfParameters() > 4 )
-        {
-        samplingStrategy = metricOption->GetFunction( currentStage )->GetParameter(  4 );
-        }
-      ConvertToLowerCase( samplingStrategy );
-      typename TranslationRegistrationType::MetricSamplingStrategyType metricSamplingStrategy =
-        TranslationRegistrationType::NONE;
-      if( std::strcmp( samplingStrategy.c_str(), "random" ) == 0 )
-        {
-        metricSamplingStrategy = TranslationRegistrationType::RANDOM;
-        }
-      if( std::strcmp( samplingStrategy.c_str(), "regular" ) == 0 )
-        {
-        metricSamplingStrategy = TranslationRegistrationType::REGULAR;
-        }
+    str.LearningRate = parser->Convert<float>( transformOption->GetFunction( currentStage )->GetParameter(  0 ) );
+    str.DoEstimateLearningRateOnce = doEstimateLearningRateOnce;
+    str.Iterations = iterations;
+    str.ShrinkFactors = shrinkFactorsPerLevel;
+    str.SmoothingSigmas = smoothingSigmasPerLevel;
+    str.FixedSlices = &fixedSliceList;
+    str.MovingSlices = &movingSliceList;
+    str.MaskSlices = &maskSliceList;
+    str.Transforms = &transformList;
+    str.UpdateTransforms = &transformUList;
+    std::vector<double> metricValues( timedims, 0.0 );
+    str.MetricValues = &metricValues;
+    if ( ( verbose ) && ( maskfn.length() > 3 ) )
+      {
+      std::cout << " setting mask " << maskfn << std::endl;
+      }
 
-      if( std::strcmp( whichMetric.c_str(), "cc" ) == 0 )
-        {
-        unsigned int radiusOption = parser->Convert<unsigned int>( metricOption->GetFunction(
-                                                                     currentStage )->GetParameter(  3 ) );
-
-        typedef itk::ANTSNeighborhoodCorrelationImageToImageMetricv4<FixedImageType,
-                                                                     FixedImageType> CorrelationMetricType;
-        typename CorrelationMetricType::Pointer correlationMetric = CorrelationMetricType::New();
-        typename CorrelationMetricType::RadiusType radius;
-        radius.Fill( radiusOption );
-        correlationMetric->SetRadius( radius );
-        correlationMetric->SetUseMovingImageGradientFilter( false );
-        correlationMetric->SetUseFixedImageGradientFilter( false );
-        metric = correlationMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "mi" ) == 0 )
-        {
-        unsigned int binOption =
-          parser->Convert<unsigned int>( metricOption->GetFunction( currentStage )->GetParameter(  3 ) );
-        typedef itk::MattesMutualInformationImageToImageMetricv4<FixedImageType,
-                                                                 FixedImageType> MutualInformationMetricType;
-        typename MutualInformationMetricType::Pointer mutualInformationMetric = MutualInformationMetricType::New();
-        mutualInformationMetric = mutualInformationMetric;
-        mutualInformationMetric->SetNumberOfHistogramBins( binOption );
-        mutualInformationMetric->SetUseMovingImageGradientFilter( false );
-        mutualInformationMetric->SetUseFixedImageGradientFilter( false );
-        metric = mutualInformationMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "meansquares" ) == 0 )
-        {
-        typedef itk::MeanSquaresImageToImageMetricv4<FixedImageType, FixedImageType> MSQMetricType;
-        typename MSQMetricType::Pointer demonsMetric = MSQMetricType::New();
-        demonsMetric = demonsMetric;
-        metric = demonsMetric;
-        }
-      else if( std::strcmp( whichMetric.c_str(), "gc" ) == 0 )
-        {
-        typedef itk::CorrelationImageToImageMetricv4<FixedImageType, FixedImageType> corrMetricType;
-        typename corrMetricType::Pointer corrMetric = corrMetricType::New();
-        metric = corrMetric;
-        }
-      else
+    // implement a gradient descent on the polynomial parameters by looping over registration results.
+    // The slices are registered independently, so they are registered in parallel.  The first loop
+    // registers every slice; the next ones only the slices the regularization moved by more than half
+    // a voxel, starting from their regularized translation.
+    unsigned int maxloop = 2;
+    for ( unsigned int loop = 0; loop < maxloop; loop++ )
+    {
+    str.SliceIndices.clear();
+    for( unsigned int timedim = 0; timedim < timedims; timedim++ )
+      {
+      if( loop == 0 )
         {
-        std::cerr << "ERROR: Unrecognized image metric: " << whichMetric << std::endl;
-        return EXIT_FAILURE;
+        str.SliceIndices.push_back( timedim );
+        continue;
         }
-      metric->SetVirtualDomainFromImage(  fixedSliceList[timedim] );
-      if ( maskfn.length() > 3 )
+      const typename FixedImageType::SpacingType spacing = fixedSliceList[timedim]->GetSpacing();
+      const RealType threshold = 0.5 * std::min( spacing[0], spacing[1] );
+      typename TranslationTransformType::ParametersType p = transformList[timedim]->GetParameters();
+      typename TranslationTransformType::ParametersType pu = transformUList[timedim]->GetParameters();
+      if( std::sqrt( std::pow( p[0] - pu[0], 2.0 ) + std::pow( p[1] - pu[1], 2.0 ) ) > threshold )
         {
-        typedef itk::ImageMaskSpatialObject<ImageDimension-1> spMaskType;
-        typename spMaskType::Pointer  spatialObjectMask = spMaskType::New();
-        spatialObjectMask->SetImage( mask_time_slice );
-        metric->SetFixedImageMask( spatialObjectMask );
-        if ( ( verbose ) && ( loop == 0 ) && ( timedim == 0 ) )
-           std::cout << " setting mask " << maskfn << std::endl;
+        str.SliceIndices.push_back( timedim );
         }
-      typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType> ScalesEstimatorType;
-      typename ScalesEstimatorType::Pointer scalesEstimator = ScalesEstimatorType::New();
-      scalesEstimator->SetMetric( metric );
-      scalesEstimator->SetTransformForward( true );
-      float learningRate = parser->Convert<float>(
-        transformOption->GetFunction( currentStage )->GetParameter(  0 ) );
-
-      typedef itk::ConjugateGradientLineSearchOptimizerv4 OptimizerType;
-      typename OptimizerType::Pointer optimizer = OptimizerType::New();
-      optimizer->SetNumberOfIterations( iterations[0] );
-      optimizer->SetMinimumConvergenceValue( 1.e-7 );
-      optimizer->SetConvergenceWindowSize( 8 );
-      optimizer->SetLowerLimit( 0 );
-      optimizer->SetUpperLimit( 2 );
-      optimizer->SetEpsilon( 0.1 );
-      optimizer->SetScalesEstimator( scalesEstimator );
-      optimizer->SetMaximumStepSizeInPhysicalUnits( learningRate );
-      optimizer->SetDoEstimateLearningRateOnce( doEstimateLearningRateOnce );
-      optimizer->SetDoEstimateLearningRateAtEachIteration( !doEstimateLearningRateOnce );
-
-      // Set up the image registration methods along with the transforms
-      std::string whichTransform = transformOption->GetFunction( currentStage )->GetName();
-      ConvertToLowerCase( whichTransform );
-      typename TranslationRegistrationType::Pointer translationRegistration = TranslationRegistrationType::New();
-      if( std::strcmp( whichTransform.c_str(), "translation" ) == 0 )
-        {
-        transformList[timedim]->GetNumberOfParameters();
-        metric->SetFixedImage( preprocessFixedImage );
-        metric->SetVirtualDomainFromImage( preprocessFixedImage );
-        metric->SetMovingImage( preprocessMovingImage );
-        metric->SetMovingTransform( transformList[timedim] );
-        typename ScalesEstimatorType::ScalesType scales( transformList[timedim]->GetNumberOfParameters() );
-        typename MetricType::ParametersType      newparams(  transformList[timedim]->GetParameters() );
-        metric->SetParameters( newparams );
-        metric->Initialize();
-        scalesEstimator->SetMetric(metric);
-        scalesEstimator->EstimateScales(scales);
-        optimizer->SetScales(scales);
-        translationRegistration->SetFixedImage( preprocessFixedImage );
-        translationRegistration->SetMovingImage( preprocessMovingImage );
-        translationRegistration->SetNumberOfLevels( numberOfLevels );
-        translationRegistration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
-        translationRegistration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-        translationRegistration->SetMetricSamplingStrategy( metricSamplingStrategy );
-        translationRegistration->SetMetricSamplingPercentage( samplingPercentage );
-        translationRegistration->SetMetric( metric );
-        translationRegistration->SetOptimizer( optimizer );
-
-        typedef CommandIterationUpdate<TranslationRegistrationType> TranslationCommandType;
-        typename TranslationCommandType::Pointer translationObserver = TranslationCommandType::New();
-        translationObserver->SetNumberOfIterations( iterations );
-        translationRegistration->AddObserver( itk::IterationEvent(), translationObserver );
-        if ( ! skipThisTimePoint )
-        try
-          {
-          translationRegistration->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          std::cerr << "Exception caught: " << e << std::endl;
-          return EXIT_FAILURE;
-          }
-	}
-      else
+      }
+    if( str.SliceIndices.empty() )
+      {
+      if ( verbose )
         {
-        std::cerr << "ERROR:  Unrecognized transform option - " << whichTransform << std::endl;
-        return EXIT_FAILURE;
+        std::cout << "Loop" << loop << " no slice moved by the regularization" << std::endl;
         }
-      transformUList[timedim] = translationRegistration->GetModifiableTransform();
-      metricval += metric->GetValue();
+      break;
+      }
+
+    const itk::ThreadIdType numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    const itk::ThreadIdType numberOfSliceThreads = std::max( std::min( numberOfThreads,
+      static_cast<itk::ThreadIdType>( str.SliceIndices.size() ) ), static_cast<itk::ThreadIdType>( 1 ) );
+    str.NumberOfThreadsPerSlice = std::max( numberOfThreads / numberOfSliceThreads,
+                                            static_cast<itk::ThreadIdType>( 1 ) );
+    str.StartFromTransforms = ( loop > 0 );
+    str.NextSlice = 0;
+    str.Failed = false;
+    if ( verbose )
+      {
+      std::cout << "Loop" << loop << " registering " << str.SliceIndices.size() << " slices with "
+                << numberOfSliceThreads << " threads" << std::endl;
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfSliceThreads );
+    threader->SetSingleMethod( ants_slice_regularized_registration_threader_callback<ImageDimension>, &str );
+    threader->SingleMethodExecute();
+    if( str.Failed )
+      {
+      std::cerr << "Exception caught: " << str.ErrorMessage << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    RealType metricval = 0;
+    for( unsigned int timedim = 0; timedim < timedims; timedim++ )
+      {
+      metricval += metricValues[timedim];
       }
 
   for ( unsigned int i = 0; i < transformList.size(); i++)
@@ -1,8 +1,8 @@
 #include "antsCommandLineParser.h"
+#include "antsMarchingCubesSurface.h"
 #include "antsUtilities.h"
 #include "ReadWriteData.h"
 
-#include "itkAffineTransform.h"
 #include "itkAntiAliasBinaryImageFilter.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
@@ -10,25 +10,23 @@
 #include "vtkSTLWriter.h"
 #include "vtkPLYReader.h"
 #include "vtkPLYWriter.h"
-#include "itkImageToVTKImageFilter.h"
 
 #include "vtkActor.h"
 #include "vtkCallbackCommand.h"
+#include "vtkCellArray.h"
 #include "vtkExtractEdges.h"
 #include "vtkGraphicsFactory.h"
 #include "vtkImageData.h"
 #include "vtkImageStencil.h"
 #include "vtkLookupTable.h"
-#include "vtkMarchingCubes.h"
 #include "vtkMetaImageWriter.h"
 #include "vtkPointData.h"
 #include "vtkPolyData.h"
-#include "vtkPolyDataConnectivityFilter.h"
 #include "vtkPolyDataMapper.h"
+#include "vtkPoints.h"
 #include "vtkPolyDataNormals.h"
 #include "vtkProperty.h"
 #include "vtkSmartPointer.h"
-#include "vtkTriangleFilter.h"
 #include "vtkUnsignedCharArray.h"
 #include "vtkWindowedSincPolyDataFilter.h"
 #include "vtkPolyDataWriter.h"
@@ -74,6 +72,56 @@ float CalculateGenus( vtkPolyData *mesh, bool verbose )
   return genus;
 }
 
+template <class TImage>
+float CalculateGenus( const MarchingCubesSurface<TImage> & mesh, bool verbose )
+{
+  float numberOfEdges = static_cast<float>( mesh.GetNumberOfEdges() );
+  float numberOfVertices = static_cast<float>( mesh.GetNumberOfPoints() );
+  float numberOfFaces = static_cast<float>( mesh.GetNumberOfTriangles() );
+
+  float genus = 0.5 * ( 2.0 - numberOfVertices + numberOfEdges - numberOfFaces );
+
+  if( verbose )
+    {
+    std::cout << "Genus = "  << genus << std::endl;
+    std::cout << "  number of vertices = "  << numberOfVertices << std::endl;
+    std::cout << "  number of edges = "  << numberOfEdges << std::endl;
+    std::cout << "  number of faces = "  << numberOfFaces << std::endl;
+    }
+
+  return genus;
+}
+
+template <class TImage>
+vtkSmartPointer<vtkPolyData> ConvertToPolyData( const MarchingCubesSurface<TImage> & mesh )
+{
+  const std::vector<float> &        meshPoints = mesh.GetPoints();
+  const std::vector<unsigned int> & meshTriangles = mesh.GetTriangles();
+
+  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  points->SetNumberOfPoints( mesh.GetNumberOfPoints() );
+  for( unsigned long n = 0; n < mesh.GetNumberOfPoints(); n++ )
+    {
+    points->SetPoint( n, meshPoints[3 * n], meshPoints[3 * n + 1], meshPoints[3 * n + 2] );
+    }
+
+  vtkSmartPointer<vtkCellArray> triangles = vtkSmartPointer<vtkCellArray>::New();
+  triangles->Allocate( triangles->EstimateSize( mesh.GetNumberOfTriangles(), 3 ) );
+  for( unsigned long t = 0; t < mesh.GetNumberOfTriangles(); t++ )
+    {
+    vtkIdType triangle[3];
+    triangle[0] = meshTriangles[3 * t];
+    triangle[1] = meshTriangles[3 * t + 1];
+    triangle[2] = meshTriangles[3 * t + 2];
+    triangles->InsertNextCell( 3, triangle );
+    }
+
+  vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+  polyData->SetPoints( points );
+  polyData->SetPolys( triangles );
+  return polyData;
+}
+
 void Display( vtkPolyData *vtkMesh,
               const std::vector<float> rotationAngleInDegrees,
               const std::vector<float> backgroundColor,
@@ -256,29 +304,6 @@ int antsImageToSurface( itk::ants::CommandLineParser *parser )
     return EXIT_FAILURE;
     }
 
-  // There's a reorientation issue between itk image physical space and the mesh space
-  // for which we have to account.  See
-  // http://www.vtk.org/pipermail/vtkusers/2011-July/068595.html
-  //   and
-  // http://www.vtk.org/Wiki/VTK/ExamplesBoneYard/Cxx/VolumeRendering/itkVtkImageConvert
-
-  typedef itk::AffineTransform<RealType> RigidTransformType;
-  RigidTransformType::Pointer meshToItkImageTransform = RigidTransformType::New();
-  RigidTransformType::OutputVectorType offset;
-  offset[0] = -inputImage->GetOrigin()[0];
-  offset[1] = -inputImage->GetOrigin()[1];
-  offset[2] = -inputImage->GetOrigin()[2];
-  RigidTransformType::MatrixType matrix;
-  for( unsigned int i = 0; i < ImageDimension; i++ )
-    {
-    for( unsigned int j = 0; j < ImageDimension; j++ )
-      {
-      matrix( i, j ) = inputImage->GetDirection()( i, j );
-      }
-    }
-  meshToItkImageTransform->SetMatrix( matrix );
-  meshToItkImageTransform->SetOffset( offset );
-
   // Get anti-alias RMSE parameter
 
   RealType antiAliasRmseParameter = 0.03;
@@ -298,31 +323,21 @@ int antsImageToSurface( itk::ants::CommandLineParser *parser )
 
   // Reconstruct binary surface.
 
-  typedef itk::ImageToVTKImageFilter<ImageType> ConnectorType;
-  ConnectorType::Pointer connector = ConnectorType::New();
-  connector->SetInput( antiAlias->GetOutput() );
-  connector->Update();
-
-  vtkSmartPointer<vtkMarchingCubes> marchingCubes = vtkSmartPointer<vtkMarchingCubes>::New();
-  marchingCubes->SetInputData( connector->GetOutput() );
-  marchingCubes->ComputeScalarsOff();
-  marchingCubes->ComputeGradientsOff();
-  marchingCubes->SetNumberOfContours( 1 );
-  marchingCubes->SetValue( 0, 0.0 );
-  marchingCubes->Update();
+  // The surface is extracted directly from the anti-aliased image, with its
+  // points already in the physical space of the ITK images, and converted to
+  // a vtkPolyData only once the largest component has been kept.
 
-  vtkSmartPointer<vtkPolyDataConnectivityFilter> connectivityFilter =
-    vtkSmartPointer<vtkPolyDataConnectivityFilter>::New();
-  connectivityFilter->SetExtractionModeToLargestRegion();
-  connectivityFilter->SetInputData( marchingCubes->GetOutput() );
-  connectivityFilter->Update();
+  typedef MarchingCubesSurface<ImageType> MarchingCubesType;
+  MarchingCubesType marchingCubes;
+  marchingCubes.SetInput( antiAlias->GetOutput() );
+  marchingCubes.SetIsoValue( 0.0 );
+  marchingCubes.Update();
+  marchingCubes.KeepLargestComponent();
 
-  vtkSmartPointer<vtkTriangleFilter> triangularizer = vtkSmartPointer<vtkTriangleFilter>::New();
-  triangularizer->SetInputData( connectivityFilter->GetOutput() );
-  triangularizer->Update();
+  CalculateGenus( marchingCubes, true );
 
-  vtkPolyData *vtkMesh = triangularizer->GetOutput();
-  CalculateGenus( vtkMesh, true );
+  vtkSmartPointer<vtkPolyData> surfaceMesh = ConvertToPolyData( marchingCubes );
+  vtkPolyData *vtkMesh = surfaceMesh;
 
   // Add the functional overlays
 
@@ -394,25 +409,9 @@ int antsImageToSurface( itk::ants::CommandLineParser *parser )
       }
     }
 
-  // Reset mesh points to physical space of ITK images
-
   vtkSmartPointer<vtkPoints> meshPoints = vtkMesh->GetPoints();
   int        numberOfPoints = meshPoints->GetNumberOfPoints();
 
-  for( int n = 0; n < numberOfPoints; n++ )
-    {
-    RigidTransformType::InputPointType inputTransformPoint;
-    RigidTransformType::OutputPointType outputTransformPoint;
-
-    for( unsigned int d = 0; d < ImageDimension; d++ )
-      {
-      inputTransformPoint[d] = meshPoints->GetPoint( n )[d];
-      }
-    outputTransformPoint = meshToItkImageTransform->TransformPoint( inputTransformPoint );
-
-    meshPoints->SetPoint( n, outputTransformPoint[0], outputTransformPoint[1], outputTransformPoint[2] );
-    }
-
   // Do the painting
   vtkSmartPointer<vtkUnsignedCharArray> colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
   colors->SetNumberOfComponents( 3 );   // R, G, B, and alpha components
@@ -1,6 +1,8 @@
 
 #include "antsUtilities.h"
 
+#include "itksys/SystemTools.hxx"
+
 #include <deque>
 #include <string>
 #include <vector>
@@ -8,11 +10,141 @@
 #include <math.h>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
 
 namespace ants
 {
 // We need to ensure that only one of these exists!
 // boost::iostreams::stream<ants_Sink> std::cout( ( ants_Sink() ) );
+
+#if defined( ANTS_ENABLE_PROFILING )
+ProfileRegistry & ProfileRegistry::GetInstance()
+{
+  // destroyed, and so printed, when the program exits
+  static ProfileRegistry registry;
+
+  return registry;
+}
+
+ProfileRegistry::ProfileRegistry() :
+  m_Clock( itk::RealTimeClock::New() )
+{
+  this->m_StartTime = this->m_Clock->GetTimeInSeconds();
+}
+
+ProfileRegistry::~ProfileRegistry()
+{
+  this->Print( std::cerr );
+}
+
+double ProfileRegistry::GetTimeInSeconds() const
+{
+  return this->m_Clock->GetTimeInSeconds();
+}
+
+void ProfileRegistry::AddTime( const char * name, double seconds )
+{
+  this->m_Mutex.Lock();
+  EntryMapType::iterator it = this->m_Entries.find( name );
+  if( it == this->m_Entries.end() )
+    {
+    Entry entry = { 0.0, 0, true };
+    it = this->m_Entries.insert( EntryMapType::value_type( name, entry ) ).first;
+    }
+  it->second.m_Time += seconds;
+  it->second.m_Count++;
+  this->m_Mutex.Unlock();
+}
+
+void ProfileRegistry::AddCount( const char * name, unsigned long count )
+{
+  this->m_Mutex.Lock();
+  EntryMapType::iterator it = this->m_Entries.find( name );
+  if( it == this->m_Entries.end() )
+    {
+    Entry entry = { 0.0, 0, false };
+    it = this->m_Entries.insert( EntryMapType::value_type( name, entry ) ).first;
+    }
+  it->second.m_Count += count;
+  this->m_Mutex.Unlock();
+}
+
+namespace
+{
+typedef std::pair<double, std::string> ProfileLineType;
+
+bool CompareProfileLines( const ProfileLineType & a, const ProfileLineType & b )
+{
+  return a.first > b.first;
+}
+}
+
+void ProfileRegistry::Print( std::ostream & os ) const
+{
+  this->m_Mutex.Lock();
+  if( this->m_Entries.empty() )
+    {
+    this->m_Mutex.Unlock();
+    return;
+    }
+
+  const double totalTime = this->GetTimeInSeconds() - this->m_StartTime;
+
+  std::vector<ProfileLineType> timers;
+  std::vector<ProfileLineType> counters;
+  for( EntryMapType::const_iterator it = this->m_Entries.begin(); it != this->m_Entries.end(); ++it )
+    {
+    const Entry &      entry = it->second;
+    std::ostringstream line;
+    line << std::fixed << std::setprecision( 3 );
+    if( entry.m_IsTimer )
+      {
+      line << std::setw( 12 ) << entry.m_Time
+           << std::setw( 8 ) << ( totalTime > 0.0 ? 100.0 * entry.m_Time / totalTime : 0.0 )
+           << std::setw( 12 ) << entry.m_Count
+           << std::setw( 14 ) << 1000.0 * entry.m_Time / entry.m_Count
+           << "  " << it->first;
+      timers.push_back( ProfileLineType( entry.m_Time, line.str() ) );
+      }
+    else
+      {
+      line << std::setw( 12 ) << entry.m_Count << "  " << it->first;
+      counters.push_back( ProfileLineType( static_cast<double>( entry.m_Count ), line.str() ) );
+      }
+    }
+  this->m_Mutex.Unlock();
+
+  std::sort( timers.begin(), timers.end(), CompareProfileLines );
+  std::sort( counters.begin(), counters.end(), CompareProfileLines );
+
+  const std::ios::fmtflags flags = os.flags();
+  const std::streamsize    precision = os.precision();
+
+  os << std::fixed << std::setprecision( 3 );
+  os << std::endl << "Profile (" << totalTime << " s of wall time, scopes include nested scopes)" << std::endl;
+  if( !timers.empty() )
+    {
+    os << std::setw( 12 ) << "seconds" << std::setw( 8 ) << "%" << std::setw( 12 ) << "calls"
+       << std::setw( 14 ) << "ms/call" << "  scope" << std::endl;
+    }
+  for( unsigned int n = 0; n < timers.size(); n++ )
+    {
+    os << timers[n].second << std::endl;
+    }
+  if( !counters.empty() )
+    {
+    os << std::setw( 12 ) << "count" << "  counter" << std::endl;
+    }
+  for( unsigned int n = 0; n < counters.size(); n++ )
+    {
+    os << counters[n].second << std::endl;
+    }
+
+  os.flags( flags );
+  os.precision( precision );
+}
+#endif
 }
 
 TRAN_FILE_TYPE CheckFileType(const char * const str)
@@ -210,6 +342,51 @@ void DisplayOpt(const TRAN_OPT & opt)
   std::cout << ": " << opt.filename << std::endl;
 }
 
+// FNV-1a hash of a string, continued from the given hash value
+static unsigned long long HashString(const std::string & str, unsigned long long hash)
+{
+  for( std::string::size_type i = 0; i < str.length(); i++ )
+    {
+    hash ^= static_cast<unsigned char>( str[i] );
+    hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+// identify a file by its name, length and modification time
+static std::string GetFileSignature(const std::string & filename)
+{
+  std::ostringstream signature;
+  signature << filename << ":";
+  if( itksys::SystemTools::FileExists( filename.c_str(), true ) )
+    {
+    signature << itksys::SystemTools::FileLength( filename.c_str() ) << ":"
+              << itksys::SystemTools::ModifiedTime( filename.c_str() );
+    }
+  return signature.str();
+}
+
+std::string GetComposedDisplacementFieldCacheFileName(const TRAN_OPT_QUEUE & opt_queue,
+                                                      const char * const reference_image_filename,
+                                                      const char * const cache_directory)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+
+  hash = HashString( GetFileSignature( reference_image_filename ), hash );
+  for( unsigned int i = 0; i < opt_queue.size(); i++ )
+    {
+    std::ostringstream item;
+    item << "|" << opt_queue[i].file_type << ":" << opt_queue[i].do_affine_inv << ":"
+         << GetFileSignature( opt_queue[i].filename );
+    hash = HashString( item.str(), hash );
+    }
+
+  std::ostringstream filename;
+  filename << cache_directory << "/composedWarp" << std::hex << std::setw( 16 ) << std::setfill( '0' ) << hash
+           << ".nii.gz";
+  return filename.str();
+}
+
 std::string GetPreferredTransformFileType(void)
 {
   // return ".mat";
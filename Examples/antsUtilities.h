@@ -10,6 +10,7 @@
 
 // #include "antscout.hxx"
 #include "antsAllocImage.h"
+#include <sstream>
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -27,6 +28,98 @@
 #include "itkGrayscaleDilateImageFilter.h"
 #include "itkGrayscaleErodeImageFilter.h"
 
+#if defined( ANTS_ENABLE_PROFILING )
+#include "itkRealTimeClock.h"
+#include "itkSimpleFastMutexLock.h"
+#include <map>
+#endif
+
+namespace ants
+{
+#if defined( ANTS_ENABLE_PROFILING )
+/** \class ProfileRegistry
+ *  \brief flat profile of the scopes marked with ANTS_PROFILE_SCOPE
+ *
+ * Accumulates the wall time and the number of calls of every instrumented
+ * scope, and the totals of the events counted with ANTS_PROFILE_COUNT, and
+ * prints them on std::cerr when the program exits.  The time of a scope
+ * includes the time of the scopes nested in it, and scopes entered by
+ * several threads at once add up the time of all of them.
+ *
+ * The registry is only compiled when ANTS is configured with
+ * ANTS_ENABLE_PROFILING, otherwise the macros expand to nothing.
+ */
+class ProfileRegistry
+{
+public:
+  static ProfileRegistry & GetInstance();
+
+  double GetTimeInSeconds() const;
+
+  void AddTime( const char * name, double seconds );
+
+  void AddCount( const char * name, unsigned long count );
+
+  void Print( std::ostream & os ) const;
+
+private:
+  ProfileRegistry();
+  ~ProfileRegistry();
+  ProfileRegistry( const ProfileRegistry & );
+  void operator=( const ProfileRegistry & );
+
+  struct Entry
+    {
+    double        m_Time;
+    unsigned long m_Count;
+    bool          m_IsTimer;
+    };
+  typedef std::map<std::string, Entry> EntryMapType;
+
+  itk::RealTimeClock::Pointer      m_Clock;
+  double                           m_StartTime;
+  mutable itk::SimpleFastMutexLock m_Mutex;
+  EntryMapType                     m_Entries;
+};
+
+/** Adds the time between its construction and its destruction to the
+    registry entry of its name, which must be a string literal. */
+class ScopedProfileTimer
+{
+public:
+  explicit ScopedProfileTimer( const char * name ) :
+    m_Name( name ),
+    m_StartTime( ProfileRegistry::GetInstance().GetTimeInSeconds() )
+  {
+  }
+
+  ~ScopedProfileTimer()
+  {
+    ProfileRegistry & registry = ProfileRegistry::GetInstance();
+
+    registry.AddTime( this->m_Name, registry.GetTimeInSeconds() - this->m_StartTime );
+  }
+
+private:
+  ScopedProfileTimer( const ScopedProfileTimer & );
+  void operator=( const ScopedProfileTimer & );
+
+  const char * m_Name;
+  double       m_StartTime;
+};
+
+#define ANTS_PROFILE_JOIN_( a, b ) a ## b
+#define ANTS_PROFILE_JOIN( a, b ) ANTS_PROFILE_JOIN_( a, b )
+#define ANTS_PROFILE_SCOPE( name ) \
+  ::ants::ScopedProfileTimer ANTS_PROFILE_JOIN( antsProfileScope, __LINE__ )( name )
+#define ANTS_PROFILE_COUNT( name, count ) \
+  ::ants::ProfileRegistry::GetInstance().AddCount( name, count )
+#else
+#define ANTS_PROFILE_SCOPE( name )
+#define ANTS_PROFILE_COUNT( name, count )
+#endif
+} // end namespace ants
+
 // We need to ensure that only one of these exists!
 namespace ants
 {
@@ -562,6 +655,27 @@ void GetLargestSizeAfterWarp(typename WarperType::Pointer & warper,
 //  std::cout << "pt_min: " << pt_min << " pt_max:" << pt_max << " largest_size:" << largest_size << std::endl;
 }
 
+/** Collapse the transform list of a WarpImageMultiTransformFilter into a single
+ * displacement field on the grid of img_ref.  ComposerType is the matching
+ * DisplacementFieldFromMultiTransformFilter.  Points that map outside of a
+ * deformation field domain are set to the maximum displacement value so that the
+ * warper treats them as outside when the field is pushed back as its only
+ * transform. */
+template <class ComposerType, class WarperType, class ImageType>
+typename ComposerType::OutputImageType::Pointer
+ComposeWarperTransformList( WarperType * warper, const ImageType * img_ref )
+{
+  typename ComposerType::Pointer composer = ComposerType::New();
+  composer->GetTransformList() = warper->GetTransformList();
+  composer->SetOutputParametersFromImage( img_ref );
+  composer->DetermineFirstDeformNoInterp();
+  composer->Update();
+
+  typename ComposerType::OutputImageType::Pointer field = composer->GetOutput();
+  field->DisconnectPipeline();
+  return field;
+}
+
 template <class TImageIn, class TImageOut>
 typename TImageOut::Pointer
 arCastImage( typename TImageIn::Pointer Rimage )
@@ -622,6 +736,19 @@ std::vector<TValue> ConvertVector( std::string optionString )
   return values;
 }
 
+/** The comma separated file names of a batch, or the one file name. */
+inline std::vector<std::string> GetBatchFileNames( const std::string & fileNames )
+{
+  std::vector<std::string> batch;
+  std::istringstream       iss( fileNames );
+  std::string              fileName;
+  while( std::getline( iss, fileName, ',' ) )
+    {
+    batch.push_back( fileName );
+    }
+  return batch;
+}
+
 // void ANTsStringReplace( std::string &s, const std::string &search, const std::string &replace )
 // {
 //   for( size_t pos = 0; ; pos += replace.length() )
@@ -682,6 +809,8 @@ typedef struct
   bool use_TightestBoundingBox;
   char * reference_image_filename;
   bool use_RotationHeader;
+  char * composed_field_cache_directory;
+  unsigned int time_points_per_slab;
 
   MLINTERP_OPT opt_ML;
   } MISC_OPT;
@@ -696,6 +825,10 @@ extern void DisplayOptQueue(const TRAN_OPT_QUEUE & opt_queue);
 
 extern void DisplayOpt(const TRAN_OPT & opt);
 
+extern std::string GetComposedDisplacementFieldCacheFileName(const TRAN_OPT_QUEUE & opt_queue,
+                                                             const char * const reference_image_filename,
+                                                             const char * const cache_directory);
+
 // ##########################################################################
 
 extern bool get_a_double_number(const char * const str, double & v);
@@ -4,9 +4,11 @@
 #include "itkantsReadWriteTransform.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkBSplineTransform.h"
+#include "itkMultiThreader.h"
 #include <vcl_compiler.h>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 #include "antsUtilities.h"
 
@@ -154,6 +156,133 @@ int compareTransforms( const typename itk::Transform<double, VImageDimension, VI
   return EXIT_SUCCESS;
 }
 
+struct CompareTransformSetThreadStruct
+{
+  const std::vector<std::string> *                      ClassNames;
+  const std::vector<itk::OptimizerParameters<double> > * Parameters;
+  std::vector<std::vector<double> > *                   Differences;
+};
+
+/** The largest absolute difference of the (fixed) parameters of every
+ * pair, or -1 for transforms of different types.  The rows are dealt out
+ * to the threads in turn since the later rows of the triangle are shorter. */
+static ITK_THREAD_RETURN_TYPE CompareTransformSetThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  CompareTransformSetThreadStruct *     str = static_cast<CompareTransformSetThreadStruct *>( info->UserData );
+
+  const std::vector<itk::OptimizerParameters<double> > & parameters = *str->Parameters;
+  const unsigned int                                    N = parameters.size();
+  for( unsigned int i = info->ThreadID; i < N; i += info->NumberOfThreads )
+    {
+    for( unsigned int j = i + 1; j < N; j++ )
+      {
+      double difference = -1.0;
+      if( ( *str->ClassNames )[i] == ( *str->ClassNames )[j] && parameters[i].Size() == parameters[j].Size() )
+        {
+        difference = 0.0;
+        for( unsigned int k = 0; k < parameters[i].Size(); k++ )
+          {
+          difference = std::max( difference, std::fabs( parameters[i][k] - parameters[j][k] ) );
+          }
+        }
+      ( *str->Differences )[i][j] = difference;
+      ( *str->Differences )[j][i] = difference;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Compare every pair of a set of transforms at once.  The transforms are
+ * read on all threads and their parameters gathered once, so each pair is
+ * one pass over two arrays. */
+template <unsigned int VImageDimension>
+int compareTransformSet( const std::vector<std::string> & fileNames )
+{
+  typedef itk::Transform<double, VImageDimension, VImageDimension> TransformType;
+  typedef itk::CompositeTransform<double, VImageDimension>         CompositeTransformType;
+
+  std::vector<typename TransformType::Pointer> transforms;
+  itk::ants::ReadTransforms<double, VImageDimension>( fileNames, transforms );
+
+  const unsigned int N = transforms.size();
+
+  std::vector<std::string>                       classNames( N );
+  std::vector<itk::OptimizerParameters<double> > parameters( N );
+  for( unsigned int i = 0; i < N; i++ )
+    {
+    if( transforms[i].IsNull() )
+      {
+      return EXIT_FAILURE;
+      }
+
+    // a composite transform is compared component by component
+    std::vector<typename TransformType::ConstPointer> components;
+    const CompositeTransformType *composite = dynamic_cast<const CompositeTransformType *>( transforms[i].GetPointer() );
+    if( composite )
+      {
+      for( unsigned int n = 0; n < composite->GetNumberOfTransforms(); n++ )
+        {
+        components.push_back( composite->GetNthTransform( n ).GetPointer() );
+        }
+      }
+    else
+      {
+      components.push_back( transforms[i].GetPointer() );
+      }
+
+    unsigned int numberOfParameters = 0;
+    for( unsigned int n = 0; n < components.size(); n++ )
+      {
+      classNames[i] += std::string( components[n]->GetNameOfClass() ) + " ";
+      numberOfParameters += components[n]->GetFixedParameters().Size() + components[n]->GetParameters().Size();
+      }
+    parameters[i].SetSize( numberOfParameters );
+    unsigned int k = 0;
+    for( unsigned int n = 0; n < components.size(); n++ )
+      {
+      const typename TransformType::FixedParametersType & fixedParameters = components[n]->GetFixedParameters();
+      for( unsigned int m = 0; m < fixedParameters.Size(); m++ )
+        {
+        parameters[i][k++] = fixedParameters[m];
+        }
+      const typename TransformType::ParametersType & transformParameters = components[n]->GetParameters();
+      for( unsigned int m = 0; m < transformParameters.Size(); m++ )
+        {
+        parameters[i][k++] = transformParameters[m];
+        }
+      }
+    }
+  transforms.clear();
+
+  std::vector<std::vector<double> > differences( N, std::vector<double>( N, 0.0 ) );
+
+  CompareTransformSetThreadStruct str;
+  str.ClassNames = &classNames;
+  str.Parameters = &parameters;
+  str.Differences = &differences;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( 1u, std::min( static_cast<unsigned int>( threader->GetNumberOfThreads() ), N ) ) );
+  threader->SetSingleMethod( CompareTransformSetThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  std::cout << "Largest parameter difference of every pair of transforms (-1: different transform types)" << std::endl;
+  for( unsigned int i = 0; i < N; i++ )
+    {
+    std::cout << i << ": " << fileNames[i] << std::endl;
+    }
+  for( unsigned int i = 0; i < N; i++ )
+    {
+    for( unsigned int j = 0; j < N; j++ )
+      {
+      std::cout << ( j > 0 ? "\t" : "" ) << differences[i][j];
+      }
+    std::cout << std::endl;
+    }
+  return EXIT_SUCCESS;
+}
+
 int compareTwoTransforms( std::vector<std::string> args, std::ostream* /* out_stream = NULL */ )
 {
   // the arguments coming in as 'args' is a replacement for the standard (argc,argv) format
@@ -161,10 +290,23 @@ int compareTwoTransforms( std::vector<std::string> args, std::ostream* /* out_st
   // and the argc equals:
   int argc = args.size() + 1;
 
+  if( argc > 3 && args[0] == std::string( "-m" ) )
+    {
+    const std::vector<std::string> fileNames( args.begin() + 1, args.end() );
+    if( compareTransformSet<2>( fileNames ) == EXIT_SUCCESS || compareTransformSet<3>( fileNames ) == EXIT_SUCCESS )
+      {
+      return EXIT_SUCCESS;
+      }
+    std::cerr << "Can't read input transforms" << std::endl;
+    return EXIT_FAILURE;
+    }
+
   if( argc != 3 )
     {
     std::cerr << "Usage: compareTwoTransforms\n"
-    << "<First Transform> , <Second Transform>" << std::endl;
+    << "<First Transform> , <Second Transform>\n"
+    << "or: compareTwoTransforms -m <Transform 1> <Transform 2> ... <Transform N>\n"
+    << "to print the largest parameter difference of every pair of N transforms" << std::endl;
     return EXIT_FAILURE;
     }
 
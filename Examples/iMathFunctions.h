@@ -73,7 +73,7 @@ iMathMD(typename ImageType::Pointer image, unsigned long radius,
 template <class ImageType>
 typename ImageType::Pointer
 iMathME(typename ImageType::Pointer image, unsigned long radius,
-        typename ImageType::Pointer erodeValue );
+        typename ImageType::PixelType erodeValue );
 #define iMathMERadius 1;
 #define iMathMEValue 1;
 
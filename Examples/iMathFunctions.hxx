@@ -14,8 +14,11 @@
 #include "iMathFunctions.h"
 #include "ReadWriteData.h"
 #include "antsUtilities.h"
+#include "antsAOSAnisotropicDiffusion.h"
+#include "antsAdaptiveHistogramEqualization.h"
+#include "antsBinaryBallMorphology.h"
+#include "antsIntensityQuantiles.h"
 
-#include "itkAdaptiveHistogramEqualizationImageFilter.h"
 #include "itkBinaryBallStructuringElement.h"
 #include "itkBinaryErodeImageFilter.h"
 #include "itkBinaryDilateImageFilter.h"
@@ -26,7 +29,6 @@
 #include "itkCastImageFilter.h"
 #include "itkConnectedComponentImageFilter.h"
 #include "itkDanielssonDistanceMapImageFilter.h"
-#include "itkGradientAnisotropicDiffusionImageFilter.h"
 #include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
 #include "itkGrayscaleDilateImageFilter.h"
 #include "itkGrayscaleErodeImageFilter.h"
@@ -36,9 +38,10 @@
 #include "itkIntensityWindowingImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
 #include "itkLaplacianRecursiveGaussianImageFilter.h"
-#include "itkLaplacianSharpeningImageFilter.h"
+#include "itkMinimumMaximumImageCalculator.h"
 #include "itkMultiScaleLaplacianBlobDetectorImageFilter.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkOptimalSharpeningImageFilter.h"
 #include "itkRelabelComponentImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkSignedMaurerDistanceMapImageFilter.h"
@@ -554,17 +557,11 @@ iMathHistogramEqualization( typename ImageType::Pointer image, double alpha, dou
     // NOPE
     }
 
-  typedef itk::AdaptiveHistogramEqualizationImageFilter< ImageType > AdaptiveHistogramEqualizationImageFilterType;
-  typename AdaptiveHistogramEqualizationImageFilterType::Pointer adaptiveHistogramEqualizationImageFilter = AdaptiveHistogramEqualizationImageFilterType::New();
-  adaptiveHistogramEqualizationImageFilter->SetInput( image );
-  typename AdaptiveHistogramEqualizationImageFilterType::RadiusType radius;
+  // the equalization of AdaptiveHistogramEqualizationImageFilter, with a
+  // sliding histogram for all but the smallest radii
+  typename ImageType::SizeType radius;
   radius.Fill( r );
-  adaptiveHistogramEqualizationImageFilter->SetRadius(radius);
-  adaptiveHistogramEqualizationImageFilter->SetAlpha(alpha);
-  adaptiveHistogramEqualizationImageFilter->SetBeta(beta);
-  adaptiveHistogramEqualizationImageFilter->Update( );
-
-  return adaptiveHistogramEqualizationImageFilter->GetOutput();
+  return AdaptiveHistogramEqualization::Equalize<ImageType>( image, radius, alpha, beta );
 }
 
 template <class ImageType>
@@ -581,13 +578,22 @@ iMathLaplacian(typename ImageType::Pointer image, double sigma, bool normalize )
   typename ImageType::Pointer output = laplacian->GetOutput();
   if ( normalize )
     {
-    typedef itk::RescaleIntensityImageFilter<ImageType, ImageType> RescaleFilterType;
-    typename RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
-    rescaler->SetOutputMinimum( 0 );
-    rescaler->SetOutputMaximum( 1 );
-    rescaler->SetInput( laplacian->GetOutput() );
-    rescaler->Update();
-    output = rescaler->GetOutput();
+    // rescale to [0,1] in place
+    typedef itk::MinimumMaximumImageCalculator<ImageType> CalculatorType;
+    typename CalculatorType::Pointer calculator = CalculatorType::New();
+    calculator->SetImage( output );
+    calculator->Compute();
+
+    const double minimum = calculator->GetMinimum();
+    const double range = calculator->GetMaximum() - calculator->GetMinimum();
+    const double scale = ( range > 0 ) ? 1.0 / range : 0.0;
+
+    typename ImageType::PixelType *buffer = output->GetBufferPointer();
+    const itk::SizeValueType       numberOfPixels = output->GetBufferedRegion().GetNumberOfPixels();
+    for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      buffer[n] = static_cast<typename ImageType::PixelType>( ( buffer[n] - minimum ) * scale );
+      }
     }
 
   return output;
@@ -624,6 +630,13 @@ iMathMC(typename ImageType::Pointer image, unsigned long radius,
         typename ImageType::PixelType closeValue)
 {
 
+  // Beyond a radius of one the ball is applied as a threshold on the distance
+  // transform, whose cost does not grow with the radius
+  if( radius > 1 )
+    {
+    return ants::BinaryBallMorphology::Close<ImageType>( image, radius, closeValue );
+    }
+
   const unsigned int ImageDimension = ImageType::ImageDimension;
   typedef typename ImageType::PixelType                         PixelType;
 
@@ -653,6 +666,11 @@ iMathMD(typename ImageType::Pointer image, unsigned long radius,
         typename ImageType::PixelType dilateValue)
 {
 
+  if( radius > 1 )
+    {
+    return ants::BinaryBallMorphology::Dilate<ImageType>( image, radius, dilateValue );
+    }
+
   const unsigned int ImageDimension = ImageType::ImageDimension;
   typedef typename ImageType::PixelType                         PixelType;
 
@@ -681,6 +699,11 @@ typename ImageType::Pointer
 iMathME( typename ImageType::Pointer image, unsigned long radius,
          typename ImageType::PixelType erodeValue )
 {
+  if( radius > 1 )
+    {
+    return ants::BinaryBallMorphology::Erode<ImageType>( image, radius, erodeValue, 0 );
+    }
+
   const unsigned int ImageDimension = ImageType::ImageDimension;
   typedef typename ImageType::PixelType                         PixelType;
 
@@ -708,6 +731,11 @@ typename ImageType::Pointer
 iMathMO( typename ImageType::Pointer image, unsigned long radius,
          typename ImageType::PixelType openValue )
 {
+  if( radius > 1 )
+    {
+    return ants::BinaryBallMorphology::Open<ImageType>( image, radius, openValue, 0 );
+    }
+
   const unsigned int ImageDimension = ImageType::ImageDimension;
   typedef typename ImageType::PixelType                         PixelType;
 
@@ -839,9 +867,7 @@ iMathPeronaMalik( typename ImageType::Pointer image, unsigned long nIterations,
     // NOPE
     }
 
-  typedef itk::GradientAnisotropicDiffusionImageFilter< ImageType, ImageType >
-    FilterType;
-  typedef typename FilterType::TimeStepType             TimeStepType;
+  typedef double TimeStepType;
 
   // Select time step size.
   TimeStepType  spacingsize = 0;
@@ -861,14 +887,9 @@ iMathPeronaMalik( typename ImageType::Pointer image, unsigned long nIterations,
     mytimestep = reftimestep;
     }
 
-  typename FilterType::Pointer filter = FilterType::New();
-  filter->SetInput( image );
-  filter->SetConductanceParameter( conductance ); // might need to change this
-  filter->SetNumberOfIterations( nIterations );
-  filter->SetTimeStep( mytimestep );
-
-  filter->Update();
-  return filter->GetOutput();
+  // The explicit scheme is stable only for the step above; the semi-implicit
+  // one reaches the same diffusion time in steps of up to one
+  return ants::AOSAnisotropicDiffusion::Diffuse<ImageType>( image, nIterations * mytimestep, conductance );
 }
 
 template <class ImageType>
@@ -880,9 +901,11 @@ iMathSharpen( typename ImageType::Pointer image )
     // NOPE
     }
 
-  typedef itk::LaplacianSharpeningImageFilter<ImageType, ImageType> FilterType;
+  // the Laplacian sharpening of ITK, in two threaded passes
+  typedef itk::OptimalSharpeningImageFilter<ImageType, ImageType> FilterType;
   typename FilterType::Pointer sharpenFilter = FilterType::New();
   sharpenFilter->SetInput( image );
+  sharpenFilter->SetSValue( 1.0 );
   sharpenFilter->Update();
 
   return sharpenFilter->GetOutput();
@@ -898,46 +921,17 @@ iMathTruncateIntensity( typename ImageType::Pointer image, double lowerQ, double
   typedef unsigned int                                      LabelType;
   typedef itk::Image<LabelType, ImageType::ImageDimension>  MaskType;
 
-  if( mask.IsNull() )
+  // the quantiles of the histogram of LabelStatisticsImageFilter, without
+  // the positive voxels thresholded into a mask first
+  double lowerValue = 0.0;
+  double upperValue = 0.0;
+  if( !IntensityQuantiles::Compute<ImageType, MaskType>( image, mask.GetPointer(), nBins, lowerQ, upperQ,
+                                                         lowerValue, upperValue ) )
     {
-    typedef itk::BinaryThresholdImageFilter<ImageType, MaskType> ThresholdFilterType;
-    typename ThresholdFilterType::Pointer thresh = ThresholdFilterType::New();
-    thresh->SetInput( image );
-    thresh->SetLowerThreshold( 1e-6 );
-    thresh->SetUpperThreshold( itk::NumericTraits<PixelType>::max() );
-    thresh->SetInsideValue(1);
-    thresh->SetOutsideValue(0);
-    thresh->Update();
-    mask = thresh->GetOutput();
+    return image;
     }
-  typedef itk::LabelStatisticsImageFilter<ImageType, MaskType> HistogramFilterType;
-  typename HistogramFilterType::Pointer stats = HistogramFilterType::New();
-
-  stats->SetInput( image );
-  stats->SetLabelInput( mask );
-  stats->Update();
-  PixelType minValue = stats->GetMinimum( 1 );
-  PixelType maxValue = stats->GetMaximum( 1 );
-
-  // Hack increment by delta
-  if (minValue == 0)
-    {
-    minValue = (PixelType) (minValue + 1e-6);
-    }
-  if (minValue == 0)
-    {
-    minValue++;
-    }
-
-  stats->SetUseHistograms( true );
-  stats->SetHistogramParameters( nBins, minValue, maxValue );
-  stats->Update();
-
-  typedef typename HistogramFilterType::HistogramPointer HistogramPointer;
-  HistogramPointer histogram = stats->GetHistogram( 1 );
-
-  PixelType lowerQuantile = histogram->Quantile( 0, lowerQ );
-  PixelType upperQuantile = histogram->Quantile( 0, upperQ );
+  PixelType lowerQuantile = static_cast<PixelType>( lowerValue );
+  PixelType upperQuantile = static_cast<PixelType>( upperValue );
 
   typedef itk::IntensityWindowingImageFilter<ImageType,ImageType> WindowFilterType;
   typename WindowFilterType::Pointer windowFilter = WindowFilterType::New();
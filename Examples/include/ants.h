@@ -49,6 +49,14 @@
 
 #include "antsRegistration.h"
 
+#include "antsServer.h"
+
+#include "antsBuildTemplate.h"
+
+#include "antsAtroposN4.h"
+
+#include "antsPipeline.h"
+
 #include "antsSurf.h"
 
 #include "antsUtilitiesTesting.h"
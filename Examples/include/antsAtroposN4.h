@@ -0,0 +1,11 @@
+#ifndef ANTSATROPOSN4_H
+#define ANTSATROPOSN4_H
+
+namespace ants
+{
+extern int antsAtroposN4( std::vector<std::string>, // equivalent to argv of command line parameters to main()
+                          std::ostream* out_stream  // [optional] output stream to write
+                          );
+} // namespace ants
+
+#endif // ANTSATROPOSN4_H
@@ -0,0 +1,11 @@
+#ifndef ANTSBUILDTEMPLATE_H
+#define ANTSBUILDTEMPLATE_H
+
+namespace ants
+{
+extern int antsBuildTemplate( std::vector<std::string>, // equivalent to argv of command line parameters to main()
+                              std::ostream* out_stream  // [optional] output stream to write
+                              );
+} // namespace ants
+
+#endif // ANTSBUILDTEMPLATE_H
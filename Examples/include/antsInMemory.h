@@ -0,0 +1,282 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsInMemory_h
+#define antsInMemory_h
+
+/** Typed entry points of the library tools for callers that hold their
+ * images and transforms in memory (wrappers, pipelines, batch drivers).
+ *
+ * Images and transforms are handed over by the in-memory names ReadImage,
+ * WriteImage, itk::ants::ReadTransform and itk::ants::WriteTransform already
+ * understand ("0x" followed by the address of a smart pointer), so no file
+ * is written, read or serialized and nothing is converted on the way.  The
+ * remaining settings of a tool are given as its usual command line options,
+ * e.g. std::vector<std::string>( 1, "--convergence" ) followed by
+ * "[50x50x50,0.0]".  A null pointer is returned if the tool fails.
+ *
+ * Registrations are run in memory with ants::RegistrationHelper (see
+ * itkantsRegistrationHelper.h), which takes the images and stages directly
+ * and returns the composite transform.
+ */
+
+#include "itkImage.h"
+#include "itkTransform.h"
+
+#include <ostream>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "antsApplyTransforms.h"
+#include "antsJointFusion.h"
+#include "Atropos.h"
+#include "DenoiseImage.h"
+#include "N4BiasFieldCorrection.h"
+
+namespace ants
+{
+namespace inmemory
+{
+/** The in-memory name of the object held by pointer.  The pointer must stay
+ * in scope while the tool runs; outputs are assigned to it. */
+template <class TPointer>
+std::string Name( TPointer & pointer )
+{
+  char buffer[64];
+
+  sprintf( buffer, "%p", static_cast<void *>( &pointer ) );
+
+  // not every C library prefixes %p
+  std::string name( buffer );
+  if( name.substr( 0, 2 ) != std::string( "0x" ) )
+    {
+    name = std::string( "0x" ) + name;
+    }
+  return name;
+}
+
+template <unsigned int VDimension>
+std::vector<std::string> Arguments( const std::vector<std::string> & options )
+{
+  std::ostringstream dimension;
+
+  dimension << VDimension;
+
+  std::vector<std::string> args;
+  args.push_back( "-d" );
+  args.push_back( dimension.str() );
+  args.insert( args.end(), options.begin(), options.end() );
+  return args;
+}
+
+/** N4BiasFieldCorrection of input within the optional mask.  The estimated
+ * bias field is assigned to biasField if it is given. */
+template <unsigned int VDimension>
+typename itk::Image<float, VDimension>::Pointer
+N4BiasFieldCorrection( typename itk::Image<float, VDimension>::Pointer input,
+                       typename itk::Image<float, VDimension>::Pointer mask = ITK_NULLPTR,
+                       const std::vector<std::string> & options = std::vector<std::string>(),
+                       typename itk::Image<float, VDimension>::Pointer *biasField = ITK_NULLPTR,
+                       std::ostream *out_stream = ITK_NULLPTR )
+{
+  typedef itk::Image<float, VDimension> ImageType;
+
+  typename ImageType::Pointer corrected = ITK_NULLPTR;
+
+  std::vector<std::string> args = Arguments<VDimension>( options );
+  args.push_back( "-i" );
+  args.push_back( Name( input ) );
+  if( mask.IsNotNull() )
+    {
+    args.push_back( "-x" );
+    args.push_back( Name( mask ) );
+    }
+  args.push_back( "-o" );
+  if( biasField != ITK_NULLPTR )
+    {
+    args.push_back( std::string( "[" ) + Name( corrected ) + "," + Name( *biasField ) + "]" );
+    }
+  else
+    {
+    args.push_back( Name( corrected ) );
+    }
+
+  if( ::ants::N4BiasFieldCorrection( args, out_stream ) != EXIT_SUCCESS )
+    {
+    return ITK_NULLPTR;
+    }
+  return corrected;
+}
+
+/** DenoiseImage of input within the optional mask.  The mask has the pixel
+ * type of the mask of the denoiser, unsigned char, since the in-memory name
+ * is read back as a pointer to exactly that type. */
+template <unsigned int VDimension>
+typename itk::Image<float, VDimension>::Pointer
+DenoiseImage( typename itk::Image<float, VDimension>::Pointer input,
+              typename itk::Image<unsigned char, VDimension>::Pointer mask = ITK_NULLPTR,
+              const std::vector<std::string> & options = std::vector<std::string>(),
+              std::ostream *out_stream = ITK_NULLPTR )
+{
+  typedef itk::Image<float, VDimension> ImageType;
+
+  typename ImageType::Pointer denoised = ITK_NULLPTR;
+
+  std::vector<std::string> args = Arguments<VDimension>( options );
+  args.push_back( "-i" );
+  args.push_back( Name( input ) );
+  if( mask.IsNotNull() )
+    {
+    args.push_back( "-x" );
+    args.push_back( Name( mask ) );
+    }
+  args.push_back( "-o" );
+  args.push_back( Name( denoised ) );
+
+  if( ::ants::DenoiseImage( args, out_stream ) != EXIT_SUCCESS )
+    {
+    return ITK_NULLPTR;
+    }
+  return denoised;
+}
+
+/** antsApplyTransforms of a scalar input onto the grid of reference.  The
+ * transforms are listed as for -t, the last one being applied first, and
+ * are computed in the precision of the images (float or double). */
+template <class TComputeType, unsigned int VDimension>
+typename itk::Image<TComputeType, VDimension>::Pointer
+ApplyTransforms( typename itk::Image<TComputeType, VDimension>::Pointer input,
+                 typename itk::Image<TComputeType, VDimension>::Pointer reference,
+                 std::vector<typename itk::Transform<TComputeType, VDimension, VDimension>::Pointer> & transforms,
+                 const std::vector<std::string> & options = std::vector<std::string>(),
+                 std::ostream *out_stream = ITK_NULLPTR )
+{
+  typedef itk::Image<TComputeType, VDimension> ImageType;
+
+  typename ImageType::Pointer warped = ITK_NULLPTR;
+
+  std::vector<std::string> args = Arguments<VDimension>( options );
+  if( sizeof( TComputeType ) == sizeof( float ) )
+    {
+    args.push_back( "--float" );
+    args.push_back( "1" );
+    }
+  args.push_back( "-i" );
+  args.push_back( Name( input ) );
+  args.push_back( "-r" );
+  args.push_back( Name( reference ) );
+  for( unsigned int n = 0; n < transforms.size(); n++ )
+    {
+    args.push_back( "-t" );
+    args.push_back( Name( transforms[n] ) );
+    }
+  args.push_back( "-o" );
+  args.push_back( Name( warped ) );
+
+  if( ::ants::antsApplyTransforms( args, out_stream ) != EXIT_SUCCESS )
+    {
+    return ITK_NULLPTR;
+    }
+  return warped;
+}
+
+/** Atropos segmentation of the intensity images within mask.  The
+ * initialization, likelihood and prior settings are given in options. */
+template <unsigned int VDimension>
+typename itk::Image<unsigned int, VDimension>::Pointer
+Atropos( std::vector<typename itk::Image<float, VDimension>::Pointer> & images,
+         typename itk::Image<unsigned int, VDimension>::Pointer mask,
+         const std::vector<std::string> & options,
+         std::ostream *out_stream = ITK_NULLPTR )
+{
+  typedef itk::Image<unsigned int, VDimension> LabelImageType;
+
+  typename LabelImageType::Pointer segmentation = ITK_NULLPTR;
+
+  std::vector<std::string> args = Arguments<VDimension>( options );
+  for( unsigned int n = 0; n < images.size(); n++ )
+    {
+    args.push_back( "-a" );
+    args.push_back( Name( images[n] ) );
+    }
+  args.push_back( "-x" );
+  args.push_back( Name( mask ) );
+  args.push_back( "-o" );
+  args.push_back( Name( segmentation ) );
+
+  if( ::ants::Atropos( args, out_stream ) != EXIT_SUCCESS )
+    {
+    return ITK_NULLPTR;
+    }
+  return segmentation;
+}
+
+/** antsJointFusion label fusion of the atlas segmentations onto target.
+ * Each atlas has one image per modality of target, in the same order. */
+template <unsigned int VDimension>
+typename itk::Image<unsigned int, VDimension>::Pointer
+JointFusion( std::vector<typename itk::Image<float, VDimension>::Pointer> & target,
+             std::vector<std::vector<typename itk::Image<float, VDimension>::Pointer> > & atlasImages,
+             std::vector<typename itk::Image<unsigned int, VDimension>::Pointer> & atlasSegmentations,
+             typename itk::Image<unsigned int, VDimension>::Pointer mask = ITK_NULLPTR,
+             const std::vector<std::string> & options = std::vector<std::string>(),
+             std::ostream *out_stream = ITK_NULLPTR )
+{
+  typedef itk::Image<unsigned int, VDimension> LabelImageType;
+
+  typename LabelImageType::Pointer fusion = ITK_NULLPTR;
+
+  std::vector<std::string> args = Arguments<VDimension>( options );
+
+  std::string targetNames;
+  for( unsigned int n = 0; n < target.size(); n++ )
+    {
+    targetNames += ( n == 0 ? "[" : "," ) + Name( target[n] );
+    }
+  args.push_back( "-t" );
+  args.push_back( targetNames + "]" );
+  for( unsigned int m = 0; m < atlasImages.size(); m++ )
+    {
+    std::string atlasNames;
+    for( unsigned int n = 0; n < atlasImages[m].size(); n++ )
+      {
+      atlasNames += ( n == 0 ? "[" : "," ) + Name( atlasImages[m][n] );
+      }
+    args.push_back( "-g" );
+    args.push_back( atlasNames + "]" );
+    }
+  for( unsigned int m = 0; m < atlasSegmentations.size(); m++ )
+    {
+    args.push_back( "-l" );
+    args.push_back( Name( atlasSegmentations[m] ) );
+    }
+  if( mask.IsNotNull() )
+    {
+    args.push_back( "-x" );
+    args.push_back( Name( mask ) );
+    }
+  args.push_back( "-o" );
+  args.push_back( std::string( "[" ) + Name( fusion ) + "]" );
+
+  if( ::ants::antsJointFusion( args, out_stream ) != EXIT_SUCCESS )
+    {
+    return ITK_NULLPTR;
+    }
+  return fusion;
+}
+} // namespace inmemory
+} // namespace ants
+
+#endif // antsInMemory_h
@@ -0,0 +1,11 @@
+#ifndef ANTSPIPELINE_H
+#define ANTSPIPELINE_H
+
+namespace ants
+{
+extern int antsPipeline( std::vector<std::string>, // equivalent to argv of command line parameters to main()
+                         std::ostream* out_stream  // [optional] output stream to write
+                         );
+} // namespace ants
+
+#endif // ANTSPIPELINE_H
@@ -22,8 +22,11 @@
 #include "itkANTSAffine3DTransform.h"
 #include "itkANTSCenteredAffine2DTransform.h"
 #include "itkANTSNeighborhoodCorrelationImageToImageMetricv4.h"
+#include "itkAdaptiveInversionSyNImageRegistrationMethod.h"
 #include "itkAffineTransform.h"
 #include "itkArray.h"
+#include "itkBSplineControlPointDisplacementFieldTransform.h"
+#include "itkBSplineControlPointDisplacementFieldTransformParametersAdaptor.h"
 #include "itkBSplineExponentialDiffeomorphicTransform.h"
 #include "itkBSplineExponentialDiffeomorphicTransformParametersAdaptor.h"
 #include "itkBSplineSmoothingOnUpdateDisplacementFieldTransform.h"
@@ -37,6 +40,7 @@
 #include "itkCommand.h"
 #include "itkComposeDisplacementFieldsImageFilter.h"
 #include "itkCompositeTransform.h"
+#include "itkConcurrentObjectToObjectMultiMetricv4.h"
 #include "itkConjugateGradientLineSearchOptimizerv4.h"
 #include "itkCorrelationImageToImageMetricv4.h"
 #include "itkDemonsImageToImageMetricv4.h"
@@ -53,9 +57,12 @@
 #include "itkHistogramMatchingImageFilter.h"
 #include "itkIdentityTransform.h"
 #include "itkImage.h"
+#include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkImageMaskSpatialObject.h"
+#include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageRegistrationMethodv4.h"
+#include "itkImportanceSamplingImageRegistrationMethodv4.h"
 #include "itkImageToHistogramFilter.h"
 #include "itkImageToImageMetricv4.h"
 #include "itkIntensityWindowingImageFilter.h"
@@ -73,9 +80,11 @@
 #include "itkObjectToObjectMultiMetricv4.h"
 #include "itkQuaternionRigidTransform.h"
 #include "itkRegistrationParameterScalesFromPhysicalShift.h"
+#include "itkScalingAndSquaringExponentialTransform.h"
 #include "itkSimilarity2DTransform.h"
 #include "itkSimilarity3DTransform.h"
 #include "itkSyNImageRegistrationMethod.h"
+#include "itkThreadedPointSetToPointSetMetricv4.h"
 #include "itkTimeProbe.h"
 #include "itkTimeVaryingBSplineVelocityFieldImageRegistrationMethod.h"
 #include "itkTimeVaryingBSplineVelocityFieldTransformParametersAdaptor.h"
@@ -85,20 +94,26 @@
 #include "itkTransform.h"
 #include "itkTransformFactory.h"
 #include "itkTranslationTransform.h"
+#include "itkVectorLinearInterpolateImageFunction.h"
 #include "itkVersorRigid3DTransform.h"
 #include "itkWeakPointer.h"
 
 #include "itkantsReadWriteTransform.h"
 
 #include "antsAllocImage.h"
+#include "antsBackgroundWriter.h"
 #include "antsCommandLineParser.h"
+#include "antsUtilities.h"
 
 #include <string>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <deque>
 #include <iomanip>
+#include <list>
 
+#include "antsRegistrationTelemetry.h"
 #include "antsRegistrationCommandIterationUpdate.h"
 #include "antsRegistrationOptimizerCommandIterationUpdate.h"
 #include "antsDisplacementAndVelocityFieldRegistrationCommandIterationUpdate.h"
@@ -134,7 +149,7 @@ public:
 
   typedef itk::Transform<TComputeType, VImageDimension, VImageDimension>             TransformType;
   typedef itk::AffineTransform<RealType, VImageDimension>                            AffineTransformType;
-  typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, AffineTransformType,
+  typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, AffineTransformType,
     ImageType, LabeledPointSetType>                                                  AffineRegistrationType;
   typedef typename AffineRegistrationType::ShrinkFactorsPerDimensionContainerType    ShrinkFactorsPerDimensionContainerType;
   typedef typename AffineTransformType::Superclass                                   MatrixOffsetTransformBaseType;
@@ -147,7 +162,7 @@ public:
   typedef itk::TimeVaryingVelocityFieldTransform<RealType, VImageDimension>          TimeVaryingVelocityFieldTransformType;
   typedef itk::ObjectToObjectMetric
                      <VImageDimension, VImageDimension, ImageType, RealType>         ObjectMetricType;
-  typedef itk::ObjectToObjectMultiMetricv4
+  typedef itk::ConcurrentObjectToObjectMultiMetricv4
                      <VImageDimension, VImageDimension, ImageType, RealType>         MultiMetricType;
   typedef itk::ImageToImageMetricv4<ImageType, ImageType, ImageType, RealType>       ImageMetricType;
   typedef itk::ImageMaskSpatialObject<VImageDimension>                               ImageMaskSpatialObjectType;
@@ -175,9 +190,10 @@ public:
     };
   enum SamplingStrategy
     {
-    none = 0,     // aka dense
-    regular = 1,  // regularly spaced sub-sampling
-    random = 2,   // irregularly spaced sub-sampling
+    none = 0,       // aka dense
+    regular = 1,    // regularly spaced sub-sampling
+    random = 2,     // irregularly spaced sub-sampling
+    importance = 3, // edge-weighted, stratified sub-sampling (random in the deformable stages)
     invalid = 17
     };
 
@@ -340,6 +356,7 @@ public:
   public:
     TransformMethod() : m_XfrmMethod( Rigid ),
       m_GradientStep( 0 ),
+      m_UseControlPointSupportGradient( false ),
       m_UpdateFieldVarianceInVarianceSpace( 0.0 ),
       m_TotalFieldVarianceInVarianceSpace( 0.0 ),
       m_SplineOrder( 3 ),
@@ -421,6 +438,7 @@ public:
     RealType m_GradientStep;
     // BSpline
     std::vector<unsigned int> m_MeshSizeAtBaseLevel;
+    bool                      m_UseControlPointSupportGradient;
     // GaussianDisplacementField
     RealType m_UpdateFieldVarianceInVarianceSpace;
     RealType m_TotalFieldVarianceInVarianceSpace;
@@ -555,9 +573,12 @@ public:
   void AddTranslationTransform( RealType GradientStep );
 
   /**
-   * add a spline transform
+   * add a spline transform; with UseControlPointSupportGradient the metric
+   * gradient is accumulated on the support of the control points, see
+   * BSplineControlPointDisplacementFieldTransform
    */
-  void AddBSplineTransform( RealType GradientStep, std::vector<unsigned int> & MeshSizeAtBaseLevel );
+  void AddBSplineTransform( RealType GradientStep, std::vector<unsigned int> & MeshSizeAtBaseLevel,
+                            bool UseControlPointSupportGradient = false );
 
   /**
    * add gaussian displacement transform
@@ -699,11 +720,90 @@ public:
   itkGetConstMacro( InitializeTransformsPerStage, bool );
   itkBooleanMacro( InitializeTransformsPerStage );
 
+  /**
+   * Adaptive level schedule for SyN stages: once a level improves the metric
+   * by less than minimumRelativeGain, the finer levels are given no
+   * iterations.  With carryOverUnusedIterations, iterations left over by a
+   * level that converged early go to the next level.  A gain of 0 disables
+   * the schedule.
+   */
+  void SetAdaptiveLevelSchedule( RealType minimumRelativeGain, bool carryOverUnusedIterations = false )
+  {
+    this->m_MinimumRelativeLevelGain = minimumRelativeGain;
+    this->m_CarryOverUnusedIterations = carryOverUnusedIterations;
+  }
+
   /**
    * turn on winsorize image intensity normalization
    */
   void SetWinsorizeImageIntensities( bool Winsorize, float LowerQuantile = 0.0, float UpperQuantile = 1.0 );
 
+  /**
+   * Set/Get the memory limit (in megabytes) of the cache holding the
+   * preprocessed (winsorized/histogram matched) images shared between
+   * stages.  The least recently used images are evicted first.  A value
+   * of 0 disables the cache.
+   */
+  itkSetMacro( PreprocessedImageCacheMemoryLimit, unsigned int );
+  itkGetConstMacro( PreprocessedImageCacheMemoryLimit, unsigned int );
+
+  /**
+   * Set/Get whether to trade speed for memory: the cache of preprocessed
+   * images is disabled and the displacement fields of the output transforms
+   * are collapsed in place instead of through intermediate fields.
+   */
+  itkSetMacro( ReduceMemoryFootprint, bool );
+  itkGetConstMacro( ReduceMemoryFootprint, bool );
+  itkBooleanMacro( ReduceMemoryFootprint );
+
+  /**
+   * Set/Get the prefix of the checkpoint files.  When set, the transforms
+   * computed so far are written after every stage as
+   * <prefix>CheckpointStage<n>.h5 (and <prefix>CheckpointStage<n>Inverse.h5),
+   * and <prefix>Checkpoint.txt is then replaced to record that n stages are
+   * complete.  An empty prefix (the default) disables checkpointing.
+   */
+  itkSetStringMacro( CheckpointPrefix );
+  itkGetStringMacro( CheckpointPrefix );
+
+  /**
+   * Set/Get the file the telemetry records of the stages, levels and
+   * iterations are written to, see RegistrationTelemetry.  An empty name
+   * (the default) writes none.
+   */
+  itkSetStringMacro( TelemetryFileName );
+  itkGetStringMacro( TelemetryFileName );
+
+  /**
+   * Set/Get the directory where the preprocessed (winsorized and rescaled)
+   * fixed images are kept from one run to the next.  The files are named
+   * after a hash of the pixels and geometry of the fixed image and of the
+   * preprocessing parameters, and are read instead of preprocessing the image
+   * again.  An empty name (the default) keeps none.
+   */
+  itkSetStringMacro( FixedImageCacheDirectory );
+  itkGetStringMacro( FixedImageCacheDirectory );
+
+  /**
+   * Restore the transforms of the stages completed in a previous run from the
+   * checkpoint written with this prefix.  The restored transforms replace the
+   * moving initial transform, which they already contain, and DoRegistration()
+   * skips the completed stages.  Finding no checkpoint is not an error; the
+   * registration then starts from the first stage.
+   */
+  int RestoreCheckpoint( const std::string & prefix );
+
+  itkGetConstMacro( NumberOfCompletedStages, unsigned int );
+
+  /**
+   * Set/Get the number of stages after which DoRegistration() stops, so that
+   * the remaining stages can be run by another helper, e.g. of another
+   * precision, restored from the checkpoint.  Zero (the default) runs all
+   * the stages.
+   */
+  itkSetMacro( NumberOfStagesToRun, unsigned int );
+  itkGetConstMacro( NumberOfStagesToRun, unsigned int );
+
   itkGetModifiableObjectMacro( CompositeTransform, CompositeTransformType );
   itkGetModifiableObjectMacro( RegistrationState, CompositeTransformType );
   /**
@@ -795,6 +895,38 @@ protected:
   virtual ~RegistrationHelper();
 private:
 
+  /**
+   * Entry of the preprocessed image cache.  The key is the input image, the
+   * winsorizing quantiles and the (unprocessed) histogram matching reference.
+   */
+  struct PreprocessedImageCacheEntry
+    {
+    typename ImageType::ConstPointer m_InputImage;
+    typename ImageType::ConstPointer m_HistogramMatchSourceImage;
+    RealType                         m_LowerQuantile;
+    RealType                         m_UpperQuantile;
+    typename ImageType::Pointer      m_PreprocessedImage;
+    };
+  typedef std::list<PreprocessedImageCacheEntry> PreprocessedImageCacheType;
+
+  /**
+   * Return the preprocessed version of the input image, computing it only if
+   * no previous stage has already done so.  The returned image shares its
+   * pixel buffer with the cached copy but has its own header so that the
+   * caller may modify the image geometry.
+   */
+  typename ImageType::Pointer GetPreprocessedImage( const ImageType * inputImage,
+                                                    const ImageType * histogramMatchSourceImage,
+                                                    bool isFixedImage = false );
+
+  /** The file of FixedImageCacheDirectory holding the preprocessed image. */
+  std::string GetFixedImageCacheFileName( const ImageType * inputImage ) const;
+
+  typename ImageType::Pointer ReadFixedImageCacheFile( const std::string & fileName,
+                                                       const ImageType * inputImage );
+
+  void WriteFixedImageCacheFile( const std::string & fileName, const ImageType * preprocessedImage );
+
   typename itk::ImageBase<VImageDimension>::Pointer GetShrinkImageOutputInformation(const itk::ImageBase<VImageDimension> * inputImageInformation,
                                const typename RegistrationHelper<TComputeType, VImageDimension>::ShrinkFactorsPerDimensionContainerType &shrinkFactorsPerDimensionForCurrentLevel) const;
 
@@ -942,6 +1074,7 @@ private:
             fixedPointSetsPerStage, movingPointSetsPerStage, stageMetricList, singleMetric,
             multiMetric, optimizer, numberOfLevels, shrinkFactorsPerDimensionForAllLevels,
             smoothingSigmasPerLevel, metricSamplingStrategy, samplingPercentage );
+    registrationMethod->SetUseImportanceSampling( stageMetricList[0].m_SamplingStrategy == importance );
 
     typedef antsRegistrationCommandIterationUpdate<RegistrationMethodType> TransformCommandType;
     typename TransformCommandType::Pointer transformObserver = TransformCommandType::New();
@@ -958,6 +1091,7 @@ private:
       this->Logger() << std::endl << "*** Running " <<
         currentTransform->GetNameOfClass() << " registration ***" << std::endl << std::endl;
       transformObserver->Execute( registrationMethod, itk::StartEvent() );
+      ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
       registrationMethod->Update();
       }
     catch( itk::ExceptionObject & e )
@@ -1011,8 +1145,66 @@ private:
   unsigned int m_PrintSimilarityMeasureInterval;
   unsigned int m_WriteIntervalVolumes;
   bool         m_InitializeTransformsPerStage;
+  RealType     m_MinimumRelativeLevelGain;
+  bool         m_CarryOverUnusedIterations;
   bool         m_AllPreviousTransformsAreLinear;
   typename CompositeTransformType::Pointer m_CompositeLinearTransformForFixedImageHeader;
+
+  unsigned int               m_PreprocessedImageCacheMemoryLimit;
+  PreprocessedImageCacheType m_PreprocessedImageCache;
+  bool                       m_ReduceMemoryFootprint;
+
+  /** The CollapseDisplacementFieldTransforms variant used to reduce the memory footprint. */
+  typename CompositeTransformType::Pointer CollapseDisplacementFieldTransformsInPlace( const CompositeTransformType * );
+
+  /** Compose the displacement field into the warping field, in place. */
+  void ComposeDisplacementFieldInPlace( DisplacementFieldType * warpingField,
+                                        const DisplacementFieldType * displacementField );
+
+  /** Queue the checkpoint of the completed stages on the background writer. */
+  void WriteCheckpoint( unsigned int numberOfCompletedStages );
+
+  static int WriteCheckpointFiles( CompositeTransformType * compositeTransform, const std::string & prefix,
+                                   unsigned int numberOfCompletedStages, std::ostream & messages );
+
+  /** The transforms of the completed stages are not modified by the later
+   * stages, so the job holds a composite sharing them rather than a copy. */
+  class CheckpointWriteJob : public ants::BackgroundWriteJob
+  {
+public:
+    CheckpointWriteJob( CompositeTransformType * compositeTransform, const std::string & prefix,
+                        unsigned int numberOfCompletedStages ) :
+      m_CompositeTransform( compositeTransform ),
+      m_Prefix( prefix ),
+      m_NumberOfCompletedStages( numberOfCompletedStages )
+    {
+    }
+
+    virtual void Run( std::ostream & messages ) ITK_OVERRIDE
+    {
+      if( WriteCheckpointFiles( this->m_CompositeTransform, this->m_Prefix, this->m_NumberOfCompletedStages,
+                                messages ) == EXIT_FAILURE )
+        {
+        // a lost checkpoint only costs the ability to resume, so keep going
+        messages << "WARNING:  could not write the checkpoint for stage " << this->m_NumberOfCompletedStages - 1
+                 << std::endl;
+        }
+    }
+
+private:
+    typename CompositeTransformType::Pointer m_CompositeTransform;
+    std::string                              m_Prefix;
+    unsigned int                             m_NumberOfCompletedStages;
+  };
+
+  std::string  m_CheckpointPrefix;
+  unsigned int m_NumberOfCompletedStages;
+  unsigned int m_NumberOfStagesToRun;
+
+  std::string                    m_TelemetryFileName;
+  RegistrationTelemetry::Pointer m_Telemetry;
+
+  std::string m_FixedImageCacheDirectory;
 };
 
 // ##########################################################################
@@ -1144,7 +1336,9 @@ template <class TComputeType, unsigned VImageDimension>
 typename ants::RegistrationHelper<TComputeType, VImageDimension>::CompositeTransformType::Pointer
 GetCompositeTransformFromParserOption( typename ParserType::Pointer & parser,
                                        typename ParserType::OptionType::Pointer initialTransformOption,
-                                       std::vector<bool> & derivedTransforms, bool useStaticCastForR = false )
+                                       std::vector<bool> & derivedTransforms, bool useStaticCastForR = false,
+                                       unsigned int brickSizeForDisplacementFields = 0,
+                                       unsigned int maximumNumberOfBricksForDisplacementFields = 64 )
 {
   typedef typename ants::RegistrationHelper<TComputeType, VImageDimension>      RegistrationHelperType;
   typedef typename RegistrationHelperType::CompositeTransformType CompositeTransformType;
@@ -1293,7 +1487,24 @@ GetCompositeTransformFromParserOption( typename ParserType::Pointer & parser,
         }
       else
         {
-        initialTransform = itk::ants::ReadTransform<TComputeType, VImageDimension>( initialTransformName, useStaticCastForR );
+        // displacement fields can be read on demand, a brick at a time
+        if( brickSizeForDisplacementFields > 0 && !useInverse
+            && initialTransformName.substr( 0, 2 ) != std::string( "0x" )
+            && initialTransformName.find( ".h5" ) == std::string::npos
+            && initialTransformName.find( ".hdf5" ) == std::string::npos
+            && initialTransformName.find( ".hdf4" ) == std::string::npos
+            && initialTransformName.find( ".mat" ) == std::string::npos
+            && initialTransformName.find( ".txt" ) == std::string::npos
+            && initialTransformName.find( ".xfm" ) == std::string::npos
+            && !itk::ants::IsTransformContainerFile( initialTransformName ) )
+          {
+          initialTransform = itk::ants::ReadBrickCachedDisplacementFieldTransform<TComputeType, VImageDimension>(
+              initialTransformName, brickSizeForDisplacementFields, maximumNumberOfBricksForDisplacementFields ).GetPointer();
+          }
+        if( initialTransform.IsNull() )
+          {
+          initialTransform = itk::ants::ReadTransform<TComputeType, VImageDimension>( initialTransformName, useStaticCastForR );
+          }
         }
       if( initialTransform.IsNull() )
         {
@@ -59,8 +59,18 @@ RegistrationHelper<TComputeType, VImageDimension>
   m_PrintSimilarityMeasureInterval( 0 ),
   m_WriteIntervalVolumes( 0 ),
   m_InitializeTransformsPerStage( false ),
+  m_MinimumRelativeLevelGain( 0.0 ),
+  m_CarryOverUnusedIterations( false ),
   m_AllPreviousTransformsAreLinear( true ),
-  m_CompositeLinearTransformForFixedImageHeader( ITK_NULLPTR )
+  m_CompositeLinearTransformForFixedImageHeader( ITK_NULLPTR ),
+  m_PreprocessedImageCacheMemoryLimit( 2048 ),
+  m_ReduceMemoryFootprint( false ),
+  m_CheckpointPrefix(),
+  m_NumberOfCompletedStages( 0 ),
+  m_NumberOfStagesToRun( 0 ),
+  m_TelemetryFileName(),
+  m_Telemetry( ITK_NULLPTR ),
+  m_FixedImageCacheDirectory()
 {
   typedef itk::LinearInterpolateImageFunction<ImageType, RealType> LinearInterpolatorType;
   typename LinearInterpolatorType::Pointer linearInterpolator = LinearInterpolatorType::New();
@@ -135,6 +145,217 @@ typename ImageType::Pointer PreprocessImage( typename ImageType::ConstPointer  i
   return outputImage;
 }
 
+template <class TComputeType, unsigned VImageDimension>
+typename RegistrationHelper<TComputeType, VImageDimension>::ImageType::Pointer
+RegistrationHelper<TComputeType, VImageDimension>
+::GetPreprocessedImage( const ImageType * inputImage, const ImageType * histogramMatchSourceImage,
+                        bool isFixedImage )
+{
+  typename PreprocessedImageCacheType::iterator it;
+  for( it = this->m_PreprocessedImageCache.begin(); it != this->m_PreprocessedImageCache.end(); ++it )
+    {
+    if( it->m_InputImage.GetPointer() == inputImage &&
+        it->m_HistogramMatchSourceImage.GetPointer() == histogramMatchSourceImage &&
+        it->m_LowerQuantile == this->m_LowerQuantile &&
+        it->m_UpperQuantile == this->m_UpperQuantile )
+      {
+      break;
+      }
+    }
+
+  typename ImageType::Pointer preprocessedImage = ITK_NULLPTR;
+  if( it != this->m_PreprocessedImageCache.end() )
+    {
+    // move the hit to the front of the list (most recently used)
+    this->m_PreprocessedImageCache.splice( this->m_PreprocessedImageCache.begin(),
+                                           this->m_PreprocessedImageCache, it );
+    preprocessedImage = this->m_PreprocessedImageCache.front().m_PreprocessedImage;
+    }
+  else
+    {
+    // the fixed image is usually the same from one run to the next
+    std::string cacheFileName;
+    if( isFixedImage && !this->m_FixedImageCacheDirectory.empty() && histogramMatchSourceImage == ITK_NULLPTR )
+      {
+      cacheFileName = this->GetFixedImageCacheFileName( inputImage );
+      preprocessedImage = this->ReadFixedImageCacheFile( cacheFileName, inputImage );
+      }
+
+    if( preprocessedImage.IsNull() )
+      {
+      typename ImageType::Pointer preprocessedHistogramMatchSourceImage = ITK_NULLPTR;
+      if( histogramMatchSourceImage )
+        {
+        preprocessedHistogramMatchSourceImage = this->GetPreprocessedImage( histogramMatchSourceImage, ITK_NULLPTR,
+                                                                            true );
+        }
+
+      const PixelType lowerScaleValue = 0.0;
+      const PixelType upperScaleValue = 1.0;
+      preprocessedImage = PreprocessImage<ImageType>( inputImage, lowerScaleValue, upperScaleValue,
+                                                      this->m_LowerQuantile, this->m_UpperQuantile,
+                                                      preprocessedHistogramMatchSourceImage.GetPointer() );
+      if( !cacheFileName.empty() )
+        {
+        this->WriteFixedImageCacheFile( cacheFileName, preprocessedImage );
+        }
+      }
+    ImageMemoryAccounting::Track( preprocessedImage.GetPointer() );
+    if( this->m_PreprocessedImageCacheMemoryLimit == 0 || this->m_ReduceMemoryFootprint )
+      {
+      return preprocessedImage;
+      }
+
+    PreprocessedImageCacheEntry entry;
+    entry.m_InputImage = inputImage;
+    entry.m_HistogramMatchSourceImage = histogramMatchSourceImage;
+    entry.m_LowerQuantile = this->m_LowerQuantile;
+    entry.m_UpperQuantile = this->m_UpperQuantile;
+    entry.m_PreprocessedImage = preprocessedImage;
+    this->m_PreprocessedImageCache.push_front( entry );
+
+    // evict the least recently used images once the memory limit is exceeded
+    const double memoryLimitInBytes = 1024.0 * 1024.0 * this->m_PreprocessedImageCacheMemoryLimit;
+    double       cacheSizeInBytes = 0.0;
+    for( it = this->m_PreprocessedImageCache.begin(); it != this->m_PreprocessedImageCache.end(); ++it )
+      {
+      cacheSizeInBytes += static_cast<double>( sizeof( PixelType ) ) *
+        it->m_PreprocessedImage->GetBufferedRegion().GetNumberOfPixels();
+      }
+    while( cacheSizeInBytes > memoryLimitInBytes && this->m_PreprocessedImageCache.size() > 1 )
+      {
+      const typename ImageType::Pointer & evictedImage = this->m_PreprocessedImageCache.back().m_PreprocessedImage;
+      cacheSizeInBytes -= static_cast<double>( sizeof( PixelType ) ) *
+        evictedImage->GetBufferedRegion().GetNumberOfPixels();
+      this->m_PreprocessedImageCache.pop_back();
+      }
+    }
+
+  // Hand out a new header which shares the cached pixel buffer.
+  typename ImageType::Pointer outputImage = ImageType::New();
+  outputImage->CopyInformation( preprocessedImage );
+  outputImage->SetRegions( preprocessedImage->GetBufferedRegion() );
+  outputImage->SetPixelContainer( preprocessedImage->GetPixelContainer() );
+
+  return outputImage;
+}
+
+template <class TComputeType, unsigned VImageDimension>
+std::string
+RegistrationHelper<TComputeType, VImageDimension>
+::GetFixedImageCacheFileName( const ImageType * inputImage ) const
+{
+  // FNV-1a hash of the pixels, then of the geometry and the preprocessing parameters
+  unsigned long long hash = 14695981039346656037ULL;
+
+  const unsigned char *    pixels = reinterpret_cast<const unsigned char *>( inputImage->GetBufferPointer() );
+  const itk::SizeValueType numberOfBytes = inputImage->GetBufferedRegion().GetNumberOfPixels() * sizeof( PixelType );
+  for( itk::SizeValueType i = 0; i < numberOfBytes; i++ )
+    {
+    hash ^= pixels[i];
+    hash *= 1099511628211ULL;
+    }
+
+  std::ostringstream parameters;
+  parameters << std::setprecision( 17 )
+             << inputImage->GetBufferedRegion().GetIndex() << inputImage->GetBufferedRegion().GetSize()
+             << inputImage->GetSpacing() << inputImage->GetOrigin() << inputImage->GetDirection()
+             << sizeof( PixelType ) << ":" << this->m_LowerQuantile << ":" << this->m_UpperQuantile;
+  const std::string parametersString = parameters.str();
+  for( std::string::size_type i = 0; i < parametersString.size(); i++ )
+    {
+    hash ^= static_cast<unsigned char>( parametersString[i] );
+    hash *= 1099511628211ULL;
+    }
+
+  std::ostringstream fileName;
+  fileName << this->m_FixedImageCacheDirectory << "/preprocessedFixedImage"
+           << std::hex << std::setw( 16 ) << std::setfill( '0' ) << hash << ".mha";
+  return fileName.str();
+}
+
+template <class TComputeType, unsigned VImageDimension>
+typename RegistrationHelper<TComputeType, VImageDimension>::ImageType::Pointer
+RegistrationHelper<TComputeType, VImageDimension>
+::ReadFixedImageCacheFile( const std::string & fileName, const ImageType * inputImage )
+{
+  if( !itksys::SystemTools::FileExists( fileName.c_str(), true ) )
+    {
+    return ITK_NULLPTR;
+    }
+
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  try
+    {
+    reader->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    this->Logger() << "WARNING:  could not read the cached fixed image " << fileName << ": "
+                   << err.GetDescription() << std::endl;
+    return ITK_NULLPTR;
+    }
+
+  typename ImageType::Pointer preprocessedImage = reader->GetOutput();
+  preprocessedImage->DisconnectPipeline();
+  if( preprocessedImage->GetBufferedRegion().GetSize() != inputImage->GetBufferedRegion().GetSize() )
+    {
+    return ITK_NULLPTR;
+    }
+
+  // the geometry is that of the input image, without the round off of the file header
+  preprocessedImage->SetRegions( inputImage->GetBufferedRegion() );
+  preprocessedImage->SetSpacing( inputImage->GetSpacing() );
+  preprocessedImage->SetOrigin( inputImage->GetOrigin() );
+  preprocessedImage->SetDirection( inputImage->GetDirection() );
+
+  this->Logger() << "  preprocessing:  read the fixed image from " << fileName << std::endl;
+  return preprocessedImage;
+}
+
+template <class TComputeType, unsigned VImageDimension>
+void
+RegistrationHelper<TComputeType, VImageDimension>
+::WriteFixedImageCacheFile( const std::string & fileName, const ImageType * preprocessedImage )
+{
+  if( !itksys::SystemTools::FileIsDirectory( this->m_FixedImageCacheDirectory.c_str() ) &&
+      !itksys::SystemTools::MakeDirectory( this->m_FixedImageCacheDirectory.c_str() ) )
+    {
+    this->Logger() << "WARNING:  could not create the fixed image cache "
+                   << this->m_FixedImageCacheDirectory << std::endl;
+    return;
+    }
+
+  // Runs sharing the cache may write the same file at the same time, so each
+  // writes its own file and renames it once it is complete.
+  std::ostringstream partialFileName;
+  partialFileName << fileName.substr( 0, fileName.size() - 4 ) << "." << this << "."
+                  << std::fixed << itksys::SystemTools::GetTime() << ".mha";
+
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput( preprocessedImage );
+  writer->SetFileName( partialFileName.str() );
+  writer->SetUseCompression( false );
+  try
+    {
+    writer->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    this->Logger() << "WARNING:  could not write the cached fixed image " << fileName << ": "
+                   << err.GetDescription() << std::endl;
+    itksys::SystemTools::RemoveFile( partialFileName.str().c_str() );
+    return;
+    }
+  if( !itksys::SystemTools::RenameFile( partialFileName.str().c_str(), fileName.c_str() ) )
+    {
+    itksys::SystemTools::RemoveFile( partialFileName.str().c_str() );
+    }
+}
+
 template <class TComputeType, unsigned VImageDimension>
 typename RegistrationHelper<TComputeType, VImageDimension>::MetricEnumeration
 RegistrationHelper<TComputeType, VImageDimension>
@@ -371,13 +592,15 @@ RegistrationHelper<TComputeType, VImageDimension>
 template <class TComputeType, unsigned VImageDimension>
 void
 RegistrationHelper<TComputeType, VImageDimension>
-::AddBSplineTransform(RealType GradientStep, std::vector<unsigned int> & MeshSizeAtBaseLevel)
+::AddBSplineTransform(RealType GradientStep, std::vector<unsigned int> & MeshSizeAtBaseLevel,
+                      bool UseControlPointSupportGradient)
 {
   TransformMethod init;
 
   init.m_XfrmMethod = BSpline;
   init.m_GradientStep = GradientStep;
   init.m_MeshSizeAtBaseLevel = MeshSizeAtBaseLevel;
+  init.m_UseControlPointSupportGradient = UseControlPointSupportGradient;
   this->m_TransformMethods.push_back( init );
 }
 
@@ -823,11 +1046,55 @@ RegistrationHelper<TComputeType, VImageDimension>
   // ##The main loop for exstimating the total composite tranform
   // ########################################################################################
   // ########################################################################################
+  if( this->m_NumberOfCompletedStages > this->m_NumberOfStages )
+    {
+    this->Logger() << "ERROR:  the checkpoint has " << this->m_NumberOfCompletedStages
+                   << " completed stages but only " << this->m_NumberOfStages << " stages are specified." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  if( this->m_ReduceMemoryFootprint )
+    {
+    this->m_PreprocessedImageCache.clear();
+    }
+
+  this->m_Telemetry = ITK_NULLPTR;
+  if( !this->m_TelemetryFileName.empty() )
+    {
+    this->m_Telemetry = RegistrationTelemetry::New();
+    if( !this->m_Telemetry->Open( this->m_TelemetryFileName ) )
+      {
+      this->Logger() << "WARNING:  could not open the telemetry file " << this->m_TelemetryFileName << std::endl;
+      this->m_Telemetry = ITK_NULLPTR;
+      }
+    }
+
   for( unsigned int currentStageNumber = 0; currentStageNumber < this->m_NumberOfStages; currentStageNumber++ )
     {
+    if( this->m_NumberOfStagesToRun > 0 && currentStageNumber >= this->m_NumberOfStagesToRun )
+      {
+      this->Logger() << std::endl << "Stopping after stage " << currentStageNumber - 1 << "." << std::endl;
+      break;
+      }
+    if( currentStageNumber < this->m_NumberOfCompletedStages )
+      {
+      this->Logger() << std::endl << "Stage " << currentStageNumber << " was restored from the checkpoint."
+                     << std::endl;
+      continue;
+      }
+
     itk::TimeProbe timer;
     timer.Start();
 
+    // the stage setup is the time of the stage less that of the optimization
+    ANTS_PROFILE_SCOPE( "RegistrationHelper::Stage" );
+
+    if( this->m_Telemetry )
+      {
+      this->m_Telemetry->BeginStage( currentStageNumber,
+                                     this->m_TransformMethods[currentStageNumber].XfrmMethodAsString() );
+      }
+
     this->Logger() << std::endl << "Stage " << currentStageNumber << std::endl;
     std::stringstream currentStageString;
     currentStageString << currentStageNumber;
@@ -1017,7 +1284,9 @@ RegistrationHelper<TComputeType, VImageDimension>
           {
           this->Logger() << "  using the ICP metric (weight = "
                          << stageMetricList[currentMetricNumber].m_Weighting << ")" << std::endl;
-          typedef itk::EuclideanDistancePointSetToPointSetMetricv4<LabeledPointSetType, LabeledPointSetType, RealType> IcpPointSetMetricType;
+          typedef itk::ThreadedPointSetToPointSetMetricv4<
+            itk::EuclideanDistancePointSetToPointSetMetricv4<LabeledPointSetType, LabeledPointSetType, RealType> >
+            IcpPointSetMetricType;
           typename IcpPointSetMetricType::Pointer icpMetric = IcpPointSetMetricType::New();
 
           labeledPointSetMetric->SetPointSetMetric( icpMetric.GetPointer() );
@@ -1027,7 +1296,9 @@ RegistrationHelper<TComputeType, VImageDimension>
           {
           this->Logger() << "  using the PSE metric (weight = "
                          << stageMetricList[currentMetricNumber].m_Weighting << ")" << std::endl;
-          typedef itk::ExpectationBasedPointSetToPointSetMetricv4<LabeledPointSetType, LabeledPointSetType, RealType> PsePointSetMetricType;
+          typedef itk::ThreadedPointSetToPointSetMetricv4<
+            itk::ExpectationBasedPointSetToPointSetMetricv4<LabeledPointSetType, LabeledPointSetType, RealType> >
+            PsePointSetMetricType;
           typename PsePointSetMetricType::Pointer pseMetric = PsePointSetMetricType::New();
           pseMetric->SetPointSetSigma( stageMetricList[currentMetricNumber].m_PointSetSigma );
           pseMetric->SetEvaluationKNeighborhood( stageMetricList[currentMetricNumber].m_EvaluationKNeighborhood );
@@ -1039,7 +1310,9 @@ RegistrationHelper<TComputeType, VImageDimension>
           {
           this->Logger() << "  using the JHCT metric (weight = "
                          << stageMetricList[currentMetricNumber].m_Weighting << ")" << std::endl;
-          typedef itk::JensenHavrdaCharvatTsallisPointSetToPointSetMetricv4<LabeledPointSetType, RealType> JhctPointSetMetricType;
+          typedef itk::ThreadedPointSetToPointSetMetricv4<
+            itk::JensenHavrdaCharvatTsallisPointSetToPointSetMetricv4<LabeledPointSetType, RealType> >
+            JhctPointSetMetricType;
           typename JhctPointSetMetricType::Pointer jhctMetric = JhctPointSetMetricType::New();
           jhctMetric->SetPointSetSigma( stageMetricList[currentMetricNumber].m_PointSetSigma );
           jhctMetric->SetKernelSigma( 10.0 );
@@ -1097,33 +1370,25 @@ RegistrationHelper<TComputeType, VImageDimension>
 
         std::string outputPreprocessingString = "";
 
-        PixelType lowerScaleValue = 0.0;
-        PixelType upperScaleValue = 1.0;
         if( this->m_WinsorizeImageIntensities )
           {
           outputPreprocessingString += "  preprocessing:  winsorizing the image intensities\n";
           }
 
         typename ImageType::Pointer preprocessFixedImage =
-          PreprocessImage<ImageType>( fixedImage.GetPointer(), lowerScaleValue,
-                                      upperScaleValue, this->m_LowerQuantile, this->m_UpperQuantile,
-                                      ITK_NULLPTR );
+          this->GetPreprocessedImage( fixedImage.GetPointer(), ITK_NULLPTR, true );
 
         preprocessedFixedImagesPerStage.push_back( preprocessFixedImage.GetPointer() );
 
-        typename ImageType::Pointer preprocessMovingImage =
-          PreprocessImage<ImageType>( movingImage.GetPointer(), lowerScaleValue,
-                                      upperScaleValue, this->m_LowerQuantile, this->m_UpperQuantile,
-                                      ITK_NULLPTR );
-
+        typename ImageType::Pointer preprocessMovingImage = ITK_NULLPTR;
         if( this->m_UseHistogramMatching )
           {
           outputPreprocessingString += "  preprocessing:  histogram matching the images\n";
-          preprocessMovingImage =
-            PreprocessImage<ImageType>( movingImage.GetPointer(),
-                                        lowerScaleValue, upperScaleValue,
-                                        this->m_LowerQuantile, this->m_UpperQuantile,
-                                        preprocessFixedImage.GetPointer() );
+          preprocessMovingImage = this->GetPreprocessedImage( movingImage.GetPointer(), fixedImage.GetPointer() );
+          }
+        else
+          {
+          preprocessMovingImage = this->GetPreprocessedImage( movingImage.GetPointer(), ITK_NULLPTR );
           }
         preprocessedMovingImagesPerStage.push_back( preprocessMovingImage.GetPointer() );
 
@@ -1237,6 +1502,17 @@ RegistrationHelper<TComputeType, VImageDimension>
     if( useMultiMetric )
       {
       multiMetric->SetMetricWeights( metricWeights );
+
+      // the metrics are evaluated at the same time and share the threads
+      const typename MultiMetricType::MetricQueueType & metricQueue = multiMetric->GetMetricQueue();
+      for( unsigned int n = 0; n < metricQueue.size(); n++ )
+        {
+        ImageMetricType *imageMetric = dynamic_cast<ImageMetricType *>( metricQueue[n].GetPointer() );
+        if( imageMetric )
+          {
+          imageMetric->SetMaximumNumberOfThreads( multiMetric->GetNumberOfThreadsPerMetric() );
+          }
+        }
       }
 
     // These two variables are specified in setting up the registration method.
@@ -1298,6 +1574,21 @@ RegistrationHelper<TComputeType, VImageDimension>
       this->Logger() << "  regular sampling (percentage = " << samplingPercentage << ")" << std::endl;
       metricSamplingStrategy = AffineRegistrationType::REGULAR;
       }
+    else if( samplingStrategy == importance )
+      {
+      const XfrmMethod stageTransform = this->m_TransformMethods[currentStageNumber].m_XfrmMethod;
+      if( stageTransform == Rigid || stageTransform == Affine || stageTransform == CompositeAffine ||
+          stageTransform == Similarity || stageTransform == Translation )
+        {
+        this->Logger() << "  importance sampling (percentage = " << samplingPercentage << ")" << std::endl;
+        }
+      else
+        {
+        this->Logger() << "  random sampling (percentage = " << samplingPercentage
+                       << "), importance sampling is only done in the linear stages" << std::endl;
+        }
+      metricSamplingStrategy = AffineRegistrationType::RANDOM;
+      }
     else if( samplingStrategy == none )
       {
       this->Logger() << "  Using default NONE metricSamplingStrategy " << std::endl;
@@ -1365,6 +1656,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                                                             ConjugateGradientDescentOptimizerType> OptimizerCommandType;
     typename OptimizerCommandType::Pointer optimizerObserver = OptimizerCommandType::New();
     optimizerObserver->SetLogStream( *this->m_LogStream );
+    optimizerObserver->SetTelemetry( this->m_Telemetry );
     optimizerObserver->SetNumberOfIterations( currentStageIterations );
     optimizerObserver->SetOptimizer( optimizer );
 
@@ -1402,6 +1694,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                                                             GradientDescentOptimizerType> OptimizerCommandType2;
     typename OptimizerCommandType2::Pointer optimizerObserver2 = OptimizerCommandType2::New();
     optimizerObserver2->SetLogStream( *this->m_LogStream );
+    optimizerObserver2->SetTelemetry( this->m_Telemetry );
     optimizerObserver2->SetNumberOfIterations( currentStageIterations );
     optimizerObserver2->SetOptimizer( optimizer2 );
     if( !this->IsPointSetMetric( this->m_Metrics[0].m_MetricType ) )
@@ -1454,7 +1747,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           }
         else
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType,
             AffineTransformType, ImageType, IntensityPointSetType>  AffineRegistrationType2;
 
           this->AddLinearTransformToCompositeTransform<AffineRegistrationType2>(
@@ -1472,7 +1765,7 @@ RegistrationHelper<TComputeType, VImageDimension>
 
         if( stageMetricList[0].m_MetricType != IGDM )
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, RigidTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, RigidTransformType,
             ImageType, LabeledPointSetType> RigidRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<RigidRegistrationType>(
@@ -1484,7 +1777,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           }
         else
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, RigidTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, RigidTransformType,
             ImageType, IntensityPointSetType> RigidRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<RigidRegistrationType>(
@@ -1502,7 +1795,7 @@ RegistrationHelper<TComputeType, VImageDimension>
 
         if( stageMetricList[0].m_MetricType != IGDM )
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType,
             CompositeAffineTransformType, ImageType, LabeledPointSetType> CompositeAffineRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<CompositeAffineRegistrationType>(
@@ -1514,7 +1807,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           }
         else
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType,
             CompositeAffineTransformType, ImageType, IntensityPointSetType> CompositeAffineRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<CompositeAffineRegistrationType>(
@@ -1532,7 +1825,7 @@ RegistrationHelper<TComputeType, VImageDimension>
 
         if( stageMetricList[0].m_MetricType != IGDM )
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, SimilarityTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, SimilarityTransformType,
             ImageType, LabeledPointSetType> SimilarityRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<SimilarityRegistrationType>(
@@ -1544,7 +1837,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           }
         else
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, SimilarityTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, SimilarityTransformType,
             ImageType, IntensityPointSetType> SimilarityRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<SimilarityRegistrationType>(
@@ -1562,7 +1855,7 @@ RegistrationHelper<TComputeType, VImageDimension>
 
         if( stageMetricList[0].m_MetricType != IGDM )
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, TranslationTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, TranslationTransformType,
             ImageType, LabeledPointSetType> TranslationRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<TranslationRegistrationType>(
@@ -1574,7 +1867,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           }
         else
           {
-          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, TranslationTransformType,
+          typedef itk::ImportanceSamplingImageRegistrationMethodv4<ImageType, ImageType, TranslationTransformType,
             ImageType, IntensityPointSetType> TranslationRegistrationType;
 
           this->AddLinearTransformToCompositeTransform<TranslationRegistrationType>(
@@ -1658,6 +1951,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
           DisplacementFieldCommandType::New();
         displacementFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+        displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
         displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
         registrationMethod->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -1670,6 +1964,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << varianceForUpdateField << ", varianceForTotalField = " << varianceForTotalField << ") ***"
                          << std::endl << std::endl;
           displacementFieldRegistrationObserver->Execute( registrationMethod, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           registrationMethod->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -1777,6 +2072,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
           DisplacementFieldCommandType::New();
         displacementFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+        displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
         displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
         registrationMethod->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -1789,6 +2085,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << updateMeshSize << ", totalMeshSizeAtBaseLevel = " << totalMeshSize << ") ***" << std::endl
                          << std::endl;
           displacementFieldRegistrationObserver->Execute( registrationMethod, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           registrationMethod->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -1821,7 +2118,8 @@ RegistrationHelper<TComputeType, VImageDimension>
           AllocImage<DisplacementFieldType>( virtualDomainImage, zeroVector );
 
         typedef itk::SyNImageRegistrationMethod<ImageType, ImageType,
-          DisplacementFieldTransformType, ImageType, LabeledPointSetType> DisplacementFieldRegistrationType;
+          DisplacementFieldTransformType, ImageType, LabeledPointSetType> SyNRegistrationType;
+        typedef itk::AdaptiveInversionSyNImageRegistrationMethod<SyNRegistrationType> DisplacementFieldRegistrationType;
         typename DisplacementFieldRegistrationType::Pointer displacementFieldRegistration =
           DisplacementFieldRegistrationType::New();
 
@@ -1976,6 +2274,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename DisplacementFieldCommandType2::Pointer displacementFieldRegistrationObserver2 =
           DisplacementFieldCommandType2::New();
         displacementFieldRegistrationObserver2->SetLogStream(*this->m_LogStream);
+        displacementFieldRegistrationObserver2->SetTelemetry( this->m_Telemetry );
         displacementFieldRegistrationObserver2->SetNumberOfIterations( currentStageIterations );
         displacementFieldRegistrationObserver2->SetOrigFixedImage( this->m_Metrics[0].m_FixedImage );
         displacementFieldRegistrationObserver2->SetOrigMovingImage( this->m_Metrics[0].m_MovingImage );
@@ -1988,6 +2287,8 @@ RegistrationHelper<TComputeType, VImageDimension>
           displacementFieldRegistrationObserver2->SetWriteInterationsOutputsInIntervals( this->m_WriteIntervalVolumes );
           displacementFieldRegistrationObserver2->SetCurrentStageNumber( currentStageNumber );
           }
+        displacementFieldRegistrationObserver2->SetMinimumRelativeLevelGain( this->m_MinimumRelativeLevelGain );
+        displacementFieldRegistrationObserver2->SetCarryOverUnusedIterations( this->m_CarryOverUnusedIterations );
         displacementFieldRegistration->AddObserver( itk::InitializeEvent(), displacementFieldRegistrationObserver2 );
         displacementFieldRegistration->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver2 );
 
@@ -1997,6 +2298,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << varianceForUpdateField << ", varianceForTotalField = " << varianceForTotalField << ") ***"
                          << std::endl << std::endl;
           displacementFieldRegistrationObserver2->Execute( displacementFieldRegistration, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           displacementFieldRegistration->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -2057,6 +2359,8 @@ RegistrationHelper<TComputeType, VImageDimension>
           {
           typedef itk::BSplineSyNImageRegistrationMethod<ImageType, ImageType,
             BSplineDisplacementFieldTransformType, ImageType, LabeledPointSetType>
+            BSplineSyNRegistrationType;
+          typedef itk::AdaptiveInversionSyNImageRegistrationMethod<BSplineSyNRegistrationType>
             DisplacementFieldRegistrationType;
 
           typename DisplacementFieldRegistrationType::Pointer registrationMethod =
@@ -2133,6 +2437,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
             DisplacementFieldCommandType::New();
           displacementFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+          displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
           displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
           registrationMethod->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -2144,6 +2449,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                            << updateMeshSize << ", totalMeshSizeAtBaseLevel = " << totalMeshSize << ") ***" << std::endl
                            << std::endl;
             displacementFieldRegistrationObserver->Execute( registrationMethod, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
             registrationMethod->Update();
             }
           catch( itk::ExceptionObject & e )
@@ -2159,6 +2465,8 @@ RegistrationHelper<TComputeType, VImageDimension>
           {
           typedef itk::BSplineSyNImageRegistrationMethod<ImageType, ImageType,
             BSplineDisplacementFieldTransformType, ImageType, IntensityPointSetType>
+            BSplineSyNRegistrationType;
+          typedef itk::AdaptiveInversionSyNImageRegistrationMethod<BSplineSyNRegistrationType>
             DisplacementFieldRegistrationType;
 
           typename DisplacementFieldRegistrationType::Pointer registrationMethod =
@@ -2235,6 +2543,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
             DisplacementFieldCommandType::New();
           displacementFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+          displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
           displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
           registrationMethod->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -2246,6 +2555,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                            << updateMeshSize << ", totalMeshSizeAtBaseLevel = " << totalMeshSize << ") ***" << std::endl
                            << std::endl;
             displacementFieldRegistrationObserver->Execute( registrationMethod, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
             registrationMethod->Update();
             }
           catch( itk::ExceptionObject & e )
@@ -2284,6 +2594,20 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename ImageType::SpacingType fixedImageSpacing = preprocessedFixedImagesPerStage[0]->GetSpacing();
         typename ImageType::DirectionType fixedImageDirection = preprocessedFixedImagesPerStage[0]->GetDirection();
 
+        // The adaptor of every level, including the first, resamples the field
+        // onto that level's grid, so start on the grid of the first level.  A
+        // full resolution field would only be replaced at level 0, while these
+        // references keep it alive for the whole stage.
+        typename itk::ImageBase<VImageDimension>::Pointer initialSpace =
+          this->GetShrinkImageOutputInformation( virtualDomainImage.GetPointer(),
+                                                 shrinkFactorsPerDimensionForAllLevels[0] );
+        typename ImageType::RegionType initialRegion = initialSpace->GetLargestPossibleRegion();
+        fixedImageIndex = initialRegion.GetIndex();
+        fixedImageSize = initialRegion.GetSize();
+        fixedImageOrigin = initialSpace->GetOrigin();
+        fixedImageSpacing = initialSpace->GetSpacing();
+        fixedImageDirection = initialSpace->GetDirection();
+
         unsigned int numberOfTimeIndices = this->m_TransformMethods[currentStageNumber].m_NumberOfTimeIndices;
 
         velocityFieldIndex.Fill( 0 );
@@ -2313,13 +2637,13 @@ RegistrationHelper<TComputeType, VImageDimension>
                                                    zeroVector);
 
         typename DisplacementFieldType::Pointer displacementField =
-          AllocImage<DisplacementFieldType>( preprocessedFixedImagesPerStage[0]->GetBufferedRegion(),
+          AllocImage<DisplacementFieldType>( initialRegion,
                                                     fixedImageSpacing,
                                                     fixedImageOrigin,
                                                     fixedImageDirection,
                                                     zeroVector );
         typename DisplacementFieldType::Pointer inverseDisplacementField =
-          AllocImage<DisplacementFieldType>( preprocessedFixedImagesPerStage[0]->GetBufferedRegion(),
+          AllocImage<DisplacementFieldType>( initialRegion,
                                                     fixedImageSpacing,
                                                     fixedImageOrigin,
                                                     fixedImageDirection,
@@ -2470,6 +2794,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typedef antsRegistrationCommandIterationUpdate<VelocityFieldRegistrationType> VelocityFieldCommandType;
         typename VelocityFieldCommandType::Pointer velocityFieldRegistrationObserver = VelocityFieldCommandType::New();
         velocityFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+        velocityFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
         velocityFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
         velocityFieldRegistration->AddObserver( itk::IterationEvent(), velocityFieldRegistrationObserver );
@@ -2484,6 +2809,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << varianceForUpdateFieldTime << ", varianceForTotalFieldTime = " << varianceForTotalFieldTime
                          << ") ***" << std::endl << std::endl;
           velocityFieldRegistrationObserver->Execute( velocityFieldRegistration, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           velocityFieldRegistration->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -2673,6 +2999,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           typedef antsRegistrationCommandIterationUpdate<VelocityFieldRegistrationType> VelocityFieldCommandType;
           typename VelocityFieldCommandType::Pointer velocityFieldRegistrationObserver = VelocityFieldCommandType::New();
           velocityFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+          velocityFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
           velocityFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
           velocityFieldRegistration->AddObserver( itk::IterationEvent(), velocityFieldRegistrationObserver );
@@ -2684,6 +3011,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                            << "*** Running time-varying b-spline velocity field registration (initial mesh size = "
                            << initialTransformDomainMeshSize << ") ***" << std::endl << std::endl;
             velocityFieldRegistrationObserver->Execute( velocityFieldRegistration, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
             velocityFieldRegistration->Update();
             }
           catch( itk::ExceptionObject & e )
@@ -2811,6 +3139,7 @@ RegistrationHelper<TComputeType, VImageDimension>
           typedef antsRegistrationCommandIterationUpdate<VelocityFieldRegistrationType> VelocityFieldCommandType;
           typename VelocityFieldCommandType::Pointer velocityFieldRegistrationObserver = VelocityFieldCommandType::New();
           velocityFieldRegistrationObserver->SetLogStream( *this->m_LogStream );
+          velocityFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
           velocityFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
           velocityFieldRegistration->AddObserver( itk::IterationEvent(), velocityFieldRegistrationObserver );
@@ -2822,6 +3151,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                            << "*** Running time-varying b-spline velocity field registration (initial mesh size = "
                            << initialTransformDomainMeshSize << ") ***" << std::endl << std::endl;
             velocityFieldRegistrationObserver->Execute( velocityFieldRegistration, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
             velocityFieldRegistration->Update();
             }
           catch( itk::ExceptionObject & e )
@@ -2846,8 +3176,9 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename ConstantVelocityFieldType::Pointer constantVelocityField = AllocImage<ConstantVelocityFieldType>(
             preprocessedFixedImagesPerStage[0], zeroVector );
 
-        typedef itk::GaussianExponentialDiffeomorphicTransform<RealType,
-                                                               VImageDimension> GaussianDisplacementFieldTransformType;
+        typedef itk::ScalingAndSquaringExponentialTransform<itk::GaussianExponentialDiffeomorphicTransform<RealType,
+                                                                                                        VImageDimension> >
+          GaussianDisplacementFieldTransformType;
 
         typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, GaussianDisplacementFieldTransformType,
           ImageType, LabeledPointSetType> DisplacementFieldRegistrationType;
@@ -2968,6 +3299,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
           DisplacementFieldCommandType::New();
         displacementFieldRegistrationObserver->SetLogStream(*this->m_LogStream );
+        displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
         displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
         displacementFieldRegistration->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -2981,6 +3313,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << ") ***"
                          << std::endl << std::endl;
           displacementFieldRegistrationObserver->Execute( displacementFieldRegistration, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           displacementFieldRegistration->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -3004,7 +3337,8 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename ConstantVelocityFieldType::Pointer constantVelocityField = AllocImage<ConstantVelocityFieldType>(
             preprocessedFixedImagesPerStage[0], zeroVector );
 
-        typedef itk::BSplineExponentialDiffeomorphicTransform<RealType, VImageDimension>
+        typedef itk::ScalingAndSquaringExponentialTransform<itk::BSplineExponentialDiffeomorphicTransform<RealType,
+                                                                                                       VImageDimension> >
           BSplineDisplacementFieldTransformType;
 
         typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, BSplineDisplacementFieldTransformType,
@@ -3145,6 +3479,7 @@ RegistrationHelper<TComputeType, VImageDimension>
         typename DisplacementFieldCommandType::Pointer displacementFieldRegistrationObserver =
           DisplacementFieldCommandType::New();
         displacementFieldRegistrationObserver->SetLogStream(*this->m_LogStream);
+        displacementFieldRegistrationObserver->SetTelemetry( this->m_Telemetry );
         displacementFieldRegistrationObserver->SetNumberOfIterations( currentStageIterations );
 
         displacementFieldRegistration->AddObserver( itk::IterationEvent(), displacementFieldRegistrationObserver );
@@ -3158,6 +3493,7 @@ RegistrationHelper<TComputeType, VImageDimension>
                          << std::endl
                          << std::endl;
           displacementFieldRegistrationObserver->Execute( displacementFieldRegistration, itk::StartEvent() );
+          ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
           displacementFieldRegistration->Update();
           }
         catch( itk::ExceptionObject & e )
@@ -3174,95 +3510,224 @@ RegistrationHelper<TComputeType, VImageDimension>
         break;
       case BSpline:
         {
-        const unsigned int SplineOrder = 3;
-        typedef itk::BSplineTransform<RealType, VImageDimension, SplineOrder> BSplineTransformType;
-        typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, BSplineTransformType,
-          ImageType, LabeledPointSetType> BSplineRegistrationType;
+        if( !this->m_TransformMethods[currentStageNumber].m_UseControlPointSupportGradient )
+          {
+          const unsigned int SplineOrder = 3;
+          typedef itk::BSplineTransform<RealType, VImageDimension, SplineOrder> BSplineTransformType;
+          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, BSplineTransformType,
+            ImageType, LabeledPointSetType> BSplineRegistrationType;
 
-        typename BSplineRegistrationType::Pointer registrationMethod =
-          this->PrepareRegistrationMethod<BSplineRegistrationType>(
-                this->m_CompositeTransform, currentStageNumber, VImageDimension,
-                preprocessedFixedImagesPerStage, preprocessedMovingImagesPerStage,
-                fixedLabeledPointSetsPerStage, movingLabeledPointSetsPerStage, stageMetricList, singleMetric,
-                multiMetric, optimizer, numberOfLevels, shrinkFactorsPerDimensionForAllLevels,
-                smoothingSigmasPerLevel, metricSamplingStrategy, samplingPercentage );
+          typename BSplineRegistrationType::Pointer registrationMethod =
+            this->PrepareRegistrationMethod<BSplineRegistrationType>(
+                  this->m_CompositeTransform, currentStageNumber, VImageDimension,
+                  preprocessedFixedImagesPerStage, preprocessedMovingImagesPerStage,
+                  fixedLabeledPointSetsPerStage, movingLabeledPointSetsPerStage, stageMetricList, singleMetric,
+                  multiMetric, optimizer, numberOfLevels, shrinkFactorsPerDimensionForAllLevels,
+                  smoothingSigmasPerLevel, metricSamplingStrategy, samplingPercentage );
 
-        typename BSplineTransformType::Pointer outputBSplineTransform = registrationMethod->GetModifiableTransform();
+          typename BSplineTransformType::Pointer outputBSplineTransform = registrationMethod->GetModifiableTransform();
 
-        const std::vector<unsigned int> & size = this->m_TransformMethods[currentStageNumber].m_MeshSizeAtBaseLevel;
+          const std::vector<unsigned int> & size = this->m_TransformMethods[currentStageNumber].m_MeshSizeAtBaseLevel;
 
-        typename BSplineTransformType::PhysicalDimensionsType physicalDimensions;
-        typename BSplineTransformType::MeshSizeType meshSize;
-        for( unsigned int d = 0; d < VImageDimension; d++ )
-          {
-          physicalDimensions[d] = preprocessedFixedImagesPerStage[0]->GetSpacing()[d]
-            * static_cast<RealType>( preprocessedFixedImagesPerStage[0]->GetLargestPossibleRegion().GetSize()[d] - 1 );
-          meshSize[d] = size[d];
-          }
+          typename BSplineTransformType::PhysicalDimensionsType physicalDimensions;
+          typename BSplineTransformType::MeshSizeType meshSize;
+          for( unsigned int d = 0; d < VImageDimension; d++ )
+            {
+            physicalDimensions[d] = preprocessedFixedImagesPerStage[0]->GetSpacing()[d]
+              * static_cast<RealType>( preprocessedFixedImagesPerStage[0]->GetLargestPossibleRegion().GetSize()[d] - 1 );
+            meshSize[d] = size[d];
+            }
 
-        // Create the transform adaptors
+          // Create the transform adaptors
 
-        typename BSplineRegistrationType::TransformParametersAdaptorsContainerType adaptors;
-        // Create the transform adaptors specific to B-splines
-        for( unsigned int level = 0; level < numberOfLevels; level++ )
+          typename BSplineRegistrationType::TransformParametersAdaptorsContainerType adaptors;
+          // Create the transform adaptors specific to B-splines
+          for( unsigned int level = 0; level < numberOfLevels; level++ )
+            {
+            typename itk::ImageBase<VImageDimension>::Pointer shrunkSpace=
+                       this->GetShrinkImageOutputInformation(
+                            virtualDomainImage.GetPointer(),
+                            shrinkFactorsPerDimensionForAllLevels[level]  );
+
+
+            // A good heuristic is to RealType the b-spline mesh resolution at each level
+
+            typename BSplineTransformType::MeshSizeType requiredMeshSize;
+            for( unsigned int d = 0; d < VImageDimension; d++ )
+              {
+              requiredMeshSize[d] = meshSize[d] << level;
+              }
+
+            typedef itk::BSplineTransformParametersAdaptor<BSplineTransformType> BSplineAdaptorType;
+            typename BSplineAdaptorType::Pointer bsplineAdaptor = BSplineAdaptorType::New();
+            bsplineAdaptor->SetTransform( outputBSplineTransform );
+            bsplineAdaptor->SetRequiredTransformDomainMeshSize( requiredMeshSize );
+            bsplineAdaptor->SetRequiredTransformDomainOrigin( shrunkSpace->GetOrigin() );
+            bsplineAdaptor->SetRequiredTransformDomainDirection( shrunkSpace->GetDirection() );
+            bsplineAdaptor->SetRequiredTransformDomainPhysicalDimensions( physicalDimensions );
+
+            adaptors.push_back( bsplineAdaptor.GetPointer() );
+            }
+
+          registrationMethod->SetTransformParametersAdaptorsPerLevel( adaptors );
+          outputBSplineTransform->SetTransformDomainOrigin( preprocessedFixedImagesPerStage[0]->GetOrigin() );
+          outputBSplineTransform->SetTransformDomainPhysicalDimensions( physicalDimensions );
+          outputBSplineTransform->SetTransformDomainMeshSize( meshSize );
+          outputBSplineTransform->SetTransformDomainDirection( preprocessedFixedImagesPerStage[0]->GetDirection() );
+          outputBSplineTransform->SetIdentity();
+
+          typedef antsRegistrationCommandIterationUpdate<BSplineRegistrationType> BSplineCommandType;
+          typename BSplineCommandType::Pointer bsplineObserver = BSplineCommandType::New();
+          bsplineObserver->SetLogStream( *this->m_LogStream );
+          bsplineObserver->SetTelemetry( this->m_Telemetry );
+          bsplineObserver->SetNumberOfIterations( currentStageIterations );
+
+          registrationMethod->AddObserver( itk::IterationEvent(), bsplineObserver );
+          registrationMethod->AddObserver( itk::InitializeEvent(), bsplineObserver );
+
+          try
+            {
+            this->Logger() << std::endl << "*** Running bspline registration (meshSizeAtBaseLevel = " << meshSize
+                           << ") ***"
+                           << std::endl << std::endl;
+            bsplineObserver->Execute( registrationMethod, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
+            registrationMethod->Update();
+            }
+          catch( itk::ExceptionObject & e )
+            {
+            this->Logger() << "Exception caught: " << e << std::endl;
+            return EXIT_FAILURE;
+            }
+          // Add calculated transform to the composite transform
+          this->m_CompositeTransform->AddTransform( outputBSplineTransform );
+
+          this->m_AllPreviousTransformsAreLinear = false;
+          }
+        else
           {
-          typename itk::ImageBase<VImageDimension>::Pointer shrunkSpace=
-                     this->GetShrinkImageOutputInformation(
-                          virtualDomainImage.GetPointer(),
-                          shrinkFactorsPerDimensionForAllLevels[level]  );
+          // The metrics see the B-spline transform through its displacement
+          // field on the virtual domain, so that a sample only contributes to
+          // the parameters of its voxel; the transform projects the gradient
+          // field onto the (SplineOrder + 1)^dimension control points of the
+          // support of each voxel.  The stage opts into this path since its
+          // optimizer and steps differ from those of the BSplineTransform path.
+          const unsigned int SplineOrder = 3;
+          typedef itk::BSplineControlPointDisplacementFieldTransform<RealType, VImageDimension, SplineOrder>
+            BSplineFieldTransformType;
+          typedef typename BSplineFieldTransformType::BSplineTransformType BSplineTransformType;
+          typedef itk::ImageRegistrationMethodv4<ImageType, ImageType, BSplineFieldTransformType,
+            ImageType, LabeledPointSetType> BSplineRegistrationType;
+
+          typename BSplineRegistrationType::Pointer registrationMethod =
+            this->PrepareRegistrationMethod<BSplineRegistrationType>(
+                  this->m_CompositeTransform, currentStageNumber, VImageDimension,
+                  preprocessedFixedImagesPerStage, preprocessedMovingImagesPerStage,
+                  fixedLabeledPointSetsPerStage, movingLabeledPointSetsPerStage, stageMetricList, singleMetric,
+                  multiMetric, optimizer, numberOfLevels, shrinkFactorsPerDimensionForAllLevels,
+                  smoothingSigmasPerLevel, metricSamplingStrategy, samplingPercentage );
 
+          typename BSplineFieldTransformType::Pointer outputBSplineFieldTransform =
+            registrationMethod->GetModifiableTransform();
+          typename BSplineTransformType::Pointer outputBSplineTransform =
+            outputBSplineFieldTransform->GetModifiableBSplineTransform();
 
-          // A good heuristic is to RealType the b-spline mesh resolution at each level
+          const std::vector<unsigned int> & size = this->m_TransformMethods[currentStageNumber].m_MeshSizeAtBaseLevel;
 
-          typename BSplineTransformType::MeshSizeType requiredMeshSize;
+          typename BSplineTransformType::PhysicalDimensionsType physicalDimensions;
+          typename BSplineTransformType::MeshSizeType meshSize;
           for( unsigned int d = 0; d < VImageDimension; d++ )
             {
-            requiredMeshSize[d] = meshSize[d] << level;
+            physicalDimensions[d] = preprocessedFixedImagesPerStage[0]->GetSpacing()[d]
+              * static_cast<RealType>( preprocessedFixedImagesPerStage[0]->GetLargestPossibleRegion().GetSize()[d] - 1 );
+            meshSize[d] = size[d];
             }
 
-          typedef itk::BSplineTransformParametersAdaptor<BSplineTransformType> BSplineAdaptorType;
-          typename BSplineAdaptorType::Pointer bsplineAdaptor = BSplineAdaptorType::New();
-          bsplineAdaptor->SetTransform( outputBSplineTransform );
-          bsplineAdaptor->SetRequiredTransformDomainMeshSize( requiredMeshSize );
-          bsplineAdaptor->SetRequiredTransformDomainOrigin( shrunkSpace->GetOrigin() );
-          bsplineAdaptor->SetRequiredTransformDomainDirection( shrunkSpace->GetDirection() );
-          bsplineAdaptor->SetRequiredTransformDomainPhysicalDimensions( physicalDimensions );
+          // Create the transform adaptors
 
-          adaptors.push_back( bsplineAdaptor.GetPointer() );
-          }
+          typename BSplineRegistrationType::TransformParametersAdaptorsContainerType adaptors;
+          // Create the transform adaptors specific to B-splines
+          for( unsigned int level = 0; level < numberOfLevels; level++ )
+            {
+            typename itk::ImageBase<VImageDimension>::Pointer shrunkSpace=
+                       this->GetShrinkImageOutputInformation(
+                            virtualDomainImage.GetPointer(),
+                            shrinkFactorsPerDimensionForAllLevels[level]  );
 
-        registrationMethod->SetTransformParametersAdaptorsPerLevel( adaptors );
-        outputBSplineTransform->SetTransformDomainOrigin( preprocessedFixedImagesPerStage[0]->GetOrigin() );
-        outputBSplineTransform->SetTransformDomainPhysicalDimensions( physicalDimensions );
-        outputBSplineTransform->SetTransformDomainMeshSize( meshSize );
-        outputBSplineTransform->SetTransformDomainDirection( preprocessedFixedImagesPerStage[0]->GetDirection() );
-        outputBSplineTransform->SetIdentity();
 
-        typedef antsRegistrationCommandIterationUpdate<BSplineRegistrationType> BSplineCommandType;
-        typename BSplineCommandType::Pointer bsplineObserver = BSplineCommandType::New();
-        bsplineObserver->SetLogStream( *this->m_LogStream );
-        bsplineObserver->SetNumberOfIterations( currentStageIterations );
+            // A good heuristic is to RealType the b-spline mesh resolution at each level
 
-        registrationMethod->AddObserver( itk::IterationEvent(), bsplineObserver );
-        registrationMethod->AddObserver( itk::InitializeEvent(), bsplineObserver );
+            typename BSplineTransformType::MeshSizeType requiredMeshSize;
+            for( unsigned int d = 0; d < VImageDimension; d++ )
+              {
+              requiredMeshSize[d] = meshSize[d] << level;
+              }
 
-        try
-          {
-          this->Logger() << std::endl << "*** Running bspline registration (meshSizeAtBaseLevel = " << meshSize
-                         << ") ***"
-                         << std::endl << std::endl;
-          bsplineObserver->Execute( registrationMethod, itk::StartEvent() );
-          registrationMethod->Update();
-          }
-        catch( itk::ExceptionObject & e )
-          {
-          this->Logger() << "Exception caught: " << e << std::endl;
-          return EXIT_FAILURE;
-          }
-        // Add calculated transform to the composite transform
-        this->m_CompositeTransform->AddTransform( outputBSplineTransform );
+            typedef itk::BSplineControlPointDisplacementFieldTransformParametersAdaptor<BSplineFieldTransformType>
+              BSplineAdaptorType;
+            typename BSplineAdaptorType::Pointer bsplineAdaptor = BSplineAdaptorType::New();
+            bsplineAdaptor->SetTransform( outputBSplineFieldTransform );
+            bsplineAdaptor->SetRequiredTransformDomainMeshSize( requiredMeshSize );
+            bsplineAdaptor->SetRequiredTransformDomainOrigin( shrunkSpace->GetOrigin() );
+            bsplineAdaptor->SetRequiredTransformDomainDirection( shrunkSpace->GetDirection() );
+            bsplineAdaptor->SetRequiredTransformDomainPhysicalDimensions( physicalDimensions );
+            bsplineAdaptor->SetRequiredSpacing( shrunkSpace->GetSpacing() );
+            bsplineAdaptor->SetRequiredSize( shrunkSpace->GetLargestPossibleRegion().GetSize() );
+            bsplineAdaptor->SetRequiredDirection( shrunkSpace->GetDirection() );
+            bsplineAdaptor->SetRequiredOrigin( shrunkSpace->GetOrigin() );
+
+            adaptors.push_back( bsplineAdaptor.GetPointer() );
+            }
 
-        this->m_AllPreviousTransformsAreLinear = false;
+          registrationMethod->SetTransformParametersAdaptorsPerLevel( adaptors );
+          outputBSplineTransform->SetTransformDomainOrigin( preprocessedFixedImagesPerStage[0]->GetOrigin() );
+          outputBSplineTransform->SetTransformDomainPhysicalDimensions( physicalDimensions );
+          outputBSplineTransform->SetTransformDomainMeshSize( meshSize );
+          outputBSplineTransform->SetTransformDomainDirection( preprocessedFixedImagesPerStage[0]->GetDirection() );
+          outputBSplineTransform->SetIdentity();
+
+          typedef itk::Vector<RealType, VImageDimension> VectorType;
+          VectorType zeroVector( 0.0 );
+          typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>(
+              preprocessedFixedImagesPerStage[0], zeroVector );
+          outputBSplineFieldTransform->SetDisplacementField( displacementField );
+          outputBSplineFieldTransform->UpdateDisplacementField();
+
+          // The line search of the conjugate gradient optimizer restores the
+          // parameters it tried through SetParameters(), which cannot restore
+          // the control points, so the stage takes gradient descent steps; the
+          // transform keeps the largest step of the scales estimator.
+          optimizer2->SetScalesEstimator( scalesEstimator );
+          registrationMethod->SetOptimizer( optimizer2 );
+
+          typedef antsRegistrationCommandIterationUpdate<BSplineRegistrationType> BSplineCommandType;
+          typename BSplineCommandType::Pointer bsplineObserver = BSplineCommandType::New();
+          bsplineObserver->SetLogStream( *this->m_LogStream );
+          bsplineObserver->SetTelemetry( this->m_Telemetry );
+          bsplineObserver->SetNumberOfIterations( currentStageIterations );
+
+          registrationMethod->AddObserver( itk::IterationEvent(), bsplineObserver );
+          registrationMethod->AddObserver( itk::InitializeEvent(), bsplineObserver );
+
+          try
+            {
+            this->Logger() << std::endl << "*** Running bspline registration (meshSizeAtBaseLevel = " << meshSize
+                           << ") ***"
+                           << std::endl << std::endl;
+            bsplineObserver->Execute( registrationMethod, itk::StartEvent() );
+            ANTS_PROFILE_SCOPE( "RegistrationHelper::Optimization" );
+            registrationMethod->Update();
+            }
+          catch( itk::ExceptionObject & e )
+            {
+            this->Logger() << "Exception caught: " << e << std::endl;
+            return EXIT_FAILURE;
+            }
+          // Add calculated transform to the composite transform
+          this->m_CompositeTransform->AddTransform( outputBSplineTransform );
+
+          this->m_AllPreviousTransformsAreLinear = false;
+          }
         }
         break;
       default:
@@ -3272,6 +3737,15 @@ RegistrationHelper<TComputeType, VImageDimension>
     timer.Stop();
     this->Logger() << "  Elapsed time (stage " << currentStageNumber << "): " << timer.GetMean() << std::endl
                    << std::endl;
+    if( this->m_Telemetry )
+      {
+      this->m_Telemetry->EndStage();
+      }
+
+    if( !this->m_CheckpointPrefix.empty() )
+      {
+      this->WriteCheckpoint( currentStageNumber + 1 );
+      }
     }
 
   if( this->m_ApplyLinearTransformsToFixedImageHeader &&
@@ -3281,6 +3755,9 @@ RegistrationHelper<TComputeType, VImageDimension>
     this->m_CompositeTransform->FlattenTransformQueue();
     }
 
+  // the interval volumes and checkpoints still queued
+  ants::BackgroundWriter::Flush( this->Logger() );
+
   totalTimer.Stop();
   this->Logger() << std::endl << "Total elapsed time: " << totalTimer.GetMean() << std::endl;
 
@@ -3354,6 +3831,183 @@ RegistrationHelper<TComputeType, VImageDimension>
     }
 }
 
+template <class TComputeType, unsigned VImageDimension>
+void
+RegistrationHelper<TComputeType, VImageDimension>
+::WriteCheckpoint( unsigned int numberOfCompletedStages )
+{
+  typename CompositeTransformType::Pointer compositeTransform = CompositeTransformType::New();
+  for( unsigned int n = 0; n < this->m_CompositeTransform->GetNumberOfTransforms(); n++ )
+    {
+    compositeTransform->AddTransform( this->m_CompositeTransform->GetNthTransform( n ) );
+    }
+  ants::BackgroundWriter::Submit( new CheckpointWriteJob( compositeTransform, this->m_CheckpointPrefix,
+                                                          numberOfCompletedStages ), this->Logger() );
+}
+
+template <class TComputeType, unsigned VImageDimension>
+int
+RegistrationHelper<TComputeType, VImageDimension>
+::WriteCheckpointFiles( CompositeTransformType * compositeTransform, const std::string & prefix,
+                        unsigned int numberOfCompletedStages, std::ostream & messages )
+{
+  std::stringstream stageString;
+  stageString << prefix << "CheckpointStage" << numberOfCompletedStages;
+  const std::string forwardFileName = stageString.str() + std::string( ".h5" );
+  const std::string inverseFileName = stageString.str() + std::string( "Inverse.h5" );
+
+  typename TransformType::Pointer forwardTransform = compositeTransform;
+  if( itk::ants::WriteTransform<TComputeType, VImageDimension>( forwardTransform, forwardFileName ) != EXIT_SUCCESS )
+    {
+    return EXIT_FAILURE;
+    }
+
+  // The inverse displacement fields are not part of the forward file, so
+  // they are kept through the inverse composite.  It does not exist if a
+  // stage produced a field without an inverse.
+  bool hasInverse = false;
+  typename TransformType::Pointer inverseTransform =
+    dynamic_cast<TransformType *>( compositeTransform->GetInverseTransform().GetPointer() );
+  if( inverseTransform.IsNotNull() )
+    {
+    hasInverse =
+      ( itk::ants::WriteTransform<TComputeType, VImageDimension>( inverseTransform, inverseFileName ) == EXIT_SUCCESS );
+    }
+
+  // The index is replaced only once the stage files are complete, so an
+  // interrupted write leaves the previous checkpoint in place.
+  const std::string indexFileName = prefix + std::string( "Checkpoint.txt" );
+  const std::string partialIndexFileName = indexFileName + std::string( ".partial" );
+    {
+    std::ofstream indexFile( partialIndexFileName.c_str() );
+    indexFile << numberOfCompletedStages << " " << hasInverse << std::endl;
+    if( !indexFile )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+  if( !itksys::SystemTools::RenameFile( partialIndexFileName.c_str(), indexFileName.c_str() ) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  if( numberOfCompletedStages > 1 )
+    {
+    std::stringstream previousStageString;
+    previousStageString << prefix << "CheckpointStage" << numberOfCompletedStages - 1;
+    itksys::SystemTools::RemoveFile( ( previousStageString.str() + std::string( ".h5" ) ).c_str() );
+    itksys::SystemTools::RemoveFile( ( previousStageString.str() + std::string( "Inverse.h5" ) ).c_str() );
+    }
+
+  messages << "  Checkpoint written to " << forwardFileName << std::endl;
+  return EXIT_SUCCESS;
+}
+
+template <class TComputeType, unsigned VImageDimension>
+int
+RegistrationHelper<TComputeType, VImageDimension>
+::RestoreCheckpoint( const std::string & prefix )
+{
+  // a checkpoint written by a previous pass may still be queued
+  ants::BackgroundWriter::Flush( this->Logger() );
+
+  const std::string indexFileName = prefix + std::string( "Checkpoint.txt" );
+  if( !itksys::SystemTools::FileExists( indexFileName.c_str() ) )
+    {
+    this->Logger() << "No checkpoint found at " << indexFileName << ", starting from the first stage." << std::endl;
+    return EXIT_SUCCESS;
+    }
+
+  unsigned int numberOfCompletedStages = 0;
+  bool         hasInverse = false;
+    {
+    std::ifstream indexFile( indexFileName.c_str() );
+    indexFile >> numberOfCompletedStages >> hasInverse;
+    if( !indexFile )
+      {
+      this->Logger() << "ERROR:  could not read the checkpoint index " << indexFileName << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::stringstream stageString;
+  stageString << prefix << "CheckpointStage" << numberOfCompletedStages;
+
+  typename TransformType::Pointer forwardTransform =
+    itk::ants::ReadTransform<TComputeType, VImageDimension>( stageString.str() + std::string( ".h5" ) );
+  if( forwardTransform.IsNull() )
+    {
+    this->Logger() << "ERROR:  could not read the checkpoint transform " << stageString.str() << ".h5" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  typename CompositeTransformType::Pointer compositeTransform =
+    dynamic_cast<CompositeTransformType *>( forwardTransform.GetPointer() );
+  if( compositeTransform.IsNull() )
+    {
+    compositeTransform = CompositeTransformType::New();
+    compositeTransform->AddTransform( forwardTransform );
+    }
+  compositeTransform->FlattenTransformQueue();
+
+  // give the displacement fields back their inverses; component n of the
+  // forward composite is component N-1-n of the inverse
+  if( hasInverse )
+    {
+    typename TransformType::Pointer inverseTransform =
+      itk::ants::ReadTransform<TComputeType, VImageDimension>( stageString.str() + std::string( "Inverse.h5" ) );
+    typename CompositeTransformType::Pointer inverseCompositeTransform =
+      dynamic_cast<CompositeTransformType *>( inverseTransform.GetPointer() );
+    if( inverseCompositeTransform.IsNull() && inverseTransform.IsNotNull() )
+      {
+      inverseCompositeTransform = CompositeTransformType::New();
+      inverseCompositeTransform->AddTransform( inverseTransform );
+      }
+    if( inverseCompositeTransform.IsNotNull() )
+      {
+      inverseCompositeTransform->FlattenTransformQueue();
+      }
+    const unsigned int numberOfTransforms = compositeTransform->GetNumberOfTransforms();
+    if( inverseCompositeTransform.IsNull()
+        || inverseCompositeTransform->GetNumberOfTransforms() != numberOfTransforms )
+      {
+      this->Logger() << "WARNING:  the inverse checkpoint transform does not match, "
+                     << "so the inverse displacement fields are not restored." << std::endl;
+      }
+    else
+      {
+      for( unsigned int n = 0; n < numberOfTransforms; n++ )
+        {
+        DisplacementFieldTransformType *forwardField =
+          dynamic_cast<DisplacementFieldTransformType *>( compositeTransform->GetNthTransform( n ).GetPointer() );
+        DisplacementFieldTransformType *inverseField =
+          dynamic_cast<DisplacementFieldTransformType *>(
+            inverseCompositeTransform->GetNthTransform( numberOfTransforms - 1 - n ).GetPointer() );
+        if( forwardField && inverseField && !forwardField->GetInverseDisplacementField()
+            && inverseField->GetDisplacementField() )
+          {
+          forwardField->SetInverseDisplacementField( inverseField->GetModifiableDisplacementField() );
+          }
+        }
+      }
+    }
+
+  this->m_CompositeTransform = compositeTransform;
+  this->m_NumberOfCompletedStages = numberOfCompletedStages;
+  this->m_AllPreviousTransformsAreLinear = true;
+  for( unsigned int n = 0; n < compositeTransform->GetNumberOfTransforms(); n++ )
+    {
+    if( compositeTransform->GetNthTransform( n )->GetTransformCategory() != TransformType::Linear )
+      {
+      this->m_AllPreviousTransformsAreLinear = false;
+      }
+    }
+
+  this->Logger() << "Restored " << numberOfCompletedStages << " completed stage(s) from " << stageString.str()
+                 << ".h5" << std::endl;
+  return EXIT_SUCCESS;
+}
+
 template <class TComputeType, unsigned VImageDimension>
 void
 RegistrationHelper<TComputeType, VImageDimension>
@@ -3540,6 +4194,8 @@ typename RegistrationHelper<TComputeType, VImageDimension>::CompositeTransformTy
 RegistrationHelper<TComputeType, VImageDimension>
 ::CollapseDisplacementFieldTransforms( const CompositeTransformType * compositeTransform )
 {
+  ANTS_PROFILE_SCOPE( "RegistrationHelper::CollapseDisplacementFieldTransforms" );
+
   typename CompositeTransformType::Pointer combinedCompositeTransform = CompositeTransformType::New();
 
   if( compositeTransform->GetTransformCategory() != TransformType::DisplacementField  )
@@ -3553,6 +4209,11 @@ RegistrationHelper<TComputeType, VImageDimension>
     return combinedCompositeTransform;
     }
 
+  if( this->m_ReduceMemoryFootprint )
+    {
+    return this->CollapseDisplacementFieldTransformsInPlace( compositeTransform );
+    }
+
   typename TransformType::Pointer transform = compositeTransform->GetNthTransform( 0 );
 
   typename DisplacementFieldTransformType::Pointer currentTransform =
@@ -3627,6 +4288,120 @@ RegistrationHelper<TComputeType, VImageDimension>
   return combinedCompositeTransform;
 }
 
+template <class TComputeType, unsigned VImageDimension>
+typename RegistrationHelper<TComputeType, VImageDimension>::CompositeTransformType::Pointer
+RegistrationHelper<TComputeType, VImageDimension>
+::CollapseDisplacementFieldTransformsInPlace( const CompositeTransformType * compositeTransform )
+{
+  // Each run of adjacent transforms which all have, or all lack, an inverse is
+  // collapsed into one transform.  The forward fields of a run are composed
+  // from the last transform (the first one applied) to the first, and the
+  // inverse fields the other way around, so that the accumulated field is
+  // only read at the voxel being updated and needs no intermediate copy.
+  // Unlike CollapseDisplacementFieldTransforms, the transforms of the
+  // composite are not modified.
+  typename CompositeTransformType::Pointer combinedCompositeTransform = CompositeTransformType::New();
+
+  const unsigned int numberOfTransforms = compositeTransform->GetNumberOfTransforms();
+
+  std::vector<DisplacementFieldTransformPointer> transforms( numberOfTransforms );
+  for( unsigned int n = 0; n < numberOfTransforms; n++ )
+    {
+    transforms[n] = dynamic_cast<DisplacementFieldTransformType *>( compositeTransform->GetNthTransform( n ).GetPointer() );
+    }
+
+  unsigned int runBegin = 0;
+  while( runBegin < numberOfTransforms )
+    {
+    const bool isRunInvertible = transforms[runBegin]->GetInverseDisplacementField() != ITK_NULLPTR;
+    unsigned int runEnd = runBegin + 1;
+    while( runEnd < numberOfTransforms &&
+           ( transforms[runEnd]->GetInverseDisplacementField() != ITK_NULLPTR ) == isRunInvertible )
+      {
+      runEnd++;
+      }
+
+    typename DisplacementFieldType::Pointer totalField = transforms[runEnd - 1]->GetModifiableDisplacementField();
+    typename DisplacementFieldType::Pointer totalInverseField = ITK_NULLPTR;
+    if( isRunInvertible )
+      {
+      totalInverseField = transforms[runBegin]->GetModifiableInverseDisplacementField();
+      }
+
+    if( runEnd - runBegin > 1 )
+      {
+      typename DisplacementFieldType::Pointer field = AllocImage<DisplacementFieldType>( totalField );
+      std::copy( totalField->GetBufferPointer(),
+                 totalField->GetBufferPointer() + totalField->GetBufferedRegion().GetNumberOfPixels(),
+                 field->GetBufferPointer() );
+      totalField = field;
+      for( unsigned int n = runEnd - 1; n > runBegin; n-- )
+        {
+        this->ComposeDisplacementFieldInPlace( totalField, transforms[n - 1]->GetDisplacementField() );
+        }
+
+      if( isRunInvertible )
+        {
+        typename DisplacementFieldType::Pointer inverseField = AllocImage<DisplacementFieldType>( totalInverseField );
+        std::copy( totalInverseField->GetBufferPointer(),
+                   totalInverseField->GetBufferPointer() + totalInverseField->GetBufferedRegion().GetNumberOfPixels(),
+                   inverseField->GetBufferPointer() );
+        totalInverseField = inverseField;
+        for( unsigned int n = runBegin + 1; n < runEnd; n++ )
+          {
+          this->ComposeDisplacementFieldInPlace( totalInverseField, transforms[n]->GetInverseDisplacementField() );
+          }
+        }
+      }
+
+    DisplacementFieldTransformPointer displacementFieldTransform = DisplacementFieldTransformType::New();
+    displacementFieldTransform->SetDisplacementField( totalField );
+    if( isRunInvertible )
+      {
+      displacementFieldTransform->SetInverseDisplacementField( totalInverseField );
+      }
+    combinedCompositeTransform->AddTransform( displacementFieldTransform );
+
+    runBegin = runEnd;
+    }
+
+  return combinedCompositeTransform;
+}
+
+template <class TComputeType, unsigned VImageDimension>
+void
+RegistrationHelper<TComputeType, VImageDimension>
+::ComposeDisplacementFieldInPlace( DisplacementFieldType * warpingField,
+                                   const DisplacementFieldType * displacementField )
+{
+  // Same as itk::ComposeDisplacementFieldsImageFilter, with the warping field as output.
+  typedef itk::VectorLinearInterpolateImageFunction<DisplacementFieldType, RealType> InterpolatorType;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage( displacementField );
+
+  itk::ImageRegionIteratorWithIndex<DisplacementFieldType> It( warpingField, warpingField->GetBufferedRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    typename DisplacementFieldType::PixelType warpVector = It.Get();
+
+    typename DisplacementFieldType::PointType point;
+    warpingField->TransformIndexToPhysicalPoint( It.GetIndex(), point );
+    for( unsigned int d = 0; d < VImageDimension; d++ )
+      {
+      point[d] += warpVector[d];
+      }
+    if( interpolator->IsInsideBuffer( point ) )
+      {
+      const typename InterpolatorType::OutputType displacement = interpolator->Evaluate( point );
+      for( unsigned int d = 0; d < VImageDimension; d++ )
+        {
+        warpVector[d] += displacement[d];
+        }
+      It.Set( warpVector );
+      }
+    }
+}
+
 template <class TComputeType, unsigned VImageDimension>
 typename RegistrationHelper<TComputeType, VImageDimension>::CompositeTransformPointer
 RegistrationHelper<TComputeType, VImageDimension>
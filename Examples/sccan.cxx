@@ -24,6 +24,8 @@
 #include <vnl/algo/vnl_real_eigensystem.h>
 #include <vnl/algo/vnl_generalized_eigensystem.h>
 #include "antsSCCANObject.h"
+#include "antsVoxelMatrixFile.h"
+#include "antsPermutationTester.h"
 #include "itkCSVNumericObjectFileWriter.h"
 #include "itkCSVArray2DDataObject.h"
 #include "itkCSVArray2DFileReader.h"
@@ -387,6 +389,29 @@ int sccanRandom(int n)
   return rand() % n;
 }
 
+template <class TSCCAN>
+void SetRandomizedSVDFromOption( itk::ants::CommandLineParser *sccanparser, TSCCAN *sccanobj )
+{
+  itk::ants::CommandLineParser::OptionType::Pointer rsvdOption =
+    sccanparser->GetOption( "randomized-svd" );
+  if( !rsvdOption || rsvdOption->GetNumberOfFunctions() == 0 )
+    {
+    return;
+    }
+  sccanobj->SetUseRandomizedSVD(
+    sccanparser->Convert<unsigned int>( rsvdOption->GetFunction( 0 )->GetName() ) > 0 );
+  if( rsvdOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+    {
+    sccanobj->SetRandomizedSVDPowerIterations(
+      sccanparser->Convert<unsigned int>( rsvdOption->GetFunction( 0 )->GetParameter( 0 ) ) );
+    }
+  if( rsvdOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+    {
+    sccanobj->SetRandomizedSVDOversampling(
+      sccanparser->Convert<unsigned int>( rsvdOption->GetFunction( 0 )->GetParameter( 1 ) ) );
+    }
+}
+
 template <class TComp>
 vnl_matrix<TComp>
 PermuteMatrix( vnl_matrix<TComp> q, bool doperm = true)
@@ -468,6 +493,15 @@ ReadMatrixFromCSVorImageSet( std::string matname, vnl_matrix<PixelType> & p )
   typedef itk::Image<PixelType, 2>              MatrixImageType;
   typedef itk::ImageFileReader<MatrixImageType> matReaderType;
   std::string ext = itksys::SystemTools::GetFilenameExtension( matname );
+  if( VoxelMatrixFile::IsVoxelMatrixFileName( matname ) )
+    {
+    VoxelMatrixFile vxm;
+    if( vxm.Open( matname ) )
+      {
+      vxm.GetMatrix( p );
+      }
+    return;
+    }
   if( strcmp(ext.c_str(), ".csv") == 0 )
     {
     typedef itk::CSVArray2DFileReader<double> ReaderType;
@@ -559,6 +593,33 @@ ConvertImageListToMatrix( std::string imagelist, std::string maskfn, std::string
   /** declare the output matrix image */
   unsigned long xsize = image_fn_list.size();
   unsigned long ysize = voxct;
+
+  if( VoxelMatrixFile::IsVoxelMatrixFileName( outname ) )
+    {
+    // written one subject at a time, so the matrix is never held in memory
+    VoxelMatrixFileWriter writer;
+    if( !writer.Open( outname, xsize, ysize, VoxelMatrixFloat, maskfn ) )
+      {
+      return zmat;
+      }
+    vnl_vector<PixelType> row( ysize );
+    for( unsigned int j = 0; j < image_fn_list.size(); j++ )
+      {
+      typename ImageType::Pointer image;
+      ReadImage<ImageType>( image, image_fn_list[j].c_str() );
+      unsigned long tvoxct = 0;
+      for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+        {
+        if( mIter.Get() >= 0.5 )
+          {
+          row[tvoxct++] = image->GetPixel( mIter.GetIndex() );
+          }
+        }
+      writer.WriteRow( row );
+      }
+    writer.Close();
+    return zmat;
+    }
   typename MatrixImageType::SizeType tilesize;
   tilesize[0] = xsize;
   tilesize[1] = ysize;
@@ -1165,6 +1226,7 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
   sccanobj->SetGradStep( gradstep );
   sccanobj->SetMaximumNumberOfIterations(iterct);
   sccanobj->SetRowSparseness( row_sparseness );
+  SetRandomizedSVDFromOption<SCCANType>( sccanparser, sccanobj );
   sccanobj->SetSmoother( smoother );
   /** read the matrix images */
   /** we refer to the two view matrices as P and Q */
@@ -1376,6 +1438,98 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
   return EXIT_SUCCESS;
 }
 
+/** One permutation of the two-view sparse CCA for PermutationTester.  The
+ * rows of Q are permuted; P and Q are only read, so all threads share them.
+ * Returns the canonical correlations followed by the first P and Q variates. */
+template <class TSCCAN>
+class TwoViewPermutationStatistic
+{
+public:
+  typedef typename TSCCAN::MatrixType   MatrixType;
+  typedef typename TSCCAN::VectorType   VectorType;
+  typedef typename TSCCAN::ImagePointer ImagePointer;
+
+  TwoViewPermutationStatistic( const TSCCAN *reference, const MatrixType & p, const MatrixType & q,
+                               ImagePointer maskP, ImagePointer maskQ, unsigned int numberOfEigenvectors ) :
+    m_Reference( reference ),
+    m_P( p ),
+    m_Q( q ),
+    m_MaskP( maskP ),
+    m_MaskQ( maskQ ),
+    m_NumberOfEigenvectors( numberOfEigenvectors )
+  {
+  }
+
+  vnl_vector<double> operator()( const std::vector<unsigned int> & permutation ) const
+  {
+    MatrixType qPerm( this->m_Q.rows(), this->m_Q.cols() );
+    for( unsigned int i = 0; i < permutation.size(); i++ )
+      {
+      qPerm.set_row( i, this->m_Q[permutation[i]] );
+      }
+
+    typename TSCCAN::Pointer sccanobj = this->m_Reference->CloneSettings();
+    // the permutations are the parallel tasks
+    sccanobj->SetNumberOfThreads( 1 );
+    sccanobj->SetMatrixP( this->m_P );
+    sccanobj->SetMatrixQ( qPerm );
+    sccanobj->SetMaskImageP( this->m_MaskP );
+    sccanobj->SetMaskImageQ( this->m_MaskQ );
+    sccanobj->SparsePartialArnoldiCCA( this->m_NumberOfEigenvectors );
+
+    const VectorType corrs = sccanobj->GetCanonicalCorrelations();
+    const VectorType wP = sccanobj->GetVariateP( 0 );
+    const VectorType wQ = sccanobj->GetVariateQ( 0 );
+    vnl_vector<double> statistics( corrs.size() + wP.size() + wQ.size() );
+    statistics.update( corrs, 0 );
+    statistics.update( wP, corrs.size() );
+    statistics.update( wQ, corrs.size() + wP.size() );
+    return statistics;
+  }
+
+private:
+  const TSCCAN *     m_Reference;
+  const MatrixType & m_P;
+  const MatrixType & m_Q;
+  ImagePointer       m_MaskP;
+  ImagePointer       m_MaskQ;
+  unsigned int       m_NumberOfEigenvectors;
+};
+
+template <class TTester>
+void SetPermutationTesterFromOptions( itk::ants::CommandLineParser *sccanparser, TTester & tester,
+                                      unsigned int numberOfStatisticsForEarlyStopping )
+{
+  tester.SetNumberOfThreads( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() );
+  itk::ants::CommandLineParser::OptionType::Pointer threadsOption =
+    sccanparser->GetOption( "permutation-threads" );
+  if( threadsOption && threadsOption->GetNumberOfFunctions() > 0 )
+    {
+    tester.SetNumberOfThreads( sccanparser->Convert<unsigned int>( threadsOption->GetFunction( 0 )->GetName() ) );
+    }
+  itk::ants::CommandLineParser::OptionType::Pointer stopOption =
+    sccanparser->GetOption( "permutation-early-stop" );
+  if( stopOption && stopOption->GetNumberOfFunctions() > 0 )
+    {
+    double        alpha = 0.05;
+    unsigned long minimumNumberOfPermutations = 100;
+    if( stopOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      alpha = sccanparser->Convert<double>( stopOption->GetFunction( 0 )->GetParameter( 0 ) );
+      }
+    else
+      {
+      alpha = sccanparser->Convert<double>( stopOption->GetFunction( 0 )->GetName() );
+      }
+    if( stopOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+      {
+      minimumNumberOfPermutations =
+        sccanparser->Convert<unsigned long>( stopOption->GetFunction( 0 )->GetParameter( 1 ) );
+      }
+    tester.SetEarlyStopping( alpha > 0, alpha, minimumNumberOfPermutations, numberOfStatisticsForEarlyStopping );
+    }
+}
+
 template <unsigned int ImageDimension, class PixelType>
 int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, unsigned int n_evec, unsigned int newimp,
               unsigned int robustify, unsigned int p_cluster_thresh, unsigned int q_cluster_thresh, unsigned int iterct,
@@ -1407,6 +1561,7 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
   sccanobj->SetSilent(  ! verbosity  );
   sccanobj->SetPriorWeight( priorWeight );
   sccanobj->SetMaximumNumberOfIterations(iterct);
+  SetRandomizedSVDFromOption<SCCANType>( sccanparser, sccanobj );
   if( uselong > 0 )
     {
     sccanobj->SetUseLongitudinalFormulation( uselong );
@@ -1556,88 +1711,77 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
   sermuted ;  2. scca ;  3. test corrs and weights significance */
   if( permct > 0 )
     {
-    vnl_vector<unsigned long> perm_exceed_ct( sccancorrs.size(),  0 );
-    vVector                   w_p_signif_ct(w_p.size(), 0);
-    vVector                   w_q_signif_ct(w_q.size(), 0);
-    for( unsigned long pct = 0; pct <= permct; pct++ )
+    typedef TwoViewPermutationStatistic<SCCANType> StatisticType;
+    StatisticType statistic( sccanobj, p, q, mask1, mask2, n_evec );
+
+    vVector observed( sccancorrs.size() + w_p.size() + w_q.size() );
+    observed.update( sccancorrs, 0 );
+    observed.update( w_p, sccancorrs.size() );
+    observed.update( w_q, sccancorrs.size() + w_p.size() );
+
+    PermutationTester<StatisticType> tester;
+    // the voxelwise counts do not decide when to stop
+    SetPermutationTesterFromOptions( sccanparser, tester, sccancorrs.size() );
+    tester.SetNumberOfRows( q.rows() );
+    tester.SetNumberOfPermutations( permct );
+    tester.SetObservedStatistics( observed );
+    if( verbosity )
       {
-      // 0. compute permutation for q ( switch around rows )
-      sccanobj->SetFractionNonZeroP(FracNonZero1);
-      sccanobj->SetFractionNonZeroQ(FracNonZero2);
-      sccanobj->SetGradStep( gradstep );
-      sccanobj->SetMatrixP( p );
-      ReadMatrixFromCSVorImageSet<Scalar>(qmatname, q);
-      vMatrix q_perm = PermuteMatrix<Scalar>( q );
-      sccanobj->SetMatrixQ( q_perm );
-      sccanobj->SparsePartialArnoldiCCA(n_evec );
-      vVector permcorrs = sccanobj->GetCanonicalCorrelations();
-      // std::cout << " perm-corr " << permcorrs << " ct " << pct << " p-values ";
-      for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-        {
-        if( permcorrs[kk] > sccancorrs[kk] )
-          {
-          perm_exceed_ct[kk]++;
-          }
-        // std::cout <<  ( double ) perm_exceed_ct[kk] / (pct + 1) << " ";
-        }
-      // std::cout << std::endl;
-      vVector w_p_perm = sccanobj->GetVariateP(0);
-      vVector w_q_perm = sccanobj->GetVariateQ(0);
-      for( unsigned long j = 0; j < w_p.size(); j++ )
-        {
-        if( w_p_perm(j) > w_p(j) )
-          {
-          w_p_signif_ct(j) = w_p_signif_ct(j)++;
-          }
-        }
-      for( unsigned long j = 0; j < w_q.size(); j++ )
-        {
-        if( w_q_perm(j) > w_q(j) )
-          {
-          w_q_signif_ct(j) = w_q_signif_ct(j)++;
-          }
-        }
-      // end solve cca permutation
-      if( pct == permct )
-        {
-        // std::cout << "final_p_values" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          // std::cout << ( double ) perm_exceed_ct[kk] / (pct + 1) << ",";
-          }
-        // std::cout << "x" << std::endl;
+      std::cout << " running " << permct << " permutations " << std::endl;
+      }
+    tester.Run( statistic );
+    if( tester.GetNumberOfPermutationsRun() < permct && verbosity )
+      {
+      std::cout << " p-values settled after " << tester.GetNumberOfPermutationsRun() << " permutations "
+                << std::endl;
+      }
+    const unsigned long nperm = tester.GetNumberOfPermutationsRun();
+    vVector             w_p_signif_ct(w_p.size(), 0);
+    vVector             w_q_signif_ct(w_q.size(), 0);
+    for( unsigned long j = 0; j < w_p.size(); j++ )
+      {
+      w_p_signif_ct(j) = tester.GetExceedanceCounts()[sccancorrs.size() + j];
+      }
+    for( unsigned long j = 0; j < w_q.size(); j++ )
+      {
+      w_q_signif_ct(j) = tester.GetExceedanceCounts()[sccancorrs.size() + w_p.size() + j];
+      }
 
-        std::ofstream myfile;
-        std::string   fnmp = filepre + std::string("_summary.csv");
-        myfile.open(fnmp.c_str(), std::ios::out );
-        myfile << "TypeOfMeasure" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          std::string colname = std::string("Variate") + sccan_to_string<unsigned int>(kk);
-          myfile << colname << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile << "final_p_values" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          myfile << ( double ) perm_exceed_ct[kk] / (pct + 1) << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile << "corrs" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          myfile << sccancorrs[kk]  << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile.close();
-        }
+    std::ofstream myfile;
+    std::string   fnmp = filepre + std::string("_summary.csv");
+    myfile.open(fnmp.c_str(), std::ios::out );
+    myfile << "TypeOfMeasure" << ",";
+    for( unsigned int kk = 0; kk < sccancorrs.size(); kk++ )
+      {
+      std::string colname = std::string("Variate") + sccan_to_string<unsigned int>(kk);
+      myfile << colname << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile << "final_p_values" << ",";
+    for( unsigned int kk = 0; kk < sccancorrs.size(); kk++ )
+      {
+      myfile << ( double ) tester.GetExceedanceCounts()[kk] / nperm << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile << "corrs" << ",";
+    for( unsigned int kk = 0; kk < sccancorrs.size(); kk++ )
+      {
+      myfile << sccancorrs[kk]  << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile << "n_permutations" << ",";
+    for( unsigned int kk = 0; kk < sccancorrs.size(); kk++ )
+      {
+      myfile << nperm << ",";
       }
+    myfile << "x" << std::endl;
+    myfile.close();
     unsigned long psigct = 0, qsigct = 0;
     for( unsigned long j = 0; j < w_p.size(); j++ )
       {
       if( w_p(j) > pinvtoler )
         {
-        w_p_signif_ct(j) = 1.0 - (double)w_p_signif_ct(j) / (double)(permct);
+        w_p_signif_ct(j) = 1.0 - (double)w_p_signif_ct(j) / (double)(nperm);
         if( w_p_signif_ct(j) > 0.949 )
           {
           psigct++;
@@ -1652,7 +1796,7 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
       {
       if( w_q(j) > pinvtoler )
         {
-        w_q_signif_ct(j) = 1.0 - (double)w_q_signif_ct(j) / (double)(permct);
+        w_q_signif_ct(j) = 1.0 - (double)w_q_signif_ct(j) / (double)(nperm);
         if( w_q_signif_ct(j) > 0.949 )
           {
           qsigct++;
@@ -1703,6 +1847,7 @@ int mSCCA_vnl( itk::ants::CommandLineParser *sccanparser,
   typedef itk::Image<Scalar, 2>                         MatrixImageType;
   typename SCCANType::Pointer sccanobj = SCCANType::New();
   sccanobj->SetMaximumNumberOfIterations(iterct);
+  SetRandomizedSVDFromOption<SCCANType>( sccanparser, sccanobj );
   typedef typename SCCANType::MatrixType         vMatrix;
   typedef typename SCCANType::VectorType         vVector;
 
@@ -2561,6 +2706,31 @@ private:
     sccanparser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "number of permutations run at once (two-view scca). each one holds its own copy of the " )
+      + std::string( "normalized matrices, so reduce this when memory is short. the default is the number of cores. " )
+      + std::string( "the results do not depend on it." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "permutation-threads" );
+    option->SetUsageOption( 0, "4" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
+    {
+    std::string description =
+      std::string( "stop the permutation test (two-view scca) once every canonical correlation's p-value is " )
+      + std::string( "clearly above or below alpha, i.e. outside a 99.9% confidence interval around it. " )
+      + std::string( "checked every 50 permutations after the minimum number. the number of permutations run " )
+      + std::string( "is written to the summary csv." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "permutation-early-stop" );
+    option->SetUsageOption( 0, "[<alpha=0.05>,<minimumNumberOfPermutations=100>]" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
     {
     std::string description =
       std::string( "Smoothing function for variates" );
@@ -2763,11 +2933,27 @@ private:
     sccanparser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "initialize from the leading eigenvectors of a randomized truncated svd " )
+      + std::string( "rather than the full decomposition. useful when the number of columns is large and " )
+      + std::string( "only a few eigenvectors are requested. the power iterations improve accuracy when the " )
+      + std::string( "spectrum decays slowly." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "randomized-svd" );
+    option->SetUsageOption( 0, "1[<powerIterations=2>,<oversampling=10>]" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
     {
     std::string description =
       std::string( "takes a list of image files names (one per line) " )
       + std::string(
-        "and converts it to a 2D matrix / image in binary or csv format depending on the filetype used to define the output." );
+        "and converts it to a 2D matrix / image in binary or csv format depending on the filetype used to define the output. " )
+      + std::string(
+        "a .vxm output is a raw subjects x voxels matrix that is written one image at a time and memory-mapped when read back, " )
+      + std::string( "which is much faster than csv for large masks and lets concurrent sccan runs share the data." );
     OptionType::Pointer option = OptionType::New();
     option->SetLongName( "imageset-to-matrix" );
     option->SetUsageOption( 0, "[list.txt,mask.nii.gz]" );
@@ -36,11 +36,20 @@
 
 #include "itkImageRegionIterator.h"
 #include "itkRandomImageSource.h"
+#include <vnl/vnl_random.h>
+#include <vnl/vnl_quaternion.h>
+#include <algorithm>
 #include "itkAddImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkANTSImagePyramid.h"
 
 typedef enum { AffineWithMutualInformation = 1, AffineWithMeanSquareDifference, AffineWithHistogramCorrelation,
                AffineWithNormalizedCorrelation, AffineWithGradientDifference } AffineMetricType;
 
+// fixed image voxels used by the affine metric, as the sampling strategy of antsRegistration
+typedef enum { AffineSamplingNone = 0, AffineSamplingRegular, AffineSamplingRandom } AffineSamplingStrategyType;
+
 template <class TAffineTransform, class TMaskImage>
 class OptAffine
 {
@@ -50,11 +59,14 @@ public:
   typedef TAffineTransform                   AffineTransformType;
   typedef TMaskImage                         MaskImageType;
   typedef typename MaskImageType::Pointer    MaskObjectPointerType;
+  typedef itk::ANTSImagePyramid<TMaskImage>  SharedImagePyramidType;
   OptAffine():
   metric_type (AffineWithMutualInformation)
   {
     MI_bins = 32;
     MI_samples = 6000;
+    sampling_strategy = AffineSamplingNone;
+    sampling_percentage = 1.0;
     number_of_seeds = 0;
     time_seed = (unsigned int) time(ITK_NULLPTR);
     number_of_levels = 3;
@@ -78,9 +90,13 @@ public:
 
   AffineTransformPointerType transform_initial;
   MaskImagePointerType       mask_fixed;
+  // pyramid shared with the deformable stage, the affine stage builds its own if null
+  typename SharedImagePyramidType::Pointer image_pyramid;
 
   int                 MI_bins;
   int                 MI_samples;
+  AffineSamplingStrategyType sampling_strategy;
+  double                     sampling_percentage;
   int                 number_of_seeds;
   unsigned int        time_seed;
   int                 number_of_levels;
@@ -118,6 +134,8 @@ std::ostream & operator<<(std::ostream& os, const OptAffine<TAffineTransform,  T
       os << "AffineWithGradientDifference" << std::endl; break;
     }
   os << "MI_bins=" << p.MI_bins << " " << "MI_samples=" << p.MI_samples << std::endl;
+  os << "sampling_strategy=" << p.sampling_strategy << " " << "sampling_percentage=" << p.sampling_percentage
+     << std::endl;
   os << "number_of_seeds=" << p.number_of_seeds << " " << "time_seed=" << p.time_seed << std::endl;
   os << "number_of_levels=" << p.number_of_levels << std::endl;
   os << "number_of_iteration_list=" << "[";
@@ -384,11 +402,17 @@ inline void PreConversionInAffine(ImagePointerType & fixedImage, RunningImagePoi
     //  warning: dereferencing type-punned pointer will break strict-aliasing rules
     }
 
+  // the running image type is the input image type, so the pyramid converts like the mask
+  R_opt.image_pyramid =
+    dynamic_cast<typename RunningOptAffineType::SharedImagePyramidType *>( opt.image_pyramid.GetPointer() );
+
   R_fixedImage = reinterpret_cast<RunningImagePointerType &>(fixedImage);
   R_movingImage = reinterpret_cast<RunningImagePointerType &>(movingImage);
 
   R_opt.MI_bins = opt.MI_bins;
   R_opt.MI_samples = opt.MI_samples;
+  R_opt.sampling_strategy = opt.sampling_strategy;
+  R_opt.sampling_percentage = opt.sampling_percentage;
   R_opt.number_of_seeds = opt.number_of_seeds;
   R_opt.time_seed = opt.time_seed;
   R_opt.number_of_levels = opt.number_of_levels;
@@ -549,14 +573,15 @@ void ComputeSingleAffineTransform2D3D(typename ImageType::Pointer & fixed_image,
   transform->SetParameters(para_final);
   transform->SetCenter(opt.transform_initial->GetCenter() );
 
-  double rval_init = TestCostValueMMI(fixed_image, moving_image,
-                                      opt.transform_initial->GetParameters(),
-                                      opt.transform_initial->GetCenter(), transform);
-
-  // std::cout << "ABCDABCD: " << transform << std::endl;
-
-  double rval_final = TestCostValueMMI(fixed_image, moving_image, para_final,
-                                       opt.transform_initial->GetCenter(), transform);
+  // both costs in one pass, each on its own metric
+  std::vector<ParaType> test_paras;
+  test_paras.push_back( opt.transform_initial->GetParameters() );
+  test_paras.push_back( para_final );
+  std::vector<double> test_values;
+  TestCostValuesMMI(fixed_image, moving_image, test_paras, opt.transform_initial->GetCenter(), transform,
+                    typename ImageMaskSpatialObjectType::Pointer(), test_values);
+  double rval_init = test_values[0];
+  double rval_final = test_values[1];
 
   std::cout << "outputput affine center: " << transform->GetCenter() << std::endl;
   std::cout << "output affine para: " << transform->GetParameters() << std::endl;
@@ -798,118 +823,283 @@ void InjectInitialPara(PointType & center, VectorType & translation_vec, Transfo
 }
 
 // ////////////////////////////////////////////////////////////////////////////////////////
-template <class ImagePointerType, class ParaType, class PointType, class TransformTypePointer>
-double TestCostValueMMI(ImagePointerType fixedImage, ImagePointerType movingImage, ParaType para, PointType center,
-                        TransformTypePointer /* null_transform */)
+// Mattes MI of a list of affine parameters, used to report the cost before and
+// after the registration and to rank the multi-seed starts.  Each thread owns
+// its metric, interpolator and transform; the metrics are initialized here with
+// the same seed, so every parameter set is scored on the same fixed samples.
+template <class MetricPointerType, class ParaType>
+struct AffineCostThreadStruct
+  {
+  std::vector<MetricPointerType> Metrics;
+  const std::vector<ParaType> *  Paras;
+  std::vector<double>            Values;
+  unsigned int                   NextPara;
+  itk::SimpleFastMutexLock       Mutex;
+  };
+
+template <class MetricPointerType, class ParaType>
+ITK_THREAD_RETURN_TYPE AffineCostThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  AffineCostThreadStruct<MetricPointerType, ParaType> * str =
+    static_cast<AffineCostThreadStruct<MetricPointerType, ParaType> *>( info->UserData );
+
+  MetricPointerType & metric = str->Metrics[info->ThreadID];
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int n = str->NextPara++;
+    str->Mutex.Unlock();
+    if( n >= str->Paras->size() )
+      {
+      break;
+      }
+    try
+      {
+      str->Values[n] = metric->GetValue( ( *str->Paras )[n] );
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      str->Mutex.Lock();
+      std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << err << std::endl
+                << "Exception caught in computing mattesMutualInfo after registration" << std::endl
+                << "Maybe: Too many samples map outside moving image buffer" << std::endl
+                << "Set the cost value = 0 (max for MutualInfo) " << std::endl;
+      str->Mutex.Unlock();
+      str->Values[n] = 0;
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class ImagePointerType, class ParaType, class PointType, class TransformTypePointer,
+          class MaskObjectPointerType>
+void TestCostValuesMMI(ImagePointerType fixedImage, ImagePointerType movingImage, const std::vector<ParaType> & paras,
+                       PointType center, TransformTypePointer /* null_transform */,
+                       const MaskObjectPointerType & mask_fixed_object, std::vector<double> & values)
 {
   typedef typename ImagePointerType::ObjectType     ImageType;
   typedef typename TransformTypePointer::ObjectType TransformType;
 
-  typename TransformType::Pointer transform = TransformType::New();
-  transform->SetCenter(center);
-  // transform->SetParameters(para);
-
   typedef typename itk::MattesMutualInformationImageToImageMetric<ImageType, ImageType> mattesMutualInfoMetricType;
-  typename mattesMutualInfoMetricType::Pointer mattesMutualInfo = mattesMutualInfoMetricType::New();
-
-  typedef typename itk::LinearInterpolateImageFunction<ImageType, double> InterpolatorType;
-  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-
-  interpolator->SetInputImage(movingImage);
-
-  mattesMutualInfo->SetFixedImage(fixedImage);
-  mattesMutualInfo->SetMovingImage(movingImage);
-  mattesMutualInfo->SetFixedImageRegion(fixedImage->GetBufferedRegion() );
-  mattesMutualInfo->SetTransform(transform);
-  mattesMutualInfo->SetInterpolator(interpolator);
-  mattesMutualInfo->SetNumberOfHistogramBins( 32 );
-  mattesMutualInfo->SetNumberOfSpatialSamples( 5000 );
-  mattesMutualInfo->SetTransformParameters(para);
-  mattesMutualInfo->Initialize();
-  double rval = 0;
-  try
+  typedef typename mattesMutualInfoMetricType::Pointer                                  MetricPointerType;
+  typedef typename itk::LinearInterpolateImageFunction<ImageType, double>                InterpolatorType;
+
+  values.assign( paras.size(), 0.0 );
+  if( paras.empty() )
     {
-    rval = mattesMutualInfo->GetValue(para);
+    return;
     }
-  catch( itk::ExceptionObject & err )
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  const unsigned int          globalThreads =
+    static_cast<unsigned int>( threader->GetGlobalDefaultNumberOfThreads() );
+  unsigned int numberOfThreads = std::min( static_cast<unsigned int>( paras.size() ),
+                                           static_cast<unsigned int>( ITK_MAX_THREADS ) );
+  numberOfThreads = std::max( std::min( numberOfThreads, globalThreads ), 1u );
+  // threads left over by a short list go to the metric itself
+  const unsigned int metricThreads = std::max( globalThreads / numberOfThreads, 1u );
+
+  AffineCostThreadStruct<MetricPointerType, ParaType> str;
+  str.Paras = &paras;
+  str.Values.assign( paras.size(), 0.0 );
+  str.NextPara = 0;
+  for( unsigned int t = 0; t < numberOfThreads; t++ )
     {
-    std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << err << std::endl
-                     << "Exception caught in computing mattesMutualInfo after registration" << std::endl
-                     << "Maybe: Too many samples map outside moving image buffer" << std::endl
-                     << "Set the cost value = 0 (max for MutualInfo) " << std::endl;
-    rval = 0;
+    typename TransformType::Pointer transform = TransformType::New();
+    transform->SetCenter(center);
+    transform->SetParameters(paras[0]);
+
+    typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    interpolator->SetInputImage(movingImage);
+
+    MetricPointerType mattesMutualInfo = mattesMutualInfoMetricType::New();
+    mattesMutualInfo->SetFixedImage(fixedImage);
+    mattesMutualInfo->SetMovingImage(movingImage);
+    mattesMutualInfo->SetFixedImageRegion(fixedImage->GetBufferedRegion() );
+    if( mask_fixed_object.IsNotNull() )
+      {
+      mattesMutualInfo->SetFixedImageMask(mask_fixed_object);
+      }
+    mattesMutualInfo->SetTransform(transform);
+    mattesMutualInfo->SetInterpolator(interpolator);
+    mattesMutualInfo->SetNumberOfHistogramBins( 32 );
+    mattesMutualInfo->SetNumberOfSpatialSamples( 5000 );
+    mattesMutualInfo->SetNumberOfThreads( metricThreads );
+    mattesMutualInfo->ReinitializeSeed( 19650218 );
+    mattesMutualInfo->SetTransformParameters(paras[0]);
+    // sampling draws from the shared random generator, so stay serial here
+    mattesMutualInfo->Initialize();
+    str.Metrics.push_back( mattesMutualInfo );
     }
 
-  return rval;
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( AffineCostThreaderCallback<MetricPointerType, ParaType>, &str );
+  threader->SingleMethodExecute();
+
+  values = str.Values;
 }
 
-template <class ImagePointer>
-ImagePointer  ShrinkImageToScale(ImagePointer image,  float scalingFactor )
+template <class ImagePointerType, class ParaType, class PointType, class TransformTypePointer>
+double TestCostValueMMI(ImagePointerType fixedImage, ImagePointerType movingImage, ParaType para, PointType center,
+                        TransformTypePointer null_transform)
 {
-  typedef typename ImagePointer::ObjectType ImageType;
-  typedef typename ImageType::PixelType     RealType;
-
-  typedef typename ImagePointer::ObjectType ImageType;
-  typename ImageType::SpacingType inputSpacing = image->GetSpacing();
-  typename ImageType::RegionType::SizeType inputSize = image->GetRequestedRegion().GetSize();
-
-  typename ImageType::SpacingType outputSpacing;
-  typename ImageType::RegionType::SizeType outputSize;
+  typedef typename ImagePointerType::ObjectType                       ImageType;
+  typedef itk::ImageMaskSpatialObject<ImageType::ImageDimension>      MaskObjectType;
+
+  std::vector<ParaType> paras(1, para);
+  std::vector<double>   values;
+  TestCostValuesMMI(fixedImage, movingImage, paras, center, null_transform,
+                    typename MaskObjectType::Pointer(), values);
+  return values[0];
+}
 
-  typedef itk::ResampleImageFilter<ImageType, ImageType> ResampleFilterType;
-  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+// /////////////////////////////////////////////////////////////////////////////
+// random restarts of the affine search: seed 0 is the given start, the others
+// rotate it about the transform center by up to 45 degrees around a random axis
+// and shift it by up to a tenth of the fixed image extent.  Only rotation and
+// translation are perturbed, so the seeds are valid for the rigid search too.
+template <class ImagePointerType, class ParaType>
+void GenerateAffineSeeds(const ImagePointerType & fixed_image, const ParaType & para0, int number_of_seeds,
+                         unsigned int time_seed, std::vector<ParaType> & seeds)
+{
+  typedef typename ImagePointerType::ObjectType ImageType;
+  const unsigned int kImageDim = ImageType::ImageDimension;
+  const unsigned int kParaDim = para0.Size();
+  const double       max_angle = vnl_math::pi / 4.0;
 
-  RealType minimumSpacing = inputSpacing.GetVnlVector().min_value();
-  //    RealType maximumSpacing = inputSpacing.GetVnlVector().max_value();
+  typename ImageType::SizeType    size = fixed_image->GetLargestPossibleRegion().GetSize();
+  typename ImageType::SpacingType spacing = fixed_image->GetSpacing();
 
-  ImagePointer current_image = image;
-  for( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+  vnl_random randgen( time_seed );
+  seeds.assign( 1, para0 );
+  for( int n = 0; n < number_of_seeds; n++ )
     {
-    RealType scaling = vnl_math_min( scalingFactor * minimumSpacing / inputSpacing[d],
-                                     static_cast<RealType>( inputSize[d] ) / 32.0 );
-    outputSpacing[d] = inputSpacing[d] * scaling;
-    outputSize[d] = static_cast<unsigned long>( inputSpacing[d]
-                                                * static_cast<RealType>( inputSize[d] ) / outputSpacing[d] + 0.5 );
-
-    typedef itk::RecursiveGaussianImageFilter<ImageType, ImageType> GaussianFilterType;
-    typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
-    smoother->SetInputImage( current_image  );
-    smoother->SetDirection( d );
-    smoother->SetNormalizeAcrossScale( false );
-    smoother->SetSigma( 0.25 * ( outputSpacing[d] / inputSpacing[d]  ) );
-
-    if( smoother->GetSigma() > 0.0 )
+    ParaType para = para0;
+    double   translation[3] = { 0, 0, 0 };
+    for( unsigned int d = 0; d < kImageDim; d++ )
+      {
+      translation[d] = para0[kParaDim - kImageDim + d];
+      }
+    switch( kImageDim )
+      {
+      case 2: // theta, s1, s2, k, c1, c2, t1, t2
+        {
+        const double angle = randgen.drand64( -1.0, 1.0 ) * max_angle;
+        para[0] += angle;
+        para[kParaDim - 2] = std::cos(angle) * translation[0] - std::sin(angle) * translation[1];
+        para[kParaDim - 1] = std::sin(angle) * translation[0] + std::cos(angle) * translation[1];
+        }
+        break;
+      case 3: // q1,q2,q3,q4,s1,s2,s3,k1,k2,k3,t1,t2,t3
+        {
+        vnl_vector_fixed<double, 3> axis( randgen.normal64(), randgen.normal64(), randgen.normal64() );
+        if( axis.magnitude() == 0.0 )
+          {
+          axis[2] = 1.0;
+          }
+        axis.normalize();
+        // rotating T about its center gives dq * q, and the translation is rotated by dq
+        vnl_quaternion<double> dq( axis, randgen.drand64( -1.0, 1.0 ) * max_angle );
+        vnl_quaternion<double> q( para0[0], para0[1], para0[2], para0[3] );
+        vnl_quaternion<double> rq = dq * q;
+        vnl_vector_fixed<double, 3> rt = dq.rotate( vnl_vector_fixed<double, 3>( translation ) );
+        for( unsigned int j = 0; j < 4; j++ )
+          {
+          para[j] = rq[j];
+          }
+        for( unsigned int d = 0; d < 3; d++ )
+          {
+          para[kParaDim - 3 + d] = rt[d];
+          }
+        }
+        break;
+      }
+    for( unsigned int d = 0; d < kImageDim; d++ )
       {
-      smoother->Update();
-      current_image  = smoother->GetOutput();
+      para[kParaDim - kImageDim + d] += randgen.drand64( -0.1, 0.1 ) * spacing[d] * size[d];
       }
+    seeds.push_back( para );
     }
+}
 
-  resampler->SetInput(current_image );
-  resampler->SetSize(outputSize);
-  resampler->SetOutputSpacing(outputSpacing);
-  resampler->SetOutputOrigin(image->GetOrigin() );
-  resampler->SetOutputDirection(image->GetDirection() );
+// pick the start of the affine optimization among opt.number_of_seeds random
+// seeds: all of them are scored in parallel at the coarsest pyramid level, and
+// the better half is carried to each finer level until a single seed is left.
+template <class RunningAffineCacheType, class OptAffine, class ParaType>
+void SearchAffineSeeds(RunningAffineCacheType & running_cache, OptAffine & opt, ParaType & current_para)
+{
+  if( opt.number_of_seeds <= 0 || opt.number_of_levels <= 0 )
+    {
+    return;
+    }
 
-  resampler->Update();
+  std::vector<ParaType> seeds;
+  GenerateAffineSeeds(running_cache.fixed_image_pyramid[0], current_para, opt.number_of_seeds, opt.time_seed, seeds);
 
-  image = resampler->GetOutput();
+  std::vector<std::pair<double, unsigned int> > ranking;
+  for( unsigned int n = 0; n < seeds.size(); n++ )
+    {
+    ranking.push_back( std::make_pair( 0.0, n ) );
+    }
+  for( int i = 0; i < opt.number_of_levels && ranking.size() > 1; i++ )
+    {
+    std::vector<ParaType> candidates;
+    for( unsigned int n = 0; n < ranking.size(); n++ )
+      {
+      candidates.push_back( seeds[ranking[n].second] );
+      }
+    std::vector<double> values;
+    TestCostValuesMMI(running_cache.fixed_image_pyramid[i], running_cache.moving_image_pyramid[i], candidates,
+                      opt.transform_initial->GetCenter(), opt.transform_initial, running_cache.mask_fixed_object,
+                      values);
+    for( unsigned int n = 0; n < ranking.size(); n++ )
+      {
+      ranking[n].first = values[n];
+      }
+    std::sort( ranking.begin(), ranking.end() );
 
-  // std::cout << "DEBUG: " << outputSize << std::endl;
+    const unsigned int kept = ( i + 1 == opt.number_of_levels ) ? 1 : ( ranking.size() + 1 ) / 2;
+    std::cout << "seed search level " << i << ": " << ranking.size() << " seeds, best seed ["
+              << ranking[0].second << "] rval = " << ranking[0].first << std::endl;
+    ranking.resize( kept );
+    }
 
-  return image;
+  current_para = seeds[ranking[0].second];
+  std::cout << "start from seed [" << ranking[0].second << "] of " << seeds.size()
+            << ", affine para: " << current_para << std::endl;
 }
 
-template <class ImagePointerType, class ImagePyramidType>
-void BuildImagePyramid(const ImagePointerType & image, int number_of_levels, ImagePyramidType & image_pyramid)
+template <class ImagePointer>
+ImagePointer  ShrinkImageToScale(ImagePointer image,  float scalingFactor )
 {
+  typedef typename ImagePointer::ObjectType ImageType;
+
+  return itk::ANTSImagePyramid<ImageType>::ShrinkImageToScale( image, scalingFactor );
+}
+
+// the levels come from shared_pyramid when one is given, so they are only built once
+template <class ImagePointerType, class ImagePyramidType, class SharedImagePyramidPointerType>
+void BuildImagePyramid(const ImagePointerType & image, int number_of_levels, ImagePyramidType & image_pyramid,
+                       const SharedImagePyramidPointerType & shared_pyramid)
+{
+  typedef typename SharedImagePyramidPointerType::ObjectType SharedImagePyramidType;
+
   image_pyramid.resize(number_of_levels);
 
   image_pyramid[number_of_levels - 1] = image;
   double scale_factor = 2;
   for( int i = 0; i < number_of_levels - 1; i++ )
     {
-    image_pyramid[number_of_levels - 2 - i] = ShrinkImageToScale(image, scale_factor);
+    if( shared_pyramid.IsNotNull() )
+      {
+      image_pyramid[number_of_levels - 2 - i] =
+        shared_pyramid->GetLevel(image, SharedImagePyramidType::AffineShrink, static_cast<float>( scale_factor ) );
+      }
+    else
+      {
+      image_pyramid[number_of_levels - 2 - i] = ShrinkImageToScale(image, scale_factor);
+      }
     scale_factor *= 2;
     }
 
@@ -918,6 +1108,14 @@ void BuildImagePyramid(const ImagePointerType & image, int number_of_levels, Ima
   // std::endl;
 }
 
+template <class ImagePointerType, class ImagePyramidType>
+void BuildImagePyramid(const ImagePointerType & image, int number_of_levels, ImagePyramidType & image_pyramid)
+{
+  typedef typename ImagePointerType::ObjectType ImageType;
+
+  BuildImagePyramid(image, number_of_levels, image_pyramid, typename itk::ANTSImagePyramid<ImageType>::Pointer() );
+}
+
 template <class ImagePointerType, class OptAffineType, class RunningAffineCacheType>
 void InitializeRunningAffineCache(ImagePointerType & fixed_image, ImagePointerType & moving_image, OptAffineType & opt,
                                   RunningAffineCacheType & running_cache)
@@ -925,8 +1123,8 @@ void InitializeRunningAffineCache(ImagePointerType & fixed_image, ImagePointerTy
   typedef typename RunningAffineCacheType::InterpolatorType InterpolatorType;
   typedef typename RunningAffineCacheType::MetricType       MetricType;
 
-  BuildImagePyramid(fixed_image, opt.number_of_levels, running_cache.fixed_image_pyramid);
-  BuildImagePyramid(moving_image, opt.number_of_levels, running_cache.moving_image_pyramid);
+  BuildImagePyramid(fixed_image, opt.number_of_levels, running_cache.fixed_image_pyramid, opt.image_pyramid);
+  BuildImagePyramid(moving_image, opt.number_of_levels, running_cache.moving_image_pyramid, opt.image_pyramid);
   InitialzeImageMask(opt.mask_fixed, running_cache.mask_fixed_object);
 
   running_cache.interpolator = InterpolatorType::New();
@@ -934,6 +1132,64 @@ void InitializeRunningAffineCache(ImagePointerType & fixed_image, ImagePointerTy
   running_cache.invmetric = MetricType::New();
 }
 
+// restrict the metric to a subset of the fixed image voxels inside the mask.
+// Regular keeps every round(1/percentage)-th voxel, Random keeps each voxel
+// with probability percentage (fixed seed, so runs are reproducible).
+// Only the metrics that evaluate ImageToImageMetric's sample list (MI, MSQ)
+// honor the subset; the others keep iterating the whole fixed region.
+template <class MetricPointerType, class ImagePointerType, class MaskObjectPointerType, class OptAffineType>
+void SetAffineMetricSampling(MetricPointerType & metric, const ImagePointerType & fixed_image,
+                             const MaskObjectPointerType & mask_fixed_object, const OptAffineType & opt)
+{
+  typedef typename MetricPointerType::ObjectType        MetricType;
+  typedef typename ImagePointerType::ObjectType         ImageType;
+  typedef typename MetricType::FixedImageIndexContainer IndexContainerType;
+
+  if( opt.sampling_strategy == AffineSamplingNone || opt.sampling_percentage >= 1.0 )
+    {
+    return;
+    }
+  if( opt.metric_type != AffineWithMutualInformation && opt.metric_type != AffineWithMeanSquareDifference )
+    {
+    std::cout << "affine sampling is only used by the MI and MSQ metrics, using all voxels." << std::endl;
+    return;
+    }
+
+  const double       percentage = std::max( opt.sampling_percentage, 1.e-6 );
+  const unsigned int step = std::max( static_cast<unsigned int>( 1.0 / percentage + 0.5 ), 1u );
+  vnl_random         randgen( 19650218 );
+
+  IndexContainerType indexes;
+  unsigned long      count = 0;
+  itk::ImageRegionIteratorWithIndex<ImageType> it( fixed_image, fixed_image->GetLargestPossibleRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it, ++count )
+    {
+    const bool keep = ( opt.sampling_strategy == AffineSamplingRegular ) ? ( count % step == 0 ) :
+      ( randgen.drand64() < percentage );
+    if( !keep )
+      {
+      continue;
+      }
+    if( mask_fixed_object.IsNotNull() )
+      {
+      typename ImageType::PointType point;
+      fixed_image->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+      if( !mask_fixed_object->IsInside( point ) )
+        {
+        continue;
+        }
+      }
+    indexes.push_back( it.GetIndex() );
+    }
+  if( indexes.empty() )
+    {
+    std::cout << "affine sampling selected no voxels, using all voxels." << std::endl;
+    return;
+    }
+  std::cout << "affine metric samples: " << indexes.size() << " of " << count << " voxels" << std::endl;
+  metric->SetFixedImageIndexes( indexes );
+}
+
 template <class ImagePointerType, class OptAffineType>
 void  InitializeAffineTransform(ImagePointerType & fixed_image, ImagePointerType & moving_image, OptAffineType& opt)
 {
@@ -1025,6 +1281,7 @@ bool SymmRegisterImageAffineMutualInformationMultiResolution(RunningAffineCacheT
 
   ParaType current_para(kParaDim);
   current_para = opt.transform_initial->GetParameters();
+  SearchAffineSeeds(running_cache, opt, current_para);
 
   double maximum_step_length = opt.maximum_step_length;
   double relaxation_factor = opt.relaxation_factor;
@@ -1238,6 +1495,7 @@ bool RegisterImageAffineMutualInformationMultiResolution(RunningAffineCacheType
 
   ParaType current_para(kParaDim);
   current_para = opt.transform_initial->GetParameters();
+  SearchAffineSeeds(running_cache, opt, current_para);
 
   double maximum_step_length = opt.maximum_step_length;
   double relaxation_factor = opt.relaxation_factor;
@@ -1263,6 +1521,7 @@ bool RegisterImageAffineMutualInformationMultiResolution(RunningAffineCacheType
       {
       metric->SetFixedImageMask(mask_fixed_object);
       }
+    SetAffineMetricSampling(metric, fixed_image, mask_fixed_object, opt);
     metric->Initialize();
 
     ParaType last_gradient(kParaDim);
@@ -0,0 +1,327 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkANTSImagePyramid_h
+#define __itkANTSImagePyramid_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkMacro.h"
+#include "itkRecursiveGaussianImageFilter.h"
+#include "itkDiscreteGaussianImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkMinimumMaximumImageFilter.h"
+#include "itkShiftScaleImageFilter.h"
+
+#include <map>
+#include <string>
+
+namespace itk
+{
+/** \class ANTSImagePyramid
+ * \brief Multi-resolution levels of the images of an ANTS run.
+ *
+ * One pyramid is shared by the input reading, the affine stage and the
+ * deformable stage, so every level is computed once however many metrics or
+ * stages ask for it.  A level is built on first request and is keyed by its
+ * source image (pointer and modification time), the kind of level and the
+ * scale factor or sigma.  Images read through the pyramid are shared by file
+ * name, so metrics on the same files also share their levels.
+ */
+template <class TImage>
+class ANTSImagePyramid
+  : public       Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef ANTSImagePyramid         Self;
+  typedef Object                   Superclass;
+  typedef SmartPointer<Self>       Pointer;
+  typedef SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( ANTSImagePyramid, Object );
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  typedef TImage                      ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType RealType;
+
+  /** AffineShrink: smoothed and resampled levels of the affine stage.
+   *  DeformableSmooth: full resolution levels of the deformable stage,
+   *  smoothed to the scale factor and normalized to [0,1].
+   *  DeformableGaussian: as DeformableSmooth for a user given sigma. */
+  typedef enum { AffineShrink = 0, DeformableSmooth, DeformableGaussian } LevelKindType;
+
+  /** The image read from fileName, or null if no image was added for it. */
+  ImagePointer GetImage( const std::string & fileName ) const
+  {
+    typename ImageMapType::const_iterator it = this->m_Images.find( fileName );
+
+    return ( it != this->m_Images.end() ) ? it->second : ImagePointer( ITK_NULLPTR );
+  }
+
+  void AddImage( const std::string & fileName, ImagePointer image )
+  {
+    this->m_Images[fileName] = image;
+  }
+
+  /** The level of image for the kind and scale (the sigma for
+   * DeformableGaussian), built on first request. */
+  ImagePointer GetLevel( ImageType *image, LevelKindType kind, double scale )
+  {
+    LevelKeyType key;
+
+    key.Image = image;
+    key.MTime = image->GetMTime();
+    key.Kind = kind;
+    key.Scale = scale;
+
+    typename LevelMapType::iterator it = this->m_Levels.find( key );
+    if( it != this->m_Levels.end() )
+      {
+      return it->second.Level;
+      }
+
+    LevelEntryType entry;
+    entry.Source = image;
+    switch( kind )
+      {
+      case AffineShrink:
+        entry.Level = ShrinkImageToScale( image, scale );
+        break;
+      case DeformableSmooth:
+        entry.Level = SmoothImageToScale( image, scale );
+        break;
+      case DeformableGaussian:
+        entry.Level = GaussianSmoothImage( image, scale );
+        break;
+      }
+    this->m_Levels[key] = entry;
+    return entry.Level;
+  }
+
+  /** Drop the levels of one kind, once the stage using them is done. */
+  void ReleaseLevels( LevelKindType kind )
+  {
+    typename LevelMapType::iterator it = this->m_Levels.begin();
+    while( it != this->m_Levels.end() )
+      {
+      if( it->first.Kind == kind )
+        {
+        this->m_Levels.erase( it++ );
+        }
+      else
+        {
+        ++it;
+        }
+      }
+  }
+
+  void ReleaseLevels()
+  {
+    this->m_Levels.clear();
+  }
+
+  unsigned long GetNumberOfLevels() const
+  {
+    return this->m_Levels.size();
+  }
+
+  /** smooth and resample the image by scalingFactor, as the legacy affine pyramid */
+  static ImagePointer ShrinkImageToScale( ImagePointer image, double scalingFactor )
+  {
+    typename ImageType::SpacingType inputSpacing = image->GetSpacing();
+    typename ImageType::RegionType::SizeType inputSize = image->GetRequestedRegion().GetSize();
+
+    typename ImageType::SpacingType outputSpacing;
+    typename ImageType::RegionType::SizeType outputSize;
+
+    typedef ResampleImageFilter<ImageType, ImageType> ResampleFilterType;
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+
+    RealType minimumSpacing = inputSpacing.GetVnlVector().min_value();
+
+    ImagePointer current_image = image;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      RealType scaling = vnl_math_min( static_cast<RealType>( scalingFactor ) * minimumSpacing / inputSpacing[d],
+                                       static_cast<RealType>( inputSize[d] ) / 32.0 );
+      outputSpacing[d] = inputSpacing[d] * scaling;
+      outputSize[d] = static_cast<unsigned long>( inputSpacing[d]
+                                                  * static_cast<RealType>( inputSize[d] ) / outputSpacing[d] + 0.5 );
+
+      typedef RecursiveGaussianImageFilter<ImageType, ImageType> GaussianFilterType;
+      typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
+      smoother->SetInputImage( current_image  );
+      smoother->SetDirection( d );
+      smoother->SetNormalizeAcrossScale( false );
+      smoother->SetSigma( 0.25 * ( outputSpacing[d] / inputSpacing[d]  ) );
+
+      if( smoother->GetSigma() > 0.0 )
+        {
+        smoother->Update();
+        current_image  = smoother->GetOutput();
+        }
+      }
+
+    resampler->SetInput(current_image );
+    resampler->SetSize(outputSize);
+    resampler->SetOutputSpacing(outputSpacing);
+    resampler->SetOutputOrigin(image->GetOrigin() );
+    resampler->SetOutputDirection(image->GetDirection() );
+
+    resampler->Update();
+
+    return resampler->GetOutput();
+  }
+
+  /** smooth the image to the scale of a deformable level, keeping its grid */
+  static ImagePointer SmoothImageToScale( ImagePointer image, double scalingFactor )
+  {
+    typename ImageType::SpacingType inputSpacing = image->GetSpacing();
+    typename ImageType::RegionType::SizeType inputSize = image->GetRequestedRegion().GetSize();
+
+    typename ImageType::SpacingType outputSpacing;
+
+    RealType minimumSpacing = inputSpacing.GetVnlVector().min_value();
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      RealType scaling = vnl_math_min( static_cast<RealType>( scalingFactor ) * minimumSpacing / inputSpacing[d],
+                                       static_cast<RealType>( inputSize[d] ) / 32.0 );
+      outputSpacing[d] = inputSpacing[d] * scaling;
+
+      typedef RecursiveGaussianImageFilter<ImageType, ImageType> GaussianFilterType;
+      typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
+      smoother->SetInputImage( image );
+      smoother->SetDirection( d );
+      smoother->SetNormalizeAcrossScale( false );
+      RealType sig = (outputSpacing[d] / inputSpacing[d] - 1.0) * 0.2;
+      smoother->SetSigma(sig );
+
+      if( smoother->GetSigma() > 0.0 )
+        {
+        smoother->Update();
+        image = smoother->GetOutput();
+        }
+      }
+
+    return NormalizeImage(image);
+  }
+
+  static ImagePointer GaussianSmoothImage( ImagePointer image, double sigma )
+  {
+    typedef DiscreteGaussianImageFilter<ImageType, ImageType> SmootherType;
+    typename SmootherType::Pointer smoother = SmootherType::New();
+    smoother->SetVariance( vnl_math_sqr( static_cast<RealType>( sigma ) ) );
+    smoother->SetMaximumError( 0.01 );
+    smoother->SetInput( image );
+
+    ImagePointer smoothImage = smoother->GetOutput();
+    smoothImage->Update();
+    smoothImage->DisconnectPipeline();
+
+    return NormalizeImage( smoothImage );
+  }
+
+  /** rescale the intensities to [0,1] */
+  static ImagePointer NormalizeImage( ImagePointer image )
+  {
+    typedef MinimumMaximumImageFilter<ImageType> MinMaxFilterType;
+    typename MinMaxFilterType::Pointer minMaxFilter = MinMaxFilterType::New();
+
+    minMaxFilter->SetInput( image );
+    minMaxFilter->Update();
+
+    RealType min = minMaxFilter->GetMinimum();
+    RealType shift = -1.0 * static_cast<RealType>( min );
+    RealType scale = static_cast<RealType>( minMaxFilter->GetMaximum() );
+    scale += shift;
+    scale = 1.0 / scale;
+
+    typedef ShiftScaleImageFilter<ImageType, ImageType> FilterType;
+    typename FilterType::Pointer filter = FilterType::New();
+
+    filter->SetInput( image );
+    filter->SetShift( shift );
+    filter->SetScale( scale );
+    filter->Update();
+
+    return filter->GetOutput();
+  }
+
+protected:
+  ANTSImagePyramid()
+  {
+  }
+
+  ~ANTSImagePyramid()
+  {
+  }
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "Images: " << this->m_Images.size() << std::endl;
+    os << indent << "Levels: " << this->m_Levels.size() << std::endl;
+  }
+
+private:
+  ANTSImagePyramid( const Self & ); // purposely not implemented
+  void operator=( const Self & );   // purposely not implemented
+
+  struct LevelKeyType
+    {
+    const ImageType *Image;
+    unsigned long    MTime;
+    int              Kind;
+    double           Scale;
+
+    bool operator<( const LevelKeyType & other ) const
+    {
+      if( this->Image != other.Image )
+        {
+        return this->Image < other.Image;
+        }
+      if( this->MTime != other.MTime )
+        {
+        return this->MTime < other.MTime;
+        }
+      if( this->Kind != other.Kind )
+        {
+        return this->Kind < other.Kind;
+        }
+      return this->Scale < other.Scale;
+    }
+    };
+
+  /** the source is held so that its address is not reused by another image */
+  struct LevelEntryType
+    {
+    ImagePointer Source;
+    ImagePointer Level;
+    };
+
+  typedef std::map<LevelKeyType, LevelEntryType> LevelMapType;
+  typedef std::map<std::string, ImagePointer>    ImageMapType;
+
+  LevelMapType m_Levels;
+  ImageMapType m_Images;
+};
+} // end namespace itk
+
+#endif
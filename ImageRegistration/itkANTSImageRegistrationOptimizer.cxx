@@ -19,9 +19,12 @@
 #pragma warning(disable: 4786)
 #endif
 #include "antsAllocImage.h"
-#include "itkVectorParameterizedNeighborhoodOperatorImageFilter.h"
+#include "antsUtilities.h"
+#include "antsSeparableGaussianSmoothing.h"
 #include "itkANTSImageRegistrationOptimizer.h"
 #include "itkIdentityTransform.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkRecursiveGaussianImageFilter.h"
 #include "itkVectorGaussianInterpolateImageFunction.h"
@@ -61,6 +64,9 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
   this->m_SyNFInv = ITK_NULLPTR;
   this->m_SyNM = ITK_NULLPTR;
   this->m_SyNMInv = ITK_NULLPTR;
+  this->m_InvertFieldMagnitudeImage = ITK_NULLPTR;
+  this->m_InvertFieldLagrangianInitCond = ITK_NULLPTR;
+  this->m_InvertFieldEulerianInitCond = ITK_NULLPTR;
   this->m_Parser = ITK_NULLPTR;
   this->m_GaussianTruncation = 256;
   this->m_TimeVaryingVelocity = ITK_NULLPTR;
@@ -149,6 +155,8 @@ void
 ANTSImageRegistrationOptimizer<TDimension, TReal>
 ::SmoothDisplacementFieldGauss(DisplacementFieldPointer field, TReal sig, bool /* useparamimage */, unsigned int lodim)
 {
+  ANTS_PROFILE_SCOPE( "ANTS::SmoothDisplacementFieldGauss" );
+
   if( this->m_Debug )
     {
     std::cout << " enter gauss smooth " <<  sig  << std::endl;
@@ -161,53 +169,14 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     {
     std::cout << " No Field in gauss Smoother " << std::endl; return;
     }
-  DisplacementFieldPointer tempField =
-    AllocImage<DisplacementFieldType>(field);
-
-  typedef typename DisplacementFieldType::PixelType    DispVectorType;
-  typedef typename DispVectorType::ValueType           ScalarType;
-  typedef GaussianOperator<ScalarType, ImageDimension> OperatorType;
-  // typedef VectorNeighborhoodOperatorImageFilter< DisplacementFieldType,    DisplacementFieldType> SmootherType;
-  typedef VectorParameterizedNeighborhoodOperatorImageFilter<
-      DisplacementFieldType,
-      DisplacementFieldType, ImageType> SmootherType;
-
-  OperatorType * oper = new OperatorType;
-  typename SmootherType::Pointer smoother = SmootherType::New();
-
-  typedef typename DisplacementFieldType::PixelContainerPointer
-    PixelContainerPointer;
-  PixelContainerPointer swapPtr;
-
-  // graft the output field onto the mini-pipeline
-  smoother->GraftOutput( tempField );
-  for( unsigned int j = 0; j < lodim; j++ )
+  lodim = std::min( lodim, static_cast<unsigned int>( ImageDimension ) );
+  if( lodim == 0 )
     {
-    // smooth along this dimension
-    oper->SetDirection( j );
-    TReal sigt = sig;
-    oper->SetVariance( sigt );
-    oper->SetMaximumError(0.001 );
-    oper->SetMaximumKernelWidth( (unsigned int) this->m_GaussianTruncation );
-    oper->CreateDirectional();
-
-    // todo: make sure we only smooth within the buffered region
-    smoother->SetOperator( *oper );
-    smoother->SetInput( field );
-    smoother->Update();
-
-    if( j < lodim - 1 )
-      {
-      // swap the containers
-      swapPtr = smoother->GetOutput()->GetPixelContainer();
-      smoother->GraftOutput( field );
-      field->SetPixelContainer( swapPtr );
-      smoother->Modified();
-      }
+    return;
     }
 
-  // graft the output back to this filter
-  tempField->SetPixelContainer( field->GetPixelContainer() );
+  typedef typename DisplacementFieldType::PixelType DispVectorType;
+  typedef ants::SeparableGaussianSmoothing         SmootherType;
 
   // make sure boundary does not move
   TReal weight = 1.0;
@@ -216,9 +185,38 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     weight = 1.0 - 1.0 * (sig / 0.5);
     }
   TReal weight2 = 1.0 - weight;
+
+  // smooth in place along the first lodim dimensions; the smoothed field is
+  // blended with the field smoothed along all but the last of them
+  itk::FixedArray<double, ImageDimension> variance;
+  variance.Fill( 0.0 );
+  for( unsigned int j = 0; j + 1 < lodim; j++ )
+    {
+    variance[j] = sig;
+    }
+  SmootherType::Smooth<DisplacementFieldType>( field, variance, 0.001,
+                                               static_cast<unsigned int>( this->m_GaussianTruncation ) );
+
+  DisplacementFieldPointer blendField = ITK_NULLPTR;
+  if( weight2 > 0 )
+    {
+    blendField = this->CopyDisplacementField( field );
+    }
+
+  variance.Fill( 0.0 );
+  variance[lodim - 1] = sig;
+  SmootherType::Smooth<DisplacementFieldType>( field, variance, 0.001,
+                                               static_cast<unsigned int>( this->m_GaussianTruncation ) );
+
   typedef itk::ImageRegionIteratorWithIndex<DisplacementFieldType> Iterator;
+  typedef itk::ImageRegionConstIterator<DisplacementFieldType>     BlendIterator;
   typename DisplacementFieldType::SizeType size = field->GetLargestPossibleRegion().GetSize();
   Iterator outIter( field, field->GetLargestPossibleRegion() );
+  BlendIterator blendIter;
+  if( blendField )
+    {
+    blendIter = BlendIterator( blendField, field->GetLargestPossibleRegion() );
+    }
   for( outIter.GoToBegin(); !outIter.IsAtEnd(); ++outIter )
     {
     bool onboundary = false;
@@ -236,11 +234,13 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
       vec.Fill(0.0);
       outIter.Set(vec);
       }
-    else
+    else if( blendField )
       {
-      // field=this->CopyDisplacementField(
-      DispVectorType svec = smoother->GetOutput()->GetPixel(index);
-      outIter.Set( svec * weight + outIter.Get() * weight2);
+      outIter.Set( outIter.Get() * weight + blendIter.Get() * weight2 );
+      }
+    if( blendField )
+      {
+      ++blendIter;
       }
     }
 
@@ -248,8 +248,6 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     {
     std::cout << " done gauss smooth " << std::endl;
     }
-
-  delete oper;
 }
 
 template <unsigned int TDimension, class TReal>
@@ -257,6 +255,8 @@ void
 ANTSImageRegistrationOptimizer<TDimension, TReal>
 ::SmoothVelocityGauss(TimeVaryingVelocityFieldPointer field, TReal sig, unsigned int lodim)
 {
+  ANTS_PROFILE_SCOPE( "ANTS::SmoothVelocityGauss" );
+
   if( sig <= 0 )
     {
     return;
@@ -318,9 +318,11 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     }
   TReal weight2 = 1.0 - weight;
   typedef itk::ImageRegionIteratorWithIndex<TimeVaryingVelocityFieldType> Iterator;
+  typedef itk::ImageRegionConstIterator<TimeVaryingVelocityFieldType>     SmoothedIterator;
   typename TimeVaryingVelocityFieldType::SizeType size = field->GetLargestPossibleRegion().GetSize();
-  Iterator outIter( field, field->GetLargestPossibleRegion() );
-  for( outIter.GoToBegin(); !outIter.IsAtEnd(); ++outIter )
+  Iterator         outIter( field, field->GetLargestPossibleRegion() );
+  SmoothedIterator smoothedIter( smoother->GetOutput(), field->GetLargestPossibleRegion() );
+  for( outIter.GoToBegin(), smoothedIter.GoToBegin(); !outIter.IsAtEnd(); ++outIter, ++smoothedIter )
     {
     bool onboundary = false;
     typename TimeVaryingVelocityFieldType::IndexType index = outIter.GetIndex();
@@ -340,7 +342,7 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     else
       {
       // field=this->CopyDisplacementField(
-      TVVFVectorType svec = smoother->GetOutput()->GetPixel(index);
+      const TVVFVectorType & svec = smoothedIter.Value();
       outIter.Set( svec * weight + outIter.Get() * weight2);
       }
     }
@@ -359,6 +361,8 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
 ::SmoothDisplacementFieldBSpline( DisplacementFieldPointer field, ArrayType meshsize,
                                   unsigned int splineorder, unsigned int numberoflevels )
 {
+  ANTS_PROFILE_SCOPE( "ANTS::SmoothDisplacementFieldBSpline" );
+
   if( this->m_Debug )
     {
     std::cout << " enter bspline smooth " << std::endl;
@@ -449,75 +453,187 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
                DisplacementFieldPointer fieldout,
                TReal timesign)
 {
-  typedef Point<TReal, itkGetStaticConstMacro(ImageDimension)> VPointType;
-
-//  field->SetSpacing( fieldtowarpby->GetSpacing() );
-//  field->SetOrigin( fieldtowarpby->GetOrigin() );
-//  field->SetDirection( fieldtowarpby->GetDirection() );
+  ANTS_PROFILE_SCOPE( "ANTS::ComposeDiffs" );
 
   if( !fieldout )
     {
-    VectorType zero;  zero.Fill(0);
     fieldout = AllocImage<DisplacementFieldType>(fieldtowarpby);
     }
-  typedef typename DisplacementFieldType::PixelType DispVectorType;
 
+  // field is sampled away from the voxel being written, so it cannot be overwritten in place
+  DisplacementFieldPointer output = fieldout;
+  if( fieldout == field )
+    {
+    output = AllocImage<DisplacementFieldType>(fieldtowarpby);
+    }
 
-  typedef itk::ImageRegionIteratorWithIndex<DisplacementFieldType> FieldIterator;
+  ComposeDiffsThreadStruct str;
+  str.FieldToWarpBy = fieldtowarpby;
+  str.Field = field;
+  str.FieldOut = output;
+  str.TimeSign = timesign;
 
-  typedef typename DisplacementFieldType::IndexType DispIndexType;
+  const SizeValueType numberOfSlabs =
+    fieldtowarpby->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  ThreadIdType numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if( numberOfThreads > numberOfSlabs )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( numberOfSlabs );
+    }
 
-  typedef itk::VectorLinearInterpolateImageFunction<DisplacementFieldType, TReal>   DefaultInterpolatorType;
-  typename DefaultInterpolatorType::Pointer vinterp =  DefaultInterpolatorType::New();
-  vinterp->SetInputImage(field);
-  //    vinterp->SetParameters(NULL,1);
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( Self::ComposeDiffsThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  if( output != fieldout )
+    {
+    const SizeValueType numberOfPixels = output->GetBufferedRegion().GetNumberOfPixels();
+    std::copy( output->GetBufferPointer(), output->GetBufferPointer() + numberOfPixels,
+               fieldout->GetBufferPointer() );
+    }
+}
+
+template <unsigned int TDimension, class TReal>
+void
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::ThreadedComposeDiffs( const ComposeDiffsThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads )
+{
+  typedef Point<TReal, itkGetStaticConstMacro(ImageDimension)> VPointType;
+  typedef typename DisplacementFieldType::PixelType            DispVectorType;
+  typedef typename DisplacementFieldType::RegionType           DispRegionType;
+  typedef typename NumericTraits<TReal>::RealType              AccumulateType;
+
+  const DisplacementFieldType *fieldtowarpby = str->FieldToWarpBy;
+  const DisplacementFieldType *field = str->Field;
+
+  // contiguous slabs of the slowest dimension, so that the neighbouring rows
+  // sampled in field are shared by consecutive voxels of one thread
+  DispRegionType      region = fieldtowarpby->GetLargestPossibleRegion();
+  const unsigned int  slabDimension = ImageDimension - 1;
+  const SizeValueType numberOfSlabs = region.GetSize()[slabDimension];
+  const SizeValueType firstSlab = numberOfSlabs * threadId / numberOfThreads;
+  const SizeValueType endSlab = numberOfSlabs * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlab == endSlab )
+    {
+    return;
+    }
+  region.SetIndex( slabDimension, region.GetIndex()[slabDimension] + static_cast<IndexValueType>( firstSlab ) );
+  region.SetSize( slabDimension, endSlab - firstSlab );
+
+  // linear interpolation directly on the buffer of field, with the same
+  // bounds and edge handling as VectorLinearInterpolateImageFunction
+  const DispRegionType &  fieldRegion = field->GetBufferedRegion();
+  const DispVectorType *  fieldBuffer = field->GetBufferPointer();
+  const OffsetValueType * offsetTable = field->GetOffsetTable();
+  const typename DisplacementFieldType::DirectionType & physicalToIndex = field->GetPhysicalPointToIndex();
+  const typename DisplacementFieldType::PointType &     fieldOrigin = field->GetOrigin();
+
+  IndexValueType fieldStart[ImageDimension];
+  IndexValueType fieldEnd[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    fieldStart[d] = fieldRegion.GetIndex()[d];
+    fieldEnd[d] = fieldStart[d] + static_cast<IndexValueType>( fieldRegion.GetSize()[d] ) - 1;
+    }
+  const unsigned int numberOfNeighbors = 1u << ImageDimension;
+
+  ImageRegionConstIteratorWithIndex<DisplacementFieldType> ItF( fieldtowarpby, region );
+  ImageRegionIterator<DisplacementFieldType>               ItO( str->FieldOut, region );
 
   VPointType pointIn1;
   VPointType pointIn2;
-  typename DefaultInterpolatorType::ContinuousIndexType  contind;   // married to pointIn2
-  VPointType   pointIn3;
-  unsigned int ct = 0;
-  // iterate through fieldtowarpby finding the points that it maps to via field.
-  // then take the difference from the original point and put it in the output field.
-  //      std::cout << " begin iteration " << std::endl;
-  FieldIterator m_FieldIter( fieldtowarpby, fieldtowarpby->GetLargestPossibleRegion() );
-  for(  m_FieldIter.GoToBegin(); !m_FieldIter.IsAtEnd(); ++m_FieldIter )
+  for( ItF.GoToBegin(), ItO.GoToBegin(); !ItF.IsAtEnd(); ++ItF, ++ItO )
     {
-    DispIndexType index = m_FieldIter.GetIndex();
-    bool          dosample = true;
-    //      if (sub && m_TRealImage->GetPixel(index) < 0.5) dosample=false;
-    if( dosample )
+    fieldtowarpby->TransformIndexToPhysicalPoint( ItF.GetIndex(), pointIn1 );
+    const DispVectorType & disp = ItF.Value();
+    for( unsigned int jj = 0; jj < ImageDimension; jj++ )
       {
-      fieldtowarpby->TransformIndexToPhysicalPoint( index, pointIn1 );
-      DispVectorType disp = m_FieldIter.Get();
-      for( unsigned int jj = 0; jj < ImageDimension; jj++ )
+      pointIn2[jj] = disp[jj] + pointIn1[jj];
+      }
+
+    TReal cindex[ImageDimension];
+    bool  inside = true;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      AccumulateType sum = 0;
+      for( unsigned int j = 0; j < ImageDimension; j++ )
         {
-        pointIn2[jj] = disp[jj] + pointIn1[jj];
+        sum += physicalToIndex[i][j] * ( pointIn2[j] - fieldOrigin[j] );
         }
-      typename DefaultInterpolatorType::OutputType disp2;
-      if( vinterp->IsInsideBuffer(pointIn2) )
+      cindex[i] = static_cast<TReal>( sum );
+      if( cindex[i] < fieldStart[i] - 0.5 || cindex[i] >= fieldEnd[i] + 0.5 )
         {
-        disp2 = vinterp->Evaluate( pointIn2 );
+        inside = false;
         }
-      else
+      }
+
+    AccumulateType disp2[ImageDimension];
+    for( unsigned int jj = 0; jj < ImageDimension; jj++ )
+      {
+      disp2[jj] = 0;
+      }
+    if( inside )
+      {
+      IndexValueType baseIndex[ImageDimension];
+      TReal          distance[ImageDimension];
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        disp2.Fill(0);
+        baseIndex[d] = Math::Floor<IndexValueType>( cindex[d] );
+        distance[d] = cindex[d] - static_cast<TReal>( baseIndex[d] );
         }
-      for( unsigned int jj = 0; jj < ImageDimension; jj++ )
+      for( unsigned int counter = 0; counter < numberOfNeighbors; counter++ )
         {
-        pointIn3[jj] = disp2[jj] * timesign + pointIn2[jj];
+        AccumulateType  overlap = 1.0;
+        OffsetValueType offset = 0;
+        unsigned int    upper = counter;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          IndexValueType neighbor;
+          if( upper & 1 )
+            {
+            neighbor = std::min( baseIndex[d] + 1, fieldEnd[d] );
+            overlap *= distance[d];
+            }
+          else
+            {
+            neighbor = std::max( baseIndex[d], fieldStart[d] );
+            overlap *= 1.0 - distance[d];
+            }
+          offset += ( neighbor - fieldStart[d] ) * offsetTable[d];
+          upper >>= 1;
+          }
+        if( overlap )
+          {
+          const DispVectorType & value = fieldBuffer[offset];
+          for( unsigned int jj = 0; jj < ImageDimension; jj++ )
+            {
+            disp2[jj] += overlap * value[jj];
+            }
+          }
         }
+      }
 
-      DispVectorType out;
-      for( unsigned int jj = 0; jj < ImageDimension; jj++ )
-        {
-        out[jj] = pointIn3[jj] - pointIn1[jj];
-        }
+    DispVectorType out;
+    for( unsigned int jj = 0; jj < ImageDimension; jj++ )
+      {
+      out[jj] = ( static_cast<TReal>( disp2[jj] ) * str->TimeSign + pointIn2[jj] ) - pointIn1[jj];
+      }
+    ItO.Set( out );
+    }
+}
 
-      fieldout->SetPixel(m_FieldIter.GetIndex(), out);
-      ct++;
-      } // endif
-    }   // end iteration
+template <unsigned int TDimension, class TReal>
+ITK_THREAD_RETURN_TYPE
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::ComposeDiffsThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+
+  Self::ThreadedComposeDiffs( static_cast<const ComposeDiffsThreadStruct *>( info->UserData ),
+                              info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 template <unsigned int TDimension, class TReal>
@@ -537,6 +653,43 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
   return diffmap;
 }
 
+template <unsigned int TDimension, class TReal>
+typename ANTSImageRegistrationOptimizer<TDimension, TReal>::ImagePointer
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::GetCachedWarpedImage( ImagePointer source, DisplacementFieldPointer warp, AffineTransformPointer aff, bool fixedSide )
+{
+  for( unsigned int i = 0; i < this->m_WarpedImageCache.size(); i++ )
+    {
+    const WarpedImageCacheEntry & entry = this->m_WarpedImageCache[i];
+    if( entry.Source == source && entry.Warp == warp && entry.Affine == aff && entry.FixedSide == fixedSide )
+      {
+      return entry.Image;
+      }
+    }
+
+  WarpedImageCacheEntry entry;
+  entry.Source = source;
+  entry.Warp = warp;
+  entry.Affine = aff;
+  entry.FixedSide = fixedSide;
+  if( !warp )
+    {
+    entry.Image = this->SubsampleImage( source, this->m_ScaleFactor, source->GetOrigin(), source->GetDirection(),
+                                        ITK_NULLPTR );
+    }
+  else if( fixedSide )
+    {
+    // fixed side images are mapped through the moving warp and the fixed image affine
+    entry.Image = this->WarpMultiTransform( this->m_ReferenceSpaceImage, source, ITK_NULLPTR, warp, false, aff );
+    }
+  else
+    {
+    entry.Image = this->WarpMultiTransform( this->m_ReferenceSpaceImage, source, aff, warp, false, ITK_NULLPTR );
+    }
+  this->m_WarpedImageCache.push_back( entry );
+  return entry.Image;
+}
+
 template <unsigned int TDimension, class TReal>
 typename ANTSImageRegistrationOptimizer<TDimension, TReal>::DisplacementFieldPointer
 ANTSImageRegistrationOptimizer<TDimension, TReal>
@@ -544,17 +697,19 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
                      PointSetPointer wpoints, DisplacementFieldPointer totalUpdateInvField,
                      bool updateenergy)
 {
+  ANTS_PROFILE_SCOPE( "ANTS::ComputeUpdateField" );
+
   ImagePointer mask = ITK_NULLPTR;
 
+  // the warps may have changed since the last call
+  this->ClearWarpedImageCache( true );
   if( movingwarp && this->m_MaskImage && !this->m_ComputeThickness )
     {
-    mask = this->WarpMultiTransform( this->m_ReferenceSpaceImage, this->m_MaskImage, ITK_NULLPTR, movingwarp, false,
-                                     this->m_FixedImageAffineTransform );
+    mask = this->GetCachedWarpedImage( this->m_MaskImage, movingwarp, this->m_FixedImageAffineTransform, true );
     }
   else if( this->m_MaskImage && !this->m_ComputeThickness  )
     {
-    mask = this->SubsampleImage( this->m_MaskImage, this->m_ScaleFactor,
-                                 this->m_MaskImage->GetOrigin(), this->m_MaskImage->GetDirection(),  ITK_NULLPTR);
+    mask = this->GetCachedWarpedImage( this->m_MaskImage, ITK_NULLPTR, ITK_NULLPTR, true );
     }
 
   if( !fixedwarp )
@@ -633,33 +788,24 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     ImagePointer wmimage = ITK_NULLPTR;
     if( fixedwarp )
       {
-      wmimage =
-        this->WarpMultiTransform(  this->m_ReferenceSpaceImage, this->m_SmoothMovingImages[metricCount],
-                                   this->m_AffineTransform,
-                                   fixedwarp, false,
-                                   ITK_NULLPTR );
+      wmimage = this->GetCachedWarpedImage( this->m_SmoothMovingImages[metricCount], fixedwarp,
+                                            this->m_AffineTransform, false );
       }
     else
       {
-      wmimage = this->SubsampleImage( this->m_SmoothMovingImages[metricCount], this->m_ScaleFactor,
-                                      this->m_SmoothMovingImages[metricCount]->GetOrigin(),
-                                      this->m_SmoothMovingImages[metricCount]->GetDirection(),  ITK_NULLPTR);
+      wmimage = this->GetCachedWarpedImage( this->m_SmoothMovingImages[metricCount], ITK_NULLPTR, ITK_NULLPTR, false );
       }
 
 //    std::cout << " C " << std::endl;
     ImagePointer wfimage = ITK_NULLPTR;
     if( movingwarp )
       {
-      wfimage =
-        this->WarpMultiTransform( this->m_ReferenceSpaceImage, this->m_SmoothFixedImages[metricCount], ITK_NULLPTR, movingwarp,
-                                  false,
-                                  this->m_FixedImageAffineTransform );
+      wfimage = this->GetCachedWarpedImage( this->m_SmoothFixedImages[metricCount], movingwarp,
+                                            this->m_FixedImageAffineTransform, true );
       }
     else
       {
-      wfimage = this->SubsampleImage( this->m_SmoothFixedImages[metricCount], this->m_ScaleFactor,
-                                      this->m_SmoothFixedImages[metricCount]->GetOrigin(),
-                                      this->m_SmoothFixedImages[metricCount]->GetDirection(),  ITK_NULLPTR);
+      wfimage = this->GetCachedWarpedImage( this->m_SmoothFixedImages[metricCount], ITK_NULLPTR, ITK_NULLPTR, true );
       }
     /*
     if (this->m_TimeVaryingVelocity && ! this->m_MaskImage ) {
@@ -718,42 +864,50 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     // Process the non-boundary region.
     NeighborhoodIteratorType nD(radius, updateField, *fIt);
     UpdateIteratorType       nU(updateField,  *fIt);
-    nD.GoToBegin();
-    nU.GoToBegin();
-    while( !nD.IsAtEnd() )
+
+    // metrics with a whole-field kernel update the non-boundary region in one
+    // pass, the others are visited neighborhood by neighborhood
+    DisplacementFieldType *updateInv = totalUpdateInvField ? updateFieldInv.GetPointer() : ITK_NULLPTR;
+    const bool             updatedfield = df->ComputeUpdateField( updateField, updateInv, mask, *fIt, globalData );
+    if( !updatedfield )
       {
-      bool  oktosample = true;
-      TReal maskprob = 1.0;
-      if( mask )
+      nD.GoToBegin();
+      nU.GoToBegin();
+      while( !nD.IsAtEnd() )
         {
-        maskprob = mask->GetPixel( nD.GetIndex() );
-        if( maskprob > 1.0 )
+        bool  oktosample = true;
+        TReal maskprob = 1.0;
+        if( mask )
           {
-          maskprob = 1.0;
+          maskprob = mask->GetPixel( nD.GetIndex() );
+          if( maskprob > 1.0 )
+            {
+            maskprob = 1.0;
+            }
+          if( maskprob < 0.1 )
+            {
+            oktosample = false;
+            }
           }
-        if( maskprob < 0.1 )
+        if( oktosample )
           {
-          oktosample = false;
+          VectorType temp = df->ComputeUpdate(nD, globalData) * maskprob;
+          nU.Value() += temp;
+          if( totalUpdateInvField )
+            {
+            typename ImageType::IndexType index = nD.GetIndex();
+            temp = df->ComputeUpdateInv(nD, globalData) * maskprob + updateFieldInv->GetPixel(index);
+            updateFieldInv->SetPixel(index, temp);
+            }       // else nU.Value() -= df->ComputeUpdateInv(nD, globalData)*maskprob;
+
+          ++nD;
+          ++nU;
           }
-        }
-      if( oktosample )
-        {
-        VectorType temp = df->ComputeUpdate(nD, globalData) * maskprob;
-        nU.Value() += temp;
-        if( totalUpdateInvField )
+        else
           {
-          typename ImageType::IndexType index = nD.GetIndex();
-          temp = df->ComputeUpdateInv(nD, globalData) * maskprob + updateFieldInv->GetPixel(index);
-          updateFieldInv->SetPixel(index, temp);
-          }       // else nU.Value() -= df->ComputeUpdateInv(nD, globalData)*maskprob;
-
-        ++nD;
-        ++nU;
-        }
-      else
-        {
-        ++nD;
-        ++nU;
+          ++nD;
+          ++nU;
+          }
         }
       }
 
@@ -1068,6 +1222,8 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
                                    DisplacementFieldPointer totalUpdateInvField,
                                    bool updateenergy)
 {
+  ANTS_PROFILE_SCOPE( "ANTS::ComputeUpdateFieldAlternatingMin" );
+
   ImagePointer mask = NULL;
 
   if( movingwarp && this->m_MaskImage )
@@ -1648,11 +1804,15 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>::AffineOptimization(OptAffineT
   // std::endl;
   // compute_single_affine_transform(fixedImage, movingImage, maskImage, transform, transform_init);
 
+  // the affine levels come from the pyramid shared with the deformable stage
+  affine_opt.image_pyramid = this->GetImagePyramid();
+
   // OptAffine<AffineTransformPointer, ImagePointer> opt;
   ComputeSingleAffineTransform<ImageType, TransformType, OptAffineType>(fixedImage,
                                                                         movingImage,
                                                                         affine_opt,
                                                                         transform);
+  this->m_ImagePyramid->ReleaseLevels( ImagePyramidType::AffineShrink );
 
   return transform;
 }
@@ -1731,10 +1891,12 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     this->SmoothDisplacementField( this->m_SyNM, false);
     }
 
-  this->InvertField(this->m_SyNF, this->m_SyNFInv);
-  this->InvertField(this->m_SyNM, this->m_SyNMInv);
-  this->InvertField(this->m_SyNFInv, this->m_SyNF);
-  this->InvertField(this->m_SyNMInv, this->m_SyNM);
+  // each inversion starts from the inverse of the previous iteration
+  const TReal inverseTolerance = this->GetSyNInverseFieldTolerance();
+  this->InvertField(this->m_SyNF, this->m_SyNFInv, 1.0, inverseTolerance);
+  this->InvertField(this->m_SyNM, this->m_SyNMInv, 1.0, inverseTolerance);
+  this->InvertField(this->m_SyNFInv, this->m_SyNF, 1.0, inverseTolerance);
+  this->InvertField(this->m_SyNMInv, this->m_SyNM, 1.0, inverseTolerance);
 
 //      std::cout <<  " F " << this->MeasureDeformation(this->m_SyNF) << " F1 " <<
 // this->MeasureDeformation(this->m_SyNFInv) << std::endl;
@@ -2372,6 +2534,8 @@ typename ANTSImageRegistrationOptimizer<TDimension, TReal>::DisplacementFieldPoi
 ANTSImageRegistrationOptimizer<TDimension, TReal>
 ::IntegrateVelocity(TReal starttimein, TReal finishtimein )
 {
+  ANTS_PROFILE_SCOPE( "ANTS::IntegrateVelocity" );
+
   ImagePointer mask = ITK_NULLPTR;
 
   if( this->m_SyNMInv && this->m_MaskImage )
@@ -2442,27 +2606,23 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     finishtimein = 1;
     }
 
-  FieldIterator m_FieldIter(this->GetDisplacementField(), this->GetDisplacementField()->GetLargestPossibleRegion() );
-//  std::cout << " Start Int " << starttimein <<  std::endl;
-  if( mask  && !this->m_ComputeThickness )
-    {
-    for(  m_FieldIter.GoToBegin(); !m_FieldIter.IsAtEnd(); ++m_FieldIter )
-      {
-      IndexType  velind = m_FieldIter.GetIndex();
-      VectorType disp;
-      if( mask->GetPixel(velind) > 0.05 )
-        {
-        disp = this->IntegratePointVelocity(starttimein, finishtimein, velind) * mask->GetPixel(velind);
-        }
-      else
-        {
-        disp.Fill(0);
-        }
-      intfield->SetPixel(velind, disp);
-      }
+  // the thickness accumulates into shared images, so it is integrated serially
+  this->m_Debug = false;
+  if( !( this->m_ThickImage && this->m_HitImage ) )
+    {
+    IntegrateVelocityThreadStruct str;
+    str.Optimizer = this;
+    str.Mask = ( mask && !this->m_ComputeThickness ) ? mask.GetPointer() : ITK_NULLPTR;
+    str.Field = intfield;
+    str.Indices = ITK_NULLPTR;
+    str.Displacements = ITK_NULLPTR;
+    str.StartTime = starttimein;
+    str.FinishTime = finishtimein;
+    this->IntegrateVelocityInParallel( &str, intfield->GetLargestPossibleRegion().GetSize()[ImageDimension - 1] );
     }
   else
     {
+    FieldIterator m_FieldIter(this->GetDisplacementField(), this->GetDisplacementField()->GetLargestPossibleRegion() );
     for(  m_FieldIter.GoToBegin(); !m_FieldIter.IsAtEnd(); ++m_FieldIter )
       {
       IndexType  velind = m_FieldIter.GetIndex();
@@ -2527,7 +2687,8 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     finishtimein = 1;
     }
 
-  unsigned long sz1 = mypoints->GetNumberOfPoints();
+  std::vector<IndexType> indices;
+  unsigned long          sz1 = mypoints->GetNumberOfPoints();
   for( unsigned long ii = 0; ii < sz1; ii++ )
     {
     PointType point;
@@ -2551,14 +2712,38 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
       // std::cout <<" inside? " << bisinside  << std::endl;
       if( bisinside )
         {
-//      std::cout <<  "integrate " << std::endl;
-        VectorType disp = this->IntegratePointVelocity(starttimein, finishtimein, velind);
-//      std::cout <<  "put inside " << std::endl;
-        intfield->SetPixel(velind, disp);
+        indices.push_back( velind );
         }
       }
     }
 
+  // the thickness accumulates into shared images, so it is integrated serially
+  this->m_Debug = false;
+  std::vector<VectorType> displacements( indices.size() );
+  if( !( this->m_ThickImage && this->m_HitImage ) )
+    {
+    IntegrateVelocityThreadStruct str;
+    str.Optimizer = this;
+    str.Mask = ITK_NULLPTR;
+    str.Field = intfield;
+    str.Indices = &indices;
+    str.Displacements = &displacements;
+    str.StartTime = starttimein;
+    str.FinishTime = finishtimein;
+    this->IntegrateVelocityInParallel( &str, indices.size() );
+    }
+  else
+    {
+    for( unsigned long ii = 0; ii < indices.size(); ii++ )
+      {
+      displacements[ii] = this->IntegratePointVelocity(starttimein, finishtimein, indices[ii]);
+      }
+    }
+  for( unsigned long ii = 0; ii < indices.size(); ii++ )
+    {
+    intfield->SetPixel(indices[ii], displacements[ii]);
+    }
+
   return intfield;
 }
 
@@ -2568,7 +2753,6 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
 ::IntegratePointVelocity(TReal starttimein, TReal finishtimein, IndexType velind)
 {
   typedef Point<TReal, itkGetStaticConstMacro(ImageDimension + 1)> xPointType;
-  this->m_Debug = false;
 
 
   VectorType zero;
@@ -2580,7 +2764,12 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
 
   typedef typename TimeVaryingVelocityFieldType::IndexType         VIndexType;
 
-  this->m_VelocityFieldInterpolator->SetInputImage(this->m_TimeVaryingVelocity);
+  // the callers set the input of the interpolator before integrating from
+  // several threads
+  if( this->m_VelocityFieldInterpolator->GetInputImage() != this->m_TimeVaryingVelocity.GetPointer() )
+    {
+    this->m_VelocityFieldInterpolator->SetInputImage(this->m_TimeVaryingVelocity);
+    }
 
   TReal        dT = this->m_DeltaTime;
   unsigned int m_NumberOfTimePoints = this->m_TimeVaryingVelocity->GetLargestPossibleRegion().GetSize()[TDimension];
@@ -2937,10 +3126,95 @@ ANTSImageRegistrationOptimizer<TDimension, TReal>
     {
     std::cout << " Length " << thislength << std::endl;
     }
-  this->m_Debug = false;
   return disp;
 }
 
+template <unsigned int TDimension, class TReal>
+void
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::IntegrateVelocityInParallel( IntegrateVelocityThreadStruct *str, SizeValueType numberOfTasks )
+{
+  if( numberOfTasks == 0 )
+    {
+    return;
+    }
+  ThreadIdType numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if( numberOfThreads > numberOfTasks )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( numberOfTasks );
+    }
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( Self::IntegrateVelocityThreaderCallback, str );
+  threader->SingleMethodExecute();
+}
+
+template <unsigned int TDimension, class TReal>
+void
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::ThreadedIntegrateVelocity( const IntegrateVelocityThreadStruct *str, ThreadIdType threadId,
+                             ThreadIdType numberOfThreads )
+{
+  if( str->Indices )
+    {
+    const SizeValueType numberOfIndices = str->Indices->size();
+    const SizeValueType first = numberOfIndices * threadId / numberOfThreads;
+    const SizeValueType end = numberOfIndices * ( threadId + 1 ) / numberOfThreads;
+    for( SizeValueType ii = first; ii < end; ii++ )
+      {
+      ( *str->Displacements )[ii] =
+        str->Optimizer->IntegratePointVelocity( str->StartTime, str->FinishTime, ( *str->Indices )[ii] );
+      }
+    return;
+    }
+
+  typedef typename DisplacementFieldType::RegionType DispRegionType;
+
+  DispRegionType      region = str->Field->GetLargestPossibleRegion();
+  const unsigned int  slabDimension = ImageDimension - 1;
+  const SizeValueType numberOfSlabs = region.GetSize()[slabDimension];
+  const SizeValueType firstSlab = numberOfSlabs * threadId / numberOfThreads;
+  const SizeValueType endSlab = numberOfSlabs * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlab == endSlab )
+    {
+    return;
+    }
+  region.SetIndex( slabDimension, region.GetIndex()[slabDimension] + static_cast<IndexValueType>( firstSlab ) );
+  region.SetSize( slabDimension, endSlab - firstSlab );
+
+  ImageRegionIteratorWithIndex<DisplacementFieldType> It( str->Field, region );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    const IndexType velind = It.GetIndex();
+    VectorType      disp;
+    disp.Fill( 0 );
+    if( !str->Mask )
+      {
+      disp = str->Optimizer->IntegratePointVelocity( str->StartTime, str->FinishTime, velind );
+      }
+    else if( str->Mask->GetPixel( velind ) > 0.05 )
+      {
+      disp = str->Optimizer->IntegratePointVelocity( str->StartTime, str->FinishTime, velind )
+        * str->Mask->GetPixel( velind );
+      }
+    It.Set( disp );
+    }
+}
+
+template <unsigned int TDimension, class TReal>
+ITK_THREAD_RETURN_TYPE
+ANTSImageRegistrationOptimizer<TDimension, TReal>
+::IntegrateVelocityThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+
+  Self::ThreadedIntegrateVelocity( static_cast<const IntegrateVelocityThreadStruct *>( info->UserData ),
+                                   info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 /**
  * Standard "PrintSelf" method
  */
@@ -47,8 +47,11 @@
 #include "itkGeneralToBSplineDisplacementFieldFilter.h"
 #include "itkBSplineControlPointImageFunction.h"
 #include "ANTS_affine_registration2.h"
+#include "itkANTSImagePyramid.h"
 #include "itkVectorFieldGradientImageFunction.h"
 #include "itkBSplineInterpolateImageFunction.h"
+#include "itkMultiThreader.h"
+#include <algorithm>
 
 namespace itk
 {
@@ -91,6 +94,8 @@ public:
   typedef TransformType                             AffineTransformType;
   typedef typename AffineTransformType::Pointer     AffineTransformPointer;
   typedef OptAffine<AffineTransformType, ImageType> OptAffineType;
+  typedef ANTSImagePyramid<ImageType>               ImagePyramidType;
+  typedef typename ImagePyramidType::Pointer        ImagePyramidPointer;
 
   typedef itk::Vector<TReal, ImageDimension>      VectorType;
   typedef itk::Image<VectorType, ImageDimension>  DisplacementFieldType;
@@ -161,6 +166,22 @@ public:
     this->m_ReferenceSpaceImage = m;
   }
 
+  /** The multi-resolution levels shared by the affine and deformable stages.
+   * One is created on first use if none is set. */
+  void SetImagePyramid( ImagePyramidPointer p )
+  {
+    this->m_ImagePyramid = p;
+  }
+
+  ImagePyramidPointer GetImagePyramid()
+  {
+    if( this->m_ImagePyramid.IsNull() )
+      {
+      this->m_ImagePyramid = ImagePyramidType::New();
+      }
+    return this->m_ImagePyramid;
+  }
+
   void SetFixedImageAffineTransform(AffineTransformPointer A)
   {
     this->m_FixedImageAffineTransform = A;
@@ -348,6 +369,30 @@ public:
                                               PointSetPointer  fpoints = NULL,  PointSetPointer wpoints = NULL,
                                               DisplacementFieldPointer updateFieldInv = NULL, bool updateenergy = true);
 
+  /** Warped (or, without a warp, subsampled) metric images shared by all
+   * metric terms.  An entry is keyed by the source image, the warp and the
+   * affine transform.  Entries without a warp only depend on the level and
+   * are kept until the next level; warped entries are dropped at the start
+   * of every ComputeUpdateField call, since the warps are updated in place. */
+  ImagePointer GetCachedWarpedImage( ImagePointer source, DisplacementFieldPointer warp, AffineTransformPointer aff,
+                                     bool fixedSide );
+
+  void ClearWarpedImageCache( bool warpedOnly )
+  {
+    typename std::vector<WarpedImageCacheEntry>::iterator it = this->m_WarpedImageCache.begin();
+    while( it != this->m_WarpedImageCache.end() )
+      {
+      if( !warpedOnly || it->Warp )
+        {
+        it = this->m_WarpedImageCache.erase( it );
+        }
+      else
+        {
+        ++it;
+        }
+      }
+  }
+
   TimeVaryingVelocityFieldPointer ExpandVelocity()
   {
     float expandFactors[ImageDimension + 1];
@@ -711,57 +756,12 @@ public:
 
   ImagePointer  SmoothImageToScale(ImagePointer image,  TReal scalingFactor )
   {
-    typename ImageType::SpacingType inputSpacing = image->GetSpacing();
-    typename ImageType::RegionType::SizeType inputSize = image->GetRequestedRegion().GetSize();
-
-    typename ImageType::SpacingType outputSpacing;
-    typename ImageType::RegionType::SizeType outputSize;
-
-    RealType minimumSpacing = inputSpacing.GetVnlVector().min_value();
-//    RealType maximumSpacing = inputSpacing.GetVnlVector().max_value();
-    for( unsigned int d = 0; d < Dimension; d++ )
-      {
-      RealType scaling = vnl_math_min( scalingFactor * minimumSpacing / inputSpacing[d],
-                                       static_cast<RealType>( inputSize[d] ) / 32.0 );
-      outputSpacing[d] = inputSpacing[d] * scaling;
-      outputSize[d] = static_cast<unsigned long>( inputSpacing[d]
-                                                  * static_cast<RealType>( inputSize[d] ) / outputSpacing[d] + 0.5 );
-
-      typedef RecursiveGaussianImageFilter<ImageType, ImageType> GaussianFilterType;
-      typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
-      smoother->SetInputImage( image );
-      smoother->SetDirection( d );
-      smoother->SetNormalizeAcrossScale( false );
-      TReal sig = (outputSpacing[d] / inputSpacing[d] - 1.0) * 0.2; // /(TReal)ImageDimension;
-      smoother->SetSigma(sig );
-
-      if( smoother->GetSigma() > 0.0 )
-        {
-        smoother->Update();
-        image = smoother->GetOutput();
-        }
-      }
-
-    image = this->NormalizeImage(image);
-
-    return image;
+    return ImagePyramidType::SmoothImageToScale( image, scalingFactor );
   }
 
   ImagePointer GaussianSmoothImage( ImagePointer image,  TReal sigma )
   {
-    typedef DiscreteGaussianImageFilter<ImageType, ImageType> SmootherType;
-    typename SmootherType::Pointer smoother = SmootherType::New();
-    smoother->SetVariance( vnl_math_sqr( sigma ) );
-    smoother->SetMaximumError( 0.01 );
-    smoother->SetInput( image );
-
-    ImagePointer smoothImage = smoother->GetOutput();
-    smoothImage->Update();
-    smoothImage->DisconnectPipeline();
-
-    smoothImage = this->NormalizeImage( smoothImage );
-
-    return smoothImage;
+    return ImagePyramidType::GaussianSmoothImage( image, sigma );
   }
 
   typename ANTSImageRegistrationOptimizer<TDimension, TReal>::DisplacementFieldPointer IntegrateConstantVelocity(
@@ -1131,27 +1131,7 @@ public:
 
   ImagePointer NormalizeImage( ImagePointer image)
   {
-    typedef itk::MinimumMaximumImageFilter<ImageType> MinMaxFilterType;
-    typename MinMaxFilterType::Pointer minMaxFilter = MinMaxFilterType::New();
-
-    minMaxFilter->SetInput( image );
-    minMaxFilter->Update();
-
-    TReal min = minMaxFilter->GetMinimum();
-    TReal shift = -1.0 * static_cast<TReal>( min );
-    TReal scale = static_cast<TReal>( minMaxFilter->GetMaximum() );
-    scale += shift;
-    scale = 1.0 / scale;
-
-    typedef itk::ShiftScaleImageFilter<ImageType, ImageType> FilterType;
-    typename FilterType::Pointer filter = FilterType::New();
-
-    filter->SetInput( image );
-    filter->SetShift( shift );
-    filter->SetScale( scale );
-    filter->Update();
-
-    return filter->GetOutput();
+    return ImagePyramidType::NormalizeImage( image );
   }
 
   void DeformableOptimization()
@@ -1306,23 +1286,29 @@ public:
         }
       this->ComputeMultiResolutionParameters(this->m_ReferenceSpaceImage);
       std::cout << " Its at this level " << this->m_Iterations[currentLevel] << std::endl;
-      /*  generate smoothed images for all metrics */
+      this->ClearWarpedImageCache( false );
+      /*  generate smoothed images for all metrics, metrics on the same images share them */
+      ImagePyramidPointer pyramid = this->GetImagePyramid();
+      pyramid->ReleaseLevels( ImagePyramidType::DeformableSmooth );
+      pyramid->ReleaseLevels( ImagePyramidType::DeformableGaussian );
       for( unsigned int metricCount = 0;  metricCount < numberOfMetrics;  metricCount++ )
         {
         if( this->m_GaussianSmoothingSigmas.size() == 0 )
           {
-          this->m_SmoothFixedImages[metricCount] = this->SmoothImageToScale(
-              this->m_SimilarityMetrics[metricCount]->GetFixedImage(), this->m_ScaleFactor );
-          this->m_SmoothMovingImages[metricCount] = this->SmoothImageToScale(
-              this->m_SimilarityMetrics[metricCount]->GetMovingImage(), this->m_ScaleFactor );
+          this->m_SmoothFixedImages[metricCount] = pyramid->GetLevel(
+              this->m_SimilarityMetrics[metricCount]->GetFixedImage(), ImagePyramidType::DeformableSmooth,
+              this->m_ScaleFactor );
+          this->m_SmoothMovingImages[metricCount] = pyramid->GetLevel(
+              this->m_SimilarityMetrics[metricCount]->GetMovingImage(), ImagePyramidType::DeformableSmooth,
+              this->m_ScaleFactor );
           }
         else
           {
-          this->m_SmoothFixedImages[metricCount] = this->GaussianSmoothImage(
-              this->m_SimilarityMetrics[metricCount]->GetFixedImage(),
+          this->m_SmoothFixedImages[metricCount] = pyramid->GetLevel(
+              this->m_SimilarityMetrics[metricCount]->GetFixedImage(), ImagePyramidType::DeformableGaussian,
               this->m_GaussianSmoothingSigmas[currentLevel] );
-          this->m_SmoothMovingImages[metricCount] = this->GaussianSmoothImage(
-              this->m_SimilarityMetrics[metricCount]->GetMovingImage(),
+          this->m_SmoothMovingImages[metricCount] = pyramid->GetLevel(
+              this->m_SimilarityMetrics[metricCount]->GetMovingImage(), ImagePyramidType::DeformableGaussian,
               this->m_GaussianSmoothingSigmas[currentLevel] );
           }
         }
@@ -1773,6 +1759,8 @@ public:
     return warper->GetOutput();
   }
 
+  /** fieldout(x) = fieldtowarpby(x) + sign * field( x + fieldtowarpby(x) ), computed on all threads.
+   * fieldout may be fieldtowarpby or field. */
   void ComposeDiffs(DisplacementFieldPointer fieldtowarpby, DisplacementFieldPointer field,
                     DisplacementFieldPointer fieldout, TReal sign);
 
@@ -1796,6 +1784,21 @@ public:
     this->m_DeltaTime = t;
   }
 
+  /** The tolerance of the inversions of the SyN fields at the current level.
+      The coarser levels are refined by the finer ones, so their tolerance is
+      doubled per level, up to half a voxel. */
+  TReal GetSyNInverseFieldTolerance() const
+  {
+    const TReal finestLevelTolerance = 0.1;
+    const int   levelsToFinest = static_cast<int>( this->m_NumberOfLevels ) - 1
+      - static_cast<int>( this->m_CurrentLevel );
+    return std::min( finestLevelTolerance * static_cast<TReal>( 1 << std::min( std::max( levelsToFinest, 0 ), 3 ) ),
+                     static_cast<TReal>( 0.5 ) );
+  }
+
+  /** The inverse field is refined from its current contents, which for SyN
+      are the inverse of the previous iteration, until its largest error (in
+      voxels) is below toler and its mean error below a hundredth of toler. */
   TReal InvertField(DisplacementFieldPointer field,
                     DisplacementFieldPointer inverseField, TReal weight = 1.0,
                     TReal toler = 0.1, int maxiter = 20, bool /* print */ = false)
@@ -1807,22 +1810,32 @@ public:
       = this->m_Parser->GetOption( "go-faster" );
     if( thicknessOption->GetFunction( 0 )->GetName() == "true" ||  thicknessOption->GetFunction( 0 )->GetName() == "1" )
       {
-      mytoler = 0.5; maxiter = 12;
+      mytoler = std::max( mytoler, static_cast<TReal>( 0.5 ) ); mymaxiter = std::min( mymaxiter, 12u );
       }
+    const TReal mymeantoler = mytoler * 0.01;
 
     VectorType zero; zero.Fill(0);
     //  if (this->GetElapsedIterations() < 2 ) maxiter=10;
 
-    ImagePointer TRealImage = AllocImage<ImageType>(field);
-
     typedef typename DisplacementFieldType::PixelType           DispVectorType;
     typedef typename DisplacementFieldType::IndexType           DispIndexType;
     typedef ImageRegionIteratorWithIndex<DisplacementFieldType> Iterator;
 
-    DisplacementFieldPointer lagrangianInitCond =
-      AllocImage<DisplacementFieldType>(field);
-    DisplacementFieldPointer eulerianInitCond =
-      AllocImage<DisplacementFieldType>(field);
+    // the work images are kept from one call to the next on the same grid
+    if( !this->m_InvertFieldMagnitudeImage
+        || this->m_InvertFieldMagnitudeImage->GetLargestPossibleRegion() != field->GetLargestPossibleRegion()
+        || this->m_InvertFieldMagnitudeImage->GetSpacing() != field->GetSpacing() )
+      {
+      this->m_InvertFieldMagnitudeImage = AllocImage<ImageType>(field);
+      this->m_InvertFieldLagrangianInitCond = AllocImage<DisplacementFieldType>(field);
+      this->m_InvertFieldEulerianInitCond = AllocImage<DisplacementFieldType>(field);
+      }
+    this->m_InvertFieldLagrangianInitCond->CopyInformation( field );
+    this->m_InvertFieldEulerianInitCond->CopyInformation( field );
+
+    ImagePointer             TRealImage = this->m_InvertFieldMagnitudeImage;
+    DisplacementFieldPointer lagrangianInitCond = this->m_InvertFieldLagrangianInitCond;
+    DisplacementFieldPointer eulerianInitCond = this->m_InvertFieldEulerianInitCond;
 
     typedef typename DisplacementFieldType::SizeType SizeType;
     SizeType size = field->GetLargestPossibleRegion().GetSize();
@@ -1882,7 +1895,7 @@ public:
       epsilon = 1;
       }
 
-    while( difmag > mytoler && ct<mymaxiter && meandif> 0.001 )
+    while( difmag > mytoler && ct<mymaxiter && meandif> mymeantoler )
       {
       meandif = 0.0;
 
@@ -2121,12 +2134,60 @@ private:
   std::vector<ImagePointer> m_SmoothFixedImages;
   std::vector<ImagePointer> m_SmoothMovingImages;
 
+  struct WarpedImageCacheEntry
+    {
+    ImagePointer             Source;
+    DisplacementFieldPointer Warp;
+    AffineTransformPointer   Affine;
+    bool                     FixedSide;
+    ImagePointer             Image;
+    };
+  std::vector<WarpedImageCacheEntry> m_WarpedImageCache;
+
+  struct ComposeDiffsThreadStruct
+    {
+    const DisplacementFieldType *FieldToWarpBy;
+    const DisplacementFieldType *Field;
+    DisplacementFieldType *      FieldOut;
+    TReal                        TimeSign;
+    };
+
+  /** Compose the slabs of the slowest dimension assigned to threadId. */
+  static void ThreadedComposeDiffs( const ComposeDiffsThreadStruct *str, ThreadIdType threadId,
+                                    ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE ComposeDiffsThreaderCallback( void *arg );
+
+  /** Integrates the trajectories of the voxels of Field, or of Indices into
+      Displacements when Indices is set. */
+  struct IntegrateVelocityThreadStruct
+    {
+    Self *                         Optimizer;
+    const ImageType *              Mask;
+    DisplacementFieldType *        Field;
+    const std::vector<IndexType> * Indices;
+    std::vector<VectorType> *      Displacements;
+    TReal                          StartTime;
+    TReal                          FinishTime;
+    };
+
+  /** Integrate the slabs of the slowest dimension, or the share of the
+      indices, assigned to threadId. */
+  static void ThreadedIntegrateVelocity( const IntegrateVelocityThreadStruct *str, ThreadIdType threadId,
+                                         ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE IntegrateVelocityThreaderCallback( void *arg );
+
+  /** Run ThreadedIntegrateVelocity over at most numberOfTasks threads. */
+  void IntegrateVelocityInParallel( IntegrateVelocityThreadStruct *str, SizeValueType numberOfTasks );
+
   bool         m_Debug;
   unsigned int m_NumberOfLevels;
   typename ParserType::Pointer m_Parser;
   SimilarityMetricListType  m_SimilarityMetrics;
   ImagePointer              m_MaskImage;
   ImagePointer              m_ReferenceSpaceImage;
+  ImagePyramidPointer       m_ImagePyramid;
   TReal                     m_ScaleFactor;
   bool                      m_UseMulti;
   bool                      m_UseROI;
@@ -2156,6 +2217,9 @@ private:
   std::vector<unsigned int> m_EnergyBad;
 
 /** for SyN only */
+  ImagePointer                    m_InvertFieldMagnitudeImage;
+  DisplacementFieldPointer        m_InvertFieldLagrangianInitCond;
+  DisplacementFieldPointer        m_InvertFieldEulerianInitCond;
   DisplacementFieldPointer        m_SyNF;
   DisplacementFieldPointer        m_SyNFInv;
   DisplacementFieldPointer        m_SyNM;
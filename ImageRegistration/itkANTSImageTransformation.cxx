@@ -25,14 +25,21 @@
 #include "itkIdentityTransform.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkRecursiveGaussianImageFilter.h"
 #include "itkResampleImageFilter.h"
 #include "itkTransformFileWriter.h"
 #include "itkDisplacementFieldTransform.h"
+#include "itkVectorLinearInterpolateImageFunction.h"
 
 #include "vnl/vnl_math.h"
 
+#include <typeinfo>
+
 namespace itk
 {
 template <unsigned int TDimension, class TReal>
@@ -43,6 +50,7 @@ ANTSImageTransformation<TDimension, TReal>
   this->m_InverseDisplacementField = ITK_NULLPTR;
   this->m_AffineTransform = ITK_NULLPTR;
   this->m_WriteComponentImages = false;
+  this->m_WriteFloatFields = false;
   m_DeformationRegionOfInterestSize.Fill(0);
   m_DeformationRegionSpacing.Fill(1);
   m_DeformationRegionOfInterestCenter.Fill(0);
@@ -53,6 +61,184 @@ void
 ANTSImageTransformation<TDimension, TReal>
 ::Compose()
 {
+  if( !this->m_AffineTransform || !this->m_DisplacementField )
+    {
+    return;
+    }
+
+  // the warp is applied first, so the field is only read where it is written
+  typedef ImageRegionIteratorWithIndex<DisplacementFieldType> IteratorType;
+  IteratorType It( this->m_DisplacementField, this->m_DisplacementField->GetLargestPossibleRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    typename DisplacementFieldType::PointType x;
+    this->m_DisplacementField->TransformIndexToPhysicalPoint( It.GetIndex(), x );
+    const VectorType                                  u = It.Get();
+    typename AffineTransformType::InputPointType      p;
+    for( unsigned int d = 0; d < TDimension; d++ )
+      {
+      p[d] = x[d] + u[d];
+      }
+    const typename AffineTransformType::OutputPointType y = this->m_AffineTransform->TransformPoint( p );
+    VectorType                                          v;
+    for( unsigned int d = 0; d < TDimension; d++ )
+      {
+      v[d] = static_cast<TReal>( y[d] - x[d] );
+      }
+    It.Set( v );
+    }
+}
+
+template <unsigned int TDimension, class TReal>
+void
+ANTSImageTransformation<TDimension, TReal>
+::ComposeInverse()
+{
+  if( !this->m_AffineTransform || !this->m_InverseDisplacementField )
+    {
+    return;
+    }
+
+  typename AffineTransformType::Pointer inverseAffineTransform = AffineTransformType::New();
+  if( !this->m_AffineTransform->GetInverse( inverseAffineTransform ) )
+    {
+    itkExceptionMacro( << "The affine transform is not invertible." );
+    }
+
+  // the inverse affine transform is applied first, so the inverse warp is
+  // interpolated elsewhere than where it is written
+  typedef VectorLinearInterpolateImageFunction<DisplacementFieldType, TComp> InterpolatorType;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage( this->m_InverseDisplacementField );
+
+  DisplacementFieldPointer composedField = DisplacementFieldType::New();
+  composedField->CopyInformation( this->m_InverseDisplacementField );
+  composedField->SetRegions( this->m_InverseDisplacementField->GetLargestPossibleRegion() );
+  composedField->Allocate();
+
+  typedef ImageRegionIteratorWithIndex<DisplacementFieldType> IteratorType;
+  IteratorType It( composedField, composedField->GetLargestPossibleRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    typename DisplacementFieldType::PointType y;
+    composedField->TransformIndexToPhysicalPoint( It.GetIndex(), y );
+    typename AffineTransformType::InputPointType p;
+    for( unsigned int d = 0; d < TDimension; d++ )
+      {
+      p[d] = y[d];
+      }
+    const typename AffineTransformType::OutputPointType q = inverseAffineTransform->TransformPoint( p );
+    typename InterpolatorType::PointType                z;
+    for( unsigned int d = 0; d < TDimension; d++ )
+      {
+      z[d] = q[d];
+      }
+    VectorType v;
+    if( interpolator->IsInsideBuffer( z ) )
+      {
+      const typename InterpolatorType::OutputType u = interpolator->Evaluate( z );
+      for( unsigned int d = 0; d < TDimension; d++ )
+        {
+        v[d] = static_cast<TReal>( z[d] + u[d] - y[d] );
+        }
+      }
+    else
+      {
+      for( unsigned int d = 0; d < TDimension; d++ )
+        {
+        v[d] = static_cast<TReal>( z[d] - y[d] );
+        }
+      }
+    It.Set( v );
+    }
+
+  this->m_InverseDisplacementField = composedField;
+}
+
+template <unsigned int TDimension, class TReal>
+void
+ANTSImageTransformation<TDimension, TReal>
+::WriteField( const FieldWriteTask & task ) const
+{
+  if( this->m_WriteFloatFields && typeid( TReal ) != typeid( float ) )
+    {
+    typename FloatDisplacementFieldType::Pointer floatField = FloatDisplacementFieldType::New();
+    floatField->CopyInformation( task.Field );
+    floatField->SetRegions( task.Field->GetLargestPossibleRegion() );
+    floatField->Allocate();
+
+    ImageRegionConstIterator<DisplacementFieldType> ItD( task.Field, task.Field->GetLargestPossibleRegion() );
+    ImageRegionIterator<FloatDisplacementFieldType> ItF( floatField, floatField->GetLargestPossibleRegion() );
+    for( ItD.GoToBegin(), ItF.GoToBegin(); !ItD.IsAtEnd(); ++ItD, ++ItF )
+      {
+      const VectorType u = ItD.Get();
+      FloatVectorType  v;
+      for( unsigned int d = 0; d < TDimension; d++ )
+        {
+        v[d] = static_cast<float>( u[d] );
+        }
+      ItF.Set( v );
+      }
+
+    typedef ImageFileWriter<FloatDisplacementFieldType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( task.FileName );
+    if( task.ImageIO )
+      {
+      writer->SetImageIO( task.ImageIO );
+      }
+    writer->SetInput( floatField );
+    writer->Update();
+    }
+  else
+    {
+    typedef ImageFileWriter<DisplacementFieldType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( task.FileName );
+    if( task.ImageIO )
+      {
+      writer->SetImageIO( task.ImageIO );
+      }
+    writer->SetInput( task.Field );
+    writer->Update();
+    }
+}
+
+template <unsigned int TDimension, class TReal>
+ITK_THREAD_RETURN_TYPE
+ANTSImageTransformation<TDimension, TReal>
+::WriteThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *threadInfo = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  WriteThreadStruct *              str = static_cast<WriteThreadStruct *>( threadInfo->UserData );
+
+  while( true )
+    {
+    unsigned int task;
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      if( str->Failed || str->NextTask >= str->Tasks.size() )
+        {
+        break;
+        }
+      task = str->NextTask++;
+      }
+    try
+      {
+      str->Transformation->WriteField( str->Tasks[task] );
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      if( !str->Failed )
+        {
+        str->Failed = true;
+        str->ErrorMessage = e.GetDescription();
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 template <unsigned int TDimension, class TReal>
@@ -189,54 +375,64 @@ ANTSImageTransformation<TDimension, TReal>
                                                   filename);
     }
 
+  // the warps are written concurrently, as their compression takes most of
+  // the time; the image IOs are created here as the object factory is not
+  // thread safe
+  WriteThreadStruct str;
+  str.Transformation = this;
+  str.NextTask = 0;
+  str.Failed = false;
+
   if( this->m_DisplacementField )
     {
     std::cout << " writing " << filePrefix << " def " <<  std::endl;
+    FieldWriteTask task;
+    task.Field = this->m_DisplacementField;
     if( extension != std::string( ".mha" ) )
       {
-      std::string filename = filePrefix + std::string( "Warp" )
-        + extension + gzExtension;
-
-      typedef ImageFileWriter<DisplacementFieldType> WriterType;
-      typename WriterType::Pointer writer = WriterType::New();
-      std::cout << "filename " << filename << std::endl;
-      writer->SetFileName( filename );
-      //            writer->SetUseAvantsNamingConvention( true );
-      writer->SetInput( this->m_DisplacementField );
-      writer->Update();
+      task.FileName = filePrefix + std::string( "Warp" ) + extension + gzExtension;
+      std::cout << "filename " << task.FileName << std::endl;
       }
     else
       {
-      std::string filename = filePrefix + std::string( "Warp.nii.gz" );
-      typedef ImageFileWriter<DisplacementFieldType> WriterType;
-      typename WriterType::Pointer writer = WriterType::New();
-      writer->SetFileName( filename );
-      writer->SetInput( this->m_DisplacementField );
-      writer->Update();
+      task.FileName = filePrefix + std::string( "Warp.nii.gz" );
       }
+    str.Tasks.push_back( task );
     }
 
   if( this->m_InverseDisplacementField )
     {
+    FieldWriteTask task;
+    task.Field = this->m_InverseDisplacementField;
     if( extension != std::string( ".mha" ) )
       {
-      std::string filename = filePrefix + std::string( "InverseWarp" )
-        + extension + gzExtension;
-      typedef ImageFileWriter<DisplacementFieldType> WriterType;
-      typename WriterType::Pointer writer = WriterType::New();
-      writer->SetFileName( filename );
-      //            writer->SetUseAvantsNamingConvention( true );
-      writer->SetInput( this->m_InverseDisplacementField );
-      writer->Update();
+      task.FileName = filePrefix + std::string( "InverseWarp" ) + extension + gzExtension;
       }
     else
       {
-      std::string filename = filePrefix + std::string( "InverseWarp.mha" );
-      typedef ImageFileWriter<DisplacementFieldType> WriterType;
-      typename WriterType::Pointer writer = WriterType::New();
-      writer->SetFileName( filename );
-      writer->SetInput( this->m_InverseDisplacementField );
-      writer->Update();
+      task.FileName = filePrefix + std::string( "InverseWarp.mha" );
+      }
+    str.Tasks.push_back( task );
+    }
+
+  for( unsigned int n = 0; n < str.Tasks.size(); n++ )
+    {
+    str.Tasks[n].ImageIO = ImageIOFactory::CreateImageIO( str.Tasks[n].FileName.c_str(), ImageIOFactory::WriteMode );
+    }
+
+  if( str.Tasks.size() == 1 )
+    {
+    this->WriteField( str.Tasks[0] );
+    }
+  else if( str.Tasks.size() > 1 )
+    {
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads( static_cast<ThreadIdType>( str.Tasks.size() ) );
+    threader->SetSingleMethod( Self::WriteThreaderCallback, &str );
+    threader->SingleMethodExecute();
+    if( str.Failed )
+      {
+      itkExceptionMacro( << str.ErrorMessage );
       }
     }
   }
@@ -251,6 +447,8 @@ ANTSImageTransformation<TDimension, TReal>
 ::PrintSelf( std::ostream& os, Indent indent) const
 {
   Superclass::PrintSelf( os, indent );
+  os << indent << "Write component images: " << this->m_WriteComponentImages << std::endl;
+  os << indent << "Write float fields: " << this->m_WriteFloatFields << std::endl;
 }
 } // end namespace itk
 #endif
@@ -29,6 +29,11 @@
 #include "itkCenteredTransformInitializer.h"
 #include  "itkTransformFileReader.h"
 #include "itkTransformFileWriter.h"
+#include "itkImageIOBase.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <vector>
 namespace itk
 {
 template <unsigned int TDimension = 3, class TReal = float>
@@ -154,15 +159,26 @@ public:
   /** Write the transformations out */
   void Write();
 
-  /** Concatenate all transformations  */
+  /** Concatenate all transformations: fold the affine transform into the
+      displacement field, in place, so that x + u(x) maps as the warp
+      followed by the affine transform did.  The affine transform is left
+      unchanged and should not be applied again with the composed field. */
   void Compose();
 
-  /** Concatenate all transformations in inverse direction */
+  /** Concatenate all transformations in inverse direction: fold the inverse
+      of the affine transform into the inverse displacement field, which is
+      resampled over its own lattice into a single new field. */
   void ComposeInverse();
 
   itkSetMacro( WriteComponentImages, bool );
   itkGetMacro( WriteComponentImages, bool );
   itkBooleanMacro( WriteComponentImages );
+
+  /** Write the displacement fields with float components whatever TReal is.
+      Each field is converted as it is written. */
+  itkSetMacro( WriteFloatFields, bool );
+  itkGetMacro( WriteFloatFields, bool );
+  itkBooleanMacro( WriteFloatFields );
 protected:
   ANTSImageTransformation();
   virtual ~ANTSImageTransformation()
@@ -175,6 +191,32 @@ private:
   ANTSImageTransformation( const Self & ); // purposely not implemented
   void operator=( const Self & );          // purposely not implemented
 
+  typedef itk::Vector<float, ImageDimension>          FloatVectorType;
+  typedef itk::Image<FloatVectorType, ImageDimension> FloatDisplacementFieldType;
+
+  /** A displacement field to write, its file name and its image IO. */
+  struct FieldWriteTask
+    {
+    DisplacementFieldPointer Field;
+    std::string              FileName;
+    ImageIOBase::Pointer     ImageIO;
+    };
+
+  struct WriteThreadStruct
+    {
+    Self *                      Transformation;
+    std::vector<FieldWriteTask> Tasks;
+    unsigned int                NextTask;
+    SimpleFastMutexLock         Mutex;
+    bool                        Failed;
+    std::string                 ErrorMessage;
+    };
+
+  static ITK_THREAD_RETURN_TYPE WriteThreaderCallback( void *arg );
+
+  /** Write one field, with the image IO created beforehand for its file. */
+  void WriteField( const FieldWriteTask & task ) const;
+
   AffineTransformPointer                m_AffineTransform;
   AffineTransformPointer                m_FixedImageAffineTransform;
   DisplacementFieldPointer              m_DisplacementField;
@@ -185,6 +227,7 @@ private:
   DisplacementFieldPointer m_InverseDisplacementField;
   std::string              m_NamingConvention;
   bool                     m_WriteComponentImages;
+  bool                     m_WriteFloatFields;
 };
 } // end namespace itk
 
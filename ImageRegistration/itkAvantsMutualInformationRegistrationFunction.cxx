@@ -25,6 +25,8 @@
 #include "vnl/vnl_math.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkMath.h"
+#include <algorithm>
 
 namespace itk
 {
@@ -81,6 +83,9 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
       interp.GetPointer() );
 
   this->m_RobustnessParameter = -1.e19;
+
+  this->m_SamplingStrategy = NONE;
+  this->m_SamplingPercentage = 1.0;
 }
 
 /**
@@ -115,6 +120,10 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
   os << m_MovingImageBinSize << std::endl;
   os << indent << "InterpolatorIsBSpline: ";
   os << m_InterpolatorIsBSpline << std::endl;
+  os << indent << "SamplingStrategy: ";
+  os << m_SamplingStrategy << std::endl;
+  os << indent << "SamplingPercentage: ";
+  os << m_SamplingPercentage << std::endl;
 }
 
 /**
@@ -330,51 +339,40 @@ void
 AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
 ::GetProbabilities()
 {
-  typedef ImageRegionConstIteratorWithIndex<FixedImageType> RandomIterator;
-  RandomIterator randIter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
   this->m_FixedImageMarginalPDF->FillBuffer(0);
   this->m_MovingImageMarginalPDF->FillBuffer(0);
 
-  // Reset the joint pdfs to zero
-  m_JointPDF->FillBuffer( 0.0 );
+  typename MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() );
 
-  unsigned long  nSamples = 0;
-  RandomIterator iter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
-  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+  const SizeValueType numberOfBins = this->m_JointPDF->GetBufferedRegion().GetNumberOfPixels();
+
+  std::vector<std::vector<double> > partialHistograms( threader->GetNumberOfThreads(),
+                                                       std::vector<double>( numberOfBins, 0.0 ) );
+  JointHistogramThreadStruct str;
+  str.Function = this;
+  str.PartialHistograms = &partialHistograms;
+  threader->SetSingleMethod( Self::JointHistogramThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  // pairwise (tree) reduction of the partial histograms
+  for( size_t stride = 1; stride < partialHistograms.size(); stride *= 2 )
     {
-    bool takesample = true;
-    if( this->m_FixedImageMask )
+    for( size_t t = 0; t + stride < partialHistograms.size(); t += 2 * stride )
       {
-      if( this->m_FixedImageMask->GetPixel( iter.GetIndex() ) < 1.e-6 )
+      std::vector<double> &       sum = partialHistograms[t];
+      const std::vector<double> & other = partialHistograms[t + stride];
+      for( SizeValueType b = 0; b < numberOfBins; b++ )
         {
-        takesample = false;
+        sum[b] += other[b];
         }
       }
+    }
 
-    if( takesample )
-      {
-      // Get sampled index
-      FixedImageIndexType index = iter.GetIndex();
-/*    bool inimage=true;
-    for (unsigned int dd=0; dd<ImageDimension; dd++)
-      {
-        if ( index[dd] < 1 ||    index[dd] >= static_cast<typename IndexType::IndexValueType>(imagesize[dd]-1) )
-          inimage=false;
-      }
-*/
-      double movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( index )  );
-      double fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( index )  );
-
-      /** add the paired intensity points to the joint histogram */
-      JointPDFPointType jointPDFpoint;
-      this->ComputeJointPDFPoint(fixedImageValue, movingImageValue, jointPDFpoint);
-      JointPDFIndexType jointPDFIndex;
-      jointPDFIndex.Fill(0);
-      this->m_JointPDF->TransformPhysicalPointToIndex(jointPDFpoint, jointPDFIndex);
-      this->m_JointPDF->SetPixel(jointPDFIndex, this->m_JointPDF->GetPixel(jointPDFIndex) + 1);
-
-      ++nSamples;
-      }
+  JointPDFValueType *pdfPtr = this->m_JointPDF->GetBufferPointer();
+  for( SizeValueType b = 0; b < numberOfBins; b++ )
+    {
+    pdfPtr[b] = static_cast<JointPDFValueType>( partialHistograms[0][b] );
     }
 
   /**
@@ -464,6 +462,135 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
     }
 }
 
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+ITK_THREAD_RETURN_TYPE
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::JointHistogramThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  JointHistogramThreadStruct *     str = static_cast<JointHistogramThreadStruct *>( info->UserData );
+
+  str->Function->ThreadedAccumulateJointHistogram( ( *str->PartialHistograms )[info->ThreadID], info->ThreadID,
+                                                   info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ThreadedAccumulateJointHistogram( std::vector<double> & histogram, ThreadIdType threadId,
+                                    ThreadIdType numberOfThreads )
+{
+  typedef typename FixedImageType::RegionType RegionType;
+
+  const RegionType region = this->m_FixedImage->GetLargestPossibleRegion();
+
+  // slabs along the slowest axis
+  const unsigned int  slabAxis = ImageDimension - 1;
+  const SizeValueType firstSlice = region.GetSize()[slabAxis] * threadId / numberOfThreads;
+  const SizeValueType lastSlice = region.GetSize()[slabAxis] * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlice >= lastSlice )
+    {
+    return;
+    }
+  RegionType slab = region;
+  slab.SetIndex( slabAxis, region.GetIndex()[slabAxis] + static_cast<IndexValueType>( firstSlice ) );
+  slab.SetSize( slabAxis, lastSlice - firstSlice );
+
+  // the bin of a sample is the nearest joint PDF index of its normalized
+  // intensities, as TransformPhysicalPointToIndex would give
+  const JointPDFPointType   origin = this->m_JointPDF->GetOrigin();
+  const JointPDFSpacingType spacing = this->m_JointPDF->GetSpacing();
+  const IndexValueType      lastBin = static_cast<IndexValueType>( this->m_NumberOfHistogramBins ) - 1;
+
+  const bool            sample = this->m_SamplingStrategy != NONE && this->m_SamplingPercentage < 1.0;
+  const OffsetValueType step = std::max( static_cast<OffsetValueType>( 1.0 / this->m_SamplingPercentage + 0.5 ),
+                                         static_cast<OffsetValueType>( 1 ) );
+  vnl_random            randgen;
+  IndexValueType        currentSlice = region.GetIndex()[slabAxis] - 1;
+
+  ImageRegionConstIteratorWithIndex<FixedImageType> iter( this->m_FixedImage, slab );
+  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+    {
+    const FixedImageIndexType index = iter.GetIndex();
+    if( sample && this->m_SamplingStrategy == REGULAR && this->m_FixedImage->ComputeOffset( index ) % step != 0 )
+      {
+      continue;
+      }
+    if( sample && this->m_SamplingStrategy == RANDOM )
+      {
+      // reseeding per slice keeps the subset independent of the slab split
+      if( index[slabAxis] != currentSlice )
+        {
+        currentSlice = index[slabAxis];
+        randgen.reseed( 19650218 + static_cast<unsigned long>( currentSlice - region.GetIndex()[slabAxis] ) );
+        }
+      if( randgen.drand64() >= this->m_SamplingPercentage )
+        {
+        continue;
+        }
+      }
+    if( this->m_FixedImageMask && this->m_FixedImageMask->GetPixel( index ) < 1.e-6 )
+      {
+      continue;
+      }
+
+    const double movingImageValue = this->GetMovingParzenTerm( this->m_MovingImage->GetPixel( index ) );
+    const double fixedImageValue = this->GetFixedParzenTerm( iter.Get() );
+
+    JointPDFPointType jointPDFpoint;
+    this->ComputeJointPDFPoint( fixedImageValue, movingImageValue, jointPDFpoint );
+
+    IndexValueType bin[2];
+    for( unsigned int d = 0; d < 2; d++ )
+      {
+      bin[d] = Math::RoundHalfIntegerUp<IndexValueType>( ( jointPDFpoint[d] - origin[d] ) / spacing[d] );
+      bin[d] = std::min( std::max( bin[d], static_cast<IndexValueType>( 0 ) ), lastBin );
+      }
+    histogram[bin[0] + bin[1] * this->m_NumberOfHistogramBins] += 1.0;
+    }
+}
+
+/**
+ * Compute the update of the whole region in one pass
+ */
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+bool
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                      const FixedImageType *mask,
+                      const typename DisplacementFieldType::RegionType & region, void * /* globalData */ )
+{
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+
+  // the kernel reads all the buffers with the offsets of the update field
+  const typename DisplacementFieldType::RegionType buffered = update->GetBufferedRegion();
+  if( !fixedImage || !movingImage ||
+      fixedImage->GetBufferedRegion() != buffered || movingImage->GetBufferedRegion() != buffered ||
+      ( updateInv && updateInv->GetBufferedRegion() != buffered ) ||
+      ( mask && mask->GetBufferedRegion() != buffered ) )
+    {
+    return false;
+    }
+
+  UpdateFieldKernel kernel;
+  kernel.Function = this;
+  kernel.FixedValues = fixedImage->GetBufferPointer();
+  kernel.MovingValues = movingImage->GetBufferPointer();
+  kernel.OffsetTable = fixedImage->GetOffsetTable();
+  kernel.FixedSize = fixedImage->GetLargestPossibleRegion().GetSize();
+  kernel.MovingSize = movingImage->GetLargestPossibleRegion().GetSize();
+  kernel.FixedSpacing = fixedImage->GetSpacing();
+  kernel.MovingSpacing = movingImage->GetSpacing();
+  kernel.FixedGradient.SetImage( fixedImage );
+  kernel.MovingGradient.SetImage( movingImage );
+
+  this->ApplyUpdateFieldKernel( kernel, update, updateInv, mask, region );
+  return true;
+}
+
 /**
  * Get the both Value and Derivative Measure
  */
@@ -474,13 +601,19 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
                         MeasureType & /* valuei */,
                         DerivativeType & /* derivative1 */, DerivativeType & /* derivative2 */)
 {
-  double         value = 0;
-  DerivativeType zero(ImageDimension);
+  return this->GetValueAndDerivative( this->m_FixedImage->GetPixel( oindex ),
+                                      this->m_MovingImage->GetPixel( oindex ) );
+}
 
-  zero.Fill(0);
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+double
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::GetValueAndDerivative( double fixedValue, double movingValue )
+{
+  double value = 0;
 
-  double movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( oindex )  );
-  double fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( oindex )  );
+  double movingImageValue = this->GetMovingParzenTerm( movingValue );
+  double fixedImageValue = this->GetFixedParzenTerm( fixedValue );
 
   JointPDFPointType pdfind;
   this->ComputeJointPDFPoint(fixedImageValue, movingImageValue, pdfind);
@@ -514,13 +647,19 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
                            MeasureType & /* valuei */,
                            DerivativeType & /* derivative1 */, DerivativeType & /* derivative2 */)
 {
-  double         value = 0;
-  DerivativeType zero(ImageDimension);
+  return this->GetValueAndDerivativeInv( this->m_FixedImage->GetPixel( oindex ),
+                                         this->m_MovingImage->GetPixel( oindex ) );
+}
 
-  zero.Fill(0);
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+double
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::GetValueAndDerivativeInv( double fixedValue, double movingValue )
+{
+  double value = 0;
 
-  double movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( oindex )  );
-  double fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( oindex )  );
+  double movingImageValue = this->GetMovingParzenTerm( movingValue );
+  double fixedImageValue = this->GetFixedParzenTerm( fixedValue );
 
   JointPDFPointType pdfind;
   this->ComputeJointPDFPoint(fixedImageValue, movingImageValue, pdfind);
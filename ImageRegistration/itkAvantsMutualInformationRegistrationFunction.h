@@ -37,6 +37,9 @@
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkSpatialObject.h"
 #include "itkConstNeighborhoodIterator.h"
+#include "itkMultiThreader.h"
+#include <vnl/vnl_random.h>
+#include <vector>
 
 namespace itk
 {
@@ -274,6 +277,11 @@ public:
   double GetValueAndDerivativeInv( IndexType index, MeasureType& Value, DerivativeType& Derivative1,
                                    DerivativeType& Derivative2 );
 
+  /** The same terms from the fixed and moving image values at a voxel. */
+  double GetValueAndDerivative( double fixedImageValue, double movingImageValue );
+
+  double GetValueAndDerivativeInv( double fixedImageValue, double movingImageValue );
+
   /** Number of spatial samples to used to compute metric */
   //  itkSetClampMacro( NumberOfSpatialSamples, unsigned long,
   //                1, NumericTraits<unsigned long>::max() );
@@ -293,6 +301,18 @@ public:
     return m_NumberOfHistogramBins;
   }
 
+  /** Fixed image voxels binned into the joint histogram.  The metric
+   * derivative is still computed at every voxel; only the histogram
+   * estimate is subsampled.  REGULAR keeps every round(1/percentage)-th
+   * voxel, RANDOM keeps each voxel with probability percentage.  The random
+   * subset is drawn per slice from a fixed seed, so it is the same at every
+   * iteration and for any number of threads. */
+  enum SamplingStrategyType { NONE, REGULAR, RANDOM };
+  itkSetMacro( SamplingStrategy, SamplingStrategyType );
+  itkGetConstMacro( SamplingStrategy, SamplingStrategyType );
+  itkSetClampMacro( SamplingPercentage, double, 1.e-6, 1.0 );
+  itkGetConstMacro( SamplingPercentage, double );
+
   void SetTransform(TransformPointer t)
   {
     m_Transform = t;
@@ -584,6 +604,14 @@ public:
     return (double) this->m_Padding + windowTerm * (float)(this->m_NumberOfHistogramBins - this->m_Padding);
   }
 
+  /** ComputeUpdate and ComputeUpdateInv over region in one threaded pass,
+   * from the buffers of the images.  Returns false if they do not share the
+   * buffered region of the update field. */
+  virtual bool ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                                   const FixedImageType *mask,
+                                   const typename DisplacementFieldType::RegionType & region,
+                                   void *globalData ) ITK_OVERRIDE;
+
   virtual VectorType ComputeUpdate(const NeighborhoodType & neighborhood,
                                    void * /* globalData */,
                                    const FloatOffsetType & /* offset */ = FloatOffsetType(0.0) ) ITK_OVERRIDE
@@ -700,6 +728,84 @@ private:
 
   typename JointPDFDerivativesType::Pointer m_JointPDFDerivatives;
 
+  /** The voxelwise kernel of ComputeUpdateField:  ComputeUpdate and, if
+   * there is an inverse field, ComputeUpdateInv at buffer offset o. */
+  class UpdateFieldKernel
+  {
+public:
+    typedef typename Superclass::template CentralDifferenceKernel<FixedImageType>  FixedGradientKernelType;
+    typedef typename Superclass::template CentralDifferenceKernel<MovingImageType> MovingGradientKernelType;
+    typedef typename FixedGradientKernelType::GradientType                          GradientType;
+
+    Self *                                      Function;
+    const typename FixedImageType::PixelType *  FixedValues;
+    const typename MovingImageType::PixelType * MovingValues;
+    const OffsetValueType *                     OffsetTable;
+    typename FixedImageType::SizeType           FixedSize;
+    typename MovingImageType::SizeType          MovingSize;
+    typename FixedImageType::SpacingType        FixedSpacing;
+    typename MovingImageType::SpacingType       MovingSpacing;
+    FixedGradientKernelType                     FixedGradient;
+    MovingGradientKernelType                    MovingGradient;
+
+    static bool IsInside( const IndexType & index, const SizeType & size )
+    {
+      for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+        {
+        if( index[dd] < 1 ||
+            index[dd] >= static_cast<typename IndexType::IndexValueType>(size[dd] - 1) )
+          {
+          return false;
+          }
+        }
+      return true;
+    }
+
+    void operator()( const IndexType & index, OffsetValueType o, const bool *interior,
+                     typename VectorType::ValueType maskprob, VectorType *update, VectorType *updateInv,
+                     double & /* energy */ ) const
+    {
+      const double fixedValue = this->FixedValues[o];
+      const double movingValue = this->MovingValues[o];
+
+      VectorType   deriv;
+      GradientType gradient;
+      if( IsInside( index, this->MovingSize ) )
+        {
+        this->MovingGradient.Evaluate( o, this->OffsetTable, interior, gradient );
+        const double loce = this->Function->GetValueAndDerivativeInv( fixedValue, movingValue );
+        for( unsigned int imd = 0; imd < ImageDimension; imd++ )
+          {
+          deriv[imd] = loce * gradient[imd] * this->MovingSpacing[imd];
+          }
+        *update += deriv * maskprob;
+        }
+      if( updateInv && IsInside( index, this->FixedSize ) )
+        {
+        this->FixedGradient.Evaluate( o, this->OffsetTable, interior, gradient );
+        const double loce = this->Function->GetValueAndDerivative( fixedValue, movingValue );
+        for( unsigned int imd = 0; imd < ImageDimension; imd++ )
+          {
+          deriv[imd] = loce * gradient[imd] * this->FixedSpacing[imd];
+          }
+        *updateInv += deriv * maskprob;
+        }
+    }
+  };
+
+  /** The joint histogram is binned by slabs of the fixed image, one partial
+   * histogram per thread, and the partials are summed pairwise. */
+  struct JointHistogramThreadStruct
+    {
+    Self *Function;
+    std::vector<std::vector<double> > *PartialHistograms;
+    };
+
+  void ThreadedAccumulateJointHistogram( std::vector<double> & histogram, ThreadIdType threadId,
+                                         ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE JointHistogramThreaderCallback( void *arg );
+
   /** Typedefs for BSpline kernel and derivative functions. */
   typedef BSplineKernelFunction<3> CubicBSplineFunctionType;
   typedef BSplineDerivativeKernelFunction<3>
@@ -788,6 +894,9 @@ private:
 
   unsigned int        m_Padding;
   JointPDFSpacingType m_JointPDFSpacing;
+
+  SamplingStrategyType m_SamplingStrategy;
+  double               m_SamplingPercentage;
 };
 } // end namespace itk
 
@@ -16,7 +16,14 @@
 #include "antsAllocImage.h"
 #include "itkPDEDeformableRegistrationFunction.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkCovariantVector.h"
+#include "itkMultiThreader.h"
 #include "itkPointSet.h"
+
+#include <algorithm>
+#include <vector>
+
 namespace itk
 {
 /** \class AvantsPDEDeformableRegistrationFunction
@@ -183,6 +190,22 @@ public:
     return 0.0;
   }
 
+  /** Whole-field update for metrics whose force is a voxelwise expression of
+   * the images: add the update (and the inverse update if updateInv is
+   * given), weighted by the mask, to every voxel of region in one pass.
+   * region is the non-boundary face of the fields for the radius of the
+   * function, i.e. the voxels the neighborhood loop of the ANTS optimizer
+   * visits.  The mask weight is clamped to 1 and voxels below 0.1 are
+   * skipped, as in that loop.  Returns false if the metric has no such
+   * kernel, and the caller then visits the neighborhoods. */
+  virtual bool ComputeUpdateField( DisplacementFieldType * /* update */, DisplacementFieldType * /* updateInv */,
+                                   const FixedImageType * /* mask */,
+                                   const typename DisplacementFieldType::RegionType & /* region */,
+                                   void * /* globalData */ )
+  {
+    return false;
+  }
+
   virtual VectorType ComputeUpdateInv(const NeighborhoodType & neighborhood,
                                       void * /* globalData */,
                                       const FloatOffsetType & /* offset */ = FloatOffsetType(0.0) )
@@ -322,6 +345,96 @@ protected:
   {
   }
 
+  /** The central differences of CentralDifferenceImageFunction from the raw
+   * buffer of an image:  zero along the axes on whose first or last voxel the
+   * offset lies, scaled by the spacing and oriented by the image direction. */
+  template <class TImage>
+  class CentralDifferenceKernel
+  {
+public:
+    typedef CovariantVector<double, ImageDimension> GradientType;
+
+    CentralDifferenceKernel() : m_Image( ITK_NULLPTR ), m_Buffer( ITK_NULLPTR ), m_Orient( false )
+    {
+    }
+
+    void SetImage( const TImage *image )
+    {
+      typename TImage::DirectionType identity;
+      identity.SetIdentity();
+
+      this->m_Image = image;
+      this->m_Buffer = image->GetBufferPointer();
+      this->m_Orient = ( image->GetDirection() != identity );
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        this->m_Scale[d] = 0.5 / image->GetSpacing()[d];
+        }
+    }
+
+    void Evaluate( OffsetValueType o, const OffsetValueType *offsetTable, const bool *interior,
+                   GradientType & gradient ) const
+    {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        gradient[d] = interior[d] ?
+          ( static_cast<double>( this->m_Buffer[o + offsetTable[d]] ) - this->m_Buffer[o - offsetTable[d]] ) *
+          this->m_Scale[d] : 0.0;
+        }
+      if( this->m_Orient )
+        {
+        this->m_Image->TransformLocalVectorToPhysicalVector( GradientType( gradient ), gradient );
+        }
+    }
+
+private:
+    const TImage *                     m_Image;
+    const typename TImage::PixelType * m_Buffer;
+    double                             m_Scale[ImageDimension];
+    bool                               m_Orient;
+  };
+
+  /** Runs a voxelwise update kernel over region of the fields, threaded over
+   * slabs of the slowest axis, and returns the sum of the energies of the
+   * threads.  The kernel is a functor called as
+   *
+   *   kernel( index, offset, interior, maskWeight, update, updateInv, energy )
+   *
+   * with the index and buffer offset of the voxel, whether it is off the
+   * first and last voxel of each axis of the buffer, the mask weight, the
+   * voxel of each field to add to (updateInv is ITK_NULLPTR if there is no
+   * inverse field) and the energy of the thread.  It is a template argument,
+   * so each metric's kernel is compiled for the dimension and pixel types of
+   * the run and inlined, with no virtual call or neighborhood per voxel.  All
+   * the images the kernel reads must share the buffered region of the
+   * update field. */
+  template <class TKernel>
+  double ApplyUpdateFieldKernel( const TKernel & kernel, DisplacementFieldType *update,
+                                 DisplacementFieldType *updateInv, const FixedImageType *mask,
+                                 const typename DisplacementFieldType::RegionType & region )
+  {
+    UpdateFieldKernelThreadStruct<TKernel> str;
+    str.Kernel = &kernel;
+    str.Update = update;
+    str.UpdateInv = updateInv;
+    str.Mask = mask;
+    str.Region = region;
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( MultiThreader::GetGlobalDefaultNumberOfThreads(),
+      static_cast<ThreadIdType>( region.GetSize()[ImageDimension - 1] ) ), static_cast<ThreadIdType>( 1 ) ) );
+    str.Energies.assign( threader->GetNumberOfThreads(), 0.0 );
+    threader->SetSingleMethod( Self::template UpdateFieldKernelThreaderCallback<TKernel>, &str );
+    threader->SingleMethodExecute();
+
+    double energy = 0.0;
+    for( unsigned int t = 0; t < str.Energies.size(); t++ )
+      {
+      energy += str.Energies[t];
+      }
+    return energy;
+  }
+
   mutable double m_BestEnergy;
   mutable double m_LastLastEnergy;
   mutable double m_MaxAllowedStep;
@@ -341,6 +454,96 @@ protected:
 private:
   AvantsPDEDeformableRegistrationFunction(const Self &); // purposely not implemented
   void operator=(const Self &);                          // purposely not implemented
+
+  template <class TKernel>
+  struct UpdateFieldKernelThreadStruct
+    {
+    const TKernel *Kernel;
+    DisplacementFieldType *Update;
+    DisplacementFieldType *UpdateInv;
+    const FixedImageType *Mask;
+    typename DisplacementFieldType::RegionType Region;
+    std::vector<double> Energies;
+    };
+
+  template <class TKernel>
+  static ITK_THREAD_RETURN_TYPE UpdateFieldKernelThreaderCallback( void *arg )
+  {
+    typedef typename DisplacementFieldType::RegionType RegionType;
+    typedef typename VectorType::ValueType             WeightType;
+
+    MultiThreader::ThreadInfoStruct *       info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+    UpdateFieldKernelThreadStruct<TKernel> *str = static_cast<UpdateFieldKernelThreadStruct<TKernel> *>(
+        info->UserData );
+
+    // the slab of the slowest axis of the region
+    const unsigned int  slabAxis = ImageDimension - 1;
+    RegionType          slab = str->Region;
+    const SizeValueType numberOfSlices = slab.GetSize()[slabAxis];
+    const SizeValueType firstSlice = numberOfSlices * info->ThreadID / info->NumberOfThreads;
+    const SizeValueType lastSlice = numberOfSlices * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    if( firstSlice >= lastSlice )
+      {
+      return ITK_THREAD_RETURN_VALUE;
+      }
+    slab.SetIndex( slabAxis, slab.GetIndex()[slabAxis] + static_cast<IndexValueType>( firstSlice ) );
+    slab.SetSize( slabAxis, lastSlice - firstSlice );
+
+    const RegionType                    buffered = str->Update->GetBufferedRegion();
+    const typename RegionType::IndexType start = buffered.GetIndex();
+    const typename RegionType::SizeType  size = buffered.GetSize();
+
+    const OffsetValueType *                    offsetTable = str->Update->GetOffsetTable();
+    VectorType *                               updateBuffer = str->Update->GetBufferPointer();
+    VectorType *                               updateInvBuffer = str->UpdateInv ?
+      str->UpdateInv->GetBufferPointer() : ITK_NULLPTR;
+    const typename FixedImageType::PixelType * maskBuffer = str->Mask ? str->Mask->GetBufferPointer() : ITK_NULLPTR;
+
+    const TKernel &     kernel = *str->Kernel;
+    const SizeValueType lineLength = slab.GetSize()[0];
+    double              energy = 0.0;
+
+    ImageLinearConstIteratorWithIndex<DisplacementFieldType> lineIt( str->Update, slab );
+    lineIt.SetDirection( 0 );
+    for( lineIt.GoToBegin(); !lineIt.IsAtEnd(); lineIt.NextLine() )
+      {
+      IndexType             index = lineIt.GetIndex();
+      const IndexValueType  lineStart = index[0];
+      const OffsetValueType lineOffset = str->Update->ComputeOffset( index );
+
+      bool interior[ImageDimension];
+      for( unsigned int d = 1; d < ImageDimension; d++ )
+        {
+        interior[d] = ( index[d] > start[d] && index[d] + 1 < start[d] + static_cast<IndexValueType>( size[d] ) );
+        }
+      for( SizeValueType i = 0; i < lineLength; i++ )
+        {
+        const OffsetValueType o = lineOffset + static_cast<OffsetValueType>( i );
+
+        WeightType maskprob = 1.0;
+        if( maskBuffer )
+          {
+          maskprob = maskBuffer[o];
+          if( maskprob > 1.0 )
+            {
+            maskprob = 1.0;
+            }
+          if( maskprob < 0.1 )
+            {
+            continue;
+            }
+          }
+
+        index[0] = lineStart + static_cast<IndexValueType>( i );
+        interior[0] = ( index[0] > start[0] && index[0] + 1 < start[0] + static_cast<IndexValueType>( size[0] ) );
+        kernel( index, o, interior, maskprob, updateBuffer + o,
+                updateInvBuffer ? updateInvBuffer + o : ITK_NULLPTR, energy );
+        }
+      }
+    str->Energies[info->ThreadID] = energy;
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
 };
 } // end namespace itk
 
@@ -18,13 +18,12 @@
 #include "itkExceptionObject.h"
 #include "vnl/vnl_math.h"
 #include "itkImageFileWriter.h"
-#include "itkImageLinearConstIteratorWithIndex.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkMeanImageFilter.h"
 #include "itkMedianImageFilter.h"
-#include "itkImageFileWriter.h"
-
-#include <deque>
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkMultiThreader.h"
 
 namespace itk
 {
@@ -161,219 +160,252 @@ CrossCorrelationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementFie
     finitediffimages[4] = this->MakeImage();
     }
 
-  // float sig=15.;
+  //
+  // The local sums sf, sm, sff, smm and sfm are computed with a separable
+  // running-sum box filter so that the cost per voxel does not depend on the
+  // neighborhood radius.
+  //
+  this->ComputeLocalStatisticsWithRunningSums();
+
+  // m_FixedImageGradientCalculator->SetInputImage(finitediffimages[0]);
+
+  m_MaxMag = 0.0;
+  m_MinMag = 9.e9;
+  m_AvgMag = 0.0;
+  m_Iteration++;
+}
+
+/*
+ * Compute the local correlation statistics with separable running sums
+ */
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+CrossCorrelationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ComputeLocalStatisticsWithRunningSums()
+{
+  const SizeType size = this->finitediffimages[0]->GetLargestPossibleRegion().GetSize();
+
+  SizeValueType numberOfVoxels = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    this->m_RunningSumStride[d] = numberOfVoxels;
+    numberOfVoxels *= size[d];
+    }
+  for( unsigned int k = 0; k < NumberOfRunningSums; k++ )
+    {
+    this->m_RunningSums[k].resize( numberOfVoxels );
+    }
+
+  typename MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() );
 
-  RadiusType r;
-  for( unsigned int j = 0; j < ImageDimension; j++ )
+  // Pass 0 fills the per-voxel products, passes 1..ImageDimension box-filter
+  // along each axis in turn and the last pass forms the centered statistics.
+  RunningSumThreadStruct str;
+  str.Function = this;
+  for( unsigned int pass = 0; pass < ImageDimension + 2; pass++ )
     {
-    r[j] = this->GetRadius()[j];
+    str.Pass = pass;
+    threader->SetSingleMethod( Self::RunningSumThreaderCallback, &str );
+    threader->SingleMethodExecute();
     }
+}
 
-  typedef itk::ImageRegionIteratorWithIndex<TFixedImage> Iterator;
-  Iterator tIter(this->GetFixedImage(), this->GetFixedImage()->GetLargestPossibleRegion() );
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+ITK_THREAD_RETURN_TYPE
+CrossCorrelationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::RunningSumThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  RunningSumThreadStruct *         str = static_cast<RunningSumThreadStruct *>( info->UserData );
 
-  // compute local means
-  //  typedef itk::ImageRegionIteratorWithIndex<MetricImageType> Iterator;
+  str->Function->ThreadedRunningSumPass( str->Pass, info->ThreadID, info->NumberOfThreads );
 
-  //
-  // The following change was made to speed up the correlation calculation.
-  //
+  return ITK_THREAD_RETURN_VALUE;
+}
 
-  typedef std::deque<float> SumQueueType;
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+CrossCorrelationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ThreadedRunningSumPass( unsigned int pass, ThreadIdType threadId, ThreadIdType numberOfThreads )
+{
+  typedef typename FixedImageType::RegionType RegionType;
 
-  SumQueueType Qsuma2;
-  SumQueueType Qsumb2;
-  SumQueueType Qsuma;
-  SumQueueType Qsumb;
-  SumQueueType Qsumab;
-  SumQueueType Qcount;
+  const RegionType region = this->finitediffimages[0]->GetLargestPossibleRegion();
+  const SizeType   size = region.GetSize();
 
-  ImageLinearConstIteratorWithIndex<MetricImageType> outIter( this->finitediffimages[0],
-                                                              this->finitediffimages[0]->GetLargestPossibleRegion() );
-  outIter.SetDirection( 0 );
-  outIter.GoToBegin();
-  while( !outIter.IsAtEnd() )
+  if( pass == 0 || pass == ImageDimension + 1 )
     {
-    // Push the zeros onto the stack that are outsized the image boundary at
-    // the beginning of the line.
-    Qsuma2 = SumQueueType( r[0], 0.0 );
-    Qsumb2 = SumQueueType( r[0], 0.0 );
-    Qsuma = SumQueueType( r[0], 0.0 );
-    Qsumb = SumQueueType( r[0], 0.0 );
-    Qsumab = SumQueueType( r[0], 0.0 );
-    Qcount = SumQueueType( r[0], 0.0 );
-
-    NeighborhoodIterator<MetricImageType> hoodIt(
-      this->GetRadius(),
-      this->finitediffimages[0],
-      this->finitediffimages[0]->GetLargestPossibleRegion() );
-    IndexType oindex = outIter.GetIndex();
-    hoodIt.SetLocation( oindex );
-    unsigned int hoodlen = hoodIt.Size();
-    // Now add the rest of the values from each hyperplane
-    for( unsigned int i = r[0]; i < ( 2 * r[0] + 1 ); i++ )
+    // voxelwise passes are split into slabs along the slowest axis
+    const unsigned int  slabAxis = ImageDimension - 1;
+    const SizeValueType firstSlice = size[slabAxis] * threadId / numberOfThreads;
+    const SizeValueType lastSlice = size[slabAxis] * ( threadId + 1 ) / numberOfThreads;
+    if( firstSlice >= lastSlice )
       {
-      float suma2 = 0.0;
-      float sumb2 = 0.0;
-      float suma = 0.0;
-      float sumb = 0.0;
-      float sumab = 0.0;
-      float count = 0.0;
-      for( unsigned int indct = i; indct < hoodlen; indct += ( 2 * r[0] + 1 ) )
-        {
-        bool isInBounds = true;
-        hoodIt.GetPixel( indct, isInBounds );
-        IndexType index = hoodIt.GetIndex( indct );
+      return;
+      }
 
-        if( !isInBounds || ( this->m_FixedImageMask &&
-                             this->m_FixedImageMask->GetPixel( index ) < 0.25 ) )
-          {
-          continue;
-          }
+    RegionType slab = region;
+    slab.SetIndex( slabAxis, region.GetIndex()[slabAxis] + static_cast<IndexValueType>( firstSlice ) );
+    slab.SetSize( slabAxis, lastSlice - firstSlice );
 
-        float a = this->GetFixedImage()->GetPixel( index );
-        float b = this->GetMovingImage()->GetPixel( index );
+    SizeValueType offset = firstSlice * this->m_RunningSumStride[slabAxis];
 
-        suma2 += a * a;
-        sumb2 += b * b;
-        suma += a;
-        sumb += b;
-        sumab += a * b;
-        count += 1.0;
-        }
+    ImageRegionConstIterator<FixedImageType>  ItF( this->GetFixedImage(), slab );
+    ImageRegionConstIterator<MovingImageType> ItM( this->GetMovingImage(), slab );
 
-      Qsuma2.push_back( suma2 );
-      Qsumb2.push_back( sumb2 );
-      Qsuma.push_back( suma );
-      Qsumb.push_back( sumb );
-      Qsumab.push_back( sumab );
-      Qcount.push_back( count );
-      }
-
-    while( !outIter.IsAtEndOfLine() )
+    if( pass == 0 )
       {
-      // Test to see if there are any voxels we need to handle in the current
-      // window.
-
-      float suma2 = 0.0;
-      float sumb2 = 0.0;
-      float suma = 0.0;
-      float sumb = 0.0;
-      float sumab = 0.0;
-      float count = 0.0;
-
-      typename SumQueueType::iterator itcount = Qcount.begin();
-      while( itcount != Qcount.end() )
+      ImageRegionConstIterator<MetricImageType> ItMask;
+      if( this->m_FixedImageMask )
         {
-        count += *itcount;
-        ++itcount;
+        ItMask = ImageRegionConstIterator<MetricImageType>( this->m_FixedImageMask, slab );
         }
-
-      // If there are values, we need to calculate the different quantities
-      if( count > 0 )
+      for( ItF.GoToBegin(), ItM.GoToBegin(); !ItF.IsAtEnd(); ++ItF, ++ItM, ++offset )
         {
-        typename SumQueueType::iterator ita2 = Qsuma2.begin();
-        typename SumQueueType::iterator itb2 = Qsumb2.begin();
-        typename SumQueueType::iterator ita = Qsuma.begin();
-        typename SumQueueType::iterator itb = Qsumb.begin();
-        typename SumQueueType::iterator itab = Qsumab.begin();
-
-        while( ita2 != Qsuma2.end() )
+        bool isInMask = true;
+        if( this->m_FixedImageMask )
           {
-          suma2 += *ita2;
-          sumb2 += *itb2;
-          suma += *ita;
-          sumb += *itb;
-          sumab += *itab;
-
-          ++ita2;
-          ++itb2;
-          ++ita;
-          ++itb;
-          ++itab;
+          isInMask = ( ItMask.Get() >= 0.25 );
+          ++ItMask;
           }
+        const float a = isInMask ? static_cast<float>( ItF.Get() ) : 0.0;
+        const float b = isInMask ? static_cast<float>( ItM.Get() ) : 0.0;
+
+        this->m_RunningSums[0][offset] = a;
+        this->m_RunningSums[1][offset] = b;
+        this->m_RunningSums[2][offset] = a * a;
+        this->m_RunningSums[3][offset] = b * b;
+        this->m_RunningSums[4][offset] = a * b;
+        this->m_RunningSums[5][offset] = isInMask ? 1.0 : 0.0;
+        }
+      }
+    else
+      {
+      ImageRegionIterator<MetricImageType> ItA( this->finitediffimages[0], slab );
+      ImageRegionIterator<MetricImageType> ItB( this->finitediffimages[1], slab );
+      ImageRegionIterator<MetricImageType> ItFM( this->finitediffimages[2], slab );
+      ImageRegionIterator<MetricImageType> ItFF( this->finitediffimages[3], slab );
+      ImageRegionIterator<MetricImageType> ItMM( this->finitediffimages[4], slab );
+      for( ItF.GoToBegin(), ItM.GoToBegin(); !ItF.IsAtEnd();
+           ++ItF, ++ItM, ++ItA, ++ItB, ++ItFM, ++ItFF, ++ItMM, ++offset )
+        {
+        const float count = this->m_RunningSums[5][offset];
+        if( count > 0 )
+          {
+          const float suma = this->m_RunningSums[0][offset];
+          const float sumb = this->m_RunningSums[1][offset];
+          const float suma2 = this->m_RunningSums[2][offset];
+          const float sumb2 = this->m_RunningSums[3][offset];
+          const float sumab = this->m_RunningSums[4][offset];
+
+          const float fixedMean = suma / count;
+          const float movingMean = sumb / count;
+
+          const float sff = suma2 - fixedMean * suma - fixedMean * suma + count * fixedMean * fixedMean;
+          const float smm = sumb2 - movingMean * sumb - movingMean * sumb + count * movingMean * movingMean;
+          const float sfm = sumab - movingMean * suma - fixedMean * sumb + count * movingMean * fixedMean;
+
+          ItA.Set( ItF.Get() - fixedMean );
+          ItB.Set( ItM.Get() - movingMean );
+          ItFM.Set( sfm ); // A
+          ItFF.Set( sff ); // B
+          ItMM.Set( smm ); // C
+          }
+        }
+      }
+    return;
+    }
 
-        float fixedMean = suma / count;
-        float movingMean = sumb / count;
-
-        float sff = suma2 - fixedMean * suma - fixedMean * suma + count * fixedMean * fixedMean;
-        float smm = sumb2 - movingMean * sumb - movingMean * sumb + count * movingMean * movingMean;
-        float sfm = sumab - movingMean * suma - fixedMean * sumb + count * movingMean * fixedMean;
+  // separable box filter along one axis:  every line is independent so the
+  // lines are distributed across the threads.
+  const unsigned int  axis = pass - 1;
+  const SizeValueType lineLength = size[axis];
+  const SizeValueType stride = this->m_RunningSumStride[axis];
+  const SizeValueType numberOfLines = region.GetNumberOfPixels() / lineLength;
+  const SizeValueType radius = this->GetRadius()[axis];
 
-        IndexType _oindex = outIter.GetIndex();
+  const SizeValueType firstLine = numberOfLines * threadId / numberOfThreads;
+  const SizeValueType lastLine = numberOfLines * ( threadId + 1 ) / numberOfThreads;
 
-        float val = this->GetFixedImage()->GetPixel( _oindex ) - fixedMean;
-        this->finitediffimages[0]->SetPixel( _oindex, val );
-        val = this->GetMovingImage()->GetPixel( _oindex ) - movingMean;
-        this->finitediffimages[1]->SetPixel( _oindex, val );
-        this->finitediffimages[2]->SetPixel( _oindex, sfm ); // A
-        this->finitediffimages[3]->SetPixel( _oindex, sff ); // B
-        this->finitediffimages[4]->SetPixel( _oindex, smm ); // C
+  std::vector<double> line( lineLength );
+  for( SizeValueType l = firstLine; l < lastLine; l++ )
+    {
+    const SizeValueType base = ( l / stride ) * stride * lineLength + l % stride;
+    for( unsigned int k = 0; k < NumberOfRunningSums; k++ )
+      {
+      float *data = &( this->m_RunningSums[k][0] );
+      for( SizeValueType i = 0; i < lineLength; i++ )
+        {
+        line[i] = data[base + i * stride];
         }
 
-      // Increment the iterator and check to see if we're at the end of the
-      // line.  If so, go to the next line.  Otherwise, add the
-      // the values for the next hyperplane.
-      ++outIter;
-
-      if( !outIter.IsAtEndOfLine() )
+      // window [i - radius, i + radius] clipped to the line
+      double sum = 0.0;
+      for( SizeValueType i = 0; i <= radius && i < lineLength; i++ )
+        {
+        sum += line[i];
+        }
+      for( SizeValueType i = 0; i < lineLength; i++ )
         {
-        hoodIt.SetLocation( outIter.GetIndex() );
-
-        suma2 = 0.0;
-        sumb2 = 0.0;
-        suma = 0.0;
-        sumb = 0.0;
-        sumab = 0.0;
-        count = 0.0;
-        for( unsigned int indct = 2 * r[0]; indct < hoodlen; indct += ( 2 * r[0] + 1 ) )
+        data[base + i * stride] = static_cast<float>( sum );
+        if( i + radius + 1 < lineLength )
           {
-          bool isInBounds = true;
-          hoodIt.GetPixel( indct, isInBounds );
-          IndexType index = hoodIt.GetIndex( indct );
-
-          if( !isInBounds || ( this->m_FixedImageMask &&
-                               this->m_FixedImageMask->GetPixel( index ) < 0.25 ) )
-            {
-            continue;
-            }
-
-          float a = this->GetFixedImage()->GetPixel( index );
-          float b = this->GetMovingImage()->GetPixel( index );
-
-          suma2 += a * a;
-          sumb2 += b * b;
-          suma += a;
-          sumb += b;
-          sumab += a * b;
-          count += 1.0;
+          sum += line[i + radius + 1];
+          }
+        if( i >= radius )
+          {
+          sum -= line[i - radius];
           }
-
-        Qsuma2.push_back( suma2 );
-        Qsumb2.push_back( sumb2 );
-        Qsuma.push_back( suma );
-        Qsumb.push_back( sumb );
-        Qsumab.push_back( sumab );
-        Qcount.push_back( count );
         }
-
-      Qsuma2.pop_front();
-      Qsumb2.pop_front();
-      Qsuma.pop_front();
-      Qsumb.pop_front();
-      Qsumab.pop_front();
-      Qcount.pop_front();
       }
-
-    outIter.NextLine();
     }
+}
 
-  // m_FixedImageGradientCalculator->SetInputImage(finitediffimages[0]);
+/*
+ * Compute the update of the whole region in one pass
+ */
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+bool
+CrossCorrelationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                      const FixedImageType *mask,
+                      const typename DisplacementFieldType::RegionType & region, void * /* globalData */ )
+{
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+
+  // the kernel reads all the buffers with the offsets of the update field
+  const typename DisplacementFieldType::RegionType buffered = update->GetBufferedRegion();
+  if( !fixedImage || !movingImage ||
+      fixedImage->GetBufferedRegion() != buffered || movingImage->GetBufferedRegion() != buffered ||
+      ( updateInv && updateInv->GetBufferedRegion() != buffered ) ||
+      ( mask && mask->GetBufferedRegion() != buffered ) ||
+      ( this->m_FixedImageMask && this->m_FixedImageMask->GetBufferedRegion() != buffered ) )
+    {
+    return false;
+    }
+  for( unsigned int k = 0; k < 5; k++ )
+    {
+    if( !this->finitediffimages[k] || this->finitediffimages[k]->GetBufferedRegion() != buffered )
+      {
+      return false;
+      }
+    }
 
-  m_MaxMag = 0.0;
-  m_MinMag = 9.e9;
-  m_AvgMag = 0.0;
-  m_Iteration++;
+  UpdateFieldKernel kernel;
+  kernel.Mask = this->m_FixedImageMask ? this->m_FixedImageMask->GetBufferPointer() : ITK_NULLPTR;
+  kernel.FixedValues = this->finitediffimages[0]->GetBufferPointer();
+  kernel.MovingValues = this->finitediffimages[1]->GetBufferPointer();
+  kernel.Sfm = this->finitediffimages[2]->GetBufferPointer();
+  kernel.Sff = this->finitediffimages[3]->GetBufferPointer();
+  kernel.Smm = this->finitediffimages[4]->GetBufferPointer();
+  kernel.OffsetTable = fixedImage->GetOffsetTable();
+  kernel.FixedGradient.SetImage( fixedImage );
+  kernel.MovingGradient.SetImage( movingImage );
+
+  this->m_Energy += this->ApplyUpdateFieldKernel( kernel, update, updateInv, mask, region );
+  return true;
 }
 
 /*
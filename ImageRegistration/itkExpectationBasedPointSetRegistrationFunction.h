@@ -30,6 +30,9 @@
 #include "itkInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkCentralDifferenceImageFunction.h"
+#include "itkMultiThreader.h"
+#include <map>
+#include <vector>
 
 namespace itk
 {
@@ -123,6 +126,7 @@ public:
     Statistics::WeightedCentroidKdTreeGenerator<SampleType>   TreeGeneratorType;
   typedef typename TreeGeneratorType::KdTreeType::
     InstanceIdentifierVectorType                              NeighborhoodIdentifierType;
+  typedef typename TreeGeneratorType::KdTreeType            KdTreeType;
 
   /** Bspline stuff */
   typedef PointSet<VectorType,
@@ -244,6 +248,15 @@ public:
     this->m_UseSymmetricMatching = b;
   }
 
+  /** The per-label KD-trees are kept between iterations.  When no point of a
+   * label has moved by more than this tolerance (in units of the smallest
+   * fixed image spacing) since its tree was built, the tree is refit: the
+   * points are updated in place and the tree structure is reused, so the
+   * K-neighborhood search prunes with slightly stale node bounds.  Otherwise
+   * the tree is rebuilt.  Zero rebuilds whenever a point moves. */
+  itkSetMacro( KdTreeRefitTolerance, double );
+  itkGetConstMacro( KdTreeRefitTolerance, double );
+
 protected:
   ExpectationBasedPointSetRegistrationFunction();
   ~ExpectationBasedPointSetRegistrationFunction()
@@ -266,6 +279,11 @@ protected:
 
   void SetUpKDTrees(long whichlabel);
 
+  /** Gather the fixed (or moving) points of one label and refit or rebuild
+   * their tree. */
+  void UpdateKDTree(bool fixed, long whichlabel, typename SampleType::Pointer & sample,
+                    typename TreeGeneratorType::Pointer & tree, std::vector<MeasurementVectorType> & builtPoints);
+
 private:
   ExpectationBasedPointSetRegistrationFunction(const Self &); // purposely not implemented
   void operator=(const Self &);                               // purposely not implemented
@@ -327,6 +345,47 @@ private:
   typename BSplinePointSetType::Pointer m_bpoints;
   typename BSplineWeightsType::Pointer m_bweights;
   unsigned int m_bcount;
+
+  struct LabelKdTrees
+    {
+    typename SampleType::Pointer        FixedSample;
+    typename TreeGeneratorType::Pointer FixedTree;
+    std::vector<MeasurementVectorType>  FixedBuiltPoints;
+    typename SampleType::Pointer        MovingSample;
+    typename TreeGeneratorType::Pointer MovingTree;
+    std::vector<MeasurementVectorType>  MovingBuiltPoints;
+    };
+  std::map<long, LabelKdTrees> m_LabelKdTrees;
+  double                       m_KdTreeRefitTolerance;
+
+  /** The expectation of each point is computed by the threads into its own
+   * slot and the slots are applied to the field in point order, so the
+   * result does not depend on the number of threads. */
+  struct LandmarkUpdate
+    {
+    bool                  Valid;
+    IndexType             Index;
+    VectorType            Force;
+    VectorType            Distance;
+    MeasurementVectorType Point;
+    float                 Magnitude;
+    };
+
+  struct LandmarkThreadStruct
+    {
+    Self *                       Function;
+    const KdTreeType *           FixedTree;
+    const KdTreeType *           MovingTree;
+    unsigned int                 KNeighbors;
+    float                        Weight;
+    bool                         WhichDirection;
+    std::vector<LandmarkUpdate> *Updates;
+    };
+
+  void ThreadedComputeLandmarkUpdates( const LandmarkThreadStruct & str, ThreadIdType threadId,
+                                       ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE LandmarkThreaderCallback( void *arg );
 };
 } // end namespace itk
 
@@ -20,6 +20,7 @@
 
 #include "itkBSplineScatteredDataPointSetToImageFilter.h"
 #include "itkPointSet.h"
+#include <algorithm>
 
 namespace itk
 {
@@ -66,6 +67,7 @@ ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplac
   this->m_IsPointSetMetric = true;
   this->m_UseSymmetricMatching = 100000;
   this->m_Iterations = 0;
+  this->m_KdTreeRefitTolerance = 0.5;
 }
 
 /*
@@ -530,7 +532,7 @@ ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplac
 }
 
 /*
- * Set the function state values before each iteration
+ * Refit or rebuild the KD-trees of the fixed and moving points of a label
  */
 
 template <class TFixedImage, class TMovingImage, class TDisplacementField, class TPointSet>
@@ -538,72 +540,212 @@ void
 ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField, TPointSet>::SetUpKDTrees(
   long whichlabel)
 {
-  // convert this->m_FixedPointSet to a sample type
-  this->m_FixedSamplePoints = SampleType::New();
-  this->m_FixedSamplePoints->SetMeasurementVectorSize( MeasurementDimension );
-  MeasurementVectorType mv;
-  unsigned int          bucketsize = 4;
-  unsigned int          npts = this->m_FixedPointSet->GetNumberOfPoints();
-//  std::cout << " NP MOV " << npts << std::endl;
-  for( unsigned int i = 0; i < npts; i++ )
+  LabelKdTrees & trees = this->m_LabelKdTrees[whichlabel];
+
+  this->UpdateKDTree( true, whichlabel, trees.FixedSample, trees.FixedTree, trees.FixedBuiltPoints );
+  this->UpdateKDTree( false, whichlabel, trees.MovingSample, trees.MovingTree, trees.MovingBuiltPoints );
+
+  this->m_FixedSamplePoints = trees.FixedSample;
+  this->m_FixedKdTreeGenerator = trees.FixedTree;
+  this->m_MovingSamplePoints = trees.MovingSample;
+  this->m_MovingKdTreeGenerator = trees.MovingTree;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField, class TPointSet>
+void
+ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField, TPointSet>::UpdateKDTree(
+  bool fixed, long whichlabel, typename SampleType::Pointer & sample, typename TreeGeneratorType::Pointer & tree,
+  std::vector<MeasurementVectorType> & builtPoints)
+{
+  // convert the points of this label to measurement vectors
+  std::vector<MeasurementVectorType> points;
+  MeasurementVectorType              mv;
+  const unsigned long                npts = fixed ? this->m_FixedPointSet->GetNumberOfPoints() :
+    this->m_MovingPointSet->GetNumberOfPoints();
+  for( unsigned long i = 0; i < npts; i++ )
     {
-    PointType  fixedpoint;
-    const bool validFixedPoint = this->m_FixedPointSet->GetPoint(i, &fixedpoint);
-    if( !validFixedPoint )
+    PointType     point;
+    PointDataType label = 0;
+    if( fixed )
       {
-      itkExceptionMacro( << "Invalid FixedPoint Requested at " << i );
+      if( !this->m_FixedPointSet->GetPoint(i, &point) )
+        {
+        itkExceptionMacro( << "Invalid FixedPoint Requested at " << i );
+        }
+      this->m_FixedPointSet->GetPointData(i, &label);
       }
     else
       {
-      PointDataType fixedlabel = 0;
-      this->m_FixedPointSet->GetPointData(i, &fixedlabel);
-      for( unsigned int d = 0; d < ImageDimension; d++ )
+      if( !this->m_MovingPointSet->GetPoint(i, &point) )
         {
-        mv[d] = fixedpoint[d];
+        itkExceptionMacro( << "Invalid MovingPoint Requested at " << i );
         }
-      // mv[ImageDimension]=(float) fixedlabel*1.e6;
-      if( fixedlabel == whichlabel )
+      this->m_MovingPointSet->GetPointData(i, &label);
+      }
+    if( label == whichlabel )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        this->m_FixedSamplePoints->PushBack( mv );
+        mv[d] = point[d];
         }
+      points.push_back( mv );
       }
     }
-  this->m_FixedKdTreeGenerator = TreeGeneratorType::New();
-  this->m_FixedKdTreeGenerator->SetSample( this->m_FixedSamplePoints );
-  this->m_FixedKdTreeGenerator->SetBucketSize( bucketsize );
-  this->m_FixedKdTreeGenerator->Update();
-
-  this->m_MovingSamplePoints = SampleType::New();
-  this->m_MovingSamplePoints->SetMeasurementVectorSize( ImageDimension );
-  npts = this->m_MovingPointSet->GetNumberOfPoints();
-//  std::cout << " NP MOV " << npts << std::endl;
-  for( unsigned int i = 0; i < npts; i++ )
+
+  // refit: same points, none moved further than the tolerance since the build
+  if( tree.IsNotNull() && !points.empty() && points.size() == builtPoints.size() )
     {
-    PointType  movingpoint;
-    const bool validMovingPoint = this->m_MovingPointSet->GetPoint(i, &movingpoint);
-    if( !validMovingPoint )
+    double minimumSpacing = this->m_FixedImageSpacing[0];
+    for( unsigned int d = 1; d < ImageDimension; d++ )
       {
-      itkExceptionMacro( << "Invalid MovingPoint Requested at " << i );
+      minimumSpacing = std::min( minimumSpacing, static_cast<double>( this->m_FixedImageSpacing[d] ) );
       }
-    else
+    const double tolerance = this->m_KdTreeRefitTolerance * minimumSpacing;
+
+    double maximumSquaredMove = 0.0;
+    for( unsigned long i = 0; i < points.size(); i++ )
       {
-      PointDataType movinglabel = 0;
-      this->m_MovingPointSet->GetPointData(i, &movinglabel);
+      double squaredMove = 0.0;
       for( unsigned int d = 0; d < ImageDimension; d++ )
         {
-        mv[d] = movingpoint[d];
+        squaredMove += vnl_math_sqr( points[i][d] - builtPoints[i][d] );
+        }
+      maximumSquaredMove = std::max( maximumSquaredMove, squaredMove );
+      }
+    if( maximumSquaredMove <= tolerance * tolerance )
+      {
+      for( unsigned long i = 0; i < points.size(); i++ )
+        {
+        sample->SetMeasurementVector( i, points[i] );
+        }
+      return;
+      }
+    }
+
+  const unsigned int bucketsize = 4;
+  sample = SampleType::New();
+  sample->SetMeasurementVectorSize( MeasurementDimension );
+  for( unsigned long i = 0; i < points.size(); i++ )
+    {
+    sample->PushBack( points[i] );
+    }
+  tree = TreeGeneratorType::New();
+  tree->SetSample( sample );
+  tree->SetBucketSize( bucketsize );
+  tree->Update();
+  builtPoints = points;
+}
+
+/*
+ * Expectation of the matching points, for the points of one thread
+ */
+template <class TFixedImage, class TMovingImage, class TDisplacementField, class TPointSet>
+ITK_THREAD_RETURN_TYPE
+ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField, TPointSet>
+::LandmarkThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  LandmarkThreadStruct *           str = static_cast<LandmarkThreadStruct *>( info->UserData );
+
+  str->Function->ThreadedComputeLandmarkUpdates( *str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField, class TPointSet>
+void
+ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField, TPointSet>
+::ThreadedComputeLandmarkUpdates( const LandmarkThreadStruct & str, ThreadIdType threadId,
+                                  ThreadIdType numberOfThreads )
+{
+  std::vector<LandmarkUpdate> & updates = *str.Updates;
+  const unsigned long           sz1 = updates.size();
+  const unsigned long           first = sz1 * threadId / numberOfThreads;
+  const unsigned long           last = sz1 * ( threadId + 1 ) / numberOfThreads;
+
+  SpacingType spacing = this->GetFixedImage()->GetSpacing();
+  float       sigma = this->m_FixedPointSetSigma;
+  if( !str.WhichDirection )
+    {
+    sigma = this->m_MovingPointSetSigma;
+    }
+
+  // K-neighborhood buffers of this thread
+  typename KdTreeType::InstanceIdentifierVectorType neighbors;
+  vnl_vector<double>                                probabilities(str.KNeighbors);
+  probabilities.fill(0);
+  for( unsigned long ii = first; ii < last; ii++ )
+    {
+    LandmarkUpdate & update = updates[ii];
+    update.Valid = false;
+
+    VectorType distance;
+    distance.Fill(0);
+    MeasurementVectorType fixedpoint = str.FixedTree->GetMeasurementVector(ii);
+    ImagePointType        mpt;
+    mpt.Fill(0);
+    ImagePointType fpt;
+    fpt.Fill(0);
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      fpt[j] = fixedpoint[j];
+      }
+    IndexType fixedindex;
+    if( !this->GetFixedImage()->TransformPhysicalPointToIndex(fpt, fixedindex) )
+      {
+      continue;
+      }
+
+    VectorType force;
+    force.Fill(0);
+    str.MovingTree->Search( fixedpoint, str.KNeighbors, neighbors );
+    double probtotal = 0.0;
+    for( unsigned int dd = 0;   dd < str.KNeighbors; dd++ )
+      {
+      unsigned long         wpt = neighbors[dd];
+      MeasurementVectorType npt = str.MovingTree->GetMeasurementVector(wpt);
+      float                 _mag = 0;
+      for( unsigned int qq = 0; qq < ImageDimension; qq++ )
+        {
+        _mag += (fixedpoint[qq] - npt[qq]) * (fixedpoint[qq] - npt[qq]);
         }
-      // mv[ImageDimension]=(float) movinglabel*1.e6;
-      if( movinglabel == whichlabel )
+      double prob = 1.0 / sqrt(3.14186 * 2.0 * sigma * sigma) * exp(-1.0 * _mag / (2.0 * sigma * sigma) );
+      probtotal += prob;
+      probabilities(dd) = prob;
+      }
+    if( probtotal  > 0 )
+      {
+      for( unsigned int dd = 0;   dd < str.KNeighbors; dd++ )
         {
-        this->m_MovingSamplePoints->PushBack( mv );
+        unsigned long         wpt = neighbors[dd];
+        MeasurementVectorType npt = str.MovingTree->GetMeasurementVector(wpt);
+        double                pp = probabilities(dd) / probtotal;
+        if( pp > 0 )
+          {
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            mpt[j] += pp * npt[j];
+            }
+          }
         }
       }
+
+    float mag = 0.0;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      distance[j] = mpt[j] - fixedpoint[j];
+      mag += distance[j] / spacing[j] * distance[j] / spacing[j];
+      force[j] = distance[j] * str.Weight;
+      }
+    double prob = 1.0 / sqrt(3.14186 * 2.0 * sigma * sigma) * exp(-1.0 * mag / (2.0 * sigma * sigma) );
+
+    update.Valid = true;
+    update.Index = fixedindex;
+    update.Force = force * prob;
+    update.Distance = distance;
+    update.Point = fixedpoint;
+    update.Magnitude = sqrt(mag);
     }
-  this->m_MovingKdTreeGenerator = TreeGeneratorType::New();
-  this->m_MovingKdTreeGenerator->SetSample( this->m_MovingSamplePoints );
-  this->m_MovingKdTreeGenerator->SetBucketSize( bucketsize );
-  this->m_MovingKdTreeGenerator->Update();
 }
 
 /*
@@ -626,8 +768,6 @@ ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplac
   m_MeshResolution.Fill(1);
   unsigned int PointDimension = ImageDimension;
 
-  SpacingType spacing = this->GetFixedImage()->GetSpacing();
-
   typename TreeGeneratorType::Pointer fkdtree;
   typename TreeGeneratorType::Pointer mkdtree;
   if( whichdirection )
@@ -666,110 +806,48 @@ ExpectationBasedPointSetRegistrationFunction<TFixedImage, TMovingImage, TDisplac
   this->m_LandmarkEnergy = 0.0;
 //  float max=0;
 
-  vnl_vector<double> probabilities(KNeighbors);
-  probabilities.fill(0);
+  std::vector<LandmarkUpdate> updates( sz1 );
+
+  LandmarkThreadStruct str;
+  str.Function = this;
+  str.FixedTree = fkdtree->GetOutput();
+  str.MovingTree = mkdtree->GetOutput();
+  str.KNeighbors = KNeighbors;
+  str.Weight = inweight;
+  str.WhichDirection = whichdirection;
+  str.Updates = &updates;
+
+  typename MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() );
+  threader->SetSingleMethod( Self::LandmarkThreaderCallback, &str );
+  threader->SingleMethodExecute();
 
   float energy = 0, maxerr = 0;
   for( unsigned long ii = 0; ii < sz1; ii++ )
     {
-    VectorType distance;
-    distance.Fill(0);
-    MeasurementVectorType fixedpoint = fkdtree->GetOutput()->GetMeasurementVector(ii);
-    ImagePointType        mpt;
-    mpt.Fill(0);
-    ImagePointType fpt;
-    fpt.Fill(0);
+    const LandmarkUpdate & update = updates[ii];
+    if( !update.Valid )
+      {
+      continue;
+      }
+    typename BSplinePointSetType::PointType bpoint;
     for( unsigned int j = 0; j < ImageDimension; j++ )
       {
-      fpt[j] = fixedpoint[j];
+      bpoint[j] = update.Point[j];
       }
-//    float err=0;
-    bool      convok = false;
-    IndexType fixedindex;
-    convok = this->GetFixedImage()->TransformPhysicalPointToIndex(fpt, fixedindex);
-//    std::cout << " Orig " << this->GetFixedImage()->GetOrigin() << " ind " << fixedindex << " pt " << fpt <<
-// std::endl;
-    if( convok )
+    this->m_bpoints->SetPoint( this->m_bcount, bpoint );
+    this->m_bpoints->SetPointData( this->m_bcount, update.Distance );
+    float bwt = 1;
+    this->m_bweights->InsertElement( this->m_bcount,
+                                     static_cast<typename BSplineWeightsType::Element>( bwt ) );
+    this->m_bcount++;
+
+    if( update.Magnitude > maxerr )
       {
-      VectorType force;
-      force.Fill(0);
-      typename TreeGeneratorType::KdTreeType::InstanceIdentifierVectorType neighbors;
-      mkdtree->GetOutput()->Search( fixedpoint, static_cast<unsigned int>( KNeighbors ), neighbors );
-      double probtotal = 0.0;
-      for( unsigned int dd = 0;   dd < KNeighbors; dd++ )
-        {
-        PointType             movingpoint;
-        unsigned long         wpt = neighbors[dd];
-        MeasurementVectorType npt = mkdtree->GetOutput()->GetMeasurementVector(wpt);
-        float                 _mag = 0;
-        for( unsigned int qq = 0; qq < ImageDimension; qq++ )
-          {
-          _mag += (fixedpoint[qq] - npt[qq]) * (fixedpoint[qq] - npt[qq]);
-          }
-        float sigma = this->m_FixedPointSetSigma;
-        if( !whichdirection )
-          {
-          sigma = this->m_MovingPointSetSigma;
-          }
-        double prob = 1.0 / sqrt(3.14186 * 2.0 * sigma * sigma) * exp(-1.0 * _mag / (2.0 * sigma * sigma) );
-        probtotal += prob;
-        probabilities(dd) = prob;
-        }
-      if( probtotal  > 0 )
-        {
-        for( unsigned int dd = 0;   dd < KNeighbors; dd++ )
-          {
-          PointType             movingpoint;
-          unsigned long         wpt = neighbors[dd];
-          MeasurementVectorType npt = mkdtree->GetOutput()->GetMeasurementVector(wpt);
-          double                pp = probabilities(dd) / probtotal;
-          if( pp > 0 )
-            {
-            for( unsigned int j = 0; j < ImageDimension; j++ )
-              {
-              mpt[j] += pp * npt[j];
-              }
-            }
-          //
-//    if (ii % 245 && pp > 1.e-3) std::cout << " prob " << pp <<  " mpt " << mpt << " dd " << dd <<" wpt " << wpt
-// << "
-// movinpoint " << movingpoint << " ptot " << probtotal <<  std::endl;
-          }
-        }
-
-      float mag = 0.0;
-      typename BSplinePointSetType::PointType bpoint;
-      for( unsigned int j = 0; j < ImageDimension; j++ )
-        {
-        distance[j] = mpt[j] - fixedpoint[j];
-        mag += distance[j] / spacing[j] * distance[j] / spacing[j];
-        force[j] = distance[j] * inweight;
-        bpoint[j] = fixedpoint[j];
-        }
-      float sigma = this->m_FixedPointSetSigma;
-      if( !whichdirection )
-        {
-        sigma = this->m_MovingPointSetSigma;
-        }
-      double prob = 1.0 / sqrt(3.14186 * 2.0 * sigma * sigma) * exp(-1.0 * mag / (2.0 * sigma * sigma) );
-      force = force * prob;
-
-//
-      this->m_bpoints->SetPoint( this->m_bcount, bpoint );
-      this->m_bpoints->SetPointData( this->m_bcount, distance );
-      float bwt = 1;
-      this->m_bweights->InsertElement( this->m_bcount,
-                                       static_cast<typename BSplineWeightsType::Element>( bwt ) );
-      this->m_bcount++;
-
-      mag = sqrt(mag);
-      if( mag > maxerr )
-        {
-        maxerr = mag;
-        }
-      energy += mag;
-      lmField->SetPixel(fixedindex, force + lmField->GetPixel(fixedindex) );
+      maxerr = update.Magnitude;
       }
+    energy += update.Magnitude;
+    lmField->SetPixel(update.Index, update.Force + lmField->GetPixel(update.Index) );
     }
 //  std::cout <<  " max " << maxerr << std::endl;
   this->m_LandmarkEnergy = energy / (float)sz1;
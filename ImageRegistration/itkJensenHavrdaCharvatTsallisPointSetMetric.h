@@ -17,6 +17,9 @@
 
 #include "itkIdentityTransform.h"
 #include "itkManifoldParzenWindowsPointSetFunction.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -180,6 +183,40 @@ private:
   JensenHavrdaCharvatTsallisPointSetMetric(const Self &);
   void operator=(const Self &);
 
+  /**
+   * One term of GetValueAndDerivative(), evaluated over all samples on all
+   * threads.  For every sample x with p = scale * density(x) != 0 the term
+   * adds energyPrefactor * ( log p or p^(alpha-1) ) to energy and, for each
+   * of the kNeighborhood nearest kernels G_n, derivativePrefactor * G_n(x) /
+   * ( factorScale * p^(2-alpha) ) * C_n^-1 ( mu_n - x ) to row n of
+   * derivative.  Each thread sums a contiguous range of samples and the
+   * partial sums are added in thread order, so the result is reproducible
+   * for a given number of threads.
+   */
+  void AccumulateValueAndDerivative( const DensityFunctionType *density, const PointSetType *samples,
+                                     unsigned int kNeighborhood, RealType probabilityScale, RealType factorScale,
+                                     RealType energyPrefactor, RealType derivativePrefactor,
+                                     RealType & energy, DerivativeType & derivative ) const;
+
+  struct ValueAndDerivativeThreadStruct
+    {
+    const Self *Metric;
+    const DensityFunctionType *DensityFunction;
+    const std::vector<PointType> *Samples;
+    unsigned int KNeighborhood;
+    RealType ProbabilityScale;
+    RealType FactorScale;
+    RealType EnergyPrefactor;
+    RealType DerivativePrefactor;
+    std::vector<RealType> *Energies;
+    std::vector<DerivativeType> *Derivatives;
+    };
+
+  void ThreadedAccumulateValueAndDerivative( const ValueAndDerivativeThreadStruct *str, ThreadIdType threadId,
+                                             ThreadIdType numberOfThreads ) const;
+
+  static ITK_THREAD_RETURN_TYPE ValueAndDerivativeThreaderCallback( void *arg );
+
   bool m_UseRegularizationTerm;
   bool m_UseInputAsSamples;
   bool m_UseAnisotropicCovariances;
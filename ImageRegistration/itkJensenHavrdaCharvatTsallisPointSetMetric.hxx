@@ -621,193 +621,201 @@ JensenHavrdaCharvatTsallisPointSetMetric<TPointSet>
     }
   prefactor[1] = 1.0 / ( totalNumberOfSamples * totalNumberOfPoints );
 
+  this->AccumulateValueAndDerivative( densityFunctions[1], samples[0], kNeighborhood,
+                                      static_cast<RealType>( points[1]->GetNumberOfPoints() )
+                                      / totalNumberOfPoints, 1.0, prefactor[0], prefactor[1],
+                                      energyTerm1, derivative );
+
+  if( this->m_Alpha != 1.0 )
+    {
+    energyTerm1 -= 1.0;
+    }
+  energyTerm1 *= prefactor[0];
+
+  /**
+   * second term, i.e. regularization term
+   */
+  if( this->m_UseRegularizationTerm )
+    {
+    RealType prefactor2[2];
+    prefactor2[0] = -static_cast<RealType>(
+        points[1]->GetNumberOfPoints() ) / ( totalNumberOfPoints
+                                             * static_cast<RealType>( samples[1]->GetNumberOfPoints() ) );
+    prefactor2[1] = -1.0 / ( static_cast<RealType>(
+                               samples[1]->GetNumberOfPoints() ) * totalNumberOfPoints );
+    if( this->m_Alpha != 1.0 )
+      {
+      prefactor2[0] /= ( this->m_Alpha - 1.0 );
+      }
+
+    this->AccumulateValueAndDerivative( densityFunctions[1], samples[1], kNeighborhood, 1.0,
+                                        static_cast<RealType>( samples[1]->GetNumberOfPoints() )
+                                        / totalNumberOfSamples, prefactor2[0], prefactor2[1],
+                                        energyTerm2, derivative );
+
+    if( this->m_Alpha != 1.0 )
+      {
+      energyTerm2 -= 1.0;
+      }
+    energyTerm2 *= prefactor2[0];
+    }
+
+  value[0] = energyTerm1 - energyTerm2;
+}
+
+template <class TPointSet>
+void
+JensenHavrdaCharvatTsallisPointSetMetric<TPointSet>
+::AccumulateValueAndDerivative( const DensityFunctionType *density, const PointSetType *samples,
+                                unsigned int kNeighborhood, RealType probabilityScale, RealType factorScale,
+                                RealType energyPrefactor, RealType derivativePrefactor,
+                                RealType & energy, DerivativeType & derivative ) const
+{
+  std::vector<PointType> samplePoints;
+  samplePoints.reserve( samples->GetNumberOfPoints() );
   typename PointSetType::PointsContainerConstIterator It
-    = samples[0]->GetPoints()->Begin();
-  while( It != samples[0]->GetPoints()->End() )
+    = samples->GetPoints()->Begin();
+  while( It != samples->GetPoints()->End() )
     {
-    PointType fixedSamplePoint = It.Value();
+    samplePoints.push_back( It.Value() );
+    ++It;
+    }
+  if( samplePoints.empty() )
+    {
+    return;
+    }
 
-    RealType probabilityStar =
-//       densityFunctions[0]->Evaluate( fixedSamplePoint ) *
-//       static_cast<RealType>( points[0]->GetNumberOfPoints() ) +
-      densityFunctions[1]->Evaluate( fixedSamplePoint )
-      * static_cast<RealType>( points[1]->GetNumberOfPoints() );
+  ThreadIdType numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if( numberOfThreads > samplePoints.size() )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( samplePoints.size() );
+    }
 
-    probabilityStar /= totalNumberOfPoints;
+  std::vector<RealType>       energies( numberOfThreads, 0.0 );
+  std::vector<DerivativeType> derivatives( numberOfThreads );
+  for( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    derivatives[t].SetSize( derivative.rows(), derivative.cols() );
+    derivatives[t].Fill( 0 );
+    }
 
-    if( probabilityStar == 0 )
+  ValueAndDerivativeThreadStruct str;
+  str.Metric = this;
+  str.DensityFunction = density;
+  str.Samples = &samplePoints;
+  str.KNeighborhood = kNeighborhood;
+  str.ProbabilityScale = probabilityScale;
+  str.FactorScale = factorScale;
+  str.EnergyPrefactor = energyPrefactor;
+  str.DerivativePrefactor = derivativePrefactor;
+  str.Energies = &energies;
+  str.Derivatives = &derivatives;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( Self::ValueAndDerivativeThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  for( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    energy += energies[t];
+    derivative += derivatives[t];
+    }
+}
+
+template <class TPointSet>
+void
+JensenHavrdaCharvatTsallisPointSetMetric<TPointSet>
+::ThreadedAccumulateValueAndDerivative( const ValueAndDerivativeThreadStruct *str, ThreadIdType threadId,
+                                        ThreadIdType numberOfThreads ) const
+{
+  const std::vector<PointType> & samplePoints = *str->Samples;
+  const DensityFunctionType *    density = str->DensityFunction;
+
+  RealType &       energy = ( *str->Energies )[threadId];
+  DerivativeType & derivative = ( *str->Derivatives )[threadId];
+
+  const unsigned long first = samplePoints.size() * threadId / numberOfThreads;
+  const unsigned long last = samplePoints.size() * ( threadId + 1 ) / numberOfThreads;
+  for( unsigned long i = first; i < last; i++ )
+    {
+    const PointType & samplePoint = samplePoints[i];
+
+    RealType probability = density->Evaluate( samplePoint ) * str->ProbabilityScale;
+    if( probability == 0 )
       {
-      ++It;
       continue;
       }
 
     if( this->m_Alpha == 1.0 )
       {
-      energyTerm1 += ( prefactor[0] * std::log( probabilityStar ) );
+      energy += ( str->EnergyPrefactor * std::log( probability ) );
       }
     else
       {
-      energyTerm1 += ( prefactor[0] * std::pow( probabilityStar,
-                                               static_cast<RealType>( this->m_Alpha - 1.0 ) ) );
+      energy += ( str->EnergyPrefactor * std::pow( probability,
+                                                   static_cast<RealType>( this->m_Alpha - 1.0 ) ) );
       }
 
-    RealType probabilityStarFactor = std::pow( probabilityStar,
-                                              static_cast<RealType>( 2.0 - this->m_Alpha ) );
+    RealType probabilityFactor = std::pow( probability,
+                                           static_cast<RealType>( 2.0 - this->m_Alpha ) );
+    probabilityFactor *= str->FactorScale;
 
     typename GaussianType::MeasurementVectorType sampleMeasurement;
     for( unsigned int d = 0; d < PointDimension; d++ )
       {
-      sampleMeasurement[d] = fixedSamplePoint[d];
+      sampleMeasurement[d] = samplePoint[d];
       }
 
     typename DensityFunctionType::NeighborhoodIdentifierType neighbors
-      = densityFunctions[1]->GetNeighborhoodIdentifiers(
-          sampleMeasurement, kNeighborhood );
+      = density->GetNeighborhoodIdentifiers( sampleMeasurement, str->KNeighborhood );
     for( unsigned int n = 0; n < neighbors.size(); n++ )
       {
-      RealType gaussian = densityFunctions[1]->
-        GetGaussian( neighbors[n] )->Evaluate( sampleMeasurement );
+      const GaussianType *kernel = density->GetGaussian( neighbors[n] );
 
+      RealType gaussian = kernel->Evaluate( sampleMeasurement );
       if( gaussian == 0 )
         {
         continue;
         }
 
-      typename GaussianType::MeanType mean
-        = densityFunctions[1]->GetGaussian( neighbors[n] )->GetMean();
+      typename GaussianType::MeanType mean = kernel->GetMean();
       for( unsigned int d = 0; d < PointDimension; d++ )
         {
-        mean[d] -= fixedSamplePoint[d];
+        mean[d] -= samplePoint[d];
         }
 
       if( this->m_UseAnisotropicCovariances )
         {
-        typename GaussianType::MatrixType Ci
-          = densityFunctions[1]->GetGaussian( neighbors[n] )
-            ->GetInverseCovariance();
+        typename GaussianType::MatrixType Ci = kernel->GetInverseCovariance();
         mean = Ci * mean;
         }
       else
         {
-        mean /= vnl_math_sqr(
-            densityFunctions[1]->GetGaussian( neighbors[n] )->GetSigma() );
+        mean /= vnl_math_sqr( kernel->GetSigma() );
         }
 
-      mean *= ( prefactor[1] * gaussian / probabilityStarFactor );
+      mean *= ( str->DerivativePrefactor * gaussian / probabilityFactor );
       for( unsigned int d = 0; d < PointDimension; d++ )
         {
         derivative(neighbors[n], d) += mean[d];
         }
       }
-    ++It;
-    }
-
-  if( this->m_Alpha != 1.0 )
-    {
-    energyTerm1 -= 1.0;
     }
-  energyTerm1 *= prefactor[0];
-
-  /**
-   * second term, i.e. regularization term
-   */
-  if( this->m_UseRegularizationTerm )
-    {
-    RealType prefactor2[2];
-    prefactor2[0] = -static_cast<RealType>(
-        points[1]->GetNumberOfPoints() ) / ( totalNumberOfPoints
-                                             * static_cast<RealType>( samples[1]->GetNumberOfPoints() ) );
-    prefactor2[1] = -1.0 / ( static_cast<RealType>(
-                               samples[1]->GetNumberOfPoints() ) * totalNumberOfPoints );
-    if( this->m_Alpha != 1.0 )
-      {
-      prefactor2[0] /= ( this->m_Alpha - 1.0 );
-      }
-
-    typename PointSetType::PointsContainerConstIterator It
-      = samples[1]->GetPoints()->Begin();
-    while( It != samples[1]->GetPoints()->End() )
-      {
-      PointType movingSamplePoint = It.Value();
-
-      RealType probability = densityFunctions[1]->Evaluate( movingSamplePoint );
-
-      if( probability == 0 )
-        {
-        ++It;
-        continue;
-        }
-
-      if( this->m_Alpha == 1.0 )
-        {
-        energyTerm2 += ( prefactor2[0] * std::log( probability ) );
-        }
-      else
-        {
-        energyTerm2 += ( prefactor2[0] * std::pow( probability,
-                                                  static_cast<RealType>( this->m_Alpha - 1.0 ) ) );
-        }
-
-      RealType probabilityFactor = std::pow( probability,
-                                            static_cast<RealType>( 2.0 - this->m_Alpha ) );
-      probabilityFactor *= ( samples[1]->GetNumberOfPoints()
-                             / totalNumberOfSamples );
-
-      typename GaussianType::MeasurementVectorType sampleMeasurement;
-      for( unsigned int d = 0; d < PointDimension; d++ )
-        {
-        sampleMeasurement[d] = movingSamplePoint[d];
-        }
-
-      typename DensityFunctionType::NeighborhoodIdentifierType neighbors
-        = densityFunctions[1]->GetNeighborhoodIdentifiers(
-            sampleMeasurement, kNeighborhood );
-      for( unsigned int i = 0; i < neighbors.size(); i++ )
-        {
-        RealType gaussian = densityFunctions[1]->
-          GetGaussian( neighbors[i] )->Evaluate( sampleMeasurement );
-        if( gaussian == 0 )
-          {
-          continue;
-          }
-
-        typename GaussianType::MeanType mean
-          = densityFunctions[1]->GetGaussian( neighbors[i] )->GetMean();
-        for( unsigned int d = 0; d < PointDimension; d++ )
-          {
-          mean[d] -= movingSamplePoint[d];
-          }
-
-        if( this->m_UseAnisotropicCovariances )
-          {
-          typename GaussianType::MatrixType Ci
-            = densityFunctions[1]->GetGaussian( neighbors[i] )
-              ->GetInverseCovariance();
-          mean = Ci * mean;
-          }
-        else
-          {
-          mean /= vnl_math_sqr(
-              densityFunctions[1]->GetGaussian( neighbors[i] )->GetSigma() );
-          }
+}
 
-        mean *= ( prefactor2[1] * gaussian / probabilityFactor );
-        for( unsigned int d = 0; d < PointDimension; d++ )
-          {
-          derivative(neighbors[i], d) += mean[d];
-          }
-        }
-      ++It;
-      }
+template <class TPointSet>
+ITK_THREAD_RETURN_TYPE
+JensenHavrdaCharvatTsallisPointSetMetric<TPointSet>
+::ValueAndDerivativeThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const ValueAndDerivativeThreadStruct *str
+    = static_cast<const ValueAndDerivativeThreadStruct *>( info->UserData );
 
-    if( this->m_Alpha != 1.0 )
-      {
-      energyTerm2 -= 1.0;
-      }
-    energyTerm2 *= prefactor2[0];
-    }
+  str->Metric->ThreadedAccumulateValueAndDerivative( str, info->ThreadID, info->NumberOfThreads );
 
-  value[0] = energyTerm1 - energyTerm2;
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 template <class TPointSet>
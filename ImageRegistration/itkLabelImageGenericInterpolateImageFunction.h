@@ -2,6 +2,7 @@
 #define __itkLabelImageGenericInterpolateImageFunction_h
 
 #include <itkInterpolateImageFunction.h>
+#include <itkLinearInterpolateImageFunction.h>
 #include "itkLabelSelectionAdaptor.h"
 #include <vector>
 #include <set>
@@ -16,9 +17,27 @@ namespace itk
  *
  * This filter is an alternative to nearest neighbor interpolation for multi-label
  * images. It can use almost any underlying interpolator.
+ *
+ * With the linear interpolator, the labels of the 2^d neighbors are weighted in
+ * a single pass instead of interpolating one binary mask per label, so the cost
+ * does not depend on the number of labels.
  * * \ingroup ITKImageFunction
  */
 
+/** Whether the interpolator is linear, i.e. the label weights are the linear
+ * weights of the neighbors. */
+template <template<class, typename> class TInterpolator>
+struct LabelImageGenericInterpolatorIsLinear
+{
+  static const bool Value = false;
+};
+
+template <>
+struct LabelImageGenericInterpolatorIsLinear<LinearInterpolateImageFunction>
+{
+  static const bool Value = true;
+};
+
 template <typename TInputImage,template<class, typename> class TInterpolator, typename TCoordRep=double >
 class LabelImageGenericInterpolateImageFunction :
   public InterpolateImageFunction<TInputImage, TCoordRep>
@@ -89,6 +108,13 @@ private:
    */
   virtual OutputType EvaluateAtContinuousIndex(
     const ContinuousIndexType &, OutputType * ) const;
+
+  /**
+   * Single pass evaluation with the linear interpolator
+   */
+  OutputType EvaluateLinearAtContinuousIndex( const ContinuousIndexType & cindex ) const;
+
+  static const unsigned int NumberOfNeighbors = 1u << ImageDimension;
 };
 
 } // end namespace itk
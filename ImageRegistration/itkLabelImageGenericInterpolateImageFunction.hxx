@@ -3,6 +3,7 @@
 
 #include "itkLabelImageGenericInterpolateImageFunction.h"
 #include <itkImageRegionConstIterator.h>
+#include <itkMath.h>
 
 namespace itk
 {
@@ -18,7 +19,11 @@ void LabelImageGenericInterpolateImageFunction<TInputImage,TInterpolator, TCoord
 ::SetInputImage( const TInputImage *image ) {
 	/** We have one adaptor and one interpolator per label to keep the class thread-safe:
 	 *  changing the adaptor's accepted value wouldn't work when called from a multi-threaded filter */
-	if (image) {
+	m_Labels.clear();
+	m_InternalInterpolators.clear();
+	m_LabelSelectionAdaptors.clear();
+	/** The linear evaluation reads the labels of the image directly */
+	if (image && !LabelImageGenericInterpolatorIsLinear<TInterpolator>::Value) {
 		m_Labels.clear();
 		typedef itk::ImageRegionConstIterator<TInputImage> IteratorType;
 		IteratorType it(image,image->GetLargestPossibleRegion());
@@ -48,6 +53,10 @@ typename LabelImageGenericInterpolateImageFunction<TInputImage, TInterpolator, T
 LabelImageGenericInterpolateImageFunction<TInputImage, TInterpolator, TCoordRep>
 ::EvaluateAtContinuousIndex( const ContinuousIndexType & cindex, OutputType * itkNotUsed( grad ) ) const
 {
+	if( LabelImageGenericInterpolatorIsLinear<TInterpolator>::Value ) {
+		return this->EvaluateLinearAtContinuousIndex( cindex );
+	}
+
 	/** Interpolate the binary mask corresponding to each label and return the label
 	 * with the highest value */
 	double value=0;
@@ -65,6 +74,74 @@ LabelImageGenericInterpolateImageFunction<TInputImage, TInterpolator, TCoordRep>
 		return best_label;
 }
 
+template<typename TInputImage, template<class, typename> class TInterpolator , typename TCoordRep>
+typename LabelImageGenericInterpolateImageFunction<TInputImage, TInterpolator, TCoordRep>
+::OutputType
+LabelImageGenericInterpolateImageFunction<TInputImage, TInterpolator, TCoordRep>
+::EvaluateLinearAtContinuousIndex( const ContinuousIndexType & cindex ) const
+{
+	/** Sum the linear weights of the neighbors of each label, clamping the
+	 * neighbors to the image as LinearInterpolateImageFunction does, and return
+	 * the label with the largest weight.  Ties go to the smallest label, as with
+	 * the binary masks interpolated in increasing label order. */
+	const TInputImage *image = this->GetInputImage();
+
+	IndexType baseIndex;
+	double distance[ImageDimension];
+	for( unsigned int d = 0; d < ImageDimension; ++d ) {
+		baseIndex[d] = Math::Floor< IndexValueType >( cindex[d] );
+		distance[d] = cindex[d] - static_cast< double >( baseIndex[d] );
+	}
+
+	InputPixelType labels[NumberOfNeighbors];
+	double weights[NumberOfNeighbors];
+	unsigned int numberOfLabels = 0;
+
+	for( unsigned int counter = 0; counter < NumberOfNeighbors; ++counter ) {
+		double overlap = 1.0;
+		IndexType neighIndex( baseIndex );
+		for( unsigned int d = 0; d < ImageDimension; ++d ) {
+			if( counter & ( 1u << d ) ) {
+				++neighIndex[d];
+				if( neighIndex[d] > this->m_EndIndex[d] ) {
+					neighIndex[d] = this->m_EndIndex[d];
+				}
+				overlap *= distance[d];
+			}
+			else {
+				if( neighIndex[d] < this->m_StartIndex[d] ) {
+					neighIndex[d] = this->m_StartIndex[d];
+				}
+				overlap *= 1.0 - distance[d];
+			}
+		}
+		if( overlap <= 0.0 ) {
+			continue;
+		}
+
+		const InputPixelType label = image->GetPixel( neighIndex );
+		unsigned int l = 0;
+		while( l < numberOfLabels && labels[l] != label ) {
+			++l;
+		}
+		if( l == numberOfLabels ) {
+			labels[numberOfLabels] = label;
+			weights[numberOfLabels++] = 0.0;
+		}
+		weights[l] += overlap;
+	}
+
+	double value=0;
+	InputPixelType best_label=0;
+	for( unsigned int l = 0; l < numberOfLabels; ++l ) {
+		if( weights[l] > value || ( weights[l] == value && value > 0 && labels[l] < best_label ) ) {
+			value = weights[l];
+			best_label = labels[l];
+		}
+	}
+	return best_label;
+}
+
 } // namespace itk
 
 #endif
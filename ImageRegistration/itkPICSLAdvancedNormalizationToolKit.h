@@ -58,6 +58,7 @@ public:
   typedef typename TransformationModelType::DisplacementFieldType DisplacementFieldType;
   typedef typename TransformationModelType::AffineTransformType   AffineTransformType;
   typedef typename RegistrationOptimizerType::OptAffineType       OptAffineType;
+  typedef typename RegistrationOptimizerType::ImagePyramidType    ImagePyramidType;
 
   /** Point Set Type */
   typedef itk::ANTSLabeledPointSet<Dimension>        LabeledPointSetType;
@@ -125,6 +126,8 @@ private:
   RegistrationOptimizerPointer m_RegistrationOptimizer;
 
   SimilarityMetricListType m_SimilarityMetrics;
+
+  typename ImagePyramidType::Pointer m_ImagePyramid;
 };
 } // end namespace itk
 
@@ -121,6 +121,7 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
   this->m_TransformationModel->InitializeTransform();
   this->m_RegistrationOptimizer->SetParser( this->m_Parser );
   this->m_RegistrationOptimizer->SetSimilarityMetrics( this->m_SimilarityMetrics );
+  this->m_RegistrationOptimizer->SetImagePyramid( this->m_ImagePyramid );
 }
 
 template <unsigned int TDimension, class TReal>
@@ -275,6 +276,41 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
       temp = this->m_Parser->GetOption( "ignore-void-origin")->GetFunction( 0 )->GetName();
       affine_opt.ignore_void_orgin = (temp == "true");
       std::cout << "affine_opt.ignore_void_orgin = " << affine_opt.ignore_void_orgin  << std::endl;
+
+      typename OptionType::Pointer affineSamplingOption = this->m_Parser->GetOption( "affine-sampling" );
+      if( affineSamplingOption && affineSamplingOption->GetNumberOfFunctions() )
+        {
+        temp = affineSamplingOption->GetFunction( 0 )->GetName();
+        if( temp == "Regular" || temp == "regular" )
+          {
+          affine_opt.sampling_strategy = AffineSamplingRegular;
+          }
+        else if( temp == "Random" || temp == "random" )
+          {
+          affine_opt.sampling_strategy = AffineSamplingRandom;
+          }
+        if( affineSamplingOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+          {
+          affine_opt.sampling_percentage = this->m_Parser->template Convert<double>(
+              affineSamplingOption->GetFunction( 0 )->GetParameter( 0 ) );
+          }
+        std::cout << "affine_opt.sampling_strategy = " << affine_opt.sampling_strategy
+                  << " affine_opt.sampling_percentage = " << affine_opt.sampling_percentage << std::endl;
+        }
+
+      typename OptionType::Pointer affineSeedsOption = this->m_Parser->GetOption( "affine-seeds" );
+      if( affineSeedsOption && affineSeedsOption->GetNumberOfFunctions() )
+        {
+        affine_opt.number_of_seeds = this->m_Parser->template Convert<int>(
+            affineSeedsOption->GetFunction( 0 )->GetName() );
+        if( affineSeedsOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+          {
+          affine_opt.time_seed = this->m_Parser->template Convert<unsigned int>(
+              affineSeedsOption->GetFunction( 0 )->GetParameter( 0 ) );
+          }
+        std::cout << "affine_opt.number_of_seeds = " << affine_opt.number_of_seeds
+                  << " affine_opt.time_seed = " << affine_opt.time_seed << std::endl;
+        }
       }
 
     aff = this->m_RegistrationOptimizer->AffineOptimization(affine_opt);
@@ -390,6 +426,7 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
    * storing them in their corresponding image lists.
    */
   this->m_SimilarityMetrics.clear();
+  this->m_ImagePyramid = ImagePyramidType::New();
 
   typedef ImageFileReader<ImageType> ReaderType;
   bool useHistMatch = this->m_Parser->template Convert<bool>( this->m_Parser->GetOption(
@@ -409,29 +446,40 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
 
       unsigned int parameterCount = 0;
 
-      typename ReaderType::Pointer fixedImageFileReader = ReaderType::New();
-      fixedImageFileReader->SetFileName( option->GetFunction( i )->GetParameter(  parameterCount ) );
-      fixedImageFileReader->Update();
-      ImagePointer fixedImage = this->PreprocessImage(
-          fixedImageFileReader->GetOutput() );
+      // metrics on the same files share one image, and so its pyramid levels
+      const std::string fixedImageFileName = option->GetFunction( i )->GetParameter(  parameterCount );
+      ImagePointer      fixedImage = this->m_ImagePyramid->GetImage( fixedImageFileName );
+      if( !fixedImage )
+        {
+        typename ReaderType::Pointer fixedImageFileReader = ReaderType::New();
+        fixedImageFileReader->SetFileName( fixedImageFileName );
+        fixedImageFileReader->Update();
+        fixedImage = this->PreprocessImage( fixedImageFileReader->GetOutput() );
+        this->m_ImagePyramid->AddImage( fixedImageFileName, fixedImage );
+        }
       similarityMetric->SetFixedImage( fixedImage );
       parameterCount++;
 
       std::cout << "  Fixed image file: "
-                       << fixedImageFileReader->GetFileName() << std::endl;
+                       << fixedImageFileName << std::endl;
 
-      typename ReaderType::Pointer movingImageFileReader = ReaderType::New();
-      movingImageFileReader->SetFileName( option->GetFunction( i )->GetParameter(  parameterCount ) );
-      movingImageFileReader->Update();
-      ImagePointer movingImage = this->PreprocessImage(
-          movingImageFileReader->GetOutput() );
+      const std::string movingImageFileName = option->GetFunction( i )->GetParameter(  parameterCount );
+      ImagePointer      movingImage = this->m_ImagePyramid->GetImage( movingImageFileName );
+      if( !movingImage )
+        {
+        typename ReaderType::Pointer movingImageFileReader = ReaderType::New();
+        movingImageFileReader->SetFileName( movingImageFileName );
+        movingImageFileReader->Update();
+        movingImage = this->PreprocessImage( movingImageFileReader->GetOutput() );
+        this->m_ImagePyramid->AddImage( movingImageFileName, movingImage );
+        }
       similarityMetric->SetMovingImage( movingImage );
       typename SimilarityMetricType::RadiusType radius;
       radius.Fill( 0 );
       parameterCount++;
 
       std::cout << "  Moving image file: "
-                       << movingImageFileReader->GetFileName() << std::endl;
+                       << movingImageFileName << std::endl;
 
       /**
        * Check if similarity metric is image based or point-set based.
@@ -672,9 +720,9 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
         {
         std::cout << "Metric " << i << ": " << " Not a Point-set" << std::endl;
         std::cout << "  Fixed image file: "
-                         << fixedImageFileReader->GetFileName() << std::endl;
+                         << fixedImageFileName << std::endl;
         std::cout << "  Moving image file: "
-                         << movingImageFileReader->GetFileName() << std::endl;
+                         << movingImageFileName << std::endl;
 
         similarityMetric->SetFixedPointSet( ITK_NULLPTR);
         similarityMetric->SetMovingPointSet( ITK_NULLPTR );
@@ -818,6 +866,26 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
           metric->SetNumberOfHistogramBins(histbins);
           radius.Fill(0);
           metric->SetRadius( radius );
+          typename OptionType::Pointer samplingOption = this->m_Parser->GetOption( "image-metric-sampling" );
+          if( samplingOption && samplingOption->GetNumberOfFunctions() )
+            {
+            std::string strategy = samplingOption->GetFunction( 0 )->GetName();
+            if( strategy == "Regular" || strategy == "regular" )
+              {
+              metric->SetSamplingStrategy( MetricType::REGULAR );
+              }
+            else if( strategy == "Random" || strategy == "random" )
+              {
+              metric->SetSamplingStrategy( MetricType::RANDOM );
+              }
+            if( samplingOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+              {
+              metric->SetSamplingPercentage( this->m_Parser->template Convert<double>(
+                                               samplingOption->GetFunction( 0 )->GetParameter( 0 ) ) );
+              }
+            std::cout << "  joint histogram sampling: " << strategy << " "
+                      << metric->GetSamplingPercentage() << std::endl;
+            }
           similarityMetric->SetMetric(  metric );
           similarityMetric->SetMaximizeMetric( true );
           this->m_SimilarityMetrics.push_back( similarityMetric );
@@ -840,6 +908,26 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
           metric->SetNumberOfHistogramBins(histbins);
           radius.Fill(0);
           metric->SetRadius( radius );
+          typename OptionType::Pointer samplingOption = this->m_Parser->GetOption( "image-metric-sampling" );
+          if( samplingOption && samplingOption->GetNumberOfFunctions() )
+            {
+            std::string strategy = samplingOption->GetFunction( 0 )->GetName();
+            if( strategy == "Regular" || strategy == "regular" )
+              {
+              metric->SetSamplingStrategy( MetricType::REGULAR );
+              }
+            else if( strategy == "Random" || strategy == "random" )
+              {
+              metric->SetSamplingStrategy( MetricType::RANDOM );
+              }
+            if( samplingOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+              {
+              metric->SetSamplingPercentage( this->m_Parser->template Convert<double>(
+                                               samplingOption->GetFunction( 0 )->GetParameter( 0 ) ) );
+              }
+            std::cout << "  joint histogram sampling: " << strategy << " "
+                      << metric->GetSamplingPercentage() << std::endl;
+            }
           similarityMetric->SetMetric(  metric );
           similarityMetric->SetMaximizeMetric( true );
           this->m_SimilarityMetrics.push_back( similarityMetric );
@@ -1017,6 +1105,15 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
     this->m_Parser->AddOption( option );
     }
 
+  if( true )
+    {
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "image-metric-sampling" );
+    option->SetDescription(
+      "voxels binned into the joint histograms of the MI and SMI image metrics: None (default) / Regular[samplingPercentage] / Random[samplingPercentage]. The deformation update is still computed at every voxel. CC is always dense. " );
+    this->m_Parser->AddOption( option );
+    }
+
   if( true )
     {
     OptionType::Pointer option = OptionType::New();
@@ -1370,6 +1467,24 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
     this->m_Parser->AddOption( option );
     }
 
+  if( true )
+    {
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "affine-sampling" );
+    option->SetDescription(
+      "voxels used by the MI and MSQ affine metrics: None (default) / Regular[samplingPercentage] / Random[samplingPercentage], e.g. Regular[0.25] " );
+    this->m_Parser->AddOption( option );
+    }
+
+  if( true )
+    {
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "affine-seeds" );
+    option->SetDescription(
+      "random restarts of the affine search, ranked in parallel from the coarsest level: numberOfSeeds[randomSeed], e.g. 16[1234] (default: 0, a single start) " );
+    this->m_Parser->AddOption( option );
+    }
+
   if( true )
     {
     OptionType::Pointer option = OptionType::New();
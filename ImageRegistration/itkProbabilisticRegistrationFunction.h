@@ -22,6 +22,9 @@
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkCentralDifferenceImageFunction.h"
 #include "itkGradientRecursiveGaussianImageFilter.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
 
 #include "itkAvantsMutualInformationRegistrationFunction.h"
 
@@ -289,6 +292,15 @@ public:
     return update;
   }
 
+  /** ComputeMetricAtPairB and ComputeMetricAtPairC over region in one
+   * threaded pass, from the buffers of the images and the local statistics.
+   * Returns false if they do not share the buffered region of the update
+   * field. */
+  virtual bool ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                                   const FixedImageType *mask,
+                                   const typename DisplacementFieldType::RegionType & region,
+                                   void *globalData ) ITK_OVERRIDE;
+
   virtual VectorType ComputeUpdateInv(const NeighborhoodType & neighborhood,
                                       void * /* globalData */,
                                       const FloatOffsetType & /* offset */ = FloatOffsetType(0.0) ) ITK_OVERRIDE
@@ -389,6 +401,105 @@ private:
   MetricImagePointer finitediffimages[5];
   BinaryImagePointer binaryimage;
 
+  /** Running-sum engine for the local statistics, as in the CC metric.  The
+   * buffers hold, in order, sum(a), sum(b), sum(a*a), sum(b*b), sum(a*b) and
+   * the count of voxels in the (masked) neighborhood.  Round 0 sums the fixed
+   * and moving images, round 1 the images centered by round 0. */
+  itkStaticConstMacro( NumberOfRunningSums, unsigned int, 6 );
+
+  struct RunningSumThreadStruct
+    {
+    Self *Function;
+    unsigned int Round;
+    unsigned int Pass;
+    };
+
+  void ComputeLocalStatisticsWithRunningSums( unsigned int round );
+
+  void ThreadedRunningSumPass( unsigned int round, unsigned int pass, ThreadIdType threadId,
+                               ThreadIdType numberOfThreads );
+
+  template <class TImageA, class TImageB>
+  void FillRunningSumProducts( const TImageA *imageA, const TImageB *imageB,
+                               const typename FixedImageType::RegionType & slab, SizeValueType offset );
+
+  static ITK_THREAD_RETURN_TYPE RunningSumThreaderCallback( void *arg );
+
+  std::vector<float> m_RunningSums[6];
+  SizeValueType      m_RunningSumStride[ImageDimension];
+
+  /** The voxelwise kernel of ComputeUpdateField:  ComputeMetricAtPairB and,
+   * if there is an inverse field, ComputeMetricAtPairC at buffer offset o. */
+  class UpdateFieldKernel
+  {
+public:
+    typedef typename Superclass::template CentralDifferenceKernel<FixedImageType>  FixedGradientKernelType;
+    typedef typename Superclass::template CentralDifferenceKernel<MovingImageType> MovingGradientKernelType;
+    typedef typename FixedGradientKernelType::GradientType                          GradientType;
+    typedef typename MetricImageType::PixelType                                     MetricPixelType;
+
+    const MetricPixelType *  Mask;
+    const MetricPixelType *  FixedValues;
+    const MetricPixelType *  MovingValues;
+    const MetricPixelType *  Sfm;
+    const MetricPixelType *  Sff;
+    const MetricPixelType *  Smm;
+    const OffsetValueType *  OffsetTable;
+    FixedGradientKernelType  FixedGradient;
+    MovingGradientKernelType MovingGradient;
+    double                   RobustnessParameter;
+
+    void operator()( const IndexType & /* index */, OffsetValueType o, const bool *interior,
+                     typename VectorType::ValueType maskprob, VectorType *update, VectorType *updateInv,
+                     double & energy ) const
+    {
+      if( this->Mask && this->Mask[o] < 0.25 )
+        {
+        return;
+        }
+
+      const double sfm = this->Sfm[o];
+      const double sff = this->Sff[o];
+      const double smm = this->Smm[o];
+      if( sff == 0.0 || smm == 0.0 )
+        {
+        return;
+        }
+
+      const double localProbabilistic = ( sff * smm != 0.0 ) ? sfm * sfm / ( sff * smm ) : 1.0;
+      energy -= localProbabilistic;
+      if( localProbabilistic * (-1.0) < this->RobustnessParameter )
+        {
+        return;
+        }
+
+      const float Ji = this->MovingValues[o];
+      const float Ii = this->FixedValues[o];
+
+      GradientType gradI;
+      this->FixedGradient.Evaluate( o, this->OffsetTable, interior, gradI );
+      const double factor = 2.0 * sfm / (sff * smm) * ( Ji - sfm / sff * Ii );
+      VectorType   deriv;
+      for( unsigned int qq = 0; qq < ImageDimension; qq++ )
+        {
+        deriv[qq] = -factor * gradI[qq];
+        }
+      *update += deriv * maskprob;
+
+      if( updateInv )
+        {
+        GradientType gradJ;
+        this->MovingGradient.Evaluate( o, this->OffsetTable, interior, gradJ );
+        const double factorInv = 2.0 * sfm / (sff * smm) * ( Ii - sfm / smm * Ji );
+        for( unsigned int qq = 0; qq < ImageDimension; qq++ )
+          {
+          deriv[qq] = -factorInv * gradJ[qq];
+          }
+        *updateInv += deriv * maskprob;
+        }
+    }
+  };
+
   MetricImagePointer m_FixedImageMask;
   MetricImagePointer m_MovingImageMask;
 
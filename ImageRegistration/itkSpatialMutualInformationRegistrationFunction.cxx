@@ -24,6 +24,7 @@
 #include "vnl/vnl_math.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
+#include <algorithm>
 
 namespace itk
 {
@@ -80,6 +81,9 @@ SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplac
       interp.GetPointer() );
 
   this->m_RobustnessParameter = -1.e19;
+
+  this->m_SamplingStrategy = NONE;
+  this->m_SamplingPercentage = 1.0;
 }
 
 /**
@@ -96,6 +100,10 @@ SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplac
   os << m_NumberOfSpatialSamples << std::endl;
   os << indent << "NumberOfHistogramBins: ";
   os << m_NumberOfHistogramBins << std::endl;
+  os << indent << "SamplingStrategy: ";
+  os << m_SamplingStrategy << std::endl;
+  os << indent << "SamplingPercentage: ";
+  os << m_SamplingPercentage << std::endl;
 
   // Debugging information
   os << indent << "NumberOfParameters: ";
@@ -377,8 +385,6 @@ void
 SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
 ::GetProbabilities()
 {
-  typedef ImageRegionConstIteratorWithIndex<FixedImageType> RandomIterator;
-  RandomIterator randIter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
   for( unsigned int j = 0; j < m_NumberOfHistogramBins; j++ )
     {
     MarginalPDFIndexType mind;
@@ -387,154 +393,58 @@ SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplac
     m_MovingImageMarginalPDF->SetPixel(mind, 0);
     }
 
-  // Reset the joint pdfs to zero
-  m_JointPDF->FillBuffer( 0.0 );
-  m_JointPDFXuY->FillBuffer( 0.0 );
-  m_JointPDFXYu->FillBuffer( 0.0 );
-  m_JointPDFXlY->FillBuffer( 0.0 );
-  m_JointPDFXYl->FillBuffer( 0.0 );
-  m_JointPDFXuYl->FillBuffer( 0.0 );
-  m_JointPDFXlYu->FillBuffer( 0.0 );
-  m_JointPDFXrYu->FillBuffer( 0.0 );
-  m_JointPDFXuYr->FillBuffer( 0.0 );
+  // the joint pdfs are overwritten by the reduced partial histograms below
   m_JointHist->FillBuffer( 0.0 );
 
-  unsigned long  nSamples = 0;
-  RandomIterator iter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
-  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+  typename MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() );
+
+  const SizeValueType numberOfBins = this->m_JointPDF->GetBufferedRegion().GetNumberOfPixels();
+
+  // the bins of a voxel are read by its own sample and by the samples of its
+  // neighbors, so they are computed once per iteration
+  const SizeValueType numberOfVoxels = this->m_FixedImage->GetBufferedRegion().GetNumberOfPixels();
+  this->m_FixedImageBins.resize( numberOfVoxels );
+  this->m_MovingImageBins.resize( numberOfVoxels );
+
+  std::vector<std::vector<double> > partialHistograms( threader->GetNumberOfThreads(),
+                                                       std::vector<double>( NumberOfJointPDFs * numberOfBins,
+                                                                            0.0 ) );
+  JointHistogramThreadStruct str;
+  str.Function = this;
+  str.PartialHistograms = &partialHistograms;
+  for( str.Pass = 0; str.Pass < 2; str.Pass++ )
     {
-    bool takesample = true;
-    if( this->m_FixedImageMask )
+    threader->SetSingleMethod( Self::JointHistogramThreaderCallback, &str );
+    threader->SingleMethodExecute();
+    }
+
+  // pairwise (tree) reduction of the partial histograms
+  for( size_t stride = 1; stride < partialHistograms.size(); stride *= 2 )
+    {
+    for( size_t t = 0; t + stride < partialHistograms.size(); t += 2 * stride )
       {
-      if( this->m_FixedImageMask->GetPixel( iter.GetIndex() ) < 1.e-6 )
+      std::vector<double> &       sum = partialHistograms[t];
+      const std::vector<double> & other = partialHistograms[t + stride];
+      for( SizeValueType b = 0; b < NumberOfJointPDFs * numberOfBins; b++ )
         {
-        takesample = false;
+        sum[b] += other[b];
         }
       }
+    }
 
-    if( takesample )
+  JointPDFValueType *const pdfPtrs[NumberOfJointPDFs] =
+    { m_JointPDF->GetBufferPointer(), m_JointPDFXuY->GetBufferPointer(), m_JointPDFXYu->GetBufferPointer(),
+      m_JointPDFXlY->GetBufferPointer(), m_JointPDFXYl->GetBufferPointer(), m_JointPDFXuYl->GetBufferPointer(),
+      m_JointPDFXlYu->GetBufferPointer(), m_JointPDFXrYu->GetBufferPointer(), m_JointPDFXuYr->GetBufferPointer() };
+  for( unsigned int h = 0; h < NumberOfJointPDFs; h++ )
+    {
+    const double *partial = &( partialHistograms[0][h * numberOfBins] );
+    for( SizeValueType b = 0; b < numberOfBins; b++ )
       {
-      // Get sampled index
-      FixedImageIndexType index = iter.GetIndex();
-      FixedImageIndexType IndexU = index;
-      FixedImageIndexType IndexL = index;
-      FixedImageIndexType IndexR = index;
-
-      // check the neighboring voxel to be in the image
-      typename FixedImageType::SizeType imagesize = this->m_FixedImage->GetLargestPossibleRegion().GetSize();
-      bool inimage = true;
-      for( unsigned int dd = 0; dd < ImageDimension; dd++ )
-        {
-        if( index[dd] < 1 || index[dd] > static_cast<typename IndexType::IndexValueType>(imagesize[dd] - 2) )
-          {
-          inimage = false;
-          }
-        }
-
-//            std::cout << " Image size? " << imagesize << std::endl;
-
-      if( inimage )
-        {
-        IndexU[0] = index[0] - 1;
-        IndexL[1] = index[1] - 1;
-        IndexR[1] = index[1] + 1;
-
-        double       movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( index )  );
-        double       fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( index )  );
-        unsigned int movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        unsigned int fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        JointPDFValueType *pdfPtr = m_JointPDF->GetBufferPointer()
-          + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        int pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( index )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexU )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXuY->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexU )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( index )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXYu->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( index )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexL )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXlY->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexL )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( index )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXYl->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexL )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexU )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXuYl->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexU )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexL )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXlYu->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexU )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexR )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXrYu->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( IndexR )  );
-        fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( IndexU )  );
-        movingImageParzenWindowIndex = this->FitIndexInBins(  movingImageValue );
-        fixedImageParzenWindowIndex = this->FitIndexInBins( fixedImageValue  );
-
-        pdfPtr = m_JointPDFXuYr->GetBufferPointer() + ( fixedImageParzenWindowIndex * m_NumberOfHistogramBins );
-        pdfMovingIndex = static_cast<int>( movingImageParzenWindowIndex );
-        pdfPtr += pdfMovingIndex;
-        *(pdfPtr) += static_cast<PDFValueType>( 1 );
-
-        ++nSamples;
-        }
+      pdfPtrs[h][b] = static_cast<JointPDFValueType>( partial[b] );
       }
     }
-//    std::cout << " Image Rotation Number " << nSamples << std::endl;
 
   /**
    * Normalize the PDFs, compute moving image marginal PDF
@@ -661,6 +571,163 @@ SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplac
     }
 }
 
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+ITK_THREAD_RETURN_TYPE
+SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::JointHistogramThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  JointHistogramThreadStruct *     str = static_cast<JointHistogramThreadStruct *>( info->UserData );
+
+  if( str->Pass == 0 )
+    {
+    str->Function->ThreadedComputeBins( info->ThreadID, info->NumberOfThreads );
+    }
+  else
+    {
+    str->Function->ThreadedAccumulateJointHistograms( ( *str->PartialHistograms )[info->ThreadID],
+                                                      info->ThreadID, info->NumberOfThreads );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+typename TFixedImage::RegionType
+SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::GetThreadSlab( ThreadIdType threadId, ThreadIdType numberOfThreads ) const
+{
+  typedef typename FixedImageType::RegionType RegionType;
+
+  const RegionType region = this->m_FixedImage->GetLargestPossibleRegion();
+
+  // slabs along the slowest axis
+  const unsigned int  slabAxis = ImageDimension - 1;
+  const SizeValueType firstSlice = region.GetSize()[slabAxis] * threadId / numberOfThreads;
+  const SizeValueType lastSlice = region.GetSize()[slabAxis] * ( threadId + 1 ) / numberOfThreads;
+
+  RegionType slab = region;
+  slab.SetIndex( slabAxis, region.GetIndex()[slabAxis] + static_cast<IndexValueType>( firstSlice ) );
+  slab.SetSize( slabAxis, ( lastSlice > firstSlice ) ? lastSlice - firstSlice : 0 );
+  return slab;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ThreadedComputeBins( ThreadIdType threadId, ThreadIdType numberOfThreads )
+{
+  const typename FixedImageType::RegionType slab = this->GetThreadSlab( threadId, numberOfThreads );
+  if( slab.GetNumberOfPixels() == 0 )
+    {
+    return;
+    }
+
+  ImageRegionConstIteratorWithIndex<FixedImageType> iter( this->m_FixedImage, slab );
+  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+    {
+    const FixedImageIndexType index = iter.GetIndex();
+    const OffsetValueType     offset = this->m_FixedImage->ComputeOffset( index );
+
+    this->m_FixedImageBins[offset] = this->FitIndexInBins( this->GetFixedParzenTerm( iter.Get() ) );
+    this->m_MovingImageBins[offset] =
+      this->FitIndexInBins( this->GetMovingParzenTerm( this->m_MovingImage->GetPixel( index ) ) );
+    }
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+SpatialMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ThreadedAccumulateJointHistograms( std::vector<double> & histograms, ThreadIdType threadId,
+                                     ThreadIdType numberOfThreads )
+{
+  const typename FixedImageType::RegionType slab = this->GetThreadSlab( threadId, numberOfThreads );
+  if( slab.GetNumberOfPixels() == 0 )
+    {
+    return;
+    }
+
+  const typename FixedImageType::RegionType region = this->m_FixedImage->GetLargestPossibleRegion();
+  const typename FixedImageType::SizeType imagesize = region.GetSize();
+
+  const SizeValueType numberOfBins = this->m_NumberOfHistogramBins * this->m_NumberOfHistogramBins;
+
+  // buffer offsets of the neighbors: U is index[0] - 1, L and R are
+  // index[1] -/+ 1
+  const OffsetValueType *offsetTable = this->m_FixedImage->GetOffsetTable();
+  const OffsetValueType  offsetU = -offsetTable[0];
+  const OffsetValueType  offsetL = -offsetTable[1];
+  const OffsetValueType  offsetR = offsetTable[1];
+
+  const unsigned int *fixedBins = &( this->m_FixedImageBins[0] );
+  const unsigned int *movingBins = &( this->m_MovingImageBins[0] );
+
+  const bool            sample = this->m_SamplingStrategy != NONE && this->m_SamplingPercentage < 1.0;
+  const OffsetValueType step = std::max( static_cast<OffsetValueType>( 1.0 / this->m_SamplingPercentage + 0.5 ),
+                                         static_cast<OffsetValueType>( 1 ) );
+  const unsigned int    slabAxis = ImageDimension - 1;
+  vnl_random            randgen;
+  IndexValueType        currentSlice = region.GetIndex()[slabAxis] - 1;
+
+  ImageRegionConstIteratorWithIndex<FixedImageType> iter( this->m_FixedImage, slab );
+  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+    {
+    const FixedImageIndexType index = iter.GetIndex();
+    const OffsetValueType     offset = this->m_FixedImage->ComputeOffset( index );
+    if( sample && this->m_SamplingStrategy == REGULAR && offset % step != 0 )
+      {
+      continue;
+      }
+    if( sample && this->m_SamplingStrategy == RANDOM )
+      {
+      // reseeding per slice keeps the subset independent of the slab split
+      if( index[slabAxis] != currentSlice )
+        {
+        currentSlice = index[slabAxis];
+        randgen.reseed( 19650218 + static_cast<unsigned long>( currentSlice - region.GetIndex()[slabAxis] ) );
+        }
+      if( randgen.drand64() >= this->m_SamplingPercentage )
+        {
+        continue;
+        }
+      }
+    if( this->m_FixedImageMask && this->m_FixedImageMask->GetPixel( index ) < 1.e-6 )
+      {
+      continue;
+      }
+
+    // check the neighboring voxel to be in the image
+    bool inimage = true;
+    for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+      {
+      if( index[dd] < 1 || index[dd] > static_cast<IndexValueType>( imagesize[dd] - 2 ) )
+        {
+        inimage = false;
+        }
+      }
+    if( !inimage )
+      {
+      continue;
+      }
+
+    const unsigned int pairs[NumberOfJointPDFs][2] = {
+        { fixedBins[offset], movingBins[offset] },                     // XY
+        { fixedBins[offset + offsetU], movingBins[offset] },           // XuY
+        { fixedBins[offset], movingBins[offset + offsetU] },           // XYu
+        { fixedBins[offset + offsetL], movingBins[offset] },           // XlY
+        { fixedBins[offset], movingBins[offset + offsetL] },           // XYl
+        { fixedBins[offset + offsetU], movingBins[offset + offsetL] }, // XuYl
+        { fixedBins[offset + offsetL], movingBins[offset + offsetU] }, // XlYu
+        { fixedBins[offset + offsetR], movingBins[offset + offsetU] }, // XrYu
+        { fixedBins[offset + offsetU], movingBins[offset + offsetR] }  // XuYr
+      };
+    for( unsigned int h = 0; h < NumberOfJointPDFs; h++ )
+      {
+      histograms[h * numberOfBins + pairs[h][0] * this->m_NumberOfHistogramBins + pairs[h][1]] += 1.0;
+      }
+    }
+}
+
 /**
  * Get the both Value and Derivative Measure
  */
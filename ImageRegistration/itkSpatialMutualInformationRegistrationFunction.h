@@ -34,6 +34,9 @@
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkSpatialObject.h"
 #include "itkConstNeighborhoodIterator.h"
+#include "itkMultiThreader.h"
+#include <vnl/vnl_random.h>
+#include <vector>
 
 namespace itk
 {
@@ -287,6 +290,16 @@ public:
     return m_NumberOfHistogramBins;
   }
 
+  /** Fixed image voxels binned into the joint histograms, as in the MI
+   * function.  The metric derivative is still computed at every voxel.
+   * REGULAR keeps every round(1/percentage)-th voxel, RANDOM keeps each
+   * voxel with probability percentage, drawn per slice from a fixed seed. */
+  enum SamplingStrategyType { NONE, REGULAR, RANDOM };
+  itkSetMacro( SamplingStrategy, SamplingStrategyType );
+  itkGetConstMacro( SamplingStrategy, SamplingStrategyType );
+  itkSetClampMacro( SamplingPercentage, double, 1.e-6, 1.0 );
+  itkGetConstMacro( SamplingPercentage, double );
+
   void SetTransform(TransformPointer t)
   {
     m_Transform = t;
@@ -701,6 +714,31 @@ private:
   typename pdfintType::Pointer pdfinterpolatorXuYr;
   typename pdfintType::Pointer pdfinterpolatorXrYu;
 
+  /** The joint PDF and its eight neighbor PDFs are binned by slabs of the
+   * fixed image, one partial histogram per thread, and the partials are
+   * summed pairwise.  A first pass stores the bin of every voxel, which the
+   * second pass reads for the voxel and its neighbors. */
+  itkStaticConstMacro( NumberOfJointPDFs, unsigned int, 9 );
+
+  struct JointHistogramThreadStruct
+    {
+    Self *Function;
+    unsigned int Pass;
+    std::vector<std::vector<double> > *PartialHistograms;
+    };
+
+  typename TFixedImage::RegionType GetThreadSlab( ThreadIdType threadId, ThreadIdType numberOfThreads ) const;
+
+  void ThreadedComputeBins( ThreadIdType threadId, ThreadIdType numberOfThreads );
+
+  void ThreadedAccumulateJointHistograms( std::vector<double> & histograms, ThreadIdType threadId,
+                                          ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE JointHistogramThreaderCallback( void *arg );
+
+  std::vector<unsigned int> m_FixedImageBins;
+  std::vector<unsigned int> m_MovingImageBins;
+
   /** Typedefs for BSpline kernel and derivative functions. */
   typedef BSplineKernelFunction<3> CubicBSplineFunctionType;
   typedef BSplineDerivativeKernelFunction<3>
@@ -793,6 +831,9 @@ private:
   typename pdfintType2::Pointer pdfinterpolator3;
 
   unsigned int m_Padding;
+
+  SamplingStrategyType m_SamplingStrategy;
+  double               m_SamplingPercentage;
 };
 } // end namespace itk
 
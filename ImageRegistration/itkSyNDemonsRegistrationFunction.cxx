@@ -17,6 +17,7 @@
 #include "itkSyNDemonsRegistrationFunction.h"
 #include "itkExceptionObject.h"
 #include "vnl/vnl_math.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
 
 namespace itk
 {
@@ -336,6 +337,259 @@ SyNDemonsRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
   return update;
 }
 
+/*
+ * Compute the update of the whole field in one pass
+ */
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+bool
+SyNDemonsRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                      const FixedImageType *mask,
+                      const typename DisplacementFieldType::RegionType & updateRegion, void *gd )
+{
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+
+  // the kernel walks all the buffers with the offsets of the update field
+  const typename DisplacementFieldType::RegionType region = update->GetBufferedRegion();
+  if( updateRegion != region || !fixedImage || !movingImage ||
+      fixedImage->GetBufferedRegion() != region || movingImage->GetBufferedRegion() != region ||
+      ( updateInv && updateInv->GetBufferedRegion() != region ) ||
+      ( mask && mask->GetBufferedRegion() != region ) )
+    {
+    return false;
+    }
+
+  typename MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() );
+
+  GlobalDataStruct zero;
+  zero.m_SumOfSquaredDifference = 0.0;
+  zero.m_NumberOfPixelsProcessed = 0L;
+  zero.m_SumOfSquaredChange = 0.0;
+
+  std::vector<GlobalDataStruct> sums( threader->GetNumberOfThreads(), zero );
+  std::vector<double>           energies( threader->GetNumberOfThreads(), 0.0 );
+
+  UpdateFieldThreadStruct str;
+  str.Function = this;
+  str.Update = update;
+  str.UpdateInv = updateInv;
+  str.Mask = mask;
+  str.Sums = &sums;
+  str.Energies = &energies;
+  threader->SetSingleMethod( Self::UpdateFieldThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  GlobalDataStruct *globalData = reinterpret_cast<GlobalDataStruct *>( gd );
+  for( unsigned int t = 0; t < sums.size(); t++ )
+    {
+    this->m_Energy += energies[t];
+    if( globalData )
+      {
+      globalData->m_SumOfSquaredDifference += sums[t].m_SumOfSquaredDifference;
+      globalData->m_NumberOfPixelsProcessed += sums[t].m_NumberOfPixelsProcessed;
+      globalData->m_SumOfSquaredChange += sums[t].m_SumOfSquaredChange;
+      }
+    }
+  return true;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+ITK_THREAD_RETURN_TYPE
+SyNDemonsRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::UpdateFieldThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  UpdateFieldThreadStruct *        str = static_cast<UpdateFieldThreadStruct *>( info->UserData );
+
+  str->Function->ThreadedComputeUpdateField( str->Update, str->UpdateInv, str->Mask,
+                                             ( *str->Sums )[info->ThreadID], ( *str->Energies )[info->ThreadID],
+                                             info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage, class TDisplacementField>
+void
+SyNDemonsRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::ThreadedComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                              const FixedImageType *mask, GlobalDataStruct & sums, double & energy,
+                              ThreadIdType threadId, ThreadIdType numberOfThreads )
+{
+  typedef typename DisplacementFieldType::RegionType RegionType;
+
+  const RegionType region = update->GetBufferedRegion();
+  const SizeType   size = region.GetSize();
+  const IndexType  start = region.GetIndex();
+
+  // slabs along the slowest axis
+  const unsigned int  slabAxis = ImageDimension - 1;
+  const SizeValueType firstSlice = size[slabAxis] * threadId / numberOfThreads;
+  const SizeValueType lastSlice = size[slabAxis] * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlice >= lastSlice )
+    {
+    return;
+    }
+  RegionType slab = region;
+  slab.SetIndex( slabAxis, start[slabAxis] + static_cast<IndexValueType>( firstSlice ) );
+  slab.SetSize( slabAxis, lastSlice - firstSlice );
+
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+
+  const typename FixedImageType::PixelType * fixedBuffer = fixedImage->GetBufferPointer();
+  const typename MovingImageType::PixelType *movingBuffer = movingImage->GetBufferPointer();
+  const typename FixedImageType::PixelType * maskBuffer = mask ? mask->GetBufferPointer() : ITK_NULLPTR;
+  PixelType *                                updateBuffer = update->GetBufferPointer();
+  PixelType *                                updateInvBuffer = updateInv ? updateInv->GetBufferPointer() : ITK_NULLPTR;
+
+  // central differences as in CentralDifferenceImageFunction: zero on the
+  // first and last voxel of an axis, scaled by the spacing and oriented by
+  // the image direction
+  const OffsetValueType *offsetTable = update->GetOffsetTable();
+  double                 fixedScale[ImageDimension];
+  double                 movingScale[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    fixedScale[d] = 0.5 / fixedImage->GetSpacing()[d];
+    movingScale[d] = 0.5 / movingImage->GetSpacing()[d];
+    }
+  typename FixedImageType::DirectionType identity;
+  identity.SetIdentity();
+  const bool orientFixed = ( fixedImage->GetDirection() != identity );
+  const bool orientMoving = ( movingImage->GetDirection() != identity );
+
+  const bool          useMovingGradient = this->m_UseMovingImageGradient || updateInvBuffer;
+  const SizeValueType lineLength = size[0];
+
+  ImageLinearConstIteratorWithIndex<DisplacementFieldType> lineIt( update, slab );
+  lineIt.SetDirection( 0 );
+  for( lineIt.GoToBegin(); !lineIt.IsAtEnd(); lineIt.NextLine() )
+    {
+    const IndexType       lineIndex = lineIt.GetIndex();
+    const OffsetValueType lineOffset = update->ComputeOffset( lineIndex );
+
+    bool interior[ImageDimension];
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      interior[d] = ( lineIndex[d] > start[d] &&
+                      lineIndex[d] + 1 < start[d] + static_cast<IndexValueType>( size[d] ) );
+      }
+    for( SizeValueType i = 0; i < lineLength; i++ )
+      {
+      const OffsetValueType o = lineOffset + static_cast<OffsetValueType>( i );
+
+      double maskprob = 1.0;
+      if( maskBuffer )
+        {
+        maskprob = maskBuffer[o];
+        if( maskprob > 1.0 )
+          {
+          maskprob = 1.0;
+          }
+        if( maskprob < 0.1 )
+          {
+          continue;
+          }
+        }
+
+      const double fixedValue = fixedBuffer[o];
+      const double movingValue = movingBuffer[o];
+
+      interior[0] = ( i > 0 && i + 1 < lineLength );
+      CovariantVectorType fixedGradient;
+      CovariantVectorType movingGradient;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        fixedGradient[d] = interior[d] ?
+          ( static_cast<double>( fixedBuffer[o + offsetTable[d]] ) - fixedBuffer[o - offsetTable[d]] ) * fixedScale[d] :
+          0.0;
+        movingGradient[d] = ( interior[d] && useMovingGradient ) ?
+          ( static_cast<double>( movingBuffer[o + offsetTable[d]] ) - movingBuffer[o - offsetTable[d]] ) *
+          movingScale[d] : 0.0;
+        }
+      if( orientFixed )
+        {
+        fixedImage->TransformLocalVectorToPhysicalVector( CovariantVectorType( fixedGradient ), fixedGradient );
+        }
+      if( orientMoving && useMovingGradient )
+        {
+        movingImage->TransformLocalVectorToPhysicalVector( CovariantVectorType( movingGradient ), movingGradient );
+        }
+
+      // the force of ComputeUpdate
+        {
+        CovariantVectorType gradient = fixedGradient;
+        double              gradientSquaredMagnitude = 0;
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          if( this->m_UseMovingImageGradient )
+            {
+            gradient[j] += movingGradient[j];
+            }
+          gradientSquaredMagnitude += vnl_math_sqr( gradient[j] );
+          }
+
+        double speedValue = fixedValue - movingValue;
+        if( fabs(speedValue) < this->m_RobustnessParameter )
+          {
+          speedValue = 0;
+          }
+        sums.m_SumOfSquaredDifference += vnl_math_sqr( speedValue );
+        sums.m_NumberOfPixelsProcessed += 1;
+
+        double denominator = vnl_math_sqr( speedValue ) / m_Normalizer + gradientSquaredMagnitude;
+        energy += speedValue * speedValue;
+        if( m_UseSSD )
+          {
+          denominator = 1;
+          }
+        if( !( vnl_math_abs(speedValue) < m_IntensityDifferenceThreshold ||
+               denominator < m_DenominatorThreshold ) )
+          {
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            const double u = speedValue * gradient[j] / denominator;
+            sums.m_SumOfSquaredChange += vnl_math_sqr( u );
+            updateBuffer[o][j] += u * maskprob;
+            }
+          }
+        }
+
+      // the force of ComputeUpdateInv
+      if( updateInvBuffer )
+        {
+        double gradientSquaredMagnitude = 0;
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          gradientSquaredMagnitude += vnl_math_sqr( movingGradient[j] );
+          }
+
+        double speedValue = movingValue - fixedValue;
+        if( fabs(speedValue) < this->m_RobustnessParameter )
+          {
+          speedValue = 0;
+          }
+        sums.m_SumOfSquaredDifference += vnl_math_sqr( speedValue );
+        sums.m_NumberOfPixelsProcessed += 1;
+
+        const double denominator = vnl_math_sqr( speedValue ) / m_Normalizer + gradientSquaredMagnitude;
+        if( !( vnl_math_abs(speedValue) < m_IntensityDifferenceThreshold ||
+               denominator < m_DenominatorThreshold ) )
+          {
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            const double u = speedValue * movingGradient[j] / denominator;
+            sums.m_SumOfSquaredChange += vnl_math_sqr( u );
+            updateInvBuffer[o][j] += u * maskprob;
+            }
+          }
+        }
+      }
+    }
+}
+
 /*
  * Update the metric and release the per-thread-global data.
  */
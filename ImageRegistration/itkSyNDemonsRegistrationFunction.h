@@ -20,6 +20,9 @@
 #include "itkInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkCentralDifferenceImageFunction.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -164,6 +167,16 @@ public:
                                         FloatOffsetType(
                                           0.0) ) ITK_OVERRIDE;
 
+  /** Fused demons kernel: the forces and central-difference gradients of
+   * all voxels are computed in one threaded pass over the image buffers,
+   * with the same result as ComputeUpdate and ComputeUpdateInv.  Returns
+   * false, and leaves the fields alone, if the images do not share the
+   * buffered region of the update field or region is not all of it. */
+  virtual bool ComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                                   const FixedImageType *mask,
+                                   const typename DisplacementFieldType::RegionType & region,
+                                   void *globalData ) ITK_OVERRIDE;
+
   void SetUseSSD( bool b )
   {
     this->m_UseSSD = b;
@@ -228,6 +241,24 @@ private:
   SyNDemonsRegistrationFunction(const Self &); // purposely not implemented
   void operator=(const Self &);                // purposely not implemented
 
+  /** The fused kernel splits the field into slabs along the slowest axis,
+   * and each thread sums its own metric terms. */
+  struct UpdateFieldThreadStruct
+    {
+    Self *Function;
+    DisplacementFieldType *Update;
+    DisplacementFieldType *UpdateInv;
+    const FixedImageType *Mask;
+    std::vector<GlobalDataStruct> *Sums;
+    std::vector<double> *Energies;
+    };
+
+  void ThreadedComputeUpdateField( DisplacementFieldType *update, DisplacementFieldType *updateInv,
+                                   const FixedImageType *mask, GlobalDataStruct & sums, double & energy,
+                                   ThreadIdType threadId, ThreadIdType numberOfThreads );
+
+  static ITK_THREAD_RETURN_TYPE UpdateFieldThreaderCallback( void *arg );
+
   /** Cache fixed image information. */
   SpacingType m_FixedImageSpacing;
   PointType   m_FixedImageOrigin;
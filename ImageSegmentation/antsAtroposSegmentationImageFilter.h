@@ -26,6 +26,8 @@
 #include "itkFixedArray.h"
 #include "itkListSample.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkNeighborhoodIterator.h"
 #include "itkPointSet.h"
 #include "itkSymmetricSecondRankTensor.h"
@@ -416,6 +418,29 @@ public:
    */
   itkBooleanMacro( MinimizeMemoryUsage );
 
+  /**
+   * Set the value of the boolean parameter dictating whether or not the
+   * posterior and distance prior probability images are stored in compact
+   * form.  This is a compromise between the default behavior and memory
+   * minimization:  the probabilities are quantized to 16 bits and only the
+   * voxels inside the mask are kept.  Full probability images are only
+   * materialized when requested, e.g., by GetPosteriorProbabilityImage().
+   * This option is ignored when memory usage is minimized.  Default = false.
+   */
+  itkSetMacro( UseCompactProbabilityStorage, bool );
+
+  /**
+   * Get the value of the boolean parameter dictating whether or not the
+   * probability images are stored in compact form.
+   */
+  itkGetConstMacro( UseCompactProbabilityStorage, bool );
+
+  /**
+   * Set the value of the boolean parameter dictating whether or not the
+   * probability images are stored in compact form.
+   */
+  itkBooleanMacro( UseCompactProbabilityStorage );
+
   /**
    * Set the prior probability threshold value.  This determines what pixel
    * values are included in the sparse representation of the prior probability
@@ -540,6 +565,24 @@ public:
    */
   void SetPriorProbabilityImage( unsigned int whichClass, RealImageType * prior );
 
+  /**
+   * Set a prior probability image in its sparse representation (only used
+   * if m_MinimizeMemoryUsage is true).  Together with
+   * AddToSparsePriorProbabilityImage() this allows the priors to be
+   * sparsified piece by piece as they are read without ever holding a full
+   * prior image.
+   */
+  void SetPriorProbabilitySparseImage( unsigned int whichClass, SparseImageType * prior );
+
+  /**
+   * Append to the sparse prior the voxels of the requested region of the
+   * given image which are above the probability threshold.  The voxels are
+   * numbered with respect to the full region of the prior, which is the
+   * third argument.  Different sparse images can be filled concurrently.
+   */
+  void AddToSparsePriorProbabilityImage( SparseImageType *, const RealImageType *,
+                                         const typename RealImageType::RegionType & ) const;
+
   /**
    * Get a prior probability image (numbered between 1,...,numberOfClasses).
    */
@@ -678,6 +721,24 @@ public:
    */
   RealImagePointer GetDistancePriorProbabilityImage( unsigned int );
 
+  /**
+   * The distance prior probability image of a class before normalization by
+   * the sum over the classes.
+   */
+  RealImagePointer ComputeUnnormalizedDistancePriorProbabilityImage( unsigned int );
+
+  /**
+   * Divide by m_SumDistancePriorProbabilityImage inside the mask.
+   */
+  void NormalizeDistancePriorProbabilityImage( RealImageType * );
+
+  /**
+   * Compare the label image the distance priors are computed from with the
+   * copy kept from the last computation and update the copy.  Returns true
+   * if the labels have changed.
+   */
+  bool UpdateDistancePriorLabelImage();
+
   /**
    * Boolean variable governing the update scheme.  If set to true (default), an
    * asynchronous approach to updating the class labels is performed which
@@ -762,6 +823,13 @@ private:
    */
   void GenerateInitialClassLabelingWithKMeansClustering();
 
+  /**
+   * Index of the center nearest (in Euclidean distance) to the sample, both
+   * with numberOfComponents components.  centers holds the centers one after
+   * the other.
+   */
+  unsigned int GetNearestKMeansCluster( const RealType *, const std::vector<RealType> &, unsigned int ) const;
+
   /**
    * Initialize labeling using prior probability images.
    */
@@ -783,7 +851,8 @@ private:
   /**
    * This function returns a set of samples for each class such that each
    * measurement vector of the returned SampleType corresponds to a single
-   * voxel across the set of auxiliary and input images.
+   * voxel across the set of auxiliary and input images.  The samples are
+   * computed on the first call of each update and then reused.
    */
   typename SampleType::Pointer GetScalarSamples();
 
@@ -795,7 +864,117 @@ private:
 
   void EvaluateMRFNeighborhoodWeights( ConstNeighborhoodIterator<ClassifiedImageType>, Array<RealType> & );
 
-  RealType PerformLocalLabelingUpdate( NeighborhoodIterator<ClassifiedImageType> );
+  RealType PerformLocalLabelingUpdate( NeighborhoodIterator<ClassifiedImageType>, RandomizerType * );
+
+  typedef unsigned short                       CompactProbabilityType;
+  typedef std::vector<CompactProbabilityType>  CompactProbabilityVectorType;
+  typedef std::pair<SizeValueType, SizeValueType> CompactStorageRunType;
+
+  /**
+   * Compute the runs (buffer offset, length) of the voxels inside the mask
+   * which constitute the compact storage layout.
+   */
+  void ComputeCompactStorageRuns();
+
+  /**
+   * Gather the values of the voxels of the compact storage layout.
+   */
+  void GatherCompactStorageValues( const RealImageType *, std::vector<RealType> & ) const;
+
+  /**
+   * Quantize probabilities in [0, 1] to 16 bits.
+   */
+  void QuantizeProbabilities( const std::vector<RealType> &, CompactProbabilityVectorType & ) const;
+
+  /**
+   * Materialize a full probability image from its compact representation.
+   */
+  RealImagePointer ExpandCompactProbabilities( const CompactProbabilityVectorType & ) const;
+
+  typedef typename ClassifiedImageType::RegionType ClassifiedRegionType;
+
+  /**
+   * Structure shared by the threads updating the voxels of a single ICM
+   * code.  The requested region is cut into a fixed number of chunks which
+   * the threads grab dynamically so that the threads which finish early
+   * (e.g., on a chunk mostly outside the mask) take over the remaining work.
+   */
+  struct ICMThreadStruct
+    {
+    Self                                          *Filter;
+    LabelType                                      ICMCode;
+    std::vector<ClassifiedRegionType>              Chunks;
+    std::vector<typename RandomizerType::Pointer>  ChunkRandomizers;
+    std::vector<RealType>                          ChunkPosteriorSums;
+    SizeValueType                                  NextChunk;
+    SimpleFastMutexLock                            Mutex;
+    };
+
+  /**
+   * Update in parallel all the voxels of the given ICM code.  Voxels of the
+   * same code do not share MRF neighborhoods so they can be labeled
+   * independently.  Returns the sum of the maximum posterior probabilities.
+   */
+  RealType PerformParallelLabelingUpdate( LabelType );
+
+  RealType PerformLocalLabelingUpdateOverRegion( const ClassifiedRegionType &, LabelType, RandomizerType * );
+
+  static ITK_THREAD_RETURN_TYPE ICMThreaderCallback( void * );
+
+  /**
+   * Structure shared by the threads computing the unnormalized posterior
+   * probabilities of a single class.  Each chunk of the requested region is
+   * written by exactly one thread so the output images need no locking.
+   * The sum image is optional and, if given, the posterior probabilities
+   * are added to it.
+   */
+  struct PosteriorThreadStruct
+    {
+    Self                              *Filter;
+    unsigned int                       WhichClass;
+    bool                               StorePosteriorProbabilities;
+    RealImageType                     *PosteriorProbabilityImage;
+    RealImageType                     *SumPosteriorProbabilityImage;
+    const RealImageType               *SumPriorProbabilityImage;
+    const RealImageType               *PriorProbabilityImage;
+    const RealImageType               *DistancePriorProbabilityImage;
+    std::vector<RealImagePointer>      SmoothImages;
+    std::vector<ClassifiedRegionType>  Chunks;
+    SizeValueType                      NextChunk;
+    SimpleFastMutexLock                Mutex;
+    };
+
+  /**
+   * Compute in parallel the unnormalized posterior probabilities of the
+   * class described by the given structure over the masked voxels.
+   */
+  void PerformParallelPosteriorProbabilityUpdate( PosteriorThreadStruct & );
+
+  void ComputeLocalPosteriorProbabilitiesOverRegion( const ClassifiedRegionType &, const PosteriorThreadStruct & );
+
+  static ITK_THREAD_RETURN_TYPE PosteriorThreaderCallback( void * );
+
+  /**
+   * Structure shared by the threads re-estimating the mixture model
+   * components.  The components of different classes are independent once
+   * the class weights are known so each thread takes whole classes.
+   */
+  struct MStepThreadStruct
+    {
+    Self                *Filter;
+    const SampleType    *Sample;
+    unsigned int         NumberOfClasses;
+    unsigned int         NextClass;
+    SimpleFastMutexLock  Mutex;
+    };
+
+  /**
+   * Re-estimate the parameters of the specified mixture model component from
+   * the samples and the current class weights.
+   */
+  void UpdateMixtureModelComponent( unsigned int, const SampleType * );
+
+  static ITK_THREAD_RETURN_TYPE MStepThreaderCallback( void * );
 
   // ivars
 
@@ -852,6 +1031,7 @@ private:
   std::vector<ControlPointLatticeContainerType> m_ControlPointLattices;
 
   RealImagePointer m_SumDistancePriorProbabilityImage;
+  typename ClassifiedImageType::Pointer m_DistancePriorLabelImage;
   RealImagePointer m_SumPosteriorProbabilityImage;
   bool             m_MinimizeMemoryUsage;
 
@@ -859,6 +1039,15 @@ private:
   std::vector<RealImagePointer> m_DistancePriorProbabilityImages;
   std::vector<RealImagePointer> m_PosteriorProbabilityImages;
 
+  typename SampleType::Pointer m_ScalarSamples;
+  std::vector<WeightArrayType> m_ClassWeights;
+
+  bool                                      m_UseCompactProbabilityStorage;
+  std::vector<CompactStorageRunType>        m_CompactStorageRuns;
+  SizeValueType                             m_NumberOfCompactStorageVoxels;
+  std::vector<CompactProbabilityVectorType> m_CompactDistancePriorProbabilities;
+  std::vector<CompactProbabilityVectorType> m_CompactPosteriorProbabilities;
+
   itk::Array<unsigned long> m_LabelVolumes;
 
   std::vector<const ImageType *> m_IntensityImages;
@@ -18,6 +18,7 @@
 #include "antsAtroposSegmentationImageFilter.h"
 #include "antsGaussianListSampleFunction.h"
 #include "antsAllocImage.h"
+#include "antsUtilities.h"
 #include "itkAddImageFilter.h"
 #include "itkAddConstantToImageFilter.h"
 #include "itkBinaryContourImageFilter.h"
@@ -26,25 +27,19 @@
 #include "itkCastImageFilter.h"
 #include "itkConstNeighborhoodIterator.h"
 #include "itkContinuousIndex.h"
-#include "itkDistanceToCentroidMembershipFunction.h"
 #include "itkFastMarchingImageFilter.h"
 #include "itkImageDuplicator.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkIterationReporter.h"
-#include "itkKdTreeBasedKmeansEstimator.h"
 #include "itkLabelGeometryImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
-#include "itkMinimumDecisionRule.h"
 #include "itkMultiplyImageFilter.h"
 #include "itkMaskImageFilter.h"
 #include "itkOtsuMultipleThresholdsCalculator.h"
-#include "itkSampleClassifierFilter.h"
 #include "itkSignedMaurerDistanceMapImageFilter.h"
-#include "itkVariableSizeMatrix.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
-#include "itkWeightedCentroidKdTreeGenerator.h"
 
 #include "vnl/vnl_vector.h"
 
@@ -98,6 +93,10 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   this->m_UseEuclideanDistanceForPriorLabels = false;
   this->m_PosteriorProbabilityImages.clear();
   this->m_DistancePriorProbabilityImages.clear();
+  this->m_DistancePriorLabelImage = ITK_NULLPTR;
+
+  this->m_UseCompactProbabilityStorage = false;
+  this->m_NumberOfCompactStorageVoxels = 0;
 
   this->m_OutlierHandlingFilter = ITK_NULLPTR;
 
@@ -188,45 +187,12 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     }
   if( this->m_MinimizeMemoryUsage )
     {
-    // To make matters simpler, we force the index to be zero
-    //   for each priorImage image.
-
-    typename RealImageType::IndexType startIndex =
-      priorImage->GetRequestedRegion().GetIndex();
-
     typename SparseImageType::Pointer sparsePriorImage = SparseImageType::New();
     sparsePriorImage->Initialize();
 
-    unsigned long count = 0;
-
-    ImageRegionConstIteratorWithIndex<RealImageType> It( priorImage,
-                                                         priorImage->GetRequestedRegion() );
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      if( It.Get() > this->m_ProbabilityThreshold )
-        {
-        typename RealImageType::IndexType index = It.GetIndex();
-        for( unsigned int d = 0; d < ImageDimension; d++ )
-          {
-          index[d] -= startIndex[d];
-          }
-
-        unsigned long number = this->IndexToNumber(
-            index, priorImage->GetRequestedRegion().GetSize() );
-
-        typename SparseImageType::PointType imageNumberIndex;
-        imageNumberIndex[0] = number;
-
-        sparsePriorImage->SetPoint( count, imageNumberIndex );
-        sparsePriorImage->SetPointData( count, It.Get() );
-        count++;
-        }
-      }
-    if( this->m_PriorProbabilitySparseImages.size() < whichClass )
-      {
-      this->m_PriorProbabilitySparseImages.resize( whichClass );
-      }
-    this->m_PriorProbabilitySparseImages[whichClass - 1] = sparsePriorImage;
+    this->AddToSparsePriorProbabilityImage( sparsePriorImage, priorImage,
+                                            priorImage->GetRequestedRegion() );
+    this->SetPriorProbabilitySparseImage( whichClass, sparsePriorImage );
     }
   else
     {
@@ -238,6 +204,61 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     }
 }
 
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::SetPriorProbabilitySparseImage( unsigned int whichClass, SparseImageType * sparsePriorImage )
+{
+  if( whichClass < 1 || whichClass > this->m_NumberOfTissueClasses )
+    {
+    itkExceptionMacro( "The requested prior probability image = "
+                       << whichClass << " should be in the range [1, "
+                       << this->m_NumberOfTissueClasses << "]" );
+    }
+  if( this->m_PriorProbabilitySparseImages.size() < whichClass )
+    {
+    this->m_PriorProbabilitySparseImages.resize( whichClass );
+    }
+  this->m_PriorProbabilitySparseImages[whichClass - 1] = sparsePriorImage;
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::AddToSparsePriorProbabilityImage( SparseImageType * sparsePriorImage, const RealImageType * priorImage,
+                                    const typename RealImageType::RegionType & priorRegion ) const
+{
+  // To make matters simpler, we force the index to be zero
+  //   for each priorImage image.
+
+  const typename RealImageType::IndexType startIndex = priorRegion.GetIndex();
+
+  unsigned long count = sparsePriorImage->GetNumberOfPoints();
+
+  ImageRegionConstIteratorWithIndex<RealImageType> It( priorImage,
+                                                       priorImage->GetRequestedRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    if( It.Get() > this->m_ProbabilityThreshold )
+      {
+      typename RealImageType::IndexType index = It.GetIndex();
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        index[d] -= startIndex[d];
+        }
+
+      unsigned long number = this->IndexToNumber( index, priorRegion.GetSize() );
+
+      typename SparseImageType::PointType imageNumberIndex;
+      imageNumberIndex[0] = number;
+
+      sparsePriorImage->SetPoint( count, imageNumberIndex );
+      sparsePriorImage->SetPointData( count, It.Get() );
+      count++;
+      }
+    }
+}
+
 template <class TInputImage, class TMaskImage, class TClassifiedImage>
 typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 ::RealImagePointer
@@ -456,10 +477,16 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     this->m_NumberOfPartialVolumeClasses = 0;
     }
 
+  this->m_ScalarSamples = ITK_NULLPTR;
+  this->m_ClassWeights.clear();
+
   //
   // Initialize the class labeling and the likelihood models
   //
+  {
+  ANTS_PROFILE_SCOPE( "Atropos::GenerateInitialClassLabeling" );
   this->GenerateInitialClassLabeling();
+  }
 
   //
   // Iterate until convergence or iterative exhaustion.
@@ -480,6 +507,7 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     {
     reporter.CompletedStep();
 
+    ANTS_PROFILE_SCOPE( "Atropos::Iteration" );
     this->m_CurrentPosteriorProbability = this->UpdateClassLabeling();
 
     if( this->m_CurrentPosteriorProbability - probabilityOld <
@@ -499,6 +527,7 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     // recalculation of the posterior probability images.
     //
     this->m_PosteriorProbabilityImages.clear();
+    this->m_CompactPosteriorProbabilities.clear();
     }
 }
 
@@ -904,33 +933,20 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 {
   //
   // We first perform kmeans on the first image and use the results to
-  // seed the second run of kmeans using all the images.
+  // seed the second run of kmeans using all the images.  The first run is
+  // Lloyd's algorithm on the weighted bin centers of a fine histogram of the
+  // masked intensities, so each iteration costs the number of bins instead
+  // of the number of voxels.  The second run is mini-batch kmeans.
   //
-  typedef LabelStatisticsImageFilter<ImageType, MaskImageType> StatsType;
-  typename StatsType::Pointer stats = StatsType::New();
-  stats->SetInput( this->GetInput() );
-  if( this->GetMaskImage() )
-    {
-    stats->SetLabelInput( const_cast<MaskImageType *>( this->GetMaskImage() ) );
-    }
-  else
-    {
-    typename MaskImageType::Pointer maskImage =
-      AllocImage<MaskImageType>( this->GetOutput(), NumericTraits<LabelType>::OneValue() );
-    stats->SetLabelInput( maskImage );
-    }
-  stats->UseHistogramsOff();
-  stats->Update();
+  const unsigned int numberOfClasses = this->m_NumberOfTissueClasses;
+  const unsigned int numberOfImages = this->m_NumberOfIntensityImages;
 
-  const RealType minValue = stats->GetMinimum( NumericTraits<LabelType>::OneValue() );
-  const RealType maxValue = stats->GetMaximum( NumericTraits<LabelType>::OneValue() );
+  const unsigned int numberOfHistogramBins = 4096;
+  const unsigned int maximumNumberOfIterations = 200;
 
-  //
-  // The code below can be replaced by itkListSampleToImageFilter when we
-  // migrate over to the Statistics classes current in the Review/ directory.
-  //
-  typename SampleType::Pointer sample = SampleType::New();
-  sample->SetMeasurementVectorSize( 1 );
+  std::vector<RealType> samples;
+  RealType              minValue = NumericTraits<RealType>::max();
+  RealType              maxValue = NumericTraits<RealType>::NonpositiveMin();
 
   ImageRegionConstIteratorWithIndex<ImageType> ItI( this->GetInput(),
                                                     this->GetInput()->GetRequestedRegion() );
@@ -938,130 +954,101 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     {
     if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItI.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
       {
-      typename SampleType::MeasurementVectorType measurement;
-      measurement.SetSize( 1 );
-      measurement[0] = ItI.Get();
-      sample->PushBack( measurement );
+      const RealType value = static_cast<RealType>( ItI.Get() );
+      samples.push_back( value );
+      minValue = std::min( minValue, value );
+      maxValue = std::max( maxValue, value );
       }
     }
+  const size_t numberOfSamples = samples.size();
 
-  typedef itk::Statistics::WeightedCentroidKdTreeGenerator<SampleType>
-    TreeGeneratorType;
-  typename TreeGeneratorType::Pointer treeGenerator = TreeGeneratorType::New();
-  treeGenerator->SetSample( sample );
-  treeGenerator->SetBucketSize( 16 );
-  treeGenerator->Update();
-
-  typedef typename TreeGeneratorType::KdTreeType                TreeType;
-  typedef itk::Statistics::KdTreeBasedKmeansEstimator<TreeType> EstimatorType;
-  typename EstimatorType::Pointer estimator = EstimatorType::New();
-  estimator->SetKdTree( treeGenerator->GetOutput() );
-  estimator->SetMaximumIteration( 200 );
-  estimator->SetCentroidPositionChangesThreshold( 0.0 );
-
-  typename EstimatorType::ParametersType
-    initialMeans( this->m_NumberOfTissueClasses );
+  std::vector<RealType> binCounts( numberOfHistogramBins, 0.0 );
+  std::vector<RealType> binSums( numberOfHistogramBins, 0.0 );
+  const RealType        binScale = ( maxValue > minValue )
+    ? static_cast<RealType>( numberOfHistogramBins ) / ( maxValue - minValue ) : 0.0;
+  for( size_t k = 0; k < numberOfSamples; k++ )
+    {
+    const unsigned int bin = std::min( static_cast<unsigned int>( ( samples[k] - minValue ) * binScale ),
+                                       numberOfHistogramBins - 1 );
+    binCounts[bin] += 1.0;
+    binSums[bin] += samples[k];
+    }
 
   //
   // If the initial KMeans parameters are not set, guess initial class means by
   // dividing the dynamic range of the first image into equal intervals.
   //
-  if( this->m_InitialKMeansParameters.Size() == this->m_NumberOfTissueClasses )
+  std::vector<RealType> means( numberOfClasses );
+  if( this->m_InitialKMeansParameters.Size() == numberOfClasses )
     {
-    for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
       {
-      initialMeans[n] = this->m_InitialKMeansParameters[n];
+      means[n] = this->m_InitialKMeansParameters[n];
       }
     }
   else
     {
-    for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
       {
-      initialMeans[n] = minValue + ( maxValue - minValue )
+      means[n] = minValue + ( maxValue - minValue )
         * ( static_cast<RealType>( n ) + 0.5 )
-        / static_cast<RealType>( this->m_NumberOfTissueClasses );
+        / static_cast<RealType>( numberOfClasses );
       }
     }
-  estimator->SetParameters( initialMeans );
-  estimator->StartOptimization();
-
-  //
-  // Classify the samples
-  //
-  typedef itk::Statistics::MinimumDecisionRule DecisionRuleType;
-  typename DecisionRuleType::Pointer decisionRule = DecisionRuleType::New();
-
-  typedef itk::Statistics::SampleClassifierFilter<SampleType> ClassifierType;
-  typename ClassifierType::Pointer classifier = ClassifierType::New();
-  classifier->SetDecisionRule( decisionRule );
-  classifier->SetInput( sample );
-  classifier->SetNumberOfClasses( this->m_NumberOfTissueClasses );
-
-  typename ClassifierType::ClassLabelVectorObjectType::Pointer classLabels =
-    ClassifierType::ClassLabelVectorObjectType::New();
-  classifier->SetClassLabels( classLabels );
-  typename ClassifierType::ClassLabelVectorType & classLabelVector =
-    classLabels->Get();
-
-  //
-  // Order the cluster means so that the lowest mean of the input image
-  // corresponds to label '1', the second lowest to label '2', etc.
-  //
-  std::vector<RealType> estimatorParameters;
-  for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
-    {
-    estimatorParameters.push_back( estimator->GetParameters()[n] );
-    }
-  std::sort( estimatorParameters.begin(), estimatorParameters.end() );
 
-  typedef itk::Statistics::DistanceToCentroidMembershipFunction
-    <MeasurementVectorType> MembershipFunctionType;
-  typename ClassifierType::MembershipFunctionVectorObjectType::Pointer
-  membershipFunctions = ClassifierType::MembershipFunctionVectorObjectType::New();
-  typename ClassifierType::MembershipFunctionVectorType & membershipFunctionsVector =
-    membershipFunctions->Get();
-
-  classifier->SetMembershipFunctions( membershipFunctions );
-  for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+  for( unsigned int iteration = 0; iteration < maximumNumberOfIterations; iteration++ )
     {
-    typename MembershipFunctionType::Pointer
-    membershipFunction = MembershipFunctionType::New();
-    membershipFunction->SetMeasurementVectorSize(
-      sample->GetMeasurementVectorSize() );
-    typename MembershipFunctionType::CentroidType centroid;
-    NumericTraits<typename MembershipFunctionType::CentroidType>::SetLength(
-      centroid, sample->GetMeasurementVectorSize() );
-    centroid[0] = estimatorParameters[n];
-    membershipFunction->SetCentroid( centroid );
-    membershipFunctionsVector.push_back( membershipFunction.GetPointer() );
-
-    classLabelVector.push_back(
-      static_cast<typename ClassifierType::ClassLabelType>( n + 1 ) );
+    std::vector<RealType> clusterCounts( numberOfClasses, 0.0 );
+    std::vector<RealType> clusterSums( numberOfClasses, 0.0 );
+    for( unsigned int b = 0; b < numberOfHistogramBins; b++ )
+      {
+      if( binCounts[b] > 0.0 )
+        {
+        const RealType     binCenter = binSums[b] / binCounts[b];
+        const unsigned int n = this->GetNearestKMeansCluster( &binCenter, means, 1 );
+        clusterCounts[n] += binCounts[b];
+        clusterSums[n] += binSums[b];
+        }
+      }
+    bool hasConverged = true;
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
+      {
+      if( clusterCounts[n] > 0.0 )
+        {
+        const RealType mean = clusterSums[n] / clusterCounts[n];
+        if( mean != means[n] )
+          {
+          hasConverged = false;
+          }
+        means[n] = mean;
+        }
+      }
+    if( hasConverged )
+      {
+      break;
+      }
     }
-  classifier->Update();
 
   //
-  // Classify the voxels
+  // Order the cluster means so that the lowest mean of the input image
+  // corresponds to label '1', the second lowest to label '2', etc. and
+  // classify the voxels.
   //
-  typedef typename ClassifierType::MembershipSampleType ClassifierOutputType;
-  typedef typename ClassifierOutputType::ConstIterator  LabelIterator;
+  std::sort( means.begin(), means.end() );
 
   ImageRegionIteratorWithIndex<ClassifiedImageType> ItO( this->GetOutput(),
                                                          this->GetOutput()->GetRequestedRegion() );
-  ItO.GoToBegin();
-  LabelIterator it = classifier->GetOutput()->Begin();
-  while( it != classifier->GetOutput()->End() )
+  size_t k = 0;
+  for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
     {
     if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
       {
-      ItO.Set( it.GetClassLabel() );
-      ++it;
+      ItO.Set( static_cast<LabelType>( this->GetNearestKMeansCluster( &samples[k++], means, 1 ) + 1 ) );
       }
     else
       {
       ItO.Set( NumericTraits<LabelType>::ZeroValue() );
       }
-    ++ItO;
     }
 
   //
@@ -1069,144 +1056,137 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   // kmeans grouping to seed a second invoking of the algorithm using both
   // the input image and the auxiliary images.
   //
-  if( this->m_NumberOfIntensityImages > 1 )
+  if( numberOfImages > 1 && numberOfSamples > 0 )
     {
-    VariableSizeMatrix<RealType> classMeanValues;
-    classMeanValues.SetSize(
-      this->m_NumberOfIntensityImages, this->m_NumberOfTissueClasses );
-    for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
-      {
-      typedef LabelStatisticsImageFilter<ImageType, ClassifiedImageType> ClassStatsType;
-      typename ClassStatsType::Pointer stats2 = StatsType::New();
-      stats2->SetInput( this->GetIntensityImage( i ) );
-      stats2->SetLabelInput( this->GetOutput() );
-      stats2->UseHistogramsOff();
-      stats2->Update();
-      for( unsigned int j = 0; j < this->m_NumberOfTissueClasses; j++ )
-        {
-        classMeanValues( i, j ) = stats->GetMean( j + 1 );
-        }
-      }
+    std::vector<RealType> multivariateSamples( numberOfSamples * numberOfImages );
+    std::vector<RealType> centers( numberOfClasses * numberOfImages, 0.0 );
+    std::vector<RealType> centerCounts( numberOfClasses, 0.0 );
 
-    typename EstimatorType::Pointer estimator2 = EstimatorType::New();
-    typename EstimatorType::ParametersType initialMeans2(
-      this->m_NumberOfTissueClasses * ( this->m_NumberOfIntensityImages ) );
-    initialMeans2.Fill( 0.0 );
-    for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+    k = 0;
+    for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
       {
-      for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
+      if( !this->GetMaskImage() ||
+          this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
         {
-        initialMeans2[this->m_NumberOfIntensityImages * n + i] = classMeanValues( i, n );
+        const unsigned int n = ItO.Get() - 1;
+        for( unsigned int i = 0; i < numberOfImages; i++ )
+          {
+          const RealType value = this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
+          multivariateSamples[numberOfImages * k + i] = value;
+          centers[numberOfImages * n + i] += value;
+          }
+        centerCounts[n] += 1.0;
+        k++;
         }
       }
-
-    typename SampleType::Pointer sample2 = SampleType::New();
-    sample2->SetMeasurementVectorSize( this->m_NumberOfIntensityImages );
-    for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
       {
-      if( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<LabelType>::ZeroValue()  )
+      for( unsigned int i = 0; i < numberOfImages; i++ )
         {
-        typename SampleType::MeasurementVectorType measurement;
-        measurement.SetSize( this->m_NumberOfIntensityImages );
-        for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
+        if( centerCounts[n] > 0.0 )
           {
-          measurement[i] =
-            this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
+          centers[numberOfImages * n + i] /= centerCounts[n];
           }
-        sample2->PushBack( measurement );
         }
       }
 
-    typename TreeGeneratorType::Pointer treeGenerator2 =
-      TreeGeneratorType::New();
-    treeGenerator2->SetSample( sample2 );
-    treeGenerator2->SetBucketSize( 16 );
-    treeGenerator2->Update();
-
-    estimator2->SetParameters( initialMeans2 );
-    estimator2->SetKdTree( treeGenerator2->GetOutput() );
-    estimator2->SetMaximumIteration( 200 );
-    estimator2->SetCentroidPositionChangesThreshold( 0.0 );
-    estimator2->StartOptimization();
-
     //
-    // Classify the samples
+    // Mini-batch kmeans (Sculley, 2010):  each iteration assigns a random
+    // batch of samples to the current centers and then moves every center
+    // towards its samples with a per-center learning rate of 1 / (number of
+    // samples it has seen).  A fixed seed keeps the initialization
+    // reproducible.
     //
-    typename DecisionRuleType::Pointer decisionRule2 = DecisionRuleType::New();
+    const size_t batchSize = std::min( numberOfSamples, static_cast<size_t>( 4096 ) );
 
-    typename ClassifierType::Pointer classifier2 = ClassifierType::New();
-    classifier2->SetDecisionRule( decisionRule2 );
-    classifier2->SetInput( sample2 );
-    classifier2->SetNumberOfClasses( this->m_NumberOfTissueClasses );
+    typename RandomizerType::Pointer randomizer = RandomizerType::New();
+    randomizer->Initialize( 1967 );
 
-    typename ClassifierType::ClassLabelVectorObjectType::Pointer classLabels2 =
-      ClassifierType::ClassLabelVectorObjectType::New();
-    classifier2->SetClassLabels( classLabels2 );
-    typename ClassifierType::ClassLabelVectorType & classLabelVector2 =
-      classLabels2->Get();
+    std::vector<size_t>       batch( batchSize );
+    std::vector<unsigned int> batchLabels( batchSize );
+    std::fill( centerCounts.begin(), centerCounts.end(), 0.0 );
+    for( unsigned int iteration = 0; iteration < maximumNumberOfIterations; iteration++ )
+      {
+      for( size_t b = 0; b < batchSize; b++ )
+        {
+        batch[b] = ( batchSize == numberOfSamples ) ? b :
+          static_cast<size_t>( randomizer->GetIntegerVariate( static_cast<RandomizerSeedType>( numberOfSamples - 1 ) ) );
+        batchLabels[b] = this->GetNearestKMeansCluster(
+            &multivariateSamples[numberOfImages * batch[b]], centers, numberOfImages );
+        }
+      for( size_t b = 0; b < batchSize; b++ )
+        {
+        const unsigned int n = batchLabels[b];
+        centerCounts[n] += 1.0;
+        const RealType learningRate = 1.0 / centerCounts[n];
+        for( unsigned int i = 0; i < numberOfImages; i++ )
+          {
+          RealType & center = centers[numberOfImages * n + i];
+          center += learningRate * ( multivariateSamples[numberOfImages * batch[b] + i] - center );
+          }
+        }
+      }
 
     //
-    // Order the cluster means so that the lowest mean of the input image
-    // corresponds to label '1', the second lowest to label '2', etc.
+    // Order the clusters by their mean of the input image and classify the
+    // voxels.
     //
-    std::vector<RealType> estimatorParameters2;
-    for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+    std::vector<std::pair<RealType, unsigned int> > order( numberOfClasses );
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
       {
-      estimatorParameters2.push_back( estimator2->GetParameters()[n] );
+      order[n] = std::make_pair( centers[numberOfImages * n], n );
       }
-    std::sort( estimatorParameters2.begin(), estimatorParameters2.end() );
+    std::sort( order.begin(), order.end() );
 
-    typename ClassifierType::MembershipFunctionVectorObjectType::Pointer
-    membershipFunctions2 = ClassifierType::MembershipFunctionVectorObjectType::New();
-    typename ClassifierType::MembershipFunctionVectorType & membershipFunctionsVector2 =
-      membershipFunctions2->Get();
-
-    classifier2->SetMembershipFunctions( membershipFunctions2 );
-    for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+    std::vector<RealType> sortedCenters( centers.size() );
+    for( unsigned int n = 0; n < numberOfClasses; n++ )
       {
-      typename MembershipFunctionType::Pointer
-      membershipFunction2 = MembershipFunctionType::New();
-      membershipFunction2->SetMeasurementVectorSize(
-        sample2->GetMeasurementVectorSize() );
-      typename MembershipFunctionType::CentroidType centroid;
-      NumericTraits<typename MembershipFunctionType::CentroidType>::SetLength(
-        centroid, sample2->GetMeasurementVectorSize() );
-      for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
-        {
-        centroid[i] = estimator2->GetParameters()[
-            ( this->m_NumberOfIntensityImages ) * n + i];
-        }
-      membershipFunction2->SetCentroid( centroid );
-      membershipFunctionsVector2.push_back( membershipFunction2.GetPointer() );
-
-      classLabelVector2.push_back(
-        static_cast<typename ClassifierType::ClassLabelType>( n + 1 ) );
+      std::copy( centers.begin() + numberOfImages * order[n].second,
+                 centers.begin() + numberOfImages * ( order[n].second + 1 ),
+                 sortedCenters.begin() + numberOfImages * n );
       }
-    classifier2->Update();
 
-    //
-    // Classify the voxels
-    //
-    ItO.GoToBegin();
-    LabelIterator it2 = classifier->GetOutput()->Begin();
-    while( it2 != classifier->GetOutput()->End() )
+    k = 0;
+    for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
       {
       if( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<LabelType>::ZeroValue() )
-        {
-        ItO.Set( it2.GetClassLabel() );
-        ++it2;
-        }
-      else
+          this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
         {
-        ItO.Set( NumericTraits<LabelType>::ZeroValue() );
+        ItO.Set( static_cast<LabelType>( this->GetNearestKMeansCluster(
+                                           &multivariateSamples[numberOfImages * k++], sortedCenters,
+                                           numberOfImages ) + 1 ) );
         }
-      ++ItO;
       }
     }
 }
 
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+unsigned int
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::GetNearestKMeansCluster( const RealType *sample, const std::vector<RealType> & centers,
+                           unsigned int numberOfComponents ) const
+{
+  const unsigned int numberOfClusters = centers.size() / numberOfComponents;
+
+  unsigned int nearestCluster = 0;
+  RealType     minimumDistance = NumericTraits<RealType>::max();
+  for( unsigned int n = 0; n < numberOfClusters; n++ )
+    {
+    RealType distance = 0.0;
+    for( unsigned int i = 0; i < numberOfComponents; i++ )
+      {
+      const RealType difference = sample[i] - centers[numberOfComponents * n + i];
+      distance += difference * difference;
+      }
+    if( distance < minimumDistance )
+      {
+      minimumDistance = distance;
+      nearestCluster = n;
+      }
+    }
+  return nearestCluster;
+}
+
 template <class TInputImage, class TMaskImage, class TClassifiedImage>
 typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 ::RealType
@@ -1217,19 +1197,13 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 
   if( this->m_UseAsynchronousUpdating )
     {
+    ANTS_PROFILE_SCOPE( "Atropos::E-step (ICM)" );
+
     if( this->m_MaximumICMCode == 0 )
       {
       this->ComputeICMCodeImage();
       }
 
-    typename NeighborhoodIterator<ClassifiedImageType>::RadiusType radius;
-    for( unsigned int d = 0; d < ImageDimension; d++ )
-      {
-      radius[d] = this->m_MRFRadius[d];
-      }
-    NeighborhoodIterator<ClassifiedImageType> ItO( radius, this->GetOutput(),
-                                                   this->GetOutput()->GetRequestedRegion() );
-
     maxPosteriorSum = 0.0;
     RealType     oldMaxPosteriorSum = -1.0;
     unsigned int numberOfIterations = 0;
@@ -1260,13 +1234,7 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
         }
       for( unsigned int n = 0; n < icmCodeSet.Size(); n++ )
         {
-        for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
-          {
-          if( this->m_ICMCodeImage->GetPixel( ItO.GetIndex() ) == icmCodeSet[n] )
-            {
-            maxPosteriorSum += this->PerformLocalLabelingUpdate( ItO );
-            }
-          }
+        maxPosteriorSum += this->PerformParallelLabelingUpdate( icmCodeSet[n] );
         }
       itkDebugMacro( "ICM posterior probability sum: " << maxPosteriorSum );
       }
@@ -1285,13 +1253,16 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   Array<RealType> sumPosteriors( totalNumberOfClasses );
   sumPosteriors.Fill( 0.0 );
 
-  typename SampleType::Pointer sample = SampleType::New();
-  sample = this->GetScalarSamples();
+  typename SampleType::Pointer sample = this->GetScalarSamples();
   unsigned long totalSampleSize = sample->Size();
+  this->m_ClassWeights.resize( totalNumberOfClasses );
   for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
     {
-    RealImagePointer posteriorProbabilityImage
-      = this->GetPosteriorProbabilityImage( n + 1 );
+    RealImagePointer posteriorProbabilityImage;
+    {
+    ANTS_PROFILE_SCOPE( "Atropos::E-step (posteriors)" );
+    posteriorProbabilityImage = this->GetPosteriorProbabilityImage( n + 1 );
+    }
 
     ImageRegionIteratorWithIndex<ClassifiedImageType> ItO( maxLabels,
                                                            maxLabels->GetRequestedRegion() );
@@ -1300,7 +1271,9 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     ImageRegionIterator<RealImageType> ItM( maxPosteriorProbabilityImage,
                                             maxPosteriorProbabilityImage->GetRequestedRegion() );
 
-    WeightArrayType weights( totalSampleSize );
+    // kept across iterations; the likelihood functions hold a pointer to it
+    WeightArrayType & weights = this->m_ClassWeights[n];
+    weights.SetSize( totalSampleSize );
 
     unsigned long count = 0;
 
@@ -1346,25 +1319,8 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
       ++ItO;
       }
 
-    if( n < this->m_NumberOfTissueClasses )
-      {
-      this->m_MixtureModelComponents[n]->SetListSampleWeights( &weights );
-      this->m_MixtureModelComponents[n]->SetInputListSample( sample );
-      this->m_MixtureModelComponents[n]->ClearInputListSample();
-      }
-    else
+    if( n >= this->m_NumberOfTissueClasses )
       {
-      PartialVolumeLabelSetType labelSet =
-        this->m_PartialVolumeClasses[n - this->m_NumberOfTissueClasses];
-      for( unsigned d = 0; d < labelSet.size(); d++ )
-        {
-        if( n == labelSet[d] - 1 )
-          {
-          this->m_MixtureModelComponents[n]->SetListSampleWeights( d, &weights );
-          this->m_MixtureModelComponents[n]->SetIndexedInputListSample( d, sample );
-          this->m_MixtureModelComponents[n]->ClearInputListSample( d );
-          }
-        }
       this->m_MixtureModelProportions[n] = 0.0;
       }
 
@@ -1380,6 +1336,28 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
       }
     }
 
+  //
+  // The posterior probabilities of a class do not depend on the parameters
+  // of the other classes so the mixture model components are only updated
+  // once all the class weights are known, and then concurrently.
+  //
+  {
+  ANTS_PROFILE_SCOPE( "Atropos::M-step" );
+
+  MStepThreadStruct str;
+  str.Filter = this;
+  str.Sample = sample;
+  str.NumberOfClasses = totalNumberOfClasses;
+  str.NextClass = 0;
+
+  const unsigned int numberOfThreads = std::max( std::min( static_cast<unsigned int>(
+    this->GetNumberOfThreads() ), totalNumberOfClasses ), 1u );
+
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( this->MStepThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+  }
+
   typedef LabelGeometryImageFilter<ClassifiedImageType, ImageType> GeometryType;
   typename GeometryType::Pointer geom = GeometryType::New();
   geom->SetInput( maxLabels );
@@ -1549,60 +1527,210 @@ template <class TInputImage, class TMaskImage, class TClassifiedImage>
 typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 ::RealType
 AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
-::PerformLocalLabelingUpdate( NeighborhoodIterator<ClassifiedImageType> It )
+::PerformParallelLabelingUpdate( LabelType icmCode )
 {
-  MeasurementVectorType measurement;
+  // The number of chunks is fixed (and not tied to the number of threads)
+  // and each chunk has its own random number stream so that the labeling
+  // does not depend on the number of threads or the scheduling.
+  const unsigned int numberOfRequestedChunks = 256;
 
-  measurement.SetSize( this->m_NumberOfIntensityImages );
-  for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
+  const ClassifiedRegionType & region = this->GetOutput()->GetRequestedRegion();
+
+  ICMThreadStruct str;
+  str.Filter = this;
+  str.ICMCode = icmCode;
+  str.NextChunk = 0;
+
+  const RandomizerSeedType seed = this->m_Randomizer->GetIntegerVariate();
+
+  const unsigned int numberOfChunks =
+    this->GetImageRegionSplitter()->GetNumberOfSplits( region, numberOfRequestedChunks );
+  for( unsigned int n = 0; n < numberOfChunks; n++ )
     {
-    measurement[i] = this->GetIntensityImage( i )->GetPixel( It.GetIndex() );
+    ClassifiedRegionType chunk = region;
+    this->GetImageRegionSplitter()->GetSplit( n, numberOfChunks, chunk );
+    str.Chunks.push_back( chunk );
+
+    typename RandomizerType::Pointer randomizer = RandomizerType::New();
+    randomizer->Initialize( seed + static_cast<RandomizerSeedType>( n ) );
+    str.ChunkRandomizers.push_back( randomizer );
     }
+  str.ChunkPosteriorSums.assign( str.Chunks.size(), 0.0 );
 
-  RealType mrfSmoothingFactor = this->m_MRFSmoothingFactor;
-  if( this->m_MRFCoefficientImage )
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ICMThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  RealType maxPosteriorSum = 0.0;
+  for( unsigned int n = 0; n < str.ChunkPosteriorSums.size(); n++ )
     {
-    mrfSmoothingFactor = this->m_MRFCoefficientImage->GetPixel( It.GetIndex() );
+    maxPosteriorSum += str.ChunkPosteriorSums[n];
     }
+  return maxPosteriorSum;
+}
 
-  Array<RealType> mrfNeighborhoodWeights;
-  this->EvaluateMRFNeighborhoodWeights( It, mrfNeighborhoodWeights );
-
-  LabelType maxLabel =
-    this->m_Randomizer->GetIntegerVariate( this->m_NumberOfTissueClasses - 1 ) + 1;
-  RealType maxPosteriorProbability = 0.0;
-  RealType sumPosteriorProbability = 0.0;
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+ITK_THREAD_RETURN_TYPE
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::ICMThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ICMThreadStruct *str = static_cast<ICMThreadStruct *>( info->UserData );
 
-  unsigned int totalNumberOfClasses = this->m_NumberOfTissueClasses
-    + this->m_NumberOfPartialVolumeClasses;
-  for( unsigned int k = 0; k < totalNumberOfClasses; k++ )
+  while( true )
     {
-    // Calculate likelihood probability
+    str->Mutex.Lock();
+    const SizeValueType chunk = str->NextChunk++;
+    str->Mutex.Unlock();
 
-    RealType likelihood =
-      this->m_MixtureModelComponents[k]->Evaluate( measurement );
+    if( chunk >= str->Chunks.size() )
+      {
+      break;
+      }
+    str->ChunkPosteriorSums[chunk] = str->Filter->PerformLocalLabelingUpdateOverRegion(
+      str->Chunks[chunk], str->ICMCode, str->ChunkRandomizers[chunk] );
+    }
 
-    // Calculate the mrf prior probability
+  return ITK_THREAD_RETURN_VALUE;
+}
 
-    RealType mrfPriorProbability = 1.0;
-    if( mrfSmoothingFactor > 0.0 && ( It.GetNeighborhood() ).Size() > 1 )
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::UpdateMixtureModelComponent( unsigned int n, const SampleType *sample )
+{
+  WeightArrayType & weights = this->m_ClassWeights[n];
+
+  if( n < this->m_NumberOfTissueClasses )
+    {
+    this->m_MixtureModelComponents[n]->SetListSampleWeights( &weights );
+    this->m_MixtureModelComponents[n]->SetInputListSample( sample );
+    this->m_MixtureModelComponents[n]->ClearInputListSample();
+    }
+  else
+    {
+    PartialVolumeLabelSetType labelSet =
+      this->m_PartialVolumeClasses[n - this->m_NumberOfTissueClasses];
+    for( unsigned d = 0; d < labelSet.size(); d++ )
       {
-      RealType numerator = std::exp( -mrfSmoothingFactor * mrfNeighborhoodWeights[k] );
-      RealType denominator = 0.0;
-      for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+      if( n == labelSet[d] - 1 )
         {
-        denominator += std::exp( -mrfSmoothingFactor * mrfNeighborhoodWeights[n] );
-        }
-      if( denominator > 0.0 )
-        {
-        mrfPriorProbability = numerator / denominator;
+        this->m_MixtureModelComponents[n]->SetListSampleWeights( d, &weights );
+        this->m_MixtureModelComponents[n]->SetIndexedInputListSample( d, sample );
+        this->m_MixtureModelComponents[n]->ClearInputListSample( d );
         }
       }
+    }
+}
 
-    // Get the spatial prior probability
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+ITK_THREAD_RETURN_TYPE
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::MStepThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  MStepThreadStruct *str = static_cast<MStepThreadStruct *>( info->UserData );
 
-    RealType priorProbability = 1.0;
-    if( this->GetPriorProbabilityImage( k + 1 ) )
+  while( true )
+    {
+    str->Mutex.Lock();
+    const unsigned int n = str->NextClass++;
+    str->Mutex.Unlock();
+
+    if( n >= str->NumberOfClasses )
+      {
+      break;
+      }
+    str->Filter->UpdateMixtureModelComponent( n, str->Sample );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::RealType
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::PerformLocalLabelingUpdateOverRegion( const ClassifiedRegionType & region, LabelType icmCode,
+                                        RandomizerType *randomizer )
+{
+  typename NeighborhoodIterator<ClassifiedImageType>::RadiusType radius;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    radius[d] = this->m_MRFRadius[d];
+    }
+  NeighborhoodIterator<ClassifiedImageType> ItO( radius, this->GetOutput(), region );
+  ImageRegionConstIterator<ClassifiedImageType> ItC( this->m_ICMCodeImage, region );
+
+  RealType maxPosteriorSum = 0.0;
+  for( ItO.GoToBegin(), ItC.GoToBegin(); !ItO.IsAtEnd(); ++ItO, ++ItC )
+    {
+    if( ItC.Get() == icmCode )
+      {
+      maxPosteriorSum += this->PerformLocalLabelingUpdate( ItO, randomizer );
+      }
+    }
+  return maxPosteriorSum;
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::RealType
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::PerformLocalLabelingUpdate( NeighborhoodIterator<ClassifiedImageType> It, RandomizerType *randomizer )
+{
+  MeasurementVectorType measurement;
+
+  measurement.SetSize( this->m_NumberOfIntensityImages );
+  for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
+    {
+    measurement[i] = this->GetIntensityImage( i )->GetPixel( It.GetIndex() );
+    }
+
+  RealType mrfSmoothingFactor = this->m_MRFSmoothingFactor;
+  if( this->m_MRFCoefficientImage )
+    {
+    mrfSmoothingFactor = this->m_MRFCoefficientImage->GetPixel( It.GetIndex() );
+    }
+
+  Array<RealType> mrfNeighborhoodWeights;
+  this->EvaluateMRFNeighborhoodWeights( It, mrfNeighborhoodWeights );
+
+  LabelType maxLabel =
+    randomizer->GetIntegerVariate( this->m_NumberOfTissueClasses - 1 ) + 1;
+  RealType maxPosteriorProbability = 0.0;
+  RealType sumPosteriorProbability = 0.0;
+
+  unsigned int totalNumberOfClasses = this->m_NumberOfTissueClasses
+    + this->m_NumberOfPartialVolumeClasses;
+  for( unsigned int k = 0; k < totalNumberOfClasses; k++ )
+    {
+    // Calculate likelihood probability
+
+    RealType likelihood =
+      this->m_MixtureModelComponents[k]->Evaluate( measurement );
+
+    // Calculate the mrf prior probability
+
+    RealType mrfPriorProbability = 1.0;
+    if( mrfSmoothingFactor > 0.0 && ( It.GetNeighborhood() ).Size() > 1 )
+      {
+      RealType numerator = std::exp( -mrfSmoothingFactor * mrfNeighborhoodWeights[k] );
+      RealType denominator = 0.0;
+      for( unsigned int n = 0; n < this->m_NumberOfTissueClasses; n++ )
+        {
+        denominator += std::exp( -mrfSmoothingFactor * mrfNeighborhoodWeights[n] );
+        }
+      if( denominator > 0.0 )
+        {
+        mrfPriorProbability = numerator / denominator;
+        }
+      }
+
+    // Get the spatial prior probability
+
+    RealType priorProbability = 1.0;
+    if( this->GetPriorProbabilityImage( k + 1 ) )
       {
       priorProbability =
         this->GetPriorProbabilityImage( k + 1 )->GetPixel( It.GetIndex() );
@@ -1654,10 +1782,27 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   //
   // This function returns a set of samples for each class such that each
   // measurement vector of the returned SampleType corresponds to a single
-  // voxel across the set of auxiliary and input images.
+  // voxel across the set of auxiliary and input images.  The samples only
+  // depend on the intensity images, the mask and the outlier handling, so
+  // they are computed once per update and the same list is returned to every
+  // iteration.
   //
+  if( this->m_ScalarSamples.IsNotNull() )
+    {
+    return this->m_ScalarSamples;
+    }
 
-  std::vector<typename SampleType::Pointer> samples;
+  unsigned long numberOfSamples = 0;
+
+  ImageRegionIteratorWithIndex<ClassifiedImageType> ItO( this->GetOutput(),
+                                                         this->GetOutput()->GetRequestedRegion() );
+  for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
+    {
+    if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
+      {
+      numberOfSamples++;
+      }
+    }
 
   //
   // Accumulate the samples in individual SampleTypes.  This allows us to
@@ -1666,27 +1811,29 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   // converting vector/tensor auxiliary images to scalar data for
   // modeling.
   //
+  std::vector<typename SampleType::Pointer> samples;
   for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
     {
     typename SampleType::Pointer sample = SampleType::New();
     sample->SetMeasurementVectorSize( 1 );
+    sample->Resize( numberOfSamples );
     samples.push_back( sample );
     }
 
-  ImageRegionIteratorWithIndex<ClassifiedImageType> ItO( this->GetOutput(),
-                                                         this->GetOutput()->GetRequestedRegion() );
+  typename SampleType::MeasurementVectorType measurement;
+  NumericTraits<MeasurementVectorType>::SetLength( measurement, 1 );
+
+  unsigned long count = 0;
   for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
     {
     if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
       {
       for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
         {
-        typename SampleType::MeasurementVectorType measurement;
-        NumericTraits<MeasurementVectorType>::SetLength( measurement, 1 );
-        measurement.SetSize( 1 );
         measurement[0] = this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
-        samples[i]->PushBack( measurement );
+        samples[i]->SetMeasurementVector( count, measurement );
         }
+      count++;
       }
     }
 
@@ -1712,32 +1859,29 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 
     if( i == 0 )
       {
-      typename SampleType::ConstIterator It = univariateSamples->Begin();
-      while( It != univariateSamples->End() )
+      typename SampleType::MeasurementVectorType scalarMeasurement;
+      NumericTraits<MeasurementVectorType>::SetLength( scalarMeasurement,
+                                                       this->m_NumberOfIntensityImages );
+      scalarMeasurement.Fill( 0.0 );
+
+      scalarSamples->Resize( univariateSamples->Size() );
+      for( unsigned long k = 0; k < univariateSamples->Size(); k++ )
         {
-        typename SampleType::MeasurementVectorType measurement;
-        measurement.SetSize( this->m_NumberOfIntensityImages );
-        NumericTraits<MeasurementVectorType>::SetLength( measurement,
-                                                         this->m_NumberOfIntensityImages );
-        measurement[0] = It.GetMeasurementVector()[0];
-        scalarSamples->PushBack( measurement );
-        ++It;
+        scalarMeasurement[0] = univariateSamples->GetMeasurementVector( k )[0];
+        scalarSamples->SetMeasurementVector( k, scalarMeasurement );
         }
       }
     else
       {
-      typename SampleType::Iterator ItS = scalarSamples->Begin();
-      typename SampleType::ConstIterator It = univariateSamples->Begin();
-      while( ItS != scalarSamples->End() )
+      for( unsigned long k = 0; k < scalarSamples->Size(); k++ )
         {
-        scalarSamples->SetMeasurement( ItS.GetInstanceIdentifier(), i,
-                                       It.GetMeasurementVector()[0] );
-        ++It;
-        ++ItS;
+        scalarSamples->SetMeasurement( k, i, univariateSamples->GetMeasurementVector( k )[0] );
         }
       }
+    samples[i] = ITK_NULLPTR;
     }
 
+  this->m_ScalarSamples = scalarSamples;
   return scalarSamples;
 }
 
@@ -1984,6 +2128,10 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     {
     return this->m_PosteriorProbabilityImages[whichClass - 1];
     }
+  else if( whichClass <= this->m_CompactPosteriorProbabilities.size() )
+    {
+    return this->ExpandCompactProbabilities( this->m_CompactPosteriorProbabilities[whichClass - 1] );
+    }
   else
     {
     //
@@ -2006,6 +2154,18 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
       this->m_SumPosteriorProbabilityImage =
         AllocImage<RealImageType>( this->GetOutput(), 0 );
 
+      const bool useCompactStorage = ( !this->m_MinimizeMemoryUsage &&
+                                       this->m_UseCompactProbabilityStorage );
+
+      // In compact mode, the unnormalized posteriors are only kept inside
+      // the mask until their sum is known.
+      std::vector<std::vector<RealType> > unnormalizedPosteriorProbabilities;
+      if( useCompactStorage )
+        {
+        this->ComputeCompactStorageRuns();
+        unnormalizedPosteriorProbabilities.resize( totalNumberOfClasses );
+        }
+
       RealImagePointer sumPriorProbabilityImage = ITK_NULLPTR;
 
       if( this->m_InitializationStrategy == PriorLabelImage ||
@@ -2077,150 +2237,22 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
         RealImagePointer priorProbabilityImage =
           this->GetPriorProbabilityImage( c + 1 );
 
-        typename NeighborhoodIterator<ClassifiedImageType>::RadiusType radius;
-        unsigned int neighborhoodSize = 1;
-        for( unsigned int d = 0; d < ImageDimension; d++ )
-          {
-          neighborhoodSize *= ( 2 * this->m_MRFRadius[d] + 1 );
-          radius[d] = this->m_MRFRadius[d];
-          }
-
-        ConstNeighborhoodIterator<ClassifiedImageType> ItO( radius,
-                                                            this->GetOutput(),
-                                                            this->GetOutput()->GetRequestedRegion() );
-        ImageRegionIterator<RealImageType> ItS(
-          this->m_SumPosteriorProbabilityImage,
-          this->m_SumPosteriorProbabilityImage->GetRequestedRegion() );
-        for( ItO.GoToBegin(), ItS.GoToBegin(); !ItO.IsAtEnd(); ++ItO, ++ItS )
+        PosteriorThreadStruct str;
+        str.WhichClass = c + 1;
+        str.StorePosteriorProbabilities = ( c == 0 || !this->m_MinimizeMemoryUsage );
+        str.PosteriorProbabilityImage = posteriorProbabilityImage;
+        str.SumPosteriorProbabilityImage = this->m_SumPosteriorProbabilityImage;
+        str.SumPriorProbabilityImage = sumPriorProbabilityImage;
+        str.PriorProbabilityImage = priorProbabilityImage;
+        str.DistancePriorProbabilityImage = distancePriorProbabilityImage;
+        str.SmoothImages = smoothImages;
+        this->PerformParallelPosteriorProbabilityUpdate( str );
+        if( useCompactStorage )
           {
-          if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
-            {
-            RealType mrfSmoothingFactor = this->m_MRFSmoothingFactor;
-            if( this->m_MRFCoefficientImage )
-              {
-              mrfSmoothingFactor = this->m_MRFCoefficientImage->GetPixel( ItO.GetIndex() );
-              }
-            //
-            // Perform mrf prior calculation
-            //
-            RealType mrfPriorProbability = 1.0;
-            if( mrfSmoothingFactor > 0.0 && ( ItO.GetNeighborhood() ).Size() > 1 )
-              {
-              Array<RealType> mrfNeighborhoodWeights;
-              this->EvaluateMRFNeighborhoodWeights( ItO, mrfNeighborhoodWeights );
-
-              RealType numerator = std::exp( -mrfSmoothingFactor
-                                            * mrfNeighborhoodWeights[c] );
-              RealType denominator = 0.0;
-              for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
-                {
-                denominator += std::exp( -mrfSmoothingFactor
-                                        * mrfNeighborhoodWeights[n] );
-                }
-              if( denominator > 0.0 )
-                {
-                mrfPriorProbability = numerator / denominator;
-                }
-              }
-
-            //
-            // Perform prior calculation using both the mixing proportions
-            // and template-based prior images (if available)
-            //
-            RealType priorProbability = 0.0;
-            RealType distancePriorProbability = 0.0;
-            if( this->m_InitializationStrategy == PriorLabelImage ||
-                this->m_InitializationStrategy == PriorProbabilityImages )
-              {
-              if( distancePriorProbabilityImage )
-                {
-                distancePriorProbability =
-                  distancePriorProbabilityImage->GetPixel( ItO.GetIndex() );
-                }
-              if( priorProbabilityImage )
-                {
-                priorProbability =
-                  priorProbabilityImage->GetPixel( ItO.GetIndex() );
-                }
-              else if( this->GetPriorLabelImage() )
-                {
-                if( priorProbability == 0.0 )
-                  {
-                  priorProbability = 1.0
-                    / static_cast<RealType>( totalNumberOfClasses );
-                  }
-                else
-                  {
-                  priorProbability = 1.0;
-                  }
-                }
-              RealType sumPriorProbability =
-                sumPriorProbabilityImage->GetPixel( ItO.GetIndex() );
-              if( sumPriorProbability > this->m_ProbabilityThreshold )
-                {
-                priorProbability *= ( this->m_MixtureModelProportions[c]
-                                      / sumPriorProbability );
-                }
-              else if( distancePriorProbabilityImage )
-                {
-                priorProbability = distancePriorProbability;
-                }
-              }
-
-            MeasurementVectorType measurement;
-            measurement.SetSize( this->m_NumberOfIntensityImages );
-            for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
-              {
-              measurement[i] =
-                this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
-
-              if( ( this->m_InitializationStrategy == PriorProbabilityImages ||
-                    this->m_InitializationStrategy == PriorLabelImage ) &&
-                  smoothImages[i] )
-                {
-                measurement[i] = ( 1.0 - this->m_AdaptiveSmoothingWeights[i] )
-                  * measurement[i] + this->m_AdaptiveSmoothingWeights[i]
-                  * smoothImages[i]->GetPixel( ItO.GetIndex() );
-                }
-              }
-
-            //
-            // Calculate likelihood probability from the model
-            //
-            RealType likelihood =
-              this->m_MixtureModelComponents[c]->Evaluate( measurement );
-
-            //
-            // Calculate the local posterior probability.  Given that the
-            // algorithm is meant to maximize the posterior probability of the
-            // labeling configuration, this is the critical energy minimization
-            // equation.
-            //
-            RealType posteriorProbability =
-              this->CalculateLocalPosteriorProbability(
-                this->m_MixtureModelProportions[c], priorProbability,
-                distancePriorProbability, mrfPriorProbability, likelihood,
-                ItO.GetIndex(), c + 1 );
-
-            if( vnl_math_isnan( posteriorProbability ) ||
-                vnl_math_isinf( posteriorProbability ) )
-              {
-              posteriorProbability = 0.0;
-              }
-
-            if( ( c == 0 ) || !this->m_MinimizeMemoryUsage )
-              {
-              posteriorProbabilityImage->SetPixel( ItO.GetIndex(),
-                                                   posteriorProbability );
-              }
-
-            //
-            // Calculate a running total of the posterior probabilities.
-            //
-            ItS.Set( ItS.Get() + posteriorProbability  );
-            }
+          this->GatherCompactStorageValues( posteriorProbabilityImage,
+                                            unnormalizedPosteriorProbabilities[c] );
           }
-        if( !this->m_MinimizeMemoryUsage )
+        else if( !this->m_MinimizeMemoryUsage )
           {
           typedef ImageDuplicator<RealImageType> DuplicatorType;
           typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
@@ -2251,6 +2283,33 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
           }
         return posteriorProbabilityImage;
         }
+      else if( useCompactStorage )
+        {
+        const RealType *sumBuffer = this->m_SumPosteriorProbabilityImage->GetBufferPointer();
+
+        this->m_CompactPosteriorProbabilities.resize( totalNumberOfClasses );
+        for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
+          {
+          std::vector<RealType> & posteriors = unnormalizedPosteriorProbabilities[n];
+
+          SizeValueType count = 0;
+          for( SizeValueType r = 0; r < this->m_CompactStorageRuns.size(); r++ )
+            {
+            const RealType *sum = sumBuffer + this->m_CompactStorageRuns[r].first;
+            for( SizeValueType k = 0; k < this->m_CompactStorageRuns[r].second; k++ )
+              {
+              if( sum[k] > 0 )
+                {
+                posteriors[count] /= sum[k];
+                }
+              ++count;
+              }
+            }
+          this->QuantizeProbabilities( posteriors, this->m_CompactPosteriorProbabilities[n] );
+          std::vector<RealType>().swap( posteriors );
+          }
+        return this->ExpandCompactProbabilities( this->m_CompactPosteriorProbabilities[0] );
+        }
       else
         {
         for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
@@ -2344,122 +2403,16 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
       RealImagePointer priorProbabilityImage =
         this->GetPriorProbabilityImage( whichClass );
 
-      typename NeighborhoodIterator<ClassifiedImageType>::RadiusType radius;
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        radius[d] = this->m_MRFRadius[d];
-        }
-
-      ConstNeighborhoodIterator<ClassifiedImageType> ItO( radius,
-                                                          this->GetOutput(), this->GetOutput()->GetRequestedRegion() );
-      for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
-        {
-        if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
-          {
-          RealType mrfSmoothingFactor = this->m_MRFSmoothingFactor;
-          if( this->m_MRFCoefficientImage )
-            {
-            mrfSmoothingFactor = this->m_MRFCoefficientImage->GetPixel( ItO.GetIndex() );
-            }
-          //
-          // Perform mrf prior calculation
-          //
-          RealType mrfPriorProbability = 1.0;
-          if( mrfSmoothingFactor > 0.0 && ( ItO.GetNeighborhood() ).Size() > 1 )
-            {
-            Array<RealType> mrfNeighborhoodWeights;
-            this->EvaluateMRFNeighborhoodWeights( ItO, mrfNeighborhoodWeights );
-
-            RealType numerator = std::exp( -mrfSmoothingFactor
-                                          * mrfNeighborhoodWeights[whichClass - 1] );
-            RealType denominator = 0.0;
-            for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
-              {
-              denominator += std::exp( -mrfSmoothingFactor * mrfNeighborhoodWeights[n] );
-              }
-            if( denominator > 0.0 )
-              {
-              mrfPriorProbability = numerator / denominator;
-              }
-            }
-
-          //
-          // Perform prior calculation using both the mixing proportions
-          // and template-based prior images (if available)
-          //
-          RealType priorProbability = 0.0;
-          RealType distancePriorProbability = 0.0;
-          if( this->m_InitializationStrategy == PriorLabelImage ||
-              this->m_InitializationStrategy == PriorProbabilityImages )
-            {
-            if( distancePriorProbabilityImage )
-              {
-              distancePriorProbability =
-                distancePriorProbabilityImage->GetPixel( ItO.GetIndex() );
-              }
-            if( priorProbabilityImage )
-              {
-              priorProbability =
-                priorProbabilityImage->GetPixel( ItO.GetIndex() );
-              }
-            RealType sumPriorProbability =
-              sumPriorProbabilityImage->GetPixel( ItO.GetIndex() );
-            if( sumPriorProbability > this->m_ProbabilityThreshold )
-              {
-              priorProbability *= ( this->m_MixtureModelProportions[whichClass - 1]
-                                    / sumPriorProbability );
-              }
-            else if( distancePriorProbabilityImage )
-              {
-              priorProbability = distancePriorProbability;
-              }
-            }
-
-          MeasurementVectorType measurement;
-          measurement.SetSize( this->m_NumberOfIntensityImages );
-          for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
-            {
-            measurement[i] =
-              this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
-
-            if( ( this->m_InitializationStrategy == PriorProbabilityImages ||
-                  this->m_InitializationStrategy == PriorLabelImage ) &&
-                smoothImages[i] )
-              {
-              measurement[i] = ( 1.0 - this->m_AdaptiveSmoothingWeights[i] )
-                * measurement[i] + this->m_AdaptiveSmoothingWeights[i]
-                * smoothImages[i]->GetPixel( ItO.GetIndex() );
-              }
-            }
-
-          //
-          // Calculate likelihood probability from the model
-          //
-          RealType likelihood =
-            this->m_MixtureModelComponents[whichClass - 1]->Evaluate( measurement );
-
-          //
-          // Calculate the local posterior probability.  Given that the
-          // algorithm is meant to maximize the posterior probability of the
-          // labeling configuration, this is the critical energy minimization
-          // equation.
-          //
-          RealType posteriorProbability =
-            this->CalculateLocalPosteriorProbability(
-              this->m_MixtureModelProportions[whichClass - 1], priorProbability,
-              distancePriorProbability, mrfPriorProbability, likelihood,
-              ItO.GetIndex(), whichClass );
-
-          if( vnl_math_isnan( posteriorProbability ) ||
-              vnl_math_isinf( posteriorProbability ) )
-            {
-            posteriorProbability = 0.0;
-            }
-
-          posteriorProbabilityImage->SetPixel( ItO.GetIndex(),
-                                               posteriorProbability );
-          }
-        }
+      PosteriorThreadStruct str;
+      str.WhichClass = whichClass;
+      str.StorePosteriorProbabilities = true;
+      str.PosteriorProbabilityImage = posteriorProbabilityImage;
+      str.SumPosteriorProbabilityImage = ITK_NULLPTR;
+      str.SumPriorProbabilityImage = sumPriorProbabilityImage;
+      str.PriorProbabilityImage = priorProbabilityImage;
+      str.DistancePriorProbabilityImage = distancePriorProbabilityImage;
+      str.SmoothImages = smoothImages;
+      this->PerformParallelPosteriorProbabilityUpdate( str );
 
       //
       // Normalize the posterior probability image(s).
@@ -2482,474 +2435,573 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
 }
 
 template <class TInputImage, class TMaskImage, class TClassifiedImage>
-typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
-::RealImagePointer
+void
 AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
-::GetDistancePriorProbabilityImage( unsigned int whichClass )
+::PerformParallelPosteriorProbabilityUpdate( PosteriorThreadStruct & str )
 {
-  unsigned int totalNumberOfClasses = this->m_NumberOfTissueClasses
-    + this->m_NumberOfPartialVolumeClasses;
+  // More chunks than threads so that the threads which finish early (e.g.,
+  // on a chunk mostly outside the mask) take over the remaining work.
+  const unsigned int numberOfRequestedChunks = 256;
 
-  if( ( this->m_InitializationStrategy != PriorLabelImage &&
-        this->m_InitializationStrategy != PriorProbabilityImages ) ||
-      ( whichClass > this->m_NumberOfTissueClasses && whichClass <=
-        totalNumberOfClasses ) )
+  const ClassifiedRegionType & region = this->GetOutput()->GetRequestedRegion();
+
+  str.Filter = this;
+  str.NextChunk = 0;
+  str.Chunks.clear();
+
+  const unsigned int numberOfChunks =
+    this->GetImageRegionSplitter()->GetNumberOfSplits( region, numberOfRequestedChunks );
+  for( unsigned int n = 0; n < numberOfChunks; n++ )
     {
-    return ITK_NULLPTR;
+    ClassifiedRegionType chunk = region;
+    this->GetImageRegionSplitter()->GetSplit( n, numberOfChunks, chunk );
+    str.Chunks.push_back( chunk );
     }
-  if( this->m_NumberOfPartialVolumeClasses == 0 && whichClass
-      > this->m_NumberOfTissueClasses )
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->PosteriorThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+ITK_THREAD_RETURN_TYPE
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::PosteriorThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  PosteriorThreadStruct *str = static_cast<PosteriorThreadStruct *>( info->UserData );
+
+  while( true )
     {
-    itkExceptionMacro( "The requested distance prior probability image = "
-                       << whichClass << " should be in the range [1, "
-                       << this->m_NumberOfTissueClasses << "]" );
+    str->Mutex.Lock();
+    const SizeValueType chunk = str->NextChunk++;
+    str->Mutex.Unlock();
+
+    if( chunk >= str->Chunks.size() )
+      {
+      break;
+      }
+    str->Filter->ComputeLocalPosteriorProbabilitiesOverRegion( str->Chunks[chunk], *str );
     }
-  else if( whichClass > this->m_NumberOfTissueClasses )
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::ComputeLocalPosteriorProbabilitiesOverRegion( const ClassifiedRegionType & region,
+                                                const PosteriorThreadStruct & str )
+{
+  const unsigned int totalNumberOfClasses = this->m_NumberOfTissueClasses
+    + this->m_NumberOfPartialVolumeClasses;
+  const unsigned int c = str.WhichClass - 1;
+
+  typename NeighborhoodIterator<ClassifiedImageType>::RadiusType radius;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
     {
-    return ITK_NULLPTR;
+    radius[d] = this->m_MRFRadius[d];
     }
 
-  //
-  // If memory minimization is turned off and if the distance prior probability
-  // images have already been calculated, simply return the probability
-  // image for the requested class.  Otherwise, calculate the probability
-  // image.
-  //
-  if( whichClass <= this->m_DistancePriorProbabilityImages.size() )
+  // Buffers of this thread, reused for all the voxels of the chunk.
+  Array<RealType> mrfNeighborhoodWeights;
+  MeasurementVectorType measurement;
+  measurement.SetSize( this->m_NumberOfIntensityImages );
+
+  ConstNeighborhoodIterator<ClassifiedImageType> ItO( radius, this->GetOutput(), region );
+  for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO )
     {
-    return this->m_DistancePriorProbabilityImages[whichClass - 1];
-    }
-  else
-    {
-    //
-    // Here we assume that the calling function is invoked in order such
-    // that GetDistancePriorImage( 1 ) is called before
-    // GetDistancePriorImage( 2 ), etc.  As such, when this part of
-    // the code is reached and the class requested is '1', we assume that
-    // the sum of the distance prior probability images needs to be calculated
-    // for normalization purposes.  This sum is then saved for subsequent calls.
-    //
-    RealImagePointer distancePriorProbabilityImage = ITK_NULLPTR;
-
-    //
-    // Calculate the sum of the distance probability images.  Also, store the
-    // distance probability images if m_MinimizeMemoryUsage == false.
-    //
-    if( whichClass == 1 )
+    if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItO.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
       {
-      this->m_SumDistancePriorProbabilityImage = RealImageType::New();
-      this->m_SumDistancePriorProbabilityImage->CopyInformation( this->GetOutput() );
-      this->m_SumDistancePriorProbabilityImage->SetRegions(
-        this->GetOutput()->GetRequestedRegion() );
-      this->m_SumDistancePriorProbabilityImage->Allocate();
-      this->m_SumDistancePriorProbabilityImage->FillBuffer( 0 );
-      for( unsigned int c = 0; c < this->m_NumberOfTissueClasses; c++ )
+      RealType mrfSmoothingFactor = this->m_MRFSmoothingFactor;
+      if( this->m_MRFCoefficientImage )
         {
-        typedef BinaryThresholdImageFilter<ClassifiedImageType, RealImageType>
-          ThresholderType;
-        typename ThresholderType::Pointer thresholder = ThresholderType::New();
-        if( this->m_InitializationStrategy == PriorLabelImage )
+        mrfSmoothingFactor = this->m_MRFCoefficientImage->GetPixel( ItO.GetIndex() );
+        }
+      //
+      // Perform mrf prior calculation
+      //
+      RealType mrfPriorProbability = 1.0;
+      if( mrfSmoothingFactor > 0.0 && ( ItO.GetNeighborhood() ).Size() > 1 )
+        {
+        this->EvaluateMRFNeighborhoodWeights( ItO, mrfNeighborhoodWeights );
+
+        RealType numerator = std::exp( -mrfSmoothingFactor
+                                      * mrfNeighborhoodWeights[c] );
+        RealType denominator = 0.0;
+        for( unsigned int n = 0; n < totalNumberOfClasses; n++ )
           {
-          thresholder->SetInput( const_cast<ClassifiedImageType *>(
-                                   this->GetPriorLabelImage() ) );
+          denominator += std::exp( -mrfSmoothingFactor
+                                  * mrfNeighborhoodWeights[n] );
           }
-        else
+        if( denominator > 0.0 )
           {
-          thresholder->SetInput( this->GetOutput() );
+          mrfPriorProbability = numerator / denominator;
           }
-        thresholder->SetInsideValue( 1 );
-        thresholder->SetOutsideValue( 0 );
-        thresholder->SetLowerThreshold( static_cast<LabelType>( c + 1 ) );
-        thresholder->SetUpperThreshold( static_cast<LabelType>( c + 1 ) );
-        thresholder->Update();
-
-        RealImagePointer distanceImage = RealImageType::New();
+        }
 
-        if( this->m_UseEuclideanDistanceForPriorLabels )
+      //
+      // Perform prior calculation using both the mixing proportions
+      // and template-based prior images (if available)
+      //
+      RealType priorProbability = 0.0;
+      RealType distancePriorProbability = 0.0;
+      if( this->m_InitializationStrategy == PriorLabelImage ||
+          this->m_InitializationStrategy == PriorProbabilityImages )
+        {
+        if( str.DistancePriorProbabilityImage )
           {
-          typedef SignedMaurerDistanceMapImageFilter
-            <RealImageType, RealImageType> DistancerType;
-          typename DistancerType::Pointer distancer = DistancerType::New();
-          distancer->SetInput( thresholder->GetOutput() );
-          distancer->SetSquaredDistance( false );
-          distancer->SetUseImageSpacing( true );
-          distancer->SetInsideIsPositive( false );
-          distancer->Update();
-
-          distanceImage = distancer->GetOutput();
+          distancePriorProbability =
+            str.DistancePriorProbabilityImage->GetPixel( ItO.GetIndex() );
           }
-        else
+        if( str.PriorProbabilityImage )
           {
-          typedef BinaryContourImageFilter<RealImageType, RealImageType>
-            ContourFilterType;
-          typename ContourFilterType::Pointer contour = ContourFilterType::New();
-          contour->SetInput( thresholder->GetOutput() );
-          contour->FullyConnectedOff();
-          contour->SetBackgroundValue( 0 );
-          contour->SetForegroundValue( 1 );
-          contour->Update();
-
-          typedef FastMarchingImageFilter<RealImageType, RealImageType>
-            FastMarchingFilterType;
-          typename FastMarchingFilterType::Pointer fastMarching
-            = FastMarchingFilterType::New();
-
-          typedef CastImageFilter<MaskImageType, RealImageType> CasterType;
-          typename CasterType::Pointer caster = CasterType::New();
-          if( this->GetMaskImage() )
-            {
-            caster->SetInput( const_cast<MaskImageType *>( this->GetMaskImage() ) );
-            caster->Update();
-            fastMarching->SetInput( caster->GetOutput() );
-            }
-          else
-            {
-            fastMarching->SetSpeedConstant( 1.0 );
-            fastMarching->SetOverrideOutputInformation( true );
-            fastMarching->SetOutputOrigin( this->GetOutput()->GetOrigin() );
-            fastMarching->SetOutputSpacing( this->GetOutput()->GetSpacing() );
-            fastMarching->SetOutputRegion( this->GetOutput()->GetRequestedRegion() );
-            fastMarching->SetOutputDirection( this->GetOutput()->GetDirection() );
-            }
-
-          typedef typename FastMarchingFilterType::NodeContainer NodeContainer;
-          typedef typename FastMarchingFilterType::NodeType      NodeType;
-          typename NodeContainer::Pointer trialPoints = NodeContainer::New();
-          trialPoints->Initialize();
-
-          unsigned long trialCount = 0;
-
-          ImageRegionIteratorWithIndex<RealImageType> ItC(
-            contour->GetOutput(), contour->GetOutput()->GetRequestedRegion() );
-          for( ItC.GoToBegin(); !ItC.IsAtEnd(); ++ItC )
-            {
-            if( ItC.Get() == contour->GetForegroundValue() )
-              {
-              NodeType node;
-              node.SetValue( 0.0 );
-              node.SetIndex( ItC.GetIndex() );
-              trialPoints->InsertElement( trialCount++, node );
-              }
-            }
-          fastMarching->SetTrialPoints( trialPoints );
-          fastMarching->SetStoppingValue( NumericTraits<RealType>::max() );
-//           fastMarching->SetTopologyCheck( FastMarchingFilterType::None );
-          fastMarching->Update();
-
-          ImageRegionIterator<RealImageType> ItT( thresholder->GetOutput(),
-                                                  thresholder->GetOutput()->GetRequestedRegion() );
-          ImageRegionIterator<RealImageType> ItF( fastMarching->GetOutput(),
-                                                  fastMarching->GetOutput()->GetRequestedRegion() );
-          for( ItT.GoToBegin(), ItF.GoToBegin(); !ItT.IsAtEnd(); ++ItT, ++ItF )
-            {
-            if( ItT.Get() == 1 )
-              {
-              ItF.Set( -ItF.Get() );
-              }
-            }
-
-          distanceImage = fastMarching->GetOutput();
+          priorProbability =
+            str.PriorProbabilityImage->GetPixel( ItO.GetIndex() );
           }
-
-        RealType maximumInteriorDistance = 0.0;
-
-        ImageRegionIterator<RealImageType> ItD( distanceImage,
-                                                distanceImage->GetRequestedRegion() );
-        for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+        else if( this->GetPriorLabelImage() )
           {
-          if( ItD.Get() < 0 &&
-              maximumInteriorDistance < vnl_math_abs( ItD.Get() ) )
-            {
-            maximumInteriorDistance = vnl_math_abs( ItD.Get() );
-            }
+          priorProbability = 1.0
+            / static_cast<RealType>( totalNumberOfClasses );
           }
-
-        RealType labelLambda = 0.0;
-        RealType labelBoundaryProbability = 1.0;
-
-        typename LabelParameterMapType::iterator it =
-          this->m_PriorLabelParameterMap.find( c + 1 );
-        if( it != this->m_PriorLabelParameterMap.end() )
+        RealType sumPriorProbability =
+          str.SumPriorProbabilityImage->GetPixel( ItO.GetIndex() );
+        if( sumPriorProbability > this->m_ProbabilityThreshold )
           {
-          labelLambda = ( it->second ).first;
-          labelBoundaryProbability = ( it->second ).second;
+          priorProbability *= ( this->m_MixtureModelProportions[c]
+                                / sumPriorProbability );
           }
-        for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+        else if( str.DistancePriorProbabilityImage )
           {
-          if( labelLambda == 0 )
-            {
-            if( ItD.Get() <= 0 )
-              {
-              ItD.Set( labelBoundaryProbability );
-              }
-            else
-              {
-              ItD.Set( 0.0 );
-              }
-            }
-          else if( ItD.Get() >= 0 )
-            {
-            ItD.Set( labelBoundaryProbability
-                     * std::exp( -labelLambda * ItD.Get() ) );
-            }
-          else if( ItD.Get() < 0 )
-            {
-            ItD.Set( 1.0 - ( 1.0 - labelBoundaryProbability )
-                     * ( maximumInteriorDistance - vnl_math_abs( ItD.Get() ) )
-                     / ( maximumInteriorDistance ) );
-            }
+          priorProbability = distancePriorProbability;
           }
+        }
 
-        typedef AddImageFilter<RealImageType, RealImageType, RealImageType>
-          AdderType;
-        typename AdderType::Pointer adder = AdderType::New();
-        adder->SetInput1( this->m_SumDistancePriorProbabilityImage );
-        adder->SetInput2( distanceImage );
-        adder->Update();
-
-        this->m_SumDistancePriorProbabilityImage = adder->GetOutput();
+      for( unsigned int i = 0; i < this->m_NumberOfIntensityImages; i++ )
+        {
+        measurement[i] =
+          this->GetIntensityImage( i )->GetPixel( ItO.GetIndex() );
 
-        if( ( c == 0 ) && this->m_MinimizeMemoryUsage )
-          {
-          distancePriorProbabilityImage = distanceImage;
-          }
-        if( !this->m_MinimizeMemoryUsage )
+        if( ( this->m_InitializationStrategy == PriorProbabilityImages ||
+              this->m_InitializationStrategy == PriorLabelImage ) &&
+            i < str.SmoothImages.size() && str.SmoothImages[i] )
           {
-          this->m_DistancePriorProbabilityImages.push_back(
-            distanceImage );
+          measurement[i] = ( 1.0 - this->m_AdaptiveSmoothingWeights[i] )
+            * measurement[i] + this->m_AdaptiveSmoothingWeights[i]
+            * str.SmoothImages[i]->GetPixel( ItO.GetIndex() );
           }
         }
 
       //
-      // Normalize the distance prior probability image(s).
+      // Calculate likelihood probability from the model
       //
-      ImageRegionIterator<RealImageType> ItS(
-        this->m_SumDistancePriorProbabilityImage,
-        this->m_SumDistancePriorProbabilityImage->GetRequestedRegion() );
-      if( this->m_MinimizeMemoryUsage )
+      RealType likelihood =
+        this->m_MixtureModelComponents[c]->Evaluate( measurement );
+
+      //
+      // Calculate the local posterior probability.  Given that the
+      // algorithm is meant to maximize the posterior probability of the
+      // labeling configuration, this is the critical energy minimization
+      // equation.
+      //
+      RealType posteriorProbability =
+        this->CalculateLocalPosteriorProbability(
+          this->m_MixtureModelProportions[c], priorProbability,
+          distancePriorProbability, mrfPriorProbability, likelihood,
+          ItO.GetIndex(), str.WhichClass );
+
+      if( vnl_math_isnan( posteriorProbability ) ||
+          vnl_math_isinf( posteriorProbability ) )
         {
-        ImageRegionIteratorWithIndex<RealImageType> ItD(
-          distancePriorProbabilityImage,
-          distancePriorProbabilityImage->GetRequestedRegion() );
-        for( ItD.GoToBegin(), ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItD, ++ItS )
-          {
-          if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItD.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
-            {
-            if( ItS.Get() <= this->m_ProbabilityThreshold )
-              {
-              ItD.Set( NumericTraits<RealType>::ZeroValue() );
-              }
-            else
-              {
-              ItD.Set( ItD.Get() / ItS.Get() );
-              }
-            }
-          }
-        return distancePriorProbabilityImage;
+        posteriorProbability = 0.0;
         }
-      else
+
+      if( str.StorePosteriorProbabilities )
         {
-        for( unsigned int c = 0; c < this->m_NumberOfTissueClasses; c++ )
-          {
-          ImageRegionIteratorWithIndex<RealImageType> ItD(
-            this->m_DistancePriorProbabilityImages[c],
-            this->m_DistancePriorProbabilityImages[c]->GetRequestedRegion() );
-          for( ItD.GoToBegin(), ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItD, ++ItS )
-            {
-            if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItD.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
-              {
-              if( ItS.Get() <= this->m_ProbabilityThreshold )
-                {
-                ItD.Set( NumericTraits<RealType>::ZeroValue() );
-                }
-              else
-                {
-                ItD.Set( ItD.Get() / ItS.Get() );
-                }
-              }
-            }
-          }
-        return this->m_DistancePriorProbabilityImages[0];
+        str.PosteriorProbabilityImage->SetPixel( ItO.GetIndex(),
+                                                 posteriorProbability );
+        }
+
+      //
+      // Calculate a running total of the posterior probabilities.
+      //
+      if( str.SumPosteriorProbabilityImage )
+        {
+        str.SumPosteriorProbabilityImage->SetPixel( ItO.GetIndex(),
+          str.SumPosteriorProbabilityImage->GetPixel( ItO.GetIndex() ) + posteriorProbability );
         }
       }
-    else // whichClass > 1
+    }
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::RealImagePointer
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::ComputeUnnormalizedDistancePriorProbabilityImage( unsigned int whichClass )
+{
+  typedef BinaryThresholdImageFilter<ClassifiedImageType, RealImageType>
+    ThresholderType;
+  typename ThresholderType::Pointer thresholder = ThresholderType::New();
+  if( this->m_InitializationStrategy == PriorLabelImage )
+    {
+    thresholder->SetInput( const_cast<ClassifiedImageType *>(
+                             this->GetPriorLabelImage() ) );
+    }
+  else
+    {
+    thresholder->SetInput( this->GetOutput() );
+    }
+  thresholder->SetInsideValue( 1 );
+  thresholder->SetOutsideValue( 0 );
+  thresholder->SetLowerThreshold( static_cast<LabelType>( whichClass ) );
+  thresholder->SetUpperThreshold( static_cast<LabelType>( whichClass ) );
+  thresholder->Update();
+
+  RealImagePointer distanceImage = RealImageType::New();
+
+  if( this->m_UseEuclideanDistanceForPriorLabels )
+    {
+    typedef SignedMaurerDistanceMapImageFilter
+      <RealImageType, RealImageType> DistancerType;
+    typename DistancerType::Pointer distancer = DistancerType::New();
+    distancer->SetInput( thresholder->GetOutput() );
+    distancer->SetSquaredDistance( false );
+    distancer->SetUseImageSpacing( true );
+    distancer->SetInsideIsPositive( false );
+    distancer->Update();
+
+    distanceImage = distancer->GetOutput();
+    }
+  else
+    {
+    typedef BinaryContourImageFilter<RealImageType, RealImageType>
+      ContourFilterType;
+    typename ContourFilterType::Pointer contour = ContourFilterType::New();
+    contour->SetInput( thresholder->GetOutput() );
+    contour->FullyConnectedOff();
+    contour->SetBackgroundValue( 0 );
+    contour->SetForegroundValue( 1 );
+    contour->Update();
+
+    typedef FastMarchingImageFilter<RealImageType, RealImageType>
+      FastMarchingFilterType;
+    typename FastMarchingFilterType::Pointer fastMarching
+      = FastMarchingFilterType::New();
+
+    typedef CastImageFilter<MaskImageType, RealImageType> CasterType;
+    typename CasterType::Pointer caster = CasterType::New();
+    if( this->GetMaskImage() )
       {
-      typedef BinaryThresholdImageFilter<ClassifiedImageType, RealImageType>
-        ThresholderType;
-      typename ThresholderType::Pointer thresholder = ThresholderType::New();
-      if( this->m_InitializationStrategy == PriorLabelImage )
+      caster->SetInput( const_cast<MaskImageType *>( this->GetMaskImage() ) );
+      caster->Update();
+      fastMarching->SetInput( caster->GetOutput() );
+      }
+    else
+      {
+      fastMarching->SetSpeedConstant( 1.0 );
+      fastMarching->SetOverrideOutputInformation( true );
+      fastMarching->SetOutputOrigin( this->GetOutput()->GetOrigin() );
+      fastMarching->SetOutputSpacing( this->GetOutput()->GetSpacing() );
+      fastMarching->SetOutputRegion( this->GetOutput()->GetRequestedRegion() );
+      fastMarching->SetOutputDirection( this->GetOutput()->GetDirection() );
+      }
+
+    typedef typename FastMarchingFilterType::NodeContainer NodeContainer;
+    typedef typename FastMarchingFilterType::NodeType      NodeType;
+    typename NodeContainer::Pointer trialPoints = NodeContainer::New();
+    trialPoints->Initialize();
+
+    unsigned long trialCount = 0;
+
+    ImageRegionIteratorWithIndex<RealImageType> ItC(
+      contour->GetOutput(), contour->GetOutput()->GetRequestedRegion() );
+    for( ItC.GoToBegin(); !ItC.IsAtEnd(); ++ItC )
+      {
+      if( ItC.Get() == contour->GetForegroundValue() )
         {
-        thresholder->SetInput( const_cast<ClassifiedImageType *>(
-                                 this->GetPriorLabelImage() ) );
+        NodeType node;
+        node.SetValue( 0.0 );
+        node.SetIndex( ItC.GetIndex() );
+        trialPoints->InsertElement( trialCount++, node );
         }
-      else
+      }
+    fastMarching->SetTrialPoints( trialPoints );
+    fastMarching->SetStoppingValue( NumericTraits<RealType>::max() );
+//         fastMarching->SetTopologyCheck( FastMarchingFilterType::None );
+    fastMarching->Update();
+
+    ImageRegionIterator<RealImageType> ItT( thresholder->GetOutput(),
+                                            thresholder->GetOutput()->GetRequestedRegion() );
+    ImageRegionIterator<RealImageType> ItF( fastMarching->GetOutput(),
+                                            fastMarching->GetOutput()->GetRequestedRegion() );
+    for( ItT.GoToBegin(), ItF.GoToBegin(); !ItT.IsAtEnd(); ++ItT, ++ItF )
+      {
+      if( ItT.Get() == 1 )
         {
-        thresholder->SetInput( this->GetOutput() );
+        ItF.Set( -ItF.Get() );
         }
-      thresholder->SetInsideValue( 1 );
-      thresholder->SetOutsideValue( 0 );
-      thresholder->SetLowerThreshold( static_cast<LabelType>( whichClass ) );
-      thresholder->SetUpperThreshold( static_cast<LabelType>( whichClass ) );
-      thresholder->Update();
+      }
+    distanceImage = fastMarching->GetOutput();
+    }
 
-      RealImagePointer distanceImage = RealImageType::New();
+  RealImagePointer distancePriorProbabilityImage = distanceImage;
 
-      if( this->m_UseEuclideanDistanceForPriorLabels )
-        {
-        typedef SignedMaurerDistanceMapImageFilter
-          <RealImageType, RealImageType> DistancerType;
-        typename DistancerType::Pointer distancer = DistancerType::New();
-        distancer->SetInput( thresholder->GetOutput() );
-        distancer->SetSquaredDistance( false );
-        distancer->SetUseImageSpacing( true );
-        distancer->SetInsideIsPositive( false );
-        distancer->Update();
+  RealType maximumInteriorDistance = 0.0;
 
-        distanceImage = distancer->GetOutput();
+  ImageRegionIterator<RealImageType> ItD( distancePriorProbabilityImage,
+                                          distancePriorProbabilityImage->GetRequestedRegion() );
+  for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+    {
+    if( ItD.Get() < 0 &&
+        maximumInteriorDistance < vnl_math_abs( ItD.Get() ) )
+      {
+      maximumInteriorDistance = vnl_math_abs( ItD.Get() );
+      }
+    }
+
+  RealType labelLambda = 0.0;
+  RealType labelBoundaryProbability = 1.0;
+
+  typename LabelParameterMapType::iterator it =
+    this->m_PriorLabelParameterMap.find( whichClass );
+  if( it != this->m_PriorLabelParameterMap.end() )
+    {
+    labelLambda = ( it->second ).first;
+    labelBoundaryProbability = ( it->second ).second;
+    }
+  for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+    {
+    if( labelLambda == 0 )
+      {
+      if( ItD.Get() <= 0 )
+        {
+        ItD.Set( labelBoundaryProbability );
         }
       else
         {
-        typedef BinaryContourImageFilter<RealImageType, RealImageType>
-          ContourFilterType;
-        typename ContourFilterType::Pointer contour = ContourFilterType::New();
-        contour->SetInput( thresholder->GetOutput() );
-        contour->FullyConnectedOff();
-        contour->SetBackgroundValue( 0 );
-        contour->SetForegroundValue( 1 );
-        contour->Update();
-
-        typedef FastMarchingImageFilter<RealImageType, RealImageType>
-          FastMarchingFilterType;
-        typename FastMarchingFilterType::Pointer fastMarching
-          = FastMarchingFilterType::New();
-
-        typedef CastImageFilter<MaskImageType, RealImageType> CasterType;
-        typename CasterType::Pointer caster = CasterType::New();
-        if( this->GetMaskImage() )
-          {
-          caster->SetInput( const_cast<MaskImageType *>( this->GetMaskImage() ) );
-          caster->Update();
-          fastMarching->SetInput( caster->GetOutput() );
-          }
-        else
-          {
-          fastMarching->SetSpeedConstant( 1.0 );
-          fastMarching->SetOverrideOutputInformation( true );
-          fastMarching->SetOutputOrigin( this->GetOutput()->GetOrigin() );
-          fastMarching->SetOutputSpacing( this->GetOutput()->GetSpacing() );
-          fastMarching->SetOutputRegion( this->GetOutput()->GetRequestedRegion() );
-          fastMarching->SetOutputDirection( this->GetOutput()->GetDirection() );
-          }
-
-        typedef typename FastMarchingFilterType::NodeContainer NodeContainer;
-        typedef typename FastMarchingFilterType::NodeType      NodeType;
-        typename NodeContainer::Pointer trialPoints = NodeContainer::New();
-        trialPoints->Initialize();
-
-        unsigned long trialCount = 0;
+        ItD.Set( 0.0 );
+        }
+      }
+    else if( ItD.Get() >= 0 )
+      {
+      ItD.Set( labelBoundaryProbability
+               * std::exp( -labelLambda * ItD.Get() ) );
+      }
+    else if( ItD.Get() < 0 )
+      {
+      ItD.Set( 1.0 - ( 1.0 - labelBoundaryProbability )
+               * ( maximumInteriorDistance - vnl_math_abs( ItD.Get() ) )
+               / ( maximumInteriorDistance ) );
+      }
+    }
 
-        ImageRegionIteratorWithIndex<RealImageType> ItC(
-          contour->GetOutput(), contour->GetOutput()->GetRequestedRegion() );
-        for( ItC.GoToBegin(); !ItC.IsAtEnd(); ++ItC )
-          {
-          if( ItC.Get() == contour->GetForegroundValue() )
-            {
-            NodeType node;
-            node.SetValue( 0.0 );
-            node.SetIndex( ItC.GetIndex() );
-            trialPoints->InsertElement( trialCount++, node );
-            }
-          }
-        fastMarching->SetTrialPoints( trialPoints );
-        fastMarching->SetStoppingValue( NumericTraits<RealType>::max() );
-//         fastMarching->SetTopologyCheck( FastMarchingFilterType::None );
-        fastMarching->Update();
+  return distancePriorProbabilityImage;
+}
 
-        ImageRegionIterator<RealImageType> ItT( thresholder->GetOutput(),
-                                                thresholder->GetOutput()->GetRequestedRegion() );
-        ImageRegionIterator<RealImageType> ItF( fastMarching->GetOutput(),
-                                                fastMarching->GetOutput()->GetRequestedRegion() );
-        for( ItT.GoToBegin(), ItF.GoToBegin(); !ItT.IsAtEnd(); ++ItT, ++ItF )
-          {
-          if( ItT.Get() == 1 )
-            {
-            ItF.Set( -ItF.Get() );
-            }
-          }
-        distanceImage = fastMarching->GetOutput();
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::NormalizeDistancePriorProbabilityImage( RealImageType *distancePriorProbabilityImage )
+{
+  ImageRegionIterator<RealImageType> ItS(
+    this->m_SumDistancePriorProbabilityImage,
+    this->m_SumDistancePriorProbabilityImage->GetRequestedRegion() );
+  ImageRegionIteratorWithIndex<RealImageType> ItD(
+    distancePriorProbabilityImage,
+    distancePriorProbabilityImage->GetRequestedRegion() );
+  for( ItD.GoToBegin(), ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItD, ++ItS )
+    {
+    if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItD.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
+      {
+      if( ItS.Get() <= this->m_ProbabilityThreshold )
+        {
+        ItD.Set( NumericTraits<RealType>::ZeroValue() );
         }
+      else
+        {
+        ItD.Set( ItD.Get() / ItS.Get() );
+        }
+      }
+    }
+}
 
-      distancePriorProbabilityImage = distanceImage;
-
-      RealType maximumInteriorDistance = 0.0;
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+bool
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::UpdateDistancePriorLabelImage()
+{
+  const ClassifiedImageType *labelImage = this->GetOutput();
+  if( this->m_InitializationStrategy == PriorLabelImage )
+    {
+    labelImage = this->GetPriorLabelImage();
+    }
 
-      ImageRegionIterator<RealImageType> ItD( distancePriorProbabilityImage,
-                                              distancePriorProbabilityImage->GetRequestedRegion() );
-      for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+  bool hasChanged = true;
+  if( this->m_DistancePriorLabelImage.IsNotNull() &&
+      this->m_DistancePriorLabelImage->GetBufferedRegion() == labelImage->GetRequestedRegion() )
+    {
+    hasChanged = false;
+    ImageRegionConstIterator<ClassifiedImageType> ItL( labelImage, labelImage->GetRequestedRegion() );
+    ImageRegionConstIterator<ClassifiedImageType> ItP( this->m_DistancePriorLabelImage,
+                                                       this->m_DistancePriorLabelImage->GetBufferedRegion() );
+    for( ItL.GoToBegin(), ItP.GoToBegin(); !ItL.IsAtEnd(); ++ItL, ++ItP )
+      {
+      if( ItL.Get() != ItP.Get() )
         {
-        if( ItD.Get() < 0 &&
-            maximumInteriorDistance < vnl_math_abs( ItD.Get() ) )
-          {
-          maximumInteriorDistance = vnl_math_abs( ItD.Get() );
-          }
+        hasChanged = true;
+        break;
         }
+      }
+    }
+  if( hasChanged )
+    {
+    typedef ImageDuplicator<ClassifiedImageType> DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    duplicator->SetInputImage( labelImage );
+    duplicator->Update();
+    this->m_DistancePriorLabelImage = duplicator->GetModifiableOutput();
+    }
+  return hasChanged;
+}
 
-      RealType labelLambda = 0.0;
-      RealType labelBoundaryProbability = 1.0;
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::RealImagePointer
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::GetDistancePriorProbabilityImage( unsigned int whichClass )
+{
+  unsigned int totalNumberOfClasses = this->m_NumberOfTissueClasses
+    + this->m_NumberOfPartialVolumeClasses;
 
-      typename LabelParameterMapType::iterator it =
-        this->m_PriorLabelParameterMap.find( whichClass );
-      if( it != this->m_PriorLabelParameterMap.end() )
+  if( ( this->m_InitializationStrategy != PriorLabelImage &&
+        this->m_InitializationStrategy != PriorProbabilityImages ) ||
+      ( whichClass > this->m_NumberOfTissueClasses && whichClass <=
+        totalNumberOfClasses ) )
+    {
+    return ITK_NULLPTR;
+    }
+  if( this->m_NumberOfPartialVolumeClasses == 0 && whichClass
+      > this->m_NumberOfTissueClasses )
+    {
+    itkExceptionMacro( "The requested distance prior probability image = "
+                       << whichClass << " should be in the range [1, "
+                       << this->m_NumberOfTissueClasses << "]" );
+    }
+  else if( whichClass > this->m_NumberOfTissueClasses )
+    {
+    return ITK_NULLPTR;
+    }
+
+  //
+  // If memory minimization is turned off and if the distance prior probability
+  // images have already been calculated, simply return the probability
+  // image for the requested class.  Otherwise, calculate the probability
+  // image.
+  //
+  if( whichClass <= this->m_DistancePriorProbabilityImages.size() )
+    {
+    return this->m_DistancePriorProbabilityImages[whichClass - 1];
+    }
+  else if( whichClass <= this->m_CompactDistancePriorProbabilities.size() )
+    {
+    return this->ExpandCompactProbabilities( this->m_CompactDistancePriorProbabilities[whichClass - 1] );
+    }
+  else
+    {
+    //
+    // Here we assume that the calling function is invoked in order such
+    // that GetDistancePriorImage( 1 ) is called before
+    // GetDistancePriorImage( 2 ), etc.  As such, when this part of
+    // the code is reached and the class requested is '1', we assume that
+    // the sum of the distance prior probability images needs to be calculated
+    // for normalization purposes.  This sum is then saved for subsequent calls
+    // and, with m_MinimizeMemoryUsage == true, only recomputed when the label
+    // image has changed, which leaves a single distance computation per
+    // requested class.
+    //
+    if( whichClass == 1 && ( !this->m_MinimizeMemoryUsage ||
+                             this->m_SumDistancePriorProbabilityImage.IsNull() ||
+                             this->UpdateDistancePriorLabelImage() ) )
+      {
+      this->m_SumDistancePriorProbabilityImage = RealImageType::New();
+      this->m_SumDistancePriorProbabilityImage->CopyInformation( this->GetOutput() );
+      this->m_SumDistancePriorProbabilityImage->SetRegions(
+        this->GetOutput()->GetRequestedRegion() );
+      this->m_SumDistancePriorProbabilityImage->Allocate();
+      this->m_SumDistancePriorProbabilityImage->FillBuffer( 0 );
+
+      if( this->m_MinimizeMemoryUsage && this->m_DistancePriorLabelImage.IsNull() )
         {
-        labelLambda = ( it->second ).first;
-        labelBoundaryProbability = ( it->second ).second;
+        this->UpdateDistancePriorLabelImage();
         }
-      for( ItD.GoToBegin(); !ItD.IsAtEnd(); ++ItD )
+
+      //
+      // Calculate the sum of the distance probability images.  Also, store the
+      // distance probability images if m_MinimizeMemoryUsage == false.
+      //
+      RealImagePointer distancePriorProbabilityImage = ITK_NULLPTR;
+      for( unsigned int c = 0; c < this->m_NumberOfTissueClasses; c++ )
         {
-        if( labelLambda == 0 )
-          {
-          if( ItD.Get() <= 0 )
-            {
-            ItD.Set( labelBoundaryProbability );
-            }
-          else
-            {
-            ItD.Set( 0.0 );
-            }
-          }
-        else if( ItD.Get() >= 0 )
+        RealImagePointer distanceImage = this->ComputeUnnormalizedDistancePriorProbabilityImage( c + 1 );
+
+        typedef AddImageFilter<RealImageType, RealImageType, RealImageType>
+          AdderType;
+        typename AdderType::Pointer adder = AdderType::New();
+        adder->SetInput1( this->m_SumDistancePriorProbabilityImage );
+        adder->SetInput2( distanceImage );
+        adder->Update();
+
+        this->m_SumDistancePriorProbabilityImage = adder->GetOutput();
+
+        if( ( c == 0 ) && this->m_MinimizeMemoryUsage )
           {
-          ItD.Set( labelBoundaryProbability
-                   * std::exp( -labelLambda * ItD.Get() ) );
+          distancePriorProbabilityImage = distanceImage;
           }
-        else if( ItD.Get() < 0 )
+        if( !this->m_MinimizeMemoryUsage )
           {
-          ItD.Set( 1.0 - ( 1.0 - labelBoundaryProbability )
-                   * ( maximumInteriorDistance - vnl_math_abs( ItD.Get() ) )
-                   / ( maximumInteriorDistance ) );
+          this->m_DistancePriorProbabilityImages.push_back(
+            distanceImage );
           }
         }
 
       //
       // Normalize the distance prior probability image(s).
       //
-      ImageRegionIterator<RealImageType> ItS(
-        this->m_SumDistancePriorProbabilityImage,
-        this->m_SumDistancePriorProbabilityImage->GetRequestedRegion() );
-      for( ItD.GoToBegin(), ItS.GoToBegin(); !ItS.IsAtEnd(); ++ItD, ++ItS )
+      if( this->m_MinimizeMemoryUsage )
         {
-        if( !this->GetMaskImage() || this->GetMaskImage()->GetPixel( ItD.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
+        this->NormalizeDistancePriorProbabilityImage( distancePriorProbabilityImage );
+        return distancePriorProbabilityImage;
+        }
+      else
+        {
+        for( unsigned int c = 0; c < this->m_NumberOfTissueClasses; c++ )
           {
-          if( ItS.Get() <= this->m_ProbabilityThreshold )
-            {
-            ItD.Set( NumericTraits<RealType>::ZeroValue() );
-            }
-          else
+          this->NormalizeDistancePriorProbabilityImage( this->m_DistancePriorProbabilityImages[c] );
+          }
+        if( this->m_UseCompactProbabilityStorage )
+          {
+          this->ComputeCompactStorageRuns();
+
+          this->m_CompactDistancePriorProbabilities.resize( this->m_NumberOfTissueClasses );
+          for( unsigned int c = 0; c < this->m_NumberOfTissueClasses; c++ )
             {
-            ItD.Set( ItD.Get() / ItS.Get() );
+            std::vector<RealType> distancePriors;
+            this->GatherCompactStorageValues( this->m_DistancePriorProbabilityImages[c], distancePriors );
+            this->QuantizeProbabilities( distancePriors, this->m_CompactDistancePriorProbabilities[c] );
             }
+          this->m_DistancePriorProbabilityImages.clear();
+
+          return this->ExpandCompactProbabilities( this->m_CompactDistancePriorProbabilities[0] );
           }
+        return this->m_DistancePriorProbabilityImages[0];
         }
+      }
+    else
+      {
+      RealImagePointer distancePriorProbabilityImage =
+        this->ComputeUnnormalizedDistancePriorProbabilityImage( whichClass );
+      this->NormalizeDistancePriorProbabilityImage( distancePriorProbabilityImage );
       return distancePriorProbabilityImage;
       }
     }
@@ -3149,6 +3201,111 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
   return likelihoodImage;
 }
 
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::ComputeCompactStorageRuns()
+{
+  this->m_CompactStorageRuns.clear();
+  this->m_NumberOfCompactStorageVoxels = 0;
+
+  // The offsets are relative to the buffer of the output which is shared
+  // by all the probability images (see AllocImage()).
+  ImageRegionConstIteratorWithIndex<ClassifiedImageType> It( this->GetOutput(),
+                                                             this->GetOutput()->GetBufferedRegion() );
+
+  SizeValueType offset = 0;
+  bool isInsideRun = false;
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    if( !this->GetMaskImage() ||
+        this->GetMaskImage()->GetPixel( It.GetIndex() ) != NumericTraits<MaskLabelType>::ZeroValue() )
+      {
+      if( !isInsideRun )
+        {
+        this->m_CompactStorageRuns.push_back( CompactStorageRunType( offset, 0 ) );
+        isInsideRun = true;
+        }
+      this->m_CompactStorageRuns.back().second++;
+      this->m_NumberOfCompactStorageVoxels++;
+      }
+    else
+      {
+      isInsideRun = false;
+      }
+    ++offset;
+    }
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::GatherCompactStorageValues( const RealImageType *image, std::vector<RealType> & values ) const
+{
+  values.resize( this->m_NumberOfCompactStorageVoxels );
+
+  const RealType *buffer = image->GetBufferPointer();
+
+  SizeValueType count = 0;
+  for( SizeValueType r = 0; r < this->m_CompactStorageRuns.size(); r++ )
+    {
+    const RealType *run = buffer + this->m_CompactStorageRuns[r].first;
+    for( SizeValueType k = 0; k < this->m_CompactStorageRuns[r].second; k++ )
+      {
+      values[count++] = run[k];
+      }
+    }
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+void
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::QuantizeProbabilities( const std::vector<RealType> & values, CompactProbabilityVectorType & quantizedValues ) const
+{
+  const RealType maximumValue =
+    static_cast<RealType>( NumericTraits<CompactProbabilityType>::max() );
+
+  quantizedValues.resize( values.size() );
+  for( SizeValueType n = 0; n < values.size(); n++ )
+    {
+    RealType value = values[n];
+    if( !( value > 0.0 ) )
+      {
+      value = 0.0;
+      }
+    else if( value > 1.0 )
+      {
+      value = 1.0;
+      }
+    quantizedValues[n] = static_cast<CompactProbabilityType>( value * maximumValue + 0.5 );
+    }
+}
+
+template <class TInputImage, class TMaskImage, class TClassifiedImage>
+typename AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::RealImagePointer
+AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
+::ExpandCompactProbabilities( const CompactProbabilityVectorType & quantizedValues ) const
+{
+  const RealType scale = 1.0 /
+    static_cast<RealType>( NumericTraits<CompactProbabilityType>::max() );
+
+  RealImagePointer image = AllocImage<RealImageType>( this->GetOutput(), 0 );
+
+  RealType *buffer = image->GetBufferPointer();
+
+  SizeValueType count = 0;
+  for( SizeValueType r = 0; r < this->m_CompactStorageRuns.size(); r++ )
+    {
+    RealType *run = buffer + this->m_CompactStorageRuns[r].first;
+    for( SizeValueType k = 0; k < this->m_CompactStorageRuns[r].second; k++ )
+      {
+      run[k] = scale * static_cast<RealType>( quantizedValues[count++] );
+      }
+    }
+  return image;
+}
+
 template <class TInputImage, class TMaskImage, class TClassifiedImage>
 void
 AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
@@ -3247,6 +3404,11 @@ AtroposSegmentationImageFilter<TInputImage, TMaskImage, TClassifiedImage>
     {
     os << " false" << std::endl;
     }
+  if( this->m_UseCompactProbabilityStorage && !this->m_MinimizeMemoryUsage )
+    {
+    os << indent << "Compact probability storage: true (16-bit, "
+       << this->m_NumberOfCompactStorageVoxels << " voxels)" << std::endl;
+    }
 
   os << indent << "Initialization strategy: ";
 
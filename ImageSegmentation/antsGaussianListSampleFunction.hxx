@@ -17,10 +17,9 @@
 
 #include "antsGaussianListSampleFunction.h"
 
-#include "itkCovarianceSampleFilter.h"
-#include "itkMeanSampleFilter.h"
-#include "itkWeightedCovarianceSampleFilter.h"
-#include "itkWeightedMeanSampleFilter.h"
+#include "vnl/vnl_matrix.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -55,50 +54,90 @@ GaussianListSampleFunction<TListSample, TOutput, TCoordRep>
 
   if( this->GetInputListSample()->Size() > 1 )
     {
-    if( this->GetListSampleWeights()->Size() == this->GetInputListSample()->Size() )
+    //
+    // The weighted mean and covariance are accumulated directly from the
+    // measurement vectors in two passes, with the normalizations of
+    // WeightedCovarianceSampleFilter (sum of weights minus the sum of
+    // squared weights over the sum of weights) and CovarianceSampleFilter
+    // (N - 1), instead of going through the sample filter pipelines.
+    //
+    const InputListSampleType *sample = this->GetInputListSample();
+    const unsigned int         numberOfComponents = sample->GetMeasurementVectorSize();
+    const unsigned long        numberOfSamples = sample->Size();
+
+    const ListSampleWeightArrayType *weights = this->GetListSampleWeights();
+    const bool                       useWeights = ( weights && weights->Size() == numberOfSamples );
+
+    std::vector<double> sumMeasurements( numberOfComponents, 0.0 );
+    double              sumWeights = 0.0;
+    double              sumSquaredWeights = 0.0;
+    for( unsigned long k = 0; k < numberOfSamples; k++ )
       {
-      typedef typename itk::Statistics::
-        WeightedCovarianceSampleFilter<InputListSampleType> CovarianceCalculatorType;
-      typename CovarianceCalculatorType::Pointer covarianceCalculator =
-        CovarianceCalculatorType::New();
-
-      covarianceCalculator->SetWeights( *this->GetListSampleWeights() );
-      covarianceCalculator->SetInput( this->GetInputListSample() );
-      covarianceCalculator->Update();
-
-      typename GaussianType::MeanVectorType mean;
-      NumericTraits<typename GaussianType::MeanVectorType>::SetLength( mean,
-                                                                       this->GetInputListSample()->
-                                                                       GetMeasurementVectorSize() );
-      for( unsigned int d = 0; d < this->GetInputListSample()->
-           GetMeasurementVectorSize(); d++ )
+      const InputMeasurementVectorType & measurement = sample->GetMeasurementVector( k );
+      const double                       weight = useWeights ? ( *weights )[k] : 1.0;
+      for( unsigned int d = 0; d < numberOfComponents; d++ )
         {
-        mean[d] = covarianceCalculator->GetMean()[d];
+        sumMeasurements[d] += weight * static_cast<double>( measurement[d] );
         }
-      this->m_Gaussian->SetMean( mean );
-      this->m_Gaussian->SetCovariance( covarianceCalculator->GetCovarianceMatrix() );
+      sumWeights += weight;
+      sumSquaredWeights += weight * weight;
       }
-    else
+
+    typename GaussianType::MeanVectorType mean;
+    NumericTraits<typename GaussianType::MeanVectorType>::SetLength( mean, numberOfComponents );
+    for( unsigned int d = 0; d < numberOfComponents; d++ )
+      {
+      mean[d] = ( sumWeights != 0.0 ) ? sumMeasurements[d] / sumWeights : 0.0;
+      }
+
+    vnl_matrix<double>  covariance( numberOfComponents, numberOfComponents, 0.0 );
+    std::vector<double> difference( numberOfComponents );
+    for( unsigned long k = 0; k < numberOfSamples; k++ )
       {
-      typedef itk::Statistics::CovarianceSampleFilter<InputListSampleType>
-        CovarianceCalculatorType;
-      typename CovarianceCalculatorType::Pointer covarianceCalculator =
-        CovarianceCalculatorType::New();
-      covarianceCalculator->SetInput( this->GetInputListSample() );
-      covarianceCalculator->Update();
-
-      typename GaussianType::MeanVectorType mean;
-      NumericTraits<typename GaussianType::MeanVectorType>::SetLength( mean,
-                                                                       this->GetInputListSample()->
-                                                                       GetMeasurementVectorSize() );
-      for( unsigned int d = 0; d < this->GetInputListSample()->
-           GetMeasurementVectorSize(); d++ )
+      const InputMeasurementVectorType & measurement = sample->GetMeasurementVector( k );
+      const double                       weight = useWeights ? ( *weights )[k] : 1.0;
+      for( unsigned int d = 0; d < numberOfComponents; d++ )
         {
-        mean[d] = covarianceCalculator->GetMean()[d];
+        difference[d] = static_cast<double>( measurement[d] ) - mean[d];
+        }
+      for( unsigned int r = 0; r < numberOfComponents; r++ )
+        {
+        const double weightedDifference = weight * difference[r];
+        for( unsigned int c = 0; c <= r; c++ )
+          {
+          covariance( r, c ) += weightedDifference * difference[c];
+          }
         }
-      this->m_Gaussian->SetMean( mean );
-      this->m_Gaussian->SetCovariance( covarianceCalculator->GetCovarianceMatrix() );
       }
+    for( unsigned int r = 0; r < numberOfComponents; r++ )
+      {
+      for( unsigned int c = 0; c < r; c++ )
+        {
+        covariance( c, r ) = covariance( r, c );
+        }
+      }
+
+    const double normalizationFactor = useWeights
+      ? ( sumWeights - sumSquaredWeights / sumWeights )
+      : static_cast<double>( numberOfSamples - 1 );
+    if( !( normalizationFactor > NumericTraits<double>::epsilon() ) )
+      {
+      itkExceptionMacro( "Normalization factor was too close to zero. Value = "
+                         << normalizationFactor );
+      }
+    covariance /= normalizationFactor;
+
+    typename GaussianType::CovarianceMatrixType covarianceMatrix( numberOfComponents, numberOfComponents );
+    for( unsigned int r = 0; r < numberOfComponents; r++ )
+      {
+      for( unsigned int c = 0; c < numberOfComponents; c++ )
+        {
+        covarianceMatrix( r, c ) = covariance( r, c );
+        }
+      }
+
+    this->m_Gaussian->SetMean( mean );
+    this->m_Gaussian->SetCovariance( covarianceMatrix );
 
     // Check to see if the covariance matrix is nonsingular
 
@@ -74,6 +74,13 @@ public:
   itkSetMacro( NumberOfHistogramBins, unsigned int );
   itkGetConstMacro( NumberOfHistogramBins, unsigned int );
 
+  /** Number of lookup table samples per histogram bin.  The B-spline
+   * interpolated histograms are sampled at this rate when the list sample is
+   * set and Evaluate() linearly interpolates the samples.  Set it before the
+   * list sample. */
+  itkSetMacro( NumberOfLookupTableSamplesPerBin, unsigned int );
+  itkGetConstMacro( NumberOfLookupTableSamplesPerBin, unsigned int );
+
   virtual void SetInputListSample( const InputListSampleType * ptr ) ITK_OVERRIDE;
 
   virtual TOutput Evaluate( const InputMeasurementVectorType& measurement ) const ITK_OVERRIDE;
@@ -92,8 +99,14 @@ private:
 
   unsigned int                                      m_NumberOfHistogramBins;
   RealType                                          m_Sigma;
-  InterpolatorPointer                               m_Interpolator;
   std::vector<typename HistogramImageType::Pointer> m_HistogramImages;
+
+  // one flat lookup table per measurement component spanning the histogram
+  // buffer, with the position of its first sample and the samples per unit
+  unsigned int                       m_NumberOfLookupTableSamplesPerBin;
+  std::vector<std::vector<RealType> > m_LookupTables;
+  std::vector<RealType>               m_LookupTableOrigins;
+  std::vector<RealType>               m_LookupTableScales;
 };
 } // end of namespace Statistics
 } // end of namespace ants
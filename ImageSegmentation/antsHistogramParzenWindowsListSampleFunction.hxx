@@ -24,6 +24,8 @@
 #include "itkDivideByConstantImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 
+#include <algorithm>
+
 namespace itk
 {
 namespace ants
@@ -34,11 +36,9 @@ template <class TListSample, class TOutput, class TCoordRep>
 HistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
 ::HistogramParzenWindowsListSampleFunction()
 {
-  this->m_Interpolator = InterpolatorType::New();
-  this->m_Interpolator->SetSplineOrder( 3 );
-
   this->m_NumberOfHistogramBins = 32;
   this->m_Sigma = 1.0;
+  this->m_NumberOfLookupTableSamplesPerBin = 8;
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -54,6 +54,10 @@ HistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
 {
   Superclass::SetInputListSample( ptr );
 
+  this->m_LookupTables.clear();
+  this->m_LookupTableOrigins.clear();
+  this->m_LookupTableScales.clear();
+
   if( !this->GetInputListSample() )
     {
     return;
@@ -187,6 +191,37 @@ HistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
     divider->Update();
     this->m_HistogramImages[d] = divider->GetOutput();
     }
+
+  // Sample the cubic B-spline interpolation of each histogram over the whole
+  // buffer (continuous indices [-0.5, size - 0.5]) into a flat table so that
+  // Evaluate() only needs two table lookups per component.
+  const unsigned int samplesPerBin = std::max( this->m_NumberOfLookupTableSamplesPerBin, 1u );
+
+  this->m_LookupTables.resize( Dimension );
+  this->m_LookupTableOrigins.resize( Dimension );
+  this->m_LookupTableScales.resize( Dimension );
+  for( unsigned int d = 0; d < Dimension; d++ )
+    {
+    InterpolatorPointer interpolator = InterpolatorType::New();
+    interpolator->SetSplineOrder( 3 );
+    interpolator->SetInputImage( this->m_HistogramImages[d] );
+
+    const unsigned int numberOfBins =
+      this->m_HistogramImages[d]->GetLargestPossibleRegion().GetSize()[0];
+    const unsigned int numberOfIntervals = numberOfBins * samplesPerBin;
+
+    this->m_LookupTables[d].resize( numberOfIntervals + 1 );
+    typename InterpolatorType::ContinuousIndexType cidx;
+    for( unsigned int k = 0; k <= numberOfIntervals; k++ )
+      {
+      cidx[0] = -0.5 + static_cast<double>( k ) / static_cast<double>( samplesPerBin );
+      this->m_LookupTables[d][k] = interpolator->EvaluateAtContinuousIndex( cidx );
+      }
+
+    const RealType spacing = this->m_HistogramImages[d]->GetSpacing()[0];
+    this->m_LookupTableOrigins[d] = this->m_HistogramImages[d]->GetOrigin()[0] - 0.5 * spacing;
+    this->m_LookupTableScales[d] = static_cast<RealType>( samplesPerBin ) / spacing;
+    }
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -194,30 +229,24 @@ TOutput
 HistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
 ::Evaluate( const InputMeasurementVectorType & measurement ) const
 {
-  try
+  RealType probability = 1.0;
+  for( unsigned int d = 0; d < this->m_LookupTables.size(); d++ )
     {
-    RealType probability = 1.0;
-    for( unsigned int d = 0; d < this->m_HistogramImages.size(); d++ )
-      {
-      typename HistogramImageType::PointType point;
-      point[0] = measurement[d];
+    const std::vector<RealType> & table = this->m_LookupTables[d];
 
-      this->m_Interpolator->SetInputImage( this->m_HistogramImages[d] );
-      if( this->m_Interpolator->IsInsideBuffer( point ) )
-        {
-        probability *= this->m_Interpolator->Evaluate( point );
-        }
-      else
-        {
-        return 0;
-        }
+    const RealType t = ( measurement[d] - this->m_LookupTableOrigins[d] ) * this->m_LookupTableScales[d];
+
+    // outside of the histogram buffer (the negated test also rejects NaN)
+    if( !( t >= 0.0 ) || t >= static_cast<RealType>( table.size() - 1 ) )
+      {
+      return 0;
       }
-    return probability;
-    }
-  catch( ... )
-    {
-    return 0;
+    const unsigned int k = static_cast<unsigned int>( t );
+    const RealType     w = t - static_cast<RealType>( k );
+
+    probability *= ( 1.0 - w ) * table[k] + w * table[k + 1];
     }
+  return probability;
 }
 
 /**
@@ -234,6 +263,8 @@ HistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
      << this->m_Sigma << std::endl;
   os << indent << "Number of histogram bins: "
      << this->m_NumberOfHistogramBins << std::endl;
+  os << indent << "Number of lookup table samples per bin: "
+     << this->m_NumberOfLookupTableSamplesPerBin << std::endl;
 }
 } // end of namespace Statistics
 } // end of namespace ants
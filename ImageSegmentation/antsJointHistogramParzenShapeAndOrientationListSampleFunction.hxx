@@ -43,8 +43,11 @@ JointHistogramParzenShapeAndOrientationListSampleFunction<TListSample, TOutput,
   this->m_MaximumEigenvalue2 = 0;
   this->m_MinimumEigenvalue1 = 1;
   this->m_MinimumEigenvalue2 = 1;
-  this->m_Interpolator = InterpolatorType::New();
-  this->m_Interpolator->SetSplineOrder( 3 );
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    this->m_Interpolators[d] = InterpolatorType::New();
+    this->m_Interpolators[d]->SetSplineOrder( 3 );
+    }
   this->m_JointHistogramImages[0] = ITK_NULLPTR;
   this->m_JointHistogramImages[1] = ITK_NULLPTR;
   this->m_JointHistogramImages[2] = ITK_NULLPTR;
@@ -595,6 +598,10 @@ JointHistogramParzenShapeAndOrientationListSampleFunction<TListSample, TOutput,
     divider->SetConstant( stats->GetSum() );
     divider->Update();
     this->m_JointHistogramImages[d] = divider->GetOutput();
+
+    // The spline coefficients are computed once here so that Evaluate()
+    // does not modify the function.
+    this->m_Interpolators[d]->SetInputImage( this->m_JointHistogramImages[d] );
     }
 /*  write out histograms--for debugging
     static int which_class=0;
@@ -632,10 +639,9 @@ JointHistogramParzenShapeAndOrientationListSampleFunction<TListSample, TOutput,
       typename JointHistogramImageType::PointType point;
       point[0] = measurement[d];
 
-      this->m_Interpolator->SetInputImage( this->m_JointHistogramImages[d] );
-      if( this->m_Interpolator->IsInsideBuffer( point ) )
+      if( this->m_Interpolators[d]->IsInsideBuffer( point ) )
         {
-        probability *= this->m_Interpolator->Evaluate( point );
+        probability *= this->m_Interpolators[d]->Evaluate( point );
         }
       else
         {
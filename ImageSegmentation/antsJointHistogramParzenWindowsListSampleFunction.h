@@ -68,6 +68,13 @@ public:
   itkSetMacro( NumberOfJointHistogramBins, unsigned int );
   itkGetConstMacro( NumberOfJointHistogramBins, unsigned int );
 
+  /** Number of lookup table samples per histogram bin (along each axis).
+   * The B-spline interpolated joint histograms are sampled at this rate when
+   * the list sample is set and Evaluate() bilinearly interpolates the
+   * samples.  Set it before the list sample. */
+  itkSetMacro( NumberOfLookupTableSamplesPerBin, unsigned int );
+  itkGetConstMacro( NumberOfLookupTableSamplesPerBin, unsigned int );
+
   virtual void SetInputListSample( const InputListSampleType * ptr );
 
   virtual TOutput Evaluate( const InputMeasurementVectorType& measurement ) const;
@@ -90,6 +97,15 @@ private:
   RealType                                               m_Sigma;
   bool                                                   m_UseNNforJointHistIncrements;
   std::vector<typename JointHistogramImageType::Pointer> m_JointHistogramImages;
+
+  // range of each measurement component used to map it onto the histogram axes
+  std::vector<RealType> m_MinimumValues;
+  std::vector<RealType> m_MaximumValues;
+
+  // one flat (row-major) lookup table per joint histogram spanning its buffer
+  unsigned int                        m_NumberOfLookupTableSamplesPerBin;
+  unsigned int                        m_LookupTableSize;
+  std::vector<std::vector<RealType> > m_LookupTables;
 };
 } // end of namespace Statistics
 } // end of namespace ants
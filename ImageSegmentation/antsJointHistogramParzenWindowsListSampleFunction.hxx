@@ -24,6 +24,8 @@
 #include "itkDivideByConstantImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 
+#include <algorithm>
+
 namespace itk
 {
 namespace ants
@@ -37,6 +39,8 @@ JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
   this->m_NumberOfJointHistogramBins = 32;
   this->m_Sigma = 1.0;
   this->m_UseNNforJointHistIncrements = true;
+  this->m_NumberOfLookupTableSamplesPerBin = 8;
+  this->m_LookupTableSize = 0;
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -65,7 +69,7 @@ JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
     typename JointHistogramImageType::DirectionType direction;
     direction.SetIdentity();
     typename JointHistogramImageType::Pointer curJHI =
-      AllocImage<JointHistogramImageType>(size, spacing, origin, regions, 0);
+      AllocImage<JointHistogramImageType>(size, spacing, origin, direction, 0);
 
     this->m_JointHistogramImages.push_back( curJHI);
     }
@@ -181,6 +185,8 @@ JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
 {
   this->m_ListSample = ptr;
   this->m_JointHistogramImages.clear();
+  this->m_LookupTables.clear();
+  this->m_LookupTableSize = 0;
   if( !this->m_ListSample )
     {
     return;
@@ -265,6 +271,39 @@ JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
     divider->Update();
     this->m_JointHistogramImages[d] = divider->GetOutput();
     }
+
+  this->m_MinimumValues.assign( minValues.begin(), minValues.end() );
+  this->m_MaximumValues.assign( maxValues.begin(), maxValues.end() );
+
+  // Sample the cubic B-spline interpolation of each joint histogram over the
+  // whole buffer (continuous indices [-0.5, size - 0.5]^2) into a flat table so
+  // that Evaluate() only needs four table lookups per histogram.
+  const unsigned int samplesPerBin = std::max( this->m_NumberOfLookupTableSamplesPerBin, 1u );
+  const unsigned int numberOfIntervals = this->m_NumberOfJointHistogramBins * samplesPerBin;
+
+  this->m_LookupTableSize = numberOfIntervals + 1;
+  this->m_LookupTables.resize( this->m_JointHistogramImages.size() );
+  for( unsigned int d = 0; d < this->m_JointHistogramImages.size(); d++ )
+    {
+    typedef BSplineInterpolateImageFunction<JointHistogramImageType> InterpolatorType;
+    typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    interpolator->SetSplineOrder( 3 );
+    interpolator->SetInputImage( this->m_JointHistogramImages[d] );
+
+    std::vector<RealType> & table = this->m_LookupTables[d];
+    table.resize( this->m_LookupTableSize * this->m_LookupTableSize );
+
+    typename InterpolatorType::ContinuousIndexType cidx;
+    for( unsigned int j = 0; j <= numberOfIntervals; j++ )
+      {
+      cidx[1] = -0.5 + static_cast<double>( j ) / static_cast<double>( samplesPerBin );
+      for( unsigned int i = 0; i <= numberOfIntervals; i++ )
+        {
+        cidx[0] = -0.5 + static_cast<double>( i ) / static_cast<double>( samplesPerBin );
+        table[j * this->m_LookupTableSize + i] = interpolator->EvaluateAtContinuousIndex( cidx );
+        }
+      }
+    }
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -272,34 +311,46 @@ TOutput
 JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
 ::Evaluate( const InputMeasurementVectorType & measurement ) const
 {
-  try
+  if( this->m_LookupTables.empty() )
     {
-    typedef BSplineInterpolateImageFunction<JointHistogramImageType> InterpolatorType;
+    return 0;
+    }
+
+  const RealType samplesPerBin = static_cast<RealType>( std::max( this->m_NumberOfLookupTableSamplesPerBin, 1u ) );
+  const RealType maximumPosition = static_cast<RealType>( this->m_LookupTableSize - 1 );
 
-    RealType probability = 1.0;
-    for( unsigned int d = 0; d < this->m_JointHistogramImages.size(); d++ )
+  RealType probability = 1.0;
+  for( unsigned int d = 0; d < this->m_LookupTables.size(); d++ )
+    {
+    // map the component pair onto the histogram axes as in IncrementJointHistogram()
+    // and then onto the table (the histogram has origin 0 and unit spacing)
+    RealType t[2];
+    for( unsigned int n = 0; n < 2; n++ )
       {
-      typename JointHistogramImageType::PointType point;
-      point[0] = measurement[d];
+      const unsigned int c = 2 * d + n;
+      RealType           value = ( measurement[c] - this->m_MinimumValues[c] )
+        / ( this->m_MaximumValues[c] - this->m_MinimumValues[c] );
+      value = std::min( std::max( value, static_cast<RealType>( 0.0 ) ), static_cast<RealType>( 1.0 ) );
 
-      typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-      interpolator->SetSplineOrder( 3 );
-      interpolator->SetInputImage( this->m_JointHistogramImages[d] );
-      if( interpolator->IsInsideBuffer( point ) )
-        {
-        probability *= interpolator->Evaluate( point );
-        }
-      else
+      t[n] = ( value * ( this->m_NumberOfJointHistogramBins - 1 ) + 0.5 ) * samplesPerBin;
+      if( !( t[n] >= 0.0 ) || t[n] >= maximumPosition )
         {
         return 0;
         }
       }
-    return probability;
-    }
-  catch( ... )
-    {
-    return 0;
+
+    const unsigned int i = static_cast<unsigned int>( t[0] );
+    const unsigned int j = static_cast<unsigned int>( t[1] );
+    const RealType     wi = t[0] - static_cast<RealType>( i );
+    const RealType     wj = t[1] - static_cast<RealType>( j );
+
+    const RealType * row0 = &( this->m_LookupTables[d][j * this->m_LookupTableSize + i] );
+    const RealType * row1 = row0 + this->m_LookupTableSize;
+
+    probability *= ( 1.0 - wj ) * ( ( 1.0 - wi ) * row0[0] + wi * row0[1] )
+      + wj * ( ( 1.0 - wi ) * row1[0] + wi * row1[1] );
     }
+  return probability;
 }
 
 /**
@@ -316,6 +367,8 @@ JointHistogramParzenWindowsListSampleFunction<TListSample, TOutput, TCoordRep>
      << this->m_Sigma << std::endl;
   os << indent << "Number of histogram bins: "
      << this->m_NumberOfJointHistogramBins << std::endl;
+  os << indent << "Number of lookup table samples per bin: "
+     << this->m_NumberOfLookupTableSamplesPerBin << std::endl;
 }
 } // end of namespace Statistics
 } // end of namespace ants
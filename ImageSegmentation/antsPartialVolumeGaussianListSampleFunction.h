@@ -91,6 +91,12 @@ private:
   bool     m_IsCalculated[2];
 
   typename GaussianType::Pointer                            m_Gaussian;
+
+  // The constants of m_Gaussian, whose covariance is diagonal, computed once
+  // per update of the means so that Evaluate() is a few flops and an exp().
+  MeanType                                                  m_PartialVolumeMean;
+  Array<RealType>                                           m_InverseVariance;
+  RealType                                                  m_PreFactor;
 };
 } // end of namespace Statistics
 } // end of namespace ants
@@ -20,6 +20,8 @@
 #include "itkMeanSampleFilter.h"
 #include "itkWeightedMeanSampleFilter.h"
 
+#include <cmath>
+
 namespace itk
 {
 namespace ants
@@ -34,6 +36,8 @@ PartialVolumeGaussianListSampleFunction<TListSample, TOutput, TCoordRep>
 
   this->m_IsCalculated[0] = false;
   this->m_IsCalculated[1] = false;
+
+  this->m_PreFactor = 0.0;
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -152,6 +156,32 @@ PartialVolumeGaussianListSampleFunction<TListSample, TOutput, TCoordRep>
 
   this->m_Gaussian->SetMean( mean );
   this->m_Gaussian->SetCovariance( covariance );
+
+  // The covariance is diagonal, so its inverse and determinant are those of
+  // the variances.  A (nearly) singular covariance is treated as is done by
+  // itk::Statistics::GaussianMembershipFunction:  unit inverse and prefactor.
+  this->m_PartialVolumeMean = mean;
+  this->m_InverseVariance.SetSize( mean.Size() );
+
+  RealType determinant = 1.0;
+  for( unsigned int d = 0; d < mean.Size(); d++ )
+    {
+    determinant *= covariance( d, d );
+    }
+  if( determinant > 1.0e-10 )
+    {
+    for( unsigned int d = 0; d < mean.Size(); d++ )
+      {
+      this->m_InverseVariance[d] = 1.0 / covariance( d, d );
+      }
+    this->m_PreFactor = 1.0 / ( std::sqrt( determinant ) *
+                                std::pow( std::sqrt( 2.0 * vnl_math::pi ), static_cast<RealType>( mean.Size() ) ) );
+    }
+  else
+    {
+    this->m_InverseVariance.Fill( 1.0 );
+    this->m_PreFactor = 1.0;
+    }
 }
 
 template <class TListSample, class TOutput, class TCoordRep>
@@ -159,21 +189,19 @@ TOutput
 PartialVolumeGaussianListSampleFunction<TListSample, TOutput, TCoordRep>
 ::Evaluate( const InputMeasurementVectorType & measurement ) const
 {
-  if( this->m_IsCalculated[0] && this->m_IsCalculated[1] )
+  if( !this->m_IsCalculated[0] || !this->m_IsCalculated[1] ||
+      measurement.Size() != this->m_PartialVolumeMean.Size() )
     {
-    try
-      {
-      return this->m_Gaussian->Evaluate( measurement );
-      }
-    catch( ... )
-      {
-      return 0.0;
-      }
+    return 0.0;
     }
-  else
+
+  RealType distance = 0.0;
+  for( unsigned int d = 0; d < this->m_PartialVolumeMean.Size(); d++ )
     {
-    return 0.0;
+    const RealType difference = measurement[d] - this->m_PartialVolumeMean[d];
+    distance += difference * difference * this->m_InverseVariance[d];
     }
+  return this->m_PreFactor * std::exp( -0.5 * distance );
 }
 
 /**
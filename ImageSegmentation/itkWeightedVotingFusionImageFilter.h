@@ -21,6 +21,7 @@
 #include "itkImageToImageFilter.h"
 
 #include "itkConstNeighborhoodIterator.h"
+#include "itkSimpleFastMutexLock.h"
 
 #include <vnl/vnl_matrix.h>
 #include <vnl/vnl_vector.h>
@@ -47,6 +48,13 @@ namespace itk
  * label fusion and corrective learning--an open source implementation,"
  * Front. Neuroinform., 2013.
  *
+ * The filter supports streaming:  when only a part of the output is
+ * requested (e.g., through a StreamingImageFilter), just that region,
+ * padded by the search and patch radii, is requested from the inputs and
+ * the result is identical to the one obtained for the whole image.  The
+ * retained posterior, voting weight and intensity fusion images are then
+ * assembled over the full image domain piece by piece.
+ *
  * \ingroup ImageSegmentation
  */
 
@@ -139,10 +147,7 @@ public:
    */
   void AddAtlas( InputImageList imageList, LabelImageType *segmentation = ITK_NULLPTR )
     {
-    for( unsigned int i = 0; i < imageList.size(); i++ )
-      {
-      this->m_AtlasImages.push_back( imageList );
-      }
+    this->m_AtlasImages.push_back( imageList );
     if( this->m_NumberOfAtlasModalities == 0 )
       {
       itkDebugMacro( "Setting the number of modalities to " << this->m_NumberOfAtlasModalities );
@@ -262,6 +267,16 @@ public:
   itkGetConstMacro( ConstrainSolutionToNonnegativeWeights, bool );
   itkBooleanMacro( ConstrainSolutionToNonnegativeWeights );
 
+  /**
+   * The region over which the posterior, voting weight and intensity fusion
+   * images are assembled when streaming, e.g. the shard of the target domain
+   * processed by one of several independent jobs, so that they need not span
+   * the whole target.  It must contain every requested region.  An empty
+   * region (the default) stands for the largest possible region.
+   */
+  itkSetMacro( StreamedRegion, RegionType );
+  itkGetConstMacro( StreamedRegion, RegionType );
+
   /**
    * Measurement of neighborhood similarity.
    */
@@ -277,6 +292,10 @@ public:
       {
       if( std::find( this->m_LabelSet.begin(), this->m_LabelSet.end(), label ) != this->m_LabelSet.end() )
         {
+        if( this->m_IsStreaming )
+          {
+          return this->m_StreamedLabelPosteriorProbabilityImages[label];
+          }
         return this->m_LabelPosteriorProbabilityImages[label];
         }
       else
@@ -301,6 +320,10 @@ public:
       {
       if( n < this->m_NumberOfAtlases )
         {
+        if( this->m_IsStreaming )
+          {
+          return this->m_StreamedAtlasVotingWeightImages[n];
+          }
         return this->m_AtlasVotingWeightImages[n];
         }
       else
@@ -323,6 +346,10 @@ public:
     {
     if( n < this->m_NumberOfAtlasModalities )
       {
+      if( this->m_IsStreaming )
+        {
+        return this->m_StreamedJointIntensityFusionImage[n];
+        }
       return this->m_JointIntensityFusionImage[n];
       }
     else
@@ -339,6 +366,10 @@ protected:
 
   void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
 
+  void GenerateOutputInformation() ITK_OVERRIDE;
+
+  unsigned int SplitRequestedRegion( unsigned int, unsigned int, RegionType & ) ITK_OVERRIDE;
+
   void ThreadedGenerateData( const RegionType &, ThreadIdType ) ITK_OVERRIDE;
 
   void BeforeThreadedGenerateData() ITK_OVERRIDE;
@@ -353,7 +384,8 @@ private:
 
   void ThreadedGenerateDataForReconstruction( const RegionType &, ThreadIdType );
 
-  RealType ComputeNeighborhoodPatchSimilarity( const InputImageList &, const IndexType, const InputImagePixelVectorType &, const bool );
+  RealType ComputeNeighborhoodPatchSimilarity( const InputImageList &, const IndexType, const InputImagePixelVectorType &,
+    const bool, const bool );
 
   InputImagePixelVectorType VectorizeImageListPatch( const InputImageList &, const IndexType, const bool );
 
@@ -365,6 +397,29 @@ private:
 
   void UpdateInputs();
 
+  void CopyRequestedRegionToStreamedImages();
+
+  /** The work units of the weighted averaging:  slabs of the weighted
+   * averaging region along its last dimension, with about the same estimated
+   * cost (the voxels in the mask times the size of their search
+   * neighborhood) and at least twice the patch radius thick.  Returns false
+   * if the region is too thin for enough units. */
+  bool ComputeWeightedAveragingUnits( std::vector<RegionType> &, std::vector<RealType> & );
+
+  typedef std::pair<RealType, SizeValueType> UnitCostType;
+
+  struct WeightedAveragingThreadStruct
+    {
+    WeightedVotingFusionImageFilter *Filter;
+    std::vector<RegionType>          Units;
+    std::vector<UnitCostType>        UnitOrder;
+    SizeValueType                    NextUnit;
+    SimpleFastMutexLock              Mutex;
+    };
+
+  /** Every thread takes the next unit of UnitOrder until none is left. */
+  static ITK_THREAD_RETURN_TYPE WeightedAveragingThreaderCallback( void * );
+
   typedef std::pair<unsigned int, RealType>           DistanceIndexType;
   typedef std::vector<DistanceIndexType>              DistanceIndexVectorType;
 
@@ -386,6 +441,8 @@ private:
   MaskImagePointer                                     m_MaskImage;
 
   RegionType                                           m_TargetImageRequestedRegion;
+  RegionType                                           m_WeightedAveragingRegion;
+  bool                                                 m_IsStreaming;
 
   typename CountImageType::Pointer                     m_CountImage;
 
@@ -403,6 +460,14 @@ private:
 
   std::vector<NeighborhoodOffsetType>                  m_PatchNeighborhoodOffsetList;
 
+  /** Patch offsets in units of pixels of the shared input buffer.  They are
+   * used, instead of the index offsets and the bounds checks, for the patches
+   * centered in m_PatchInteriorRegion when all the target and atlas images
+   * have buffers of the same size. */
+  std::vector<OffsetValueType>                         m_PatchNeighborhoodBufferOffsets;
+  RegionType                                           m_PatchInteriorRegion;
+  bool                                                 m_UsePatchNeighborhoodBufferOffsets;
+
   RealType                                             m_Alpha;
   RealType                                             m_Beta;
 
@@ -421,6 +486,12 @@ private:
   VotingWeightImageList                                m_AtlasVotingWeightImages;
 
   InputImageList                                       m_JointIntensityFusionImage;
+
+  /** Output variables assembled over the streamed region when streaming */
+  RegionType                                           m_StreamedRegion;
+  LabelPosteriorProbabilityMap                         m_StreamedLabelPosteriorProbabilityImages;
+  VotingWeightImageList                                m_StreamedAtlasVotingWeightImages;
+  InputImageList                                       m_StreamedJointIntensityFusionImage;
 };
 
 } // namespace itk
@@ -19,13 +19,18 @@
 #define itkWeightedVotingFusionImageFilter_hxx
 
 #include "itkWeightedVotingFusionImageFilter.h"
+#include "antsUtilities.h"
 
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkProgressReporter.h"
 
 #include <algorithm>
+#include <cmath>
+#include <functional>
 #include <numeric>
 
+#include <vnl/algo/vnl_cholesky.h>
 #include <vnl/algo/vnl_svd.h>
 #include <vnl/vnl_inverse.h>
 
@@ -35,6 +40,8 @@ template<typename TInputImage, typename TOutputImage>
 WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 ::WeightedVotingFusionImageFilter() :
   m_IsWeightedAveragingComplete( false ),
+  m_IsStreaming( false ),
+  m_UsePatchNeighborhoodBufferOffsets( false ),
   m_NumberOfAtlases( 0 ),
   m_NumberOfAtlasSegmentations( 0 ),
   m_NumberOfAtlasModalities( 0 ),
@@ -111,7 +118,10 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   // Get the output requested region
   RegionType outRegion = this->GetOutput()->GetRequestedRegion();
 
-  // Pad this region by the search window and patch size
+  // Pad this region by the search window and twice the patch size.  Votes
+  // are cast by all the patches overlapping the output region so the
+  // similarity of patches centered up to one patch radius outside of the
+  // output region is needed.
   if( this->m_SearchNeighborhoodRadiusImage.IsNull() )
     {
     outRegion.PadByRadius( this->m_SearchNeighborhoodRadius );
@@ -134,19 +144,20 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     outRegion.PadByRadius( maxSearchNeighborhoodRadius );
     }
   outRegion.PadByRadius( this->m_PatchNeighborhoodRadius );
+  outRegion.PadByRadius( this->m_PatchNeighborhoodRadius );
 
   // Iterate over all the inputs to this filter
 
   for( SizeValueType i = 0; i < this->m_TargetImage.size(); i++ )
     {
     InputImageType *input = this->m_TargetImage[i];
-    if( i == 0 )
-      {
-      this->m_TargetImageRequestedRegion = input->GetRequestedRegion();
-      }
     RegionType region = outRegion;
     region.Crop( input->GetLargestPossibleRegion() );
     input->SetRequestedRegion( region );
+    if( i == 0 )
+      {
+      this->m_TargetImageRequestedRegion = region;
+      }
     }
 
   for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
@@ -186,23 +197,89 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     }
 }
 
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  // A new update starts:  discard the images assembled by a previous
+  // streamed update.
+  this->m_IsStreaming = false;
+  this->m_LabelSet.clear();
+  this->m_StreamedLabelPosteriorProbabilityImages.clear();
+  this->m_StreamedAtlasVotingWeightImages.clear();
+  this->m_StreamedJointIntensityFusionImage.clear();
+}
+
+template <class TInputImage, class TOutputImage>
+unsigned int
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::SplitRequestedRegion( unsigned int i, unsigned int pieces, RegionType & splitRegion )
+{
+  // The weighted averaging is performed over the output requested region
+  // padded by the patch radius whereas the reconstruction is restricted to
+  // the output requested region.
+  if( !this->m_IsWeightedAveragingComplete )
+    {
+    splitRegion = this->m_WeightedAveragingRegion;
+    }
+  else
+    {
+    splitRegion = this->GetOutput()->GetRequestedRegion();
+    }
+  return this->GetImageRegionSplitter()->GetSplit( i, pieces, splitRegion );
+}
+
 template <class TInputImage, class TOutputImage>
 void
 WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 ::GenerateData()
 {
+  ANTS_PROFILE_SCOPE( "JointFusion::GenerateData" );
+
   this->BeforeThreadedGenerateData();
 
   /**
    * Multithread processing for the weighted averaging
    */
-  typename ImageSource<TOutputImage>::ThreadStruct str1;
+  WeightedAveragingThreadStruct str1;
   str1.Filter = this;
 
-  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
-  this->GetMultiThreader()->SetSingleMethod( this->ThreaderCallback, &str1 );
+  std::vector<RealType> unitCosts;
+  if( this->GetNumberOfThreads() > 1 && this->ComputeWeightedAveragingUnits( str1.Units, unitCosts ) )
+    {
+    // The even units, then the odd ones:  a unit writes the patches around
+    // its voxels, which reach the patch radius into its neighbours, so two
+    // units of the same parity never write the same voxel.  Within a pass
+    // the most expensive units go first, whichever thread is free.
+    for( SizeValueType parity = 0; parity < 2; parity++ )
+      {
+      str1.UnitOrder.clear();
+      for( SizeValueType n = parity; n < str1.Units.size(); n += 2 )
+        {
+        str1.UnitOrder.push_back( UnitCostType( unitCosts[n], n ) );
+        }
+      std::sort( str1.UnitOrder.begin(), str1.UnitOrder.end(), std::greater<UnitCostType>() );
+      str1.NextUnit = 0;
 
-  this->GetMultiThreader()->SingleMethodExecute();
+      this->GetMultiThreader()->SetNumberOfThreads( std::min( static_cast<SizeValueType>(
+        this->GetNumberOfThreads() ), static_cast<SizeValueType>( str1.UnitOrder.size() ) ) );
+      this->GetMultiThreader()->SetSingleMethod( this->WeightedAveragingThreaderCallback, &str1 );
+      this->GetMultiThreader()->SingleMethodExecute();
+      }
+    }
+  else
+    {
+    typename ImageSource<TOutputImage>::ThreadStruct str;
+    str.Filter = this;
+
+    this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+    this->GetMultiThreader()->SetSingleMethod( this->ThreaderCallback, &str );
+
+    this->GetMultiThreader()->SingleMethodExecute();
+    }
 
   this->m_IsWeightedAveragingComplete = true;
 
@@ -221,6 +298,114 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   this->AfterThreadedGenerateData();
 }
 
+template <class TInputImage, class TOutputImage>
+bool
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::ComputeWeightedAveragingUnits( std::vector<RegionType> & units, std::vector<RealType> & unitCosts )
+{
+  units.clear();
+  unitCosts.clear();
+
+  const RegionType &  region = this->m_WeightedAveragingRegion;
+  const unsigned int  splitDimension = ImageDimension - 1;
+  const SizeValueType numberOfSlices = region.GetSize()[splitDimension];
+  const SizeValueType minimumThickness = std::max( static_cast<SizeValueType>(
+    2 * this->m_PatchNeighborhoodRadius[splitDimension] ), static_cast<SizeValueType>( 1 ) );
+
+  // the cost of each slice:  the search neighborhood sizes of its voxels in
+  // the mask, which is where the patch searches go
+  std::vector<RealType> sliceCosts( numberOfSlices, 0.0 );
+  ImageRegionConstIteratorWithIndex<InputImageType> It( this->m_TargetImage[0], region );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    const IndexType index = It.GetIndex();
+    if( this->m_MaskImage &&
+        this->m_MaskImage->GetPixel( index ) == NumericTraits<LabelType>::ZeroValue() )
+      {
+      continue;
+      }
+    RealType searchNeighborhoodSize = static_cast<RealType>( this->m_SearchNeighborhoodOffsetList.size() );
+    if( this->m_SearchNeighborhoodRadiusImage.IsNotNull() )
+      {
+      const RadiusValueType localSearchRadius = this->m_SearchNeighborhoodRadiusImage->GetPixel( index );
+      if( localSearchRadius <= 0 )
+        {
+        continue;
+        }
+      searchNeighborhoodSize = std::pow( static_cast<RealType>( 2 * localSearchRadius + 1 ),
+        static_cast<RealType>( ImageDimension ) );
+      }
+    sliceCosts[index[splitDimension] - region.GetIndex()[splitDimension]] += searchNeighborhoodSize;
+    }
+
+  const RealType totalCost = std::accumulate( sliceCosts.begin(), sliceCosts.end(), 0.0 );
+  if( !( totalCost > 0.0 ) )
+    {
+    return false;
+    }
+
+  // a few units per thread and pass, so that the last ones are small
+  const RealType targetCost = totalCost / static_cast<RealType>( 8 * this->GetNumberOfThreads() );
+
+  SizeValueType first = 0;
+  RealType      cost = 0.0;
+  for( SizeValueType n = 0; n < numberOfSlices; n++ )
+    {
+    cost += sliceCosts[n];
+    if( n + 1 - first >= minimumThickness && cost >= targetCost )
+      {
+      RegionType unit = region;
+      unit.SetIndex( splitDimension, region.GetIndex()[splitDimension] + static_cast<IndexValueType>( first ) );
+      unit.SetSize( splitDimension, n + 1 - first );
+      units.push_back( unit );
+      unitCosts.push_back( cost );
+      first = n + 1;
+      cost = 0.0;
+      }
+    }
+  if( first < numberOfSlices )
+    {
+    if( units.empty() || numberOfSlices - first >= minimumThickness )
+      {
+      RegionType unit = region;
+      unit.SetIndex( splitDimension, region.GetIndex()[splitDimension] + static_cast<IndexValueType>( first ) );
+      unit.SetSize( splitDimension, numberOfSlices - first );
+      units.push_back( unit );
+      unitCosts.push_back( cost );
+      }
+    else
+      {
+      units.back().SetSize( splitDimension, units.back().GetSize()[splitDimension] + numberOfSlices - first );
+      unitCosts.back() += cost;
+      }
+    }
+
+  // too few units to keep the threads busy in both passes
+  return units.size() >= 4 * static_cast<SizeValueType>( this->GetNumberOfThreads() );
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::WeightedAveragingThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  WeightedAveragingThreadStruct *  str = static_cast<WeightedAveragingThreadStruct *>( info->UserData );
+
+  while( true )
+    {
+    str->Mutex.Lock();
+    const SizeValueType n = str->NextUnit++;
+    str->Mutex.Unlock();
+    if( n >= str->UnitOrder.size() )
+      {
+      break;
+      }
+    str->Filter->ThreadedGenerateData( str->Units[str->UnitOrder[n].second], info->ThreadID );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <class TInputImage, class TOutputImage>
 void
 WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
@@ -240,8 +425,24 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     itkExceptionMacro( "The number of target images must be 1 or must be the number of atlas modalities." );
     }
 
-  // Find all the unique labels in the atlas segmentations
-  this->m_LabelSet.clear();
+  this->m_IsWeightedAveragingComplete = false;
+
+  const RegionType & outputRegion = this->GetOutput()->GetRequestedRegion();
+  const RegionType & largestRegion = this->GetOutput()->GetLargestPossibleRegion();
+
+  this->m_IsStreaming = ( outputRegion != largestRegion );
+
+  this->m_WeightedAveragingRegion = outputRegion;
+  this->m_WeightedAveragingRegion.PadByRadius( this->m_PatchNeighborhoodRadius );
+  this->m_WeightedAveragingRegion.Crop( largestRegion );
+
+  // Find all the unique labels in the atlas segmentations.  When streaming,
+  // the label set accumulates over the pieces (it is reset in
+  // GenerateOutputInformation()).
+  if( !this->m_IsStreaming )
+    {
+    this->m_LabelSet.clear();
+    }
   for( unsigned int i = 0; i < this->m_NumberOfAtlasSegmentations; i++ )
     {
     ImageRegionConstIteratorWithIndex<LabelImageType> It(
@@ -415,6 +616,51 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     this->m_PatchNeighborhoodOffsetList.push_back( ( It2.GetNeighborhood() ).GetOffset( n ) );
     }
 
+  // If all the intensity images have buffers of the same size (and thus the
+  // same offset table), a patch lying completely inside the target requested
+  // region can be gathered directly from the pixel buffers with precomputed
+  // offsets.
+
+  const RegionType & bufferedRegion = this->m_TargetImage[0]->GetBufferedRegion();
+
+  this->m_UsePatchNeighborhoodBufferOffsets = true;
+  for( SizeValueType i = 0; i < this->m_TargetImage.size(); i++ )
+    {
+    if( this->m_TargetImage[i]->GetBufferedRegion().GetSize() != bufferedRegion.GetSize() )
+      {
+      this->m_UsePatchNeighborhoodBufferOffsets = false;
+      }
+    }
+  for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
+    {
+    for( SizeValueType j = 0; j < this->m_NumberOfAtlasModalities; j++ )
+      {
+      if( this->m_AtlasImages[i][j]->GetBufferedRegion().GetSize() != bufferedRegion.GetSize() )
+        {
+        this->m_UsePatchNeighborhoodBufferOffsets = false;
+        }
+      }
+    }
+
+  this->m_PatchNeighborhoodBufferOffsets.resize( this->m_PatchNeighborhoodSize );
+  const OffsetValueType centerOffset = this->m_TargetImage[0]->ComputeOffset( bufferedRegion.GetIndex() );
+  for( unsigned int n = 0; n < this->m_PatchNeighborhoodSize; n++ )
+    {
+    this->m_PatchNeighborhoodBufferOffsets[n] = this->m_TargetImage[0]->ComputeOffset(
+      bufferedRegion.GetIndex() + this->m_PatchNeighborhoodOffsetList[n] ) - centerOffset;
+    }
+
+  IndexType interiorIndex = this->m_TargetImageRequestedRegion.GetIndex();
+  SizeType interiorSize = this->m_TargetImageRequestedRegion.GetSize();
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const SizeValueType radius = this->m_PatchNeighborhoodRadius[d];
+    interiorIndex[d] += static_cast<IndexValueType>( radius );
+    interiorSize[d] = ( interiorSize[d] > 2 * radius ) ? interiorSize[d] - 2 * radius : 0;
+    }
+  this->m_PatchInteriorRegion.SetIndex( interiorIndex );
+  this->m_PatchInteriorRegion.SetSize( interiorSize );
+
   this->AllocateOutputs();
 }
 
@@ -425,10 +671,13 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 {
   if( !this->m_IsWeightedAveragingComplete )
     {
+    // the patch search and the weight estimation, summed over the threads
+    ANTS_PROFILE_SCOPE( "JointFusion::PatchSearchAndWeights" );
     this->ThreadedGenerateDataForWeightedAveraging( region, threadId );
     }
   else
     {
+    ANTS_PROFILE_SCOPE( "JointFusion::Reconstruction" );
     this->ThreadedGenerateDataForReconstruction( region, threadId );
     }
 }
@@ -452,6 +701,12 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 
   std::vector<SizeValueType> minimumAtlasOffsetIndices( this->m_NumberOfAtlases );
 
+  MatrixType Mx( this->m_NumberOfAtlases, this->m_NumberOfAtlases );
+  MatrixType MxBar( this->m_NumberOfAtlases, this->m_NumberOfAtlases );
+
+  // Define a vector of all ones
+  VectorType ones( this->m_NumberOfAtlases, 1.0 );
+
   bool useOnlyFirstAtlasImage = true;
   if( numberOfTargetModalities == this->m_NumberOfAtlasModalities )
     {
@@ -514,6 +769,7 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 
     InputImagePixelVectorType normalizedTargetPatch =
       this->VectorizeImageListPatch( this->m_TargetImage, currentCenterIndex, true );
+    const bool isTargetPatchInterior = this->m_PatchInteriorRegion.IsInside( currentCenterIndex );
 
     absoluteAtlasPatchDifferences.fill( 0.0 );
     originalAtlasPatchIntensities.fill( 0.0 );
@@ -529,13 +785,13 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
         {
         IndexType searchIndex = currentCenterIndex + searchNeighborhoodOffsetList[j];
 
-        if( !output->GetRequestedRegion().IsInside( searchIndex ) )
+        if( !output->GetLargestPossibleRegion().IsInside( searchIndex ) )
           {
           continue;
           }
 
         RealType patchSimilarity = this->ComputeNeighborhoodPatchSimilarity(
-          this->m_AtlasImages[i], searchIndex, normalizedTargetPatch, useOnlyFirstAtlasImage );
+          this->m_AtlasImages[i], searchIndex, normalizedTargetPatch, useOnlyFirstAtlasImage, isTargetPatchInterior );
 
         if( patchSimilarity < minimumPatchSimilarity )
           {
@@ -585,9 +841,6 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
       minimumAtlasOffsetIndices[i] = minimumPatchOffsetIndex;
       }
 
-    // Allocate Mx
-    MatrixType Mx( this->m_NumberOfAtlases, this->m_NumberOfAtlases );
-
     // Compute Mx values
     for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
       {
@@ -620,12 +873,10 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
       }
 
     // Compute the weights by solving for the inverse of Mx
-    MatrixType MxBar( this->m_NumberOfAtlases, this->m_NumberOfAtlases, 0.0 );
+    MxBar.fill( 0.0 );
     MxBar.fill_diagonal( this->m_Alpha );
     MxBar += Mx;
 
-    // Define a vector of all ones
-    VectorType ones( this->m_NumberOfAtlases, 1.0 );
     VectorType W( this->m_NumberOfAtlases, 1.0 );
 
     if( this->m_ConstrainSolutionToNonnegativeWeights )
@@ -634,7 +885,18 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
       }
     else
       {
-      W = vnl_svd<RealType>( MxBar ).solve( ones );
+      // MxBar is symmetric and, for beta = 2, positive definite (the
+      // elementwise square of a Gram matrix plus alpha * I) so the Cholesky
+      // factorization normally succeeds.  Otherwise fall back to the SVD.
+      vnl_cholesky cholesky( MxBar, vnl_cholesky::quiet );
+      if( cholesky.rank_deficiency() == 0 )
+        {
+        W = cholesky.solve( ones );
+        }
+      else
+        {
+        W = vnl_svd<RealType>( MxBar ).solve( ones );
+        }
 
       for( SizeValueType i = 0; i < W.size(); i++ )
         {
@@ -706,7 +968,7 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
           IndexType minimumIndex = neighborhoodIndex +
             searchNeighborhoodOffsetList[minimumAtlasOffsetIndices[i]];
 
-          if( !output->GetRequestedRegion().IsInside( minimumIndex ) )
+          if( !output->GetLargestPossibleRegion().IsInside( minimumIndex ) )
             {
             continue;
             }
@@ -848,6 +1110,106 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
         }
       }
     }
+
+  if( this->m_IsStreaming )
+    {
+    this->CopyRequestedRegionToStreamedImages();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::CopyRequestedRegionToStreamedImages()
+{
+  const RegionType & outputRegion = this->GetOutput()->GetRequestedRegion();
+
+  RegionType streamedRegion = this->GetOutput()->GetLargestPossibleRegion();
+  if( this->m_StreamedRegion.GetNumberOfPixels() > 0 )
+    {
+    streamedRegion = this->m_StreamedRegion;
+    }
+  if( !streamedRegion.IsInside( outputRegion ) )
+    {
+    itkExceptionMacro( "The requested region " << outputRegion << " is outside of the streamed region "
+      << streamedRegion );
+    }
+
+  if( this->m_RetainLabelPosteriorProbabilityImages )
+    {
+    typename LabelPosteriorProbabilityMap::const_iterator it;
+    for( it = this->m_LabelPosteriorProbabilityImages.begin();
+         it != this->m_LabelPosteriorProbabilityImages.end(); ++it )
+      {
+      if( this->m_StreamedLabelPosteriorProbabilityImages.find( it->first ) ==
+          this->m_StreamedLabelPosteriorProbabilityImages.end() )
+        {
+        ProbabilityImagePointer labelProbabilityImage = ProbabilityImageType::New();
+        labelProbabilityImage->CopyInformation( this->GetOutput() );
+        labelProbabilityImage->SetRegions( streamedRegion );
+        labelProbabilityImage->Allocate();
+        labelProbabilityImage->FillBuffer( 0.0 );
+
+        this->m_StreamedLabelPosteriorProbabilityImages.insert(
+          std::pair<LabelType, ProbabilityImagePointer>( it->first, labelProbabilityImage ) );
+        }
+
+      ImageRegionConstIterator<ProbabilityImageType> ItP( it->second, outputRegion );
+      ImageRegionIterator<ProbabilityImageType> ItS(
+        this->m_StreamedLabelPosteriorProbabilityImages[it->first], outputRegion );
+      for( ItP.GoToBegin(), ItS.GoToBegin(); !ItP.IsAtEnd(); ++ItP, ++ItS )
+        {
+        ItS.Set( ItP.Get() );
+        }
+      }
+    }
+
+  if( this->m_RetainAtlasVotingWeightImages )
+    {
+    if( this->m_StreamedAtlasVotingWeightImages.empty() )
+      {
+      this->m_StreamedAtlasVotingWeightImages.resize( this->m_NumberOfAtlases );
+      for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
+        {
+        this->m_StreamedAtlasVotingWeightImages[i] = ProbabilityImageType::New();
+        this->m_StreamedAtlasVotingWeightImages[i]->CopyInformation( this->GetOutput() );
+        this->m_StreamedAtlasVotingWeightImages[i]->SetRegions( streamedRegion );
+        this->m_StreamedAtlasVotingWeightImages[i]->Allocate();
+        this->m_StreamedAtlasVotingWeightImages[i]->FillBuffer( 0.0 );
+        }
+      }
+    for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
+      {
+      ImageRegionConstIterator<ProbabilityImageType> ItW( this->m_AtlasVotingWeightImages[i], outputRegion );
+      ImageRegionIterator<ProbabilityImageType> ItS( this->m_StreamedAtlasVotingWeightImages[i], outputRegion );
+      for( ItW.GoToBegin(), ItS.GoToBegin(); !ItW.IsAtEnd(); ++ItW, ++ItS )
+        {
+        ItS.Set( ItW.Get() );
+        }
+      }
+    }
+
+  if( this->m_StreamedJointIntensityFusionImage.empty() )
+    {
+    this->m_StreamedJointIntensityFusionImage.resize( this->m_NumberOfAtlasModalities );
+    for( SizeValueType i = 0; i < this->m_NumberOfAtlasModalities; i++ )
+      {
+      this->m_StreamedJointIntensityFusionImage[i] = InputImageType::New();
+      this->m_StreamedJointIntensityFusionImage[i]->CopyInformation( this->GetOutput() );
+      this->m_StreamedJointIntensityFusionImage[i]->SetRegions( streamedRegion );
+      this->m_StreamedJointIntensityFusionImage[i]->Allocate();
+      this->m_StreamedJointIntensityFusionImage[i]->FillBuffer( 0.0 );
+      }
+    }
+  for( SizeValueType i = 0; i < this->m_NumberOfAtlasModalities; i++ )
+    {
+    ImageRegionConstIterator<InputImageType> ItJ( this->m_JointIntensityFusionImage[i], outputRegion );
+    ImageRegionIterator<InputImageType> ItS( this->m_StreamedJointIntensityFusionImage[i], outputRegion );
+    for( ItJ.GoToBegin(), ItS.GoToBegin(); !ItJ.IsAtEnd(); ++ItJ, ++ItS )
+      {
+      ItS.Set( ItJ.Get() );
+      }
+    }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -873,19 +1235,30 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 ::VectorizeImagePatch( const InputImagePointer image, const IndexType index, const bool normalize )
 {
   InputImagePixelVectorType patchVector( this->m_PatchNeighborhoodSize );
-  for( SizeValueType i = 0; i < this->m_PatchNeighborhoodSize; i++ )
+  if( this->m_UsePatchNeighborhoodBufferOffsets && this->m_PatchInteriorRegion.IsInside( index ) )
     {
-    IndexType neighborhoodIndex = index + this->m_PatchNeighborhoodOffsetList[i];
-
-    bool isInBounds = this->m_TargetImageRequestedRegion.IsInside( neighborhoodIndex );
-    if( isInBounds )
+    const InputImagePixelType *patchCenter = image->GetBufferPointer() + image->ComputeOffset( index );
+    for( SizeValueType i = 0; i < this->m_PatchNeighborhoodSize; i++ )
       {
-      InputImagePixelType pixel = image->GetPixel( neighborhoodIndex );
-      patchVector[i] = pixel;
+      patchVector[i] = patchCenter[this->m_PatchNeighborhoodBufferOffsets[i]];
       }
-    else
+    }
+  else
+    {
+    for( SizeValueType i = 0; i < this->m_PatchNeighborhoodSize; i++ )
       {
-      patchVector[i] = std::numeric_limits<RealType>::quiet_NaN();
+      IndexType neighborhoodIndex = index + this->m_PatchNeighborhoodOffsetList[i];
+
+      bool isInBounds = this->m_TargetImageRequestedRegion.IsInside( neighborhoodIndex );
+      if( isInBounds )
+        {
+        InputImagePixelType pixel = image->GetPixel( neighborhoodIndex );
+        patchVector[i] = pixel;
+        }
+      else
+        {
+        patchVector[i] = std::numeric_limits<RealType>::quiet_NaN();
+        }
       }
     }
 
@@ -935,7 +1308,8 @@ template <class TInputImage, class TOutputImage>
 typename WeightedVotingFusionImageFilter<TInputImage, TOutputImage>::RealType
 WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 ::ComputeNeighborhoodPatchSimilarity( const InputImageList &imageList, const IndexType index,
-  const InputImagePixelVectorType &normalizedPatchVectorY, const bool useOnlyFirstImage )
+  const InputImagePixelVectorType &normalizedPatchVectorY, const bool useOnlyFirstImage,
+  const bool isPatchVectorYInterior )
 {
   unsigned int numberOfImagesToUse = imageList.size();
   if( useOnlyFirstImage )
@@ -949,27 +1323,58 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   RealType sumXY = 0.0;
   RealType N = 0.0;
 
-  SizeValueType count = 0;
-  for( SizeValueType i = 0; i < numberOfImagesToUse; i++ )
+  if( isPatchVectorYInterior && this->m_UsePatchNeighborhoodBufferOffsets &&
+      this->m_PatchInteriorRegion.IsInside( index ) )
     {
-    for( SizeValueType j = 0; j < this->m_PatchNeighborhoodSize; j++ )
+    // Both patches are completely inside the image so there is no bounds
+    // checking:  the atlas patch is read straight from the pixel buffer and
+    // the target patch is contiguous.
+    const SizeValueType patchSize = this->m_PatchNeighborhoodSize;
+    const OffsetValueType *offsets = &( this->m_PatchNeighborhoodBufferOffsets[0] );
+
+    for( SizeValueType i = 0; i < numberOfImagesToUse; i++ )
       {
-      IndexType neighborhoodIndex = index + this->m_PatchNeighborhoodOffsetList[j];
+      const InputImagePixelType *patchCenterX = imageList[i]->GetBufferPointer() + imageList[i]->ComputeOffset( index );
+      const InputImagePixelType *patchY = &( normalizedPatchVectorY[i * patchSize] );
 
-      bool isInBounds = this->m_TargetImageRequestedRegion.IsInside( neighborhoodIndex );
-      if( isInBounds && std::isfinite( normalizedPatchVectorY[count] ) )
+      for( SizeValueType j = 0; j < patchSize; j++ )
         {
-        RealType x = static_cast<RealType>( imageList[i]->GetPixel( neighborhoodIndex ) );
-        RealType y = static_cast<RealType>( normalizedPatchVectorY[count] );
+        RealType x = static_cast<RealType>( patchCenterX[offsets[j]] );
+        RealType y = static_cast<RealType>( patchY[j] );
 
         sumX += x;
         sumOfSquaresX += vnl_math_sqr( x );
         sumXY += ( x * y );
 
         sumOfSquaredDifferencesXY += vnl_math_sqr( y - x );
-        N += 1.0;
         }
-      ++count;
+      }
+    N = static_cast<RealType>( numberOfImagesToUse * patchSize );
+    }
+  else
+    {
+    SizeValueType count = 0;
+    for( SizeValueType i = 0; i < numberOfImagesToUse; i++ )
+      {
+      for( SizeValueType j = 0; j < this->m_PatchNeighborhoodSize; j++ )
+        {
+        IndexType neighborhoodIndex = index + this->m_PatchNeighborhoodOffsetList[j];
+
+        bool isInBounds = this->m_TargetImageRequestedRegion.IsInside( neighborhoodIndex );
+        if( isInBounds && std::isfinite( normalizedPatchVectorY[count] ) )
+          {
+          RealType x = static_cast<RealType>( imageList[i]->GetPixel( neighborhoodIndex ) );
+          RealType y = static_cast<RealType>( normalizedPatchVectorY[count] );
+
+          sumX += x;
+          sumOfSquaresX += vnl_math_sqr( x );
+          sumXY += ( x * y );
+
+          sumOfSquaredDifferencesXY += vnl_math_sqr( y - x );
+          N += 1.0;
+          }
+        ++count;
+        }
       }
     }
 
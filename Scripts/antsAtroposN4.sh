@@ -443,6 +443,9 @@ if [[ -f ${SEGMENTATION_CONVERGENCE_FILE} ]];
     logCmd rm -f ${SEGMENTATION_CONVERGENCE_FILE}
   fi
 
+SEGMENTATION_N4_BIAS_FIELDS=()
+SEGMENTATION_N4_BIAS_FIELD_LATTICES=()
+
 POSTERIOR_PROBABILITY_CONVERGED=0
 for (( i = 0; i < ${N4_ATROPOS_NUMBER_OF_ITERATIONS}; i++ ))
   do
@@ -461,11 +464,18 @@ for (( i = 0; i < ${N4_ATROPOS_NUMBER_OF_ITERATIONS}; i++ ))
           else
             cp ${ANATOMICAL_IMAGES[$j]} ${SEGMENTATION_N4_IMAGES[$j]}
           fi
-        exe_n4_correction="${N4} -d ${DIMENSION} -i ${SEGMENTATION_N4_IMAGES[$j]} -x ${ATROPOS_SEGMENTATION_MASK} -s ${N4_SHRINK_FACTOR} -c ${N4_CONVERGENCE} -b ${N4_BSPLINE_PARAMS} -o ${SEGMENTATION_N4_IMAGES[$j]} --verbose 1"
+        SEGMENTATION_N4_BIAS_FIELDS[$j]=${ATROPOS_SEGMENTATION_OUTPUT}${j}N4BiasField.${OUTPUT_SUFFIX}
+        SEGMENTATION_N4_BIAS_FIELD_LATTICES[$j]=${ATROPOS_SEGMENTATION_OUTPUT}${j}N4BiasFieldLattice.${OUTPUT_SUFFIX}
+        exe_n4_correction="${N4} -d ${DIMENSION} -i ${SEGMENTATION_N4_IMAGES[$j]} -x ${ATROPOS_SEGMENTATION_MASK} -s ${N4_SHRINK_FACTOR} -c ${N4_CONVERGENCE} -b ${N4_BSPLINE_PARAMS} -o [${SEGMENTATION_N4_IMAGES[$j]},${SEGMENTATION_N4_BIAS_FIELDS[$j]},${SEGMENTATION_N4_BIAS_FIELD_LATTICES[$j]}] --verbose 1"
         if [[ -f ${SEGMENTATION_WEIGHT_MASK} ]];
           then
             exe_n4_correction="${exe_n4_correction} -w ${SEGMENTATION_WEIGHT_MASK}"
           fi
+        # warm start from the bias field of the previous iteration
+        if [[ $i -gt 0 && -f ${SEGMENTATION_N4_BIAS_FIELD_LATTICES[$j]} ]];
+          then
+            exe_n4_correction="${exe_n4_correction} -l ${SEGMENTATION_N4_BIAS_FIELD_LATTICES[$j]}"
+          fi
         logCmd $exe_n4_correction
         logCmd ${ANTSPATH}/ImageMath ${DIMENSION} ${SEGMENTATION_N4_IMAGES[$j]} Normalize ${SEGMENTATION_N4_IMAGES[$j]}
         logCmd ${ANTSPATH}/ImageMath ${DIMENSION} ${SEGMENTATION_N4_IMAGES[$j]} m ${SEGMENTATION_N4_IMAGES[$j]} 1000
@@ -584,7 +594,7 @@ for (( i = 0; i < ${N4_ATROPOS_NUMBER_OF_ITERATIONS}; i++ ))
 
   done
 
-TMP_FILES=( $SEGMENTATION_WEIGHT_MASK ${POSTERIOR_IMAGE_FILENAMES_PREVIOUS_ITERATION[@]} ${SEGMENTATION_PREVIOUS_ITERATION} )
+TMP_FILES=( $SEGMENTATION_WEIGHT_MASK ${POSTERIOR_IMAGE_FILENAMES_PREVIOUS_ITERATION[@]} ${SEGMENTATION_PREVIOUS_ITERATION} ${SEGMENTATION_N4_BIAS_FIELDS[@]} ${SEGMENTATION_N4_BIAS_FIELD_LATTICES[@]} )
 
 if [[ $KEEP_TMP_IMAGES -eq 0 ]];
   then
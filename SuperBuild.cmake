@@ -107,6 +107,15 @@ CMAKE_DEPENDENT_OPTION(
      "USE_VTK" OFF
      )
 
+option(ANTS_ENABLE_PROFILING "Print a profile of the instrumented code paths at exit" OFF)
+mark_as_advanced(ANTS_ENABLE_PROFILING)
+option(ANTS_BUILD_BENCHMARKS "Build the antsBenchmarks performance suite and the ants_benchmarks target" OFF)
+mark_as_advanced(ANTS_BUILD_BENCHMARKS)
+option(ANTS_USE_BLAS "Use an external BLAS for the matrix products of sccan" OFF)
+mark_as_advanced(ANTS_USE_BLAS)
+set(BLA_VENDOR "" CACHE STRING "BLAS implementation used with ANTS_USE_BLAS, e.g. OpenBLAS or Intel10_64lp")
+mark_as_advanced(BLA_VENDOR)
+
 option(BUILD_ALL_ANTS_APPS "Build all ANTs apps" ON)
 option(RUN_SHORT_TESTS    "Run the quick unit tests."                                   ON  )
 option(RUN_LONG_TESTS     "Run the time consuming tests. i.e. real world registrations" ON  )
@@ -165,6 +174,10 @@ endmacro()
 #-----------------------------------------------------------------------------
 list(APPEND ${CMAKE_PROJECT_NAME}_SUPERBUILD_EP_VARS
   USE_VTK:BOOL
+  ANTS_ENABLE_PROFILING:BOOL
+  ANTS_BUILD_BENCHMARKS:BOOL
+  ANTS_USE_BLAS:BOOL
+  BLA_VENDOR:STRING
   CMAKE_BUILD_TYPE:PATH
   MAKECOMMAND:STRING
   CMAKE_SKIP_RPATH:BOOL
@@ -22,8 +22,9 @@ Program:   Advanced Normalization Tools
 
 #include "vnl/vnl_math.h"
 
-#include <functional>
-#include <queue>
+#include <deque>
+#include <map>
+#include <vector>
 
 namespace itk
 {
@@ -37,11 +38,19 @@ namespace itk
  *
  * Updates are preformed using an entropy satisfy scheme where only
  * "upwind" neighborhoods are used. This implementation of Fast Marching
- * uses a std::priority_queue to locate the next proper grid position to
- * update.
+ * uses an indexed min-heap to locate the next proper grid position to
+ * update.  Each trial point is on the heap once and its value is updated in
+ * place when a neighbor becomes alive.
  *
  * Fast Marching sweeps through N grid points in (N log N) steps to obtain
  * the arrival time value as the front propagates through the grid.
+ * Alternatively, an untidy priority queue can be used which sorts the trial
+ * points into buckets of a fixed width of arrival times and processes each
+ * bucket in first-in first-out order (Yatziv, Bartesaghi and Sapiro, "O(N)
+ * implementation of the fast marching algorithm", J. Comput. Phys. 2006).
+ * Only the few buckets around the front are in use, so the cost per point
+ * no longer grows with the size of the front, at the cost of an error in
+ * the arrival times on the order of the bucket width.
  *
  * Implementation of this class is based on Chapter 8 of
  * "Level Set Methods and Fast Marching Methods", J.A. Sethian,
@@ -82,18 +91,6 @@ namespace itk
  * and SetOutputOrigin(). Else if the speed image is not NULL, the output information
  * is copied from the input speed image.
  *
- * Possible Improvements:
- * In the current implemenation, std::priority_queue only allows
- * taking nodes out from the front and putting nodes in from the back.
- * To update a value already on the heap, a new node is added to the heap.
- * The defunct old node is left on the heap. When it is removed from the
- * top, it will be recognized as invalid and not used.
- * Future implementations can implement the heap in a different way
- * allowing the values to be updated. This will generally require
- * some sift-up and sift-down functions and
- * an image of back-pointers going from the image to heap in order
- * to locate the node which is to be updated.
- *
  * \sa LevelSetTypeDefault
  * \ingroup LevelSetSegmentation
  */
@@ -282,6 +279,15 @@ private:
   itkSetMacro( TopologyCheck, TopologyCheckType );
   itkGetConstReferenceMacro( TopologyCheck, TopologyCheckType );
 
+  /** Set/Get the bucket width of the untidy priority queue.  If the width is
+   * zero (the default), trial points are kept on an indexed min-heap and
+   * processed in the exact order of their arrival times.  Otherwise points
+   * whose arrival times fall into the same bucket are processed in the
+   * order they were reached.  A width of a fraction of the smallest
+   * spacing divided by the largest speed keeps the error small. */
+  itkSetClampMacro( UntidyQueueBucketWidth, double, 0.0, NumericTraits<double>::max() );
+  itkGetConstMacro( UntidyQueueBucketWidth, double );
+
   /** Get the container of Processed Points. If the CollectPoints flag
    * is set, the algorithm collects a container of all processed nodes.
    * This is useful for defining creating Narrowbands for level
@@ -397,13 +403,41 @@ private:
 
   /** Trial points are stored in a min-heap. This allow efficient access
    * to the trial point with minimum value which is the next grid point
-   * the algorithm processes. */
-  typedef std::vector<AxisNodeType>  HeapContainer;
-  typedef std::greater<AxisNodeType> NodeComparer;
-  typedef std::priority_queue<AxisNodeType, HeapContainer, NodeComparer>
-    HeapType;
+   * the algorithm processes.  The position of every trial point on the heap
+   * is kept per voxel (in buffer order) so that its value can be updated
+   * with a sift-up or sift-down instead of adding a duplicate node. */
+  typedef std::vector<AxisNodeType> HeapContainer;
+  typedef unsigned int              HeapPositionType;
+
+  HeapContainer                 m_TrialHeap;
+  std::vector<HeapPositionType> m_TrialHeapPositions;
+
+  /** Buckets of the untidy priority queue.  Bucket b holds the arrival
+   * times in [ b * width, ( b + 1 ) * width ); only the few buckets around
+   * the front are non-empty.  Updated points are added again, the old nodes
+   * are skipped when taken out of the queue. */
+  typedef std::deque<AxisNodeType>             BucketType;
+  typedef std::map<OffsetValueType, BucketType> BucketContainer;
+
+  BucketContainer m_TrialBuckets;
+  double          m_UntidyQueueBucketWidth;
+
+  void ClearTrialQueue();
+
+  bool IsTrialQueueEmpty() const;
+
+  /** Add a trial point or update the value of a trial point already queued. */
+  void PushTrialNode( const AxisNodeType & );
+
+  /** Take the trial point with the smallest value (the first point of the
+   * smallest bucket for the untidy queue). */
+  AxisNodeType PopTrialNode();
+
+  void SiftUpTrialHeap( HeapPositionType );
+
+  void SiftDownTrialHeap( HeapPositionType );
 
-  HeapType m_TrialHeap;
+  void SetTrialHeapNode( HeapPositionType, const AxisNodeType & );
 
   double m_NormalizationFactor;
 
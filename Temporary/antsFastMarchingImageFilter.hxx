@@ -24,13 +24,15 @@
 #include "vnl/vnl_math.h"
 
 #include <algorithm>
+#include <cmath>
 
 namespace itk
 {
 template <class TLevelSet, class TSpeedImage>
 FMarchingImageFilter<TLevelSet, TSpeedImage>
 ::FMarchingImageFilter()
-  : m_TrialHeap()
+  : m_TrialHeap(),
+  m_UntidyQueueBucketWidth( 0.0 )
 {
   this->ProcessObject::SetNumberOfRequiredInputs(0);
 
@@ -96,6 +98,7 @@ FMarchingImageFilter<TLevelSet, TSpeedImage>
     case Strict:
       os << "Strict" << std::endl;
     }
+  os << indent << "Untidy queue bucket width: " << this->m_UntidyQueueBucketWidth << std::endl;
   os << indent << "Collect points: " << this->m_CollectPoints << std::endl;
   os << indent << "OverrideOutputInformation: ";
   os << this->m_OverrideOutputInformation << std::endl;
@@ -259,10 +262,7 @@ FMarchingImageFilter<TLevelSet, TSpeedImage>
     }
 
   // make sure the heap is empty
-  while( !this->m_TrialHeap.empty() )
-    {
-    this->m_TrialHeap.pop();
-    }
+  this->ClearTrialQueue();
 
   // process the input trial points
   if( this->m_TrialPoints )
@@ -291,7 +291,7 @@ FMarchingImageFilter<TLevelSet, TSpeedImage>
       outputPixel = node.GetValue();
       output->SetPixel( node.GetIndex(), outputPixel );
 
-      this->m_TrialHeap.push( node );
+      this->PushTrialNode( node );
       }
     }
 
@@ -336,13 +336,13 @@ FMarchingImageFilter<TLevelSet, TSpeedImage>
 
   this->UpdateProgress( 0.0 ); // Send first progress event
 
-  while( !this->m_TrialHeap.empty() )
+  while( !this->IsTrialQueueEmpty() )
     {
     // get the node with the smallest value
-    node = this->m_TrialHeap.top();
-    this->m_TrialHeap.pop();
+    node = this->PopTrialNode();
 
-    // does this node contain the current value ?
+    // does this node contain the current value ?  (only nodes of the untidy
+    // queue can be out of date)
     currentValue = (double) output->GetPixel( node.GetIndex() );
 
     if( node.GetValue() != currentValue )
@@ -662,12 +662,166 @@ FMarchingImageFilter<TLevelSet, TSpeedImage>
     this->m_LabelImage->SetPixel( index, TrialPoint );
     node.SetValue( static_cast<PixelType>( solution ) );
     node.SetIndex( index );
-    this->m_TrialHeap.push( node );
+    this->PushTrialNode( node );
     }
 
   return solution;
 }
 
+template <class TLevelSet, class TSpeedImage>
+void
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::ClearTrialQueue()
+{
+  this->m_TrialHeap.clear();
+  this->m_TrialBuckets.clear();
+
+  if( this->m_UntidyQueueBucketWidth > 0.0 )
+    {
+    std::vector<HeapPositionType>().swap( this->m_TrialHeapPositions );
+    }
+  else
+    {
+    this->m_TrialHeapPositions.assign( this->m_BufferedRegion.GetNumberOfPixels(),
+                                       NumericTraits<HeapPositionType>::max() );
+    }
+}
+
+template <class TLevelSet, class TSpeedImage>
+bool
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::IsTrialQueueEmpty() const
+{
+  if( this->m_UntidyQueueBucketWidth > 0.0 )
+    {
+    return this->m_TrialBuckets.empty();
+    }
+  return this->m_TrialHeap.empty();
+}
+
+template <class TLevelSet, class TSpeedImage>
+void
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::PushTrialNode( const AxisNodeType & node )
+{
+  if( this->m_UntidyQueueBucketWidth > 0.0 )
+    {
+    // clamp so that very slow (large) arrival times do not overflow the bucket number
+    const double maximumBucket = 0.5 * static_cast<double>( NumericTraits<OffsetValueType>::max() );
+    double       bucket = std::floor( static_cast<double>( node.GetValue() ) / this->m_UntidyQueueBucketWidth );
+    bucket = std::max( -maximumBucket, std::min( maximumBucket, bucket ) );
+
+    this->m_TrialBuckets[static_cast<OffsetValueType>( bucket )].push_back( node );
+    return;
+    }
+
+  const OffsetValueType  offset = this->m_LabelImage->ComputeOffset( node.GetIndex() );
+  const HeapPositionType position = this->m_TrialHeapPositions[offset];
+  if( position == NumericTraits<HeapPositionType>::max() )
+    {
+    this->m_TrialHeap.push_back( node );
+    this->m_TrialHeapPositions[offset] = static_cast<HeapPositionType>( this->m_TrialHeap.size() - 1 );
+    this->SiftUpTrialHeap( static_cast<HeapPositionType>( this->m_TrialHeap.size() - 1 ) );
+    }
+  else
+    {
+    const bool isDecrease = node.GetValue() < this->m_TrialHeap[position].GetValue();
+    this->m_TrialHeap[position] = node;
+    if( isDecrease )
+      {
+      this->SiftUpTrialHeap( position );
+      }
+    else
+      {
+      this->SiftDownTrialHeap( position );
+      }
+    }
+}
+
+template <class TLevelSet, class TSpeedImage>
+typename FMarchingImageFilter<TLevelSet, TSpeedImage>::AxisNodeType
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::PopTrialNode()
+{
+  AxisNodeType node;
+  if( this->m_UntidyQueueBucketWidth > 0.0 )
+    {
+    typename BucketContainer::iterator bucket = this->m_TrialBuckets.begin();
+    node = bucket->second.front();
+    bucket->second.pop_front();
+    if( bucket->second.empty() )
+      {
+      this->m_TrialBuckets.erase( bucket );
+      }
+    return node;
+    }
+
+  node = this->m_TrialHeap.front();
+  this->m_TrialHeapPositions[this->m_LabelImage->ComputeOffset( node.GetIndex() )] =
+    NumericTraits<HeapPositionType>::max();
+
+  const AxisNodeType last = this->m_TrialHeap.back();
+  this->m_TrialHeap.pop_back();
+  if( !this->m_TrialHeap.empty() )
+    {
+    this->SetTrialHeapNode( 0, last );
+    this->SiftDownTrialHeap( 0 );
+    }
+  return node;
+}
+
+template <class TLevelSet, class TSpeedImage>
+void
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::SiftUpTrialHeap( HeapPositionType position )
+{
+  const AxisNodeType node = this->m_TrialHeap[position];
+  while( position > 0 )
+    {
+    const HeapPositionType parent = ( position - 1 ) / 2;
+    if( !( node.GetValue() < this->m_TrialHeap[parent].GetValue() ) )
+      {
+      break;
+      }
+    this->SetTrialHeapNode( position, this->m_TrialHeap[parent] );
+    position = parent;
+    }
+  this->SetTrialHeapNode( position, node );
+}
+
+template <class TLevelSet, class TSpeedImage>
+void
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::SiftDownTrialHeap( HeapPositionType position )
+{
+  const HeapPositionType size = static_cast<HeapPositionType>( this->m_TrialHeap.size() );
+  const AxisNodeType     node = this->m_TrialHeap[position];
+  while( 2 * static_cast<SizeValueType>( position ) + 1 < size )
+    {
+    HeapPositionType child = 2 * position + 1;
+    if( child + 1 < size && this->m_TrialHeap[child + 1].GetValue() < this->m_TrialHeap[child].GetValue() )
+      {
+      child++;
+      }
+    if( !( this->m_TrialHeap[child].GetValue() < node.GetValue() ) )
+      {
+      break;
+      }
+    this->SetTrialHeapNode( position, this->m_TrialHeap[child] );
+    position = child;
+    }
+  this->SetTrialHeapNode( position, node );
+}
+
+template <class TLevelSet, class TSpeedImage>
+void
+FMarchingImageFilter<TLevelSet, TSpeedImage>
+::SetTrialHeapNode( HeapPositionType position, const AxisNodeType & node )
+{
+  this->m_TrialHeap[position] = node;
+  this->m_TrialHeapPositions[this->m_LabelImage->ComputeOffset( node.GetIndex() )] = position;
+}
+
 /**
  * Topology check functions
  */
@@ -274,6 +274,288 @@ void DijkstrasAlgorithm<TGraphSearchNode>::FindPath()
 
   return;
 }
+
+template <class TPixelType>
+DijkstrasGraphDistances<TPixelType>::DijkstrasGraphDistances()
+{
+  m_NumberOfVertices = 0;
+  m_MaximumDistance = NumericTraits<PixelType>::max();
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::SetNumberOfVertices(VertexIdentifierType n)
+{
+  m_NumberOfVertices = n;
+  m_Offsets.assign( n + 1, 0 );
+  m_Targets.clear();
+  m_Weights.clear();
+  m_EdgeSources.clear();
+  m_EdgeTargets.clear();
+  m_EdgeWeights.clear();
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::AddEdge(VertexIdentifierType u, VertexIdentifierType v, PixelType length)
+{
+  if( u >= m_NumberOfVertices || v >= m_NumberOfVertices )
+    {
+    itkExceptionMacro( "Edge (" << u << ", " << v << ") is outside of the "
+                                << m_NumberOfVertices << " vertices." );
+    }
+  m_EdgeSources.push_back(u);
+  m_EdgeTargets.push_back(v);
+  m_EdgeWeights.push_back(length);
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::BuildGraph()
+{
+  // count the degree of every vertex, keeping the edges of an
+  // earlier build
+  VertexListType degree( m_NumberOfVertices, 0 );
+  for( VertexIdentifierType v = 0; v < m_NumberOfVertices; v++ )
+    {
+    degree[v] = m_Offsets[v + 1] - m_Offsets[v];
+    }
+  for( VertexIdentifierType e = 0; e < m_EdgeSources.size(); e++ )
+    {
+    degree[m_EdgeSources[e]]++;
+    degree[m_EdgeTargets[e]]++;
+    }
+
+  VertexListType offsets( m_NumberOfVertices + 1, 0 );
+  for( VertexIdentifierType v = 0; v < m_NumberOfVertices; v++ )
+    {
+    offsets[v + 1] = offsets[v] + degree[v];
+    }
+
+  VertexListType   targets( offsets[m_NumberOfVertices] );
+  DistanceListType weights( offsets[m_NumberOfVertices] );
+  VertexListType   fill( offsets.begin(), offsets.end() - 1 );
+  for( VertexIdentifierType v = 0; v < m_NumberOfVertices; v++ )
+    {
+    for( VertexIdentifierType k = m_Offsets[v]; k < m_Offsets[v + 1]; k++ )
+      {
+      targets[fill[v]] = m_Targets[k];
+      weights[fill[v]++] = m_Weights[k];
+      }
+    }
+  for( VertexIdentifierType e = 0; e < m_EdgeSources.size(); e++ )
+    {
+    const VertexIdentifierType u = m_EdgeSources[e];
+    const VertexIdentifierType v = m_EdgeTargets[e];
+    targets[fill[u]] = v;
+    weights[fill[u]++] = m_EdgeWeights[e];
+    targets[fill[v]] = u;
+    weights[fill[v]++] = m_EdgeWeights[e];
+    }
+
+  m_Offsets.swap( offsets );
+  m_Targets.swap( targets );
+  m_Weights.swap( weights );
+  VertexListType().swap( m_EdgeSources );
+  VertexListType().swap( m_EdgeTargets );
+  DistanceListType().swap( m_EdgeWeights );
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::SetGraph(const VertexListType & offsets,
+                                                   const VertexListType & targets,
+                                                   const DistanceListType & weights)
+{
+  if( offsets.empty() || targets.size() != weights.size() || offsets.back() != targets.size() )
+    {
+    itkExceptionMacro( "Inconsistent adjacency: " << offsets.size() << " offsets, "
+                                                  << targets.size() << " targets and "
+                                                  << weights.size() << " weights." );
+    }
+  m_NumberOfVertices = offsets.size() - 1;
+  m_Offsets = offsets;
+  m_Targets = targets;
+  m_Weights = weights;
+  m_EdgeSources.clear();
+  m_EdgeTargets.clear();
+  m_EdgeWeights.clear();
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::ResetVertices()
+{
+  if( m_Distances.size() != m_NumberOfVertices )
+    {
+    m_Distances.assign( m_NumberOfVertices, NumericTraits<PixelType>::max() );
+    m_Predecessors.assign( m_NumberOfVertices, InvalidVertex() );
+    m_ClosestSources.assign( m_NumberOfVertices, InvalidVertex() );
+    m_HeapPositions.assign( m_NumberOfVertices, InvalidVertex() );
+    }
+  else
+    {
+    for( VertexIdentifierType i = 0; i < m_Touched.size(); i++ )
+      {
+      const VertexIdentifierType v = m_Touched[i];
+      m_Distances[v] = NumericTraits<PixelType>::max();
+      m_Predecessors[v] = InvalidVertex();
+      m_ClosestSources[v] = InvalidVertex();
+      m_HeapPositions[v] = InvalidVertex();
+      }
+    }
+  m_Touched.clear();
+  m_Settled.clear();
+  m_Heap.clear();
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::HeapUp(VertexIdentifierType position)
+{
+  const VertexIdentifierType v = m_Heap[position];
+  const PixelType            distance = m_Distances[v];
+
+  while( position > 0 )
+    {
+    const VertexIdentifierType parent = ( position - 1 ) / 2;
+    if( m_Distances[m_Heap[parent]] <= distance )
+      {
+      break;
+      }
+    m_Heap[position] = m_Heap[parent];
+    m_HeapPositions[m_Heap[position]] = position;
+    position = parent;
+    }
+  m_Heap[position] = v;
+  m_HeapPositions[v] = position;
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::HeapDown(VertexIdentifierType position)
+{
+  const VertexIdentifierType v = m_Heap[position];
+  const PixelType            distance = m_Distances[v];
+  const VertexIdentifierType size = m_Heap.size();
+
+  for( ;; )
+    {
+    VertexIdentifierType child = 2 * position + 1;
+    if( child >= size )
+      {
+      break;
+      }
+    if( child + 1 < size && m_Distances[m_Heap[child + 1]] < m_Distances[m_Heap[child]] )
+      {
+      child++;
+      }
+    if( distance <= m_Distances[m_Heap[child]] )
+      {
+      break;
+      }
+    m_Heap[position] = m_Heap[child];
+    m_HeapPositions[m_Heap[position]] = position;
+    position = child;
+    }
+  m_Heap[position] = v;
+  m_HeapPositions[v] = position;
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::Compute()
+{
+  if( !m_EdgeSources.empty() )
+    {
+    this->BuildGraph();
+    }
+  this->ResetVertices();
+
+  for( VertexIdentifierType i = 0; i < m_Sources.size(); i++ )
+    {
+    const VertexIdentifierType v = m_Sources[i];
+    const PixelType            distance = m_SourceDistances[i];
+    if( v >= m_NumberOfVertices )
+      {
+      itkExceptionMacro( "Source " << v << " is outside of the " << m_NumberOfVertices << " vertices." );
+      }
+    if( distance > m_MaximumDistance || distance >= m_Distances[v] )
+      {
+      continue;
+      }
+    if( m_Predecessors[v] == InvalidVertex() )
+      {
+      m_Touched.push_back(v);
+      }
+    m_Distances[v] = distance;
+    m_Predecessors[v] = v;
+    m_ClosestSources[v] = i;
+    if( m_HeapPositions[v] == InvalidVertex() )
+      {
+      m_Heap.push_back(v);
+      this->HeapUp( m_Heap.size() - 1 );
+      }
+    else
+      {
+      this->HeapUp( m_HeapPositions[v] );
+      }
+    }
+
+  // vertices beyond the maximum distance are never queued, so the search
+  // ends as soon as the bound is reached
+  while( !m_Heap.empty() )
+    {
+    const VertexIdentifierType u = m_Heap[0];
+    m_HeapPositions[u] = InvalidVertex();
+    m_Heap[0] = m_Heap.back();
+    m_Heap.pop_back();
+    if( !m_Heap.empty() )
+      {
+      this->HeapDown(0);
+      }
+    m_Settled.push_back(u);
+
+    const PixelType distance = m_Distances[u];
+    for( VertexIdentifierType k = m_Offsets[u]; k < m_Offsets[u + 1]; k++ )
+      {
+      const VertexIdentifierType v = m_Targets[k];
+      const PixelType            newDistance = distance + m_Weights[k];
+      if( newDistance >= m_Distances[v] || newDistance > m_MaximumDistance )
+        {
+        continue;
+        }
+      if( m_Predecessors[v] == InvalidVertex() )
+        {
+        m_Touched.push_back(v);
+        }
+      m_Distances[v] = newDistance;
+      m_Predecessors[v] = u;
+      m_ClosestSources[v] = m_ClosestSources[u];
+      if( m_HeapPositions[v] == InvalidVertex() )
+        {
+        m_Heap.push_back(v);
+        this->HeapUp( m_Heap.size() - 1 );
+        }
+      else
+        {
+        this->HeapUp( m_HeapPositions[v] );
+        }
+      }
+    }
+}
+
+template <class TPixelType>
+void DijkstrasGraphDistances<TPixelType>::BackTrack(VertexIdentifierType v, VertexListType & path) const
+{
+  path.clear();
+  if( v >= m_Predecessors.size() || !this->WasReached(v) )
+    {
+    return;
+    }
+  for( ;; )
+    {
+    path.push_back(v);
+    const VertexIdentifierType p = m_Predecessors[v];
+    if( p == v )
+      {
+      break;
+      }
+    v = p;
+    }
+}
 } // end namespace itk
 
 #endif
@@ -52,6 +52,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkNeighborhoodIterator.h"
 #include "itkVector.h"
+#include "itkNumericTraits.h"
 using namespace std;
 
 namespace itk
@@ -687,6 +688,175 @@ private:
   DijkstrasAlgorithm(const Self &); // purposely not implemented
   void operator=(const Self &);     // purposely not implemented
 };
+/**
+ * \class DijkstrasGraphDistances
+ * \brief Shortest path distances on a graph stored as compressed adjacency lists.
+ *
+ *  Unlike DijkstrasAlgorithm, which allocates a node object for every
+ *  visited location of a regular grid, this class holds an arbitrary graph
+ *  (e.g. the vertices and edges of a surface mesh) as compressed sparse row
+ *  adjacency: the neighbors of vertex v are m_Targets[m_Offsets[v]] up to,
+ *  but not including, m_Targets[m_Offsets[v+1]], with the matching edge
+ *  lengths in m_Weights.  The search uses a binary heap indexed by vertex so
+ *  that a shorter path updates the queued entry in place (decrease-key).
+ *  Any number of sources may be given; every reached vertex records its
+ *  distance to, and the identity of, the closest source.  The search stops
+ *  once the closest queued vertex is farther than the maximum distance.
+ *  Only the vertices touched by a query are reset by the next one, so
+ *  repeated local queries on a large mesh do not pay for the whole graph.
+ *  Note: we assume all edge weights are non-negative.
+ */
+template <class TPixelType = float>
+class DijkstrasGraphDistances : public itk::LightObject
+{
+public:
+  typedef DijkstrasGraphDistances  Self;
+  typedef LightObject              Superclass;
+  typedef SmartPointer<Self>       Pointer;
+  typedef SmartPointer<const Self> ConstPointer;
+  itkTypeMacro(DijkstrasGraphDistances, LightObject);
+  itkNewMacro(Self);
+
+  typedef TPixelType                 PixelType;   /** edge length and distance type */
+  typedef unsigned long              VertexIdentifierType;
+  typedef vector<VertexIdentifierType> VertexListType;
+  typedef vector<PixelType>            DistanceListType;
+
+  /** Sets the number of vertices and discards any edges added so far. */
+  void SetNumberOfVertices(VertexIdentifierType n);
+
+  VertexIdentifierType GetNumberOfVertices() const
+  {
+    return m_NumberOfVertices;
+  }
+
+  /** Adds an edge in both directions.  The adjacency is rebuilt by
+      BuildGraph, which Compute calls if edges were added since. */
+  void AddEdge(VertexIdentifierType u, VertexIdentifierType v, PixelType length);
+
+  /** Builds the compressed adjacency from the added edges. */
+  void BuildGraph();
+
+  /** Sets a ready made compressed adjacency, offsets has one entry more
+      than there are vertices. */
+  void SetGraph(const VertexListType & offsets, const VertexListType & targets,
+                const DistanceListType & weights);
+
+  /** adds a source, with an optional initial distance */
+  void AddSource(VertexIdentifierType v, PixelType distance = 0)
+  {
+    m_Sources.push_back(v);
+    m_SourceDistances.push_back(distance);
+  }
+
+  void ClearSources()
+  {
+    m_Sources.clear();
+    m_SourceDistances.clear();
+  }
+
+  /** Vertices farther than this from every source are not searched. */
+  void SetMaximumDistance(PixelType m)
+  {
+    m_MaximumDistance = m;
+  }
+
+  PixelType GetMaximumDistance() const
+  {
+    return m_MaximumDistance;
+  }
+
+  /** runs the search from the current sources */
+  void Compute();
+
+  /** The distance to the closest source, the maximum value of the pixel
+      type for vertices that were not reached. */
+  inline PixelType GetDistance(VertexIdentifierType v) const
+  {
+    return m_Distances[v];
+  }
+
+  inline const DistanceListType & GetDistances() const
+  {
+    return m_Distances;
+  }
+
+  /** previous vertex on the shortest path, the vertex itself for sources */
+  inline VertexIdentifierType GetPredecessor(VertexIdentifierType v) const
+  {
+    return m_Predecessors[v];
+  }
+
+  /** the closest source of the vertex, in the order the sources were added */
+  inline VertexIdentifierType GetClosestSource(VertexIdentifierType v) const
+  {
+    return m_ClosestSources[v];
+  }
+
+  inline bool WasReached(VertexIdentifierType v) const
+  {
+    return m_Predecessors[v] != InvalidVertex();
+  }
+
+  /** The vertices settled by the last query, in order of distance. */
+  inline const VertexListType & GetSettledVertices() const
+  {
+    return m_Settled;
+  }
+
+  /** Fills path with the vertices from v back to its closest source. */
+  void BackTrack(VertexIdentifierType v, VertexListType & path) const;
+
+  static VertexIdentifierType InvalidVertex()
+  {
+    return NumericTraits<VertexIdentifierType>::max();
+  }
+
+protected:
+  DijkstrasGraphDistances();
+  ~DijkstrasGraphDistances()
+  {
+  };
+
+  void ResetVertices();
+
+  void HeapUp(VertexIdentifierType position);
+
+  void HeapDown(VertexIdentifierType position);
+
+  VertexIdentifierType m_NumberOfVertices;
+
+  /** compressed adjacency */
+  VertexListType   m_Offsets;
+  VertexListType   m_Targets;
+  DistanceListType m_Weights;
+
+  /** edges added since the last BuildGraph */
+  VertexListType   m_EdgeSources;
+  VertexListType   m_EdgeTargets;
+  DistanceListType m_EdgeWeights;
+
+  VertexListType   m_Sources;
+  DistanceListType m_SourceDistances;
+  PixelType        m_MaximumDistance;
+
+  /** per vertex results */
+  DistanceListType m_Distances;
+  VertexListType   m_Predecessors;
+  VertexListType   m_ClosestSources;
+
+  /** m_Heap holds vertices, m_HeapPositions the heap slot of each vertex */
+  VertexListType m_Heap;
+  VertexListType m_HeapPositions;
+
+  /** vertices whose results must be reset before the next query */
+  VertexListType m_Touched;
+  VertexListType m_Settled;
+private:
+
+  DijkstrasGraphDistances(const Self &); // purposely not implemented
+  void operator=(const Self &);          // purposely not implemented
+};
 } // end namespace itk
 
 #ifndef ITK_MANUAL_INSTANTIATION
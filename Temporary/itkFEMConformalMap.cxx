@@ -1055,11 +1055,9 @@ void  FEMConformalMap<TSurface, TImage, TDimension>
   unsigned int maxits = m_Solver.GetNumberOfDegreesOfFreedom();   // should be > twice ndofs
   // if (m_Debug)
   ::std::cout << " ndof " << maxits << std::endl;
-  itpackWrapper.SetMaximumNumberIterations(maxits * 4);
-  itpackWrapper.SetTolerance(1.e-5);
-  itpackWrapper.JacobianConjugateGradient();
-  itpackWrapper.SetMaximumNonZeroValuesInMatrix(maxits * 100);
-  m_Solver.SetLinearSystemWrapper(&itpackWrapper);
+  pcgWrapper.SetMaximumNumberOfIterations(maxits * 4);
+  pcgWrapper.SetTolerance(1.e-5);
+  m_Solver.SetLinearSystemWrapper(&pcgWrapper);
 
   /**
    * Assemble the master stiffness matrix. In order to do this
@@ -59,7 +59,7 @@
 #include "itkCastImageFilter.h"
 
 #include "itkFEM.h"
-#include "itkFEMLinearSystemWrapperItpack.h"
+#include "itkFEMLinearSystemWrapperPCG.h"
 #include "itkFEMElement3DC0LinearTriangularLaplaceBeltrami.h"
 #include "itkFEMElement3DC0LinearTriangularMembrane.h"
 
@@ -213,7 +213,7 @@ private:
   ImageTypePointer                    m_Image;
   ImageTypePointer                    m_SphereImage;
   SurfaceTypePointer                  m_SurfaceMesh;
-  itk::fem::LinearSystemWrapperItpack itpackWrapper;
+  itk::fem::LinearSystemWrapperPCG    pcgWrapper;
 
   unsigned long m_PoleElementsGN[7];
 };
@@ -1445,12 +1445,9 @@ void  FEMDiscConformalMap<TSurface, TImage, TDimension>
   unsigned int maxits = m_Solver.GetNumberOfDegreesOfFreedom(); // should be > twice ndofs
   // if (m_Debug)
   std::cout << " ndof " << maxits << std::endl;
-  itpackWrapper.SetMaximumNumberIterations(maxits * 5);
-  itpackWrapper.SetTolerance(1.e-4);
-  itpackWrapper.SuccessiveOverrelaxation();
-  // itpackWrapper.JacobianConjugateGradient();
-  itpackWrapper.SetMaximumNonZeroValuesInMatrix(maxits * 50);
-  m_Solver.SetLinearSystemWrapper(&itpackWrapper);
+  pcgWrapper.SetMaximumNumberOfIterations(maxits * 5);
+  pcgWrapper.SetTolerance(1.e-4);
+  m_Solver.SetLinearSystemWrapper(&pcgWrapper);
 
   this->FixBoundaryPoints(0);
   m_Solver.AssembleK();
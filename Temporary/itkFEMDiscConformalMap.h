@@ -62,7 +62,7 @@
 #include "itkCastImageFilter.h"
 
 // #include "itkFEM.h"
-#include "itkFEMLinearSystemWrapperItpack.h"
+#include "itkFEMLinearSystemWrapperPCG.h"
 #include "itkFEMLoadNode.h"
 #include "itkFEMSolver.h"
 #include "itkMesh.h"
@@ -281,7 +281,7 @@ private:
   SurfaceTypePointer m_SurfaceFeatureMesh;
 
   float                               m_MaxCost;
-  itk::fem::LinearSystemWrapperItpack itpackWrapper;
+  itk::fem::LinearSystemWrapperPCG    pcgWrapper;
 
   unsigned long                 m_PoleElementsGN[7];
   ManifoldIntegratorTypePointer manifoldIntegrator;
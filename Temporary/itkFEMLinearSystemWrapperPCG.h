@@ -0,0 +1,617 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef _itkFEMLinearSystemWrapperPCG_h
+#define _itkFEMLinearSystemWrapperPCG_h
+
+#include "itkFEMLinearSystemWrapper.h"
+#include "itkFEMException.h"
+#include "itkMultiThreader.h"
+#include "vnl/vnl_vector.h"
+#include "vnl/vnl_math.h"
+#include <algorithm>
+#include <vector>
+
+namespace itk
+{
+namespace fem
+{
+/** \class LinearSystemWrapperPCG
+ * \brief Sparse linear system solved by Jacobi preconditioned conjugate gradients.
+ *
+ * The matrices are assembled row by row into sorted (column, value) lists
+ * with no limit on the number of non-zeros.  Solve compresses matrix 0 into
+ * compressed sparse row arrays, which are reused until the matrix changes,
+ * and runs a Jacobi preconditioned conjugate gradient iteration whose
+ * matrix-vector products are split over threads for large systems.  The
+ * previous solution is the starting guess of the next solve when the system
+ * order has not changed, so that e.g. the real and imaginary parts of a
+ * conformal map, which share the stiffness matrix, converge quickly.
+ *
+ * The system matrix must be symmetric positive definite, which is the case
+ * for the stiffness matrices here once Solver::ApplyBC fixes the boundary.
+ */
+class LinearSystemWrapperPCG : public LinearSystemWrapper
+{
+public:
+
+  /* Standard typedefs. */
+  typedef LinearSystemWrapperPCG               Self;
+  typedef LinearSystemWrapper                  Superclass;
+  typedef std::vector<std::pair<unsigned int, Float> > RowType;
+  typedef std::vector<RowType>                 MatrixType;
+  typedef vnl_vector<Float>                    VectorType;
+
+  LinearSystemWrapperPCG() :
+    m_Tolerance( 1.e-6 ),
+    m_MaximumNumberOfIterations( 0 ),
+    m_NumberOfIterations( 0 ),
+    m_ResidualNorm( 0 ),
+    m_UseWarmStart( true ),
+    m_NumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() ),
+    m_CompressedMatrixIsCurrent( false )
+  {
+  }
+
+  virtual ~LinearSystemWrapperPCG()
+  {
+    for( unsigned int i = 0; i < m_Matrices.size(); i++ )
+      {
+      delete m_Matrices[i];
+      }
+    for( unsigned int i = 0; i < m_Vectors.size(); i++ )
+      {
+      delete m_Vectors[i];
+      }
+    for( unsigned int i = 0; i < m_Solutions.size(); i++ )
+      {
+      delete m_Solutions[i];
+      }
+  }
+
+  /** relative residual at which the iteration stops */
+  void SetTolerance( Float tolerance )
+  {
+    m_Tolerance = tolerance;
+  }
+
+  Float GetTolerance() const
+  {
+    return m_Tolerance;
+  }
+
+  /** 0, the default, allows as many iterations as the system order */
+  void SetMaximumNumberOfIterations( unsigned int n )
+  {
+    m_MaximumNumberOfIterations = n;
+  }
+
+  unsigned int GetNumberOfIterations() const
+  {
+    return m_NumberOfIterations;
+  }
+
+  Float GetResidualNorm() const
+  {
+    return m_ResidualNorm;
+  }
+
+  void SetUseWarmStart( bool b )
+  {
+    m_UseWarmStart = b;
+  }
+
+  void SetNumberOfThreads( ThreadIdType n )
+  {
+    m_NumberOfThreads = std::max( n, static_cast<ThreadIdType>( 1 ) );
+  }
+
+  virtual void InitializeMatrix( unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    if( m_Matrices.size() < m_NumberOfMatrices )
+      {
+      m_Matrices.resize( m_NumberOfMatrices, ITK_NULLPTR );
+      }
+    delete m_Matrices[matrixIndex];
+    m_Matrices[matrixIndex] = new MatrixType( this->GetSystemOrder() );
+    this->MatrixChanged( matrixIndex );
+  }
+
+  virtual bool IsMatrixInitialized( unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    return matrixIndex < m_Matrices.size() && m_Matrices[matrixIndex];
+  }
+
+  virtual void DestroyMatrix( unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    if( this->IsMatrixInitialized( matrixIndex ) )
+      {
+      delete m_Matrices[matrixIndex];
+      m_Matrices[matrixIndex] = ITK_NULLPTR;
+      this->MatrixChanged( matrixIndex );
+      }
+  }
+
+  virtual void InitializeVector( unsigned int vectorIndex = 0 ) ITK_OVERRIDE
+  {
+    this->InitializeVectorList( m_Vectors, m_NumberOfVectors, vectorIndex );
+  }
+
+  virtual bool IsVectorInitialized( unsigned int vectorIndex = 0 ) ITK_OVERRIDE
+  {
+    return vectorIndex < m_Vectors.size() && m_Vectors[vectorIndex];
+  }
+
+  virtual void DestroyVector( unsigned int vectorIndex = 0 ) ITK_OVERRIDE
+  {
+    if( this->IsVectorInitialized( vectorIndex ) )
+      {
+      delete m_Vectors[vectorIndex];
+      m_Vectors[vectorIndex] = ITK_NULLPTR;
+      }
+  }
+
+  virtual void InitializeSolution( unsigned int solutionIndex = 0 ) ITK_OVERRIDE
+  {
+    this->InitializeVectorList( m_Solutions, m_NumberOfSolutions, solutionIndex );
+  }
+
+  virtual bool IsSolutionInitialized( unsigned int solutionIndex = 0 ) ITK_OVERRIDE
+  {
+    return solutionIndex < m_Solutions.size() && m_Solutions[solutionIndex];
+  }
+
+  virtual void DestroySolution( unsigned int solutionIndex = 0 ) ITK_OVERRIDE
+  {
+    if( this->IsSolutionInitialized( solutionIndex ) )
+      {
+      delete m_Solutions[solutionIndex];
+      m_Solutions[solutionIndex] = ITK_NULLPTR;
+      }
+  }
+
+  virtual Float GetMatrixValue( unsigned int i, unsigned int j, unsigned int matrixIndex = 0 ) const ITK_OVERRIDE
+  {
+    const RowType &         row = ( *m_Matrices[matrixIndex] )[i];
+    RowType::const_iterator it = std::lower_bound( row.begin(), row.end(), std::make_pair( j, Float( 0 ) ),
+                                                   CompareColumns );
+    return ( it != row.end() && it->first == j ) ? it->second : 0.0;
+  }
+
+  virtual void SetMatrixValue( unsigned int i, unsigned int j, Float value, unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    RowType &         row = ( *m_Matrices[matrixIndex] )[i];
+    RowType::iterator it = std::lower_bound( row.begin(), row.end(), std::make_pair( j, Float( 0 ) ),
+                                             CompareColumns );
+    if( it != row.end() && it->first == j )
+      {
+      it->second = value;
+      }
+    else if( value != 0.0 )
+      {
+      row.insert( it, std::make_pair( j, value ) );
+      }
+    this->MatrixChanged( matrixIndex );
+  }
+
+  virtual void AddMatrixValue( unsigned int i, unsigned int j, Float value, unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    if( value == 0.0 )
+      {
+      return;
+      }
+    RowType &         row = ( *m_Matrices[matrixIndex] )[i];
+    RowType::iterator it = std::lower_bound( row.begin(), row.end(), std::make_pair( j, Float( 0 ) ),
+                                             CompareColumns );
+    if( it != row.end() && it->first == j )
+      {
+      it->second += value;
+      }
+    else
+      {
+      row.insert( it, std::make_pair( j, value ) );
+      }
+    this->MatrixChanged( matrixIndex );
+  }
+
+  /** Solver::ApplyBC visits the stored entries of a row, this avoids the
+      default implementation, which queries every column. */
+  virtual void GetColumnsOfNonZeroMatrixElementsInRow( unsigned int row, ColumnArray & cols,
+                                                       unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    const RowType & r = ( *m_Matrices[matrixIndex] )[row];
+
+    cols.clear();
+    for( RowType::const_iterator it = r.begin(); it != r.end(); ++it )
+      {
+      if( it->second != 0.0 )
+        {
+        cols.push_back( it->first );
+        }
+      }
+  }
+
+  virtual void ScaleMatrix( Float scale, unsigned int matrixIndex = 0 ) ITK_OVERRIDE
+  {
+    MatrixType & A = *m_Matrices[matrixIndex];
+    for( unsigned int i = 0; i < A.size(); i++ )
+      {
+      for( RowType::iterator it = A[i].begin(); it != A[i].end(); ++it )
+        {
+        it->second *= scale;
+        }
+      }
+    this->MatrixChanged( matrixIndex );
+  }
+
+  virtual Float GetVectorValue( unsigned int i, unsigned int vectorIndex = 0 ) const ITK_OVERRIDE
+  {
+    return ( *m_Vectors[vectorIndex] )[i];
+  }
+
+  virtual void SetVectorValue( unsigned int i, Float value, unsigned int vectorIndex = 0 ) ITK_OVERRIDE
+  {
+    ( *m_Vectors[vectorIndex] )[i] = value;
+  }
+
+  virtual void AddVectorValue( unsigned int i, Float value, unsigned int vectorIndex = 0 ) ITK_OVERRIDE
+  {
+    ( *m_Vectors[vectorIndex] )[i] += value;
+  }
+
+  virtual void SetSolutionValue( unsigned int i, Float value, unsigned int solutionIndex = 0 ) ITK_OVERRIDE
+  {
+    ( *m_Solutions[solutionIndex] )[i] = value;
+  }
+
+  virtual void AddSolutionValue( unsigned int i, Float value, unsigned int solutionIndex = 0 ) ITK_OVERRIDE
+  {
+    ( *m_Solutions[solutionIndex] )[i] += value;
+  }
+
+  virtual Float GetSolutionValue( unsigned int i, unsigned int solutionIndex = 0 ) const ITK_OVERRIDE
+  {
+    if( solutionIndex >= m_Solutions.size() || !m_Solutions[solutionIndex] ||
+        i >= m_Solutions[solutionIndex]->size() )
+      {
+      return 0.0;
+      }
+    return ( *m_Solutions[solutionIndex] )[i];
+  }
+
+  virtual void Solve( void ) ITK_OVERRIDE;
+
+  virtual void SwapMatrices( unsigned int matrixIndex1, unsigned int matrixIndex2 ) ITK_OVERRIDE
+  {
+    std::swap( m_Matrices[matrixIndex1], m_Matrices[matrixIndex2] );
+    this->MatrixChanged( matrixIndex1 );
+    this->MatrixChanged( matrixIndex2 );
+  }
+
+  virtual void SwapVectors( unsigned int vectorIndex1, unsigned int vectorIndex2 ) ITK_OVERRIDE
+  {
+    std::swap( m_Vectors[vectorIndex1], m_Vectors[vectorIndex2] );
+  }
+
+  virtual void SwapSolutions( unsigned int solutionIndex1, unsigned int solutionIndex2 ) ITK_OVERRIDE
+  {
+    std::swap( m_Solutions[solutionIndex1], m_Solutions[solutionIndex2] );
+  }
+
+  virtual void MultiplyMatrixMatrix( unsigned int resultMatrixIndex, unsigned int leftMatrixIndex,
+                                     unsigned int rightMatrixIndex ) ITK_OVERRIDE;
+
+  virtual void MultiplyMatrixVector( unsigned int resultVectorIndex, unsigned int matrixIndex,
+                                     unsigned int vectorIndex ) ITK_OVERRIDE
+  {
+    const MatrixType & A = *m_Matrices[matrixIndex];
+    const VectorType & x = *m_Vectors[vectorIndex];
+    VectorType         y( this->GetSystemOrder(), 0.0 );
+    for( unsigned int i = 0; i < A.size(); i++ )
+      {
+      Float sum = 0.0;
+      for( RowType::const_iterator it = A[i].begin(); it != A[i].end(); ++it )
+        {
+        sum += it->second * x[it->first];
+        }
+      y[i] = sum;
+      }
+    *m_Vectors[resultVectorIndex] = y;
+  }
+
+  virtual void CopySolution2Vector( unsigned int solutionIndex, unsigned int vectorIndex ) ITK_OVERRIDE
+  {
+    this->InitializeVector( vectorIndex );
+    *m_Vectors[vectorIndex] = *m_Solutions[solutionIndex];
+  }
+
+  virtual void CopyVector2Solution( unsigned int vectorIndex, unsigned int solutionIndex ) ITK_OVERRIDE
+  {
+    this->InitializeSolution( solutionIndex );
+    *m_Solutions[solutionIndex] = *m_Vectors[vectorIndex];
+  }
+
+private:
+
+  static bool CompareColumns( const std::pair<unsigned int, Float> & a, const std::pair<unsigned int, Float> & b )
+  {
+    return a.first < b.first;
+  }
+
+  void InitializeVectorList( std::vector<VectorType *> & list, unsigned int n, unsigned int index )
+  {
+    if( list.size() < n )
+      {
+      list.resize( n, ITK_NULLPTR );
+      }
+    delete list[index];
+    list[index] = new VectorType( this->GetSystemOrder(), 0.0 );
+  }
+
+  void MatrixChanged( unsigned int matrixIndex )
+  {
+    if( matrixIndex == 0 )
+      {
+      m_CompressedMatrixIsCurrent = false;
+      }
+  }
+
+  /** copies matrix 0 into the compressed row arrays */
+  void CompressMatrix();
+
+  /** y = A x with the compressed matrix, threaded for large systems */
+  void CompressedMatrixVector( const Float *x, Float *y );
+
+  struct MultiplyThreadStruct
+    {
+    const Self  *Wrapper;
+    const Float *X;
+    Float       *Y;
+    };
+
+  static ITK_THREAD_RETURN_TYPE MultiplyThreaderCallback( void *arg );
+
+  void MultiplyRows( const Float *x, Float *y, unsigned int first, unsigned int last ) const;
+
+  std::vector<MatrixType *> m_Matrices;
+  std::vector<VectorType *> m_Vectors;
+  std::vector<VectorType *> m_Solutions;
+
+  Float        m_Tolerance;
+  unsigned int m_MaximumNumberOfIterations;
+  unsigned int m_NumberOfIterations;
+  Float        m_ResidualNorm;
+  bool         m_UseWarmStart;
+  ThreadIdType m_NumberOfThreads;
+
+  /** compressed sparse row copy of matrix 0 */
+  bool                      m_CompressedMatrixIsCurrent;
+  std::vector<unsigned int> m_RowOffsets;
+  std::vector<unsigned int> m_Columns;
+  std::vector<Float>        m_Values;
+  std::vector<Float>        m_InverseDiagonal;
+
+  VectorType m_PreviousSolution;
+
+  MultiThreader::Pointer m_Threader;
+};
+
+inline void LinearSystemWrapperPCG::MultiplyMatrixMatrix( unsigned int resultMatrixIndex,
+                                                          unsigned int leftMatrixIndex,
+                                                          unsigned int rightMatrixIndex )
+{
+  const MatrixType & L = *m_Matrices[leftMatrixIndex];
+  const MatrixType & R = *m_Matrices[rightMatrixIndex];
+  MatrixType *       C = new MatrixType( this->GetSystemOrder() );
+
+  std::vector<Float> accumulator( this->GetSystemOrder(), 0.0 );
+  std::vector<bool>  used( this->GetSystemOrder(), false );
+  std::vector<unsigned int> columns;
+  for( unsigned int i = 0; i < L.size(); i++ )
+    {
+    columns.clear();
+    for( RowType::const_iterator lt = L[i].begin(); lt != L[i].end(); ++lt )
+      {
+      const RowType & r = R[lt->first];
+      for( RowType::const_iterator rt = r.begin(); rt != r.end(); ++rt )
+        {
+        if( !used[rt->first] )
+          {
+          used[rt->first] = true;
+          columns.push_back( rt->first );
+          }
+        accumulator[rt->first] += lt->second * rt->second;
+        }
+      }
+    std::sort( columns.begin(), columns.end() );
+    ( *C )[i].reserve( columns.size() );
+    for( unsigned int k = 0; k < columns.size(); k++ )
+      {
+      ( *C )[i].push_back( std::make_pair( columns[k], accumulator[columns[k]] ) );
+      accumulator[columns[k]] = 0.0;
+      used[columns[k]] = false;
+      }
+    }
+
+  delete m_Matrices[resultMatrixIndex];
+  m_Matrices[resultMatrixIndex] = C;
+  this->MatrixChanged( resultMatrixIndex );
+}
+
+inline void LinearSystemWrapperPCG::CompressMatrix()
+{
+  const MatrixType & A = *m_Matrices[0];
+  const unsigned int n = this->GetSystemOrder();
+
+  m_RowOffsets.assign( n + 1, 0 );
+  for( unsigned int i = 0; i < n; i++ )
+    {
+    m_RowOffsets[i + 1] = m_RowOffsets[i] + A[i].size();
+    }
+  m_Columns.resize( m_RowOffsets[n] );
+  m_Values.resize( m_RowOffsets[n] );
+  m_InverseDiagonal.assign( n, 1.0 );
+  for( unsigned int i = 0; i < n; i++ )
+    {
+    unsigned int k = m_RowOffsets[i];
+    for( RowType::const_iterator it = A[i].begin(); it != A[i].end(); ++it, ++k )
+      {
+      m_Columns[k] = it->first;
+      m_Values[k] = it->second;
+      if( it->first == i && it->second != 0.0 )
+        {
+        m_InverseDiagonal[i] = 1.0 / it->second;
+        }
+      }
+    }
+  m_CompressedMatrixIsCurrent = true;
+}
+
+inline void LinearSystemWrapperPCG::MultiplyRows( const Float *x, Float *y, unsigned int first,
+                                                  unsigned int last ) const
+{
+  for( unsigned int i = first; i < last; i++ )
+    {
+    Float sum = 0.0;
+    for( unsigned int k = m_RowOffsets[i]; k < m_RowOffsets[i + 1]; k++ )
+      {
+      sum += m_Values[k] * x[m_Columns[k]];
+      }
+    y[i] = sum;
+    }
+}
+
+inline ITK_THREAD_RETURN_TYPE LinearSystemWrapperPCG::MultiplyThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  MultiplyThreadStruct *           str = static_cast<MultiplyThreadStruct *>( info->UserData );
+
+  const unsigned long n = str->Wrapper->m_RowOffsets.size() - 1;
+  const unsigned int  first = n * info->ThreadID / info->NumberOfThreads;
+  const unsigned int  last = n * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  str->Wrapper->MultiplyRows( str->X, str->Y, first, last );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+inline void LinearSystemWrapperPCG::CompressedMatrixVector( const Float *x, Float *y )
+{
+  const unsigned int n = m_RowOffsets.size() - 1;
+
+  // below a few tens of thousands of non-zeros starting the threads costs
+  // more than the product
+  if( m_NumberOfThreads < 2 || m_Values.size() < 50000 )
+    {
+    this->MultiplyRows( x, y, 0, n );
+    return;
+    }
+  if( !m_Threader )
+    {
+    m_Threader = MultiThreader::New();
+    }
+  MultiplyThreadStruct str;
+  str.Wrapper = this;
+  str.X = x;
+  str.Y = y;
+  m_Threader->SetNumberOfThreads( m_NumberOfThreads );
+  m_Threader->SetSingleMethod( Self::MultiplyThreaderCallback, &str );
+  m_Threader->SingleMethodExecute();
+}
+
+inline void LinearSystemWrapperPCG::Solve( void )
+{
+  const unsigned int n = this->GetSystemOrder();
+
+  if( !this->IsMatrixInitialized( 0 ) || !this->IsVectorInitialized( 0 ) )
+    {
+    throw FEMException( __FILE__, __LINE__, "LinearSystemWrapperPCG::Solve(): system is not initialized" );
+    }
+  if( !m_CompressedMatrixIsCurrent )
+    {
+    this->CompressMatrix();
+    }
+  if( !this->IsSolutionInitialized( 0 ) )
+    {
+    this->InitializeSolution( 0 );
+    }
+
+  const VectorType & b = *m_Vectors[0];
+  VectorType &       x = *m_Solutions[0];
+  if( m_UseWarmStart && m_PreviousSolution.size() == n )
+    {
+    x = m_PreviousSolution;
+    }
+  else
+    {
+    x.fill( 0.0 );
+    }
+
+  m_NumberOfIterations = 0;
+  const Float bnorm = b.two_norm();
+  if( bnorm == 0.0 )
+    {
+    x.fill( 0.0 );
+    m_ResidualNorm = 0.0;
+    m_PreviousSolution = x;
+    return;
+    }
+
+  VectorType r( n );
+  VectorType z( n );
+  VectorType p( n );
+  VectorType q( n );
+
+  this->CompressedMatrixVector( x.data_block(), q.data_block() );
+  r = b - q;
+  for( unsigned int i = 0; i < n; i++ )
+    {
+    z[i] = m_InverseDiagonal[i] * r[i];
+    }
+  p = z;
+  Float rz = dot_product( r, z );
+
+  const unsigned int maximumNumberOfIterations = m_MaximumNumberOfIterations > 0 ? m_MaximumNumberOfIterations :
+    std::max( n, 1u );
+  m_ResidualNorm = r.two_norm() / bnorm;
+  while( m_ResidualNorm > m_Tolerance && m_NumberOfIterations < maximumNumberOfIterations )
+    {
+    this->CompressedMatrixVector( p.data_block(), q.data_block() );
+    const Float pq = dot_product( p, q );
+    if( pq <= 0.0 || vnl_math_isnan( pq ) )
+      {
+      // the matrix is not positive definite along p
+      break;
+      }
+    const Float alpha = rz / pq;
+    for( unsigned int i = 0; i < n; i++ )
+      {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * q[i];
+      z[i] = m_InverseDiagonal[i] * r[i];
+      }
+    const Float rzNew = dot_product( r, z );
+    const Float beta = rzNew / rz;
+    rz = rzNew;
+    for( unsigned int i = 0; i < n; i++ )
+      {
+      p[i] = z[i] + beta * p[i];
+      }
+    m_ResidualNorm = r.two_norm() / bnorm;
+    m_NumberOfIterations++;
+    }
+  m_PreviousSolution = x;
+}
+}
+}  // end namespace itk::fem
+
+#endif
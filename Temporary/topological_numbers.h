@@ -5,7 +5,10 @@
 
    This code is the result of my understanding of their paper, and is
    not optimized. In fact, it is possible to generate look-up tables
-   to greatly speed-up computations...
+   to greatly speed-up computations...  ants::DigitalTopology
+   (antsDigitalTopology.h) tests the (6,26) and (26,6) conventions on a
+   bit-packed neighborhood, classifies whole images on all threads and
+   computes Euler characteristics from a table of 2x2x2 configurations.
 
    Given a binary 3*3*3 neighborhood ( the structure
    TOPOLOGICAL_NEIGHBORHOOD or NBH ) and a pair of consistent
@@ -13,8 +13,13 @@
 #include "itkRotationMatrixFromVectors.h"
 #include "vnl/algo/vnl_matrix_inverse.h"
 #include "vnl/algo/vnl_symmetric_eigensystem.h"
+#include "vnl/vnl_math.h"
 #include "itkMatrix.h"
 #include "itkVariableSizeMatrix.h"
+
+#include <algorithm>
+#include <cmath>
+
 namespace matHelper
 {
 template <typename TFloat, unsigned int dim>
@@ -108,14 +113,383 @@ TensorType Matrix2Vector( MatrixType dtm )
   return dtv;
 }
 
+/** The eigenvalues, in increasing order, and the eigenvectors (the columns
+ * of evecs, as the V of vnl_symmetric_eigensystem) of the symmetric 3x3
+ * matrix with the upper triangle t = ( xx, xy, xz, yy, yz, zz ), by cyclic
+ * Jacobi rotations.  A few sweeps reach double precision, without the
+ * general solver's allocations. */
+inline void SymmetricEigenSystem3x3( const double t[6], double evals[3], double evecs[3][3] )
+{
+  double a[3][3] = { { t[0], t[1], t[2] }, { t[1], t[3], t[4] }, { t[2], t[4], t[5] } };
+
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      evecs[i][j] = ( i == j ) ? 1.0 : 0.0;
+      }
+    }
+  for( unsigned int sweep = 0; sweep < 50; sweep++ )
+    {
+    const double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+    const double diagonal = a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2];
+    if( off <= 1.e-32 * diagonal )
+      {
+      break;
+      }
+    for( unsigned int p = 0; p < 2; p++ )
+      {
+      for( unsigned int q = p + 1; q < 3; q++ )
+        {
+        if( a[p][q] == 0.0 )
+          {
+          continue;
+          }
+        // the rotation that zeroes a[p][q]
+        const double theta = ( a[q][q] - a[p][p] ) / ( 2.0 * a[p][q] );
+        double       tangent = 1.0 / ( std::fabs( theta ) + std::sqrt( theta * theta + 1.0 ) );
+        if( theta < 0.0 )
+          {
+          tangent = -tangent;
+          }
+        const double c = 1.0 / std::sqrt( tangent * tangent + 1.0 );
+        const double s = tangent * c;
+        for( unsigned int k = 0; k < 3; k++ )
+          {
+          const double akp = a[k][p];
+          const double akq = a[k][q];
+          a[k][p] = c * akp - s * akq;
+          a[k][q] = s * akp + c * akq;
+          }
+        for( unsigned int k = 0; k < 3; k++ )
+          {
+          const double apk = a[p][k];
+          const double aqk = a[q][k];
+          a[p][k] = c * apk - s * aqk;
+          a[q][k] = s * apk + c * aqk;
+          }
+        a[p][q] = a[q][p] = 0.0;
+        for( unsigned int k = 0; k < 3; k++ )
+          {
+          const double vkp = evecs[k][p];
+          const double vkq = evecs[k][q];
+          evecs[k][p] = c * vkp - s * vkq;
+          evecs[k][q] = s * vkp + c * vkq;
+          }
+        }
+      }
+    }
+
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    evals[i] = a[i][i];
+    }
+  // sort the columns by increasing eigenvalue
+  for( unsigned int i = 0; i < 2; i++ )
+    {
+    unsigned int smallest = i;
+    for( unsigned int j = i + 1; j < 3; j++ )
+      {
+      if( evals[j] < evals[smallest] )
+        {
+        smallest = j;
+        }
+      }
+    if( smallest != i )
+      {
+      std::swap( evals[i], evals[smallest] );
+      for( unsigned int k = 0; k < 3; k++ )
+        {
+        std::swap( evecs[k][i], evecs[k][smallest] );
+        }
+      }
+    }
+}
+
+/** The eigenvalues, in increasing order, of the symmetric 3x3 matrix ( xx,
+ * xy, xz, yy, yz, zz ) in closed form, from the trigonometric solution of
+ * its characteristic polynomial.  No branches, so that loops over arrays
+ * of tensors vectorize. */
+inline void SymmetricEigenValues3x3( double xx, double xy, double xz, double yy, double yz, double zz,
+                                     double & e1, double & e2, double & e3 )
+{
+  const double q = ( xx + yy + zz ) / 3.0;
+  const double a = xx - q;
+  const double b = yy - q;
+  const double c = zz - q;
+  const double p = std::sqrt( ( a * a + b * b + c * c + 2.0 * ( xy * xy + xz * xz + yz * yz ) ) / 6.0 );
+  const double inverse = p > 0.0 ? 1.0 / p : 0.0;
+  // det( A - q I ) / ( 2 p^3 ), in [-1, 1] up to rounding
+  const double determinant = a * ( b * c - yz * yz ) - xy * ( xy * c - yz * xz ) + xz * ( xy * yz - b * xz );
+  const double r = std::min( 1.0, std::max( -1.0, 0.5 * determinant * inverse * inverse * inverse ) );
+  const double phi = std::acos( r ) / 3.0;
+  e3 = q + 2.0 * p * std::cos( phi );
+  e1 = q + 2.0 * p * std::cos( phi + 2.0 * vnl_math::pi / 3.0 );
+  e2 = 3.0 * q - e1 - e3;
+}
+
+inline void SymmetricEigenValues3x3( const double t[6], double evals[3] )
+{
+  SymmetricEigenValues3x3( t[0], t[1], t[2], t[3], t[4], t[5], evals[0], evals[1], evals[2] );
+}
+
+/** The eigenvalues of numberOfTensors tensors of 6 consecutive values each
+ * (e.g. the buffer of an image of SymmetricSecondRankTensor<TValue, 3>),
+ * 3 per tensor in increasing order.  The tensors are transposed to one
+ * array per component a block at a time for the closed form loop. */
+template <class TValue, class TEigenValue>
+void SymmetricEigenValues3x3( const TValue *tensors, unsigned long numberOfTensors, TEigenValue *evals )
+{
+  const unsigned long blockSize = 256;
+  double              components[6][blockSize];
+  double              values[3][blockSize];
+
+  for( unsigned long begin = 0; begin < numberOfTensors; begin += blockSize )
+    {
+    const unsigned long count = std::min( blockSize, numberOfTensors - begin );
+    const TValue *      block = tensors + 6 * begin;
+    for( unsigned long k = 0; k < count; k++ )
+      {
+      for( unsigned int c = 0; c < 6; c++ )
+        {
+        components[c][k] = block[6 * k + c];
+        }
+      }
+    for( unsigned long k = 0; k < count; k++ )
+      {
+      SymmetricEigenValues3x3( components[0][k], components[1][k], components[2][k], components[3][k],
+                               components[4][k], components[5][k], values[0][k], values[1][k], values[2][k] );
+      }
+    TEigenValue *output = evals + 3 * begin;
+    for( unsigned long k = 0; k < count; k++ )
+      {
+      for( unsigned int i = 0; i < 3; i++ )
+        {
+        output[3 * k + i] = static_cast<TEigenValue>( values[i][k] );
+        }
+      }
+    }
+}
+
+template <class TensorType>
+void TensorEigenValues( const TensorType & dtv, double evals[3] )
+{
+  SymmetricEigenValues3x3( dtv[0], dtv[1], dtv[2], dtv[3], dtv[4], dtv[5], evals[0], evals[1], evals[2] );
+}
+
+template <class TensorType>
+void TensorEigenSystem( const TensorType & dtv, double evals[3], double evecs[3][3] )
+{
+  const double t[6] = { dtv[0], dtv[1], dtv[2], dtv[3], dtv[4], dtv[5] };
+
+  SymmetricEigenSystem3x3( t, evals, evecs );
+}
+
 template <class TensorType, class MatrixType>
 void EigenAnalysis(TensorType dtv,  MatrixType & evals, MatrixType & evecs)
 {
-  MatrixType dtm = Vector2Matrix<TensorType, MatrixType>(dtv);
+  double values[3];
+  double vectors[3][3];
+
+  TensorEigenSystem<TensorType>( dtv, values, vectors );
+  evals.SetSize( 3, 3 );
+  evecs.SetSize( 3, 3 );
+  evals.Fill( 0.0 );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    evals(i, i) = values[i];
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      evecs(i, j) = vectors[i][j];
+      }
+    }
+}
+
+/** The tensor reoriented by the preservation of principal direction under
+ * the linear map inverseJacobian (3x3, accessed as m(i, j)): the principal
+ * eigenvector follows the map, the second one the part of its image that
+ * is perpendicular to the first. */
+template <class TensorType, class MatrixType>
+TensorType PreservationOfPrincipalDirectionReorientation( const TensorType & tensor,
+                                                          const MatrixType & inverseJacobian )
+{
+  double evals[3];
+  double evecs[3][3];
 
-  itk::DecomposeTensorFunction2<MatrixType, typename MatrixType::ValueType, MatrixType> decomposer;
+  TensorEigenSystem<TensorType>( tensor, evals, evecs );
+
+  double ev1r[3];
+  double ev2a[3];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev1r[i] = 0.0;
+    ev2a[i] = 0.0;
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      ev1r[i] += inverseJacobian(i, j) * evecs[j][2];
+      ev2a[i] += inverseJacobian(i, j) * evecs[j][1];
+      }
+    }
+  double norm = std::sqrt( ev1r[0] * ev1r[0] + ev1r[1] * ev1r[1] + ev1r[2] * ev1r[2] );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev1r[i] /= norm;
+    }
+
+  double projection = ev2a[0] * ev1r[0] + ev2a[1] * ev1r[1] + ev2a[2] * ev1r[2];
+  double ev2r[3];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev2r[i] = ev2a[i] - projection * ev1r[i];
+    }
+  norm = std::sqrt( ev2r[0] * ev2r[0] + ev2r[1] * ev2r[1] + ev2r[2] * ev2r[2] );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev2r[i] /= norm;
+    }
 
-  decomposer.EvaluateSymmetricEigenDecomposition( dtm, evals, evecs );
+  double ev3r[3];
+  ev3r[0] = ev1r[1] * ev2r[2] - ev1r[2] * ev2r[1];
+  ev3r[1] = ev1r[2] * ev2r[0] - ev1r[0] * ev2r[2];
+  ev3r[2] = ev1r[0] * ev2r[1] - ev1r[1] * ev2r[0];
+
+  TensorType   outTensor;
+  unsigned int k = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = i; j < 3; j++ )
+      {
+      outTensor[k++] = evals[2] * ev1r[i] * ev1r[j] + evals[1] * ev2r[i] * ev2r[j] + evals[0] * ev3r[i] * ev3r[j];
+      }
+    }
+  return outTensor;
+}
+
+/** The tensor rotated by the rotation part R = ( F F^T )^{-1/2} F of the
+ * linear map F = inverseJacobian (finite strain reorientation).  The tensor
+ * is returned as is when F is singular. */
+template <class TensorType, class MatrixType>
+TensorType FiniteStrainReorientation( const TensorType & tensor, const MatrixType & inverseJacobian )
+{
+  double f[3][3];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      f[i][j] = inverseJacobian(i, j);
+      }
+    }
+
+  // F F^T = V diag( evals ) V^T
+  double       fft[6];
+  unsigned int k = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = i; j < 3; j++ )
+      {
+      fft[k++] = f[i][0] * f[j][0] + f[i][1] * f[j][1] + f[i][2] * f[j][2];
+      }
+    }
+  double evals[3];
+  double evecs[3][3];
+  SymmetricEigenSystem3x3( fft, evals, evecs );
+  if( !( evals[0] > 0.0 ) )
+    {
+    return tensor;
+    }
+
+  double r[3][3];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      // ( F F^T )^{-1/2} F
+      r[i][j] = 0.0;
+      for( unsigned int l = 0; l < 3; l++ )
+        {
+        double sqrtInverse = 0.0;
+        for( unsigned int e = 0; e < 3; e++ )
+          {
+          sqrtInverse += evecs[i][e] * evecs[l][e] / std::sqrt( evals[e] );
+          }
+        r[i][j] += sqrtInverse * f[l][j];
+        }
+      }
+    }
+
+  const double d[3][3] = { { tensor[0], tensor[1], tensor[2] },
+                           { tensor[1], tensor[3], tensor[4] },
+                           { tensor[2], tensor[4], tensor[5] } };
+  TensorType outTensor;
+  k = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = i; j < 3; j++ )
+      {
+      double value = 0.0;
+      for( unsigned int a = 0; a < 3; a++ )
+        {
+        for( unsigned int b = 0; b < 3; b++ )
+          {
+          value += r[i][a] * d[a][b] * r[j][b];
+          }
+        }
+      outTensor[k++] = value;
+      }
+    }
+  return outTensor;
+}
+
+/** The inverse of the physical space Jacobian of a displacement field at a
+ * voxel, from the output gradient of DeformationFieldGradientTensorImageFilter
+ * with CalculateJacobian on.  That is R ( I + G ) R^T, G(i, j) the
+ * derivative of the j-th component along the i-th image axis and R the
+ * direction of the field, so that the Jacobian is I + R^T ( gradient^T - I ).
+ * Two dimensional Jacobians are embedded with a unit third axis; the result
+ * is the identity where the Jacobian is not finite or singular. */
+template <class TValue, unsigned int VDimension>
+itk::Matrix<double, 3, 3> InverseJacobianFromGradientTensor(
+  const itk::Matrix<TValue, VDimension, VDimension> & gradient,
+  const itk::Matrix<double, VDimension, VDimension> & direction )
+{
+  double a[3][3] = { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } };
+  bool   isFinite = true;
+
+  for( unsigned int i = 0; i < VDimension && i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < VDimension && j < 3; j++ )
+      {
+      for( unsigned int k = 0; k < VDimension; k++ )
+        {
+        a[i][j] += direction(k, i) * ( gradient(j, k) - ( ( j == k ) ? 1.0 : 0.0 ) );
+        }
+      isFinite = isFinite && vnl_math_isfinite( a[i][j] );
+      }
+    }
+
+  itk::Matrix<double, 3, 3> inverse;
+  inverse.SetIdentity();
+
+  const double determinant = a[0][0] * ( a[1][1] * a[2][2] - a[1][2] * a[2][1] )
+    - a[0][1] * ( a[1][0] * a[2][2] - a[1][2] * a[2][0] )
+    + a[0][2] * ( a[1][0] * a[2][1] - a[1][1] * a[2][0] );
+  if( !isFinite || determinant == 0.0 )
+    {
+    return inverse;
+    }
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      // the cofactor of a[j][i]
+      const unsigned int r0 = ( j + 1 ) % 3;
+      const unsigned int r1 = ( j + 2 ) % 3;
+      const unsigned int c0 = ( i + 1 ) % 3;
+      const unsigned int c1 = ( i + 2 ) % 3;
+      inverse(i, j) = ( a[r0][c0] * a[r1][c1] - a[r0][c1] * a[r1][c0] ) / determinant;
+      }
+    }
+  return inverse;
 }
 
 template <class TensorType, class VectorType>
@@ -207,16 +581,12 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
     success = false;
     return dtv;
     }
-  // typedef vnl_matrix<double>        MatrixType;
-  typedef itk::VariableSizeMatrix<typename TensorType::ValueType> MatrixType;
-
-  // MatrixType DT = Vector2Matrix<TensorType,MatrixType>(dtv);
-  MatrixType D;
-  MatrixType V;
-  EigenAnalysis<TensorType, MatrixType>(dtv, D, V);
-  double e1 = D(0, 0);
-  double e2 = D(1, 1);
-  double e3 = D(2, 2);
+  double evals[3];
+  double V[3][3];
+  TensorEigenSystem<TensorType>( dtv, evals, V );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   // float peigeps=1.e-12;
 
   if( fabs(e3) < eps )
@@ -226,8 +596,7 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
     // return dtv;
     }
 
-  MatrixType eigmat(3, 3);
-  eigmat.Fill(0);
+  double eigmat[3];
   if( takelog )
     {
     if( e1 < 0 )
@@ -238,30 +607,36 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
       {
       e3 = e2;
       }
-    eigmat(0, 0) = log(fabs(e1) );
-    eigmat(1, 1) = log(fabs(e2) );
-    eigmat(2, 2) = log(fabs(e3) );
+    eigmat[0] = log(fabs(e1) );
+    eigmat[1] = log(fabs(e2) );
+    eigmat[2] = log(fabs(e3) );
     }
   else // take exp
     {
-    eigmat(0, 0) = exp(e1);
-    eigmat(1, 1) = exp(e2);
-    eigmat(2, 2) = exp(e3);
+    eigmat[0] = exp(e1);
+    eigmat[1] = exp(e2);
+    eigmat[2] = exp(e3);
     }
 
-  if( vnl_math_isnan(eigmat(0, 0) ) ||
-      vnl_math_isnan(eigmat(1, 1) ) ||
-      vnl_math_isnan(eigmat(2, 2) ) )
+  if( vnl_math_isnan(eigmat[0] ) ||
+      vnl_math_isnan(eigmat[1] ) ||
+      vnl_math_isnan(eigmat[2] ) )
     {
     dtv.Fill(0);
     success = false;
     return dtv;
     }
 
-  typedef typename MatrixType::InternalMatrixType VnlMatrixType;
-  VnlMatrixType DTrec = V.GetVnlMatrix() * eigmat.GetVnlMatrix() * V.GetTranspose();
-  TensorType    dtv2 = Matrix2Vector<TensorType, VnlMatrixType>(DTrec);
-
+  // V diag( eigmat ) V^T, upper triangle
+  TensorType   dtv2;
+  unsigned int k = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = i; j < 3; j++ )
+      {
+      dtv2[k++] = V[i][0] * eigmat[0] * V[j][0] + V[i][1] * eigmat[1] * V[j][1] + V[i][2] * eigmat[2] * V[j][2];
+      }
+    }
   return dtv2;
 }
 
@@ -292,30 +667,13 @@ bool IsRealTensor( TensorType dtv )
   return isreal;
 }
 
-template <class TensorType>
-float  GetTensorFA( TensorType dtv )
+/** The FA of the increasing eigenvalues evals, negative extreme eigenvalues
+ * replaced by the middle one. */
+inline float GetFAFromEigenValues( const double evals[3] )
 {
-
-  // Check for zero diffusion (probably background) and return zero FA 
-  // if that's the case
-  if (dtv[0] + dtv[3] + dtv[5] == 0.0f) 
-    {
-      return 0.0f;
-    }
-
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -332,22 +690,30 @@ float  GetTensorFA( TensorType dtv )
   return fa;
 }
 
+template <class TensorType>
+float  GetTensorFA( TensorType dtv )
+{
+
+  // Check for zero diffusion (probably background) and return zero FA 
+  // if that's the case
+  if (dtv[0] + dtv[3] + dtv[5] == 0.0f) 
+    {
+      return 0.0f;
+    }
+
+  double evals[3];
+  TensorEigenValues<TensorType>( dtv, evals );
+  return GetFAFromEigenValues( evals );
+}
+
 template <class TensorType>
 float  GetTensorFANumerator( TensorType dtv )
 {
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  TensorEigenValues<TensorType>( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -365,19 +731,11 @@ float  GetTensorFANumerator( TensorType dtv )
 template <class TensorType>
 float  GetTensorFADenominator( TensorType dtv )
 {
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  TensorEigenValues<TensorType>( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -442,15 +800,12 @@ TVectorType ChangeTensorByVector(  TVectorType dpath,  TTensorType dtv, float ep
   DT(1, 0) = DT(0, 1) = dtv[1];
   DT(2, 0) = DT(0, 2) = dtv[2];
   DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e3 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e1 = (eig.D(2, 2) );
-  double                            etot = e1 + e2 + e3;
-  if( etot == 0 )
-    {
-    etot = 1;
-    }
+  double evals[3];
+  double evecs[3][3];
+  TensorEigenSystem<TTensorType>( dtv, evals, evecs );
+  double e3 = evals[0];
+  double e2 = evals[1];
+  double e1 = evals[2];
 
   MatrixType vec(3, 1);
   vec(0, 0) = dpath[0];
@@ -458,17 +813,17 @@ TVectorType ChangeTensorByVector(  TVectorType dpath,  TTensorType dtv, float ep
   vec(2, 0) = dpath[2];
 
   MatrixType evec1(3, 1); // biggest
-  evec1(0, 0) = eig.V(0, 2);
-  evec1(1, 0) = eig.V(1, 2);
-  evec1(2, 0) = eig.V(2, 2);
+  evec1(0, 0) = evecs[0][2];
+  evec1(1, 0) = evecs[1][2];
+  evec1(2, 0) = evecs[2][2];
   MatrixType evec2(3, 1); // middle
-  evec2(0, 0) = eig.V(0, 1);
-  evec2(1, 0) = eig.V(1, 1);
-  evec2(2, 0) = eig.V(2, 1);
+  evec2(0, 0) = evecs[0][1];
+  evec2(1, 0) = evecs[1][1];
+  evec2(2, 0) = evecs[2][1];
   MatrixType evec3(3, 1); // smallest
-  evec3(0, 0) = eig.V(0, 0);
-  evec3(1, 0) = eig.V(1, 0);
-  evec3(2, 0) = eig.V(2, 0);
+  evec3(0, 0) = evecs[0][0];
+  evec3(1, 0) = evecs[1][0];
+  evec3(2, 0) = evecs[2][0];
 
   float temp;
   temp = (vec.transpose() * evec1)(0, 0);
@@ -536,22 +891,11 @@ float  GetTensorADC( TTensorType dtv,  unsigned int opt = 0)
     return 0;
     }
 
-  itk::Vector<float, 6> dtv2;
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  //  if (takelog )std::cout << " TAKING LOG " << std::endl;  elsestd::cout << "TAKING EXP " << std::endl;
-  // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  TensorEigenValues<TTensorType>( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
 
   /*
   opt  return
@@ -618,16 +962,18 @@ itk::RGBPixel<unsigned char>   GetTensorRGB( TTensorType dtv )
     return zero;
     }
 
-  typedef itk::VariableSizeMatrix<typename TTensorType::ValueType> EigenMatrixType;
-  EigenMatrixType evals(3, 3);
-  EigenMatrixType evecs(3, 3);
-
-  EigenAnalysis<TensorType, EigenMatrixType>(dtv, evals, evecs);
-  float fa = GetTensorFA<TensorType>(dtv);
+  double evals[3];
+  double evecs[3][3];
+  TensorEigenSystem<TensorType>( dtv, evals, evecs );
+  float fa = 0.0f;
+  if( dtv[0] + dtv[3] + dtv[5] != 0.0f )
+    {
+    fa = GetFAFromEigenValues( evals );
+    }
 
-  rgb[0] = (unsigned char)(std::fabs(evecs(0, 2) ) * fa * 255);
-  rgb[1] = (unsigned char)(std::fabs(evecs(1, 2) ) * fa * 255);
-  rgb[2] = (unsigned char)(std::fabs(evecs(2, 2) ) * fa * 255);
+  rgb[0] = (unsigned char)(std::fabs(evecs[0][2]) * fa * 255);
+  rgb[1] = (unsigned char)(std::fabs(evecs[1][2]) * fa * 255);
+  rgb[2] = (unsigned char)(std::fabs(evecs[2][2]) * fa * 255);
 
   return rgb;
 }
@@ -659,19 +1005,9 @@ itk::RGBPixel<float>   GetTensorPrincipalEigenvector( TTensorType dtv )
     return zero;
     }
 
-  itk::Vector<float, 6> dtv2;
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  //  if (takelog )std::cout << " TAKING LOG " << std::endl;  elsestd::cout << "TAKING EXP " << std::endl;
-  // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
+  double evals[3];
+  double evecs[3][3];
+  TensorEigenSystem<TTensorType>( dtv, evals, evecs );
 
   itk::RGBPixel<float> rgb;
 
@@ -693,14 +1029,10 @@ itk::RGBPixel<float>   GetTensorPrincipalEigenvector( TTensorType dtv )
     fa = ( std::sqrt(anisotropy / ( 2.0 * isp ) ) );
     }
 
-  // rgb[0]=eig.V(2,0)*fa*255;//+eig.V(1,0)*e2;
-  // rgb[1]=eig.V(2,1)*fa*255;//+eig.V(1,1)*e2;
-  //  rgb[2]=eig.V(2,2)*fa*255;//+eig.V(1,2)*e2;
-
   // biggest evec
-  rgb[0] = eig.V(0, 2); // +eig.V(1,0)*e2;
-  rgb[1] = eig.V(1, 2); // +eig.V(1,1)*e2;
-  rgb[2] = eig.V(2, 2); // +eig.V(1,2)*e2;
+  rgb[0] = evecs[0][2];
+  rgb[1] = evecs[1][2];
+  rgb[2] = evecs[2][2];
 
   return rgb;
   mag = rgb[0] * rgb[0] + rgb[1] * rgb[1] + rgb[2] * rgb[2];
@@ -740,19 +1072,9 @@ itk::Vector<float>   GetTensorPrincipalEigenvector( TTensorType dtv, unsigned in
     return zero;
     }
 
-  itk::Vector<float, 6> dtv2;
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  //  if (takelog )std::cout << " TAKING LOG " << std::endl;  else std::cout << "TAKING EXP " << std::endl;
-  // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
+  double evals[3];
+  double evecs[3][3];
+  TensorEigenSystem<TTensorType>( dtv, evals, evecs );
 
   itk::Vector<float, 3> rgb;
 
@@ -771,9 +1093,9 @@ itk::Vector<float>   GetTensorPrincipalEigenvector( TTensorType dtv, unsigned in
     trace += dtv[5];
     }
 
-  rgb[0] = eig.V(0, whichvec); // +eig.V(1,0)*e2;
-  rgb[1] = eig.V(1, whichvec); // +eig.V(1,1)*e2;
-  rgb[2] = eig.V(2, whichvec); // +eig.V(1,2)*e2;
+  rgb[0] = evecs[0][whichvec];
+  rgb[1] = evecs[1][whichvec];
+  rgb[2] = evecs[2][whichvec];
 
   return rgb;
 }
@@ -781,19 +1103,11 @@ itk::Vector<float>   GetTensorPrincipalEigenvector( TTensorType dtv, unsigned in
 template <class TTensorType>
 static float GetMetricTensorCost(  itk::Vector<float, 3> dpath,  TTensorType dtv )
 {
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  TensorEigenValues<TensorType>( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   double                            etot = e1 + e2 + e3;
   if( etot == 0 )
     {
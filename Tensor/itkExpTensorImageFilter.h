@@ -107,7 +107,8 @@ protected:
    *
    * \sa ImageToImageFilter::ThreadedGenerateData(),
    *     ImageToImageFilter::GenerateData() */
-  void GenerateData() ITK_OVERRIDE;
+  void ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                             ThreadIdType threadId ) ITK_OVERRIDE;
 
 private:
   ExpTensorImageFilter(const Self &); // purposely not implemented
@@ -37,19 +37,17 @@ ExpTensorImageFilter<TInputImage, TOutputImage>
 template <class TInputImage, class TOutputImage>
 void
 ExpTensorImageFilter<TInputImage, TOutputImage>
-::GenerateData()
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                        ThreadIdType itkNotUsed( threadId ) )
 {
   InputImagePointer  input = this->GetInput();
   OutputImagePointer output = this->GetOutput();
 
-  ImageRegionConstIterator<InputImageType> inputIt( input, input->GetLargestPossibleRegion() );
-
-  output->SetRegions( input->GetLargestPossibleRegion() );
-  output->Allocate();
-
-  ImageRegionIterator<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
+  ImageRegionConstIterator<InputImageType> inputIt( input, outputRegionForThread );
+  ImageRegionIterator<OutputImageType> outputIt( output, outputRegionForThread );
   for( inputIt.GoToBegin(), outputIt.GoToBegin();
-       !inputIt.IsAtEnd() && !outputIt.IsAtEnd(); ++inputIt, ++outputIt )
+       !inputIt.IsAtEnd() && !outputIt.IsAtEnd();
+       ++inputIt, ++outputIt )
     {
     bool           success; // TODO -- actually check the result?
     InputPixelType result = TensorLogAndExp<InputPixelType>(inputIt.Value(), false, success);
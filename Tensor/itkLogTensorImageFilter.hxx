@@ -37,17 +37,14 @@ LogTensorImageFilter<TInputImage, TOutputImage>
 template <class TInputImage, class TOutputImage>
 void
 LogTensorImageFilter<TInputImage, TOutputImage>
-::GenerateData()
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                        ThreadIdType itkNotUsed( threadId ) )
 {
   InputImagePointer  input = this->GetInput();
   OutputImagePointer output = this->GetOutput();
 
-  ImageRegionConstIterator<InputImageType> inputIt( input, input->GetLargestPossibleRegion() );
-
-  output->SetRegions( input->GetLargestPossibleRegion() );
-  output->Allocate();
-
-  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
+  ImageRegionConstIterator<InputImageType> inputIt( input, outputRegionForThread );
+  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, outputRegionForThread );
   for( inputIt.GoToBegin(), outputIt.GoToBegin();
        !inputIt.IsAtEnd() && !outputIt.IsAtEnd();
        ++inputIt, ++outputIt )
@@ -18,6 +18,7 @@
 #include "itkNeighborhoodInnerProduct.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 #include "itkNeighborhoodAlgorithm.h"
 #include "itkOffset.h"
 #include "itkProgressReporter.h"
@@ -31,6 +32,7 @@
 #include "itkVariableSizeMatrix.h"
 #include "itkDecomposeTensorFunction.h"
 #include "itkSymmetricSecondRankTensor.h"
+#include "TensorFunctions.h"
 
 #include <vnl/vnl_cross.h>
 #include <vnl/vnl_inverse.h>
@@ -47,7 +49,7 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
   m_DisplacementField = ITK_NULLPTR;
   m_DirectionTransform = ITK_NULLPTR;
   m_AffineTransform = ITK_NULLPTR;
-  m_InverseAffineTransform = ITK_NULLPTR;
+  m_InverseAffineMatrix.SetIdentity();
   m_UseAffine = false;
   m_UseImageDirection = true;
 }
@@ -69,267 +71,79 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
 }
 
 template <typename TTensorImage, typename TVectorImage>
-typename PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>::TensorType
-PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
-::ApplyReorientation(InverseTransformPointer deformation, TensorType tensor )
-{
-  VnlMatrixType DT(3, 3);
-
-  DT.fill(0);
-  DT(0, 0) = tensor[0];
-  DT(1, 1) = tensor[3];
-  DT(2, 2) = tensor[5];
-  DT(1, 0) = DT(0, 1) = tensor[1];
-  DT(2, 0) = DT(0, 2) = tensor[2];
-  DT(2, 1) = DT(1, 2) = tensor[4];
-
-  vnl_symmetric_eigensystem<RealType> eig(DT);
-  TensorType                          outTensor;
-
-  TransformInputVectorType ev1;
-  TransformInputVectorType ev2;
-  TransformInputVectorType ev3;
-  for( unsigned int i = 0; i < 3; i++ )
-    {
-    ev1[i] = eig.get_eigenvector(2)[i];
-    ev2[i] = eig.get_eigenvector(1)[i];
-    ev3[i] = eig.get_eigenvector(0)[i];
-    }
-
-  TransformOutputVectorType ev1r = deformation->TransformVector( ev1 );
-  ev1r.Normalize();
-
-  // Get aspect of rotated e2 that is perpendicular to rotated e1
-  TransformOutputVectorType ev2a = deformation->TransformVector( ev2 );
-  if( (ev2a * ev1r) < 0 )
-    {
-    ev2a = ev2a * (-1.0);
-    }
-  TransformOutputVectorType ev2r = ev2a - (ev2a * ev1r) * ev1r;
-  ev2r.Normalize();
-
-  TransformOutputVectorType ev3r = CrossProduct( ev1r, ev2r );
-  ev3r.Normalize();
-
-  VnlVectorType e1(3);
-  VnlVectorType e2(3);
-  VnlVectorType e3(3);
-  for( unsigned int i = 0; i < 3; i++ )
-    {
-    e1[i] = ev1r[i];
-    e2[i] = ev2r[i];
-    e3[i] = ev3r[i];
-    }
-
-  VnlMatrixType DTrotated = eig.get_eigenvalue(2) * outer_product(e1, e1)
-    + eig.get_eigenvalue(1) * outer_product(e2, e2) + eig.get_eigenvalue(0) * outer_product(e3, e3);
-
-  outTensor[0] = DTrotated(0, 0);
-  outTensor[1] = DTrotated(0, 1);
-  outTensor[2] = DTrotated(0, 2);
-  outTensor[3] = DTrotated(1, 1);
-  outTensor[4] = DTrotated(1, 2);
-  outTensor[5] = DTrotated(2, 2);
-
-  return outTensor;
-}
-
-template <typename TTensorImage, typename TVectorImage>
-typename PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage,
-                                                                        TVectorImage>::AffineTransformPointer
+void
 PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
-::GetLocalDeformation(DisplacementFieldPointer field, typename DisplacementFieldType::IndexType index)
+::BeforeThreadedGenerateData()
 {
-  AffineTransformPointer affineTransform = AffineTransformType::New();
-
-  affineTransform->SetIdentity();
-
-  typename AffineTransformType::MatrixType jMatrix;
-  jMatrix.Fill(0.0);
-
-  typename DisplacementFieldType::SizeType size = field->GetLargestPossibleRegion().GetSize();
-  typename DisplacementFieldType::SpacingType spacing = field->GetSpacing();
+  InputImagePointer input = this->GetInput();
 
-  typename DisplacementFieldType::IndexType ddrindex;
-  typename DisplacementFieldType::IndexType ddlindex;
-
-  typename DisplacementFieldType::IndexType difIndex[ImageDimension][2];
+  this->m_DirectionTransform = AffineTransformType::New();
+  this->m_DirectionTransform->SetIdentity();
 
-  unsigned int posoff = 1;
-  RealType     space = 1.0;
-  RealType     mindist = 1.0;
-  RealType     dist = 100.0;
-  bool         oktosample = true;
-  for( unsigned int row = 0; row < ImageDimension; row++ )
+  if( this->m_UseAffine )
     {
-    dist = fabs( (RealType)index[row]);
-    if( dist < mindist )
-      {
-      oktosample = false;
-      }
-    dist = fabs( (RealType)size[row] - (RealType)index[row]);
-    if( dist < mindist )
+    this->m_DirectionTransform->SetMatrix( input->GetDirection() );
+    if( this->m_UseImageDirection )
       {
-      oktosample = false;
+      this->DirectionCorrectTransform( this->m_AffineTransform, this->m_DirectionTransform );
       }
-    }
-
-  if( oktosample )
-    {
-    typename DisplacementFieldType::PixelType cpix = m_DisplacementField->GetPixel(index);
-    cpix = this->TransformVectorByDirection(cpix);
-    // itkCentralDifferenceImageFunction does not support vector images so do this manually here
-    for( unsigned int row = 0; row < ImageDimension; row++ )
+    const typename AffineTransformType::InverseMatrixType & inverse = this->m_AffineTransform->GetInverseMatrix();
+    for( unsigned int i = 0; i < 3; i++ )
       {
-      difIndex[row][0] = index;
-      difIndex[row][1] = index;
-      ddrindex = index;
-      ddlindex = index;
-      if( (int) index[row] < (int)(size[row] - 2) )
+      for( unsigned int j = 0; j < 3; j++ )
         {
-        difIndex[row][0][row] = index[row] + posoff;
-        ddrindex[row] = index[row] + posoff * 2;
-        }
-      if( index[row] > 1 )
-        {
-        difIndex[row][1][row] = index[row] - 1;
-        ddlindex[row] = index[row] - 2;
-        }
-
-      RealType h = 1;
-      space = 1.0; // should use image spacing here?
-
-      typename DisplacementFieldType::PixelType rpix = m_DisplacementField->GetPixel( difIndex[row][1] );
-      typename DisplacementFieldType::PixelType lpix = m_DisplacementField->GetPixel( difIndex[row][0] );
-      typename DisplacementFieldType::PixelType rrpix = m_DisplacementField->GetPixel( ddrindex );
-      typename DisplacementFieldType::PixelType llpix = m_DisplacementField->GetPixel( ddlindex );
-
-      if( this->m_UseImageDirection )
-        {
-        rpix = this->TransformVectorByDirection(rpix);
-        lpix = this->TransformVectorByDirection(lpix);
-        rrpix = this->TransformVectorByDirection(rrpix);
-        llpix = this->TransformVectorByDirection(llpix);
-        }
-
-      rpix = rpix * h + cpix * (1. - h);
-      lpix = lpix * h + cpix * (1. - h);
-      rrpix = rrpix * h + rpix * (1. - h);
-      llpix = llpix * h + lpix * (1. - h);
-
-      typename DisplacementFieldType::PixelType dPix
-        = ( lpix * 8.0 + llpix - rrpix - rpix * 8.0 ) * space / (12.0); // 4th order centered difference
-      // typename DisplacementFieldType::PixelType dPix=( lpix - rpix )*space/(2.0*h); //4th order centered difference
-      for( unsigned int col = 0; col < ImageDimension; col++ )
-        {
-        RealType val = dPix[col] / spacing[col];
-
-        if( row == col )
-          {
-          val += 1.0;
-          }
-
-        jMatrix(col, row) = val;
+        this->m_InverseAffineMatrix(i, j) = inverse(i, j);
         }
       }
+    this->m_JacobianImage = ITK_NULLPTR;
     }
-  for( unsigned int jx = 0; jx < ImageDimension; jx++ )
+  else
     {
-    for( unsigned int jy = 0; jy < ImageDimension; jy++ )
+    // Retain input image space as that should be handled in antsApplyTransforms
+    if( this->m_DisplacementField.IsNull() )
       {
-      if( !vnl_math_isfinite(jMatrix(jx, jy) )  )
-        {
-        oktosample = false;
-        }
+      itkExceptionMacro( "Neither an affine transform nor a displacement field is set." );
       }
-    }
-
-  if( !oktosample )
-    {
-    jMatrix.Fill(0.0);
-    for( unsigned int i = 0; i < ImageDimension; i++ )
+    if( this->m_DisplacementField->GetLargestPossibleRegion() != input->GetLargestPossibleRegion() )
       {
-      jMatrix(i, i) = 1.0;
+      itkExceptionMacro( "The displacement field is not on the grid of the tensor image." );
       }
-    }
-
-  affineTransform->SetMatrix( jMatrix );
-  // this->DirectionCorrectTransform( affineTransform, this->m_DirectionTransform );
+    this->m_DirectionTransform->SetMatrix( m_DisplacementField->GetDirection() );
 
-  return affineTransform;
+    typename JacobianFilterType::Pointer jacobianFilter = JacobianFilterType::New();
+    jacobianFilter->SetInput( this->m_DisplacementField );
+    jacobianFilter->SetCalculateJacobian( true );
+    jacobianFilter->SetUseImageSpacing( true );
+    jacobianFilter->SetOrder( 2 );
+    jacobianFilter->SetUseCenteredDifference( true );
+    jacobianFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
+    jacobianFilter->Update();
+    this->m_JacobianImage = jacobianFilter->GetOutput();
+    this->m_JacobianImage->DisconnectPipeline();
+    }
 }
 
 template <typename TTensorImage, typename TVectorImage>
 void
 PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
-::GenerateData()
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread, ThreadIdType itkNotUsed( threadId ) )
 {
-  // get input and output images
-  // FIXME - use buffered region, etc
   InputImagePointer  input = this->GetInput();
   OutputImagePointer output = this->GetOutput();
 
-  this->m_DirectionTransform = AffineTransformType::New();
-  this->m_DirectionTransform->SetIdentity();
-  AffineTransformPointer directionTranspose = AffineTransformType::New();
-  directionTranspose->SetIdentity();
-
-  if( this->m_UseAffine )
+  ImageRegionConstIterator<InputImageType> inputIt( input, outputRegionForThread );
+  ImageRegionIterator<OutputImageType>     outputIt( output, outputRegionForThread );
+  ImageRegionConstIterator<JacobianImageType> jacobianIt;
+  if( !this->m_UseAffine )
     {
-    this->m_DirectionTransform->SetMatrix( input->GetDirection() );
-    if( this->m_UseImageDirection )
-      {
-      this->DirectionCorrectTransform( this->m_AffineTransform, this->m_DirectionTransform );
-      }
-    this->m_InverseAffineTransform = this->m_AffineTransform->GetInverseTransform();
-
-    output->SetRegions( input->GetLargestPossibleRegion() );
-    output->SetSpacing( input->GetSpacing() );
-    output->SetOrigin( input->GetOrigin() );
-    output->SetDirection( input->GetDirection() );
-    output->Allocate();
-    }
-  else
-    {
-    // Retain input image space as that should be handled in antsApplyTransforms
-
-    this->m_DirectionTransform->SetMatrix( m_DisplacementField->GetDirection() );
-
-    output->SetRegions( input->GetLargestPossibleRegion() );
-    output->SetSpacing( input->GetSpacing() );
-    output->SetOrigin( input->GetOrigin() );
-    output->SetDirection( input->GetDirection() );
-    output->Allocate();
-
-    this->m_DisplacementTransform = DisplacementFieldTransformType::New();
-    this->m_DisplacementTransform->SetDisplacementField( m_DisplacementField );
+    jacobianIt = ImageRegionConstIterator<JacobianImageType>( this->m_JacobianImage, outputRegionForThread );
     }
 
-  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
-
-  VariableMatrixType jMatrixAvg;
-  jMatrixAvg.SetSize(ImageDimension, ImageDimension);
-  jMatrixAvg.Fill(0.0);
-
-  std::cout << "Iterating over image" << std::endl;
   // for all voxels
-  for( outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt )
+  for( ; !outputIt.IsAtEnd(); ++inputIt, ++outputIt )
     {
-    InverseTransformPointer localDeformation;
-
-    // FIXME - eventually this will be callable via a generic transform base class
-    if( this->m_UseAffine )
-      {
-      localDeformation = this->m_InverseAffineTransform;
-      }
-    else
-      {
-      AffineTransformPointer deformation = this->GetLocalDeformation( this->m_DisplacementField, outputIt.GetIndex() );
-      localDeformation = deformation->GetInverseTransform();
-      }
-
-    TensorType inTensor = input->GetPixel(outputIt.GetIndex() );
-    TensorType outTensor;
+    const TensorType & inTensor = inputIt.Get();
+    TensorType         outTensor;
 
     // valid values?
     bool hasNans = false;
@@ -352,30 +166,14 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
       {
       outTensor = inTensor;
       }
+    else if( this->m_UseAffine )
+      {
+      outTensor = PreservationOfPrincipalDirectionReorientation( inTensor, this->m_InverseAffineMatrix );
+      }
     else
       {
-      // outTensor = inTensor;
-      // InverseTransformPointer localDeformation;
-      if( this->m_UseAffine )
-        {
-        outTensor = this->m_AffineTransform->TransformDiffusionTensor3D( inTensor );
-        // localDeformation = this->m_InverseAffineTransform;
-        }
-      else
-        {
-        typename DisplacementFieldType::PointType pt;
-        this->m_DisplacementField->TransformIndexToPhysicalPoint( outputIt.GetIndex(), pt );
-        outTensor = this->m_DisplacementTransform->TransformDiffusionTensor3D( inTensor, pt );
-        // AffineTransformPointer deformation = this->GetLocalDeformation( this->m_DeformationField, outputIt.GetIndex()
-        // );
-        // localDeformation = deformation->GetInverseTransform();
-        }
-
-      /*
-     std::cout << "apply";
-      outTensor = this->ApplyReorientation( localDeformation, inTensor );
-     std::cout << " ok" << std::endl;
-      */
+      outTensor = PreservationOfPrincipalDirectionReorientation( inTensor,
+        InverseJacobianFromGradientTensor( jacobianIt.Get(), this->m_DisplacementField->GetDirection() ) );
       }
     // valid values?
     for( unsigned int jj = 0; jj < 6; jj++ )
@@ -387,6 +185,10 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
       }
 
     outputIt.Set( outTensor );
+    if( !this->m_UseAffine )
+      {
+      ++jacobianIt;
+      }
     }
 }
 
@@ -22,21 +22,18 @@
 #include "itkVector.h"
 #include "itkSymmetricSecondRankTensor.h"
 #include "itkDisplacementFieldTransform.h"
+#include "itkDeformationFieldGradientTensorImageFilter.h"
 
 namespace itk
 {
 /** \class PreservationOfPrincipalDirectionImageFilter
- * \brief Applies an averaging filter to an image
+ * \brief Reorients a tensor image by the preservation of principal direction
  *
- * Computes an image where a given pixel is the mean value of the
- * the pixels in a neighborhood about the corresponding input pixel.
- *
- * A mean filter is one of the family of linear filters.
- *
- * \sa Image
- * \sa Neighborhood
- * \sa NeighborhoodOperator
- * \sa NeighborhoodIterator
+ * Each tensor is rotated so that its principal eigenvector follows the
+ * inverse of the local Jacobian of the transform: the Jacobian of the
+ * displacement field, computed once for the whole field by
+ * DeformationFieldGradientTensorImageFilter, or the matrix of the affine
+ * transform.  The displacement field has to be on the grid of the input.
  *
  * \ingroup IntensityImageFilters
  */
@@ -57,6 +54,9 @@ public:
 
   typedef typename DisplacementFieldTransformType::Pointer DisplacementFieldTransformPointer;
 
+  typedef DeformationFieldGradientTensorImageFilter<DisplacementFieldType, RealType> JacobianFilterType;
+  typedef typename JacobianFilterType::OutputImageType                               JacobianImageType;
+
   typedef Matrix<RealType, 3, 3> MatrixType;
   // typedef Vector<RealType, 3> VectorType;
   typedef VariableSizeMatrix<RealType> VariableMatrixType;
@@ -137,17 +137,15 @@ protected:
 
   void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
 
-  /** PreservationOfPrincipalDirectionTensorReorientationImageFilter can be implemented as a multithreaded filter.
-   * Therefore, this implementation provides a ThreadedGenerateData()
-   * routine which is called for each processing thread. The output
-   * image data is allocated automatically by the superclass prior to
-   * calling ThreadedGenerateData().  ThreadedGenerateData can only
-   * write to the portion of the output image specified by the
-   * parameter "outputRegionForThread"
-   *
-   * \sa ImageToImageFilter::ThreadedGenerateData(),
-   *     ImageToImageFilter::GenerateData() */
-  void GenerateData() ITK_OVERRIDE;
+  /** Set up the direction corrected affine transform, or compute the
+   * Jacobian of the displacement field. */
+  void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  /** PreservationOfPrincipalDirectionTensorReorientationImageFilter is
+   * implemented as a multithreaded filter: each tensor only depends on the
+   * Jacobian at its voxel. */
+  void ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                             ThreadIdType threadId ) ITK_OVERRIDE;
 
   typename DisplacementFieldType::PixelType TransformVectorByDirection( typename DisplacementFieldType::PixelType cpix )
   {
@@ -172,21 +170,18 @@ private:
   PreservationOfPrincipalDirectionTensorReorientationImageFilter(const Self &); // purposely not implemented
   void operator=(const Self &);                                                 // purposely not implemented
 
-  AffineTransformPointer GetLocalDeformation(DisplacementFieldPointer, typename DisplacementFieldType::IndexType );
-
-  TensorType ApplyReorientation(InverseTransformPointer, TensorType );
 
   void DirectionCorrectTransform( AffineTransformPointer, AffineTransformPointer );
 
   DisplacementFieldPointer m_DisplacementField;
 
-  DisplacementFieldTransformPointer m_DisplacementTransform;
+  typename JacobianImageType::Pointer m_JacobianImage;
 
   AffineTransformPointer m_DirectionTransform;
 
   AffineTransformPointer m_AffineTransform;
 
-  InverseTransformPointer m_InverseAffineTransform;
+  MatrixType m_InverseAffineMatrix;
 
   bool m_UseAffine;
 
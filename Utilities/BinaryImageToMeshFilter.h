@@ -14,41 +14,19 @@
 // #include "itkBinaryWellComposed3DImageFilter.h"
 #include "itkMinimumMaximumImageCalculator.h"
 #include "itkCommand.h"
+#include "antsMarchingCubesSurface.h"
 
 #include <vtkCellArray.h>
+#include <vtkPoints.h>
 #include <vtkPolyData.h>
-#include <vtkTriangleFilter.h>
-#include <vtkImageMarchingCubes.h>
-#include <vtkImageImport.h>
-#include <itkVTKImageExport.h>
 #include <vtkDecimatePro.h>
 #include <vtkPolyDataConnectivityFilter.h>
-#include <vtkStripper.h>
-#include <vtkCleanPolyData.h>
 #include <vtkSmoothPolyDataFilter.h>
-#include <vtkImageData.h>
 
 #include <iostream>
 
 using namespace std;
 
-template <class TImage>
-void ConnectITKToVTK(itk::VTKImageExport<TImage> *fltExport, vtkImageImport *fltImport)
-{
-  fltImport->SetUpdateInformationCallback( fltExport->GetUpdateInformationCallback() );
-  fltImport->SetPipelineModifiedCallback( fltExport->GetPipelineModifiedCallback() );
-  fltImport->SetWholeExtentCallback( fltExport->GetWholeExtentCallback() );
-  fltImport->SetSpacingCallback( fltExport->GetSpacingCallback() );
-  fltImport->SetOriginCallback( fltExport->GetOriginCallback() );
-  fltImport->SetScalarTypeCallback( fltExport->GetScalarTypeCallback() );
-  fltImport->SetNumberOfComponentsCallback( fltExport->GetNumberOfComponentsCallback() );
-  fltImport->SetPropagateUpdateExtentCallback( fltExport->GetPropagateUpdateExtentCallback() );
-  fltImport->SetUpdateDataCallback( fltExport->GetUpdateDataCallback() );
-  fltImport->SetDataExtentCallback( fltExport->GetDataExtentCallback() );
-  fltImport->SetBufferPointerCallback( fltExport->GetBufferPointerCallback() );
-  fltImport->SetCallbackUserData( fltExport->GetCallbackUserData() );
-}
-
 class UnaryFunctorBinaryToFloat
 {
 public:
@@ -95,7 +73,7 @@ public:
   /** Get the result mesh */
   vtkPolyData * GetMesh()
   {
-    return fltTriangle->GetOutput();
+    return m_Result;
   }
 
   /** Get the intermediate antialiased image */
@@ -206,54 +184,6 @@ protected:
     fltAlias->SetInput(imgPipeEnd);
     imgPipeEnd = fltAlias->GetOutput();
 
-    // Cast the image to VTK
-    fltExport = ExportFilter::New();
-    fltImport = vtkImageImport::New();
-    fltExport->SetInput(imgPipeEnd);
-    ConnectITKToVTK(fltExport.GetPointer(), fltImport);
-
-    // Compute marching cubes
-    vtkImageData *importPipeEnd = fltImport->GetOutput();
-    fltMarching = vtkImageMarchingCubes::New();
-    fltMarching->SetInputData(importPipeEnd);
-    fltMarching->ComputeScalarsOff();
-    fltMarching->ComputeGradientsOff();
-    fltMarching->SetNumberOfContours(1);
-    fltMarching->SetValue(0, 0.0f);
-    vtkPolyData *meshPipeEnd = fltMarching->GetOutput();
-
-    // Keep the largest connected component
-    fltConnect = vtkPolyDataConnectivityFilter::New();
-    fltConnect->SetInputData(meshPipeEnd);
-    fltConnect->SetExtractionModeToLargestRegion();
-    meshPipeEnd = fltMarching->GetOutput();
-
-    fltClean = vtkCleanPolyData::New();
-    bool doclean = false;
-    if ( doclean ) 
-      {
-      // Clean up the data
-      fltClean->SetInputData(meshPipeEnd);
-      meshPipeEnd = fltClean->GetOutput();
-      // Decimate the data
-      fltDecimate = vtkDecimatePro::New();
-      fltDecimate->SetInputData(meshPipeEnd);
-      fltDecimate->PreserveTopologyOn();
-      meshPipeEnd = fltDecimate->GetOutput();
-      }
-
-    // Smooth the data, keeping it on the contour
-    vtkSmartPointer<vtkSmoothPolyDataFilter> smoothFilter =
-      vtkSmartPointer<vtkSmoothPolyDataFilter>::New();
-    smoothFilter->SetInputData(meshPipeEnd);
-    smoothFilter->SetNumberOfIterations(5);
-    meshPipeEnd = smoothFilter->GetOutput();
-
-    // Compute triangle strips for faster display
-    fltTriangle = vtkTriangleFilter::New();
-    fltTriangle->SetInputData(meshPipeEnd);
-    meshPipeEnd = fltTriangle->GetOutput();
-
     // Set up progress
     typedef itk::MemberCommand<Self> CommandType;
     typename CommandType::Pointer cmd = CommandType::New();
@@ -271,18 +201,13 @@ protected:
 
     // Decimate - NO
     m_DecimateFactor = 0.0f;
+
+    // Smooth - NO
+    m_SmoothingIterations = 0;
   }
 
   ~BinaryImageToMeshFilter()
   {
-    // CLean up
-    fltMarching->Delete();
-    fltConnect->Delete();
-    fltImport->Delete();
-    fltTriangle->Delete();
-    fltClean->Delete();
-    fltDecimate->Delete();
-    fltSmoothMesh->Delete();
   }
 
   /** Generate Data */
@@ -353,59 +278,63 @@ protected:
       }
 
     // Run the filters
+    const FloatImageType *distanceImage = fltAlias->GetOutput();
     if( fltAlias->GetMaximumRMSError() > 0.0 )
       {
       cout << "   anti-aliasing the image " << endl;
       fltAlias->Update();
-      fltExport->SetInput(fltAlias->GetOutput() );
       }
     else
       {
-      fltExport->SetInput(fltAlias->GetInput() );
+      distanceImage = fltAlias->GetInput();
       }
     bool verbose = true;
-    if( verbose )
-      {
-      cout << endl << "   converting image to VTK" << endl;
-      }
-    fltImport->Update();
 
+    // The surface is extracted from the ITK buffer itself, placed as the
+    // VTK importer would place the voxels, i.e. without the direction.
     if( verbose )
       {
       cout << "   running marching cubes algorithm" << endl;
       }
-    fltMarching->Update();
+    MarchingCubesType marchingCubes;
+    marchingCubes.SetInput( distanceImage );
+    marchingCubes.SetIsoValue( 0.0 );
+    marchingCubes.SetUseImageDirection( false );
+    marchingCubes.Update();
 
     if( verbose )
       {
       cout << "      mesh has "
-           << fltMarching->GetOutput()->GetNumberOfCells() << " cells and "
-           << fltMarching->GetOutput()->GetNumberOfPoints() << " points. " << endl;
+           << marchingCubes.GetNumberOfTriangles() << " cells and "
+           << marchingCubes.GetNumberOfPoints() << " points. " << endl;
       }
 
     if( verbose )
       {
       cout << "   extracting the largest component" << endl;
       }
-    fltConnect->Update();
+    marchingCubes.KeepLargestComponent();
 
     if( verbose )
       {
       cout << "      mesh has "
-           << fltConnect->GetOutput()->GetNumberOfCells() << " cells and "
-           << fltConnect->GetOutput()->GetNumberOfPoints() << " points. " << endl;
+           << marchingCubes.GetNumberOfTriangles() << " cells and "
+           << marchingCubes.GetNumberOfPoints() << " points. " << endl;
       }
 
-    bool doclean = false;
-    if ( doclean ) 
+    // Without decimation the mesh is smoothed before it is handed to VTK
+    const bool smoothInVTK = ( m_DecimateFactor > 0.0 );
+    if( m_SmoothingIterations > 0 && !smoothInVTK )
       {
-      if (verbose) cout << "   cleaning the mesh " << endl;
-      fltClean->Update();
-      if (verbose) cout << "  after clean step mesh uses " << m_DecimateFactor << " decimation " 
-		      << fltClean->GetOutput()->GetNumberOfCells() << " cells and "
-		      << fltClean->GetOutput()->GetNumberOfPoints() << " points. " << endl;
+      if( verbose )
+        {
+        cout << "   smoothing the mesh " << m_SmoothingIterations  << endl;
+        }
+      marchingCubes.Smooth( m_SmoothingIterations );
       }
 
+    m_Result = ConvertMesh( marchingCubes );
+
     std::cout << "  to decimation with factor " <<  m_DecimateFactor << std::endl;
     // If decimation is on, run it
     if( m_DecimateFactor > 0.0  )
@@ -414,26 +343,14 @@ protected:
         {
         cout << "   decimating the mesh by factor of " << m_DecimateFactor << endl;
         }
+      vtkSmartPointer<vtkDecimatePro> fltDecimate = vtkSmartPointer<vtkDecimatePro>::New();
       fltDecimate->SetTargetReduction(m_DecimateFactor);
-      fltDecimate->SetInputData(fltConnect->GetOutput());
+      fltDecimate->PreserveTopologyOn();
+      fltDecimate->SetInputData(m_Result);
       fltDecimate->Update();
-      fltTriangle->SetInputData(fltDecimate->GetOutput() );
-      //      if (verbose) cout << "      mesh has "
-      // << fltClean->GetOutput()->GetNumberOfCells() << " cells and "
-      //  << fltClean->GetOutput()->GetNumberOfPoints() << " points. " << endl;
-      }
-    else
-      {
-      fltTriangle->SetInputData(fltConnect->GetOutput());
+      m_Result = fltDecimate->GetOutput();
       }
 
-    if( verbose )
-      {
-      cout << "   converting mesh to triangles" << endl;
-      }
-    fltTriangle->Update();
-    m_Result = fltTriangle->GetOutput();
-
     if( verbose )
       {
       cout << "      mesh has "
@@ -442,15 +359,15 @@ protected:
       }
 
     // If smoothing is on, run it
-    if( m_SmoothingIterations > 0  )
+    if( m_SmoothingIterations > 0 && smoothInVTK )
       {
       if( verbose )
         {
         cout << "   smoothing the mesh " << m_SmoothingIterations  << endl;
         }
+      vtkSmartPointer<vtkSmoothPolyDataFilter> fltSmoothMesh = vtkSmartPointer<vtkSmoothPolyDataFilter>::New();
       fltSmoothMesh->SetNumberOfIterations(m_SmoothingIterations);
       fltSmoothMesh->SetInputData(m_Result);
-      //      fltSmoothMesh->SetInputConnection(m_Result); // BA FIXME
       fltSmoothMesh->Update();
       m_Result = fltSmoothMesh->GetOutput();
       std::cout << " Done " << std::endl;
@@ -482,30 +399,50 @@ private:
   // Antialiasing filter
   typedef itk::AntiAliasBinaryImageFilter<FloatImageType, FloatImageType> AAFilter;
 
-  // Export to VTK filter
-  typedef itk::VTKImageExport<FloatImageType> ExportFilter;
+  // Surface extraction
+  typedef ants::MarchingCubesSurface<FloatImageType> MarchingCubesType;
 
   // typename TopologyFilter::Pointer fltTopology;
   typename AAFilter::Pointer fltAlias;
-  typename ExportFilter::Pointer fltExport;
   typename ToFloatFilter::Pointer fltToFloat;
   typename ResampleFilter::Pointer fltResample;
   typename ResampleFunction::Pointer fnInterpolate;
 
-  vtkImageImport *               fltImport;
-  vtkImageMarchingCubes *        fltMarching;
-  vtkPolyDataConnectivityFilter *fltConnect;
-  vtkCleanPolyData *             fltClean;
-  vtkTriangleFilter *            fltTriangle;
-  vtkDecimatePro *               fltDecimate;
-  vtkSmoothPolyDataFilter *      fltSmoothMesh;
-
   bool   m_InvertInput;
   float  m_ResampleScaleFactor;
   double m_DecimateFactor;
   int    m_SmoothingIterations;
 
-  vtkPolyData *m_Result;
+  vtkSmartPointer<vtkPolyData> m_Result;
+
+  static vtkSmartPointer<vtkPolyData> ConvertMesh( const MarchingCubesType & mesh )
+  {
+    const std::vector<float> &        meshPoints = mesh.GetPoints();
+    const std::vector<unsigned int> & meshTriangles = mesh.GetTriangles();
+
+    vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+    points->SetNumberOfPoints( mesh.GetNumberOfPoints() );
+    for( unsigned long n = 0; n < mesh.GetNumberOfPoints(); n++ )
+      {
+      points->SetPoint( n, meshPoints[3 * n], meshPoints[3 * n + 1], meshPoints[3 * n + 2] );
+      }
+
+    vtkSmartPointer<vtkCellArray> triangles = vtkSmartPointer<vtkCellArray>::New();
+    triangles->Allocate( triangles->EstimateSize( mesh.GetNumberOfTriangles(), 3 ) );
+    for( unsigned long t = 0; t < mesh.GetNumberOfTriangles(); t++ )
+      {
+      vtkIdType triangle[3];
+      triangle[0] = meshTriangles[3 * t];
+      triangle[1] = meshTriangles[3 * t + 1];
+      triangle[2] = meshTriangles[3 * t + 2];
+      triangles->InsertNextCell( 3, triangle );
+      }
+
+    vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+    polyData->SetPoints( points );
+    polyData->SetPolys( triangles );
+    return polyData;
+  }
 
   void ProgressCommand(itk::Object *source, const itk::EventObject & /*evt*/)
   {
@@ -1,6 +1,7 @@
 #ifndef __ReadWriteData_h_
 #define __ReadWriteData_h_
 #include <antsAllocImage.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
@@ -24,6 +25,14 @@
 #include "itkLogTensorImageFilter.h"
 #include "itkExpTensorImageFilter.h"
 #include "itkCastImageFilter.h"
+#include "itkExtractImageFilter.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkMinimumMaximumImageCalculator.h"
+#include "itkRescaleIntensityImageFilter.h"
+#include "itkUnaryFunctorImageFilter.h"
+#include "itksys/SystemTools.hxx"
+#include "antsObjectCache.h"
+#include "antsParallelGzip.h"
 #include <sys/stat.h>
 
 extern bool ANTSFileExists(const std::string & strFilename);
@@ -245,8 +254,19 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
     typedef TImageType                      ImageType;
     typedef itk::ImageFileReader<ImageType> FileSourceType;
 
+    typename ImageType::Pointer cached = ants::GetCachedImage<ImageType>( file );
+    if( cached.IsNotNull() )
+      {
+      target = cached;
+      return true;
+      }
+
+    // files written by WriteImage with parallel gzip are also decompressed
+    // in parallel
+    const std::string temporaryFile = ants::DecompressParallelGzipToTemporaryFile( file );
+
     typename FileSourceType::Pointer reffilter = FileSourceType::New();
-    reffilter->SetFileName( file );
+    reffilter->SetFileName( temporaryFile.empty() ? std::string( file ) : temporaryFile );
     try
       {
       reffilter->Update();
@@ -255,10 +275,18 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
       {
       std::cerr << "Exception caught during reference file reading " << std::endl;
       std::cerr << e << " file " << file << std::endl;
+      if( !temporaryFile.empty() )
+        {
+        itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+        }
       target = ITK_NULLPTR;
       std::exception();
       return false;
       }
+    if( !temporaryFile.empty() )
+      {
+      itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+      }
 
     // typename ImageType::DirectionType dir;
     // dir.SetIdentity();
@@ -266,7 +294,79 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
 
     // std::cout << " setting pointer " << std::endl;
     target = reffilter->GetOutput();
+    ants::ImageMemoryAccounting::Track( target.GetPointer() );
+    ants::CacheImage<ImageType>( file, target );
+    }
+  return true;
+}
+
+// Read only the given region of an image.  File formats whose ImageIO
+// supports streamed reading (e.g. uncompressed NIfTI, NRRD and MetaImage)
+// read just the bytes of the region; other formats are read in full and
+// cropped.  The returned image keeps the index of the region in the full
+// image, so its geometry is unchanged.
+template <class TImageType>
+bool ReadImageRegion(itk::SmartPointer<TImageType> & target, const char *file,
+                     const typename TImageType::RegionType & region)
+{
+  typedef TImageType                                  ImageType;
+  typedef itk::ExtractImageFilter<ImageType, ImageType> ExtracterType;
+
+  typename ExtracterType::Pointer extracter = ExtracterType::New();
+  extracter->SetDirectionCollapseToSubmatrix();
+  extracter->SetExtractionRegion( region );
+
+  typename ImageType::Pointer inputImage = ITK_NULLPTR;
+
+  typedef itk::ImageFileReader<ImageType> FileSourceType;
+  typename FileSourceType::Pointer reffilter = ITK_NULLPTR;
+
+  if( std::string( file ).substr( 0, 2 ) == std::string( "0x" ) )
+    {
+    // in-memory image, see ReadImage
+    if( !ReadImage<ImageType>( inputImage, file ) )
+      {
+      target = ITK_NULLPTR;
+      return false;
+      }
+    extracter->SetInput( inputImage );
+    }
+  else
+    {
+    if( !ANTSFileExists(std::string(file) ) )
+      {
+      std::cerr << " file " << std::string(file) << " does not exist . " << std::endl; target = ITK_NULLPTR;
+      return false;
+      }
+    reffilter = FileSourceType::New();
+    reffilter->SetFileName( file );
+    extracter->SetInput( reffilter->GetOutput() );
+    }
+
+  try
+    {
+    extracter->UpdateOutputInformation();
+    const typename ImageType::RegionType & largestRegion = extracter->GetInput()->GetLargestPossibleRegion();
+    if( !largestRegion.IsInside( region ) )
+      {
+      std::cerr << "The requested region " << region << " is not inside the image " << std::endl;
+      std::cerr << largestRegion << " file " << file << std::endl;
+      target = ITK_NULLPTR;
+      return false;
+      }
+    // the reader only reads the requested region of the extracter
+    extracter->Update();
     }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Exception caught during reference file reading " << std::endl;
+    std::cerr << e << " file " << file << std::endl;
+    target = ITK_NULLPTR;
+    return false;
+    }
+
+  target = extracter->GetOutput();
+  target->DisconnectPipeline();
   return true;
 }
 
@@ -276,8 +376,16 @@ typename ImageType::Pointer ReadImage(char* fn )
   // Read the image files begin
   typedef itk::ImageFileReader<ImageType> FileSourceType;
 
+  typename ImageType::Pointer cached = ants::GetCachedImage<ImageType>( fn );
+  if( cached.IsNotNull() )
+    {
+    return cached;
+    }
+
+  const std::string temporaryFile = ants::DecompressParallelGzipToTemporaryFile( fn );
+
   typename FileSourceType::Pointer reffilter = FileSourceType::New();
-  reffilter->SetFileName( fn );
+  reffilter->SetFileName( temporaryFile.empty() ? std::string( fn ) : temporaryFile );
   try
     {
     reffilter->Update();
@@ -286,14 +394,23 @@ typename ImageType::Pointer ReadImage(char* fn )
     {
     std::cerr << "Exception caught during image reference file reading " << std::endl;
     std::cerr << e << std::endl;
+    if( !temporaryFile.empty() )
+      {
+      itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+      }
     return NULL;
     }
+  if( !temporaryFile.empty() )
+    {
+    itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+    }
 
   //typename ImageType::DirectionType dir;
   //dir.SetIdentity();
   //  reffilter->GetOutput()->SetDirection(dir);
 
   typename ImageType::Pointer target = reffilter->GetOutput();
+  ants::CacheImage<ImageType>( fn, target );
   // if (reffilter->GetImageIO->GetNumberOfComponents() == 6)
   // NiftiDTICheck<ImageType>(target,fn);
 
@@ -513,19 +630,258 @@ bool WriteImage(const itk::SmartPointer<TImageType> image, const char *file)
     {
     typename itk::ImageFileWriter<TImageType>::Pointer writer =
       itk::ImageFileWriter<TImageType>::New();
-    writer->SetFileName(file);
     if( !image )
       {
       std::cerr << "Image is null." << std::endl;
       std::exception();
       }
     writer->SetInput(image);
-    writer->SetUseCompression( true );
-    writer->Update();
+    ants::ObjectCache::Invalidate( file );
+
+    // .nii.gz files are written uncompressed next to the output and then
+    // compressed on all threads, since the NIfTI writer deflates serially
+    std::string temporaryFile;
+    if( ants::UseParallelGzip( file ) )
+      {
+      temporaryFile = ants::GetTemporaryFileName( itksys::SystemTools::GetFilenamePath( file ), ".nii" );
+      writer->SetFileName( temporaryFile );
+      }
+    else
+      {
+      writer->SetFileName(file);
+      writer->SetUseCompression( true );
+      }
+    try
+      {
+      writer->Update();
+      }
+    catch( ... )
+      {
+      if( !temporaryFile.empty() )
+        {
+        itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+        }
+      throw;
+      }
+    if( !temporaryFile.empty() )
+      {
+      const bool compressed = ants::ParallelGzipCompressFile( temporaryFile, file );
+      itksys::SystemTools::RemoveFile( temporaryFile.c_str() );
+      if( !compressed )
+        {
+        std::cerr << "Could not write " << file << std::endl;
+        return false;
+        }
+      }
+
+    // the next reader of the file in this process gets the image from the
+    // cache, if it is enabled, instead of parsing the file again
+    ants::CacheImage<TImageType>( file, image );
     }
   return true;
 }
 
+// Convert an image file to another pixel type without holding the whole
+// image in memory.  When rescale is set, a first pass reads the image in
+// chunks of at most maximumChunkBytes to find its intensity range, which is
+// then mapped linearly to [outputMinimum, outputMaximum] as
+// RescaleIntensityImageFilter does; otherwise the pixels are only cast.
+// The converted image is written chunk by chunk.  Formats whose ImageIO
+// can not stream are read or written in full, and in-memory ("0x") and
+// cached images are converted in memory.
+template <class TInputImage, class TOutputImage>
+bool ConvertImageFile(const char *inputFile, const char *outputFile, bool rescale,
+                      double outputMinimum, double outputMaximum,
+                      itk::SizeValueType maximumChunkBytes = 64 * 1024 * 1024)
+{
+  typedef TInputImage                          InputImageType;
+  typedef TOutputImage                         OutputImageType;
+  typedef typename InputImageType::PixelType   InputPixelType;
+  typedef typename OutputImageType::PixelType  OutputPixelType;
+  typedef typename InputImageType::RegionType  RegionType;
+  typedef itk::ImageFileReader<InputImageType> ReaderType;
+
+  if( std::string( inputFile ).length() < 3 || std::string( outputFile ).length() < 3 )
+    {
+    return false;
+    }
+
+  typename InputImageType::Pointer inputImage = ITK_NULLPTR;
+  typename ReaderType::Pointer     reader = ITK_NULLPTR;
+  std::string                      temporaryInputFile;
+  if( std::string( inputFile ).substr( 0, 2 ) == std::string( "0x" ) )
+    {
+    if( !ReadImage<InputImageType>( inputImage, inputFile ) )
+      {
+      return false;
+      }
+    }
+  else
+    {
+    if( !ANTSFileExists( std::string( inputFile ) ) )
+      {
+      std::cerr << " file " << std::string( inputFile ) << " does not exist . " << std::endl;
+      return false;
+      }
+    inputImage = ants::GetCachedImage<InputImageType>( inputFile );
+    if( inputImage.IsNull() )
+      {
+      temporaryInputFile = ants::DecompressParallelGzipToTemporaryFile( inputFile );
+      reader = ReaderType::New();
+      reader->SetFileName( temporaryInputFile.empty() ? std::string( inputFile ) : temporaryInputFile );
+      }
+    }
+
+  typedef itk::ImageToImageFilter<InputImageType, OutputImageType> ConverterType;
+  typename ConverterType::Pointer converter = ITK_NULLPTR;
+
+  std::string temporaryOutputFile;
+  bool        success = true;
+  try
+    {
+    RegionType largestRegion;
+    if( reader )
+      {
+      reader->UpdateOutputInformation();
+      largestRegion = reader->GetOutput()->GetLargestPossibleRegion();
+      }
+    else
+      {
+      largestRegion = inputImage->GetLargestPossibleRegion();
+      }
+
+    const itk::SizeValueType numberOfBytes = largestRegion.GetNumberOfPixels() * sizeof( InputPixelType );
+    unsigned int             numberOfChunks = 1;
+    if( reader && maximumChunkBytes > 0 )
+      {
+      numberOfChunks = static_cast<unsigned int>( ( numberOfBytes + maximumChunkBytes - 1 ) / maximumChunkBytes );
+      numberOfChunks = std::max( numberOfChunks, 1u );
+      }
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    numberOfChunks = splitter->GetNumberOfSplits( largestRegion, numberOfChunks );
+
+    if( rescale )
+      {
+      // first pass:  the intensity range, one chunk at a time.  Readers that
+      // can not stream read the whole image for the first chunk and the
+      // remaining chunks are then already in memory.
+      typedef itk::MinimumMaximumImageCalculator<InputImageType> CalculatorType;
+      typename CalculatorType::Pointer calculator = CalculatorType::New();
+
+      InputPixelType inputMinimum = itk::NumericTraits<InputPixelType>::max();
+      InputPixelType inputMaximum = itk::NumericTraits<InputPixelType>::NonpositiveMin();
+      for( unsigned int n = 0; n < numberOfChunks; n++ )
+        {
+        RegionType chunk = largestRegion;
+        splitter->GetSplit( n, numberOfChunks, chunk );
+        if( reader )
+          {
+          reader->GetOutput()->SetRequestedRegion( chunk );
+          reader->Update();
+          calculator->SetImage( reader->GetOutput() );
+          }
+        else
+          {
+          calculator->SetImage( inputImage );
+          }
+        calculator->SetRegion( chunk );
+        calculator->Compute();
+        inputMinimum = std::min( inputMinimum, calculator->GetMinimum() );
+        inputMaximum = std::max( inputMaximum, calculator->GetMaximum() );
+        }
+
+      // same mapping as RescaleIntensityImageFilter
+      typedef itk::Functor::IntensityLinearTransform<InputPixelType, OutputPixelType> TransformType;
+      typedef typename TransformType::RealType                                         RealType;
+
+      RealType scale = itk::NumericTraits<RealType>::ZeroValue();
+      if( inputMinimum != inputMaximum )
+        {
+        scale = ( static_cast<RealType>( outputMaximum ) - static_cast<RealType>( outputMinimum ) )
+          / ( static_cast<RealType>( inputMaximum ) - static_cast<RealType>( inputMinimum ) );
+        }
+      else if( inputMaximum != itk::NumericTraits<InputPixelType>::ZeroValue() )
+        {
+        scale = ( static_cast<RealType>( outputMaximum ) - static_cast<RealType>( outputMinimum ) )
+          / static_cast<RealType>( inputMaximum );
+        }
+      const RealType shift = static_cast<RealType>( outputMinimum ) - static_cast<RealType>( inputMinimum ) * scale;
+
+      typedef itk::UnaryFunctorImageFilter<InputImageType, OutputImageType, TransformType> RescalerType;
+      typename RescalerType::Pointer rescaler = RescalerType::New();
+      rescaler->GetFunctor().SetFactor( scale );
+      rescaler->GetFunctor().SetOffset( shift );
+      rescaler->GetFunctor().SetMinimum( static_cast<OutputPixelType>( outputMinimum ) );
+      rescaler->GetFunctor().SetMaximum( static_cast<OutputPixelType>( outputMaximum ) );
+      converter = rescaler;
+      }
+    else
+      {
+      typedef itk::CastImageFilter<InputImageType, OutputImageType> CasterType;
+      converter = CasterType::New();
+      }
+    if( reader )
+      {
+      converter->SetInput( reader->GetOutput() );
+      }
+    else
+      {
+      converter->SetInput( inputImage );
+      }
+
+    // second pass:  cast or rescale and write one chunk at a time
+    if( std::string( outputFile ).substr( 0, 2 ) == std::string( "0x" ) )
+      {
+      converter->Update();
+      WriteImage<OutputImageType>( converter->GetOutput(), outputFile );
+      }
+    else
+      {
+      typedef itk::ImageFileWriter<OutputImageType> WriterType;
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetInput( converter->GetOutput() );
+      writer->SetNumberOfStreamDivisions( numberOfChunks );
+      ants::ObjectCache::Invalidate( outputFile );
+
+      // as in WriteImage
+      if( ants::UseParallelGzip( outputFile ) )
+        {
+        temporaryOutputFile = ants::GetTemporaryFileName( itksys::SystemTools::GetFilenamePath( outputFile ), ".nii" );
+        writer->SetFileName( temporaryOutputFile );
+        }
+      else
+        {
+        writer->SetFileName( outputFile );
+        writer->SetUseCompression( true );
+        }
+      writer->Update();
+      if( !temporaryOutputFile.empty() )
+        {
+        success = ants::ParallelGzipCompressFile( temporaryOutputFile, outputFile );
+        if( !success )
+          {
+          std::cerr << "Could not write " << outputFile << std::endl;
+          }
+        }
+      }
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Exception caught during image conversion " << std::endl;
+    std::cerr << e << " file " << inputFile << std::endl;
+    success = false;
+    }
+  if( !temporaryInputFile.empty() )
+    {
+    itksys::SystemTools::RemoveFile( temporaryInputFile.c_str() );
+    }
+  if( !temporaryOutputFile.empty() )
+    {
+    itksys::SystemTools::RemoveFile( temporaryOutputFile.c_str() );
+    }
+  return success;
+}
+
 template <class TImageType>
 void WriteTensorImage(itk::SmartPointer<TImageType> image, const char *file, bool takeexp = true)
 {
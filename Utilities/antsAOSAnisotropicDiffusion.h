@@ -0,0 +1,268 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsAOSAnisotropicDiffusion_h
+#define antsAOSAnisotropicDiffusion_h
+
+#include "antsAllocImage.h"
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ants
+{
+/** Perona-Malik diffusion to a given time by the additive operator splitting
+ * of Weickert, Romeny and Viergever: each step averages, over the axes, the
+ * solutions of the implicit one dimensional problems
+ *
+ *   ( I - dimension * timeStep * A_axis ) u_axis = u
+ *
+ * which are tridiagonal along the lines of the axis and are solved on all
+ * threads.  The scheme is stable for any time step, so the time is reached in
+ * steps of up to maximumTimeStep rather than of the explicit limit.
+ *
+ * The operator is that of GradientAnisotropicDiffusionImageFilter: the
+ * conductance of the face between two neighbours is
+ * exp( -|grad u|^2 / ( 2 K^2 <|grad u|^2> ) ), with the gradient at the face
+ * from the difference across it and the mean of the central differences along
+ * the other axes, K the conductance parameter and <|grad u|^2> the mean over
+ * the image, the fluxes are scaled once by the spacing and nothing flows
+ * through the boundary.
+ */
+class AOSAnisotropicDiffusion
+{
+public:
+  template <class TImage>
+  static typename TImage::Pointer Diffuse( const TImage *image, double time, double conductance,
+                                           double maximumTimeStep = 1.0 )
+  {
+    const unsigned int ImageDimension = TImage::ImageDimension;
+
+    ThreadStruct str;
+    str.Size.resize( ImageDimension );
+    str.Strides.resize( ImageDimension );
+    str.Scales.resize( ImageDimension );
+    str.NumberOfPixels = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.Size[d] = image->GetBufferedRegion().GetSize()[d];
+      str.Strides[d] = str.NumberOfPixels;
+      str.Scales[d] = 1.0 / image->GetSpacing()[d];
+      str.NumberOfPixels *= str.Size[d];
+      }
+
+    std::vector<double> values( image->GetBufferPointer(), image->GetBufferPointer() + str.NumberOfPixels );
+    std::vector<double> updated( str.NumberOfPixels );
+    str.Values = &values[0];
+    str.Updated = &updated[0];
+
+    const unsigned long numberOfSteps = ( time > 0.0 ) ?
+      std::max( static_cast<unsigned long>( std::ceil( time / maximumTimeStep ) ), 1ul ) : 0ul;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    const unsigned int          maximumNumberOfThreads = threader->GetNumberOfThreads();
+    for( unsigned long step = 0; step < numberOfSteps; step++ )
+      {
+      threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                          maximumNumberOfThreads ), str.NumberOfPixels ),
+                                              static_cast<itk::SizeValueType>( 1 ) ) );
+      str.SumsOfSquares.assign( threader->GetNumberOfThreads(), 0.0 );
+      threader->SetSingleMethod( GradientThreaderCallback, &str );
+      threader->SingleMethodExecute();
+
+      double sumOfSquares = 0.0;
+      for( unsigned int t = 0; t < str.SumsOfSquares.size(); t++ )
+        {
+        sumOfSquares += str.SumsOfSquares[t];
+        }
+      const double averageGradientMagnitudeSquared = sumOfSquares / str.NumberOfPixels;
+      if( averageGradientMagnitudeSquared == 0.0 )
+        {
+        break;
+        }
+      str.K = -2.0 * averageGradientMagnitudeSquared * conductance * conductance;
+      str.Weight = ImageDimension * time / numberOfSteps;
+
+      std::fill( updated.begin(), updated.end(), 0.0 );
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        str.Axis = d;
+        str.NumberOfLines = str.NumberOfPixels / str.Size[d];
+        threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                            maximumNumberOfThreads ), str.NumberOfLines ),
+                                                static_cast<itk::SizeValueType>( 1 ) ) );
+        threader->SetSingleMethod( SolveThreaderCallback, &str );
+        threader->SingleMethodExecute();
+        }
+      values.swap( updated );
+      str.Values = &values[0];
+      str.Updated = &updated[0];
+      }
+
+    typename TImage::Pointer output = AllocImage<TImage>( image );
+    typename TImage::PixelType *out = output->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < str.NumberOfPixels; n++ )
+      {
+      out[n] = static_cast<typename TImage::PixelType>( values[n] );
+      }
+    return output;
+  }
+
+private:
+  AOSAnisotropicDiffusion();
+
+  struct ThreadStruct
+    {
+    const double *                    Values;
+    double *                          Updated;
+    std::vector<itk::SizeValueType>   Size;
+    std::vector<itk::OffsetValueType> Strides;
+    std::vector<double>               Scales;
+    itk::SizeValueType                NumberOfPixels;
+    std::vector<double>               SumsOfSquares;
+    double                            K;
+    double                            Weight;
+    unsigned int                      Axis;
+    itk::SizeValueType                NumberOfLines;
+    };
+
+  /** the central difference along axis d at the voxel of offset n and index
+   * index along d, with the neighbours outside of the image replaced by the
+   * voxel itself */
+  static double CentralDifference( const ThreadStruct *str, itk::SizeValueType n,
+                                   itk::SizeValueType index, unsigned int d )
+  {
+    const itk::OffsetValueType stride = str->Strides[d];
+    const double               next = ( index + 1 < str->Size[d] ) ? str->Values[n + stride] : str->Values[n];
+    const double               previous = ( index > 0 ) ? str->Values[n - stride] : str->Values[n];
+
+    return 0.5 * ( next - previous ) * str->Scales[d];
+  }
+
+  static ITK_THREAD_RETURN_TYPE GradientThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct *                        str = static_cast<ThreadStruct *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    const unsigned int       dimension = str->Size.size();
+
+    double sumOfSquares = 0.0;
+    for( itk::SizeValueType n = first; n < last; n++ )
+      {
+      itk::SizeValueType remainder = n;
+      for( unsigned int d = 0; d < dimension; d++ )
+        {
+        const double dx = CentralDifference( str, n, remainder % str->Size[d], d );
+        remainder /= str->Size[d];
+        sumOfSquares += dx * dx;
+        }
+      }
+    str->SumsOfSquares[info->ThreadID] = sumOfSquares;
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** the conductances of the faces along each line of Axis, then the Thomas
+   * algorithm on its tridiagonal system, added with a weight of one over the
+   * dimension to Updated */
+  static ITK_THREAD_RETURN_TYPE SolveThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct *                        str = static_cast<ThreadStruct *>( info->UserData );
+
+    const itk::SizeValueType   first = str->NumberOfLines * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType   last = str->NumberOfLines * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    const unsigned int         dimension = str->Size.size();
+    const unsigned int         axis = str->Axis;
+    const itk::SizeValueType   length = str->Size[axis];
+    const itk::OffsetValueType stride = str->Strides[axis];
+    const double               scale = str->Scales[axis];
+    const double               weight = str->Weight * scale;
+
+    std::vector<itk::SizeValueType> index( dimension, 0 );
+    std::vector<double>             faces( length );
+    std::vector<double>             upper( length );
+    std::vector<double>             solution( length );
+    for( itk::SizeValueType line = first; line < last; line++ )
+      {
+      itk::SizeValueType offset = 0;
+      itk::SizeValueType remainder = line;
+      for( unsigned int d = 0; d < dimension; d++ )
+        {
+        if( d != axis )
+          {
+          index[d] = remainder % str->Size[d];
+          remainder /= str->Size[d];
+          offset += index[d] * str->Strides[d];
+          }
+        }
+
+      // faces[k] is the conductance between voxels k and k + 1
+      for( itk::SizeValueType k = 0; k + 1 < length; k++ )
+        {
+        const itk::SizeValueType n = offset + k * stride;
+        const double             dx = ( str->Values[n + stride] - str->Values[n] ) * scale;
+        double                   gradientMagnitudeSquared = dx * dx;
+        for( unsigned int d = 0; d < dimension; d++ )
+          {
+          if( d != axis )
+            {
+            const double dy = CentralDifference( str, n, index[d], d )
+              + CentralDifference( str, n + stride, index[d], d );
+            gradientMagnitudeSquared += 0.25 * dy * dy;
+            }
+          }
+        faces[k] = std::exp( gradientMagnitudeSquared / str->K );
+        }
+      faces[length - 1] = 0.0;
+
+      double previousFace = 0.0;
+      for( itk::SizeValueType k = 0; k < length; k++ )
+        {
+        const double lower = -weight * previousFace;
+        const double diagonal = 1.0 + weight * ( previousFace + faces[k] );
+        const double right = str->Values[offset + k * stride];
+        if( k == 0 )
+          {
+          upper[k] = -weight * faces[k] / diagonal;
+          solution[k] = right / diagonal;
+          }
+        else
+          {
+          const double pivot = diagonal - lower * upper[k - 1];
+          upper[k] = -weight * faces[k] / pivot;
+          solution[k] = ( right - lower * solution[k - 1] ) / pivot;
+          }
+        previousFace = faces[k];
+        }
+      for( itk::SizeValueType k = length - 1; k > 0; k-- )
+        {
+        solution[k - 1] -= upper[k - 1] * solution[k];
+        }
+
+      for( itk::SizeValueType k = 0; k < length; k++ )
+        {
+        str->Updated[offset + k * stride] += solution[k] / dimension;
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif // antsAOSAnisotropicDiffusion_h
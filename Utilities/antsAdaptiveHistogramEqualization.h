@@ -0,0 +1,315 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsAdaptiveHistogramEqualization_h
+#define antsAdaptiveHistogramEqualization_h
+
+#include "antsAllocImage.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ants
+{
+/** Adaptive histogram equalization of scalar images, as computed by
+ * itk::AdaptiveHistogramEqualizationImageFilter:  every voxel u is mapped
+ * through the sum over its box neighborhood of
+ *
+ *   0.5 sgn(u - v) |2 (u - v)|^alpha - 0.5 beta sgn(u - v) |2 (u - v)| + beta u
+ *
+ * with the intensities normalized to [-0.5, 0.5], divided by the number of
+ * voxels of the box.  Voxels outside of the image are left out of the sum.
+ *
+ * Small boxes are summed directly.  Once the box holds more voxels than
+ * there are histogram bins, a histogram of the binned intensities in the
+ * box is slid along each line instead.  Only the two faces of the box
+ * entering and leaving it are updated per voxel, and the sum is read off
+ * the histogram with the function tabulated at the bin differences.  The
+ * lines are spread over the threads.
+ */
+class AdaptiveHistogramEqualization
+{
+public:
+  template <class TImage>
+  static typename TImage::Pointer Equalize( const TImage *input, const typename TImage::SizeType & radius,
+                                            double alpha, double beta, unsigned int numberOfBins = 1024 )
+  {
+    typedef typename TImage::PixelType PixelType;
+
+    const unsigned int ImageDimension = TImage::ImageDimension;
+
+    typename TImage::Pointer output = AllocImage<TImage>( input );
+
+    const PixelType *        buffer = input->GetBufferPointer();
+    const itk::SizeValueType numberOfPixels = input->GetBufferedRegion().GetNumberOfPixels();
+    if( numberOfPixels == 0 )
+      {
+      return output;
+      }
+
+    PixelType minimum = buffer[0];
+    PixelType maximum = buffer[0];
+    for( itk::SizeValueType n = 1; n < numberOfPixels; n++ )
+      {
+      minimum = std::min( minimum, buffer[n] );
+      maximum = std::max( maximum, buffer[n] );
+      }
+    if( !( maximum > minimum ) )
+      {
+      std::copy( buffer, buffer + numberOfPixels, output->GetBufferPointer() );
+      return output;
+      }
+
+    ThreadStruct<PixelType> str;
+    str.Input = buffer;
+    str.Output = output->GetBufferPointer();
+    str.ImageDimension = ImageDimension;
+    str.Minimum = minimum;
+    str.Scale = static_cast<double>( maximum ) - static_cast<double>( minimum );
+    str.Alpha = alpha;
+    str.Beta = beta;
+    str.KernelSize = 1.0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.Size[d] = input->GetBufferedRegion().GetSize()[d];
+      str.Stride[d] = input->GetOffsetTable()[d];
+      str.Radius[d] = radius[d];
+      str.KernelSize *= 2.0 * radius[d] + 1.0;
+      }
+    str.NumberOfLines = numberOfPixels / str.Size[0];
+
+    str.NumberOfBins = std::max( numberOfBins, 2u );
+    str.UseHistogram = ( str.KernelSize > str.NumberOfBins );
+    if( str.UseHistogram )
+      {
+      // the intensities rounded to the bins, and the function at every
+      // difference of bins
+      const double binScale = ( str.NumberOfBins - 1 ) / str.Scale;
+      str.Bins.resize( numberOfPixels );
+      for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+        {
+        str.Bins[n] = static_cast<unsigned int>( ( buffer[n] - str.Minimum ) * binScale + 0.5 );
+        }
+      const int last = str.NumberOfBins - 1;
+      str.Table.resize( 2 * last + 1 );
+      for( int m = -last; m <= last; m++ )
+        {
+        str.Table[m + last] = CumulativeFunction( static_cast<double>( m ) / last, alpha, beta );
+        }
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfLines ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    threader->SetSingleMethod( ThreaderCallback<PixelType>, &str );
+    threader->SingleMethodExecute();
+
+    return output;
+  }
+
+private:
+  AdaptiveHistogramEqualization();
+
+  itkStaticConstMacro( MaximumDimension, unsigned int, 4 );
+
+  template <class TPixel>
+  struct ThreadStruct
+    {
+    const TPixel *Input;
+    TPixel *      Output;
+    unsigned int  ImageDimension;
+
+    itk::SizeValueType   Size[MaximumDimension];
+    itk::OffsetValueType Stride[MaximumDimension];
+    itk::SizeValueType   Radius[MaximumDimension];
+    itk::SizeValueType   NumberOfLines;
+
+    TPixel Minimum;
+    double Scale;
+    double Alpha;
+    double Beta;
+    double KernelSize;
+
+    bool                      UseHistogram;
+    unsigned int              NumberOfBins;
+    std::vector<unsigned int> Bins;
+    std::vector<double>       Table;
+    };
+
+  /** The sum of the function without its beta u term, for the normalized
+   * difference u - v. */
+  static double CumulativeFunction( double difference, double alpha, double beta )
+  {
+    if( difference == 0.0 )
+      {
+      return 0.0;
+      }
+    const double s = ( difference > 0.0 ) ? 1.0 : -1.0;
+    const double ad = std::fabs( 2.0 * difference );
+    return 0.5 * s * std::pow( ad, alpha ) - beta * 0.5 * s * ad;
+  }
+
+  template <class TPixel>
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const ThreadStruct<TPixel> *          str = static_cast<ThreadStruct<TPixel> *>( info->UserData );
+
+    const unsigned int       D = str->ImageDimension;
+    const itk::SizeValueType length = str->Size[0];
+    const itk::SizeValueType first = str->NumberOfLines * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfLines * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    std::vector<itk::OffsetValueType> faceOffsets;
+    std::vector<itk::SizeValueType>   histogram( str->UseHistogram ? str->NumberOfBins : 0, 0 );
+    for( itk::SizeValueType line = first; line < last; line++ )
+      {
+      // the offsets of the box across the line, clipped to the image
+      itk::OffsetValueType lineOffset = 0;
+      itk::SizeValueType   lower[MaximumDimension];
+      itk::SizeValueType   extent[MaximumDimension];
+      itk::SizeValueType   numberOfFaceOffsets = 1;
+      itk::SizeValueType   remainder = line;
+      for( unsigned int d = 1; d < D; d++ )
+        {
+        const itk::SizeValueType c = remainder % str->Size[d];
+        remainder /= str->Size[d];
+        lineOffset += c * str->Stride[d];
+        lower[d] = ( c > str->Radius[d] ) ? c - str->Radius[d] : 0;
+        extent[d] = std::min( c + str->Radius[d], str->Size[d] - 1 ) - lower[d] + 1;
+        numberOfFaceOffsets *= extent[d];
+        }
+      faceOffsets.resize( numberOfFaceOffsets );
+      for( itk::SizeValueType k = 0; k < numberOfFaceOffsets; k++ )
+        {
+        itk::OffsetValueType offset = 0;
+        itk::SizeValueType   r = k;
+        for( unsigned int d = 1; d < D; d++ )
+          {
+          offset += ( lower[d] + r % extent[d] ) * str->Stride[d];
+          r /= extent[d];
+          }
+        faceOffsets[k] = offset;
+        }
+
+      const itk::SizeValueType radius = str->Radius[0];
+      TPixel *                 output = str->Output + lineOffset;
+      if( !str->UseHistogram )
+        {
+        const bool powerOne = ( str->Alpha == 1.0 );
+        for( itk::SizeValueType x = 0; x < length; x++ )
+          {
+          const double             u = ( str->Input[lineOffset + x] - str->Minimum ) / str->Scale - 0.5;
+          const itk::SizeValueType x0 = ( x > radius ) ? x - radius : 0;
+          const itk::SizeValueType x1 = std::min( x + radius, length - 1 );
+
+          double sum = 0.0;
+          for( itk::SizeValueType k = 0; k < numberOfFaceOffsets; k++ )
+            {
+            const TPixel *neighbors = str->Input + faceOffsets[k];
+            for( itk::SizeValueType xx = x0; xx <= x1; xx++ )
+              {
+              const double difference = u - ( ( neighbors[xx] - str->Minimum ) / str->Scale - 0.5 );
+              if( difference != 0.0 )
+                {
+                const double s = ( difference > 0.0 ) ? 1.0 : -1.0;
+                const double ad = std::fabs( 2.0 * difference );
+                sum += 0.5 * s * ( powerOne ? ad : std::pow( ad, str->Alpha ) ) - str->Beta * 0.5 * s * ad;
+                }
+              sum += str->Beta * u;
+              }
+            }
+          output[x] = static_cast<TPixel>( str->Scale * ( sum / str->KernelSize + 0.5 ) + str->Minimum );
+          }
+        continue;
+        }
+
+      // slide the histogram of the box along the line, keeping the range
+      // of bins it may occupy
+      const int           lastBin = str->NumberOfBins - 1;
+      const unsigned int *bins = &( str->Bins[0] );
+      itk::SizeValueType  count = 0;
+      int                 lowBin = lastBin;
+      int                 highBin = 0;
+      std::fill( histogram.begin(), histogram.end(), 0 );
+      for( itk::SizeValueType xx = 0; xx <= std::min( radius, length - 1 ); xx++ )
+        {
+        for( itk::SizeValueType k = 0; k < numberOfFaceOffsets; k++ )
+          {
+          const int b = bins[faceOffsets[k] + xx];
+          histogram[b]++;
+          lowBin = std::min( lowBin, b );
+          highBin = std::max( highBin, b );
+          }
+        count += numberOfFaceOffsets;
+        }
+      for( itk::SizeValueType x = 0; x < length; x++ )
+        {
+        while( lowBin < highBin && histogram[lowBin] == 0 )
+          {
+          lowBin++;
+          }
+        while( highBin > lowBin && histogram[highBin] == 0 )
+          {
+          highBin--;
+          }
+
+        // the position of u between the bins, interpolating the table
+        const double t = ( str->Input[lineOffset + x] - str->Minimum ) / str->Scale * lastBin;
+        const int    k = std::min( static_cast<int>( t ), lastBin - 1 );
+        const double f = t - k;
+
+        const double *table = &( str->Table[lastBin] );
+        double        sum0 = 0.0;
+        double        sum1 = 0.0;
+        for( int b = lowBin; b <= highBin; b++ )
+          {
+          const double h = static_cast<double>( histogram[b] );
+          sum0 += h * table[k - b];
+          sum1 += h * table[k + 1 - b];
+          }
+        const double u = t / lastBin - 0.5;
+        const double sum = ( 1.0 - f ) * sum0 + f * sum1 + str->Beta * u * count;
+        output[x] = static_cast<TPixel>( str->Scale * ( sum / str->KernelSize + 0.5 ) + str->Minimum );
+
+        if( x >= radius )
+          {
+          for( itk::SizeValueType n = 0; n < numberOfFaceOffsets; n++ )
+            {
+            histogram[bins[faceOffsets[n] + x - radius]]--;
+            }
+          count -= numberOfFaceOffsets;
+          }
+        if( x + radius + 1 < length )
+          {
+          for( itk::SizeValueType n = 0; n < numberOfFaceOffsets; n++ )
+            {
+            const int b = bins[faceOffsets[n] + x + radius + 1];
+            histogram[b]++;
+            lowBin = std::min( lowBin, b );
+            highBin = std::max( highBin, b );
+            }
+          count += numberOfFaceOffsets;
+          }
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif // antsAdaptiveHistogramEqualization_h
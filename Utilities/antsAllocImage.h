@@ -2,6 +2,136 @@
 #define ANTSAllocImage_h
 #include "itkImageBase.h"
 #include "itkImage.h"
+#include "itkCommand.h"
+#include "antsImageAllocationPolicy.h"
+#include "itkMutexLockHolder.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <algorithm>
+#include <set>
+
+namespace ants
+{
+/** \class ImageMemoryAccounting
+ * Bookkeeping of the pixel buffers allocated through AllocImage, to
+ * estimate the memory footprint of a program.  It is off by default.  Once
+ * it is enabled every buffer is counted when its image is allocated, or when
+ * it is passed to Track(), and is released from the count when the last
+ * image sharing it is deleted.
+ */
+class ImageMemoryAccounting
+{
+public:
+  static void SetEnabled( bool enabled )
+  {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( GetState().m_Lock );
+    GetState().m_Enabled = enabled;
+  }
+
+  static bool GetEnabled()
+  {
+    return GetState().m_Enabled;
+  }
+
+  /** The bytes of the tracked buffers which are still alive. */
+  static double GetCurrentBytes()
+  {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( GetState().m_Lock );
+    return GetState().m_CurrentBytes;
+  }
+
+  /** The largest number of bytes which were alive at the same time. */
+  static double GetPeakBytes()
+  {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( GetState().m_Lock );
+    return GetState().m_PeakBytes;
+  }
+
+  /** Count the pixel buffer of an image which was not allocated through
+      AllocImage, such as one read from file.  A buffer is counted once. */
+  template <class ImageType>
+  static void Track( ImageType * image )
+  {
+    if( !GetState().m_Enabled || image == ITK_NULLPTR || image->GetPixelContainer() == ITK_NULLPTR )
+      {
+      return;
+      }
+    typedef typename ImageType::PixelContainer PixelContainerType;
+    PixelContainerType * container = image->GetPixelContainer();
+    const double bytes = static_cast<double>( sizeof( typename PixelContainerType::Element ) ) * container->Size();
+
+    State & state = GetState();
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( state.m_Lock );
+      if( !state.m_Buffers.insert( static_cast<const itk::Object *>( container ) ).second )
+        {
+        return;
+        }
+      state.m_CurrentBytes += bytes;
+      state.m_PeakBytes = std::max( state.m_PeakBytes, state.m_CurrentBytes );
+      }
+
+    ReleaseCommand::Pointer release = ReleaseCommand::New();
+    release->m_Bytes = bytes;
+    container->AddObserver( itk::DeleteEvent(), release );
+  }
+
+private:
+  struct State
+    {
+    State() : m_Enabled( false ), m_CurrentBytes( 0.0 ), m_PeakBytes( 0.0 )
+    {
+    }
+
+    itk::SimpleFastMutexLock      m_Lock;
+    bool                          m_Enabled;
+    double                        m_CurrentBytes;
+    double                        m_PeakBytes;
+    std::set<const itk::Object *> m_Buffers;
+    };
+
+  static State & GetState()
+  {
+    static State state;
+    return state;
+  }
+
+  /** Removes the buffer from the count when its container is deleted. */
+  class ReleaseCommand : public itk::Command
+  {
+public:
+    typedef ReleaseCommand          Self;
+    typedef itk::Command            Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    itkNewMacro( Self );
+
+    virtual void Execute( itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE
+    {
+      this->Execute( const_cast<const itk::Object *>( caller ), event );
+    }
+
+    virtual void Execute( const itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE
+    {
+      if( !itk::DeleteEvent().CheckEvent( &event ) )
+        {
+        return;
+        }
+      State & state = GetState();
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder( state.m_Lock );
+      if( state.m_Buffers.erase( caller ) > 0 )
+        {
+        state.m_CurrentBytes -= this->m_Bytes;
+        }
+    }
+
+    double m_Bytes;
+protected:
+    ReleaseCommand() : m_Bytes( 0.0 )
+    {
+    }
+  };
+};
+} // end namespace ants
 
 /** Allocate an image based only on region */
 template <class ImageType>
@@ -10,7 +140,8 @@ AllocImage(const typename ImageType::RegionType & region)
 {
   typename ImageType::Pointer rval = ImageType::New();
   rval->SetRegions(region);
-  rval->Allocate();
+  ants::AllocateImageBuffer( rval.GetPointer() );
+  ants::ImageMemoryAccounting::Track( rval.GetPointer() );
   return rval;
 }
 
@@ -122,7 +253,8 @@ AllocImage(const typename itk::ImageBase<ImageType::ImageDimension> *exemplar)
   rval->SetSpacing( exemplar->GetSpacing() );
   rval->SetOrigin( exemplar->GetOrigin() );
   rval->SetDirection( exemplar->GetDirection() );
-  rval->Allocate();
+  ants::AllocateImageBuffer( rval.GetPointer() );
+  ants::ImageMemoryAccounting::Track( rval.GetPointer() );
   return rval;
 }
 
@@ -0,0 +1,234 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsBackgroundWriter.h"
+
+#include "itkConditionVariable.h"
+#include "itkMultiThreader.h"
+#include "itkMutexLock.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+
+namespace ants
+{
+namespace
+{
+/** A queued job and the stream of the thread which submitted it. */
+struct QueuedJob
+  {
+  BackgroundWriteJob *Job;
+  std::ostream *      Messages;
+  };
+
+typedef std::deque<QueuedJob>                  QueueType;
+typedef std::map<std::ostream *, std::string> MessagesType;
+
+itk::SimpleMutexLock            writerMutex;
+itk::ConditionVariable::Pointer writerCondition;
+itk::MultiThreader::Pointer     writerThreader;
+itk::ThreadIdType               writerThreadId = 0;
+bool                            isWriterRunning = false;
+bool                            isStopping = false;
+QueueType                       queue;
+unsigned int                    numberOfPendingJobs = 0;
+unsigned long                   numberOfSubmittedJobs = 0;
+unsigned long                   numberOfCompletedJobs = 0;
+unsigned int                    queueSize = 2;
+MessagesType                    pendingMessages;
+bool                            isEnabled = true;
+bool                            isInitialized = false;
+
+// all of the following expect writerMutex to be held
+
+void InitializeFromEnvironment()
+{
+  if( isInitialized )
+    {
+    return;
+    }
+  isInitialized = true;
+  writerCondition = itk::ConditionVariable::New();
+  writerThreader = itk::MultiThreader::New();
+  const char *value = std::getenv( "ANTS_BACKGROUND_WRITES" );
+  isEnabled = ( value == ITK_NULLPTR || std::string( value ) != "0" );
+}
+
+/** Print the messages of the completed jobs submitted with this stream. */
+void TakeMessages( std::ostream & messages )
+{
+  MessagesType::iterator it = pendingMessages.find( &messages );
+  if( it != pendingMessages.end() )
+    {
+    messages << it->second << std::flush;
+    pendingMessages.erase( it );
+    }
+}
+
+/** Run the queued jobs until the queue is empty and the program ends. */
+ITK_THREAD_RETURN_TYPE WriterThreadCallback( void * )
+{
+  writerMutex.Lock();
+  while( true )
+    {
+    while( queue.empty() && !isStopping )
+      {
+      writerCondition->Wait( &writerMutex );
+      }
+    if( queue.empty() )
+      {
+      break;
+      }
+    const QueuedJob job = queue.front();
+    queue.pop_front();
+    writerMutex.Unlock();
+
+    std::ostringstream messages;
+    job.Job->Run( messages );
+    delete job.Job;
+
+    writerMutex.Lock();
+    if( !messages.str().empty() )
+      {
+      pendingMessages[job.Messages] += messages.str();
+      }
+    numberOfPendingJobs--;
+    numberOfCompletedJobs++;
+    writerCondition->Broadcast();
+    }
+  writerMutex.Unlock();
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Runs the remaining jobs and joins the writer at the end of the program.
+ * This is the only join, so it happens once however many threads flush. */
+struct WriterGuard
+  {
+  ~WriterGuard()
+  {
+    writerMutex.Lock();
+    const bool isRunning = isWriterRunning;
+    isStopping = true;
+    if( isRunning )
+      {
+      writerCondition->Broadcast();
+      }
+    writerMutex.Unlock();
+    if( !isRunning )
+      {
+      return;
+      }
+
+    writerThreader->TerminateThread( writerThreadId );
+
+    writerMutex.Lock();
+    isWriterRunning = false;
+    for( MessagesType::const_iterator it = pendingMessages.begin(); it != pendingMessages.end(); ++it )
+      {
+      std::cout << it->second << std::flush;
+      }
+    pendingMessages.clear();
+    writerMutex.Unlock();
+  }
+  };
+
+WriterGuard writerGuard;
+} // anonymous namespace
+
+void BackgroundWriter::SetEnabled( bool enabled )
+{
+  writerMutex.Lock();
+  InitializeFromEnvironment();
+  isEnabled = enabled;
+  writerMutex.Unlock();
+}
+
+bool BackgroundWriter::GetEnabled()
+{
+  writerMutex.Lock();
+  InitializeFromEnvironment();
+  const bool enabled = isEnabled;
+  writerMutex.Unlock();
+  return enabled;
+}
+
+void BackgroundWriter::SetQueueSize( unsigned int size )
+{
+  writerMutex.Lock();
+  InitializeFromEnvironment();
+  queueSize = std::max( size, 1u );
+  writerCondition->Broadcast();
+  writerMutex.Unlock();
+}
+
+unsigned int BackgroundWriter::GetQueueSize()
+{
+  writerMutex.Lock();
+  const unsigned int size = queueSize;
+  writerMutex.Unlock();
+  return size;
+}
+
+void BackgroundWriter::Submit( BackgroundWriteJob *job, std::ostream & messages )
+{
+  writerMutex.Lock();
+  InitializeFromEnvironment();
+  if( !isEnabled || isStopping )
+    {
+    TakeMessages( messages );
+    writerMutex.Unlock();
+    job->Run( messages );
+    delete job;
+    return;
+    }
+
+  // back-pressure:  wait for a slot
+  while( isWriterRunning && numberOfPendingJobs >= queueSize )
+    {
+    writerCondition->Wait( &writerMutex );
+    }
+  QueuedJob queued;
+  queued.Job = job;
+  queued.Messages = &messages;
+  queue.push_back( queued );
+  numberOfPendingJobs++;
+  numberOfSubmittedJobs++;
+  if( !isWriterRunning )
+    {
+    isWriterRunning = true;
+    writerThreadId = writerThreader->SpawnThread( WriterThreadCallback, ITK_NULLPTR );
+    }
+  writerCondition->Broadcast();
+  TakeMessages( messages );
+  writerMutex.Unlock();
+}
+
+void BackgroundWriter::Flush( std::ostream & messages )
+{
+  writerMutex.Lock();
+  InitializeFromEnvironment();
+
+  // the jobs run in order, so those submitted so far are done once as many
+  // jobs have completed; later submissions of other threads are not waited on
+  const unsigned long numberOfJobs = numberOfSubmittedJobs;
+  while( numberOfCompletedJobs < numberOfJobs )
+    {
+    writerCondition->Wait( &writerMutex );
+    }
+  TakeMessages( messages );
+  writerMutex.Unlock();
+}
+} // namespace ants
@@ -0,0 +1,116 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsBackgroundWriter_h
+#define __antsBackgroundWriter_h
+
+#include "itkImageFileWriter.h"
+
+#include <ostream>
+#include <sstream>
+#include <string>
+
+namespace ants
+{
+/** A file to write, with everything it needs held by the job itself so it
+ * can run on another thread.  Messages for the user go to the stream passed
+ * to Run, and are printed by the thread which submitted the job. */
+class BackgroundWriteJob
+{
+public:
+  virtual ~BackgroundWriteJob()
+  {
+  }
+
+  virtual void Run( std::ostream & messages ) = 0;
+};
+
+/** \class BackgroundWriter
+ *
+ * Process-wide writer thread for the intermediate outputs of the
+ * registrations (interval volumes, checkpoints), so that the optimization
+ * does not wait on the disk or on the compression.  The jobs run one at a
+ * time in the order they were submitted.  At most QueueSize jobs, the one
+ * being written included, are pending: Submit blocks beyond that, which
+ * bounds the memory held by the queue.  The default of 2 lets one output be
+ * written while the next is prepared.
+ *
+ * The thread is started by the first Submit and joined at the end of the
+ * program.  Flush returns once every job submitted before it has run, and
+ * must be called before the files are needed; any number of threads, e.g.
+ * the registrations of antsServer or antsPipeline jobs, may submit and flush
+ * at once.  The messages of a job are printed on the stream it was submitted
+ * with, by the next Submit or Flush with that stream.  With the environment
+ * variable ANTS_BACKGROUND_WRITES set to 0, or SetEnabled( false ), Submit
+ * runs the job on the calling thread.
+ */
+class BackgroundWriter
+{
+public:
+  static void SetEnabled( bool enabled );
+
+  static bool GetEnabled();
+
+  static void SetQueueSize( unsigned int queueSize );
+
+  static unsigned int GetQueueSize();
+
+  /** Queue the job, which is deleted once it has run.  The messages of the
+   * jobs submitted with messages and completed so far are written to it. */
+  static void Submit( BackgroundWriteJob *job, std::ostream & messages );
+
+  /** Wait for the jobs submitted so far, then write the messages of those
+   * submitted with messages. */
+  static void Flush( std::ostream & messages );
+
+private:
+  BackgroundWriter();
+};
+
+/** Writes an image, which must not be modified once submitted, with
+ * itk::ImageFileWriter. */
+template <class TImage>
+class ImageWriteJob : public BackgroundWriteJob
+{
+public:
+  ImageWriteJob( const TImage *image, const std::string & fileName ) :
+    m_Image( image ),
+    m_FileName( fileName )
+  {
+  }
+
+  virtual void Run( std::ostream & messages )
+  {
+    typedef itk::ImageFileWriter<TImage> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( this->m_FileName.c_str() );
+    writer->SetInput( this->m_Image );
+    try
+      {
+      writer->Update();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      messages << "Can't write warped image " << this->m_FileName << std::endl;
+      messages << "Exception Object caught: " << std::endl;
+      messages << err << std::endl;
+      }
+  }
+
+private:
+  typename TImage::ConstPointer m_Image;
+  std::string                   m_FileName;
+};
+} // namespace ants
+
+#endif // __antsBackgroundWriter_h
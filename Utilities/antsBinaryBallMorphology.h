@@ -0,0 +1,382 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsBinaryBallMorphology_h
+#define antsBinaryBallMorphology_h
+
+#include "antsAllocImage.h"
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** Binary dilation, erosion, opening and closing by a ball of a given radius
+ * (in voxels), computed as a threshold on the exact squared Euclidean distance
+ * transform of the foreground or of the background, so the cost does not
+ * depend on the radius.  The ball is that of BinaryBallStructuringElement,
+ * the offsets o with |o|^2 <= (radius + 0.5)^2, and the pixels of the result
+ * are those of BinaryDilateImageFilter, BinaryErodeImageFilter,
+ * BinaryMorphologicalOpeningImageFilter and
+ * BinaryMorphologicalClosingImageFilter (with its safe border): the voxels not
+ * reached by the operation keep their input value.
+ *
+ * The distance transform is the separable one of Felzenszwalb and
+ * Huttenlocher, one pass per axis with the lines of each pass shared among the
+ * threads.  The distances are clamped just above the squared radius, which
+ * does not change the ones below it and keeps them in an unsigned int.
+ */
+class BinaryBallMorphology
+{
+public:
+  template <class TImage>
+  static typename TImage::Pointer Dilate( const TImage *image, unsigned long radius,
+                                          typename TImage::PixelType foregroundValue )
+  {
+    Grid grid( image, radius, 0 );
+
+    std::vector<unsigned char> foreground;
+    GetForeground( image, foregroundValue, grid, foreground );
+
+    std::vector<unsigned char> dilated;
+    grid.Dilate( foreground, dilated );
+
+    typename TImage::Pointer output = AllocImage<TImage>( image );
+    const typename TImage::PixelType *in = image->GetBufferPointer();
+    typename TImage::PixelType *      out = output->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < grid.m_NumberOfPixels; n++ )
+      {
+      out[n] = dilated[n] ? foregroundValue : in[n];
+      }
+    return output;
+  }
+
+  template <class TImage>
+  static typename TImage::Pointer Erode( const TImage *image, unsigned long radius,
+                                         typename TImage::PixelType foregroundValue,
+                                         typename TImage::PixelType backgroundValue )
+  {
+    Grid grid( image, radius, 0 );
+
+    std::vector<unsigned char> foreground;
+    GetForeground( image, foregroundValue, grid, foreground );
+
+    std::vector<unsigned char> eroded;
+    grid.Erode( foreground, eroded );
+
+    typename TImage::Pointer output = AllocImage<TImage>( image );
+    const typename TImage::PixelType *in = image->GetBufferPointer();
+    typename TImage::PixelType *      out = output->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < grid.m_NumberOfPixels; n++ )
+      {
+      out[n] = ( foreground[n] && !eroded[n] ) ? backgroundValue : in[n];
+      }
+    return output;
+  }
+
+  template <class TImage>
+  static typename TImage::Pointer Open( const TImage *image, unsigned long radius,
+                                        typename TImage::PixelType foregroundValue,
+                                        typename TImage::PixelType backgroundValue )
+  {
+    Grid grid( image, radius, 0 );
+
+    std::vector<unsigned char> foreground;
+    GetForeground( image, foregroundValue, grid, foreground );
+
+    std::vector<unsigned char> eroded;
+    grid.Erode( foreground, eroded );
+    std::vector<unsigned char> opened;
+    grid.Dilate( eroded, opened );
+
+    typename TImage::Pointer output = AllocImage<TImage>( image );
+    const typename TImage::PixelType *in = image->GetBufferPointer();
+    typename TImage::PixelType *      out = output->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < grid.m_NumberOfPixels; n++ )
+      {
+      if( opened[n] )
+        {
+        out[n] = foregroundValue;
+        }
+      else
+        {
+        out[n] = foreground[n] ? backgroundValue : in[n];
+        }
+      }
+    return output;
+  }
+
+  /** The closing is computed on the image padded by the radius with
+   * background, so that the foreground is not closed against the edges of the
+   * image.  As in BinaryMorphologicalClosingImageFilter, the voxels covered by
+   * the dilation but not by the closing are set to zero (or to the largest
+   * value when the foreground is zero). */
+  template <class TImage>
+  static typename TImage::Pointer Close( const TImage *image, unsigned long radius,
+                                         typename TImage::PixelType foregroundValue )
+  {
+    typedef typename TImage::PixelType PixelType;
+
+    PixelType backgroundValue = itk::NumericTraits<PixelType>::ZeroValue();
+    if( foregroundValue == backgroundValue )
+      {
+      backgroundValue = itk::NumericTraits<PixelType>::max();
+      }
+
+    Grid grid( image, radius, radius );
+
+    std::vector<unsigned char> foreground;
+    GetForeground( image, foregroundValue, grid, foreground );
+
+    std::vector<unsigned char> dilated;
+    grid.Dilate( foreground, dilated );
+    std::vector<unsigned char> closed;
+    grid.Erode( dilated, closed );
+
+    typename TImage::Pointer output = AllocImage<TImage>( image );
+    const PixelType *in = image->GetBufferPointer();
+    PixelType *      out = output->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < grid.m_NumberOfPixels; n++ )
+      {
+      const itk::SizeValueType g = grid.GridOffset( n );
+      if( closed[g] || foreground[g] )
+        {
+        out[n] = foregroundValue;
+        }
+      else
+        {
+        out[n] = dilated[g] ? backgroundValue : in[n];
+        }
+      }
+    return output;
+  }
+
+private:
+  BinaryBallMorphology();
+
+  struct ThreadStruct
+    {
+    unsigned int *                  Distance;
+    unsigned int                    Cap;
+    std::vector<itk::SizeValueType> Size;
+    unsigned int                    Axis;
+    itk::SizeValueType              Stride;
+    itk::SizeValueType              NumberOfLines;
+    };
+
+  /** the lower envelope of the parabolas rooted at the voxels of each line
+   * along Axis, skipping those at the cap, which cannot lower any distance
+   * below it */
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct *                        str = static_cast<ThreadStruct *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfLines * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfLines * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    const unsigned int       dimension = str->Size.size();
+    const long               length = str->Size[str->Axis];
+
+    std::vector<long>   f( length );
+    std::vector<long>   v( length );
+    std::vector<double> z( length + 1 );
+    for( itk::SizeValueType line = first; line < last; line++ )
+      {
+      // the first voxel of the line, from its index on the other axes
+      itk::SizeValueType offset = 0;
+      itk::SizeValueType stride = 1;
+      itk::SizeValueType remainder = line;
+      for( unsigned int d = 0; d < dimension; d++ )
+        {
+        if( d != str->Axis )
+          {
+          offset += ( remainder % str->Size[d] ) * stride;
+          remainder /= str->Size[d];
+          }
+        stride *= str->Size[d];
+        }
+      unsigned int *distance = str->Distance + offset;
+
+      long k = -1;
+      for( long q = 0; q < length; q++ )
+        {
+        f[q] = distance[q * str->Stride];
+        if( f[q] >= static_cast<long>( str->Cap ) )
+          {
+          continue;
+          }
+        double s = 0.0;
+        while( k >= 0 )
+          {
+          s = static_cast<double>( ( f[q] + q * q ) - ( f[v[k]] + v[k] * v[k] ) ) / ( 2 * ( q - v[k] ) );
+          if( s > z[k] )
+            {
+            break;
+            }
+          k--;
+          }
+        k++;
+        v[k] = q;
+        z[k] = ( k == 0 ) ? -itk::NumericTraits<double>::max() : s;
+        z[k + 1] = itk::NumericTraits<double>::max();
+        }
+      if( k < 0 )
+        {
+        continue;
+        }
+
+      k = 0;
+      for( long q = 0; q < length; q++ )
+        {
+        while( z[k + 1] < q )
+          {
+          k++;
+          }
+        const long d = ( q - v[k] ) * ( q - v[k] ) + f[v[k]];
+        distance[q * str->Stride] = static_cast<unsigned int>( std::min( d, static_cast<long>( str->Cap ) ) );
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** the voxels of the image, padded by a border of Padding voxels on each
+   * side, on which the sets are held as one byte per voxel */
+  class Grid
+  {
+public:
+    template <class TImage>
+    Grid( const TImage *image, unsigned long radius, unsigned long padding ) :
+      m_ImageSize( TImage::ImageDimension ),
+      m_Size( TImage::ImageDimension ),
+      m_Padding( padding ),
+      m_NumberOfPixels( 1 ),
+      m_NumberOfGridPixels( 1 )
+    {
+      const typename TImage::SizeType & size = image->GetBufferedRegion().GetSize();
+
+      for( unsigned int d = 0; d < TImage::ImageDimension; d++ )
+        {
+        m_ImageSize[d] = size[d];
+        m_Size[d] = size[d] + 2 * padding;
+        m_NumberOfPixels *= m_ImageSize[d];
+        m_NumberOfGridPixels *= m_Size[d];
+        }
+      m_SquaredRadius = static_cast<unsigned int>( radius * radius + radius );
+    }
+
+    /** the offset on the grid of the n-th voxel of the image */
+    itk::SizeValueType GridOffset( itk::SizeValueType n ) const
+    {
+      if( m_Padding == 0 )
+        {
+        return n;
+        }
+      itk::SizeValueType offset = 0;
+      itk::SizeValueType stride = 1;
+      for( unsigned int d = 0; d < m_Size.size(); d++ )
+        {
+        offset += ( n % m_ImageSize[d] + m_Padding ) * stride;
+        n /= m_ImageSize[d];
+        stride *= m_Size[d];
+        }
+      return offset;
+    }
+
+    /** the voxels within the ball of a voxel of the set */
+    void Dilate( const std::vector<unsigned char> & set, std::vector<unsigned char> & dilated ) const
+    {
+      std::vector<unsigned int> distance( m_NumberOfGridPixels );
+      for( itk::SizeValueType n = 0; n < m_NumberOfGridPixels; n++ )
+        {
+        distance[n] = set[n] ? 0 : m_SquaredRadius + 1;
+        }
+      ComputeSquaredDistances( distance );
+
+      dilated.resize( m_NumberOfGridPixels );
+      for( itk::SizeValueType n = 0; n < m_NumberOfGridPixels; n++ )
+        {
+        dilated[n] = ( distance[n] <= m_SquaredRadius );
+        }
+    }
+
+    /** the voxels of the set whose ball holds no voxel of the grid outside of
+     * the set; beyond the grid counts as the set, as in BinaryErodeImageFilter */
+    void Erode( const std::vector<unsigned char> & set, std::vector<unsigned char> & eroded ) const
+    {
+      std::vector<unsigned int> distance( m_NumberOfGridPixels );
+      for( itk::SizeValueType n = 0; n < m_NumberOfGridPixels; n++ )
+        {
+        distance[n] = set[n] ? m_SquaredRadius + 1 : 0;
+        }
+      ComputeSquaredDistances( distance );
+
+      eroded.resize( m_NumberOfGridPixels );
+      for( itk::SizeValueType n = 0; n < m_NumberOfGridPixels; n++ )
+        {
+        eroded[n] = ( distance[n] > m_SquaredRadius );
+        }
+    }
+
+    std::vector<itk::SizeValueType> m_ImageSize;
+    std::vector<itk::SizeValueType> m_Size;
+    itk::SizeValueType              m_Padding;
+    itk::SizeValueType              m_NumberOfPixels;
+    itk::SizeValueType              m_NumberOfGridPixels;
+    unsigned int                    m_SquaredRadius;
+private:
+    void ComputeSquaredDistances( std::vector<unsigned int> & distance ) const
+    {
+      ThreadStruct str;
+
+      str.Distance = &distance[0];
+      str.Cap = m_SquaredRadius + 1;
+      str.Size = m_Size;
+
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      const unsigned int          maximumNumberOfThreads = threader->GetNumberOfThreads();
+      itk::SizeValueType          stride = 1;
+      for( unsigned int d = 0; d < m_Size.size(); d++ )
+        {
+        str.Axis = d;
+        str.Stride = stride;
+        str.NumberOfLines = m_NumberOfGridPixels / m_Size[d];
+        threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                            maximumNumberOfThreads ), str.NumberOfLines ),
+                                                static_cast<itk::SizeValueType>( 1 ) ) );
+        threader->SetSingleMethod( ThreaderCallback, &str );
+        threader->SingleMethodExecute();
+        stride *= m_Size[d];
+        }
+    }
+  };
+
+  template <class TImage>
+  static void GetForeground( const TImage *image, typename TImage::PixelType foregroundValue,
+                             const Grid & grid, std::vector<unsigned char> & foreground )
+  {
+    const typename TImage::PixelType *in = image->GetBufferPointer();
+
+    foreground.assign( grid.m_NumberOfGridPixels, 0 );
+    for( itk::SizeValueType n = 0; n < grid.m_NumberOfPixels; n++ )
+      {
+      foreground[grid.GridOffset( n )] = ( in[n] == foregroundValue );
+      }
+  }
+};
+} // namespace ants
+
+#endif // antsBinaryBallMorphology_h
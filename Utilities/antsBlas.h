@@ -0,0 +1,117 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsBlas_h
+#define antsBlas_h
+
+/** Thin wrappers of the BLAS matrix products, compiled in when ANTs is
+ * configured with ANTS_USE_BLAS (see ANTS.cmake).  The Fortran interface is
+ * declared here so that no vendor header (cblas.h, mkl_cblas.h) is needed,
+ * which keeps OpenBLAS, MKL and the reference BLAS interchangeable.
+ *
+ * The wrappers take row-major matrices, as stored by vnl_matrix, and
+ * forward them as the column-major transposes BLAS expects.
+ */
+#if defined( ANTS_USE_BLAS )
+
+extern "C" {
+void sgemv_( const char *trans, const int *m, const int *n, const float *alpha, const float *a,
+             const int *lda, const float *x, const int *incx, const float *beta, float *y, const int *incy );
+void dgemv_( const char *trans, const int *m, const int *n, const double *alpha, const double *a,
+             const int *lda, const double *x, const int *incx, const double *beta, double *y, const int *incy );
+void sgemm_( const char *transa, const char *transb, const int *m, const int *n, const int *k,
+             const float *alpha, const float *a, const int *lda, const float *b, const int *ldb,
+             const float *beta, float *c, const int *ldc );
+void dgemm_( const char *transa, const char *transb, const int *m, const int *n, const int *k,
+             const double *alpha, const double *a, const int *lda, const double *b, const int *ldb,
+             const double *beta, double *c, const int *ldc );
+}
+
+namespace ants
+{
+namespace blas
+{
+inline void gemv( const char trans, int m, int n, const float *a, int lda, const float *x, float *y )
+{
+  const float alpha = 1;
+  const float beta = 0;
+  const int   inc = 1;
+
+  sgemv_( &trans, &m, &n, &alpha, a, &lda, x, &inc, &beta, y, &inc );
+}
+
+inline void gemv( const char trans, int m, int n, const double *a, int lda, const double *x, double *y )
+{
+  const double alpha = 1;
+  const double beta = 0;
+  const int    inc = 1;
+
+  dgemv_( &trans, &m, &n, &alpha, a, &lda, x, &inc, &beta, y, &inc );
+}
+
+inline void gemm( const char transa, const char transb, int m, int n, int k, const float *a, int lda,
+                  const float *b, int ldb, float *c, int ldc )
+{
+  const float alpha = 1;
+  const float beta = 0;
+
+  sgemm_( &transa, &transb, &m, &n, &k, &alpha, a, &lda, b, &ldb, &beta, c, &ldc );
+}
+
+inline void gemm( const char transa, const char transb, int m, int n, int k, const double *a, int lda,
+                  const double *b, int ldb, double *c, int ldc )
+{
+  const double alpha = 1;
+  const double beta = 0;
+
+  dgemm_( &transa, &transb, &m, &n, &k, &alpha, a, &lda, b, &ldb, &beta, c, &ldc );
+}
+
+/** y = A x for the row-major rows x cols matrix A. */
+template <class TReal>
+void RowMajorMatrixVectorProduct( unsigned int rows, unsigned int cols, const TReal *A, const TReal *x, TReal *y )
+{
+  gemv( 'T', cols, rows, A, cols, x, y );
+}
+
+/** y = A^T x for the row-major rows x cols matrix A. */
+template <class TReal>
+void RowMajorMatrixTransposeVectorProduct( unsigned int rows, unsigned int cols, const TReal *A, const TReal *x,
+                                           TReal *y )
+{
+  gemv( 'N', cols, rows, A, cols, x, y );
+}
+
+/** C = A B^T for the row-major matrices A ( m x n ) and B ( p x n ). */
+template <class TReal>
+void RowMajorMatrixMatrixTransposeProduct( unsigned int m, unsigned int n, unsigned int p, const TReal *A,
+                                           const TReal *B, TReal *C )
+{
+  // C^T = B A^T in column-major terms
+  gemm( 'T', 'N', p, m, n, B, n, A, n, C, p );
+}
+
+/** C = A^T B for the row-major matrices A ( m x n ) and B ( m x p ). */
+template <class TReal>
+void RowMajorMatrixTransposeMatrixProduct( unsigned int m, unsigned int n, unsigned int p, const TReal *A,
+                                           const TReal *B, TReal *C )
+{
+  // C^T = B^T A in column-major terms
+  gemm( 'N', 'T', p, n, m, B, p, A, n, C, p );
+}
+} // namespace blas
+} // namespace ants
+
+#endif // ANTS_USE_BLAS
+
+#endif // antsBlas_h
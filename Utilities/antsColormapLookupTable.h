@@ -0,0 +1,203 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsColormapLookupTable_h
+#define antsColormapLookupTable_h
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/** An itk::Function::ColormapFunction baked into a table of NumberOfEntries
+ * colors, evenly spaced over the input range of the colormap, each one the
+ * color of the center of its bin.  Values below or above the range take the
+ * first or last color, as does the colormap.  The table is the colormap to
+ * within 1/4096 of the input range, i.e. a difference of at most one in a
+ * component for the colormaps which vary by less than 16 levels per bin.
+ *
+ * Apply() colors an image in a single threaded pass over its buffer, with
+ * the voxels outside of a mask on the same grid set to zero.
+ */
+template <class TRGBPixel>
+class ColormapLookupTable
+{
+public:
+  typedef TRGBPixel PixelType;
+
+  enum { NumberOfEntries = 4096 };
+
+  ColormapLookupTable() : m_Minimum( 0.0 ), m_Scale( 0.0 ), m_Table( NumberOfEntries )
+  {
+  }
+
+  /** The colors of the colormap over its minimum and maximum input values. */
+  template <class TColormap>
+  void Build( const TColormap *colormap )
+  {
+    typedef typename TColormap::ScalarType ScalarType;
+
+    const double minimum = static_cast<double>( colormap->GetMinimumInputValue() );
+    const double range = static_cast<double>( colormap->GetMaximumInputValue() ) - minimum;
+
+    this->m_Minimum = minimum;
+    this->m_Scale = ( range > 0.0 ) ? static_cast<double>( NumberOfEntries ) / range : 0.0;
+    for( unsigned int n = 0; n < NumberOfEntries; n++ )
+      {
+      const double value = ( range > 0.0 ) ?
+        minimum + ( n + 0.5 ) * range / static_cast<double>( NumberOfEntries ) : minimum;
+      this->m_Table[n] = ( *colormap )( static_cast<ScalarType>( value ) );
+      }
+  }
+
+  const PixelType & Lookup( double value ) const
+  {
+    const double bin = ( value - this->m_Minimum ) * this->m_Scale;
+    if( !( bin > 0.0 ) )
+      {
+      return this->m_Table[0];
+      }
+    if( bin >= static_cast<double>( NumberOfEntries ) )
+      {
+      return this->m_Table[NumberOfEntries - 1];
+      }
+    return this->m_Table[static_cast<unsigned int>( bin )];
+  }
+
+  /** output = the colors of image, zero where mask is 0.  The mask, if any,
+   * and the output must have the buffered region of the image. */
+  template <class TImage, class TMask, class TRGBImage>
+  void Apply( const TImage *image, const TMask *mask, TRGBImage *output ) const
+  {
+    ThreadStruct<TImage, TMask> str;
+    str.Table = this;
+    str.Values = image->GetBufferPointer();
+    str.Mask = mask ? mask->GetBufferPointer() : ITK_NULLPTR;
+    str.Output = output->GetBufferPointer();
+    str.NumberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfPixels ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    threader->SetSingleMethod( ApplyThreaderCallback<TImage, TMask>, &str );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  template <class TImage, class TMask>
+  struct ThreadStruct
+    {
+    const ColormapLookupTable *         Table;
+    const typename TImage::PixelType *  Values;
+    const typename TMask::PixelType *   Mask;
+    PixelType *                         Output;
+    itk::SizeValueType                  NumberOfPixels;
+    };
+
+  template <class TImage, class TMask>
+  static ITK_THREAD_RETURN_TYPE ApplyThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct<TImage, TMask> *         str = static_cast<ThreadStruct<TImage, TMask> *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    PixelType zero;
+    zero.Fill( itk::NumericTraits<typename PixelType::ComponentType>::ZeroValue() );
+    for( itk::SizeValueType n = first; n < last; n++ )
+      {
+      if( str->Mask && str->Mask[n] == 0 )
+        {
+        str->Output[n] = zero;
+        }
+      else
+        {
+        str->Output[n] = str->Table->Lookup( static_cast<double>( str->Values[n] ) );
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  double                 m_Minimum;
+  double                 m_Scale;
+  std::vector<PixelType> m_Table;
+};
+
+/** The channels of a custom colormap. */
+struct CustomColormapChannels
+  {
+  std::vector<double> Red;
+  std::vector<double> Green;
+  std::vector<double> Blue;
+  };
+
+/** The red, green and blue channels of a custom colormap file, e.g. those of
+ * Examples/CustomColormaps:  three lines of values in [0, 1].  The files are
+ * parsed once and kept for the life of the process, so the tools run from the
+ * library, or over a batch of images, do not read them again.  Returns false
+ * if the file cannot be read. */
+inline bool GetCustomColormapChannels( const std::string & fileName, CustomColormapChannels & channels )
+{
+  typedef std::map<std::string, CustomColormapChannels> CacheType;
+
+  static itk::SimpleFastMutexLock cacheMutex;
+  static CacheType                cache;
+
+  cacheMutex.Lock();
+  CacheType::const_iterator it = cache.find( fileName );
+  if( it != cache.end() )
+    {
+    channels = it->second;
+    cacheMutex.Unlock();
+    return true;
+    }
+  cacheMutex.Unlock();
+
+  std::ifstream str( fileName.c_str() );
+  if( !str )
+    {
+    return false;
+    }
+  std::vector<double> *channel[3] = { &channels.Red, &channels.Green, &channels.Blue };
+  for( unsigned int c = 0; c < 3; c++ )
+    {
+    channel[c]->clear();
+
+    std::string line;
+    std::getline( str, line );
+    std::istringstream iss( line );
+    double             value;
+    while( iss >> value )
+      {
+      channel[c]->push_back( value );
+      }
+    }
+
+  cacheMutex.Lock();
+  cache[fileName] = channels;
+  cacheMutex.Unlock();
+  return true;
+}
+} // namespace ants
+
+#endif // antsColormapLookupTable_h
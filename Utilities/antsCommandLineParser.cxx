@@ -13,6 +13,10 @@
 #include "antsCommandLineParser.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cfloat>
+#include <climits>
+#include <cstdlib>
 
 namespace itk
 {
@@ -64,6 +68,14 @@ CommandLineParser
            !this->GetOption( option->GetLongName() ) ) )
     {
     this->m_Options.push_back( option );
+    if( option->GetShortName() != '\0' )
+      {
+      this->m_ShortNameMap.insert( ShortNameMapType::value_type( option->GetShortName(), option ) );
+      }
+    if( !option->GetLongName().empty() )
+      {
+      this->m_LongNameMap.insert( LongNameMapType::value_type( option->GetLongName(), option ) );
+      }
     }
   else
     {
@@ -92,9 +104,22 @@ CommandLineParser
 int
 CommandLineParser
 ::Parse( unsigned int argc, char * *argv )
+{
+  std::vector<std::string> args;
+  args.reserve( argc );
+  for( unsigned int n = 0; n < argc; n++ )
+    {
+    args.push_back( std::string( argv[n] ) );
+    }
+  return this->Parse( args );
+}
+
+int
+CommandLineParser
+::Parse( const std::vector<std::string> & args )
 {
   std::vector<std::string> arguments =
-    this->RegroupCommandLineArguments( argc, argv );
+    this->RegroupCommandLineArguments( args );
 
   unsigned int n = 0;
   unsigned int order = 0;
@@ -210,7 +235,7 @@ CommandLineParser
 
 std::vector<std::string>
 CommandLineParser
-::RegroupCommandLineArguments( unsigned int argc, char * *argv )
+::RegroupCommandLineArguments( const std::vector<std::string> & args )
 {
   /**
    * Inclusion of this function allows the user to use spaces inside
@@ -222,9 +247,9 @@ CommandLineParser
   std::string currentArg( "" );
   bool        isArgOpen = false;
 
-  for( unsigned int n = 0; n < argc; n++ )
+  for( unsigned int n = 0; n < args.size(); n++ )
     {
-    std::string a( argv[n] );
+    std::string a( args[n] );
 
     if( n == 0 )
       {
@@ -323,13 +348,10 @@ CommandLineParser
     return this->GetOption( name.at( 0 ) );
     }
 
-  OptionListType::iterator it;
-  for( it = this->m_Options.begin(); it != this->m_Options.end(); ++it )
+  LongNameMapType::const_iterator it = this->m_LongNameMap.find( name );
+  if( it != this->m_LongNameMap.end() )
     {
-    if( name.compare( (*it)->GetLongName() ) == 0 )
-      {
-      return *it;
-      }
+    return it->second;
     }
   return ITK_NULLPTR;
 }
@@ -338,14 +360,10 @@ CommandLineParser::OptionType::Pointer
 CommandLineParser
 ::GetOption( char name )
 {
-  OptionListType::iterator it;
-
-  for( it = this->m_Options.begin(); it != this->m_Options.end(); ++it )
+  ShortNameMapType::const_iterator it = this->m_ShortNameMap.find( name );
+  if( it != this->m_ShortNameMap.end() )
     {
-    if( name == (*it)->GetShortName() )
-      {
-      return *it;
-      }
+    return it->second;
     }
   return ITK_NULLPTR;
 }
@@ -354,18 +372,9 @@ bool
 CommandLineParser::
 ValidateFlag(const std::string & currentFlag)
 {
-  bool validFlagFound = false;
-  for( OptionListType::const_iterator it = this->m_Options.begin(); it != this->m_Options.end(); ++it )
-    {
-    const char shortName = (*it)->GetShortName();
-    const std::string longName  = (*it)->GetLongName();
-    if( (    ( currentFlag.size() == 1 ) &&
-             ( shortName == currentFlag[0] ) )
-          || ( longName == currentFlag ) )
-      {
-      validFlagFound = true;
-      }
-    }
+  const bool validFlagFound =
+    ( currentFlag.size() == 1 && this->m_ShortNameMap.find( currentFlag[0] ) != this->m_ShortNameMap.end() )
+    || this->m_LongNameMap.find( currentFlag ) != this->m_LongNameMap.end();
 
   if ( ( ! validFlagFound ) && ( currentFlag.size() > 0 ))
     {
@@ -626,6 +635,128 @@ CommandLineParser
     }
 }
 
+namespace
+{
+/** only the characters of a decimal number, so that strtod does not accept
+ * the "inf", "nan" or hexadecimal forms a stringstream rejects */
+bool IsDecimalNumber( const std::string & s, bool isInteger )
+{
+  const char *allowed = isInteger ? "0123456789+- \t\n\r" : "0123456789+-.eE \t\n\r";
+
+  return !s.empty() && s.find_first_not_of( allowed ) == std::string::npos;
+}
+
+bool ParseDouble( const std::string & s, double & value )
+{
+  if( !IsDecimalNumber( s, false ) )
+    {
+    return false;
+    }
+  const char *begin = s.c_str();
+  char *      end = ITK_NULLPTR;
+  errno = 0;
+  value = std::strtod( begin, &end );
+  return end != begin && *end == '\0' && errno != ERANGE;
+}
+
+bool ParseLong( const std::string & s, long & value )
+{
+  if( !IsDecimalNumber( s, true ) )
+    {
+    return false;
+    }
+  const char *begin = s.c_str();
+  char *      end = ITK_NULLPTR;
+  errno = 0;
+  value = std::strtol( begin, &end, 10 );
+  return end != begin && *end == '\0' && errno != ERANGE;
+}
+
+/** as a stream, a negative value is negated in the unsigned type */
+bool ParseUnsignedLong( const std::string & s, unsigned long & value, bool & negative )
+{
+  if( !IsDecimalNumber( s, true ) )
+    {
+    return false;
+    }
+  const char *begin = s.c_str();
+  char *      end = ITK_NULLPTR;
+  errno = 0;
+  value = std::strtoul( begin, &end, 10 );
+  negative = ( s.find( '-' ) != std::string::npos );
+  return end != begin && *end == '\0' && errno != ERANGE;
+}
+} // end anonymous namespace
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, double & value )
+{
+  return ParseDouble( optionString, value );
+}
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, float & value )
+{
+  double v = 0.0;
+  if( !ParseDouble( optionString, v ) || v > FLT_MAX || v < -FLT_MAX )
+    {
+    return false;
+    }
+  value = static_cast<float>( v );
+  return true;
+}
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, long & value )
+{
+  return ParseLong( optionString, value );
+}
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, int & value )
+{
+  long v = 0;
+  if( !ParseLong( optionString, v ) || v > INT_MAX || v < INT_MIN )
+    {
+    return false;
+    }
+  value = static_cast<int>( v );
+  return true;
+}
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, unsigned long & value )
+{
+  bool negative = false;
+
+  return ParseUnsignedLong( optionString, value, negative );
+}
+
+bool
+CommandLineParser
+::ParseValue( const std::string & optionString, unsigned int & value )
+{
+  unsigned long v = 0;
+  bool          negative = false;
+  if( !ParseUnsignedLong( optionString, v, negative ) )
+    {
+    return false;
+    }
+  const unsigned long magnitude = negative ? static_cast<unsigned long>( 0 ) - v : v;
+  if( magnitude > UINT_MAX )
+    {
+    return false;
+    }
+  value = negative ? static_cast<unsigned int>( 0 ) - static_cast<unsigned int>( magnitude ) :
+    static_cast<unsigned int>( magnitude );
+  return true;
+}
+
 /**
  * Standard "PrintSelf" method
  */
@@ -21,6 +21,7 @@
 #include "itkNumericTraits.h"
 
 #include <list>
+#include <map>
 #include <sstream>
 #include <stdio.h>
 #include <string>
@@ -78,6 +79,11 @@ public:
 
   bool starts_with( const std::string &, const std::string & );
   int Parse( unsigned int, char * * );
+
+  /** Parse arguments that are already strings, e.g. those of the library
+   * entry points, without copying them into an argv array first.  The first
+   * argument is the command name. */
+  int Parse( const std::vector<std::string> & );
   bool ValidateFlag(const std::string & currentFlag);
 
   void AddOption( OptionType::Pointer );
@@ -114,11 +120,8 @@ public:
     {
     //Strip whitespace at end
     optionString.erase(optionString.find_last_not_of(" \n\r\t")+1);
-    TValue             value;
-    std::istringstream iss( optionString );
-    if (!(iss >> value)  //Conversion did not fail
-      || !( iss.peek() == EOF ) // All content parsed
-    )
+    TValue value;
+    if( !Self::ParseValue( optionString, value ) )
       {
       std::string internalTypeName( typeid(value).name() );
       itkExceptionMacro( "ERROR: Parse error occured during command line argument processing\n"
@@ -164,13 +167,40 @@ private:
   CommandLineParser( const Self & ); // purposely not implemented
   void operator=( const Self & );    // purposely not implemented
 
-  std::vector<std::string> RegroupCommandLineArguments( unsigned int, char * * );
+  std::vector<std::string> RegroupCommandLineArguments( const std::vector<std::string> & );
+
+  /** The whole string has to convert to the value.  The common numeric
+   * types are converted with strtod/strtol rather than a stringstream. */
+  template <class TValue>
+  static bool ParseValue( const std::string & optionString, TValue & value )
+  {
+    std::istringstream iss( optionString );
+    return ( iss >> value ) && iss.peek() == EOF;
+  }
+
+  static bool ParseValue( const std::string &, double & );
+
+  static bool ParseValue( const std::string &, float & );
+
+  static bool ParseValue( const std::string &, int & );
+
+  static bool ParseValue( const std::string &, long & );
+
+  static bool ParseValue( const std::string &, unsigned int & );
+
+  static bool ParseValue( const std::string &, unsigned long & );
 
   std::string BreakUpStringIntoNewLines( std::string, const std::string, unsigned int ) const;
 
   void TokenizeString( std::string, std::vector<std::string> &, std::string ) const;
 
   OptionListType m_Options;
+
+  /** lookup of the options by name, the first option added for a name wins */
+  typedef std::map<char, OptionType::Pointer>        ShortNameMapType;
+  typedef std::map<std::string, OptionType::Pointer> LongNameMapType;
+  ShortNameMapType m_ShortNameMap;
+  LongNameMapType  m_LongNameMap;
   std::string    m_Command;
   std::string    m_CommandDescription;
   OptionListType m_UnknownOptions;
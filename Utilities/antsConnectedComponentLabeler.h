@@ -0,0 +1,594 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsConnectedComponentLabeler_h
+#define __antsConnectedComponentLabeler_h
+
+#include "itkImage.h"
+#include "itkMacro.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace ants
+{
+/** \class ConnectedComponentLabeler
+ *
+ * Labels the connected components of the foreground of an image and
+ * collects their statistics in the same pass, in place of the
+ * ConnectedComponentImageFilter, RelabelComponentImageFilter and the loops
+ * over the labels that followed them.
+ *
+ * The image is cut into slabs along its last dimension; each thread joins
+ * the voxels of its slab with a union-find, then the slabs are joined
+ * across their borders.  The root of a component is its first voxel in
+ * raster order, so the components come out as the filters number them:
+ * by decreasing size, ties in the order of their first voxel, with the
+ * components smaller than MinimumComponentSize removed.
+ *
+ * A voxel is foreground if it is >= LowerThreshold, or != 0 when no
+ * threshold is set.  With ConnectEqualValuesOnly, neighbors are only
+ * joined if they have the same value, i.e. each label of a label image is
+ * split into its connected parts.
+ *
+ * ComputeMaximumComponentSizes gives the largest component at each of a
+ * list of thresholds from a single sweep over the voxels sorted by value,
+ * merging the components as the threshold decreases (the component tree of
+ * the image), as needed for cluster extent permutation tests.
+ */
+template <class TImage, class TLabelImage = itk::Image<unsigned long, TImage::ImageDimension> >
+class ConnectedComponentLabeler
+{
+public:
+  typedef TImage                                ImageType;
+  typedef typename ImageType::PixelType         PixelType;
+  typedef TLabelImage                           LabelImageType;
+  typedef typename LabelImageType::Pointer      LabelImagePointer;
+  typedef typename LabelImageType::PixelType    LabelType;
+  typedef typename ImageType::OffsetValueType   OffsetValueType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  struct ComponentStatistics
+    {
+    unsigned long   NumberOfVoxels;
+    double          Sum;           // of the value image
+    double          Maximum;       // of the value image
+    OffsetValueType MaximumOffset; // the first voxel with the Maximum
+    OffsetValueType FirstOffset;   // the first voxel in raster order
+    };
+
+  ConnectedComponentLabeler() :
+    m_FullyConnected( false ),
+    m_UseLowerThreshold( false ),
+    m_LowerThreshold( 0 ),
+    m_ConnectEqualValuesOnly( false ),
+    m_MinimumComponentSize( 0 ),
+    m_NumberOfThreads( 0 )
+  {
+  }
+
+  void SetInput( const ImageType *image )
+  {
+    this->m_Input = image;
+  }
+
+  /** The image the statistics are taken of; the input if not set. */
+  void SetValueImage( const ImageType *image )
+  {
+    this->m_ValueImage = image;
+  }
+
+  void SetFullyConnected( bool fullyConnected )
+  {
+    this->m_FullyConnected = fullyConnected;
+  }
+
+  void SetLowerThreshold( double threshold )
+  {
+    this->m_LowerThreshold = threshold;
+    this->m_UseLowerThreshold = true;
+  }
+
+  void SetConnectEqualValuesOnly( bool equalOnly )
+  {
+    this->m_ConnectEqualValuesOnly = equalOnly;
+  }
+
+  void SetMinimumComponentSize( unsigned long size )
+  {
+    this->m_MinimumComponentSize = size;
+  }
+
+  /** 0 uses the ITK global default number of threads. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  /** The components, numbered from 1, 0 for background. */
+  LabelImageType * GetOutput() const
+  {
+    return this->m_Output.GetPointer();
+  }
+
+  unsigned long GetNumberOfComponents() const
+  {
+    return this->m_Statistics.size() - 1;
+  }
+
+  /** The statistics of component label, 1 <= label <= GetNumberOfComponents(). */
+  const ComponentStatistics & GetStatistics( unsigned long label ) const
+  {
+    return this->m_Statistics[label];
+  }
+
+  void Update()
+  {
+    this->Initialize();
+
+    const OffsetValueType numberOfVoxels = this->m_NumberOfVoxels;
+    const unsigned int    lastDimension = ImageDimension - 1;
+    this->m_Parents.assign( numberOfVoxels, -1 );
+
+    // the slabs of the threads, a few slices at least
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    const OffsetValueType numberOfSlices = this->m_Size[lastDimension];
+    const OffsetValueType maximumNumberOfSlabs = std::max<OffsetValueType>( 1, numberOfSlices / 4 );
+    numberOfThreads = static_cast<unsigned int>( std::min<OffsetValueType>( numberOfThreads, maximumNumberOfSlabs ) );
+    this->m_SlabBegins.resize( numberOfThreads + 1 );
+    for( unsigned int t = 0; t <= numberOfThreads; t++ )
+      {
+      this->m_SlabBegins[t] = numberOfSlices * t / numberOfThreads;
+      }
+    if( numberOfThreads <= 1 )
+      {
+      this->LabelSlab( 0 );
+      }
+    else
+      {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( Self::LabelThreaderCallback, this );
+      threader->SingleMethodExecute();
+      }
+
+    // join the slabs across their first slices
+    for( unsigned int t = 1; t < numberOfThreads; t++ )
+      {
+      this->JoinSlice( this->m_SlabBegins[t] );
+      }
+
+    // every parent precedes its voxel, so one raster pass finds the roots;
+    // the roots are numbered in the order of their first voxel
+    const PixelType *                values = this->m_ValueImage->GetBufferPointer();
+    std::vector<ComponentStatistics> statistics;
+    std::vector<OffsetValueType> &   parents = this->m_Parents;
+    for( OffsetValueType n = 0; n < numberOfVoxels; n++ )
+      {
+      const OffsetValueType parent = parents[n];
+      if( parent < 0 )
+        {
+        continue;
+        }
+      double value = values[n];
+      if( parent == n )
+        {
+        // from here on the parents hold -2 - the id of the component
+        ComponentStatistics component;
+        component.NumberOfVoxels = 0;
+        component.Sum = 0.0;
+        component.Maximum = value;
+        component.MaximumOffset = n;
+        component.FirstOffset = n;
+        statistics.push_back( component );
+        parents[n] = -static_cast<OffsetValueType>( statistics.size() ) - 1;
+        }
+      else
+        {
+        parents[n] = parents[parent];
+        }
+      ComponentStatistics & component = statistics[-parents[n] - 2];
+      component.NumberOfVoxels++;
+      component.Sum += value;
+      if( value > component.Maximum )
+        {
+        component.Maximum = value;
+        component.MaximumOffset = n;
+        }
+      }
+
+    // number by decreasing size and drop the small components
+    std::vector<unsigned long> order( statistics.size() );
+    for( unsigned long c = 0; c < order.size(); c++ )
+      {
+      order[c] = c;
+      }
+    std::stable_sort( order.begin(), order.end(), SizeComparator( statistics ) );
+    std::vector<LabelType> labels( statistics.size(), 0 );
+    this->m_Statistics.assign( 1, ComponentStatistics() );
+    for( unsigned long c = 0; c < order.size(); c++ )
+      {
+      if( statistics[order[c]].NumberOfVoxels < this->m_MinimumComponentSize )
+        {
+        break;
+        }
+      labels[order[c]] = static_cast<LabelType>( c + 1 );
+      this->m_Statistics.push_back( statistics[order[c]] );
+      }
+
+    this->m_Output = LabelImageType::New();
+    this->m_Output->CopyInformation( this->m_Input );
+    this->m_Output->SetRegions( this->m_Input->GetBufferedRegion() );
+    this->m_Output->Allocate();
+    LabelType *output = this->m_Output->GetBufferPointer();
+    for( OffsetValueType n = 0; n < numberOfVoxels; n++ )
+      {
+      output[n] = parents[n] < -1 ? labels[-parents[n] - 2] : 0;
+      }
+    std::vector<OffsetValueType>().swap( this->m_Parents );
+  }
+
+  /** The size and the sum of the values of the largest component of the
+   * foreground at or above each threshold (the statistics of different
+   * components if they are not the same).  The LowerThreshold, if set,
+   * bounds the thresholds from below as well. */
+  void ComputeMaximumComponentSizes( const std::vector<double> & thresholds, std::vector<unsigned long> & sizes,
+                                     std::vector<double> & sums )
+  {
+    this->Initialize();
+    sizes.assign( thresholds.size(), 0 );
+    sums.assign( thresholds.size(), 0.0 );
+    if( thresholds.empty() )
+      {
+      return;
+      }
+
+    // the thresholds in decreasing order
+    std::vector<std::pair<double, unsigned long> > sorted;
+    for( unsigned long t = 0; t < thresholds.size(); t++ )
+      {
+      sorted.push_back( std::make_pair( thresholds[t], t ) );
+      }
+    std::sort( sorted.begin(), sorted.end(), std::greater<std::pair<double, unsigned long> >() );
+    const double lowest = sorted.back().first;
+
+    // the candidate voxels in decreasing order of value
+    const PixelType *                                values = this->m_Input->GetBufferPointer();
+    const PixelType *                                sumValues = this->m_ValueImage->GetBufferPointer();
+    std::vector<std::pair<PixelType, OffsetValueType> > voxels;
+    for( OffsetValueType n = 0; n < this->m_NumberOfVoxels; n++ )
+      {
+      if( values[n] >= lowest && this->IsForeground( values[n] ) )
+        {
+        voxels.push_back( std::make_pair( values[n], n ) );
+        }
+      }
+    std::sort( voxels.begin(), voxels.end(), std::greater<std::pair<PixelType, OffsetValueType> >() );
+
+    // the parents of the voxels above the current threshold, -1 below; the
+    // roots hold the size and sum of their component
+    this->m_Parents.assign( this->m_NumberOfVoxels, -1 );
+    std::vector<OffsetValueType> & parents = this->m_Parents;
+    std::vector<unsigned long>     rootSizes( this->m_NumberOfVoxels, 0 );
+    std::vector<double>            rootSums( this->m_NumberOfVoxels, 0.0 );
+    unsigned long                  largestSize = 0;
+    double                         largestSum = 0.0;
+    OffsetValueType                position[ImageDimension];
+    size_t                         v = 0;
+    for( unsigned long t = 0; t < sorted.size(); t++ )
+      {
+      for( ; v < voxels.size() && voxels[v].first >= sorted[t].first; v++ )
+        {
+        const OffsetValueType n = voxels[v].second;
+        parents[n] = n;
+        rootSizes[n] = 1;
+        rootSums[n] = sumValues[n];
+        this->GetPosition( n, position );
+        for( unsigned int k = 0; k < this->m_NeighborOffsets.size(); k++ )
+          {
+          if( !this->IsInside( position, this->m_NeighborDeltas[k] ) )
+            {
+            continue;
+            }
+          const OffsetValueType neighbor = n + this->m_NeighborOffsets[k];
+          if( parents[neighbor] < 0 || !this->AreConnected( values, n, neighbor ) )
+            {
+            continue;
+            }
+          OffsetValueType root = this->Find( n );
+          OffsetValueType neighborRoot = this->Find( neighbor );
+          if( root == neighborRoot )
+            {
+            continue;
+            }
+          if( rootSizes[root] < rootSizes[neighborRoot] )
+            {
+            std::swap( root, neighborRoot );
+            }
+          parents[neighborRoot] = root;
+          rootSizes[root] += rootSizes[neighborRoot];
+          rootSums[root] += rootSums[neighborRoot];
+          }
+        const OffsetValueType root = this->Find( n );
+        largestSize = std::max( largestSize, rootSizes[root] );
+        largestSum = std::max( largestSum, rootSums[root] );
+        }
+      sizes[sorted[t].second] = largestSize;
+      sums[sorted[t].second] = largestSum;
+      }
+    std::vector<OffsetValueType>().swap( this->m_Parents );
+  }
+
+private:
+  typedef ConnectedComponentLabeler Self;
+
+  ConnectedComponentLabeler( const Self & ); // purposely not implemented
+  void operator=( const Self & );            // purposely not implemented
+
+  struct SizeComparator
+    {
+    explicit SizeComparator( const std::vector<ComponentStatistics> & statistics ) :
+      Statistics( statistics )
+    {
+    }
+
+    bool operator()( unsigned long a, unsigned long b ) const
+    {
+      return this->Statistics[a].NumberOfVoxels > this->Statistics[b].NumberOfVoxels;
+    }
+
+    const std::vector<ComponentStatistics> & Statistics;
+    };
+
+  void Initialize()
+  {
+    if( this->m_Input.IsNull() )
+      {
+      itkGenericExceptionMacro( "ConnectedComponentLabeler: the input has to be set." );
+      }
+    if( this->m_ValueImage.IsNull() )
+      {
+      this->m_ValueImage = this->m_Input;
+      }
+    if( this->m_ValueImage->GetBufferedRegion() != this->m_Input->GetBufferedRegion() )
+      {
+      itkGenericExceptionMacro( "ConnectedComponentLabeler: the input and value images have different regions." );
+      }
+
+    OffsetValueType stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      this->m_Size[d] = static_cast<OffsetValueType>( this->m_Input->GetBufferedRegion().GetSize()[d] );
+      this->m_Strides[d] = stride;
+      stride *= this->m_Size[d];
+      }
+    this->m_NumberOfVoxels = stride;
+
+    // the neighbors that precede a voxel in raster order
+    this->m_NeighborOffsets.clear();
+    this->m_NeighborDeltas.clear();
+    unsigned int numberOfNeighbors = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      numberOfNeighbors *= 3;
+      }
+    for( unsigned int k = 0; k < numberOfNeighbors; k++ )
+      {
+      Delta           delta;
+      OffsetValueType offset = 0;
+      unsigned int    nonzero = 0;
+      unsigned int    code = k;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        delta.Values[d] = static_cast<int>( code % 3 ) - 1;
+        code /= 3;
+        offset += delta.Values[d] * this->m_Strides[d];
+        nonzero += ( delta.Values[d] != 0 );
+        }
+      if( offset < 0 && ( this->m_FullyConnected || nonzero == 1 ) )
+        {
+        this->m_NeighborOffsets.push_back( offset );
+        this->m_NeighborDeltas.push_back( delta );
+        }
+      }
+    // the sweep of ComputeMaximumComponentSizes needs the neighbors on both sides
+    const size_t numberOfPreceding = this->m_NeighborOffsets.size();
+    for( size_t k = 0; k < numberOfPreceding; k++ )
+      {
+      Delta delta = this->m_NeighborDeltas[k];
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        delta.Values[d] = -delta.Values[d];
+        }
+      this->m_NeighborOffsets.push_back( -this->m_NeighborOffsets[k] );
+      this->m_NeighborDeltas.push_back( delta );
+      }
+    this->m_NumberOfPrecedingNeighbors = numberOfPreceding;
+  }
+
+  struct Delta
+    {
+    int Values[ImageDimension];
+    };
+
+  bool IsForeground( PixelType value ) const
+  {
+    if( this->m_UseLowerThreshold )
+      {
+      return value >= this->m_LowerThreshold;
+      }
+    return value != 0;
+  }
+
+  bool AreConnected( const PixelType *values, OffsetValueType a, OffsetValueType b ) const
+  {
+    return !this->m_ConnectEqualValuesOnly || values[a] == values[b];
+  }
+
+  void GetPosition( OffsetValueType offset, OffsetValueType *position ) const
+  {
+    for( int d = ImageDimension - 1; d >= 0; d-- )
+      {
+      position[d] = offset / this->m_Strides[d];
+      offset -= position[d] * this->m_Strides[d];
+      }
+  }
+
+  bool IsInside( const OffsetValueType *position, const Delta & delta ) const
+  {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const OffsetValueType p = position[d] + delta.Values[d];
+      if( p < 0 || p >= this->m_Size[d] )
+        {
+        return false;
+        }
+      }
+    return true;
+  }
+
+  /** The root of n, halving the path on the way. */
+  OffsetValueType Find( OffsetValueType n )
+  {
+    std::vector<OffsetValueType> & parents = this->m_Parents;
+    while( parents[n] != n )
+      {
+      parents[n] = parents[parents[n]];
+      n = parents[n];
+      }
+    return n;
+  }
+
+  /** Join the components of a and b under the smaller of the roots. */
+  void Union( OffsetValueType a, OffsetValueType b )
+  {
+    const OffsetValueType ra = this->Find( a );
+    const OffsetValueType rb = this->Find( b );
+    if( ra < rb )
+      {
+      this->m_Parents[rb] = ra;
+      }
+    else if( rb < ra )
+      {
+      this->m_Parents[ra] = rb;
+      }
+  }
+
+  /** Union-find over the voxels of slab t; only touches the voxels of
+   * the slab. */
+  void LabelSlab( unsigned int t )
+  {
+    const unsigned int    lastDimension = ImageDimension - 1;
+    const OffsetValueType sliceBegin = this->m_SlabBegins[t];
+    const OffsetValueType sliceEnd = this->m_SlabBegins[t + 1];
+    const OffsetValueType begin = sliceBegin * this->m_Strides[lastDimension];
+    const OffsetValueType end = sliceEnd * this->m_Strides[lastDimension];
+    const PixelType *     values = this->m_Input->GetBufferPointer();
+    OffsetValueType       position[ImageDimension];
+    for( OffsetValueType n = begin; n < end; n++ )
+      {
+      if( !this->IsForeground( values[n] ) )
+        {
+        continue;
+        }
+      this->m_Parents[n] = n;
+      this->GetPosition( n, position );
+      for( unsigned int k = 0; k < this->m_NumberOfPrecedingNeighbors; k++ )
+        {
+        const Delta & delta = this->m_NeighborDeltas[k];
+        if( position[lastDimension] + delta.Values[lastDimension] < sliceBegin
+            || !this->IsInside( position, delta ) )
+          {
+          continue;
+          }
+        const OffsetValueType neighbor = n + this->m_NeighborOffsets[k];
+        if( this->m_Parents[neighbor] >= 0 && this->AreConnected( values, n, neighbor ) )
+          {
+          this->Union( n, neighbor );
+          }
+        }
+      }
+  }
+
+  /** Join the voxels of slice to their neighbors in the slice before. */
+  void JoinSlice( OffsetValueType slice )
+  {
+    const unsigned int    lastDimension = ImageDimension - 1;
+    const OffsetValueType begin = slice * this->m_Strides[lastDimension];
+    const OffsetValueType end = begin + this->m_Strides[lastDimension];
+    const PixelType *     values = this->m_Input->GetBufferPointer();
+    OffsetValueType       position[ImageDimension];
+    for( OffsetValueType n = begin; n < end; n++ )
+      {
+      if( this->m_Parents[n] < 0 )
+        {
+        continue;
+        }
+      this->GetPosition( n, position );
+      for( unsigned int k = 0; k < this->m_NumberOfPrecedingNeighbors; k++ )
+        {
+        const Delta & delta = this->m_NeighborDeltas[k];
+        if( delta.Values[lastDimension] == 0 || !this->IsInside( position, delta ) )
+          {
+          continue;
+          }
+        const OffsetValueType neighbor = n + this->m_NeighborOffsets[k];
+        if( this->m_Parents[neighbor] >= 0 && this->AreConnected( values, n, neighbor ) )
+          {
+          this->Union( n, neighbor );
+          }
+        }
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE LabelThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+
+    self->LabelSlab( info->ThreadID );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  typename ImageType::ConstPointer m_Input;
+  typename ImageType::ConstPointer m_ValueImage;
+  bool                             m_FullyConnected;
+  bool                             m_UseLowerThreshold;
+  double                           m_LowerThreshold;
+  bool                             m_ConnectEqualValuesOnly;
+  unsigned long                    m_MinimumComponentSize;
+  unsigned int                     m_NumberOfThreads;
+
+  OffsetValueType              m_Size[ImageDimension];
+  OffsetValueType              m_Strides[ImageDimension];
+  OffsetValueType              m_NumberOfVoxels;
+  std::vector<OffsetValueType> m_NeighborOffsets;
+  std::vector<Delta>           m_NeighborDeltas;
+  unsigned int                 m_NumberOfPrecedingNeighbors;
+  std::vector<OffsetValueType> m_SlabBegins;
+  std::vector<OffsetValueType> m_Parents;
+
+  LabelImagePointer                m_Output;
+  std::vector<ComponentStatistics> m_Statistics;
+};
+} // namespace ants
+
+#endif // __antsConnectedComponentLabeler_h
@@ -0,0 +1,101 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsCopyImageRegion_h
+#define antsCopyImageRegion_h
+
+#include "itkImage.h"
+#include "itkIntTypes.h"
+
+#include <algorithm>
+
+namespace ants
+{
+/** Copy a block of size[0] x ... x size[dimension-1] pixels between two
+ * buffers with the given strides (in pixels).  The lines along the first
+ * axis are copied whole when they are contiguous in both buffers. */
+template <class TSourcePixel, class TTargetPixel>
+void CopyPixelBlock( const TSourcePixel *source, const itk::OffsetValueType *sourceStrides,
+                     TTargetPixel *target, const itk::OffsetValueType *targetStrides,
+                     const itk::SizeValueType *size, unsigned int dimension )
+{
+  itk::SizeValueType numberOfLines = 1;
+
+  for( unsigned int d = 0; d < dimension; d++ )
+    {
+    if( size[d] == 0 )
+      {
+      return;
+      }
+    if( d > 0 )
+      {
+      numberOfLines *= size[d];
+      }
+    }
+
+  const bool isContiguous = ( sourceStrides[0] == 1 && targetStrides[0] == 1 );
+  for( itk::SizeValueType line = 0; line < numberOfLines; line++ )
+    {
+    itk::OffsetValueType sourceOffset = 0;
+    itk::OffsetValueType targetOffset = 0;
+    itk::SizeValueType   remainder = line;
+    for( unsigned int d = 1; d < dimension; d++ )
+      {
+      const itk::OffsetValueType n = static_cast<itk::OffsetValueType>( remainder % size[d] );
+      remainder /= size[d];
+      sourceOffset += n * sourceStrides[d];
+      targetOffset += n * targetStrides[d];
+      }
+
+    const TSourcePixel *from = source + sourceOffset;
+    TTargetPixel *      to = target + targetOffset;
+    if( isContiguous )
+      {
+      std::copy( from, from + size[0], to );
+      }
+    else
+      {
+      for( itk::SizeValueType x = 0; x < size[0]; x++ )
+        {
+        to[x * targetStrides[0]] = from[x * sourceStrides[0]];
+        }
+      }
+    }
+}
+
+/** Copy sourceRegion of source into target at targetIndex.  Both regions
+ * must lie in the buffered regions of their images. */
+template <class TSourceImage, class TTargetImage>
+void CopyImageRegion( const TSourceImage *source, const typename TSourceImage::RegionType & sourceRegion,
+                      TTargetImage *target, const typename TTargetImage::IndexType & targetIndex )
+{
+  const unsigned int ImageDimension = TSourceImage::ImageDimension;
+
+  itk::OffsetValueType sourceStrides[ImageDimension];
+  itk::OffsetValueType targetStrides[ImageDimension];
+  itk::SizeValueType   size[ImageDimension];
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    sourceStrides[d] = source->GetOffsetTable()[d];
+    targetStrides[d] = target->GetOffsetTable()[d];
+    size[d] = sourceRegion.GetSize()[d];
+    }
+
+  CopyPixelBlock( source->GetBufferPointer() + source->ComputeOffset( sourceRegion.GetIndex() ), sourceStrides,
+                  target->GetBufferPointer() + target->ComputeOffset( targetIndex ), targetStrides,
+                  size, ImageDimension );
+}
+} // namespace ants
+
+#endif // antsCopyImageRegion_h
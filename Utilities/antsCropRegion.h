@@ -0,0 +1,392 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsCropRegion_h
+#define antsCropRegion_h
+
+#include "antsAllocImage.h"
+#include "antsCopyImageRegion.h"
+
+#include "itkImage.h"
+#include "itkImageScanlineConstIterator.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/** The smallest region holding a set of indices. */
+template <unsigned int ImageDimension>
+class LabelBoundingBox
+{
+public:
+  typedef itk::Index<ImageDimension>       IndexType;
+  typedef itk::ImageRegion<ImageDimension> RegionType;
+
+  LabelBoundingBox()
+  {
+    m_Minimum.Fill( itk::NumericTraits<itk::IndexValueType>::max() );
+    m_Maximum.Fill( itk::NumericTraits<itk::IndexValueType>::NonpositiveMin() );
+  }
+
+  /** Adds the run of indices from index to index + length - 1 along axis 0. */
+  void AddRun( const IndexType & index, itk::SizeValueType length )
+  {
+    m_Minimum[0] = std::min( m_Minimum[0], index[0] );
+    m_Maximum[0] = std::max( m_Maximum[0], index[0] + static_cast<itk::IndexValueType>( length ) - 1 );
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      m_Minimum[d] = std::min( m_Minimum[d], index[d] );
+      m_Maximum[d] = std::max( m_Maximum[d], index[d] );
+      }
+  }
+
+  void Add( const LabelBoundingBox & other )
+  {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_Minimum[d] = std::min( m_Minimum[d], other.m_Minimum[d] );
+      m_Maximum[d] = std::max( m_Maximum[d], other.m_Maximum[d] );
+      }
+  }
+
+  RegionType GetRegion() const
+  {
+    RegionType region;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      region.SetIndex( d, m_Minimum[d] );
+      region.SetSize( d, static_cast<itk::SizeValueType>( m_Maximum[d] - m_Minimum[d] + 1 ) );
+      }
+    return region;
+  }
+
+  IndexType m_Minimum;
+  IndexType m_Maximum;
+};
+
+template <class TLabelImage>
+struct LabelBoundingBoxThreadStruct
+  {
+  typedef LabelBoundingBox<TLabelImage::ImageDimension>                BoundingBoxType;
+  typedef std::map<typename TLabelImage::PixelType, BoundingBoxType> MapType;
+
+  const TLabelImage *  LabelImage;
+  bool                 SkipBackground;
+  std::vector<MapType> BoundingBoxesPerThread;
+  };
+
+/** Grows the boxes of the labels of a slab of the slowest dimension, one
+ * run of equal labels along a line at a time. */
+template <class TLabelImage>
+ITK_THREAD_RETURN_TYPE LabelBoundingBoxThreaderCallback( void *arg )
+{
+  typedef LabelBoundingBoxThreadStruct<TLabelImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType         MapType;
+  typedef typename TLabelImage::PixelType            LabelType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const unsigned int               lastDimension = TLabelImage::ImageDimension - 1;
+  typename TLabelImage::RegionType region = str->LabelImage->GetBufferedRegion();
+  const itk::SizeValueType         size = region.GetSize()[lastDimension];
+  const itk::SizeValueType         begin = size * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType         end = size * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  if( begin == end )
+    {
+    return ITK_THREAD_RETURN_VALUE;
+    }
+  region.SetIndex( lastDimension, region.GetIndex()[lastDimension] + begin );
+  region.SetSize( lastDimension, end - begin );
+
+  MapType & boxes = str->BoundingBoxesPerThread[info->ThreadID];
+
+  itk::ImageScanlineConstIterator<TLabelImage> It( str->LabelImage, region );
+  for( It.GoToBegin(); !It.IsAtEnd(); It.NextLine() )
+    {
+    while( !It.IsAtEndOfLine() )
+      {
+      const typename TLabelImage::IndexType runIndex = It.GetIndex();
+      const LabelType                       label = It.Get();
+      itk::SizeValueType                    length = 0;
+      while( !It.IsAtEndOfLine() && It.Get() == label )
+        {
+        ++length;
+        ++It;
+        }
+      if( !( str->SkipBackground && label == 0 ) )
+        {
+        boxes[label].AddRun( runIndex, length );
+        }
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The bounding regions of every label of the image, the background (0)
+ * included unless skipped, in one threaded pass over slabs of the slowest
+ * dimension. */
+template <class TLabelImage>
+void ComputeLabelBoundingBoxes( const TLabelImage *labelImage, bool skipBackground,
+                                std::map<typename TLabelImage::PixelType,
+                                         typename TLabelImage::RegionType> & regions )
+{
+  typedef LabelBoundingBoxThreadStruct<TLabelImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType         MapType;
+
+  ThreadStructType str;
+  str.LabelImage = labelImage;
+  str.SkipBackground = skipBackground;
+
+  const unsigned int numberOfThreads = std::max( std::min( itk::MultiThreader::GetGlobalDefaultNumberOfThreads(),
+    static_cast<unsigned int>( labelImage->GetBufferedRegion().GetSize()[TLabelImage::ImageDimension - 1] ) ),
+    1u );
+  str.BoundingBoxesPerThread.resize( numberOfThreads );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( LabelBoundingBoxThreaderCallback<TLabelImage>, &str );
+  threader->SingleMethodExecute();
+
+  MapType boxes;
+  for( unsigned int n = 0; n < numberOfThreads; n++ )
+    {
+    for( typename MapType::const_iterator it = str.BoundingBoxesPerThread[n].begin();
+         it != str.BoundingBoxesPerThread[n].end(); ++it )
+      {
+      boxes[it->first].Add( it->second );
+      }
+    }
+
+  regions.clear();
+  for( typename MapType::const_iterator it = boxes.begin(); it != boxes.end(); ++it )
+    {
+    regions[it->first] = it->second.GetRegion();
+    }
+}
+
+/** Where a cropped image lies in the image it was cropped from:  the grid of
+ * the full image and the region of it kept.  It is what is needed to paste
+ * the cropped image, or a result computed on its grid, back to full size,
+ * and is kept next to the cropped image as a small text file. */
+template <unsigned int ImageDimension>
+struct CropRegion
+  {
+  typedef itk::Image<char, ImageDimension> GridImageType;
+  typedef typename GridImageType::RegionType    RegionType;
+  typedef typename GridImageType::SpacingType   SpacingType;
+  typedef typename GridImageType::PointType     PointType;
+  typedef typename GridImageType::DirectionType DirectionType;
+
+  RegionType    FullRegion;
+  SpacingType   Spacing;
+  PointType     Origin;
+  DirectionType Direction;
+  RegionType    Region;
+  };
+
+/** The crop of label of the label image, padded by padRadius and clipped to
+ * the image.  Returns false if the label is not in the image. */
+template <class TLabelImage>
+bool GetLabelCropRegion( const TLabelImage *labelImage, typename TLabelImage::PixelType label,
+                         unsigned int padRadius, CropRegion<TLabelImage::ImageDimension> & crop )
+{
+  typedef std::map<typename TLabelImage::PixelType, typename TLabelImage::RegionType> RegionMapType;
+
+  RegionMapType regions;
+  ComputeLabelBoundingBoxes( labelImage, false, regions );
+
+  typename RegionMapType::const_iterator it = regions.find( label );
+  if( it == regions.end() )
+    {
+    return false;
+    }
+
+  crop.FullRegion = labelImage->GetLargestPossibleRegion();
+  crop.Spacing = labelImage->GetSpacing();
+  crop.Origin = labelImage->GetOrigin();
+  crop.Direction = labelImage->GetDirection();
+  crop.Region = it->second;
+  crop.Region.PadByRadius( padRadius );
+  crop.Region.Crop( crop.FullRegion );
+  return true;
+}
+
+/** The pixels of crop.Region of image, on a grid indexed from 0 with its
+ * origin at the first pixel kept.  The image must be on the full grid. */
+template <class TImage>
+typename TImage::Pointer CropImage( const TImage *image, const CropRegion<TImage::ImageDimension> & crop )
+{
+  typename TImage::RegionType region;
+  region.SetSize( crop.Region.GetSize() );
+
+  typename TImage::PointType origin;
+  image->TransformIndexToPhysicalPoint( crop.Region.GetIndex(), origin );
+
+  typename TImage::Pointer cropped =
+    AllocImage<TImage>( region, image->GetSpacing(), origin, image->GetDirection() );
+  CopyImageRegion( image, crop.Region, cropped.GetPointer(), region.GetIndex() );
+  return cropped;
+}
+
+/** The image on the full grid with the cropped image pasted into
+ * crop.Region and fillValue elsewhere. */
+template <class TImage>
+typename TImage::Pointer UncropImage( const TImage *cropped, const CropRegion<TImage::ImageDimension> & crop,
+                                      typename TImage::PixelType fillValue )
+{
+  typename TImage::Pointer image =
+    AllocImage<TImage>( crop.FullRegion, crop.Spacing, crop.Origin, crop.Direction, fillValue );
+  CopyImageRegion( cropped, cropped->GetBufferedRegion(), image.GetPointer(), crop.Region.GetIndex() );
+  return image;
+}
+
+/** Writes the crop as lines of "Key: values".  Returns false on failure. */
+template <unsigned int ImageDimension>
+bool WriteCropRegion( const CropRegion<ImageDimension> & crop, const std::string & fileName )
+{
+  std::ofstream str( fileName.c_str() );
+  if( !str )
+    {
+    return false;
+    }
+  str.precision( 17 );
+
+  str << "ImageDimension:";
+  str << " " << ImageDimension << std::endl;
+  str << "FullIndex:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.FullRegion.GetIndex()[d];
+    }
+  str << std::endl << "FullSize:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.FullRegion.GetSize()[d];
+    }
+  str << std::endl << "Spacing:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.Spacing[d];
+    }
+  str << std::endl << "Origin:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.Origin[d];
+    }
+  str << std::endl << "Direction:";
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      str << " " << crop.Direction( i, j );
+      }
+    }
+  str << std::endl << "CropIndex:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.Region.GetIndex()[d];
+    }
+  str << std::endl << "CropSize:";
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str << " " << crop.Region.GetSize()[d];
+    }
+  str << std::endl;
+
+  return static_cast<bool>( str );
+}
+
+/** Reads a crop written by WriteCropRegion().  Returns false if the file
+ * cannot be read or is not a crop of ImageDimension-dimensional images. */
+template <unsigned int ImageDimension>
+bool ReadCropRegion( const std::string & fileName, CropRegion<ImageDimension> & crop )
+{
+  std::ifstream str( fileName.c_str() );
+  if( !str )
+    {
+    return false;
+    }
+
+  std::string  key;
+  unsigned int dimension = 0;
+  if( !( str >> key >> dimension ) || key != "ImageDimension:" || dimension != ImageDimension )
+    {
+    return false;
+    }
+
+  itk::IndexValueType fullIndex[ImageDimension];
+  itk::SizeValueType  fullSize[ImageDimension];
+  itk::IndexValueType cropIndex[ImageDimension];
+  itk::SizeValueType  cropSize[ImageDimension];
+
+  bool isValid = true;
+  isValid = isValid && ( str >> key ) && key == "FullIndex:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> fullIndex[d] );
+    }
+  isValid = isValid && ( str >> key ) && key == "FullSize:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> fullSize[d] );
+    }
+  isValid = isValid && ( str >> key ) && key == "Spacing:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> crop.Spacing[d] );
+    }
+  isValid = isValid && ( str >> key ) && key == "Origin:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> crop.Origin[d] );
+    }
+  isValid = isValid && ( str >> key ) && key == "Direction:";
+  for( unsigned int i = 0; i < ImageDimension && isValid; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension && isValid; j++ )
+      {
+      isValid = static_cast<bool>( str >> crop.Direction( i, j ) );
+      }
+    }
+  isValid = isValid && ( str >> key ) && key == "CropIndex:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> cropIndex[d] );
+    }
+  isValid = isValid && ( str >> key ) && key == "CropSize:";
+  for( unsigned int d = 0; d < ImageDimension && isValid; d++ )
+    {
+    isValid = static_cast<bool>( str >> cropSize[d] );
+    }
+  if( !isValid )
+    {
+    return false;
+    }
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    crop.FullRegion.SetIndex( d, fullIndex[d] );
+    crop.FullRegion.SetSize( d, fullSize[d] );
+    crop.Region.SetIndex( d, cropIndex[d] );
+    crop.Region.SetSize( d, cropSize[d] );
+    }
+  return crop.FullRegion.IsInside( crop.Region );
+}
+} // namespace ants
+
+#endif // antsCropRegion_h
@@ -0,0 +1,200 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsDiffusionDirections_h
+#define __antsDiffusionDirections_h
+
+#include "itkAffineTransform.h"
+#include "itkArray2D.h"
+#include "itkCSVArray2DFileReader.h"
+#include "itkEuler3DTransform.h"
+#include "itkMatrix.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace ants
+{
+/** The diffusion directions of a bvec file, one row per volume.  Transposed
+ * is set when the file has one direction per column, as FSL writes them, so
+ * that the directions are written back in the layout they were read in. */
+struct DiffusionDirectionTable
+  {
+  itk::Array2D<double> Directions;
+  bool                 Transposed;
+  };
+
+inline bool ReadDiffusionDirections( const std::string & bvecName, DiffusionDirectionTable & table )
+{
+  typedef itk::CSVArray2DFileReader<double> ReaderType;
+
+  ReaderType::Pointer bvecReader = ReaderType::New();
+  bvecReader->SetFileName( bvecName.c_str() );
+  bvecReader->SetFieldDelimiterCharacter( ' ' );
+  bvecReader->HasColumnHeadersOff();
+  bvecReader->HasRowHeadersOff();
+  try
+    {
+    bvecReader->Update();
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << "Can't read bvec file " << bvecName << std::endl << e << std::endl;
+    return false;
+    }
+  const ReaderType::Array2DDataObjectType::MatrixType bvecMatrix = bvecReader->GetOutput()->GetMatrix();
+
+  table.Transposed = ( bvecMatrix.cols() != 3 );
+  if( table.Transposed )
+    {
+    table.Directions.SetSize( bvecMatrix.cols(), bvecMatrix.rows() );
+    }
+  else
+    {
+    table.Directions.SetSize( bvecMatrix.rows(), bvecMatrix.cols() );
+    }
+  for( unsigned int i = 0; i < bvecMatrix.rows(); i++ )
+    {
+    for( unsigned int j = 0; j < bvecMatrix.cols(); j++ )
+      {
+      if( table.Transposed )
+        {
+        table.Directions( j, i ) = bvecMatrix( i, j );
+        }
+      else
+        {
+        table.Directions( i, j ) = bvecMatrix( i, j );
+        }
+      }
+    }
+  return true;
+}
+
+/** Rotate the direction of each volume by the linear part of its motion
+ * correction transform, whose rigid (6) or affine (12) parameters follow the
+ * two metric columns of mocoParameters as antsMotionCorr writes them.  The
+ * directions are given along the axes of an image whose direction cosines
+ * are physicalDirection and are renormalized after the transform. */
+inline bool ReorientDiffusionDirections( const DiffusionDirectionTable & input, const vnl_matrix<double> & mocoParameters,
+                                         const itk::Matrix<double, 3, 3> & physicalDirection,
+                                         DiffusionDirectionTable & output, bool verbose = false )
+{
+  typedef itk::AffineTransform<double, 3> AffineTransformType;
+  typedef itk::Euler3DTransform<double>   RigidTransformType;
+
+  if( input.Directions.cols() != 3 || mocoParameters.rows() < input.Directions.rows() )
+    {
+    std::cerr << "The motion correction parameters have " << mocoParameters.rows() << " volumes for "
+              << input.Directions.rows() << " directions of size " << input.Directions.cols() << std::endl;
+    return false;
+    }
+  const unsigned int nTransformParams = mocoParameters.cols() - 2;
+
+  AffineTransformType::Pointer toPhysical = AffineTransformType::New();
+  toPhysical->SetIdentity();
+  toPhysical->SetMatrix( physicalDirection );
+  AffineTransformType::Pointer toIndex = AffineTransformType::New();
+  toPhysical->GetInverse( toIndex );
+
+  output.Transposed = input.Transposed;
+  output.Directions.SetSize( input.Directions.rows(), input.Directions.cols() );
+  for( unsigned int i = 0; i < input.Directions.rows(); i++ )
+    {
+    AffineTransformType::Pointer        affineTransform = AffineTransformType::New();
+    AffineTransformType::ParametersType params;
+    params.SetSize( nTransformParams );
+    for( unsigned int t = 0; t < nTransformParams; t++ )
+      {
+      params[t] = mocoParameters( i, t + 2 );
+      }
+    if( nTransformParams == 6 )
+      {
+      RigidTransformType::Pointer rigid = RigidTransformType::New();
+      rigid->SetParameters( params );
+      affineTransform->SetMatrix( rigid->GetMatrix() );
+      affineTransform->SetTranslation( rigid->GetTranslation() );
+      }
+    else if( nTransformParams == 12 )
+      {
+      affineTransform->SetParameters( params );
+      }
+    else
+      {
+      // Not rigid (6 params) or affine (12), something is wrong
+      std::cerr << "Unknown transform type with " << nTransformParams << " parameters" << std::endl;
+      return false;
+      }
+
+    AffineTransformType::InputVectorType  dir;
+    AffineTransformType::OutputVectorType rotatedDir;
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      dir[j] = input.Directions( i, j );
+      }
+    rotatedDir = dir;
+    if( dir.GetNorm() > 0 )
+      {
+      dir.Normalize();
+      rotatedDir = toPhysical->TransformVector( dir );
+      rotatedDir = affineTransform->TransformVector( rotatedDir );
+      rotatedDir.Normalize();
+      rotatedDir = toIndex->TransformVector( rotatedDir );
+      }
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      output.Directions( i, j ) = rotatedDir[j];
+      }
+    if( verbose )
+      {
+      std::cout << dir << " -> " << rotatedDir << std::endl;
+      }
+    }
+  return true;
+}
+
+inline bool WriteDiffusionDirections( const std::string & bvecName, const DiffusionDirectionTable & table )
+{
+  std::ofstream outfile( bvecName.c_str() );
+  if( !outfile )
+    {
+    std::cerr << "Can't write bvec file " << bvecName << std::endl;
+    return false;
+    }
+  if( table.Transposed )
+    {
+    for( unsigned int i = 0; i < table.Directions.cols(); i++ )
+      {
+      for( unsigned int j = 0; j < table.Directions.rows(); j++ )
+        {
+        outfile << table.Directions( j, i ) << " ";
+        }
+      outfile << std::endl;
+      }
+    }
+  else
+    {
+    for( unsigned int i = 0; i < table.Directions.rows(); i++ )
+      {
+      for( unsigned int j = 0; j < table.Directions.cols(); j++ )
+        {
+        outfile << table.Directions( i, j ) << " ";
+        }
+      outfile << std::endl;
+      }
+    }
+  return true;
+}
+} // namespace ants
+
+#endif
@@ -0,0 +1,463 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsDigitalTopology_h
+#define __antsDigitalTopology_h
+
+#include "itkImage.h"
+#include "itkMacro.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace ants
+{
+/** \class DigitalTopology
+ *
+ * Topology of the foreground (the non-zero voxels) of a 2-D or 3-D image.
+ *
+ * The Euler characteristic is summed over the 2^D blocks of voxels that
+ * share a lattice corner, the image being padded with background: each
+ * configuration of a block adds its share of the vertices, edges, faces and
+ * cubes of the foreground, read from a table with one entry per
+ * configuration (256 in 3-D).  With VertexConnectivity (8 in 2-D, 26 in
+ * 3-D) the foreground is the union of its closed voxels; with
+ * FaceConnectivity (4 or 6) it is the cubical complex with the voxels as
+ * its vertices.  For a single component without cavities the genus of its
+ * surface is 1 - Euler characteristic.
+ *
+ * A foreground voxel is simple in 3-D if the topological numbers of
+ * Bertrand and Malandain of the foreground and of the background in its
+ * 3x3x3 neighborhood are both 1, for the (26,6) or (6,26) pair of
+ * connectivities (conventions 4 and 3 of topological_numbers.h).  The
+ * neighborhood is packed in a 27 bit word so that the components are grown
+ * with a few masks.
+ *
+ * Both computations run over slabs along the last dimension, one per
+ * thread, and the result does not depend on the number of threads.
+ */
+template <class TImage>
+class DigitalTopology
+{
+public:
+  typedef TImage                             ImageType;
+  typedef typename ImageType::PixelType      PixelType;
+  typedef itk::Image<unsigned char, TImage::ImageDimension> SimplePointImageType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  typedef enum { FaceConnectivity = 0, VertexConnectivity } ConnectivityType;
+
+  /** The Euler characteristic of the non-zero voxels of the buffered region. */
+  static long EulerCharacteristic( const ImageType *image, ConnectivityType connectivity = VertexConnectivity )
+  {
+    if( ImageDimension != 2 && ImageDimension != 3 )
+      {
+      itkGenericExceptionMacro( "The Euler characteristic is computed for 2-D and 3-D images only." );
+      }
+
+    EulerThreadStruct str;
+    str.Image = image;
+    str.Table = &GetEulerTable( connectivity );
+
+    const itk::SizeValueType numberOfPlanes = image->GetBufferedRegion().GetSize()[ImageDimension - 1] + 1;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), numberOfPlanes ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    str.NumberOfThreads = threader->GetNumberOfThreads();
+    str.Sums.assign( str.NumberOfThreads, 0 );
+    threader->SetSingleMethod( EulerThreaderCallback, &str );
+    threader->SingleMethodExecute();
+
+    long sum = 0;
+    for( unsigned int t = 0; t < str.NumberOfThreads; t++ )
+      {
+      sum += str.Sums[t];
+      }
+    return sum / ( 1 << ImageDimension );
+  }
+
+  /** 1 - EulerCharacteristic, the genus of the surface of one component */
+  static long Genus( const ImageType *image, ConnectivityType connectivity = VertexConnectivity )
+  {
+    return 1 - EulerCharacteristic( image, connectivity );
+  }
+
+  /** Whether the foreground voxel at offset of the buffer can be flipped to
+   * the background without changing the topology.  connectivity is that of
+   * the foreground, the background taking the other one.  The voxel must
+   * not lie on the border of the buffer. */
+  static bool IsSimplePoint( const ImageType *image, itk::OffsetValueType offset,
+                             ConnectivityType connectivity = VertexConnectivity )
+  {
+    const PixelType *             center = image->GetBufferPointer() + offset;
+    const itk::OffsetValueType *  stride = image->GetOffsetTable();
+    unsigned int                  neighborhood = 0;
+
+    for( unsigned int n = 0; n < 27; n++ )
+      {
+      const itk::OffsetValueType o = ( static_cast<int>( n % 3 ) - 1 ) + ( static_cast<int>( n / 3 % 3 ) - 1 )
+        * stride[1] + ( static_cast<int>( n / 9 ) - 1 ) * stride[2];
+      if( center[o] != itk::NumericTraits<PixelType>::ZeroValue() )
+        {
+        neighborhood |= ( 1u << n );
+        }
+      }
+    return IsSimpleNeighborhood( neighborhood, connectivity );
+  }
+
+  /** Whether the center of the 3x3x3 neighborhood, bit x + 3 y + 9 z set for
+   * the foreground, is a simple point. */
+  static bool IsSimpleNeighborhood( unsigned int neighborhood, ConnectivityType connectivity )
+  {
+    const NeighborhoodMasks & masks = GetNeighborhoodMasks();
+    const unsigned int        foreground = neighborhood & ~( 1u << 13 );
+    const unsigned int        background = ~neighborhood & ( ( 1u << 27 ) - 1 ) & ~( 1u << 13 );
+
+    if( connectivity == VertexConnectivity )
+      {
+      return CountComponents( foreground & masks.N26, masks.Adjacent26, masks.N26 ) == 1
+             && CountComponents( background & masks.N18, masks.Adjacent6, masks.N6 ) == 1;
+      }
+    return CountComponents( foreground & masks.N18, masks.Adjacent6, masks.N6 ) == 1
+           && CountComponents( background & masks.N26, masks.Adjacent26, masks.N26 ) == 1;
+  }
+
+  /** Mark the simple foreground voxels of a 3-D image with 1 in output,
+   * every other voxel (background, non-simple, buffer border) with 0. */
+  static void ClassifySimplePoints( const ImageType *image, SimplePointImageType *output,
+                                    ConnectivityType connectivity = VertexConnectivity )
+  {
+    if( ImageDimension != 3 )
+      {
+      itkGenericExceptionMacro( "Simple points are classified in 3-D images only." );
+      }
+
+    output->CopyInformation( image );
+    output->SetRegions( image->GetBufferedRegion() );
+    output->Allocate();
+    output->FillBuffer( 0 );
+
+    SimplePointThreadStruct str;
+    str.Image = image;
+    str.Output = output;
+    str.Connectivity = connectivity;
+
+    const itk::SizeValueType numberOfSlices = image->GetBufferedRegion().GetSize()[ImageDimension - 1];
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), numberOfSlices ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    str.NumberOfThreads = threader->GetNumberOfThreads();
+    threader->SetSingleMethod( SimplePointThreaderCallback, &str );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  struct EulerThreadStruct
+    {
+    const ImageType *        Image;
+    const std::vector<int> * Table;
+    std::vector<long>        Sums;
+    unsigned int             NumberOfThreads;
+    };
+
+  struct SimplePointThreadStruct
+    {
+    const ImageType *      Image;
+    SimplePointImageType * Output;
+    ConnectivityType       Connectivity;
+    unsigned int           NumberOfThreads;
+    };
+
+  /** The 27 bit masks of the neighborhood: the 6, 18 and 26 neighbors of the
+   * center and, for each position, its 6 and 26 neighbors. */
+  struct NeighborhoodMasks
+    {
+    unsigned int N6;
+    unsigned int N18;
+    unsigned int N26;
+    unsigned int Adjacent6[27];
+    unsigned int Adjacent26[27];
+
+    NeighborhoodMasks()
+    {
+      N6 = N18 = N26 = 0;
+      for( int n = 0; n < 27; n++ )
+        {
+        const int x = n % 3, y = n / 3 % 3, z = n / 9;
+        const int distance = std::abs( x - 1 ) + std::abs( y - 1 ) + std::abs( z - 1 );
+        if( distance == 1 )
+          {
+          N6 |= ( 1u << n );
+          }
+        if( distance >= 1 && distance <= 2 )
+          {
+          N18 |= ( 1u << n );
+          }
+        if( distance >= 1 )
+          {
+          N26 |= ( 1u << n );
+          }
+
+        Adjacent6[n] = Adjacent26[n] = 0;
+        for( int m = 0; m < 27; m++ )
+          {
+          const int dx = std::abs( m % 3 - x ), dy = std::abs( m / 3 % 3 - y ), dz = std::abs( m / 9 - z );
+          if( m == n || dx > 1 || dy > 1 || dz > 1 )
+            {
+            continue;
+            }
+          Adjacent26[n] |= ( 1u << m );
+          if( dx + dy + dz == 1 )
+            {
+            Adjacent6[n] |= ( 1u << m );
+            }
+          }
+        }
+    }
+    };
+
+  static const NeighborhoodMasks & GetNeighborhoodMasks()
+  {
+    static const NeighborhoodMasks masks;
+
+    return masks;
+  }
+
+  /** The number of components of set, for the adjacency masks, that meet
+   * the positions of seeds. */
+  static unsigned int CountComponents( unsigned int set, const unsigned int *adjacent, unsigned int seeds )
+  {
+    unsigned int count = 0;
+
+    while( set & seeds )
+      {
+      // grow the component of the lowest seed
+      unsigned int n = 0;
+      while( !( ( set & seeds ) & ( 1u << n ) ) )
+        {
+        n++;
+        }
+      unsigned int component = ( 1u << n );
+      unsigned int frontier = component;
+      while( frontier )
+        {
+        unsigned int grown = 0;
+        for( unsigned int m = 0; m < 27; m++ )
+          {
+          if( frontier & ( 1u << m ) )
+            {
+            grown |= adjacent[m];
+            }
+          }
+        frontier = grown & set & ~component;
+        component |= frontier;
+        }
+      set &= ~component;
+      count++;
+      }
+    return count;
+  }
+
+  /** The table of the contributions, times 2^D, of the 2^( 2^D )
+   * configurations of a block.  Voxel v of a block is at offset bit d of v
+   * along dimension d. */
+  static std::vector<int> BuildEulerTable( ConnectivityType connectivity )
+  {
+    const unsigned int numberOfVoxels = 1u << ImageDimension;
+    const unsigned int all = numberOfVoxels - 1;
+
+    std::vector<int> table( 1u << numberOfVoxels, 0 );
+    for( unsigned int configuration = 0; configuration < table.size(); configuration++ )
+      {
+      int contribution = 0;
+      // the cells spanned by the dimensions of the mask axes
+      for( unsigned int axes = 0; axes <= all; axes++ )
+        {
+        unsigned int k = 0;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          k += ( axes >> d ) & 1;
+          }
+        const int sign = ( k % 2 ) ? -1 : 1;
+        for( unsigned int bits = 0; bits <= all; bits++ )
+          {
+          if( connectivity == VertexConnectivity )
+            {
+            // the part of a k-cell of the closed voxels around the corner, in
+            // the orthant bits on the axes: present if one of its voxels is
+            if( bits & ~axes )
+              {
+              continue;
+              }
+            bool present = false;
+            for( unsigned int v = 0; v < numberOfVoxels; v++ )
+              {
+              if( ( v & axes ) == bits && ( configuration & ( 1u << v ) ) )
+                {
+                present = true;
+                }
+              }
+            contribution += present ? sign * ( 1 << ( ImageDimension - k ) ) : 0;
+            }
+          else
+            {
+            // a k-face of the block, its other coordinates fixed to bits:
+            // present if all of its voxels are
+            if( bits & axes )
+              {
+              continue;
+              }
+            bool present = true;
+            for( unsigned int v = 0; v < numberOfVoxels; v++ )
+              {
+              if( ( v & ~axes & all ) == bits && !( configuration & ( 1u << v ) ) )
+                {
+                present = false;
+                }
+              }
+            contribution += present ? sign * ( 1 << k ) : 0;
+            }
+          }
+        }
+      table[configuration] = contribution;
+      }
+    return table;
+  }
+
+  static const std::vector<int> & GetEulerTable( ConnectivityType connectivity )
+  {
+    static const std::vector<int> faceTable = BuildEulerTable( FaceConnectivity );
+    static const std::vector<int> vertexTable = BuildEulerTable( VertexConnectivity );
+
+    return ( connectivity == VertexConnectivity ) ? vertexTable : faceTable;
+  }
+
+  static ITK_THREAD_RETURN_TYPE EulerThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    EulerThreadStruct *                   str = static_cast<EulerThreadStruct *>( info->UserData );
+
+    const ImageType *                                  image = str->Image;
+    const typename ImageType::SizeType &               size = image->GetBufferedRegion().GetSize();
+    const PixelType *                                  buffer = image->GetBufferPointer();
+    const itk::OffsetValueType *                       stride = image->GetOffsetTable();
+    const std::vector<int> &                           table = *str->Table;
+    const unsigned int                                 numberOfRows = 1u << ( ImageDimension - 1 );
+
+    // a block starts at voxel -1 .. size - 1 along each dimension
+    const long numberOfPlanes = static_cast<long>( size[ImageDimension - 1] ) + 1;
+    const long first = numberOfPlanes * info->ThreadID / str->NumberOfThreads - 1;
+    const long end = numberOfPlanes * ( info->ThreadID + 1 ) / str->NumberOfThreads - 1;
+    const long numberOfColumns = static_cast<long>( size[0] );
+
+    long sum = 0;
+    long corner[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      corner[d] = -1;
+      }
+    corner[ImageDimension - 1] = first;
+    while( first < end && corner[ImageDimension - 1] < end )
+      {
+      // the rows of the block along the first dimension, null outside
+      const PixelType *rows[4];
+      for( unsigned int r = 0; r < numberOfRows; r++ )
+        {
+        itk::OffsetValueType offset = 0;
+        bool                 inside = true;
+        for( unsigned int d = 1; d < ImageDimension; d++ )
+          {
+          const long position = corner[d] + ( ( r >> ( d - 1 ) ) & 1 );
+          inside = inside && position >= 0 && position < static_cast<long>( size[d] );
+          offset += position * stride[d];
+          }
+        rows[r] = inside ? buffer + offset : ITK_NULLPTR;
+        }
+
+      // the bits of the rows at column x, placed at the bits of offset 0
+      unsigned int previous = 0;
+      for( long x = 0; x <= numberOfColumns; x++ )
+        {
+        unsigned int column = 0;
+        if( x < numberOfColumns )
+          {
+          for( unsigned int r = 0; r < numberOfRows; r++ )
+            {
+            if( rows[r] && rows[r][x] != itk::NumericTraits<PixelType>::ZeroValue() )
+              {
+              column |= ( 1u << ( 2 * r ) );
+              }
+            }
+          }
+        sum += table[previous | ( column << 1 )];
+        previous = column;
+        }
+
+      // next row of blocks
+      unsigned int d = 1;
+      while( d < ImageDimension - 1 && ++corner[d] >= static_cast<long>( size[d] ) )
+        {
+        corner[d] = -1;
+        d++;
+        }
+      if( d == ImageDimension - 1 )
+        {
+        corner[d]++;
+        }
+      }
+    str->Sums[info->ThreadID] = sum;
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  static ITK_THREAD_RETURN_TYPE SimplePointThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const SimplePointThreadStruct *       str = static_cast<SimplePointThreadStruct *>( info->UserData );
+
+    const ImageType *                    image = str->Image;
+    const typename ImageType::SizeType & size = image->GetBufferedRegion().GetSize();
+    const PixelType *                    buffer = image->GetBufferPointer();
+    const itk::OffsetValueType *         stride = image->GetOffsetTable();
+    unsigned char *                      output = str->Output->GetBufferPointer();
+
+    const itk::SizeValueType first = size[2] * info->ThreadID / str->NumberOfThreads;
+    const itk::SizeValueType end = size[2] * ( info->ThreadID + 1 ) / str->NumberOfThreads;
+    for( itk::SizeValueType z = std::max( first, static_cast<itk::SizeValueType>( 1 ) );
+         z < std::min( end, static_cast<itk::SizeValueType>( size[2] - 1 ) ); z++ )
+      {
+      for( itk::SizeValueType y = 1; y + 1 < size[1]; y++ )
+        {
+        const itk::OffsetValueType row = z * stride[2] + y * stride[1];
+        for( itk::SizeValueType x = 1; x + 1 < size[0]; x++ )
+          {
+          if( buffer[row + x] != itk::NumericTraits<PixelType>::ZeroValue()
+              && IsSimplePoint( image, row + x, str->Connectivity ) )
+            {
+            output[row + x] = 1;
+            }
+          }
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif
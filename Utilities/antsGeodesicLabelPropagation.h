@@ -0,0 +1,340 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsGeodesicLabelPropagation_h
+#define __antsGeodesicLabelPropagation_h
+
+#include "itkImage.h"
+#include "itkMacro.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace ants
+{
+/** \class GeodesicLabelPropagation
+ *
+ * Propagates all labels of a label image through a speed image in a single
+ * fast marching pass.  One priority queue holds the trial voxels of all
+ * labels together with the label that reached them; a voxel is taken by
+ * the first label to arrive, and the arrival times of a label are only
+ * computed from the voxels that label has taken.  Each unlabeled voxel thus
+ * gets the label with the smallest arrival time, as when one fast marching
+ * is run per label and the earliest one is kept, but the work no longer
+ * grows with the number of labels.
+ *
+ * The arrival times solve the same first order upwind scheme as
+ * itk::FMarchingImageFilter.  Voxels with speed < SpeedThreshold are not
+ * entered; the march stops at StoppingValue, the trial voxels left in the
+ * queue keep their tentative time and label (as in the fast marching
+ * output).  The label of a voxel is its value truncated to an integer;
+ * voxels with labels in [1, MaximumLabel] are the seeds.
+ */
+template <class TImage>
+class GeodesicLabelPropagation
+{
+public:
+  typedef TImage                                                 ImageType;
+  typedef typename ImageType::Pointer                            ImagePointer;
+  typedef typename ImageType::PixelType                          PixelType;
+  typedef itk::Image<unsigned char, TImage::ImageDimension>      StatusImageType;
+  typedef typename ImageType::IndexType                          IndexType;
+  typedef typename ImageType::OffsetValueType                    OffsetValueType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  /** The states of the voxels in GetStatusImage(), numbered as the point
+   * types of the fast marching filters. */
+  enum StatusType { Far = 0, Alive = 1, Trial = 2 };
+
+  GeodesicLabelPropagation() :
+    m_SpeedThreshold( 1.e-9 ),
+    m_StoppingValue( 100.0 ),
+    m_MaximumLabel( 0 ),
+    m_FarValue( 1.e9 )
+  {
+  }
+
+  void SetSpeedImage( const ImageType *speed )
+  {
+    this->m_SpeedImage = speed;
+  }
+
+  void SetLabelImage( const ImageType *labels )
+  {
+    this->m_LabelImage = labels;
+  }
+
+  void SetSpeedThreshold( double threshold )
+  {
+    this->m_SpeedThreshold = threshold;
+  }
+
+  void SetStoppingValue( double value )
+  {
+    this->m_StoppingValue = value;
+  }
+
+  void SetMaximumLabel( unsigned int label )
+  {
+    this->m_MaximumLabel = label;
+  }
+
+  /** The time of voxels that are not reached. */
+  void SetFarValue( PixelType value )
+  {
+    this->m_FarValue = value;
+  }
+
+  /** The arrival times; 0 at the seeds, FarValue where no label arrived. */
+  ImageType * GetArrivalTimes() const
+  {
+    return this->m_ArrivalTimes.GetPointer();
+  }
+
+  /** The label that arrived first, the seed label at the seeds, 0 where no
+   * label arrived. */
+  ImageType * GetOutput() const
+  {
+    return this->m_Output.GetPointer();
+  }
+
+  StatusImageType * GetStatusImage() const
+  {
+    return this->m_StatusImage.GetPointer();
+  }
+
+  void Update()
+  {
+    const ImageType *speed = this->m_SpeedImage.GetPointer();
+    const ImageType *labels = this->m_LabelImage.GetPointer();
+    if( !speed || !labels )
+      {
+      itkGenericExceptionMacro( "GeodesicLabelPropagation: the speed and label images have to be set." );
+      }
+    if( speed->GetBufferedRegion() != labels->GetBufferedRegion() )
+      {
+      itkGenericExceptionMacro( "GeodesicLabelPropagation: the speed and label images have different regions." );
+      }
+
+    this->m_Region = labels->GetBufferedRegion();
+    this->m_ArrivalTimes = this->AllocateLike<ImageType>( labels );
+    this->m_ArrivalTimes->FillBuffer( this->m_FarValue );
+    this->m_Output = this->AllocateLike<ImageType>( labels );
+    this->m_Output->FillBuffer( 0 );
+    this->m_StatusImage = this->AllocateLike<StatusImageType>( labels );
+    this->m_StatusImage->FillBuffer( Far );
+
+    const typename ImageType::SpacingType spacing = labels->GetSpacing();
+    OffsetValueType                       stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      this->m_Strides[d] = stride;
+      this->m_SpaceFactors[d] = 1.0 / ( spacing[d] * spacing[d] );
+      stride *= static_cast<OffsetValueType>( this->m_Region.GetSize()[d] );
+      }
+
+    const PixelType *speedBuffer = speed->GetBufferPointer();
+    const PixelType *labelBuffer = labels->GetBufferPointer();
+    PixelType *      times = this->m_ArrivalTimes->GetBufferPointer();
+    PixelType *      output = this->m_Output->GetBufferPointer();
+    unsigned char *  status = this->m_StatusImage->GetBufferPointer();
+    const OffsetValueType numberOfVoxels = static_cast<OffsetValueType>( this->m_Region.GetNumberOfPixels() );
+
+    // all seeds are alive at 0, their neighbors are the first trial voxels
+    for( OffsetValueType n = 0; n < numberOfVoxels; n++ )
+      {
+      const unsigned int label = static_cast<unsigned int>( labelBuffer[n] );
+      if( labelBuffer[n] >= 1 && label <= this->m_MaximumLabel )
+        {
+        times[n] = 0;
+        output[n] = label;
+        status[n] = Alive;
+        }
+      }
+    QueueType queue;
+    for( OffsetValueType n = 0; n < numberOfVoxels; n++ )
+      {
+      if( status[n] == Alive )
+        {
+        this->UpdateNeighbors( n, speedBuffer, times, output, status, queue );
+        }
+      }
+
+    while( !queue.empty() )
+      {
+      const QueueNode node = queue.top();
+      if( status[node.Offset] == Alive || node.Label != output[node.Offset] || node.Value != times[node.Offset] )
+        {
+        // superseded by an earlier arrival
+        queue.pop();
+        continue;
+        }
+      if( node.Value > this->m_StoppingValue )
+        {
+        break;
+        }
+      queue.pop();
+      status[node.Offset] = Alive;
+      this->UpdateNeighbors( node.Offset, speedBuffer, times, output, status, queue );
+      }
+  }
+
+private:
+  GeodesicLabelPropagation( const GeodesicLabelPropagation & ); // purposely not implemented
+  void operator=( const GeodesicLabelPropagation & );           // purposely not implemented
+
+  struct QueueNode
+    {
+    double          Value;
+    OffsetValueType Offset;
+    PixelType       Label;
+
+    bool operator>( const QueueNode & other ) const
+    {
+      return this->Value > other.Value;
+    }
+    };
+  typedef std::priority_queue<QueueNode, std::vector<QueueNode>, std::greater<QueueNode> > QueueType;
+
+  template <class TOutputImage>
+  static typename TOutputImage::Pointer AllocateLike( const ImageType *image )
+  {
+    typename TOutputImage::Pointer output = TOutputImage::New();
+    output->CopyInformation( image );
+    output->SetRegions( image->GetBufferedRegion() );
+    output->Allocate();
+    return output;
+  }
+
+  /** The position of offset along each dimension. */
+  void GetPosition( OffsetValueType offset, OffsetValueType *position ) const
+  {
+    for( int d = ImageDimension - 1; d >= 0; d-- )
+      {
+      position[d] = offset / this->m_Strides[d];
+      offset -= position[d] * this->m_Strides[d];
+      }
+  }
+
+  /** Recompute the tentative times of the face neighbors of the alive
+   * voxel offset, as reached by its label. */
+  void UpdateNeighbors( OffsetValueType offset, const PixelType *speed, PixelType *times, PixelType *output,
+                        unsigned char *status, QueueType & queue ) const
+  {
+    OffsetValueType position[ImageDimension];
+    this->GetPosition( offset, position );
+    const PixelType label = output[offset];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      for( int s = -1; s < 2; s += 2 )
+        {
+        const OffsetValueType p = position[d] + s;
+        if( p < 0 || p >= static_cast<OffsetValueType>( this->m_Region.GetSize()[d] ) )
+          {
+          continue;
+          }
+        const OffsetValueType neighbor = offset + s * this->m_Strides[d];
+        if( status[neighbor] == Alive || speed[neighbor] < this->m_SpeedThreshold )
+          {
+          continue;
+          }
+        position[d] = p;
+        const double solution = this->Solve( neighbor, position, label, speed[neighbor], times, output, status );
+        position[d] -= s;
+        if( status[neighbor] == Trial && solution >= times[neighbor] )
+          {
+          continue;
+          }
+        times[neighbor] = static_cast<PixelType>( solution );
+        output[neighbor] = label;
+        status[neighbor] = Trial;
+
+        QueueNode node;
+        node.Value = times[neighbor];
+        node.Offset = neighbor;
+        node.Label = label;
+        queue.push( node );
+        }
+      }
+  }
+
+  /** The upwind solution at offset from the alive voxels of label. */
+  double Solve( OffsetValueType offset, const OffsetValueType *position, PixelType label, PixelType speed,
+                const PixelType *times, const PixelType *output, const unsigned char *status ) const
+  {
+    std::pair<double, unsigned int> nodes[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      nodes[d] = std::make_pair( itk::NumericTraits<double>::max(), d );
+      for( int s = -1; s < 2; s += 2 )
+        {
+        const OffsetValueType p = position[d] + s;
+        if( p < 0 || p >= static_cast<OffsetValueType>( this->m_Region.GetSize()[d] ) )
+          {
+          continue;
+          }
+        const OffsetValueType neighbor = offset + s * this->m_Strides[d];
+        if( status[neighbor] == Alive && output[neighbor] == label && times[neighbor] < nodes[d].first )
+          {
+          nodes[d].first = times[neighbor];
+          }
+        }
+      }
+    std::sort( nodes, nodes + ImageDimension );
+
+    double aa = 0.0;
+    double bb = 0.0;
+    double cc = -1.0 / ( static_cast<double>( speed ) * speed );
+    double solution = itk::NumericTraits<double>::max();
+    for( unsigned int j = 0; j < ImageDimension && solution >= nodes[j].first; j++ )
+      {
+      const double spaceFactor = this->m_SpaceFactors[nodes[j].second];
+      const double value = nodes[j].first;
+      aa += spaceFactor;
+      bb += value * spaceFactor;
+      cc += value * value * spaceFactor;
+
+      // rounding can make the discriminant slightly negative; use the
+      // solution of the axes so far then
+      const double discrim = bb * bb - aa * cc;
+      if( discrim < 0.0 )
+        {
+        break;
+        }
+      solution = ( std::sqrt( discrim ) + bb ) / aa;
+      }
+    return solution;
+  }
+
+  typename ImageType::ConstPointer m_SpeedImage;
+  typename ImageType::ConstPointer m_LabelImage;
+  double                           m_SpeedThreshold;
+  double                           m_StoppingValue;
+  unsigned int                     m_MaximumLabel;
+  PixelType                        m_FarValue;
+
+  typename ImageType::RegionType   m_Region;
+  OffsetValueType                  m_Strides[ImageDimension];
+  double                           m_SpaceFactors[ImageDimension];
+
+  ImagePointer                       m_ArrivalTimes;
+  ImagePointer                       m_Output;
+  typename StatusImageType::Pointer  m_StatusImage;
+};
+} // namespace ants
+
+#endif // __antsGeodesicLabelPropagation_h
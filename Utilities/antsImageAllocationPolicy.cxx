@@ -0,0 +1,283 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsImageAllocationPolicy.h"
+
+#include "itkSimpleFastMutexLock.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <new>
+#include <string>
+
+#if defined( _WIN32 )
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+#if defined( __linux__ )
+#include <sys/mman.h>
+#endif
+
+namespace ants
+{
+namespace
+{
+const unsigned long hugePageSize = 2ul * 1024ul * 1024ul;
+const unsigned long hugePageThreshold = 8ul * 1024ul * 1024ul;
+const unsigned long cacheLineSize = 64ul;
+
+// buffers below this are touched on the allocating thread alone
+const unsigned long firstTouchThreshold = 1024ul * 1024ul;
+
+struct PooledBuffer
+  {
+  void *        Buffer;
+  unsigned long Bytes;
+  };
+
+// most recently released first
+typedef std::list<PooledBuffer> PoolType;
+
+itk::SimpleFastMutexLock policyMutex;
+bool                     firstTouch = false;
+bool                     hugePages = false;
+unsigned long            maximumPoolMemory = 0;
+unsigned long            poolMemory = 0;
+PoolType                 pool;
+bool                     isInitialized = false;
+
+// all of the following expect policyMutex to be held
+
+void InitializeFromEnvironment()
+{
+  if( isInitialized )
+    {
+    return;
+    }
+  isInitialized = true;
+  const char *value = std::getenv( "ANTS_IMAGE_ALLOCATION" );
+  if( value )
+    {
+    const std::string policies = std::string( "," ) + value + ",";
+    firstTouch = ( policies.find( ",firsttouch," ) != std::string::npos );
+    hugePages = ( policies.find( ",hugepages," ) != std::string::npos );
+    }
+  const char *poolValue = std::getenv( "ANTS_IMAGE_POOL_MB" );
+  if( poolValue )
+    {
+    maximumPoolMemory = std::strtoul( poolValue, ITK_NULLPTR, 10 ) * 1024ul * 1024ul;
+    }
+}
+
+void * AllocateAligned( unsigned long bytes, unsigned long alignment )
+{
+  void *buffer = ITK_NULLPTR;
+#if defined( _WIN32 )
+  buffer = _aligned_malloc( bytes, alignment );
+#else
+  if( posix_memalign( &buffer, alignment, bytes ) != 0 )
+    {
+    buffer = ITK_NULLPTR;
+    }
+#endif
+  return buffer;
+}
+
+void FreeAligned( void *buffer )
+{
+#if defined( _WIN32 )
+  _aligned_free( buffer );
+#else
+  free( buffer );
+#endif
+}
+
+/** Free the least recently released buffers until bytes more fit. */
+void TrimPool( unsigned long bytes )
+{
+  while( !pool.empty() && poolMemory + bytes > maximumPoolMemory )
+    {
+    FreeAligned( pool.back().Buffer );
+    poolMemory -= pool.back().Bytes;
+    pool.pop_back();
+    }
+}
+
+struct FirstTouchThreadStruct
+  {
+  char *                             Buffer;
+  unsigned long                      Bytes;
+  const std::vector<unsigned long> * SlabBegins;
+  };
+
+ITK_THREAD_RETURN_TYPE FirstTouchThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  FirstTouchThreadStruct *              str = static_cast<FirstTouchThreadStruct *>( info->UserData );
+
+  const std::vector<unsigned long> & slabBegins = *str->SlabBegins;
+  for( unsigned long s = info->ThreadID; s < slabBegins.size(); s += info->NumberOfThreads )
+    {
+    const unsigned long end = ( s + 1 < slabBegins.size() ) ? slabBegins[s + 1] : str->Bytes;
+    std::memset( str->Buffer + slabBegins[s], 0, end - slabBegins[s] );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+} // anonymous namespace
+
+void ImageAllocationPolicy::SetFirstTouch( bool value )
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  firstTouch = value;
+  policyMutex.Unlock();
+}
+
+bool ImageAllocationPolicy::GetFirstTouch()
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  const bool value = firstTouch;
+  policyMutex.Unlock();
+  return value;
+}
+
+void ImageAllocationPolicy::SetHugePages( bool value )
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  hugePages = value;
+  policyMutex.Unlock();
+}
+
+bool ImageAllocationPolicy::GetHugePages()
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  const bool value = hugePages;
+  policyMutex.Unlock();
+  return value;
+}
+
+void ImageAllocationPolicy::SetMaximumPoolMemory( unsigned long bytes )
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  maximumPoolMemory = bytes;
+  TrimPool( 0 );
+  policyMutex.Unlock();
+}
+
+unsigned long ImageAllocationPolicy::GetMaximumPoolMemory()
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  const unsigned long bytes = maximumPoolMemory;
+  policyMutex.Unlock();
+  return bytes;
+}
+
+unsigned long ImageAllocationPolicy::GetPoolMemory()
+{
+  policyMutex.Lock();
+  const unsigned long bytes = poolMemory;
+  policyMutex.Unlock();
+  return bytes;
+}
+
+bool ImageAllocationPolicy::IsEnabled()
+{
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  const bool enabled = firstTouch || hugePages || maximumPoolMemory > 0;
+  policyMutex.Unlock();
+  return enabled;
+}
+
+void * ImageAllocationPolicy::Allocate( unsigned long bytes, const std::vector<unsigned long> & slabBegins )
+{
+  bool useHugePages = false;
+  policyMutex.Lock();
+  InitializeFromEnvironment();
+  for( PoolType::iterator it = pool.begin(); it != pool.end(); ++it )
+    {
+    if( it->Bytes == bytes )
+      {
+      void *buffer = it->Buffer;
+      poolMemory -= bytes;
+      pool.erase( it );
+      policyMutex.Unlock();
+      return buffer;
+      }
+    }
+  useHugePages = hugePages && bytes >= hugePageThreshold;
+  policyMutex.Unlock();
+
+  void *buffer = AllocateAligned( bytes, useHugePages ? hugePageSize : cacheLineSize );
+  if( buffer == ITK_NULLPTR )
+    {
+    // give the pool back and try once more before giving up
+    policyMutex.Lock();
+    const unsigned long budget = maximumPoolMemory;
+    maximumPoolMemory = 0;
+    TrimPool( 0 );
+    maximumPoolMemory = budget;
+    policyMutex.Unlock();
+    buffer = AllocateAligned( bytes, useHugePages ? hugePageSize : cacheLineSize );
+    if( buffer == ITK_NULLPTR )
+      {
+      throw std::bad_alloc();
+      }
+    }
+#if defined( __linux__ ) && defined( MADV_HUGEPAGE )
+  if( useHugePages )
+    {
+    madvise( buffer, bytes, MADV_HUGEPAGE );
+    }
+#endif
+
+  if( slabBegins.size() > 1 && bytes >= firstTouchThreshold )
+    {
+    FirstTouchThreadStruct str;
+    str.Buffer = static_cast<char *>( buffer );
+    str.Bytes = bytes;
+    str.SlabBegins = &slabBegins;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( slabBegins.size() );
+    threader->SetSingleMethod( FirstTouchThreaderCallback, &str );
+    threader->SingleMethodExecute();
+    }
+  return buffer;
+}
+
+void ImageAllocationPolicy::Release( void *buffer, unsigned long bytes )
+{
+  policyMutex.Lock();
+  if( bytes <= maximumPoolMemory )
+    {
+    TrimPool( bytes );
+    PooledBuffer pooled;
+    pooled.Buffer = buffer;
+    pooled.Bytes = bytes;
+    pool.push_front( pooled );
+    poolMemory += bytes;
+    policyMutex.Unlock();
+    return;
+    }
+  policyMutex.Unlock();
+  FreeAligned( buffer );
+}
+} // namespace ants
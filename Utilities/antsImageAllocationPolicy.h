@@ -0,0 +1,168 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsImageAllocationPolicy_h
+#define __antsImageAllocationPolicy_h
+
+#include "itkCommand.h"
+#include "itkImage.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
+
+namespace ants
+{
+/** \class ImageAllocationPolicy
+ *
+ * Opt-in placement of the pixel buffers of the itk::Images allocated
+ * through AllocImage, for machines with several memory nodes:
+ *
+ *  - first touch: the buffer is zeroed on the threads of an
+ *    itk::MultiThreader, each writing the slab that the default splitter of
+ *    the threaded filters gives it, so that the pages are spread over the
+ *    nodes rather than all taken on the node of the allocating thread;
+ *  - huge pages: buffers of 8 MB and more are aligned to 2 MB and, on
+ *    Linux, advised as candidates for transparent huge pages;
+ *  - pool: released buffers are kept, up to a budget, and handed again to
+ *    the next image of the same byte size, which spares the allocation, the
+ *    page faults and the first touch of the temporaries allocated and freed
+ *    on every iteration of the registrations.
+ *
+ * Everything is off until enabled with the setters or with the environment
+ * variables ANTS_IMAGE_ALLOCATION, a comma separated list among
+ * "firsttouch" and "hugepages", and ANTS_IMAGE_POOL_MB, the budget of the
+ * pool.  Buffers allocated while the policy is on are freed correctly after
+ * it is turned off.
+ */
+class ImageAllocationPolicy
+{
+public:
+  static void SetFirstTouch( bool firstTouch );
+
+  static bool GetFirstTouch();
+
+  static void SetHugePages( bool hugePages );
+
+  static bool GetHugePages();
+
+  /** Budget of the pool in bytes, 0 disables the pool and frees it. */
+  static void SetMaximumPoolMemory( unsigned long bytes );
+
+  static unsigned long GetMaximumPoolMemory();
+
+  static bool IsEnabled();
+
+  /** A buffer of the given bytes, from the pool or newly allocated.  The
+   * ranges of bytes of the slabs are those written by each thread on first
+   * touch; a buffer from the pool is returned as it was released. */
+  static void * Allocate( unsigned long bytes, const std::vector<unsigned long> & slabBegins );
+
+  /** Give back a buffer returned by Allocate. */
+  static void Release( void *buffer, unsigned long bytes );
+
+  /** The bytes of the buffers held by the pool. */
+  static unsigned long GetPoolMemory();
+
+private:
+  ImageAllocationPolicy();
+};
+
+/** Release of a buffer from ImageAllocationPolicy when the pixel container
+ * which imported it is deleted. */
+class ImageAllocationReleaseCommand : public itk::Command
+{
+public:
+  typedef ImageAllocationReleaseCommand Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer<Self>       Pointer;
+  itkNewMacro( Self );
+
+  virtual void Execute( itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE
+  {
+    this->Execute( const_cast<const itk::Object *>( caller ), event );
+  }
+
+  virtual void Execute( const itk::Object *, const itk::EventObject & event ) ITK_OVERRIDE
+  {
+    if( itk::DeleteEvent().CheckEvent( &event ) && this->m_Buffer )
+      {
+      ImageAllocationPolicy::Release( this->m_Buffer, this->m_Bytes );
+      this->m_Buffer = ITK_NULLPTR;
+      }
+  }
+
+  void *        m_Buffer;
+  unsigned long m_Bytes;
+protected:
+  ImageAllocationReleaseCommand() : m_Buffer( ITK_NULLPTR ), m_Bytes( 0 )
+  {
+  }
+};
+
+/** Allocate the buffered region of an image, through ImageAllocationPolicy
+ * when it is enabled.  Images other than itk::Image (VectorImage, ...) are
+ * always allocated by ITK. */
+template <class ImageType>
+void AllocateImageBuffer( ImageType *image )
+{
+  image->Allocate();
+}
+
+template <class TPixel, unsigned int VImageDimension>
+void AllocateImageBuffer( itk::Image<TPixel, VImageDimension> *image )
+{
+  typedef itk::Image<TPixel, VImageDimension>  ImageType;
+  typedef typename ImageType::PixelContainer   PixelContainerType;
+  typedef typename PixelContainerType::Element ElementType;
+
+  const itk::SizeValueType numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  if( !ImageAllocationPolicy::IsEnabled() || numberOfPixels == 0 )
+    {
+    image->Allocate();
+    return;
+    }
+
+  // the slabs of the default splitter of the threaded filters, which are
+  // contiguous in the buffer
+  std::vector<unsigned long> slabBegins;
+  if( ImageAllocationPolicy::GetFirstTouch() )
+    {
+    itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+    const typename ImageType::RegionType           bufferedRegion = image->GetBufferedRegion();
+    const unsigned int                             numberOfSlabs = splitter->GetNumberOfSplits(
+        bufferedRegion, itk::MultiThreader::GetGlobalDefaultNumberOfThreads() );
+    for( unsigned int s = 0; s < numberOfSlabs; s++ )
+      {
+      typename ImageType::RegionType slab = bufferedRegion;
+      splitter->GetSplit( s, numberOfSlabs, slab );
+      slabBegins.push_back( image->ComputeOffset( slab.GetIndex() ) * sizeof( ElementType ) );
+      }
+    }
+
+  const unsigned long bytes = numberOfPixels * sizeof( ElementType );
+  void *              buffer = ImageAllocationPolicy::Allocate( bytes, slabBegins );
+
+  typename PixelContainerType::Pointer container = PixelContainerType::New();
+  container->SetImportPointer( static_cast<ElementType *>( buffer ), numberOfPixels, false );
+
+  ImageAllocationReleaseCommand::Pointer release = ImageAllocationReleaseCommand::New();
+  release->m_Buffer = buffer;
+  release->m_Bytes = bytes;
+  container->AddObserver( itk::DeleteEvent(), release );
+
+  image->SetPixelContainer( container );
+}
+} // namespace ants
+
+#endif // __antsImageAllocationPolicy_h
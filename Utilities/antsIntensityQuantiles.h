@@ -0,0 +1,212 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsIntensityQuantiles_h
+#define antsIntensityQuantiles_h
+
+#include "itkHistogram.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** Quantiles of the intensities of an image within a mask (the voxels
+ * labeled 1) or, without a mask, of its positive voxels, read off a
+ * histogram of numberOfBins bins between the smallest and largest of those
+ * intensities.  The histogram and its quantiles are those of
+ * LabelStatisticsImageFilter and itk::Statistics::Histogram::Quantile, but
+ * the range and the histogram are each gathered in one pass over the
+ * buffers on all threads, without a label image or a map of labels.
+ */
+class IntensityQuantiles
+{
+public:
+  /** Returns false if there is no voxel in the mask. */
+  template <class TImage, class TMask>
+  static bool Compute( const TImage *image, const TMask *mask, unsigned int numberOfBins,
+                       double lowerQuantile, double upperQuantile, double & lower, double & upper )
+  {
+    typedef typename TImage::PixelType PixelType;
+    typedef typename TMask::PixelType  MaskPixelType;
+
+    ThreadStruct<PixelType, MaskPixelType> str;
+    str.Image = image->GetBufferPointer();
+    str.Mask = mask ? mask->GetBufferPointer() : ITK_NULLPTR;
+    str.NumberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+    str.NumberOfBins = std::max( numberOfBins, 1u );
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfPixels ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    const unsigned int numberOfThreads = threader->GetNumberOfThreads();
+    str.Minimum.assign( numberOfThreads, itk::NumericTraits<PixelType>::max() );
+    str.Maximum.assign( numberOfThreads, itk::NumericTraits<PixelType>::NonpositiveMin() );
+    str.Counts.assign( numberOfThreads, 0 );
+    threader->SetSingleMethod( RangeThreaderCallback<PixelType, MaskPixelType>, &str );
+    threader->SingleMethodExecute();
+
+    PixelType          minValue = str.Minimum[0];
+    PixelType          maxValue = str.Maximum[0];
+    itk::SizeValueType count = str.Counts[0];
+    for( unsigned int t = 1; t < numberOfThreads; t++ )
+      {
+      minValue = std::min( minValue, str.Minimum[t] );
+      maxValue = std::max( maxValue, str.Maximum[t] );
+      count += str.Counts[t];
+      }
+    if( count == 0 )
+      {
+      return false;
+      }
+
+    // Hack increment by delta
+    if( minValue == 0 )
+      {
+      minValue = (PixelType) ( minValue + 1e-6 );
+      }
+    if( minValue == 0 )
+      {
+      minValue++;
+      }
+    str.Lower = minValue;
+    str.BinWidth = ( static_cast<double>( maxValue ) - static_cast<double>( minValue ) ) / str.NumberOfBins;
+    str.Frequencies.assign( numberOfThreads, std::vector<itk::SizeValueType>( str.NumberOfBins, 0 ) );
+    threader->SetSingleMethod( HistogramThreaderCallback<PixelType, MaskPixelType>, &str );
+    threader->SingleMethodExecute();
+
+    typedef itk::Statistics::Histogram<double> HistogramType;
+    HistogramType::Pointer histogram = HistogramType::New();
+
+    HistogramType::SizeType              size( 1 );
+    HistogramType::MeasurementVectorType lowerBound( 1 );
+    HistogramType::MeasurementVectorType upperBound( 1 );
+    size[0] = str.NumberOfBins;
+    lowerBound[0] = minValue;
+    upperBound[0] = maxValue;
+    histogram->SetMeasurementVectorSize( 1 );
+    histogram->SetClipBinsAtEnds( false );
+    histogram->Initialize( size, lowerBound, upperBound );
+    for( unsigned int b = 0; b < str.NumberOfBins; b++ )
+      {
+      itk::SizeValueType frequency = 0;
+      for( unsigned int t = 0; t < numberOfThreads; t++ )
+        {
+        frequency += str.Frequencies[t][b];
+        }
+      histogram->SetFrequency( b, frequency );
+      }
+
+    lower = histogram->Quantile( 0, lowerQuantile );
+    upper = histogram->Quantile( 0, upperQuantile );
+    return true;
+  }
+
+private:
+  IntensityQuantiles();
+
+  template <class TPixel, class TMaskPixel>
+  struct ThreadStruct
+    {
+    const TPixel *     Image;
+    const TMaskPixel * Mask;
+    itk::SizeValueType NumberOfPixels;
+    unsigned int       NumberOfBins;
+
+    std::vector<TPixel>             Minimum;
+    std::vector<TPixel>             Maximum;
+    std::vector<itk::SizeValueType> Counts;
+
+    double                                       Lower;
+    double                                       BinWidth;
+    std::vector<std::vector<itk::SizeValueType> > Frequencies;
+    };
+
+  /** the voxels labeled 1, or the positive ones without a mask */
+  template <class TPixel, class TMaskPixel>
+  static bool IsInside( const ThreadStruct<TPixel, TMaskPixel> *str, itk::SizeValueType n )
+  {
+    if( str->Mask )
+      {
+      return str->Mask[n] == 1;
+      }
+    return str->Image[n] >= 1e-6 && str->Image[n] <= itk::NumericTraits<TPixel>::max();
+  }
+
+  template <class TPixel, class TMaskPixel>
+  static ITK_THREAD_RETURN_TYPE RangeThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct<TPixel, TMaskPixel> *    str = static_cast<ThreadStruct<TPixel, TMaskPixel> *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    TPixel             minimum = itk::NumericTraits<TPixel>::max();
+    TPixel             maximum = itk::NumericTraits<TPixel>::NonpositiveMin();
+    itk::SizeValueType count = 0;
+    for( itk::SizeValueType n = first; n < last; n++ )
+      {
+      if( IsInside( str, n ) )
+        {
+        minimum = std::min( minimum, str->Image[n] );
+        maximum = std::max( maximum, str->Image[n] );
+        count++;
+        }
+      }
+    str->Minimum[info->ThreadID] = minimum;
+    str->Maximum[info->ThreadID] = maximum;
+    str->Counts[info->ThreadID] = count;
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** the bins of itk::Statistics::Histogram with ClipBinsAtEnds off, the
+   * intensities outside of the range going to the end bins */
+  template <class TPixel, class TMaskPixel>
+  static ITK_THREAD_RETURN_TYPE HistogramThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct<TPixel, TMaskPixel> *    str = static_cast<ThreadStruct<TPixel, TMaskPixel> *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    std::vector<itk::SizeValueType> & frequencies = str->Frequencies[info->ThreadID];
+    const long                        lastBin = str->NumberOfBins - 1;
+    for( itk::SizeValueType n = first; n < last; n++ )
+      {
+      if( IsInside( str, n ) )
+        {
+        const double position = ( str->Image[n] - str->Lower ) / str->BinWidth;
+        long         b = lastBin;
+        if( position < 0.0 )
+          {
+          b = 0;
+          }
+        else if( position < lastBin + 1 )
+          {
+          b = std::min( static_cast<long>( position ), lastBin );
+          }
+        frequencies[b]++;
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif // antsIntensityQuantiles_h
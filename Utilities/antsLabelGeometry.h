@@ -0,0 +1,303 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsLabelGeometry_h
+#define antsLabelGeometry_h
+
+#include "itkContinuousIndex.h"
+#include "itkFixedArray.h"
+#include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
+#include <vnl/vnl_math.h>
+#include <vnl/vnl_matrix_fixed.h>
+#include <vnl/vnl_vector_fixed.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+namespace ants
+{
+/** Per-label moments accumulated in one pass over the label image (and the
+ * intensity image), and the measures of itk::LabelGeometryImageFilter
+ * derived from them.  As in that filter, positions are in index space. */
+template <unsigned int ImageDimension>
+class LabelGeometry
+{
+public:
+  typedef itk::Index<ImageDimension>                             IndexType;
+  typedef itk::Point<double, ImageDimension>                     PointType;
+  typedef itk::FixedArray<double, ImageDimension>                AxesLengthType;
+  typedef itk::FixedArray<itk::IndexValueType, 2 * ImageDimension> BoundingBoxType;
+
+  LabelGeometry() :
+    m_Volume( 0 ),
+    m_IntegratedIntensity( 0 ),
+    m_Eccentricity( 0 ),
+    m_Elongation( 0 ),
+    m_Orientation( 0 )
+  {
+    m_FirstOrderRawMoments.fill( 0 );
+    m_FirstOrderWeightedRawMoments.fill( 0 );
+    m_SecondOrderRawMoments.fill( 0 );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_BoundingBox[2 * d] = itk::NumericTraits<itk::IndexValueType>::max();
+      m_BoundingBox[2 * d + 1] = itk::NumericTraits<itk::IndexValueType>::NonpositiveMin();
+      }
+  }
+
+  void AddPixel( const IndexType & index, double value )
+  {
+    m_Volume++;
+    m_IntegratedIntensity += value;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      m_BoundingBox[2 * i] = std::min( m_BoundingBox[2 * i], index[i] );
+      m_BoundingBox[2 * i + 1] = std::max( m_BoundingBox[2 * i + 1], index[i] );
+      m_FirstOrderRawMoments[i] += index[i];
+      m_FirstOrderWeightedRawMoments[i] += index[i] * value;
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        m_SecondOrderRawMoments( i, j ) += static_cast<double>( index[i] ) * index[j];
+        }
+      }
+  }
+
+  void Add( const LabelGeometry & other )
+  {
+    m_Volume += other.m_Volume;
+    m_IntegratedIntensity += other.m_IntegratedIntensity;
+    m_FirstOrderRawMoments += other.m_FirstOrderRawMoments;
+    m_FirstOrderWeightedRawMoments += other.m_FirstOrderWeightedRawMoments;
+    m_SecondOrderRawMoments += other.m_SecondOrderRawMoments;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      m_BoundingBox[2 * i] = std::min( m_BoundingBox[2 * i], other.m_BoundingBox[2 * i] );
+      m_BoundingBox[2 * i + 1] = std::max( m_BoundingBox[2 * i + 1], other.m_BoundingBox[2 * i + 1] );
+      }
+  }
+
+  /** Centroid, axes, eccentricity, elongation and orientation from the
+   * second order central moments. */
+  void Finalize()
+  {
+    vnl_matrix<double> centralMoments( ImageDimension, ImageDimension );
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      m_Centroid[i] = m_FirstOrderRawMoments[i] / m_Volume;
+      m_WeightedCentroid[i] = m_FirstOrderWeightedRawMoments[i] / m_IntegratedIntensity;
+      }
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        centralMoments( i, j ) = m_SecondOrderRawMoments( i, j ) / m_Volume - m_Centroid[i] * m_Centroid[j];
+        }
+      }
+
+    // eigenvalues in ascending order
+    vnl_symmetric_eigensystem<double> eigen( centralMoments );
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      m_AxesLength[i] = 4 * std::sqrt( eigen.get_eigenvalue( i ) );
+      }
+    const double minorAxisLength = m_AxesLength[0];
+    const double majorAxisLength = m_AxesLength[ImageDimension - 1];
+    m_Eccentricity = std::sqrt( ( eigen.get_eigenvalue( ImageDimension - 1 ) - eigen.get_eigenvalue( 0 ) )
+                                / eigen.get_eigenvalue( ImageDimension - 1 ) );
+    m_Elongation = majorAxisLength / minorAxisLength;
+
+    double orientation = std::atan2( eigen.V( 1, ImageDimension - 1 ), eigen.V( 0, ImageDimension - 1 ) );
+    // the orientation of an axis is only defined up to pi
+    if( orientation < -0.5 * vnl_math::pi )
+      {
+      orientation += vnl_math::pi;
+      }
+    if( orientation > 0.5 * vnl_math::pi )
+      {
+      orientation -= vnl_math::pi;
+      }
+    m_Orientation = orientation;
+  }
+
+  unsigned long   m_Volume;
+  double          m_IntegratedIntensity;
+  BoundingBoxType m_BoundingBox;
+  PointType       m_Centroid;
+  PointType       m_WeightedCentroid;
+  AxesLengthType  m_AxesLength;
+  double          m_Eccentricity;
+  double          m_Elongation;
+  double          m_Orientation;
+
+private:
+  vnl_vector_fixed<double, ImageDimension>                 m_FirstOrderRawMoments;
+  vnl_vector_fixed<double, ImageDimension>                 m_FirstOrderWeightedRawMoments;
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> m_SecondOrderRawMoments;
+};
+
+template <class TLabelImage, class TRealImage>
+struct LabelGeometryThreadStruct
+  {
+  typedef LabelGeometry<TLabelImage::ImageDimension>                        GeometryType;
+  typedef std::map<typename TLabelImage::PixelType, GeometryType>          MapType;
+
+  const TLabelImage *  LabelImage;
+  const TRealImage *   IntensityImage;
+  bool                 SkipBackground;
+  std::vector<MapType> GeometryPerThread;
+  };
+
+/** Accumulates the moments of the pixels of a slab of the slowest
+ * dimension per label. */
+template <class TLabelImage, class TRealImage>
+ITK_THREAD_RETURN_TYPE LabelGeometryThreaderCallback( void *arg )
+{
+  typedef LabelGeometryThreadStruct<TLabelImage, TRealImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType                  MapType;
+  typedef typename ThreadStructType::GeometryType             GeometryType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const unsigned int                   lastDimension = TLabelImage::ImageDimension - 1;
+  typename TLabelImage::RegionType     region = str->LabelImage->GetLargestPossibleRegion();
+  const itk::SizeValueType             size = region.GetSize()[lastDimension];
+  const itk::SizeValueType             begin = size * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType             end = size * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  if( begin == end )
+    {
+    return ITK_THREAD_RETURN_VALUE;
+    }
+  region.SetIndex( lastDimension, region.GetIndex()[lastDimension] + begin );
+  region.SetSize( lastDimension, end - begin );
+
+  MapType & geometry = str->GeometryPerThread[info->ThreadID];
+
+  itk::ImageRegionConstIteratorWithIndex<TLabelImage> It( str->LabelImage, region );
+  itk::ImageRegionConstIterator<TRealImage>           ItI;
+  if( str->IntensityImage )
+    {
+    ItI = itk::ImageRegionConstIterator<TRealImage>( str->IntensityImage, region );
+    ItI.GoToBegin();
+    }
+
+  // neighboring pixels mostly share the label; only look it up when it changes
+  typename TLabelImage::PixelType currentLabel = 0;
+  GeometryType *                  current = ITK_NULLPTR;
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    double value = 0;
+    if( str->IntensityImage )
+      {
+      value = ItI.Get();
+      ++ItI;
+      }
+    const typename TLabelImage::PixelType label = It.Get();
+    if( str->SkipBackground && label == 0 )
+      {
+      continue;
+      }
+    if( !current || label != currentLabel )
+      {
+      currentLabel = label;
+      current = &geometry[label];
+      }
+    current->AddPixel( It.GetIndex(), value );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The finalized geometry of every label of the image, the background (0)
+ * included unless skipped, in one threaded pass over slabs of the slowest
+ * dimension.  The intensity image may be ITK_NULLPTR. */
+template <class TLabelImage, class TRealImage>
+void ComputeLabelGeometry( const TLabelImage *labelImage, const TRealImage *intensityImage, bool skipBackground,
+                           typename LabelGeometryThreadStruct<TLabelImage, TRealImage>::MapType & geometry )
+{
+  typedef LabelGeometryThreadStruct<TLabelImage, TRealImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType                  MapType;
+
+  ThreadStructType str;
+  str.LabelImage = labelImage;
+  str.IntensityImage = intensityImage;
+  str.SkipBackground = skipBackground;
+
+  const unsigned int numberOfThreads = std::max( std::min( itk::MultiThreader::GetGlobalDefaultNumberOfThreads(),
+    static_cast<unsigned int>( labelImage->GetLargestPossibleRegion().GetSize()[TLabelImage::ImageDimension - 1] ) ),
+    1u );
+  str.GeometryPerThread.resize( numberOfThreads );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( LabelGeometryThreaderCallback<TLabelImage, TRealImage>, &str );
+  threader->SingleMethodExecute();
+
+  geometry.clear();
+  for( unsigned int n = 0; n < numberOfThreads; n++ )
+    {
+    for( typename MapType::const_iterator it = str.GeometryPerThread[n].begin();
+         it != str.GeometryPerThread[n].end(); ++it )
+      {
+      geometry[it->first].Add( it->second );
+      }
+    str.GeometryPerThread[n].clear();
+    }
+  for( typename MapType::iterator it = geometry.begin(); it != geometry.end(); ++it )
+    {
+    it->second.Finalize();
+    }
+}
+
+/** The labels other than 0, in ascending order, and the physical points of
+ * their centroids:  the landmarks of a landmark label image. */
+template <class TLabelImage, class TPoint>
+void GetLabelCentroids( const TLabelImage *labelImage, std::vector<typename TLabelImage::PixelType> & labels,
+                        std::vector<TPoint> & centroids )
+{
+  typedef LabelGeometryThreadStruct<TLabelImage, TLabelImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType                   MapType;
+
+  MapType geometry;
+  ComputeLabelGeometry<TLabelImage, TLabelImage>( labelImage, ITK_NULLPTR, true, geometry );
+
+  labels.clear();
+  centroids.clear();
+  for( typename MapType::const_iterator it = geometry.begin(); it != geometry.end(); ++it )
+    {
+    // the mean of the physical points is the physical point of the mean index
+    itk::ContinuousIndex<double, TLabelImage::ImageDimension> centroidIndex;
+    for( unsigned int d = 0; d < TLabelImage::ImageDimension; d++ )
+      {
+      centroidIndex[d] = it->second.m_Centroid[d];
+      }
+    typename TLabelImage::PointType physicalCentroid;
+    labelImage->TransformContinuousIndexToPhysicalPoint( centroidIndex, physicalCentroid );
+
+    TPoint centroid;
+    for( unsigned int d = 0; d < TLabelImage::ImageDimension; d++ )
+      {
+      centroid[d] = physicalCentroid[d];
+      }
+    labels.push_back( it->first );
+    centroids.push_back( centroid );
+    }
+}
+} // namespace ants
+
+#endif // antsLabelGeometry_h
@@ -0,0 +1,396 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsLabelIntensityStatistics_h
+#define antsLabelIntensityStatistics_h
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+namespace ants
+{
+/** The count, sum, extrema and central moments up to the fourth of the
+ * intensities of one label.  The moments are updated one value at a time
+ * (Terriberry's extension of Welford's algorithm) and merged across threads
+ * with the pairwise formulas of Pebay, so they do not suffer from the
+ * cancellation of raw power sums in float images with a large mean.  With
+ * an initialized histogram, the values are also counted in equal bins over
+ * its range, for the quantiles and the entropy. */
+class LabelIntensityStatistics
+{
+public:
+  LabelIntensityStatistics() :
+    m_Count( 0 ),
+    m_Sum( 0 ),
+    m_Minimum( itk::NumericTraits<double>::max() ),
+    m_Maximum( itk::NumericTraits<double>::NonpositiveMin() ),
+    m_HistogramMinimum( 0 ),
+    m_HistogramMaximum( 0 ),
+    m_Mean( 0 ),
+    m_M2( 0 ),
+    m_M3( 0 ),
+    m_M4( 0 )
+  {
+  }
+
+  void InitializeHistogram( unsigned int numberOfBins, double minimum, double maximum )
+  {
+    m_Histogram.assign( numberOfBins, 0 );
+    m_HistogramMinimum = minimum;
+    m_HistogramMaximum = maximum;
+  }
+
+  void AddValue( double value )
+  {
+    const double n1 = static_cast<double>( m_Count );
+    const double n = n1 + 1;
+    const double delta = value - m_Mean;
+    const double deltaN = delta / n;
+    const double deltaN2 = deltaN * deltaN;
+    const double term = delta * deltaN * n1;
+
+    m_Mean += deltaN;
+    m_M4 += term * deltaN2 * ( n * n - 3 * n + 3 ) + 6 * deltaN2 * m_M2 - 4 * deltaN * m_M3;
+    m_M3 += term * deltaN * ( n - 2 ) - 3 * deltaN * m_M2;
+    m_M2 += term;
+
+    m_Count++;
+    m_Sum += value;
+    m_Minimum = std::min( m_Minimum, value );
+    m_Maximum = std::max( m_Maximum, value );
+    if( !m_Histogram.empty() )
+      {
+      m_Histogram[this->GetHistogramBin( value )]++;
+      }
+  }
+
+  /** Merges the statistics of other, whose histogram, if any, must have the
+   * same bins. */
+  void Add( const LabelIntensityStatistics & other )
+  {
+    if( other.m_Count == 0 )
+      {
+      return;
+      }
+    if( m_Count == 0 )
+      {
+      *this = other;
+      return;
+      }
+
+    const double na = static_cast<double>( m_Count );
+    const double nb = static_cast<double>( other.m_Count );
+    const double n = na + nb;
+    const double delta = other.m_Mean - m_Mean;
+    const double delta2 = delta * delta;
+
+    m_Mean += delta * nb / n;
+    m_M4 += other.m_M4 + delta2 * delta2 * na * nb * ( na * na - na * nb + nb * nb ) / ( n * n * n )
+      + 6 * delta2 * ( na * na * other.m_M2 + nb * nb * m_M2 ) / ( n * n )
+      + 4 * delta * ( na * other.m_M3 - nb * m_M3 ) / n;
+    m_M3 += other.m_M3 + delta2 * delta * na * nb * ( na - nb ) / ( n * n )
+      + 3 * delta * ( na * other.m_M2 - nb * m_M2 ) / n;
+    m_M2 += other.m_M2 + delta2 * na * nb / n;
+
+    m_Count += other.m_Count;
+    m_Sum += other.m_Sum;
+    m_Minimum = std::min( m_Minimum, other.m_Minimum );
+    m_Maximum = std::max( m_Maximum, other.m_Maximum );
+    for( unsigned int i = 0; i < m_Histogram.size() && i < other.m_Histogram.size(); i++ )
+      {
+      m_Histogram[i] += other.m_Histogram[i];
+      }
+  }
+
+  double GetMean() const
+  {
+    return m_Mean;
+  }
+
+  /** The unbiased variance, as that of itk::LabelStatisticsImageFilter. */
+  double GetVariance() const
+  {
+    return ( m_Count > 1 ) ? m_M2 / static_cast<double>( m_Count - 1 ) : 0.0;
+  }
+
+  double GetSigma() const
+  {
+    return std::sqrt( this->GetVariance() );
+  }
+
+  /** sum( ( x - mean )^order ) / count, for order 2, 3 or 4. */
+  double GetCentralMoment( unsigned int order ) const
+  {
+    if( m_Count == 0 )
+      {
+      return 0.0;
+      }
+    const double moment = ( order == 2 ) ? m_M2 : ( ( order == 3 ) ? m_M3 : m_M4 );
+    return moment / static_cast<double>( m_Count );
+  }
+
+  /** The value below which the fraction p of the values lies, interpolated
+   * linearly within its bin of the histogram and kept within the extrema. */
+  double GetQuantile( double p ) const
+  {
+    if( m_Histogram.empty() || m_Count == 0 )
+      {
+      return 0.0;
+      }
+    const double binWidth = ( m_HistogramMaximum - m_HistogramMinimum ) / static_cast<double>( m_Histogram.size() );
+    const double target = p * static_cast<double>( m_Count );
+
+    double quantile = m_Maximum;
+    double cumulated = 0.0;
+    for( unsigned int i = 0; i < m_Histogram.size(); i++ )
+      {
+      const double frequency = static_cast<double>( m_Histogram[i] );
+      if( frequency > 0 && cumulated + frequency >= target )
+        {
+        quantile = m_HistogramMinimum + binWidth * ( i + ( target - cumulated ) / frequency );
+        break;
+        }
+      cumulated += frequency;
+      }
+    return std::max( m_Minimum, std::min( m_Maximum, quantile ) );
+  }
+
+  /** The entropy, in bits, of the histogram merged into numberOfBins bins,
+   * a divisor of the number of bins of the histogram. */
+  double GetEntropy( unsigned int numberOfBins ) const
+  {
+    if( m_Histogram.empty() || m_Count == 0 || numberOfBins == 0 )
+      {
+      return 0.0;
+      }
+    const unsigned int binsPerBin = std::max( static_cast<unsigned int>( m_Histogram.size() / numberOfBins ), 1u );
+
+    double entropy = 0.0;
+    for( unsigned int i = 0; i < m_Histogram.size(); i += binsPerBin )
+      {
+      itk::SizeValueType frequency = 0;
+      for( unsigned int j = i; j < i + binsPerBin && j < m_Histogram.size(); j++ )
+        {
+        frequency += m_Histogram[j];
+        }
+      const double p = static_cast<double>( frequency ) / static_cast<double>( m_Count );
+      if( p > 0 )
+        {
+        entropy -= p * std::log( p ) / std::log( 2.0 );
+        }
+      }
+    return entropy;
+  }
+
+  itk::SizeValueType              m_Count;
+  double                          m_Sum;
+  double                          m_Minimum;
+  double                          m_Maximum;
+  std::vector<itk::SizeValueType> m_Histogram;
+  double                          m_HistogramMinimum;
+  double                          m_HistogramMaximum;
+
+private:
+  unsigned int GetHistogramBin( double value ) const
+  {
+    const double range = m_HistogramMaximum - m_HistogramMinimum;
+    if( !( range > 0 ) || !( value > m_HistogramMinimum ) )
+      {
+      return 0;
+      }
+    const double bin = ( value - m_HistogramMinimum ) / range * static_cast<double>( m_Histogram.size() );
+    if( bin >= static_cast<double>( m_Histogram.size() ) )
+      {
+      return m_Histogram.size() - 1;
+      }
+    return static_cast<unsigned int>( bin );
+  }
+
+  double m_Mean;
+  double m_M2;
+  double m_M3;
+  double m_M4;
+};
+
+template <class TLabelImage, class TRealImage>
+struct LabelIntensityStatisticsThreadStruct
+  {
+  typedef typename TLabelImage::PixelType                   LabelType;
+  typedef std::map<LabelType, LabelIntensityStatistics>     MapType;
+
+  const TLabelImage *  LabelImage;
+  const TRealImage *   IntensityImage;
+  bool                 SkipBackground;
+  itk::SizeValueType   NumberOfPixels;
+  unsigned int         NumberOfHistogramBins;
+  double               HistogramMinimum;
+  double               HistogramMaximum;
+  std::vector<double>  MinimumPerThread;
+  std::vector<double>  MaximumPerThread;
+  std::vector<MapType> StatisticsPerThread;
+  };
+
+/** The extrema of the intensities counted by
+ * LabelIntensityStatisticsThreaderCallback in a range of the buffer:  the
+ * range of the histograms. */
+template <class TLabelImage, class TRealImage>
+ITK_THREAD_RETURN_TYPE LabelIntensityRangeThreaderCallback( void *arg )
+{
+  typedef LabelIntensityStatisticsThreadStruct<TLabelImage, TRealImage> ThreadStructType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  const typename TLabelImage::PixelType *labels = str->LabelImage ? str->LabelImage->GetBufferPointer() :
+    ITK_NULLPTR;
+  const typename TRealImage::PixelType *values = str->IntensityImage->GetBufferPointer();
+
+  double minimum = itk::NumericTraits<double>::max();
+  double maximum = itk::NumericTraits<double>::NonpositiveMin();
+  for( itk::SizeValueType n = first; n < last; n++ )
+    {
+    if( labels && str->SkipBackground && labels[n] == 0 )
+      {
+      continue;
+      }
+    const double value = static_cast<double>( values[n] );
+    minimum = std::min( minimum, value );
+    maximum = std::max( maximum, value );
+    }
+  str->MinimumPerThread[info->ThreadID] = minimum;
+  str->MaximumPerThread[info->ThreadID] = maximum;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Accumulates the statistics of the intensities of a range of the buffer
+ * per label. */
+template <class TLabelImage, class TRealImage>
+ITK_THREAD_RETURN_TYPE LabelIntensityStatisticsThreaderCallback( void *arg )
+{
+  typedef LabelIntensityStatisticsThreadStruct<TLabelImage, TRealImage> ThreadStructType;
+  typedef typename ThreadStructType::LabelType                           LabelType;
+  typedef typename ThreadStructType::MapType                             MapType;
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStructType *                    str = static_cast<ThreadStructType *>( info->UserData );
+
+  const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+  const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  const LabelType *                     labels = str->LabelImage ? str->LabelImage->GetBufferPointer() : ITK_NULLPTR;
+  const typename TRealImage::PixelType *values = str->IntensityImage->GetBufferPointer();
+
+  MapType & statistics = str->StatisticsPerThread[info->ThreadID];
+
+  // neighboring pixels mostly share the label; only look it up when it changes
+  LabelType                  currentLabel = 1;
+  LabelIntensityStatistics * current = ITK_NULLPTR;
+  for( itk::SizeValueType n = first; n < last; n++ )
+    {
+    const LabelType label = labels ? labels[n] : static_cast<LabelType>( 1 );
+    if( str->SkipBackground && label == 0 )
+      {
+      continue;
+      }
+    if( !current || label != currentLabel )
+      {
+      currentLabel = label;
+      typename MapType::iterator it = statistics.find( label );
+      if( it == statistics.end() )
+        {
+        it = statistics.insert( typename MapType::value_type( label, LabelIntensityStatistics() ) ).first;
+        if( str->NumberOfHistogramBins > 0 )
+          {
+          it->second.InitializeHistogram( str->NumberOfHistogramBins, str->HistogramMinimum,
+                                          str->HistogramMaximum );
+          }
+        }
+      current = &( it->second );
+      }
+    current->AddValue( static_cast<double>( values[n] ) );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** The intensity statistics of every label of the image, the background (0)
+ * included unless skipped, in one threaded pass over the buffer.  Without a
+ * label image every pixel has the label 1.  With numberOfHistogramBins > 0,
+ * a first, cheaper pass finds the range of the counted intensities, over
+ * which the histograms of all labels share their bins.  The label image, if
+ * any, must have the buffered region of the intensity image. */
+template <class TLabelImage, class TRealImage>
+void ComputeLabelIntensityStatistics( const TLabelImage *labelImage, const TRealImage *intensityImage,
+                                      bool skipBackground, unsigned int numberOfHistogramBins,
+                                      typename LabelIntensityStatisticsThreadStruct<TLabelImage,
+                                                                                    TRealImage>::MapType & statistics )
+{
+  typedef LabelIntensityStatisticsThreadStruct<TLabelImage, TRealImage> ThreadStructType;
+  typedef typename ThreadStructType::MapType                             MapType;
+
+  ThreadStructType str;
+  str.LabelImage = labelImage;
+  str.IntensityImage = intensityImage;
+  str.SkipBackground = skipBackground;
+  str.NumberOfPixels = intensityImage->GetBufferedRegion().GetNumberOfPixels();
+  str.NumberOfHistogramBins = numberOfHistogramBins;
+  str.HistogramMinimum = 0.0;
+  str.HistogramMaximum = 0.0;
+
+  const unsigned int numberOfThreads = std::max( static_cast<unsigned int>( std::min(
+    static_cast<itk::SizeValueType>( itk::MultiThreader::GetGlobalDefaultNumberOfThreads() ), str.NumberOfPixels ) ),
+    1u );
+  str.StatisticsPerThread.resize( numberOfThreads );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+
+  if( numberOfHistogramBins > 0 )
+    {
+    str.MinimumPerThread.resize( numberOfThreads );
+    str.MaximumPerThread.resize( numberOfThreads );
+    threader->SetSingleMethod( LabelIntensityRangeThreaderCallback<TLabelImage, TRealImage>, &str );
+    threader->SingleMethodExecute();
+
+    const double minimum = *std::min_element( str.MinimumPerThread.begin(), str.MinimumPerThread.end() );
+    const double maximum = *std::max_element( str.MaximumPerThread.begin(), str.MaximumPerThread.end() );
+    if( minimum <= maximum )
+      {
+      str.HistogramMinimum = minimum;
+      str.HistogramMaximum = maximum;
+      }
+    }
+
+  threader->SetSingleMethod( LabelIntensityStatisticsThreaderCallback<TLabelImage, TRealImage>, &str );
+  threader->SingleMethodExecute();
+
+  statistics.clear();
+  for( unsigned int n = 0; n < numberOfThreads; n++ )
+    {
+    for( typename MapType::const_iterator it = str.StatisticsPerThread[n].begin();
+         it != str.StatisticsPerThread[n].end(); ++it )
+      {
+      statistics[it->first].Add( it->second );
+      }
+    str.StatisticsPerThread[n].clear();
+    }
+}
+} // namespace ants
+
+#endif // antsLabelIntensityStatistics_h
@@ -0,0 +1,890 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsLabelVotingFusion_h
+#define __antsLabelVotingFusion_h
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageIOFactory.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/** \class LabelVotingFusion
+ *
+ * The voting behind the label fusion operations of ImageMath
+ * (MajorityVoting, CorrelationVoting, STAPLE and AverageLabels).
+ *
+ * The atlases are read a slab of SlabSize slices (along the last dimension)
+ * at a time, one atlas per thread, and only the current slab is held in
+ * memory.  The voxels of the slab are then split among the threads; each
+ * voxel is voted on with a small histogram of the labels the atlases give
+ * it, so the cost does not depend on the number of labels.
+ *
+ * MajorityVoting and CorrelationVoting produce the fused label image
+ * directly.  For STAPLE and AverageLabels, ComputeLabelVotes() keeps for
+ * every label > 0 the voxels voted for it and the atlases that voted, so
+ * the per-label estimates only visit the voxels of their label.
+ *
+ * All the images have to be on the grid of the first label image.
+ */
+template <class TLabelImage, class TRealImage>
+class LabelVotingFusion
+{
+public:
+  typedef TLabelImage                         LabelImageType;
+  typedef typename LabelImageType::PixelType  LabelType;
+  typedef typename LabelImageType::Pointer    LabelImagePointer;
+  typedef TRealImage                          RealImageType;
+  typedef typename RealImageType::PixelType   RealType;
+  typedef typename LabelImageType::RegionType RegionType;
+  typedef typename LabelImageType::IndexType  IndexType;
+  typedef typename LabelImageType::OffsetType OffsetType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TLabelImage::ImageDimension );
+
+  /** The voxels (buffer offsets, in buffer order) voted for one label.  The
+   * atlases voting for Offsets[k] are Atlases[Ends[k - 1]], ...,
+   * Atlases[Ends[k] - 1]. */
+  struct LabelVotes
+    {
+    std::vector<unsigned long long> Offsets;
+    std::vector<size_t>             Ends;
+    std::vector<unsigned int>       Atlases;
+    };
+  typedef std::map<LabelType, LabelVotes> LabelVotesMapType;
+
+  LabelVotingFusion() :
+    m_NumberOfThreads( 0 ),
+    m_SlabSize( 0 ),
+    m_NeighborhoodRadius( 5 ),
+    m_MaximumLabel( 0 ),
+    m_Mode( MajorityVotingMode ),
+    m_NumberOfSlabVoxels( 0 ),
+    m_NumberOfExtendedSlabVoxels( 0 ),
+    m_NextInput( 0 ),
+    m_Failed( false )
+  {
+  }
+
+  void SetLabelFileNames( const std::vector<std::string> & fileNames )
+  {
+    this->m_LabelFileNames = fileNames;
+  }
+
+  /** The target and one intensity image per label image, for CorrelationVoting. */
+  void SetIntensityFileNames( const std::string & target, const std::vector<std::string> & fileNames )
+  {
+    this->m_TargetFileName = target;
+    this->m_IntensityFileNames = fileNames;
+  }
+
+  /** The radius of the correlation neighborhood of CorrelationVoting. */
+  void SetNeighborhoodRadius( unsigned int radius )
+  {
+    this->m_NeighborhoodRadius = radius;
+  }
+
+  /** The number of slices per slab.  0 picks a slab of about 2^26 atlas
+   * voxels, or the whole image if one of the inputs can't be read in
+   * pieces (e.g. compressed files, which would be decompressed again for
+   * every slab). */
+  void SetSlabSize( unsigned int slices )
+  {
+    this->m_SlabSize = slices;
+  }
+
+  /** 0 uses the ITK global default number of threads. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  unsigned int GetNumberOfAtlases() const
+  {
+    return this->m_LabelFileNames.size();
+  }
+
+  const std::string & GetErrorMessage() const
+  {
+    return this->m_ErrorMessage;
+  }
+
+  /** The grid of the first label image; it has no buffer. */
+  const LabelImageType * GetReferenceImage() const
+  {
+    return this->m_Reference.GetPointer();
+  }
+
+  /** At each voxel, the label with the most votes; of labels with as many
+   * votes, the one that got there first in atlas order. */
+  bool ComputeMajorityVoting( LabelImagePointer & output )
+  {
+    return this->Run( MajorityVotingMode, output );
+  }
+
+  /** Where the atlases disagree, each atlas votes with the absolute
+   * correlation of its intensity image and the target in the
+   * neighborhood. */
+  bool ComputeCorrelationVoting( LabelImagePointer & output )
+  {
+    return this->Run( CorrelationVotingMode, output );
+  }
+
+  /** Collect the votes for each label > 0, see GetLabelVotes(). */
+  bool ComputeLabelVotes()
+  {
+    LabelImagePointer output;
+    return this->Run( LabelVotesMode, output );
+  }
+
+  const LabelVotesMapType & GetLabelVotes() const
+  {
+    return this->m_LabelVotes;
+  }
+
+  /** The largest label of all atlases, valid after ComputeLabelVotes(). */
+  LabelType GetMaximumLabel() const
+  {
+    return this->m_MaximumLabel;
+  }
+
+  /** The fraction of the atlases voting for label at each voxel.  output
+   * has to be allocated on the reference grid. */
+  void ComputeAverageLabel( LabelType label, RealImageType *output ) const
+  {
+    output->FillBuffer( 0 );
+    typename LabelVotesMapType::const_iterator it = this->m_LabelVotes.find( label );
+    if( it == this->m_LabelVotes.end() )
+      {
+      return;
+      }
+    const LabelVotes & votes = it->second;
+    RealType *         buffer = output->GetBufferPointer();
+    size_t             begin = 0;
+    for( size_t k = 0; k < votes.Offsets.size(); k++ )
+      {
+      buffer[votes.Offsets[k]] = static_cast<RealType>( votes.Ends[k] - begin )
+        / static_cast<RealType>( this->GetNumberOfAtlases() );
+      begin = votes.Ends[k];
+      }
+  }
+
+  /** The STAPLE (Warfield et al. 2004) probability of label at each voxel,
+   * estimated by expectation maximization of the sensitivity and
+   * specificity of each atlas.  The prior probability of the label, its
+   * fraction of the atlas voxels, is scaled by confidenceWeight.  All
+   * voxels that no atlas votes for share one probability, so an iteration
+   * only visits the voxels of the label.  output has to be allocated on the
+   * reference grid. */
+  void ComputeSTAPLE( LabelType label, double confidenceWeight, RealImageType *output ) const
+  {
+    output->FillBuffer( 0 );
+    typename LabelVotesMapType::const_iterator it = this->m_LabelVotes.find( label );
+    if( it == this->m_LabelVotes.end() )
+      {
+      return;
+      }
+
+    STAPLEStruct str;
+    str.Votes = &it->second;
+    const unsigned int       numberOfAtlases = this->GetNumberOfAtlases();
+    const double             numberOfVoxels = this->m_Region.GetNumberOfPixels();
+    const unsigned long long numberOfEmptyVoxels =
+      this->m_Region.GetNumberOfPixels() - str.Votes->Offsets.size();
+
+    str.Prior = confidenceWeight * static_cast<double>( str.Votes->Atlases.size() )
+      / ( numberOfVoxels * numberOfAtlases );
+    str.Sensitivity.assign( numberOfAtlases, 0.99999 );
+    str.Specificity.assign( numberOfAtlases, 0.99999 );
+    str.Weights.resize( str.Votes->Offsets.size() );
+
+    unsigned int numberOfThreads = this->GetNumberOfThreads();
+    if( str.Votes->Offsets.size() < 4096 * static_cast<size_t>( numberOfThreads ) )
+      {
+      numberOfThreads = 1;
+      }
+
+    double emptyWeight = 0.0;
+    for( unsigned int iteration = 0; iteration < STAPLEMaximumIterations; iteration++ )
+      {
+      // E step
+      str.Accumulators.assign( numberOfThreads, STAPLEAccumulator( numberOfAtlases ) );
+      if( numberOfThreads > 1 )
+        {
+        itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+        threader->SetNumberOfThreads( numberOfThreads );
+        threader->SetSingleMethod( Self::STAPLEThreaderCallback, &str );
+        threader->SingleMethodExecute();
+        }
+      else
+        {
+        Self::STAPLERange( str, 0, str.Votes->Offsets.size(), str.Accumulators[0] );
+        }
+
+      double alpha = str.Prior;
+      double beta = 1.0 - str.Prior;
+      for( unsigned int j = 0; j < numberOfAtlases; j++ )
+        {
+        alpha *= 1.0 - str.Sensitivity[j];
+        beta *= str.Specificity[j];
+        }
+      emptyWeight = alpha / ( alpha + beta );
+
+      STAPLEAccumulator total( numberOfAtlases );
+      for( unsigned int t = 0; t < numberOfThreads; t++ )
+        {
+        total.Add( str.Accumulators[t] );
+        }
+      total.SumWeights += numberOfEmptyVoxels * emptyWeight;
+      total.SumComplementWeights += numberOfEmptyVoxels * ( 1.0 - emptyWeight );
+      for( unsigned int j = 0; j < numberOfAtlases; j++ )
+        {
+        total.Specificity[j] += numberOfEmptyVoxels * ( 1.0 - emptyWeight );
+        }
+
+      // M step
+      double change = 0.0;
+      for( unsigned int j = 0; j < numberOfAtlases; j++ )
+        {
+        const double p = total.Sensitivity[j] / total.SumWeights;
+        const double q = total.Specificity[j] / total.SumComplementWeights;
+        change = std::max( change, std::max( std::fabs( p - str.Sensitivity[j] ),
+                                             std::fabs( q - str.Specificity[j] ) ) );
+        str.Sensitivity[j] = p;
+        str.Specificity[j] = q;
+        }
+      if( change < STAPLEEpsilon )
+        {
+        break;
+        }
+      }
+
+    output->FillBuffer( static_cast<RealType>( emptyWeight ) );
+    RealType *buffer = output->GetBufferPointer();
+    for( size_t k = 0; k < str.Weights.size(); k++ )
+      {
+      buffer[str.Votes->Offsets[k]] = static_cast<RealType>( str.Weights[k] );
+      }
+  }
+
+private:
+  typedef LabelVotingFusion Self;
+
+  LabelVotingFusion( const Self & ); // purposely not implemented
+  void operator=( const Self & );    // purposely not implemented
+
+  enum ModeType { MajorityVotingMode, CorrelationVotingMode, LabelVotesMode };
+
+  itkStaticConstMacro( STAPLEMaximumIterations, unsigned int, 1000 );
+  static const double STAPLEEpsilon;
+
+  struct STAPLEAccumulator
+    {
+    STAPLEAccumulator( unsigned int numberOfAtlases = 0 ) :
+      Sensitivity( numberOfAtlases, 0.0 ),
+      Specificity( numberOfAtlases, 0.0 ),
+      SumWeights( 0.0 ),
+      SumComplementWeights( 0.0 )
+    {
+    }
+
+    void Add( const STAPLEAccumulator & other )
+    {
+      for( size_t j = 0; j < this->Sensitivity.size(); j++ )
+        {
+        this->Sensitivity[j] += other.Sensitivity[j];
+        this->Specificity[j] += other.Specificity[j];
+        }
+      this->SumWeights += other.SumWeights;
+      this->SumComplementWeights += other.SumComplementWeights;
+    }
+
+    std::vector<double> Sensitivity; // sum of the weights of the voxels atlas j votes for
+    std::vector<double> Specificity; // sum of the complement weights of the others
+    double              SumWeights;
+    double              SumComplementWeights;
+    };
+
+  struct STAPLEStruct
+    {
+    const LabelVotes *             Votes;
+    double                         Prior;
+    std::vector<double>            Sensitivity;
+    std::vector<double>            Specificity;
+    std::vector<double>            Weights;
+    std::vector<STAPLEAccumulator> Accumulators;
+    };
+
+  unsigned int GetNumberOfThreads() const
+  {
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    return std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) ) );
+  }
+
+  /** The E step for the voxels [begin, end) of the label. */
+  static void STAPLERange( STAPLEStruct & str, size_t begin, size_t end, STAPLEAccumulator & accumulator )
+  {
+    const unsigned int numberOfAtlases = str.Sensitivity.size();
+    accumulator = STAPLEAccumulator( numberOfAtlases );
+    std::vector<char> voted( numberOfAtlases, 0 );
+    for( size_t k = begin; k < end; k++ )
+      {
+      const size_t first = ( k == 0 ) ? 0 : str.Votes->Ends[k - 1];
+      const size_t last = str.Votes->Ends[k];
+      for( size_t n = first; n < last; n++ )
+        {
+        voted[str.Votes->Atlases[n]] = 1;
+        }
+
+      double alpha = str.Prior;
+      double beta = 1.0 - str.Prior;
+      for( unsigned int j = 0; j < numberOfAtlases; j++ )
+        {
+        if( voted[j] )
+          {
+          alpha *= str.Sensitivity[j];
+          beta *= 1.0 - str.Specificity[j];
+          }
+        else
+          {
+          alpha *= 1.0 - str.Sensitivity[j];
+          beta *= str.Specificity[j];
+          }
+        }
+      const double weight = alpha / ( alpha + beta );
+      str.Weights[k] = weight;
+
+      for( unsigned int j = 0; j < numberOfAtlases; j++ )
+        {
+        if( voted[j] )
+          {
+          accumulator.Sensitivity[j] += weight;
+          }
+        else
+          {
+          accumulator.Specificity[j] += 1.0 - weight;
+          }
+        }
+      accumulator.SumWeights += weight;
+      accumulator.SumComplementWeights += 1.0 - weight;
+
+      for( size_t n = first; n < last; n++ )
+        {
+        voted[str.Votes->Atlases[n]] = 0;
+        }
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE STAPLEThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    STAPLEStruct *                        str = static_cast<STAPLEStruct *>( info->UserData );
+
+    const unsigned long long numberOfVoxels = str->Votes->Offsets.size();
+    const size_t             begin = numberOfVoxels * info->ThreadID / info->NumberOfThreads;
+    const size_t             end = numberOfVoxels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    Self::STAPLERange( *str, begin, end, str->Accumulators[info->ThreadID] );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  struct Input
+    {
+    std::string               FileName;
+    itk::ImageIOBase::Pointer ImageIO;
+    };
+
+  bool Initialize()
+  {
+    this->m_Inputs.clear();
+    this->m_ErrorMessage.clear();
+    if( this->m_LabelFileNames.empty() )
+      {
+      this->m_ErrorMessage = "no label images";
+      return false;
+      }
+    std::vector<std::string> fileNames = this->m_LabelFileNames;
+    if( this->m_Mode == CorrelationVotingMode )
+      {
+      if( this->m_IntensityFileNames.size() != this->m_LabelFileNames.size() )
+        {
+        this->m_ErrorMessage = "there has to be one intensity image per label image";
+        return false;
+        }
+      fileNames.insert( fileNames.end(), this->m_IntensityFileNames.begin(), this->m_IntensityFileNames.end() );
+      fileNames.push_back( this->m_TargetFileName );
+      }
+
+    bool canStream = true;
+    for( size_t n = 0; n < fileNames.size(); n++ )
+      {
+      Input input;
+      input.FileName = fileNames[n];
+      input.ImageIO = itk::ImageIOFactory::CreateImageIO( input.FileName.c_str(), itk::ImageIOFactory::ReadMode );
+      if( input.ImageIO.IsNull() )
+        {
+        this->m_ErrorMessage = "can't read " + input.FileName;
+        return false;
+        }
+      input.ImageIO->SetFileName( input.FileName.c_str() );
+      input.ImageIO->ReadImageInformation();
+      // gzipped files can only be streamed by decompressing up to the region
+      canStream = canStream && input.ImageIO->CanStreamRead()
+        && itksys::SystemTools::GetFilenameLastExtension( input.FileName ) != ".gz";
+
+      if( n == 0 )
+        {
+        typedef itk::ImageFileReader<LabelImageType> ReaderType;
+        typename ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileName( input.FileName );
+        reader->SetImageIO( input.ImageIO );
+        reader->UpdateOutputInformation();
+        this->m_Reference = LabelImageType::New();
+        this->m_Reference->CopyInformation( reader->GetOutput() );
+        this->m_Region = reader->GetOutput()->GetLargestPossibleRegion();
+        this->m_Reference->SetRegions( this->m_Region );
+        }
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        const unsigned long size =
+          ( d < input.ImageIO->GetNumberOfDimensions() ) ? input.ImageIO->GetDimensions( d ) : 1;
+        if( size != this->m_Region.GetSize()[d] )
+          {
+          this->m_ErrorMessage = input.FileName + " is not on the grid of " + fileNames[0];
+          return false;
+          }
+        }
+      this->m_Inputs.push_back( input );
+      }
+
+    const unsigned int       lastDimension = ImageDimension - 1;
+    const unsigned int       numberOfSlices = this->m_Region.GetSize()[lastDimension];
+    const unsigned long long sliceSize = this->m_Region.GetNumberOfPixels() / numberOfSlices;
+    this->m_Slices = this->m_SlabSize;
+    if( this->m_Slices == 0 )
+      {
+      const unsigned long long maximumNumberOfValues = 1ull << 26;
+      this->m_Slices = canStream ? static_cast<unsigned int>( maximumNumberOfValues
+                                                              / ( sliceSize * this->m_Inputs.size() ) )
+        : numberOfSlices;
+      }
+    this->m_Slices = std::max( 1u, std::min( this->m_Slices, numberOfSlices ) );
+    return true;
+  }
+
+  /** Copy region of input n into values. */
+  template <class TImage, class TValue>
+  void ReadRegion( size_t n, const RegionType & region, TValue *values )
+  {
+    typedef itk::ImageFileReader<TImage> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( this->m_Inputs[n].FileName );
+    reader->SetImageIO( this->m_Inputs[n].ImageIO );
+    reader->UpdateOutputInformation();
+    reader->GetOutput()->SetRequestedRegion( region );
+    reader->GetOutput()->Update();
+
+    itk::ImageRegionConstIterator<TImage> It( reader->GetOutput(), region );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      *values++ = static_cast<TValue>( It.Get() );
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE ReadThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+
+    const size_t numberOfAtlases = self->GetNumberOfAtlases();
+    while( true )
+      {
+      self->m_Mutex.Lock();
+      const size_t n = self->m_NextInput++;
+      const bool   failed = self->m_Failed;
+      self->m_Mutex.Unlock();
+      if( failed || n >= self->m_Inputs.size() )
+        {
+        break;
+        }
+      try
+        {
+        if( n < numberOfAtlases )
+          {
+          LabelType *values = &self->m_Labels[n * self->m_NumberOfSlabVoxels];
+          self->template ReadRegion<LabelImageType>( n, self->m_Slab, values );
+          }
+        else
+          {
+          float *values = &self->m_Intensities[( n - numberOfAtlases ) * self->m_NumberOfExtendedSlabVoxels];
+          self->template ReadRegion<RealImageType>( n, self->m_ExtendedSlab, values );
+          }
+        }
+      catch( itk::ExceptionObject & e )
+        {
+        self->m_Mutex.Lock();
+        self->m_Failed = true;
+        self->m_ErrorMessage = e.what();
+        self->m_Mutex.Unlock();
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** The absolute Pearson correlation of the target and the intensity image
+   * of atlas i in the neighborhood of index, on the extended slab. */
+  float GetNeighborhoodCorrelation( const IndexType & index, unsigned int i ) const
+  {
+    const float *target = &this->m_Intensities[this->GetNumberOfAtlases() * this->m_NumberOfExtendedSlabVoxels];
+    const float *image = &this->m_Intensities[i * this->m_NumberOfExtendedSlabVoxels];
+
+    float targetMean = 0.0;
+    float targetVar = 0.0;
+    float imageMean = 0.0;
+    float imageVar = 0.0;
+    float k = 0;
+    float product = 0.0;
+    for( size_t j = 0; j < this->m_Neighborhood.size(); j++ )
+      {
+      const IndexType neighbor = index + this->m_Neighborhood[j];
+      if( !this->m_Region.IsInside( neighbor ) )
+        {
+        continue;
+        }
+      const typename LabelImageType::OffsetValueType offset = this->GetExtendedSlabOffset( neighbor );
+      k++;
+      if( k == 1 )
+        {
+        targetMean = target[offset];
+        imageMean = image[offset];
+        targetVar = 0.0;
+        imageVar = 0.0;
+        }
+      else
+        {
+        float oldMean = targetMean;
+        float value = target[offset];
+        targetMean = targetMean + ( value - targetMean ) / k;
+        targetVar = targetVar + ( value - oldMean ) * ( value - targetMean );
+
+        oldMean = imageMean;
+        float iValue = image[offset];
+        imageMean = imageMean + ( iValue - imageMean ) / k;
+        imageVar = imageVar + ( iValue - oldMean ) * ( iValue - imageMean );
+
+        product += value * iValue;
+        }
+      }
+
+    targetVar /= ( k - 1 );
+    imageVar /= ( k - 1 );
+    const float pearson =
+      ( product - k * targetMean * imageMean ) / ( ( k - 1 ) * std::sqrt( targetVar ) * std::sqrt( imageVar ) );
+    return std::fabs( pearson );
+  }
+
+  typename LabelImageType::OffsetValueType GetExtendedSlabOffset( const IndexType & index ) const
+  {
+    typename LabelImageType::OffsetValueType offset = 0;
+    typename LabelImageType::OffsetValueType stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      offset += ( index[d] - this->m_ExtendedSlab.GetIndex()[d] ) * stride;
+      stride *= this->m_ExtendedSlab.GetSize()[d];
+      }
+    return offset;
+  }
+
+  /** Votes on the voxels [begin, end) of the slab. */
+  void VoteRange( size_t begin, size_t end, LabelVotesMapType & votes )
+  {
+    const unsigned int numberOfAtlases = this->GetNumberOfAtlases();
+    const size_t       numberOfSlabVoxels = this->m_NumberOfSlabVoxels;
+    const size_t       slabOffset = this->m_Reference->ComputeOffset( this->m_Slab.GetIndex() );
+
+    // the histogram of the labels at the voxel
+    std::vector<LabelType> labels( numberOfAtlases );
+    std::vector<float>     counts( numberOfAtlases );
+    std::vector<float>     weights( numberOfAtlases );
+    LabelType *            output = this->m_Output.IsNotNull() ? this->m_Output->GetBufferPointer() : ITK_NULLPTR;
+
+    for( size_t v = begin; v < end; v++ )
+      {
+      if( this->m_Mode == LabelVotesMode )
+        {
+        for( unsigned int i = 0; i < numberOfAtlases; i++ )
+          {
+          const LabelType label = this->m_Labels[i * numberOfSlabVoxels + v];
+          if( label > 0 )
+            {
+            LabelVotes & labelVotes = votes[label];
+            if( labelVotes.Offsets.empty() || labelVotes.Offsets.back() != slabOffset + v )
+              {
+              labelVotes.Offsets.push_back( slabOffset + v );
+              labelVotes.Ends.push_back( labelVotes.Atlases.size() );
+              }
+            labelVotes.Atlases.push_back( i );
+            labelVotes.Ends.back()++;
+            }
+          }
+        continue;
+        }
+
+      unsigned int numberOfLabels = 0;
+      float        maxVotes = 0;
+      LabelType    votedLabel = 0;
+      for( unsigned int i = 0; i < numberOfAtlases; i++ )
+        {
+        const LabelType label = this->m_Labels[i * numberOfSlabVoxels + v];
+        unsigned int    l = 0;
+        while( l < numberOfLabels && labels[l] != label )
+          {
+          l++;
+          }
+        if( l == numberOfLabels )
+          {
+          labels[numberOfLabels] = label;
+          counts[numberOfLabels++] = 0;
+          }
+        counts[l] += 1;
+        if( counts[l] > maxVotes )
+          {
+          maxVotes = counts[l];
+          votedLabel = label;
+          }
+        }
+
+      // if all agree, the label is assigned immediately
+      if( this->m_Mode == CorrelationVotingMode && maxVotes != numberOfAtlases )
+        {
+        const IndexType index = this->m_Reference->ComputeIndex(
+          static_cast<typename LabelImageType::OffsetValueType>( slabOffset + v ) );
+        for( unsigned int i = 0; i < numberOfAtlases; i++ )
+          {
+          weights[i] = this->GetNeighborhoodCorrelation( index, i );
+          }
+
+        numberOfLabels = 0;
+        maxVotes = 0.0;
+        votedLabel = 0;
+        for( unsigned int i = 0; i < numberOfAtlases; i++ )
+          {
+          const LabelType label = this->m_Labels[i * numberOfSlabVoxels + v];
+          unsigned int    l = 0;
+          while( l < numberOfLabels && labels[l] != label )
+            {
+            l++;
+            }
+          if( l == numberOfLabels )
+            {
+            labels[numberOfLabels] = label;
+            counts[numberOfLabels++] = 0;
+            }
+          counts[l] += weights[i];
+          if( counts[l] > maxVotes )
+            {
+            maxVotes = counts[l];
+            votedLabel = label;
+            }
+          }
+        }
+      output[slabOffset + v] = votedLabel;
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE VoteThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+
+    // contiguous ranges, so that the votes of each thread are in buffer order
+    const unsigned long long numberOfVoxels = self->m_NumberOfSlabVoxels;
+    const size_t             begin = numberOfVoxels * info->ThreadID / info->NumberOfThreads;
+    const size_t             end = numberOfVoxels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    self->VoteRange( begin, end, self->m_ThreadVotes[info->ThreadID] );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** Append the votes of a thread, which follow those already collected. */
+  void MergeVotes( const LabelVotesMapType & votes )
+  {
+    for( typename LabelVotesMapType::const_iterator it = votes.begin(); it != votes.end(); ++it )
+      {
+      LabelVotes & labelVotes = this->m_LabelVotes[it->first];
+      const size_t shift = labelVotes.Atlases.size();
+      labelVotes.Offsets.insert( labelVotes.Offsets.end(), it->second.Offsets.begin(), it->second.Offsets.end() );
+      labelVotes.Atlases.insert( labelVotes.Atlases.end(), it->second.Atlases.begin(), it->second.Atlases.end() );
+      for( size_t k = 0; k < it->second.Ends.size(); k++ )
+        {
+        labelVotes.Ends.push_back( it->second.Ends[k] + shift );
+        }
+      this->m_MaximumLabel = std::max( this->m_MaximumLabel, it->first );
+      }
+  }
+
+  bool Run( ModeType mode, LabelImagePointer & output )
+  {
+    this->m_Mode = mode;
+    this->m_LabelVotes.clear();
+    this->m_MaximumLabel = 0;
+    if( !this->Initialize() )
+      {
+      return false;
+      }
+
+    if( mode != LabelVotesMode )
+      {
+      this->m_Output = LabelImageType::New();
+      this->m_Output->CopyInformation( this->m_Reference );
+      this->m_Output->SetRegions( this->m_Region );
+      this->m_Output->Allocate();
+      this->m_Output->FillBuffer( 0 );
+      }
+    else
+      {
+      this->m_Output = ITK_NULLPTR;
+      }
+
+    const int radius = ( mode == CorrelationVotingMode ) ? static_cast<int>( this->m_NeighborhoodRadius ) : 0;
+    this->m_Neighborhood.clear();
+    if( mode == CorrelationVotingMode )
+      {
+      // in the order of a neighborhood iterator, the first dimension fastest
+      OffsetType offset;
+      offset.Fill( -radius );
+      while( true )
+        {
+        this->m_Neighborhood.push_back( offset );
+        unsigned int d = 0;
+        while( d < ImageDimension && offset[d] == radius )
+          {
+          offset[d] = -radius;
+          d++;
+          }
+        if( d == ImageDimension )
+          {
+          break;
+          }
+        offset[d]++;
+        }
+      }
+
+    const unsigned int   numberOfThreads = this->GetNumberOfThreads();
+    const unsigned int   lastDimension = ImageDimension - 1;
+    const itk::IndexValueType firstSlice = this->m_Region.GetIndex()[lastDimension];
+    const itk::IndexValueType endSlice = firstSlice + static_cast<itk::IndexValueType>(
+      this->m_Region.GetSize()[lastDimension] );
+    for( itk::IndexValueType slice = firstSlice; slice < endSlice; slice += this->m_Slices )
+      {
+      this->m_Slab = this->m_Region;
+      this->m_Slab.SetIndex( lastDimension, slice );
+      this->m_Slab.SetSize( lastDimension, std::min<itk::IndexValueType>( this->m_Slices, endSlice - slice ) );
+      this->m_NumberOfSlabVoxels = this->m_Slab.GetNumberOfPixels();
+      this->m_Labels.resize( this->GetNumberOfAtlases() * this->m_NumberOfSlabVoxels );
+
+      // the correlation neighborhoods reach radius slices beyond the slab
+      this->m_ExtendedSlab = this->m_Slab;
+      if( mode == CorrelationVotingMode )
+        {
+        const itk::IndexValueType first = std::max( firstSlice, slice - radius );
+        const itk::IndexValueType last = std::min( endSlice, slice + static_cast<itk::IndexValueType>(
+                                                     this->m_Slab.GetSize()[lastDimension] ) + radius );
+        this->m_ExtendedSlab.SetIndex( lastDimension, first );
+        this->m_ExtendedSlab.SetSize( lastDimension, last - first );
+        this->m_NumberOfExtendedSlabVoxels = this->m_ExtendedSlab.GetNumberOfPixels();
+        this->m_Intensities.resize( ( this->GetNumberOfAtlases() + 1 ) * this->m_NumberOfExtendedSlabVoxels );
+        }
+
+      this->m_NextInput = 0;
+      this->m_Failed = false;
+      itk::MultiThreader::Pointer reader = itk::MultiThreader::New();
+      reader->SetNumberOfThreads( std::min<unsigned int>( numberOfThreads, this->m_Inputs.size() ) );
+      reader->SetSingleMethod( Self::ReadThreaderCallback, this );
+      reader->SingleMethodExecute();
+      if( this->m_Failed )
+        {
+        return false;
+        }
+
+      const unsigned int voters = static_cast<unsigned int>(
+        std::min<unsigned long long>( numberOfThreads, this->m_NumberOfSlabVoxels ) );
+      this->m_ThreadVotes.assign( voters, LabelVotesMapType() );
+      itk::MultiThreader::Pointer voter = itk::MultiThreader::New();
+      voter->SetNumberOfThreads( voters );
+      voter->SetSingleMethod( Self::VoteThreaderCallback, this );
+      voter->SingleMethodExecute();
+      for( unsigned int t = 0; t < voters; t++ )
+        {
+        this->MergeVotes( this->m_ThreadVotes[t] );
+        }
+      this->m_ThreadVotes.clear();
+      }
+
+    this->m_Labels.clear();
+    this->m_Intensities.clear();
+    output = this->m_Output;
+    this->m_Output = ITK_NULLPTR;
+    return true;
+  }
+
+  unsigned int             m_NumberOfThreads;
+  unsigned int             m_SlabSize;
+  unsigned int             m_NeighborhoodRadius;
+  std::vector<std::string> m_LabelFileNames;
+  std::vector<std::string> m_IntensityFileNames;
+  std::string              m_TargetFileName;
+  std::string              m_ErrorMessage;
+
+  LabelImagePointer  m_Reference;
+  RegionType         m_Region;
+  LabelVotesMapType  m_LabelVotes;
+  LabelType          m_MaximumLabel;
+
+  // the state of the current run
+  ModeType                       m_Mode;
+  std::vector<Input>             m_Inputs;
+  unsigned int                   m_Slices;
+  RegionType                     m_Slab;
+  RegionType                     m_ExtendedSlab;
+  unsigned long long             m_NumberOfSlabVoxels;
+  unsigned long long             m_NumberOfExtendedSlabVoxels;
+  std::vector<LabelType>         m_Labels;      // the slab of atlas i at i * m_NumberOfSlabVoxels
+  std::vector<float>             m_Intensities; // the extended slabs of the atlases, then of the target
+  std::vector<OffsetType>        m_Neighborhood;
+  LabelImagePointer              m_Output;
+  std::vector<LabelVotesMapType> m_ThreadVotes;
+
+  size_t                   m_NextInput;
+  itk::SimpleFastMutexLock m_Mutex;
+  bool                     m_Failed;
+};
+
+template <class TLabelImage, class TRealImage>
+const double LabelVotingFusion<TLabelImage, TRealImage>::STAPLEEpsilon = 1.0e-10;
+} // namespace ants
+
+#endif // __antsLabelVotingFusion_h
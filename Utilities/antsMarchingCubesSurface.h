@@ -0,0 +1,870 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsMarchingCubesSurface_h
+#define __antsMarchingCubesSurface_h
+
+#include "itkImage.h"
+#include "itkMacro.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** \class MarchingCubesSurface
+ *
+ * Extracts the iso-surface of a 3-D scalar image as a triangle mesh,
+ * reading the ITK buffer directly instead of going through an exported
+ * vtkImageData and vtkMarchingCubes.  The mesh is kept as flat point and
+ * triangle arrays, on which the largest component, the smoothing and the
+ * genus are computed before, if at all, a vtkPolyData is built.
+ *
+ * As in flying edges, the work is done in passes over slabs of slices, one
+ * slab per thread: the first pass finds the edges of each slice of samples
+ * that cross the iso-value and places a point on them, the point ids are
+ * then offset by the counts of the preceding slices, and the second pass
+ * triangulates the cubes between consecutive slices, looking up the points
+ * of their edges in the sorted edge lists of the two slices.  The result
+ * does not depend on the number of threads.
+ *
+ * A sample is inside if it is >= the iso-value.  The case table is built
+ * from the crossings on the cube faces, joined so that the inside corners
+ * of an ambiguous face are kept apart; neighboring cubes agree on their
+ * common face, so the surface is closed away from the image boundary, and
+ * the triangles are ordered counter-clockwise seen from the outside.
+ *
+ * The points are in physical space, or in the index space scaled by the
+ * spacing and shifted by the origin, as a vtkImageData would place them,
+ * with SetUseImageDirection( false ).
+ */
+template <class TImage>
+class MarchingCubesSurface
+{
+public:
+  typedef MarchingCubesSurface          Self;
+  typedef TImage                        ImageType;
+  typedef typename ImageType::PixelType PixelType;
+  typedef float                         CoordinateType;
+  typedef unsigned int                  PointIdentifierType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  MarchingCubesSurface() :
+    m_IsoValue( 0.0 ),
+    m_UseImageDirection( true ),
+    m_NumberOfThreads( 0 ),
+    m_Stage( 0 )
+  {
+  }
+
+  void SetInput( const ImageType *image )
+  {
+    this->m_Input = image;
+  }
+
+  void SetIsoValue( double value )
+  {
+    this->m_IsoValue = value;
+  }
+
+  void SetUseImageDirection( bool useDirection )
+  {
+    this->m_UseImageDirection = useDirection;
+  }
+
+  /** 0 uses the ITK global default number of threads. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  /** x, y, z of each point */
+  const std::vector<CoordinateType> & GetPoints() const
+  {
+    return this->m_Points;
+  }
+
+  /** the three point ids of each triangle */
+  const std::vector<PointIdentifierType> & GetTriangles() const
+  {
+    return this->m_Triangles;
+  }
+
+  unsigned long GetNumberOfPoints() const
+  {
+    return this->m_Points.size() / 3;
+  }
+
+  unsigned long GetNumberOfTriangles() const
+  {
+    return this->m_Triangles.size() / 3;
+  }
+
+  void Update()
+  {
+    itkStaticAssert( ImageDimension == 3, "MarchingCubesSurface needs a 3-D image" );
+
+    this->Initialize();
+    this->m_Points.clear();
+    this->m_Triangles.clear();
+    if( this->m_Size[0] < 2 || this->m_Size[1] < 2 || this->m_Size[2] < 2 )
+      {
+      return;
+      }
+
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    numberOfThreads = static_cast<unsigned int>(
+        std::min<long>( numberOfThreads, std::max<long>( 1, this->m_Size[2] / 4 ) ) );
+    this->m_SlabBegins.resize( numberOfThreads + 1 );
+    for( unsigned int t = 0; t <= numberOfThreads; t++ )
+      {
+      this->m_SlabBegins[t] = this->m_Size[2] * t / numberOfThreads;
+      }
+
+    // points on the crossing edges of every slice of samples
+    this->m_SliceEdges.assign( this->m_Size[2], std::vector<unsigned long>() );
+    this->m_SlicePoints.assign( this->m_Size[2], std::vector<CoordinateType>() );
+    this->RunStage( 0, numberOfThreads );
+
+    this->m_SlicePointOffsets.assign( this->m_Size[2] + 1, 0 );
+    for( long z = 0; z < this->m_Size[2]; z++ )
+      {
+      this->m_SlicePointOffsets[z + 1] = this->m_SlicePointOffsets[z] + this->m_SliceEdges[z].size();
+      }
+    this->m_Points.reserve( 3 * this->m_SlicePointOffsets[this->m_Size[2]] );
+    for( long z = 0; z < this->m_Size[2]; z++ )
+      {
+      this->m_Points.insert( this->m_Points.end(), this->m_SlicePoints[z].begin(), this->m_SlicePoints[z].end() );
+      std::vector<CoordinateType>().swap( this->m_SlicePoints[z] );
+      }
+
+    // triangles of the cubes between consecutive slices
+    this->m_SlabTriangles.assign( numberOfThreads, std::vector<PointIdentifierType>() );
+    this->RunStage( 1, numberOfThreads );
+
+    unsigned long numberOfIds = 0;
+    for( unsigned int t = 0; t < numberOfThreads; t++ )
+      {
+      numberOfIds += this->m_SlabTriangles[t].size();
+      }
+    this->m_Triangles.reserve( numberOfIds );
+    for( unsigned int t = 0; t < numberOfThreads; t++ )
+      {
+      this->m_Triangles.insert( this->m_Triangles.end(), this->m_SlabTriangles[t].begin(),
+                                this->m_SlabTriangles[t].end() );
+      }
+    this->m_SlabTriangles.clear();
+    this->m_SliceEdges.clear();
+    this->m_SlicePointOffsets.clear();
+  }
+
+  /** Keeps the component with the most triangles, as the largest region
+      of vtkPolyDataConnectivityFilter does, and drops the unused points. */
+  void KeepLargestComponent()
+  {
+    const unsigned long numberOfPoints = this->GetNumberOfPoints();
+    const unsigned long numberOfTriangles = this->GetNumberOfTriangles();
+    if( numberOfTriangles == 0 )
+      {
+      return;
+      }
+
+    std::vector<PointIdentifierType> parents( numberOfPoints );
+    for( unsigned long n = 0; n < numberOfPoints; n++ )
+      {
+      parents[n] = n;
+      }
+    for( unsigned long t = 0; t < numberOfTriangles; t++ )
+      {
+      const PointIdentifierType *triangle = &this->m_Triangles[3 * t];
+      Union( parents, triangle[0], triangle[1] );
+      Union( parents, triangle[0], triangle[2] );
+      }
+
+    std::vector<unsigned long> counts( numberOfPoints, 0 );
+    PointIdentifierType        largest = 0;
+    for( unsigned long t = 0; t < numberOfTriangles; t++ )
+      {
+      const PointIdentifierType root = Find( parents, this->m_Triangles[3 * t] );
+      if( ++counts[root] > counts[largest] )
+        {
+        largest = root;
+        }
+      }
+    if( counts[largest] == numberOfTriangles )
+      {
+      return;
+      }
+
+    // renumber the points of the largest component in their order
+    std::vector<PointIdentifierType> newIds( numberOfPoints, 0 );
+    std::vector<CoordinateType>      points;
+    PointIdentifierType              numberOfNewPoints = 0;
+    for( unsigned long n = 0; n < numberOfPoints; n++ )
+      {
+      if( Find( parents, n ) == largest )
+        {
+        newIds[n] = numberOfNewPoints++;
+        points.insert( points.end(), &this->m_Points[3 * n], &this->m_Points[3 * n] + 3 );
+        }
+      }
+    std::vector<PointIdentifierType> triangles;
+    triangles.reserve( 3 * counts[largest] );
+    for( unsigned long t = 0; t < numberOfTriangles; t++ )
+      {
+      const PointIdentifierType *triangle = &this->m_Triangles[3 * t];
+      if( Find( parents, triangle[0] ) == largest )
+        {
+        triangles.push_back( newIds[triangle[0]] );
+        triangles.push_back( newIds[triangle[1]] );
+        triangles.push_back( newIds[triangle[2]] );
+        }
+      }
+    this->m_Points.swap( points );
+    this->m_Triangles.swap( triangles );
+  }
+
+  /** The number of distinct edges of the triangles. */
+  unsigned long GetNumberOfEdges() const
+  {
+    std::vector<unsigned long long> edges;
+    edges.reserve( this->m_Triangles.size() );
+    for( unsigned long t = 0; t < this->m_Triangles.size(); t += 3 )
+      {
+      for( unsigned int k = 0; k < 3; k++ )
+        {
+        unsigned long long a = this->m_Triangles[t + k];
+        unsigned long long b = this->m_Triangles[t + ( k + 1 ) % 3];
+        if( a > b )
+          {
+          std::swap( a, b );
+          }
+        edges.push_back( ( a << 32 ) | b );
+        }
+      }
+    std::sort( edges.begin(), edges.end() );
+    return std::unique( edges.begin(), edges.end() ) - edges.begin();
+  }
+
+  /** 1 - Euler characteristic / 2, the genus of a closed surface */
+  double GetGenus() const
+  {
+    return 0.5 * ( 2.0 - static_cast<double>( this->GetNumberOfPoints() )
+                   + static_cast<double>( this->GetNumberOfEdges() )
+                   - static_cast<double>( this->GetNumberOfTriangles() ) );
+  }
+
+  /** Laplacian smoothing, each iteration moves every point by relaxation
+      times its offset from the mean of its neighbors, as
+      vtkSmoothPolyDataFilter does without its feature edge handling. */
+  void Smooth( unsigned int numberOfIterations, double relaxationFactor = 0.01 )
+  {
+    const unsigned long numberOfPoints = this->GetNumberOfPoints();
+    if( numberOfIterations == 0 || numberOfPoints == 0 )
+      {
+      return;
+      }
+    this->BuildPointNeighbors();
+
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    numberOfThreads = static_cast<unsigned int>(
+        std::min<unsigned long>( numberOfThreads, std::max<unsigned long>( 1, numberOfPoints / 10000 ) ) );
+    this->m_SlabBegins.resize( numberOfThreads + 1 );
+    for( unsigned int t = 0; t <= numberOfThreads; t++ )
+      {
+      this->m_SlabBegins[t] = numberOfPoints * t / numberOfThreads;
+      }
+
+    this->m_RelaxationFactor = relaxationFactor;
+    this->m_SmoothedPoints.resize( this->m_Points.size() );
+    for( unsigned int i = 0; i < numberOfIterations; i++ )
+      {
+      this->RunStage( 2, numberOfThreads );
+      this->m_Points.swap( this->m_SmoothedPoints );
+      }
+    std::vector<CoordinateType>().swap( this->m_SmoothedPoints );
+    std::vector<unsigned long>().swap( this->m_NeighborOffsets );
+    std::vector<PointIdentifierType>().swap( this->m_Neighbors );
+  }
+
+private:
+
+  struct CubeEdge
+    {
+    unsigned int Corner;    // the corner the edge starts from
+    unsigned int Direction; // 0, 1 or 2
+    };
+
+  static PointIdentifierType Find( std::vector<PointIdentifierType> & parents, PointIdentifierType n )
+  {
+    while( parents[n] != n )
+      {
+      parents[n] = parents[parents[n]];
+      n = parents[n];
+      }
+    return n;
+  }
+
+  static void Union( std::vector<PointIdentifierType> & parents, PointIdentifierType a, PointIdentifierType b )
+  {
+    a = Find( parents, a );
+    b = Find( parents, b );
+    if( a != b )
+      {
+      parents[std::max( a, b )] = std::min( a, b );
+      }
+  }
+
+  void Initialize()
+  {
+    if( !this->m_Input )
+      {
+      itkGenericExceptionMacro( "MarchingCubesSurface: the input is not set." );
+      }
+    const typename ImageType::RegionType & region = this->m_Input->GetBufferedRegion();
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      this->m_Size[d] = region.GetSize()[d];
+      }
+    this->m_Strides[0] = 1;
+    this->m_Strides[1] = this->m_Size[0];
+    this->m_Strides[2] = this->m_Size[0] * this->m_Size[1];
+
+    // continuous index to point: origin + M * index
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      this->m_Origin[i] = this->m_Input->GetOrigin()[i];
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        const double direction = this->m_UseImageDirection ? this->m_Input->GetDirection()( i, j )
+          : static_cast<double>( i == j );
+        this->m_Matrix[i][j] = direction * this->m_Input->GetSpacing()[j];
+        }
+      }
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        this->m_Origin[i] += this->m_Matrix[i][j] * region.GetIndex()[j];
+        }
+      }
+  }
+
+  void RunStage( unsigned int stage, unsigned int numberOfThreads )
+  {
+    this->m_Stage = stage;
+    if( numberOfThreads <= 1 )
+      {
+      this->RunStageOnSlab( 0 );
+      }
+    else
+      {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( Self::StageThreaderCallback, this );
+      threader->SingleMethodExecute();
+      }
+  }
+
+  void RunStageOnSlab( unsigned int slab )
+  {
+    switch( this->m_Stage )
+      {
+      case 0:
+        {
+        this->PlacePoints( slab );
+        }
+        break;
+      case 1:
+        {
+        this->Triangulate( slab );
+        }
+        break;
+      default:
+        {
+        this->SmoothPoints( slab );
+        }
+      }
+  }
+
+  /** the edges of the slice z that cross the iso-value, in raster order
+      of ( x, y, direction ), and the points on them */
+  void PlacePoints( unsigned int slab )
+  {
+    const PixelType *buffer = this->m_Input->GetBufferPointer();
+    const double     iso = this->m_IsoValue;
+
+    for( long z = this->m_SlabBegins[slab]; z < this->m_SlabBegins[slab + 1]; z++ )
+      {
+      std::vector<unsigned long> &  edges = this->m_SliceEdges[z];
+      std::vector<CoordinateType> & points = this->m_SlicePoints[z];
+      for( long y = 0; y < this->m_Size[1]; y++ )
+        {
+        const PixelType *row = buffer + z * this->m_Strides[2] + y * this->m_Strides[1];
+        for( long x = 0; x < this->m_Size[0]; x++ )
+          {
+          const double value = row[x];
+          const bool   inside = value >= iso;
+          const long   position[3] = { x, y, z };
+          for( unsigned int d = 0; d < 3; d++ )
+            {
+            if( position[d] + 1 >= this->m_Size[d] )
+              {
+              continue;
+              }
+            const double neighbor = row[x + this->m_Strides[d]];
+            if( ( neighbor >= iso ) == inside )
+              {
+              continue;
+              }
+            const double t = ( iso - value ) / ( neighbor - value );
+            double       index[3] = { static_cast<double>( x ), static_cast<double>( y ),
+                                      static_cast<double>( z ) };
+            index[d] += t;
+            for( unsigned int i = 0; i < 3; i++ )
+              {
+              points.push_back( static_cast<CoordinateType>( this->m_Origin[i]
+                                                             + this->m_Matrix[i][0] * index[0]
+                                                             + this->m_Matrix[i][1] * index[1]
+                                                             + this->m_Matrix[i][2] * index[2] ) );
+              }
+            edges.push_back( 3 * ( x + y * this->m_Size[0] ) + d );
+            }
+          }
+        }
+      }
+  }
+
+  PointIdentifierType GetEdgePoint( long x, long y, long z, const CubeEdge & edge ) const
+  {
+    const long                         cx = x + ( edge.Corner & 1 );
+    const long                         cy = y + ( ( edge.Corner >> 1 ) & 1 );
+    const long                         cz = z + ( ( edge.Corner >> 2 ) & 1 );
+    const std::vector<unsigned long> & edges = this->m_SliceEdges[cz];
+    const unsigned long                key = 3 * ( cx + cy * this->m_Size[0] ) + edge.Direction;
+
+    return this->m_SlicePointOffsets[cz]
+           + ( std::lower_bound( edges.begin(), edges.end(), key ) - edges.begin() );
+  }
+
+  void Triangulate( unsigned int slab )
+  {
+    // the corners of a cube are numbered x + 2 y + 4 z and the edges
+    // 0-3 along x, 4-7 along y and 8-11 along z
+    static const CubeEdge cubeEdges[12] = {
+      { 0, 0 }, { 2, 0 }, { 4, 0 }, { 6, 0 },
+      { 0, 1 }, { 1, 1 }, { 4, 1 }, { 5, 1 },
+      { 0, 2 }, { 1, 2 }, { 2, 2 }, { 3, 2 }
+      };
+    static const signed char triangleTable[256][16] = {
+      { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  9,  5,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  9, 10,  9,  5, 10,  5,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  9, 11,  1,  9,  1,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  9,  4,  9, 11,  4, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  5, 10,  5, 11, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  0, 10,  0,  9, 10,  9, 11, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  9, 10,  9, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  2,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  0, 10,  0,  1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  2,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  9, 10,  9,  5, 10,  5,  1, -1, -1, -1, -1 },
+      {  8,  6,  2,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  0,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  2,  9, 11,  1,  9,  1,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  9,  4,  9, 11,  4, 11,  1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5, 11,  8,  6,  2, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  0, 10,  0,  5, 10,  5, 11, -1, -1, -1, -1 },
+      { 10,  4,  0, 10,  0,  9, 10,  9, 11,  8,  6,  2, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  9, 10,  9, 11, -1, -1, -1, -1, -1, -1, -1 },
+      {  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  7,  5,  0,  7,  0,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  2,  4,  2,  7,  4,  7,  5, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  7,  5,  0,  7,  0,  2, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  2, 10,  2,  7, 10,  7,  5, 10,  5,  1, -1, -1, -1, -1 },
+      {  5, 11,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0,  5, 11,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  7, 11,  1,  7,  1,  0,  7,  0,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  2,  4,  2,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5, 11,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  5, 10,  5, 11,  7,  9,  2, -1, -1, -1, -1 },
+      { 10,  4,  0, 10,  0,  2, 10,  2,  7, 10,  7, 11, -1, -1, -1, -1 },
+      { 10,  8,  2, 10,  2,  7, 10,  7, 11, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  7,  8,  7,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  7,  4,  7,  9,  4,  9,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  7,  8,  7,  5,  8,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  7,  4,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  7,  8,  7,  9, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  6,  7, 10,  7,  9, 10,  9,  0, 10,  0,  1, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  7,  8,  7,  5,  8,  5,  0, -1, -1, -1, -1 },
+      { 10,  6,  7, 10,  7,  5, 10,  5,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  7,  8,  7,  9,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  7,  4,  7,  9,  4,  9,  0,  5, 11,  1, -1, -1, -1, -1 },
+      {  8,  6,  7,  8,  7, 11,  8, 11,  1,  8,  1,  0, -1, -1, -1, -1 },
+      {  4,  6,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5, 11,  8,  6,  7,  8,  7,  9, -1, -1, -1, -1 },
+      { 10,  6,  7, 10,  7,  9, 10,  9,  0, 10,  0,  5, 10,  5, 11, -1 },
+      { 10,  4,  0, 10,  0,  8, 10,  8,  6, 10,  6,  7, 10,  7, 11, -1 },
+      { 10,  6,  7, 10,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  1,  6,  1,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1,  3,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  9,  6,  9,  5,  6,  5,  1,  6,  1,  3, -1, -1, -1, -1 },
+      {  6, 10,  3,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  0,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  9, 11,  1,  9,  1,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  9,  4,  9, 11,  4, 11,  1, -1, -1, -1, -1 },
+      {  6,  4,  5,  6,  5, 11,  6, 11,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  5,  6,  5, 11,  6, 11,  3, -1, -1, -1, -1 },
+      {  6,  4,  0,  6,  0,  9,  6,  9, 11,  6, 11,  3, -1, -1, -1, -1 },
+      {  6,  8,  9,  6,  9, 11,  6, 11,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  2,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  2,  4,  2,  9,  4,  9,  5, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1,  3,  8,  3,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  2,  0,  1,  2,  1,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1,  3,  8,  3,  2,  9,  5,  0, -1, -1, -1, -1 },
+      {  9,  5,  1,  9,  1,  3,  9,  3,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  2,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  2,  4,  2,  0,  5, 11,  1, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  2,  9, 11,  1,  9,  1,  0, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  2,  4,  2,  9,  4,  9, 11,  4, 11,  1, -1 },
+      {  8,  4,  5,  8,  5, 11,  8, 11,  3,  8,  3,  2, -1, -1, -1, -1 },
+      {  5, 11,  3,  5,  3,  2,  5,  2,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  0,  8,  0,  9,  8,  9, 11,  8, 11,  3,  8,  3,  2, -1 },
+      {  9, 11,  3,  9,  3,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  0,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  7,  5,  0,  7,  0,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  2,  4,  2,  7,  4,  7,  5, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1,  3,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  1,  6,  1,  3,  7,  9,  2, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1,  3,  7,  5,  0,  7,  0,  2, -1, -1, -1, -1 },
+      {  6,  8,  2,  6,  2,  7,  6,  7,  5,  6,  5,  1,  6,  1,  3, -1 },
+      {  6, 10,  3,  5, 11,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  0,  5, 11,  1,  7,  9,  2, -1, -1, -1, -1 },
+      {  6, 10,  3,  7, 11,  1,  7,  1,  0,  7,  0,  2, -1, -1, -1, -1 },
+      {  6, 10,  3,  4,  8,  2,  4,  2,  7,  4,  7, 11,  4, 11,  1, -1 },
+      {  6,  4,  5,  6,  5, 11,  6, 11,  3,  7,  9,  2, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  5,  6,  5, 11,  6, 11,  3,  7,  9,  2, -1 },
+      {  6,  4,  0,  6,  0,  2,  6,  2,  7,  6,  7, 11,  6, 11,  3, -1 },
+      {  6,  8,  2,  6,  2,  7,  6,  7, 11,  6, 11,  3, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  7,  8,  7,  9, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  7,  4,  7,  9,  4,  9,  0, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  7,  8,  7,  5,  8,  5,  0, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  7,  4,  7,  5, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1,  3,  8,  3,  7,  8,  7,  9, -1, -1, -1, -1 },
+      {  7,  9,  0,  7,  0,  1,  7,  1,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1,  3,  8,  3,  7,  8,  7,  5,  8,  5,  0, -1 },
+      {  7,  5,  1,  7,  1,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10,  3,  8,  3,  7,  8,  7,  9,  5, 11,  1, -1, -1, -1, -1 },
+      {  4, 10,  3,  4,  3,  7,  4,  7,  9,  4,  9,  0,  5, 11,  1, -1 },
+      {  8, 10,  3,  8,  3,  7,  8,  7, 11,  8, 11,  1,  8,  1,  0, -1 },
+      {  4, 10,  3,  4,  3,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1 },
+      {  8,  4,  5,  8,  5, 11,  8, 11,  3,  8,  3,  7,  8,  7,  9, -1 },
+      {  5, 11,  3,  5,  3,  7,  5,  7,  9,  5,  9,  0, -1, -1, -1, -1 },
+      {  8,  4,  0,  7, 11,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  7, 11,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 11,  7,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 11,  7,  3,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  9,  4,  9,  5, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  1, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1, 11,  7,  3,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  9, 10,  9,  5, 10,  5,  1, 11,  7,  3, -1, -1, -1, -1 },
+      {  5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0,  5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  9,  7,  3,  9,  3,  1,  9,  1,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  9,  4,  9,  7,  4,  7,  3,  4,  3,  1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5,  7, 10,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  5, 10,  5,  7, 10,  7,  3, -1, -1, -1, -1 },
+      { 10,  4,  0, 10,  0,  9, 10,  9,  7, 10,  7,  3, -1, -1, -1, -1 },
+      { 10,  8,  9, 10,  9,  7, 10,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  2, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  0, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  2, 11,  7,  3,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  9,  4,  9,  5, 11,  7,  3, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  2, 11,  7,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  0, 10,  0,  1, 11,  7,  3, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  2, 11,  7,  3,  9,  5,  0, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  9, 10,  9,  5, 10,  5,  1, 11,  7,  3, -1 },
+      {  8,  6,  2,  5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  0,  5,  7,  3,  5,  3,  1, -1, -1, -1, -1 },
+      {  8,  6,  2,  9,  7,  3,  9,  3,  1,  9,  1,  0, -1, -1, -1, -1 },
+      {  4,  6,  2,  4,  2,  9,  4,  9,  7,  4,  7,  3,  4,  3,  1, -1 },
+      { 10,  4,  5, 10,  5,  7, 10,  7,  3,  8,  6,  2, -1, -1, -1, -1 },
+      { 10,  6,  2, 10,  2,  0, 10,  0,  5, 10,  5,  7, 10,  7,  3, -1 },
+      { 10,  4,  0, 10,  0,  9, 10,  9,  7, 10,  7,  3,  8,  6,  2, -1 },
+      { 10,  6,  2, 10,  2,  9, 10,  9,  7, 10,  7,  3, -1, -1, -1, -1 },
+      { 11,  9,  2, 11,  2,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0, 11,  9,  2, 11,  2,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 11,  5,  0, 11,  0,  2, 11,  2,  3, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  2,  4,  2,  3,  4,  3, 11,  4, 11,  5, -1, -1, -1, -1 },
+      { 10,  4,  1, 11,  9,  2, 11,  2,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  1, 11,  9,  2, 11,  2,  3, -1, -1, -1, -1 },
+      { 10,  4,  1, 11,  5,  0, 11,  0,  2, 11,  2,  3, -1, -1, -1, -1 },
+      { 10,  8,  2, 10,  2,  3, 10,  3, 11, 10, 11,  5, 10,  5,  1, -1 },
+      {  5,  9,  2,  5,  2,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  0,  5,  9,  2,  5,  2,  3,  5,  3,  1, -1, -1, -1, -1 },
+      {  0,  2,  3,  0,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  8,  2,  4,  2,  3,  4,  3,  1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5,  9, 10,  9,  2, 10,  2,  3, -1, -1, -1, -1 },
+      { 10,  8,  0, 10,  0,  5, 10,  5,  9, 10,  9,  2, 10,  2,  3, -1 },
+      { 10,  4,  0, 10,  0,  2, 10,  2,  3, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  8,  2, 10,  2,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  6,  3,  8,  3, 11,  8, 11,  9, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  3,  4,  3, 11,  4, 11,  9,  4,  9,  0, -1, -1, -1, -1 },
+      {  8,  6,  3,  8,  3, 11,  8, 11,  5,  8,  5,  0, -1, -1, -1, -1 },
+      {  4,  6,  3,  4,  3, 11,  4, 11,  5, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  1,  8,  6,  3,  8,  3, 11,  8, 11,  9, -1, -1, -1, -1 },
+      { 10,  6,  3, 10,  3, 11, 10, 11,  9, 10,  9,  0, 10,  0,  1, -1 },
+      { 10,  4,  1,  8,  6,  3,  8,  3, 11,  8, 11,  5,  8,  5,  0, -1 },
+      { 10,  6,  3, 10,  3, 11, 10, 11,  5, 10,  5,  1, -1, -1, -1, -1 },
+      {  8,  6,  3,  8,  3,  1,  8,  1,  5,  8,  5,  9, -1, -1, -1, -1 },
+      {  4,  6,  3,  4,  3,  1,  4,  1,  5,  4,  5,  9,  4,  9,  0, -1 },
+      {  8,  6,  3,  8,  3,  1,  8,  1,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4,  6,  3,  4,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  5, 10,  5,  9, 10,  9,  8, 10,  8,  6, 10,  6,  3, -1 },
+      { 10,  6,  3,  5,  9,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { 10,  4,  0, 10,  0,  8, 10,  8,  6, 10,  6,  3, -1, -1, -1, -1 },
+      { 10,  6,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  7,  4,  8,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  7,  9,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  7,  4,  8,  9,  4,  9,  5, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1, 11,  6, 11,  7, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  1,  6,  1, 11,  6, 11,  7, -1, -1, -1, -1 },
+      {  6,  4,  1,  6,  1, 11,  6, 11,  7,  9,  5,  0, -1, -1, -1, -1 },
+      {  6,  8,  9,  6,  9,  5,  6,  5,  1,  6,  1, 11,  6, 11,  7, -1 },
+      {  6, 10,  1,  6,  1,  5,  6,  5,  7, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  5,  6,  5,  7,  4,  8,  0, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  0,  6,  0,  9,  6,  9,  7, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  4,  6,  4,  8,  6,  8,  9,  6,  9,  7, -1 },
+      {  6,  4,  5,  6,  5,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  5,  6,  5,  7, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  4,  0,  6,  0,  9,  6,  9,  7, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  9,  6,  9,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10, 11,  8, 11,  7,  8,  7,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10, 11,  4, 11,  7,  4,  7,  2,  4,  2,  0, -1, -1, -1, -1 },
+      {  8, 10, 11,  8, 11,  7,  8,  7,  2,  9,  5,  0, -1, -1, -1, -1 },
+      {  4, 10, 11,  4, 11,  7,  4,  7,  2,  4,  2,  9,  4,  9,  5, -1 },
+      {  8,  4,  1,  8,  1, 11,  8, 11,  7,  8,  7,  2, -1, -1, -1, -1 },
+      { 11,  7,  2, 11,  2,  0, 11,  0,  1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1, 11,  8, 11,  7,  8,  7,  2,  9,  5,  0, -1 },
+      { 11,  7,  2, 11,  2,  9, 11,  9,  5, 11,  5,  1, -1, -1, -1, -1 },
+      {  8, 10,  1,  8,  1,  5,  8,  5,  7,  8,  7,  2, -1, -1, -1, -1 },
+      {  4, 10,  1,  4,  1,  5,  4,  5,  7,  4,  7,  2,  4,  2,  0, -1 },
+      {  8, 10,  1,  8,  1,  0,  8,  0,  9,  8,  9,  7,  8,  7,  2, -1 },
+      {  4, 10,  1,  9,  7,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  5,  8,  5,  7,  8,  7,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  5,  7,  2,  5,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  0,  8,  0,  9,  8,  9,  7,  8,  7,  2, -1, -1, -1, -1 },
+      {  9,  7,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  9,  6,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  9,  6,  9,  2,  4,  8,  0, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  5,  6,  5,  0,  6,  0,  2, -1, -1, -1, -1 },
+      {  6, 10, 11,  6, 11,  5,  6,  5,  4,  6,  4,  8,  6,  8,  2, -1 },
+      {  6,  4,  1,  6,  1, 11,  6, 11,  9,  6,  9,  2, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  1,  6,  1, 11,  6, 11,  9,  6,  9,  2, -1 },
+      {  6,  4,  1,  6,  1, 11,  6, 11,  5,  6,  5,  0,  6,  0,  2, -1 },
+      {  6,  8,  2, 11,  5,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  5,  6,  5,  9,  6,  9,  2, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  5,  6,  5,  9,  6,  9,  2,  4,  8,  0, -1 },
+      {  6, 10,  1,  6,  1,  0,  6,  0,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6, 10,  1,  6,  1,  4,  6,  4,  8,  6,  8,  2, -1, -1, -1, -1 },
+      {  6,  4,  5,  6,  5,  9,  6,  9,  2, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  0,  6,  0,  5,  6,  5,  9,  6,  9,  2, -1, -1, -1, -1 },
+      {  6,  4,  0,  6,  0,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  6,  8,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10, 11,  8, 11,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10, 11,  4, 11,  9,  4,  9,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10, 11,  8, 11,  5,  8,  5,  0, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10, 11,  4, 11,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1, 11,  8, 11,  9, -1, -1, -1, -1, -1, -1, -1 },
+      { 11,  9,  0, 11,  0,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  1,  8,  1, 11,  8, 11,  5,  8,  5,  0, -1, -1, -1, -1 },
+      { 11,  5,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8, 10,  1,  8,  1,  5,  8,  5,  9, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  1,  4,  1,  5,  4,  5,  9,  4,  9,  0, -1, -1, -1, -1 },
+      {  8, 10,  1,  8,  1,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  4, 10,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  5,  8,  5,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  5,  9,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      {  8,  4,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }
+      };
+
+    const PixelType *buffer = this->m_Input->GetBufferPointer();
+    const double     iso = this->m_IsoValue;
+    long             cornerOffsets[8];
+    for( unsigned int c = 0; c < 8; c++ )
+      {
+      cornerOffsets[c] = ( c & 1 ) * this->m_Strides[0] + ( ( c >> 1 ) & 1 ) * this->m_Strides[1]
+        + ( ( c >> 2 ) & 1 ) * this->m_Strides[2];
+      }
+
+    std::vector<PointIdentifierType> & triangles = this->m_SlabTriangles[slab];
+    const long                         lastSlice = std::min( this->m_SlabBegins[slab + 1], this->m_Size[2] - 1 );
+    for( long z = this->m_SlabBegins[slab]; z < lastSlice; z++ )
+      {
+      for( long y = 0; y + 1 < this->m_Size[1]; y++ )
+        {
+        const PixelType *row = buffer + z * this->m_Strides[2] + y * this->m_Strides[1];
+        for( long x = 0; x + 1 < this->m_Size[0]; x++ )
+          {
+          unsigned int cubeCase = 0;
+          for( unsigned int c = 0; c < 8; c++ )
+            {
+            if( static_cast<double>( row[x + cornerOffsets[c]] ) >= iso )
+              {
+              cubeCase |= ( 1u << c );
+              }
+            }
+          const signed char *cubeTriangles = triangleTable[cubeCase];
+          for( unsigned int k = 0; cubeTriangles[k] >= 0; k++ )
+            {
+            triangles.push_back( this->GetEdgePoint( x, y, z, cubeEdges[cubeTriangles[k]] ) );
+            }
+          }
+        }
+      }
+  }
+
+  void BuildPointNeighbors()
+  {
+    const unsigned long numberOfPoints = this->GetNumberOfPoints();
+
+    std::vector<unsigned long long> edges;
+    edges.reserve( 2 * this->m_Triangles.size() );
+    for( unsigned long t = 0; t < this->m_Triangles.size(); t += 3 )
+      {
+      for( unsigned int k = 0; k < 3; k++ )
+        {
+        const unsigned long long a = this->m_Triangles[t + k];
+        const unsigned long long b = this->m_Triangles[t + ( k + 1 ) % 3];
+        edges.push_back( ( a << 32 ) | b );
+        edges.push_back( ( b << 32 ) | a );
+        }
+      }
+    std::sort( edges.begin(), edges.end() );
+    edges.erase( std::unique( edges.begin(), edges.end() ), edges.end() );
+
+    this->m_NeighborOffsets.assign( numberOfPoints + 1, 0 );
+    this->m_Neighbors.resize( edges.size() );
+    for( unsigned long e = 0; e < edges.size(); e++ )
+      {
+      this->m_NeighborOffsets[( edges[e] >> 32 ) + 1]++;
+      this->m_Neighbors[e] = static_cast<PointIdentifierType>( edges[e] & 0xffffffffULL );
+      }
+    for( unsigned long n = 0; n < numberOfPoints; n++ )
+      {
+      this->m_NeighborOffsets[n + 1] += this->m_NeighborOffsets[n];
+      }
+  }
+
+  void SmoothPoints( unsigned int slab )
+  {
+    const CoordinateType *points = &this->m_Points[0];
+    CoordinateType *      smoothed = &this->m_SmoothedPoints[0];
+    const double          relaxation = this->m_RelaxationFactor;
+
+    for( unsigned long n = this->m_SlabBegins[slab]; n < static_cast<unsigned long>( this->m_SlabBegins[slab + 1] );
+         n++ )
+      {
+      const unsigned long first = this->m_NeighborOffsets[n];
+      const unsigned long last = this->m_NeighborOffsets[n + 1];
+      for( unsigned int i = 0; i < 3; i++ )
+        {
+        double mean = 0.0;
+        for( unsigned long k = first; k < last; k++ )
+          {
+          mean += points[3 * this->m_Neighbors[k] + i];
+          }
+        const double point = points[3 * n + i];
+        smoothed[3 * n + i] = ( last > first )
+          ? static_cast<CoordinateType>( point + relaxation * ( mean / ( last - first ) - point ) )
+          : points[3 * n + i];
+        }
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE StageThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+
+    self->RunStageOnSlab( info->ThreadID );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  typename ImageType::ConstPointer m_Input;
+  double                           m_IsoValue;
+  bool                             m_UseImageDirection;
+  unsigned int                     m_NumberOfThreads;
+  unsigned int                     m_Stage;
+
+  long   m_Size[3];
+  long   m_Strides[3];
+  double m_Origin[3];
+  double m_Matrix[3][3];
+
+  std::vector<long>                             m_SlabBegins;
+  std::vector<std::vector<unsigned long> >      m_SliceEdges;
+  std::vector<std::vector<CoordinateType> >     m_SlicePoints;
+  std::vector<unsigned long>                    m_SlicePointOffsets;
+  std::vector<std::vector<PointIdentifierType> > m_SlabTriangles;
+
+  std::vector<CoordinateType>      m_Points;
+  std::vector<PointIdentifierType> m_Triangles;
+
+  double                           m_RelaxationFactor;
+  std::vector<CoordinateType>      m_SmoothedPoints;
+  std::vector<unsigned long>       m_NeighborOffsets;
+  std::vector<PointIdentifierType> m_Neighbors;
+};
+} // namespace ants
+
+#endif // __antsMarchingCubesSurface_h
@@ -0,0 +1,706 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsMaskedPoissonSolver_h
+#define __antsMaskedPoissonSolver_h
+
+#include "itkImage.h"
+#include "itkMacro.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ants
+{
+/** \class MaskedPoissonSolver
+ *
+ * Solves - Laplacian( u ) = f on the voxels marked Unknown, with u fixed to
+ * the input values on the voxels marked Fixed (Dirichlet) and no flux into
+ * the voxels marked Excluded or out of the image (Neumann).  The Laplacian
+ * is the 2 * ImageDimension + 1 point stencil, scaled by the spacing.
+ *
+ * This replaces the "smooth, then reset the known values" iterations of
+ * PoissonDiffusion, InPaint and LaplacianThickness, which need hundreds of
+ * sweeps over the image because each sweep only carries information a few
+ * voxels further.  The system is solved by conjugate gradients
+ * preconditioned with one geometric multigrid V-cycle: red-black
+ * Gauss-Seidel smoothing on all threads, restriction by averaging 2^N
+ * voxels and piecewise constant prolongation.  A coarse voxel is Unknown if
+ * any of its voxels is; the conjugate gradients make up for the resulting
+ * coarse operators only approximating the fine one near the mask boundary.
+ *
+ * Unknown voxels that are not connected to a Fixed voxel have no unique
+ * solution and keep their input value.  The iterations stop at a relative
+ * residual of Tolerance, after MaximumNumberOfIterations, or when the
+ * residual no longer decreases (the vectors are single precision).
+ */
+template <class TImage>
+class MaskedPoissonSolver
+{
+public:
+  typedef TImage                                            ImageType;
+  typedef typename ImageType::Pointer                       ImagePointer;
+  typedef typename ImageType::PixelType                     PixelType;
+  typedef itk::Image<unsigned char, TImage::ImageDimension> VoxelTypeImageType;
+  typedef typename ImageType::OffsetValueType               OffsetValueType;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  enum VoxelType { Excluded = 0, Unknown = 1, Fixed = 2 };
+
+  MaskedPoissonSolver() :
+    m_Tolerance( 1.e-6 ),
+    m_MaximumNumberOfIterations( 200 ),
+    m_NumberOfThreads( 0 ),
+    m_NumberOfIterations( 0 ),
+    m_RelativeResidual( 0 )
+  {
+  }
+
+  /** The values of the Fixed voxels and the initial guess at the Unknown ones. */
+  void SetInput( const ImageType *image )
+  {
+    this->m_Input = image;
+  }
+
+  /** The VoxelType of each voxel. */
+  void SetVoxelTypeImage( const VoxelTypeImageType *types )
+  {
+    this->m_VoxelTypeImage = types;
+  }
+
+  /** f; 0 if not set, i.e. the Laplace equation. */
+  void SetSourceImage( const ImageType *source )
+  {
+    this->m_SourceImage = source;
+  }
+
+  void SetTolerance( double tolerance )
+  {
+    this->m_Tolerance = tolerance;
+  }
+
+  void SetMaximumNumberOfIterations( unsigned int n )
+  {
+    this->m_MaximumNumberOfIterations = n;
+  }
+
+  /** 0 uses the ITK global default number of threads. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  unsigned int GetNumberOfIterations() const
+  {
+    return this->m_NumberOfIterations;
+  }
+
+  double GetRelativeResidual() const
+  {
+    return this->m_RelativeResidual;
+  }
+
+  /** The input with the Unknown voxels solved. */
+  ImageType * GetOutput() const
+  {
+    return this->m_Output.GetPointer();
+  }
+
+  void Update()
+  {
+    if( this->m_Input.IsNull() || this->m_VoxelTypeImage.IsNull() )
+      {
+      itkGenericExceptionMacro( "MaskedPoissonSolver: the input and voxel type images have to be set." );
+      }
+    const typename ImageType::RegionType region = this->m_Input->GetBufferedRegion();
+    if( this->m_VoxelTypeImage->GetBufferedRegion() != region
+        || ( this->m_SourceImage.IsNotNull() && this->m_SourceImage->GetBufferedRegion() != region ) )
+      {
+      itkGenericExceptionMacro( "MaskedPoissonSolver: the images have different regions." );
+      }
+
+    this->m_Output = ImageType::New();
+    this->m_Output->CopyInformation( this->m_Input );
+    this->m_Output->SetRegions( region );
+    this->m_Output->Allocate();
+    const size_t     numberOfVoxels = region.GetNumberOfPixels();
+    const PixelType *input = this->m_Input->GetBufferPointer();
+    std::copy( input, input + numberOfVoxels, this->m_Output->GetBufferPointer() );
+
+    // the finest level
+    this->m_Levels.clear();
+    this->m_Levels.push_back( Level() );
+    Level &                               fine = this->m_Levels[0];
+    const typename ImageType::SpacingType spacing = this->m_Input->GetSpacing();
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      fine.Size[d] = static_cast<OffsetValueType>( region.GetSize()[d] );
+      fine.Weights[d] = 1.0 / ( spacing[d] * spacing[d] );
+      }
+    const unsigned char *types = this->m_VoxelTypeImage->GetBufferPointer();
+    fine.Types.assign( types, types + numberOfVoxels );
+    this->InitializeLevel( fine );
+    this->ExcludeUnanchoredVoxels( fine );
+    if( fine.NumberOfUnknowns == 0 )
+      {
+      this->m_NumberOfIterations = 0;
+      this->m_RelativeResidual = 0;
+      return;
+      }
+
+    while( this->m_Levels.size() < MaximumNumberOfLevels && this->m_Levels.back().NumberOfUnknowns > 512 )
+      {
+      Level coarse;
+      if( !this->Coarsen( this->m_Levels.back(), coarse ) )
+        {
+        break;
+        }
+      this->m_Levels.push_back( coarse );
+      }
+
+    this->SolveConjugateGradients();
+    this->m_Levels.clear();
+  }
+
+private:
+  typedef MaskedPoissonSolver Self;
+
+  MaskedPoissonSolver( const Self & ); // purposely not implemented
+  void operator=( const Self & );      // purposely not implemented
+
+  itkStaticConstMacro( MaximumNumberOfLevels, unsigned int, 12 );
+  itkStaticConstMacro( NumberOfCoarsestSweeps, unsigned int, 20 );
+
+  struct Level
+    {
+    OffsetValueType            Size[ImageDimension];
+    OffsetValueType            Strides[ImageDimension];
+    double                     Weights[ImageDimension];
+    size_t                     NumberOfVoxels;
+    size_t                     NumberOfRows;
+    size_t                     NumberOfUnknowns;
+    std::vector<unsigned char> Types;
+    std::vector<float>         Diagonal;
+    std::vector<float>         X; // the correction
+    std::vector<float>         B; // the right hand side
+    std::vector<float>         R; // the residual
+    };
+
+  enum OperationType { RedSmoothing, BlackSmoothing, ResidualComputation, OperatorApplication };
+
+  struct ThreadStruct
+    {
+    const Self *  Solver;
+    Level *       CurrentLevel;
+    OperationType Operation;
+    const float * In;  // OperatorApplication: Out = A In, Sums = In . Out
+    float *       Out;
+    double        Sums[ITK_MAX_THREADS];
+    };
+
+  void InitializeLevel( Level & level ) const
+  {
+    OffsetValueType stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      level.Strides[d] = stride;
+      stride *= level.Size[d];
+      }
+    level.NumberOfVoxels = static_cast<size_t>( stride );
+    level.NumberOfRows = level.NumberOfVoxels / level.Size[0];
+
+    // the diagonal counts the neighbors that are not excluded
+    level.Diagonal.assign( level.NumberOfVoxels, 0.0f );
+    level.NumberOfUnknowns = 0;
+    OffsetValueType position[ImageDimension];
+    for( size_t n = 0; n < level.NumberOfVoxels; n++ )
+      {
+      if( level.Types[n] != Unknown )
+        {
+        continue;
+        }
+      level.NumberOfUnknowns++;
+      this->GetPosition( level, n, position );
+      double diagonal = 0.0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( position[d] > 0 && level.Types[n - level.Strides[d]] != Excluded )
+          {
+          diagonal += level.Weights[d];
+          }
+        if( position[d] + 1 < level.Size[d] && level.Types[n + level.Strides[d]] != Excluded )
+          {
+          diagonal += level.Weights[d];
+          }
+        }
+      level.Diagonal[n] = static_cast<float>( diagonal );
+      }
+    level.X.assign( level.NumberOfVoxels, 0.0f );
+    level.B.assign( level.NumberOfVoxels, 0.0f );
+    level.R.assign( level.NumberOfVoxels, 0.0f );
+  }
+
+  void GetPosition( const Level & level, size_t n, OffsetValueType *position ) const
+  {
+    OffsetValueType offset = static_cast<OffsetValueType>( n );
+    for( int d = ImageDimension - 1; d >= 0; d-- )
+      {
+      position[d] = offset / level.Strides[d];
+      offset -= position[d] * level.Strides[d];
+      }
+  }
+
+  /** Exclude the Unknown voxels that can't reach a Fixed voxel. */
+  void ExcludeUnanchoredVoxels( Level & level ) const
+  {
+    std::vector<char>   reached( level.NumberOfVoxels, 0 );
+    std::vector<size_t> front;
+    OffsetValueType     position[ImageDimension];
+    for( size_t n = 0; n < level.NumberOfVoxels; n++ )
+      {
+      if( level.Types[n] == Fixed )
+        {
+        reached[n] = 1;
+        front.push_back( n );
+        }
+      }
+    while( !front.empty() )
+      {
+      const size_t n = front.back();
+      front.pop_back();
+      this->GetPosition( level, n, position );
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( position[d] > 0 && !reached[n - level.Strides[d]] && level.Types[n - level.Strides[d]] == Unknown )
+          {
+          reached[n - level.Strides[d]] = 1;
+          front.push_back( n - level.Strides[d] );
+          }
+        if( position[d] + 1 < level.Size[d] && !reached[n + level.Strides[d]]
+            && level.Types[n + level.Strides[d]] == Unknown )
+          {
+          reached[n + level.Strides[d]] = 1;
+          front.push_back( n + level.Strides[d] );
+          }
+        }
+      }
+    bool changed = false;
+    for( size_t n = 0; n < level.NumberOfVoxels; n++ )
+      {
+      if( level.Types[n] == Unknown && !reached[n] )
+        {
+        level.Types[n] = Excluded;
+        changed = true;
+        }
+      }
+    if( changed )
+      {
+      this->InitializeLevel( level );
+      }
+  }
+
+  bool Coarsen( const Level & fine, Level & coarse ) const
+  {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( fine.Size[d] < 4 )
+        {
+        return false;
+        }
+      coarse.Size[d] = ( fine.Size[d] + 1 ) / 2;
+      coarse.Weights[d] = fine.Weights[d] * 0.25;
+      }
+    size_t numberOfVoxels = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      numberOfVoxels *= coarse.Size[d];
+      }
+    coarse.Types.assign( numberOfVoxels, static_cast<unsigned char>( Excluded ) );
+    this->InitializeLevel( coarse ); // for the strides
+    for( size_t n = 0; n < fine.NumberOfVoxels; n++ )
+      {
+      unsigned char & type = coarse.Types[this->GetParent( fine, coarse, n )];
+      if( fine.Types[n] == Unknown || ( fine.Types[n] == Fixed && type == Excluded ) )
+        {
+        type = fine.Types[n];
+        }
+      }
+    this->InitializeLevel( coarse );
+    return true;
+  }
+
+  size_t GetParent( const Level & fine, const Level & coarse, size_t n ) const
+  {
+    OffsetValueType position[ImageDimension];
+    this->GetPosition( fine, n, position );
+    size_t parent = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      parent += ( position[d] / 2 ) * coarse.Strides[d];
+      }
+    return parent;
+  }
+
+  /** The operation on the voxels of the rows [begin, end) of level. */
+  double ProcessRows( ThreadStruct & str, size_t begin, size_t end ) const
+  {
+    Level &               level = *str.CurrentLevel;
+    const unsigned char * types = &level.Types[0];
+    const float *         diagonal = &level.Diagonal[0];
+    const OffsetValueType size0 = level.Size[0];
+    const double          weight0 = level.Weights[0];
+
+    const float *in = ITK_NULLPTR;
+    float *      out = ITK_NULLPTR;
+    size_t       step = 1;
+    switch( str.Operation )
+      {
+      case RedSmoothing:
+      case BlackSmoothing:
+        in = &level.X[0];
+        out = &level.X[0];
+        step = 2;
+        break;
+      case ResidualComputation:
+        in = &level.X[0];
+        out = &level.R[0];
+        break;
+      case OperatorApplication:
+        in = str.In;
+        out = str.Out;
+        break;
+      }
+    const float *b = &level.B[0];
+
+    double          sum = 0.0;
+    OffsetValueType position[ImageDimension];
+    for( size_t row = begin; row < end; row++ )
+      {
+      const size_t rowStart = row * static_cast<size_t>( size0 );
+      this->GetPosition( level, rowStart, position );
+      OffsetValueType parity = 0;
+      for( unsigned int d = 1; d < ImageDimension; d++ )
+        {
+        parity += position[d];
+        }
+      OffsetValueType first = 0;
+      if( str.Operation == RedSmoothing )
+        {
+        first = parity % 2;
+        }
+      else if( str.Operation == BlackSmoothing )
+        {
+        first = ( parity + 1 ) % 2;
+        }
+
+      for( OffsetValueType x = first; x < size0; x += step )
+        {
+        const size_t n = rowStart + x;
+        if( types[n] != Unknown )
+          {
+          if( str.Operation == ResidualComputation || str.Operation == OperatorApplication )
+            {
+            out[n] = 0;
+            }
+          continue;
+          }
+
+        // the sum over the unknown neighbors
+        double neighbors = 0.0;
+        if( x > 0 && types[n - 1] == Unknown )
+          {
+          neighbors += weight0 * in[n - 1];
+          }
+        if( x + 1 < size0 && types[n + 1] == Unknown )
+          {
+          neighbors += weight0 * in[n + 1];
+          }
+        for( unsigned int d = 1; d < ImageDimension; d++ )
+          {
+          const OffsetValueType stride = level.Strides[d];
+          if( position[d] > 0 && types[n - stride] == Unknown )
+            {
+            neighbors += level.Weights[d] * in[n - stride];
+            }
+          if( position[d] + 1 < level.Size[d] && types[n + stride] == Unknown )
+            {
+            neighbors += level.Weights[d] * in[n + stride];
+            }
+          }
+
+        switch( str.Operation )
+          {
+          case RedSmoothing:
+          case BlackSmoothing:
+            if( diagonal[n] > 0 )
+              {
+              out[n] = static_cast<float>( ( b[n] + neighbors ) / diagonal[n] );
+              }
+            break;
+          case ResidualComputation:
+            out[n] = static_cast<float>( b[n] - ( diagonal[n] * in[n] - neighbors ) );
+            break;
+          case OperatorApplication:
+            out[n] = static_cast<float>( diagonal[n] * in[n] - neighbors );
+            sum += static_cast<double>( in[n] ) * out[n];
+            break;
+          }
+        }
+      }
+    return sum;
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct *                        str = static_cast<ThreadStruct *>( info->UserData );
+
+    const unsigned long long numberOfRows = str->CurrentLevel->NumberOfRows;
+    const size_t             begin = numberOfRows * info->ThreadID / info->NumberOfThreads;
+    const size_t             end = numberOfRows * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+    str->Sums[info->ThreadID] = str->Solver->ProcessRows( *str, begin, end );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** Run operation on level on all threads; returns the sum of the Sums. */
+  double Run( Level & level, OperationType operation, const float *in = ITK_NULLPTR, float *out = ITK_NULLPTR ) const
+  {
+    ThreadStruct str;
+    str.Solver = this;
+    str.CurrentLevel = &level;
+    str.Operation = operation;
+    str.In = in;
+    str.Out = out;
+
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    // small levels are not worth starting threads for
+    if( level.NumberOfVoxels < 32768 || level.NumberOfRows < numberOfThreads )
+      {
+      numberOfThreads = 1;
+      }
+    std::fill( str.Sums, str.Sums + ITK_MAX_THREADS, 0.0 );
+    if( numberOfThreads <= 1 )
+      {
+      return this->ProcessRows( str, 0, level.NumberOfRows );
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( Self::ThreaderCallback, &str );
+    threader->SingleMethodExecute();
+
+    double sum = 0.0;
+    for( unsigned int t = 0; t < ITK_MAX_THREADS; t++ )
+      {
+      sum += str.Sums[t];
+      }
+    return sum;
+  }
+
+  /** Level l's X from its B with one V-cycle, starting from 0.  The
+   * post-smoothing runs the colors in the reverse order of the
+   * pre-smoothing, so the cycle is a symmetric preconditioner. */
+  void VCycle( unsigned int l )
+  {
+    Level & level = this->m_Levels[l];
+    std::fill( level.X.begin(), level.X.end(), 0.0f );
+    if( l + 1 == this->m_Levels.size() )
+      {
+      for( unsigned int k = 0; k < NumberOfCoarsestSweeps; k++ )
+        {
+        this->Run( level, RedSmoothing );
+        this->Run( level, BlackSmoothing );
+        this->Run( level, BlackSmoothing );
+        this->Run( level, RedSmoothing );
+        }
+      return;
+      }
+
+    this->Run( level, RedSmoothing );
+    this->Run( level, BlackSmoothing );
+    this->Run( level, ResidualComputation );
+
+    Level & coarse = this->m_Levels[l + 1];
+    std::fill( coarse.B.begin(), coarse.B.end(), 0.0f );
+    const float scale = 1.0f / static_cast<float>( 1u << ImageDimension );
+    for( size_t n = 0; n < level.NumberOfVoxels; n++ )
+      {
+      if( level.Types[n] == Unknown )
+        {
+        coarse.B[this->GetParent( level, coarse, n )] += scale * level.R[n];
+        }
+      }
+    for( size_t n = 0; n < coarse.NumberOfVoxels; n++ )
+      {
+      if( coarse.Types[n] != Unknown )
+        {
+        coarse.B[n] = 0;
+        }
+      }
+
+    this->VCycle( l + 1 );
+
+    for( size_t n = 0; n < level.NumberOfVoxels; n++ )
+      {
+      if( level.Types[n] == Unknown )
+        {
+        level.X[n] += coarse.X[this->GetParent( level, coarse, n )];
+        }
+      }
+
+    this->Run( level, BlackSmoothing );
+    this->Run( level, RedSmoothing );
+  }
+
+  static double Dot( const std::vector<float> & a, const std::vector<float> & b )
+  {
+    double sum = 0.0;
+    for( size_t n = 0; n < a.size(); n++ )
+      {
+      sum += static_cast<double>( a[n] ) * b[n];
+      }
+    return sum;
+  }
+
+  void SolveConjugateGradients()
+  {
+    Level &              fine = this->m_Levels[0];
+    PixelType *          output = this->m_Output->GetBufferPointer();
+    const PixelType *    source = this->m_SourceImage.IsNotNull() ? this->m_SourceImage->GetBufferPointer() : ITK_NULLPTR;
+    const size_t         numberOfVoxels = fine.NumberOfVoxels;
+    std::vector<float>   x( numberOfVoxels, 0.0f );
+    std::vector<float>   b( numberOfVoxels, 0.0f );
+    OffsetValueType      position[ImageDimension];
+
+    // the fixed neighbors move to the right hand side
+    for( size_t n = 0; n < numberOfVoxels; n++ )
+      {
+      if( fine.Types[n] != Unknown )
+        {
+        continue;
+        }
+      x[n] = output[n];
+      double value = source ? source[n] : 0.0;
+      this->GetPosition( fine, n, position );
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( position[d] > 0 && fine.Types[n - fine.Strides[d]] == Fixed )
+          {
+          value += fine.Weights[d] * output[n - fine.Strides[d]];
+          }
+        if( position[d] + 1 < fine.Size[d] && fine.Types[n + fine.Strides[d]] == Fixed )
+          {
+          value += fine.Weights[d] * output[n + fine.Strides[d]];
+          }
+        }
+      b[n] = static_cast<float>( value );
+      }
+
+    // r = b - A x
+    std::vector<float> r( numberOfVoxels );
+    std::vector<float> q( numberOfVoxels );
+    this->Run( fine, OperatorApplication, &x[0], &q[0] );
+    for( size_t n = 0; n < numberOfVoxels; n++ )
+      {
+      r[n] = b[n] - q[n];
+      }
+    double normB = std::sqrt( Dot( b, b ) );
+    if( normB == 0.0 )
+      {
+      normB = 1.0;
+      }
+
+    std::vector<float> z( numberOfVoxels );
+    std::vector<float> p( numberOfVoxels );
+    fine.B = r;
+    this->VCycle( 0 );
+    z = fine.X;
+    p = z;
+    double rz = Dot( r, z );
+
+    double       bestResidual = std::sqrt( Dot( r, r ) ) / normB;
+    unsigned int sinceBest = 0;
+    this->m_RelativeResidual = bestResidual;
+    this->m_NumberOfIterations = 0;
+    while( this->m_NumberOfIterations < this->m_MaximumNumberOfIterations
+           && this->m_RelativeResidual > this->m_Tolerance && rz > 0.0 )
+      {
+      const double pq = this->Run( fine, OperatorApplication, &p[0], &q[0] );
+      if( pq <= 0.0 )
+        {
+        break;
+        }
+      const double alpha = rz / pq;
+      for( size_t n = 0; n < numberOfVoxels; n++ )
+        {
+        x[n] += static_cast<float>( alpha * p[n] );
+        r[n] -= static_cast<float>( alpha * q[n] );
+        }
+      this->m_NumberOfIterations++;
+      this->m_RelativeResidual = std::sqrt( Dot( r, r ) ) / normB;
+
+      // single precision limits how small the residual gets
+      if( this->m_RelativeResidual < 0.99 * bestResidual )
+        {
+        bestResidual = this->m_RelativeResidual;
+        sinceBest = 0;
+        }
+      else if( ++sinceBest >= 10 )
+        {
+        break;
+        }
+
+      fine.B = r;
+      this->VCycle( 0 );
+      z = fine.X;
+      const double rzNew = Dot( r, z );
+      const double beta = rzNew / rz;
+      rz = rzNew;
+      for( size_t n = 0; n < numberOfVoxels; n++ )
+        {
+        p[n] = static_cast<float>( z[n] + beta * p[n] );
+        }
+      }
+
+    for( size_t n = 0; n < numberOfVoxels; n++ )
+      {
+      if( fine.Types[n] == Unknown )
+        {
+        output[n] = static_cast<PixelType>( x[n] );
+        }
+      }
+  }
+
+  typename ImageType::ConstPointer          m_Input;
+  typename VoxelTypeImageType::ConstPointer m_VoxelTypeImage;
+  typename ImageType::ConstPointer          m_SourceImage;
+  double                                    m_Tolerance;
+  unsigned int                              m_MaximumNumberOfIterations;
+  unsigned int                              m_NumberOfThreads;
+  unsigned int                              m_NumberOfIterations;
+  double                                    m_RelativeResidual;
+
+  std::vector<Level> m_Levels;
+  ImagePointer       m_Output;
+};
+} // namespace ants
+
+#endif // __antsMaskedPoissonSolver_h
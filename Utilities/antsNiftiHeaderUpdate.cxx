@@ -0,0 +1,146 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsNiftiHeaderUpdate.h"
+
+#include "antsObjectCache.h"
+
+#include "nifti1_io.h"
+#include "itksys/SystemTools.hxx"
+
+#include <cstring>
+#include <fstream>
+
+namespace ants
+{
+namespace
+{
+bool IsUncompressedNiftiFileName( const std::string & fileName )
+{
+  const std::string extension = ".nii";
+  return fileName.size() > extension.size() &&
+         itksys::SystemTools::LowerCase( fileName.substr( fileName.size() - extension.size() ) ) == extension;
+}
+}
+
+bool UpdateNiftiHeaderGeometry( const std::string & inputFileName, const std::string & outputFileName,
+                                unsigned int dimension, const double *origin, const double *spacing,
+                                const double *direction )
+{
+  if( dimension < 2 || dimension > 3 ||
+      !IsUncompressedNiftiFileName( inputFileName ) || !IsUncompressedNiftiFileName( outputFileName ) )
+    {
+    return false;
+    }
+
+  nifti_1_header header;
+  {
+  std::ifstream inputFile( inputFileName.c_str(), std::ios::in | std::ios::binary );
+  if( !inputFile.read( reinterpret_cast<char *>( &header ), sizeof( header ) ) )
+    {
+    return false;
+    }
+  }
+
+  // the header is in the byte order of the machine that wrote it
+  const bool isSwapped = ( header.sizeof_hdr != 348 );
+  if( isSwapped )
+    {
+    swap_nifti_header( &header, 1 );
+    if( header.sizeof_hdr != 348 )
+      {
+      return false;
+      }
+    }
+  if( std::strncmp( header.magic, "n+1", 4 ) != 0 || header.dim[0] != static_cast<short>( dimension ) )
+    {
+    return false;
+    }
+
+  // ITK's LPS geometry in NIfTI's RAS: the first two rows change sign.  A 2D
+  // image is the first slice of a 3D one, as ITK writes it.
+  mat44 R;
+  for( unsigned int i = 0; i < 4; i++ )
+    {
+    for( unsigned int j = 0; j < 4; j++ )
+      {
+      R.m[i][j] = 0.0f;
+      }
+    }
+  R.m[2][2] = ( header.pixdim[3] > 0.0f ) ? header.pixdim[3] : 1.0f;
+  R.m[3][3] = 1.0f;
+  for( unsigned int i = 0; i < dimension; i++ )
+    {
+    const double sign = ( i < 2 ) ? -1.0 : 1.0;
+    for( unsigned int j = 0; j < dimension; j++ )
+      {
+      R.m[i][j] = static_cast<float>( sign * direction[i * dimension + j] * spacing[j] );
+      }
+    R.m[i][3] = static_cast<float>( sign * origin[i] );
+    }
+
+  float qb, qc, qd, qx, qy, qz, dx, dy, dz, qfac;
+  nifti_mat44_to_quatern( R, &qb, &qc, &qd, &qx, &qy, &qz, &dx, &dy, &dz, &qfac );
+
+  header.quatern_b = qb;
+  header.quatern_c = qc;
+  header.quatern_d = qd;
+  header.qoffset_x = qx;
+  header.qoffset_y = qy;
+  header.qoffset_z = qz;
+  header.pixdim[0] = qfac;
+  for( unsigned int d = 0; d < dimension; d++ )
+    {
+    header.pixdim[d + 1] = static_cast<float>( spacing[d] );
+    }
+  for( unsigned int j = 0; j < 4; j++ )
+    {
+    header.srow_x[j] = R.m[0][j];
+    header.srow_y[j] = R.m[1][j];
+    header.srow_z[j] = R.m[2][j];
+    }
+  if( header.qform_code <= 0 )
+    {
+    header.qform_code = NIFTI_XFORM_SCANNER_ANAT;
+    }
+  if( header.sform_code <= 0 )
+    {
+    header.sform_code = NIFTI_XFORM_SCANNER_ANAT;
+    }
+
+  if( isSwapped )
+    {
+    swap_nifti_header( &header, 1 );
+    }
+
+  if( !itksys::SystemTools::SameFile( inputFileName, outputFileName ) &&
+      !itksys::SystemTools::CopyFileAlways( inputFileName, outputFileName ) )
+    {
+    return false;
+    }
+
+  std::fstream outputFile( outputFileName.c_str(), std::ios::in | std::ios::out | std::ios::binary );
+  if( !outputFile.is_open() )
+    {
+    return false;
+    }
+  outputFile.seekp( 0 );
+  outputFile.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+  const bool isWritten = !outputFile.fail();
+  outputFile.close();
+
+  ObjectCache::Invalidate( outputFileName );
+
+  return isWritten;
+}
+} // namespace ants
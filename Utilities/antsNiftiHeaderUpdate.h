@@ -0,0 +1,63 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsNiftiHeaderUpdate_h
+#define __antsNiftiHeaderUpdate_h
+
+#include <string>
+
+namespace ants
+{
+/**
+ * Set the origin, spacing and direction (ITK's LPS convention) of an
+ * uncompressed single file NIfTI-1 image by rewriting its header in place,
+ * without reading or writing the voxels.  If outputFileName is another file,
+ * the input is copied to it first.  The voxels keep their stored data type.
+ *
+ * Returns false, leaving the output untouched, when the input or output is
+ * not a 2 or 3 dimensional .nii file; the caller then reads and writes the
+ * whole image.  The arrays hold dimension values, and dimension x dimension
+ * for the direction in row major order.
+ */
+bool UpdateNiftiHeaderGeometry( const std::string & inputFileName, const std::string & outputFileName,
+                                unsigned int dimension, const double *origin, const double *spacing,
+                                const double *direction );
+
+/** The same with the geometry of an image, e.g. the output information of a reader. */
+template <class TImage>
+bool UpdateNiftiHeaderGeometry( const std::string & inputFileName, const std::string & outputFileName,
+                                const TImage *image )
+{
+  const unsigned int dimension = TImage::ImageDimension;
+  if( dimension > 3 )
+    {
+    return false;
+    }
+
+  double origin[3];
+  double spacing[3];
+  double direction[9];
+  for( unsigned int i = 0; i < dimension; i++ )
+    {
+    origin[i] = image->GetOrigin()[i];
+    spacing[i] = image->GetSpacing()[i];
+    for( unsigned int j = 0; j < dimension; j++ )
+      {
+      direction[i * dimension + j] = image->GetDirection()[i][j];
+      }
+    }
+  return UpdateNiftiHeaderGeometry( inputFileName, outputFileName, dimension, origin, spacing, direction );
+}
+} // namespace ants
+
+#endif // __antsNiftiHeaderUpdate_h
@@ -0,0 +1,203 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsObjectCache.h"
+
+#include "itkSimpleFastMutexLock.h"
+#include "itksys/SystemTools.hxx"
+
+#include <cstdlib>
+#include <map>
+
+namespace ants
+{
+namespace
+{
+struct CacheEntry
+  {
+  itk::LightObject::Pointer Object;
+  std::string               FileName;
+  long int                  ModifiedTime;
+  unsigned long             FileLength;
+  unsigned long             MemorySize;
+  unsigned long             LastUse;
+  };
+
+typedef std::map<std::string, CacheEntry> CacheType;
+
+itk::SimpleFastMutexLock cacheMutex;
+CacheType                cache;
+unsigned long            maximumMemory = 0;
+unsigned long            memoryInUse = 0;
+unsigned long            useCounter = 0;
+bool                     isInitialized = false;
+
+// all of the following expect cacheMutex to be held
+
+void InitializeFromEnvironment()
+{
+  if( isInitialized )
+    {
+    return;
+    }
+  isInitialized = true;
+  const char *value = std::getenv( "ANTS_OBJECT_CACHE_MB" );
+  if( value )
+    {
+    maximumMemory = std::strtoul( value, ITK_NULLPTR, 10 ) * 1024ul * 1024ul;
+    }
+}
+
+std::string GetKey( const std::string & fileName, const std::string & typeName )
+{
+  return fileName + "|" + typeName;
+}
+
+void Erase( CacheType::iterator it )
+{
+  memoryInUse -= it->second.MemorySize;
+  cache.erase( it );
+}
+
+/** Evict the least recently used entries until memorySize more bytes fit. */
+void MakeRoom( unsigned long memorySize )
+{
+  while( !cache.empty() && memoryInUse + memorySize > maximumMemory )
+    {
+    CacheType::iterator oldest = cache.begin();
+    for( CacheType::iterator it = cache.begin(); it != cache.end(); ++it )
+      {
+      if( it->second.LastUse < oldest->second.LastUse )
+        {
+        oldest = it;
+        }
+      }
+    Erase( oldest );
+    }
+}
+} // anonymous namespace
+
+void ObjectCache::SetMaximumMemory( unsigned long bytes )
+{
+  cacheMutex.Lock();
+  isInitialized = true;
+  maximumMemory = bytes;
+  MakeRoom( 0 );
+  cacheMutex.Unlock();
+}
+
+unsigned long ObjectCache::GetMaximumMemory()
+{
+  cacheMutex.Lock();
+  InitializeFromEnvironment();
+  const unsigned long bytes = maximumMemory;
+  cacheMutex.Unlock();
+  return bytes;
+}
+
+bool ObjectCache::IsEnabled()
+{
+  return GetMaximumMemory() > 0;
+}
+
+void ObjectCache::Clear()
+{
+  cacheMutex.Lock();
+  cache.clear();
+  memoryInUse = 0;
+  cacheMutex.Unlock();
+}
+
+void ObjectCache::Invalidate( const std::string & fileName )
+{
+  cacheMutex.Lock();
+  for( CacheType::iterator it = cache.begin(); it != cache.end(); )
+    {
+    CacheType::iterator current = it++;
+    if( current->second.FileName == fileName )
+      {
+      Erase( current );
+      }
+    }
+  cacheMutex.Unlock();
+}
+
+itk::LightObject::Pointer ObjectCache::Find( const std::string & fileName, const std::string & typeName )
+{
+  // stat the file outside of the lock
+  const bool          exists = itksys::SystemTools::FileExists( fileName.c_str(), true );
+  const long int      modifiedTime = exists ? itksys::SystemTools::ModifiedTime( fileName.c_str() ) : 0;
+  const unsigned long fileLength = exists ? itksys::SystemTools::FileLength( fileName.c_str() ) : 0;
+
+  itk::LightObject::Pointer object;
+
+  cacheMutex.Lock();
+  CacheType::iterator it = cache.find( GetKey( fileName, typeName ) );
+  if( it != cache.end() )
+    {
+    if( !exists || it->second.ModifiedTime != modifiedTime || it->second.FileLength != fileLength )
+      {
+      Erase( it );
+      }
+    else
+      {
+      it->second.LastUse = ++useCounter;
+      object = it->second.Object;
+      }
+    }
+  cacheMutex.Unlock();
+
+  return object;
+}
+
+void ObjectCache::Insert( const std::string & fileName, const std::string & typeName, itk::LightObject * object,
+                          unsigned long memorySize )
+{
+  if( !itksys::SystemTools::FileExists( fileName.c_str(), true ) )
+    {
+    return;
+    }
+
+  CacheEntry entry;
+  entry.Object = object;
+  entry.FileName = fileName;
+  entry.ModifiedTime = itksys::SystemTools::ModifiedTime( fileName.c_str() );
+  entry.FileLength = itksys::SystemTools::FileLength( fileName.c_str() );
+  entry.MemorySize = memorySize;
+
+  cacheMutex.Lock();
+  InitializeFromEnvironment();
+  const std::string   key = GetKey( fileName, typeName );
+  CacheType::iterator it = cache.find( key );
+  if( it != cache.end() )
+    {
+    Erase( it );
+    }
+  if( memorySize <= maximumMemory )
+    {
+    MakeRoom( memorySize );
+    entry.LastUse = ++useCounter;
+    cache[key] = entry;
+    memoryInUse += memorySize;
+    }
+  cacheMutex.Unlock();
+}
+
+unsigned long ObjectCache::GetMemoryInUse()
+{
+  cacheMutex.Lock();
+  const unsigned long bytes = memoryInUse;
+  cacheMutex.Unlock();
+  return bytes;
+}
+} // namespace ants
@@ -0,0 +1,155 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsObjectCache_h
+#define __antsObjectCache_h
+
+#include "itkCompositeTransform.h"
+#include "itkImageDuplicator.h"
+#include "itkLightObject.h"
+
+#include <string>
+#include <typeinfo>
+
+namespace ants
+{
+/** \class ObjectCache
+ *
+ * Process-wide cache of the images and transforms read by ReadImage and
+ * itk::ants::ReadTransform, for pipelines that call several of the ants::
+ * library entry points (antsRegistration, antsApplyTransforms, ImageMath,
+ * ...) in one process and would otherwise parse the same files again in
+ * every call.
+ *
+ * The cache is off until SetMaximumMemory is called with a nonzero budget
+ * or the environment variable ANTS_OBJECT_CACHE_MB is set.  Entries are
+ * keyed by file name and object type and are dropped when the modification
+ * time or size of the file changes; the least recently used entries are
+ * evicted to stay within the budget.  Readers get a copy of the cached
+ * object, so the tools can keep modifying what they read.
+ */
+class ObjectCache
+{
+public:
+  /** Budget in bytes, 0 disables the cache and clears it. */
+  static void SetMaximumMemory( unsigned long bytes );
+
+  static unsigned long GetMaximumMemory();
+
+  static bool IsEnabled();
+
+  static void Clear();
+
+  /** Drop the entries of fileName, e.g. after it was written. */
+  static void Invalidate( const std::string & fileName );
+
+  /** The object cached for (fileName, typeName) if it is still current. */
+  static itk::LightObject::Pointer Find( const std::string & fileName, const std::string & typeName );
+
+  static void Insert( const std::string & fileName, const std::string & typeName, itk::LightObject * object,
+                      unsigned long memorySize );
+
+  static unsigned long GetMemoryInUse();
+
+private:
+  ObjectCache();
+};
+
+template <class TImage>
+typename TImage::Pointer GetCachedImage( const std::string & fileName )
+{
+  if( !ObjectCache::IsEnabled() )
+    {
+    return ITK_NULLPTR;
+    }
+  itk::LightObject::Pointer object = ObjectCache::Find( fileName, typeid( TImage ).name() );
+  const TImage *               cached = dynamic_cast<const TImage *>( object.GetPointer() );
+  if( !cached )
+    {
+    return ITK_NULLPTR;
+    }
+
+  typedef itk::ImageDuplicator<TImage> DuplicatorType;
+  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+  duplicator->SetInputImage( cached );
+  duplicator->Update();
+  return duplicator->GetModifiableOutput();
+}
+
+template <class TImage>
+void CacheImage( const std::string & fileName, const TImage *image )
+{
+  if( !ObjectCache::IsEnabled() || !image )
+    {
+    return;
+    }
+  typedef itk::ImageDuplicator<TImage> DuplicatorType;
+  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+  duplicator->SetInputImage( image );
+  duplicator->Update();
+
+  typename TImage::Pointer copy = duplicator->GetModifiableOutput();
+  const unsigned long      memorySize = static_cast<unsigned long>( copy->GetPixelContainer()->Size()
+                                                                    * sizeof( typename TImage::InternalPixelType ) );
+  ObjectCache::Insert( fileName, typeid( TImage ).name(), copy, memorySize );
+}
+
+template <class TTransform>
+unsigned long GetTransformMemorySize( const TTransform *transform )
+{
+  typedef typename TTransform::ScalarType                                       RealType;
+  typedef itk::CompositeTransform<RealType, TTransform::InputSpaceDimension> CompositeTransformType;
+
+  const CompositeTransformType *composite = dynamic_cast<const CompositeTransformType *>( transform );
+  if( composite )
+    {
+    unsigned long memorySize = 0;
+    for( unsigned int n = 0; n < composite->GetNumberOfTransforms(); n++ )
+      {
+      memorySize += GetTransformMemorySize( composite->GetNthTransform( n ).GetPointer() );
+      }
+    return memorySize;
+    }
+  return static_cast<unsigned long>( ( transform->GetParameters().Size()
+                                       + transform->GetFixedParameters().Size() ) * sizeof( RealType ) );
+}
+
+template <class TTransform>
+typename TTransform::Pointer GetCachedTransform( const std::string & fileName )
+{
+  if( !ObjectCache::IsEnabled() )
+    {
+    return ITK_NULLPTR;
+    }
+  itk::LightObject::Pointer object = ObjectCache::Find( fileName, typeid( TTransform ).name() );
+  const TTransform *               cached = dynamic_cast<const TTransform *>( object.GetPointer() );
+  if( !cached )
+    {
+    return ITK_NULLPTR;
+    }
+  return dynamic_cast<TTransform *>( cached->Clone().GetPointer() );
+}
+
+template <class TTransform>
+void CacheTransform( const std::string & fileName, const TTransform *transform )
+{
+  if( !ObjectCache::IsEnabled() || !transform )
+    {
+    return;
+    }
+  itk::LightObject::Pointer copy = transform->Clone().GetPointer();
+  ObjectCache::Insert( fileName, typeid( TTransform ).name(), copy, GetTransformMemorySize( transform ) );
+}
+} // namespace ants
+
+#endif // __antsObjectCache_h
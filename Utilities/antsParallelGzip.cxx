@@ -0,0 +1,519 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsParallelGzip.h"
+
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itk_zlib.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined( _WIN32 )
+#include <io.h>
+#include <process.h>
+#define ANTS_GETPID _getpid
+#else
+#include <unistd.h>
+#define ANTS_GETPID getpid
+#endif
+
+namespace ants
+{
+namespace
+{
+// gzip member header: ID1 ID2 CM FLG MTIME(4) XFL OS, XLEN(2), and the
+// 'A','N' subfield with its length (2) and the member size (4)
+const unsigned int GzipHeaderSize = 20;
+const unsigned int GzipTrailerSize = 8;
+
+const unsigned char GzipFlagExtra = 4;
+
+typedef std::vector<unsigned char> BufferType;
+
+void PutLittleEndian16( unsigned char *p, unsigned int value )
+{
+  p[0] = static_cast<unsigned char>( value & 0xff );
+  p[1] = static_cast<unsigned char>( ( value >> 8 ) & 0xff );
+}
+
+void PutLittleEndian32( unsigned char *p, unsigned long value )
+{
+  for( unsigned int i = 0; i < 4; i++ )
+    {
+    p[i] = static_cast<unsigned char>( ( value >> ( 8 * i ) ) & 0xff );
+    }
+}
+
+unsigned long GetLittleEndian32( const unsigned char *p )
+{
+  return static_cast<unsigned long>( p[0] ) | ( static_cast<unsigned long>( p[1] ) << 8 )
+         | ( static_cast<unsigned long>( p[2] ) << 16 ) | ( static_cast<unsigned long>( p[3] ) << 24 );
+}
+
+/** Size of the member starting at p, or 0 if it is not one of ours. */
+unsigned long GetMemberSize( const unsigned char *p, unsigned long available )
+{
+  if( available < GzipHeaderSize + GzipTrailerSize )
+    {
+    return 0;
+    }
+  if( p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != GzipFlagExtra
+      || p[10] != 8 || p[11] != 0 || p[12] != 'A' || p[13] != 'N' || p[14] != 4 || p[15] != 0 )
+    {
+    return 0;
+    }
+  const unsigned long size = GetLittleEndian32( p + 16 );
+  if( size < GzipHeaderSize + GzipTrailerSize || size > available )
+    {
+    return 0;
+    }
+  return size;
+}
+
+unsigned int GetNumberOfThreads( unsigned int numberOfThreads, unsigned long numberOfJobs )
+{
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+  if( numberOfThreads > numberOfJobs )
+    {
+    numberOfThreads = static_cast<unsigned int>( numberOfJobs );
+    }
+  return std::max( numberOfThreads, 1u );
+}
+
+struct BlockThreadStruct
+  {
+  std::vector<BufferType> *Input;
+  std::vector<BufferType> *Output;
+  int                     CompressionLevel;
+  std::vector<bool>       Succeeded;
+  };
+
+bool CompressBlock( const BufferType & input, BufferType & output, int compressionLevel )
+{
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  // raw deflate, the gzip header and trailer are written here
+  if( deflateInit2( &stream, compressionLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+    {
+    return false;
+    }
+
+  const uLong bound = deflateBound( &stream, static_cast<uLong>( input.size() ) );
+  output.resize( GzipHeaderSize + bound + GzipTrailerSize );
+
+  stream.next_in = const_cast<Bytef *>( input.empty() ? Z_NULL : &input[0] );
+  stream.avail_in = static_cast<uInt>( input.size() );
+  stream.next_out = &output[GzipHeaderSize];
+  stream.avail_out = static_cast<uInt>( bound );
+
+  const int status = deflate( &stream, Z_FINISH );
+  const uLong compressedSize = stream.total_out;
+  deflateEnd( &stream );
+  if( status != Z_STREAM_END )
+    {
+    return false;
+    }
+
+  const unsigned long memberSize = GzipHeaderSize + compressedSize + GzipTrailerSize;
+  output.resize( memberSize );
+
+  unsigned char *header = &output[0];
+  header[0] = 0x1f;
+  header[1] = 0x8b;
+  header[2] = 8; // deflate
+  header[3] = GzipFlagExtra;
+  PutLittleEndian32( header + 4, 0 ); // no modification time
+  header[8] = 0;
+  header[9] = 255; // unknown OS
+  PutLittleEndian16( header + 10, 8 );
+  header[12] = 'A';
+  header[13] = 'N';
+  PutLittleEndian16( header + 14, 4 );
+  PutLittleEndian32( header + 16, memberSize );
+
+  uLong crc = crc32( 0L, Z_NULL, 0 );
+  if( !input.empty() )
+    {
+    crc = crc32( crc, &input[0], static_cast<uInt>( input.size() ) );
+    }
+  unsigned char *trailer = &output[memberSize - GzipTrailerSize];
+  PutLittleEndian32( trailer, crc );
+  PutLittleEndian32( trailer + 4, static_cast<unsigned long>( input.size() ) );
+
+  return true;
+}
+
+bool DecompressBlock( const BufferType & input, BufferType & output )
+{
+  const unsigned char *trailer = &input[input.size() - GzipTrailerSize];
+  const unsigned long  expectedCrc = GetLittleEndian32( trailer );
+  const unsigned long  uncompressedSize = GetLittleEndian32( trailer + 4 );
+  if( uncompressedSize > ParallelGzipBlockSize )
+    {
+    return false;
+    }
+  output.resize( uncompressedSize );
+
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in = Z_NULL;
+  stream.avail_in = 0;
+  if( inflateInit2( &stream, -MAX_WBITS ) != Z_OK )
+    {
+    return false;
+    }
+
+  // one spare byte so that inflate can report the end of the stream even
+  // for an empty block
+  BufferType spare( 1 );
+  stream.next_in = const_cast<Bytef *>( &input[GzipHeaderSize] );
+  stream.avail_in = static_cast<uInt>( input.size() - GzipHeaderSize - GzipTrailerSize );
+  stream.next_out = output.empty() ? &spare[0] : &output[0];
+  stream.avail_out = static_cast<uInt>( output.empty() ? spare.size() : output.size() );
+
+  const int status = inflate( &stream, Z_FINISH );
+  const uLong decompressedSize = stream.total_out;
+  inflateEnd( &stream );
+  if( status != Z_STREAM_END || decompressedSize != uncompressedSize )
+    {
+    return false;
+    }
+
+  uLong crc = crc32( 0L, Z_NULL, 0 );
+  if( !output.empty() )
+    {
+    crc = crc32( crc, &output[0], static_cast<uInt>( output.size() ) );
+    }
+  return ( crc & 0xffffffffUL ) == expectedCrc;
+}
+
+ITK_THREAD_RETURN_TYPE CompressBlocksThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  BlockThreadStruct *                   str = static_cast<BlockThreadStruct *>( info->UserData );
+
+  bool succeeded = true;
+  for( size_t n = info->ThreadID; n < str->Input->size(); n += info->NumberOfThreads )
+    {
+    succeeded = CompressBlock( ( *str->Input )[n], ( *str->Output )[n], str->CompressionLevel ) && succeeded;
+    }
+  str->Succeeded[info->ThreadID] = succeeded;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+ITK_THREAD_RETURN_TYPE DecompressBlocksThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  BlockThreadStruct *                   str = static_cast<BlockThreadStruct *>( info->UserData );
+
+  bool succeeded = true;
+  for( size_t n = info->ThreadID; n < str->Input->size(); n += info->NumberOfThreads )
+    {
+    succeeded = DecompressBlock( ( *str->Input )[n], ( *str->Output )[n] ) && succeeded;
+    }
+  str->Succeeded[info->ThreadID] = succeeded;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Run the callback on the blocks of str and report whether all succeeded. */
+bool ProcessBlocks( ITK_THREAD_RETURN_TYPE (*callback)( void * ), BlockThreadStruct & str,
+                    unsigned int numberOfThreads )
+{
+  numberOfThreads = GetNumberOfThreads( numberOfThreads, str.Input->size() );
+  str.Succeeded.assign( numberOfThreads, false );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( callback, &str );
+  threader->SingleMethodExecute();
+
+  return std::find( str.Succeeded.begin(), str.Succeeded.end(), false ) == str.Succeeded.end();
+}
+
+// the counter of the temporary file names of the process, shared by the
+// threads that read and write images concurrently
+itk::SimpleFastMutexLock TemporaryFileNameMutex;
+unsigned long            TemporaryFileNameCounter = 0;
+
+unsigned long GetNextTemporaryFileNameCounter()
+{
+  TemporaryFileNameMutex.Lock();
+  const unsigned long counter = TemporaryFileNameCounter++;
+  TemporaryFileNameMutex.Unlock();
+  return counter;
+}
+
+/** Create the empty file fileName, failing if it exists, in one step so that
+ * no other thread or process can create it in between.  errno is EEXIST if
+ * the file was already there. */
+bool CreateFileExclusively( const std::string & fileName )
+{
+#if defined( _WIN32 )
+  const int descriptor = _open( fileName.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE );
+  if( descriptor < 0 )
+    {
+    return false;
+    }
+  _close( descriptor );
+#else
+  const int descriptor = open( fileName.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600 );
+  if( descriptor < 0 )
+    {
+    return false;
+    }
+  close( descriptor );
+#endif
+  return true;
+}
+} // anonymous namespace
+
+bool ParallelGzipCompressFile( const std::string & inputFileName, const std::string & outputFileName,
+                               unsigned int numberOfThreads, int compressionLevel )
+{
+  std::ifstream input( inputFileName.c_str(), std::ios::in | std::ios::binary );
+  std::ofstream output( outputFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !input || !output )
+    {
+    return false;
+    }
+
+  // compress a batch of blocks per thread at a time to bound the memory use
+  const unsigned int numberOfBlocksPerBatch = 4 * GetNumberOfThreads( numberOfThreads, ITK_MAX_THREADS );
+
+  std::vector<BufferType> blocks;
+  std::vector<BufferType> members;
+
+  bool isFirstBatch = true;
+  while( true )
+    {
+    blocks.clear();
+    while( blocks.size() < numberOfBlocksPerBatch )
+      {
+      BufferType block( ParallelGzipBlockSize );
+      input.read( reinterpret_cast<char *>( &block[0] ), block.size() );
+      block.resize( static_cast<size_t>( input.gcount() ) );
+      if( block.empty() )
+        {
+        break;
+        }
+      blocks.push_back( block );
+      }
+    if( blocks.empty() )
+      {
+      if( isFirstBatch )
+        {
+        // an empty file still needs one member
+        blocks.push_back( BufferType() );
+        }
+      else
+        {
+        break;
+        }
+      }
+    isFirstBatch = false;
+
+    members.assign( blocks.size(), BufferType() );
+
+    BlockThreadStruct str;
+    str.Input = &blocks;
+    str.Output = &members;
+    str.CompressionLevel = compressionLevel;
+    if( !ProcessBlocks( CompressBlocksThreaderCallback, str, numberOfThreads ) )
+      {
+      return false;
+      }
+    for( size_t n = 0; n < members.size(); n++ )
+      {
+      output.write( reinterpret_cast<const char *>( &members[n][0] ), members[n].size() );
+      }
+    if( !output )
+      {
+      return false;
+      }
+    if( blocks.back().size() < ParallelGzipBlockSize )
+      {
+      break;
+      }
+    }
+
+  output.close();
+  return !output.fail();
+}
+
+bool IsParallelGzipFile( const std::string & fileName )
+{
+  std::ifstream input( fileName.c_str(), std::ios::in | std::ios::binary );
+  if( !input )
+    {
+    return false;
+    }
+  unsigned char header[GzipHeaderSize];
+  input.read( reinterpret_cast<char *>( header ), GzipHeaderSize );
+  if( input.gcount() != static_cast<std::streamsize>( GzipHeaderSize ) )
+    {
+    return false;
+    }
+  return GetMemberSize( header, 0xffffffffUL ) > 0;
+}
+
+bool ParallelGzipDecompressFile( const std::string & inputFileName, const std::string & outputFileName,
+                                 unsigned int numberOfThreads )
+{
+  std::ifstream input( inputFileName.c_str(), std::ios::in | std::ios::binary );
+  if( !input )
+    {
+    return false;
+    }
+  std::ofstream output( outputFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !output )
+    {
+    return false;
+    }
+
+  const unsigned int numberOfBlocksPerBatch = 4 * GetNumberOfThreads( numberOfThreads, ITK_MAX_THREADS );
+
+  std::vector<BufferType> members;
+  std::vector<BufferType> blocks;
+  while( input.peek() != std::ifstream::traits_type::eof() )
+    {
+    members.clear();
+    while( members.size() < numberOfBlocksPerBatch
+           && input.peek() != std::ifstream::traits_type::eof() )
+      {
+      unsigned char header[GzipHeaderSize];
+      input.read( reinterpret_cast<char *>( header ), GzipHeaderSize );
+      if( input.gcount() != static_cast<std::streamsize>( GzipHeaderSize ) )
+        {
+        return false;
+        }
+      const unsigned long memberSize = GetMemberSize( header, 0xffffffffUL );
+      if( memberSize == 0 )
+        {
+        // not written by ParallelGzipCompressFile
+        return false;
+        }
+      BufferType member( memberSize );
+      std::copy( header, header + GzipHeaderSize, member.begin() );
+      input.read( reinterpret_cast<char *>( &member[GzipHeaderSize] ), memberSize - GzipHeaderSize );
+      if( input.gcount() != static_cast<std::streamsize>( memberSize - GzipHeaderSize ) )
+        {
+        return false;
+        }
+      members.push_back( member );
+      }
+
+    blocks.assign( members.size(), BufferType() );
+
+    BlockThreadStruct str;
+    str.Input = &members;
+    str.Output = &blocks;
+    str.CompressionLevel = 0;
+    if( !ProcessBlocks( DecompressBlocksThreaderCallback, str, numberOfThreads ) )
+      {
+      return false;
+      }
+    for( size_t n = 0; n < blocks.size(); n++ )
+      {
+      if( !blocks[n].empty() )
+        {
+        output.write( reinterpret_cast<const char *>( &blocks[n][0] ), blocks[n].size() );
+        }
+      }
+    if( !output )
+      {
+      return false;
+      }
+    }
+
+  output.close();
+  return !output.fail();
+}
+
+bool UseParallelGzip( const std::string & fileName )
+{
+  const std::string extension( ".nii.gz" );
+  if( fileName.size() <= extension.size()
+      || fileName.compare( fileName.size() - extension.size(), extension.size(), extension ) != 0 )
+    {
+    return false;
+    }
+  const char *value = std::getenv( "ANTS_USE_PARALLEL_GZIP" );
+  return value == NULL || std::string( value ) != "0";
+}
+
+std::string GetTemporaryFileName( const std::string & directory, const std::string & extension )
+{
+  std::string prefix = directory;
+  if( !prefix.empty() && prefix[prefix.size() - 1] != '/' )
+    {
+    prefix += "/";
+    }
+
+  while( true )
+    {
+    std::ostringstream stream;
+    stream << prefix << "antsTemporary" << ANTS_GETPID() << "_" << std::time( ITK_NULLPTR ) << "_"
+           << GetNextTemporaryFileNameCounter() << extension;
+    const std::string fileName = stream.str();
+    if( CreateFileExclusively( fileName ) || errno != EEXIST )
+      {
+      // if the directory is not writable, the caller's write reports it
+      return fileName;
+      }
+    }
+}
+
+std::string DecompressParallelGzipToTemporaryFile( const std::string & fileName )
+{
+  if( !IsParallelGzipFile( fileName ) )
+    {
+    return std::string();
+    }
+
+  std::string directory;
+  if( !itksys::SystemTools::GetEnv( "TMPDIR", directory ) && !itksys::SystemTools::GetEnv( "TEMP", directory ) )
+    {
+#if defined( _WIN32 )
+    directory = ".";
+#else
+    directory = "/tmp";
+#endif
+    }
+
+  const std::string temporaryFileName = GetTemporaryFileName( directory, ".nii" );
+  if( !ParallelGzipDecompressFile( fileName, temporaryFileName ) )
+    {
+    itksys::SystemTools::RemoveFile( temporaryFileName.c_str() );
+    return std::string();
+    }
+  return temporaryFileName;
+}
+} // namespace ants
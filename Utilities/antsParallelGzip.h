@@ -0,0 +1,64 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsParallelGzip_h
+#define __antsParallelGzip_h
+
+#include <string>
+
+namespace ants
+{
+/**
+ * Multi-member gzip files compressed and decompressed on all threads.
+ *
+ * The input is cut into blocks of ParallelGzipBlockSize bytes, and each
+ * block is deflated independently into its own gzip member.  Concatenated
+ * members form a valid gzip file (RFC 1952), which gzip, zlib's gzread
+ * (and hence the ITK image readers) and other standard readers decompress
+ * to the original bytes.  Each member header carries an extra field 'A','N'
+ * holding the size of the member, so that a reader can find the members
+ * without inflating them and decompress them in parallel.
+ *
+ * numberOfThreads = 0 uses the ITK global default number of threads.
+ */
+const unsigned int ParallelGzipBlockSize = 1u << 20;
+
+bool ParallelGzipCompressFile( const std::string & inputFileName, const std::string & outputFileName,
+                               unsigned int numberOfThreads = 0, int compressionLevel = 6 );
+
+/** Whether fileName starts with a member written by ParallelGzipCompressFile. */
+bool IsParallelGzipFile( const std::string & fileName );
+
+/** Returns false if the file is not a multi-member file written by
+ * ParallelGzipCompressFile, or if it is corrupt. */
+bool ParallelGzipDecompressFile( const std::string & inputFileName, const std::string & outputFileName,
+                                 unsigned int numberOfThreads = 0 );
+
+/** Whether WriteImage should write fileName through ParallelGzipCompressFile:
+ * the file is a .nii.gz and the environment variable ANTS_USE_PARALLEL_GZIP
+ * is not set to 0. */
+bool UseParallelGzip( const std::string & fileName );
+
+/** A new, empty file in directory (the current directory if empty), ending
+ * in extension, which the caller overwrites and removes.  The file is
+ * created atomically, so concurrent callers in this or other processes never
+ * get the same name. */
+std::string GetTemporaryFileName( const std::string & directory, const std::string & extension );
+
+/** If fileName was written by ParallelGzipCompressFile, decompress it in
+ * parallel to a temporary .nii file and return its name, which the caller
+ * removes after reading.  Otherwise return an empty string. */
+std::string DecompressParallelGzipToTemporaryFile( const std::string & fileName );
+} // namespace ants
+
+#endif // __antsParallelGzip_h
@@ -0,0 +1,293 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsPermutationTester_h
+#define antsPermutationTester_h
+
+#include "itkMultiThreader.h"
+#include "itkMutexLock.h"
+
+#include <vnl/vnl_random.h>
+#include <vnl/vnl_vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ants
+{
+/** \class PermutationTester
+ *
+ * Runs a permutation test as independent tasks on a pool of threads.  Each
+ * task draws a permutation of the rows (subjects) and calls the statistic
+ * functor with it.  TStatistic must provide
+ *
+ *   vnl_vector<double> operator()( const std::vector<unsigned int> & permutation ) const
+ *
+ * which is called concurrently, so it may only read shared data (e.g. the
+ * data matrices) and must build its own antsSCCANObject.  For every entry of
+ * the returned vector the tester counts the permutations that exceed the
+ * observed value.
+ *
+ * Permutation n is drawn from its own generator seeded with Seed + n, so the
+ * result does not depend on the number of threads or on scheduling.  For the
+ * same reason early stopping is only decided between batches of
+ * BatchSize permutations: it ends the test once the p-values of the first
+ * NumberOfStatisticsForEarlyStopping statistics are all clearly above or
+ * below Alpha (their 99.9% normal confidence intervals exclude it).
+ */
+template <class TStatistic>
+class PermutationTester
+{
+public:
+  typedef TStatistic         StatisticType;
+  typedef vnl_vector<double> VectorType;
+
+  PermutationTester() :
+    m_NumberOfRows( 0 ),
+    m_NumberOfPermutations( 0 ),
+    m_NumberOfThreads( 1 ),
+    m_Seed( 1 ),
+    m_EarlyStopping( false ),
+    m_Alpha( 0.05 ),
+    m_MinimumNumberOfPermutations( 100 ),
+    m_NumberOfStatisticsForEarlyStopping( 0 ),
+    m_BatchSize( 50 ),
+    m_NumberOfPermutationsRun( 0 ),
+    m_Statistic( ITK_NULLPTR ),
+    m_NextPermutation( 0 ),
+    m_BatchEnd( 0 )
+  {
+    this->m_Threader = itk::MultiThreader::New();
+  }
+
+  /** Number of rows (subjects) of the permuted matrices. */
+  void SetNumberOfRows( unsigned int n )
+  {
+    this->m_NumberOfRows = n;
+  }
+
+  /** Maximum number of permutations. */
+  void SetNumberOfPermutations( unsigned long n )
+  {
+    this->m_NumberOfPermutations = n;
+  }
+
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  void SetSeed( unsigned long seed )
+  {
+    this->m_Seed = seed;
+  }
+
+  /** The statistics of the unpermuted data. */
+  void SetObservedStatistics( const VectorType & observed )
+  {
+    this->m_ObservedStatistics = observed;
+  }
+
+  /** Stop once the p-values of the first \c numberOfStatistics statistics
+   * (0: all) are settled with respect to alpha, but never before
+   * minimumNumberOfPermutations. */
+  void SetEarlyStopping( bool stop, double alpha = 0.05, unsigned long minimumNumberOfPermutations = 100,
+                         unsigned int numberOfStatistics = 0 )
+  {
+    this->m_EarlyStopping = stop;
+    this->m_Alpha = alpha;
+    this->m_MinimumNumberOfPermutations = minimumNumberOfPermutations;
+    this->m_NumberOfStatisticsForEarlyStopping = numberOfStatistics;
+  }
+
+  void SetBatchSize( unsigned long n )
+  {
+    this->m_BatchSize = std::max( n, 1UL );
+  }
+
+  /** Draw permutation n.  Public so that callers can reproduce a single
+   * permutation of a run. */
+  std::vector<unsigned int> GetPermutation( unsigned long n ) const
+  {
+    std::vector<unsigned int> permutation( this->m_NumberOfRows );
+    for( unsigned int i = 0; i < this->m_NumberOfRows; i++ )
+      {
+      permutation[i] = i;
+      }
+    vnl_random randgen( this->m_Seed + n );
+    for( unsigned int i = this->m_NumberOfRows; i > 1; i-- )
+      {
+      const unsigned int j = static_cast<unsigned int>( randgen.lrand32( 0, i - 1 ) );
+      std::swap( permutation[i - 1], permutation[j] );
+      }
+    return permutation;
+  }
+
+  void Run( const StatisticType & statistic )
+  {
+    this->m_Statistic = &statistic;
+    this->m_ExceedanceCounts.assign( this->m_ObservedStatistics.size(), 0 );
+    this->m_NumberOfPermutationsRun = 0;
+    this->m_NextPermutation = 0;
+
+    unsigned int numberOfThreads = std::max( this->m_NumberOfThreads, 1u );
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    this->m_Threader->SetNumberOfThreads( numberOfThreads );
+
+    while( this->m_NextPermutation < this->m_NumberOfPermutations )
+      {
+      this->m_BatchEnd = this->m_NumberOfPermutations;
+      if( this->m_EarlyStopping )
+        {
+        this->m_BatchEnd = std::min( this->m_NextPermutation + this->m_BatchSize, this->m_NumberOfPermutations );
+        }
+      if( numberOfThreads > 1 )
+        {
+        this->m_Threader->SetSingleMethod( Self::ThreaderCallback, this );
+        this->m_Threader->SingleMethodExecute();
+        }
+      else
+        {
+        this->RunPermutations();
+        }
+      this->m_NumberOfPermutationsRun = this->m_BatchEnd;
+      if( this->m_EarlyStopping && this->IsSettled() )
+        {
+        break;
+        }
+      }
+    this->m_Statistic = ITK_NULLPTR;
+  }
+
+  unsigned long GetNumberOfPermutationsRun() const
+  {
+    return this->m_NumberOfPermutationsRun;
+  }
+
+  /** Number of permutations whose statistic exceeded the observed one. */
+  const std::vector<unsigned long> & GetExceedanceCounts() const
+  {
+    return this->m_ExceedanceCounts;
+  }
+
+  /** Fraction of the permutations run that exceeded the observed statistic. */
+  VectorType GetPValues() const
+  {
+    VectorType pvalues( this->m_ExceedanceCounts.size(), 0 );
+    for( unsigned int k = 0; k < pvalues.size() && this->m_NumberOfPermutationsRun > 0; k++ )
+      {
+      pvalues[k] = static_cast<double>( this->m_ExceedanceCounts[k] )
+        / static_cast<double>( this->m_NumberOfPermutationsRun );
+      }
+    return pvalues;
+  }
+
+private:
+  typedef PermutationTester Self;
+
+  PermutationTester( const Self & ); // purposely not implemented
+  void operator=( const Self & );    // purposely not implemented
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    static_cast<Self *>( info->UserData )->RunPermutations();
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** Take permutations of the current batch until none are left. */
+  void RunPermutations()
+  {
+    std::vector<unsigned long> counts( this->m_ExceedanceCounts.size(), 0 );
+    while( true )
+      {
+      this->m_Mutex.Lock();
+      const unsigned long n = this->m_NextPermutation;
+      if( n < this->m_BatchEnd )
+        {
+        this->m_NextPermutation++;
+        }
+      this->m_Mutex.Unlock();
+      if( n >= this->m_BatchEnd )
+        {
+        break;
+        }
+
+      const VectorType statistics = ( *this->m_Statistic )( this->GetPermutation( n ) );
+      for( unsigned int k = 0; k < counts.size() && k < statistics.size(); k++ )
+        {
+        if( statistics[k] > this->m_ObservedStatistics[k] )
+          {
+          counts[k]++;
+          }
+        }
+      }
+
+    this->m_Mutex.Lock();
+    for( unsigned int k = 0; k < counts.size(); k++ )
+      {
+      this->m_ExceedanceCounts[k] += counts[k];
+      }
+    this->m_Mutex.Unlock();
+  }
+
+  bool IsSettled() const
+  {
+    const double n = static_cast<double>( this->m_NumberOfPermutationsRun );
+    if( this->m_NumberOfPermutationsRun < this->m_MinimumNumberOfPermutations )
+      {
+      return false;
+      }
+    unsigned int numberOfStatistics = this->m_ExceedanceCounts.size();
+    if( this->m_NumberOfStatisticsForEarlyStopping > 0 )
+      {
+      numberOfStatistics = std::min( numberOfStatistics, this->m_NumberOfStatisticsForEarlyStopping );
+      }
+    for( unsigned int k = 0; k < numberOfStatistics; k++ )
+      {
+      // shrunk estimate so that zero counts still have a nonzero spread
+      const double p = ( static_cast<double>( this->m_ExceedanceCounts[k] ) + 1.0 ) / ( n + 1.0 );
+      if( std::fabs( p - this->m_Alpha ) <= 3.29 * std::sqrt( p * ( 1.0 - p ) / n ) )
+        {
+        return false;
+        }
+      }
+    return true;
+  }
+
+  unsigned int  m_NumberOfRows;
+  unsigned long m_NumberOfPermutations;
+  unsigned int  m_NumberOfThreads;
+  unsigned long m_Seed;
+  VectorType    m_ObservedStatistics;
+
+  bool          m_EarlyStopping;
+  double        m_Alpha;
+  unsigned long m_MinimumNumberOfPermutations;
+  unsigned int  m_NumberOfStatisticsForEarlyStopping;
+  unsigned long m_BatchSize;
+
+  std::vector<unsigned long> m_ExceedanceCounts;
+  unsigned long              m_NumberOfPermutationsRun;
+
+  const StatisticType *m_Statistic;
+  unsigned long        m_NextPermutation;
+  unsigned long        m_BatchEnd;
+
+  itk::MultiThreader::Pointer m_Threader;
+  itk::SimpleMutexLock        m_Mutex;
+};
+} // namespace ants
+
+#endif // antsPermutationTester_h
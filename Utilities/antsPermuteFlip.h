@@ -0,0 +1,190 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsPermuteFlip_h
+#define antsPermuteFlip_h
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+
+namespace ants
+{
+/** The voxels of itk::PermuteAxesImageFilter followed by itk::FlipImageFilter
+ * in one pass:  output axis j is input axis order[j], reversed if flip[j].
+ * The flips are folded into the signed input strides of the output axes, so
+ * the output is written in buffer order while the input is read along them.
+ *
+ * When the fastest input axis is not the fastest output axis, the copy is a
+ * transpose, done in BlockSize x BlockSize tiles of the two axes so that the
+ * input lines of a tile stay in cache while it is written.  The tiles (or,
+ * without a transpose, the lines) are divided among the threads.
+ *
+ * Only the buffers are touched:  the output must already be allocated with
+ * the permuted size, and its spacing, origin and direction are left to the
+ * caller.
+ */
+class PermuteFlip
+{
+public:
+  enum { BlockSize = 64 };
+
+  template <class TImage>
+  static void Apply( const TImage *input, const unsigned int order[], const bool flip[], TImage *output )
+  {
+    const unsigned int ImageDimension = TImage::ImageDimension;
+
+    ThreadStruct<TImage> str;
+    str.Input = input->GetBufferPointer();
+    str.Output = output->GetBufferPointer();
+
+    itk::OffsetValueType inputStrides[ImageDimension];
+    itk::OffsetValueType inputStride = 1;
+    itk::OffsetValueType outputStride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      inputStrides[d] = inputStride;
+      inputStride *= static_cast<itk::OffsetValueType>( input->GetBufferedRegion().GetSize()[d] );
+      str.Size[d] = output->GetBufferedRegion().GetSize()[d];
+      str.OutputStrides[d] = outputStride;
+      outputStride *= str.Size[d];
+      }
+
+    str.InputBase = 0;
+    str.TransposeAxis = 0;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      str.InputStrides[j] = inputStrides[order[j]];
+      if( flip[j] )
+        {
+        str.InputBase += static_cast<itk::OffsetValueType>( str.Size[j] - 1 ) * str.InputStrides[j];
+        str.InputStrides[j] = -str.InputStrides[j];
+        }
+      if( order[j] == 0 )
+        {
+        str.TransposeAxis = j;
+        }
+      }
+
+    // the units:  the tiles of axes 0 and TransposeAxis, or the lines of
+    // axis 0 if the fastest axis is not moved, for every index of the others
+    str.NumberOfTiles0 = ( str.Size[0] + BlockSize - 1 ) / BlockSize;
+    str.NumberOfTilesTranspose = ( str.TransposeAxis > 0 ) ?
+      ( str.Size[str.TransposeAxis] + BlockSize - 1 ) / BlockSize : 1;
+    str.NumberOfUnits = ( str.TransposeAxis > 0 ) ? str.NumberOfTiles0 * str.NumberOfTilesTranspose : 1;
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      if( j != str.TransposeAxis )
+        {
+        str.NumberOfUnits *= str.Size[j];
+        }
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfUnits ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    threader->SetSingleMethod( ApplyThreaderCallback<TImage>, &str );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  PermuteFlip();
+
+  template <class TImage>
+  struct ThreadStruct
+    {
+    typedef typename TImage::PixelType PixelType;
+
+    const PixelType *    Input;
+    PixelType *          Output;
+    itk::SizeValueType   Size[TImage::ImageDimension];
+    itk::OffsetValueType OutputStrides[TImage::ImageDimension];
+    itk::OffsetValueType InputStrides[TImage::ImageDimension];
+    itk::OffsetValueType InputBase;
+    unsigned int         TransposeAxis;
+    itk::SizeValueType   NumberOfTiles0;
+    itk::SizeValueType   NumberOfTilesTranspose;
+    itk::SizeValueType   NumberOfUnits;
+    };
+
+  template <class TImage>
+  static ITK_THREAD_RETURN_TYPE ApplyThreaderCallback( void *arg )
+  {
+    const unsigned int ImageDimension = TImage::ImageDimension;
+    typedef typename TImage::PixelType PixelType;
+
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct<TImage> *                str = static_cast<ThreadStruct<TImage> *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfUnits * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfUnits * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    const unsigned int         transposeAxis = str->TransposeAxis;
+    const itk::OffsetValueType inputStride0 = str->InputStrides[0];
+    for( itk::SizeValueType unit = first; unit < last; unit++ )
+      {
+      itk::SizeValueType remainder = unit;
+
+      itk::SizeValueType begin0 = 0;
+      itk::SizeValueType end0 = str->Size[0];
+      itk::SizeValueType beginTranspose = 0;
+      itk::SizeValueType endTranspose = 1;
+      if( transposeAxis > 0 )
+        {
+        begin0 = ( remainder % str->NumberOfTiles0 ) * BlockSize;
+        end0 = std::min( begin0 + BlockSize, str->Size[0] );
+        remainder /= str->NumberOfTiles0;
+        beginTranspose = ( remainder % str->NumberOfTilesTranspose ) * BlockSize;
+        endTranspose = std::min( beginTranspose + BlockSize, str->Size[transposeAxis] );
+        remainder /= str->NumberOfTilesTranspose;
+        }
+
+      // the offsets of the corner of the unit
+      itk::OffsetValueType outputOffset = begin0;
+      itk::OffsetValueType inputOffset = str->InputBase + static_cast<itk::OffsetValueType>( begin0 ) * inputStride0;
+      for( unsigned int j = 1; j < ImageDimension; j++ )
+        {
+        itk::SizeValueType index = beginTranspose;
+        if( j != transposeAxis )
+          {
+          index = remainder % str->Size[j];
+          remainder /= str->Size[j];
+          }
+        outputOffset += static_cast<itk::OffsetValueType>( index ) * str->OutputStrides[j];
+        inputOffset += static_cast<itk::OffsetValueType>( index ) * str->InputStrides[j];
+        }
+
+      const itk::SizeValueType   length0 = end0 - begin0;
+      const itk::OffsetValueType outputStrideTranspose = str->OutputStrides[transposeAxis];
+      const itk::OffsetValueType inputStrideTranspose = str->InputStrides[transposeAxis];
+      for( itk::SizeValueType k = beginTranspose; k < endTranspose; k++ )
+        {
+        PixelType *       out = str->Output + outputOffset;
+        const PixelType * in = str->Input + inputOffset;
+        for( itk::SizeValueType i = 0; i < length0; i++ )
+          {
+          out[i] = *in;
+          in += inputStride0;
+          }
+        outputOffset += outputStrideTranspose;
+        inputOffset += inputStrideTranspose;
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif // antsPermuteFlip_h
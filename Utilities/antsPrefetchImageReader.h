@@ -0,0 +1,262 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsPrefetchImageReader_h
+#define antsPrefetchImageReader_h
+
+#include "ReadWriteData.h"
+
+#include "itkConditionVariable.h"
+#include "itkMultiThreader.h"
+#include "itkMutexLock.h"
+#include "itkTimeProbe.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/** \class PrefetchImageReader
+ *
+ * Reads a list of image files on a small pool of threads while the caller
+ * consumes them in order with GetNextImage().  At most QueueSize images
+ * are read ahead of the consumer (back-pressure) so that the number of
+ * images held by the reader stays bounded.  The time spent reading each
+ * file and the time the consumer spent waiting are recorded.
+ */
+template <class TImage>
+class PrefetchImageReader
+{
+public:
+  typedef TImage                       ImageType;
+  typedef typename ImageType::Pointer  ImagePointer;
+
+  PrefetchImageReader() :
+    m_NumberOfThreads( 1 ),
+    m_QueueSize( 2 ),
+    m_NextFileToRead( 0 ),
+    m_NextImageToConsume( 0 ),
+    m_NumberOfActiveThreads( 0 ),
+    m_Abort( false ),
+    m_WaitTime( 0.0 )
+  {
+    this->m_Threader = itk::MultiThreader::New();
+    this->m_Condition = itk::ConditionVariable::New();
+  }
+
+  ~PrefetchImageReader()
+  {
+    this->Stop();
+  }
+
+  void SetFileNames( const std::vector<std::string> & fileNames )
+  {
+    this->m_FileNames = fileNames;
+  }
+
+  /** Number of reader threads.  Clamped to [1, number of files]. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  /** Maximum number of images read ahead of the consumer. */
+  void SetQueueSize( unsigned int n )
+  {
+    this->m_QueueSize = n;
+  }
+
+  /** Spawn the reader threads. */
+  void Start()
+  {
+    const unsigned int numberOfFiles = this->m_FileNames.size();
+
+    this->m_Images.assign( numberOfFiles, ImagePointer() );
+    this->m_IsRead.assign( numberOfFiles, false );
+    this->m_ReadTimes.assign( numberOfFiles, 0.0 );
+    this->m_NextFileToRead = 0;
+    this->m_NextImageToConsume = 0;
+    this->m_Abort = false;
+    this->m_WaitTime = 0.0;
+
+    if( this->m_QueueSize < 1 )
+      {
+      this->m_QueueSize = 1;
+      }
+
+    unsigned int numberOfThreads = std::min( this->m_NumberOfThreads, numberOfFiles );
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    numberOfThreads = std::max( numberOfThreads, 1u );
+
+    this->m_ThreadIds.clear();
+    for( unsigned int n = 0; n < numberOfThreads && numberOfFiles > 0; n++ )
+      {
+      this->m_ThreadIds.push_back( this->m_Threader->SpawnThread( Self::ReaderThreadCallback, this ) );
+      }
+    this->m_NumberOfActiveThreads = this->m_ThreadIds.size();
+  }
+
+  /** Block until the next image (in file order) is available and return it.
+   * A null pointer is returned if the file could not be read. */
+  ImagePointer GetNextImage()
+  {
+    itk::TimeProbe waitTimer;
+    waitTimer.Start();
+
+    this->m_Mutex.Lock();
+    const unsigned int index = this->m_NextImageToConsume;
+    if( index >= this->m_Images.size() )
+      {
+      this->m_Mutex.Unlock();
+      return ITK_NULLPTR;
+      }
+    while( !this->m_IsRead[index] )
+      {
+      this->m_Condition->Wait( &this->m_Mutex );
+      }
+    ImagePointer image = this->m_Images[index];
+    this->m_Images[index] = ITK_NULLPTR;
+    this->m_NextImageToConsume++;
+    this->m_Condition->Broadcast();
+    this->m_Mutex.Unlock();
+
+    waitTimer.Stop();
+    this->m_WaitTime += waitTimer.GetTotal();
+
+    return image;
+  }
+
+  /** Stop reading and join the threads. */
+  void Stop()
+  {
+    this->m_Mutex.Lock();
+    this->m_Abort = true;
+    this->m_Condition->Broadcast();
+    this->m_Mutex.Unlock();
+
+    for( unsigned int n = 0; n < this->m_ThreadIds.size(); n++ )
+      {
+      this->m_Threader->TerminateThread( this->m_ThreadIds[n] );
+      }
+    this->m_ThreadIds.clear();
+    this->m_Images.clear();
+  }
+
+  /** Wall time (in seconds) spent reading the given file. */
+  double GetReadTime( unsigned int n ) const
+  {
+    return this->m_ReadTimes[n];
+  }
+
+  /** Sum of the read times of all files. */
+  double GetTotalReadTime() const
+  {
+    double total = 0.0;
+    for( unsigned int n = 0; n < this->m_ReadTimes.size(); n++ )
+      {
+      total += this->m_ReadTimes[n];
+      }
+    return total;
+  }
+
+  /** Time the consumer spent blocked in GetNextImage(). */
+  double GetWaitTime() const
+  {
+    return this->m_WaitTime;
+  }
+
+  unsigned int GetNumberOfThreadsUsed() const
+  {
+    return this->m_NumberOfActiveThreads;
+  }
+
+private:
+  typedef PrefetchImageReader Self;
+
+  PrefetchImageReader( const Self & ); // purposely not implemented
+  void operator=( const Self & );      // purposely not implemented
+
+  static ITK_THREAD_RETURN_TYPE ReaderThreadCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    Self *                                self = static_cast<Self *>( info->UserData );
+
+    self->ReadFiles();
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void ReadFiles()
+  {
+    const unsigned int numberOfFiles = this->m_FileNames.size();
+
+    this->m_Mutex.Lock();
+    while( true )
+      {
+      // back-pressure:  do not run further than QueueSize images ahead of the consumer
+      while( !this->m_Abort && this->m_NextFileToRead < numberOfFiles &&
+             this->m_NextFileToRead >= this->m_NextImageToConsume + this->m_QueueSize )
+        {
+        this->m_Condition->Wait( &this->m_Mutex );
+        }
+      if( this->m_Abort || this->m_NextFileToRead >= numberOfFiles )
+        {
+        break;
+        }
+      const unsigned int index = this->m_NextFileToRead++;
+      this->m_Mutex.Unlock();
+
+      itk::TimeProbe readTimer;
+      readTimer.Start();
+      ImagePointer image = ITK_NULLPTR;
+      if( ReadImage<ImageType>( image, this->m_FileNames[index].c_str() ) )
+        {
+        image->DisconnectPipeline();
+        }
+      else
+        {
+        image = ITK_NULLPTR;
+        }
+      readTimer.Stop();
+
+      this->m_Mutex.Lock();
+      this->m_Images[index] = image;
+      this->m_IsRead[index] = true;
+      this->m_ReadTimes[index] = readTimer.GetTotal();
+      this->m_Condition->Broadcast();
+      }
+    this->m_Mutex.Unlock();
+  }
+
+  std::vector<std::string>  m_FileNames;
+  std::vector<ImagePointer> m_Images;
+  std::vector<bool>         m_IsRead;
+  std::vector<double>       m_ReadTimes;
+
+  unsigned int m_NumberOfThreads;
+  unsigned int m_QueueSize;
+  unsigned int m_NextFileToRead;
+  unsigned int m_NextImageToConsume;
+  unsigned int m_NumberOfActiveThreads;
+  bool         m_Abort;
+  double       m_WaitTime;
+
+  itk::MultiThreader::Pointer       m_Threader;
+  std::vector<itk::ThreadIdType>    m_ThreadIds;
+  itk::SimpleMutexLock              m_Mutex;
+  itk::ConditionVariable::Pointer   m_Condition;
+};
+} // namespace ants
+
+#endif
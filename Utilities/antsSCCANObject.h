@@ -23,6 +23,9 @@
 #include <vnl/algo/vnl_matrix_inverse.h>
 #include <vnl/algo/vnl_cholesky.h>
 #include "itkImageToImageFilter.h"
+#include "itkMultiThreader.h"
+#include "antsBlas.h"
+#include <algorithm>
 /** Custom SCCA implemented with vnl and ITK: Flexible positivity constraints, image ops, permutation testing, etc. */
 namespace itk
 {
@@ -107,6 +110,17 @@ public:
   itkSetMacro( Smoother, RealType );
   itkGetMacro( Smoother, RealType );
 
+  /** Compute the leading eigenvectors of the initializations with a
+   * randomized range finder instead of the full decomposition of P P^T.  Only
+   * used when the number of eigenvectors is known and small. */
+  itkSetMacro( UseRandomizedSVD, bool );
+  itkGetConstMacro( UseRandomizedSVD, bool );
+  itkBooleanMacro( UseRandomizedSVD );
+  itkSetMacro( RandomizedSVDPowerIterations, unsigned int );
+  itkGetConstMacro( RandomizedSVDPowerIterations, unsigned int );
+  itkSetMacro( RandomizedSVDOversampling, unsigned int );
+  itkGetConstMacro( RandomizedSVDOversampling, unsigned int );
+
   void NormalizeWeights(const unsigned int k );
 
   void NormalizeWeightsByCovariance(const unsigned int k, const TRealType taup = 0, const TRealType tauq = 0);
@@ -136,6 +150,33 @@ public:
       }
   }
 
+  /** Multithreaded products with the data matrices.  These never form the
+   * transpose of their arguments, which for subjects x voxels matrices is
+   * as large as the matrix itself.  Zero entries of the vector argument are
+   * skipped, so sparse variates are cheaper to project. */
+  VectorType MatrixVectorProduct( const MatrixType & A, const VectorType & x );
+
+  /** A^T x, i.e. x * A */
+  VectorType MatrixTransposeVectorProduct( const MatrixType & A, const VectorType & x );
+
+  /** A^T ( A x ) */
+  VectorType NormalMatrixVectorProduct( const MatrixType & A, const VectorType & x )
+  {
+    return this->MatrixTransposeVectorProduct( A, this->MatrixVectorProduct( A, x ) );
+  }
+
+  /** A B^T, e.g. the rows x rows covariance P P^T */
+  MatrixType MatrixMatrixTransposeProduct( const MatrixType & A, const MatrixType & B );
+
+  /** A^T B, e.g. the variates P^T U */
+  MatrixType MatrixTransposeMatrixProduct( const MatrixType & A, const MatrixType & B );
+
+  /** The k leading left singular vectors and singular values of A from a
+   * randomized range finder (Halko, Martinsson and Tropp, 2011) with the
+   * oversampling and power iterations of this object.  A is only touched
+   * through the products above, so it is never transposed or squared. */
+  void RandomizedSVD( const MatrixType & A, unsigned int k, MatrixType & U, VectorType & singularValues );
+
   void DeleteRow( MatrixType &, unsigned int );
 
   void PosNegVector( VectorType& v1, bool pos  )
@@ -429,16 +470,20 @@ public:
   {
     if( p.rows() < p.columns() )
       {
-      MatrixType invcov = p * p.transpose();
-      invcov.set_identity();
-      invcov = invcov * regularization + p * p.transpose();
+      MatrixType invcov = this->MatrixMatrixTransposeProduct( p, p );
+      for( unsigned int i = 0; i < invcov.rows(); i++ )
+        {
+        invcov( i, i ) += regularization;
+        }
       return invcov;
       }
     else
       {
-      MatrixType invcov = p.transpose() * p;
-      invcov.set_identity();
-      invcov = invcov * regularization + p.transpose() * p;
+      MatrixType invcov = this->MatrixTransposeMatrixProduct( p, p );
+      for( unsigned int i = 0; i < invcov.rows(); i++ )
+        {
+        invcov( i, i ) += regularization;
+        }
       return invcov;
       }
   }
@@ -490,7 +535,23 @@ public:
     bool armadillo = false;
 
     b = this->NormalizeMatrix( b );
-    MatrixType mat = b * b.transpose();
+    if( !armadillo && b.cols() < b.rows() )
+      {
+      // b has low rank, e.g. the nuisance and top variates in whitening:
+      // ( r I + b b^T )^-1 = ( I - b ( r I + b^T b )^-1 b^T ) / r
+      MatrixType small = this->MatrixTransposeMatrixProduct( b, b );
+      for( unsigned int i = 0; i < small.rows(); i++ )
+        {
+        small( i, i ) += regularization;
+        }
+      MatrixType proj = this->MatrixMatrixTransposeProduct( b * vnl_svd<double>( small ).inverse(), b ) * ( -1.0 );
+      for( unsigned int i = 0; i < proj.rows(); i++ )
+        {
+        proj( i, i ) += 1.0;
+        }
+      return proj / regularization;
+      }
+    MatrixType mat = this->MatrixMatrixTransposeProduct( b, b );
     if( !armadillo )
       {
       MatrixType cov( mat.rows(), mat.cols(), 0);
@@ -702,8 +763,17 @@ public:
 
   RealType LASSO( unsigned int nvecs );
 
+  /** Coordinate descent for  0.5 | y - X beta |^2 + gamma | beta |_1  with an
+   * unpenalized intercept, warm-started from beta.  its bounds the number of
+   * coordinate sweeps. */
   void LASSO_alg( MatrixType & X,  VectorType & y, VectorType & beta, RealType gamma, unsigned int its );
 
+  /** Pathwise coordinate descent ( Friedman et al. 2007 ): solve the lasso on a
+   * geometric sequence of pathLength penalties from the smallest one that
+   * zeroes beta down to gamma, warm-starting each solve from the previous one. */
+  void LASSO_Path( MatrixType & X,  VectorType & y, VectorType & beta, RealType gamma, unsigned int its,
+                   unsigned int pathLength = 20 );
+
   inline RealType LASSOSoft( RealType beta, RealType gamma )
   {
     if( beta > 0 && gamma < beta )
@@ -745,7 +815,14 @@ public:
     return corr * sdy / sdyp;
   }
 
-  MatrixType GetCovMatEigenvectors( MatrixType p );
+  /** A new object with the parameters (sparseness, penalties, priors,
+   * iterations, ...) of this one but no data matrices, masks or results.
+   * Used to run permutations as independent tasks. */
+  Pointer CloneSettings() const;
+
+  /** Eigenvectors of p p^T.  When numberOfEigenvectors > 0 only that many are
+   * needed, which allows the randomized decomposition. */
+  MatrixType GetCovMatEigenvectors( MatrixType p, unsigned int numberOfEigenvectors = 0 );
 
   void MRFFilterVariateMatrix();
 
@@ -859,15 +936,17 @@ protected:
       }
     RealType initmax = x_k1.max_value();
     x_k1 = x_k1 / initmax;
-    std::vector<RealType> x_k1sort( x_k1.size() , 0 );
-    for ( unsigned long j = 0; j < x_k1.size(); ++j ) x_k1sort[j] = ( x_k1(j) );
-    sort(x_k1sort.begin(), x_k1sort.end() , std::less<RealType>() );
-    //    std::cout << "Sorted " << x_k1sort[1] << " " << x_k1sort[x_k1.size()-1] << std::endl;
     RealType     low  = 0;
     RealType maxj = static_cast<RealType>(  x_k1.size() );
     unsigned long maxjind = static_cast<unsigned long>( (1-fnp*0.5) * maxj + 0.5 );
     unsigned long minjind = static_cast<unsigned long>( (  fnp*0.5) * maxj + 0.5 );
     if ( maxjind > ( maxj - 1 ) ) maxjind = ( maxj - 1 );
+    if ( minjind > maxjind ) minjind = maxjind;
+    // only two order statistics are needed, so select them instead of
+    // sorting:  the second selection is in the part below the first one
+    std::vector<RealType> x_k1sort( x_k1.begin(), x_k1.end() );
+    std::nth_element( x_k1sort.begin(), x_k1sort.begin() + maxjind, x_k1sort.end() );
+    std::nth_element( x_k1sort.begin(), x_k1sort.begin() + minjind, x_k1sort.begin() + maxjind );
     RealType  maxval = x_k1sort[ maxjind ];
     RealType  minval = x_k1sort[ minjind ];
     RealType    high = maxval;
@@ -1207,6 +1286,60 @@ protected:
 
 private:
 
+  enum MatrixProductType { MatrixVector, MatrixTransposeVector, MatrixMatrixTranspose, MatrixTransposeMatrix };
+
+  struct MatrixProductThreadStruct
+    {
+    MatrixProductType  Product;
+    const MatrixType * A;
+    const MatrixType * B;
+    const RealType *   X;
+    const unsigned int *NonZeroIndices;
+    unsigned int       NumberOfNonZeroIndices;
+    RealType *         Y;
+    };
+
+  /** Run the product on the threads of this object.  Small products are computed
+   * on the calling thread. */
+  void ComputeMatrixProduct( MatrixProductThreadStruct & str, unsigned long numberOfOperations );
+
+  static ITK_THREAD_RETURN_TYPE MatrixProductThreaderCallback( void *arg );
+
+  /** State of the lasso coordinate descent.  Correlation holds Xc^T ( yc - Xc beta )
+   * for the centered Xc and yc and is kept current with the columns of Xc^T Xc
+   * ( covariance updates ), which are computed when a variable first becomes
+   * non-zero. */
+  struct LASSOState
+    {
+    MatrixType *              X;
+    VectorType                Mean;
+    VectorType                SquaredNorm;
+    VectorType                Correlation;
+    RealType                  Tolerance;
+    std::vector<VectorType>   Gram;
+    std::vector<long>         GramIndex;
+    };
+
+  void InitializeLASSO( LASSOState & state, MatrixType & X, const VectorType & y, const VectorType & beta );
+
+  const VectorType & GetLASSOGramColumn( LASSOState & state, unsigned int j );
+
+  /** Solve at gamma with the sequential strong rule from previousGamma ( the
+   * penalty of the warm start, or 0 for none ) and active set cycling.  The
+   * screened variables are checked against the KKT conditions at the end. */
+  void LASSOCoordinateDescent( LASSOState & state, VectorType & beta, RealType gamma, RealType previousGamma,
+                               unsigned int maxits );
+
+  RealType LASSOSweep( LASSOState & state, VectorType & beta, RealType gamma,
+                       const std::vector<unsigned int> & coordinates );
+
+  static void ComputeMatrixProductBlock( const MatrixProductThreadStruct & str,
+                                         unsigned int threadId, unsigned int numberOfThreads );
+
+  /** Modified Gram-Schmidt on the rows of A.  Rows that are (numerically) in
+   * the span of the previous ones are zeroed. */
+  static void OrthonormalizeRows( MatrixType & A );
+
   ImagePointer ConvertVariateToSpatialImage4D( VectorType variate, ImagePointer mask, bool threshold_at_zero = false );
 
   MatrixType m_OriginalMatrixPriorROI;
@@ -1215,6 +1348,22 @@ private:
   VectorType ClusterThresholdVariate( VectorType &, ImagePointer mask, unsigned int);
   VectorType ClusterThresholdVariate4D( VectorType &, ImagePointer mask, unsigned int);
 
+  /** Cache the face-neighbour graph of the mask voxels, numbered in variate
+   * order ( the first time slice of the mask for 4D images ).  The graph is
+   * rebuilt only when the mask changes. */
+  void UpdateClusterGraph( ImagePointer mask );
+
+  /** Union-find over the variate entries, used to label the clusters. */
+  static unsigned long FindCluster( std::vector<unsigned long> & parent, unsigned long n );
+
+  static void MergeClusters( std::vector<unsigned long> & parent, std::vector<unsigned long> & clustersize,
+                             unsigned long a, unsigned long b );
+
+  const ImageType *          m_ClusterGraphMask;
+  ModifiedTimeType           m_ClusterGraphMaskMTime;
+  std::vector<unsigned long> m_ClusterGraphOffsets;
+  std::vector<unsigned long> m_ClusterGraphNeighbors;
+
   bool       m_Debug;
   bool       m_Silent;
   MatrixType m_OriginalMatrixP;
@@ -1232,6 +1381,9 @@ private:
 
   SCCANFormulationType m_SCCANFormulation;
   RealType             m_PinvTolerance;
+  bool                 m_UseRandomizedSVD;
+  unsigned int         m_RandomizedSVDPowerIterations;
+  unsigned int         m_RandomizedSVDOversampling;
   RealType             m_PercentVarianceForPseudoInverse;
   RealType             m_Epsilon; /** used to prevent div by zero */
 
@@ -14,13 +14,13 @@
 
 =========================================================================*/
 #include "itkMinimumMaximumImageFilter.h"
-#include "itkConnectedComponentImageFilter.h"
-#include "itkRelabelComponentImageFilter.h"
 #include "itkExtractImageFilter.h"
 #include <vnl/vnl_random.h>
+#include <algorithm>
 #include <vnl/vnl_trace.h>
 #include <vnl/algo/vnl_ldl_cholesky.h>
 #include <vnl/algo/vnl_qr.h>
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
 #include <vnl/algo/vnl_matrix_inverse.h>
 #include <vnl/algo/vnl_generalized_eigensystem.h>
 #include "antsSCCANObject.h"
@@ -48,12 +48,17 @@ antsSCCANObject<TInputImage, TRealType>::antsSCCANObject()
   this->m_MinClusterSizeP = 1;
   this->m_MinClusterSizeQ = 1;
   this->m_KeptClusterSize = 0;
+  this->m_ClusterGraphMask = ITK_NULLPTR;
+  this->m_ClusterGraphMaskMTime = 0;
   this->m_Debug = false;
   this->m_Silent = true;
   this->m_CorrelationForSignificanceTest = 0;
   this->m_SpecializationForHBM2011 = false;
   this->m_AlreadyWhitened = false;
   this->m_PinvTolerance = 1.e-6;
+  this->m_UseRandomizedSVD = false;
+  this->m_RandomizedSVDPowerIterations = 2;
+  this->m_RandomizedSVDOversampling = 10;
   this->m_PercentVarianceForPseudoInverse = 0.9;
   this->m_MaximumNumberOfIterations = 20;
   this->m_MaskImageP = ITK_NULLPTR;
@@ -76,6 +81,479 @@ antsSCCANObject<TInputImage, TRealType>::antsSCCANObject()
   this->m_PriorWeight = 0;
 }
 
+template <class TInputImage, class TRealType>
+typename antsSCCANObject<TInputImage, TRealType>::VectorType
+antsSCCANObject<TInputImage, TRealType>
+::MatrixVectorProduct( const MatrixType & A, const VectorType & x )
+{
+  if( A.cols() != x.size() )
+    {
+    itkExceptionMacro( "Matrix and vector sizes do not match:  " << A.rows() << "x" << A.cols()
+                       << " * " << x.size() );
+    }
+  VectorType y( A.rows(), 0 );
+
+  // list the non-zero entries of sparse vectors
+  std::vector<unsigned int> nonZeroIndices;
+  for( unsigned int j = 0; j < x.size(); j++ )
+    {
+    if( x[j] != 0 )
+      {
+      nonZeroIndices.push_back( j );
+      }
+    }
+
+  MatrixProductThreadStruct str;
+  str.Product = MatrixVector;
+  str.A = &A;
+  str.B = ITK_NULLPTR;
+  str.X = x.data_block();
+  str.NonZeroIndices = ITK_NULLPTR;
+  str.NumberOfNonZeroIndices = nonZeroIndices.size();
+  if( 2 * nonZeroIndices.size() < x.size() )
+    {
+    str.NonZeroIndices = &nonZeroIndices[0];
+    }
+  str.Y = y.data_block();
+  if( nonZeroIndices.size() > 0 )
+    {
+    this->ComputeMatrixProduct( str, static_cast<unsigned long>( A.rows() ) * nonZeroIndices.size() );
+    }
+  return y;
+}
+
+template <class TInputImage, class TRealType>
+typename antsSCCANObject<TInputImage, TRealType>::VectorType
+antsSCCANObject<TInputImage, TRealType>
+::MatrixTransposeVectorProduct( const MatrixType & A, const VectorType & x )
+{
+  if( A.rows() != x.size() )
+    {
+    itkExceptionMacro( "Matrix and vector sizes do not match:  ( " << A.rows() << "x" << A.cols()
+                       << " )^T * " << x.size() );
+    }
+  VectorType y( A.cols(), 0 );
+
+  std::vector<unsigned int> nonZeroIndices;
+  for( unsigned int i = 0; i < x.size(); i++ )
+    {
+    if( x[i] != 0 )
+      {
+      nonZeroIndices.push_back( i );
+      }
+    }
+
+  MatrixProductThreadStruct str;
+  str.Product = MatrixTransposeVector;
+  str.A = &A;
+  str.B = ITK_NULLPTR;
+  str.X = x.data_block();
+  str.NonZeroIndices = nonZeroIndices.empty() ? ITK_NULLPTR : &nonZeroIndices[0];
+  str.NumberOfNonZeroIndices = nonZeroIndices.size();
+  str.Y = y.data_block();
+  if( nonZeroIndices.size() > 0 )
+    {
+    this->ComputeMatrixProduct( str, static_cast<unsigned long>( A.cols() ) * nonZeroIndices.size() );
+    }
+  return y;
+}
+
+template <class TInputImage, class TRealType>
+typename antsSCCANObject<TInputImage, TRealType>::MatrixType
+antsSCCANObject<TInputImage, TRealType>
+::MatrixMatrixTransposeProduct( const MatrixType & A, const MatrixType & B )
+{
+  if( A.cols() != B.cols() )
+    {
+    itkExceptionMacro( "Matrix sizes do not match:  " << A.rows() << "x" << A.cols() << " * ( "
+                       << B.rows() << "x" << B.cols() << " )^T" );
+    }
+  MatrixType C( A.rows(), B.rows(), 0 );
+
+  MatrixProductThreadStruct str;
+  str.Product = MatrixMatrixTranspose;
+  str.A = &A;
+  str.B = &B;
+  str.X = ITK_NULLPTR;
+  str.NonZeroIndices = ITK_NULLPTR;
+  str.NumberOfNonZeroIndices = 0;
+  str.Y = C.data_block();
+  this->ComputeMatrixProduct( str, static_cast<unsigned long>( A.rows() ) * B.rows() * A.cols() );
+
+  // only the upper triangle of A A^T is computed
+  if( &A == &B )
+    {
+    for( unsigned int i = 0; i < C.rows(); i++ )
+      {
+      for( unsigned int k = 0; k < i; k++ )
+        {
+        C( i, k ) = C( k, i );
+        }
+      }
+    }
+  return C;
+}
+
+template <class TInputImage, class TRealType>
+typename antsSCCANObject<TInputImage, TRealType>::MatrixType
+antsSCCANObject<TInputImage, TRealType>
+::MatrixTransposeMatrixProduct( const MatrixType & A, const MatrixType & B )
+{
+  if( A.rows() != B.rows() )
+    {
+    itkExceptionMacro( "Matrix sizes do not match:  ( " << A.rows() << "x" << A.cols() << " )^T * "
+                       << B.rows() << "x" << B.cols() );
+    }
+  MatrixType C( A.cols(), B.cols(), 0 );
+
+  MatrixProductThreadStruct str;
+  str.Product = MatrixTransposeMatrix;
+  str.A = &A;
+  str.B = &B;
+  str.X = ITK_NULLPTR;
+  str.NonZeroIndices = ITK_NULLPTR;
+  str.NumberOfNonZeroIndices = 0;
+  str.Y = C.data_block();
+  this->ComputeMatrixProduct( str, static_cast<unsigned long>( A.cols() ) * B.cols() * A.rows() );
+  return C;
+}
+
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::RandomizedSVD( const MatrixType & A, unsigned int k, MatrixType & U, VectorType & singularValues )
+{
+  const unsigned int n = A.rows();
+  const unsigned int l = std::min( k + this->m_RandomizedSVDOversampling, std::min( A.rows(), A.cols() ) );
+  k = std::min( k, l );
+
+  // Gaussian test matrix, stored transposed ( l x cols ) so that A Omega is an A B^T product
+  vnl_random randgen( 19650218 ); /* fixed seed, as in InitializeV, so runs are reproducible */
+  MatrixType omegaT( l, A.cols() );
+  for( unsigned int i = 0; i < l; i++ )
+    {
+    for( unsigned int j = 0; j < A.cols(); j++ )
+      {
+      omegaT( i, j ) = randgen.normal();
+      }
+    }
+
+  // Qt holds the orthonormal basis of the range of A as rows ( l x n )
+  MatrixType qT = this->MatrixMatrixTransposeProduct( A, omegaT ).transpose();
+  omegaT.clear();
+  Self::OrthonormalizeRows( qT );
+  for( unsigned int it = 0; it < this->m_RandomizedSVDPowerIterations; it++ )
+    {
+    MatrixType zT = this->MatrixTransposeMatrixProduct( qT.transpose(), A );
+    Self::OrthonormalizeRows( zT );
+    qT = this->MatrixMatrixTransposeProduct( A, zT ).transpose();
+    Self::OrthonormalizeRows( qT );
+    }
+
+  // B = Q^T A is l x cols, so its left singular vectors come from the small B B^T
+  const MatrixType Q = qT.transpose();
+  MatrixType       bT = this->MatrixTransposeMatrixProduct( Q, A );
+  vnl_symmetric_eigensystem<RealType> eig( this->MatrixMatrixTransposeProduct( bT, bT ) );
+  bT.clear();
+
+  U.set_size( n, k );
+  singularValues.set_size( k );
+  for( unsigned int i = 0; i < k; i++ )
+    {
+    // the eigenvalues are in increasing order
+    const unsigned int e = l - 1 - i;
+    singularValues[i] = sqrt( std::max( eig.D( e ), static_cast<RealType>( 0 ) ) );
+    U.set_column( i, Q * eig.get_eigenvector( e ) );
+    }
+}
+
+template <class TInputImage, class TRealType>
+typename antsSCCANObject<TInputImage, TRealType>::Pointer
+antsSCCANObject<TInputImage, TRealType>
+::CloneSettings() const
+{
+  Pointer clone = Self::New();
+
+  clone->m_Debug = this->m_Debug;
+  clone->m_Silent = this->m_Silent;
+  clone->m_RowSparseness = this->m_RowSparseness;
+  clone->m_MaximumNumberOfIterations = this->m_MaximumNumberOfIterations;
+  clone->m_ConvergenceThreshold = this->m_ConvergenceThreshold;
+  clone->m_SCCANFormulation = this->m_SCCANFormulation;
+  clone->m_PinvTolerance = this->m_PinvTolerance;
+  clone->m_UseRandomizedSVD = this->m_UseRandomizedSVD;
+  clone->m_RandomizedSVDPowerIterations = this->m_RandomizedSVDPowerIterations;
+  clone->m_RandomizedSVDOversampling = this->m_RandomizedSVDOversampling;
+  clone->m_PercentVarianceForPseudoInverse = this->m_PercentVarianceForPseudoInverse;
+  clone->m_Epsilon = this->m_Epsilon;
+  clone->m_OriginalMatrixPriorROI = this->m_OriginalMatrixPriorROI;
+  clone->m_MatrixPriorROI = this->m_MatrixPriorROI;
+  clone->m_MatrixPriorROI2 = this->m_MatrixPriorROI2;
+  clone->m_priorScaleMat = this->m_priorScaleMat;
+  clone->m_FractionNonZeroP = this->m_FractionNonZeroP;
+  clone->m_KeepPositiveP = this->m_KeepPositiveP;
+  clone->m_UseLongitudinalFormulation = this->m_UseLongitudinalFormulation;
+  clone->m_Smoother = this->m_Smoother;
+  clone->m_FractionNonZeroQ = this->m_FractionNonZeroQ;
+  clone->m_KeepPositiveQ = this->m_KeepPositiveQ;
+  clone->m_FractionNonZeroR = this->m_FractionNonZeroR;
+  clone->m_KeepPositiveR = this->m_KeepPositiveR;
+  clone->m_Covering = this->m_Covering;
+  clone->m_GetSmall = this->m_GetSmall;
+  clone->m_UseL1 = this->m_UseL1;
+  clone->m_MinClusterSizeP = this->m_MinClusterSizeP;
+  clone->m_MinClusterSizeQ = this->m_MinClusterSizeQ;
+  clone->m_GradStep = this->m_GradStep;
+  clone->m_PriorWeight = this->m_PriorWeight;
+  clone->SetNumberOfThreads( this->GetNumberOfThreads() );
+  return clone;
+}
+
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::OrthonormalizeRows( MatrixType & A )
+{
+  RealType maxNorm = 0;
+  for( unsigned int i = 0; i < A.rows(); i++ )
+    {
+    RealType *ai = A[i];
+    RealType  norm0 = 0;
+    for( unsigned int c = 0; c < A.cols(); c++ )
+      {
+      norm0 += ai[c] * ai[c];
+      }
+    maxNorm = std::max( maxNorm, norm0 );
+    for( unsigned int j = 0; j < i; j++ )
+      {
+      const RealType *aj = A[j];
+      RealType        dot = 0;
+      for( unsigned int c = 0; c < A.cols(); c++ )
+        {
+        dot += ai[c] * aj[c];
+        }
+      for( unsigned int c = 0; c < A.cols(); c++ )
+        {
+        ai[c] -= dot * aj[c];
+        }
+      }
+    RealType norm = 0;
+    for( unsigned int c = 0; c < A.cols(); c++ )
+      {
+      norm += ai[c] * ai[c];
+      }
+    norm = sqrt( norm );
+    if( norm * norm <= 1.e-24 * maxNorm || norm == 0 )
+      {
+      A.set_row( i, 0 );
+      continue;
+      }
+    for( unsigned int c = 0; c < A.cols(); c++ )
+      {
+      ai[c] /= norm;
+      }
+    }
+}
+
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::ComputeMatrixProduct( MatrixProductThreadStruct & str, unsigned long numberOfOperations )
+{
+#if defined( ANTS_USE_BLAS )
+  // The dense products go to the (threaded) BLAS, the products with sparse
+  // vectors are cheaper on the non-zero entries only.
+  const MatrixType & A = *str.A;
+  switch( str.Product )
+    {
+    case MatrixVector:
+      if( !str.NonZeroIndices )
+        {
+        ants::blas::RowMajorMatrixVectorProduct( A.rows(), A.cols(), A.data_block(), str.X, str.Y );
+        return;
+        }
+      break;
+    case MatrixTransposeVector:
+      if( 2 * str.NumberOfNonZeroIndices >= A.rows() )
+        {
+        ants::blas::RowMajorMatrixTransposeVectorProduct( A.rows(), A.cols(), A.data_block(), str.X, str.Y );
+        return;
+        }
+      break;
+    case MatrixMatrixTranspose:
+      ants::blas::RowMajorMatrixMatrixTransposeProduct( A.rows(), A.cols(), str.B->rows(), A.data_block(),
+                                                        str.B->data_block(), str.Y );
+      return;
+    case MatrixTransposeMatrix:
+      ants::blas::RowMajorMatrixTransposeMatrixProduct( A.rows(), A.cols(), str.B->cols(), A.data_block(),
+                                                        str.B->data_block(), str.Y );
+      return;
+    }
+#endif
+
+  // below this size the threads cost more than they save
+  const unsigned long minimumNumberOfOperationsPerThread = 1UL << 16;
+
+  unsigned int numberOfThreads = this->GetNumberOfThreads();
+  if( numberOfOperations / minimumNumberOfOperationsPerThread < numberOfThreads )
+    {
+    numberOfThreads = std::max( numberOfOperations / minimumNumberOfOperationsPerThread, 1UL );
+    }
+
+  if( numberOfThreads <= 1 )
+    {
+    Self::ComputeMatrixProductBlock( str, 0, 1 );
+    return;
+    }
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( Self::MatrixProductThreaderCallback, &str );
+  threader->SingleMethodExecute();
+}
+
+template <class TInputImage, class TRealType>
+ITK_THREAD_RETURN_TYPE
+antsSCCANObject<TInputImage, TRealType>
+::MatrixProductThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const MatrixProductThreadStruct *str = static_cast<const MatrixProductThreadStruct *>( info->UserData );
+
+  Self::ComputeMatrixProductBlock( *str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::ComputeMatrixProductBlock( const MatrixProductThreadStruct & str,
+                             unsigned int threadId, unsigned int numberOfThreads )
+{
+  // The matrices are row-major.  Long rows are processed in column blocks so
+  // that the block of the output (or of B) each thread works on stays in cache.
+  const unsigned int columnBlockSize = 4096;
+
+  const MatrixType & A = *str.A;
+
+  switch( str.Product )
+    {
+    case MatrixVector:
+      {
+      // y = A x:  the rows of A are split among the threads
+      const unsigned int first = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.rows() ) * threadId / numberOfThreads );
+      const unsigned int last = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.rows() ) * ( threadId + 1 ) / numberOfThreads );
+      for( unsigned int i = first; i < last; i++ )
+        {
+        const RealType *row = A[i];
+        RealType        sum = 0;
+        if( str.NonZeroIndices )
+          {
+          for( unsigned int n = 0; n < str.NumberOfNonZeroIndices; n++ )
+            {
+            sum += row[str.NonZeroIndices[n]] * str.X[str.NonZeroIndices[n]];
+            }
+          }
+        else
+          {
+          for( unsigned int j = 0; j < A.cols(); j++ )
+            {
+            sum += row[j] * str.X[j];
+            }
+          }
+        str.Y[i] = sum;
+        }
+      }
+      break;
+    case MatrixTransposeVector:
+      {
+      // y = A^T x:  the columns of A (entries of y) are split among the threads
+      const unsigned int first = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.cols() ) * threadId / numberOfThreads );
+      const unsigned int last = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.cols() ) * ( threadId + 1 ) / numberOfThreads );
+      for( unsigned int j0 = first; j0 < last; j0 += columnBlockSize )
+        {
+        const unsigned int j1 = std::min( j0 + columnBlockSize, last );
+        for( unsigned int n = 0; n < str.NumberOfNonZeroIndices; n++ )
+          {
+          const unsigned int i = str.NonZeroIndices[n];
+          const RealType     xi = str.X[i];
+          const RealType *   row = A[i];
+          for( unsigned int j = j0; j < j1; j++ )
+            {
+            str.Y[j] += xi * row[j];
+            }
+          }
+        }
+      }
+      break;
+    case MatrixMatrixTranspose:
+      {
+      // C = A B^T:  the rows of C are split among the threads
+      const MatrixType & B = *str.B;
+      const bool         isSymmetric = ( str.A == str.B );
+
+      const unsigned int first = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.rows() ) * threadId / numberOfThreads );
+      const unsigned int last = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.rows() ) * ( threadId + 1 ) / numberOfThreads );
+      for( unsigned int j0 = 0; j0 < A.cols(); j0 += columnBlockSize )
+        {
+        const unsigned int j1 = std::min( j0 + columnBlockSize, A.cols() );
+        for( unsigned int i = first; i < last; i++ )
+          {
+          const RealType *rowA = A[i];
+          RealType *      rowC = str.Y + static_cast<unsigned long>( i ) * B.rows();
+          for( unsigned int k = ( isSymmetric ? i : 0 ); k < B.rows(); k++ )
+            {
+            const RealType *rowB = B[k];
+            RealType        sum = 0;
+            for( unsigned int j = j0; j < j1; j++ )
+              {
+              sum += rowA[j] * rowB[j];
+              }
+            rowC[k] += sum;
+            }
+          }
+        }
+      }
+      break;
+    case MatrixTransposeMatrix:
+      {
+      // C = A^T B:  the columns of A (rows of C) are split among the threads
+      const MatrixType & B = *str.B;
+
+      const unsigned int first = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.cols() ) * threadId / numberOfThreads );
+      const unsigned int last = static_cast<unsigned int>(
+          static_cast<unsigned long>( A.cols() ) * ( threadId + 1 ) / numberOfThreads );
+      for( unsigned int i = 0; i < A.rows(); i++ )
+        {
+        const RealType *rowA = A[i];
+        const RealType *rowB = B[i];
+        for( unsigned int j = first; j < last; j++ )
+          {
+          const RealType a = rowA[j];
+          if( a == 0 )
+            {
+            continue;
+            }
+          RealType *rowC = str.Y + static_cast<unsigned long>( j ) * B.cols();
+          for( unsigned int k = 0; k < B.cols(); k++ )
+            {
+            rowC[k] += a * rowB[k];
+            }
+          }
+        }
+      }
+      break;
+    }
+}
+
 template <class TInputImage, class TRealType>
 typename TInputImage::Pointer
 antsSCCANObject<TInputImage, TRealType>
@@ -311,6 +789,108 @@ antsSCCANObject<TInputImage, TRealType>
   return gradvec.two_norm();
 }
 
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::UpdateClusterGraph( typename TInputImage::Pointer mask )
+{
+  if( mask.GetPointer() == this->m_ClusterGraphMask && mask->GetMTime() == this->m_ClusterGraphMaskMTime )
+    {
+    return;
+    }
+
+  // the 4D variates stack one copy of the first time slice of the mask per time point
+  unsigned int graphDimension = ImageDimension;
+  typename ImageType::RegionType region = mask->GetLargestPossibleRegion();
+  if( ImageDimension == 4 )
+    {
+    graphDimension = ImageDimension - 1;
+    region.SetSize( ImageDimension - 1, 1 );
+    region.SetIndex( ImageDimension - 1, 0 );
+    }
+
+  // number the mask voxels in the order ConvertImageToVariate stores them
+  typedef itk::ImageRegionConstIteratorWithIndex<ImageType> Iterator;
+  std::vector<long> node( region.GetNumberOfPixels(), -1 );
+  unsigned long     numberOfNodes = 0;
+  unsigned long     position = 0;
+  Iterator          mIter( mask, region );
+  for( mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter, ++position )
+    {
+    if( mIter.Get() >= 0.5 )
+      {
+      node[position] = numberOfNodes++;
+      }
+    }
+
+  unsigned long stride[ImageDimension];
+  stride[0] = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    stride[d] = stride[d - 1] * region.GetSize( d - 1 );
+    }
+
+  // face connectivity, as ConnectedComponentImageFilter with FullyConnected off;
+  // each edge is stored once, from the voxel with the lower offset
+  this->m_ClusterGraphOffsets.assign( 1, 0 );
+  this->m_ClusterGraphOffsets.reserve( numberOfNodes + 1 );
+  this->m_ClusterGraphNeighbors.clear();
+  position = 0;
+  for( mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter, ++position )
+    {
+    if( node[position] < 0 )
+      {
+      continue;
+      }
+    const typename ImageType::IndexType ind = mIter.GetIndex();
+    for( unsigned int d = 0; d < graphDimension; d++ )
+      {
+      if( ind[d] + 1 < region.GetIndex( d ) + static_cast<long>( region.GetSize( d ) ) &&
+          node[position + stride[d]] >= 0 )
+        {
+        this->m_ClusterGraphNeighbors.push_back( node[position + stride[d]] );
+        }
+      }
+    this->m_ClusterGraphOffsets.push_back( this->m_ClusterGraphNeighbors.size() );
+    }
+
+  this->m_ClusterGraphMask = mask.GetPointer();
+  this->m_ClusterGraphMaskMTime = mask->GetMTime();
+}
+
+template <class TInputImage, class TRealType>
+unsigned long
+antsSCCANObject<TInputImage, TRealType>
+::FindCluster( std::vector<unsigned long> & parent, unsigned long n )
+{
+  while( parent[n] != n )
+    {
+    parent[n] = parent[parent[n]];
+    n = parent[n];
+    }
+  return n;
+}
+
+template <class TInputImage, class TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MergeClusters( std::vector<unsigned long> & parent, std::vector<unsigned long> & clustersize,
+                 unsigned long a, unsigned long b )
+{
+  a = Self::FindCluster( parent, a );
+  b = Self::FindCluster( parent, b );
+  if( a == b )
+    {
+    return;
+    }
+  if( clustersize[a] < clustersize[b] )
+    {
+    std::swap( a, b );
+    }
+  parent[b] = a;
+  clustersize[a] += clustersize[b];
+}
+
 template <class TInputImage, class TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::VectorType
 antsSCCANObject<TInputImage, TRealType>
@@ -323,58 +903,67 @@ antsSCCANObject<TInputImage, TRealType>
     return w_p;
     }
   if ( ImageDimension == 4 ) return this->ClusterThresholdVariate4D( w_p, mask,  minclust );
-  typedef unsigned long                                                    ULPixelType;
-  typedef itk::Image<ULPixelType, ImageDimension>                          labelimagetype;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType>                     fIterator;
-  typedef itk::ImageRegionIteratorWithIndex<labelimagetype>                Iterator;
-  typedef itk::ConnectedComponentImageFilter<TInputImage, labelimagetype>  FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, labelimagetype> RelabelType;
 
-// we assume w_p has been thresholded by another function
-  bool threshold_at_zero = true;
-  typename TInputImage::Pointer image = this->ConvertVariateToSpatialImage( w_p, mask, threshold_at_zero );
-  typename FilterType::Pointer filter = FilterType::New();
-  typename RelabelType::Pointer relabel = RelabelType::New();
-  filter->SetInput( image );
-  filter->SetFullyConnected( 0 );
-  relabel->SetInput( filter->GetOutput() );
-  relabel->SetMinimumObjectSize( 1 );
-  try
+  this->UpdateClusterGraph( mask );
+  const unsigned long numberOfNodes = this->m_ClusterGraphOffsets.size() - 1;
+  if( numberOfNodes == 0 )
     {
-    relabel->Update();
+    return w_p;
     }
-  catch( itk::ExceptionObject & excep )
+  this->m_VecToMaskSize = static_cast<unsigned int>
+    ( static_cast<double>( w_p.size() ) / static_cast<double>( numberOfNodes ) + 0.5 );
+
+// we assume w_p has been thresholded by another function
+// a voxel is in a cluster where the weight image of ConvertVariateToSpatialImage
+// ( with threshold_at_zero ) is non-zero
+  RealType          avgwt = 1.0 / static_cast<double>( this->m_VecToMaskSize );
+  std::vector<bool> inCluster( numberOfNodes, false );
+  for( unsigned long j = 0; j < numberOfNodes; j++ )
     {
-    if ( ! this->m_Silent )  std::cout << "Relabel: exception caught !" << std::endl;
-    if ( ! this->m_Silent )  std::cout << excep << std::endl;
+    TRealType weight = 0;
+    for( unsigned int k = 0; k < this->m_VecToMaskSize; k++ )
+      {
+      const unsigned long vecind = k * numberOfNodes + j;
+      TRealType           val = 0;
+      if( vecind < w_p.size() )
+        {
+        val = w_p( vecind ) * avgwt + weight;
+        }
+      weight = ( fabs( val ) > this->m_Epsilon ) ? 1 : val;
+      }
+    inCluster[j] = ( weight != 0 );
     }
 
-  Iterator                   vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
-  float                      maximum = relabel->GetNumberOfObjects();
-  std::vector<unsigned long> histogram( (int)maximum + 1);
-  for( int i = 0; i <= maximum; i++ )
+  std::vector<unsigned long> parent( numberOfNodes );
+  std::vector<unsigned long> clustersize( numberOfNodes, 1 );
+  for( unsigned long j = 0; j < numberOfNodes; j++ )
     {
-    histogram[i] = 0;
+    parent[j] = j;
     }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  for( unsigned long j = 0; j < numberOfNodes; j++ )
     {
-    float vox = vfIter.Get();
-    if( vox > 0 )
+    if( !inCluster[j] )
       {
-      if( vox > 0 )
+      continue;
+      }
+    for( unsigned long e = this->m_ClusterGraphOffsets[j]; e < this->m_ClusterGraphOffsets[j + 1]; e++ )
+      {
+      if( inCluster[this->m_ClusterGraphNeighbors[e]] )
         {
-        histogram[(unsigned long)vox] = histogram[(unsigned long)vox] + 1;
+        Self::MergeClusters( parent, clustersize, j, this->m_ClusterGraphNeighbors[e] );
         }
       }
     }
 
   // get the largest component's size
-  unsigned long largest_component_size = 0;
-  for( int i = 0; i <= maximum; i++ )
+  std::vector<unsigned long> voxelclustersize( numberOfNodes, 0 );
+  unsigned long              largest_component_size = 0;
+  for( unsigned long j = 0; j < numberOfNodes; j++ )
     {
-    if( largest_component_size < histogram[i] )
+    if( inCluster[j] )
       {
-      largest_component_size = histogram[i];
+      voxelclustersize[j] = clustersize[Self::FindCluster( parent, j )];
+      largest_component_size = std::max( largest_component_size, voxelclustersize[j] );
       }
     }
 
@@ -382,42 +971,19 @@ antsSCCANObject<TInputImage, TRealType>
     {
     minclust = largest_component_size - 1;
     }
-//  now create the output vector
-// iterate through the image and set the voxels where  countinlabel[(unsigned
-// long)(labelimage->GetPixel(vfIter.GetIndex()) - min)]
-// is < MinClusterSize
-  unsigned long vecind = 0, keepct = 0;
+//  now create the output vector:  keep the clusters > minclust
   for ( unsigned int k = 0; k < this->m_VecToMaskSize; k++ )
   {
-  fIterator     mIter( mask,  mask->GetLargestPossibleRegion() );
-  for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+  for( unsigned long j = 0; j < numberOfNodes; j++ )
     {
-    if( mIter.Get() > 0 )
+    const unsigned long vecind = k * numberOfNodes + j;
+    if( vecind < w_p.size() && voxelclustersize[j] <= minclust )
       {
-      float         vox = mask->GetPixel(vfIter.GetIndex() );
-      unsigned long clustersize = 0;
-      if( vox >= 0  )
-        {
-        clustersize = histogram[(unsigned long)(relabel->GetOutput()->GetPixel(mIter.GetIndex() ) )];
-        if( clustersize > minclust )
-          {
-          keepct += 1;
-          }                                      // get clusters > minclust
-        //    if ( clustersize == largest_component_size ) { keepct++; } // get largest cluster
-        else
-          {
-          w_p(vecind) = 0;
-          }
-        vecind++;
-        }
+      w_p( vecind ) = 0;
       }
     }
   }
-  this->m_KeptClusterSize = histogram[1]; // only records the size of the largest cluster in the variate
-  //  for (unsigned int i=0; i<histogram.size(); i++)
-  //  if ( histogram[i] > minclust ) this->m_KeptClusterSize+=histogram[i];
-  //  if ( ! this->m_Silent )  std::cout << " Cluster Threshold Kept % of sparseness " <<  ( (float)keepct/(float)w_p.size() ) /
-  // this->m_FractionNonZeroP   << " kept clust size " << keepct << std::endl;
+  this->m_KeptClusterSize = largest_component_size; // only records the size of the largest cluster in the variate
   return w_p;
 }
 
@@ -433,71 +999,64 @@ antsSCCANObject<TInputImage, TRealType>
     {
     return w_p;
     }
-  typedef unsigned long                                                    ULPixelType;
-  typedef itk::Image<ULPixelType, ImageDimension>                          labelimagetype;
-  typedef itk::ImageRegionIteratorWithIndex<labelimagetype>                Iterator;
-  typedef itk::ConnectedComponentImageFilter<TInputImage, labelimagetype>  FilterType;
-  typedef itk::RelabelComponentImageFilter<labelimagetype, labelimagetype> RelabelType;
 
-  typedef itk::ImageRegionIteratorWithIndex<RealImageTypeDminus1>          fIterator;
-  typename RealImageTypeDminus1::Pointer maskdm1;
-  typedef itk::ExtractImageFilter<TInputImage, RealImageTypeDminus1> ExtractFilterType;
-  typename ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
-  extractFilter->SetInput( mask );
-  extractFilter->SetDirectionCollapseToIdentity();
-  extractFilter->SetDirectionCollapseToSubmatrix();
-  typename ImageType::RegionType extractRegion = mask->GetLargestPossibleRegion();
-  extractRegion.SetSize(ImageDimension - 1, 0);
-  extractRegion.SetIndex(ImageDimension - 1, 0 );
-  extractFilter->SetExtractionRegion( extractRegion );
-  extractFilter->Update();
-  maskdm1 = extractFilter->GetOutput();
-
-// we assume w_p has been thresholded by another function
-  bool threshold_at_zero = true;
-  typename TInputImage::Pointer image = this->ConvertVariateToSpatialImage( w_p, mask, threshold_at_zero );
-  typename FilterType::Pointer filter = FilterType::New();
-  typename RelabelType::Pointer relabel = RelabelType::New();
-  filter->SetInput( image );
-  filter->SetFullyConnected( 0 );
-  relabel->SetInput( filter->GetOutput() );
-  relabel->SetMinimumObjectSize( 1 );
-  try
+  this->UpdateClusterGraph( mask );
+  const unsigned long numberOfMaskNodes = this->m_ClusterGraphOffsets.size() - 1;
+  if( numberOfMaskNodes == 0 )
     {
-    relabel->Update();
+    return w_p;
     }
-  catch( itk::ExceptionObject & excep )
+  this->m_VecToMaskSize = static_cast<unsigned int>
+    ( static_cast<double>( w_p.size() ) / static_cast<double>( numberOfMaskNodes ) + 0.5 );
+
+// we assume w_p has been thresholded by another function
+// each time point is a copy of the mask slice, so the nodes are ( time, voxel )
+// and consecutive time points of a voxel are face neighbours
+  const unsigned long numberOfNodes = numberOfMaskNodes * this->m_VecToMaskSize;
+  std::vector<bool>   inCluster( numberOfNodes, false );
+  for( unsigned long n = 0; n < numberOfNodes && n < w_p.size(); n++ )
     {
-    if ( ! this->m_Silent )  std::cout << "Relabel: exception caught !" << std::endl;
-    if ( ! this->m_Silent )  std::cout << excep << std::endl;
+    inCluster[n] = ( w_p( n ) != 0 );
     }
 
-  Iterator                   vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
-  float                      maximum = relabel->GetNumberOfObjects();
-  std::vector<unsigned long> histogram( (int)maximum + 1);
-  for( int i = 0; i <= maximum; i++ )
+  std::vector<unsigned long> parent( numberOfNodes );
+  std::vector<unsigned long> clustersize( numberOfNodes, 1 );
+  for( unsigned long n = 0; n < numberOfNodes; n++ )
     {
-    histogram[i] = 0;
+    parent[n] = n;
     }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  for ( unsigned int k = 0; k < this->m_VecToMaskSize; k++ )
+  {
+  const unsigned long base = k * numberOfMaskNodes;
+  for( unsigned long j = 0; j < numberOfMaskNodes; j++ )
     {
-    float vox = vfIter.Get();
-    if( vox > 0 )
+    if( !inCluster[base + j] )
+      {
+      continue;
+      }
+    for( unsigned long e = this->m_ClusterGraphOffsets[j]; e < this->m_ClusterGraphOffsets[j + 1]; e++ )
       {
-      if( vox > 0 )
+      if( inCluster[base + this->m_ClusterGraphNeighbors[e]] )
         {
-        histogram[(unsigned long)vox] = histogram[(unsigned long)vox] + 1;
+        Self::MergeClusters( parent, clustersize, base + j, base + this->m_ClusterGraphNeighbors[e] );
         }
       }
+    if( k + 1 < this->m_VecToMaskSize && inCluster[base + numberOfMaskNodes + j] )
+      {
+      Self::MergeClusters( parent, clustersize, base + j, base + numberOfMaskNodes + j );
+      }
     }
+  }
 
   // get the largest component's size
-  unsigned long largest_component_size = 0;
-  for( int i = 0; i <= maximum; i++ )
+  std::vector<unsigned long> voxelclustersize( numberOfNodes, 0 );
+  unsigned long              largest_component_size = 0;
+  for( unsigned long n = 0; n < numberOfNodes; n++ )
     {
-    if( largest_component_size < histogram[i] )
+    if( inCluster[n] )
       {
-      largest_component_size = histogram[i];
+      voxelclustersize[n] = clustersize[Self::FindCluster( parent, n )];
+      largest_component_size = std::max( largest_component_size, voxelclustersize[n] );
       }
     }
 
@@ -506,34 +1065,15 @@ antsSCCANObject<TInputImage, TRealType>
     minclust = largest_component_size - 1;
     }
 
-//  now create the output vector
-// iterate through the image and set the voxels where  countinlabel[(unsigned
-// long)(labelimage->GetPixel(vfIter.GetIndex()) - min)]
-// is < MinClusterSize
-  unsigned long vecind = 0;
-  for ( unsigned int k = 0; k < this->m_VecToMaskSize; k++ )
-  {
-  fIterator     mIter( maskdm1,  maskdm1->GetLargestPossibleRegion() );
-  for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+//  now create the output vector:  remove the clusters < minclust
+  for( unsigned long n = 0; n < numberOfNodes && n < w_p.size(); n++ )
     {
-    if( mIter.Get() >= 0.5 )
+    if( voxelclustersize[n] < minclust )
       {
-      typename RealImageTypeDminus1::IndexType mind = mIter.GetIndex();
-      typename ImageType::IndexType ind4d;
-      for ( unsigned int dim = 0; dim < ImageDimension-1; dim++ ) ind4d[ dim ] = mind[ dim ];
-      ind4d[ ImageDimension - 1 ] = k;
-      unsigned long clustersize = 0;
-      clustersize = histogram[(unsigned long)(relabel->GetOutput()->GetPixel( ind4d ) )];
-      if( clustersize < minclust )
-	{
-        w_p( vecind ) = 0;
-	}
-      vecind++;
+      w_p( n ) = 0;
       }
     }
-  }// loop
-  this->m_KeptClusterSize = histogram[1]; // only records the size of the largest cluster in the variate
-  //  if ( ! this->m_Silent )  std::cout << " w_p out " << w_p.two_norm() << " hist " <<  histogram[1] << " nz " << this->CountNonZero( w_p ) << std::endl;
+  this->m_KeptClusterSize = largest_component_size; // only records the size of the largest cluster in the variate
   return w_p;
 }
 
@@ -1296,17 +1836,13 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     if ( ! this->m_Silent )  std::cout << " inv view mats " << std::endl;
     }
   MatrixType inviewcovmatP =
-    ( (this->m_MatrixP
-       * this->m_MatrixP.transpose() )
-      * (this->m_MatrixP
-         * this->m_MatrixP.transpose() ) )
-    * (1 - tau) +  ( this->m_MatrixP * this->m_MatrixP.transpose() ) * tau * (RealType)nsubj;
+    ( this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP )
+      * this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP ) )
+    * (1 - tau) +  ( this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP ) ) * tau * (RealType)nsubj;
   MatrixType inviewcovmatQ =
-    ( (this->m_MatrixQ
-       * this->m_MatrixQ.transpose() )
-      * (this->m_MatrixQ
-         * this->m_MatrixQ.transpose() ) )
-    * (1 - tau) + ( this->m_MatrixQ * this->m_MatrixQ.transpose() ) * tau * (RealType)nsubj;
+    ( this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ )
+      * this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ ) )
+    * (1 - tau) + ( this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ ) ) * tau * (RealType)nsubj;
 
 /** standard cca */
 //  MatrixType CppInv=this->PseudoInverseCovMat(this->m_MatrixP);
@@ -1323,10 +1859,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 
   /** need the eigenvectors of this reduced matrix */
   //  eMatrix pccain=CppInv*Cpq*CqqInv*Cqp;
-  MatrixType ccap = ( (CppInv * (this->m_MatrixP * this->m_MatrixP.transpose() ) ).transpose()
-                      * (CqqInv * (this->m_MatrixQ * this->m_MatrixQ.transpose() ) )
-                      * ( (this->m_MatrixP * this->m_MatrixP.transpose() ).transpose()
-                          * (this->m_MatrixQ * this->m_MatrixQ.transpose() ) ).transpose() );
+  MatrixType ccap = ( (CppInv * (this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP ) ) ).transpose()
+                      * (CqqInv * (this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ ) ) )
+                      * ( (this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP ) ).transpose()
+                          * (this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ ) ) ).transpose() );
 // convert to eigen3 format
 /*
   eMatrix pccain=this->mVtoE(ccap);
@@ -1343,7 +1879,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   this->m_CanonicalCorrelations.set_size(nvecs);
   this->m_CanonicalCorrelations.fill(0);
 // copy to stl vector so we can sort the results
-  MatrixType projToQ=( CqqInv*( (this->m_MatrixQ*this->m_MatrixQ.transpose() )* (this->m_MatrixP*this->m_MatrixP.transpose() ) ));
+  MatrixType projToQ=( CqqInv*( (this->MatrixMatrixTransposeProduct( this->m_MatrixQ, this->m_MatrixQ ) )* (this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP ) ) ));
   std::vector<TRealType> evals(pccaSquaredCorrs.cols(),0);
   std::vector<TRealType> oevals(pccaSquaredCorrs.cols(),0);
   for ( long j=0; j<pccaSquaredCorrs.cols(); ++j){
@@ -1351,11 +1887,11 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     if ( val > 0.05 ){
       VectorType temp=this->vEtoV( pccaVecs.col(  j ) );
       VectorType tempq=projToQ*temp;
-      VectorType pvar=temp*this->m_MatrixP;
+      VectorType pvar=this->MatrixTransposeVectorProduct( this->m_MatrixP, temp );
       this->ReSoftThreshold( pvar , this->m_FractionNonZeroP , this->m_KeepPositiveP );
-      VectorType qvar= tempq*this->m_MatrixQ;
+      VectorType qvar= this->MatrixTransposeVectorProduct( this->m_MatrixQ, tempq );
       this->ReSoftThreshold( qvar , this->m_FractionNonZeroQ , this->m_KeepPositiveQ );
-      evals[j]=fabs(this->PearsonCorr(this->m_MatrixP*pvar,this->m_MatrixQ*qvar));
+      evals[j]=fabs(this->PearsonCorr(this->MatrixVectorProduct( this->m_MatrixP, pvar ),this->MatrixVectorProduct( this->m_MatrixQ, qvar )));
       oevals[j]=evals[j];
     }
   }
@@ -1376,9 +1912,9 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   for (unsigned int i=0; i<nvecs; i++) {
     VectorType temp=this->vEtoV( pccaVecs.col(  sorted_indices[i] ) );
     VectorType tempq=projToQ*temp;
-    VectorType pvar= temp*this->m_MatrixP;
+    VectorType pvar= this->MatrixTransposeVectorProduct( this->m_MatrixP, temp );
     this->ReSoftThreshold(pvar , this->m_FractionNonZeroP , this->m_KeepPositiveP );
-    VectorType qvar= tempq*this->m_MatrixQ ;
+    VectorType qvar= this->MatrixTransposeVectorProduct( this->m_MatrixQ, tempq ) ;
     this->ReSoftThreshold(qvar , this->m_FractionNonZeroQ , this->m_KeepPositiveQ );
     this->m_VariatesP.set_column( i, pvar  );
     this->m_VariatesQ.set_column( i, qvar  );
@@ -1386,12 +1922,12 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 
   for (unsigned int i=0; i<nvecs; i++) {
     this->m_CanonicalCorrelations[i]=
-      this->PearsonCorr(this->m_MatrixP*this->GetVariateP(i),this->m_MatrixQ*this->GetVariateQ(i) );
+      this->PearsonCorr(this->MatrixVectorProduct( this->m_MatrixP, this->GetVariateP(i) ),this->MatrixVectorProduct( this->m_MatrixQ, this->GetVariateQ(i) ) );
     if ( ! this->m_Silent )  std::cout << "correlation of mapped back data " << this->m_CanonicalCorrelations[i] <<
      " eval " << pccaSquaredCorrs(sorted_indices[i],sorted_indices[i]) << std::endl;
   }
   for (unsigned int i=0; i<nvecs; i++) {
-    if ( ! this->m_Silent )  std::cout << "inner prod of projections 0 vs i  " <<  this->PearsonCorr( this->m_MatrixP*this->GetVariateP(0) , this->m_MatrixP*this->GetVariateP(i) ) << std::endl;
+    if ( ! this->m_Silent )  std::cout << "inner prod of projections 0 vs i  " <<  this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, this->GetVariateP(0) ) , this->MatrixVectorProduct( this->m_MatrixP, this->GetVariateP(i) ) ) << std::endl;
   }
 */
 //  this->RunDiagnostics(nvecs);
@@ -1423,8 +1959,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     if ( ! this->m_Silent )  std::cout <<" corr-pre " << this->PearsonCorr( this->m_MatrixP.get_column(0) , this->m_OriginalMatrixR.get_column(0)  ) << std::endl  ;if ( ! this->m_Silent )  std::cout <<" corr-post " << this->PearsonCorr( PslashR.get_column(0) , this->m_OriginalMatrixR.get_column(0)  ) << std::endl;
     if ( ! this->m_Silent )  std::cout <<" corr-pre " << this->PearsonCorr( this->m_MatrixQ.get_column(0) , this->m_OriginalMatrixR.get_column(0)  ) << std::endl  ;if ( ! this->m_Silent )  std::cout <<" corr-post " << this->PearsonCorr( QslashR.get_column(0) , this->m_OriginalMatrixR.get_column(0)  ) << std::endl;
   }
-  MatrixType inviewcovmatP=( (PslashR*PslashR.transpose())*(PslashR*PslashR.transpose()) )*(1-tau)+  ( PslashR*PslashR.transpose() )*tau*(RealType)nsubj;
-  MatrixType inviewcovmatQ=( (QslashR*QslashR.transpose())*(QslashR*QslashR.transpose()) )*(1-tau)+( QslashR*QslashR.transpose() )*tau*(RealType)nsubj;
+  MatrixType inviewcovmatP=( (this->MatrixMatrixTransposeProduct( PslashR, PslashR ))*(this->MatrixMatrixTransposeProduct( PslashR, PslashR )) )*(1-tau)+  ( this->MatrixMatrixTransposeProduct( PslashR, PslashR ) )*tau*(RealType)nsubj;
+  MatrixType inviewcovmatQ=( (this->MatrixMatrixTransposeProduct( QslashR, QslashR ))*(this->MatrixMatrixTransposeProduct( QslashR, QslashR )) )*(1-tau)+( this->MatrixMatrixTransposeProduct( QslashR, QslashR ) )*tau*(RealType)nsubj;
 
 // dual cca
   if (this->m_Debug) if ( ! this->m_Silent )  std::cout << " inv view mats pinv " << std::endl;
@@ -1433,10 +1969,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if (this->m_Debug) if ( ! this->m_Silent )  std::cout << " inv view mats pinv done " << std::endl;
 
   // need the eigenvectors of this reduced matrix
-  MatrixType ccap=( (CppInv*(PslashR*PslashR.transpose())).transpose() *
-                  (CqqInv*(QslashR*QslashR.transpose()))*
-                        ( (PslashR*PslashR.transpose() ).transpose()*
-                          (QslashR*QslashR.transpose() ) ).transpose() );
+  MatrixType ccap=( (CppInv*(this->MatrixMatrixTransposeProduct( PslashR, PslashR ))).transpose() *
+                  (CqqInv*(this->MatrixMatrixTransposeProduct( QslashR, QslashR )))*
+                        ( (this->MatrixMatrixTransposeProduct( PslashR, PslashR ) ).transpose()*
+                          (this->MatrixMatrixTransposeProduct( QslashR, QslashR ) ) ).transpose() );
 // convert to eigen3 format
   eMatrix pccain=this->mVtoE(ccap);
 
@@ -1449,7 +1985,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 // map the variates back to P, Q space and sort them
   this->m_CanonicalCorrelations.set_size(nvecs);
   this->m_CanonicalCorrelations.fill(0);
-  MatrixType projToQ=( CqqInv*( (QslashR*QslashR.transpose() )* (PslashR*PslashR.transpose() ) ));
+  MatrixType projToQ=( CqqInv*( (this->MatrixMatrixTransposeProduct( QslashR, QslashR ) )* (this->MatrixMatrixTransposeProduct( PslashR, PslashR ) ) ));
 // copy to stl vector so we can sort the results
   std::vector<TRealType> evals(pccaSquaredCorrs.cols(),0);
   std::vector<TRealType> oevals(pccaSquaredCorrs.cols(),0);
@@ -1627,28 +2163,26 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if( this->m_OriginalMatrixR.size() > 0 )
     {
     this->m_MatrixRRt = this->ProjectionMatrix(this->m_OriginalMatrixR);
-    this->m_MatrixP = this->m_MatrixP - (this->m_MatrixRRt * this->m_MatrixP);
+    // the projection matrix is symmetric
+    this->m_MatrixP = this->m_MatrixP - this->MatrixTransposeMatrixProduct( this->m_MatrixRRt, this->m_MatrixP );
     }
   this->m_ClusterSizes.set_size(n_vecs);
   this->m_ClusterSizes.fill(0);
-  double trace = 0;
-  for( unsigned int i = 0; i < this->m_MatrixP.cols(); i++ )
-    {
-    trace += inner_product(this->m_MatrixP.get_column(i), this->m_MatrixP.get_column(i) );
-    }
+  // trace of P^T P, without copying the columns of P
+  const double trace = vnl_math_sqr( static_cast<double>( this->m_MatrixP.frobenius_norm() ) );
   this->m_VariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   VariateType myGradients;
   this->m_SparseVariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   this->m_SparseVariatesP.fill(0);
   myGradients.set_size(this->m_MatrixP.cols(), n_vecs);
   myGradients.fill(0);
-  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP );
+  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP, n_vecs );
   for( unsigned int kk = 0; kk < n_vecs; kk++ )
     {
     this->m_VariatesP.set_column(kk, this->InitializeV(this->m_MatrixP) );
     if( kk < init.columns() )
       {
-      VectorType initv = init.get_column(kk) * this->m_MatrixP;
+      VectorType initv = this->MatrixTransposeVectorProduct( this->m_MatrixP, init.get_column(kk) );
       this->m_VariatesP.set_column(kk, initv);
       }
     }
@@ -1667,7 +2201,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       // if ( loop == 0 )
       ptemp = this->m_VariatesP.get_column(k);
       MatrixType pmod = this->m_MatrixP;
-      VectorType pveck = pmod.transpose() * ( pmod  * ptemp ); // classic
+      VectorType pveck = this->NormalMatrixVectorProduct( pmod, ptemp ); // classic
       RealType   hkkm1 = pveck.two_norm();
       if( hkkm1 > this->m_Epsilon  )
         {
@@ -1715,7 +2249,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     double recuravg2 = 1 - recuravg;
     for( unsigned int k = 0; k < n_vecs; k++ )
       {
-      VectorType proj = this->m_MatrixP * this->m_VariatesP.get_column( k );
+      VectorType proj = this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( k ) );
       double     denom =  inner_product( proj, proj );  if( denom < this->m_Epsilon )
         {
         denom = 1.e9;
@@ -1743,7 +2277,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         ptemp = ptemp / ptemp.two_norm();
         }
       MatrixType pmod = this->m_MatrixP;
-      VectorType pveck  = pmod.transpose() * ( pmod  * ptemp ); // classic
+      VectorType pveck  = this->NormalMatrixVectorProduct( pmod, ptemp ); // classic
       RealType   hkkm1 = pveck.two_norm();
       if( hkkm1 > this->m_Epsilon  )
         {
@@ -1918,7 +2452,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       matrixB.set_column( a, zerob );  //  if  X =  U V^T  + Error   then   matrixB = U
       MatrixType tempMatrix = this->m_VariatesP;
       tempMatrix.set_column( a, zero );
-      MatrixType partialmatrix = matrixB * tempMatrix.transpose();
+      MatrixType partialmatrix = this->MatrixMatrixTransposeProduct( matrixB, tempMatrix );
       for(  unsigned int interc = 0; interc < this->m_MatrixP.rows(); interc++ )
         {
         partialmatrix.set_row( interc, partialmatrix.get_row( interc ) + icept( interc ) );
@@ -1994,7 +2528,6 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     rayquo = inner_product( proj, proj  ) / denom;
     }
-  MatrixType   At = A.transpose();
   unsigned int powerits = 0;
   VectorType   bestevec = evec;
   RealType     basevscale = 1;
@@ -2003,7 +2536,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   while( ( ( powerits < maxits ) && ( rayquo > rayquold ) ) || ( powerits < 4 ) )
     {
     VectorType pvec = this->FastOuterProductVectorMultiplication( prior , evec );
-    VectorType nvec   = ( At   * ( A    * evec ) );
+    VectorType nvec   = this->NormalMatrixVectorProduct( A, evec );
     if ( powerits == 0 )
       {
       basevscale = pvec.two_norm() / nvec.two_norm() * this->m_GradStep;
@@ -2037,7 +2570,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     if( denom > 0 )
       {
       // fast way to compute   evec^T * (  A^T A + M M^T ) evec
-      proj =  ( At   * ( A    * evec ) ) * basevscale +
+      proj =  this->NormalMatrixVectorProduct( A, evec ) * basevscale +
 	( this->FastOuterProductVectorMultiplication( prior , evec ) ) * basepscale;
       rayquo = inner_product( evec, proj  ) / denom;
       }
@@ -2155,7 +2688,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     { // estimate sparseness from PCA
       if ( ! this->m_Silent )  std::cout << " data-driven initialization from PCA " << std::endl;
       VectorType maxvals( this->m_MatrixP.cols() , 0 );
-      MatrixType        cov = this->m_MatrixP * this->m_MatrixP.transpose();
+      MatrixType        cov = this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP );
       vnl_svd<RealType> eig( cov, 1.e-6 );
       this->m_VariatesP.set_size( this->m_MatrixP.cols(), n_vecs );
       this->m_VariatesP.fill( 0 );
@@ -2164,7 +2697,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     	  if( i < this->m_MatrixP.rows() )
     	    {
     	    VectorType u = eig.U().get_column( i );
-    	    VectorType up = u * this->m_MatrixP;
+    	    VectorType up = this->MatrixTransposeVectorProduct( this->m_MatrixP, u );
     	    up = up / up.two_norm();
     	    this->m_VariatesP.set_column( i, up );
     	    }
@@ -2258,7 +2791,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       matrixB.set_column( a, zerob );
       MatrixType tempMatrix = this->m_VariatesP;
       tempMatrix.set_column( a, zero );
-      MatrixType partialmatrix = matrixB * tempMatrix.transpose();
+      MatrixType partialmatrix = this->MatrixMatrixTransposeProduct( matrixB, tempMatrix );
       for(  unsigned int interc = 0; interc < this->m_MatrixP.rows(); interc++ )
 	      {
         partialmatrix.set_row( interc,
@@ -2343,7 +2876,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     evec = this->InitializeV( this->m_MatrixP, true );
     }
-  VectorType proj = ( A * evec  );
+  VectorType proj = this->MatrixVectorProduct( A, evec );
   VectorType lastgrad = evec;
   RealType   rayquo = 0, rayquold = -1;
   RealType   denom = inner_product( evec, evec );
@@ -2351,13 +2884,12 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     rayquo = inner_product( proj, proj  ) / denom;
     }
-  MatrixType   At = A.transpose();
   unsigned int powerits = 0;
   bool         conjgrad = true;
   VectorType   bestevec = evec;
   while( ( ( rayquo > rayquold ) && ( powerits < maxits ) )  )
     {
-    VectorType nvec = At * proj;
+    VectorType nvec = this->MatrixTransposeVectorProduct( A, proj );
     for( unsigned int orth = 0; orth < maxorth; orth++ )
       {
       nvec = this->Orthogonalize( nvec, this->m_VariatesP.get_column( orth ) );
@@ -2379,7 +2911,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       evec = evec / evec.two_norm();
       }
-    proj = ( A * evec  );
+    proj = this->MatrixVectorProduct( A, evec );
     rayquold = rayquo;
     denom = inner_product( evec, evec );
     if( denom > 0 )
@@ -2412,7 +2944,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   MatrixType matrixB( this->m_OriginalMatrixP.rows(), n_vecs );
   matrixB.fill( 0 );
   this->m_MatrixP = this->NormalizeMatrix( this->m_OriginalMatrixP );
-  MatrixType        cov = this->m_MatrixP * this->m_MatrixP.transpose();
+  MatrixType        cov = this->MatrixMatrixTransposeProduct( this->m_MatrixP, this->m_MatrixP );
   vnl_svd<RealType> eig( cov, 1.e-6 );
   this->m_VariatesP.set_size( this->m_MatrixP.cols(), n_vecs );
   this->m_VariatesP.fill( 0 );
@@ -2421,7 +2953,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     if( i < this->m_MatrixP.rows() )
       {
       VectorType u = eig.U().get_column( i );
-      VectorType up = u * this->m_MatrixP;
+      VectorType up = this->MatrixTransposeVectorProduct( this->m_MatrixP, u );
       this->SparsifyP( up );
       this->m_VariatesP.set_column( i, up );
       matrixB.set_column( i,  u );
@@ -2458,7 +2990,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       matrixB.set_column( a, zerob );
       MatrixType tempMatrix = this->m_VariatesP;
       tempMatrix.set_column( a, zero );
-      MatrixType partialmatrix = matrixB * tempMatrix.transpose();
+      MatrixType partialmatrix = this->MatrixMatrixTransposeProduct( matrixB, tempMatrix );
       for(  unsigned int interc = 0; interc < this->m_MatrixP.rows(); interc++ )
         {
         partialmatrix.set_row( interc, partialmatrix.get_row( interc ) + icept( interc ) );
@@ -2491,7 +3023,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       VectorType lmsolv = matrixB.get_row( a );                           // good initialization should increase
                                                                           // convergence speed
       (void) this->ConjGrad(  this->m_VariatesP, lmsolv, x_i, 0, 10000 ); // A x = b
-      VectorType x_recon = ( this->m_VariatesP * lmsolv + this->m_Intercept );
+      VectorType x_recon = ( this->MatrixVectorProduct( this->m_VariatesP, lmsolv ) + this->m_Intercept );
       icept( a ) = this->m_Intercept;
       onenorm += x_i.one_norm() / this->m_MatrixP.cols();
       reconerr += ( x_i - x_recon ).one_norm() / this->m_MatrixP.cols();
@@ -2524,7 +3056,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     this->m_MatrixP = this->m_MatrixP - (this->m_MatrixRRt * this->m_MatrixP);
     }
   this->m_VariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
-  MatrixType bmatrix = this->GetCovMatEigenvectors( this->m_MatrixP );
+  MatrixType bmatrix = this->GetCovMatEigenvectors( this->m_MatrixP, n_vecs );
   MatrixType bmatrix_big;
   bmatrix_big.set_size( this->m_MatrixP.cols(), n_vecs );
   //  double trace = vnl_trace<double>(   this->m_MatrixP * this->m_MatrixP.transpose()  );
@@ -2533,7 +3065,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     this->m_VariatesP.set_column( kk, this->InitializeV( this->m_MatrixP )  );
     if( kk < bmatrix.columns() && true )
       {
-      VectorType initv = bmatrix.get_column( kk ) * this->m_MatrixP;
+      VectorType initv = this->MatrixTransposeVectorProduct( this->m_MatrixP, bmatrix.get_column( kk ) );
       this->SparsifyP( initv );
       this->m_VariatesP.set_column( kk, initv );
       }
@@ -2562,7 +3094,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         MatrixType m( this->m_MatrixP.rows(), k, 0 );
         for( unsigned int mm = 0; mm < k; mm++ )
           {
-          m.set_column( mm, this->m_MatrixP * this->m_VariatesP.get_column( mm ) );
+          m.set_column( mm, this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( mm ) ) );
           }
         MatrixType projmat = this->ProjectionMatrix( m, 1.e-8 );
         pmod = pmod - projmat * pmod;
@@ -2570,7 +3102,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       for( unsigned int powerit = 0; powerit < 5; powerit++ )
         {
         pveck = ( pmod * pveck ); // classic
-        pveck  = pmod.transpose() * ( pveck  );
+        pveck  = this->MatrixTransposeVectorProduct( pmod, pveck );
         RealType hkkm1 = pveck.two_norm();
         if( hkkm1 > 0 )
           {
@@ -2616,7 +3148,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       RealType maxcorr = 0;
       for ( unsigned int cc = 0 ; cc < bmatrix_big.cols(); cc ++ )
         {
-        RealType corr = fabs( this->PearsonCorr( this->m_MatrixP * pveck , bmatrix.get_column( cc ) ) );
+        RealType corr = fabs( this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, pveck ) , bmatrix.get_column( cc ) ) );
         if (  corr > maxcorr ) bcolind = cc;
         }
       VectorType b = bmatrix_big.get_column( bcolind ) ;
@@ -2801,7 +3333,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       // the old solution
       VectorType pveck = this->m_VariatesP.get_column(k);
-      pveck  = this->m_MatrixP.transpose() * ( this->m_MatrixP  * pveck );
+      pveck  = this->NormalMatrixVectorProduct( this->m_MatrixP, pveck );
       RealType hkkm1 = pveck.two_norm();
       if( hkkm1 > 0 )
         {
@@ -2860,7 +3392,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     for( unsigned int k = 0; k < n_vecs; k++ )
       {
       VectorType pveck = this->m_SparseVariatesP.get_column(k);
-      pveck  = this->m_MatrixP.transpose() * ( this->m_MatrixP  * pveck );
+      pveck  = this->NormalMatrixVectorProduct( this->m_MatrixP, pveck );
       RealType hkkm1 = pveck.two_norm();
       if( hkkm1 > 0 )
         {
@@ -2934,10 +3466,9 @@ TRealType antsSCCANObject<TInputImage, TRealType>
    */
   bool debug = false;
   // minimize the following error :    \| A^T*A * vec_i -    b \|  +  sparseness_penalty
-  MatrixType At = A.transpose();
   VectorType b = b_in - b_in.mean();
   b = b * A;
-  VectorType r_k = At * ( A * x_k );
+  VectorType r_k = this->NormalMatrixVectorProduct( A, x_k );
   r_k = b - r_k;
   VectorType   p_k = r_k;
   double       approxerr = 1.e9;
@@ -2947,7 +3478,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType     minerr = starterr, deltaminerr = 1, lasterr = starterr * 2;
   while(  deltaminerr > 0 && approxerr > convcrit && ct < maxits )
     {
-    RealType alpha_denom = inner_product( p_k, At * ( A * p_k ) );
+    RealType alpha_denom = inner_product( p_k, this->NormalMatrixVectorProduct( A, p_k ) );
     RealType iprk = inner_product( r_k, r_k );
     if( debug )
       {
@@ -2964,7 +3495,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       }
     VectorType x_k1  = x_k + alpha_k * p_k; // this adds the scaled residual to the current solution
     //    this->SparsifyOther( x_k1 ); // this can be used to approximate NMF
-    VectorType r_k1 =  b - At * (A * x_k1 );
+    VectorType r_k1 =  b - this->NormalMatrixVectorProduct( A, x_k1 );
     approxerr = r_k1.two_norm();
     if( approxerr < minerr )
       {
@@ -3012,7 +3543,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   VectorType x_k1  = x_k + minalph * p_k;
 
   this->SparsifyP( x_k1 );
-  VectorType r_k1 = ( b -  A.transpose() * ( A * x_k1 )  );
+  VectorType r_k1 = ( b - this->NormalMatrixVectorProduct( A, x_k1 )  );
   RealType   e = r_k1.two_norm() + x_k1.two_norm() * lambda;
   return e;
 }
@@ -3131,7 +3662,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   bool     debug = false;
   RealType intercept = 0;
 
-  VectorType   r_k = ( b -  A.transpose() * ( A * x_k ) );
+  VectorType   r_k = ( b - this->NormalMatrixVectorProduct( A, x_k ) );
   VectorType   p_k = r_k;
   double       approxerr = 1.e22;
   unsigned int ct = 0;
@@ -3140,7 +3671,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType     minerr = starterr, deltaminerr = 1;
   while(  deltaminerr > 1.e-4 && minerr > convcrit && ct < maxits )
     {
-    RealType alpha_denom = inner_product( p_k,  A.transpose() * ( A * p_k ) );
+    RealType alpha_denom = inner_product( p_k, this->NormalMatrixVectorProduct( A, p_k ) );
     RealType iprk = inner_product( r_k, r_k );
     RealType alpha_k = iprk / alpha_denom;
     if( debug )
@@ -3173,7 +3704,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       if ( ! this->m_Silent )  std::cout << " xk12n " << x_k1.two_norm() << " alpha_k " << alpha_k << " pk2n " << p_k.two_norm()
                        << std::endl;
       }
-    VectorType proj = A.transpose() * (A * x_k1 );
+    VectorType proj = this->NormalMatrixVectorProduct( A, x_k1 );
     VectorType r_k1 = ( b -  proj );
     if( makeprojsparse  )
       {
@@ -3254,7 +3785,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     }
 
   RealType     intercept = 0;
-  VectorType   r_k = ( b -  A.transpose() * ( A * x_k ) );
+  VectorType   r_k = ( b - this->NormalMatrixVectorProduct( A, x_k ) );
   VectorType   z_k = this->m_PreC * r_k;
   VectorType   p_k = z_k;
   double       approxerr = 1.e22;
@@ -3267,7 +3798,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
          )
     {
     //    RealType spgoal = 100.0 * ( 1 - vnl_math_abs( this->m_FractionNonZeroP ) );
-    RealType alpha_denom = inner_product( p_k,  A.transpose() * ( A * p_k ) );
+    RealType alpha_denom = inner_product( p_k, this->NormalMatrixVectorProduct( A, p_k ) );
     RealType iprk = inner_product( r_k, z_k );
     RealType alpha_k = iprk / alpha_denom;
     RealType best_alph = alpha_k;
@@ -3281,7 +3812,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     // VectorType x_k2( x_k1 );
     // this->CurvatureSparseness( x_k1 , spgoal , 500 );
     //    x_k1 = x_k2;
-    VectorType proj = A.transpose() * (A * x_k1 );
+    VectorType proj = this->NormalMatrixVectorProduct( A, x_k1 );
     VectorType r_k1 = ( b -  proj ) - x_k1 * 100;
     //    this->CurvatureSparseness( r_k1 , spgoal , A , b , 5 );
     approxerr = r_k1.two_norm();
@@ -3334,7 +3865,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       evec = evec / evec.two_norm();
       }
-    evec = ( A.transpose() ) * ( A * evec ); // power iteration
+    evec = this->NormalMatrixVectorProduct( A, evec ); // power iteration
     for( unsigned int orth = 0; orth < n_vecs; orth++ )
       {
       evec = this->Orthogonalize( evec, this->m_VariatesP.get_column( orth ) );
@@ -3349,7 +3880,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     evec = evec / evec.two_norm();
     }
-  return inner_product( A * evec, A * evec );
+  const VectorType proj = this->MatrixVectorProduct( A, evec );
+  return inner_product( proj, proj );
 }
 
 template <class TInputImage, class TRealType>
@@ -3372,7 +3904,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     evec = this->InitializeV( this->m_MatrixP, false );
     }
-  VectorType proj = ( A * evecin  );
+  VectorType proj = this->MatrixVectorProduct( A, evecin );
   VectorType lastgrad = evecin;
   RealType   rayquo = 0;
   RealType   denom = inner_product( evecin, evecin );
@@ -3381,7 +3913,6 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     rayquo = inner_product( proj, proj  ) / denom;
     } else if ( ! this->m_Silent )  std::cout << "Denom < 0: probable trouble." << std::endl;
   RealType     bestrayquo = 0;
-  MatrixType   At = A.transpose();
   unsigned int powerits = 0;
   bool         conjgrad = true;
   VectorType   bestevec = evecin;
@@ -3390,7 +3921,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   while(  ( ( rayquo > bestrayquo ) && ( powerits < maxits ) )  || powerits < 2 )
   // while ( ( relfac > 1.e-4  )  && ( powerits < maxits ) )
     {
-    VectorType nvec = At * proj;
+    VectorType nvec = this->MatrixTransposeVectorProduct( A, proj );
     RealType gamma = 0.1;
     //    nvec = this->SpatiallySmoothVector( nvec, this->m_MaskImageP );
     if ( powerits == 0 ) di = nvec;
@@ -3419,7 +3950,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       evec = evec / evec.two_norm();
       }
-    proj = ( A * evec  );
+    proj = this->MatrixVectorProduct( A, evec );
     denom = inner_product( evec, evec );
     if( denom > 0 )
       {
@@ -3455,9 +3986,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   VectorType proj = evecin;
   RealType   rayquo = 0;
   RealType     bestrayquo = 0;
-  MatrixType   At = A.transpose();
-  VectorType lastgrad = At * proj;
-  VectorType evec = At * proj;
+  VectorType lastgrad = this->MatrixTransposeVectorProduct( A, proj );
+  VectorType evec = this->MatrixTransposeVectorProduct( A, proj );
   RealType   denom = inner_product( evec, evec );
   if( denom > 0 )
     {
@@ -3470,7 +4000,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   VectorType di;
   while(  ( ( rayquo > bestrayquo ) && ( powerits < maxits ) )  || powerits < 2 )
     {
-    VectorType nvec = At * proj;
+    VectorType nvec = this->MatrixTransposeVectorProduct( A, proj );
     RealType gamma = 0.1;
     if ( powerits == 0 ) di = nvec;
     if( ( lastgrad.two_norm() > 0  ) && ( conjgrad ) )
@@ -3493,7 +4023,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       evec = evec / evec.two_norm();
       }
-    proj = ( A * evec  );
+    proj = this->MatrixVectorProduct( A, evec );
     denom = inner_product( evec, evec );
     if( denom > 0 )
       {
@@ -3563,10 +4093,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       VectorType ptemp = this->m_VariatesP.get_column(k);
       VectorType qtemp = this->m_VariatesQ.get_column(k);
-      VectorType pveck = this->m_MatrixQ * qtemp;
-      VectorType qveck = this->m_MatrixP * ptemp;
-      pveck = pveck * this->m_MatrixP;
-      qveck = qveck * this->m_MatrixQ;
+      VectorType pveck = this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
+      VectorType qveck = this->MatrixVectorProduct( this->m_MatrixP, ptemp );
+      pveck = this->MatrixTransposeVectorProduct( this->m_MatrixP, pveck );
+      qveck = this->MatrixTransposeVectorProduct( this->m_MatrixQ, qveck );
       for( unsigned int j = 0; j < k; j++ )
         {
         VectorType qj = this->m_VariatesP.get_column(j);  // this->ZeroProduct( pveck, qj );
@@ -3581,8 +4111,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       this->m_VariatesP.set_column( k, pveck );
       this->m_VariatesQ.set_column( k, qveck );
       this->NormalizeWeightsByCovariance( k, taup, tauq );
-      VectorType proj1 =  this->m_MatrixP * this->m_VariatesP.get_column( k );
-      VectorType proj2 =  this->m_MatrixQ * this->m_VariatesQ.get_column( k );
+      VectorType proj1 =  this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( k ) );
+      VectorType proj2 =  this->MatrixVectorProduct( this->m_MatrixQ, this->m_VariatesQ.get_column( k ) );
       this->m_CanonicalCorrelations[k] = this->PearsonCorr( proj1, proj2  );
       }
     this->SortResults( n_vecs );
@@ -3628,8 +4158,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
                    typename antsSCCANObject<TInputImage, TRealType>::VectorType  b,
                    TRealType lambda, unsigned int maxits, bool makesparse )
 {
-  MatrixType At = A.transpose();
-  VectorType r_k = At * ( A * x_k );
+  VectorType r_k = this->NormalMatrixVectorProduct( A, x_k );
 
   r_k = b - r_k - x_k * lambda;
   VectorType   p_k = r_k;
@@ -3640,7 +4169,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType     minerr = starterr, deltaminerr = 1, lasterr = starterr * 2;
   while(  deltaminerr > 1.e-4 && approxerr > 0 && ct < maxits )
     {
-    RealType alpha_denom = inner_product( p_k, At * ( A * p_k ) );
+    RealType alpha_denom = inner_product( p_k, this->NormalMatrixVectorProduct( A, p_k ) );
     RealType iprk = inner_product( r_k, r_k );
     if( alpha_denom < 1.e-12 )
       {
@@ -3649,8 +4178,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     RealType   alpha_k = iprk / alpha_denom;
     VectorType x_k1  = x_k + alpha_k * p_k; // this adds the scaled residual to the current solution
     x_k1  = x_k + alpha_k * p_k * .2;       // this adds the scaled residual to the current solution
-    VectorType r_k1 =  b - At * (A * x_k1 ) - x_k1 * lambda;
-    approxerr =  (b - At * (A * x_k1 ) ).two_norm() + x_k1.two_norm() * lambda;
+    VectorType r_k1 =  b - this->NormalMatrixVectorProduct( A, x_k1 ) - x_k1 * lambda;
+    approxerr =  (b - this->NormalMatrixVectorProduct( A, x_k1 ) ).two_norm() + x_k1.two_norm() * lambda;
     if( approxerr < minerr )
       {
       minerr = approxerr; bestsol = ( x_k1 );
@@ -3690,7 +4219,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if( this->m_OriginalMatrixR.size() > 0 )
     {
     this->m_MatrixRRt = this->ProjectionMatrix( this->m_OriginalMatrixR );
-    this->m_MatrixP = this->m_MatrixP - ( this->m_MatrixRRt * this->m_MatrixP );
+    // the projection matrix is symmetric
+    this->m_MatrixP = this->m_MatrixP - this->MatrixTransposeMatrixProduct( this->m_MatrixRRt, this->m_MatrixP );
     }
   MatrixType nspaceevecs = this->GetCovMatEigenvectors( this->m_MatrixP );
   VectorType nspaceevals = this->m_Eigenvalues;
@@ -3795,66 +4325,208 @@ void antsSCCANObject<TInputImage, TRealType>
 
 template <class TInputImage, class TRealType>
 void antsSCCANObject<TInputImage, TRealType>
-::LASSO_alg(  typename antsSCCANObject<TInputImage, TRealType>::MatrixType& X,
-              typename antsSCCANObject<TInputImage, TRealType>::VectorType& y,
-              typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta_lasso, TRealType gamma,
-              unsigned int maxits )
+::InitializeLASSO( LASSOState & state, typename antsSCCANObject<TInputImage, TRealType>::MatrixType& X,
+                   const typename antsSCCANObject<TInputImage, TRealType>::VectorType& y,
+                   const typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta )
 {
-  VectorType   ypred;
-  VectorType   yresid;
-  RealType     besterr = 1.e20;
-  RealType     curerr = besterr;
-  unsigned int added = 0;
+  const unsigned int n = X.rows();
+  const unsigned int p = X.cols();
 
-  for( unsigned int its = 0; its < maxits; its++ )
+  state.X = &X;
+  state.Mean.set_size( p );
+  state.Mean.fill( 0 );
+  state.SquaredNorm.set_size( p );
+  state.SquaredNorm.fill( 0 );
+  for( unsigned int i = 0; i < n; i++ )
     {
-    added = 0;
-    ypred = X * beta_lasso;
-    for( unsigned int j = 0; j < beta_lasso.size(); j++ )
+    const RealType *row = X[i];
+    for( unsigned int j = 0; j < p; j++ )
       {
-      VectorType xj = X.get_column( j );
-      ypred = ypred - xj * beta_lasso( j );
-
-      RealType regbeta = this->SimpleRegression( y, ypred );
-      yresid = y - ( ypred * regbeta + this->m_Intercept );
+      state.Mean( j ) += row[j];
+      state.SquaredNorm( j ) += row[j] * row[j];
+      }
+    }
+  state.Mean /= static_cast<RealType>( n );
+  for( unsigned int j = 0; j < p; j++ )
+    {
+    state.SquaredNorm( j ) -= static_cast<RealType>( n ) * state.Mean( j ) * state.Mean( j );
+    }
 
-      RealType beta = beta_lasso( j );
-      for( unsigned int i = 0; i < xj.size(); i++ )
+  // the centered columns sum to zero, so Xc^T yc = X^T yc
+  VectorType yc = y - y.mean();
+  state.Correlation = this->MatrixTransposeVectorProduct( X, yc );
+  state.Tolerance = 1.e-7 * yc.squared_magnitude();
+  state.Gram.clear();
+  state.GramIndex.assign( p, -1 );
+  for( unsigned int j = 0; j < p; j++ )
+    {
+    if( beta( j ) != 0 )
+      {
+      const VectorType & gram = this->GetLASSOGramColumn( state, j );
+      for( unsigned int k = 0; k < p; k++ )
         {
-        beta += ( xj( i ) * yresid( i ) );
+        state.Correlation( k ) -= gram( k ) * beta( j );
         }
-      beta = this->LASSOSoft( beta, gamma );
-      ypred = ypred + xj * beta;
-      regbeta = this->SimpleRegression( y, ypred );
-      yresid = y - ( ypred * regbeta + this->m_Intercept );
+      }
+    }
+}
 
-      RealType sparseness = gamma * ( beta_lasso.one_norm() + fabs( beta ) - fabs( beta_lasso( j ) ) );
-      curerr = yresid.two_norm() * 0.5 + sparseness;  /** Eq 7 Friedman pathwise */
-      // if ( ! this->m_Silent )  std::cout << "Err: " << yresid.one_norm() * n  << " sp: " << sparseness << " cur " << curerr << " best "
-      // << besterr << std::endl;
-      if( curerr < besterr )
-        {
-        beta_lasso( j ) = beta;
-        besterr = curerr;
-        }
-      else
+template <class TInputImage, class TRealType>
+const typename antsSCCANObject<TInputImage, TRealType>::VectorType &
+antsSCCANObject<TInputImage, TRealType>
+::GetLASSOGramColumn( LASSOState & state, unsigned int j )
+{
+  if( state.GramIndex[j] < 0 )
+    {
+    const MatrixType & X = *state.X;
+    VectorType         xj = X.get_column( j );
+    VectorType         gram = this->MatrixTransposeVectorProduct( X, xj );
+    gram -= state.Mean * ( static_cast<RealType>( X.rows() ) * state.Mean( j ) );
+    state.GramIndex[j] = state.Gram.size();
+    state.Gram.push_back( gram );
+    }
+  return state.Gram[state.GramIndex[j]];
+}
+
+template <class TInputImage, class TRealType>
+TRealType antsSCCANObject<TInputImage, TRealType>
+::LASSOSweep( LASSOState & state, typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta,
+              TRealType gamma, const std::vector<unsigned int> & coordinates )
+{
+  const unsigned int p = beta.size();
+  RealType           maxchange = 0;
+
+  for( unsigned int c = 0; c < coordinates.size(); c++ )
+    {
+    const unsigned int j = coordinates[c];
+    const RealType     sqnorm = state.SquaredNorm( j );
+    if( sqnorm <= this->m_Epsilon )
+      {
+      continue;
+      }
+    const RealType newbeta = this->LASSOSoft( state.Correlation( j ) + sqnorm * beta( j ), gamma ) / sqnorm;
+    const RealType delta = newbeta - beta( j );
+    if( delta == 0 )
+      {
+      continue;
+      }
+    const VectorType & gram = this->GetLASSOGramColumn( state, j );
+    for( unsigned int k = 0; k < p; k++ )
+      {
+      state.Correlation( k ) -= gram( k ) * delta;
+      }
+    beta( j ) = newbeta;
+    maxchange = vnl_math_max( maxchange, sqnorm * delta * delta );
+    }
+  return maxchange;
+}
+
+template <class TInputImage, class TRealType>
+void antsSCCANObject<TInputImage, TRealType>
+::LASSOCoordinateDescent( LASSOState & state, typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta,
+                          TRealType gamma, TRealType previousGamma, unsigned int maxits )
+{
+  const unsigned int p = beta.size();
+
+  if( previousGamma <= 0 )
+    {
+    previousGamma = state.Correlation.inf_norm();
+    }
+  /** sequential strong rule, Tibshirani et al. 2012 */
+  const RealType             screen = 2 * gamma - previousGamma;
+  std::vector<bool>          strong( p, false );
+  std::vector<unsigned int>  strongset;
+  for( unsigned int j = 0; j < p; j++ )
+    {
+    if( beta( j ) != 0 || fabs( state.Correlation( j ) ) >= screen )
+      {
+      strong[j] = true;
+      strongset.push_back( j );
+      }
+    }
+
+  unsigned int its = 0;
+  while( its < maxits )
+    {
+    RealType change = this->LASSOSweep( state, beta, gamma, strongset );
+    its++;
+    if( change <= state.Tolerance )
+      {
+      // add the screened variables that violate the KKT conditions
+      bool violated = false;
+      for( unsigned int j = 0; j < p; j++ )
         {
-        ypred = ypred - xj * beta;
-        ypred = ypred + xj * beta_lasso( j );
+        if( !strong[j] && fabs( state.Correlation( j ) ) > gamma )
+          {
+          strong[j] = true;
+          strongset.push_back( j );
+          violated = true;
+          }
         }
-      if( fabs( beta_lasso( j ) ) > 0 )
+      if( !violated )
         {
-        added++;
+        break;
         }
-      if( j % 1000 == 0 && false )
+      continue;
+      }
+    std::vector<unsigned int> activeset;
+    for( unsigned int c = 0; c < strongset.size(); c++ )
+      {
+      if( beta( strongset[c] ) != 0 )
         {
-        if ( ! this->m_Silent )  std::cout << "progress: " << 100 * j / X.cols() <<  " lasso-loop " << its << " : " <<  besterr
-                         << " num_vars_added " << added << std::endl;
+        activeset.push_back( strongset[c] );
         }
       }
-    //    if ( ! this->m_Silent )  std::cout <<  " lasso-iteration: " << its << " minerr: " <<  besterr << " num_vars_added: " << added
-    //  << std::endl;
-    } // iterations
+    while( its < maxits && change > state.Tolerance )
+      {
+      change = this->LASSOSweep( state, beta, gamma, activeset );
+      its++;
+      }
+    }
+}
+
+template <class TInputImage, class TRealType>
+void antsSCCANObject<TInputImage, TRealType>
+::LASSO_alg(  typename antsSCCANObject<TInputImage, TRealType>::MatrixType& X,
+              typename antsSCCANObject<TInputImage, TRealType>::VectorType& y,
+              typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta_lasso, TRealType gamma,
+              unsigned int maxits )
+{
+  LASSOState state;
+
+  this->InitializeLASSO( state, X, y, beta_lasso );
+  this->LASSOCoordinateDescent( state, beta_lasso, gamma, 0, maxits );
+}
+
+template <class TInputImage, class TRealType>
+void antsSCCANObject<TInputImage, TRealType>
+::LASSO_Path(  typename antsSCCANObject<TInputImage, TRealType>::MatrixType& X,
+               typename antsSCCANObject<TInputImage, TRealType>::VectorType& y,
+               typename antsSCCANObject<TInputImage, TRealType>::VectorType& beta_lasso, TRealType gamma,
+               unsigned int maxits, unsigned int pathLength )
+{
+  LASSOState state;
+
+  this->InitializeLASSO( state, X, y, beta_lasso );
+  const RealType gammamax = state.Correlation.inf_norm();
+  if( gamma >= gammamax || pathLength <= 1 )
+    {
+    this->LASSOCoordinateDescent( state, beta_lasso, gamma, 0, maxits );
+    return;
+    }
+  const RealType gammamin = vnl_math_max( gamma, static_cast<RealType>( 1.e-3 ) * gammamax );
+  const RealType ratio = std::pow( gammamin / gammamax, static_cast<RealType>( 1 ) / ( pathLength - 1 ) );
+  RealType       previousGamma = gammamax;
+  for( unsigned int i = 1; i < pathLength; i++ )
+    {
+    const RealType pathGamma = ( i + 1 == pathLength ) ? gammamin : previousGamma * ratio;
+    this->LASSOCoordinateDescent( state, beta_lasso, pathGamma, previousGamma, maxits );
+    previousGamma = pathGamma;
+    }
+  if( gamma < gammamin )
+    {
+    this->LASSOCoordinateDescent( state, beta_lasso, gamma, previousGamma, maxits );
+    }
 }
 
 template <class TInputImage, class TRealType>
@@ -3940,7 +4612,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 
     /**  train the lasso + regression model */
     VectorType beta_lasso(  matrixP.cols(), 0 );
-    this->LASSO_alg( matrixP, y, beta_lasso, gamma, 2 );
+    this->LASSO_Path( matrixP, y, beta_lasso, gamma, 100 );
     VectorType ypred = matrixP * beta_lasso;
     RealType   regbeta = this->SimpleRegression( yreal, ypred );
     RealType   intercept = yreal.mean() - ypred.mean() * regbeta;
@@ -3998,7 +4670,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   for( unsigned int i = 0; i < 1; i++ )
     {
     if ( ! this->m_Silent )  std::cout << i << std::endl;
-    this->LASSO_alg( this->m_MatrixP, y, beta_lasso, gamma, this->m_MaximumNumberOfIterations );
+    this->LASSO_Path( this->m_MatrixP, y, beta_lasso, gamma, this->m_MaximumNumberOfIterations );
     //    RealType spgoal =  ( RealType ) n_vecs ;
     // this->CurvatureSparseness( beta_lasso , spgoal , 100 );
     }
@@ -4048,14 +4720,13 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType lambda = 1.e2;
   if ( ! this->m_Silent )  std::cout << "SparseConjGradRidgeRegression: lambda " << lambda << " Soft? " <<   this->m_UseL1 << " fnp "
                    << this->m_FractionNonZeroP << std::endl;
-  MatrixType At = A.transpose();
   VectorType b( b_in );
   /** The data term b = b_n * A may be noisy.  here we optionally add a penalty
    *    \kappa \| \nabla b \|^2
    *   which smooths the data term and eases optimization
    */
   this->CurvatureSparseness( b, spgoal, 10 , this->m_MaskImageP );
-  VectorType r_k = At * ( A * x_k );
+  VectorType r_k = this->NormalMatrixVectorProduct( A, x_k );
   /** this is the gradient of the objective :
    *    \| b -  A^T A x \|  + \lambda \| x \|^2
    */
@@ -4078,7 +4749,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     /** standard conjugate gradient defintion of \alpha_k and p_k
      *  see http://www.matematicas.unam.mx/gfgf/cg2010/HISTORY-conjugategradient.pdf
      */
-    RealType alpha_denom = inner_product( p_k, At * ( A * p_k ) );
+    RealType alpha_denom = inner_product( p_k, this->NormalMatrixVectorProduct( A, p_k ) );
     RealType iprk = inner_product( r_k, r_k );
     if( alpha_denom < 1.e-12 )
       {
@@ -4104,11 +4775,11 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       /** use a hard thresholding on the update to enforce l_0 */
       this->SparsifyP( x_k1  );
       }
-    RealType dataterm =  (b - At * (A * x_k1 ) ).two_norm();
+    RealType dataterm =  (b - this->NormalMatrixVectorProduct( A, x_k1 ) ).two_norm();
     // VectorType r_k1 =  b - At * (A * x_k1 ) + gradvec * lambda;
     // approxerr = dataterm + gradnorm * lambda;
     /** compute the new gradient term */
-    VectorType r_k1 =  b - At * (A * x_k1 ) - x_k1 * lambda; // ridge
+    VectorType r_k1 =  b - this->NormalMatrixVectorProduct( A, x_k1 ) - x_k1 * lambda; // ridge
     approxerr = dataterm + x_k1.two_norm() * lambda;
     if( approxerr < minerr )
       {
@@ -4124,8 +4795,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       x_k1  = x_k + alpha_k * p_k;
       this->CurvatureSparseness( x_k1, spgoal, 5, this->m_MaskImageP  );
       this->SparsifyP( x_k1 );
-      dataterm =  (b - At * (A * x_k1 ) ).two_norm();
-      r_k1 =  b - At * (A * x_k1 ) - x_k1 * lambda; // ridge
+      dataterm =  (b - this->NormalMatrixVectorProduct( A, x_k1 ) ).two_norm();
+      r_k1 =  b - this->NormalMatrixVectorProduct( A, x_k1 ) - x_k1 * lambda; // ridge
       approxerr = dataterm + x_k1.two_norm() * lambda;
       if( approxerr < minerr )
         {
@@ -4168,9 +4839,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     }
   vnl_diag_matrix<TRealType> mudiag( A.cols(), mu );
   RealType                   lambda = 0.e2;
-  MatrixType                 At = A.transpose();
   VectorType                 b( b_in );
-  VectorType                 p_k = At * ( A * x_k );
+  VectorType                 p_k = this->NormalMatrixVectorProduct( A, x_k );
   p_k = b - p_k - x_k * lambda;
   VectorType   curdir = p_k;
   VectorType   lastdir = p_k;
@@ -4226,7 +4896,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       this->SparsifyQ( x_k1 );
       gradvec = this->ComputeVectorLaplacian( x_k1, this->m_MaskImageQ );
       }
-    VectorType update = At * (A * x_k1 ) - mudiag * x_k1;
+    VectorType update = this->NormalMatrixVectorProduct( A, x_k1 ) - mudiag * x_k1;
     RealType   dataterm =  (b - update ).two_norm();
     lastgrad = p_k;
     p_k =  b - update - x_k1 * lambda + gradvec * 0.e4; // ridge
@@ -4588,7 +5258,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       MatrixType m( this->m_MatrixP.rows(), locind - baseind , 0 );
       for( unsigned int mm = baseind; mm < locind; mm++ )
   {
-        m.set_row( mm, this->m_MatrixP * this->m_VariatesP.get_column( mm ) );
+        m.set_row( mm, this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( mm ) ) );
   }
       MatrixType projmat = this->ProjectionMatrix( m, 1.e-2 );
       pmod = pmod - projmat * pmod;
@@ -4600,17 +5270,17 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     MatrixType A = this->m_MatrixP * this->m_VariatesP.get_n_columns( baseind , whichevec  );
     VectorType lmsolv( A.cols() , 1 );
-    VectorType bproj = this->m_MatrixP * b;
+    VectorType bproj = this->MatrixVectorProduct( this->m_MatrixP, b );
     this->ConjGrad(  A ,  lmsolv, bproj , 0, 10000 );
     bproj = bproj - A * lmsolv;
-    bp = bproj * this->m_MatrixP;
+    bp = this->MatrixTransposeVectorProduct( this->m_MatrixP, bproj );
     for( unsigned int vv = 0; vv < bp.size(); vv++ )
       if ( colind % 2 == 0 & bp( vv ) > 0 ) bp( vv ) = 0;
       else if ( colind % 2 > 0 & bp( vv ) < 0 ) bp( vv ) = 0;
     }
 
     VectorType bnspace = this->m_MatrixP * this->m_Eigenvectors.get_column( colind );
-    if ( ! this->m_Silent )  std::cout << " vecerr-a " << this->PearsonCorr( this->m_MatrixP * x_k , bnspace )<< " norm " << ( this->m_MatrixP * x_k - bnspace ).two_norm() << std::endl;
+    if ( ! this->m_Silent )  std::cout << " vecerr-a " << this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, x_k ) , bnspace )<< " norm " << ( this->MatrixVectorProduct( this->m_MatrixP, x_k ) - bnspace ).two_norm() << std::endl;
     if ( ! this->m_Silent )  std::cout << " vecerr-a-init " <<  this->PearsonCorr( this->m_MatrixP * variatesInit.get_column( colind ) , bnspace ) << " norm " <<  ( this->m_MatrixP * variatesInit.get_column( colind ) - bnspace ).two_norm() << std::endl;
     if ( ! this->m_Silent )  std::cout << " col " << colind << " of  " <<  n_vecs << " nspaceevecssz " << nspaceevecs.cols() << " mnv " << x_k.min_value() << " mxv " << x_k.max_value() << " colind " << colind << std::endl;
 
@@ -4710,7 +5380,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     }
   this->m_VariatesP.set_size( this->m_MatrixP.cols(), n_vecs * 2 );
 
-  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP );
+  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP, n_vecs );
   if ( ! this->m_Silent )  std::cout << "got initial svd " << std::endl;
   m_Eigenvectors.set_size( this->m_MatrixP.cols(), n_vecs * 2 );
   unsigned int svdct = 0;
@@ -4719,8 +5389,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     if( kk < init.columns() )
       {
-      VectorType initvpos = init.get_column(kk) * this->m_MatrixP;
-      VectorType initvneg = init.get_column(kk) * this->m_MatrixP;
+      VectorType initvpos = this->MatrixTransposeVectorProduct( this->m_MatrixP, init.get_column(kk) );
+      VectorType initvneg = this->MatrixTransposeVectorProduct( this->m_MatrixP, init.get_column(kk) );
       if( true )
         {
         for( unsigned int vv = 0; vv < initvneg.size(); vv++ )
@@ -4795,28 +5465,26 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if( this->m_OriginalMatrixR.size() > 0 )
     {
     this->m_MatrixRRt = this->ProjectionMatrix(this->m_OriginalMatrixR);
-    this->m_MatrixP = this->m_MatrixP - (this->m_MatrixRRt * this->m_MatrixP);
+    // the projection matrix is symmetric
+    this->m_MatrixP = this->m_MatrixP - this->MatrixTransposeMatrixProduct( this->m_MatrixRRt, this->m_MatrixP );
     }
   this->m_ClusterSizes.set_size(n_vecs);
   this->m_ClusterSizes.fill(0);
-  double trace = 0;
-  for( unsigned int i = 0; i < this->m_MatrixP.cols(); i++ )
-    {
-    trace += inner_product(this->m_MatrixP.get_column(i), this->m_MatrixP.get_column(i) );
-    }
+  // trace of P^T P, without copying the columns of P
+  const double trace = vnl_math_sqr( static_cast<double>( this->m_MatrixP.frobenius_norm() ) );
   this->m_VariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   VariateType myGradients;
   this->m_SparseVariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   this->m_SparseVariatesP.fill(0);
   myGradients.set_size(this->m_MatrixP.cols(), n_vecs);
   myGradients.fill(0);
-  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP );
+  MatrixType init = this->GetCovMatEigenvectors( this->m_MatrixP, n_vecs );
   for( unsigned int kk = 0; kk < n_vecs; kk++ )
     {
     this->m_VariatesP.set_column(kk, this->InitializeV(this->m_MatrixP) );
     if( kk < init.columns() )
       {
-      VectorType initv = init.get_column(kk) * this->m_MatrixP;
+      VectorType initv = this->MatrixTransposeVectorProduct( this->m_MatrixP, init.get_column(kk) );
       this->m_VariatesP.set_column(kk, initv);
       this->m_SparseVariatesP.set_column(kk, initv);
       }
@@ -4847,8 +5515,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         }
       //      for ( unsigned int i=0; i<k; i++) pveck = this->Orthogonalize(pveck, this->m_VariatesP.get_column(i) );
       RealType   alpha = 0.1;
-      VectorType resid = init.get_column(k) - this->m_MatrixP * pveck;
-      VectorType newsol = this->m_SparseVariatesP.get_column(k) +  this->m_MatrixP.transpose() * resid * alpha;
+      VectorType resid = init.get_column(k) - this->MatrixVectorProduct( this->m_MatrixP, pveck );
+      VectorType newsol = this->m_SparseVariatesP.get_column(k) +  this->MatrixTransposeVectorProduct( this->m_MatrixP, resid ) * alpha;
       this->m_SparseVariatesP.set_column(k, newsol);
       if( fnp < 1 )
         {
@@ -4920,13 +5588,13 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     VectorType u = this->m_VariatesP.get_column(i);
     //    vnl_diag_matrix<TRealType> indicator(this->m_MatrixP.cols(),1);
     //    for ( unsigned int j=0; j< u.size(); j++) if ( fabs(u(j)) <= this->m_Epsilon ) indicator(j,j)=0;
-    VectorType proj = this->m_MatrixP.transpose() * ( this->m_MatrixP * u );
+    VectorType proj = this->NormalMatrixVectorProduct( this->m_MatrixP, u );
     double     eigenvalue_i = 0;
     double     p2n = proj.two_norm();
     double     oeig = p2n;
-    proj =  this->m_MatrixP * u;
+    proj =  this->MatrixVectorProduct( this->m_MatrixP, u );
     eigenvalue_i = oeig;
-    u = this->m_MatrixP * u;
+    u = this->MatrixVectorProduct( this->m_MatrixP, u );
     double unorm = u.two_norm();
     if( unorm >  0 )
       {
@@ -4935,7 +5603,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     // factor out the % of the eigenvector that is not orthogonal to higher ranked eigenvectors
     for( unsigned int j = 0; j < i; j++ )
       {
-      VectorType v = this->m_MatrixP * this->m_VariatesP.get_column(j);
+      VectorType v = this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column(j) );
       if( v.two_norm() >  0 )
         {
         v = v / v.two_norm();
@@ -4981,7 +5649,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     RealType a = ptemp.frobenius_norm();
     RealType b = m.frobenius_norm();
     //    m=m*(a/b);
-    RealType hypod = inner_product(this->m_VariatesQ.get_column(i), this->m_MatrixP * this->m_VariatesP.get_column(i) );
+    RealType hypod = inner_product(this->m_VariatesQ.get_column(i), this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column(i) ) );
     if ( ! this->m_Silent )  std::cout << " hypod " << hypod << " a " << a << " b " << b << " a/b " << a / b << " " << std::endl;
     ptemp = ptemp + m * a;
     }
@@ -4991,15 +5659,31 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 template <class TInputImage, class TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::MatrixType
 antsSCCANObject<TInputImage, TRealType>
-::GetCovMatEigenvectors( typename antsSCCANObject<TInputImage, TRealType>::MatrixType rin  )
+::GetCovMatEigenvectors( typename antsSCCANObject<TInputImage, TRealType>::MatrixType rin,
+                         unsigned int numberOfEigenvectors )
 {
+  if( this->m_UseRandomizedSVD && numberOfEigenvectors > 0
+      && numberOfEigenvectors + this->m_RandomizedSVDOversampling < std::min( rin.rows(), rin.cols() ) )
+    {
+    MatrixType U;
+    VectorType singularValues;
+    this->RandomizedSVD( rin, numberOfEigenvectors, U, singularValues );
+    // the eigenvalues of rin rin^T, as returned by the exact path
+    this->m_Eigenvalues = element_product( singularValues, singularValues );
+    if( this->m_Debug && !this->m_Silent )
+      {
+      vnl_svd<RealType> exact( this->MatrixMatrixTransposeProduct( rin, rin ), this->m_PinvTolerance );
+      for( unsigned int i = 0; i < U.cols(); i++ )
+        {
+        std::cout << " randomized-svd " << i << " eval " << this->m_Eigenvalues[i] << " exact " << exact.W( i, i )
+                  << " |cos| " << fabs( dot_product( U.get_column( i ), exact.V().get_column( i ) ) ) << std::endl;
+        }
+      }
+    this->m_Eigenvectors = U;
+    return U;
+    }
   double     pinvTolerance = this->m_PinvTolerance;
-  MatrixType dd = this->NormalizeMatrix(rin);
-  MatrixType cov = dd * dd.transpose();
-
-  cov.set_identity();
-  TRealType regularization = 0;
-  cov = cov * regularization + rin * rin.transpose();
+  MatrixType cov = this->MatrixMatrixTransposeProduct( rin, rin );
   vnl_svd<RealType> eig(cov, pinvTolerance);
   VectorType        vec1 = eig.U().get_column(0);
   VectorType        vec2 = eig.V().get_column(0);
@@ -5057,10 +5741,10 @@ bool antsSCCANObject<TInputImage, TRealType>
     // 0 - vox orth + resid, 1 - only vox orth , 2 - only resid
     if ( ( k > 0 ) && ( this->m_Covering == 0 || this->m_Covering == 2 ) )
       {
-      VectorType temp = this->m_MatrixP * this->m_VariatesP.get_column( k-1 );
+      VectorType temp = this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( k-1 ) );
       this->SparsifyOther( temp );
       if ( k < (this->m_MatrixP.columns()-1) ) this->m_MatrixP = this->OrthogonalizeMatrix( this->m_MatrixP, temp );
-      temp = this->m_MatrixQ * this->m_VariatesQ.get_column( k-1 );
+      temp = this->MatrixVectorProduct( this->m_MatrixQ, this->m_VariatesQ.get_column( k-1 ) );
       this->SparsifyOther( temp );
       if ( n_vecs < this->m_MatrixQ.columns() ) this->m_MatrixQ = this->OrthogonalizeMatrix( this->m_MatrixQ, temp );
       this->m_MatrixP = this->NormalizeMatrix( this->m_MatrixP, false );
@@ -5068,9 +5752,9 @@ bool antsSCCANObject<TInputImage, TRealType>
       }
     VectorType ptemp = this->m_VariatesP.get_column(k);
     VectorType qtemp = this->m_VariatesQ.get_column(k);
-    VectorType pveck = this->m_MatrixQ * qtemp;
+    VectorType pveck = this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
     if ( secondSO ) this->SparsifyOther( pveck ); // zeromatch
-    VectorType qveck = this->m_MatrixP * ptemp;
+    VectorType qveck = this->MatrixVectorProduct( this->m_MatrixP, ptemp );
     if ( secondSO ) this->SparsifyOther( qveck ); // zeromatch
     // get list of all zeroes
     std::vector<TRealType> zeromatch( qveck.size(), 0);
@@ -5090,24 +5774,24 @@ bool antsSCCANObject<TInputImage, TRealType>
      *  where we constrain ( x X , x X ) = ( y Y , y Y ) = 1
      */
     RealType ccafactor = inner_product( pveck, qveck ) * 0.5;
-    pveck = pveck * this->m_MatrixP;
-    VectorType pproj = ( this->m_MatrixP * ptemp );
+    pveck = this->MatrixTransposeVectorProduct( this->m_MatrixP, pveck );
+    VectorType pproj = ( this->MatrixVectorProduct( this->m_MatrixP, ptemp ) );
     if ( secondSO ) this->SparsifyOther( pproj );  // zeromatch
     //    for ( unsigned int zm = 0; zm < qveck.size(); zm++ )
     //      if ( this->Close2Zero( zeromatch[ zm ] - 1 ) ) pproj( zm ) = 0;
-    pveck = pveck - this->m_MatrixP.transpose() * pproj *  ccafactor;
-    qveck = qveck * this->m_MatrixQ;
-    VectorType qproj = ( this->m_MatrixQ * qtemp );
+    pveck = pveck - this->MatrixTransposeVectorProduct( this->m_MatrixP, pproj ) *  ccafactor;
+    qveck = this->MatrixTransposeVectorProduct( this->m_MatrixQ, qveck );
+    VectorType qproj = ( this->MatrixVectorProduct( this->m_MatrixQ, qtemp ) );
     if ( secondSO ) this->SparsifyOther( qproj ); // zeromatch
     //    for ( unsigned int zm = 0; zm < qveck.size(); zm++ )
     //      if ( this->Close2Zero( zeromatch[ zm ] - 1 ) ) qproj( zm ) = 0;
-    qveck = qveck - this->m_MatrixQ.transpose() * ( qproj ) *  ccafactor;
+    qveck = qveck - this->MatrixTransposeVectorProduct( this->m_MatrixQ, qproj ) *  ccafactor;
     RealType sclp = ( static_cast<RealType>( pveck.size() )  * this->m_FractionNonZeroP );
     RealType sclq = ( static_cast<RealType>( qveck.size() )  * this->m_FractionNonZeroQ );
     bool     genomics = false;
     if( genomics )
       {
-      VectorType y = this->m_MatrixP * ptemp;
+      VectorType y = this->MatrixVectorProduct( this->m_MatrixP, ptemp );
       this->LASSO_alg( this->m_MatrixQ, y, qveck, 1.e-3, 2 );
       }
     pveck = ptemp + pveck * ( gsteP / sclp );
@@ -5118,14 +5802,14 @@ bool antsSCCANObject<TInputImage, TRealType>
       if ( j != k )
         {
         VectorType qj = this->m_VariatesP.get_column( j );
-	pproj = ( this->m_MatrixP * pveck );
+	pproj = ( this->MatrixVectorProduct( this->m_MatrixP, pveck ) );
 	if ( secondSO ) this->SparsifyOther( pproj );
 	pveck = this->Orthogonalize( pveck / ( pproj ).two_norm()  , qj );
       //      pveck = this->Orthogonalize( pveck, qj, &this->m_MatrixP, &this->m_MatrixP);
 
       //      if ( this->m_Covering ) this->ZeroProduct( pveck,  qj );
 	qj = this->m_VariatesQ.get_column( j );
-	qproj = ( this->m_MatrixQ * qveck );
+	qproj = ( this->MatrixVectorProduct( this->m_MatrixQ, qveck ) );
 	if ( secondSO ) this->SparsifyOther( qproj );
 	qveck = this->Orthogonalize( qveck / ( qproj ).two_norm()  , qj );
       //      qveck = this->Orthogonalize( qveck, qj, &this->m_MatrixQ, &this->m_MatrixQ);
@@ -5164,8 +5848,8 @@ bool antsSCCANObject<TInputImage, TRealType>
       }
     if( n_vecs == 0 )
       {
-      RealType mup = inner_product( this->m_MatrixP * ptemp, this->m_MatrixP * ptemp ) / ptemp.two_norm();
-      RealType muq = inner_product( this->m_MatrixQ * qtemp, this->m_MatrixQ * qtemp ) / qtemp.two_norm();
+      RealType mup = inner_product( this->MatrixVectorProduct( this->m_MatrixP, ptemp ), this->MatrixVectorProduct( this->m_MatrixP, ptemp ) ) / ptemp.two_norm();
+      RealType muq = inner_product( this->MatrixVectorProduct( this->m_MatrixQ, qtemp ), this->MatrixVectorProduct( this->m_MatrixQ, qtemp ) ) / qtemp.two_norm();
       if ( ! this->m_Silent )  std::cout << " USE-IHT FORMULATION " << mup << "  " << muq << std::endl;
       this->IHTRegression(  this->m_MatrixP,  ptemp, pveck, 0, 1, mup, true, false );   pveck = ptemp;
       this->IHTRegression(  this->m_MatrixQ,  qtemp, qveck, 0, 1, muq, false, false );   qveck = qtemp;
@@ -5178,13 +5862,13 @@ bool antsSCCANObject<TInputImage, TRealType>
       if ( ( rand() % 100 ) < 2 ) qveck[i] = 0; */
 
     // test 4 cases of updates
-    pproj =  this->m_MatrixP * ptemp;
+    pproj =  this->MatrixVectorProduct( this->m_MatrixP, ptemp );
     if ( secondSO ) this->SparsifyOther( pproj );
-    VectorType pproj2 = this->m_MatrixP * pveck;
+    VectorType pproj2 = this->MatrixVectorProduct( this->m_MatrixP, pveck );
     if ( secondSO ) this->SparsifyOther( pproj2 );
-    qproj =  this->m_MatrixQ * qtemp;
+    qproj =  this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
     if ( secondSO ) this->SparsifyOther( qproj );
-    VectorType qproj2 = this->m_MatrixQ * qveck;
+    VectorType qproj2 = this->MatrixVectorProduct( this->m_MatrixQ, qveck );
     if ( secondSO ) this->SparsifyOther( qproj2 );
     RealType corr0 = this->PearsonCorr( pproj , qproj  );
     RealType corr1 = this->PearsonCorr( pproj2 , qproj2  );
@@ -5230,9 +5914,9 @@ bool antsSCCANObject<TInputImage, TRealType>
     this->m_Debug = false;
     if ( normbycov ) this->NormalizeWeightsByCovariance( k, 0, 0 );
     else this->NormalizeWeights( k );
-    VectorType proj1 =  this->m_MatrixP * this->m_VariatesP.get_column( k );
+    VectorType proj1 =  this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( k ) );
     if ( secondSO ) this->SparsifyOther( proj1 );
-    VectorType proj2 =  this->m_MatrixQ * this->m_VariatesQ.get_column( k );
+    VectorType proj2 =  this->MatrixVectorProduct( this->m_MatrixQ, this->m_VariatesQ.get_column( k ) );
     if ( secondSO ) this->SparsifyOther( proj2 );
     this->m_CanonicalCorrelations[k] = this->PearsonCorr( proj1, proj2  );
     }
@@ -5265,37 +5949,37 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if ( qrowmean.two_norm() > this->m_Epsilon ) qrowmean = qrowmean / qrowmean.two_norm();
   this->SparsifyOther( prowmean );
   this->SparsifyOther( qrowmean );
-  VectorType ipvec = ( prowmean  ) * this->m_MatrixP;
-  VectorType iqvec = ( qrowmean ) * this->m_MatrixQ;
+  VectorType ipvec = this->MatrixTransposeVectorProduct( this->m_MatrixP, ( prowmean  ) );
+  VectorType iqvec = this->MatrixTransposeVectorProduct( this->m_MatrixQ, ( qrowmean ) );
   for( unsigned int kk = 0; kk < n_vecs; kk++ )
     {
     if ( ( kk > 0 ) && ( this->m_Covering == 0 || this->m_Covering == 2 ) )
       {
-      VectorType temp = this->m_MatrixP * this->m_VariatesP.get_column( kk-1 );
+      VectorType temp = this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( kk-1 ) );
       this->SparsifyOther( temp );
       if ( n_vecs < this->m_MatrixP.columns() ) this->m_MatrixP = this->OrthogonalizeMatrix( this->m_MatrixP, temp );
-      temp = this->m_MatrixQ * this->m_VariatesQ.get_column( kk-1 );
+      temp = this->MatrixVectorProduct( this->m_MatrixQ, this->m_VariatesQ.get_column( kk-1 ) );
       this->SparsifyOther( temp );
       if ( n_vecs < this->m_MatrixQ.columns() ) this->m_MatrixQ = this->OrthogonalizeMatrix( this->m_MatrixQ, temp );
       }
-    VectorType qvec = ( this->m_MatrixP * ipvec );
+    VectorType qvec = ( this->MatrixVectorProduct( this->m_MatrixP, ipvec ) );
     this->SparsifyOther( qvec );
-    qvec = qvec * this->m_MatrixQ;
+    qvec = this->MatrixTransposeVectorProduct( this->m_MatrixQ, qvec );
     if (  qvec.two_norm() > this->m_Epsilon ) qvec = qvec / qvec.two_norm();
-    VectorType vec  = ( this->m_MatrixQ * qvec );
+    VectorType vec  = ( this->MatrixVectorProduct( this->m_MatrixQ, qvec ) );
     this->SparsifyOther( vec );
-    vec = vec * this->m_MatrixP;
+    vec = this->MatrixTransposeVectorProduct( this->m_MatrixP, vec );
     if (  vec.two_norm() > this->m_Epsilon ) vec = vec / vec.two_norm();
     VectorType vec2  = ( this->m_MatrixQ * iqvec );
     this->SparsifyOther( vec2 );
     vec2 = vec2 * this->m_MatrixP;
     if (  vec2.two_norm() > this->m_Epsilon ) vec2 = vec2 / vec2.two_norm();
-    VectorType qvec2 = ( this->m_MatrixP * vec2 );
+    VectorType qvec2 = ( this->MatrixVectorProduct( this->m_MatrixP, vec2 ) );
     this->SparsifyOther( qvec2 );
     qvec2 = qvec2 * this->m_MatrixQ;
     if (  qvec2.two_norm() > this->m_Epsilon ) qvec2 = qvec2 / qvec2.two_norm();
-    if ( vnl_math_abs(  this->PearsonCorr(  this->m_MatrixP * vec2,  this->m_MatrixQ * qvec2 )  ) >
-	 vnl_math_abs(  this->PearsonCorr(  this->m_MatrixP * vec,  this->m_MatrixQ * qvec )  ) )
+    if ( vnl_math_abs(  this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec2 ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec2 ) )  ) >
+	 vnl_math_abs(  this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec ) )  ) )
       {
       vec = vec2;
       qvec = qvec2;
@@ -5322,16 +6006,16 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       }
     this->SparsifyP( vec );
     this->SparsifyQ( qvec );
-    RealType locor = vnl_math_abs( this->PearsonCorr(  this->m_MatrixP * vec,  this->m_MatrixQ * qvec ) );
+    RealType locor = vnl_math_abs( this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec ) ) );
     if ( vnl_math_isnan( qvec.two_norm() ) )
       {
       qvec = this->m_VariatesQ.get_column( kk );
-      locor = vnl_math_abs( this->PearsonCorr(  this->m_MatrixP * vec,  this->m_MatrixQ * qvec ) );
+      locor = vnl_math_abs( this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec ) ) );
       }
     if ( vnl_math_isnan( vec.two_norm() ) )
       {
       vec = this->m_VariatesP.get_column( kk );
-      locor = vnl_math_abs( this->PearsonCorr(  this->m_MatrixP * vec,  this->m_MatrixQ * qvec ) );
+      locor = vnl_math_abs( this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec ) ) );
       }
     this->m_VariatesP.set_column( kk, vec  );
     this->m_VariatesQ.set_column( kk, qvec );
@@ -5352,15 +6036,15 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     {
     unsigned int theseed = ( kk + 1 ) * seeder;
     VectorType   vec = this->InitializeV( this->m_MatrixP, theseed  );
-    vec = this->m_MatrixP * vec;
+    vec = this->MatrixVectorProduct( this->m_MatrixP, vec );
     this->SparsifyOther( vec );
-    vec = vec * this->m_MatrixP;
+    vec = this->MatrixTransposeVectorProduct( this->m_MatrixP, vec );
     vec = vec / vec.two_norm();
-    VectorType qvec = ( this->m_MatrixP * vec );
+    VectorType qvec = ( this->MatrixVectorProduct( this->m_MatrixP, vec ) );
     this->SparsifyOther( qvec );
-    qvec = qvec * this->m_MatrixQ;
+    qvec = this->MatrixTransposeVectorProduct( this->m_MatrixQ, qvec );
     qvec = qvec / qvec.two_norm();
-    vec = ( this->m_MatrixQ * qvec ) * this->m_MatrixP;
+    vec = this->MatrixTransposeVectorProduct( this->m_MatrixP, this->MatrixVectorProduct( this->m_MatrixQ, qvec ) );
     vec = vec / vec.two_norm();
     for( unsigned int j = 0; j < kk; j++ )
       {
@@ -5377,7 +6061,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     this->m_VariatesP.set_column( kk, vec );
     this->m_VariatesQ.set_column( kk, qvec );
     this->NormalizeWeights( kk );
-    totalcorr += vnl_math_abs( this->PearsonCorr(  this->m_MatrixP * vec,  this->m_MatrixQ * qvec ) );
+    totalcorr += vnl_math_abs( this->PearsonCorr(  this->MatrixVectorProduct( this->m_MatrixP, vec ),  this->MatrixVectorProduct( this->m_MatrixQ, qvec ) ) );
     }
   return totalcorr*0.5;
   //  this->CCAUpdate( n_vecs , false );
@@ -5573,13 +6257,13 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     // FIXME is this really what qj should be?  it should be the projection of the nuisance variable
     //    into the space of qj ...
       VectorType cov=this->m_MatrixR.get_column(j);
-      VectorType qj=cov*this->m_MatrixP;
-      RealType hjk=inner_product(cov,this->m_MatrixP*pveck)/
+      VectorType qj=this->MatrixTransposeVectorProduct( this->m_MatrixP, cov );
+      RealType hjk=inner_product(cov,this->MatrixVectorProduct( this->m_MatrixP, pveck ))/
                    inner_product(cov,cov);
       if ( this->m_SCCANFormulation == PminusRQ ||  this->m_SCCANFormulation == PminusRQminusR )
         for (unsigned int i=0; i<pveck.size(); i++)  pveck(i)=pveck(i)-hjk*qj(i);
-      qj=cov*this->m_MatrixQ;
-      hjk=inner_product(cov,this->m_MatrixQ*qveck)/
+      qj=this->MatrixTransposeVectorProduct( this->m_MatrixQ, cov );
+      hjk=inner_product(cov,this->MatrixVectorProduct( this->m_MatrixQ, qveck ))/
           inner_product(cov,cov);
       if ( this->m_SCCANFormulation == PQminusR ||  this->m_SCCANFormulation == PminusRQminusR )
         for (unsigned int i=0; i<qveck.size(); i++)  qveck(i)=qveck(i)-hjk*qj(i);
@@ -5592,14 +6276,14 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       VectorType upp(this->m_MatrixP.cols(),0);
       VectorType upq(this->m_MatrixQ.cols(),0);
         for ( unsigned int rr=0; rr<this->m_MatrixR.cols(); rr++) {
-          pveck=this->m_MatrixQ*qtemp;
-          qveck=this->m_MatrixP*ptemp;
+          pveck=this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
+          qveck=this->MatrixVectorProduct( this->m_MatrixP, ptemp );
           pveck=pveck/pveck.two_norm();
           qveck=qveck/qveck.two_norm();
           pveck=this->Orthogonalize(pveck,this->m_OriginalMatrixR.get_column(rr));
           qveck=this->Orthogonalize(qveck,this->m_OriginalMatrixR.get_column(rr));
-          VectorType tempp=this->m_MatrixP.transpose()*pveck;
-          VectorType tempq=this->m_MatrixQ.transpose()*qveck;
+          VectorType tempp=this->MatrixTransposeVectorProduct( this->m_MatrixP, pveck );
+          VectorType tempq=this->MatrixTransposeVectorProduct( this->m_MatrixQ, qveck );
           pveck=pveck/pveck.two_norm();
           upp=upp+tempp/tempp.two_norm()*1.0/(this->m_MatrixR.cols());
           qveck=qveck/qveck.two_norm();
@@ -5626,18 +6310,18 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       }
       ptemp=ptemp/ptemp.two_norm();
       qtemp=qtemp/qtemp.two_norm();
-      pveck=this->m_MatrixQ*qtemp;
-      qveck=this->m_MatrixP*ptemp;
+      pveck=this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
+      qveck=this->MatrixVectorProduct( this->m_MatrixP, ptemp );
     } //dd
     } //      if ( this->m_SCCANFormulation != PQ ) {
 
 
 
-       VectorType proj=this->m_MatrixQ*this->m_WeightsQ;
+       VectorType proj=this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ );
     if ( false && ( this->m_SCCANFormulation == PminusRQ ||  this->m_SCCANFormulation == PminusRQminusR ) )
         for (unsigned int kk=0; kk< this->m_OriginalMatrixR.cols(); kk++)
           proj=this->Orthogonalize(proj,this->m_MatrixR.get_column(kk));
-        this->m_WeightsP=this->m_MatrixP.transpose()*(proj);
+        this->m_WeightsP=this->MatrixTransposeVectorProduct( this->m_MatrixP, proj );
 */
 }
 
@@ -5706,10 +6390,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       VectorType ptemp = this->m_VariatesP.get_column(k);
       VectorType qtemp = this->m_VariatesQ.get_column(k);
-      VectorType pveck = this->m_MatrixQ * qtemp;
-      VectorType qveck = this->m_MatrixP * ptemp;
-      pveck = this->m_MatrixP.transpose() * pveck;
-      qveck = this->m_MatrixQ.transpose() * qveck;
+      VectorType pveck = this->MatrixVectorProduct( this->m_MatrixQ, qtemp );
+      VectorType qveck = this->MatrixVectorProduct( this->m_MatrixP, ptemp );
+      pveck = this->MatrixTransposeVectorProduct( this->m_MatrixP, pveck );
+      qveck = this->MatrixTransposeVectorProduct( this->m_MatrixQ, qveck );
       for( unsigned int j = 0; j < k; j++ )
         {
         VectorType qj = this->m_VariatesP.get_column(j);
@@ -5717,15 +6401,15 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         qj = this->m_VariatesQ.get_column(j);
         qveck = this->Orthogonalize( qveck, qj );
         }
-      RealType mup = inner_product( this->m_MatrixP * pveck, this->m_MatrixP * pveck ) / pveck.two_norm();
-      RealType muq = inner_product( this->m_MatrixQ * qveck, this->m_MatrixQ * qveck ) / qveck.two_norm();
+      RealType mup = inner_product( this->MatrixVectorProduct( this->m_MatrixP, pveck ), this->MatrixVectorProduct( this->m_MatrixP, pveck ) ) / pveck.two_norm();
+      RealType muq = inner_product( this->MatrixVectorProduct( this->m_MatrixQ, qveck ), this->MatrixVectorProduct( this->m_MatrixQ, qveck ) ) / qveck.two_norm();
       this->IHTRegression(  this->m_MatrixP,  ptemp, pveck, mup, 5, 0, true, false );
       this->IHTRegression(  this->m_MatrixQ,  qtemp, qveck, muq, 5, 0, false, false );
       this->m_VariatesP.set_column( k, ptemp );
       this->m_VariatesQ.set_column( k, qtemp );
       this->NormalizeWeightsByCovariance( k, 0.05, 0.05 );
-      VectorType proj1 =  this->m_MatrixP * this->m_VariatesP.get_column( k );
-      VectorType proj2 =  this->m_MatrixQ * this->m_VariatesQ.get_column( k );
+      VectorType proj1 =  this->MatrixVectorProduct( this->m_MatrixP, this->m_VariatesP.get_column( k ) );
+      VectorType proj2 =  this->MatrixVectorProduct( this->m_MatrixQ, this->m_VariatesQ.get_column( k ) );
       this->m_CanonicalCorrelations[k] = this->PearsonCorr( proj1, proj2  );
       }
     this->SortResults( n_vecs );
@@ -5868,7 +6552,7 @@ void antsSCCANObject<TInputImage, TRealType>
     RealType normP = 0;
     if( this->m_MatrixRp.size() > 0 )
       {
-      VectorType w = this->m_MatrixP * this->m_WeightsP;
+      VectorType w = this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP );
       normP = inner_product( w, (this->m_MatrixP - this->m_MatrixRp * this->m_MatrixP) * this->m_WeightsP );
       }
     else
@@ -5876,8 +6560,8 @@ void antsSCCANObject<TInputImage, TRealType>
       //  v^t ( X^t X + k * Id ) v = v^t  ( X X^t v + k * Id * v )
       //                           = v^t  ( X X^t v + k * Id * v )
       vnl_diag_matrix<double> regdiagp( this->m_MatrixP.cols(), taup );
-      VectorType              w = this->m_MatrixP.transpose()
-        * ( this->m_MatrixP * this->m_WeightsP ) + regdiagp * this->m_WeightsP;
+      VectorType              w = this->NormalMatrixVectorProduct( this->m_MatrixP, this->m_WeightsP )
+        + regdiagp * this->m_WeightsP;
       normP = inner_product( this->m_WeightsP, w );
       }
     if( normP > 0 )
@@ -5889,14 +6573,14 @@ void antsSCCANObject<TInputImage, TRealType>
     RealType normQ = 0;
     if( this->m_MatrixRq.size() > 0 )
       {
-      VectorType w = this->m_MatrixQ * this->m_WeightsQ;
+      VectorType w = this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ );
       normQ = inner_product( w, (this->m_MatrixQ - this->m_MatrixRq * this->m_MatrixQ) * this->m_WeightsQ );
       }
     else
       {
       vnl_diag_matrix<double> regdiagq( this->m_MatrixQ.cols(), tauq );
-      VectorType              w = this->m_MatrixQ.transpose()
-        * ( this->m_MatrixQ * this->m_WeightsQ ) + regdiagq * this->m_WeightsQ;
+      VectorType              w = this->NormalMatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ )
+        + regdiagq * this->m_WeightsQ;
       normQ = inner_product( this->m_WeightsQ, w );
       }
     if( normQ > 0 )
@@ -5981,15 +6665,15 @@ antsSCCANObject<TInputImage, TRealType>
           }
         bool doorth = true; // this->m_Debug=true;
           {
-          VectorType proj = this->m_MatrixQ * this->m_WeightsQ;
+          VectorType proj = this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ );
           if( this->m_MatrixRp.size() > 0 &&
               ( this->m_SCCANFormulation == PminusRQ ||  this->m_SCCANFormulation == PminusRQminusR )  )
             {
-            this->m_WeightsP = this->m_MatrixP.transpose() * (proj - this->m_MatrixRp * proj);
+            this->m_WeightsP = this->MatrixTransposeVectorProduct( this->m_MatrixP, proj - this->m_MatrixRp * proj );
             }
           else
             {
-            this->m_WeightsP = this->m_MatrixP.transpose() * (proj);
+            this->m_WeightsP = this->MatrixTransposeVectorProduct( this->m_MatrixP, proj );
             }
           if( doorth )
             {
@@ -6007,24 +6691,24 @@ antsSCCANObject<TInputImage, TRealType>
           if( which_e_vec > 0   && this->m_Debug   )
             {
             if ( ! this->m_Silent )  std::cout << " p orth-b "
-                             << this->PearsonCorr( this->m_MatrixP * this->m_WeightsP, this->m_MatrixP
+                             << this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP ), this->m_MatrixP
                                   * this->m_VariatesP.get_column(
                                     0) ) << std::endl;
             }
           }
-        VectorType projp = this->m_MatrixQ * this->m_WeightsQ;
-        VectorType projq = this->m_MatrixP * this->m_WeightsP;
+        VectorType projp = this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ );
+        VectorType projq = this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP );
 
           {
-          VectorType proj = this->m_MatrixP * this->m_WeightsP;
+          VectorType proj = this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP );
           if( this->m_MatrixRq.size() > 0  &&
               ( this->m_SCCANFormulation == PQminusR ||  this->m_SCCANFormulation == PminusRQminusR )   )
             {
-            this->m_WeightsQ = this->m_MatrixQ.transpose() * (proj - this->m_MatrixRq * proj);
+            this->m_WeightsQ = this->MatrixTransposeVectorProduct( this->m_MatrixQ, proj - this->m_MatrixRq * proj );
             }
           else
             {
-            this->m_WeightsQ = this->m_MatrixQ.transpose() * (proj);
+            this->m_WeightsQ = this->MatrixTransposeVectorProduct( this->m_MatrixQ, proj );
             }
           if( doorth )
             {
@@ -6038,13 +6722,13 @@ antsSCCANObject<TInputImage, TRealType>
           if( which_e_vec > 0 && this->m_Debug )
             {
             if ( ! this->m_Silent )  std::cout << " q orth-b "
-                             << this->PearsonCorr( this->m_MatrixQ * this->m_WeightsQ, this->m_MatrixQ
+                             << this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ ), this->m_MatrixQ
                                   * this->m_VariatesQ.get_column(
                                     0) ) << std::endl;
             }
           }
-        this->m_WeightsP = this->m_MatrixP.transpose() * (projp);
-        this->m_WeightsQ = this->m_MatrixQ.transpose() * (projq);
+        this->m_WeightsP = this->MatrixTransposeVectorProduct( this->m_MatrixP, projp );
+        this->m_WeightsQ = this->MatrixTransposeVectorProduct( this->m_MatrixQ, projq );
         this->ReSoftThreshold( this->m_WeightsP, this->m_FractionNonZeroP, this->m_KeepPositiveP );
         this->ReSoftThreshold( this->m_WeightsQ, this->m_FractionNonZeroQ, this->m_KeepPositiveQ );
         if( its > 1 )
@@ -6084,7 +6768,7 @@ antsSCCANObject<TInputImage, TRealType>
         this->NormalizeWeightsByCovariance(which_e_vec);
         this->m_VariatesP.set_column(which_e_vec, this->m_WeightsP);
         this->m_VariatesQ.set_column(which_e_vec, this->m_WeightsQ);
-        truecorr = this->PearsonCorr( this->m_MatrixP * this->m_WeightsP, this->m_MatrixQ * this->m_WeightsQ );
+        truecorr = this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP ), this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ ) );
         if( this->m_Debug )
           {
           if ( ! this->m_Silent )  std::cout << " corr " << truecorr << " it " << its << std::endl;
@@ -6203,7 +6887,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       this->m_MatrixR = this->NormalizeMatrix(this->m_OriginalMatrixR);
       this->m_MatrixR = this->WhitenMatrix(this->m_MatrixR);
-      this->m_MatrixRRt = this->m_MatrixR * this->m_MatrixR.transpose();
+      this->m_MatrixRRt = this->MatrixMatrixTransposeProduct( this->m_MatrixR, this->m_MatrixR );
       this->UpdatePandQbyR();
       }
     this->m_MatrixP = this->WhitenMatrix(this->m_MatrixP);
@@ -6225,7 +6909,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         this->TrueCCAPowerUpdate(this->m_FractionNonZeroQ, this->m_MatrixQ, this->m_WeightsP, this->m_MatrixP,
                                  this->m_KeepPositiveQ,
                                  false);
-      truecorr = this->PearsonCorr( this->m_MatrixP * this->m_WeightsP, this->m_MatrixQ * this->m_WeightsQ );
+      truecorr = this->PearsonCorr( this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP ), this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ ) );
       deltacorr = fabs(truecorr - lastcorr);
       lastcorr = truecorr;
       ++its;
@@ -6274,27 +6958,27 @@ antsSCCANObject<TInputImage, TRealType>
     /** for sparse mcca
      *     w_i \leftarrow \frac{ S( X_i^T ( \sum_{j \ne i} X_j w_j  ) }{norm of above }
      */
-    this->m_WeightsP = this->m_MatrixP.transpose()
-      * (this->m_MatrixQ * this->m_WeightsQ + this->m_MatrixR * this->m_WeightsR);
+    this->m_WeightsP = this->MatrixTransposeVectorProduct( this->m_MatrixP,
+      this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ ) + this->MatrixVectorProduct( this->m_MatrixR, this->m_WeightsR ) );
     this->ReSoftThreshold( this->m_WeightsP, this->m_FractionNonZeroP, this->m_KeepPositiveP);
     norm = this->m_WeightsP.two_norm();
     this->m_WeightsP = this->m_WeightsP / (norm);
 
-    this->m_WeightsQ = this->m_MatrixQ.transpose()
-      * (this->m_MatrixP * this->m_WeightsP + this->m_MatrixR * this->m_WeightsR);
+    this->m_WeightsQ = this->MatrixTransposeVectorProduct( this->m_MatrixQ,
+      this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP ) + this->MatrixVectorProduct( this->m_MatrixR, this->m_WeightsR ) );
     this->ReSoftThreshold( this->m_WeightsQ, this->m_FractionNonZeroQ, this->m_KeepPositiveQ);
     norm = this->m_WeightsQ.two_norm();
     this->m_WeightsQ = this->m_WeightsQ / (norm);
 
-    this->m_WeightsR = this->m_MatrixR.transpose()
-      * (this->m_MatrixP * this->m_WeightsP + this->m_MatrixQ * this->m_WeightsQ);
+    this->m_WeightsR = this->MatrixTransposeVectorProduct( this->m_MatrixR,
+      this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP ) + this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ ) );
     this->ReSoftThreshold( this->m_WeightsR, this->m_FractionNonZeroR, this->m_KeepPositiveR);
     norm = this->m_WeightsR.two_norm();
     this->m_WeightsR = this->m_WeightsR / (norm);
 
-    VectorType pvec = this->m_MatrixP * this->m_WeightsP;
-    VectorType qvec = this->m_MatrixQ * this->m_WeightsQ;
-    VectorType rvec = this->m_MatrixR * this->m_WeightsR;
+    VectorType pvec = this->MatrixVectorProduct( this->m_MatrixP, this->m_WeightsP );
+    VectorType qvec = this->MatrixVectorProduct( this->m_MatrixQ, this->m_WeightsQ );
+    VectorType rvec = this->MatrixVectorProduct( this->m_MatrixR, this->m_WeightsR );
 
     double corrpq = this->PearsonCorr( pvec, qvec );
     double corrpr = this->PearsonCorr( pvec, rvec );
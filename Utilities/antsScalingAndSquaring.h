@@ -0,0 +1,278 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsScalingAndSquaring_h
+#define antsScalingAndSquaring_h
+
+#include "antsAllocImage.h"
+
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ants
+{
+/** Exponential of a stationary velocity field by scaling and squaring, with
+ * the same numerics as itk::ExponentialDisplacementFieldImageFilter: the
+ * field divided by 2^N, then squared N times,
+ *
+ *   phi( x ) <- phi( x ) + phi( x + phi( x ) ),
+ *
+ * with linear interpolation and zero displacement outside of the field.  The
+ * filter allocates the outputs of its divider, warper and adder at every
+ * squaring; here the squarings go back and forth between two buffers, each
+ * one a single threaded pass which reads the field as a plain array.
+ *
+ * The fields are itk::Images of itk::Vectors, the displacements in physical
+ * space.
+ */
+class ScalingAndSquaring
+{
+public:
+  /** The rule of ExponentialDisplacementFieldImageFilter: the smallest N for
+   * which the scaled field moves less than half of the smallest spacing, plus
+   * one, capped at maximumNumberOfSquarings. */
+  template <class TField>
+  static unsigned int ComputeNumberOfSquarings( const TField *velocityField, unsigned int maximumNumberOfSquarings )
+  {
+    const itk::SizeValueType numberOfPixels = velocityField->GetBufferedRegion().GetNumberOfPixels();
+    const typename TField::PixelType *velocities = velocityField->GetBufferPointer();
+
+    double maximumNormSquared = 0.0;
+    for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      maximumNormSquared = std::max( maximumNormSquared,
+                                     static_cast<double>( velocities[n].GetSquaredNorm() ) );
+      }
+    double minimumSpacing = velocityField->GetSpacing()[0];
+    for( unsigned int d = 1; d < TField::ImageDimension; d++ )
+      {
+      minimumSpacing = std::min( minimumSpacing, static_cast<double>( velocityField->GetSpacing()[d] ) );
+      }
+    maximumNormSquared /= ( minimumSpacing * minimumSpacing );
+
+    const double numberOfSquarings = 2.0 + 0.5 * std::log( maximumNormSquared ) / std::log( 2.0 );
+    if( !( numberOfSquarings >= 0.0 ) )
+      {
+      return 0;
+      }
+    return std::min( static_cast<unsigned int>( numberOfSquarings + 1.0 ), maximumNumberOfSquarings );
+  }
+
+  /** exp( velocityField ), or exp( -velocityField ) for the inverse. */
+  template <class TField>
+  static typename TField::Pointer Exponentiate( const TField *velocityField, unsigned int numberOfSquarings,
+                                                bool inverse = false )
+  {
+    typedef typename TField::PixelType         VectorType;
+    typedef typename VectorType::ComponentType ComponentType;
+
+    const itk::SizeValueType numberOfPixels = velocityField->GetBufferedRegion().GetNumberOfPixels();
+    const double             divisor = ( inverse ? -1.0 : 1.0 ) * static_cast<double>( 1ul << numberOfSquarings );
+
+    typename TField::Pointer field = AllocImage<TField>( velocityField );
+    const VectorType *       velocities = velocityField->GetBufferPointer();
+    VectorType *             displacements = field->GetBufferPointer();
+    for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      for( unsigned int d = 0; d < TField::ImageDimension; d++ )
+        {
+        displacements[n][d] = static_cast<ComponentType>( velocities[n][d] / divisor );
+        }
+      }
+    if( numberOfSquarings == 0 )
+      {
+      return field;
+      }
+
+    typename TField::Pointer squaredField = AllocImage<TField>( velocityField );
+    for( unsigned int i = 0; i < numberOfSquarings; i++ )
+      {
+      Compose<TField>( field, field, squaredField );
+      std::swap( field, squaredField );
+      }
+    return field;
+  }
+
+  /** output( x ) = warpingField( x ) + displacementField( x + warpingField( x ) )
+   * on the grid of warpingField, which is that of displacementField too.  The
+   * output must be neither of the inputs. */
+  template <class TField>
+  static void Compose( const TField *warpingField, const TField *displacementField, TField *output )
+  {
+    const unsigned int ImageDimension = TField::ImageDimension;
+
+    ThreadStruct<TField> str;
+    str.Warping = warpingField->GetBufferPointer();
+    str.Displacements = displacementField->GetBufferPointer();
+    str.Output = output->GetBufferPointer();
+    str.NumberOfPixels = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.Size[d] = displacementField->GetBufferedRegion().GetSize()[d];
+      str.Strides[d] = str.NumberOfPixels;
+      str.NumberOfPixels *= str.Size[d];
+      }
+
+    // the continuous index of x + u is that of x plus this matrix times u
+    const typename TField::DirectionType indexToPhysical = displacementField->GetDirection();
+    typename TField::DirectionType       scaledDirection;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        scaledDirection[i][j] = indexToPhysical[i][j] * displacementField->GetSpacing()[j];
+        }
+      }
+    str.PhysicalToIndex = scaledDirection.GetInverse();
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfPixels ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    threader->SetSingleMethod( ComposeThreaderCallback<TField>, &str );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  ScalingAndSquaring();
+
+  template <class TField>
+  struct ThreadStruct
+    {
+    typedef typename TField::PixelType VectorType;
+
+    typedef vnl_matrix_fixed<double, TField::ImageDimension, TField::ImageDimension> MatrixType;
+
+    const VectorType *   Warping;
+    const VectorType *   Displacements;
+    VectorType *         Output;
+    itk::SizeValueType   Size[TField::ImageDimension];
+    itk::OffsetValueType Strides[TField::ImageDimension];
+    itk::SizeValueType   NumberOfPixels;
+    MatrixType           PhysicalToIndex;
+    };
+
+  /** each thread a contiguous range of the buffer, the index of its voxels
+   * advanced along with the offset */
+  template <class TField>
+  static ITK_THREAD_RETURN_TYPE ComposeThreaderCallback( void *arg )
+  {
+    const unsigned int ImageDimension = TField::ImageDimension;
+    const unsigned int NumberOfCorners = 1u << ImageDimension;
+    typedef typename TField::PixelType         VectorType;
+    typedef typename VectorType::ComponentType ComponentType;
+
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    ThreadStruct<TField> *                str = static_cast<ThreadStruct<TField> *>( info->UserData );
+
+    const itk::SizeValueType first = str->NumberOfPixels * info->ThreadID / info->NumberOfThreads;
+    const itk::SizeValueType last = str->NumberOfPixels * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+    itk::SizeValueType index[ImageDimension];
+    itk::SizeValueType remainder = first;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      index[d] = remainder % str->Size[d];
+      remainder /= str->Size[d];
+      }
+
+    for( itk::SizeValueType n = first; n < last; n++ )
+      {
+      const VectorType & warp = str->Warping[n];
+
+      // the neighbours and weights of VectorLinearInterpolateImageFunction,
+      // which clamps the neighbours to the field and is only evaluated in
+      // [-0.5, size - 0.5)
+      itk::OffsetValueType lower[ImageDimension];
+      itk::OffsetValueType upper[ImageDimension];
+      double               distance[ImageDimension];
+      bool                 isInside = true;
+      for( unsigned int i = 0; i < ImageDimension; i++ )
+        {
+        double continuousIndex = static_cast<double>( index[i] );
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          continuousIndex += str->PhysicalToIndex[i][j] * warp[j];
+          }
+        const double size = static_cast<double>( str->Size[i] );
+        if( !( continuousIndex >= -0.5 && continuousIndex < size - 0.5 ) )
+          {
+          isInside = false;
+          break;
+          }
+        const itk::OffsetValueType base = static_cast<itk::OffsetValueType>( std::floor( continuousIndex ) );
+        distance[i] = continuousIndex - base;
+        lower[i] = std::max( base, static_cast<itk::OffsetValueType>( 0 ) );
+        upper[i] = std::min( base + 1, static_cast<itk::OffsetValueType>( str->Size[i] - 1 ) );
+        }
+
+      VectorType & out = str->Output[n];
+      if( isInside )
+        {
+        double interpolated[ImageDimension];
+        std::fill( interpolated, interpolated + ImageDimension, 0.0 );
+        for( unsigned int corner = 0; corner < NumberOfCorners; corner++ )
+          {
+          double               overlap = 1.0;
+          itk::OffsetValueType offset = 0;
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            if( corner & ( 1u << d ) )
+              {
+              overlap *= distance[d];
+              offset += upper[d] * str->Strides[d];
+              }
+            else
+              {
+              overlap *= 1.0 - distance[d];
+              offset += lower[d] * str->Strides[d];
+              }
+            }
+          if( overlap != 0.0 )
+            {
+            const VectorType & displacement = str->Displacements[offset];
+            for( unsigned int d = 0; d < ImageDimension; d++ )
+              {
+              interpolated[d] += overlap * displacement[d];
+              }
+            }
+          }
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          out[d] = warp[d] + static_cast<ComponentType>( interpolated[d] );
+          }
+        }
+      else
+        {
+        out = warp;
+        }
+
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( ++index[d] < str->Size[d] )
+          {
+          break;
+          }
+        index[d] = 0;
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+} // namespace ants
+
+#endif // antsScalingAndSquaring_h
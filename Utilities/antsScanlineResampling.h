@@ -0,0 +1,629 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsScanlineResampling_h
+#define antsScanlineResampling_h
+
+#include "itkBSplineDecompositionImageFilter.h"
+#include "itkImage.h"
+#include "itkMatrix.h"
+#include "itkMultiThreader.h"
+#include "itkVector.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** Resampling of a scalar image onto the grid of another through an affine
+ * map of the physical points (the identity by default), with the results of
+ * ResampleImageFilter and the nearest neighbor, linear, B-spline and windowed
+ * sinc (radius 3) interpolators, their boundaries and the default value
+ * outside the input buffer.
+ *
+ * The continuous input index is affine in the output index, so it is not
+ * computed point by point.  When the input and output axes are aligned
+ * (scaling, shifts and flips) the interpolation weights along each axis are
+ * tabulated once per output column, and every output line first contracts
+ * the input lines under it into one row, then interpolates along that row,
+ * so a voxel costs a few multiply-adds per axis instead of the full tensor
+ * product.  Otherwise the index is stepped along each output line and the
+ * separable weights are computed per voxel.  The lines are spread over the
+ * threads and the inner loops run over contiguous memory so the compiler
+ * can vectorize them.
+ */
+class ScanlineResampling
+{
+public:
+  typedef enum { NearestNeighbor = 0, Linear, BSpline, WindowedSinc } InterpolationType;
+
+  /** the windows of WindowedSincInterpolateImageFunction */
+  typedef enum { Hamming = 0, Cosine, Welch, Lanczos, Blackman } WindowType;
+
+  /** Resample input onto the buffered region of output, which is already
+   * allocated and gives the grid.  The parameter is the spline order (0 to
+   * 5) for BSpline and the WindowType for WindowedSinc.  An output point p
+   * is sampled at the input point matrix * p + offset. */
+  template <class TInputImage, class TOutputImage>
+  static void Resample( const TInputImage *input, TOutputImage *output,
+                        InterpolationType interpolation, unsigned int parameter, double defaultValue,
+                        const itk::Matrix<double, TOutputImage::ImageDimension, TOutputImage::ImageDimension> & matrix,
+                        const itk::Vector<double, TOutputImage::ImageDimension> & offset )
+  {
+    typedef typename TInputImage::PixelType                  InputPixelType;
+    typedef typename TOutputImage::PixelType                 OutputPixelType;
+    typedef itk::Image<double, TOutputImage::ImageDimension> CoefficientImageType;
+
+    if( interpolation == BSpline && parameter > 1 )
+      {
+      typedef itk::BSplineDecompositionImageFilter<TInputImage, CoefficientImageType> DecompositionType;
+      typename DecompositionType::Pointer decomposition = DecompositionType::New();
+      decomposition->SetSplineOrder( parameter );
+      decomposition->SetInput( input );
+      decomposition->Update();
+
+      ThreadStruct<double, OutputPixelType> str;
+      str.Source = decomposition->GetOutput()->GetBufferPointer();
+      Setup( input, output, interpolation, parameter, defaultValue, matrix, offset, str );
+      Execute( str );
+      }
+    else
+      {
+      ThreadStruct<InputPixelType, OutputPixelType> str;
+      str.Source = input->GetBufferPointer();
+      Setup( input, output, interpolation, parameter, defaultValue, matrix, offset, str );
+      Execute( str );
+      }
+    output->Modified();
+  }
+
+  /** Resample through the identity. */
+  template <class TInputImage, class TOutputImage>
+  static void Resample( const TInputImage *input, TOutputImage *output,
+                        InterpolationType interpolation, unsigned int parameter = 0, double defaultValue = 0.0 )
+  {
+    itk::Matrix<double, TOutputImage::ImageDimension, TOutputImage::ImageDimension> matrix;
+    matrix.SetIdentity();
+    itk::Vector<double, TOutputImage::ImageDimension> offset;
+    offset.Fill( 0.0 );
+
+    Resample( input, output, interpolation, parameter, defaultValue, matrix, offset );
+  }
+
+  /** the number of input samples per axis of the interpolation */
+  static unsigned int GetNumberOfTaps( InterpolationType interpolation, unsigned int parameter )
+  {
+    switch( interpolation )
+      {
+      case Linear:
+        return 2;
+      case BSpline:
+        return parameter + 1;
+      case WindowedSinc:
+        return 2 * SincRadius;
+      default:
+        return 1;
+      }
+  }
+
+  /** The input samples and weights along one axis of length size for the
+   * continuous index x relative to the start of the buffer.  False if x is
+   * outside the buffer, as for ImageFunction::IsInsideBuffer. */
+  static bool ComputeWeights( InterpolationType interpolation, unsigned int parameter, double x, long size,
+                              long *index, double *weight )
+  {
+    if( !( x >= -0.5 && x < static_cast<double>( size ) - 0.5 ) )
+      {
+      return false;
+      }
+    switch( interpolation )
+      {
+      case NearestNeighbor: default:
+        {
+        index[0] = static_cast<long>( vcl_floor( x + 0.5 ) );
+        weight[0] = 1.0;
+        }
+        break;
+      case Linear:
+        {
+        // the neighbors are clamped to the buffer
+        const double xc = std::min( std::max( x, 0.0 ), static_cast<double>( size - 1 ) );
+        index[0] = static_cast<long>( vcl_floor( xc ) );
+        index[1] = std::min( index[0] + 1, size - 1 );
+        weight[1] = xc - static_cast<double>( index[0] );
+        weight[0] = 1.0 - weight[1];
+        }
+        break;
+      case BSpline:
+        {
+        // the support and mirror boundary of BSplineInterpolateImageFunction
+        const long order = static_cast<long>( parameter );
+        const long first = ( order & 1 ) ? static_cast<long>( vcl_floor( x ) ) - order / 2 :
+          static_cast<long>( vcl_floor( x + 0.5 ) ) - order / 2;
+        for( long k = 0; k <= order; k++ )
+          {
+          index[k] = MirrorIndex( first + k, size );
+          weight[k] = ( order == 0 ) ? 1.0 : BSplineKernel( parameter, x - static_cast<double>( first + k ) );
+          }
+        }
+        break;
+      case WindowedSinc:
+        {
+        // the neighborhood of WindowedSincInterpolateImageFunction with the
+        // zero flux Neumann boundary
+        const long   base = static_cast<long>( vcl_floor( x ) );
+        const double distance = x - static_cast<double>( base );
+        const long   radius = SincRadius;
+        for( long i = 0; i < 2 * radius; i++ )
+          {
+          index[i] = std::min( std::max( base + i - radius + 1, 0L ), size - 1 );
+          if( distance == 0.0 )
+            {
+            weight[i] = ( i == radius - 1 ) ? 1.0 : 0.0;
+            }
+          else
+            {
+            const double t = distance + static_cast<double>( radius - 1 - i );
+            weight[i] = Window( static_cast<WindowType>( parameter ), t ) * Sinc( t );
+            }
+          }
+        }
+        break;
+      }
+    return true;
+  }
+
+private:
+  enum { SincRadius = 3, MaximumDimension = 4, MaximumNumberOfTaps = 6 };
+
+  template <class TSource, class TOutput>
+  struct ThreadStruct
+    {
+    const TSource *     Source;
+    TOutput *           Output;
+    unsigned int        ImageDimension;
+    itk::SizeValueType  InputSize[MaximumDimension];
+    itk::SizeValueType  InputStride[MaximumDimension];
+    itk::SizeValueType  OutputSize[MaximumDimension];
+    itk::SizeValueType  NumberOfLines;
+    unsigned int        NumberOfThreads;
+
+    InterpolationType   Interpolation;
+    unsigned int        Parameter;
+    unsigned int        NumberOfTaps;
+    TOutput             DefaultValue;
+
+    /** continuous input index = Matrix * output index + Offset, both
+     * relative to the start of the buffers */
+    double              Matrix[MaximumDimension][MaximumDimension];
+    double              Offset[MaximumDimension];
+
+    /** per axis and output column, when the axes are aligned: whether the
+     * column is inside the input, and its input samples and weights */
+    bool                IsAxisAligned;
+    std::vector<char>   Inside[MaximumDimension];
+    std::vector<long>   Index[MaximumDimension];
+    std::vector<double> Weight[MaximumDimension];
+    /** the input columns used along the fastest axis */
+    long                FirstColumn;
+    long                LastColumn;
+    };
+
+  template <class TInputImage, class TOutputImage, class TSource, class TOutput>
+  static void Setup( const TInputImage *input, TOutputImage *output,
+                     InterpolationType interpolation, unsigned int parameter, double defaultValue,
+                     const itk::Matrix<double, TOutputImage::ImageDimension, TOutputImage::ImageDimension> & matrix,
+                     const itk::Vector<double, TOutputImage::ImageDimension> & offset,
+                     ThreadStruct<TSource, TOutput> & str )
+  {
+    const unsigned int ImageDimension = TOutputImage::ImageDimension;
+
+    str.Output = output->GetBufferPointer();
+    str.ImageDimension = ImageDimension;
+    str.Interpolation = interpolation;
+    str.Parameter = parameter;
+    str.NumberOfTaps = GetNumberOfTaps( interpolation, parameter );
+    str.DefaultValue = static_cast<TOutput>( defaultValue );
+
+    const typename TInputImage::RegionType  inputRegion = input->GetBufferedRegion();
+    const typename TOutputImage::RegionType outputRegion = output->GetBufferedRegion();
+    str.NumberOfLines = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.InputSize[d] = inputRegion.GetSize()[d];
+      str.InputStride[d] = ( d == 0 ) ? 1 : str.InputStride[d - 1] * str.InputSize[d - 1];
+      str.OutputSize[d] = outputRegion.GetSize()[d];
+      if( d > 0 )
+        {
+        str.NumberOfLines *= str.OutputSize[d];
+        }
+      }
+
+    // output index -> output point -> input point -> input index
+    const typename TInputImage::DirectionType::InternalMatrixType inverseDirection =
+      input->GetDirection().GetInverse();
+    double toInput[MaximumDimension][MaximumDimension];
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        toInput[i][j] = inverseDirection[i][j] / input->GetSpacing()[i];
+        }
+      }
+    double pointMatrix[MaximumDimension][MaximumDimension];
+    double pointOffset[MaximumDimension];
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      pointOffset[i] = offset[i];
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        pointMatrix[i][j] = 0.0;
+        for( unsigned int k = 0; k < ImageDimension; k++ )
+          {
+          pointMatrix[i][j] += matrix[i][k] * output->GetDirection()[k][j] * output->GetSpacing()[j];
+          }
+        pointOffset[i] += matrix[i][j] * output->GetOrigin()[j];
+        }
+      }
+    double maximumCoefficient = 0.0;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      str.Offset[i] = -static_cast<double>( inputRegion.GetIndex()[i] );
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        str.Matrix[i][j] = 0.0;
+        for( unsigned int k = 0; k < ImageDimension; k++ )
+          {
+          str.Matrix[i][j] += toInput[i][k] * pointMatrix[k][j];
+          }
+        str.Offset[i] += toInput[i][j] * ( pointOffset[j] - input->GetOrigin()[j] );
+        maximumCoefficient = std::max( maximumCoefficient, vcl_fabs( str.Matrix[i][j] ) );
+        }
+      }
+    // shift to the start of the output buffer
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        str.Offset[i] += str.Matrix[i][j] * static_cast<double>( outputRegion.GetIndex()[j] );
+        }
+      }
+
+    str.IsAxisAligned = true;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        if( i != j && vcl_fabs( str.Matrix[i][j] ) > 1.e-9 * maximumCoefficient )
+          {
+          str.IsAxisAligned = false;
+          }
+        }
+      }
+    if( !str.IsAxisAligned )
+      {
+      return;
+      }
+
+    const unsigned int taps = str.NumberOfTaps;
+    str.FirstColumn = static_cast<long>( str.InputSize[0] );
+    str.LastColumn = -1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.Inside[d].assign( str.OutputSize[d], 0 );
+      str.Index[d].assign( str.OutputSize[d] * taps, 0 );
+      str.Weight[d].assign( str.OutputSize[d] * taps, 0.0 );
+      for( itk::SizeValueType n = 0; n < str.OutputSize[d]; n++ )
+        {
+        const double x = str.Matrix[d][d] * static_cast<double>( n ) + str.Offset[d];
+        str.Inside[d][n] = ComputeWeights( interpolation, parameter, x, static_cast<long>( str.InputSize[d] ),
+                                           &str.Index[d][n * taps], &str.Weight[d][n * taps] );
+        if( d == 0 && str.Inside[d][n] )
+          {
+          for( unsigned int k = 0; k < taps; k++ )
+            {
+            str.FirstColumn = std::min( str.FirstColumn, str.Index[d][n * taps + k] );
+            str.LastColumn = std::max( str.LastColumn, str.Index[d][n * taps + k] );
+            }
+          }
+        }
+      }
+  }
+
+  template <class TSource, class TOutput>
+  static void Execute( ThreadStruct<TSource, TOutput> & str )
+  {
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                        threader->GetNumberOfThreads() ), str.NumberOfLines ),
+                                            static_cast<itk::SizeValueType>( 1 ) ) );
+    str.NumberOfThreads = threader->GetNumberOfThreads();
+    threader->SetSingleMethod( ThreaderCallback<TSource, TOutput>, &str );
+    threader->SingleMethodExecute();
+  }
+
+  template <class TSource, class TOutput>
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const ThreadStruct<TSource, TOutput> *str = static_cast<ThreadStruct<TSource, TOutput> *>( info->UserData );
+
+    const itk::SizeValueType firstLine = str->NumberOfLines * info->ThreadID / str->NumberOfThreads;
+    const itk::SizeValueType endLine = str->NumberOfLines * ( info->ThreadID + 1 ) / str->NumberOfThreads;
+
+    std::vector<double> row;
+    std::vector<double> lineWeights;
+    std::vector<long>   lineOffsets;
+    for( itk::SizeValueType line = firstLine; line < endLine; line++ )
+      {
+      long               lineIndex[MaximumDimension];
+      itk::SizeValueType remainder = line;
+      lineIndex[0] = 0;
+      for( unsigned int d = 1; d < str->ImageDimension; d++ )
+        {
+        lineIndex[d] = static_cast<long>( remainder % str->OutputSize[d] );
+        remainder /= str->OutputSize[d];
+        }
+      TOutput *output = str->Output + line * str->OutputSize[0];
+      if( str->IsAxisAligned )
+        {
+        ResampleAlignedLine( str, lineIndex, output, row, lineWeights, lineOffsets );
+        }
+      else
+        {
+        ResampleLine( str, lineIndex, output );
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** The input lines under the output line are contracted with the weights
+   * of the slower axes into one row, which is then interpolated along the
+   * fastest axis. */
+  template <class TSource, class TOutput>
+  static void ResampleAlignedLine( const ThreadStruct<TSource, TOutput> *str, const long *lineIndex,
+                                   TOutput *output, std::vector<double> & row,
+                                   std::vector<double> & lineWeights, std::vector<long> & lineOffsets )
+  {
+    const unsigned int       taps = str->NumberOfTaps;
+    const itk::SizeValueType width = str->OutputSize[0];
+
+    for( unsigned int d = 1; d < str->ImageDimension; d++ )
+      {
+      if( !str->Inside[d][lineIndex[d]] )
+        {
+        std::fill( output, output + width, str->DefaultValue );
+        return;
+        }
+      }
+    if( str->LastColumn < str->FirstColumn )
+      {
+      std::fill( output, output + width, str->DefaultValue );
+      return;
+      }
+
+    // the tensor product of the weights of the slower axes
+    lineWeights.assign( 1, 1.0 );
+    lineOffsets.assign( 1, 0 );
+    for( unsigned int d = 1; d < str->ImageDimension; d++ )
+      {
+      const long *  index = &str->Index[d][lineIndex[d] * taps];
+      const double *weight = &str->Weight[d][lineIndex[d] * taps];
+      const std::size_t count = lineWeights.size();
+      std::vector<double> weights;
+      std::vector<long>   offsets;
+      weights.reserve( count * taps );
+      offsets.reserve( count * taps );
+      for( unsigned int k = 0; k < taps; k++ )
+        {
+        if( weight[k] == 0.0 )
+          {
+          continue;
+          }
+        for( std::size_t j = 0; j < count; j++ )
+          {
+          weights.push_back( lineWeights[j] * weight[k] );
+          offsets.push_back( lineOffsets[j] + index[k] * static_cast<long>( str->InputStride[d] ) );
+          }
+        }
+      lineWeights.swap( weights );
+      lineOffsets.swap( offsets );
+      }
+
+    const long first = str->FirstColumn;
+    const long length = str->LastColumn - first + 1;
+    row.assign( length, 0.0 );
+    double *contracted = &row[0];
+    for( std::size_t j = 0; j < lineWeights.size(); j++ )
+      {
+      const double   w = lineWeights[j];
+      const TSource *source = str->Source + lineOffsets[j] + first;
+      for( long x = 0; x < length; x++ )
+        {
+        contracted[x] += w * static_cast<double>( source[x] );
+        }
+      }
+
+    const char *  inside = &str->Inside[0][0];
+    const long *  index = &str->Index[0][0];
+    const double *weight = &str->Weight[0][0];
+    for( itk::SizeValueType n = 0; n < width; n++ )
+      {
+      if( !inside[n] )
+        {
+        output[n] = str->DefaultValue;
+        continue;
+        }
+      double value = 0.0;
+      for( unsigned int k = 0; k < taps; k++ )
+        {
+        value += weight[n * taps + k] * contracted[index[n * taps + k] - first];
+        }
+      output[n] = static_cast<TOutput>( value );
+      }
+  }
+
+  /** The continuous index is stepped along the output line and the weights
+   * are computed for each voxel. */
+  template <class TSource, class TOutput>
+  static void ResampleLine( const ThreadStruct<TSource, TOutput> *str, const long *lineIndex, TOutput *output )
+  {
+    const unsigned int dimension = str->ImageDimension;
+    const unsigned int taps = str->NumberOfTaps;
+
+    double start[MaximumDimension];
+    for( unsigned int i = 0; i < dimension; i++ )
+      {
+      start[i] = str->Offset[i];
+      for( unsigned int j = 1; j < dimension; j++ )
+        {
+        start[i] += str->Matrix[i][j] * static_cast<double>( lineIndex[j] );
+        }
+      }
+
+    long   index[MaximumDimension][MaximumNumberOfTaps];
+    double weight[MaximumDimension][MaximumNumberOfTaps];
+    for( itk::SizeValueType n = 0; n < str->OutputSize[0]; n++ )
+      {
+      bool inside = true;
+      for( unsigned int i = 0; i < dimension && inside; i++ )
+        {
+        const double x = start[i] + str->Matrix[i][0] * static_cast<double>( n );
+        inside = ComputeWeights( str->Interpolation, str->Parameter, x, static_cast<long>( str->InputSize[i] ),
+                                 index[i], weight[i] );
+        }
+      if( !inside )
+        {
+        output[n] = str->DefaultValue;
+        continue;
+        }
+
+      // sum over the tensor product of the taps, the fastest axis innermost
+      unsigned int tap[MaximumDimension];
+      std::fill( tap, tap + MaximumDimension, 0u );
+      double value = 0.0;
+      bool   done = false;
+      while( !done )
+        {
+        double w = 1.0;
+        long   offset = 0;
+        for( unsigned int i = 1; i < dimension; i++ )
+          {
+          w *= weight[i][tap[i]];
+          offset += index[i][tap[i]] * static_cast<long>( str->InputStride[i] );
+          }
+        if( w != 0.0 )
+          {
+          const TSource *source = str->Source + offset;
+          for( unsigned int k = 0; k < taps; k++ )
+            {
+            value += w * weight[0][k] * static_cast<double>( source[index[0][k]] );
+            }
+          }
+        done = true;
+        for( unsigned int i = 1; i < dimension; i++ )
+          {
+          if( ++tap[i] < taps )
+            {
+            done = false;
+            break;
+            }
+          tap[i] = 0;
+          }
+        }
+      output[n] = static_cast<TOutput>( value );
+      }
+  }
+
+  static long MirrorIndex( long i, long size )
+  {
+    if( size == 1 )
+      {
+      return 0;
+      }
+    if( i < 0 )
+      {
+      i = -i;
+      }
+    if( i >= size - 1 )
+      {
+      i = 2 * ( size - 1 ) - i;
+      }
+    return std::min( std::max( i, 0L ), size - 1 );
+  }
+
+  /** the centered B-spline of the given order, from its truncated power form */
+  static double BSplineKernel( unsigned int order, double t )
+  {
+    double factorial = 1.0;
+    for( unsigned int n = 2; n <= order; n++ )
+      {
+      factorial *= static_cast<double>( n );
+      }
+    const double shift = t + 0.5 * static_cast<double>( order + 1 );
+    double       binomial = 1.0;
+    double       value = 0.0;
+    for( unsigned int k = 0; k <= order + 1; k++ )
+      {
+      const double u = shift - static_cast<double>( k );
+      if( u > 0.0 )
+        {
+        double power = 1.0;
+        for( unsigned int n = 0; n < order; n++ )
+          {
+          power *= u;
+          }
+        value += ( ( k & 1 ) ? -binomial : binomial ) * power;
+        }
+      binomial = binomial * static_cast<double>( order + 1 - k ) / static_cast<double>( k + 1 );
+      }
+    return value / factorial;
+  }
+
+  static double Sinc( double x )
+  {
+    const double px = vnl_math::pi * x;
+
+    return ( x == 0.0 ) ? 1.0 : vcl_sin( px ) / px;
+  }
+
+  static double Window( WindowType window, double x )
+  {
+    const double m = static_cast<double>( SincRadius );
+
+    switch( window )
+      {
+      case Cosine:
+        return vcl_cos( x * vnl_math::pi / ( 2.0 * m ) );
+      case Welch:
+        return 1.0 - x * x / ( m * m );
+      case Lanczos:
+        {
+        if( x == 0.0 )
+          {
+          return 1.0;
+          }
+        const double z = x * vnl_math::pi / m;
+        return vcl_sin( z ) / z;
+        }
+      case Blackman:
+        return 0.42 + 0.5 * vcl_cos( x * vnl_math::pi / m ) + 0.08 * vcl_cos( x * 2.0 * vnl_math::pi / m );
+      case Hamming: default:
+        return 0.54 + 0.46 * vcl_cos( x * vnl_math::pi / m );
+      }
+  }
+};
+} // namespace ants
+
+#endif // antsScanlineResampling_h
@@ -0,0 +1,368 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsSeparableGaussianSmoothing_h
+#define antsSeparableGaussianSmoothing_h
+
+#include "itkFixedArray.h"
+#include "itkGaussianOperator.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkPixelTraits.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** In-place separable Gaussian smoothing of scalar images and of vector
+ * images (displacement fields), all the components of a pixel at once.
+ *
+ * Each axis is filtered in blocks of up to BlockWidth neighboring lines,
+ * which are copied to a small buffer, filtered there and copied back, so
+ * the lines across the fastest axis are read in contiguous runs and no
+ * full-image temporary is needed.  The blocks are spread over the threads.
+ *
+ * The kernel along an axis is that of itk::GaussianOperator for the variance
+ * (in voxels), the maximum error and the maximum kernel width (0 for none),
+ * as used by DiscreteGaussianImageFilter and the neighborhood operator
+ * smoothers, with the same zero-flux boundary.  For large sigmas whose
+ * kernel is not truncated the third order recursive filter of Young and
+ * van Vliet is used instead, with the boundary initialization of Triggs and
+ * Sdika, so the cost no longer grows with sigma.
+ */
+class SeparableGaussianSmoothing
+{
+public:
+  typedef enum { Automatic = 0, FIR, IIR } MethodType;
+
+  /** smallest sigma, in voxels, for which Automatic picks the recursive filter */
+  static double GetRecursiveSigmaThreshold()
+  {
+    return 3.0;
+  }
+
+  template <class TImage>
+  static void Smooth( TImage *image, const itk::FixedArray<double, TImage::ImageDimension> & variance,
+                      double maximumError = 0.01, unsigned int maximumKernelWidth = 0,
+                      MethodType method = Automatic )
+  {
+    typedef typename TImage::PixelType                    PixelType;
+    typedef typename itk::PixelTraits<PixelType>::ValueType ValueType;
+
+    const unsigned int ImageDimension = TImage::ImageDimension;
+
+    ThreadStruct<ValueType> str;
+    str.Buffer = reinterpret_cast<ValueType *>( image->GetBufferPointer() );
+    str.NumberOfComponents = sizeof( PixelType ) / sizeof( ValueType );
+
+    const typename TImage::SizeType size = image->GetBufferedRegion().GetSize();
+    str.Stride[0] = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.Size[d] = size[d];
+      if( d > 0 )
+        {
+        str.Stride[d] = str.Stride[d - 1] * size[d - 1];
+        }
+      }
+    str.ImageDimension = ImageDimension;
+
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( variance[d] <= 0.0 || size[d] < 2 )
+        {
+        continue;
+        }
+      str.Dimension = d;
+
+      // the kernel of the operator, truncated to the maximum width if any
+      itk::GaussianOperator<double, ImageDimension> oper;
+      oper.SetDirection( d );
+      oper.SetVariance( variance[d] );
+      oper.SetMaximumError( maximumError );
+      oper.SetMaximumKernelWidth( maximumKernelWidth > 0 ? maximumKernelWidth : size[d] * 4 + 64 );
+      oper.CreateDirectional();
+
+      const double sigma = vcl_sqrt( variance[d] );
+      const bool   isTruncated = ( maximumKernelWidth > 0 && oper.Size() >= maximumKernelWidth );
+
+      bool useRecursive = ( method == IIR );
+      if( method == Automatic )
+        {
+        useRecursive = ( sigma >= GetRecursiveSigmaThreshold() && !isTruncated );
+        }
+      // the recursive filter is defined from sigma 0.5 and its boundary needs 3 samples
+      useRecursive = useRecursive && sigma >= 0.5 && size[d] >= 3;
+
+      str.UseRecursive = useRecursive;
+      if( useRecursive )
+        {
+        ComputeRecursiveCoefficients( sigma, str );
+        }
+      else
+        {
+        str.Kernel.resize( oper.Size() );
+        for( unsigned int k = 0; k < oper.Size(); k++ )
+          {
+          str.Kernel[k] = oper[k];
+          }
+        }
+
+      // the lines along d are grouped in blocks of neighboring lines along
+      // the fastest axis, or are single lines when filtering along it
+      str.BlockWidth = ( d == 0 ) ? 1 : std::min( static_cast<itk::SizeValueType>( BlockWidth ), str.Size[0] );
+      const itk::SizeValueType numberOfLines = image->GetBufferedRegion().GetNumberOfPixels() / size[d];
+      if( d == 0 )
+        {
+        str.NumberOfBlocks = numberOfLines;
+        }
+      else
+        {
+        str.BlocksPerRow = ( str.Size[0] + str.BlockWidth - 1 ) / str.BlockWidth;
+        str.NumberOfBlocks = ( numberOfLines / str.Size[0] ) * str.BlocksPerRow;
+        }
+
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( std::max( std::min( static_cast<itk::SizeValueType>(
+                                                          threader->GetNumberOfThreads() ), str.NumberOfBlocks ),
+                                              static_cast<itk::SizeValueType>( 1 ) ) );
+      str.NumberOfThreads = threader->GetNumberOfThreads();
+      threader->SetSingleMethod( ThreaderCallback<ValueType>, &str );
+      threader->SingleMethodExecute();
+      }
+    image->Modified();
+  }
+
+private:
+  enum { BlockWidth = 32, MaximumDimension = 4 };
+
+  template <class TValue>
+  struct ThreadStruct
+    {
+    TValue *            Buffer;
+    unsigned int        NumberOfComponents;
+    unsigned int        ImageDimension;
+    itk::SizeValueType  Size[MaximumDimension];
+    itk::SizeValueType  Stride[MaximumDimension];
+
+    unsigned int        Dimension;
+    itk::SizeValueType  BlockWidth;
+    itk::SizeValueType  BlocksPerRow;
+    itk::SizeValueType  NumberOfBlocks;
+    unsigned int        NumberOfThreads;
+
+    bool                UseRecursive;
+    std::vector<double> Kernel;
+    double              B;
+    double              A[3];
+    double              M[9];
+    };
+
+  template <class TValue>
+  static void ComputeRecursiveCoefficients( double sigma, ThreadStruct<TValue> & str )
+  {
+    // Young and van Vliet, Signal Processing 44 (1995) 139-151
+    const double q = ( sigma >= 2.5 ) ? 0.98711 * sigma - 0.96330 :
+      3.97156 - 4.14554 * vcl_sqrt( 1.0 - 0.26891 * sigma );
+    const double q2 = q * q;
+    const double q3 = q2 * q;
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+
+    const double a1 = ( 2.44413 * q + 2.85619 * q2 + 1.26661 * q3 ) / b0;
+    const double a2 = -( 1.4281 * q2 + 1.26661 * q3 ) / b0;
+    const double a3 = ( 0.422205 * q3 ) / b0;
+
+    str.A[0] = a1;
+    str.A[1] = a2;
+    str.A[2] = a3;
+    str.B = 1.0 - ( a1 + a2 + a3 );
+
+    // Triggs and Sdika, IEEE Trans. Signal Processing 54 (2006) 2365-2367:
+    // the state of the backward pass at the end of a line continued by its
+    // last value, from the last three values of the forward pass
+    const double scale = str.B / ( ( 1.0 + a1 - a2 + a3 ) * ( 1.0 - a1 - a2 - a3 ) * ( 1.0 + a2 + ( a1 - a3 ) * a3 ) );
+
+    str.M[0] = scale * ( -a3 * a1 + 1.0 - a3 * a3 - a2 );
+    str.M[1] = scale * ( ( a3 + a1 ) * ( a2 + a3 * a1 ) );
+    str.M[2] = scale * ( a3 * ( a1 + a3 * a2 ) );
+    str.M[3] = scale * ( a1 + a3 * a2 );
+    str.M[4] = scale * ( -( a2 - 1.0 ) * ( a2 + a3 * a1 ) );
+    str.M[5] = scale * ( -( a3 * a1 + a3 * a3 + a2 - 1.0 ) * a3 );
+    str.M[6] = scale * ( a3 * a1 + a2 + a1 * a1 - a2 * a2 );
+    str.M[7] = scale * ( a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3 );
+    str.M[8] = scale * ( a3 * ( a1 + a3 * a2 ) );
+  }
+
+  template <class TValue>
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const ThreadStruct<TValue> *str = static_cast<ThreadStruct<TValue> *>( info->UserData );
+
+    const unsigned int       d = str->Dimension;
+    const itk::SizeValueType length = str->Size[d];
+    const itk::SizeValueType pitch = str->Stride[d] * str->NumberOfComponents;
+
+    const itk::SizeValueType firstBlock = str->NumberOfBlocks * info->ThreadID / str->NumberOfThreads;
+    const itk::SizeValueType endBlock = str->NumberOfBlocks * ( info->ThreadID + 1 ) / str->NumberOfThreads;
+
+    std::vector<double> input( length * str->BlockWidth * str->NumberOfComponents );
+    std::vector<double> output( str->UseRecursive ? 0 : input.size() );
+    for( itk::SizeValueType block = firstBlock; block < endBlock; block++ )
+      {
+      // first pixel and width of the block
+      itk::SizeValueType offset = 0;
+      itk::SizeValueType width = 1;
+      if( d == 0 )
+        {
+        offset = block * length;
+        }
+      else
+        {
+        const itk::SizeValueType x = ( block % str->BlocksPerRow ) * str->BlockWidth;
+        width = std::min( str->BlockWidth, str->Size[0] - x );
+        offset = x;
+
+        itk::SizeValueType line = block / str->BlocksPerRow;
+        for( unsigned int e = 1; e < str->ImageDimension; e++ )
+          {
+          if( e != d )
+            {
+            offset += ( line % str->Size[e] ) * str->Stride[e];
+            line /= str->Size[e];
+            }
+          }
+        }
+
+      const itk::SizeValueType rowLength = width * str->NumberOfComponents;
+      TValue *                 start = str->Buffer + offset * str->NumberOfComponents;
+      for( itk::SizeValueType n = 0; n < length; n++ )
+        {
+        const TValue *source = start + n * pitch;
+        double *      row = &input[n * rowLength];
+        for( itk::SizeValueType j = 0; j < rowLength; j++ )
+          {
+          row[j] = source[j];
+          }
+        }
+
+      const double *result = &input[0];
+      if( str->UseRecursive )
+        {
+        FilterRecursive( str, &input[0], length, rowLength );
+        }
+      else
+        {
+        FilterKernel( str, &input[0], &output[0], length, rowLength );
+        result = &output[0];
+        }
+
+      for( itk::SizeValueType n = 0; n < length; n++ )
+        {
+        TValue *      target = start + n * pitch;
+        const double *row = result + n * rowLength;
+        for( itk::SizeValueType j = 0; j < rowLength; j++ )
+          {
+          target[j] = static_cast<TValue>( row[j] );
+          }
+        }
+      }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  /** convolution with the operator kernel, clamping at the ends of the lines */
+  template <class TValue>
+  static void FilterKernel( const ThreadStruct<TValue> *str, const double *input, double *output,
+                            itk::SizeValueType length, itk::SizeValueType rowLength )
+  {
+    const std::vector<double> & kernel = str->Kernel;
+    const long                  radius = static_cast<long>( kernel.size() / 2 );
+    const long                  last = static_cast<long>( length ) - 1;
+
+    for( long n = 0; n <= last; n++ )
+      {
+      double *out = output + n * rowLength;
+      std::fill( out, out + rowLength, 0.0 );
+      for( long k = -radius; k <= radius; k++ )
+        {
+        const double  weight = kernel[k + radius];
+        const double *in = input + std::min( std::max( n + k, 0L ), last ) * rowLength;
+        for( itk::SizeValueType j = 0; j < rowLength; j++ )
+          {
+          out[j] += weight * in[j];
+          }
+        }
+      }
+  }
+
+  /** forward and backward recursions in place, the lines being continued by
+   * their end values */
+  template <class TValue>
+  static void FilterRecursive( const ThreadStruct<TValue> *str, double *buffer,
+                               itk::SizeValueType length, itk::SizeValueType rowLength )
+  {
+    const double  B = str->B;
+    const double  a1 = str->A[0];
+    const double  a2 = str->A[1];
+    const double  a3 = str->A[2];
+    const double *M = str->M;
+
+    std::vector<double> first( buffer, buffer + rowLength );
+    std::vector<double> lastInput( buffer + ( length - 1 ) * rowLength, buffer + length * rowLength );
+
+    for( itk::SizeValueType n = 0; n < length; n++ )
+      {
+      double *      row = buffer + n * rowLength;
+      const double *p1 = ( n > 0 ) ? row - rowLength : &first[0];
+      const double *p2 = ( n > 1 ) ? row - 2 * rowLength : &first[0];
+      const double *p3 = ( n > 2 ) ? row - 3 * rowLength : &first[0];
+      for( itk::SizeValueType j = 0; j < rowLength; j++ )
+        {
+        row[j] = B * row[j] + a1 * p1[j] + a2 * p2[j] + a3 * p3[j];
+        }
+      }
+
+    // backward state past the end of the line: y[N-1], y[N], y[N+1]
+    std::vector<double> next( 2 * rowLength );
+    double *            lastRow = buffer + ( length - 1 ) * rowLength;
+    for( itk::SizeValueType j = 0; j < rowLength; j++ )
+      {
+      const double plus = lastInput[j];
+      const double u0 = lastRow[j] - plus;
+      const double u1 = lastRow[j - rowLength] - plus;
+      const double u2 = lastRow[j - 2 * rowLength] - plus;
+
+      const double y0 = M[0] * u0 + M[1] * u1 + M[2] * u2 + plus;
+      next[j] = M[3] * u0 + M[4] * u1 + M[5] * u2 + plus;
+      next[rowLength + j] = M[6] * u0 + M[7] * u1 + M[8] * u2 + plus;
+      lastRow[j] = y0;
+      }
+
+    for( long n = static_cast<long>( length ) - 2; n >= 0; n-- )
+      {
+      double *      row = buffer + n * rowLength;
+      const double *p1 = row + rowLength;
+      const double *p2 = ( n + 2 < static_cast<long>( length ) ) ? row + 2 * rowLength : &next[0];
+      const double *p3 = ( n + 3 < static_cast<long>( length ) ) ? row + 3 * rowLength :
+        &next[( n + 3 - static_cast<long>( length ) ) * rowLength];
+      for( itk::SizeValueType j = 0; j < rowLength; j++ )
+        {
+        row[j] = B * row[j] + a1 * p1[j] + a2 * p2[j] + a3 * p3[j];
+        }
+      }
+  }
+};
+} // namespace ants
+
+#endif // antsSeparableGaussianSmoothing_h
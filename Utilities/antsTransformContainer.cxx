@@ -0,0 +1,394 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#include "antsTransformContainer.h"
+
+#include "itkMultiThreader.h"
+#include "itk_zlib.h"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+namespace ants
+{
+namespace
+{
+typedef unsigned int UInt32Type;
+
+UInt32Type FloatBits( float value )
+{
+  UInt32Type bits;
+  std::memcpy( &bits, &value, sizeof( bits ) );
+  return bits;
+}
+
+float BitsFloat( UInt32Type bits )
+{
+  float value;
+  std::memcpy( &value, &bits, sizeof( value ) );
+  return value;
+}
+
+struct ChunkThreadStruct
+  {
+  const float *                             ConstValues;
+  float *                                   Values;
+  unsigned long                             ValuesPerChunk;
+  unsigned long                             NumberOfChunks;
+  bool                                      HalfPrecision;
+  bool                                      Compressed;
+  std::vector<TransformContainerChunkType> *Chunks;
+  const std::vector<TransformContainerChunkType> *ConstChunks;
+  std::vector<bool>                         Succeeded;
+  };
+
+bool EncodeChunk( const float *values, unsigned long valuesPerChunk, bool halfPrecision, bool compress,
+                  TransformContainerChunkType & chunk )
+{
+  TransformContainerChunkType raw( valuesPerChunk * ( halfPrecision ? 2 : 4 ) );
+  for( unsigned long n = 0; n < valuesPerChunk; n++ )
+    {
+    if( halfPrecision )
+      {
+      const unsigned short half = FloatToHalf( values[n] );
+      raw[2 * n] = static_cast<unsigned char>( half & 0xff );
+      raw[2 * n + 1] = static_cast<unsigned char>( half >> 8 );
+      }
+    else
+      {
+      const UInt32Type bits = FloatBits( values[n] );
+      for( unsigned int b = 0; b < 4; b++ )
+        {
+        raw[4 * n + b] = static_cast<unsigned char>( ( bits >> ( 8 * b ) ) & 0xff );
+        }
+      }
+    }
+  if( !compress || raw.empty() )
+    {
+    chunk.swap( raw );
+    return true;
+    }
+
+  uLongf compressedSize = compressBound( static_cast<uLong>( raw.size() ) );
+  chunk.resize( compressedSize );
+  if( compress2( &chunk[0], &compressedSize, &raw[0], static_cast<uLong>( raw.size() ), 6 ) != Z_OK )
+    {
+    return false;
+    }
+  chunk.resize( compressedSize );
+  return true;
+}
+
+bool DecodeChunk( const TransformContainerChunkType & chunk, unsigned long valuesPerChunk, bool halfPrecision,
+                  bool compressed, float *values )
+{
+  const unsigned long rawSize = valuesPerChunk * ( halfPrecision ? 2 : 4 );
+
+  TransformContainerChunkType inflated;
+  const unsigned char *       raw = chunk.empty() ? ITK_NULLPTR : &chunk[0];
+  if( compressed && rawSize > 0 )
+    {
+    inflated.resize( rawSize );
+    uLongf inflatedSize = static_cast<uLongf>( rawSize );
+    if( chunk.empty()
+        || uncompress( &inflated[0], &inflatedSize, &chunk[0], static_cast<uLong>( chunk.size() ) ) != Z_OK
+        || inflatedSize != rawSize )
+      {
+      return false;
+      }
+    raw = &inflated[0];
+    }
+  else if( chunk.size() != rawSize )
+    {
+    return false;
+    }
+
+  for( unsigned long n = 0; n < valuesPerChunk; n++ )
+    {
+    if( halfPrecision )
+      {
+      values[n] = HalfToFloat( static_cast<unsigned short>( raw[2 * n] | ( raw[2 * n + 1] << 8 ) ) );
+      }
+    else
+      {
+      UInt32Type bits = 0;
+      for( unsigned int b = 0; b < 4; b++ )
+        {
+        bits |= static_cast<UInt32Type>( raw[4 * n + b] ) << ( 8 * b );
+        }
+      values[n] = BitsFloat( bits );
+      }
+    }
+  return true;
+}
+
+ITK_THREAD_RETURN_TYPE EncodeChunksThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ChunkThreadStruct *                   str = static_cast<ChunkThreadStruct *>( info->UserData );
+
+  bool succeeded = true;
+  for( unsigned long n = info->ThreadID; n < str->NumberOfChunks; n += info->NumberOfThreads )
+    {
+    succeeded = EncodeChunk( str->ConstValues + n * str->ValuesPerChunk, str->ValuesPerChunk, str->HalfPrecision,
+                             str->Compressed, ( *str->Chunks )[n] ) && succeeded;
+    }
+  str->Succeeded[info->ThreadID] = succeeded;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+ITK_THREAD_RETURN_TYPE DecodeChunksThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ChunkThreadStruct *                   str = static_cast<ChunkThreadStruct *>( info->UserData );
+
+  bool succeeded = true;
+  for( unsigned long n = info->ThreadID; n < str->NumberOfChunks; n += info->NumberOfThreads )
+    {
+    succeeded = DecodeChunk( ( *str->ConstChunks )[n], str->ValuesPerChunk, str->HalfPrecision, str->Compressed,
+                             str->Values + n * str->ValuesPerChunk ) && succeeded;
+    }
+  str->Succeeded[info->ThreadID] = succeeded;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** Run the callback on the chunks of str and report whether all succeeded. */
+bool RunChunkThreads( ITK_THREAD_RETURN_TYPE (*callback)( void * ), ChunkThreadStruct & str,
+                      unsigned int numberOfThreads )
+{
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+  if( static_cast<unsigned long>( numberOfThreads ) > str.NumberOfChunks )
+    {
+    numberOfThreads = static_cast<unsigned int>( str.NumberOfChunks );
+    }
+  numberOfThreads = std::max( numberOfThreads, 1u );
+  str.Succeeded.assign( numberOfThreads, false );
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( callback, &str );
+  threader->SingleMethodExecute();
+
+  return std::find( str.Succeeded.begin(), str.Succeeded.end(), false ) == str.Succeeded.end();
+}
+} // anonymous namespace
+
+unsigned short FloatToHalf( float value )
+{
+  const UInt32Type bits = FloatBits( value );
+  const UInt32Type sign = ( bits >> 16 ) & 0x8000;
+  const UInt32Type absolute = bits & 0x7fffffff;
+
+  if( absolute >= 0x7f800000 )
+    {
+    // infinity or NaN, keep NaNs quiet
+    return static_cast<unsigned short>( sign | 0x7c00 | ( absolute > 0x7f800000 ? 0x200 : 0 ) );
+    }
+  if( absolute >= 0x477ff000 )
+    {
+    // rounds to a value beyond the largest half
+    return static_cast<unsigned short>( sign | 0x7c00 );
+    }
+  if( absolute < 0x38800000 )
+    {
+    // subnormal half or zero
+    if( absolute < 0x33000000 )
+      {
+      return static_cast<unsigned short>( sign );
+      }
+    const UInt32Type exponent = absolute >> 23;
+    const UInt32Type mantissa = ( absolute & 0x7fffff ) | 0x800000;
+    const UInt32Type shift = 126 - exponent;
+    UInt32Type       half = mantissa >> shift;
+    const UInt32Type remainder = mantissa & ( ( 1u << shift ) - 1 );
+    const UInt32Type halfway = 1u << ( shift - 1 );
+    if( remainder > halfway || ( remainder == halfway && ( half & 1 ) ) )
+      {
+      half++;
+      }
+    return static_cast<unsigned short>( sign | half );
+    }
+
+  // normal, round the mantissa to nearest even
+  UInt32Type half = ( ( absolute >> 13 ) - ( 112 << 10 ) );
+  const UInt32Type remainder = absolute & 0x1fff;
+  if( remainder > 0x1000 || ( remainder == 0x1000 && ( half & 1 ) ) )
+    {
+    half++;
+    }
+  return static_cast<unsigned short>( sign | half );
+}
+
+float HalfToFloat( unsigned short value )
+{
+  const UInt32Type sign = static_cast<UInt32Type>( value & 0x8000 ) << 16;
+  int              exponent = ( value >> 10 ) & 0x1f;
+  UInt32Type       mantissa = value & 0x3ff;
+
+  if( exponent == 0x1f )
+    {
+    return BitsFloat( sign | 0x7f800000 | ( mantissa << 13 ) );
+    }
+  if( exponent == 0 )
+    {
+    if( mantissa == 0 )
+      {
+      return BitsFloat( sign );
+      }
+    // normalize the subnormal half
+    exponent = 1;
+    while( !( mantissa & 0x400 ) )
+      {
+      mantissa <<= 1;
+      exponent--;
+      }
+    mantissa &= 0x3ff;
+    }
+  return BitsFloat( sign | ( static_cast<UInt32Type>( exponent + 112 ) << 23 ) | ( mantissa << 13 ) );
+}
+
+bool EncodeTransformContainerChunks( const float *values, unsigned long valuesPerChunk, unsigned long numberOfChunks,
+                                     bool halfPrecision, bool compress,
+                                     std::vector<TransformContainerChunkType> & chunks,
+                                     unsigned int numberOfThreads )
+{
+  chunks.assign( numberOfChunks, TransformContainerChunkType() );
+  if( numberOfChunks == 0 )
+    {
+    return true;
+    }
+
+  ChunkThreadStruct str;
+  str.ConstValues = values;
+  str.Values = ITK_NULLPTR;
+  str.ValuesPerChunk = valuesPerChunk;
+  str.NumberOfChunks = numberOfChunks;
+  str.HalfPrecision = halfPrecision;
+  str.Compressed = compress;
+  str.Chunks = &chunks;
+  str.ConstChunks = &chunks;
+  return RunChunkThreads( EncodeChunksThreaderCallback, str, numberOfThreads );
+}
+
+bool DecodeTransformContainerChunks( const std::vector<TransformContainerChunkType> & chunks,
+                                     unsigned long valuesPerChunk, bool halfPrecision, bool compressed,
+                                     float *values, unsigned int numberOfThreads )
+{
+  if( chunks.empty() )
+    {
+    return true;
+    }
+
+  ChunkThreadStruct str;
+  str.ConstValues = ITK_NULLPTR;
+  str.Values = values;
+  str.ValuesPerChunk = valuesPerChunk;
+  str.NumberOfChunks = chunks.size();
+  str.HalfPrecision = halfPrecision;
+  str.Compressed = compressed;
+  str.Chunks = ITK_NULLPTR;
+  str.ConstChunks = &chunks;
+  return RunChunkThreads( DecodeChunksThreaderCallback, str, numberOfThreads );
+}
+
+void WriteTransformContainerUInt32( std::ostream & os, unsigned long value )
+{
+  unsigned char bytes[4];
+  for( unsigned int b = 0; b < 4; b++ )
+    {
+    bytes[b] = static_cast<unsigned char>( ( value >> ( 8 * b ) ) & 0xff );
+    }
+  os.write( reinterpret_cast<const char *>( bytes ), 4 );
+}
+
+void WriteTransformContainerUInt64( std::ostream & os, unsigned long long value )
+{
+  unsigned char bytes[8];
+  for( unsigned int b = 0; b < 8; b++ )
+    {
+    bytes[b] = static_cast<unsigned char>( ( value >> ( 8 * b ) ) & 0xff );
+    }
+  os.write( reinterpret_cast<const char *>( bytes ), 8 );
+}
+
+void WriteTransformContainerDouble( std::ostream & os, double value )
+{
+  unsigned long long bits;
+  std::memcpy( &bits, &value, sizeof( bits ) );
+  WriteTransformContainerUInt64( os, bits );
+}
+
+void WriteTransformContainerString( std::ostream & os, const std::string & value )
+{
+  WriteTransformContainerUInt32( os, static_cast<unsigned long>( value.size() ) );
+  os.write( value.data(), value.size() );
+}
+
+bool ReadTransformContainerUInt32( std::istream & is, unsigned long & value )
+{
+  unsigned char bytes[4];
+  if( !is.read( reinterpret_cast<char *>( bytes ), 4 ) )
+    {
+    return false;
+    }
+  value = 0;
+  for( unsigned int b = 0; b < 4; b++ )
+    {
+    value |= static_cast<unsigned long>( bytes[b] ) << ( 8 * b );
+    }
+  return true;
+}
+
+bool ReadTransformContainerUInt64( std::istream & is, unsigned long long & value )
+{
+  unsigned char bytes[8];
+  if( !is.read( reinterpret_cast<char *>( bytes ), 8 ) )
+    {
+    return false;
+    }
+  value = 0;
+  for( unsigned int b = 0; b < 8; b++ )
+    {
+    value |= static_cast<unsigned long long>( bytes[b] ) << ( 8 * b );
+    }
+  return true;
+}
+
+bool ReadTransformContainerDouble( std::istream & is, double & value )
+{
+  unsigned long long bits;
+  if( !ReadTransformContainerUInt64( is, bits ) )
+    {
+    return false;
+    }
+  std::memcpy( &value, &bits, sizeof( value ) );
+  return true;
+}
+
+bool ReadTransformContainerString( std::istream & is, std::string & value )
+{
+  unsigned long size;
+  if( !ReadTransformContainerUInt32( is, size ) || size > 4096 )
+    {
+    return false;
+    }
+  value.resize( size );
+  return size == 0 || static_cast<bool>( is.read( &value[0], size ) );
+}
+} // namespace ants
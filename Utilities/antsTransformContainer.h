@@ -0,0 +1,68 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsTransformContainer_h
+#define __antsTransformContainer_h
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace ants
+{
+/**
+ * Low-level pieces of the transform container format written by
+ * itk::ants::WriteTransformContainer (see itkantsTransformContainer.h).
+ *
+ * Displacement fields are stored as float32 or float16 chunks, one chunk
+ * per slice of the slowest dimension, each optionally deflated with zlib.
+ * The chunks are encoded and decoded on all threads (numberOfThreads = 0
+ * uses the ITK global default).  Integers and doubles are stored little
+ * endian.
+ */
+typedef std::vector<unsigned char> TransformContainerChunkType;
+
+unsigned short FloatToHalf( float value );
+
+float HalfToFloat( unsigned short value );
+
+/** Encode numberOfChunks consecutive runs of valuesPerChunk floats. */
+bool EncodeTransformContainerChunks( const float *values, unsigned long valuesPerChunk, unsigned long numberOfChunks,
+                                     bool halfPrecision, bool compress,
+                                     std::vector<TransformContainerChunkType> & chunks,
+                                     unsigned int numberOfThreads = 0 );
+
+/** Decode chunks into consecutive runs of valuesPerChunk floats.  Returns
+ * false if a chunk is corrupt. */
+bool DecodeTransformContainerChunks( const std::vector<TransformContainerChunkType> & chunks,
+                                     unsigned long valuesPerChunk, bool halfPrecision, bool compressed,
+                                     float *values, unsigned int numberOfThreads = 0 );
+
+void WriteTransformContainerUInt32( std::ostream & os, unsigned long value );
+
+void WriteTransformContainerUInt64( std::ostream & os, unsigned long long value );
+
+void WriteTransformContainerDouble( std::ostream & os, double value );
+
+void WriteTransformContainerString( std::ostream & os, const std::string & value );
+
+bool ReadTransformContainerUInt32( std::istream & is, unsigned long & value );
+
+bool ReadTransformContainerUInt64( std::istream & is, unsigned long long & value );
+
+bool ReadTransformContainerDouble( std::istream & is, double & value );
+
+bool ReadTransformContainerString( std::istream & is, std::string & value );
+} // namespace ants
+
+#endif // __antsTransformContainer_h
@@ -0,0 +1,247 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __antsTransformPoints_h
+#define __antsTransformPoints_h
+
+#include "itkCompositeTransform.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ants
+{
+/** \class PointBatchTransformer
+ *
+ * Transforms arrays of points through a transform, e.g. the composite
+ * transform of antsApplyTransformsToPoints, on all threads.
+ *
+ * The composite stack is flattened once into stages: runs of adjacent
+ * matrix-offset transforms (affine, rigid, ...) are merged into a single
+ * matrix and offset, the other transforms (displacement fields, B-splines)
+ * are kept as they are.  Each thread then takes a contiguous range of the
+ * points and pushes them through the stages BatchSize points at a time,
+ * one stage after the other, instead of going through the whole stack for
+ * every point.
+ */
+template <class TRealType, unsigned int VDimension>
+class PointBatchTransformer
+{
+public:
+  typedef itk::Transform<TRealType, VDimension, VDimension>                    TransformType;
+  typedef itk::CompositeTransform<TRealType, VDimension>                       CompositeTransformType;
+  typedef itk::MatrixOffsetTransformBase<TRealType, VDimension, VDimension>    MatrixOffsetTransformType;
+  typedef typename MatrixOffsetTransformType::MatrixType                       MatrixType;
+  typedef typename MatrixOffsetTransformType::OutputVectorType                 VectorType;
+  typedef typename TransformType::InputPointType                               PointType;
+
+  itkStaticConstMacro( BatchSize, unsigned int, 1024 );
+
+  PointBatchTransformer() :
+    m_NumberOfThreads( 0 ),
+    m_Input( ITK_NULLPTR ),
+    m_Output( ITK_NULLPTR ),
+    m_NumberOfPoints( 0 ),
+    m_Stride( VDimension )
+  {
+  }
+
+  /** 0 uses the ITK global default number of threads. */
+  void SetNumberOfThreads( unsigned int n )
+  {
+    this->m_NumberOfThreads = n;
+  }
+
+  void SetTransform( const TransformType *transform )
+  {
+    this->m_Stages.clear();
+    this->AddStages( transform );
+  }
+
+  /** The number of stages the transform was flattened into. */
+  unsigned int GetNumberOfStages() const
+  {
+    return this->m_Stages.size();
+  }
+
+  /** Transform numberOfPoints points.  The coordinates of point n are
+   * input[n * stride], ..., input[n * stride + VDimension - 1]; the values
+   * in between are left alone.  input and output may be the same array. */
+  void TransformPoints( const TRealType *input, TRealType *output, unsigned long numberOfPoints,
+                        unsigned int stride = VDimension )
+  {
+    this->m_Input = input;
+    this->m_Output = output;
+    this->m_NumberOfPoints = numberOfPoints;
+    this->m_Stride = stride;
+
+    unsigned int numberOfThreads = this->m_NumberOfThreads;
+    if( numberOfThreads == 0 )
+      {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( ITK_MAX_THREADS ) );
+    const unsigned long numberOfBatches = ( numberOfPoints + BatchSize - 1 ) / BatchSize;
+    if( static_cast<unsigned long>( numberOfThreads ) > numberOfBatches )
+      {
+      numberOfThreads = static_cast<unsigned int>( numberOfBatches );
+      }
+    if( numberOfThreads <= 1 )
+      {
+      this->TransformRange( 0, numberOfPoints );
+      return;
+      }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( Self::ThreaderCallback, this );
+    threader->SingleMethodExecute();
+  }
+
+private:
+  typedef PointBatchTransformer Self;
+
+  PointBatchTransformer( const Self & ); // purposely not implemented
+  void operator=( const Self & );        // purposely not implemented
+
+  struct Stage
+    {
+    const TransformType *Transform; // null for a merged matrix-offset stage
+    MatrixType           Matrix;
+    VectorType           Offset;
+    };
+
+  /** Append the stages of transform, in the order they are applied. */
+  void AddStages( const TransformType *transform )
+  {
+    const CompositeTransformType *composite = dynamic_cast<const CompositeTransformType *>( transform );
+    if( composite )
+      {
+      // the composite applies its last transform first
+      for( int n = static_cast<int>( composite->GetNumberOfTransforms() ) - 1; n >= 0; n-- )
+        {
+        this->AddStages( composite->GetNthTransform( n ).GetPointer() );
+        }
+      return;
+      }
+
+    const MatrixOffsetTransformType *matrixOffset = dynamic_cast<const MatrixOffsetTransformType *>( transform );
+    if( !matrixOffset )
+      {
+      Stage stage;
+      stage.Transform = transform;
+      this->m_Stages.push_back( stage );
+      return;
+      }
+
+    if( !this->m_Stages.empty() && this->m_Stages.back().Transform == ITK_NULLPTR )
+      {
+      // y = M2 ( M1 x + o1 ) + o2
+      Stage & stage = this->m_Stages.back();
+      stage.Offset = matrixOffset->GetMatrix() * stage.Offset + matrixOffset->GetOffset();
+      stage.Matrix = matrixOffset->GetMatrix() * stage.Matrix;
+      return;
+      }
+
+    Stage stage;
+    stage.Transform = ITK_NULLPTR;
+    stage.Matrix = matrixOffset->GetMatrix();
+    stage.Offset = matrixOffset->GetOffset();
+    this->m_Stages.push_back( stage );
+  }
+
+  void TransformRange( unsigned long begin, unsigned long end ) const
+  {
+    std::vector<PointType> points( BatchSize );
+    for( unsigned long batchBegin = begin; batchBegin < end; batchBegin += BatchSize )
+      {
+      const unsigned long batchEnd = std::min( batchBegin + BatchSize, end );
+      const unsigned long numberOfPoints = batchEnd - batchBegin;
+
+      for( unsigned long n = 0; n < numberOfPoints; n++ )
+        {
+        const TRealType *coordinates = this->m_Input + ( batchBegin + n ) * this->m_Stride;
+        for( unsigned int d = 0; d < VDimension; d++ )
+          {
+          points[n][d] = coordinates[d];
+          }
+        }
+
+      for( size_t s = 0; s < this->m_Stages.size(); s++ )
+        {
+        const Stage & stage = this->m_Stages[s];
+        if( stage.Transform )
+          {
+          for( unsigned long n = 0; n < numberOfPoints; n++ )
+            {
+            points[n] = stage.Transform->TransformPoint( points[n] );
+            }
+          }
+        else
+          {
+          for( unsigned long n = 0; n < numberOfPoints; n++ )
+            {
+            PointType transformed;
+            for( unsigned int i = 0; i < VDimension; i++ )
+              {
+              TRealType value = stage.Offset[i];
+              for( unsigned int j = 0; j < VDimension; j++ )
+                {
+                value += stage.Matrix[i][j] * points[n][j];
+                }
+              transformed[i] = value;
+              }
+            points[n] = transformed;
+            }
+          }
+        }
+
+      for( unsigned long n = 0; n < numberOfPoints; n++ )
+        {
+        TRealType *coordinates = this->m_Output + ( batchBegin + n ) * this->m_Stride;
+        for( unsigned int d = 0; d < VDimension; d++ )
+          {
+          coordinates[d] = points[n][d];
+          }
+        }
+      }
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg )
+  {
+    itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    const Self *                          self = static_cast<const Self *>( info->UserData );
+
+    // contiguous ranges so that each thread walks its own part of the arrays
+    const unsigned long long numberOfPoints = self->m_NumberOfPoints;
+    const unsigned long      begin = static_cast<unsigned long>( numberOfPoints * info->ThreadID
+                                                                 / info->NumberOfThreads );
+    const unsigned long      end = static_cast<unsigned long>( numberOfPoints * ( info->ThreadID + 1 )
+                                                               / info->NumberOfThreads );
+    self->TransformRange( begin, end );
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  unsigned int       m_NumberOfThreads;
+  std::vector<Stage> m_Stages;
+
+  const TRealType *m_Input;
+  TRealType *      m_Output;
+  unsigned long    m_NumberOfPoints;
+  unsigned int     m_Stride;
+};
+} // namespace ants
+
+#endif // __antsTransformPoints_h
@@ -0,0 +1,481 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef antsVoxelMatrixFile_h
+#define antsVoxelMatrixFile_h
+
+#include "itkMacro.h"
+#include <vnl/vnl_matrix.h>
+#include <vnl/vnl_vector.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined( _WIN32 )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ants
+{
+/** \file antsVoxelMatrixFile.h
+ *
+ * A binary subjects x voxels matrix (extension .vxm) that is read by mapping
+ * the file into memory instead of parsing it.  Several processes reading the
+ * same file, e.g. sccan permutation runs, share one copy in the page cache.
+ *
+ * Layout (native byte order, checked on reading):
+ *   64 byte header: "ANTSVXM1", byte order mark, data offset, data type
+ *                   (VoxelMatrixFloat or VoxelMatrixDouble), rows, columns,
+ *                   length of the mask file name, number of voxel indices
+ *   the mask file name the columns were taken from
+ *   optionally, at the next multiple of 8, one unsigned 64 bit voxel index per
+ *                   column: the offset of the column's voxel in the mask
+ *                   buffer, so that a row can be put back into an image
+ *   the rows, one subject per row, starting at the data offset (a multiple of 64)
+ *
+ * Files without voxel indices have NumberOfVoxelIndices == 0; files written
+ * before the field existed have zeros there and read the same way.
+ */
+enum VoxelMatrixDataType { VoxelMatrixFloat = 1, VoxelMatrixDouble = 2 };
+
+struct VoxelMatrixFileHeader
+  {
+  char                Magic[8];
+  unsigned int        ByteOrderMark;
+  unsigned int        DataOffset;
+  unsigned int        DataType;
+  unsigned int        MaskFileNameLength;
+  unsigned long long  Rows;
+  unsigned long long  Columns;
+  unsigned long long  NumberOfVoxelIndices;
+  char                Reserved[16];
+  };
+
+static const char         VoxelMatrixFileMagic[8] = { 'A', 'N', 'T', 'S', 'V', 'X', 'M', '1' };
+static const unsigned int VoxelMatrixFileByteOrderMark = 0x01020304;
+
+/** Where the voxel indices start: after the mask file name, 8 byte aligned. */
+inline size_t GetVoxelMatrixFileIndexOffset( unsigned int maskFileNameLength )
+{
+  return ( ( sizeof( VoxelMatrixFileHeader ) + maskFileNameLength + 7 ) / 8 ) * 8;
+}
+
+/** \class VoxelMatrixFileWriter
+ *
+ * Writes a .vxm file one row at a time, so that a matrix can be built from a
+ * list of images without holding it in memory.  Rows are appended in order
+ * with WriteRow( row ) or put at their place with WriteRow( n, row ), e.g. by
+ * threads that each read a different image; the writer is not thread safe,
+ * so the latter have to hold a lock around the call.
+ */
+class VoxelMatrixFileWriter
+{
+public:
+  VoxelMatrixFileWriter() :
+    m_Rows( 0 ),
+    m_Columns( 0 ),
+    m_DataType( VoxelMatrixFloat ),
+    m_DataOffset( 0 ),
+    m_RowsWritten( 0 )
+  {
+  }
+
+  ~VoxelMatrixFileWriter()
+  {
+    this->Close();
+  }
+
+  /** voxelIndices is either empty or holds one mask buffer offset per column. */
+  bool Open( const std::string & filename, unsigned long rows, unsigned long columns,
+             VoxelMatrixDataType dataType = VoxelMatrixFloat, const std::string & maskFileName = std::string(),
+             const std::vector<unsigned long long> & voxelIndices = std::vector<unsigned long long>() )
+  {
+    if( !voxelIndices.empty() && voxelIndices.size() != columns )
+      {
+      std::cerr << "VoxelMatrixFileWriter: " << voxelIndices.size() << " voxel indices for " << columns
+                << " columns." << std::endl;
+      return false;
+      }
+    this->m_Stream.open( filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if( !this->m_Stream.is_open() )
+      {
+      std::cerr << "Can't open " << filename << " for writing." << std::endl;
+      return false;
+      }
+    this->m_Rows = rows;
+    this->m_Columns = columns;
+    this->m_DataType = dataType;
+    this->m_RowsWritten = 0;
+
+    VoxelMatrixFileHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.Magic, VoxelMatrixFileMagic, sizeof( header.Magic ) );
+    header.ByteOrderMark = VoxelMatrixFileByteOrderMark;
+    header.DataType = dataType;
+    header.MaskFileNameLength = static_cast<unsigned int>( maskFileName.size() );
+    header.NumberOfVoxelIndices = voxelIndices.size();
+    const size_t indexOffset = GetVoxelMatrixFileIndexOffset( header.MaskFileNameLength );
+    const size_t indexEnd = voxelIndices.empty() ? sizeof( header ) + maskFileName.size()
+      : indexOffset + voxelIndices.size() * sizeof( unsigned long long );
+    header.DataOffset = static_cast<unsigned int>( ( ( indexEnd + 63 ) / 64 ) * 64 );
+    header.Rows = rows;
+    header.Columns = columns;
+    this->m_DataOffset = header.DataOffset;
+
+    this->m_Stream.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+    this->m_Stream.write( maskFileName.c_str(), maskFileName.size() );
+    if( !voxelIndices.empty() )
+      {
+      this->WritePadding( indexOffset - sizeof( header ) - maskFileName.size() );
+      this->m_Stream.write( reinterpret_cast<const char *>( &voxelIndices[0] ),
+                            voxelIndices.size() * sizeof( unsigned long long ) );
+      }
+    this->WritePadding( header.DataOffset - indexEnd );
+    return this->m_Stream.good();
+  }
+
+  /** Append the next row; it must have as many entries as there are columns. */
+  template <class T>
+  bool WriteRow( const T *row )
+  {
+    if( !this->m_Stream.is_open() || this->m_RowsWritten >= this->m_Rows )
+      {
+      std::cerr << "VoxelMatrixFileWriter: no room for another row." << std::endl;
+      return false;
+      }
+    return this->WriteRowAt( this->m_RowsWritten, row );
+  }
+
+  /** Write row n, in any order; each row has to be written once. */
+  template <class T>
+  bool WriteRow( unsigned long n, const T *row )
+  {
+    if( !this->m_Stream.is_open() || n >= this->m_Rows )
+      {
+      std::cerr << "VoxelMatrixFileWriter: row " << n << " is out of range." << std::endl;
+      return false;
+      }
+    return this->WriteRowAt( n, row );
+  }
+
+  template <class T>
+  bool WriteRow( const vnl_vector<T> & row )
+  {
+    if( row.size() != this->m_Columns )
+      {
+      std::cerr << "VoxelMatrixFileWriter: the row has " << row.size() << " entries instead of "
+                << this->m_Columns << "." << std::endl;
+      return false;
+      }
+    return this->WriteRow( row.data_block() );
+  }
+
+  /** Returns false if fewer rows were written than announced in Open(). */
+  bool Close()
+  {
+    if( !this->m_Stream.is_open() )
+      {
+      return true;
+      }
+    this->m_Stream.close();
+    if( this->m_RowsWritten != this->m_Rows )
+      {
+      std::cerr << "VoxelMatrixFileWriter: wrote " << this->m_RowsWritten << " of " << this->m_Rows
+                << " rows." << std::endl;
+      return false;
+      }
+    return true;
+  }
+
+private:
+  template <class T>
+  bool WriteRowAt( unsigned long n, const T *row )
+  {
+    const size_t rowSize = this->m_Columns
+      * ( this->m_DataType == VoxelMatrixFloat ? sizeof( float ) : sizeof( double ) );
+    this->m_Stream.seekp( static_cast<std::streamoff>( this->m_DataOffset + n * rowSize ) );
+    if( this->m_DataType == VoxelMatrixFloat )
+      {
+      this->WriteConvertedRow<float>( row );
+      }
+    else
+      {
+      this->WriteConvertedRow<double>( row );
+      }
+    this->m_RowsWritten++;
+    return this->m_Stream.good();
+  }
+
+  void WritePadding( size_t length )
+  {
+    const std::vector<char> padding( length, 0 );
+    if( !padding.empty() )
+      {
+      this->m_Stream.write( &padding[0], padding.size() );
+      }
+  }
+
+  template <class TOut, class T>
+  void WriteConvertedRow( const T *row )
+  {
+    std::vector<TOut> buffer( row, row + this->m_Columns );
+    this->m_Stream.write( reinterpret_cast<const char *>( &buffer[0] ), buffer.size() * sizeof( TOut ) );
+  }
+
+  std::ofstream       m_Stream;
+  unsigned long       m_Rows;
+  unsigned long       m_Columns;
+  VoxelMatrixDataType m_DataType;
+  size_t              m_DataOffset;
+  unsigned long       m_RowsWritten;
+};
+
+/** \class VoxelMatrixFile
+ *
+ * Maps a .vxm file read-only.  The rows can be used in place through
+ * GetRow() or copied into a vnl_matrix with GetMatrix().
+ */
+class VoxelMatrixFile
+{
+public:
+  VoxelMatrixFile() :
+    m_Data( ITK_NULLPTR ),
+    m_Length( 0 )
+#if defined( _WIN32 )
+    , m_File( INVALID_HANDLE_VALUE ),
+    m_Mapping( ITK_NULLPTR )
+#endif
+  {
+    memset( &this->m_Header, 0, sizeof( this->m_Header ) );
+  }
+
+  ~VoxelMatrixFile()
+  {
+    this->Close();
+  }
+
+  static bool IsVoxelMatrixFileName( const std::string & filename )
+  {
+    return filename.size() > 4 && filename.compare( filename.size() - 4, 4, ".vxm" ) == 0;
+  }
+
+  bool Open( const std::string & filename )
+  {
+    this->Close();
+#if defined( _WIN32 )
+    this->m_File = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, ITK_NULLPTR, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, ITK_NULLPTR );
+    if( this->m_File == INVALID_HANDLE_VALUE )
+      {
+      std::cerr << "Can't open " << filename << std::endl;
+      return false;
+      }
+    LARGE_INTEGER size;
+    GetFileSizeEx( this->m_File, &size );
+    this->m_Length = static_cast<size_t>( size.QuadPart );
+    this->m_Mapping = CreateFileMappingA( this->m_File, ITK_NULLPTR, PAGE_READONLY, 0, 0, ITK_NULLPTR );
+    if( this->m_Mapping != ITK_NULLPTR )
+      {
+      this->m_Data = static_cast<const char *>( MapViewOfFile( this->m_Mapping, FILE_MAP_READ, 0, 0, 0 ) );
+      }
+#else
+    const int fd = open( filename.c_str(), O_RDONLY );
+    if( fd < 0 )
+      {
+      std::cerr << "Can't open " << filename << std::endl;
+      return false;
+      }
+    struct stat st;
+    if( fstat( fd, &st ) == 0 && st.st_size > 0 )
+      {
+      this->m_Length = static_cast<size_t>( st.st_size );
+      void *data = mmap( ITK_NULLPTR, this->m_Length, PROT_READ, MAP_SHARED, fd, 0 );
+      if( data != MAP_FAILED )
+        {
+        this->m_Data = static_cast<const char *>( data );
+        }
+      }
+    // the mapping stays valid after the descriptor is closed
+    close( fd );
+#endif
+    if( this->m_Data == ITK_NULLPTR )
+      {
+      std::cerr << "Can't map " << filename << std::endl;
+      this->Close();
+      return false;
+      }
+    if( this->m_Length < sizeof( VoxelMatrixFileHeader ) )
+      {
+      std::cerr << filename << " is not a voxel matrix file." << std::endl;
+      this->Close();
+      return false;
+      }
+    memcpy( &this->m_Header, this->m_Data, sizeof( this->m_Header ) );
+    if( memcmp( this->m_Header.Magic, VoxelMatrixFileMagic, sizeof( VoxelMatrixFileMagic ) ) != 0 )
+      {
+      std::cerr << filename << " is not a voxel matrix file." << std::endl;
+      this->Close();
+      return false;
+      }
+    if( this->m_Header.ByteOrderMark != VoxelMatrixFileByteOrderMark )
+      {
+      std::cerr << filename << " was written with a different byte order." << std::endl;
+      this->Close();
+      return false;
+      }
+    if( ( this->m_Header.DataType != VoxelMatrixFloat && this->m_Header.DataType != VoxelMatrixDouble )
+        || this->m_Header.DataOffset < sizeof( VoxelMatrixFileHeader ) + this->m_Header.MaskFileNameLength
+        || ( this->m_Header.NumberOfVoxelIndices != 0
+             && ( this->m_Header.NumberOfVoxelIndices != this->m_Header.Columns
+                  || this->m_Header.DataOffset < GetVoxelMatrixFileIndexOffset( this->m_Header.MaskFileNameLength )
+                  + this->m_Header.NumberOfVoxelIndices * sizeof( unsigned long long ) ) )
+        || this->m_Length < this->m_Header.DataOffset + this->m_Header.Rows * this->GetRowSizeInBytes() )
+      {
+      std::cerr << filename << " is truncated or has a corrupt header." << std::endl;
+      this->Close();
+      return false;
+      }
+#if !defined( _WIN32 )
+    madvise( const_cast<char *>( this->m_Data ), this->m_Length, MADV_SEQUENTIAL );
+#endif
+    return true;
+  }
+
+  void Close()
+  {
+#if defined( _WIN32 )
+    if( this->m_Data != ITK_NULLPTR )
+      {
+      UnmapViewOfFile( this->m_Data );
+      }
+    if( this->m_Mapping != ITK_NULLPTR )
+      {
+      CloseHandle( this->m_Mapping );
+      }
+    if( this->m_File != INVALID_HANDLE_VALUE )
+      {
+      CloseHandle( this->m_File );
+      }
+    this->m_Mapping = ITK_NULLPTR;
+    this->m_File = INVALID_HANDLE_VALUE;
+#else
+    if( this->m_Data != ITK_NULLPTR )
+      {
+      munmap( const_cast<char *>( this->m_Data ), this->m_Length );
+      }
+#endif
+    this->m_Data = ITK_NULLPTR;
+    this->m_Length = 0;
+  }
+
+  unsigned long GetRows() const
+  {
+    return static_cast<unsigned long>( this->m_Header.Rows );
+  }
+
+  unsigned long GetColumns() const
+  {
+    return static_cast<unsigned long>( this->m_Header.Columns );
+  }
+
+  VoxelMatrixDataType GetDataType() const
+  {
+    return static_cast<VoxelMatrixDataType>( this->m_Header.DataType );
+  }
+
+  std::string GetMaskFileName() const
+  {
+    return std::string( this->m_Data + sizeof( VoxelMatrixFileHeader ), this->m_Header.MaskFileNameLength );
+  }
+
+  bool HasVoxelIndices() const
+  {
+    return this->m_Header.NumberOfVoxelIndices != 0;
+  }
+
+  /** The mask buffer offset of the voxel of each column, or null if the
+   * file has none. */
+  const unsigned long long * GetVoxelIndices() const
+  {
+    if( !this->HasVoxelIndices() )
+      {
+      return ITK_NULLPTR;
+      }
+    return reinterpret_cast<const unsigned long long *>(
+      this->m_Data + GetVoxelMatrixFileIndexOffset( this->m_Header.MaskFileNameLength ) );
+  }
+
+  /** Pointer into the mapping; float or double according to GetDataType(). */
+  const void * GetRow( unsigned long row ) const
+  {
+    return this->m_Data + this->m_Header.DataOffset + row * this->GetRowSizeInBytes();
+  }
+
+  template <class T>
+  void GetRow( unsigned long row, T *out ) const
+  {
+    if( this->m_Header.DataType == VoxelMatrixFloat )
+      {
+      const float *in = static_cast<const float *>( this->GetRow( row ) );
+      std::copy( in, in + this->GetColumns(), out );
+      }
+    else
+      {
+      const double *in = static_cast<const double *>( this->GetRow( row ) );
+      std::copy( in, in + this->GetColumns(), out );
+      }
+  }
+
+  template <class T>
+  void GetMatrix( vnl_matrix<T> & matrix ) const
+  {
+    matrix.set_size( this->GetRows(), this->GetColumns() );
+    for( unsigned long i = 0; i < this->GetRows(); i++ )
+      {
+      this->GetRow( i, matrix[i] );
+      }
+  }
+
+private:
+  VoxelMatrixFile( const VoxelMatrixFile & ); // purposely not implemented
+  void operator=( const VoxelMatrixFile & );  // purposely not implemented
+
+  size_t GetRowSizeInBytes() const
+  {
+    return static_cast<size_t>( this->m_Header.Columns )
+           * ( this->m_Header.DataType == VoxelMatrixFloat ? sizeof( float ) : sizeof( double ) );
+  }
+
+  VoxelMatrixFileHeader m_Header;
+  const char *          m_Data;
+  size_t                m_Length;
+#if defined( _WIN32 )
+  HANDLE m_File;
+  HANDLE m_Mapping;
+#endif
+};
+} // namespace ants
+
+#endif // antsVoxelMatrixFile_h
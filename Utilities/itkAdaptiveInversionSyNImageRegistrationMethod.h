@@ -0,0 +1,108 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkAdaptiveInversionSyNImageRegistrationMethod_h
+#define __itkAdaptiveInversionSyNImageRegistrationMethod_h
+
+#include "itkSyNImageRegistrationMethod.h"
+
+namespace itk
+{
+/** \class AdaptiveInversionSyNImageRegistrationMethod
+ *
+ * SyNImageRegistrationMethod or BSplineSyNImageRegistrationMethod (the
+ * template parameter) whose inversions of the displacement fields stop
+ * earlier at the coarse levels.
+ *
+ * SyN inverts both half-way fields at every iteration, starting from the
+ * inverse of the previous iteration.  The superclass always asks for the
+ * same accuracy, although the fields of a coarse level are refined by the
+ * finer ones.  Here the error tolerances of the finest level are multiplied
+ * by LevelToleranceFactor for every level above it, the maximum error being
+ * capped at half a voxel, and the number of iterations of an inversion is
+ * capped at MaximumNumberOfInversionIterations.  A LevelToleranceFactor of 1
+ * gives the tolerances of the superclass at every level.
+ *
+ * With optimizer weights which zero some of the components of the updates
+ * (restrict-deformation), those components of the fields stay zero, so the
+ * Gaussian smoothing of the fields only smooths the other components, one
+ * scalar image at a time, as long as the restricted components of the field
+ * are indeed zero.
+ */
+template <typename TSyNImageRegistrationMethod>
+class AdaptiveInversionSyNImageRegistrationMethod : public TSyNImageRegistrationMethod
+{
+public:
+  /** Standard class typedefs. */
+  typedef AdaptiveInversionSyNImageRegistrationMethod Self;
+  typedef TSyNImageRegistrationMethod                 Superclass;
+  typedef SmartPointer<Self>                          Pointer;
+  typedef SmartPointer<const Self>                    ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( AdaptiveInversionSyNImageRegistrationMethod, SyNImageRegistrationMethod );
+
+  typedef typename Superclass::RealType                 RealType;
+  typedef typename Superclass::DisplacementFieldType    DisplacementFieldType;
+  typedef typename Superclass::DisplacementFieldPointer DisplacementFieldPointer;
+  typedef typename Superclass::OptimizerWeightsType     OptimizerWeightsType;
+
+  /** The largest number of iterations of an inversion.  Default 20. */
+  itkSetMacro( MaximumNumberOfInversionIterations, unsigned int );
+  itkGetConstMacro( MaximumNumberOfInversionIterations, unsigned int );
+
+  /** The tolerances of the mean and the maximum inverse error, in voxels, at
+      the finest level.  Defaults 0.001 and 0.1. */
+  itkSetMacro( MeanInversionErrorTolerance, RealType );
+  itkGetConstMacro( MeanInversionErrorTolerance, RealType );
+  itkSetMacro( MaxInversionErrorTolerance, RealType );
+  itkGetConstMacro( MaxInversionErrorTolerance, RealType );
+
+  /** The factor of the tolerances from one level to the next coarser one.
+      Default 2. */
+  itkSetClampMacro( LevelToleranceFactor, RealType, 1.0, NumericTraits<RealType>::max() );
+  itkGetConstMacro( LevelToleranceFactor, RealType );
+
+protected:
+  AdaptiveInversionSyNImageRegistrationMethod();
+  virtual ~AdaptiveInversionSyNImageRegistrationMethod()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+  virtual DisplacementFieldPointer InvertDisplacementField( const DisplacementFieldType *,
+                                                            const DisplacementFieldType * = ITK_NULLPTR ) ITK_OVERRIDE;
+
+  virtual DisplacementFieldPointer GaussianSmoothDisplacementField( const DisplacementFieldType *,
+                                                                    const RealType ) ITK_OVERRIDE;
+
+private:
+  AdaptiveInversionSyNImageRegistrationMethod( const Self & ); // purposely not implemented
+  void operator=( const Self & );                              // purposely not implemented
+
+  unsigned int m_MaximumNumberOfInversionIterations;
+  RealType     m_MeanInversionErrorTolerance;
+  RealType     m_MaxInversionErrorTolerance;
+  RealType     m_LevelToleranceFactor;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkAdaptiveInversionSyNImageRegistrationMethod.hxx"
+#endif
+
+#endif
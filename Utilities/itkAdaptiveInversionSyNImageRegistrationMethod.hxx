@@ -0,0 +1,185 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkAdaptiveInversionSyNImageRegistrationMethod_hxx
+#define __itkAdaptiveInversionSyNImageRegistrationMethod_hxx
+
+#include "itkAdaptiveInversionSyNImageRegistrationMethod.h"
+
+#include "antsAllocImage.h"
+#include "antsSeparableGaussianSmoothing.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkInvertDisplacementFieldImageFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace itk
+{
+template <typename TSyNImageRegistrationMethod>
+AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>
+::AdaptiveInversionSyNImageRegistrationMethod() :
+  m_MaximumNumberOfInversionIterations( 20 ),
+  m_MeanInversionErrorTolerance( 0.001 ),
+  m_MaxInversionErrorTolerance( 0.1 ),
+  m_LevelToleranceFactor( 2.0 )
+{
+}
+
+template <typename TSyNImageRegistrationMethod>
+typename AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>::DisplacementFieldPointer
+AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>
+::InvertDisplacementField( const DisplacementFieldType * field, const DisplacementFieldType * inverseFieldEstimate )
+{
+  const int levelsToFinest = static_cast<int>( this->m_NumberOfLevels ) - 1
+    - static_cast<int>( this->m_CurrentLevel );
+  const RealType levelFactor = std::pow( this->m_LevelToleranceFactor,
+                                         static_cast<RealType>( std::max( levelsToFinest, 0 ) ) );
+
+  typedef InvertDisplacementFieldImageFilter<DisplacementFieldType> InverterType;
+
+  typename InverterType::Pointer inverter = InverterType::New();
+  inverter->SetInput( field );
+  inverter->SetInverseFieldInitialEstimate( inverseFieldEstimate );
+  inverter->SetMaximumNumberOfIterations( this->m_MaximumNumberOfInversionIterations );
+  inverter->SetMeanErrorToleranceThreshold( this->m_MeanInversionErrorTolerance * levelFactor );
+  inverter->SetMaxErrorToleranceThreshold( std::max( this->m_MaxInversionErrorTolerance,
+                                                     std::min( this->m_MaxInversionErrorTolerance * levelFactor,
+                                                               static_cast<RealType>( 0.5 ) ) ) );
+  inverter->Update();
+
+  DisplacementFieldPointer inverseField = inverter->GetOutput();
+  inverseField->DisconnectPipeline();
+  return inverseField;
+}
+
+template <typename TSyNImageRegistrationMethod>
+typename AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>::DisplacementFieldPointer
+AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>
+::GaussianSmoothDisplacementField( const DisplacementFieldType * field, const RealType variance )
+{
+  const unsigned int ImageDimension = DisplacementFieldType::ImageDimension;
+
+  typedef typename DisplacementFieldType::PixelType VectorType;
+  typedef Image<RealType, ImageDimension>           RealImageType;
+
+  const OptimizerWeightsType weights = this->GetOptimizerWeights();
+  if( variance <= 0.0 || weights.Size() != ImageDimension )
+    {
+    return Superclass::GaussianSmoothDisplacementField( field, variance );
+    }
+
+  std::vector<unsigned int> activeComponents;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( weights[d] != NumericTraits<typename OptimizerWeightsType::ValueType>::ZeroValue() )
+      {
+      activeComponents.push_back( d );
+      }
+    }
+  if( activeComponents.size() == ImageDimension )
+    {
+    return Superclass::GaussianSmoothDisplacementField( field, variance );
+    }
+
+  // the restricted components of the field must be zero for their smoothing
+  // to be zero as well
+  const VectorType *  vectors = field->GetBufferPointer();
+  const SizeValueType numberOfPixels = field->GetBufferedRegion().GetNumberOfPixels();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( vectors[n][d] != NumericTraits<RealType>::ZeroValue()
+          && std::find( activeComponents.begin(), activeComponents.end(), d ) == activeComponents.end() )
+        {
+        return Superclass::GaussianSmoothDisplacementField( field, variance );
+        }
+      }
+    }
+
+  // the operators of the superclass: each axis with the maximum error 0.001
+  // and a kernel no wider than the field, a blend with the input for the
+  // small variances and no motion on the boundary
+  RealType weight1 = 1.0;
+  if( variance < 0.5 )
+    {
+    weight1 = 1.0 - 1.0 * ( variance / 0.5 );
+    }
+  const RealType weight2 = 1.0 - weight1;
+
+  const VectorType         zeroVector( 0.0 );
+  DisplacementFieldPointer smoothField = AllocImage<DisplacementFieldType>( field, zeroVector );
+  VectorType *             smoothVectors = smoothField->GetBufferPointer();
+
+  const typename DisplacementFieldType::RegionType region = field->GetLargestPossibleRegion();
+  const typename DisplacementFieldType::SizeType   size = region.GetSize();
+  const typename DisplacementFieldType::IndexType  startIndex = region.GetIndex();
+
+  typename RealImageType::Pointer component = AllocImage<RealImageType>( field );
+  RealType *                      values = component->GetBufferPointer();
+  for( unsigned int c = 0; c < activeComponents.size(); c++ )
+    {
+    const unsigned int k = activeComponents[c];
+    for( SizeValueType n = 0; n < numberOfPixels; n++ )
+      {
+      values[n] = vectors[n][k];
+      }
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      FixedArray<double, ImageDimension> varianceArray;
+      varianceArray.Fill( 0.0 );
+      varianceArray[d] = variance;
+      ::ants::SeparableGaussianSmoothing::Smooth<RealImageType>( component, varianceArray, 0.001,
+                                                                 static_cast<unsigned int>( size[d] ),
+                                                                 ::ants::SeparableGaussianSmoothing::FIR );
+      }
+
+    ImageRegionConstIteratorWithIndex<RealImageType> It( component, component->GetBufferedRegion() );
+    for( SizeValueType n = 0; !It.IsAtEnd(); ++It, n++ )
+      {
+      const typename RealImageType::IndexType index = It.GetIndex();
+      bool                                    isOnBoundary = false;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( index[d] == startIndex[d] || index[d] == static_cast<IndexValueType>( size[d] ) - startIndex[d] - 1 )
+          {
+          isOnBoundary = true;
+          break;
+          }
+        }
+      if( !isOnBoundary )
+        {
+        smoothVectors[n][k] = It.Get() * weight1 + vectors[n][k] * weight2;
+        }
+      }
+    }
+  return smoothField;
+}
+
+template <typename TSyNImageRegistrationMethod>
+void
+AdaptiveInversionSyNImageRegistrationMethod<TSyNImageRegistrationMethod>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Maximum number of inversion iterations: " << this->m_MaximumNumberOfInversionIterations
+     << std::endl;
+  os << indent << "Mean inversion error tolerance: " << this->m_MeanInversionErrorTolerance << std::endl;
+  os << indent << "Max inversion error tolerance: " << this->m_MaxInversionErrorTolerance << std::endl;
+  os << indent << "Level tolerance factor: " << this->m_LevelToleranceFactor << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -87,6 +87,20 @@ public:
   typedef typename ConstNeighborhoodIteratorType::RadiusType   NeighborhoodRadiusType;
   typedef typename ConstNeighborhoodIteratorType::OffsetType   NeighborhoodOffsetType;
 
+  /**
+   * Denoising algorithms.
+   *
+   * Blockwise:  each voxel (or each BlockStep-th voxel along every axis)
+   *   estimates its whole patch and the overlapping patch estimates are
+   *   averaged (the original implementation for BlockStep = 1).
+   *
+   * Pixelwise:  only the center voxel of each patch is estimated.  For every
+   *   search offset, the patch distances of all voxels are computed at once
+   *   with running box sums of the squared differences, so that the cost per
+   *   voxel no longer depends on the patch size.
+   */
+  enum DenoisingAlgorithmType { Blockwise, Pixelwise };
+
   /**
    * The image expected for input for noise correction.
    */
@@ -173,6 +187,22 @@ public:
   itkSetMacro( NeighborhoodPatchRadius, NeighborhoodRadiusType );
   itkGetConstMacro( NeighborhoodPatchRadius, NeighborhoodRadiusType );
 
+  /**
+   * Denoising algorithm.
+   * Default = Blockwise.
+   */
+  itkSetMacro( DenoisingAlgorithm, DenoisingAlgorithmType );
+  itkGetConstMacro( DenoisingAlgorithm, DenoisingAlgorithmType );
+
+  /**
+   * Distance between the centers of neighboring blocks for the blockwise
+   * algorithm.  Steps larger than the patch size (2 * radius + 1) would leave
+   * voxels without an estimate and are reduced to it.
+   * Default = 1.
+   */
+  itkSetClampMacro( BlockStep, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( BlockStep, unsigned int );
+
 protected:
   AdaptiveNonLocalMeansDenoisingImageFilter();
   ~AdaptiveNonLocalMeansDenoisingImageFilter() {}
@@ -192,6 +222,10 @@ private:
 
   RealType CalculateCorrectionFactor( RealType );
 
+  void ThreadedGenerateDataPixelwise( const RegionType &, ThreadIdType );
+
+  bool IsBlockCenter( const IndexType & ) const;
+
   bool                              m_UseRicianNoiseModel;
 
   ModifiedBesselCalculatorType      m_ModifiedBesselCalculator;
@@ -215,6 +249,9 @@ private:
   NeighborhoodRadiusType            m_NeighborhoodSearchRadius;
   NeighborhoodRadiusType            m_NeighborhoodPatchRadius;
 
+  DenoisingAlgorithmType            m_DenoisingAlgorithm;
+  unsigned int                      m_BlockStep;
+
   std::vector<NeighborhoodOffsetType>  m_NeighborhoodOffsetList;
 };
 
@@ -32,7 +32,9 @@
 #include "itkStatisticsImageFilter.h"
 #include "itkVarianceImageFilter.h"
 
+#include <algorithm>
 #include <numeric>
+#include <vector>
 
 namespace itk {
 
@@ -46,7 +48,9 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
   m_SmoothingFactor( 1.0 ),
   m_SmoothingVariance( 2.0 ),
   m_MaximumInputPixelIntensity( NumericTraits<RealType>::NonpositiveMin() ),
-  m_MinimumInputPixelIntensity( NumericTraits<RealType>::max() )
+  m_MinimumInputPixelIntensity( NumericTraits<RealType>::max() ),
+  m_DenoisingAlgorithm( Blockwise ),
+  m_BlockStep( 1 )
 {
   this->SetNumberOfRequiredInputs( 1 );
 
@@ -131,6 +135,12 @@ void
 AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
 ::ThreadedGenerateData( const RegionType &region, ThreadIdType threadId )
 {
+  if( this->m_DenoisingAlgorithm == Pixelwise )
+    {
+    this->ThreadedGenerateDataPixelwise( region, threadId );
+    return;
+    }
+
   ProgressReporter progress( this, threadId, region.GetNumberOfPixels(), 100 );
 
   const InputImageType *inputImage = this->GetInput();
@@ -161,6 +171,19 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
 
   while( !ItM.IsAtEnd() )
     {
+    if( this->m_BlockStep > 1 && !this->IsBlockCenter( ItM.GetIndex() ) )
+      {
+      ++ItM;
+      ++ItV;
+      ++ItBI;
+      ++ItBL;
+      ++ItBM;
+      ++ItBO;
+
+      progress.CompletedPixel();
+      continue;
+      }
+
     typename InputImageType::PixelType inputCenterPixel = ItBI.GetCenterPixel();
 
     RealType meanCenterPixel = ItM.GetCenterPixel();
@@ -385,6 +408,369 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
     }
 }
 
+template<typename TInputImage, typename TOutputImage, typename TMaskImage>
+bool
+AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
+::IsBlockCenter( const IndexType & index ) const
+{
+  const RegionType & largestRegion = this->GetInput()->GetLargestPossibleRegion();
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const unsigned int step = std::min( this->m_BlockStep,
+      static_cast<unsigned int>( 2 * this->m_NeighborhoodPatchRadius[d] + 1 ) );
+    const IndexValueType offset = index[d] - largestRegion.GetIndex()[d];
+
+    // the last voxel along each axis is always a center so that the image border is covered
+    if( offset % step != 0 && offset != static_cast<IndexValueType>( largestRegion.GetSize()[d] ) - 1 )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+template<typename TInputImage, typename TOutputImage, typename TMaskImage>
+void
+AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
+::ThreadedGenerateDataPixelwise( const RegionType &region, ThreadIdType threadId )
+{
+  const InputImageType *inputImage = this->GetInput();
+  const MaskImageType *maskImage = this->GetMaskImage();
+
+  OutputImageType *outputImage = this->GetOutput();
+
+  const RegionType & inputRegion = inputImage->GetRequestedRegion();
+
+  // The squared differences for a search offset are summed over the patches
+  // of all voxels of the thread region, i.e. over the region padded by the
+  // search and patch radii (clipped to the image).  Everything is held in flat
+  // buffers over this padded region.
+  NeighborhoodRadiusType padding;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    padding[d] = this->m_NeighborhoodSearchRadius[d] + this->m_NeighborhoodPatchRadius[d];
+    }
+  RegionType paddedRegion = region;
+  paddedRegion.PadByRadius( padding );
+  paddedRegion.Crop( inputRegion );
+
+  const IndexType paddedStart = paddedRegion.GetIndex();
+  const typename RegionType::SizeType paddedSize = paddedRegion.GetSize();
+  const SizeValueType numberOfPaddedVoxels = paddedRegion.GetNumberOfPixels();
+
+  OffsetValueType paddedStrides[ImageDimension];
+  paddedStrides[0] = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    paddedStrides[d] = paddedStrides[d - 1] * static_cast<OffsetValueType>( paddedSize[d - 1] );
+    }
+
+  std::vector<RealType> intensities( numberOfPaddedVoxels );
+  std::vector<RealType> means( numberOfPaddedVoxels );
+  std::vector<RealType> variances( numberOfPaddedVoxels );
+  {
+  ImageRegionConstIterator<InputImageType> ItI( inputImage, paddedRegion );
+  ImageRegionConstIterator<RealImageType> ItM( this->m_MeanImage, paddedRegion );
+  ImageRegionConstIterator<RealImageType> ItV( this->m_VarianceImage, paddedRegion );
+  for( SizeValueType i = 0; !ItI.IsAtEnd(); ++ItI, ++ItM, ++ItV, ++i )
+    {
+    intensities[i] = static_cast<RealType>( ItI.Get() );
+    means[i] = ItM.Get();
+    variances[i] = ItV.Get();
+    }
+  }
+
+  // search offsets (without the center)
+  Neighborhood<RealType, ImageDimension> searchNeighborhood;
+  searchNeighborhood.SetRadius( this->m_NeighborhoodSearchRadius );
+  std::vector<NeighborhoodOffsetType> searchOffsets;
+  for( unsigned int m = 0; m < searchNeighborhood.Size(); m++ )
+    {
+    if( m != static_cast<unsigned int>( 0.5 * searchNeighborhood.Size() ) )
+      {
+      searchOffsets.push_back( searchNeighborhood.GetOffset( m ) );
+      }
+    }
+
+  ProgressReporter progress( this, threadId, 2 * searchOffsets.size() + 1, 100 );
+
+  // per voxel state of the thread region
+  const SizeValueType numberOfRegionVoxels = region.GetNumberOfPixels();
+
+  std::vector<SizeValueType> paddedIndices( numberOfRegionVoxels );
+  std::vector<bool>          isActive( numberOfRegionVoxels );
+  std::vector<RealType>      minimumDistances( numberOfRegionVoxels, NumericTraits<RealType>::max() );
+  std::vector<RealType>      maxWeights( numberOfRegionVoxels, NumericTraits<RealType>::ZeroValue() );
+  std::vector<RealType>      sumOfWeights( numberOfRegionVoxels, NumericTraits<RealType>::ZeroValue() );
+  std::vector<RealType>      weightedAverageIntensities( numberOfRegionVoxels, NumericTraits<RealType>::ZeroValue() );
+  {
+  ImageRegionConstIteratorWithIndex<RealImageType> It( this->m_MeanImage, region );
+  for( SizeValueType i = 0; !It.IsAtEnd(); ++It, ++i )
+    {
+    const IndexType index = It.GetIndex();
+
+    SizeValueType paddedIndex = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      paddedIndex += ( index[d] - paddedStart[d] ) * paddedStrides[d];
+      }
+    paddedIndices[i] = paddedIndex;
+
+    isActive[i] = ( intensities[paddedIndex] > 0 && means[paddedIndex] > this->m_Epsilon &&
+      variances[paddedIndex] > this->m_Epsilon &&
+      ( !maskImage || maskImage->GetPixel( index ) != NumericTraits<MaskPixelType>::ZeroValue() ) );
+    }
+  }
+
+  std::vector<double> patchDistances( numberOfPaddedVoxels );
+  std::vector<double> lineSums;
+
+  // Two sweeps over the search offsets.  The first finds the minimum distance
+  // between the mean-subtracted patches, which sets the scale of the weights
+  // computed from the intensity patches in the second.
+  for( unsigned int sweep = 0; sweep < 2; sweep++ )
+    {
+    const bool useMeanSubtractedPatches = ( sweep == 0 );
+
+    if( sweep == 1 )
+      {
+      for( SizeValueType i = 0; i < numberOfRegionVoxels; i++ )
+        {
+        if( !isActive[i] )
+          {
+          continue;
+          }
+        if( itk::Math::AlmostEquals( minimumDistances[i], NumericTraits<RealType>::ZeroValue() ) )
+          {
+          minimumDistances[i] = NumericTraits<RealType>::OneValue();
+          }
+        }
+      }
+
+    for( unsigned int m = 0; m < searchOffsets.size(); m++ )
+      {
+      const NeighborhoodOffsetType & searchOffset = searchOffsets[m];
+
+      // squared difference between each voxel y and the voxel y - offset (clamped
+      // to the image like the patch neighborhood iterators), so that the box sum
+      // around x + offset is the distance between the patches at x and x + offset
+      {
+      IndexType index = paddedStart;
+      for( SizeValueType i = 0; i < numberOfPaddedVoxels; i++ )
+        {
+        SizeValueType shiftedIndex = 0;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          IndexValueType shifted = index[d] - searchOffset[d];
+          shifted = std::max( shifted, paddedStart[d] );
+          shifted = std::min( shifted, paddedStart[d] + static_cast<IndexValueType>( paddedSize[d] ) - 1 );
+          shiftedIndex += ( shifted - paddedStart[d] ) * paddedStrides[d];
+          }
+
+        RealType difference = intensities[i] - intensities[shiftedIndex];
+        if( useMeanSubtractedPatches )
+          {
+          difference -= ( means[i] - means[shiftedIndex] );
+          }
+        patchDistances[i] = vnl_math_sqr( static_cast<double>( difference ) );
+
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          if( ++index[d] < paddedStart[d] + static_cast<IndexValueType>( paddedSize[d] ) )
+            {
+            break;
+            }
+          index[d] = paddedStart[d];
+          }
+        }
+      }
+
+      // separable box sums with the patch radius
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        const SizeValueType    lineLength = paddedSize[d];
+        const IndexValueType   radius = static_cast<IndexValueType>( this->m_NeighborhoodPatchRadius[d] );
+        const OffsetValueType  stride = paddedStrides[d];
+        const SizeValueType    numberOfLines = numberOfPaddedVoxels / lineLength;
+
+        lineSums.resize( lineLength + 1 );
+        for( SizeValueType l = 0; l < numberOfLines; l++ )
+          {
+          const SizeValueType lineStart = ( l % stride ) + ( l / stride ) * stride * lineLength;
+
+          lineSums[0] = 0.0;
+          for( SizeValueType k = 0; k < lineLength; k++ )
+            {
+            lineSums[k + 1] = lineSums[k] + patchDistances[lineStart + k * stride];
+            }
+          for( SizeValueType k = 0; k < lineLength; k++ )
+            {
+            const IndexValueType first = std::max( static_cast<IndexValueType>( k ) - radius,
+              static_cast<IndexValueType>( 0 ) );
+            const IndexValueType last = std::min( static_cast<IndexValueType>( k ) + radius,
+              static_cast<IndexValueType>( lineLength ) - 1 );
+            patchDistances[lineStart + k * stride] = lineSums[last + 1] - lineSums[first];
+            }
+          }
+        }
+
+      OffsetValueType paddedOffset = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        paddedOffset += searchOffset[d] * paddedStrides[d];
+        }
+
+      ImageRegionConstIteratorWithIndex<RealImageType> It( this->m_MeanImage, region );
+      for( SizeValueType i = 0; !It.IsAtEnd(); ++It, ++i )
+        {
+        if( !isActive[i] )
+          {
+          continue;
+          }
+
+        const IndexType neighborhoodIndex = It.GetIndex() + searchOffset;
+        if( !inputRegion.IsInside( neighborhoodIndex ) )
+          {
+          continue;
+          }
+
+        const SizeValueType centerIndex = paddedIndices[i];
+        const SizeValueType neighborIndex = centerIndex + paddedOffset;
+
+        const RealType meanCenterPixel = means[centerIndex];
+        const RealType varianceCenterPixel = variances[centerIndex];
+        const RealType meanNeighborhoodPixel = means[neighborIndex];
+        const RealType varianceNeighborhoodPixel = variances[neighborIndex];
+
+        if( useMeanSubtractedPatches )
+          {
+          if( intensities[neighborIndex] <= 0 || meanNeighborhoodPixel <= this->m_Epsilon ||
+              varianceNeighborhoodPixel <= this->m_Epsilon )
+            {
+            continue;
+            }
+          }
+        else
+          {
+          if( intensities[neighborIndex] <= 0 || meanNeighborhoodPixel < this->m_Epsilon ||
+              varianceNeighborhoodPixel < this->m_Epsilon )
+            {
+            continue;
+            }
+          }
+
+        const RealType meanRatio = meanCenterPixel / meanNeighborhoodPixel;
+        const RealType meanRatioInverse = ( this->m_MaximumInputPixelIntensity - meanCenterPixel ) /
+          ( this->m_MaximumInputPixelIntensity - meanNeighborhoodPixel );
+
+        const RealType varianceRatio = varianceCenterPixel / varianceNeighborhoodPixel;
+
+        if( !( ( ( meanRatio > this->m_MeanThreshold && meanRatio < 1.0 / this->m_MeanThreshold ) ||
+            ( meanRatioInverse > this->m_MeanThreshold && meanRatioInverse < 1.0 / this->m_MeanThreshold ) ) &&
+            varianceRatio > this->m_VarianceThreshold && varianceRatio < 1.0 / this->m_VarianceThreshold ) )
+          {
+          continue;
+          }
+
+        // number of patch voxels inside the image
+        RealType count = 1.0;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          const IndexValueType radius = static_cast<IndexValueType>( this->m_NeighborhoodPatchRadius[d] );
+          const IndexValueType first = std::max( neighborhoodIndex[d] - radius, inputRegion.GetIndex()[d] );
+          const IndexValueType last = std::min( neighborhoodIndex[d] + radius,
+            inputRegion.GetIndex()[d] + static_cast<IndexValueType>( inputRegion.GetSize()[d] ) - 1 );
+          count *= static_cast<RealType>( last - first + 1 );
+          }
+        const RealType averageDistance = static_cast<RealType>( patchDistances[neighborIndex] ) / count;
+
+        if( useMeanSubtractedPatches )
+          {
+          minimumDistances[i] = vnl_math_min( averageDistance, minimumDistances[i] );
+          }
+        else
+          {
+          RealType weight = 0.0;
+          if( averageDistance <= 3.0 * minimumDistances[i] )
+            {
+            weight = std::exp( -averageDistance / minimumDistances[i] );
+            }
+          if( weight > maxWeights[i] )
+            {
+            maxWeights[i] = weight;
+            }
+          if( weight > 0.0 )
+            {
+            if( this->m_UseRicianNoiseModel )
+              {
+              weightedAverageIntensities[i] += weight * vnl_math_sqr( intensities[neighborIndex] );
+              }
+            else
+              {
+              weightedAverageIntensities[i] += weight * intensities[neighborIndex];
+              }
+            sumOfWeights[i] += weight;
+            }
+          }
+        }
+      progress.CompletedPixel();
+      }
+
+    // Rician correction
+    if( sweep == 0 && this->m_UseRicianNoiseModel )
+      {
+      ImageRegionConstIteratorWithIndex<RealImageType> It( this->m_MeanImage, region );
+      for( SizeValueType i = 0; !It.IsAtEnd(); ++It, ++i )
+        {
+        if( !isActive[i] )
+          {
+          continue;
+          }
+        const RealType correctedMinimumDistance =
+          itk::Math::AlmostEquals( minimumDistances[i], NumericTraits<RealType>::ZeroValue() ) ?
+          NumericTraits<RealType>::OneValue() : minimumDistances[i];
+        if( itk::Math::AlmostEquals( correctedMinimumDistance, NumericTraits<RealType>::max() ) )
+          {
+          this->m_RicianBiasImage->SetPixel( It.GetIndex(), 0.0 );
+          }
+        else
+          {
+          this->m_RicianBiasImage->SetPixel( It.GetIndex(), correctedMinimumDistance );
+          }
+        }
+      }
+    }
+
+  ImageRegionIteratorWithIndex<OutputImageType> ItO( outputImage, region );
+  for( SizeValueType i = 0; !ItO.IsAtEnd(); ++ItO, ++i )
+    {
+    RealType maxWeight = maxWeights[i];
+    if( !isActive[i] || itk::Math::AlmostEquals( maxWeight, NumericTraits<RealType>::ZeroValue() ) )
+      {
+      maxWeight = NumericTraits<RealType>::OneValue();
+      }
+
+    const RealType centerIntensity = intensities[paddedIndices[i]];
+    if( this->m_UseRicianNoiseModel )
+      {
+      weightedAverageIntensities[i] += maxWeight * vnl_math_sqr( centerIntensity );
+      }
+    else
+      {
+      weightedAverageIntensities[i] += maxWeight * centerIntensity;
+      }
+    sumOfWeights[i] += maxWeight;
+
+    if( sumOfWeights[i] > 0.0 )
+      {
+      ItO.Set( static_cast<typename OutputImageType::PixelType>( weightedAverageIntensities[i] / sumOfWeights[i] ) );
+      this->m_ThreadContributionCountImage->SetPixel( ItO.GetIndex(), 1.0 );
+      }
+    }
+  progress.CompletedPixel();
+}
+
 template<typename TInputImage, typename TOutputImage, typename TMaskImage>
 void
 AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
@@ -503,6 +889,14 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
   os << indent << "Neighborhood radius for local mean and variance = " << this->m_NeighborhoodRadiusForLocalMeanAndVariance << std::endl;
   os << indent << "Neighborhood search radius  = " << this->m_NeighborhoodSearchRadius << std::endl;
   os << indent << "Neighborhood block radius = " << this->m_NeighborhoodPatchRadius << std::endl;
+  if( this->m_DenoisingAlgorithm == Pixelwise )
+    {
+    os << indent << "Denoising algorithm = pixelwise" << std::endl;
+    }
+  else
+    {
+    os << indent << "Denoising algorithm = blockwise (block step = " << this->m_BlockStep << ")" << std::endl;
+    }
 }
 
 } // end namespace itk
@@ -19,8 +19,10 @@
 
 #include "itkANTSCenteredAffine2DTransform.h"
 #include "itkANTSAffine3DTransform.h"
+#include "itkMultiThreader.h"
 
 #include <list>
+#include <vector>
 
 namespace itk
 {
@@ -51,7 +53,7 @@ struct HelperCommonType
 
   static void ComputeAveragePartialParameters(InternalTransformListType & transform_list,
                                               ParametersType & average_parameters, unsigned int iStart,
-                                              unsigned int iEnd);
+                                              unsigned int iEnd, bool verbose = true);
   };
 
 template <class T>
@@ -76,16 +78,19 @@ public:
   typedef HelperCommonType<InternalAffineTransformType>::ParametersType            ParametersType;
 
   static void ComputeAverageScaleParameters(InternalTransformListType & transform_list,
-                                            ParametersType & average_parameters);
+                                            ParametersType & average_parameters, bool verbose = true);
 
   static void ComputeAverageShearingParameters(InternalTransformListType & transform_list,
-                                               ParametersType & average_parameters);
+                                               ParametersType & average_parameters, bool verbose = true);
 
+  /** With geodesic the rotations are averaged on the rotation group (the
+   * Karcher mean) instead of averaging the angles or quaternions. */
   static void ComputeAverageRotationParameters(InternalTransformListType & transform_list,
-                                               ParametersType & average_parameters);
+                                               ParametersType & average_parameters, bool verbose = true,
+                                               bool geodesic = false);
 
   static void ComputeAverageTranslationParameters(InternalTransformListType & transform_list,
-                                                  ParametersType & average_parameters);
+                                                  ParametersType & average_parameters, bool verbose = true);
 };
 
 // explicit specialization for 3D affine transform
@@ -103,16 +108,19 @@ public:
   typedef HelperCommonType<InternalAffineTransformType>::ParametersType            ParametersType;
 
   static void ComputeAverageScaleParameters(InternalTransformListType & transform_list,
-                                            ParametersType & average_parameters);
+                                            ParametersType & average_parameters, bool verbose = true);
 
   static void ComputeAverageShearingParameters(InternalTransformListType & transform_list,
-                                               ParametersType & average_parameters);
+                                               ParametersType & average_parameters, bool verbose = true);
 
+  /** With geodesic the rotations are averaged on the rotation group (the
+   * Karcher mean) instead of averaging the angles or quaternions. */
   static void ComputeAverageRotationParameters(InternalTransformListType & transform_list,
-                                               ParametersType & average_parameters);
+                                               ParametersType & average_parameters, bool verbose = true,
+                                               bool geodesic = false);
 
   static void ComputeAverageTranslationParameters(InternalTransformListType & transform_list,
-                                                  ParametersType & average_parameters);
+                                                  ParametersType & average_parameters, bool verbose = true);
 };
 }
 
@@ -161,6 +169,39 @@ public:
   void AverageMultipleAffineTransform(const PointType & center_output,
                                       GenericAffineTransformPointerType & affine_output);
 
+  /** Print every transform and partial average (on by default). */
+  void SetVerbose(bool verbose)
+  {
+    m_Verbose = verbose;
+  }
+
+  bool GetVerbose() const
+  {
+    return m_Verbose;
+  }
+
+  /** Average the rotations on the rotation group (off by default). */
+  void SetUseGeodesicRotationAverage(bool geodesic)
+  {
+    m_UseGeodesicRotationAverage = geodesic;
+  }
+
+  bool GetUseGeodesicRotationAverage() const
+  {
+    return m_UseGeodesicRotationAverage;
+  }
+
+  /** Threads decomposing the transforms, 0 uses the ITK global default. */
+  void SetNumberOfThreads(unsigned int n)
+  {
+    m_NumberOfThreads = n;
+  }
+
+  unsigned int GetNumberOfThreads() const
+  {
+    return m_NumberOfThreads;
+  }
+
 #ifdef ITK_USE_CONCEPT_CHECKING
   /** Begin concept checking */
   itkConceptMacro(SameDimensionCheck1,
@@ -170,6 +211,10 @@ public:
 protected:
   TransformListType m_TransformList;
 
+  bool         m_Verbose;
+  bool         m_UseGeodesicRotationAverage;
+  unsigned int m_NumberOfThreads;
+
 // type declaration to include support both 2D and 3D affine transform
 protected:
 
@@ -190,6 +235,18 @@ protected:
 
   void ConvertInternalAffineToGenericAffine(InternalAffineTransformPointerType & iaff,
                                             GenericAffineTransformPointerType & aff);
+
+  /** The decomposition of the transforms about the center is spread over
+   * the threads, each converting a contiguous range of them. */
+  struct ConvertThreadStruct
+    {
+    AverageAffineTransformFunction *Function;
+    std::vector<GenericAffineTransformPointerType> *  Generic;
+    std::vector<InternalAffineTransformPointerType> * Internal;
+    const PointType *                                 Center;
+    };
+
+  static ITK_THREAD_RETURN_TYPE ConvertThreaderCallback(void *arg);
 };
 } // end namespace itk
 
@@ -16,7 +16,12 @@
 #include "itkAverageAffineTransformNoRigidFunction.h"
 
 #include "itkNumericTraits.h"
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <vector>
+
+#include "vnl/vnl_quaternion.h"
 
 namespace itk
 {
@@ -25,6 +30,9 @@ namespace itk
  */
 template <class TTransform>
 AverageAffineTransformNoRigidFunction<TTransform>::AverageAffineTransformNoRigidFunction()
+  : m_Verbose(true),
+  m_UseGeodesicRotationAverage(false),
+  m_NumberOfThreads(0)
 {
 }
 
@@ -91,38 +99,92 @@ void AverageAffineTransformNoRigidFunction<TTransform>::AverageMultipleAffineTra
 
   typename InternalAffineTransformType::ParametersType average_parameters =
     average_iaff->GetParameters();
+
+  // the internal transforms are created here and decomposed on the threads
+  std::vector<GenericAffineTransformPointerType>  generic_transforms;
+  std::vector<InternalAffineTransformPointerType> internal_transforms;
   for( ; it != m_TransformList.end(); it++ )
+    {
+    generic_transforms.push_back(it->aff);
+    internal_transforms.push_back(InternalAffineTransformType::New() );
+    }
+
+  if( !generic_transforms.empty() )
+    {
+    unsigned int number_of_threads = m_NumberOfThreads;
+    if( number_of_threads == 0 )
+      {
+      number_of_threads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    number_of_threads = std::min(number_of_threads, static_cast<unsigned int>(generic_transforms.size() ) );
+
+    ConvertThreadStruct str;
+    str.Function = this;
+    str.Generic = &generic_transforms;
+    str.Internal = &internal_transforms;
+    str.Center = &reference_center;
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads(number_of_threads);
+    threader->SetSingleMethod(ConvertThreaderCallback, &str);
+    threader->SingleMethodExecute();
+    }
+
+  m_InternalTransformList.clear();
+  it = m_TransformList.begin();
+  for( unsigned int n = 0; it != m_TransformList.end(); it++, n++ )
     {
     SingleInternalTransformItemType internal_item;
-    internal_item.aff = InternalAffineTransformType::New();
-    ConvertGenericAffineToInternalAffineByFixingCenter(it->aff,
-                                                       internal_item.aff, reference_center);
+    internal_item.aff = internal_transforms[n];
     internal_item.weight = it->weight;
     m_InternalTransformList.push_back(internal_item);
 
-    std::cout << "internal_transform: " << internal_item.aff << std::endl;
+    if( m_Verbose )
+      {
+      std::cout << "internal_transform: " << internal_item.aff << std::endl;
+      }
     }
 
   HelperType::ComputeAverageScaleParameters(m_InternalTransformList,
-                                            average_parameters);
+                                            average_parameters, m_Verbose);
   HelperType::ComputeAverageShearingParameters(m_InternalTransformList,
-                                               average_parameters);
+                                               average_parameters, m_Verbose);
   // HelperType::ComputeAverageRotationParameters(m_InternalTransformList,
-  //                                             average_parameters);
+  //                                             average_parameters, m_Verbose,
+  //                                             m_UseGeodesicRotationAverage);
   // HelperType::ComputeAverageTranslationParameters(m_InternalTransformList,
-  //                                                average_parameters);
+  //                                                average_parameters, m_Verbose);
 
   average_iaff->SetParameters(average_parameters);
   average_iaff->SetCenter(reference_center);
 
-  std::cout << "average_iaff" << average_iaff << std::endl;
-
   ConvertInternalAffineToGenericAffine(average_iaff, affine_output);
 
-  std::cout << "affine_output" << affine_output << std::endl;
+  if( m_Verbose )
+    {
+    std::cout << "average_iaff" << average_iaff << std::endl;
+    std::cout << "affine_output" << affine_output << std::endl;
+    }
   return;
 }
 
+template <class TTransform>
+ITK_THREAD_RETURN_TYPE AverageAffineTransformNoRigidFunction<TTransform>::ConvertThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+  ConvertThreadStruct *            str = static_cast<ConvertThreadStruct *>(info->UserData);
+
+  const unsigned int number_of_transforms = str->Generic->size();
+  const unsigned int first = number_of_transforms * info->ThreadID / info->NumberOfThreads;
+  const unsigned int last = number_of_transforms * (info->ThreadID + 1) / info->NumberOfThreads;
+  for( unsigned int n = first; n < last; n++ )
+    {
+    str->Function->ConvertGenericAffineToInternalAffineByFixingCenter( (*str->Generic)[n],
+                                                                       (*str->Internal)[n], *str->Center);
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <class TTransform>
 void AverageAffineTransformNoRigidFunction<TTransform>::ConvertGenericAffineToInternalAffineByFixingCenter(
   GenericAffineTransformPointerType & aff,
@@ -153,7 +215,7 @@ template <class TAffine>
 void HelperCommonType<TAffine>::ComputeAveragePartialParameters(
   InternalTransformListType & transform_list,
   ParametersType & average_parameters, unsigned int istart,
-  unsigned int iend)
+  unsigned int iend, bool verbose)
 {
   double w = 0.0;
 
@@ -167,18 +229,27 @@ void HelperCommonType<TAffine>::ComputeAveragePartialParameters(
   unsigned int cnt = 0;
   for( ; it != transform_list.end(); it++ )
     {
-    ParametersType current_parameters = it->aff->GetParameters();
+    const ParametersType & current_parameters = it->aff->GetParameters();
     w += it->weight;
 
-    std::cout << "[" << cnt++ << "]:" << it->weight << "\t";
+    if( verbose )
+      {
+      std::cout << "[" << cnt++ << "]:" << it->weight << "\t";
+      }
     for( unsigned int k = istart; k <= iend; k++ )
       {
       average_parameters[k] += it->weight * current_parameters[k];
 
-      std::cout << current_parameters[k] << " ";
+      if( verbose )
+        {
+        std::cout << current_parameters[k] << " ";
+        }
       }
 
-    std::cout << std::endl;
+    if( verbose )
+      {
+      std::cout << std::endl;
+      }
     }
 
   if( w <= 0.0 )
@@ -188,114 +259,232 @@ void HelperCommonType<TAffine>::ComputeAveragePartialParameters(
     }
 
   // normalize by weight
-  std::cout << "sum:w=" << w <<  "\t";
-  for( unsigned int k = istart; k <= iend; k++ )
+  if( verbose )
     {
-    std::cout << average_parameters[k] << " ";
+    std::cout << "sum:w=" << w <<  "\t";
+    for( unsigned int k = istart; k <= iend; k++ )
+      {
+      std::cout << average_parameters[k] << " ";
+      }
+    std::cout << std::endl;
     }
-  std::cout << std::endl;
 
   // normalize by weight
-  std::cout << "average" << "\t";
   for( unsigned int k = istart; k <= iend; k++ )
     {
     average_parameters[k] /= w;
-    std::cout << average_parameters[k] << " ";
     }
 
-  std::cout << std::endl;
+  if( verbose )
+    {
+    std::cout << "average" << "\t";
+    for( unsigned int k = istart; k <= iend; k++ )
+      {
+      std::cout << average_parameters[k] << " ";
+      }
+    std::cout << std::endl;
+    }
   return;
 }
 
 void HelperType<Dispatcher<2> >::ComputeAverageScaleParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 1;
   unsigned int iend = 2;
 
-  std::cout << "average 2D scale parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 2D scale parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 
 void HelperType<Dispatcher<2> >::ComputeAverageShearingParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 3;
   unsigned int iend = 3;
 
-  std::cout << "average 2D shearing parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 2D shearing parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 
 void HelperType<Dispatcher<2> >::ComputeAverageRotationParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose, bool geodesic)
 {
   unsigned int istart = 0;
   unsigned int iend = 0;
 
-  std::cout << "average 2D rotation parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 2D rotation parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
+
+  if( !geodesic )
+    {
+    return;
+    }
+
+  // the average of the angles is not the mean rotation if they wrap around,
+  // so it is refined with the angles taken relative to the mean
+  double w = 0.0;
+  double sum_sin = 0.0;
+  double sum_cos = 0.0;
+  std::vector<double> angles;
+  std::vector<double> weights;
+  InternalTransformListType::iterator it = transform_list.begin();
+  for( ; it != transform_list.end(); it++ )
+    {
+    const double angle = it->aff->GetParameters()[0];
+    angles.push_back(angle);
+    weights.push_back(it->weight);
+    sum_sin += it->weight * std::sin(angle);
+    sum_cos += it->weight * std::cos(angle);
+    w += it->weight;
+    }
+  if( w <= 0.0 )
+    {
+    return;
+    }
+
+  double mean_angle = std::atan2(sum_sin, sum_cos);
+  for( unsigned int iteration = 0; iteration < 100; iteration++ )
+    {
+    double step = 0.0;
+    for( unsigned int n = 0; n < angles.size(); n++ )
+      {
+      step += weights[n] * std::atan2(std::sin(angles[n] - mean_angle), std::cos(angles[n] - mean_angle) );
+      }
+    step /= w;
+    mean_angle += step;
+    if( std::fabs(step) < 1e-12 )
+      {
+      break;
+      }
+    }
+  average_parameters[0] = mean_angle;
+
+  if( verbose )
+    {
+    std::cout << "geodesic average" << "\t" << average_parameters[0] << std::endl;
+    }
 }
 
 void HelperType<Dispatcher<2> >::ComputeAverageTranslationParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 6;
   unsigned int iend = 7;
 
-  std::cout << "average 2D translation parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 2D translation parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 
 void HelperType<Dispatcher<3> >::ComputeAverageScaleParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 4;
   unsigned int iend = 6;
 
-  std::cout << "average 3D scale parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 3D scale parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 
 void HelperType<Dispatcher<3> >::ComputeAverageShearingParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 7;
   unsigned int iend = 9;
 
-  std::cout << "average 3D shearing parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 3D shearing parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 
 void HelperType<Dispatcher<3> >::ComputeAverageRotationParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose, bool geodesic)
 {
   unsigned int istart = 0;
   unsigned int iend = 3;
 
-  std::cout << "average 3D rotation parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 3D rotation parameter " << std::endl;
+    }
 
-  HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+  // q and -q are the same rotation, so the quaternions are flipped into the
+  // half space of the first one before they are averaged
+  double w = 0.0;
+  std::vector<vnl_vector_fixed<double, 4> > quaternions;
+  std::vector<double>                       weights;
+  for( unsigned int k = istart; k <= iend; k++ )
+    {
+    average_parameters[k] = 0.0;
+    }
+  InternalTransformListType::iterator it = transform_list.begin();
+  for( unsigned int cnt = 0; it != transform_list.end(); it++, cnt++ )
+    {
+    const ParametersType &      current_parameters = it->aff->GetParameters();
+    vnl_vector_fixed<double, 4> q;
+    for( unsigned int k = istart; k <= iend; k++ )
+      {
+      q[k] = current_parameters[k];
+      }
+    if( !quaternions.empty() && dot_product(q, quaternions[0]) < 0.0 )
+      {
+      q *= -1.0;
+      }
+    quaternions.push_back(q);
+    weights.push_back(it->weight);
+    w += it->weight;
+    for( unsigned int k = istart; k <= iend; k++ )
+      {
+      average_parameters[k] += it->weight * q[k];
+      }
+
+    if( verbose )
+      {
+      std::cout << "[" << cnt << "]:" << it->weight << "\t" << q << std::endl;
+      }
+    }
+
+  if( w <= 0.0 )
+    {
+    std::cout << "Total weight smaller than 0!!!" << std::endl;
+    std::exception();
+    }
 
   // extra normalization for quaternion
 
@@ -309,19 +498,77 @@ void HelperType<Dispatcher<3> >::ComputeAverageRotationParameters(
     {
     average_parameters[j] /= quat_mag;
     }
+
+  if( geodesic )
+    {
+    // Karcher mean:  the mean of the rotation vectors relative to the current
+    // mean is applied to it until it vanishes
+    vnl_quaternion<double> mean(average_parameters[0], average_parameters[1],
+                                average_parameters[2], average_parameters[3]);
+    for( unsigned int iteration = 0; iteration < 100; iteration++ )
+      {
+      vnl_vector_fixed<double, 3> step(0.0);
+      const vnl_quaternion<double> mean_inverse = mean.conjugate();
+      for( unsigned int n = 0; n < quaternions.size(); n++ )
+        {
+        const vnl_quaternion<double> q(quaternions[n][0], quaternions[n][1], quaternions[n][2], quaternions[n][3]);
+        vnl_quaternion<double>       d = mean_inverse * q;
+        if( d.r() < 0.0 )
+          {
+          d *= -1.0;
+          }
+        const double s = std::sqrt(d.x() * d.x() + d.y() * d.y() + d.z() * d.z() );
+        if( s > 1e-15 )
+          {
+          const double scale = weights[n] * 2.0 * std::atan2(s, d.r() ) / s;
+          step[0] += scale * d.x();
+          step[1] += scale * d.y();
+          step[2] += scale * d.z();
+          }
+        }
+      step /= w;
+
+      const double angle = step.magnitude();
+      if( angle < 1e-12 )
+        {
+        break;
+        }
+      const double                 s = std::sin(0.5 * angle) / angle;
+      const vnl_quaternion<double> e(s * step[0], s * step[1], s * step[2], std::cos(0.5 * angle) );
+      mean = mean * e;
+      mean.normalize();
+      }
+    for( unsigned int j = 0; j < 4; j++ )
+      {
+      average_parameters[j] = mean[j];
+      }
+    }
+
+  if( verbose )
+    {
+    std::cout << "average" << "\t";
+    for( unsigned int k = istart; k <= iend; k++ )
+      {
+      std::cout << average_parameters[k] << " ";
+      }
+    std::cout << std::endl;
+    }
 }
 
 void HelperType<Dispatcher<3> >::ComputeAverageTranslationParameters(
   InternalTransformListType & transform_list,
-  ParametersType & average_parameters)
+  ParametersType & average_parameters, bool verbose)
 {
   unsigned int istart = 10;
   unsigned int iend = 12;
 
-  std::cout << "average 3D translation parameter " << std::endl;
+  if( verbose )
+    {
+    std::cout << "average 3D translation parameter " << std::endl;
+    }
 
   HelperCommonType<InternalAffineTransformType>::ComputeAveragePartialParameters(
-    transform_list, average_parameters, istart, iend);
+    transform_list, average_parameters, istart, iend, verbose);
 }
 } // end namespace AverageAffineTransformNoRigidFunctionHelperNameSpace
 } // end namespace itk
@@ -0,0 +1,156 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointDisplacementFieldTransform_h
+#define __itkBSplineControlPointDisplacementFieldTransform_h
+
+#include "itkBSplineTransform.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
+
+namespace itk
+{
+/** \class BSplineControlPointDisplacementFieldTransform
+ *
+ * A BSplineTransform optimized through the displacement field it gives on a
+ * grid, typically the virtual domain of the metric.  To the metrics this is
+ * a DisplacementFieldTransform, i.e. a transform of local support, so that
+ * the derivative of each sample only has the components of its voxel instead
+ * of the components of every control point.  UpdateTransformParameters()
+ * projects the resulting gradient field onto the control points, a pass per
+ * axis which touches the SplineOrder + 1 control points of the support of
+ * each grid point, updates the BSplineTransform and evaluates the update of
+ * the field back from the control points.
+ *
+ * The update of the control points is scaled so that the largest update of
+ * the field is the largest update given, which keeps the step of the
+ * optimizer, e.g. from a scales estimator, in terms of physical shift.
+ *
+ * The state of the transform is GetBSplineTransform(), which is also what
+ * TransformPoint() evaluates; the displacement field follows it.
+ * SetParameters() only sets the field, so optimizers which restore
+ * parameters, e.g. the line search of ConjugateGradientLineSearchOptimizerv4,
+ * cannot be used.  The grid of the field must have the direction of the
+ * control point lattice.  Call UpdateDisplacementField() after setting the
+ * BSplineTransform or the field.
+ *
+ * \sa BSplineControlPointDisplacementFieldTransformParametersAdaptor
+ */
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder = 3>
+class BSplineControlPointDisplacementFieldTransform
+  : public DisplacementFieldTransform<TParametersValueType, NDimensions>
+{
+public:
+  /** Standard class typedefs. */
+  typedef BSplineControlPointDisplacementFieldTransform                Self;
+  typedef DisplacementFieldTransform<TParametersValueType, NDimensions> Superclass;
+  typedef SmartPointer<Self>                                           Pointer;
+  typedef SmartPointer<const Self>                                     ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( BSplineControlPointDisplacementFieldTransform, DisplacementFieldTransform );
+
+  itkStaticConstMacro( Dimension, unsigned int, NDimensions );
+  itkStaticConstMacro( SplineOrder, unsigned int, VSplineOrder );
+
+  typedef typename Superclass::ScalarType            ScalarType;
+  typedef typename Superclass::DerivativeType        DerivativeType;
+  typedef typename Superclass::InputPointType        InputPointType;
+  typedef typename Superclass::OutputPointType       OutputPointType;
+  typedef typename Superclass::DisplacementFieldType DisplacementFieldType;
+
+  typedef BSplineTransform<TParametersValueType, NDimensions, VSplineOrder> BSplineTransformType;
+
+  /** The B-spline transform which is optimized. */
+  itkSetObjectMacro( BSplineTransform, BSplineTransformType );
+  itkGetModifiableObjectMacro( BSplineTransform, BSplineTransformType );
+
+  /** Compute the B-spline weights of the grid of the displacement field and
+   * set the field to the displacement of the B-spline transform. */
+  void UpdateDisplacementField();
+
+  /** Project factor * update onto the control points and update the B-spline
+   * transform and the displacement field. */
+  virtual void UpdateTransformParameters( const DerivativeType & update, ScalarType factor = 1.0 ) ITK_OVERRIDE;
+
+  /** The point as mapped by the B-spline transform. */
+  virtual OutputPointType TransformPoint( const InputPointType & point ) const ITK_OVERRIDE;
+
+protected:
+  BSplineControlPointDisplacementFieldTransform();
+  virtual ~BSplineControlPointDisplacementFieldTransform();
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  virtual typename LightObject::Pointer InternalClone() const ITK_OVERRIDE;
+
+private:
+  BSplineControlPointDisplacementFieldTransform( const Self & ); // purposely not implemented
+  void operator=( const Self & );                                // purposely not implemented
+
+  /** The B-spline weights of the grid points along one axis: the first
+   * control point of each grid point and its SplineOrder + 1 weights, which
+   * are zero outside the domain of the B-spline transform. */
+  struct AxisWeightsType
+    {
+    SizeValueType              NumberOfControlPoints;
+    std::vector<SizeValueType> Span;
+    std::vector<double>        Weight;
+    };
+
+  /** One pass along an axis of a buffer of interleaved channels.  Project
+   * maps InputLength grid points onto OutputLength control points; Evaluate
+   * maps control points back onto the grid. */
+  struct LatticeThreadStruct
+    {
+    typedef enum { Project = 0, Evaluate } PassType;
+
+    PassType               Pass;
+    const double *         Input;
+    double *               Output;
+    unsigned int           NumberOfChannels;
+    unsigned int           NumberOfWeights;
+    SizeValueType          LowerCount;
+    SizeValueType          UpperCount;
+    SizeValueType          InputLength;
+    SizeValueType          OutputLength;
+    const AxisWeightsType *Weights;
+    ThreadIdType           NumberOfThreads;
+    };
+
+  /** The passes along every axis, from the grid to the lattice for Project
+   * and from the lattice to the grid for Evaluate. */
+  void RunLatticePasses( typename LatticeThreadStruct::PassType pass, std::vector<double> & buffer ) const;
+
+  void RunLatticePass( LatticeThreadStruct & str ) const;
+
+  static ITK_THREAD_RETURN_TYPE LatticeThreaderCallback( void *arg );
+
+  typename BSplineTransformType::Pointer m_BSplineTransform;
+
+  /** The field the weights were computed for. */
+  const DisplacementFieldType *m_WeightedDisplacementField;
+  AxisWeightsType              m_AxisWeights[NDimensions];
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBSplineControlPointDisplacementFieldTransform.hxx"
+#endif
+
+#endif
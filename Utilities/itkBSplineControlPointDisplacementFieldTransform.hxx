@@ -0,0 +1,406 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointDisplacementFieldTransform_hxx
+#define __itkBSplineControlPointDisplacementFieldTransform_hxx
+
+#include "itkBSplineControlPointDisplacementFieldTransform.h"
+
+#include "itkBSplineKernelFunction.h"
+#include "itkContinuousIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::BSplineControlPointDisplacementFieldTransform() :
+  m_WeightedDisplacementField( ITK_NULLPTR )
+{
+  this->m_BSplineTransform = BSplineTransformType::New();
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    this->m_AxisWeights[d].NumberOfControlPoints = 0;
+    }
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::~BSplineControlPointDisplacementFieldTransform()
+{
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+void
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::UpdateDisplacementField()
+{
+  typedef typename BSplineTransformType::ImageType  CoefficientImageType;
+  typedef ContinuousIndex<double, NDimensions>      ContinuousIndexType;
+  typedef BSplineKernelFunction<VSplineOrder>       KernelType;
+
+  DisplacementFieldType *field = this->GetModifiableDisplacementField();
+  if( field == ITK_NULLPTR )
+    {
+    itkExceptionMacro( "The displacement field is not set." );
+    }
+  const typename DisplacementFieldType::RegionType region = field->GetLargestPossibleRegion();
+  const CoefficientImageType *                     lattice =
+    this->m_BSplineTransform->GetCoefficientImages()[0].GetPointer();
+
+  // the continuous index in the lattice of the first grid point and its
+  // increment along each axis of the grid
+  ContinuousIndexType                        first;
+  ContinuousIndexType                        steps[NDimensions];
+  typename DisplacementFieldType::PointType  point;
+  field->TransformIndexToPhysicalPoint( region.GetIndex(), point );
+  lattice->TransformPhysicalPointToContinuousIndex( point, first );
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    typename DisplacementFieldType::IndexType index = region.GetIndex();
+    index[d]++;
+    field->TransformIndexToPhysicalPoint( index, point );
+    lattice->TransformPhysicalPointToContinuousIndex( point, steps[d] );
+    for( unsigned int e = 0; e < NDimensions; e++ )
+      {
+      steps[d][e] -= first[e];
+      }
+    for( unsigned int e = 0; e < NDimensions; e++ )
+      {
+      if( e != d && std::fabs( steps[d][e] ) > 1.e-6 * std::fabs( steps[d][d] ) )
+        {
+        itkExceptionMacro( "The displacement field does not have the direction of the control point lattice." );
+        }
+      }
+    }
+
+  // the weights of each axis, as BSplineTransform computes them: the points
+  // outside [(order - 1) / 2, size - (order - 1) / 2 - 1] have no displacement
+  typename KernelType::Pointer kernel = KernelType::New();
+  const unsigned int           numberOfWeights = VSplineOrder + 1;
+  const double                 tolerance = 1.e-6;
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    AxisWeightsType &   weights = this->m_AxisWeights[d];
+    const SizeValueType numberOfPoints = region.GetSize()[d];
+    const SizeValueType numberOfControlPoints = lattice->GetLargestPossibleRegion().GetSize()[d];
+    const double        minimumIndex = 0.5 * ( VSplineOrder - 1.0 );
+    const double        maximumIndex = numberOfControlPoints - 0.5 * ( VSplineOrder - 1.0 ) - 1.0;
+
+    weights.NumberOfControlPoints = numberOfControlPoints;
+    weights.Span.assign( numberOfPoints, 0 );
+    weights.Weight.assign( numberOfPoints * numberOfWeights, 0.0 );
+    for( SizeValueType i = 0; i < numberOfPoints; i++ )
+      {
+      double c = first[d] + i * steps[d][d];
+      if( c < minimumIndex - tolerance || c > maximumIndex + tolerance )
+        {
+        continue;
+        }
+      c = std::min( std::max( c, minimumIndex ), maximumIndex );
+      const SizeValueType span = std::min( static_cast<SizeValueType>( std::floor( c - minimumIndex ) ),
+                                           numberOfControlPoints - numberOfWeights );
+      weights.Span[i] = span;
+      for( unsigned int k = 0; k < numberOfWeights; k++ )
+        {
+        weights.Weight[i * numberOfWeights + k] = kernel->Evaluate( c - static_cast<double>( span + k ) );
+        }
+      }
+    }
+  this->m_WeightedDisplacementField = field;
+
+  // the control points, interleaved, evaluated on the grid
+  const typename BSplineTransformType::ParametersType & parameters = this->m_BSplineTransform->GetParameters();
+  const SizeValueType numberOfControlPoints = this->m_BSplineTransform->GetNumberOfParametersPerDimension();
+
+  std::vector<double> buffer( numberOfControlPoints * NDimensions );
+  for( SizeValueType v = 0; v < numberOfControlPoints; v++ )
+    {
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      buffer[v * NDimensions + j] = parameters[j * numberOfControlPoints + v];
+      }
+    }
+  this->RunLatticePasses( LatticeThreadStruct::Evaluate, buffer );
+
+  typename DisplacementFieldType::PixelType *displacements = field->GetBufferPointer();
+  const SizeValueType                        numberOfPixels = region.GetNumberOfPixels();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      displacements[n][j] = buffer[n * NDimensions + j];
+      }
+    }
+  this->Modified();
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+void
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::UpdateTransformParameters( const DerivativeType & update, ScalarType factor )
+{
+  DisplacementFieldType *field = this->GetModifiableDisplacementField();
+  if( field == ITK_NULLPTR )
+    {
+    itkExceptionMacro( "The displacement field is not set." );
+    }
+  const SizeValueType numberOfPixels = field->GetLargestPossibleRegion().GetNumberOfPixels();
+  if( update.Size() != numberOfPixels * NDimensions )
+    {
+    itkExceptionMacro( "The update has " << update.Size() << " components instead of "
+                                         << numberOfPixels * NDimensions << "." );
+    }
+
+  // the weights follow the field and the lattice
+  bool isWeighted = ( field == this->m_WeightedDisplacementField );
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    isWeighted = isWeighted && this->m_AxisWeights[d].NumberOfControlPoints ==
+      this->m_BSplineTransform->GetCoefficientImages()[0]->GetLargestPossibleRegion().GetSize()[d];
+    }
+  if( !isWeighted )
+    {
+    this->UpdateDisplacementField();
+    }
+
+  std::vector<double> buffer( update.Size() );
+  double              maximumSquaredUpdateNorm = 0.0;
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    double squaredNorm = 0.0;
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      buffer[n * NDimensions + j] = factor * update[n * NDimensions + j];
+      squaredNorm += vnl_math_sqr( buffer[n * NDimensions + j] );
+      }
+    maximumSquaredUpdateNorm = vnl_math_max( maximumSquaredUpdateNorm, squaredNorm );
+    }
+  if( maximumSquaredUpdateNorm == 0.0 )
+    {
+    return;
+    }
+
+  // the gradient with respect to the control points is the update projected
+  // onto their support, and the update of the field is its evaluation
+  this->RunLatticePasses( LatticeThreadStruct::Project, buffer );
+  const std::vector<double> controlPointUpdate( buffer );
+  this->RunLatticePasses( LatticeThreadStruct::Evaluate, buffer );
+
+  double maximumSquaredFieldNorm = 0.0;
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    double squaredNorm = 0.0;
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      squaredNorm += vnl_math_sqr( buffer[n * NDimensions + j] );
+      }
+    maximumSquaredFieldNorm = vnl_math_max( maximumSquaredFieldNorm, squaredNorm );
+    }
+  if( maximumSquaredFieldNorm == 0.0 )
+    {
+    return;
+    }
+  const double scale = std::sqrt( maximumSquaredUpdateNorm / maximumSquaredFieldNorm );
+
+  const SizeValueType numberOfControlPoints = this->m_BSplineTransform->GetNumberOfParametersPerDimension();
+  typename BSplineTransformType::DerivativeType bsplineUpdate( numberOfControlPoints * NDimensions );
+  for( SizeValueType v = 0; v < numberOfControlPoints; v++ )
+    {
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      bsplineUpdate[j * numberOfControlPoints + v] = controlPointUpdate[v * NDimensions + j];
+      }
+    }
+  this->m_BSplineTransform->UpdateTransformParameters( bsplineUpdate, scale );
+
+  typename DisplacementFieldType::PixelType *displacements = field->GetBufferPointer();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int j = 0; j < NDimensions; j++ )
+      {
+      displacements[n][j] += scale * buffer[n * NDimensions + j];
+      }
+    }
+  this->Modified();
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+typename BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::OutputPointType
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::TransformPoint( const InputPointType & point ) const
+{
+  return this->m_BSplineTransform->TransformPoint( point );
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+void
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::RunLatticePasses( typename LatticeThreadStruct::PassType pass, std::vector<double> & buffer ) const
+{
+  const typename DisplacementFieldType::SizeType fieldSize =
+    this->m_WeightedDisplacementField->GetLargestPossibleRegion().GetSize();
+  const bool isProjection = ( pass == LatticeThreadStruct::Project );
+
+  // the current lengths of the buffer along each axis
+  SizeValueType lengths[NDimensions];
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    lengths[d] = isProjection ? fieldSize[d] : this->m_AxisWeights[d].NumberOfControlPoints;
+    }
+
+  LatticeThreadStruct str;
+  str.Pass = pass;
+  str.NumberOfChannels = NDimensions;
+  str.NumberOfWeights = VSplineOrder + 1;
+  for( unsigned int d = 0; d < NDimensions; d++ )
+    {
+    str.LowerCount = 1;
+    str.UpperCount = 1;
+    for( unsigned int e = 0; e < d; e++ )
+      {
+      str.LowerCount *= lengths[e];
+      }
+    for( unsigned int e = d + 1; e < NDimensions; e++ )
+      {
+      str.UpperCount *= lengths[e];
+      }
+    str.InputLength = lengths[d];
+    str.OutputLength = isProjection ? this->m_AxisWeights[d].NumberOfControlPoints : fieldSize[d];
+    str.Weights = &this->m_AxisWeights[d];
+
+    std::vector<double> output( str.LowerCount * str.OutputLength * str.UpperCount * NDimensions, 0.0 );
+    str.Input = &buffer[0];
+    str.Output = &output[0];
+    this->RunLatticePass( str );
+
+    buffer.swap( output );
+    lengths[d] = str.OutputLength;
+    }
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+void
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::RunLatticePass( LatticeThreadStruct & str ) const
+{
+  const SizeValueType numberOfLines = str.LowerCount * str.UpperCount;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( vnl_math_max( vnl_math_min(
+    static_cast<SizeValueType>( MultiThreader::GetGlobalDefaultNumberOfThreads() ), numberOfLines ),
+                                              static_cast<SizeValueType>( 1 ) ) );
+  str.NumberOfThreads = threader->GetNumberOfThreads();
+  threader->SetSingleMethod( LatticeThreaderCallback, &str );
+  threader->SingleMethodExecute();
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+ITK_THREAD_RETURN_TYPE
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::LatticeThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const LatticeThreadStruct *      str = static_cast<LatticeThreadStruct *>( info->UserData );
+
+  const SizeValueType numberOfLines = str->LowerCount * str->UpperCount;
+  const SizeValueType firstLine = numberOfLines * info->ThreadID / str->NumberOfThreads;
+  const SizeValueType endLine = numberOfLines * ( info->ThreadID + 1 ) / str->NumberOfThreads;
+
+  // each thread owns its lines of the output, so the projection accumulates
+  // without locks
+  const unsigned int  channels = str->NumberOfChannels;
+  const unsigned int  numberOfWeights = str->NumberOfWeights;
+  const SizeValueType stride = str->LowerCount * channels;
+  const bool          isProjection = ( str->Pass == LatticeThreadStruct::Project );
+  for( SizeValueType line = firstLine; line < endLine; line++ )
+    {
+    const SizeValueType lower = line % str->LowerCount;
+    const SizeValueType upper = line / str->LowerCount;
+    const double *      input = str->Input + ( lower + upper * str->LowerCount * str->InputLength ) * channels;
+    double *            output = str->Output + ( lower + upper * str->LowerCount * str->OutputLength ) * channels;
+
+    if( isProjection )
+      {
+      for( SizeValueType i = 0; i < str->InputLength; i++ )
+        {
+        const double *point = input + i * stride;
+        const double *B = &str->Weights->Weight[i * numberOfWeights];
+        double *      control = output + str->Weights->Span[i] * stride;
+        for( unsigned int k = 0; k < numberOfWeights; k++, control += stride )
+          {
+          for( unsigned int c = 0; c < channels; c++ )
+            {
+            control[c] += B[k] * point[c];
+            }
+          }
+        }
+      }
+    else
+      {
+      for( SizeValueType i = 0; i < str->OutputLength; i++ )
+        {
+        const double *B = &str->Weights->Weight[i * numberOfWeights];
+        const double *control = input + str->Weights->Span[i] * stride;
+        double *      point = output + i * stride;
+        for( unsigned int k = 0; k < numberOfWeights; k++, control += stride )
+          {
+          for( unsigned int c = 0; c < channels; c++ )
+            {
+            point[c] += B[k] * control[c];
+            }
+          }
+        }
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+typename LightObject::Pointer
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::InternalClone() const
+{
+  typename LightObject::Pointer loPtr = Superclass::InternalClone();
+
+  typename Self::Pointer rval = dynamic_cast<Self *>( loPtr.GetPointer() );
+  if( rval.IsNull() )
+    {
+    itkExceptionMacro( "downcast to type " << this->GetNameOfClass() << " failed." );
+    }
+  rval->SetBSplineTransform( dynamic_cast<BSplineTransformType *>( this->m_BSplineTransform->Clone().GetPointer() ) );
+  if( rval->GetModifiableDisplacementField() != ITK_NULLPTR )
+    {
+    rval->UpdateDisplacementField();
+    }
+  return loPtr;
+}
+
+/**
+ * Standard "PrintSelf" method
+ */
+template <typename TParametersValueType, unsigned int NDimensions, unsigned int VSplineOrder>
+void
+BSplineControlPointDisplacementFieldTransform<TParametersValueType, NDimensions, VSplineOrder>
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "BSplineTransform: " << this->m_BSplineTransform.GetPointer() << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -0,0 +1,112 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointDisplacementFieldTransformParametersAdaptor_h
+#define __itkBSplineControlPointDisplacementFieldTransformParametersAdaptor_h
+
+#include "itkBSplineTransformParametersAdaptor.h"
+#include "itkTransformParametersAdaptor.h"
+
+namespace itk
+{
+/** \class BSplineControlPointDisplacementFieldTransformParametersAdaptor
+ *
+ * Adapts a BSplineControlPointDisplacementFieldTransform to a level: its
+ * B-spline transform is refined to the required transform domain, as by
+ * BSplineTransformParametersAdaptor, and its displacement field is replaced
+ * by the displacement of the B-spline transform on the required grid, which
+ * is typically the virtual domain of the level.
+ *
+ * \sa BSplineControlPointDisplacementFieldTransform
+ */
+template <typename TTransform>
+class BSplineControlPointDisplacementFieldTransformParametersAdaptor
+  : public TransformParametersAdaptor<TTransform>
+{
+public:
+  /** Standard class typedefs. */
+  typedef BSplineControlPointDisplacementFieldTransformParametersAdaptor Self;
+  typedef TransformParametersAdaptor<TTransform>                         Superclass;
+  typedef SmartPointer<Self>                                             Pointer;
+  typedef SmartPointer<const Self>                                       ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( BSplineControlPointDisplacementFieldTransformParametersAdaptor, TransformParametersAdaptor );
+
+  typedef TTransform                                              TransformType;
+  typedef typename TransformType::BSplineTransformType            BSplineTransformType;
+  typedef BSplineTransformParametersAdaptor<BSplineTransformType> BSplineAdaptorType;
+
+  typedef typename BSplineAdaptorType::MeshSizeType           MeshSizeType;
+  typedef typename BSplineAdaptorType::OriginType             TransformDomainOriginType;
+  typedef typename BSplineAdaptorType::PhysicalDimensionsType PhysicalDimensionsType;
+  typedef typename BSplineAdaptorType::DirectionType          TransformDomainDirectionType;
+
+  typedef typename TransformType::DisplacementFieldType DisplacementFieldType;
+  typedef typename DisplacementFieldType::SizeType      SizeType;
+  typedef typename DisplacementFieldType::SpacingType   SpacingType;
+  typedef typename DisplacementFieldType::PointType     OriginType;
+  typedef typename DisplacementFieldType::DirectionType DirectionType;
+
+  /** The transform domain of the B-spline transform. */
+  itkSetMacro( RequiredTransformDomainMeshSize, MeshSizeType );
+  itkGetConstReferenceMacro( RequiredTransformDomainMeshSize, MeshSizeType );
+  itkSetMacro( RequiredTransformDomainOrigin, TransformDomainOriginType );
+  itkGetConstReferenceMacro( RequiredTransformDomainOrigin, TransformDomainOriginType );
+  itkSetMacro( RequiredTransformDomainPhysicalDimensions, PhysicalDimensionsType );
+  itkGetConstReferenceMacro( RequiredTransformDomainPhysicalDimensions, PhysicalDimensionsType );
+  itkSetMacro( RequiredTransformDomainDirection, TransformDomainDirectionType );
+  itkGetConstReferenceMacro( RequiredTransformDomainDirection, TransformDomainDirectionType );
+
+  /** The grid of the displacement field. */
+  itkSetMacro( RequiredSize, SizeType );
+  itkGetConstReferenceMacro( RequiredSize, SizeType );
+  itkSetMacro( RequiredSpacing, SpacingType );
+  itkGetConstReferenceMacro( RequiredSpacing, SpacingType );
+  itkSetMacro( RequiredOrigin, OriginType );
+  itkGetConstReferenceMacro( RequiredOrigin, OriginType );
+  itkSetMacro( RequiredDirection, DirectionType );
+  itkGetConstReferenceMacro( RequiredDirection, DirectionType );
+
+  virtual void AdaptTransformParameters() ITK_OVERRIDE;
+
+protected:
+  BSplineControlPointDisplacementFieldTransformParametersAdaptor();
+  virtual ~BSplineControlPointDisplacementFieldTransformParametersAdaptor();
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+private:
+  BSplineControlPointDisplacementFieldTransformParametersAdaptor( const Self & ); // purposely not implemented
+  void operator=( const Self & );                                                 // purposely not implemented
+
+  MeshSizeType                 m_RequiredTransformDomainMeshSize;
+  TransformDomainOriginType    m_RequiredTransformDomainOrigin;
+  PhysicalDimensionsType       m_RequiredTransformDomainPhysicalDimensions;
+  TransformDomainDirectionType m_RequiredTransformDomainDirection;
+
+  SizeType      m_RequiredSize;
+  SpacingType   m_RequiredSpacing;
+  OriginType    m_RequiredOrigin;
+  DirectionType m_RequiredDirection;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBSplineControlPointDisplacementFieldTransformParametersAdaptor.hxx"
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointDisplacementFieldTransformParametersAdaptor_hxx
+#define __itkBSplineControlPointDisplacementFieldTransformParametersAdaptor_hxx
+
+#include "itkBSplineControlPointDisplacementFieldTransformParametersAdaptor.h"
+
+namespace itk
+{
+template <typename TTransform>
+BSplineControlPointDisplacementFieldTransformParametersAdaptor<TTransform>
+::BSplineControlPointDisplacementFieldTransformParametersAdaptor()
+{
+  this->m_RequiredTransformDomainMeshSize.Fill( 1 );
+  this->m_RequiredTransformDomainOrigin.Fill( 0.0 );
+  this->m_RequiredTransformDomainPhysicalDimensions.Fill( 1.0 );
+  this->m_RequiredTransformDomainDirection.SetIdentity();
+
+  this->m_RequiredSize.Fill( 0 );
+  this->m_RequiredSpacing.Fill( 1.0 );
+  this->m_RequiredOrigin.Fill( 0.0 );
+  this->m_RequiredDirection.SetIdentity();
+}
+
+template <typename TTransform>
+BSplineControlPointDisplacementFieldTransformParametersAdaptor<TTransform>
+::~BSplineControlPointDisplacementFieldTransformParametersAdaptor()
+{
+}
+
+template <typename TTransform>
+void
+BSplineControlPointDisplacementFieldTransformParametersAdaptor<TTransform>
+::AdaptTransformParameters()
+{
+  TransformType *transform = this->m_Transform;
+  if( transform == ITK_NULLPTR )
+    {
+    itkExceptionMacro( "Transform has not been set." );
+    }
+
+  typename BSplineAdaptorType::Pointer bsplineAdaptor = BSplineAdaptorType::New();
+  bsplineAdaptor->SetTransform( transform->GetModifiableBSplineTransform() );
+  bsplineAdaptor->SetRequiredTransformDomainMeshSize( this->m_RequiredTransformDomainMeshSize );
+  bsplineAdaptor->SetRequiredTransformDomainOrigin( this->m_RequiredTransformDomainOrigin );
+  bsplineAdaptor->SetRequiredTransformDomainDirection( this->m_RequiredTransformDomainDirection );
+  bsplineAdaptor->SetRequiredTransformDomainPhysicalDimensions( this->m_RequiredTransformDomainPhysicalDimensions );
+  bsplineAdaptor->AdaptTransformParameters();
+
+  typename DisplacementFieldType::PixelType zeroVector( 0.0 );
+
+  typename DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+  field->SetRegions( this->m_RequiredSize );
+  field->SetSpacing( this->m_RequiredSpacing );
+  field->SetOrigin( this->m_RequiredOrigin );
+  field->SetDirection( this->m_RequiredDirection );
+  field->Allocate();
+  field->FillBuffer( zeroVector );
+
+  transform->SetDisplacementField( field );
+  transform->UpdateDisplacementField();
+}
+
+template <typename TTransform>
+void
+BSplineControlPointDisplacementFieldTransformParametersAdaptor<TTransform>
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Required transform domain mesh size: " << this->m_RequiredTransformDomainMeshSize << std::endl;
+  os << indent << "Required transform domain origin: " << this->m_RequiredTransformDomainOrigin << std::endl;
+  os << indent << "Required transform domain physical dimensions: "
+     << this->m_RequiredTransformDomainPhysicalDimensions << std::endl;
+  os << indent << "Required transform domain direction: " << this->m_RequiredTransformDomainDirection << std::endl;
+  os << indent << "Required size: " << this->m_RequiredSize << std::endl;
+  os << indent << "Required spacing: " << this->m_RequiredSpacing << std::endl;
+  os << indent << "Required origin: " << this->m_RequiredOrigin << std::endl;
+  os << indent << "Required direction: " << this->m_RequiredDirection << std::endl;
+}
+} // end namespace itk
+
+#endif
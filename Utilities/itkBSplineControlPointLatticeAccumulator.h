@@ -0,0 +1,179 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointLatticeAccumulator_h
+#define __itkBSplineControlPointLatticeAccumulator_h
+
+#include "itkBSplineControlPointImageFunction.h"
+#include "itkCoxDeBoorBSplineKernelFunction.h"
+#include "itkFixedArray.h"
+#include "itkImage.h"
+#include "itkObject.h"
+#include "itkVector.h"
+
+#include <vector>
+
+namespace itk
+{
+/** \class BSplineControlPointLatticeAccumulator
+ *
+ * Multilevel B-spline approximation of scattered data, as done by
+ * BSplineScatteredDataPointSetToImageFilter, without holding the points.
+ * The points of each level are passed one at a time to AddPoint(), which
+ * adds their contribution to the numerator and denominator of every control
+ * point of their neighborhood; the lattice of the level is their ratio.  The
+ * memory therefore only depends on the size of the control point lattice.
+ *
+ * The points are fitted level by level: call InitializeLevel() for levels
+ * 0, 1, ..., GetMaximumNumberOfLevels() - 1, pass all the points of the
+ * level, which are fitted to their residual of the previous levels, and call
+ * FinalizeLevel().  To pass the points from several threads, give each
+ * thread an accumulator from NewThreadAccumulator() and Merge() them into
+ * this one before FinalizeLevel().
+ *
+ * As with BSplineScatteredDataPointSetToImageFilter, the points are given in
+ * the parametric domain defined by Origin, Spacing and Size, i.e. without
+ * the Direction, which only sets the direction of the output image.  The
+ * pixel type of TOutputImage is an itk::Vector.
+ */
+template <typename TOutputImage>
+class BSplineControlPointLatticeAccumulator : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef BSplineControlPointLatticeAccumulator Self;
+  typedef Object                                Superclass;
+  typedef SmartPointer<Self>                    Pointer;
+  typedef SmartPointer<const Self>              ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( BSplineControlPointLatticeAccumulator, Object );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TOutputImage::ImageDimension );
+
+  typedef TOutputImage                                             OutputImageType;
+  typedef typename OutputImageType::PixelType                      PixelType;
+  typedef typename OutputImageType::PointType                      PointType;
+  typedef typename OutputImageType::SpacingType                    SpacingType;
+  typedef typename OutputImageType::SizeType                       SizeType;
+  typedef typename OutputImageType::DirectionType                  DirectionType;
+  typedef double                                                   RealType;
+  typedef FixedArray<unsigned int, ImageDimension>                 ArrayType;
+  typedef Image<PixelType, ImageDimension>                         ControlPointLatticeType;
+
+  /** The parametric domain of the points and the domain of the output image. */
+  itkSetMacro( Origin, PointType );
+  itkGetConstReferenceMacro( Origin, PointType );
+  itkSetMacro( Spacing, SpacingType );
+  itkGetConstReferenceMacro( Spacing, SpacingType );
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+  itkSetMacro( Direction, DirectionType );
+  itkGetConstReferenceMacro( Direction, DirectionType );
+
+  itkSetMacro( SplineOrder, unsigned int );
+  itkGetConstMacro( SplineOrder, unsigned int );
+
+  /** The number of levels of each dimension.  The mesh of a dimension doubles
+      at each level until its number of levels is reached. */
+  itkSetMacro( NumberOfLevels, ArrayType );
+  itkGetConstReferenceMacro( NumberOfLevels, ArrayType );
+
+  /** The number of control points of the first level. */
+  itkSetMacro( NumberOfControlPoints, ArrayType );
+  itkGetConstReferenceMacro( NumberOfControlPoints, ArrayType );
+
+  unsigned int GetMaximumNumberOfLevels() const;
+
+  itkGetConstMacro( CurrentLevel, unsigned int );
+
+  /** The number of control points of the current level. */
+  itkGetConstReferenceMacro( CurrentNumberOfControlPoints, ArrayType );
+
+  /** Start accumulating the points of a level.  Level 0 starts a new fit;
+      the other levels follow the level before them. */
+  void InitializeLevel( unsigned int level );
+
+  /** Add a point of the current level with its data and weight.  The
+      residual of the data to the fit of the previous levels is fitted. */
+  void AddPoint( const PointType & point, const PixelType & data, RealType weight );
+
+  /** An accumulator of the current level with the same settings and fit, to
+      pass points from another thread. */
+  Pointer NewThreadAccumulator() const;
+
+  /** Add the points accumulated by another accumulator of the same level. */
+  void Merge( const Self *other );
+
+  /** Add the lattice of the points of the current level to the fit. */
+  void FinalizeLevel();
+
+  /** The control point lattice of the fit of the levels so far. */
+  itkGetModifiableObjectMacro( ControlPointLattice, ControlPointLatticeType );
+
+  /** Evaluate the fit over the domain. */
+  typename OutputImageType::Pointer GenerateOutputImage() const;
+
+protected:
+  BSplineControlPointLatticeAccumulator();
+  virtual ~BSplineControlPointLatticeAccumulator()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+private:
+  BSplineControlPointLatticeAccumulator( const Self & ); // purposely not implemented
+  void operator=( const Self & );                        // purposely not implemented
+
+  typedef Vector<RealType, PixelType::Dimension>                   NumeratorType;
+  typedef Image<NumeratorType, ImageDimension>                     NumeratorLatticeType;
+  typedef Image<RealType, ImageDimension>                          DenominatorLatticeType;
+  typedef CoxDeBoorBSplineKernelFunction<3>                        KernelType;
+  typedef BSplineControlPointImageFunction<ControlPointLatticeType> FitFunctionType;
+
+  /** Allocate the numerator and denominator lattices of the current level
+      and the evaluation of the fit of the previous levels. */
+  void AllocateLevel();
+
+  PointType     m_Origin;
+  SpacingType   m_Spacing;
+  SizeType      m_Size;
+  DirectionType m_Direction;
+  unsigned int  m_SplineOrder;
+  ArrayType     m_NumberOfLevels;
+  ArrayType     m_NumberOfControlPoints;
+
+  unsigned int m_CurrentLevel;
+  ArrayType    m_CurrentNumberOfControlPoints;
+
+  typename KernelType::Pointer              m_Kernel;
+  typename NumeratorLatticeType::Pointer    m_NumeratorLattice;
+  typename DenominatorLatticeType::Pointer  m_DenominatorLattice;
+  typename ControlPointLatticeType::Pointer m_ControlPointLattice;
+  typename FitFunctionType::Pointer         m_FitFunction;
+
+  // scratch space of AddPoint()
+  std::vector<RealType> m_KernelWeights;
+  std::vector<RealType> m_NeighborhoodWeights;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBSplineControlPointLatticeAccumulator.hxx"
+#endif
+
+#endif
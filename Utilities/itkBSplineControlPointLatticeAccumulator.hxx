@@ -0,0 +1,406 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBSplineControlPointLatticeAccumulator_hxx
+#define __itkBSplineControlPointLatticeAccumulator_hxx
+
+#include "itkBSplineControlPointLatticeAccumulator.h"
+
+#include "itkBSplineControlPointImageFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+template <typename TOutputImage>
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::BSplineControlPointLatticeAccumulator() :
+  m_SplineOrder( 3 ),
+  m_CurrentLevel( 0 ),
+  m_ControlPointLattice( ITK_NULLPTR )
+{
+  this->m_Origin.Fill( 0.0 );
+  this->m_Spacing.Fill( 1.0 );
+  this->m_Size.Fill( 0 );
+  this->m_Direction.SetIdentity();
+  this->m_NumberOfLevels.Fill( 1 );
+  this->m_NumberOfControlPoints.Fill( 4 );
+  this->m_CurrentNumberOfControlPoints.Fill( 4 );
+}
+
+template <typename TOutputImage>
+unsigned int
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::GetMaximumNumberOfLevels() const
+{
+  unsigned int maximumNumberOfLevels = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    maximumNumberOfLevels = std::max( maximumNumberOfLevels, this->m_NumberOfLevels[d] );
+    }
+  return maximumNumberOfLevels;
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::InitializeLevel( unsigned int level )
+{
+  if( level > 0 && ( this->m_ControlPointLattice.IsNull() || level != this->m_CurrentLevel + 1 ) )
+    {
+    itkExceptionMacro( "Level " << level << " does not follow a finalized level." );
+    }
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( this->m_Size[d] < 2 || this->m_NumberOfControlPoints[d] <= this->m_SplineOrder )
+      {
+      itkExceptionMacro( "The domain needs more than one voxel and the lattice more than "
+                         << this->m_SplineOrder << " control points in each dimension." );
+      }
+    }
+
+  if( level == 0 )
+    {
+    this->m_ControlPointLattice = ITK_NULLPTR;
+    }
+  this->m_CurrentLevel = level;
+
+  // the mesh of a dimension doubles at each level until its number of levels
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    this->m_CurrentNumberOfControlPoints[d] = this->m_NumberOfControlPoints[d];
+    for( unsigned int l = 1; l <= level; l++ )
+      {
+      if( l < this->m_NumberOfLevels[d] )
+        {
+        this->m_CurrentNumberOfControlPoints[d] = 2 * this->m_CurrentNumberOfControlPoints[d] - this->m_SplineOrder;
+        }
+      }
+    }
+
+  this->AllocateLevel();
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::AllocateLevel()
+{
+  typename NumeratorLatticeType::SizeType latticeSize;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    latticeSize[d] = this->m_CurrentNumberOfControlPoints[d];
+    }
+  typename NumeratorLatticeType::RegionType latticeRegion;
+  latticeRegion.SetSize( latticeSize );
+
+  NumeratorType zero( 0.0 );
+
+  this->m_NumeratorLattice = NumeratorLatticeType::New();
+  this->m_NumeratorLattice->SetRegions( latticeRegion );
+  this->m_NumeratorLattice->Allocate();
+  this->m_NumeratorLattice->FillBuffer( zero );
+
+  this->m_DenominatorLattice = DenominatorLatticeType::New();
+  this->m_DenominatorLattice->SetRegions( latticeRegion );
+  this->m_DenominatorLattice->Allocate();
+  this->m_DenominatorLattice->FillBuffer( 0.0 );
+
+  this->m_Kernel = KernelType::New();
+  this->m_Kernel->SetSplineOrder( this->m_SplineOrder );
+
+  this->m_FitFunction = ITK_NULLPTR;
+  if( this->m_ControlPointLattice.IsNotNull() )
+    {
+    this->m_FitFunction = FitFunctionType::New();
+    this->m_FitFunction->SetSplineOrder( this->m_SplineOrder );
+    this->m_FitFunction->SetOrigin( this->m_Origin );
+    this->m_FitFunction->SetSpacing( this->m_Spacing );
+    this->m_FitFunction->SetSize( this->m_Size );
+    this->m_FitFunction->SetInputImage( this->m_ControlPointLattice );
+    }
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::AddPoint( const PointType & point, const PixelType & data, RealType weight )
+{
+  const unsigned int neighborhoodWidth = this->m_SplineOrder + 1;
+  this->m_KernelWeights.resize( ImageDimension * neighborhoodWidth );
+
+  typename NumeratorLatticeType::IndexType startIndex;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    // the parametric position in spans of the current level
+    const RealType numberOfSpans =
+      static_cast<RealType>( this->m_CurrentNumberOfControlPoints[d] - this->m_SplineOrder );
+    RealType u = ( point[d] - this->m_Origin[d] ) /
+      ( static_cast<RealType>( this->m_Size[d] - 1 ) * this->m_Spacing[d] ) * numberOfSpans;
+
+    const RealType epsilon = 1e-6 * numberOfSpans;
+    if( u < 0.0 && u >= -epsilon )
+      {
+      u = 0.0;
+      }
+    if( u >= numberOfSpans && u <= numberOfSpans + epsilon )
+      {
+      u = numberOfSpans - epsilon;
+      }
+    if( u < 0.0 || u >= numberOfSpans )
+      {
+      itkExceptionMacro( "The point " << point << " is outside the parametric domain." );
+      }
+
+    startIndex[d] = static_cast<IndexValueType>( std::floor( u ) );
+    const RealType t = u - static_cast<RealType>( startIndex[d] ) + 0.5 * static_cast<RealType>( this->m_SplineOrder - 1 );
+    for( unsigned int k = 0; k < neighborhoodWidth; k++ )
+      {
+      this->m_KernelWeights[d * neighborhoodWidth + k] = this->m_Kernel->Evaluate( t - static_cast<RealType>( k ) );
+      }
+    }
+
+  unsigned int neighborhoodSize = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    neighborhoodSize *= neighborhoodWidth;
+    }
+  this->m_NeighborhoodWeights.resize( neighborhoodSize );
+
+  RealType sumOfSquaredWeights = 0.0;
+  for( unsigned int n = 0; n < neighborhoodSize; n++ )
+    {
+    RealType     B = 1.0;
+    unsigned int offset = n;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      B *= this->m_KernelWeights[d * neighborhoodWidth + offset % neighborhoodWidth];
+      offset /= neighborhoodWidth;
+      }
+    this->m_NeighborhoodWeights[n] = B;
+    sumOfSquaredWeights += B * B;
+    }
+  if( sumOfSquaredWeights <= 0.0 )
+    {
+    return;
+    }
+
+  NumeratorType residual;
+  for( unsigned int i = 0; i < PixelType::Dimension; i++ )
+    {
+    residual[i] = data[i];
+    }
+  if( this->m_FitFunction.IsNotNull() )
+    {
+    const PixelType fit = this->m_FitFunction->Evaluate( point );
+    for( unsigned int i = 0; i < PixelType::Dimension; i++ )
+      {
+      residual[i] -= fit[i];
+      }
+    }
+
+  // each control point gets the data which would give the point its value,
+  // weighted by the square of its B-spline weight
+  NumeratorType *numerator = this->m_NumeratorLattice->GetBufferPointer();
+  RealType *     denominator = this->m_DenominatorLattice->GetBufferPointer();
+  for( unsigned int n = 0; n < neighborhoodSize; n++ )
+    {
+    const RealType B = this->m_NeighborhoodWeights[n];
+
+    typename NumeratorLatticeType::IndexType index;
+    unsigned int                             offset = n;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      index[d] = startIndex[d] + static_cast<IndexValueType>( offset % neighborhoodWidth );
+      offset /= neighborhoodWidth;
+      }
+    const OffsetValueType latticeOffset = this->m_NumeratorLattice->ComputeOffset( index );
+
+    const RealType B2 = weight * B * B;
+    numerator[latticeOffset] += residual * ( B2 * B / sumOfSquaredWeights );
+    denominator[latticeOffset] += B2;
+    }
+}
+
+template <typename TOutputImage>
+typename BSplineControlPointLatticeAccumulator<TOutputImage>::Pointer
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::NewThreadAccumulator() const
+{
+  Pointer accumulator = Self::New();
+  accumulator->m_Origin = this->m_Origin;
+  accumulator->m_Spacing = this->m_Spacing;
+  accumulator->m_Size = this->m_Size;
+  accumulator->m_Direction = this->m_Direction;
+  accumulator->m_SplineOrder = this->m_SplineOrder;
+  accumulator->m_NumberOfLevels = this->m_NumberOfLevels;
+  accumulator->m_NumberOfControlPoints = this->m_NumberOfControlPoints;
+  accumulator->m_CurrentLevel = this->m_CurrentLevel;
+  accumulator->m_CurrentNumberOfControlPoints = this->m_CurrentNumberOfControlPoints;
+  accumulator->m_ControlPointLattice = this->m_ControlPointLattice;
+  accumulator->AllocateLevel();
+  return accumulator;
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::Merge( const Self *other )
+{
+  if( other->m_CurrentLevel != this->m_CurrentLevel ||
+      other->m_NumeratorLattice->GetBufferedRegion() != this->m_NumeratorLattice->GetBufferedRegion() )
+    {
+    itkExceptionMacro( "Only accumulators of the same level can be merged." );
+    }
+
+  ImageRegionConstIterator<NumeratorLatticeType>   ItON( other->m_NumeratorLattice,
+                                                         other->m_NumeratorLattice->GetBufferedRegion() );
+  ImageRegionConstIterator<DenominatorLatticeType> ItOD( other->m_DenominatorLattice,
+                                                         other->m_DenominatorLattice->GetBufferedRegion() );
+  ImageRegionIterator<NumeratorLatticeType>        ItN( this->m_NumeratorLattice,
+                                                        this->m_NumeratorLattice->GetBufferedRegion() );
+  ImageRegionIterator<DenominatorLatticeType>      ItD( this->m_DenominatorLattice,
+                                                        this->m_DenominatorLattice->GetBufferedRegion() );
+  for( ItN.GoToBegin(), ItD.GoToBegin(), ItON.GoToBegin(), ItOD.GoToBegin(); !ItN.IsAtEnd();
+       ++ItN, ++ItD, ++ItON, ++ItOD )
+    {
+    ItN.Set( ItN.Get() + ItON.Get() );
+    ItD.Set( ItD.Get() + ItOD.Get() );
+    }
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::FinalizeLevel()
+{
+  if( this->m_NumeratorLattice.IsNull() )
+    {
+    itkExceptionMacro( "The level was not initialized." );
+    }
+
+  typename ControlPointLatticeType::Pointer lattice = ControlPointLatticeType::New();
+  lattice->SetRegions( this->m_NumeratorLattice->GetBufferedRegion() );
+  lattice->Allocate();
+
+  ImageRegionConstIterator<NumeratorLatticeType>   ItN( this->m_NumeratorLattice,
+                                                        this->m_NumeratorLattice->GetBufferedRegion() );
+  ImageRegionConstIterator<DenominatorLatticeType> ItD( this->m_DenominatorLattice,
+                                                        this->m_DenominatorLattice->GetBufferedRegion() );
+  ImageRegionIterator<ControlPointLatticeType>     ItL( lattice, lattice->GetBufferedRegion() );
+  for( ItN.GoToBegin(), ItD.GoToBegin(), ItL.GoToBegin(); !ItL.IsAtEnd(); ++ItN, ++ItD, ++ItL )
+    {
+    PixelType value;
+    value.Fill( 0.0 );
+    if( ItD.Get() > 0.0 )
+      {
+      for( unsigned int i = 0; i < PixelType::Dimension; i++ )
+        {
+        value[i] = ItN.Get()[i] / ItD.Get();
+        }
+      }
+    ItL.Set( value );
+    }
+  this->m_NumeratorLattice = ITK_NULLPTR;
+  this->m_DenominatorLattice = ITK_NULLPTR;
+  this->m_FitFunction = ITK_NULLPTR;
+
+  if( this->m_ControlPointLattice.IsNull() )
+    {
+    this->m_ControlPointLattice = lattice;
+    return;
+    }
+
+  // refine the fit of the previous levels to the current level and add the lattice
+  typedef BSplineControlPointImageFilter<ControlPointLatticeType, ControlPointLatticeType> BSplinerType;
+
+  typename BSplinerType::ArrayType numberOfRefinementLevels;
+  bool                             needsRefinement = false;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    numberOfRefinementLevels[d] = 1;
+    if( this->m_ControlPointLattice->GetLargestPossibleRegion().GetSize()[d] != this->m_CurrentNumberOfControlPoints[d] )
+      {
+      numberOfRefinementLevels[d] = 2;
+      needsRefinement = true;
+      }
+    }
+
+  typename ControlPointLatticeType::Pointer fit = this->m_ControlPointLattice;
+  if( needsRefinement )
+    {
+    typename BSplinerType::Pointer bspliner = BSplinerType::New();
+    bspliner->SetInput( fit );
+    bspliner->SetSplineOrder( this->m_SplineOrder );
+    bspliner->SetSize( this->m_Size );
+    bspliner->SetOrigin( this->m_Origin );
+    bspliner->SetSpacing( this->m_Spacing );
+    bspliner->SetDirection( this->m_Direction );
+    fit = bspliner->RefineControlPointLattice( numberOfRefinementLevels );
+    }
+
+  ImageRegionConstIterator<ControlPointLatticeType> ItF( fit, fit->GetLargestPossibleRegion() );
+  for( ItF.GoToBegin(), ItL.GoToBegin(); !ItL.IsAtEnd(); ++ItF, ++ItL )
+    {
+    ItL.Set( ItL.Get() + ItF.Get() );
+    }
+  this->m_ControlPointLattice = lattice;
+}
+
+template <typename TOutputImage>
+typename BSplineControlPointLatticeAccumulator<TOutputImage>::OutputImageType::Pointer
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::GenerateOutputImage() const
+{
+  if( this->m_ControlPointLattice.IsNull() )
+    {
+    itkExceptionMacro( "No level was finalized." );
+    }
+
+  typedef BSplineControlPointImageFilter<ControlPointLatticeType, OutputImageType> BSplinerType;
+  typename BSplinerType::Pointer bspliner = BSplinerType::New();
+  bspliner->SetInput( this->m_ControlPointLattice );
+  bspliner->SetSplineOrder( this->m_SplineOrder );
+  bspliner->SetSize( this->m_Size );
+  bspliner->SetOrigin( this->m_Origin );
+  bspliner->SetSpacing( this->m_Spacing );
+  bspliner->SetDirection( this->m_Direction );
+  bspliner->Update();
+
+  typename OutputImageType::Pointer output = bspliner->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+template <typename TOutputImage>
+void
+BSplineControlPointLatticeAccumulator<TOutputImage>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Origin: " << this->m_Origin << std::endl;
+  os << indent << "Spacing: " << this->m_Spacing << std::endl;
+  os << indent << "Size: " << this->m_Size << std::endl;
+  os << indent << "Direction: " << this->m_Direction << std::endl;
+  os << indent << "Spline order: " << this->m_SplineOrder << std::endl;
+  os << indent << "Number of levels: " << this->m_NumberOfLevels << std::endl;
+  os << indent << "Number of control points: " << this->m_NumberOfControlPoints << std::endl;
+  os << indent << "Current level: " << this->m_CurrentLevel << std::endl;
+  os << indent << "Current number of control points: " << this->m_CurrentNumberOfControlPoints << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -0,0 +1,132 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBrickCachedVectorLinearInterpolateImageFunction_h
+#define __itkBrickCachedVectorLinearInterpolateImageFunction_h
+
+#include "itkSimpleFastMutexLock.h"
+#include "itkVectorInterpolateImageFunction.h"
+
+#include <map>
+#include <string>
+
+namespace itk
+{
+/** \class BrickCachedVectorLinearInterpolateImageFunction
+ *
+ * Linear interpolation of a vector image that is read from FileName on
+ * demand, one brick of BrickSize^N voxels at a time, instead of being held
+ * in memory.  The image given to SetInputImage only provides the geometry
+ * and the largest possible region of the file; its buffer is not used.
+ * At most MaximumNumberOfBricks bricks are kept, the least recently used
+ * one is dropped when a new brick is needed.
+ *
+ * Set as the interpolator of a DisplacementFieldTransform, it lets points
+ * be warped through a displacement field file while reading only the parts
+ * of the field around the points (see
+ * itk::ants::ReadBrickCachedDisplacementFieldTransform).  The evaluation is
+ * thread safe; bricks are read while holding a lock.
+ */
+template <class TInputImage, class TCoordRep = double>
+class BrickCachedVectorLinearInterpolateImageFunction :
+  public VectorInterpolateImageFunction<TInputImage, TCoordRep>
+{
+public:
+  /** Standard class typedefs. */
+  typedef BrickCachedVectorLinearInterpolateImageFunction        Self;
+  typedef VectorInterpolateImageFunction<TInputImage, TCoordRep> Superclass;
+  typedef SmartPointer<Self>                                     Pointer;
+  typedef SmartPointer<const Self>                               ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( BrickCachedVectorLinearInterpolateImageFunction, VectorInterpolateImageFunction );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TInputImage::ImageDimension );
+
+  typedef TInputImage                              InputImageType;
+  typedef typename InputImageType::Pointer         InputImagePointer;
+  typedef typename InputImageType::PixelType       PixelType;
+  typedef typename InputImageType::RegionType      RegionType;
+  typedef typename Superclass::IndexType           IndexType;
+  typedef typename Superclass::ContinuousIndexType ContinuousIndexType;
+  typedef typename Superclass::OutputType          OutputType;
+
+  /** The file the bricks are read from. */
+  void SetFileName( const std::string & fileName )
+  {
+    this->m_FileName = fileName;
+    this->ClearBricks();
+  }
+
+  itkGetConstReferenceMacro( FileName, std::string );
+
+  itkSetMacro( BrickSize, unsigned int );
+  itkGetConstMacro( BrickSize, unsigned int );
+
+  itkSetMacro( MaximumNumberOfBricks, unsigned int );
+  itkGetConstMacro( MaximumNumberOfBricks, unsigned int );
+
+  /** Number of bricks read from the file so far. */
+  unsigned long GetNumberOfBricksRead() const
+  {
+    return this->m_NumberOfBricksRead;
+  }
+
+  /** The bounds used by IsInsideBuffer are those of the largest possible
+   * region of the image, i.e. of the file. */
+  virtual void SetInputImage( const InputImageType *ptr ) ITK_OVERRIDE;
+
+  virtual OutputType EvaluateAtContinuousIndex( const ContinuousIndexType & index ) const ITK_OVERRIDE;
+
+  virtual OutputType EvaluateAtIndex( const IndexType & index ) const ITK_OVERRIDE;
+
+  /** Drop all bricks. */
+  void ClearBricks();
+
+protected:
+  BrickCachedVectorLinearInterpolateImageFunction();
+  virtual ~BrickCachedVectorLinearInterpolateImageFunction()
+  {
+  }
+
+  void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+private:
+  BrickCachedVectorLinearInterpolateImageFunction( const Self & ); // purposely not implemented
+  void operator=( const Self & );                                    // purposely not implemented
+
+  typedef std::map<OffsetValueType, std::pair<InputImagePointer, unsigned long> > BrickMapType;
+
+  /** The brick holding index, read if necessary.  Expects m_Mutex to be held. */
+  InputImagePointer GetBrick( const IndexType & index ) const;
+
+  std::string  m_FileName;
+  unsigned int m_BrickSize;
+  unsigned int m_MaximumNumberOfBricks;
+  RegionType   m_Region;
+
+  mutable BrickMapType         m_Bricks;
+  mutable unsigned long        m_UseCounter;
+  mutable unsigned long        m_NumberOfBricksRead;
+  mutable SimpleFastMutexLock  m_Mutex;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBrickCachedVectorLinearInterpolateImageFunction.hxx"
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkBrickCachedVectorLinearInterpolateImageFunction_hxx
+#define __itkBrickCachedVectorLinearInterpolateImageFunction_hxx
+
+#include "itkBrickCachedVectorLinearInterpolateImageFunction.h"
+
+#include "itkExtractImageFilter.h"
+#include "itkImageFileReader.h"
+#include "itkMath.h"
+
+#include <algorithm>
+
+namespace itk
+{
+template <class TInputImage, class TCoordRep>
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::BrickCachedVectorLinearInterpolateImageFunction() :
+  m_BrickSize( 32 ),
+  m_MaximumNumberOfBricks( 64 ),
+  m_UseCounter( 0 ),
+  m_NumberOfBricksRead( 0 )
+{
+}
+
+template <class TInputImage, class TCoordRep>
+void
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::SetInputImage( const InputImageType *ptr )
+{
+  Superclass::SetInputImage( ptr );
+  this->ClearBricks();
+  if( !ptr )
+    {
+    return;
+    }
+
+  this->m_Region = ptr->GetLargestPossibleRegion();
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    this->m_StartIndex[d] = this->m_Region.GetIndex()[d];
+    this->m_EndIndex[d] = this->m_StartIndex[d] + static_cast<IndexValueType>( this->m_Region.GetSize()[d] ) - 1;
+    this->m_StartContinuousIndex[d] = static_cast<TCoordRep>( this->m_StartIndex[d] - 0.5 );
+    this->m_EndContinuousIndex[d] = static_cast<TCoordRep>( this->m_EndIndex[d] + 0.5 );
+    }
+}
+
+template <class TInputImage, class TCoordRep>
+void
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::ClearBricks()
+{
+  this->m_Mutex.Lock();
+  this->m_Bricks.clear();
+  this->m_Mutex.Unlock();
+}
+
+template <class TInputImage, class TCoordRep>
+typename BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>::InputImagePointer
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::GetBrick( const IndexType & index ) const
+{
+  const IndexValueType brickSize = static_cast<IndexValueType>( std::max( this->m_BrickSize, 1u ) );
+
+  OffsetValueType key = 0;
+  OffsetValueType stride = 1;
+  RegionType      brickRegion;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const IndexValueType start = this->m_Region.GetIndex()[d];
+    const IndexValueType size = static_cast<IndexValueType>( this->m_Region.GetSize()[d] );
+    const IndexValueType brick = ( index[d] - start ) / brickSize;
+
+    key += brick * stride;
+    stride *= ( size + brickSize - 1 ) / brickSize;
+
+    brickRegion.SetIndex( d, start + brick * brickSize );
+    brickRegion.SetSize( d, static_cast<SizeValueType>( std::min( brickSize, size - brick * brickSize ) ) );
+    }
+
+  typename BrickMapType::iterator it = this->m_Bricks.find( key );
+  if( it != this->m_Bricks.end() )
+    {
+    it->second.second = ++this->m_UseCounter;
+    return it->second.first;
+    }
+
+  // stream just the brick from the file
+  typedef ImageFileReader<InputImageType>                   ReaderType;
+  typedef ExtractImageFilter<InputImageType, InputImageType> ExtracterType;
+
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( this->m_FileName );
+
+  typename ExtracterType::Pointer extracter = ExtracterType::New();
+  extracter->SetInput( reader->GetOutput() );
+  extracter->SetExtractionRegion( brickRegion );
+  extracter->SetDirectionCollapseToSubmatrix();
+  extracter->Update();
+
+  InputImagePointer brick = extracter->GetOutput();
+  brick->DisconnectPipeline();
+  this->m_NumberOfBricksRead++;
+
+  while( !this->m_Bricks.empty() && this->m_Bricks.size() >= std::max( this->m_MaximumNumberOfBricks, 1u ) )
+    {
+    typename BrickMapType::iterator oldest = this->m_Bricks.begin();
+    for( typename BrickMapType::iterator jt = this->m_Bricks.begin(); jt != this->m_Bricks.end(); ++jt )
+      {
+      if( jt->second.second < oldest->second.second )
+        {
+        oldest = jt;
+        }
+      }
+    this->m_Bricks.erase( oldest );
+    }
+  this->m_Bricks[key] = std::make_pair( brick, ++this->m_UseCounter );
+
+  return brick;
+}
+
+template <class TInputImage, class TCoordRep>
+typename BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>::OutputType
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::EvaluateAtContinuousIndex( const ContinuousIndexType & index ) const
+{
+  IndexType baseIndex;
+  double    distance[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    baseIndex[d] = Math::Floor<IndexValueType>( index[d] );
+    distance[d] = index[d] - static_cast<double>( baseIndex[d] );
+    }
+
+  OutputType output;
+  output.Fill( 0.0 );
+
+  // the neighbors of a point can lie in different bricks; the bricks are
+  // held by the local pointers even if they are evicted meanwhile
+  this->m_Mutex.Lock();
+  try
+    {
+    const unsigned int numberOfNeighbors = 1u << ImageDimension;
+    for( unsigned int counter = 0; counter < numberOfNeighbors; counter++ )
+      {
+      double       overlap = 1.0;
+      unsigned int upper = counter;
+      IndexType    neighborIndex;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( upper & 1 )
+          {
+          neighborIndex[d] = std::min( baseIndex[d] + 1, this->m_EndIndex[d] );
+          overlap *= distance[d];
+          }
+        else
+          {
+          neighborIndex[d] = std::max( baseIndex[d], this->m_StartIndex[d] );
+          overlap *= 1.0 - distance[d];
+          }
+        upper >>= 1;
+        }
+      if( overlap > 0.0 )
+        {
+        const PixelType & pixel = this->GetBrick( neighborIndex )->GetPixel( neighborIndex );
+        for( unsigned int k = 0; k < output.Size(); k++ )
+          {
+          output[k] += overlap * static_cast<double>( pixel[k] );
+          }
+        }
+      }
+    }
+  catch( ... )
+    {
+    this->m_Mutex.Unlock();
+    throw;
+    }
+  this->m_Mutex.Unlock();
+
+  return output;
+}
+
+template <class TInputImage, class TCoordRep>
+typename BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>::OutputType
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::EvaluateAtIndex( const IndexType & index ) const
+{
+  ContinuousIndexType continuousIndex;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    continuousIndex[d] = static_cast<TCoordRep>( index[d] );
+    }
+  return this->EvaluateAtContinuousIndex( continuousIndex );
+}
+
+template <class TInputImage, class TCoordRep>
+void
+BrickCachedVectorLinearInterpolateImageFunction<TInputImage, TCoordRep>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "FileName: " << this->m_FileName << std::endl;
+  os << indent << "BrickSize: " << this->m_BrickSize << std::endl;
+  os << indent << "MaximumNumberOfBricks: " << this->m_MaximumNumberOfBricks << std::endl;
+  os << indent << "NumberOfBricksRead: " << this->m_NumberOfBricksRead << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -0,0 +1,171 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkCachedMappingResampleImageFilter_h
+#define __itkCachedMappingResampleImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkContinuousIndex.h"
+#include "itkInterpolateImageFunction.h"
+#include "itkTransform.h"
+
+namespace itk
+{
+/** \class CachedMappingResampleImageFilter
+ * \brief Resamples a sequence of images that share a grid through the same
+ * transform, and evaluates the transform only once.
+ *
+ * The filter maps every output voxel through the transform, as
+ * ResampleImageFilter does.  On the first update it stores the resulting
+ * continuous index in the input grid.  Later updates with another input on
+ * the same grid (e.g. the next volume of a time series) only interpolate at
+ * the stored indices.  The mapping is recomputed when the transform, the
+ * output parameters or the geometry of the input change.  It is also
+ * recomputed when only part of the output is requested.
+ *
+ * The stored mapping takes ImageDimension values of
+ * TInterpolatorPrecisionType per output voxel.  The results are identical
+ * to ResampleImageFilter with the same precision type and no extrapolator.
+ *
+ * \ingroup GeometricTransform
+ * \ingroup MultiThreaded
+ */
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType = double>
+class CachedMappingResampleImageFilter :
+  public         ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef CachedMappingResampleImageFilter              Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(CachedMappingResampleImageFilter, ImageToImageFilter);
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TOutputImage::ImageDimension);
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                              InputImageType;
+  typedef typename InputImageType::ConstPointer    InputImageConstPointer;
+  typedef TOutputImage                             OutputImageType;
+  typedef typename OutputImageType::Pointer        OutputImagePointer;
+  typedef typename OutputImageType::RegionType     OutputImageRegionType;
+  typedef typename OutputImageType::PixelType      PixelType;
+  typedef typename OutputImageType::IndexType      IndexType;
+  typedef typename OutputImageType::SizeType       SizeType;
+  typedef typename OutputImageType::SpacingType    SpacingType;
+  typedef typename OutputImageType::PointType      OriginPointType;
+  typedef typename OutputImageType::DirectionType  DirectionType;
+  typedef ImageBase<itkGetStaticConstMacro(ImageDimension)> ImageBaseType;
+
+  typedef Transform<TInterpolatorPrecisionType,
+                    itkGetStaticConstMacro(ImageDimension),
+                    itkGetStaticConstMacro(ImageDimension)> TransformType;
+  typedef typename TransformType::ConstPointer              TransformConstPointer;
+  typedef typename TransformType::InputPointType            PointType;
+
+  typedef InterpolateImageFunction<InputImageType, TInterpolatorPrecisionType> InterpolatorType;
+  typedef typename InterpolatorType::Pointer                                  InterpolatorPointer;
+
+  typedef ContinuousIndex<TInterpolatorPrecisionType,
+                          itkGetStaticConstMacro(ImageDimension)> ContinuousIndexType;
+  typedef Image<ContinuousIndexType,
+                itkGetStaticConstMacro(ImageDimension)>           MappingImageType;
+
+  /** Set/Get the transform mapping the output grid into the input space. */
+  void SetTransform( const TransformType *transform );
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** Set/Get the interpolator.  The default is linear interpolation. */
+  itkSetObjectMacro( Interpolator, InterpolatorType );
+  itkGetModifiableObjectMacro( Interpolator, InterpolatorType );
+
+  /** Set/Get the value of output voxels that map outside the input. */
+  itkSetMacro( DefaultPixelValue, PixelType );
+  itkGetConstReferenceMacro( DefaultPixelValue, PixelType );
+
+  /** Set the output grid from an image. */
+  void SetOutputParametersFromImage( const ImageBaseType *image );
+
+  itkGetConstReferenceMacro( OutputOrigin, OriginPointType );
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputStartIndex, IndexType );
+  itkGetConstReferenceMacro( OutputSize, SizeType );
+
+  /** Drop the stored mapping so that it is recomputed on the next update. */
+  void InvalidateMapping();
+
+  /** Whether the next update can reuse the stored mapping for the current input. */
+  bool IsMappingValid() const;
+
+protected:
+  CachedMappingResampleImageFilter();
+  ~CachedMappingResampleImageFilter()
+  {
+  }
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  void ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                             ThreadIdType threadId ) ITK_OVERRIDE;
+
+  void AfterThreadedGenerateData() ITK_OVERRIDE;
+
+private:
+  CachedMappingResampleImageFilter( const Self & ); // purposely not implemented
+  void operator=( const Self & );                   // purposely not implemented
+
+  TransformConstPointer m_Transform;
+  InterpolatorPointer   m_Interpolator;
+  PixelType             m_DefaultPixelValue;
+
+  OriginPointType m_OutputOrigin;
+  SpacingType     m_OutputSpacing;
+  DirectionType   m_OutputDirection;
+  IndexType       m_OutputStartIndex;
+  SizeType        m_OutputSize;
+
+  typename MappingImageType::Pointer m_Mapping;
+
+  bool               m_MappingIsValid;
+  bool               m_ComputeMapping;
+  ModifiedTimeType   m_MappingTransformMTime;
+  OriginPointType    m_MappingInputOrigin;
+  SpacingType        m_MappingInputSpacing;
+  DirectionType      m_MappingInputDirection;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkCachedMappingResampleImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkCachedMappingResampleImageFilter_hxx
+#define __itkCachedMappingResampleImageFilter_hxx
+
+#include "itkCachedMappingResampleImageFilter.h"
+
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+
+namespace itk
+{
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::CachedMappingResampleImageFilter() :
+  m_Transform( ITK_NULLPTR ),
+  m_DefaultPixelValue( NumericTraits<PixelType>::ZeroValue() ),
+  m_Mapping( ITK_NULLPTR ),
+  m_MappingIsValid( false ),
+  m_ComputeMapping( true ),
+  m_MappingTransformMTime( 0 )
+{
+  this->m_Interpolator = LinearInterpolateImageFunction<InputImageType, TInterpolatorPrecisionType>::New();
+
+  this->m_OutputOrigin.Fill( 0.0 );
+  this->m_OutputSpacing.Fill( 1.0 );
+  this->m_OutputDirection.SetIdentity();
+  this->m_OutputStartIndex.Fill( 0 );
+  this->m_OutputSize.Fill( 0 );
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::SetTransform( const TransformType *transform )
+{
+  if( this->m_Transform != transform )
+    {
+    this->m_Transform = transform;
+    this->InvalidateMapping();
+    this->Modified();
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::SetOutputParametersFromImage( const ImageBaseType *image )
+{
+  this->m_OutputOrigin = image->GetOrigin();
+  this->m_OutputSpacing = image->GetSpacing();
+  this->m_OutputDirection = image->GetDirection();
+  this->m_OutputStartIndex = image->GetLargestPossibleRegion().GetIndex();
+  this->m_OutputSize = image->GetLargestPossibleRegion().GetSize();
+  this->InvalidateMapping();
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::InvalidateMapping()
+{
+  this->m_MappingIsValid = false;
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+bool
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::IsMappingValid() const
+{
+  const InputImageType *inputPtr = this->GetInput();
+  if( !this->m_MappingIsValid || !inputPtr || this->m_Transform.IsNull() )
+    {
+    return false;
+    }
+  return this->m_Transform->GetMTime() == this->m_MappingTransformMTime
+         && inputPtr->GetOrigin() == this->m_MappingInputOrigin
+         && inputPtr->GetSpacing() == this->m_MappingInputSpacing
+         && inputPtr->GetDirection() == this->m_MappingInputDirection;
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  OutputImagePointer outputPtr = this->GetOutput();
+  if( !outputPtr )
+    {
+    return;
+    }
+
+  OutputImageRegionType outputRegion;
+  outputRegion.SetSize( this->m_OutputSize );
+  outputRegion.SetIndex( this->m_OutputStartIndex );
+  outputPtr->SetLargestPossibleRegion( outputRegion );
+  outputPtr->SetSpacing( this->m_OutputSpacing );
+  outputPtr->SetOrigin( this->m_OutputOrigin );
+  outputPtr->SetDirection( this->m_OutputDirection );
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  typename InputImageType::Pointer inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::BeforeThreadedGenerateData()
+{
+  if( this->m_Transform.IsNull() )
+    {
+    itkExceptionMacro( "The transform is not set." );
+    }
+  if( this->m_Interpolator.IsNull() )
+    {
+    itkExceptionMacro( "The interpolator is not set." );
+    }
+  this->m_Interpolator->SetInputImage( this->GetInput() );
+
+  OutputImagePointer outputPtr = this->GetOutput();
+
+  this->m_ComputeMapping = !this->IsMappingValid();
+  if( this->m_ComputeMapping )
+    {
+    this->m_MappingIsValid = false;
+    if( this->m_Mapping.IsNull()
+        || this->m_Mapping->GetLargestPossibleRegion() != outputPtr->GetLargestPossibleRegion() )
+      {
+      this->m_Mapping = MappingImageType::New();
+      this->m_Mapping->SetRegions( outputPtr->GetLargestPossibleRegion() );
+      this->m_Mapping->Allocate();
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread, ThreadIdType itkNotUsed( threadId ) )
+{
+  OutputImageType *     outputPtr = this->GetOutput();
+  const InputImageType *inputPtr = this->GetInput();
+
+  ImageRegionIteratorWithIndex<MappingImageType> ItM( this->m_Mapping, outputRegionForThread );
+  ImageRegionIterator<OutputImageType>           ItO( outputPtr, outputRegionForThread );
+
+  PointType outputPoint;
+  PointType inputPoint;
+  for( ItM.GoToBegin(), ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItM, ++ItO )
+    {
+    if( this->m_ComputeMapping )
+      {
+      outputPtr->TransformIndexToPhysicalPoint( ItM.GetIndex(), outputPoint );
+      inputPoint = this->m_Transform->TransformPoint( outputPoint );
+
+      ContinuousIndexType inputIndex;
+      inputPtr->TransformPhysicalPointToContinuousIndex( inputPoint, inputIndex );
+      ItM.Set( inputIndex );
+      }
+
+    const ContinuousIndexType & inputIndex = ItM.Value();
+    if( this->m_Interpolator->IsInsideBuffer( inputIndex ) )
+      {
+      ItO.Set( static_cast<PixelType>( this->m_Interpolator->EvaluateAtContinuousIndex( inputIndex ) ) );
+      }
+    else
+      {
+      ItO.Set( this->m_DefaultPixelValue );
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::AfterThreadedGenerateData()
+{
+  OutputImagePointer outputPtr = this->GetOutput();
+
+  // the mapping can only be reused if it was computed for the whole output grid
+  if( this->m_ComputeMapping
+      && outputPtr->GetRequestedRegion() == outputPtr->GetLargestPossibleRegion() )
+    {
+    const InputImageType *inputPtr = this->GetInput();
+
+    this->m_MappingIsValid = true;
+    this->m_MappingTransformMTime = this->m_Transform->GetMTime();
+    this->m_MappingInputOrigin = inputPtr->GetOrigin();
+    this->m_MappingInputSpacing = inputPtr->GetSpacing();
+    this->m_MappingInputDirection = inputPtr->GetDirection();
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+CachedMappingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Transform: " << this->m_Transform.GetPointer() << std::endl;
+  os << indent << "Interpolator: " << this->m_Interpolator.GetPointer() << std::endl;
+  os << indent << "DefaultPixelValue: "
+     << static_cast<typename NumericTraits<PixelType>::PrintType>( this->m_DefaultPixelValue ) << std::endl;
+  os << indent << "OutputOrigin: " << this->m_OutputOrigin << std::endl;
+  os << indent << "OutputSpacing: " << this->m_OutputSpacing << std::endl;
+  os << indent << "OutputDirection: " << this->m_OutputDirection << std::endl;
+  os << indent << "OutputStartIndex: " << this->m_OutputStartIndex << std::endl;
+  os << indent << "OutputSize: " << this->m_OutputSize << std::endl;
+  os << indent << "MappingIsValid: " << this->m_MappingIsValid << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -0,0 +1,133 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkConcurrentObjectToObjectMultiMetricv4_h
+#define __itkConcurrentObjectToObjectMultiMetricv4_h
+
+#include "itkMultiThreader.h"
+#include "itkObjectToObjectMultiMetricv4.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <string>
+#include <vector>
+
+namespace itk
+{
+/** \class ConcurrentObjectToObjectMultiMetricv4
+ *
+ * ObjectToObjectMultiMetricv4 which evaluates its metrics at the same time
+ * instead of one after the other.  MaximumNumberOfThreads is the budget of
+ * threads of the whole evaluation: up to that many metrics are evaluated at
+ * once, each taken from a shared queue by the next free thread, and each
+ * metric is meant to thread over its virtual domain with
+ * GetNumberOfThreadsPerMetric() threads, so that the metrics together do
+ * not use more threads than the budget.  The budget defaults to
+ * MultiThreader::GetGlobalDefaultNumberOfThreads(), i.e. to
+ * ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS when it is set.
+ *
+ * The derivatives of the metrics are combined in the order of the metrics,
+ * so the result is the same as that of the superclass.  They are all held
+ * until the end of the evaluation, which takes one derivative array per
+ * metric instead of one.
+ *
+ * The metric values are kept by this class, so use GetValueArray() and
+ * GetWeightedValue() through a pointer to this class rather than to the
+ * superclass.
+ */
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType = double>
+class ConcurrentObjectToObjectMultiMetricv4 :
+  public ObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+{
+public:
+  /** Standard class typedefs. */
+  typedef ConcurrentObjectToObjectMultiMetricv4 Self;
+  typedef ObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage,
+                                      TInternalComputationValueType> Superclass;
+  typedef SmartPointer<Self>                                         Pointer;
+  typedef SmartPointer<const Self>                                   ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( ConcurrentObjectToObjectMultiMetricv4, ObjectToObjectMultiMetricv4 );
+
+  typedef typename Superclass::MeasureType            MeasureType;
+  typedef typename Superclass::DerivativeType         DerivativeType;
+  typedef typename Superclass::DerivativeValueType    DerivativeValueType;
+  typedef typename Superclass::NumberOfParametersType NumberOfParametersType;
+  typedef typename Superclass::MetricValueArrayType   MetricValueArrayType;
+  typedef typename Superclass::WeightsArrayType       WeightsArrayType;
+  typedef typename Superclass::MetricQueueType        MetricQueueType;
+
+  /** The number of threads shared by the metrics. */
+  itkSetClampMacro( MaximumNumberOfThreads, ThreadIdType, 1, ITK_MAX_THREADS );
+  itkGetConstMacro( MaximumNumberOfThreads, ThreadIdType );
+
+  /** The number of threads each metric should use so that all the metrics
+      evaluated at once stay within MaximumNumberOfThreads. */
+  ThreadIdType GetNumberOfThreadsPerMetric() const;
+
+  /** Evaluate all the metrics and return the value of the first one, as
+      the superclass does. */
+  virtual MeasureType GetValue() const ITK_OVERRIDE;
+
+  virtual void GetDerivative( DerivativeType & derivative ) const ITK_OVERRIDE;
+
+  virtual void GetValueAndDerivative( MeasureType & value, DerivativeType & derivative ) const ITK_OVERRIDE;
+
+  /** The values of the metrics at the last evaluation. */
+  MetricValueArrayType GetValueArray() const;
+
+  /** The weighted sum of the values of the metrics at the last evaluation. */
+  MeasureType GetWeightedValue() const;
+
+protected:
+  ConcurrentObjectToObjectMultiMetricv4();
+  virtual ~ConcurrentObjectToObjectMultiMetricv4()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+private:
+  ConcurrentObjectToObjectMultiMetricv4( const Self & ); // purposely not implemented
+  void operator=( const Self & );                        // purposely not implemented
+
+  /** Evaluate the metrics in parallel, with or without their derivatives. */
+  void EvaluateMetrics( bool computeDerivatives ) const;
+
+  struct ThreadStruct
+    {
+    const Self *        Metric;
+    bool                ComputeDerivatives;
+    unsigned int        NextMetric;
+    SimpleFastMutexLock Mutex;
+    std::string         ErrorMessage;
+    };
+
+  static ITK_THREAD_RETURN_TYPE EvaluateMetricsThreaderCallback( void *arg );
+
+  ThreadIdType m_MaximumNumberOfThreads;
+
+  mutable MetricValueArrayType        m_ValueArray;
+  mutable std::vector<DerivativeType> m_Derivatives;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkConcurrentObjectToObjectMultiMetricv4.hxx"
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkConcurrentObjectToObjectMultiMetricv4_hxx
+#define __itkConcurrentObjectToObjectMultiMetricv4_hxx
+
+#include "itkConcurrentObjectToObjectMultiMetricv4.h"
+
+#include "itkMutexLockHolder.h"
+
+#include <algorithm>
+
+namespace itk
+{
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::ConcurrentObjectToObjectMultiMetricv4() :
+  m_MaximumNumberOfThreads( MultiThreader::GetGlobalDefaultNumberOfThreads() )
+{
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+ThreadIdType
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetNumberOfThreadsPerMetric() const
+{
+  const ThreadIdType numberOfMetrics = std::max( this->GetNumberOfMetrics(), static_cast<SizeValueType>( 1 ) );
+  return std::max( this->m_MaximumNumberOfThreads / numberOfMetrics, static_cast<ThreadIdType>( 1 ) );
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+ITK_THREAD_RETURN_TYPE
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::EvaluateMetricsThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *threadInfo = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStruct *                   str = static_cast<ThreadStruct *>( threadInfo->UserData );
+
+  const Self *            self = str->Metric;
+  const MetricQueueType & metricQueue = self->GetMetricQueue();
+
+  while( true )
+    {
+    unsigned int j = 0;
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      if( str->NextMetric >= metricQueue.size() || !str->ErrorMessage.empty() )
+        {
+        break;
+        }
+      j = str->NextMetric++;
+      }
+
+    try
+      {
+      if( str->ComputeDerivatives )
+        {
+        MeasureType metricValue = NumericTraits<MeasureType>::ZeroValue();
+        metricQueue[j]->GetValueAndDerivative( metricValue, self->m_Derivatives[j] );
+        self->m_ValueArray[j] = metricValue;
+        }
+      else
+        {
+        self->m_ValueArray[j] = metricQueue[j]->GetValue();
+        }
+      }
+    catch( ExceptionObject & err )
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      str->ErrorMessage = err.GetDescription();
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+void
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::EvaluateMetrics( bool computeDerivatives ) const
+{
+  const unsigned int numberOfMetrics = this->GetMetricQueue().size();
+
+  this->m_ValueArray.SetSize( numberOfMetrics );
+  this->m_ValueArray.Fill( NumericTraits<MeasureType>::ZeroValue() );
+  if( computeDerivatives )
+    {
+    this->m_Derivatives.resize( numberOfMetrics );
+    }
+
+  ThreadStruct str;
+  str.Metric = this;
+  str.ComputeDerivatives = computeDerivatives;
+  str.NextMetric = 0;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( std::min( static_cast<ThreadIdType>( numberOfMetrics ),
+                                          this->m_MaximumNumberOfThreads ) );
+  threader->SetSingleMethod( Self::EvaluateMetricsThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  if( !str.ErrorMessage.empty() )
+    {
+    itkExceptionMacro( << str.ErrorMessage );
+    }
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+typename ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage,
+                                               TInternalComputationValueType>::MeasureType
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetValue() const
+{
+  this->EvaluateMetrics( false );
+  return this->m_ValueArray.GetSize() > 0 ? this->m_ValueArray[0] : NumericTraits<MeasureType>::ZeroValue();
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+void
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetDerivative( DerivativeType & derivative ) const
+{
+  MeasureType value;
+  this->GetValueAndDerivative( value, derivative );
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+void
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetValueAndDerivative( MeasureType & value, DerivativeType & derivative ) const
+{
+  this->EvaluateMetrics( true );
+
+  const NumberOfParametersType numberOfParameters = this->GetNumberOfParameters();
+  if( derivative.GetSize() != numberOfParameters )
+    {
+    derivative.SetSize( numberOfParameters );
+    }
+  derivative.Fill( NumericTraits<DerivativeValueType>::ZeroValue() );
+
+  // derivative = totalMagnitude * \sum_j w_j * ( dM_j / ||dM_j|| ), as in the superclass
+  const WeightsArrayType & weights = this->GetMetricWeights();
+  DerivativeValueType      totalMagnitude = NumericTraits<DerivativeValueType>::ZeroValue();
+  for( unsigned int j = 0; j < this->m_Derivatives.size(); j++ )
+    {
+    const DerivativeType &    metricDerivative = this->m_Derivatives[j];
+    const DerivativeValueType magnitude = metricDerivative.magnitude();
+    totalMagnitude += magnitude;
+
+    DerivativeValueType weightOverMagnitude = NumericTraits<DerivativeValueType>::ZeroValue();
+    if( magnitude > NumericTraits<DerivativeValueType>::epsilon() )
+      {
+      weightOverMagnitude = weights[j] / magnitude;
+      }
+    for( NumberOfParametersType p = 0; p < numberOfParameters; p++ )
+      {
+      derivative[p] += metricDerivative[p] * weightOverMagnitude;
+      }
+    }
+  derivative *= totalMagnitude;
+
+  value = this->m_ValueArray.GetSize() > 0 ? this->m_ValueArray[0] : NumericTraits<MeasureType>::ZeroValue();
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+typename ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage,
+                                               TInternalComputationValueType>::MetricValueArrayType
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetValueArray() const
+{
+  return this->m_ValueArray;
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+typename ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage,
+                                               TInternalComputationValueType>::MeasureType
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::GetWeightedValue() const
+{
+  const WeightsArrayType & weights = this->GetMetricWeights();
+  MeasureType              value = NumericTraits<MeasureType>::ZeroValue();
+  for( unsigned int j = 0; j < this->m_ValueArray.GetSize(); j++ )
+    {
+    value += this->m_ValueArray[j] * weights[j];
+    }
+  return value;
+}
+
+template <unsigned int TFixedDimension, unsigned int TMovingDimension, class TVirtualImage,
+          class TInternalComputationValueType>
+void
+ConcurrentObjectToObjectMultiMetricv4<TFixedDimension, TMovingDimension, TVirtualImage, TInternalComputationValueType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Maximum number of threads: " << this->m_MaximumNumberOfThreads << std::endl;
+}
+} // end namespace itk
+
+#endif
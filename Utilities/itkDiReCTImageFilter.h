@@ -18,6 +18,8 @@
 
 #include "itkVector.h"
 
+#include <vector>
+
 namespace itk
 {
 /** \class DiReCTImageFilter
@@ -240,6 +242,39 @@ public:
   itkGetConstMacro( UseBSplineSmoothing, bool  );
   itkBooleanMacro( UseBSplineSmoothing );
 
+  /**
+   * Set/Get the option to restrict the computation to the bounding region of
+   * the gray and white matters padded by BoundingRegionPadding voxels.  The
+   * velocity and integrated fields vanish outside these tissues, so only the
+   * cost of the field updates, smoothing and inversion changes.  The padding
+   * should cover the smoothing kernels and the expected thickness.
+   * Default = false.
+   */
+  itkSetMacro( RestrictToBoundingRegion, bool );
+  itkGetConstMacro( RestrictToBoundingRegion, bool );
+  itkBooleanMacro( RestrictToBoundingRegion );
+
+  /**
+   * Set/Get the padding of the bounding region (in voxels).  Default = 10.
+   */
+  itkSetMacro( BoundingRegionPadding, unsigned int );
+  itkGetConstMacro( BoundingRegionPadding, unsigned int );
+
+  /**
+   * Set/Get the option to keep the working images and fields after an update
+   * and reuse their buffers in the next update with the same domain, e.g.
+   * when estimating the thickness of several time points of a subject with
+   * one filter.  Default = false.
+   */
+  itkSetMacro( ReuseWorkingImages, bool );
+  itkGetConstMacro( ReuseWorkingImages, bool );
+  itkBooleanMacro( ReuseWorkingImages );
+
+  /**
+   * Release the working images kept with ReuseWorkingImages.
+   */
+  void ReleaseWorkingImages();
+
   /**
    * Get the number of elapsed iterations.  This is a helper function for
    * reporting observations.
@@ -273,6 +308,98 @@ protected:
 
 private:
 
+  /**
+   * Images and per-thread accumulators of the voxel-wise pass run at each
+   * integration point.
+   */
+  struct IntegrationPointThreadStruct
+    {
+    const Self                  *Filter;
+    const InputImageType        *SegmentationImage;
+    const InputImageType        *MatterContours;
+    const RealImageType         *GrayMatterProbabilityImage;
+    const RealImageType         *WhiteMatterContours;
+    const RealImageType         *WarpedWhiteMatterProbabilityImage;
+    const RealImageType         *WarpedWhiteMatterContours;
+    const RealImageType         *WarpedThicknessImage;
+    const DisplacementFieldType *GradientImage;
+    DisplacementFieldType       *ForwardIncrementalField;
+    DisplacementFieldType       *InverseIncrementalField;
+    DisplacementFieldType       *InverseField;
+    DisplacementFieldType       *IntegratedField;
+    DisplacementFieldType       *VelocityField;
+    RealImageType               *HitImage;
+    RealImageType               *TotalImage;
+    RealImageType               *ThicknessImage;
+    bool                        IsFirstIntegrationPoint;
+    std::vector<RealType>       Energy;
+    std::vector<RealType>       NumberOfGrayMatterVoxels;
+    };
+
+  /**
+   * Images and per-thread accumulators of the velocity field update at the
+   * end of each iteration.
+   */
+  struct VelocityUpdateThreadStruct
+    {
+    const Self                  *Filter;
+    const InputImageType        *SegmentationImage;
+    const RealImageType         *SmoothHitImage;
+    const RealImageType         *SmoothTotalImage;
+    const DisplacementFieldType *ForwardIncrementalField;
+    DisplacementFieldType       *VelocityField;
+    RealImageType               *CorticalThicknessImage;
+    std::vector<RealType>       PriorEnergy;
+    std::vector<unsigned long>  PriorEnergyCount;
+    };
+
+  /**
+   * Number of threads used for the voxel-wise passes over region.
+   */
+  ThreadIdType GetNumberOfThreadsForRegion( const RegionType & ) const;
+
+  /**
+   * Contiguous slabs of the slowest dimension of region assigned to threadId.
+   * Returns false if the thread has no work.
+   */
+  bool GetRegionForThread( const RegionType &, ThreadIdType, ThreadIdType, RegionType & ) const;
+
+  static ITK_THREAD_RETURN_TYPE IntegrationPointThreaderCallback( void * );
+
+  void ThreadedIntegrationPoint( IntegrationPointThreadStruct *, ThreadIdType, ThreadIdType ) const;
+
+  static ITK_THREAD_RETURN_TYPE VelocityUpdateThreaderCallback( void * );
+
+  void ThreadedVelocityUpdate( VelocityUpdateThreadStruct *, ThreadIdType, ThreadIdType ) const;
+
+  /**
+   * Private function for computing the padded bounding region of the gray
+   * and white matters.
+   */
+  RegionType ComputeBoundingRegion( const InputImageType * ) const;
+
+  /**
+   * Private function for cropping an image to a region.  The cropped image
+   * keeps the index and geometry of the full image so that indices and
+   * physical points are unchanged.
+   */
+  template <class TImage>
+  typename TImage::Pointer CropImage( const TImage *, const RegionType & ) const;
+
+  /**
+   * Private function for copying a cropped image into its region of the
+   * full image.
+   */
+  void PasteImage( const RealImageType *, RealImageType * ) const;
+
+  /**
+   * Private function for allocating a working image on the domain of the
+   * reference image, reusing the buffer of image if it already has that
+   * domain.
+   */
+  template <class TImage>
+  void AllocateWorkingImage( SmartPointer<TImage> &, const InputImageType * ) const;
+
   /**
    * Private function for extracting regions (e.g. gray or white).
    */
@@ -336,6 +463,19 @@ private:
 
   bool m_UseBSplineSmoothing;
 
+  bool         m_RestrictToBoundingRegion;
+  unsigned int m_BoundingRegionPadding;
+
+  bool                     m_ReuseWorkingImages;
+  DisplacementFieldPointer m_ForwardIncrementalField;
+  DisplacementFieldPointer m_InverseIncrementalField;
+  DisplacementFieldPointer m_InverseField;
+  DisplacementFieldPointer m_IntegratedField;
+  DisplacementFieldPointer m_VelocityField;
+  RealImagePointer         m_HitImage;
+  RealImagePointer         m_TotalImage;
+  RealImagePointer         m_ThicknessImage;
+
 };
 } // end namespace itk
 
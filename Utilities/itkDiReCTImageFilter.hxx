@@ -25,7 +25,6 @@
 #include "itkComposeDisplacementFieldsImageFilter.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkDisplacementFieldToBSplineImageFilter.h"
-#include "itkGaussianOperator.h"
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkVectorMagnitudeImageFilter.h"
 #include "itkImageDuplicator.h"
@@ -38,11 +37,13 @@
 #include "itkMultiplyByConstantImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 #include "itkVectorLinearInterpolateImageFunction.h"
-#include "itkVectorNeighborhoodOperatorImageFilter.h"
 #include "itkWarpImageFilter.h"
 #include "itkWindowConvergenceMonitoringFunction.h"
 
 #include "ReadWriteData.h"
+#include "antsSeparableGaussianSmoothing.h"
+
+#include <algorithm>
 
 namespace itk
 {
@@ -63,7 +64,10 @@ DiReCTImageFilter<TInputImage, TOutputImage>
   m_CurrentEnergy( NumericTraits<RealType>::max() ),
   m_ConvergenceThreshold( 0.001 ),
   m_ConvergenceWindowSize( 10 ),
-  m_UseBSplineSmoothing( false )
+  m_UseBSplineSmoothing( false ),
+  m_RestrictToBoundingRegion( false ),
+  m_BoundingRegionPadding( 10 ),
+  m_ReuseWorkingImages( false )
 {
   this->m_ThicknessPriorImage = ITK_NULLPTR;
   this->SetNumberOfRequiredInputs( 3 );
@@ -141,6 +145,26 @@ DiReCTImageFilter<TInputImage, TOutputImage>
   whiteMatterProbabilityImage->Update();
   whiteMatterProbabilityImage->DisconnectPipeline();
 
+  // Optionally crop everything to the padded gm/wm bounding region.  The
+  // fields are zero outside of the gray and white matters, so this only
+  // leaves out voxels which do not contribute.
+
+  const RegionType  fullRegion = segmentationImage->GetRequestedRegion();
+  InputImagePointer fullSegmentationImage = segmentationImage;
+  RealImagePointer  fullWhiteMatterProbabilityImage = whiteMatterProbabilityImage;
+  if( this->m_RestrictToBoundingRegion )
+    {
+    const RegionType boundingRegion = this->ComputeBoundingRegion( segmentationImage );
+    if( boundingRegion != fullRegion )
+      {
+      itkDebugMacro( "Restricting to the bounding region " << boundingRegion );
+
+      segmentationImage = this->CropImage( segmentationImage.GetPointer(), boundingRegion );
+      grayMatterProbabilityImage = this->CropImage( grayMatterProbabilityImage.GetPointer(), boundingRegion );
+      whiteMatterProbabilityImage = this->CropImage( whiteMatterProbabilityImage.GetPointer(), boundingRegion );
+      }
+    }
+
   // Extract the gray and white matter segmentations and combine to form the
   // gm/wm region.  Dilate the latter region by 1 voxel.
 
@@ -176,88 +200,43 @@ DiReCTImageFilter<TInputImage, TOutputImage>
   corticalThicknessImage->Allocate();
   corticalThicknessImage->FillBuffer( 0.0 );
 
-  DisplacementFieldPointer forwardIncrementalField = DisplacementFieldType::New();
-  forwardIncrementalField->CopyInformation( segmentationImage );
-  forwardIncrementalField->SetRegions( segmentationImage->GetRequestedRegion() );
-  forwardIncrementalField->Allocate();
+  DisplacementFieldPointer forwardIncrementalField = this->m_ForwardIncrementalField;
+  this->AllocateWorkingImage( forwardIncrementalField, segmentationImage );
 
-  RealImagePointer hitImage = RealImageType::New();
-  hitImage->CopyInformation( segmentationImage );
-  hitImage->SetRegions( segmentationImage->GetRequestedRegion() );
-  hitImage->Allocate();
+  RealImagePointer hitImage = this->m_HitImage;
+  this->AllocateWorkingImage( hitImage, segmentationImage );
+  hitImage->FillBuffer( 0.0 );
 
-  DisplacementFieldPointer integratedField = DisplacementFieldType::New();
-  integratedField->CopyInformation( segmentationImage );
-  integratedField->SetRegions( segmentationImage->GetRequestedRegion() );
-  integratedField->Allocate();
+  DisplacementFieldPointer integratedField = this->m_IntegratedField;
+  this->AllocateWorkingImage( integratedField, segmentationImage );
   integratedField->FillBuffer( zeroVector );
 
-  DisplacementFieldPointer inverseField = DisplacementFieldType::New();
-  inverseField->CopyInformation( segmentationImage );
-  inverseField->SetRegions( segmentationImage->GetRequestedRegion() );
-  inverseField->Allocate();
-
-  DisplacementFieldPointer inverseIncrementalField = DisplacementFieldType::New();
-  inverseIncrementalField->CopyInformation( segmentationImage );
-  inverseIncrementalField->SetRegions( segmentationImage->GetRequestedRegion() );
-  inverseIncrementalField->Allocate();
-
-  RealImagePointer speedImage = RealImageType::New();
-  speedImage->CopyInformation( segmentationImage );
-  speedImage->SetRegions( segmentationImage->GetRequestedRegion() );
-  speedImage->Allocate();
-
-  RealImagePointer thicknessImage = RealImageType::New();
-  thicknessImage->CopyInformation( segmentationImage );
-  thicknessImage->SetRegions( segmentationImage->GetRequestedRegion() );
-  thicknessImage->Allocate();
-
-  RealImagePointer totalImage = RealImageType::New();
-  totalImage->CopyInformation( segmentationImage );
-  totalImage->SetRegions( segmentationImage->GetRequestedRegion() );
-  totalImage->Allocate();
-
-  DisplacementFieldPointer velocityField = DisplacementFieldType::New();
-  velocityField->CopyInformation( segmentationImage );
-  velocityField->SetRegions( segmentationImage->GetRequestedRegion() );
-  velocityField->Allocate();
+  DisplacementFieldPointer inverseField = this->m_InverseField;
+  this->AllocateWorkingImage( inverseField, segmentationImage );
+
+  DisplacementFieldPointer inverseIncrementalField = this->m_InverseIncrementalField;
+  this->AllocateWorkingImage( inverseIncrementalField, segmentationImage );
+
+  RealImagePointer thicknessImage = this->m_ThicknessImage;
+  this->AllocateWorkingImage( thicknessImage, segmentationImage );
+
+  RealImagePointer totalImage = this->m_TotalImage;
+  this->AllocateWorkingImage( totalImage, segmentationImage );
+  totalImage->FillBuffer( 0.0 );
+
+  DisplacementFieldPointer velocityField = this->m_VelocityField;
+  this->AllocateWorkingImage( velocityField, segmentationImage );
   velocityField->FillBuffer( zeroVector );
 
-  // Instantiate most of the iterators all in one place
+  // the buffers are handed back at the end if they are to be reused
+  this->ReleaseWorkingImages();
 
-  ImageRegionIterator<RealImageType> ItCorticalThicknessImage(
-    corticalThicknessImage,
-    corticalThicknessImage->GetRequestedRegion() );
-  ImageRegionConstIterator<RealImageType> ItGrayMatterProbabilityMap(
-    grayMatterProbabilityImage,
-    grayMatterProbabilityImage->GetRequestedRegion() );
-  ImageRegionIterator<RealImageType> ItHitImage(
-    hitImage,
-    hitImage->GetRequestedRegion() );
-  ImageRegionIterator<DisplacementFieldType> ItForwardIncrementalField(
-    forwardIncrementalField,
-    forwardIncrementalField->GetRequestedRegion() );
-  ImageRegionConstIterator<InputImageType> ItMatterContours(
-    matterContours,
-    matterContours->GetRequestedRegion() );
-  ImageRegionIterator<DisplacementFieldType> ItInverseIncrementalField(
-    inverseIncrementalField,
-    inverseIncrementalField->GetRequestedRegion() );
-  ImageRegionConstIteratorWithIndex<InputImageType> ItSegmentationImage(
-    segmentationImage,
-    segmentationImage->GetRequestedRegion() );
-  ImageRegionIterator<RealImageType> ItSpeedImage(
-    speedImage,
-    speedImage->GetRequestedRegion() );
-  ImageRegionIterator<RealImageType> ItThicknessImage(
-    thicknessImage,
-    thicknessImage->GetRequestedRegion() );
-  ImageRegionIterator<RealImageType> ItTotalImage(
-    totalImage,
-    totalImage->GetRequestedRegion() );
-  ImageRegionConstIterator<RealImageType> ItWhiteMatterContours(
-    whiteMatterContours,
-    whiteMatterContours->GetRequestedRegion() );
+  // The voxel-wise passes below are split into slabs of the slowest
+  // dimension, one per thread.
+
+  const ThreadIdType numberOfThreads =
+    this->GetNumberOfThreadsForRegion( segmentationImage->GetRequestedRegion() );
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
 
   // Monitor the convergence
   typedef Function::WindowConvergenceMonitoringFunction<double> ConvergenceMonitoringType;
@@ -288,10 +267,6 @@ DiReCTImageFilter<TInputImage, TOutputImage>
     hitImage->FillBuffer( 0.0 );
     totalImage->FillBuffer( 0.0 );
 
-    ImageRegionIterator<DisplacementFieldType> ItVelocityField(
-      velocityField,
-      velocityField->GetRequestedRegion() );
-
     unsigned int integrationPoint = 0;
     while( integrationPoint++ < this->m_NumberOfIntegrationPoints )
       {
@@ -318,152 +293,40 @@ DiReCTImageFilter<TInputImage, TOutputImage>
 
       DisplacementFieldPointer gradientImage = gradientFilter->GetOutput();
 
-      // Instantiate the iterators all in one place
-
-      ImageRegionIterator<DisplacementFieldType> ItGradientImage(
-        gradientImage,
-        gradientImage->GetRequestedRegion() );
-      ImageRegionIterator<RealImageType> ItWarpedWhiteMatterProbabilityMap(
-        warpedWhiteMatterProbabilityImage,
-        warpedWhiteMatterProbabilityImage->GetRequestedRegion() );
-      ImageRegionIterator<RealImageType> ItWarpedWhiteMatterContours(
-        warpedWhiteMatterContours,
-        warpedWhiteMatterContours->GetRequestedRegion() );
-      ImageRegionIterator<DisplacementFieldType> ItInverseField(
-        inverseField,
-        inverseField->GetRequestedRegion() );
-      ImageRegionIterator<DisplacementFieldType> ItIntegratedField(
-        integratedField,
-        integratedField->GetRequestedRegion() );
-
-      // Generate speed image
-
-      speedImage->FillBuffer( 0.0 );
-
-      ItGradientImage.GoToBegin();
-      ItGrayMatterProbabilityMap.GoToBegin();
-      ItSegmentationImage.GoToBegin();
-      ItSpeedImage.GoToBegin();
-      ItWarpedWhiteMatterProbabilityMap.GoToBegin();
-
-      const typename InputImageType::PixelType grayMatterPixel =
-        static_cast<typename InputImageType::PixelType>( this->m_GrayMatterLabel ),
-      whiteMatterPixel =
-        static_cast<typename InputImageType::PixelType>( this->m_WhiteMatterLabel );
-      while( !ItSegmentationImage.IsAtEnd() )
+      // Generate the speed, accumulate the hit and total images and update
+      // the fields.  Every voxel only touches its own location in each image
+      // so the pass is split across threads.
+
+      IntegrationPointThreadStruct integrationStruct;
+      integrationStruct.Filter = this;
+      integrationStruct.SegmentationImage = segmentationImage;
+      integrationStruct.MatterContours = matterContours;
+      integrationStruct.GrayMatterProbabilityImage = grayMatterProbabilityImage;
+      integrationStruct.WhiteMatterContours = whiteMatterContours;
+      integrationStruct.WarpedWhiteMatterProbabilityImage = warpedWhiteMatterProbabilityImage;
+      integrationStruct.WarpedWhiteMatterContours = warpedWhiteMatterContours;
+      integrationStruct.WarpedThicknessImage = warpedThicknessImage;
+      integrationStruct.GradientImage = gradientImage;
+      integrationStruct.ForwardIncrementalField = forwardIncrementalField;
+      integrationStruct.InverseIncrementalField = inverseIncrementalField;
+      integrationStruct.InverseField = inverseField;
+      integrationStruct.IntegratedField = integratedField;
+      integrationStruct.VelocityField = velocityField;
+      integrationStruct.HitImage = hitImage;
+      integrationStruct.TotalImage = totalImage;
+      integrationStruct.ThicknessImage = thicknessImage;
+      integrationStruct.IsFirstIntegrationPoint = ( integrationPoint == 1 );
+      integrationStruct.Energy.assign( numberOfThreads, 0.0 );
+      integrationStruct.NumberOfGrayMatterVoxels.assign( numberOfThreads, 0.0 );
+
+      this->GetMultiThreader()->SetSingleMethod( Self::IntegrationPointThreaderCallback, &integrationStruct );
+      this->GetMultiThreader()->SingleMethodExecute();
+
+      // reduce in thread order
+      for( ThreadIdType n = 0; n < numberOfThreads; n++ )
         {
-        if( ItSegmentationImage.Get() == grayMatterPixel )
-          {
-          RealType norm = ( ItGradientImage.Get() ).GetNorm();
-          if( norm > 1e-3 && !vnl_math_isnan( norm ) && !vnl_math_isinf( norm ) )
-            {
-            ItGradientImage.Set( ItGradientImage.Get() / norm );
-            }
-          else
-            {
-            ItGradientImage.Set( zeroVector );
-            }
-          RealType delta = ( ItWarpedWhiteMatterProbabilityMap.Get() - ItGrayMatterProbabilityMap.Get() );
-          currentEnergy += vnl_math_abs( delta );
-          numberOfGrayMatterVoxels++;
-          RealType speedValue = -1.0 * delta * ItGrayMatterProbabilityMap.Get() * this->m_CurrentGradientStep;
-          if( vnl_math_isnan( speedValue ) || vnl_math_isinf( speedValue ) )
-            {
-            speedValue = 0.0;
-            }
-          ItSpeedImage.Set( speedValue );
-          }
-        else
-          {
-          ItSpeedImage.Set( 0.0 );
-          }
-
-        ++ItGradientImage;
-        ++ItGrayMatterProbabilityMap;
-        ++ItSegmentationImage;
-        ++ItSpeedImage;
-        ++ItWarpedWhiteMatterProbabilityMap;
-        }
-
-      // Calculate objective function value
-
-      ItForwardIncrementalField.GoToBegin();
-      ItGradientImage.GoToBegin();
-      ItSegmentationImage.GoToBegin();
-      ItSpeedImage.GoToBegin();
-      ItWhiteMatterContours.GoToBegin();
-
-      while( !ItSegmentationImage.IsAtEnd() )
-        {
-        typename InputImageType::IndexType index =
-          ItSegmentationImage.GetIndex();
-        typename InputImageType::PixelType segmentationValue =
-          ItSegmentationImage.Get();
-
-        ItForwardIncrementalField.Set( ItForwardIncrementalField.Get()
-                                       + ItGradientImage.Get() * ItSpeedImage.Get() );
-        if( segmentationValue == grayMatterPixel || segmentationValue == whiteMatterPixel )
-          {
-          if( integrationPoint == 1 )
-            {
-            typename InputImageType::PixelType whiteMatterContoursValue =
-              static_cast<typename InputImageType::PixelType>( ItWhiteMatterContours.Get() );
-            hitImage->SetPixel( index, whiteMatterContoursValue );
-
-            VectorType vector = integratedField->GetPixel( index );
-            RealType   weightedNorm = vector.GetNorm() * whiteMatterContoursValue;
-
-            thicknessImage->SetPixel( index, weightedNorm );
-            totalImage->SetPixel( index, weightedNorm );
-            }
-          else if( segmentationValue == grayMatterPixel )
-            {
-            hitImage->SetPixel( index, hitImage->GetPixel( index )
-                                + warpedWhiteMatterContours->GetPixel( index ) );
-            totalImage->SetPixel( index, totalImage->GetPixel( index )
-                                  + warpedThicknessImage->GetPixel( index ) );
-            }
-          }
-
-        ++ItForwardIncrementalField;
-        ++ItGradientImage;
-        ++ItSegmentationImage;
-        ++ItSpeedImage;
-        ++ItWhiteMatterContours;
-        }
-
-      ItSegmentationImage.GoToBegin();
-      ItMatterContours.GoToBegin();
-      ItWhiteMatterContours.GoToBegin();
-      ItVelocityField.GoToBegin();
-      ItInverseIncrementalField.GoToBegin();
-      ItIntegratedField.GoToBegin();
-      ItInverseField.GoToBegin();
-      while( !ItSegmentationImage.IsAtEnd() )
-        {
-        typename InputImageType::PixelType segmentationValue =
-          ItSegmentationImage.Get();
-        typename InputImageType::PixelType whiteMatterContoursValue =
-          static_cast<typename InputImageType::PixelType>( ItWhiteMatterContours.Get() );
-        typename InputImageType::PixelType matterContoursValue = ItMatterContours.Get();
-
-        if( segmentationValue == 0 ||
-          ( whiteMatterContoursValue == 0 && matterContoursValue == 0 && segmentationValue != this->m_GrayMatterLabel ) )
-          {
-          ItInverseField.Set( zeroVector );
-          ItVelocityField.Set( zeroVector );
-          ItIntegratedField.Set( zeroVector );
-          }
-
-        ItInverseIncrementalField.Set( ItVelocityField.Get() );
-
-        ++ItSegmentationImage;
-        ++ItMatterContours;
-        ++ItWhiteMatterContours;
-        ++ItVelocityField;
-        ++ItInverseIncrementalField;
-        ++ItInverseField;
-        ++ItIntegratedField;
+        currentEnergy += integrationStruct.Energy[n];
+        numberOfGrayMatterVoxels += integrationStruct.NumberOfGrayMatterVoxels[n];
         }
 
       if( integrationPoint == 1 )
@@ -543,62 +406,24 @@ DiReCTImageFilter<TInputImage, TOutputImage>
       smoothTotalImage = totalImage;
       }
 
-    ImageRegionConstIterator<RealImageType> ItSmoothHitImage( smoothHitImage,
-      smoothHitImage->GetRequestedRegion() );
-    ImageRegionConstIterator<RealImageType> ItSmoothTotalImage( smoothTotalImage,
-      smoothTotalImage->GetRequestedRegion() );
-
-    ItCorticalThicknessImage.GoToBegin();
-    ItForwardIncrementalField.GoToBegin();
-    ItSegmentationImage.GoToBegin();
-    ItSmoothHitImage.GoToBegin();
-    ItSmoothTotalImage.GoToBegin();
-    ItVelocityField.GoToBegin();
-
-    while( !ItSegmentationImage.IsAtEnd() )
+    VelocityUpdateThreadStruct velocityStruct;
+    velocityStruct.Filter = this;
+    velocityStruct.SegmentationImage = segmentationImage;
+    velocityStruct.SmoothHitImage = smoothHitImage;
+    velocityStruct.SmoothTotalImage = smoothTotalImage;
+    velocityStruct.ForwardIncrementalField = forwardIncrementalField;
+    velocityStruct.VelocityField = velocityField;
+    velocityStruct.CorticalThicknessImage = corticalThicknessImage;
+    velocityStruct.PriorEnergy.assign( numberOfThreads, 0.0 );
+    velocityStruct.PriorEnergyCount.assign( numberOfThreads, 0 );
+
+    this->GetMultiThreader()->SetSingleMethod( Self::VelocityUpdateThreaderCallback, &velocityStruct );
+    this->GetMultiThreader()->SingleMethodExecute();
+
+    for( ThreadIdType n = 0; n < numberOfThreads; n++ )
       {
-      ItVelocityField.Set( ItVelocityField.Get() + ItForwardIncrementalField.Get() );
-      const typename InputImageType::PixelType grayMatterPixel =
-        static_cast<typename InputImageType::PixelType>( this->m_GrayMatterLabel );
-      if(  ItSegmentationImage.Get() == grayMatterPixel )
-        {
-        RealType thicknessValue = 0.0;
-        if( ItSmoothHitImage.Get() > 0.001 )
-          {
-          thicknessValue = ItSmoothTotalImage.Get() / ItSmoothHitImage.Get();
-          if( thicknessValue < 0.0 )
-            {
-            thicknessValue = 0.0;
-            }
-          if( ! this->m_ThicknessPriorImage && ( thicknessValue > this->m_ThicknessPriorEstimate ) )
-            {
-            RealType fraction = this->m_ThicknessPriorEstimate / thicknessValue;
-            ItVelocityField.Set( ItVelocityField.Get() * vnl_math_sqr( fraction ) );
-            }
-          else if( this->m_ThicknessPriorImage )
-            {
-            typename RealImageType::IndexType index = ItSegmentationImage.GetIndex();
-            RealType thicknessPrior = this->m_ThicknessPriorImage->GetPixel( index );
-            if( ( thicknessPrior > NumericTraits<RealType>::ZeroValue() ) &&
-                ( thicknessValue > thicknessPrior ) )
-              {
-              priorEnergy += vnl_math_abs( thicknessPrior - thicknessValue );
-              priorEnergyCount++;
-
-              RealType fraction = thicknessPrior / thicknessValue;
-              ItVelocityField.Set( ItVelocityField.Get() * vnl_math_sqr( fraction ) );
-              }
-            }
-          }
-        ItCorticalThicknessImage.Set( thicknessValue );
-        }
-
-      ++ItCorticalThicknessImage;
-      ++ItForwardIncrementalField;
-      ++ItSmoothHitImage;
-      ++ItSegmentationImage;
-      ++ItSmoothTotalImage;
-      ++ItVelocityField;
+      priorEnergy += velocityStruct.PriorEnergy[n];
+      priorEnergyCount += velocityStruct.PriorEnergyCount[n];
       }
 
     if( this->m_UseBSplineSmoothing )
@@ -636,11 +461,421 @@ DiReCTImageFilter<TInputImage, TOutputImage>
   // Replace the identity direction with the original direction in the outputs
 
   RealImagePointer warpedWhiteMatterProbabilityImage = this->WarpImage( whiteMatterProbabilityImage, inverseField );
+
+  // Put the cropped results back into the full domain.  Outside the bounding
+  // region the thickness is zero and the white matter is not warped.
+
+  if( segmentationImage->GetRequestedRegion() != fullRegion )
+    {
+    RealImagePointer fullCorticalThicknessImage = RealImageType::New();
+    fullCorticalThicknessImage->CopyInformation( fullSegmentationImage );
+    fullCorticalThicknessImage->SetRegions( fullRegion );
+    fullCorticalThicknessImage->Allocate();
+    fullCorticalThicknessImage->FillBuffer( 0.0 );
+    this->PasteImage( corticalThicknessImage, fullCorticalThicknessImage );
+    corticalThicknessImage = fullCorticalThicknessImage;
+
+    typedef ImageDuplicator<RealImageType> DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    duplicator->SetInputImage( fullWhiteMatterProbabilityImage );
+    duplicator->Update();
+    RealImagePointer fullWarpedWhiteMatterProbabilityImage = duplicator->GetModifiableOutput();
+    this->PasteImage( warpedWhiteMatterProbabilityImage, fullWarpedWhiteMatterProbabilityImage );
+    warpedWhiteMatterProbabilityImage = fullWarpedWhiteMatterProbabilityImage;
+    }
+
   warpedWhiteMatterProbabilityImage->SetDirection( this->GetSegmentationImage()->GetDirection() );
   corticalThicknessImage->SetDirection( this->GetSegmentationImage()->GetDirection() );
 
   this->SetNthOutput( 0, corticalThicknessImage );
   this->SetNthOutput( 1, warpedWhiteMatterProbabilityImage );
+
+  if( this->m_ReuseWorkingImages )
+    {
+    this->m_ForwardIncrementalField = forwardIncrementalField;
+    this->m_InverseIncrementalField = inverseIncrementalField;
+    this->m_InverseField = inverseField;
+    this->m_IntegratedField = integratedField;
+    this->m_VelocityField = velocityField;
+    this->m_HitImage = hitImage;
+    this->m_TotalImage = totalImage;
+    this->m_ThicknessImage = thicknessImage;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DiReCTImageFilter<TInputImage, TOutputImage>
+::ReleaseWorkingImages()
+{
+  this->m_ForwardIncrementalField = ITK_NULLPTR;
+  this->m_InverseIncrementalField = ITK_NULLPTR;
+  this->m_InverseField = ITK_NULLPTR;
+  this->m_IntegratedField = ITK_NULLPTR;
+  this->m_VelocityField = ITK_NULLPTR;
+  this->m_HitImage = ITK_NULLPTR;
+  this->m_TotalImage = ITK_NULLPTR;
+  this->m_ThicknessImage = ITK_NULLPTR;
+}
+
+template <class TInputImage, class TOutputImage>
+template <class TImage>
+void
+DiReCTImageFilter<TInputImage, TOutputImage>
+::AllocateWorkingImage( SmartPointer<TImage> & image, const InputImageType *reference ) const
+{
+  const RegionType region = reference->GetRequestedRegion();
+  const bool       reuse = image.IsNotNull() && image->GetBufferedRegion() == region;
+  if( !reuse )
+    {
+    image = TImage::New();
+    }
+  image->CopyInformation( reference );
+  image->SetRegions( region );
+  if( !reuse )
+    {
+    image->Allocate();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+ThreadIdType
+DiReCTImageFilter<TInputImage, TOutputImage>
+::GetNumberOfThreadsForRegion( const RegionType & region ) const
+{
+  const SizeValueType numberOfSlabs = region.GetSize()[ImageDimension - 1];
+
+  ThreadIdType numberOfThreads = std::max( this->GetNumberOfThreads(), static_cast<ThreadIdType>( 1 ) );
+  if( numberOfThreads > numberOfSlabs )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( std::max( numberOfSlabs, static_cast<SizeValueType>( 1 ) ) );
+    }
+  return numberOfThreads;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+DiReCTImageFilter<TInputImage, TOutputImage>
+::GetRegionForThread( const RegionType & region, ThreadIdType threadId, ThreadIdType numberOfThreads,
+                      RegionType & threadRegion ) const
+{
+  const unsigned int  slabDimension = ImageDimension - 1;
+  const SizeValueType numberOfSlabs = region.GetSize()[slabDimension];
+  const SizeValueType firstSlab = numberOfSlabs * threadId / numberOfThreads;
+  const SizeValueType endSlab = numberOfSlabs * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlab == endSlab )
+    {
+    return false;
+    }
+
+  threadRegion = region;
+  threadRegion.SetIndex( slabDimension, region.GetIndex()[slabDimension] + static_cast<IndexValueType>( firstSlab ) );
+  threadRegion.SetSize( slabDimension, endSlab - firstSlab );
+  return true;
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+DiReCTImageFilter<TInputImage, TOutputImage>
+::IntegrationPointThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  IntegrationPointThreadStruct *str = static_cast<IntegrationPointThreadStruct *>( info->UserData );
+
+  str->Filter->ThreadedIntegrationPoint( str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DiReCTImageFilter<TInputImage, TOutputImage>
+::ThreadedIntegrationPoint( IntegrationPointThreadStruct *str, ThreadIdType threadId,
+                            ThreadIdType numberOfThreads ) const
+{
+  RegionType region;
+  if( !this->GetRegionForThread( str->SegmentationImage->GetRequestedRegion(), threadId, numberOfThreads, region ) )
+    {
+    return;
+    }
+
+  const VectorType zeroVector( 0.0 );
+
+  const InputPixelType grayMatterPixel = static_cast<InputPixelType>( this->m_GrayMatterLabel );
+  const InputPixelType whiteMatterPixel = static_cast<InputPixelType>( this->m_WhiteMatterLabel );
+
+  ImageRegionConstIterator<InputImageType> ItSegmentationImage( str->SegmentationImage, region );
+  ImageRegionConstIterator<InputImageType> ItMatterContours( str->MatterContours, region );
+  ImageRegionConstIterator<RealImageType>  ItGrayMatterProbabilityMap( str->GrayMatterProbabilityImage, region );
+  ImageRegionConstIterator<RealImageType>  ItWhiteMatterContours( str->WhiteMatterContours, region );
+  ImageRegionConstIterator<RealImageType>  ItWarpedWhiteMatterProbabilityMap(
+    str->WarpedWhiteMatterProbabilityImage, region );
+  ImageRegionConstIterator<RealImageType>  ItWarpedWhiteMatterContours( str->WarpedWhiteMatterContours, region );
+  ImageRegionConstIterator<RealImageType>  ItWarpedThicknessImage( str->WarpedThicknessImage, region );
+
+  ImageRegionConstIterator<DisplacementFieldType> ItGradientImage( str->GradientImage, region );
+  ImageRegionIterator<DisplacementFieldType>      ItForwardIncrementalField( str->ForwardIncrementalField, region );
+  ImageRegionIterator<DisplacementFieldType>      ItInverseIncrementalField( str->InverseIncrementalField, region );
+  ImageRegionIterator<DisplacementFieldType>      ItInverseField( str->InverseField, region );
+  ImageRegionIterator<DisplacementFieldType>      ItIntegratedField( str->IntegratedField, region );
+  ImageRegionIterator<DisplacementFieldType>      ItVelocityField( str->VelocityField, region );
+
+  ImageRegionIterator<RealImageType> ItHitImage( str->HitImage, region );
+  ImageRegionIterator<RealImageType> ItTotalImage( str->TotalImage, region );
+  ImageRegionIterator<RealImageType> ItThicknessImage( str->ThicknessImage, region );
+
+  RealType energy = 0.0;
+  RealType numberOfGrayMatterVoxels = 0.0;
+  while( !ItSegmentationImage.IsAtEnd() )
+    {
+    const InputPixelType segmentationValue = ItSegmentationImage.Get();
+
+    // Generate the speed and update the forward incremental field
+
+    VectorType gradient = ItGradientImage.Get();
+    RealType   speedValue = 0.0;
+    if( segmentationValue == grayMatterPixel )
+      {
+      RealType norm = gradient.GetNorm();
+      if( norm > 1e-3 && !vnl_math_isnan( norm ) && !vnl_math_isinf( norm ) )
+        {
+        gradient /= norm;
+        }
+      else
+        {
+        gradient = zeroVector;
+        }
+      RealType delta = ( ItWarpedWhiteMatterProbabilityMap.Get() - ItGrayMatterProbabilityMap.Get() );
+      energy += vnl_math_abs( delta );
+      numberOfGrayMatterVoxels++;
+      speedValue = -1.0 * delta * ItGrayMatterProbabilityMap.Get() * this->m_CurrentGradientStep;
+      if( vnl_math_isnan( speedValue ) || vnl_math_isinf( speedValue ) )
+        {
+        speedValue = 0.0;
+        }
+      }
+    ItForwardIncrementalField.Set( ItForwardIncrementalField.Get() + gradient * speedValue );
+
+    // Accumulate the hit and total images
+
+    const InputPixelType whiteMatterContoursValue = static_cast<InputPixelType>( ItWhiteMatterContours.Get() );
+    if( segmentationValue == grayMatterPixel || segmentationValue == whiteMatterPixel )
+      {
+      if( str->IsFirstIntegrationPoint )
+        {
+        ItHitImage.Set( whiteMatterContoursValue );
+
+        RealType weightedNorm = ( ItIntegratedField.Get() ).GetNorm() * whiteMatterContoursValue;
+
+        ItThicknessImage.Set( weightedNorm );
+        ItTotalImage.Set( weightedNorm );
+        }
+      else if( segmentationValue == grayMatterPixel )
+        {
+        ItHitImage.Set( ItHitImage.Get() + ItWarpedWhiteMatterContours.Get() );
+        ItTotalImage.Set( ItTotalImage.Get() + ItWarpedThicknessImage.Get() );
+        }
+      }
+
+    // Restrict the fields to the gm/wm region
+
+    if( segmentationValue == 0 ||
+      ( whiteMatterContoursValue == 0 && ItMatterContours.Get() == 0 && segmentationValue != this->m_GrayMatterLabel ) )
+      {
+      ItInverseField.Set( zeroVector );
+      ItVelocityField.Set( zeroVector );
+      ItIntegratedField.Set( zeroVector );
+      }
+    ItInverseIncrementalField.Set( ItVelocityField.Get() );
+
+    ++ItSegmentationImage;
+    ++ItMatterContours;
+    ++ItGrayMatterProbabilityMap;
+    ++ItWhiteMatterContours;
+    ++ItWarpedWhiteMatterProbabilityMap;
+    ++ItWarpedWhiteMatterContours;
+    ++ItWarpedThicknessImage;
+    ++ItGradientImage;
+    ++ItForwardIncrementalField;
+    ++ItInverseIncrementalField;
+    ++ItInverseField;
+    ++ItIntegratedField;
+    ++ItVelocityField;
+    ++ItHitImage;
+    ++ItTotalImage;
+    ++ItThicknessImage;
+    }
+
+  str->Energy[threadId] = energy;
+  str->NumberOfGrayMatterVoxels[threadId] = numberOfGrayMatterVoxels;
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+DiReCTImageFilter<TInputImage, TOutputImage>
+::VelocityUpdateThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  VelocityUpdateThreadStruct *str = static_cast<VelocityUpdateThreadStruct *>( info->UserData );
+
+  str->Filter->ThreadedVelocityUpdate( str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DiReCTImageFilter<TInputImage, TOutputImage>
+::ThreadedVelocityUpdate( VelocityUpdateThreadStruct *str, ThreadIdType threadId,
+                          ThreadIdType numberOfThreads ) const
+{
+  RegionType region;
+  if( !this->GetRegionForThread( str->SegmentationImage->GetRequestedRegion(), threadId, numberOfThreads, region ) )
+    {
+    return;
+    }
+
+  const InputPixelType grayMatterPixel = static_cast<InputPixelType>( this->m_GrayMatterLabel );
+
+  ImageRegionConstIteratorWithIndex<InputImageType> ItSegmentationImage( str->SegmentationImage, region );
+  ImageRegionConstIterator<RealImageType>           ItSmoothHitImage( str->SmoothHitImage, region );
+  ImageRegionConstIterator<RealImageType>           ItSmoothTotalImage( str->SmoothTotalImage, region );
+  ImageRegionConstIterator<DisplacementFieldType>   ItForwardIncrementalField( str->ForwardIncrementalField, region );
+  ImageRegionIterator<DisplacementFieldType>        ItVelocityField( str->VelocityField, region );
+  ImageRegionIterator<RealImageType>                ItCorticalThicknessImage( str->CorticalThicknessImage, region );
+
+  RealType      priorEnergy = 0.0;
+  unsigned long priorEnergyCount = 0;
+  while( !ItSegmentationImage.IsAtEnd() )
+    {
+    ItVelocityField.Set( ItVelocityField.Get() + ItForwardIncrementalField.Get() );
+    if( ItSegmentationImage.Get() == grayMatterPixel )
+      {
+      RealType thicknessValue = 0.0;
+      if( ItSmoothHitImage.Get() > 0.001 )
+        {
+        thicknessValue = ItSmoothTotalImage.Get() / ItSmoothHitImage.Get();
+        if( thicknessValue < 0.0 )
+          {
+          thicknessValue = 0.0;
+          }
+        if( ! this->m_ThicknessPriorImage && ( thicknessValue > this->m_ThicknessPriorEstimate ) )
+          {
+          RealType fraction = this->m_ThicknessPriorEstimate / thicknessValue;
+          ItVelocityField.Set( ItVelocityField.Get() * vnl_math_sqr( fraction ) );
+          }
+        else if( this->m_ThicknessPriorImage )
+          {
+          RealType thicknessPrior = this->m_ThicknessPriorImage->GetPixel( ItSegmentationImage.GetIndex() );
+          if( ( thicknessPrior > NumericTraits<RealType>::ZeroValue() ) &&
+              ( thicknessValue > thicknessPrior ) )
+            {
+            priorEnergy += vnl_math_abs( thicknessPrior - thicknessValue );
+            priorEnergyCount++;
+
+            RealType fraction = thicknessPrior / thicknessValue;
+            ItVelocityField.Set( ItVelocityField.Get() * vnl_math_sqr( fraction ) );
+            }
+          }
+        }
+      ItCorticalThicknessImage.Set( thicknessValue );
+      }
+
+    ++ItSegmentationImage;
+    ++ItSmoothHitImage;
+    ++ItSmoothTotalImage;
+    ++ItForwardIncrementalField;
+    ++ItVelocityField;
+    ++ItCorticalThicknessImage;
+    }
+
+  str->PriorEnergy[threadId] = priorEnergy;
+  str->PriorEnergyCount[threadId] = priorEnergyCount;
+}
+
+template <class TInputImage, class TOutputImage>
+typename DiReCTImageFilter<TInputImage, TOutputImage>::RegionType
+DiReCTImageFilter<TInputImage, TOutputImage>
+::ComputeBoundingRegion( const InputImageType *segmentationImage ) const
+{
+  const RegionType & fullRegion = segmentationImage->GetRequestedRegion();
+
+  IndexType minIndex;
+  IndexType maxIndex;
+  minIndex.Fill( NumericTraits<IndexValueType>::max() );
+  maxIndex.Fill( NumericTraits<IndexValueType>::NonpositiveMin() );
+
+  bool isEmpty = true;
+
+  ImageRegionConstIteratorWithIndex<InputImageType> It( segmentationImage, fullRegion );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    const LabelType label = It.Get();
+    if( label == this->m_GrayMatterLabel || label == this->m_WhiteMatterLabel )
+      {
+      const IndexType & index = It.GetIndex();
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        minIndex[d] = std::min( minIndex[d], index[d] );
+        maxIndex[d] = std::max( maxIndex[d], index[d] );
+        }
+      isEmpty = false;
+      }
+    }
+  if( isEmpty )
+    {
+    return fullRegion;
+    }
+
+  const IndexValueType padding = static_cast<IndexValueType>( this->m_BoundingRegionPadding );
+
+  RegionType boundingRegion;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    boundingRegion.SetIndex( d, minIndex[d] - padding );
+    boundingRegion.SetSize( d, static_cast<SizeValueType>( maxIndex[d] - minIndex[d] + 1 + 2 * padding ) );
+    }
+  boundingRegion.Crop( fullRegion );
+
+  return boundingRegion;
+}
+
+template <class TInputImage, class TOutputImage>
+template <class TImage>
+typename TImage::Pointer
+DiReCTImageFilter<TInputImage, TOutputImage>
+::CropImage( const TImage *inputImage, const RegionType & region ) const
+{
+  typename TImage::Pointer croppedImage = TImage::New();
+  croppedImage->SetOrigin( inputImage->GetOrigin() );
+  croppedImage->SetSpacing( inputImage->GetSpacing() );
+  croppedImage->SetDirection( inputImage->GetDirection() );
+  croppedImage->SetRegions( region );
+  croppedImage->Allocate();
+
+  ImageRegionConstIterator<TImage> ItI( inputImage, region );
+  ImageRegionIterator<TImage>      ItC( croppedImage, region );
+  for( ItI.GoToBegin(), ItC.GoToBegin(); !ItI.IsAtEnd(); ++ItI, ++ItC )
+    {
+    ItC.Set( ItI.Get() );
+    }
+
+  return croppedImage;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DiReCTImageFilter<TInputImage, TOutputImage>
+::PasteImage( const RealImageType *croppedImage, RealImageType *fullImage ) const
+{
+  const RegionType & region = croppedImage->GetBufferedRegion();
+
+  ImageRegionConstIterator<RealImageType> ItC( croppedImage, region );
+  ImageRegionIterator<RealImageType>      ItF( fullImage, region );
+  for( ItC.GoToBegin(), ItF.GoToBegin(); !ItC.IsAtEnd(); ++ItC, ++ItF )
+    {
+    ItF.Set( ItC.Get() );
+    }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -790,28 +1025,9 @@ DiReCTImageFilter<TInputImage, TOutputImage>
   duplicator->Update();
   DisplacementFieldPointer outputField = duplicator->GetModifiableOutput();
 
-  typedef VectorNeighborhoodOperatorImageFilter<DisplacementFieldType,
-                                                DisplacementFieldType> SmootherType;
-  typename SmootherType::Pointer smoother = SmootherType::New();
-
-  typedef GaussianOperator<VectorValueType, ImageDimension> GaussianType;
-  GaussianType gaussian;
-  gaussian.SetVariance( variance );
-  gaussian.SetMaximumError( 0.001 );
-  for( unsigned int d = 0; d < ImageDimension; d++ )
-    {
-    gaussian.SetDirection( d );
-    gaussian.SetMaximumKernelWidth(
-      outputField->GetRequestedRegion().GetSize()[d] );
-    gaussian.CreateDirectional();
-
-    smoother->SetOperator( gaussian );
-    smoother->SetInput( outputField );
-
-    outputField = smoother->GetOutput();
-    outputField->Update();
-    outputField->DisconnectPipeline();
-    }
+  FixedArray<double, ImageDimension> varianceArray;
+  varianceArray.Fill( variance );
+  ::ants::SeparableGaussianSmoothing::Smooth<DisplacementFieldType>( outputField, varianceArray, 0.001 );
 
   // Ensure zero motion on the boundary
 
@@ -960,6 +1176,13 @@ DiReCTImageFilter<TInputImage, TOutputImage>
                    << this->m_ConvergenceThreshold << std::endl;
   os << indent << "Convergence window size = "
                    << this->m_ConvergenceWindowSize << std::endl;
+  if( this->m_RestrictToBoundingRegion )
+    {
+    os << indent << "Bounding region padding = "
+                   << this->m_BoundingRegionPadding << std::endl;
+    }
+  os << indent << "Reuse working images = "
+                 << this->m_ReuseWorkingImages << std::endl;
 }
 } // end namespace itk
 
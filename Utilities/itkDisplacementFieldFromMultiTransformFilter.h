@@ -2,6 +2,10 @@
 #define ITKDEFORMATIONFIELDFROMMULTITRANSFORMFILTER_H_
 
 #include "itkWarpImageMultiTransformFilter.h"
+#include "itkContinuousIndex.h"
+#include "itkMath.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -62,9 +66,95 @@ public:
     Superclass::GenerateInputRequestedRegion();
   }
 
+  /** Compile the transform list into the chain of operations evaluated by
+   * the threads: each run of affine transforms becomes a single matrix and
+   * offset, and each deformation field is read straight from its buffer. */
   virtual void BeforeThreadedGenerateData() ITK_OVERRIDE
   {
-  };
+    this->m_Chain.clear();
+
+    typename Superclass::TransformListType & transformList = this->GetTransformList();
+    for( typename Superclass::TransformListType::iterator it = transformList.begin();
+         it != transformList.end(); ++it )
+      {
+      if( it->first == Superclass::EnumAffineType )
+        {
+        const typename TransformType::MatrixType & matrix = it->second.aex.aff->GetMatrix();
+        const typename TransformType::OutputVectorType & offset = it->second.aex.aff->GetOffset();
+
+        if( !this->m_Chain.empty() && this->m_Chain.back().IsAffine )
+          {
+          // fold into the previous affine: the points go through it first
+          ChainOperationType & previous = this->m_Chain.back();
+          double               composedMatrix[ImageDimension][ImageDimension];
+          double               composedOffset[ImageDimension];
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            composedOffset[i] = offset[i];
+            for( unsigned int j = 0; j < ImageDimension; j++ )
+              {
+              composedMatrix[i][j] = 0.0;
+              for( unsigned int k = 0; k < ImageDimension; k++ )
+                {
+                composedMatrix[i][j] += matrix[i][k] * previous.Matrix[k][j];
+                }
+              composedOffset[i] += matrix[i][j] * previous.Offset[j];
+              }
+            }
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            previous.Offset[i] = composedOffset[i];
+            for( unsigned int j = 0; j < ImageDimension; j++ )
+              {
+              previous.Matrix[i][j] = composedMatrix[i][j];
+              }
+            }
+          continue;
+          }
+
+        ChainOperationType operation;
+        operation.IsAffine = true;
+        operation.Field = ITK_NULLPTR;
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          operation.Offset[i] = offset[i];
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            operation.Matrix[i][j] = matrix[i][j];
+            }
+          }
+        this->m_Chain.push_back( operation );
+        }
+      else
+        {
+        const DisplacementFieldType *field = it->second.dex.field.GetPointer();
+
+        ChainOperationType operation;
+        operation.IsAffine = false;
+        operation.Field = field;
+        operation.Buffer = field->GetBufferPointer();
+        operation.LargestRegion = field->GetLargestPossibleRegion();
+
+        // the physical point to index matrix, inverse( direction * spacing )
+        const typename DisplacementFieldType::DirectionType::InternalMatrixType inverseDirection =
+          field->GetDirection().GetInverse();
+        const typename DisplacementFieldType::RegionType & bufferedRegion = field->GetBufferedRegion();
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          operation.Offset[i] = field->GetOrigin()[i];
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            operation.Matrix[i][j] = inverseDirection[i][j] / field->GetSpacing()[i];
+            }
+          operation.StartIndex[i] = bufferedRegion.GetIndex()[i];
+          operation.EndIndex[i] =
+            bufferedRegion.GetIndex()[i] + static_cast<IndexValueType>( bufferedRegion.GetSize()[i] ) - 1;
+          operation.Stride[i] = field->GetOffsetTable()[i];
+          }
+        this->m_Chain.push_back( operation );
+        }
+      }
+  }
 
   virtual void AfterThreadedGenerateData() ITK_OVERRIDE
   {
@@ -91,9 +181,10 @@ protected:
     Superclass::PrintSelf(os, indent);
   };
 
-  /** WarpImageMultiTransformFilter is implemented as a multi-threaded filter.
-   * As such, it needs to provide and implementation for
-   * ThreadedGenerateData(). */
+  /** The chain is evaluated along each scanline of the region: the output
+   * point steps by the first column of the index to physical point matrix,
+   * and the fields are linearly interpolated as by
+   * VectorLinearInterpolateImageFunction. */
   void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                             ThreadIdType threadId ) ITK_OVERRIDE
   {
@@ -102,46 +193,221 @@ protected:
     // support progress methods/callbacks
     ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() );
 
-    // iterator for the output image
-    ImageRegionIteratorWithIndex<OutputImageType> outputIt(outputPtr, outputRegionForThread);
+    const DisplacementScalarValueType kMaxDisp = itk::NumericTraits<DisplacementScalarValueType>::max();
+    const unsigned int                numberOfOperations = this->m_Chain.size();
 
-//        int cnt = 0;
-    while( !outputIt.IsAtEnd() )
+    // the physical step of one voxel along the scanline
+    IndexType origin;
+    origin.Fill( 0 );
+    IndexType next = origin;
+    next[0] = 1;
+    PointType originPoint, nextPoint;
+    outputPtr->TransformIndexToPhysicalPoint( origin, originPoint );
+    outputPtr->TransformIndexToPhysicalPoint( next, nextPoint );
+    double step[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
       {
-      PointType point1, point2;
+      step[d] = nextPoint[d] - originPoint[d];
+      }
 
-      // get the output image index
-      IndexType index = outputIt.GetIndex();
-      outputPtr->TransformIndexToPhysicalPoint( index, point1 );
+    const SizeType & regionSize = outputRegionForThread.GetSize();
+    if( outputRegionForThread.GetNumberOfPixels() == 0 )
+      {
+      return;
+      }
+
+    IndexType lineIndex = outputRegionForThread.GetIndex();
+    bool      done = false;
+    while( !done )
+      {
+      PointType lineStart;
+      outputPtr->TransformIndexToPhysicalPoint( lineIndex, lineStart );
 
-      const bool isinside = this->MultiTransformPoint(point1, point2, Superclass::m_bFirstDeformNoInterp, index);
+      PixelType *out = outputPtr->GetBufferPointer() + outputPtr->ComputeOffset( lineIndex );
+      OffsetValueType firstFieldOffset = 0;
+      if( Superclass::m_bFirstDeformNoInterp && numberOfOperations > 0 && !this->m_Chain[0].IsAffine )
+        {
+        firstFieldOffset = this->m_Chain[0].Field->ComputeOffset( lineIndex );
+        }
 
-      if( isinside )
+      for( SizeValueType i = 0; i < regionSize[0]; i++ )
         {
-        PixelType value;
-        for( unsigned int ii = 0; ii < OutputImageType::ImageDimension; ii++ )
+        double point1[ImageDimension];
+        double point2[ImageDimension];
+        for( unsigned int d = 0; d < ImageDimension; d++ )
           {
-          value[ii] = point2[ii] - point1[ii];
+          point1[d] = lineStart[d] + i * step[d];
+          point2[d] = point1[d];
           }
 
-        outputIt.Set( value );
-        }
-      else
-        {
-        PixelType                         value;
-        const DisplacementScalarValueType kMaxDisp = itk::NumericTraits<DisplacementScalarValueType>::max();
-        for( unsigned int ii = 0; ii < OutputImageType::ImageDimension; ii++ )
+        bool isinside = false;
+        for( unsigned int n = 0; n < numberOfOperations; n++ )
           {
-          value[ii] = kMaxDisp;
+          const ChainOperationType & operation = this->m_Chain[n];
+          double                     point[ImageDimension];
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            point[d] = point2[d];
+            }
+          if( operation.IsAffine )
+            {
+            for( unsigned int r = 0; r < ImageDimension; r++ )
+              {
+              double value = operation.Offset[r];
+              for( unsigned int c = 0; c < ImageDimension; c++ )
+                {
+                value += operation.Matrix[r][c] * point[c];
+                }
+              point2[r] = value;
+              }
+            isinside = true;
+            }
+          else if( n == 0 && Superclass::m_bFirstDeformNoInterp )
+            {
+            // use discrete coordinates
+            const DisplacementType & displacement = operation.Buffer[firstFieldOffset + i];
+            for( unsigned int d = 0; d < ImageDimension; d++ )
+              {
+              point2[d] = point[d] + displacement[d];
+              }
+            isinside = true;
+            }
+          else
+            {
+            isinside = this->InterpolateField( operation, point, point2 );
+            }
+
+          bool outOfBoundary = false;
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            if( point2[d] >= kMaxDisp )
+              {
+              outOfBoundary = true;
+              }
+            }
+          if( outOfBoundary )
+            {
+            isinside = false;
+            break;
+            }
+          }
+
+        PixelType & value = out[i];
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          value[d] = isinside ? static_cast<DisplacementScalarValueType>( point2[d] - point1[d] ) : kMaxDisp;
           }
-        outputIt.Set( value );
         }
 
-      ++outputIt;
+      // next scanline of the region
+      unsigned int d = 1;
+      while( d < ImageDimension
+             && ++lineIndex[d] >= outputRegionForThread.GetIndex()[d] + static_cast<IndexValueType>( regionSize[d] ) )
+        {
+        lineIndex[d] = outputRegionForThread.GetIndex()[d];
+        d++;
+        }
+      done = ( d >= ImageDimension );
       }
 
     progress.CompletedPixel();
   };
+
+private:
+  typedef typename IndexType::IndexValueType IndexValueType;
+  typedef typename SizeType::SizeValueType   SizeValueType;
+
+  /** One step of the compiled transform chain.  For an affine step the
+   * matrix and offset map the point; for a field step they map the physical
+   * point to its continuous index ( Matrix * ( point - Offset ) ). */
+  struct ChainOperationType
+    {
+    bool                               IsAffine;
+    double                             Matrix[ImageDimension][ImageDimension];
+    double                             Offset[ImageDimension];
+    const DisplacementFieldType *      Field;
+    const DisplacementType *           Buffer;
+    typename DisplacementFieldType::RegionType LargestRegion;
+    IndexValueType                     StartIndex[ImageDimension];
+    IndexValueType                     EndIndex[ImageDimension];
+    OffsetValueType                    Stride[ImageDimension];
+    };
+
+  /** point2 = point + the displacement of the field at point, or point if
+   * point is outside of the field. */
+  static bool InterpolateField( const ChainOperationType & operation, const double *point, double *point2 )
+  {
+    ContinuousIndex<double, ImageDimension> cindex;
+    for( unsigned int r = 0; r < ImageDimension; r++ )
+      {
+      double value = 0.0;
+      for( unsigned int c = 0; c < ImageDimension; c++ )
+        {
+        value += operation.Matrix[r][c] * ( point[c] - operation.Offset[c] );
+        }
+      cindex[r] = value;
+      }
+
+    if( !operation.LargestRegion.IsInside( cindex ) )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        point2[d] = point[d];
+        }
+      return false;
+      }
+
+    IndexValueType baseIndex[ImageDimension];
+    double         distance[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      baseIndex[d] = Math::Floor<IndexValueType>( cindex[d] );
+      distance[d] = cindex[d] - static_cast<double>( baseIndex[d] );
+      }
+
+    double displacement[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      displacement[d] = 0.0;
+      }
+    for( unsigned int counter = 0; counter < ( 1u << ImageDimension ); counter++ )
+      {
+      double          overlap = 1.0;
+      OffsetValueType offset = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        IndexValueType neighbor;
+        if( counter & ( 1u << d ) )
+          {
+          neighbor = vnl_math_min( baseIndex[d] + 1, operation.EndIndex[d] );
+          overlap *= distance[d];
+          }
+        else
+          {
+          neighbor = vnl_math_max( baseIndex[d], operation.StartIndex[d] );
+          overlap *= 1.0 - distance[d];
+          }
+        offset += ( neighbor - operation.StartIndex[d] ) * operation.Stride[d];
+        }
+      if( overlap == 0.0 )
+        {
+        continue;
+        }
+      const DisplacementType & value = operation.Buffer[offset];
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        displacement[d] += overlap * static_cast<double>( value[d] );
+        }
+      }
+
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      point2[d] = point[d] + displacement[d];
+      }
+    return true;
+  }
+
+  std::vector<ChainOperationType> m_Chain;
 };
 } // end namespace itk
 #endif /*ITKDEFORMATIONFIELDFROMMULTITRANSFORMFILTER_H_*/
@@ -0,0 +1,89 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkFastLabelImageGaussianInterpolateImageFunction_h
+#define __itkFastLabelImageGaussianInterpolateImageFunction_h
+
+#include "itkLabelImageGaussianInterpolateImageFunction.h"
+
+#include <functional>
+
+namespace itk
+{
+/** \class FastLabelImageGaussianInterpolateImageFunction
+ *
+ * LabelImageGaussianInterpolateImageFunction evaluated without a map of the
+ * labels.  The weight of a neighbor is the product of the separable error
+ * function weights of its coordinates, which are computed once per
+ * evaluation.  The neighborhood is traversed row by row along the first
+ * dimension over the image buffer: rows whose weight vanishes are skipped,
+ * and the labels found are accumulated in a short list which remembers the
+ * label of the previous neighbor, as neighbors mostly share their label.
+ * The label with the largest total weight is returned, as with the ITK
+ * interpolator.
+ */
+template <typename TInputImage, typename TCoordRep = double,
+          typename TPixelCompare = std::less<typename itk::NumericTraits<typename TInputImage::PixelType>::RealType> >
+class FastLabelImageGaussianInterpolateImageFunction :
+  public LabelImageGaussianInterpolateImageFunction<TInputImage, TCoordRep, TPixelCompare>
+{
+public:
+  /** Standard class typedefs. */
+  typedef FastLabelImageGaussianInterpolateImageFunction                                  Self;
+  typedef LabelImageGaussianInterpolateImageFunction<TInputImage, TCoordRep, TPixelCompare> Superclass;
+  typedef SmartPointer<Self>                                                              Pointer;
+  typedef SmartPointer<const Self>                                                        ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( FastLabelImageGaussianInterpolateImageFunction, LabelImageGaussianInterpolateImageFunction );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TInputImage::ImageDimension );
+
+  typedef TInputImage                              InputImageType;
+  typedef typename InputImageType::PixelType       InputPixelType;
+  typedef ImageRegion<ImageDimension>              RegionType;
+  typedef typename Superclass::RealType            RealType;
+  typedef typename Superclass::OutputType          OutputType;
+  typedef typename Superclass::ContinuousIndexType ContinuousIndexType;
+
+  virtual OutputType EvaluateAtContinuousIndex( const ContinuousIndexType & cindex ) const ITK_OVERRIDE
+  {
+    return this->EvaluateAtContinuousIndex( cindex, ITK_NULLPTR );
+  }
+
+protected:
+  FastLabelImageGaussianInterpolateImageFunction()
+  {
+  }
+
+  virtual ~FastLabelImageGaussianInterpolateImageFunction()
+  {
+  }
+
+  virtual OutputType EvaluateAtContinuousIndex( const ContinuousIndexType & cindex,
+                                                OutputType * grad ) const ITK_OVERRIDE;
+
+private:
+  FastLabelImageGaussianInterpolateImageFunction( const Self & ); // purposely not implemented
+  void operator=( const Self & );                                   // purposely not implemented
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkFastLabelImageGaussianInterpolateImageFunction.hxx"
+#endif
+
+#endif
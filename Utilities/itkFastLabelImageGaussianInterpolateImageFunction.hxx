@@ -0,0 +1,115 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkFastLabelImageGaussianInterpolateImageFunction_hxx
+#define __itkFastLabelImageGaussianInterpolateImageFunction_hxx
+
+#include "itkFastLabelImageGaussianInterpolateImageFunction.h"
+
+#include <vector>
+
+namespace itk
+{
+template <typename TInputImage, typename TCoordRep, typename TPixelCompare>
+typename FastLabelImageGaussianInterpolateImageFunction<TInputImage, TCoordRep, TPixelCompare>::OutputType
+FastLabelImageGaussianInterpolateImageFunction<TInputImage, TCoordRep, TPixelCompare>
+::EvaluateAtContinuousIndex( const ContinuousIndexType & cindex, OutputType * itkNotUsed( grad ) ) const
+{
+  const RegionType region = this->ComputeInterpolationRegion( cindex );
+
+  // The separable weights of the coordinates of the neighbors
+  vnl_vector<RealType> erfArray[ImageDimension];
+  vnl_matrix<RealType> gerfArray[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    this->ComputeErrorFunctionArray( region, d, cindex[d], erfArray[d], gerfArray[d], false );
+    }
+
+  const InputImageType * image = this->GetInputImage();
+  const InputPixelType * buffer = image->GetBufferPointer();
+
+  const typename RegionType::SizeType & size = region.GetSize();
+  const SizeValueType                   rowLength = size[0];
+  const RealType *                      rowWeights = erfArray[0].data_block();
+
+  SizeValueType numberOfRows = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    numberOfRows *= size[d];
+    }
+
+  TPixelCompare         compare;
+  std::vector<OutputType> labels;
+  std::vector<RealType>   weights;
+  labels.reserve( 8 );
+  weights.reserve( 8 );
+  unsigned int current = 0;
+
+  for( SizeValueType r = 0; r < numberOfRows; r++ )
+    {
+    typename RegionType::IndexType index = region.GetIndex();
+    RealType                       rowWeight = 1.0;
+    SizeValueType                  rowNumber = r;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      const SizeValueType j = rowNumber % size[d];
+      rowNumber /= size[d];
+      index[d] += static_cast<IndexValueType>( j );
+      rowWeight *= erfArray[d][j];
+      }
+    if( rowWeight <= 0.0 )
+      {
+      continue;
+      }
+
+    const InputPixelType *row = buffer + image->ComputeOffset( index );
+    for( SizeValueType j = 0; j < rowLength; j++ )
+      {
+      const RealType w = rowWeight * rowWeights[j];
+      if( w <= 0.0 )
+        {
+        continue;
+        }
+      const OutputType V = static_cast<OutputType>( row[j] );
+      if( labels.empty() || compare( labels[current], V ) || compare( V, labels[current] ) )
+        {
+        current = 0;
+        while( current < labels.size() && ( compare( labels[current], V ) || compare( V, labels[current] ) ) )
+          {
+          current++;
+          }
+        if( current == labels.size() )
+          {
+          labels.push_back( V );
+          weights.push_back( 0.0 );
+          }
+        }
+      weights[current] += w;
+      }
+    }
+
+  RealType   wmax = 0.0;
+  OutputType Vmax = NumericTraits<OutputType>::ZeroValue();
+  for( unsigned int l = 0; l < labels.size(); l++ )
+    {
+    if( weights[l] > wmax )
+      {
+      wmax = weights[l];
+      Vmax = labels[l];
+      }
+    }
+  return Vmax;
+}
+} // end namespace itk
+
+#endif
@@ -17,10 +17,24 @@
 #include "itkImageToImageFilter.h"
 
 #include "itkBSplineScatteredDataPointSetToImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkPointSet.h"
 
+#include <vector>
+
 namespace itk
 {
+/** \class GeneralToBSplineDisplacementFieldFilter
+ * \brief B-spline approximation of a dense displacement field.
+ *
+ * The fit is the multilevel B-spline approximation of
+ * BSplineScatteredDataPointSetToImageFilter with every voxel of the
+ * requested region as a data point, except those equal to the ignore value.
+ * Because the points lie on the voxel grid, the B-spline weights of a point
+ * are a product of per-axis weights, so the lattice of each level is
+ * computed by projecting the residual field one axis at a time and the
+ * lattice is evaluated back on the grid the same way.
+ */
 template <class TInputImage, class TOutputImage = TInputImage>
 class GeneralToBSplineDisplacementFieldFilter :
   public ImageToImageFilter<TInputImage, TOutputImage>
@@ -85,6 +99,44 @@ protected:
   void GenerateData() ITK_OVERRIDE;
 
 private:
+  /** The B-spline weights of the grid points along one axis of a level:
+   * the first control point of each grid point, its order + 1 weights and
+   * the weights B^3 / sum( B^2 ) of the lattice fit. */
+  struct AxisWeightsType
+    {
+    std::vector<SizeValueType> Span;
+    std::vector<double>        Weight;
+    std::vector<double>        FitWeight;
+    };
+
+  /** One pass along an axis of a buffer of interleaved channels.  Project
+   * maps InputLength grid points onto OutputLength control points, with the
+   * last channel being the weight of the points; Evaluate maps control
+   * points back onto the grid. */
+  struct LatticeThreadStruct
+    {
+    typedef enum { Project = 0, Evaluate } PassType;
+
+    PassType               Pass;
+    const double *         Input;
+    double *               Output;
+    unsigned int           NumberOfChannels;
+    unsigned int           NumberOfWeights;
+    SizeValueType          LowerCount;
+    SizeValueType          UpperCount;
+    SizeValueType          InputLength;
+    SizeValueType          OutputLength;
+    const AxisWeightsType *Weights;
+    ThreadIdType           NumberOfThreads;
+    };
+
+  void ComputeAxisWeights( SizeValueType numberOfPoints, SizeValueType numberOfControlPoints,
+                           AxisWeightsType & weights ) const;
+
+  void RunLatticePass( LatticeThreadStruct & str );
+
+  static ITK_THREAD_RETURN_TYPE LatticeThreaderCallback( void *arg );
+
 //   typename RealImageType::Pointer              m_ConfidenceImage;
 
   InputPixelType m_IgnorePixelValue;
@@ -3,8 +3,9 @@
 
 #include "itkGeneralToBSplineDisplacementFieldFilter.h"
 
-#include "itkBSplineControlPointImageFilter.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkCoxDeBoorBSplineKernelFunction.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 
 namespace itk
 {
@@ -14,6 +15,7 @@ GeneralToBSplineDisplacementFieldFilter<TInputImage, TOutputImage>
 {
   this->m_IgnorePixelValue.Fill(
     NumericTraits<InputPixelComponentType>::max() );
+  this->m_NumberOfLevels = 1;
   this->m_SplineOrder = 3;
   this->m_NumberOfControlPoints.Fill( this->m_SplineOrder + 1 );
 
@@ -31,66 +33,299 @@ void
 GeneralToBSplineDisplacementFieldFilter<TInputImage, TOutputImage>
 ::GenerateData()
 {
-  typename PointSetType::Pointer fieldPoints = PointSetType::New();
-  fieldPoints->Initialize();
+  const InputImageType *input = this->GetInput();
 
-//  typename BSplineFilterType::WeightsContainerType confidenceValues;
-//  confidenceValues->Initialize();
+  const typename InputImageType::RegionType region = input->GetRequestedRegion();
+  const unsigned int                        numberOfComponents = InputPixelType::Dimension;
+  const SizeValueType                       numberOfPixels = region.GetNumberOfPixels();
 
-  ImageRegionConstIteratorWithIndex<InputImageType>
-  It( this->GetInput(), this->GetInput()->GetRequestedRegion() );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( this->m_NumberOfControlPoints[d] <= this->m_SplineOrder )
+      {
+      itkExceptionMacro( "The number of control points must be greater than the spline order." );
+      }
+    }
 
   itkDebugMacro( << "Extracting points from input deformation field. " )
 
-  unsigned int N = 0;
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-    {
-    InputPixelType data = It.Get();
+  // the field and the fit on the grid, components interleaved
+  std::vector<double>        data( numberOfPixels * numberOfComponents );
+  std::vector<unsigned char> isPoint( numberOfPixels );
+  std::vector<double>        fit( numberOfPixels * numberOfComponents, 0.0 );
 
-    if( data != this->m_IgnorePixelValue )
+  ImageRegionConstIterator<InputImageType> It( input, region );
+  SizeValueType                            n = 0;
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It, n++ )
+    {
+    const InputPixelType & value = It.Get();
+    isPoint[n] = ( value != this->m_IgnorePixelValue );
+    for( unsigned int c = 0; c < numberOfComponents; c++ )
       {
-      typename PointSetType::PointType point;
-      this->GetInput()->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-
-      fieldPoints->SetPointData( N, data );
-      fieldPoints->SetPoint( N, point );
-
-//      if ( this->m_ConfidenceImage )
-//        {
-//        confidenceValues->InsertElement
-//          ( N, this->m_ConfidenceImage->GetPixel( It.GetIndex() ) );
-//        }
-      N++;
+      data[n * numberOfComponents + c] = value[c];
       }
     }
 
   itkDebugMacro( "Calculating the B-spline deformation field. " );
 
-  typename OutputImageType::PointType origin;
-  typename OutputImageType::SpacingType spacing;
-  typename OutputImageType::SizeType size;
-  for( unsigned int i = 0; i < ImageDimension; i++ )
+  for( unsigned int level = 0; level < this->m_NumberOfLevels; level++ )
     {
-    origin[i] = this->GetInput( 0 )->GetOrigin()[i];
-    spacing[i] = this->GetInput( 0 )->GetSpacing()[i];
-    size[i] = this->GetInput( 0 )->GetRequestedRegion().GetSize()[i];
+    SizeValueType   controlPoints[ImageDimension];
+    AxisWeightsType weights[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      controlPoints[d] = ( static_cast<SizeValueType>( this->m_NumberOfControlPoints[d] ) - this->m_SplineOrder )
+        * ( static_cast<SizeValueType>( 1 ) << level ) + this->m_SplineOrder;
+      this->ComputeAxisWeights( region.GetSize()[d], controlPoints[d], weights[d] );
+      }
+
+    // the residual of the points, with their weight as the last channel
+    std::vector<double> buffer( numberOfPixels * ( numberOfComponents + 1 ) );
+    for( SizeValueType v = 0; v < numberOfPixels; v++ )
+      {
+      double *residual = &buffer[v * ( numberOfComponents + 1 )];
+      for( unsigned int c = 0; c < numberOfComponents; c++ )
+        {
+        residual[c] = isPoint[v] ? data[v * numberOfComponents + c] - fit[v * numberOfComponents + c] : 0.0;
+        }
+      residual[numberOfComponents] = isPoint[v] ? 1.0 : 0.0;
+      }
+
+    LatticeThreadStruct str;
+    str.NumberOfChannels = numberOfComponents + 1;
+    str.NumberOfWeights = this->m_SplineOrder + 1;
+
+    // project the residual onto the lattice, one axis at a time
+    SizeValueType currentSize[ImageDimension];
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      currentSize[d] = region.GetSize()[d];
+      }
+    str.Pass = LatticeThreadStruct::Project;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.LowerCount = 1;
+      str.UpperCount = 1;
+      for( unsigned int e = 0; e < ImageDimension; e++ )
+        {
+        if( e < d )
+          {
+          str.LowerCount *= currentSize[e];
+          }
+        else if( e > d )
+          {
+          str.UpperCount *= currentSize[e];
+          }
+        }
+      str.InputLength = currentSize[d];
+      str.OutputLength = controlPoints[d];
+      str.Weights = &weights[d];
+
+      std::vector<double> projection( str.LowerCount * str.OutputLength * str.UpperCount * str.NumberOfChannels,
+                                      0.0 );
+      str.Input = &buffer[0];
+      str.Output = &projection[0];
+      this->RunLatticePass( str );
+      buffer.swap( projection );
+      currentSize[d] = controlPoints[d];
+      }
+
+    // the lattice is the weighted average of the contributions of the points
+    const SizeValueType numberOfLatticePoints = buffer.size() / ( numberOfComponents + 1 );
+    std::vector<double> lattice( numberOfLatticePoints * numberOfComponents, 0.0 );
+    for( SizeValueType v = 0; v < numberOfLatticePoints; v++ )
+      {
+      const double *delta = &buffer[v * ( numberOfComponents + 1 )];
+      if( delta[numberOfComponents] != 0.0 )
+        {
+        for( unsigned int c = 0; c < numberOfComponents; c++ )
+          {
+          lattice[v * numberOfComponents + c] = delta[c] / delta[numberOfComponents];
+          }
+        }
+      }
+
+    // evaluate the lattice on the grid and add it to the fit
+    str.Pass = LatticeThreadStruct::Evaluate;
+    str.NumberOfChannels = numberOfComponents;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      str.LowerCount = 1;
+      str.UpperCount = 1;
+      for( unsigned int e = 0; e < ImageDimension; e++ )
+        {
+        if( e < d )
+          {
+          str.LowerCount *= currentSize[e];
+          }
+        else if( e > d )
+          {
+          str.UpperCount *= currentSize[e];
+          }
+        }
+      str.InputLength = controlPoints[d];
+      str.OutputLength = region.GetSize()[d];
+      str.Weights = &weights[d];
+
+      std::vector<double> evaluation( str.LowerCount * str.OutputLength * str.UpperCount * str.NumberOfChannels );
+      str.Input = &lattice[0];
+      str.Output = &evaluation[0];
+      this->RunLatticePass( str );
+      lattice.swap( evaluation );
+      currentSize[d] = region.GetSize()[d];
+      }
+    for( SizeValueType v = 0; v < fit.size(); v++ )
+      {
+      fit[v] += lattice[v];
+      }
     }
 
-  typename BSplineFilterType::ArrayType close;
-  close.Fill( false );
-
-  typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
-  bspliner->SetOrigin( origin );
-  bspliner->SetSpacing( spacing );
-  bspliner->SetSize( size );
-  bspliner->SetNumberOfLevels( this->m_NumberOfLevels );
-  bspliner->SetSplineOrder( this->m_SplineOrder );
-  bspliner->SetNumberOfControlPoints( this->m_NumberOfControlPoints );
-  bspliner->SetCloseDimension( close );
-  bspliner->SetInput( fieldPoints );
-  bspliner->SetGenerateOutputImage( true );
-  bspliner->Update();
-  this->SetNthOutput( 0, bspliner->GetOutput() );
+  typename OutputImageType::RegionType outputRegion;
+  outputRegion.SetSize( region.GetSize() );
+
+  typename OutputImageType::Pointer output = OutputImageType::New();
+  output->SetOrigin( input->GetOrigin() );
+  output->SetSpacing( input->GetSpacing() );
+  output->SetDirection( input->GetDirection() );
+  output->SetRegions( outputRegion );
+  output->Allocate();
+
+  ImageRegionIterator<OutputImageType> ItO( output, outputRegion );
+  n = 0;
+  for( ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItO, n++ )
+    {
+    OutputPixelType value;
+    for( unsigned int c = 0; c < numberOfComponents; c++ )
+      {
+      value[c] = static_cast<typename OutputPixelType::ValueType>( fit[n * numberOfComponents + c] );
+      }
+    ItO.Set( value );
+    }
+  this->SetNthOutput( 0, output );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+GeneralToBSplineDisplacementFieldFilter<TInputImage, TOutputImage>
+::ComputeAxisWeights( SizeValueType numberOfPoints, SizeValueType numberOfControlPoints,
+                      AxisWeightsType & weights ) const
+{
+  typedef CoxDeBoorBSplineKernelFunction<3> KernelType;
+  typename KernelType::Pointer kernel = KernelType::New();
+  kernel->SetSplineOrder( this->m_SplineOrder );
+
+  const unsigned int  numberOfWeights = this->m_SplineOrder + 1;
+  const SizeValueType numberOfSpans = numberOfControlPoints - this->m_SplineOrder;
+
+  weights.Span.resize( numberOfPoints );
+  weights.Weight.resize( numberOfPoints * numberOfWeights );
+  weights.FitWeight.resize( numberOfPoints * numberOfWeights );
+  for( SizeValueType i = 0; i < numberOfPoints; i++ )
+    {
+    // the parametric coordinate of the point, the last point closing the last span
+    const double u = ( numberOfPoints > 1 ) ?
+      static_cast<double>( i ) / static_cast<double>( numberOfPoints - 1 ) * numberOfSpans : 0.0;
+    const SizeValueType span = vnl_math_min( static_cast<SizeValueType>( u ), numberOfSpans - 1 );
+    weights.Span[i] = span;
+
+    double *B = &weights.Weight[i * numberOfWeights];
+    double  sumOfSquares = 0.0;
+    for( unsigned int k = 0; k < numberOfWeights; k++ )
+      {
+      B[k] = kernel->Evaluate( u - static_cast<double>( span + k ) + 0.5 * ( this->m_SplineOrder - 1.0 ) );
+      sumOfSquares += B[k] * B[k];
+      }
+    for( unsigned int k = 0; k < numberOfWeights; k++ )
+      {
+      weights.FitWeight[i * numberOfWeights + k] = B[k] * B[k] * B[k] / sumOfSquares;
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+GeneralToBSplineDisplacementFieldFilter<TInputImage, TOutputImage>
+::RunLatticePass( LatticeThreadStruct & str )
+{
+  const SizeValueType numberOfLines = str.LowerCount * str.UpperCount;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( vnl_math_max( vnl_math_min( static_cast<SizeValueType>( this->GetNumberOfThreads() ),
+                                                            numberOfLines ), static_cast<SizeValueType>( 1 ) ) );
+  str.NumberOfThreads = threader->GetNumberOfThreads();
+  threader->SetSingleMethod( LatticeThreaderCallback, &str );
+  threader->SingleMethodExecute();
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+GeneralToBSplineDisplacementFieldFilter<TInputImage, TOutputImage>
+::LatticeThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const LatticeThreadStruct *      str = static_cast<LatticeThreadStruct *>( info->UserData );
+
+  const SizeValueType numberOfLines = str->LowerCount * str->UpperCount;
+  const SizeValueType firstLine = numberOfLines * info->ThreadID / str->NumberOfThreads;
+  const SizeValueType endLine = numberOfLines * ( info->ThreadID + 1 ) / str->NumberOfThreads;
+
+  const unsigned int  channels = str->NumberOfChannels;
+  const unsigned int  numberOfWeights = str->NumberOfWeights;
+  const SizeValueType stride = str->LowerCount * channels;
+  const bool          isProjection = ( str->Pass == LatticeThreadStruct::Project );
+  for( SizeValueType line = firstLine; line < endLine; line++ )
+    {
+    const SizeValueType lower = line % str->LowerCount;
+    const SizeValueType upper = line / str->LowerCount;
+    const double *      input = str->Input + ( lower + upper * str->LowerCount * str->InputLength ) * channels;
+    double *            output = str->Output + ( lower + upper * str->LowerCount * str->OutputLength ) * channels;
+
+    if( isProjection )
+      {
+      // the point channels take B^3 / sum( B^2 ), the weight channel B^2
+      for( SizeValueType i = 0; i < str->InputLength; i++ )
+        {
+        const double *point = input + i * stride;
+        const double *B = &str->Weights->Weight[i * numberOfWeights];
+        const double *F = &str->Weights->FitWeight[i * numberOfWeights];
+        const double  w = point[channels - 1];
+        if( w == 0.0 )
+          {
+          continue;
+          }
+        double *control = output + str->Weights->Span[i] * stride;
+        for( unsigned int k = 0; k < numberOfWeights; k++, control += stride )
+          {
+          for( unsigned int c = 0; c + 1 < channels; c++ )
+            {
+            control[c] += F[k] * point[c];
+            }
+          control[channels - 1] += B[k] * B[k] * w;
+          }
+        }
+      }
+    else
+      {
+      for( SizeValueType i = 0; i < str->OutputLength; i++ )
+        {
+        const double *B = &str->Weights->Weight[i * numberOfWeights];
+        const double *control = input + str->Weights->Span[i] * stride;
+        double *      point = output + i * stride;
+        for( unsigned int c = 0; c < channels; c++ )
+          {
+          point[c] = 0.0;
+          }
+        for( unsigned int k = 0; k < numberOfWeights; k++, control += stride )
+          {
+          for( unsigned int c = 0; c < channels; c++ )
+            {
+            point[c] += B[k] * control[c];
+            }
+          }
+        }
+      }
+    }
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 /**
@@ -14,11 +14,16 @@
 #ifndef __itkImageIntensityAndGradientToPointSetFilter_h
 #define __itkImageIntensityAndGradientToPointSetFilter_h
 
+#include "itkCentralDifferenceImageFunction.h"
 #include "itkCovariantVector.h"
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkImage.h"
 #include "itkConstNeighborhoodIterator.h"
+#include "itkMultiThreader.h"
 #include "itkPointSet.h"
+#include "itkTimeStamp.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -26,6 +31,12 @@ namespace itk
  * \brief
  * Reads a file and creates an ikt point set.
  *
+ * The gradient and the points are computed over slabs of the slowest
+ * dimension, one per thread.  Each thread collects the points of its slab,
+ * which are appended in slab order, so the point set is the same for any
+ * number of threads.  Update() only regenerates the point set when the
+ * input image, the mask or the parameters have changed since the last
+ * update, so a filter can be shared by several stages.
  */
 template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
 class ImageIntensityAndGradientToPointSetFilter
@@ -51,6 +62,7 @@ public:
   /** Hold on to the type information specified by the template parameters. */
   typedef TInputImage                         InputImageType;
   typedef typename InputImageType::PixelType  InputImagePixelType;
+  typedef typename InputImageType::RegionType RegionType;
 
   typedef TMaskImage                          MaskImageType;
 
@@ -67,6 +79,8 @@ public:
   typedef typename ConstNeighborhoodIteratorType::RadiusType  NeighborhoodRadiusType;
 
   typedef GradientRecursiveGaussianImageFilter<InputImageType, GradientImageType> GradientFilterType;
+  typedef CentralDifferenceImageFunction<InputImageType, InputImagePixelType, GradientPixelType>
+    GradientCalculatorType;
 
   /**
    * Set/Get the input image.
@@ -143,6 +157,35 @@ private:
   void operator=( const Self & );            // purposely not implemented
 
   void ReadPoints();
+
+  struct ThreadStruct
+    {
+    const Self                   *Filter;
+    const InputImageType         *InputImage;
+    const MaskImageType          *MaskImage;
+    GradientImageType            *GradientImage;
+    const GradientCalculatorType *GradientCalculator;
+    SizeValueType                NumberOfNeighborhoodVoxels;
+
+    // the points of each thread, in the order of its slab
+    std::vector<std::vector<PointType> >         Points;
+    std::vector<std::vector<PointSetPixelType> > PointData;
+    };
+
+  ThreadIdType GetNumberOfThreadsForRegion( const RegionType & region ) const;
+
+  bool GetRegionForThread( const RegionType & region, ThreadIdType threadId, ThreadIdType numberOfThreads,
+                           RegionType & threadRegion ) const;
+
+  static ITK_THREAD_RETURN_TYPE GradientThreaderCallback( void *arg );
+
+  static ITK_THREAD_RETURN_TYPE PointThreaderCallback( void *arg );
+
+  void ThreadedGradient( ThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads ) const;
+
+  void ThreadedPoints( ThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads ) const;
+
+  TimeStamp m_GenerateDataTime;
 };
 } // end namespace itk
 
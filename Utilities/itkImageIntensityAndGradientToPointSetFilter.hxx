@@ -16,11 +16,12 @@
 
 #include "itkImageIntensityAndGradientToPointSetFilter.h"
 
-#include "itkCentralDifferenceImageFunction.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
 
+#include <algorithm>
+
 namespace itk
 {
 //
@@ -49,7 +50,23 @@ void
 ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
 ::Update()
 {
+  const InputImageType * inputImage = this->GetInputImage();
+  const MaskImageType * maskImage = this->GetMaskImage();
+  if( inputImage == ITK_NULLPTR || maskImage == ITK_NULLPTR )
+    {
+    itkExceptionMacro( "The input image and the mask image are required." );
+    }
+
+  // Nothing has changed since the point set was generated.
+  const ModifiedTimeType generateDataTime = this->m_GenerateDataTime.GetMTime();
+  if( generateDataTime > 0 && generateDataTime > this->GetMTime() &&
+      generateDataTime > inputImage->GetMTime() && generateDataTime > maskImage->GetMTime() )
+    {
+    return;
+    }
+
   this->GenerateData();
+  this->m_GenerateDataTime.Modified();
 }
 
 template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
@@ -62,30 +79,38 @@ ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
 
   typename OutputMeshType::Pointer output = this->GetOutput();
 
+  const RegionType region = inputImage->GetRequestedRegion();
+
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreadsForRegion( region );
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+
+  ThreadStruct str;
+  str.Filter = this;
+  str.InputImage = inputImage;
+  str.MaskImage = maskImage;
+  str.GradientImage = ITK_NULLPTR;
+  str.GradientCalculator = ITK_NULLPTR;
+  str.NumberOfNeighborhoodVoxels = 0;
+
   // Calculate gradient image
 
   typename GradientImageType::Pointer gradientImage = ITK_NULLPTR;
   if( this->m_UseCentralDifferenceFunction )
     {
-    GradientPixelType zeroVector;
-    zeroVector.Fill( 0 );
-
     gradientImage = GradientImageType::New();
     gradientImage->CopyInformation( inputImage );
-    gradientImage->SetRegions( inputImage->GetRequestedRegion() );
+    gradientImage->SetRegions( region );
     gradientImage->Allocate();
-    gradientImage->FillBuffer( zeroVector );
 
-    typedef CentralDifferenceImageFunction<InputImageType, InputImagePixelType, GradientPixelType> GradientCalculatorType;
     typename GradientCalculatorType::Pointer gradientCalculator = GradientCalculatorType::New();
     gradientCalculator->SetInputImage( inputImage );
     gradientCalculator->SetUseImageDirection( true );
 
-    ImageRegionIteratorWithIndex<GradientImageType> It( gradientImage, gradientImage->GetRequestedRegion() );
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      It.Set( gradientCalculator->EvaluateAtIndex( It.GetIndex() ) );
-      }
+    str.GradientImage = gradientImage;
+    str.GradientCalculator = gradientCalculator;
+
+    this->GetMultiThreader()->SetSingleMethod( Self::GradientThreaderCallback, &str );
+    this->GetMultiThreader()->SingleMethodExecute();
     }
   else
     {
@@ -93,10 +118,13 @@ ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
     gradientFilter->SetInput( inputImage );
     gradientFilter->SetSigma( this->m_Sigma );
     gradientFilter->SetUseImageDirection( true );
+    gradientFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
 
     gradientImage = gradientFilter->GetOutput();
     gradientImage->Update();
     gradientImage->DisconnectPipeline();
+
+    str.GradientImage = gradientImage;
     }
 
   // Set up the point set pixel type characteristics
@@ -108,14 +136,149 @@ ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
     {
     numberOfNeighborhoodVoxels *= ( 2 * this->m_NeighborhoodRadius[d] + 1 );
     }
-  const SizeValueType sizeOfPixelTypeArray = numberOfNeighborhoodVoxels * ( 1 + Dimension );
+  str.NumberOfNeighborhoodVoxels = numberOfNeighborhoodVoxels;
+
+  // Each thread collects the points of its slab
+
+  str.Points.resize( numberOfThreads );
+  str.PointData.resize( numberOfThreads );
+
+  this->GetMultiThreader()->SetSingleMethod( Self::PointThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
 
-  // Initialize output point set
+  // Append the points of the slabs in order
+
+  SizeValueType numberOfPoints = 0;
+  for( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    numberOfPoints += str.Points[t].size();
+    }
+
+  typename OutputMeshType::PointsContainer::Pointer points = OutputMeshType::PointsContainer::New();
+  points->Reserve( numberOfPoints );
+  typename OutputMeshType::PointDataContainer::Pointer pointData = OutputMeshType::PointDataContainer::New();
+  pointData->Reserve( numberOfPoints );
 
   SizeValueType count = 0;
+  for( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    for( SizeValueType n = 0; n < str.Points[t].size(); n++ )
+      {
+      points->SetElement( count, str.Points[t][n] );
+      pointData->SetElement( count++, str.PointData[t][n] );
+      }
+    std::vector<PointType>().swap( str.Points[t] );
+    std::vector<PointSetPixelType>().swap( str.PointData[t] );
+    }
+
+  output->SetPoints( points );
+  output->SetPointData( pointData );
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+ThreadIdType
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::GetNumberOfThreadsForRegion( const RegionType & region ) const
+{
+  const SizeValueType numberOfSlabs = region.GetSize()[Dimension - 1];
+
+  ThreadIdType numberOfThreads = std::max( this->GetNumberOfThreads(), static_cast<ThreadIdType>( 1 ) );
+  if( numberOfThreads > numberOfSlabs )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( std::max( numberOfSlabs, static_cast<SizeValueType>( 1 ) ) );
+    }
+  return numberOfThreads;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+bool
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::GetRegionForThread( const RegionType & region, ThreadIdType threadId, ThreadIdType numberOfThreads,
+                      RegionType & threadRegion ) const
+{
+  const unsigned int  slabDimension = Dimension - 1;
+  const SizeValueType numberOfSlabs = region.GetSize()[slabDimension];
+  const SizeValueType firstSlab = numberOfSlabs * threadId / numberOfThreads;
+  const SizeValueType endSlab = numberOfSlabs * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlab == endSlab )
+    {
+    return false;
+    }
+
+  threadRegion = region;
+  threadRegion.SetIndex( slabDimension, region.GetIndex()[slabDimension] + static_cast<IndexValueType>( firstSlab ) );
+  threadRegion.SetSize( slabDimension, endSlab - firstSlab );
+  return true;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+ITK_THREAD_RETURN_TYPE
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::GradientThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStruct *str = static_cast<ThreadStruct *>( info->UserData );
+
+  str->Filter->ThreadedGradient( str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+ITK_THREAD_RETURN_TYPE
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::PointThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStruct *str = static_cast<ThreadStruct *>( info->UserData );
+
+  str->Filter->ThreadedPoints( str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+void
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::ThreadedGradient( ThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads ) const
+{
+  RegionType region;
+  if( !this->GetRegionForThread( str->GradientImage->GetRequestedRegion(), threadId, numberOfThreads, region ) )
+    {
+    return;
+    }
+
+  ImageRegionIteratorWithIndex<GradientImageType> It( str->GradientImage, region );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    It.Set( str->GradientCalculator->EvaluateAtIndex( It.GetIndex() ) );
+    }
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputMesh>
+void
+ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
+::ThreadedPoints( ThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads ) const
+{
+  RegionType region;
+  if( !this->GetRegionForThread( str->GradientImage->GetRequestedRegion(), threadId, numberOfThreads, region ) )
+    {
+    return;
+    }
+
+  const InputImageType *    inputImage = str->InputImage;
+  const MaskImageType *     maskImage = str->MaskImage;
+  const GradientImageType * gradientImage = str->GradientImage;
+
+  const SizeValueType numberOfNeighborhoodVoxels = str->NumberOfNeighborhoodVoxels;
+  const SizeValueType sizeOfPixelTypeArray = numberOfNeighborhoodVoxels * ( 1 + Dimension );
+
+  std::vector<PointType> &         points = str->Points[threadId];
+  std::vector<PointSetPixelType> & pointData = str->PointData[threadId];
 
-  ConstNeighborhoodIteratorType ItN( this->m_NeighborhoodRadius, gradientImage,
-    gradientImage->GetRequestedRegion() );
+  // The inner bounds of the iterator are those of the whole gradient image,
+  // so the points of a slab do not depend on the other slabs.
+  ConstNeighborhoodIteratorType ItN( this->m_NeighborhoodRadius, gradientImage, region );
   for( ItN.GoToBegin(); !ItN.IsAtEnd(); ++ItN )
     {
     typename InputImageType::IndexType index = ItN.GetIndex();
@@ -144,8 +307,8 @@ ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
           array[arrayIndex++] = gradient[d];
           }
         }
-      output->SetPoint( count, point );
-      output->SetPointData( count++, array );
+      points.push_back( point );
+      pointData.push_back( array );
       }
     }
 }
@@ -159,6 +322,7 @@ ImageIntensityAndGradientToPointSetFilter<TInputImage, TMaskImage, TOutputMesh>
 
   os << "Sigma = " << this->m_Sigma << std::endl;
   os << "Neighborhood radius = " << this->m_NeighborhoodRadius << std::endl;
+  os << "Use central difference function = " << this->m_UseCentralDifferenceFunction << std::endl;
 }
 } // end of namespace itk
 
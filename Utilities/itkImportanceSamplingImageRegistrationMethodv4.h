@@ -0,0 +1,113 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkImportanceSamplingImageRegistrationMethodv4_h
+#define __itkImportanceSamplingImageRegistrationMethodv4_h
+
+#include "itkImageRegistrationMethodv4.h"
+
+namespace itk
+{
+/** \class ImportanceSamplingImageRegistrationMethodv4
+ *
+ * ImageRegistrationMethodv4 which, with UseImportanceSampling on and a
+ * sampling strategy other than NONE, draws the metric sample points of each
+ * level where the fixed image has edges instead of uniformly.
+ *
+ * The virtual domain of the level is divided into blocks which are each
+ * expected to get a few samples.  Each block gets the sampling percentage of
+ * its voxels inside the fixed mask, so the samples cover the domain as
+ * uniformly as random sampling does.  Within a block the voxels are drawn by
+ * systematic sampling with a probability proportional to the gradient
+ * magnitude of the (smoothed) fixed image of the level plus its mean over the
+ * block, i.e. half of the samples are spread uniformly, so that flat blocks
+ * are sampled as well.  The points are jittered within their voxel as
+ * random sampling does.
+ *
+ * The ITK v4 metrics weigh all their sample points the same, so within a
+ * block the sampling favours the edges; the stratification keeps this
+ * within each block.
+ */
+template <typename TFixedImage, typename TMovingImage, typename TOutputTransform, typename TVirtualImage,
+          typename TPointSet>
+class ImportanceSamplingImageRegistrationMethodv4 :
+  public ImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage, TPointSet>
+{
+public:
+  /** Standard class typedefs. */
+  typedef ImportanceSamplingImageRegistrationMethodv4 Self;
+  typedef ImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage,
+                                    TPointSet>        Superclass;
+  typedef SmartPointer<Self>                          Pointer;
+  typedef SmartPointer<const Self>                    ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( ImportanceSamplingImageRegistrationMethodv4, ImageRegistrationMethodv4 );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, Superclass::ImageDimension );
+
+  typedef typename Superclass::MetricType                MetricType;
+  typedef typename Superclass::ImageMetricType           ImageMetricType;
+  typedef typename Superclass::MultiMetricType           MultiMetricType;
+  typedef typename Superclass::FixedImageType            FixedImageType;
+  typedef typename Superclass::FixedImageMaskType        FixedImageMaskType;
+  typedef typename Superclass::VirtualImageType          VirtualImageType;
+  typedef typename Superclass::MetricSamplePointSetType  MetricSamplePointSetType;
+
+  /** Draw the sample points with a probability weighted by the gradient
+      magnitude of the fixed image.  Off by default. */
+  itkSetMacro( UseImportanceSampling, bool );
+  itkGetConstMacro( UseImportanceSampling, bool );
+  itkBooleanMacro( UseImportanceSampling );
+
+  /** The number of samples each block of the virtual domain is expected to
+      get.  Larger blocks spread the samples less uniformly. */
+  itkSetClampMacro( NumberOfSamplesPerBlock, double, 1.0, NumericTraits<double>::max() );
+  itkGetConstMacro( NumberOfSamplesPerBlock, double );
+
+  /** The seed of the sampling; each level adds its number to it. */
+  itkSetMacro( RandomSeed, int );
+  itkGetConstMacro( RandomSeed, int );
+
+protected:
+  ImportanceSamplingImageRegistrationMethodv4();
+  virtual ~ImportanceSamplingImageRegistrationMethodv4()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+  virtual void SetMetricSamplePoints() ITK_OVERRIDE;
+
+private:
+  ImportanceSamplingImageRegistrationMethodv4( const Self & ); // purposely not implemented
+  void operator=( const Self & );                              // purposely not implemented
+
+  /** The importance sample points of one image metric. */
+  typename MetricSamplePointSetType::Pointer GetImportanceSamplePoints( const ImageMetricType * metric,
+                                                                        double samplingPercentage ) const;
+
+  bool   m_UseImportanceSampling;
+  double m_NumberOfSamplesPerBlock;
+  int    m_RandomSeed;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkImportanceSamplingImageRegistrationMethodv4.hxx"
+#endif
+
+#endif
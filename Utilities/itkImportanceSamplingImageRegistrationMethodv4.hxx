@@ -0,0 +1,242 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkImportanceSamplingImageRegistrationMethodv4_hxx
+#define __itkImportanceSamplingImageRegistrationMethodv4_hxx
+
+#include "itkImportanceSamplingImageRegistrationMethodv4.h"
+
+#include "itkCentralDifferenceImageFunction.h"
+#include "itkImageRegionConstIteratorWithOnlyIndex.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace itk
+{
+template <typename TFixedImage, typename TMovingImage, typename TOutputTransform, typename TVirtualImage,
+          typename TPointSet>
+ImportanceSamplingImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage, TPointSet>
+::ImportanceSamplingImageRegistrationMethodv4() :
+  m_UseImportanceSampling( false ),
+  m_NumberOfSamplesPerBlock( 4.0 ),
+  m_RandomSeed( 1967 )
+{
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TOutputTransform, typename TVirtualImage,
+          typename TPointSet>
+void
+ImportanceSamplingImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage, TPointSet>
+::SetMetricSamplePoints()
+{
+  if( !this->m_UseImportanceSampling )
+    {
+    Superclass::SetMetricSamplePoints();
+    return;
+    }
+
+  const double samplingPercentage = this->m_MetricSamplingPercentagePerLevel[this->m_CurrentLevel];
+
+  if( this->m_Metric->GetMetricCategory() == MetricType::MULTI_METRIC )
+    {
+    MultiMetricType *multiMetric = dynamic_cast<MultiMetricType *>( this->m_Metric.GetPointer() );
+    for( SizeValueType n = 0; n < multiMetric->GetNumberOfMetrics(); n++ )
+      {
+      ImageMetricType *metric = dynamic_cast<ImageMetricType *>( multiMetric->GetMetricQueue()[n].GetPointer() );
+      if( metric )
+        {
+        metric->SetFixedSampledPointSet( this->GetImportanceSamplePoints( metric, samplingPercentage ) );
+        metric->SetUseFixedSampledPointSet( true );
+        }
+      }
+    }
+  else
+    {
+    ImageMetricType *metric = dynamic_cast<ImageMetricType *>( this->m_Metric.GetPointer() );
+    if( metric )
+      {
+      metric->SetFixedSampledPointSet( this->GetImportanceSamplePoints( metric, samplingPercentage ) );
+      metric->SetUseFixedSampledPointSet( true );
+      }
+    }
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TOutputTransform, typename TVirtualImage,
+          typename TPointSet>
+typename ImportanceSamplingImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage,
+                                                     TPointSet>::MetricSamplePointSetType::Pointer
+ImportanceSamplingImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage, TPointSet>
+::GetImportanceSamplePoints( const ImageMetricType * metric, double samplingPercentage ) const
+{
+  typedef typename VirtualImageType::RegionType             VirtualRegionType;
+  typedef typename VirtualImageType::IndexType              VirtualIndexType;
+  typedef typename VirtualImageType::SizeType               VirtualSizeType;
+  typedef typename MetricSamplePointSetType::PointType      SamplePointType;
+  typedef CentralDifferenceImageFunction<FixedImageType>    GradientFunctionType;
+  typedef Statistics::MersenneTwisterRandomVariateGenerator RandomizerType;
+
+  typename MetricSamplePointSetType::Pointer samplePointSet = MetricSamplePointSetType::New();
+  samplePointSet->Initialize();
+
+  const VirtualImageType *   virtualImage = metric->GetVirtualImage();
+  const FixedImageType *     fixedImage = metric->GetFixedImage();
+  const FixedImageMaskType * fixedMask = metric->GetFixedImageMask();
+  const VirtualRegionType &  virtualRegion = metric->GetVirtualRegion();
+  const typename VirtualImageType::SpacingType oneThirdVirtualSpacing = virtualImage->GetSpacing() / 3.0;
+
+  typename GradientFunctionType::Pointer gradientFunction = GradientFunctionType::New();
+  gradientFunction->SetInputImage( fixedImage );
+
+  typename RandomizerType::Pointer randomizer = RandomizerType::New();
+  randomizer->SetSeed( this->m_RandomSeed + this->m_CurrentLevel );
+
+  // blocks of about the same size in every dimension, each expecting
+  // m_NumberOfSamplesPerBlock samples
+  const double    voxelsPerBlock = this->m_NumberOfSamplesPerBlock / std::max( samplingPercentage, 1e-6 );
+  const double    blockSide = std::pow( voxelsPerBlock, 1.0 / static_cast<double>( ImageDimension ) );
+  VirtualSizeType blockSize;
+  VirtualSizeType numberOfBlocks;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    blockSize[d] = std::min( std::max( static_cast<SizeValueType>( blockSide + 0.5 ),
+                                       static_cast<SizeValueType>( 1 ) ), virtualRegion.GetSize()[d] );
+    numberOfBlocks[d] = ( virtualRegion.GetSize()[d] + blockSize[d] - 1 ) / blockSize[d];
+    }
+
+  std::vector<VirtualIndexType> blockIndices;
+  std::vector<double>           cumulativeWeights;
+  SizeValueType                 numberOfSamples = 0;
+
+  SizeValueType totalNumberOfBlocks = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    totalNumberOfBlocks *= numberOfBlocks[d];
+    }
+
+  for( SizeValueType b = 0; b < totalNumberOfBlocks; b++ )
+    {
+    VirtualRegionType blockRegion;
+    SizeValueType     blockNumber = b;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const SizeValueType offset = ( blockNumber % numberOfBlocks[d] ) * blockSize[d];
+      blockNumber /= numberOfBlocks[d];
+      blockRegion.SetIndex( d, virtualRegion.GetIndex()[d] + static_cast<IndexValueType>( offset ) );
+      blockRegion.SetSize( d, std::min( blockSize[d], virtualRegion.GetSize()[d] - offset ) );
+      }
+
+    // the gradient magnitude of the voxels of the block inside the mask
+    blockIndices.clear();
+    cumulativeWeights.clear();
+    double totalGradientMagnitude = 0.0;
+    ImageRegionConstIteratorWithOnlyIndex<VirtualImageType> ItV( virtualImage, blockRegion );
+    for( ItV.GoToBegin(); !ItV.IsAtEnd(); ++ItV )
+      {
+      SamplePointType point;
+      virtualImage->TransformIndexToPhysicalPoint( ItV.GetIndex(), point );
+      if( fixedMask && !fixedMask->IsInside( point ) )
+        {
+        continue;
+        }
+
+      double gradientMagnitude = 0.0;
+      const typename ImageMetricType::FixedTransformType::OutputPointType fixedPoint =
+        metric->GetFixedTransform()->TransformPoint( point );
+      typename FixedImageType::IndexType fixedIndex;
+      if( fixedImage->TransformPhysicalPointToIndex( fixedPoint, fixedIndex ) )
+        {
+        gradientMagnitude = gradientFunction->EvaluateAtIndex( fixedIndex ).GetNorm();
+        }
+      totalGradientMagnitude += gradientMagnitude;
+      blockIndices.push_back( ItV.GetIndex() );
+      cumulativeWeights.push_back( totalGradientMagnitude );
+      }
+    if( blockIndices.empty() )
+      {
+      continue;
+      }
+
+    // the weight of a voxel is its gradient magnitude plus the mean of the block
+    const double meanGradientMagnitude = totalGradientMagnitude / blockIndices.size();
+    for( unsigned int i = 0; i < cumulativeWeights.size(); i++ )
+      {
+      cumulativeWeights[i] += meanGradientMagnitude * ( i + 1 );
+      }
+    double totalWeight = cumulativeWeights.back();
+    if( totalWeight <= 0.0 )
+      {
+      for( unsigned int i = 0; i < cumulativeWeights.size(); i++ )
+        {
+        cumulativeWeights[i] = i + 1;
+        }
+      totalWeight = cumulativeWeights.back();
+      }
+
+    // the expected number of samples of the block is its share of the total
+    const double  expectedNumberOfBlockSamples = samplingPercentage * blockIndices.size();
+    SizeValueType numberOfBlockSamples = static_cast<SizeValueType>( expectedNumberOfBlockSamples );
+    if( randomizer->GetVariateWithOpenUpperRange() < expectedNumberOfBlockSamples - numberOfBlockSamples )
+      {
+      numberOfBlockSamples++;
+      }
+    if( numberOfBlockSamples == 0 )
+      {
+      continue;
+      }
+
+    // systematic sampling along the cumulative weights
+    const double step = totalWeight / numberOfBlockSamples;
+    double       target = randomizer->GetVariateWithOpenUpperRange() * step;
+    unsigned int i = 0;
+    for( SizeValueType s = 0; s < numberOfBlockSamples; s++, target += step )
+      {
+      while( i + 1 < cumulativeWeights.size() && cumulativeWeights[i] <= target )
+        {
+        i++;
+        }
+
+      SamplePointType voxelCenter;
+      virtualImage->TransformIndexToPhysicalPoint( blockIndices[i], voxelCenter );
+      SamplePointType point = voxelCenter;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        point[d] += randomizer->GetNormalVariate() * oneThirdVirtualSpacing[d];
+        }
+      if( fixedMask && !fixedMask->IsInside( point ) )
+        {
+        point = voxelCenter;
+        }
+      samplePointSet->SetPoint( numberOfSamples++, point );
+      }
+    }
+
+  return samplePointSet;
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TOutputTransform, typename TVirtualImage,
+          typename TPointSet>
+void
+ImportanceSamplingImageRegistrationMethodv4<TFixedImage, TMovingImage, TOutputTransform, TVirtualImage, TPointSet>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Use importance sampling: " << this->m_UseImportanceSampling << std::endl;
+  os << indent << "Number of samples per block: " << this->m_NumberOfSamplesPerBlock << std::endl;
+  os << indent << "Random seed: " << this->m_RandomSeed << std::endl;
+}
+} // end namespace itk
+
+#endif
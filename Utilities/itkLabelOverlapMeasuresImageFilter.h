@@ -20,6 +20,9 @@
 
 #include "itksys/hash_map.hxx"
 
+#include <utility>
+#include <vector>
+
 namespace itk
 {
 /** \class LabelOverlapMeasuresImageFilter
@@ -86,6 +89,7 @@ public:
       m_Intersection = l.m_Intersection;
       m_SourceComplement = l.m_SourceComplement;
       m_TargetComplement = l.m_TargetComplement;
+      return *this;
     }
 
     unsigned long m_Source;
@@ -101,6 +105,19 @@ public:
   typedef typename MapType::iterator                    MapIterator;
   typedef typename MapType::const_iterator              MapConstIterator;
 
+  /** Sparse confusion matrix: the number of pixels for each (source label,
+   * target label) pair that occurs.  All the measures follow from it. */
+  typedef std::pair<LabelType, LabelType> LabelPairType;
+  struct LabelPairHash
+    {
+    size_t operator()( const LabelPairType & pair ) const
+    {
+      return static_cast<size_t>( pair.first ) * 2654435761u ^ static_cast<size_t>( pair.second );
+    }
+    };
+  typedef itksys::hash_map<LabelPairType, unsigned long, LabelPairHash> ConfusionMatrixType;
+  typedef typename ConfusionMatrixType::const_iterator                  ConfusionMatrixConstIterator;
+
   /** Image related typedefs. */
   itkStaticConstMacro( ImageDimension, unsigned int,
                        TLabelImage::ImageDimension );
@@ -135,6 +152,12 @@ public:
     return this->m_LabelSetMeasures;
   }
 
+  /** Get the confusion matrix of the source and target labels */
+  const ConfusionMatrixType & GetConfusionMatrix() const
+  {
+    return this->m_ConfusionMatrix;
+  }
+
   /**
    * tric overlap measures
    */
@@ -216,8 +239,9 @@ private:
   LabelOverlapMeasuresImageFilter( const Self & ); // purposely not implemented
   void operator=( const Self & );                  // purposely not implemented
 
-  std::vector<MapType> m_LabelSetMeasuresPerThread;
-  MapType              m_LabelSetMeasures;
+  std::vector<ConfusionMatrixType> m_ConfusionMatrixPerThread;
+  ConfusionMatrixType              m_ConfusionMatrix;
+  MapType                          m_LabelSetMeasures;
 
   SimpleFastMutexLock m_Mutex;
 }; // end of class
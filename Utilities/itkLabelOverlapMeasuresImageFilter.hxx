@@ -21,15 +21,6 @@
 
 namespace itk
 {
-#if defined(__GNUC__) && (__GNUC__ <= 2) // NOTE: This class needs a mutex for gnu 2.95
-/** Used for mutex locking */
-#define LOCK_HASHMAP this->m_Mutex.Lock()
-#define UNLOCK_HASHMAP this->m_Mutex.Unlock()
-#else
-#define LOCK_HASHMAP
-#define UNLOCK_HASHMAP
-#endif
-
 template <class TLabelImage>
 LabelOverlapMeasuresImageFilter<TLabelImage>
 ::LabelOverlapMeasuresImageFilter()
@@ -91,14 +82,15 @@ LabelOverlapMeasuresImageFilter<TLabelImage>
   int numberOfThreads = this->GetNumberOfThreads();
 
   // Resize the thread temporaries
-  this->m_LabelSetMeasuresPerThread.resize( numberOfThreads );
+  this->m_ConfusionMatrixPerThread.resize( numberOfThreads );
   // Initialize the temporaries
   for( int n = 0; n < numberOfThreads; n++ )
     {
-    this->m_LabelSetMeasuresPerThread[n].clear();
+    this->m_ConfusionMatrixPerThread[n].clear();
     }
 
-  // Initialize the final map
+  // Initialize the final maps
+  this->m_ConfusionMatrix.clear();
   this->m_LabelSetMeasures.clear();
 }
 
@@ -107,36 +99,42 @@ void
 LabelOverlapMeasuresImageFilter<TLabelImage>
 ::AfterThreadedGenerateData()
 {
-  // Run through the map for each thread and accumulate the set measures.
-  for( unsigned int n = 0; n < this->GetNumberOfThreads(); n++ )
+  // Accumulate the confusion matrices of the threads.
+  for( unsigned int n = 0; n < this->m_ConfusionMatrixPerThread.size(); n++ )
     {
-    // iterate over the map for this thread
-    for( MapConstIterator threadIt = this->m_LabelSetMeasuresPerThread[n].begin();
-         threadIt != this->m_LabelSetMeasuresPerThread[n].end();
-         ++threadIt )
+    for( ConfusionMatrixConstIterator threadIt = this->m_ConfusionMatrixPerThread[n].begin();
+         threadIt != this->m_ConfusionMatrixPerThread[n].end(); ++threadIt )
       {
-      // does this label exist in the cumulative stucture yet?
-      MapIterator mapIt = this->m_LabelSetMeasures.find( ( *threadIt ).first );
-      if( mapIt == this->m_LabelSetMeasures.end() )
-        {
-        // create a new entry
-        typedef typename MapType::value_type MapValueType;
-        mapIt = this->m_LabelSetMeasures.insert( MapValueType(
-                                                   (*threadIt).first, LabelSetMeasures() ) ).first;
-        }
+      this->m_ConfusionMatrix[(*threadIt).first] += (*threadIt).second;
+      }
+    this->m_ConfusionMatrixPerThread[n].clear();
+    }
 
-      // accumulate the information from this thread
-      (*mapIt).second.m_Source += (*threadIt).second.m_Source;
-      (*mapIt).second.m_Target += (*threadIt).second.m_Target;
-      (*mapIt).second.m_Union += (*threadIt).second.m_Union;
-      (*mapIt).second.m_Intersection +=
-        (*threadIt).second.m_Intersection;
-      (*mapIt).second.m_SourceComplement +=
-        (*threadIt).second.m_SourceComplement;
-      (*mapIt).second.m_TargetComplement +=
-        (*threadIt).second.m_TargetComplement;
-      } // end of thread map iterator loop
-    }   // end of thread loop
+  // Every (source, target) entry counts for the source label and the target
+  // label.
+  for( ConfusionMatrixConstIterator it = this->m_ConfusionMatrix.begin();
+       it != this->m_ConfusionMatrix.end(); ++it )
+    {
+    const LabelType     sourceLabel = (*it).first.first;
+    const LabelType     targetLabel = (*it).first.second;
+    const unsigned long count = (*it).second;
+
+    LabelSetMeasures & source = this->m_LabelSetMeasures[sourceLabel];
+    source.m_Source += count;
+    source.m_Union += count;
+    LabelSetMeasures & target = this->m_LabelSetMeasures[targetLabel];
+    target.m_Target += count;
+    if( sourceLabel == targetLabel )
+      {
+      target.m_Intersection += count;
+      }
+    else
+      {
+      target.m_Union += count;
+      source.m_SourceComplement += count;
+      target.m_TargetComplement += count;
+      }
+    }
 }
 
 template <class TLabelImage>
@@ -150,59 +148,38 @@ LabelOverlapMeasuresImageFilter<TLabelImage>
   ImageRegionConstIterator<LabelImageType> ItT( this->GetTargetImage(),
                                                 outputRegionForThread );
 
+  ConfusionMatrixType & confusionMatrix = this->m_ConfusionMatrixPerThread[threadId];
+
   // support progress methods/callbacks
   ProgressReporter progress( this, threadId,
-                             2 * outputRegionForThread.GetNumberOfPixels() );
+                             outputRegionForThread.GetNumberOfPixels() );
+
+  // neighboring pixels mostly have the same pair of labels, so runs of a
+  // pair are counted before going to the map
+  LabelPairType runPair;
+  unsigned long runLength = 0;
   for( ItS.GoToBegin(), ItT.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItT )
     {
-    LabelType sourceLabel = ItS.Get();
-    LabelType targetLabel = ItT.Get();
-
-    // is the label already in this thread?
-    MapIterator mapItS =
-      this->m_LabelSetMeasuresPerThread[threadId].find( sourceLabel );
-    MapIterator mapItT =
-      this->m_LabelSetMeasuresPerThread[threadId].find( targetLabel );
-
-    if( mapItS == this->m_LabelSetMeasuresPerThread[threadId].end() )
-      {
-      // create a new label set measures object
-      typedef typename MapType::value_type MapValueType;
-      LOCK_HASHMAP;
-      mapItS = this->m_LabelSetMeasuresPerThread[threadId].insert(
-          MapValueType( sourceLabel, LabelSetMeasures() ) ).first;
-      UNLOCK_HASHMAP;
-      }
-
-    if( mapItT == this->m_LabelSetMeasuresPerThread[threadId].end() )
-      {
-      // create a new label set measures object
-      typedef typename MapType::value_type MapValueType;
-      LOCK_HASHMAP;
-      mapItT = this->m_LabelSetMeasuresPerThread[threadId].insert(
-          MapValueType( targetLabel, LabelSetMeasures() ) ).first;
-      UNLOCK_HASHMAP;
-      }
-
-    (*mapItS).second.m_Source++;
-    (*mapItT).second.m_Target++;
-
-    if( sourceLabel == targetLabel )
+    const LabelPairType pair( ItS.Get(), ItT.Get() );
+    if( runLength > 0 && pair == runPair )
       {
-      (*mapItS).second.m_Intersection++;
-      (*mapItS).second.m_Union++;
+      runLength++;
       }
     else
       {
-      (*mapItS).second.m_Union++;
-      (*mapItT).second.m_Union++;
-
-      (*mapItS).second.m_SourceComplement++;
-      (*mapItT).second.m_TargetComplement++;
+      if( runLength > 0 )
+        {
+        confusionMatrix[runPair] += runLength;
+        }
+      runPair = pair;
+      runLength = 1;
       }
-
     progress.CompletedPixel();
     }
+  if( runLength > 0 )
+    {
+    confusionMatrix[runPair] += runLength;
+    }
 }
 
 /**
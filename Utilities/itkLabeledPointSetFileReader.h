@@ -124,17 +124,43 @@ private:
   LabeledPointSetFileReader( const Self & ); // purposely not implemented
   void operator=( const Self & );            // purposely not implemented
 
+  typedef typename LabeledPointSetImageType::RegionType ImageRegionType;
+  typedef std::vector<char>                             FileBufferType;
+
+  /**
+   * Points and labels of the labeled voxels, collected per thread over
+   * slabs of the slowest dimension and concatenated in slab order.
+   */
+  struct ImagePointThreadStruct
+    {
+    const Self                            *Reader;
+    const LabeledPointSetImageType        *Image;
+    bool                                  PositiveLabelsOnly;
+    std::vector<std::vector<PointType> >  Points;
+    std::vector<std::vector<PixelType> >  Labels;
+    };
+
+  /** Read the whole file, followed by a null character, in one read. */
+  void ReadFileIntoBuffer( FileBufferType & ) const;
+
   void ReadPointsFromImageFile();
 
   void ReadPointsFromAvantsFile();
 
+  /** Read the points, the scalars and the lines of an ASCII or BINARY
+      legacy VTK file in one pass over the file. */
   void ReadVTKFile();
 
-  void ReadPointsFromVTKFile();
+  /** Add the labeled voxels of the image to the output. */
+  void ExtractPointsFromImage( const LabeledPointSetImageType *, bool positiveLabelsOnly );
+
+  ThreadIdType GetNumberOfThreadsForRegion( const ImageRegionType & ) const;
+
+  bool GetRegionForThread( const ImageRegionType &, ThreadIdType, ThreadIdType, ImageRegionType & ) const;
 
-  void ReadScalarsFromVTKFile();
+  static ITK_THREAD_RETURN_TYPE ImagePointThreaderCallback( void * );
 
-  void ReadLinesFromVTKFile();
+  void ThreadedImagePoints( ImagePointThreadStruct *, ThreadIdType, ThreadIdType ) const;
 };
 } // end namespace itk
 
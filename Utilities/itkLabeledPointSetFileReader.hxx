@@ -18,18 +18,134 @@
 
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkImageFileReader.h"
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkLabelContourImageFilter.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreader.h"
 #include "itkByteSwapper.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <set>
+#include <sstream>
 #include <stdio.h>
 #include <string>
 
 namespace itk
 {
+namespace LabeledPointSetFileReaderDetail
+{
+/** Parse the number at position, skipping the white space before it. */
+inline bool ParseNumber( const char * & position, double & value )
+{
+  char *numberEnd = ITK_NULLPTR;
+  value = std::strtod( position, &numberEnd );
+  if( numberEnd == position )
+    {
+    return false;
+    }
+  position = numberEnd;
+  return true;
+}
+
+/** The line at position, which moves past its end of line. */
+inline std::string GetNextLine( const char * & position, const char *end )
+{
+  const char *lineEnd = std::find( position, end, '\n' );
+  std::string line( position, lineEnd );
+  if( !line.empty() && line[line.size() - 1] == '\r' )
+    {
+    line.erase( line.size() - 1 );
+    }
+  position = ( lineEnd < end ) ? lineEnd + 1 : end;
+  return line;
+}
+
+/** Read count big endian values of type T. */
+template <class T>
+bool ReadBigEndianValues( const char * & position, const char *end, unsigned long count,
+                          std::vector<double> & values )
+{
+  values.resize( count );
+  if( static_cast<unsigned long>( end - position ) < count * sizeof( T ) )
+    {
+    return false;
+    }
+  if( count == 0 )
+    {
+    return true;
+    }
+  std::vector<T> data( count );
+  std::memcpy( &data[0], position, count * sizeof( T ) );
+  ByteSwapper<T>::SwapRangeFromSystemToBigEndian( &data[0], count );
+  for( unsigned long i = 0; i < count; i++ )
+    {
+    values[i] = static_cast<double>( data[i] );
+    }
+  position += count * sizeof( T );
+
+  // the end of line following the data
+  if( position < end && *position == '\n' )
+    {
+    ++position;
+    }
+  return true;
+}
+
+/** Read count values of a VTK data type, in ASCII or BINARY. */
+inline bool ReadValues( bool isBinary, const std::string & dataType, const char * & position, const char *end,
+                        unsigned long count, std::vector<double> & values )
+{
+  if( !isBinary )
+    {
+    values.resize( count );
+    for( unsigned long i = 0; i < count; i++ )
+      {
+      if( !ParseNumber( position, values[i] ) )
+        {
+        return false;
+        }
+      }
+    return true;
+    }
+  if( dataType == "float" )
+    {
+    return ReadBigEndianValues<float>( position, end, count, values );
+    }
+  else if( dataType == "double" )
+    {
+    return ReadBigEndianValues<double>( position, end, count, values );
+    }
+  else if( dataType == "int" )
+    {
+    return ReadBigEndianValues<int>( position, end, count, values );
+    }
+  else if( dataType == "unsigned_int" )
+    {
+    return ReadBigEndianValues<unsigned int>( position, end, count, values );
+    }
+  else if( dataType == "short" )
+    {
+    return ReadBigEndianValues<short>( position, end, count, values );
+    }
+  else if( dataType == "unsigned_short" )
+    {
+    return ReadBigEndianValues<unsigned short>( position, end, count, values );
+    }
+  else if( dataType == "char" )
+    {
+    return ReadBigEndianValues<char>( position, end, count, values );
+    }
+  else if( dataType == "unsigned_char" || dataType == "bit" )
+    {
+    return ReadBigEndianValues<unsigned char>( position, end, count, values );
+    }
+  return false;
+}
+} // end namespace LabeledPointSetFileReaderDetail
+
 //
 // Constructor
 //
@@ -157,12 +273,12 @@ LabeledPointSetFileReader<TOutputMesh>
 
   if( this->GetOutput()->GetNumberOfPoints() > 0 )
     {
+    std::set<PixelType> labels;
     typename OutputMeshType::PointDataContainerIterator ItD =
       this->GetOutput()->GetPointData()->Begin();
     while( ItD != this->GetOutput()->GetPointData()->End() )
       {
-      if( find( this->m_LabelSet.begin(),
-                this->m_LabelSet.end(), ItD.Value() ) == this->m_LabelSet.end() )
+      if( labels.insert( ItD.Value() ).second )
         {
         this->m_LabelSet.push_back( ItD.Value() );
         }
@@ -174,35 +290,25 @@ LabeledPointSetFileReader<TOutputMesh>
 template <class TOutputMesh>
 void
 LabeledPointSetFileReader<TOutputMesh>
-::ReadPointsFromAvantsFile()
+::ReadFileIntoBuffer( FileBufferType & buffer ) const
 {
-  typename OutputMeshType::Pointer outputMesh = this->GetOutput();
+  std::ifstream inputFile( this->m_FileName.c_str(), std::ios::in | std::ios::binary );
+  if( !inputFile.is_open() )
+    {
+    itkExceptionMacro( "Unable to open file\n"
+                       "inputFilename= " << this->m_FileName );
+    }
 
-  std::ifstream inputFile( m_FileName.c_str() );
+  inputFile.seekg( 0, std::ios::end );
+  const std::streamoff fileSize = inputFile.tellg();
+  inputFile.seekg( 0, std::ios::beg );
 
-  unsigned long count = 0;
-  while( !inputFile.eof() )
+  buffer.resize( static_cast<size_t>( fileSize ) + 1 );
+  if( fileSize > 0 )
     {
-    PointType point;
-    PixelType label;
-
-    if( Dimension == 2 )
-      {
-      float trash;
-      inputFile >> point >> trash >> label;
-      }
-    else // Dimension == 3
-      {
-      inputFile >> point >> label;
-      }
-    if( ( point.GetVectorFromOrigin() ).GetSquaredNorm() > 0.0
-        || label != 0 )
-      {
-      outputMesh->SetPointData( count, label );
-      outputMesh->SetPoint( count, point );
-      count++;
-      }
+    inputFile.read( &buffer[0], fileSize );
     }
+  buffer[static_cast<size_t>( fileSize )] = '\0';
 
   inputFile.close();
 }
@@ -210,313 +316,279 @@ LabeledPointSetFileReader<TOutputMesh>
 template <class TOutputMesh>
 void
 LabeledPointSetFileReader<TOutputMesh>
-::ReadVTKFile()
-{
-  this->ReadPointsFromVTKFile();
-  this->ReadScalarsFromVTKFile();
-  this->ReadLinesFromVTKFile();
-}
-
-template <class TOutputMesh>
-void
-LabeledPointSetFileReader<TOutputMesh>
-::ReadPointsFromVTKFile()
+::ReadPointsFromAvantsFile()
 {
   typename OutputMeshType::Pointer outputMesh = this->GetOutput();
 
-  std::ifstream inputFile( this->m_FileName.c_str() );
-
-  std::string line;
+  FileBufferType buffer;
+  this->ReadFileIntoBuffer( buffer );
 
-  bool isBinary = false;
+  std::vector<PointType> points;
+  std::vector<PixelType> labels;
 
-  while( !inputFile.eof() )
+  const char *position = &buffer[0];
+  while( true )
     {
-    std::getline( inputFile, line );
-
-    if( line.find( "BINARY" ) != std::string::npos )
+    PointType point;
+    double    value = 0.0;
+    bool      isComplete = true;
+    for( unsigned int d = 0; d < Dimension && isComplete; d++ )
       {
-      isBinary = true;
+      isComplete = LabeledPointSetFileReaderDetail::ParseNumber( position, value );
+      point[d] = value;
       }
-
-    if( line.find( "POINTS" ) != std::string::npos )
+    if( Dimension == 2 && isComplete )
       {
-      break;
+      isComplete = LabeledPointSetFileReaderDetail::ParseNumber( position, value );
       }
-    }
-
-  itkDebugMacro( "POINTS line" << line );
-
-  std::string pointLine( line, strlen( "POINTS " ), line.length() );
-  itkDebugMacro( "pointLine " << pointLine );
-
-  int numberOfPoints = -1;
-
-  if( sscanf( pointLine.c_str(), "%d", &numberOfPoints ) != 1 )
-    {
-    itkExceptionMacro( "ERROR: Failed to read numberOfPoints\n"
-                       "       pointLine = " << pointLine );
-    return;
-    }
-
-  itkDebugMacro( "numberOfPoints = " << numberOfPoints );
-
-  if( numberOfPoints < 1 )
-    {
-    itkExceptionMacro( "numberOfPoints < 1"
-                       << "       numberOfPoints = " << numberOfPoints );
-    return;
-    }
-
-  outputMesh->GetPoints()->Reserve( numberOfPoints );
-
-  //
-  // Load the point coordinates into the itk::Mesh
-  //
-  PointType point;
-
-  if( isBinary )
-    {
-    itkDebugMacro( "Data is binary" );
-
-    float * ptData = new float[numberOfPoints * 3];
-    inputFile.read( reinterpret_cast<char *>( ptData ), 3 * numberOfPoints * sizeof(float) );
-    ByteSwapper<float>::SwapRangeFromSystemToBigEndian(ptData, numberOfPoints * 3);
-    for( long i = 0; i < numberOfPoints; i++ )
+    isComplete = isComplete && LabeledPointSetFileReaderDetail::ParseNumber( position, value );
+    if( !isComplete )
       {
-      for( long j = 0; j < Dimension; j++ )
-        {
-        point[j] = ptData[i * 3 + j];
-        }
-      outputMesh->SetPoint( i, point );
+      break;
       }
+    const PixelType label = static_cast<PixelType>( value );
 
-    delete [] ptData;
-    }
-  else
-    {
-    for( long i = 0; i < numberOfPoints; i++ )
+    if( ( point.GetVectorFromOrigin() ).GetSquaredNorm() > 0.0
+        || label != 0 )
       {
-      if( Dimension == 2 )
-        {
-        float trash;
-        inputFile >> point >> trash;
-        }
-      else  // Dimension = 3
-        {
-        inputFile >> point;
-        }
-      outputMesh->SetPoint( i, point );
+      points.push_back( point );
+      labels.push_back( label );
       }
     }
 
-  inputFile.close();
+  typename OutputMeshType::PointsContainer::Pointer pointsContainer = OutputMeshType::PointsContainer::New();
+  typename OutputMeshType::PointDataContainer::Pointer pointDataContainer =
+    OutputMeshType::PointDataContainer::New();
+  pointsContainer->Reserve( points.size() );
+  pointDataContainer->Reserve( labels.size() );
+
+  typename OutputMeshType::PointsContainer::STLContainerType & pointsSTL = pointsContainer->CastToSTLContainer();
+  typename OutputMeshType::PointDataContainer::STLContainerType & pointDataSTL =
+    pointDataContainer->CastToSTLContainer();
+  for( unsigned long i = 0; i < points.size(); i++ )
+    {
+    pointsSTL[i] = points[i];
+    pointDataSTL[i] = labels[i];
+    }
+  outputMesh->SetPoints( pointsContainer );
+  outputMesh->SetPointData( pointDataContainer );
 }
 
 template <class TOutputMesh>
 void
 LabeledPointSetFileReader<TOutputMesh>
-::ReadScalarsFromVTKFile()
+::ReadVTKFile()
 {
   typename OutputMeshType::Pointer outputMesh = this->GetOutput();
 
-  std::ifstream inputFile( this->m_FileName.c_str() );
+  FileBufferType buffer;
+  this->ReadFileIntoBuffer( buffer );
 
-  std::string line;
+  const char * position = &buffer[0];
+  const char * end = &buffer[0] + buffer.size() - 1;
 
-  bool isBinary = false;
+  bool          isBinary = false;
+  bool          isPointData = false;
+  bool          hasScalars = false;
+  long          numberOfPoints = -1;
+  unsigned long numberOfDataTuples = 0;
 
-  //
-  // Find the labels associated with each pixel
-  //
-  while( !inputFile.eof() )
-    {
-    std::getline( inputFile, line );
+  std::vector<double> values;
 
-    if( line.find( "BINARY" ) != std::string::npos )
+  while( position < end )
+    {
+    const std::string        line = LabeledPointSetFileReaderDetail::GetNextLine( position, end );
+    std::istringstream       lineStream( line );
+    std::vector<std::string> words;
+    std::string              word;
+    while( lineStream >> word )
       {
-      isBinary = true;
+      words.push_back( word );
       }
-
-    if( line.find( "SCALARS" ) != std::string::npos )
+    if( words.empty() )
       {
-      break;
+      continue;
       }
-    }
+    const std::string & keyword = words[0];
 
-  if( inputFile.eof() )
-    {
-    inputFile.close();
-    return;
-    }
-
-  std::string::size_type pos = line.rfind( " " );
-
-  std::string temp = std::string( line, pos + 1, line.length() - 1 );
+    if( keyword == "BINARY" )
+      {
+      isBinary = true;
+      }
+    else if( keyword == "POINTS" )
+      {
+      itkDebugMacro( "POINTS line" << line );
 
-  unsigned int numberOfComponents = std::atoi( temp.c_str() );
+      if( words.size() < 2 || sscanf( words[1].c_str(), "%ld", &numberOfPoints ) != 1 )
+        {
+        itkExceptionMacro( "ERROR: Failed to read numberOfPoints\n"
+                           "       pointLine = " << line );
+        }
 
-  std::getline( inputFile, line );
+      itkDebugMacro( "numberOfPoints = " << numberOfPoints );
 
-  if( isBinary )
-    {
-    int   numberOfValues = outputMesh->GetNumberOfPoints() * numberOfComponents;
-    float p;
-    int * scalarData = new int[numberOfValues];
-    inputFile.read( reinterpret_cast<char *>( scalarData ), numberOfComponents * sizeof(p) );
-    ByteSwapper<int>::SwapRangeFromSystemToBigEndian(scalarData, numberOfValues);
+      if( numberOfPoints < 1 )
+        {
+        itkExceptionMacro( "numberOfPoints < 1"
+                           << "       numberOfPoints = " << numberOfPoints );
+        }
 
-    if( numberOfComponents == 1 )
-      {
-      // PixelType label;
-      for( unsigned long i = 0; i < outputMesh->GetNumberOfPoints(); i++ )
+      const std::string dataType = ( words.size() > 2 ) ? words[2] : std::string( "float" );
+      if( !LabeledPointSetFileReaderDetail::ReadValues( isBinary, dataType, position, end,
+                                                        3 * numberOfPoints, values ) )
         {
-        outputMesh->SetPointData( i, scalarData[i] );
+        itkExceptionMacro( "ERROR: Failed to read the " << numberOfPoints << " points of type "
+                                                        << dataType << " from " << this->m_FileName );
         }
-      //    itkExceptionMacro( "Only single label components are readable" );
-      }
-    else
-      {
-      this->m_MultiComponentScalars = MultiComponentScalarSetType::New();
-      this->m_MultiComponentScalars->Initialize();
-      for( unsigned long i = 0; i < outputMesh->GetNumberOfPoints(); i++ )
+
+      //
+      // Load the point coordinates into the itk::Mesh
+      //
+      typename OutputMeshType::PointsContainer::Pointer pointsContainer = OutputMeshType::PointsContainer::New();
+      pointsContainer->Reserve( numberOfPoints );
+      typename OutputMeshType::PointsContainer::STLContainerType & pointsSTL = pointsContainer->CastToSTLContainer();
+      for( long i = 0; i < numberOfPoints; i++ )
         {
-        MultiComponentScalarType scalar;
-        scalar.SetSize( numberOfComponents );
-        for( unsigned int d = 0; d < numberOfComponents; d++ )
+        PointType point;
+        for( unsigned int j = 0; j < Dimension && j < 3; j++ )
           {
-          scalar[d] = scalarData[i * numberOfComponents + d];
+          point[j] = values[i * 3 + j];
           }
-        this->m_MultiComponentScalars->InsertElement( i, scalar );
+        pointsSTL[i] = point;
         }
+      outputMesh->SetPoints( pointsContainer );
       }
-
-    delete [] scalarData;
-    }
-  else
-    {
-    if( numberOfComponents == 1 )
+    else if( keyword == "POINT_DATA" || keyword == "CELL_DATA" )
       {
-      PixelType label;
-      for( unsigned long i = 0; i < outputMesh->GetNumberOfPoints(); i++ )
-        {
-        inputFile >> label;
-        outputMesh->SetPointData( i, label );
-        }
-      //    itkExceptionMacro( "Only single label components are readable" );
+      isPointData = ( keyword == "POINT_DATA" );
+      numberOfDataTuples = ( words.size() > 1 ) ? std::atol( words[1].c_str() ) : 0;
       }
-    else
+    else if( keyword == "SCALARS" )
       {
-      this->m_MultiComponentScalars = MultiComponentScalarSetType::New();
-      this->m_MultiComponentScalars->Initialize();
-      for( unsigned long i = 0; i < outputMesh->GetNumberOfPoints(); i++ )
+      //
+      // Find the labels associated with each pixel
+      //
+      const std::string  dataType = ( words.size() > 2 ) ? words[2] : std::string( "float" );
+      const unsigned int numberOfComponents = ( words.size() > 3 ) ? std::atoi( words[3].c_str() ) : 1;
+
+      // the lookup table line
+      const char *      lookupTablePosition = position;
+      const std::string lookupTableLine = LabeledPointSetFileReaderDetail::GetNextLine( position, end );
+      if( lookupTableLine.find( "LOOKUP_TABLE" ) == std::string::npos )
+        {
+        position = lookupTablePosition;
+        }
+
+      const bool isLabelData = ( isPointData || numberOfDataTuples == 0 ) && !hasScalars && numberOfPoints > 0;
+      const unsigned long numberOfTuples = isLabelData ? static_cast<unsigned long>( numberOfPoints ) :
+        numberOfDataTuples;
+      if( !LabeledPointSetFileReaderDetail::ReadValues( isBinary, dataType, position, end,
+                                                        numberOfTuples * numberOfComponents, values ) )
+        {
+        itkExceptionMacro( "ERROR: Failed to read the scalars of type " << dataType << " from "
+                                                                         << this->m_FileName );
+        }
+      if( !isLabelData )
+        {
+        continue;
+        }
+      hasScalars = true;
+
+      if( numberOfComponents == 1 )
+        {
+        typename OutputMeshType::PointDataContainer::Pointer pointDataContainer =
+          OutputMeshType::PointDataContainer::New();
+        pointDataContainer->Reserve( numberOfTuples );
+        typename OutputMeshType::PointDataContainer::STLContainerType & pointDataSTL =
+          pointDataContainer->CastToSTLContainer();
+        for( unsigned long i = 0; i < numberOfTuples; i++ )
+          {
+          pointDataSTL[i] = static_cast<PixelType>( values[i] );
+          }
+        outputMesh->SetPointData( pointDataContainer );
+        }
+      else
         {
-        MultiComponentScalarType scalar;
-        scalar.SetSize( numberOfComponents );
-        for( unsigned int d = 0; d < numberOfComponents; d++ )
+        this->m_MultiComponentScalars = MultiComponentScalarSetType::New();
+        this->m_MultiComponentScalars->Initialize();
+        this->m_MultiComponentScalars->Reserve( numberOfTuples );
+        for( unsigned long i = 0; i < numberOfTuples; i++ )
           {
-          inputFile >> scalar[d];
+          MultiComponentScalarType scalar;
+          scalar.SetSize( numberOfComponents );
+          for( unsigned int d = 0; d < numberOfComponents; d++ )
+            {
+            scalar[d] = static_cast<PixelType>( values[i * numberOfComponents + d] );
+            }
+          this->m_MultiComponentScalars->CastToSTLContainer()[i] = scalar;
           }
-        this->m_MultiComponentScalars->InsertElement( i, scalar );
         }
       }
-    }
-
-  inputFile.close();
-}
-
-template <class TOutputMesh>
-void
-LabeledPointSetFileReader<TOutputMesh>
-::ReadLinesFromVTKFile()
-{
-  typename OutputMeshType::Pointer outputMesh = this->GetOutput();
-
-  std::ifstream inputFile( this->m_FileName.c_str() );
-
-  std::string line;
+    else if( keyword == "LINES" )
+      {
+      const unsigned long numberOfLines = ( words.size() > 1 ) ? std::atol( words[1].c_str() ) : 0;
+      const unsigned long numberOfValues = ( words.size() > 2 ) ? std::atol( words[2].c_str() ) : 0;
+      if( !LabeledPointSetFileReaderDetail::ReadValues( isBinary, "int", position, end, numberOfValues, values ) )
+        {
+        itkExceptionMacro( "ERROR: Failed to read the " << numberOfLines << " lines from " << this->m_FileName );
+        }
 
-  bool isBinary = false;
+      this->m_Lines = LineSetType::New();
+      this->m_Lines->Initialize();
 
-  //
-  // Find the labels associated with each pixel
-  //
-  while( !inputFile.eof() )
-    {
-    std::getline( inputFile, line );
+      unsigned long valueId = 0;
+      unsigned long lineId = 0;
+      while( valueId < numberOfValues && lineId < numberOfLines )
+        {
+        const unsigned long lineLength = std::min( static_cast<unsigned long>( values[valueId] ),
+                                                   numberOfValues - valueId - 1 );
+        ++valueId;
 
-    if( line.find( "BINARY" ) != std::string::npos )
-      {
-      isBinary = true;
+        LineType polyLine;
+        polyLine.SetSize( lineLength );
+        for( unsigned long i = 0; i < lineLength; i++ )
+          {
+          polyLine[i] = static_cast<unsigned long>( values[valueId] );
+          ++valueId;
+          }
+        this->m_Lines->InsertElement( lineId, polyLine );
+        ++lineId;
+        }
       }
-
-    if( line.find( "LINES" ) != std::string::npos )
+    else if( keyword == "VERTICES" || keyword == "POLYGONS" || keyword == "TRIANGLE_STRIPS" )
       {
-      break;
+      // skip the cells
+      const unsigned long numberOfValues = ( words.size() > 2 ) ? std::atol( words[2].c_str() ) : 0;
+      LabeledPointSetFileReaderDetail::ReadValues( isBinary, "int", position, end, numberOfValues, values );
       }
-    }
-
-  if( inputFile.eof() )
-    {
-    inputFile.close();
-    return;
-    }
-
-  std::string::size_type pos = line.rfind( " " );
-
-  std::string  temp = std::string( line, 6, pos - 1 );
-  unsigned int numberOfLines = std::atoi( temp.c_str() );
-
-  temp = std::string(line, pos, line.length() - 1 );
-  unsigned int numberOfValues = std::atoi( temp.c_str() );
-
-  this->m_Lines = LineSetType::New();
-  this->m_Lines->Initialize();
-
-  if( isBinary )
-    {
-    int   p;
-    int * lineData = new int[numberOfValues];
-    inputFile.read( reinterpret_cast<char *>( lineData ), numberOfValues * sizeof(p) );
-    ByteSwapper<int>::SwapRangeFromSystemToBigEndian(lineData, numberOfValues);
-
-    unsigned long valueId = 0;
-    unsigned long lineId = 0;
-    while( valueId < numberOfValues )
+    else if( keyword == "VECTORS" || keyword == "NORMALS" )
       {
-      int lineLength = lineData[valueId];
-      ++valueId;
-
-      LineType polyLine;
-      polyLine.SetSize( lineLength );
-      for( long i = 0; i < lineLength; i++ )
-        {
-        polyLine[i] = lineData[valueId];
-        ++valueId;
-        }
-      this->m_Lines->InsertElement( lineId, polyLine );
-      ++lineId;
+      const std::string dataType = ( words.size() > 2 ) ? words[2] : std::string( "float" );
+      LabeledPointSetFileReaderDetail::ReadValues( isBinary, dataType, position, end, 3 * numberOfDataTuples,
+                                                   values );
       }
-
-    delete [] lineData;
-    }
-  else
-    {
-    for( unsigned int i = 0; i < numberOfLines; i++ )
+    else if( keyword == "FIELD" )
       {
-      LineType     line_loc;
-      unsigned int numberOfPoints;
-      inputFile >> numberOfPoints;
-      line_loc.SetSize( numberOfPoints );
-      for( unsigned int d = 0; d < numberOfPoints; d++ )
+      const unsigned int numberOfArrays = ( words.size() > 2 ) ? std::atoi( words[2].c_str() ) : 0;
+      for( unsigned int n = 0; n < numberOfArrays && position < end; n++ )
         {
-        inputFile >> line_loc[d];
+        std::istringstream arrayStream( LabeledPointSetFileReaderDetail::GetNextLine( position, end ) );
+        std::string        arrayName;
+        unsigned long      numberOfComponents = 0;
+        unsigned long      numberOfTuples = 0;
+        std::string        dataType;
+        arrayStream >> arrayName >> numberOfComponents >> numberOfTuples >> dataType;
+        LabeledPointSetFileReaderDetail::ReadValues( isBinary, dataType, position, end,
+                                                     numberOfComponents * numberOfTuples, values );
         }
-      this->m_Lines->InsertElement( i, line_loc );
       }
     }
 
-  inputFile.close();
+  if( numberOfPoints < 0 )
+    {
+    itkExceptionMacro( "ERROR: Failed to read numberOfPoints\n"
+                       "       no POINTS in " << this->m_FileName );
+    }
 }
 
 template <class TOutputMesh>
@@ -524,8 +596,6 @@ void
 LabeledPointSetFileReader<TOutputMesh>
 ::ReadPointsFromImageFile()
 {
-  typename OutputMeshType::Pointer outputMesh = this->GetOutput();
-
   typedef ImageFileReader<LabeledPointSetImageType> ImageReaderType;
   typename ImageReaderType::Pointer imageReader = ImageReaderType::New();
   imageReader->SetFileName( this->m_FileName.c_str() );
@@ -533,26 +603,7 @@ LabeledPointSetFileReader<TOutputMesh>
 
   if( !this->m_ExtractBoundaryPoints )
     {
-    ImageRegionIteratorWithIndex<LabeledPointSetImageType> It( imageReader->GetOutput(),
-                                                               imageReader->GetOutput()->GetLargestPossibleRegion() );
-
-    unsigned long count = 0;
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-      {
-      PixelType label = It.Get();
-      if( label != NumericTraits<PixelType>::ZeroValue() )
-        {
-        typename LabeledPointSetImageType::PointType imagePoint;
-        imageReader->GetOutput()->TransformIndexToPhysicalPoint(
-          It.GetIndex(), imagePoint );
-
-        PointType point;
-        point.CastFrom( imagePoint );
-        outputMesh->SetPoint( count, point );
-        outputMesh->SetPointData( count, label );
-        count++;
-        }
-      }
+    this->ExtractPointsFromImage( imageReader->GetOutput(), false );
     }
   else
     {
@@ -563,35 +614,141 @@ LabeledPointSetFileReader<TOutputMesh>
     contourFilter->SetInput( imageReader->GetOutput() );
     contourFilter->SetFullyConnected( true );
     contourFilter->SetBackgroundValue( 0 );
+    contourFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
     contourFilter->Update();
 
-    this->m_LabelSet.clear();
+    this->ExtractPointsFromImage( contourFilter->GetOutput(), true );
+    }
+}
+
+template <class TOutputMesh>
+void
+LabeledPointSetFileReader<TOutputMesh>
+::ExtractPointsFromImage( const LabeledPointSetImageType *image, bool positiveLabelsOnly )
+{
+  typename OutputMeshType::Pointer outputMesh = this->GetOutput();
+
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreadsForRegion( image->GetLargestPossibleRegion() );
+
+  ImagePointThreadStruct str;
+  str.Reader = this;
+  str.Image = image;
+  str.PositiveLabelsOnly = positiveLabelsOnly;
+  str.Points.resize( numberOfThreads );
+  str.Labels.resize( numberOfThreads );
 
-    ImageRegionIteratorWithIndex<LabeledPointSetImageType> It(
-      contourFilter->GetOutput(),
-      contourFilter->GetOutput()->GetLargestPossibleRegion() );
-    unsigned long count = 0;
-    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( Self::ImagePointThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // concatenate in slab order, i.e. in the order of the voxels
+  unsigned long numberOfPoints = 0;
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    numberOfPoints += str.Points[n].size();
+    }
+
+  typename OutputMeshType::PointsContainer::Pointer pointsContainer = OutputMeshType::PointsContainer::New();
+  typename OutputMeshType::PointDataContainer::Pointer pointDataContainer =
+    OutputMeshType::PointDataContainer::New();
+  pointsContainer->Reserve( numberOfPoints );
+  pointDataContainer->Reserve( numberOfPoints );
+
+  typename OutputMeshType::PointsContainer::STLContainerType & pointsSTL = pointsContainer->CastToSTLContainer();
+  typename OutputMeshType::PointDataContainer::STLContainerType & pointDataSTL =
+    pointDataContainer->CastToSTLContainer();
+  unsigned long count = 0;
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    for( unsigned long i = 0; i < str.Points[n].size(); i++ )
       {
-      PixelType label = It.Get();
-      if( It.Get() > 0 )
-        {
-        typename LabeledPointSetImageType::PointType imagePoint;
-        contourFilter->GetOutput()->TransformIndexToPhysicalPoint(
-          It.GetIndex(), imagePoint );
+      pointsSTL[count] = str.Points[n][i];
+      pointDataSTL[count] = str.Labels[n][i];
+      count++;
+      }
+    std::vector<PointType>().swap( str.Points[n] );
+    std::vector<PixelType>().swap( str.Labels[n] );
+    }
+  outputMesh->SetPoints( pointsContainer );
+  outputMesh->SetPointData( pointDataContainer );
+}
 
-        PointType point;
-        point.CastFrom( imagePoint );
-        outputMesh->SetPoint( count, point );
-        outputMesh->SetPointData( count, It.Get() );
-        count++;
+template <class TOutputMesh>
+ThreadIdType
+LabeledPointSetFileReader<TOutputMesh>
+::GetNumberOfThreadsForRegion( const ImageRegionType & region ) const
+{
+  const SizeValueType numberOfSlabs = region.GetSize()[Dimension - 1];
 
-        if( find( this->m_LabelSet.begin(), this->m_LabelSet.end(), label )
-            == this->m_LabelSet.end() )
-          {
-          this->m_LabelSet.push_back( label );
-          }
-        }
+  ThreadIdType numberOfThreads = std::max( this->GetNumberOfThreads(), static_cast<ThreadIdType>( 1 ) );
+  if( numberOfThreads > numberOfSlabs )
+    {
+    numberOfThreads = static_cast<ThreadIdType>( std::max( numberOfSlabs, static_cast<SizeValueType>( 1 ) ) );
+    }
+  return numberOfThreads;
+}
+
+template <class TOutputMesh>
+bool
+LabeledPointSetFileReader<TOutputMesh>
+::GetRegionForThread( const ImageRegionType & region, ThreadIdType threadId, ThreadIdType numberOfThreads,
+                      ImageRegionType & threadRegion ) const
+{
+  const unsigned int  slabDimension = Dimension - 1;
+  const SizeValueType numberOfSlabs = region.GetSize()[slabDimension];
+  const SizeValueType firstSlab = numberOfSlabs * threadId / numberOfThreads;
+  const SizeValueType endSlab = numberOfSlabs * ( threadId + 1 ) / numberOfThreads;
+  if( firstSlab == endSlab )
+    {
+    return false;
+    }
+
+  threadRegion = region;
+  threadRegion.SetIndex( slabDimension, region.GetIndex()[slabDimension] + static_cast<IndexValueType>( firstSlab ) );
+  threadRegion.SetSize( slabDimension, endSlab - firstSlab );
+  return true;
+}
+
+template <class TOutputMesh>
+ITK_THREAD_RETURN_TYPE
+LabeledPointSetFileReader<TOutputMesh>
+::ImagePointThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ImagePointThreadStruct *         str = static_cast<ImagePointThreadStruct *>( info->UserData );
+
+  str->Reader->ThreadedImagePoints( str, info->ThreadID, info->NumberOfThreads );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TOutputMesh>
+void
+LabeledPointSetFileReader<TOutputMesh>
+::ThreadedImagePoints( ImagePointThreadStruct *str, ThreadIdType threadId, ThreadIdType numberOfThreads ) const
+{
+  ImageRegionType region;
+  if( !this->GetRegionForThread( str->Image->GetLargestPossibleRegion(), threadId, numberOfThreads, region ) )
+    {
+    return;
+    }
+
+  std::vector<PointType> & points = str->Points[threadId];
+  std::vector<PixelType> & labels = str->Labels[threadId];
+
+  ImageRegionConstIteratorWithIndex<LabeledPointSetImageType> It( str->Image, region );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    const PixelType label = It.Get();
+    if( str->PositiveLabelsOnly ? ( label > 0 ) : ( label != NumericTraits<PixelType>::ZeroValue() ) )
+      {
+      typename LabeledPointSetImageType::PointType imagePoint;
+      str->Image->TransformIndexToPhysicalPoint( It.GetIndex(), imagePoint );
+
+      PointType point;
+      point.CastFrom( imagePoint );
+      points.push_back( point );
+      labels.push_back( label );
       }
     }
 }
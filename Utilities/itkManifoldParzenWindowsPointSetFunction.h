@@ -127,6 +127,15 @@ public:
     this->Modified();
   }
 
+  const GaussianType * GetGaussian( unsigned int i ) const
+  {
+    if( i < this->m_Gaussians.size() )
+      {
+      return this->m_Gaussians[i].GetPointer();
+      }
+    return ITK_NULLPTR;
+  }
+
   void SetGaussian( unsigned int i, typename GaussianType::Pointer gaussian )
   {
     if( i >= this->m_Gaussians.size() )
@@ -139,10 +148,15 @@ public:
 
   void GenerateKdTree();
 
+  /**
+   * Evaluate(), GetNeighborhoodIdentifiers() and the const GetGaussian()
+   * only read the kd-tree and the kernels, so once GenerateKdTree() has run
+   * they may be called from several threads at once.
+   */
   NeighborhoodIdentifierType GetNeighborhoodIdentifiers(
-    MeasurementVectorType, unsigned int );
+    MeasurementVectorType, unsigned int ) const;
   NeighborhoodIdentifierType GetNeighborhoodIdentifiers(
-    InputPointType, unsigned int );
+    InputPointType, unsigned int ) const;
 protected:
   ManifoldParzenWindowsPointSetFunction();
   virtual ~ManifoldParzenWindowsPointSetFunction();
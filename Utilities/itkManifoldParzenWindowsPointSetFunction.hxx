@@ -278,7 +278,7 @@ typename ManifoldParzenWindowsPointSetFunction
 <TPointSet, TOutput, TCoordRep>::NeighborhoodIdentifierType
 ManifoldParzenWindowsPointSetFunction<TPointSet, TOutput, TCoordRep>
 ::GetNeighborhoodIdentifiers(
-  MeasurementVectorType point, unsigned int numberOfNeighbors )
+  MeasurementVectorType point, unsigned int numberOfNeighbors ) const
 {
   if( numberOfNeighbors > this->m_KdTreeGenerator->GetOutput()->Size() )
     {
@@ -296,7 +296,7 @@ typename ManifoldParzenWindowsPointSetFunction
 <TPointSet, TOutput, TCoordRep>::NeighborhoodIdentifierType
 ManifoldParzenWindowsPointSetFunction<TPointSet, TOutput, TCoordRep>
 ::GetNeighborhoodIdentifiers(
-  InputPointType point, unsigned int numberOfNeighbors )
+  InputPointType point, unsigned int numberOfNeighbors ) const
 {
   MeasurementVectorType queryPoint( Dimension );
 
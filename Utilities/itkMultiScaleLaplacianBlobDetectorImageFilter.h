@@ -94,7 +94,12 @@ private:
  *
  * Explain notation of scale space used
  *
- *
+ * The scale space is computed incrementally: the Gaussian smoothing of
+ * each scale is the smoothing of the previous scale by the difference
+ * of the variances, and the normalized Laplacian is computed from the
+ * smoothed image.  With UseScaleSpaceDownsampling, the smoothed image is
+ * subsampled by two along the dimensions where the sigma reaches four
+ * voxels, so the large scales are computed and searched on coarser grids.
  *
  * \sa LaplacianRecursiveGaussianImageFilter
  *
@@ -131,6 +136,8 @@ public:
   /** Run-time type information (and related methods). */
   itkTypeMacro(MultiScaleLaplacianBlobDetectorImageFilter, ImageToImageFilter);
 
+  itkStaticConstMacro( ImageDimension, unsigned int, TInputImage::ImageDimension );
+
   /** Typedef to images */
   typedef TInputImage                           InputImageType;
   typedef typename InputImageType::Pointer      InputImagePointer;
@@ -160,6 +167,13 @@ public:
   itkSetMacro( NumberOfBlobs, size_t );
   itkGetMacro( NumberOfBlobs, size_t );
 
+  /** Set/Get whether the large scales are computed on subsampled grids.
+   * Default is on.
+   */
+  itkSetMacro( UseScaleSpaceDownsampling, bool );
+  itkGetMacro( UseScaleSpaceDownsampling, bool );
+  itkBooleanMacro( UseScaleSpaceDownsampling );
+
   /** Set/Get the label image
    */
   itkSetMacro( BlobRadiusImage, BlobRadiusImagePointer );
@@ -194,6 +208,10 @@ protected:
 
   void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId ) ITK_OVERRIDE;
 
+  /** Split the grid of the center Laplacian, which may be coarser than
+   * the output, between the threads of the extrema search. */
+  static ITK_THREAD_RETURN_TYPE ExtremaThreaderCallback( void *arg );
+
 private:
   MultiScaleLaplacianBlobDetectorImageFilter( const Self &); // purposely not implemented
   void operator=( const Self &);                             // purposely not implemented
@@ -244,6 +262,16 @@ public:
 
   typedef std::vector<Blob> BlobHeapType;
 
+  /** Smooth the image of a scale by the variance to the next scale. */
+  RealImagePointer SmoothImage( const RealImageType *image, double variance ) const;
+
+  /** The Laplacian of the smoothed image, normalized across scale. */
+  RealImagePointer ComputeNormalizedLaplacian( const RealImageType *smoothedImage, double sigma ) const;
+
+  /** Subsample the smoothed image of a scale by two along some dimensions. */
+  RealImagePointer ShrinkImage( const RealImageType *smoothedImage,
+                                const typename RealImageType::SizeType & shrinkFactors ) const;
+
   // private member variable go here
   RealImageConstPointer     m_LaplacianImage[3];
   std::vector<BlobHeapType> m_BlobHeapPerThread;
@@ -260,6 +288,7 @@ public:
   unsigned int m_StepsPerOctave;
   double       m_StartT;
   double       m_EndT;
+  bool         m_UseScaleSpaceDownsampling;
 
   BlobRadiusImagePointer m_BlobRadiusImage;
 };
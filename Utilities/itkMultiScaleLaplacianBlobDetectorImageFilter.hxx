@@ -29,10 +29,12 @@
 #include "itkMultiScaleLaplacianBlobDetectorImageFilter.h"
 #include "itkEllipseSpatialObject.h"
 #include "itkCastImageFilter.h"
-#include "itkLaplacianRecursiveGaussianImageFilter.h"
+#include "itkDiscreteGaussianImageFilter.h"
+#include "itkLaplacianImageFilter.h"
 #include "itkNeighborhoodAlgorithm.h"
-#include "itkProgressAccumulator.h"
+#include "itkShrinkImageFilter.h"
 
+#include <algorithm>
 #include <iterator>
 
 namespace itk
@@ -45,6 +47,104 @@ MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
   m_StepsPerOctave = 15;
   m_StartT = 8;
   m_EndT = 128;
+  m_UseScaleSpaceDownsampling = true;
+}
+
+template <class TInputImage>
+typename MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>::RealImagePointer
+MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::SmoothImage( const RealImageType *image, double variance ) const
+{
+  // the kernel must hold the small increments between scales as well as
+  // the first smoothing of the input
+  double minimumSpacing = image->GetSpacing()[0];
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    minimumSpacing = std::min( minimumSpacing, static_cast<double>( image->GetSpacing()[d] ) );
+    }
+  const unsigned int kernelWidth = 2 * static_cast<unsigned int>( std::ceil( 4.0 * std::sqrt( variance ) / minimumSpacing ) ) + 1;
+
+  typedef DiscreteGaussianImageFilter<RealImageType, RealImageType> SmootherType;
+  typename SmootherType::Pointer smoother = SmootherType::New();
+  smoother->SetNumberOfThreads( this->GetNumberOfThreads() );
+  smoother->SetInput( image );
+  smoother->SetVariance( variance );
+  smoother->SetMaximumError( 0.01 );
+  smoother->SetMaximumKernelWidth( std::max( kernelWidth, 32u ) );
+  smoother->SetUseImageSpacing( true );
+  smoother->Update();
+
+  RealImagePointer smoothedImage = smoother->GetOutput();
+  smoothedImage->DisconnectPipeline();
+  return smoothedImage;
+}
+
+template <class TInputImage>
+typename MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>::RealImagePointer
+MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::ComputeNormalizedLaplacian( const RealImageType *smoothedImage, double sigma ) const
+{
+  typedef LaplacianImageFilter<RealImageType, RealImageType> LaplacianFilterType;
+  typename LaplacianFilterType::Pointer laplacianFilter = LaplacianFilterType::New();
+  laplacianFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
+  laplacianFilter->SetInput( smoothedImage );
+  laplacianFilter->SetUseImageSpacing( true );
+  laplacianFilter->Update();
+
+  RealImagePointer laplacianImage = laplacianFilter->GetOutput();
+  laplacianImage->DisconnectPipeline();
+
+  // normalize across scale as LaplacianRecursiveGaussianImageFilter
+  const RealPixelType normalization = static_cast<RealPixelType>( vnl_math_sqr( sigma ) );
+  RealPixelType *     buffer = laplacianImage->GetBufferPointer();
+  const SizeValueType numberOfPixels = laplacianImage->GetPixelContainer()->Size();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    buffer[n] *= normalization;
+    }
+  return laplacianImage;
+}
+
+template <class TInputImage>
+typename MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>::RealImagePointer
+MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::ShrinkImage( const RealImageType *smoothedImage, const typename RealImageType::SizeType & shrinkFactors ) const
+{
+  typedef ShrinkImageFilter<RealImageType, RealImageType> ShrinkFilterType;
+  typename ShrinkFilterType::Pointer shrinker = ShrinkFilterType::New();
+  shrinker->SetNumberOfThreads( this->GetNumberOfThreads() );
+  shrinker->SetInput( smoothedImage );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    shrinker->SetShrinkFactor( d, shrinkFactors[d] );
+    }
+  shrinker->Update();
+
+  RealImagePointer shrunkImage = shrinker->GetOutput();
+  shrunkImage->DisconnectPipeline();
+  return shrunkImage;
+}
+
+template <class TInputImage>
+ITK_THREAD_RETURN_TYPE
+MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::ExtremaThreaderCallback( void *arg )
+{
+  typedef typename Superclass::ThreadStruct ThreadStructType;
+
+  const ThreadIdType threadId = ( (MultiThreader::ThreadInfoStruct *)( arg ) )->ThreadID;
+  const ThreadIdType threadCount = ( (MultiThreader::ThreadInfoStruct *)( arg ) )->NumberOfThreads;
+  ThreadStructType * str = (ThreadStructType *)( ( (MultiThreader::ThreadInfoStruct *)( arg ) )->UserData );
+  Self *             filter = static_cast<Self *>( str->Filter.GetPointer() );
+
+  OutputImageRegionType splitRegion = filter->m_LaplacianImage[1]->GetBufferedRegion();
+  const ThreadIdType    total = filter->GetImageRegionSplitter()->GetSplit( threadId, threadCount, splitRegion );
+  if( threadId < total )
+    {
+    filter->ThreadedGenerateData( splitRegion, threadId );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
 }
 
 template <class TInputImage>
@@ -73,10 +173,6 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
   caster->Update();
   this->GraftOutput( caster->GetOutput() );
 
-  // Create a process accumulator for tracking the progress of minipipeline
-  ProgressAccumulator::Pointer progress = ProgressAccumulator::New();
-  progress->SetMiniPipelineFilter(this);
-
   // prepare one time threaded data
   this->m_BlobHeapPerThread.resize( this->GetNumberOfThreads() );
 
@@ -87,16 +183,19 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
 
   const unsigned int numberOfScales = std::ceil( std::log( std::sqrt( m_EndT ) / initial_sigma ) / std::log( k ) ) + 1.0;
 
-  typedef itk::LaplacianRecursiveGaussianImageFilter<InputImageType, RealImageType> LaplacianFilterType;
-  typename LaplacianFilterType::Pointer laplacianFilter[3];
-  for( unsigned int i = 0; i < 3; ++i )
-    {
-    laplacianFilter[i] = LaplacianFilterType::New();
-    laplacianFilter[i]->SetNumberOfThreads( this->GetNumberOfThreads() );
-    laplacianFilter[i]->SetInput( inputImage );
-    laplacianFilter[i]->SetNormalizeAcrossScale( true );
-    progress->RegisterInternalFilter( laplacianFilter[i],   1.0 / numberOfScales );
-    }
+  typedef itk::CastImageFilter<InputImageType, RealImageType> RealCasterFilterType;
+  typename RealCasterFilterType::Pointer realCaster = RealCasterFilterType::New();
+  realCaster->SetNumberOfThreads( this->GetNumberOfThreads() );
+  realCaster->SetInput( inputImage );
+  realCaster->Update();
+
+  // the smoothed images and their laplacians of the scales i-2, i-1 and i,
+  // all on the grid of scale i
+  RealImagePointer smoothedImage[3];
+  RealImagePointer laplacianImage[3];
+  smoothedImage[2] = realCaster->GetOutput();
+  smoothedImage[2]->DisconnectPipeline();
+  double previousSigma = 0.0;
 
   BlobHeapType blobs;
   m_GlobalMinimalBestBlobValue = itk::NumericTraits<RealPixelType>::NonpositiveMin();
@@ -104,23 +203,59 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
     {
     // simga' = k^i * initial_sigma
     // t = sigma^2
-    const double sigma = initial_sigma * std::pow( k, double( numberOfScales - i - 1 ) );
-    //    const double t = vnl_math_sqr( initial_sigma * std::pow( k, double( numberOfScales - i - 1 ) ) );
+    const double sigma = initial_sigma * std::pow( k, double( i ) );
 
     itkDebugMacro( << "i: " << i << " sigma: " << sigma << " k: " << k );
 
-    // update largest index with new largest sigma
-    laplacianFilter[2]->SetSigma( sigma );
+    // rotate the scales down
+    smoothedImage[0] = smoothedImage[1];
+    smoothedImage[1] = smoothedImage[2];
+    laplacianImage[0] = laplacianImage[1];
+    laplacianImage[1] = laplacianImage[2];
 
-    laplacianFilter[2]->Update();
+    // subsample the previous scales once the sigma spans enough voxels
+    if( this->m_UseScaleSpaceDownsampling && i > 0 )
+      {
+      typename RealImageType::SizeType shrinkFactors;
+      bool                             shrink = false;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        shrinkFactors[d] = 1;
+        if( previousSigma >= 4.0 * smoothedImage[1]->GetSpacing()[d] &&
+            smoothedImage[1]->GetBufferedRegion().GetSize()[d] >= 16 )
+          {
+          shrinkFactors[d] = 2;
+          shrink = true;
+          }
+        }
+      if( shrink )
+        {
+        smoothedImage[1] = this->ShrinkImage( smoothedImage[1], shrinkFactors );
+        laplacianImage[1] = this->ComputeNormalizedLaplacian( smoothedImage[1], previousSigma );
+        if( i > 1 )
+          {
+          smoothedImage[0] = this->ShrinkImage( smoothedImage[0], shrinkFactors );
+          laplacianImage[0] = this->ComputeNormalizedLaplacian( smoothedImage[0], previousSigma / k );
+          }
+        }
+      }
 
-    // wait until all three laplacian filters have run
+    // each scale is the smoothing of the previous one (scale 0 of the input)
+    smoothedImage[2] = this->SmoothImage( smoothedImage[1], vnl_math_sqr( sigma ) - vnl_math_sqr( previousSigma ) );
+    laplacianImage[2] = this->ComputeNormalizedLaplacian( smoothedImage[2], sigma );
+
+    // the smoothed image of scale i-2 is no longer needed
+    smoothedImage[0] = ITK_NULLPTR;
+
+    // wait until all three laplacians are computed
     if( i > 1 )
       {
       // prepare for threaded execution
-      this->m_LaplacianImage[0] = laplacianFilter[0]->GetOutput();
-      this->m_LaplacianImage[1] = laplacianFilter[1]->GetOutput();
-      this->m_LaplacianImage[2] = laplacianFilter[2]->GetOutput();
+      this->m_LaplacianImage[0] = laplacianImage[0];
+      this->m_LaplacianImage[1] = laplacianImage[1];
+      this->m_LaplacianImage[2] = laplacianImage[2];
+      // Current Sigma refers to the center laplacian
+      this->m_CurrentSigma = previousSigma;
       this->m_CurrentProgress = this->GetProgress();
 
       // Set up the multithreaded processing of the outputs
@@ -128,7 +263,7 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
       str.Filter = this;
 
       this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
-      this->GetMultiThreader()->SetSingleMethod( Self::ThreaderCallback, &str );
+      this->GetMultiThreader()->SetSingleMethod( Self::ExtremaThreaderCallback, &str );
 
       // multithread the execution
       this->GetMultiThreader()->SingleMethodExecute();
@@ -160,22 +295,16 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
         threadBlobs.clear();
         }
 
-      // set the minimal value
-      if( !blobs.empty() )
+      // set the minimal value, once there are enough blobs
+      if( !blobs.empty() && blobs.size() >= m_NumberOfBlobs )
         {
         m_GlobalMinimalBestBlobValue = blobs.back().m_Value;
         }
       }
 
-    // circularly rotate laplacian filters down in scale
-    std::swap( laplacianFilter[2], laplacianFilter[1] );
-    std::swap( laplacianFilter[2], laplacianFilter[0] );
-    // Current Sigma refers to the center filter, hence next it'll be
-    // the center
-    m_CurrentSigma = sigma;
+    previousSigma = sigma;
 
-    // after each pass reset progress to accumulate next iteration
-    progress->ResetFilterProgressAndKeepAccumulatedProgress();
+    this->UpdateProgress( static_cast<float>( i + 1 ) / numberOfScales );
     }
 
   // clean up member variables
@@ -291,9 +420,23 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
 
       if( isUsable )
         {
-        // add blob to thread list
+        // add blob to thread list, at its index of the output grid
+        typename RealImageType::IndexType blobIndex = n1.GetIndex();
+        if( laplacianImage->GetLargestPossibleRegion() != outputImage->GetLargestPossibleRegion() )
+          {
+          typename InputImageType::PointType point;
+          laplacianImage->TransformIndexToPhysicalPoint( n1.GetIndex(), point );
+          outputImage->TransformPhysicalPointToIndex( point, blobIndex );
+          const OutputImageRegionType & outputRegion = outputImage->GetBufferedRegion();
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            blobIndex[d] = std::max( blobIndex[d], outputRegion.GetIndex()[d] );
+            blobIndex[d] = std::min( blobIndex[d], static_cast<IndexValueType>( outputRegion.GetIndex()[d]
+                                                                               + outputRegion.GetSize()[d] - 1 ) );
+            }
+          }
 
-        Blob blob(  n1.GetIndex(), m_CurrentSigma, center );
+        Blob blob( blobIndex, m_CurrentSigma, center );
 
         // maintain a minimum heap ( first element is less than all
         // others) no greater then the target number of blobs
@@ -301,8 +444,13 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
           {
           blobHeap.push_back( blob );
           std::push_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+
+          if( blobHeap.size() == m_NumberOfBlobs )
+            {
+            localMinimalBestBlobValue = std::max( localMinimalBestBlobValue, blobHeap.front().m_Value );
+            }
           }
-        else if( blob.m_Value > localMinimalBestBlobValue )
+        else if( blob.m_Value > blobHeap.front().m_Value )
           {
           std::pop_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
           blobHeap.back() = blob;
@@ -16,13 +16,19 @@
 
 #include "itkImageToImageFilter.h"
 
+#include "itkBSplineControlPointLatticeAccumulator.h"
 #include "itkBSplineScatteredDataPointSetToImageFilter.h"
+#include "itkMultiThreader.h"
 #include "itkPointSet.h"
+#include "itkSimpleFastMutexLock.h"
 #include "itkSingleValuedCostFunction.h"
 #include "itkVector.h"
 
 #include "vnl/vnl_vector.h"
 
+#include <string>
+#include <vector>
+
 namespace itk
 {
 /** \class N3MRIBiasFieldCorrectionImageFilter.h
@@ -61,6 +67,10 @@ namespace itk
  *     See the IJ article and the test file for an example.
  *  5. The 'Z' parameter in Sled's 1998 paper is the square root
  *     of the class variable 'm_WeinerFilterNoise'.
+ *  6. The histogram, the sharpening and the b-spline fitting of each
+ *     iteration are threaded over chunks of the image which only depend on
+ *     its size.  The results of the chunks are combined in order, so the
+ *     output does not depend on the number of threads.
  *
  * \author Nicholas J. Tustison
  *
@@ -174,6 +184,8 @@ public:
   typedef typename
     BSplineFilterType::PointDataImageType            BiasFieldControlPointLatticeType;
   typedef typename BSplineFilterType::ArrayType ArrayType;
+  typedef BSplineControlPointLatticeAccumulator
+    <ScalarImageType>                                LatticeAccumulatorType;
 
   void SetMaskImage( const MaskImageType *mask )
   {
@@ -280,6 +292,33 @@ private:
   RealType CalculateOptimalBiasFieldScaling(
     typename RealImageType::Pointer );
 
+  /**
+   * The tasks which are threaded over the chunks of m_ChunkImage, each
+   * chunk being a slab of its last dimension.
+   */
+  typedef enum { HistogramRangeTask, HistogramTask, SharpenTask, FitTask } ChunkTaskType;
+
+  struct ChunkThreadStruct
+    {
+    Self *              Filter;
+    ChunkTaskType       Task;
+    unsigned int        NextChunk;
+    SimpleFastMutexLock Mutex;
+    std::string         ErrorMessage;
+    };
+
+  static ITK_THREAD_RETURN_TYPE ChunkThreaderCallback( void *arg );
+
+  void RunChunkTask( ChunkTaskType task );
+
+  void ProcessChunk( ChunkTaskType task, unsigned int chunk );
+
+  unsigned int GetNumberOfChunks() const;
+
+  typename RealImageType::RegionType GetChunkRegion( unsigned int chunk ) const;
+
+  bool IsInsideMask( const typename RealImageType::IndexType & index ) const;
+
   /**
    * Parameters for deconvolution with Weiner filter
    */
@@ -309,6 +348,19 @@ private:
    */
   RealType m_BiasFieldScaling;
   bool     m_UseOptimalBiasFieldScaling;
+
+  /**
+   * state of the chunk tasks
+   */
+  typename RealImageType::Pointer                      m_ChunkImage;
+  std::vector<RealType>                                m_ChunkMinima;
+  std::vector<RealType>                                m_ChunkMaxima;
+  std::vector<vnl_vector<RealType> >                   m_ChunkHistograms;
+  RealType                                             m_HistogramMinimum;
+  RealType                                             m_HistogramSlope;
+  vnl_vector<RealType>                                 m_IntensityMapping;
+  typename RealImageType::Pointer                      m_SharpenedImage;
+  std::vector<typename LatticeAccumulatorType::Pointer> m_ChunkAccumulators;
 }; // end of class
 } // end namespace itk
 
@@ -23,6 +23,7 @@
 #include "itkIterationReporter.h"
 #include "itkLBFGSBOptimizer.h"
 #include "itkLogImageFilter.h"
+#include "itkMutexLockHolder.h"
 #include "itkSubtractImageFilter.h"
 
 #include "vnl/algo/vnl_fft_1d.h"
@@ -186,6 +187,9 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
 
   this->m_UseOptimalBiasFieldScaling = true;
   this->m_BiasFieldScaling = 1.0;
+
+  this->m_HistogramMinimum = 0.0;
+  this->m_HistogramSlope = 1.0;
 }
 
 template <class TInputImage, class TMaskImage, class TOutputImage>
@@ -321,61 +325,31 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
    * in real space are denoted by a single uppercase letter whereas their
    * frequency counterparts are indicated by a trailing lowercase 'f'.
    */
+  this->m_ChunkImage = unsharpenedImage;
+
+  this->RunChunkTask( HistogramRangeTask );
   RealType binMaximum = NumericTraits<RealType>::NonpositiveMin();
   RealType binMinimum = NumericTraits<RealType>::max();
-
-  ImageRegionIterator<RealImageType> ItU( unsharpenedImage,
-                                          unsharpenedImage->GetLargestPossibleRegion() );
-  for( ItU.GoToBegin(); !ItU.IsAtEnd(); ++ItU )
+  for( unsigned int c = 0; c < this->GetNumberOfChunks(); c++ )
     {
-    if( ( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( ItU.GetIndex() ) != NumericTraits<MaskPixelType>::ZeroValue() )
-        && ( !this->GetConfidenceImage() ||
-             this->GetConfidenceImage()->GetPixel( ItU.GetIndex() ) > 0.0 ) )
-      {
-      RealType pixel = ItU.Get();
-      if( pixel > binMaximum )
-        {
-        binMaximum = pixel;
-        }
-      else if( pixel < binMinimum )
-        {
-        binMinimum = pixel;
-        }
-      }
+    binMaximum = vnl_math_max( binMaximum, this->m_ChunkMaxima[c] );
+    binMinimum = vnl_math_min( binMinimum, this->m_ChunkMinima[c] );
     }
   RealType histogramSlope = ( binMaximum - binMinimum )
     / static_cast<RealType>( this->m_NumberOfHistogramBins - 1 );
+  this->m_HistogramMinimum = binMinimum;
+  this->m_HistogramSlope = histogramSlope;
 
   /**
    * Create the intensity profile (within the masked region, if applicable)
-   * using a triangular parzen windowing scheme.
+   * using a triangular parzen windowing scheme.  The histograms of the
+   * chunks are added in order.
    */
+  this->RunChunkTask( HistogramTask );
   vnl_vector<RealType> H( this->m_NumberOfHistogramBins, 0.0 );
-  for( ItU.GoToBegin(); !ItU.IsAtEnd(); ++ItU )
+  for( unsigned int c = 0; c < this->GetNumberOfChunks(); c++ )
     {
-    if( ( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( ItU.GetIndex() ) != NumericTraits<MaskPixelType>::ZeroValue() )
-        && ( !this->GetConfidenceImage() ||
-             this->GetConfidenceImage()->GetPixel( ItU.GetIndex() ) > 0.0 ) )
-      {
-      RealType pixel = ItU.Get();
-
-      float cidx = ( static_cast<RealType>( pixel ) - binMinimum )
-        / histogramSlope;
-      unsigned int idx = vnl_math_floor( cidx );
-      RealType     offset = cidx - static_cast<RealType>( idx );
-
-      if( offset == 0.0 )
-        {
-        H[idx] += 1.0;
-        }
-      else if( idx < this->m_NumberOfHistogramBins - 1 )
-        {
-        H[idx] += 1.0 - offset;
-        H[idx + 1] += offset;
-        }
-      }
+    H += this->m_ChunkHistograms[c];
     }
 
   /**
@@ -503,35 +477,13 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
   /**
    * Sharpen the image with the new mapping, E(u|v)
    */
-  typename RealImageType::Pointer sharpenedImage =
-    AllocImage<RealImageType>(unsharpenedImage, 0.0);
+  this->m_IntensityMapping = E;
+  this->m_SharpenedImage = AllocImage<RealImageType>( unsharpenedImage, 0.0 );
+  this->RunChunkTask( SharpenTask );
 
-  ImageRegionIterator<RealImageType> ItC( sharpenedImage,
-                                          sharpenedImage->GetLargestPossibleRegion() );
-  for( ItU.GoToBegin(), ItC.GoToBegin(); !ItU.IsAtEnd(); ++ItU, ++ItC )
-    {
-    if( ( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( ItU.GetIndex() ) != NumericTraits<MaskPixelType>::ZeroValue() )
-        && ( !this->GetConfidenceImage() ||
-             this->GetConfidenceImage()->GetPixel( ItU.GetIndex() ) > 0.0 ) )
-      {
-      float        cidx = ( ItU.Get() - binMinimum ) / histogramSlope;
-      unsigned int idx = vnl_math_floor( cidx );
-
-      RealType correctedPixel = 0;
-      if( idx < E.size() - 1 )
-        {
-        correctedPixel = E[idx] + ( E[idx + 1] - E[idx] )
-          * ( cidx - static_cast<RealType>( idx ) );
-        }
-      else
-        {
-        correctedPixel = E[E.size() - 1];
-        }
-
-      ItC.Set( correctedPixel );
-      }
-    }
+  typename RealImageType::Pointer sharpenedImage = this->m_SharpenedImage;
+  this->m_SharpenedImage = ITK_NULLPTR;
+  this->m_ChunkImage = ITK_NULLPTR;
 
   return sharpenedImage;
 }
@@ -554,63 +506,48 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
   identity.SetIdentity();
   fieldEstimate->SetDirection( identity );
 
-  typename PointSetType::Pointer fieldPoints = PointSetType::New();
-  fieldPoints->Initialize();
-
-  typename BSplineFilterType::WeightsContainerType::Pointer weights =
-    BSplineFilterType::WeightsContainerType::New();
-  weights->Initialize();
+  typename LatticeAccumulatorType::Pointer bspliner = LatticeAccumulatorType::New();
+  bspliner->SetOrigin( fieldEstimate->GetOrigin() );
+  bspliner->SetSpacing( fieldEstimate->GetSpacing() );
+  bspliner->SetSize( fieldEstimate->GetLargestPossibleRegion().GetSize() );
+  bspliner->SetDirection( direction );
+  bspliner->SetNumberOfLevels( this->m_NumberOfFittingLevels );
+  bspliner->SetSplineOrder( this->m_SplineOrder );
+  bspliner->SetNumberOfControlPoints( this->m_NumberOfControlPoints );
 
-  ImageRegionConstIteratorWithIndex<RealImageType>
-               It( fieldEstimate, fieldEstimate->GetRequestedRegion() );
-  unsigned int N = 0;
-  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+  /**
+   * Each chunk adds its voxels to its own lattices, which are merged in
+   * order at the end of each fitting level.
+   */
+  this->m_ChunkImage = fieldEstimate;
+  for( unsigned int level = 0; level < bspliner->GetMaximumNumberOfLevels(); level++ )
     {
-    if( ( !this->GetMaskImage() ||
-          this->GetMaskImage()->GetPixel( It.GetIndex() ) != NumericTraits<MaskPixelType>::ZeroValue() )
-        && ( !this->GetConfidenceImage() ||
-             this->GetConfidenceImage()->GetPixel( It.GetIndex() ) > 0.0 ) )
-      {
-      typename PointSetType::PointType point;
-      fieldEstimate->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-
-      ScalarType scalar;
-      scalar[0] = It.Get();
+    bspliner->InitializeLevel( level );
 
-      fieldPoints->SetPointData( N, scalar );
-      fieldPoints->SetPoint( N, point );
-      if( this->GetConfidenceImage() )
-        {
-        weights->InsertElement( N,
-                                this->GetConfidenceImage()->GetPixel( It.GetIndex() ) );
-        }
-      else
-        {
-        weights->InsertElement( N, 1.0 );
-        }
-      N++;
+    this->m_ChunkAccumulators.clear();
+    for( unsigned int c = 0; c < this->GetNumberOfChunks(); c++ )
+      {
+      this->m_ChunkAccumulators.push_back( bspliner->NewThreadAccumulator() );
+      }
+    this->RunChunkTask( FitTask );
+    for( unsigned int c = 0; c < this->GetNumberOfChunks(); c++ )
+      {
+      bspliner->Merge( this->m_ChunkAccumulators[c] );
       }
+    this->m_ChunkAccumulators.clear();
+
+    bspliner->FinalizeLevel();
     }
+  this->m_ChunkImage = ITK_NULLPTR;
   fieldEstimate->SetDirection( direction );
 
-  typename BSplineFilterType::Pointer bspliner = BSplineFilterType::New();
-  bspliner->SetOrigin( fieldEstimate->GetOrigin() );
-  bspliner->SetSpacing( fieldEstimate->GetSpacing() );
-  bspliner->SetSize( fieldEstimate->GetLargestPossibleRegion().GetSize() );
-  bspliner->SetDirection( fieldEstimate->GetDirection() );
-  bspliner->SetGenerateOutputImage( true );
-  bspliner->SetNumberOfLevels( this->m_NumberOfFittingLevels );
-  bspliner->SetSplineOrder( this->m_SplineOrder );
-  bspliner->SetNumberOfControlPoints( this->m_NumberOfControlPoints );
-  bspliner->SetInput( fieldPoints );
-  bspliner->SetPointWeights( weights );
-  bspliner->Update();
+  typename ScalarImageType::Pointer bsplineImage = bspliner->GenerateOutputImage();
 
   /**
    * Save the bias field control points in case the user wants to
    * reconstruct the bias field.
    */
-  this->m_LogBiasFieldControlPointLattice = bspliner->GetPhiLattice();
+  this->m_LogBiasFieldControlPointLattice = bspliner->GetModifiableControlPointLattice();
 
   typename RealImageType::Pointer smoothField =
     AllocImage<RealImageType>(fieldEstimate->GetLargestPossibleRegion() );
@@ -618,8 +555,8 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
   smoothField->SetSpacing( fieldEstimate->GetSpacing() );
   smoothField->SetDirection( direction );
 
-  ImageRegionIterator<ScalarImageType> ItB( bspliner->GetOutput(),
-                                            bspliner->GetOutput()->GetLargestPossibleRegion() );
+  ImageRegionIterator<ScalarImageType> ItB( bsplineImage,
+                                            bsplineImage->GetLargestPossibleRegion() );
   ImageRegionIterator<RealImageType> ItF( smoothField,
                                           smoothField->GetLargestPossibleRegion() );
   for( ItB.GoToBegin(), ItF.GoToBegin(); !ItB.IsAtEnd(); ++ItB, ++ItF )
@@ -630,6 +567,222 @@ N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
   return smoothField;
 }
 
+template <class TInputImage, class TMaskImage, class TOutputImage>
+bool
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::IsInsideMask( const typename RealImageType::IndexType & index ) const
+{
+  return ( !this->GetMaskImage() ||
+           this->GetMaskImage()->GetPixel( index ) != NumericTraits<MaskPixelType>::ZeroValue() )
+         && ( !this->GetConfidenceImage() ||
+              this->GetConfidenceImage()->GetPixel( index ) > 0.0 );
+}
+
+template <class TInputImage, class TMaskImage, class TOutputImage>
+unsigned int
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::GetNumberOfChunks() const
+{
+  // up to 32 slabs; the chunks must not depend on the number of threads
+  const SizeValueType numberOfSlices =
+    this->m_ChunkImage->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  return static_cast<unsigned int>( std::min( numberOfSlices, static_cast<SizeValueType>( 32 ) ) );
+}
+
+template <class TInputImage, class TMaskImage, class TOutputImage>
+typename N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>::RealImageType::RegionType
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::GetChunkRegion( unsigned int chunk ) const
+{
+  typename RealImageType::RegionType region = this->m_ChunkImage->GetLargestPossibleRegion();
+
+  const SizeValueType numberOfSlices = region.GetSize()[ImageDimension - 1];
+  const SizeValueType numberOfChunks = this->GetNumberOfChunks();
+  const SizeValueType begin = numberOfSlices * chunk / numberOfChunks;
+  const SizeValueType end = numberOfSlices * ( chunk + 1 ) / numberOfChunks;
+
+  region.SetIndex( ImageDimension - 1, region.GetIndex()[ImageDimension - 1] + static_cast<IndexValueType>( begin ) );
+  region.SetSize( ImageDimension - 1, end - begin );
+  return region;
+}
+
+template <class TInputImage, class TMaskImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::ChunkThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *threadInfo = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ChunkThreadStruct *              str = static_cast<ChunkThreadStruct *>( threadInfo->UserData );
+
+  const unsigned int numberOfChunks = str->Filter->GetNumberOfChunks();
+  while( true )
+    {
+    unsigned int chunk = 0;
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      if( str->NextChunk >= numberOfChunks || !str->ErrorMessage.empty() )
+        {
+        break;
+        }
+      chunk = str->NextChunk++;
+      }
+
+    try
+      {
+      str->Filter->ProcessChunk( str->Task, chunk );
+      }
+    catch( ExceptionObject & err )
+      {
+      MutexLockHolder<SimpleFastMutexLock> holder( str->Mutex );
+      str->ErrorMessage = err.GetDescription();
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TMaskImage, class TOutputImage>
+void
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::RunChunkTask( ChunkTaskType task )
+{
+  const unsigned int numberOfChunks = this->GetNumberOfChunks();
+  if( task == HistogramRangeTask )
+    {
+    this->m_ChunkMinima.assign( numberOfChunks, NumericTraits<RealType>::max() );
+    this->m_ChunkMaxima.assign( numberOfChunks, NumericTraits<RealType>::NonpositiveMin() );
+    }
+  else if( task == HistogramTask )
+    {
+    this->m_ChunkHistograms.assign( numberOfChunks, vnl_vector<RealType>( this->m_NumberOfHistogramBins, 0.0 ) );
+    }
+
+  ChunkThreadStruct str;
+  str.Filter = this;
+  str.Task = task;
+  str.NextChunk = 0;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( this->GetNumberOfThreads(),
+                                                    static_cast<ThreadIdType>( numberOfChunks ) ),
+                                          static_cast<ThreadIdType>( 1 ) ) );
+  threader->SetSingleMethod( Self::ChunkThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  if( !str.ErrorMessage.empty() )
+    {
+    itkExceptionMacro( << str.ErrorMessage );
+    }
+}
+
+template <class TInputImage, class TMaskImage, class TOutputImage>
+void
+N3MRIBiasFieldCorrectionImageFilter<TInputImage, TMaskImage, TOutputImage>
+::ProcessChunk( ChunkTaskType task, unsigned int chunk )
+{
+  const typename RealImageType::RegionType region = this->GetChunkRegion( chunk );
+
+  ImageRegionConstIteratorWithIndex<RealImageType> It( this->m_ChunkImage, region );
+  switch( task )
+    {
+    case HistogramRangeTask:
+      {
+      RealType binMaximum = NumericTraits<RealType>::NonpositiveMin();
+      RealType binMinimum = NumericTraits<RealType>::max();
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        if( this->IsInsideMask( It.GetIndex() ) )
+          {
+          const RealType pixel = It.Get();
+          binMaximum = vnl_math_max( binMaximum, pixel );
+          binMinimum = vnl_math_min( binMinimum, pixel );
+          }
+        }
+      this->m_ChunkMaxima[chunk] = binMaximum;
+      this->m_ChunkMinima[chunk] = binMinimum;
+      }
+      break;
+    case HistogramTask:
+      {
+      vnl_vector<RealType> & H = this->m_ChunkHistograms[chunk];
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        if( this->IsInsideMask( It.GetIndex() ) )
+          {
+          RealType pixel = It.Get();
+
+          float cidx = ( static_cast<RealType>( pixel ) - this->m_HistogramMinimum )
+            / this->m_HistogramSlope;
+          unsigned int idx = vnl_math_floor( cidx );
+          RealType     offset = cidx - static_cast<RealType>( idx );
+
+          if( offset == 0.0 )
+            {
+            H[idx] += 1.0;
+            }
+          else if( idx < this->m_NumberOfHistogramBins - 1 )
+            {
+            H[idx] += 1.0 - offset;
+            H[idx + 1] += offset;
+            }
+          }
+        }
+      }
+      break;
+    case SharpenTask:
+      {
+      const vnl_vector<RealType> & E = this->m_IntensityMapping;
+
+      ImageRegionIterator<RealImageType> ItC( this->m_SharpenedImage, region );
+      for( It.GoToBegin(), ItC.GoToBegin(); !It.IsAtEnd(); ++It, ++ItC )
+        {
+        if( this->IsInsideMask( It.GetIndex() ) )
+          {
+          float        cidx = ( It.Get() - this->m_HistogramMinimum ) / this->m_HistogramSlope;
+          unsigned int idx = vnl_math_floor( cidx );
+
+          RealType correctedPixel = 0;
+          if( idx < E.size() - 1 )
+            {
+            correctedPixel = E[idx] + ( E[idx + 1] - E[idx] )
+              * ( cidx - static_cast<RealType>( idx ) );
+            }
+          else
+            {
+            correctedPixel = E[E.size() - 1];
+            }
+
+          ItC.Set( correctedPixel );
+          }
+        }
+      }
+      break;
+    case FitTask:
+      {
+      LatticeAccumulatorType *accumulator = this->m_ChunkAccumulators[chunk];
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+        {
+        if( this->IsInsideMask( It.GetIndex() ) )
+          {
+          typename LatticeAccumulatorType::PointType point;
+          this->m_ChunkImage->TransformIndexToPhysicalPoint( It.GetIndex(), point );
+
+          ScalarType scalar;
+          scalar[0] = It.Get();
+
+          RealType weight = 1.0;
+          if( this->GetConfidenceImage() )
+            {
+            weight = this->GetConfidenceImage()->GetPixel( It.GetIndex() );
+            }
+          accumulator->AddPoint( point, scalar, weight );
+          }
+        }
+      }
+      break;
+    }
+}
+
 template <class TInputImage, class TMaskImage, class TOutputImage>
 typename N3MRIBiasFieldCorrectionImageFilter
 <TInputImage, TMaskImage, TOutputImage>::RealType
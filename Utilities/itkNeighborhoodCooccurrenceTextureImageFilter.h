@@ -0,0 +1,109 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkNeighborhoodCooccurrenceTextureImageFilter_h
+#define __itkNeighborhoodCooccurrenceTextureImageFilter_h
+
+#include "itkMovingHistogramImageFilter.h"
+#include "itkTextureHistogram.h"
+
+namespace itk
+{
+/**
+ * \class NeighborhoodCooccurrenceTextureImageFilter
+ * \brief Compute co-occurrence (Haralick) texture features in a neighborhood
+ * at each pixel
+ *
+ * The input is a vector image holding, at each pixel, its gray level bin
+ * followed by the bins of its neighbors at each of the co-occurrence offsets
+ * (see Function::CooccurrenceTextureHistogram).  The output has one
+ * component per feature.
+ *
+ * \ingroup ITK-TextureAnalysis
+ */
+
+template< class TInputImage, class TOutputImage, class TKernel >
+class ITK_EXPORT NeighborhoodCooccurrenceTextureImageFilter:
+  public MovingHistogramImageFilter< TInputImage,
+                                     TOutputImage,
+                                     TKernel,
+                                     typename Function::CooccurrenceTextureHistogram< typename TInputImage::PixelType,
+                                                                          typename TOutputImage::PixelType > >
+{
+public:
+  /** Standard class typedefs. */
+  typedef NeighborhoodCooccurrenceTextureImageFilter Self;
+  typedef MovingHistogramImageFilter< TInputImage, TOutputImage, TKernel,
+    typename Function::CooccurrenceTextureHistogram< typename TInputImage::PixelType,  typename TOutputImage::PixelType> >  Superclass;
+  typedef SmartPointer< Self >       Pointer;
+  typedef SmartPointer< const Self > ConstPointer;
+
+  /** Standard New method. */
+  itkNewMacro(Self);
+
+  /** Runtime information support. */
+  itkTypeMacro( NeighborhoodCooccurrenceTextureImageFilter, MovingHistogramImageFilter );
+
+  /** Image related typedefs. */
+  typedef TInputImage                                InputImageType;
+  typedef TOutputImage                               OutputImageType;
+  typedef typename TInputImage::RegionType           RegionType;
+  typedef typename TInputImage::SizeType             SizeType;
+  typedef typename TInputImage::IndexType            IndexType;
+  typedef typename TInputImage::PixelType            PixelType;
+  typedef typename TInputImage::OffsetType           OffsetType;
+  typedef typename Superclass::OutputImageRegionType OutputImageRegionType;
+  typedef typename TOutputImage::PixelType           OutputPixelType;
+
+  /** Image related typedefs. */
+  itkStaticConstMacro( ImageDimension, unsigned int, TInputImage::ImageDimension );
+protected:
+
+  unsigned int GetNumberOfOutputComponents() { return 6; }
+
+  NeighborhoodCooccurrenceTextureImageFilter()
+  {
+  //this->m_Boundary = NumericTraits< PixelType >::max();
+  }
+
+  void GenerateOutputInformation() ITK_OVERRIDE
+  {
+    // this methods is overloaded so that if the output image is a
+    // VectorImage then the correct number of components are set.
+
+    Superclass::GenerateOutputInformation();
+    OutputImageType* output = this->GetOutput();
+
+    if ( !output )
+      {
+      return;
+      }
+    if ( output->GetNumberOfComponentsPerPixel() != this->GetNumberOfOutputComponents() )
+      {
+      output->SetNumberOfComponentsPerPixel( this->GetNumberOfOutputComponents() );
+      }
+  }
+
+
+  ~NeighborhoodCooccurrenceTextureImageFilter() {}
+private:
+  NeighborhoodCooccurrenceTextureImageFilter(const Self &); //purposely not implemented
+  void operator=(const Self &);                  //purposely not implemented
+};                                               // end of class
+} // end namespace itk
+
+#endif
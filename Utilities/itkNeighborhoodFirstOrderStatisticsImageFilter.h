@@ -67,7 +67,7 @@ public:
   itkStaticConstMacro( ImageDimension, unsigned int, TInputImage::ImageDimension );
 protected:
 
-  unsigned int GetNumberOfOutputComponents() { return 8; }
+  unsigned int GetNumberOfOutputComponents() { return 9; }
 
   NeighborhoodFirstOrderStatisticsImageFilter()
   {
@@ -17,6 +17,9 @@
 #include "itkNumericTraits.h"
 #include "itkImageToImageFilter.h"
 #include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -29,7 +32,12 @@ namespace itk
  * appears more in focus.
  *
  * \par The OptimalSharpening at each pixel location is computed by
- * convolution with the itk::LaplacianOperator.
+ * convolution with the itk::LaplacianOperator (zero flux boundary).  The
+ * Laplacian is rescaled to the input range, SValue times it is subtracted
+ * from the input, the mean intensity is restored and the result is clamped
+ * to the input range.  The Laplacian is computed on the fly in two threaded
+ * passes, one for the ranges and means and one for the output, so no
+ * intermediate image is held.
  *
  * \par Inputs and Outputs
  * The input to this filter is a scalar-valued itk::Image of arbitrary
@@ -120,11 +128,8 @@ protected:
   {
   }
 
-  /** Standard pipeline method. While this class does not implement a
-   * ThreadedGenerateData(), its GenerateData() delegates all
-   * calculations to an NeighborhoodOperatorImageFilter.  Since the
-   * NeighborhoodOperatorImageFilter is multithreaded, this filter is
-   * multithreaded by default.   */
+  /** Standard pipeline method.  The two passes are run over slabs of
+   * the output requested region along its last dimension. */
   void GenerateData();
 
   void PrintSelf(std::ostream &, Indent) const;
@@ -132,6 +137,38 @@ private:
   OptimalSharpeningImageFilter(const Self &); // purposely not implemented
   void operator=(const Self &);               // purposely not implemented
 
+  typedef typename TOutputImage::RegionType OutputImageRegionType;
+
+  struct ThreadStruct
+    {
+    typedef enum { Statistics = 0, Sharpen } PassType;
+
+    PassType               Pass;
+    const InputImageType * Input;
+    OutputImageType *      Output;
+    OutputImageRegionType  Region;
+    double                 SquaredScalings[ImageDimension];
+    ThreadIdType           NumberOfThreads;
+
+    // per thread statistics of the Statistics pass
+    std::vector<double> InputMinimum;
+    std::vector<double> InputMaximum;
+    std::vector<double> LaplacianMinimum;
+    std::vector<double> LaplacianMaximum;
+    std::vector<double> InputSum;
+    std::vector<double> LaplacianSum;
+
+    // the Sharpen pass: input - SValue * ( Scale * laplacian + Shift ) + MeanShift
+    double Scale;
+    double Shift;
+    double SValue;
+    double MeanShift;
+    double Minimum;
+    double Maximum;
+    };
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg );
+
   bool  m_UseImageSpacing;
   float m_SValue;
 };
@@ -15,12 +15,7 @@
 #define __itkOptimalSharpeningImageFilter_hxx
 #include "itkOptimalSharpeningImageFilter.h"
 
-#include "itkNeighborhoodOperatorImageFilter.h"
 #include "itkLaplacianOperator.h"
-#include "itkZeroFluxNeumannBoundaryCondition.h"
-#include "itkProgressAccumulator.h"
-#include "itkMinimumMaximumImageCalculator.h"
-#include "itkImageRegionIterator.h"
 
 namespace itk
 {
@@ -93,157 +88,197 @@ void
 OptimalSharpeningImageFilter<TInputImage, TOutputImage>
 ::GenerateData()
 {
-  // Create the Laplacian operator
-  LaplacianOperator<RealType, ImageDimension> oper;
-  double                                      s[ImageDimension];
+  ThreadStruct str;
+
+  str.Input = this->GetInput();
   for( unsigned i = 0; i < ImageDimension; i++ )
     {
-    if( this->GetInput()->GetSpacing()[i] == 0.0 )
+    if( str.Input->GetSpacing()[i] == 0.0 )
       {
       itkExceptionMacro( << "Image spacing cannot be zero" );
       }
-    else
-      {
-      s[i] = 1.0 / this->GetInput()->GetSpacing()[i];
-      }
+    const double scaling = this->m_UseImageSpacing ? 1.0 / str.Input->GetSpacing()[i] : 1.0;
+    str.SquaredScalings[i] = scaling * scaling;
     }
-  oper.SetDerivativeScalings( s );
-  oper.CreateOperator();
 
-  // do calculations in floating point
-  typedef Image<RealType, ImageDimension>                                RealImageType;
-  typedef NeighborhoodOperatorImageFilter<InputImageType, RealImageType> NOIF;
-  ZeroFluxNeumannBoundaryCondition<InputImageType> nbc;
-
-  typename NOIF::Pointer filter = NOIF::New();
-  filter->OverrideBoundaryCondition(static_cast<typename NOIF::ImageBoundaryConditionPointerType>(&nbc) );
-
-  // Create a process accumulator for tracking the progress of this minipipeline
-  ProgressAccumulator::Pointer progress = ProgressAccumulator::New();
-  progress->SetMiniPipelineFilter(this);
-
-  // Register the filter with the with progress accumulator using
-  // equal weight proportion
-  progress->RegisterInternalFilter(filter, 0.8f);
-
-  //
-  // set up the mini-pipline
-  //
-  filter->SetOperator(oper);
-  filter->SetInput(this->GetInput() );
-  filter->GetOutput()
-  ->SetRequestedRegion( this->GetOutput()->GetRequestedRegion() );
-
-  // execute the mini-pipeline
-  filter->Update();
-
-  // determine how the data will need to scaled to be properly combined
-  typename MinimumMaximumImageCalculator<InputImageType>::Pointer inputCalculator
-    = MinimumMaximumImageCalculator<InputImageType>::New();
-  typename MinimumMaximumImageCalculator<RealImageType>::Pointer filteredCalculator
-    = MinimumMaximumImageCalculator<RealImageType>::New();
-
-  inputCalculator->SetImage(this->GetInput() );
-  inputCalculator->SetRegion(this->GetOutput()->GetRequestedRegion() );
-  inputCalculator->Compute();
-
-  filteredCalculator->SetImage(filter->GetOutput() );
-  filteredCalculator->SetRegion(this->GetOutput()->GetRequestedRegion() );
-  filteredCalculator->Compute();
-
-  RealType inputShift, inputScale, filteredShift, filteredScale;
-  inputShift = static_cast<RealType>(inputCalculator->GetMinimum() );
-  inputScale = static_cast<RealType>(inputCalculator->GetMaximum() )
-    - static_cast<RealType>(inputCalculator->GetMinimum() );
-
-  filteredShift = filteredCalculator->GetMinimum(); // no need to cast
-  filteredScale = filteredCalculator->GetMaximum()
-    - filteredCalculator->GetMinimum();
-
-  ImageRegionIterator<RealImageType>
-  it(filter->GetOutput(), filter->GetOutput()->GetRequestedRegion() );
-  ImageRegionConstIterator<InputImageType>
-  inIt(this->GetInput(), this->GetOutput()->GetRequestedRegion() );
-
-  // combine the input and laplacian images
-  RealType value, invalue;
-  RealType inputSum = 0.0;
-  RealType enhancedSum = 0.0;
-  while( !it.IsAtEnd() )
-    {
-    value = it.Get(); // laplacian value
+  typename TOutputImage::Pointer output = this->GetOutput();
+  output->SetBufferedRegion( output->GetRequestedRegion() );
+  output->Allocate();
 
-    // rescale to [0,1]
-    value = (value - filteredShift) / filteredScale;
+  str.Output = output;
+  str.Region = output->GetRequestedRegion();
+  if( str.Region.GetNumberOfPixels() == 0 )
+    {
+    return;
+    }
 
-    // rescale to the input dynamic range
-    value = value * inputScale + inputShift;
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( vnl_math_max( vnl_math_min( static_cast<SizeValueType>( this->GetNumberOfThreads() ),
+                                                            static_cast<SizeValueType>(
+                                                              str.Region.GetSize()[ImageDimension - 1] ) ),
+                                              static_cast<SizeValueType>( 1 ) ) );
+  str.NumberOfThreads = threader->GetNumberOfThreads();
+  threader->SetSingleMethod( ThreaderCallback, &str );
+
+  // the input and Laplacian ranges and sums
+  str.InputMinimum.assign( str.NumberOfThreads, NumericTraits<double>::max() );
+  str.InputMaximum.assign( str.NumberOfThreads, NumericTraits<double>::NonpositiveMin() );
+  str.LaplacianMinimum.assign( str.NumberOfThreads, NumericTraits<double>::max() );
+  str.LaplacianMaximum.assign( str.NumberOfThreads, NumericTraits<double>::NonpositiveMin() );
+  str.InputSum.assign( str.NumberOfThreads, 0.0 );
+  str.LaplacianSum.assign( str.NumberOfThreads, 0.0 );
+  str.Pass = ThreadStruct::Statistics;
+  threader->SingleMethodExecute();
+
+  double inputMinimum = str.InputMinimum[0];
+  double inputMaximum = str.InputMaximum[0];
+  double laplacianMinimum = str.LaplacianMinimum[0];
+  double laplacianMaximum = str.LaplacianMaximum[0];
+  double inputSum = 0.0;
+  double laplacianSum = 0.0;
+  for( ThreadIdType t = 0; t < str.NumberOfThreads; t++ )
+    {
+    inputMinimum = vnl_math_min( inputMinimum, str.InputMinimum[t] );
+    inputMaximum = vnl_math_max( inputMaximum, str.InputMaximum[t] );
+    laplacianMinimum = vnl_math_min( laplacianMinimum, str.LaplacianMinimum[t] );
+    laplacianMaximum = vnl_math_max( laplacianMaximum, str.LaplacianMaximum[t] );
+    inputSum += str.InputSum[t];
+    laplacianSum += str.LaplacianSum[t];
+    }
 
-    // combine the input and laplacian image (note that we subtract
-    // the laplacian due to the signs in our laplacian kernel).
-    invalue = static_cast<RealType>(inIt.Get() );
-    value = invalue - value * this->m_SValue;
-    it.Set( value );
+  this->UpdateProgress( 0.5 );
 
-    inputSum += invalue;
-    enhancedSum += value;
-    ++it;
-    ++inIt;
-    }
+  // the Laplacian rescaled to the input dynamic range is Scale * L + Shift, so
+  // the mean of the enhanced image follows from the sums without a pass
+  const double numberOfPixels = static_cast<double>( str.Region.GetNumberOfPixels() );
+  str.Scale = ( laplacianMaximum > laplacianMinimum ) ?
+    ( inputMaximum - inputMinimum ) / ( laplacianMaximum - laplacianMinimum ) : 0.0;
+  str.Shift = inputMinimum - laplacianMinimum * str.Scale;
+  str.SValue = this->m_SValue;
+  const double inputMean = inputSum / numberOfPixels;
+  const double enhancedMean = inputMean - str.SValue * ( str.Scale * laplacianSum / numberOfPixels + str.Shift );
+  str.MeanShift = inputMean - enhancedMean;
+  str.Minimum = inputMinimum;
+  str.Maximum = inputMaximum;
 
-  RealType inputMean = inputSum
-    / static_cast<RealType>(this->GetOutput()->GetRequestedRegion()
-                            .GetNumberOfPixels() );
-  RealType enhancedMean = enhancedSum
-    / static_cast<RealType>(this->GetOutput()->GetRequestedRegion()
-                            .GetNumberOfPixels() );
+  str.Pass = ThreadStruct::Sharpen;
+  threader->SingleMethodExecute();
 
   // update progress
-  this->UpdateProgress( 0.9 );
-
-  // copy and cast the output
-  typename TOutputImage::Pointer output = this->GetOutput();
-  output->SetBufferedRegion(output->GetRequestedRegion() );
-  output->Allocate();
+  this->UpdateProgress( 1.0 );
+}
 
-  RealType        inputMinimum = inputCalculator->GetMinimum();
-  RealType        inputMaximum = inputCalculator->GetMaximum();
-  OutputPixelType castInputMinimum
-    = static_cast<OutputPixelType>(inputMinimum);
-  OutputPixelType castInputMaximum
-    = static_cast<OutputPixelType>(inputMaximum);
-
-  ImageRegionIterator<OutputImageType> outIt
-    = ImageRegionIterator<OutputImageType>(output,
-                                           output->GetRequestedRegion() );
-  outIt.GoToBegin();
-  it.GoToBegin();
-  while( !outIt.IsAtEnd() )
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+OptimalSharpeningImageFilter<TInputImage, TOutputImage>
+::ThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStruct *                   str = static_cast<ThreadStruct *>( info->UserData );
+  const ThreadIdType               threadId = info->ThreadID;
+
+  // the slab of the thread along the last dimension
+  OutputImageRegionType region = str->Region;
+  const SizeValueType   lastSize = region.GetSize()[ImageDimension - 1];
+  const SizeValueType   first = lastSize * threadId / str->NumberOfThreads;
+  const SizeValueType   end = lastSize * ( threadId + 1 ) / str->NumberOfThreads;
+  if( first >= end )
     {
-    value = it.Get();
-
-    // adjust value to make the mean intensities before and after match
-    value = value - enhancedMean + inputMean;
-
-    if( value < inputMinimum )
+    return ITK_THREAD_RETURN_VALUE;
+    }
+  region.SetIndex( ImageDimension - 1, region.GetIndex()[ImageDimension - 1] + first );
+  region.SetSize( ImageDimension - 1, end - first );
+
+  const InputInternalPixelType *                   input = str->Input->GetBufferPointer();
+  const typename InputImageType::RegionType &      buffered = str->Input->GetBufferedRegion();
+  const typename InputImageType::OffsetValueType * stride = str->Input->GetOffsetTable();
+
+  double inputMinimum = NumericTraits<double>::max();
+  double inputMaximum = NumericTraits<double>::NonpositiveMin();
+  double laplacianMinimum = NumericTraits<double>::max();
+  double laplacianMaximum = NumericTraits<double>::NonpositiveMin();
+  double inputSum = 0.0;
+  double laplacianSum = 0.0;
+
+  const SizeValueType                     lineLength = region.GetSize()[0];
+  typename OutputImageType::IndexType     lineIndex = region.GetIndex();
+  bool                                    done = false;
+  while( !done )
+    {
+    OffsetValueType lineOffset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
       {
-      outIt.Set( castInputMinimum );
+      lineOffset += ( lineIndex[d] - buffered.GetIndex()[d] ) * stride[d];
       }
-    else if( value > inputMaximum )
+
+    // the neighbors across the line, clamped to the buffer (zero flux)
+    OffsetValueType lower[ImageDimension];
+    OffsetValueType upper[ImageDimension];
+    for( unsigned int d = 1; d < ImageDimension; d++ )
       {
-      outIt.Set( castInputMaximum );
+      const IndexValueType position = lineIndex[d] - buffered.GetIndex()[d];
+      lower[d] = ( position > 0 ) ? -stride[d] : 0;
+      upper[d] = ( position + 1 < static_cast<IndexValueType>( buffered.GetSize()[d] ) ) ? stride[d] : 0;
       }
-    else
+    const IndexValueType lineStart = lineIndex[0] - buffered.GetIndex()[0];
+    const IndexValueType bufferedLength = static_cast<IndexValueType>( buffered.GetSize()[0] );
+
+    OutputInternalPixelType *out = str->Output->GetBufferPointer() + str->Output->ComputeOffset( lineIndex );
+    for( SizeValueType i = 0; i < lineLength; i++ )
       {
-      outIt.Set( static_cast<OutputPixelType>(value) );
+      const InputInternalPixelType *center = input + lineOffset + i;
+      const double                  value = static_cast<double>( *center );
+
+      const IndexValueType position = lineStart + static_cast<IndexValueType>( i );
+      const double         left = static_cast<double>( position > 0 ? center[-1] : *center );
+      const double         right = static_cast<double>( position + 1 < bufferedLength ? center[1] : *center );
+      double               laplacian = str->SquaredScalings[0] * ( left + right - 2.0 * value );
+      for( unsigned int d = 1; d < ImageDimension; d++ )
+        {
+        laplacian += str->SquaredScalings[d]
+          * ( static_cast<double>( center[lower[d]] ) + static_cast<double>( center[upper[d]] ) - 2.0 * value );
+        }
+      laplacian = static_cast<RealType>( laplacian );
+
+      if( str->Pass == ThreadStruct::Statistics )
+        {
+        inputMinimum = vnl_math_min( inputMinimum, value );
+        inputMaximum = vnl_math_max( inputMaximum, value );
+        laplacianMinimum = vnl_math_min( laplacianMinimum, laplacian );
+        laplacianMaximum = vnl_math_max( laplacianMaximum, laplacian );
+        inputSum += value;
+        laplacianSum += laplacian;
+        }
+      else
+        {
+        // subtract the laplacian due to the signs in our laplacian kernel
+        double sharpened = value - str->SValue * ( str->Scale * laplacian + str->Shift ) + str->MeanShift;
+        sharpened = vnl_math_max( str->Minimum, vnl_math_min( str->Maximum, sharpened ) );
+        out[i] = static_cast<OutputInternalPixelType>( sharpened );
+        }
       }
 
-    ++outIt;
-    ++it;
+    // next line of the slab
+    unsigned int d = 1;
+    while( d < ImageDimension
+           && ++lineIndex[d] >= region.GetIndex()[d] + static_cast<IndexValueType>( region.GetSize()[d] ) )
+      {
+      lineIndex[d] = region.GetIndex()[d];
+      d++;
+      }
+    done = ( d >= ImageDimension );
     }
 
-  // update progress
-  this->UpdateProgress( 1.0 );
+  if( str->Pass == ThreadStruct::Statistics )
+    {
+    str->InputMinimum[threadId] = inputMinimum;
+    str->InputMaximum[threadId] = inputMaximum;
+    str->LaplacianMinimum[threadId] = laplacianMinimum;
+    str->LaplacianMaximum[threadId] = laplacianMaximum;
+    str->InputSum[threadId] = inputSum;
+    str->LaplacianSum[threadId] = laplacianSum;
+    }
+  return ITK_THREAD_RETURN_VALUE;
 }
 } // end namespace itk
 
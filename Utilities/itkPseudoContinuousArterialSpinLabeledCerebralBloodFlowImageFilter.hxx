@@ -107,12 +107,6 @@ PseudoContinuousArterialSpinLabeledCerebralBloodFlowImageFilter<TInputImage, TRe
     // account for delay between acquisition of slices
     // const float TI = ( this->m_TI2 - this->m_TI1) + this->m_SliceDelay * (outIt.GetIndex()[2] - 1);
 
-    typename ReferenceImageType::IndexType idx;
-    for ( unsigned int i=0; i<ReferenceImageDimension; i++)
-      {
-      idx[i] = inIt.GetIndex()[i];
-      }
-
     //float ratio = inIt.Value() / this->GetReferenceImage()->GetPixel( idx );
 
 
@@ -19,6 +19,7 @@
 #define __itkPulsedArterialSpinLabeledCerebralBloodFlowImageFilter_h
 
 #include "itkImageToImageFilter.h"
+#include <vector>
 
 namespace itk
 {
@@ -122,6 +123,9 @@ protected:
 
   void PrintSelf(std::ostream & os, Indent indent) const ITK_OVERRIDE;
 
+  /** Compute the scaling of each slice before multi-threading. */
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
   /** PulsedArterialSpinLabeledCerebralBloodFlowImageFilter can be implemented as a multithreaded filter.
    * \sa ImageSource::ThreadedGenerateData(),
    *     ImageSource::GenerateData() */
@@ -142,6 +146,8 @@ private:
   float m_Lambda;
   float m_Alpha;
   float m_SliceDelay;
+
+  std::vector<float> m_SliceScaling;
 };
 } // end namespace itk
 
@@ -21,6 +21,7 @@
 #include "itkPulsedArterialSpinLabeledCerebralBloodFlowImageFilter.h"
 #include "itkProgressReporter.h"
 #include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 
 namespace itk
 {
@@ -81,6 +82,28 @@ PulsedArterialSpinLabeledCerebralBloodFlowImageFilter<TInputImage, TReferenceIma
          ( this->ProcessObject::GetInput(1) );
 }
 
+template <class TInputImage, class TReferenceImage, class TOutputImage>
+void
+PulsedArterialSpinLabeledCerebralBloodFlowImageFilter<TInputImage, TReferenceImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  // the scaling only depends on the slice, through the delay between the
+  // acquisition of slices
+  const InputImageRegionType & largestRegion = this->GetInput()->GetLargestPossibleRegion();
+  const unsigned int           numberOfSlices = largestRegion.GetSize()[2];
+
+  this->m_SliceScaling.resize( numberOfSlices );
+  for( unsigned int n = 0; n < numberOfSlices; n++ )
+    {
+    const float TI = ( this->m_TI2 - this->m_TI1 )
+      + this->m_SliceDelay * ( largestRegion.GetIndex()[2] + n - 1 );
+
+    // 540,000 is a unit conversion to give ml/100g/min
+    this->m_SliceScaling[n] = 5400000.0 * this->m_Lambda
+      / ( 2.0 * this->m_Alpha * this->m_TI1 * std::exp( -TI / this->m_T1blood ) );
+    }
+}
+
 template <class TInputImage, class TReferenceImage, class TOutputImage>
 void
 PulsedArterialSpinLabeledCerebralBloodFlowImageFilter<TInputImage, TReferenceImage, TOutputImage>
@@ -96,33 +119,41 @@ PulsedArterialSpinLabeledCerebralBloodFlowImageFilter<TInputImage, TReferenceIma
   InputImageRegionType inputRegion;
   this->CallCopyOutputRegionToInputRegion(inputRegion, outputRegionForThread);
 
+  // the spatial part of the region, revisited for each time point
+  ReferenceImageRegionType referenceRegion;
+  for( unsigned int i = 0; i < ReferenceImageDimension; i++ )
+    {
+    referenceRegion.SetIndex( i, inputRegion.GetIndex()[i] );
+    referenceRegion.SetSize( i, inputRegion.GetSize()[i] );
+    }
+
   ImageRegionIterator<OutputImageType> outIt(
     this->GetOutput(), outputRegion);
 
   ImageRegionConstIterator<InputImageType> inIt(
     this->GetInput(), inputRegion );
 
+  const ReferenceImageType *reference =
+    static_cast<const ReferenceImageType *>( this->ProcessObject::GetInput(1) );
+  ImageRegionConstIteratorWithIndex<ReferenceImageType> refIt( reference, referenceRegion );
+
+  const typename InputImageType::IndexValueType firstSlice = this->GetInput()->GetLargestPossibleRegion().GetIndex()[2];
+
   while( !outIt.IsAtEnd() )
     {
-    // account for delay between acquisition of slices
-    float TI = ( this->m_TI2 - this->m_TI1)
-      + this->m_SliceDelay * (outIt.GetIndex()[2] - 1);
-
-    typename ReferenceImageType::IndexType idx;
-    for ( unsigned int i=0; i<ReferenceImageDimension; i++)
+    if( refIt.IsAtEnd() )
       {
-      idx[i] = inIt.GetIndex()[i];
+      refIt.GoToBegin();
       }
 
-    float ratio = inIt.Value() / this->GetReferenceImage()->GetPixel( idx );
+    float ratio = inIt.Value() / refIt.Value();
 
-    // 540,000 is a unit conversion to give ml/100g/min
-    float cbf = ratio * 5400000.0 * this->m_Lambda
-      / ( 2.0 * this->m_Alpha * this->m_TI1 * exp( -TI / this->m_T1blood ) );
+    float cbf = ratio * this->m_SliceScaling[refIt.GetIndex()[2] - firstSlice];
 
     outIt.Set( cbf );
     ++outIt;
     ++inIt;
+    ++refIt;
     }
 }
 } // end namespace itk
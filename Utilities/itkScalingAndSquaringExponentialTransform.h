@@ -0,0 +1,100 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkScalingAndSquaringExponentialTransform_h
+#define __itkScalingAndSquaringExponentialTransform_h
+
+#include "itkConstantVelocityFieldTransform.h"
+
+namespace itk
+{
+/** \class ScalingAndSquaringExponentialTransform
+ *
+ * GaussianExponentialDiffeomorphicTransform or
+ * BSplineExponentialDiffeomorphicTransform (the template parameter) whose
+ * velocity field is integrated by ants::ScalingAndSquaring rather than by
+ * ExponentialDisplacementFieldImageFilter.  The number of squarings is that
+ * of the superclass: given by NumberOfIntegrationSteps, or computed from the
+ * maximum norm of the velocity field when it is 0 or
+ * CalculateNumberOfIntegrationStepsAutomatically is on.
+ *
+ * With a VelocityUpdateTolerance greater than 0, set here or with the
+ * environment variable ANTS_EXPONENTIAL_UPDATE_TOLERANCE, the velocity field
+ * and both displacement fields of the last integration are kept.  As long as
+ * the velocity field differs from the kept one by at most the tolerance, in
+ * voxels, the displacement fields are updated to first order,
+ *
+ *   exp( v + dv ) ~ ( Id + dv ) o exp( v ),
+ *   exp( -v - dv ) ~ exp( -v ) o ( Id - dv ),
+ *
+ * one composition each instead of the squarings.  The difference is always
+ * taken from the kept field, so the approximations do not accumulate.  The
+ * default, 0, integrates at every update and keeps nothing.
+ *
+ * The class keeps the name of its superclass, so the transforms written to
+ * disk are read back as the superclass.
+ */
+template <typename TExponentialTransform>
+class ScalingAndSquaringExponentialTransform : public TExponentialTransform
+{
+public:
+  /** Standard class typedefs. */
+  typedef ScalingAndSquaringExponentialTransform Self;
+  typedef TExponentialTransform                  Superclass;
+  typedef SmartPointer<Self>                     Pointer;
+  typedef SmartPointer<const Self>               ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  typedef typename Superclass::ScalarType                   ScalarType;
+  typedef typename Superclass::DisplacementFieldType        DisplacementFieldType;
+  typedef typename Superclass::ConstantVelocityFieldType    ConstantVelocityFieldType;
+  typedef typename Superclass::ConstantVelocityFieldPointer ConstantVelocityFieldPointer;
+
+  /** The largest difference of the velocity fields, in voxels, for which the
+      kept displacement fields are composed rather than integrated again. */
+  itkSetMacro( VelocityUpdateTolerance, ScalarType );
+  itkGetConstMacro( VelocityUpdateTolerance, ScalarType );
+
+  virtual void IntegrateVelocityField() ITK_OVERRIDE;
+
+protected:
+  ScalingAndSquaringExponentialTransform();
+  virtual ~ScalingAndSquaringExponentialTransform()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+private:
+  ScalingAndSquaringExponentialTransform( const Self & ); // purposely not implemented
+  void operator=( const Self & );                         // purposely not implemented
+
+  /** The largest norm, in voxels, of the difference of the velocity field
+      from the kept one, or -1 if the kept one is not on the same grid. */
+  ScalarType ComputeVelocityFieldDifference( const ConstantVelocityFieldType * ) const;
+
+  ScalarType m_VelocityUpdateTolerance;
+
+  ConstantVelocityFieldPointer            m_CachedVelocityField;
+  typename DisplacementFieldType::Pointer m_CachedDisplacementField;
+  typename DisplacementFieldType::Pointer m_CachedInverseDisplacementField;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkScalingAndSquaringExponentialTransform.hxx"
+#endif
+
+#endif
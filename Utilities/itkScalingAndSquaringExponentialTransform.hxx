@@ -0,0 +1,169 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkScalingAndSquaringExponentialTransform_hxx
+#define __itkScalingAndSquaringExponentialTransform_hxx
+
+#include "itkScalingAndSquaringExponentialTransform.h"
+
+#include "antsAllocImage.h"
+#include "antsScalingAndSquaring.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace itk
+{
+template <typename TExponentialTransform>
+ScalingAndSquaringExponentialTransform<TExponentialTransform>
+::ScalingAndSquaringExponentialTransform() :
+  m_VelocityUpdateTolerance( 0.0 )
+{
+  const char *value = std::getenv( "ANTS_EXPONENTIAL_UPDATE_TOLERANCE" );
+  if( value )
+    {
+    this->m_VelocityUpdateTolerance = std::max( static_cast<ScalarType>( std::atof( value ) ),
+                                                NumericTraits<ScalarType>::ZeroValue() );
+    }
+}
+
+template <typename TExponentialTransform>
+void
+ScalingAndSquaringExponentialTransform<TExponentialTransform>
+::IntegrateVelocityField()
+{
+  ConstantVelocityFieldType *velocityField = this->GetModifiableConstantVelocityField();
+  if( velocityField == ITK_NULLPTR )
+    {
+    itkExceptionMacro( "The velocity field does not exist." );
+    }
+
+  if( this->m_VelocityUpdateTolerance > 0.0 )
+    {
+    const ScalarType difference = this->ComputeVelocityFieldDifference( velocityField );
+    if( difference >= 0.0 && difference <= this->m_VelocityUpdateTolerance )
+      {
+      const unsigned int     ImageDimension = ConstantVelocityFieldType::ImageDimension;
+      const SizeValueType    numberOfPixels = velocityField->GetBufferedRegion().GetNumberOfPixels();
+      const typename ConstantVelocityFieldType::PixelType *velocities = velocityField->GetBufferPointer();
+      const typename ConstantVelocityFieldType::PixelType *cachedVelocities =
+        this->m_CachedVelocityField->GetBufferPointer();
+
+      typename DisplacementFieldType::Pointer update = AllocImage<DisplacementFieldType>( velocityField );
+      typename DisplacementFieldType::Pointer negativeUpdate = AllocImage<DisplacementFieldType>( velocityField );
+      for( SizeValueType n = 0; n < numberOfPixels; n++ )
+        {
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          update->GetBufferPointer()[n][d] = velocities[n][d] - cachedVelocities[n][d];
+          negativeUpdate->GetBufferPointer()[n][d] = -update->GetBufferPointer()[n][d];
+          }
+        }
+
+      typename DisplacementFieldType::Pointer displacementField = AllocImage<DisplacementFieldType>( velocityField );
+      ants::ScalingAndSquaring::Compose<DisplacementFieldType>( this->m_CachedDisplacementField, update,
+                                                                displacementField );
+      typename DisplacementFieldType::Pointer inverseDisplacementField =
+        AllocImage<DisplacementFieldType>( velocityField );
+      ants::ScalingAndSquaring::Compose<DisplacementFieldType>( negativeUpdate,
+                                                                this->m_CachedInverseDisplacementField,
+                                                                inverseDisplacementField );
+
+      this->SetDisplacementField( displacementField );
+      this->SetInverseDisplacementField( inverseDisplacementField );
+      return;
+      }
+    }
+
+  // the default maximum of ExponentialDisplacementFieldImageFilter
+  const unsigned int maximumNumberOfSquarings = 20;
+
+  unsigned int numberOfSquarings = this->GetNumberOfIntegrationSteps();
+  if( this->GetCalculateNumberOfIntegrationStepsAutomatically() || numberOfSquarings == 0 )
+    {
+    numberOfSquarings = ants::ScalingAndSquaring::ComputeNumberOfSquarings<ConstantVelocityFieldType>(
+        velocityField, maximumNumberOfSquarings );
+    }
+
+  typename DisplacementFieldType::Pointer displacementField =
+    ants::ScalingAndSquaring::Exponentiate<ConstantVelocityFieldType>( velocityField, numberOfSquarings, false );
+  typename DisplacementFieldType::Pointer inverseDisplacementField =
+    ants::ScalingAndSquaring::Exponentiate<ConstantVelocityFieldType>( velocityField, numberOfSquarings, true );
+
+  this->SetDisplacementField( displacementField );
+  this->SetInverseDisplacementField( inverseDisplacementField );
+
+  if( this->m_VelocityUpdateTolerance > 0.0 )
+    {
+    this->m_CachedVelocityField = AllocImage<ConstantVelocityFieldType>( velocityField );
+    std::copy( velocityField->GetBufferPointer(),
+               velocityField->GetBufferPointer() + velocityField->GetBufferedRegion().GetNumberOfPixels(),
+               this->m_CachedVelocityField->GetBufferPointer() );
+    this->m_CachedDisplacementField = displacementField;
+    this->m_CachedInverseDisplacementField = inverseDisplacementField;
+    }
+  else
+    {
+    this->m_CachedVelocityField = ITK_NULLPTR;
+    this->m_CachedDisplacementField = ITK_NULLPTR;
+    this->m_CachedInverseDisplacementField = ITK_NULLPTR;
+    }
+}
+
+template <typename TExponentialTransform>
+typename ScalingAndSquaringExponentialTransform<TExponentialTransform>::ScalarType
+ScalingAndSquaringExponentialTransform<TExponentialTransform>
+::ComputeVelocityFieldDifference( const ConstantVelocityFieldType * velocityField ) const
+{
+  const ConstantVelocityFieldType *cachedField = this->m_CachedVelocityField;
+  if( cachedField == ITK_NULLPTR
+      || cachedField->GetBufferedRegion() != velocityField->GetBufferedRegion()
+      || cachedField->GetSpacing() != velocityField->GetSpacing()
+      || cachedField->GetOrigin() != velocityField->GetOrigin()
+      || cachedField->GetDirection() != velocityField->GetDirection() )
+    {
+    return -1.0;
+    }
+
+  const SizeValueType numberOfPixels = velocityField->GetBufferedRegion().GetNumberOfPixels();
+  const typename ConstantVelocityFieldType::PixelType *velocities = velocityField->GetBufferPointer();
+  const typename ConstantVelocityFieldType::PixelType *cachedVelocities = cachedField->GetBufferPointer();
+
+  ScalarType maximumNormSquared = 0.0;
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    maximumNormSquared = std::max( maximumNormSquared,
+                                   static_cast<ScalarType>( ( velocities[n] - cachedVelocities[n] ).GetSquaredNorm() ) );
+    }
+
+  ScalarType minimumSpacing = velocityField->GetSpacing()[0];
+  for( unsigned int d = 1; d < ConstantVelocityFieldType::ImageDimension; d++ )
+    {
+    minimumSpacing = std::min( minimumSpacing, static_cast<ScalarType>( velocityField->GetSpacing()[d] ) );
+    }
+  return std::sqrt( maximumNormSquared ) / minimumSpacing;
+}
+
+template <typename TExponentialTransform>
+void
+ScalingAndSquaringExponentialTransform<TExponentialTransform>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Velocity update tolerance: " << this->m_VelocityUpdateTolerance << std::endl;
+}
+} // end namespace itk
+
+#endif
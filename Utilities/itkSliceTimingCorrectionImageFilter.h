@@ -22,6 +22,9 @@
 #include "itkExtrapolateImageFunction.h"
 #include "itkInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
+#include "itkImageRegionSplitterDirection.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -33,6 +36,12 @@ namespace itk
  * subtraction dimension. The output image is the difference between
  * the two intepolated signals.
  *
+ * Unless an interpolator is set, each voxel's time series is resampled
+ * with a 1-D linear, windowed sinc or B-spline kernel along the time
+ * dimension.  The kernel weights only depend on the slice, so they are
+ * computed once per time series, and the image is split among the
+ * threads across the time dimension.
+ *
  * \ingroup GeometricTransform
  * \ingroup MultiThreaded
  * \ingroup Streamed
@@ -74,6 +83,9 @@ public:
   //typedef typename InputImageType::SpacingType::ValueType     TimingType;
   typedef double TimingType;
 
+  /** Kernels used along the time dimension when no interpolator is set. */
+  typedef enum { LinearInterpolation = 0, WindowedSincInterpolation, BSplineInterpolation } TimeInterpolationType;
+
   /** Compiler can't inherit ImageDimension enumeration? */
   itkStaticConstMacro(InputImageDimension, unsigned int,
                       TInputImage::ImageDimension);
@@ -95,11 +107,28 @@ public:
   itkSetMacro( ExtrapolateEdges, bool );
   itkGetMacro( ExtrapolateEdges, bool );
 
-  /** Set the interpolator function.  The default is
-   * LinearInterpolateImageFunction<InputImageType,
-   * TInterpolatorPrecisionType>. WindowedSincInterpolateImageFunction
-   * is often suggested in the literature. Some
-   * other options are NearestNeighborInterpolateImageFunction
+  /** Set the kernel used along the time dimension.  The default is linear.
+   * The windowed sinc kernel, often suggested in the literature, uses a
+   * Hamming window (see WindowedSincInterpolateImageFunction) and the
+   * B-spline kernel matches BSplineInterpolateImageFunction. */
+  itkSetMacro( TimeInterpolation, TimeInterpolationType );
+  itkGetConstMacro( TimeInterpolation, TimeInterpolationType );
+
+  /** Radius of the windowed sinc kernel. */
+  itkSetMacro( SincRadius, unsigned int );
+  itkGetConstMacro( SincRadius, unsigned int );
+
+  /** Order of the B-spline kernel, from 0 to 5. */
+  itkSetClampMacro( SplineOrder, unsigned int, 0, 5 );
+  itkGetConstMacro( SplineOrder, unsigned int );
+
+  /** Set the interpolator function.  By default none is set and the
+   * kernel given by SetTimeInterpolation is applied along each time
+   * series.  An interpolator is evaluated at each output point instead,
+   * which is much slower but is also needed when the time axis is not
+   * aligned with the image grid. Some options are
+   * WindowedSincInterpolateImageFunction,
+   * NearestNeighborInterpolateImageFunction
    * (useful for binary masks and other images with a small number of
    * possible pixel values), and BSplineInterpolateImageFunction
    * (which provides a higher order of interpolation).  */
@@ -139,11 +168,14 @@ protected:
    * \sa ProcessObject::GenerateOutputInformaton() */
   virtual void GenerateOutputInformation() ITK_OVERRIDE;
 
-  /** Overrides GenerateInputRequestedRegion() in order to inform
-   * the pipeline execution model of different input requested regions
-   * than the output requested region.
+  /** Overrides GenerateInputRequestedRegion() in order to request the
+   * whole time series of the voxels in the output requested region.
    * \sa ImageToImageFilter::GenerateInputRequestedRegion() */
-  //virtual void GenerateInputRequestedRegion();
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  /** Split the output among the threads across the time dimension, so
+   * that each thread gets whole time series. */
+  virtual const ImageRegionSplitterBase * GetImageRegionSplitter() const ITK_OVERRIDE;
 
   /** This method is used to set the state of the filter before
    * multi-threading. */
@@ -155,6 +187,14 @@ protected:
   virtual void ThreadedGenerateData(const OutputImageRegionType &
                                     outputRegionForThread, ThreadIdType threadId) ITK_OVERRIDE;
 
+  /** Offsets and weights of the 1-D kernel sampling a time series at
+   * t + offset, for integer t and offset in [0,1). */
+  void ComputeTimeKernel( double offset, std::vector<int> & offsets, std::vector<double> & weights ) const;
+
+  /** Replace a time series by its B-spline coefficients, as in
+   * BSplineDecompositionImageFilter. */
+  void ComputeBSplineCoefficients( std::vector<double> & series ) const;
+
 private:
   SliceTimingCorrectionImageFilter(const Self &); // purposely not implemented
   void operator=(const Self &);                       // purposely not implemented
@@ -176,6 +216,17 @@ private:
 
   bool m_ExtrapolateEdges;
 
+  TimeInterpolationType m_TimeInterpolation;
+
+  unsigned int m_SincRadius;
+
+  unsigned int m_SplineOrder;
+
+  // shift of the continuous time index per slice
+  double m_TimeIndexShift;
+
+  ImageRegionSplitterDirection::Pointer m_ImageRegionSplitter;
+
   // ExtrapolatorPointerType m_Extrapolator;      // Image function for
   // extrapolation
 };
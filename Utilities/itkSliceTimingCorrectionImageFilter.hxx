@@ -22,6 +22,12 @@
 #include "itkProgressReporter.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageLinearIteratorWithIndex.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+#include <algorithm>
+#include <cmath>
 
 namespace itk
 {
@@ -29,13 +35,17 @@ template <class TInputImage, class TOutputImage>
 SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
 ::SliceTimingCorrectionImageFilter()
 {
-  m_Interpolator = dynamic_cast< InterpolatorType * >
-                   ( DefaultInterpolatorType::New().GetPointer() );
+  m_Interpolator = ITK_NULLPTR;
   m_IndexPadding = 1;
   m_TimeDimension = InputImageDimension-1;
   m_SliceDimension = InputImageDimension-2;
   m_SliceTiming = 0.0;
   m_ExtrapolateEdges = true;
+  m_TimeInterpolation = LinearInterpolation;
+  m_SincRadius = 4;
+  m_SplineOrder = 3;
+  m_TimeIndexShift = 0.0;
+  m_ImageRegionSplitter = ImageRegionSplitterDirection::New();
 }
 
 template <class TInputImage, class TOutputImage>
@@ -46,6 +56,9 @@ SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
   Superclass::PrintSelf(os, indent);
 
   os << indent << "TimeDimension: " << m_TimeDimension << std::endl;
+  os << indent << "TimeInterpolation: " << m_TimeInterpolation << std::endl;
+  os << indent << "SincRadius: " << m_SincRadius << std::endl;
+  os << indent << "SplineOrder: " << m_SplineOrder << std::endl;
 }
 
 template <class TInputImage, class TOutputImage>
@@ -220,6 +233,35 @@ SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
 }
 
 
+template <class TInputImage, class TOutputImage>
+void
+SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImageType *inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( !inputPtr )
+    {
+    return;
+    }
+
+  InputImageRegionType inputRequestedRegion = inputPtr->GetRequestedRegion();
+  inputRequestedRegion.SetIndex( m_TimeDimension,
+                                 inputPtr->GetLargestPossibleRegion().GetIndex()[m_TimeDimension] );
+  inputRequestedRegion.SetSize( m_TimeDimension,
+                                inputPtr->GetLargestPossibleRegion().GetSize()[m_TimeDimension] );
+  inputPtr->SetRequestedRegion( inputRequestedRegion );
+}
+
+template <class TInputImage, class TOutputImage>
+const ImageRegionSplitterBase *
+SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
+::GetImageRegionSplitter() const
+{
+  return this->m_ImageRegionSplitter;
+}
+
 /**
  * Set up state of filter before multi-threading.
  * InterpolatorType::SetInputImage is not thread-safe and hence
@@ -231,19 +273,194 @@ SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
 ::BeforeThreadedGenerateData()
 {
   itkDebugMacro(<< "Before Threaded Generate Data");
-  if( !m_Interpolator )
+
+  this->m_ImageRegionSplitter->SetDirection( m_TimeDimension );
+
+  if( m_Interpolator )
+    {
+    // Connect input image to interpolator
+    m_Interpolator->SetInputImage( this->GetInput() );
+    return;
+    }
+
+  // The slice shift is along the time axis only if the time axis is
+  // aligned with the image grid.
+  const typename InputImageType::DirectionType & direction = this->GetInput()->GetDirection();
+  for( unsigned int j = 0; j < InputImageDimension; j++ )
     {
-    itkExceptionMacro(<< "Interpolator not set");
+    if( j != m_TimeDimension && std::fabs( direction[m_TimeDimension][j] ) > 1.0e-6 )
+      {
+      itkExceptionMacro( << "The time axis is not aligned with the image grid, set an interpolator" );
+      }
     }
+  m_TimeIndexShift = m_SliceTiming * direction[m_TimeDimension][m_TimeDimension]
+    / this->GetInput()->GetSpacing()[m_TimeDimension];
+}
 
-  // Connect input image to interpolator
-  m_Interpolator->SetInputImage( this->GetInput() );
+template <class TInputImage, class TOutputImage>
+void
+SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
+::ComputeTimeKernel( double offset, std::vector<int> & offsets, std::vector<double> & weights ) const
+{
+  offsets.clear();
+  weights.clear();
 
-  // Connect input image to extrapolator
-  // if( !m_Extrapolator.IsNull() )
-  //  {
-  //  m_Extrapolator->SetInputImage( this->GetInput() );
-  //  }
+  switch( m_TimeInterpolation )
+    {
+    case WindowedSincInterpolation:
+      {
+      // Hamming windowed sinc, as in WindowedSincInterpolateImageFunction
+      const int radius = static_cast<int>( m_SincRadius );
+      for( int k = 1 - radius; k <= radius; k++ )
+        {
+        const double x = offset - k;
+        double       sinc = 1.0;
+        if( x != 0.0 )
+          {
+          sinc = std::sin( vnl_math::pi * x ) / ( vnl_math::pi * x );
+          }
+        offsets.push_back( k );
+        weights.push_back( sinc * ( 0.54 + 0.46 * std::cos( vnl_math::pi * x / radius ) ) );
+        }
+      }
+      break;
+    case BSplineInterpolation:
+      {
+      // support of BSplineInterpolateImageFunction, with the centered
+      // B-spline computed from its truncated power expansion
+      const int order = static_cast<int>( m_SplineOrder );
+      int       start = -order / 2;
+      if( order % 2 == 0 && offset >= 0.5 )
+        {
+        start++;
+        }
+      double factorial = 1.0;
+      for( int k = 2; k <= order; k++ )
+        {
+        factorial *= k;
+        }
+      for( int i = 0; i <= order; i++ )
+        {
+        const double x = offset - ( start + i );
+        double       value = 0.0;
+        double       binomial = 1.0;
+        for( int k = 0; k <= order + 1; k++ )
+          {
+          const double y = x + 0.5 * ( order + 1 ) - k;
+          if( y > 0.0 )
+            {
+            value += ( k % 2 == 0 ? 1.0 : -1.0 ) * binomial
+              * ( order == 0 ? 1.0 : std::pow( y, order ) );
+            }
+          binomial = binomial * ( order + 1 - k ) / ( k + 1 );
+          }
+        offsets.push_back( start + i );
+        weights.push_back( value / factorial );
+        }
+      }
+      break;
+    case LinearInterpolation:
+    default:
+      {
+      offsets.push_back( 0 );
+      weights.push_back( 1.0 - offset );
+      offsets.push_back( 1 );
+      weights.push_back( offset );
+      }
+      break;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
+::ComputeBSplineCoefficients( std::vector<double> & series ) const
+{
+  const long size = series.size();
+  if( size < 2 )
+    {
+    return;
+    }
+
+  std::vector<double> poles;
+  switch( m_SplineOrder )
+    {
+    case 2:
+      poles.push_back( std::sqrt( 8.0 ) - 3.0 );
+      break;
+    case 3:
+      poles.push_back( std::sqrt( 3.0 ) - 2.0 );
+      break;
+    case 4:
+      poles.push_back( std::sqrt( 664.0 - std::sqrt( 438976.0 ) ) + std::sqrt( 304.0 ) - 19.0 );
+      poles.push_back( std::sqrt( 664.0 + std::sqrt( 438976.0 ) ) - std::sqrt( 304.0 ) - 19.0 );
+      break;
+    case 5:
+      poles.push_back( std::sqrt( 135.0 / 2.0 - std::sqrt( 17745.0 / 4.0 ) ) + std::sqrt( 105.0 / 4.0 )
+                       - 13.0 / 2.0 );
+      poles.push_back( std::sqrt( 135.0 / 2.0 + std::sqrt( 17745.0 / 4.0 ) ) - std::sqrt( 105.0 / 4.0 )
+                       - 13.0 / 2.0 );
+      break;
+    default:
+      return;
+    }
+
+  double gain = 1.0;
+  for( unsigned int k = 0; k < poles.size(); k++ )
+    {
+    gain *= ( 1.0 - poles[k] ) * ( 1.0 - 1.0 / poles[k] );
+    }
+  for( long n = 0; n < size; n++ )
+    {
+    series[n] *= gain;
+    }
+
+  const double tolerance = 1.0e-10;
+  for( unsigned int k = 0; k < poles.size(); k++ )
+    {
+    const double z = poles[k];
+
+    // initial causal coefficient, mirror boundary
+    const long horizon = static_cast<long>( std::ceil( std::log( tolerance ) / std::log( std::fabs( z ) ) ) );
+    if( horizon < size )
+      {
+      double zn = z;
+      double sum = series[0];
+      for( long n = 1; n < horizon; n++ )
+        {
+        sum += zn * series[n];
+        zn *= z;
+        }
+      series[0] = sum;
+      }
+    else
+      {
+      double       zn = z;
+      const double iz = 1.0 / z;
+      double       z2n = std::pow( z, static_cast<double>( size - 1 ) );
+      double       sum = series[0] + z2n * series[size - 1];
+      z2n *= z2n * iz;
+      for( long n = 1; n <= size - 2; n++ )
+        {
+        sum += ( zn + z2n ) * series[n];
+        zn *= z;
+        z2n *= iz;
+        }
+      series[0] = sum / ( 1.0 - zn * zn );
+      }
+
+    for( long n = 1; n < size; n++ )
+      {
+      series[n] += z * series[n - 1];
+      }
+
+    // initial anticausal coefficient
+    series[size - 1] = ( z / ( z * z - 1.0 ) ) * ( z * series[size - 2] + series[size - 1] );
+    for( long n = size - 2; n >= 0; n-- )
+      {
+      series[n] = z * ( series[n + 1] - series[n] );
+      }
+    }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -255,52 +472,144 @@ SliceTimingCorrectionImageFilter<TInputImage, TOutputImage>
   itkDebugMacro(<< "Actually executing");
   //std::cout << "Actually executing" << std::endl;
 
-  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
+  unsigned int maxDim = this->GetOutput()->GetLargestPossibleRegion().GetSize()[m_TimeDimension] - 1;
 
-  OutputImageRegionType outputRegion = outputRegionForThread;
+  if( m_Interpolator )
+    {
+    ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
 
-  InputImageRegionType inputRegion;
-  this->CallCopyOutputRegionToInputRegion(inputRegion, outputRegionForThread);
+    ImageRegionIteratorWithIndex<OutputImageType> outIt(
+      this->GetOutput(), outputRegionForThread);
 
-  ImageRegionIteratorWithIndex<OutputImageType> outIt(
-    this->GetOutput(), outputRegion);
+    typename InputImageType::PointType pt;
 
-  typename InputImageType::PointType pt;
+    while( !outIt.IsAtEnd() )
+      {
+      typename InputImageType::IndexType idx = outIt.GetIndex();
 
-  while( !outIt.IsAtEnd() )
-    {
-    
-    typename InputImageType::IndexType idx = outIt.GetIndex();
-    unsigned int maxDim = this->GetOutput()->GetLargestPossibleRegion().GetSize()[m_TimeDimension] - 1;
-    //std::cout << pt << std::endl;
+      if ( this->m_ExtrapolateEdges )
+        {
+        if ( idx[m_TimeDimension] < m_IndexPadding )
+          {
+          idx[m_TimeDimension] = m_IndexPadding;
+          }
+        else if ( idx[m_TimeDimension] > ( maxDim - m_IndexPadding ) )
+          {
+          idx[m_TimeDimension] = maxDim - m_IndexPadding;
+          }
+        }
 
-    if ( this->m_ExtrapolateEdges ) 
-      {
-      if ( idx[m_TimeDimension] < m_IndexPadding )
+      this->GetOutput()->TransformIndexToPhysicalPoint( idx, pt );
+      pt[m_TimeDimension] -= idx[m_SliceDimension] * m_SliceTiming;
+
+      if ( this->m_Interpolator->IsInsideBuffer( pt ) )
         {
-        idx[m_TimeDimension] = m_IndexPadding;
+        float oValue = this->m_Interpolator->Evaluate( pt );
+        outIt.Set( oValue );
         }
-      else if ( idx[m_TimeDimension] > ( maxDim - m_IndexPadding ) )
+      else
         {
-        idx[m_TimeDimension] = maxDim - m_IndexPadding;
+        outIt.Set(0.0);
         }
+
+      ++outIt;
+      progress.CompletedPixel();
       }
+    return;
+    }
+
+  const InputImageType *input = this->GetInput();
+
+  const long firstTimePoint = input->GetLargestPossibleRegion().GetIndex()[m_TimeDimension];
+  const long numberOfTimePoints = input->GetLargestPossibleRegion().GetSize()[m_TimeDimension];
+
+  // whole time series of the voxels of this thread
+  InputImageRegionType inputRegion;
+  this->CallCopyOutputRegionToInputRegion(inputRegion, outputRegionForThread);
+  inputRegion.SetIndex( m_TimeDimension, firstTimePoint );
+  inputRegion.SetSize( m_TimeDimension, numberOfTimePoints );
+
+  ProgressReporter progress( this, threadId,
+                             outputRegionForThread.GetNumberOfPixels()
+                             / outputRegionForThread.GetSize()[m_TimeDimension] );
 
-    this->GetOutput()->TransformIndexToPhysicalPoint( idx, pt );
-    pt[m_TimeDimension] -= idx[m_SliceDimension] * m_SliceTiming;
+  ImageLinearConstIteratorWithIndex<InputImageType> inIt( input, inputRegion );
+  inIt.SetDirection( m_TimeDimension );
 
-    if ( this->m_Interpolator->IsInsideBuffer( pt ) ) 
+  ImageLinearIteratorWithIndex<OutputImageType> outIt( this->GetOutput(), outputRegionForThread );
+  outIt.SetDirection( m_TimeDimension );
+
+  std::vector<double> series( numberOfTimePoints );
+  std::vector<int>    offsets;
+  std::vector<double> weights;
+  for( inIt.GoToBegin(), outIt.GoToBegin(); !outIt.IsAtEnd(); inIt.NextLine(), outIt.NextLine() )
+    {
+    for( long t = 0; !inIt.IsAtEndOfLine(); ++inIt, ++t )
+      {
+      series[t] = inIt.Get();
+      }
+    if( m_TimeInterpolation == BSplineInterpolation )
       {
-      float oValue = this->m_Interpolator->Evaluate( pt );
-      outIt.Set( oValue );
+      this->ComputeBSplineCoefficients( series );
       }
 
-    else 
+    // the samples are at the continuous time index t - shift, the kernel
+    // is the same for every t of the series
+    const double shift = outIt.GetIndex()[m_SliceDimension] * m_TimeIndexShift;
+    const long   base = static_cast<long>( std::floor( -shift ) );
+    this->ComputeTimeKernel( -shift - base, offsets, weights );
+
+    for( long t = outIt.GetIndex()[m_TimeDimension] - firstTimePoint; !outIt.IsAtEndOfLine(); ++outIt, ++t )
       {
-      outIt.Set(0.0);
+      long tt = t;
+      if ( this->m_ExtrapolateEdges )
+        {
+        if ( tt < static_cast<long>( m_IndexPadding ) )
+          {
+          tt = m_IndexPadding;
+          }
+        else if ( tt > static_cast<long>( maxDim - m_IndexPadding ) )
+          {
+          tt = maxDim - m_IndexPadding;
+          }
+        }
+
+      const double position = tt - shift;
+      if( position < -0.5 || position >= numberOfTimePoints - 0.5 )
+        {
+        outIt.Set( 0.0 );
+        continue;
+        }
+
+      double value = 0.0;
+      for( unsigned int k = 0; k < offsets.size(); k++ )
+        {
+        long n = tt + base + offsets[k];
+        if( m_TimeInterpolation == BSplineInterpolation )
+          {
+          // mirror boundary, as in BSplineInterpolateImageFunction
+          if( numberOfTimePoints == 1 )
+            {
+            n = 0;
+            }
+          else
+            {
+            if( n < 0 )
+              {
+              n = -n;
+              }
+            if( n >= numberOfTimePoints )
+              {
+              n = 2 * ( numberOfTimePoints - 1 ) - n;
+              }
+            }
+          }
+        n = std::max( 0L, std::min( numberOfTimePoints - 1, n ) );
+        value += weights[k] * series[n];
+        }
+      outIt.Set( static_cast<typename OutputImageType::PixelType>( value ) );
       }
-    
-    ++outIt;
+    progress.CompletedPixel();
     }
 }
 } // end namespace itk
@@ -91,6 +91,9 @@ public:
 
   typedef NeighborhoodIterator<ImageType> NeighborhoodIteratorType;
 
+  typedef typename Superclass::PointContainerType PointContainerType;
+  typedef std::vector<IndexType>                  IndexContainerType;
+
   /** Find all points within some distance of the origin.
     * The argument gives the number of times to apply the
     * mean shift algorithm to find the best neighborhood.
@@ -102,7 +105,9 @@ public:
   void  FindGeodesicNeighborhood();
 
   /** This applies one of the algorithms for finding the local curvature
-      and frame.  The default is joshi. */
+      and frame.  The default is joshi.  The surface voxel neighborhoods
+      are gathered once into a compact list and the surface voxels are
+      then processed in parallel. */
   void ComputeFrameOverDomain(unsigned int which = 0) ITK_OVERRIDE;
 
   ImageType * GetInput();
@@ -140,6 +145,22 @@ public:
   /** Get the neighborhood integral for every surface point.*/
   RealType IntegrateFunctionOverSurface(bool norm = false);
 
+  /** Assemble the neighborhood integrals of IntegrateFunctionOverSurface
+      into a sparse (CSR) operator W on the function image.  The
+      neighborhoods depend only on the surface, so they are searched once,
+      in parallel, and the operator is reused by every application. */
+  void BuildSmoothingOperator(bool norm = true);
+
+  /** Replace the function image by W^k applied to it, k being the number
+      of applications.  One application gives the same result as
+      IntegrateFunctionOverSurface.  The operator is built if needed. */
+  void ApplySmoothingOperator(unsigned int numberOfApplications = 1);
+
+  /** Replace the function image by the heat kernel exp(-t(I-W)) applied to
+      it, from the series e^-t sum_k t^k/k! W^k truncated once its
+      remaining weight is negligible. */
+  void ApplyHeatKernel(RealType t);
+
   /** Postprocess the curvature function by, e.g., gaussian
       smoothing of the curvature (and perhaps frame)
       in the local neighbhorhood. */
@@ -247,6 +268,56 @@ protected:
 
   void CopyImageToFunctionImage( OutputImagePointer, OutputImagePointer);
 
+  /** Gather the neighborhood of the n-th surface voxel of domain and append
+      it to the given list. */
+  void GatherSurfaceNeighborhood( const Self *domain, unsigned long n, PointContainerType & points );
+
+  /** Estimate the frame and curvature at the n-th surface voxel of domain
+      and return the function value for that voxel. */
+  RealType ComputeFrameAtSurfacePoint( const Self *domain, unsigned long n, unsigned int which );
+
+  struct FrameThreadStruct
+    {
+    Self                *Filter;
+    std::vector<Pointer> Workers;
+    unsigned int         Which;
+    bool                 GatherNeighborhoods;
+    /** per-thread neighborhood lists, concatenated after gathering */
+    std::vector<PointContainerType>         ThreadPoints;
+    std::vector<std::vector<unsigned long> > ThreadCounts;
+    };
+
+  static ITK_THREAD_RETURN_TYPE FrameThreaderCallback( void * );
+
+  /** Append the row of the smoothing operator for the surface voxel at
+      index to the given columns and weights. */
+  void GatherOperatorRow( const IndexType & index, bool norm, std::vector<OffsetValueType> & columns,
+                          std::vector<RealType> & weights );
+
+  /** output = W input over the rows of the smoothing operator; when an
+      accumulator is given, coefficient * output is also added to it. */
+  void MultiplySmoothingOperator( const PixelType *input, PixelType *output, RealType *accumulator,
+                                  RealType coefficient );
+
+  struct OperatorThreadStruct
+    {
+    Self                *Filter;
+    std::vector<Pointer> Workers;
+    bool                 AssembleRows;
+    bool                 Norm;
+    /** per-thread rows, concatenated after assembly */
+    std::vector<std::vector<OffsetValueType> > ThreadColumns;
+    std::vector<std::vector<RealType> >        ThreadWeights;
+    std::vector<std::vector<unsigned long> >   ThreadCounts;
+    /** buffers of the products, when the rows are not being assembled */
+    const PixelType *Input;
+    PixelType       *Output;
+    RealType        *Accumulator;
+    RealType         Coefficient;
+    };
+
+  static ITK_THREAD_RETURN_TYPE OperatorThreaderCallback( void * );
+
   /** This function changes the values of the label image for use with
       the fast marching image filter. */
 private:
@@ -265,6 +336,25 @@ private:
   float                    m_Area;
   RealType                 m_MinSpacing;
   typename VectorInterpolatorType::Pointer m_Vinterp;
+
+  /** Surface voxels found by ComputeFrameOverDomain and their neighborhoods,
+      stored contiguously: the neighbors of voxel n are the points
+      m_NeighborhoodPoints[m_NeighborhoodOffsets[n]] up to, but not including,
+      m_NeighborhoodPoints[m_NeighborhoodOffsets[n+1]]. */
+  IndexContainerType         m_SurfaceIndices;
+  PointContainerType         m_SurfacePoints;
+  std::vector<unsigned long> m_NeighborhoodOffsets;
+  PointContainerType         m_NeighborhoodPoints;
+
+  /** The smoothing operator: the value at the buffer offset m_OperatorRows[n]
+      is the sum of m_OperatorWeights[j] times the value at the buffer offset
+      m_OperatorColumns[j], for j from m_OperatorOffsets[n] up to, but not
+      including, m_OperatorOffsets[n+1].  The function image is zero off the
+      rows. */
+  std::vector<OffsetValueType> m_OperatorRows;
+  std::vector<unsigned long>   m_OperatorOffsets;
+  std::vector<OffsetValueType> m_OperatorColumns;
+  std::vector<RealType>        m_OperatorWeights;
 };
 } // namespace itk
 
@@ -14,7 +14,7 @@
 #ifndef _SurfaceImageCurvature_hxx
 #define _SurfaceImageCurvature_hxx
 #include "antsAllocImage.h"
-#include <vnl/algo/vnl_real_eigensystem.h>
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
 
 #include "itkSurfaceImageCurvature.h"
 // #include "itkLevelSetCurvatureFunction.h"
@@ -546,13 +546,12 @@ template <typename TSurface>
 void  SurfaceImageCurvature<TSurface>
 ::WeingartenMap()
 {
-  typename ImageType::Pointer image = this->GetInput();
+  ImageType *image = this->GetInput();
   if( !image )
     {
     return;
     }
 
-  MatrixType D;
   unsigned int j = 0;
   unsigned int i = 0;
   unsigned int npts = this->m_PointList.size();
@@ -566,20 +565,20 @@ void  SurfaceImageCurvature<TSurface>
     this->m_Area = 0;
     return;
     }
-  D.set_size(npts, vars); // each row contains [u^2 , uv, v^2, u, v, 1] for point p
-  D.fill(0.0);
 
-  MatrixType W(2, 2);
-  W.fill(0.0);
-
-  vnl_vector<double> xdists(npts);
-  xdists.fill(0.0);
-  vnl_vector<double> ydists(npts);
-  ydists.fill(0.0);
-  vnl_vector<double> zdists(npts);
-  zdists.fill(0.0);
-  vnl_vector<double> f_uvs(npts);
-  f_uvs.fill(0.0);
+  // Each row of the design matrix D contains [1, u, v] for point p.  The
+  // least squares fits of the normal components over D are solved through
+  // the normal equations, D'D is only 3x3.
+  double DtD[3][3];
+  double DtN[3][3];
+  for( i = 0; i < 3; i++ )
+    {
+    for( j = 0; j < 3; j++ )
+      {
+      DtD[i][j] = 0.0;
+      DtN[i][j] = 0.0;
+      }
+    }
 
 // go through all the points
 //  compute weight
@@ -617,49 +616,90 @@ void  SurfaceImageCurvature<TSurface>
     f_uv = this->innerProduct( PN, this->m_Normal );
 // the point is therefore defined as:
 //    PointType surfacePoint = this->m_Tangent1 * u1 + this->m_Tangent2 * u2 + PN;
-    xdists[j] = (PN[0]);
-    ydists[j] = (PN[1]);
-    zdists[j] = (PN[2]);
-    f_uvs[j] = f_uv;
 
-    if( vars == 6 )
+    const double row[3] = { 1.0, u1, u2 };
+    const double rhs[3] = { PN[0], PN[1], PN[2] };
+    for( unsigned int r = 0; r < 3; r++ )
       {
-      // each row contains [u^2 , uv, v^2, u, v, 1] for point p
-      D(j, 5) = u2 * u2; // (0   , 2*u2)
-      D(j, 4) = u1 * u1; // (2*u1, 0)
-      D(j, 3) = u1 * u2; // (u2  , u1)
+      for( unsigned int c = 0; c < 3; c++ )
+        {
+        DtD[r][c] += row[r] * row[c];
+        DtN[r][c] += row[r] * rhs[c];
+        }
       }
-    // each row contains [ u, v, 1] for point p
-    D(j, 2) = u2; // (1   , 0)
-    D(j, 1) = u1; // (0   , 1)
-    D(j, 0) = 1.0;
-    RealType dfuv_u = 0;
-    RealType dfuv_v = 0;
-    if ( ( vnl_math_abs(u1) > 0 ) && ( vnl_math_abs(u2) < 1.e-6 ) )
-      dfuv_u = vnl_math_abs( f_uv - 1.0 ) / vnl_math_abs(u1) * 100.0;
-    if ( ( vnl_math_abs(u2) > 0 ) && ( vnl_math_abs(u1) < 1.e-6 ) )
-      dfuv_v = vnl_math_abs( f_uv - 1.0 ) / vnl_math_abs(u2) * 100.0;
+
     // this->m_Area += sqrt( 1.0 + dfuv_u*dfuv_u + dfuv_v*dfuv_v );
     this->m_Area += vnl_math_abs( f_uv - 1.0 );
     }
   this->m_Area *= areaelt;
-  vnl_svd<double>    svd(D);
-  vnl_vector<double> ax = svd.solve(xdists); // /totwt);
-  vnl_vector<double> ay = svd.solve(ydists); // /totwt);
-  vnl_vector<double> az = svd.solve(zdists); // /totwt);
-  vnl_vector<double> df_uvs = svd.solve( f_uvs ); // /totwt);
+
+  // pseudo-inverse of D'D, from the cofactors unless it is singular
+  double inverse[3][3];
+  inverse[0][0] = DtD[1][1] * DtD[2][2] - DtD[1][2] * DtD[2][1];
+  inverse[0][1] = DtD[0][2] * DtD[2][1] - DtD[0][1] * DtD[2][2];
+  inverse[0][2] = DtD[0][1] * DtD[1][2] - DtD[0][2] * DtD[1][1];
+  inverse[1][0] = DtD[1][2] * DtD[2][0] - DtD[1][0] * DtD[2][2];
+  inverse[1][1] = DtD[0][0] * DtD[2][2] - DtD[0][2] * DtD[2][0];
+  inverse[1][2] = DtD[0][2] * DtD[1][0] - DtD[0][0] * DtD[1][2];
+  inverse[2][0] = DtD[1][0] * DtD[2][1] - DtD[1][1] * DtD[2][0];
+  inverse[2][1] = DtD[0][1] * DtD[2][0] - DtD[0][0] * DtD[2][1];
+  inverse[2][2] = DtD[0][0] * DtD[1][1] - DtD[0][1] * DtD[1][0];
+  const double det = DtD[0][0] * inverse[0][0] + DtD[0][1] * inverse[1][0] + DtD[0][2] * inverse[2][0];
+  const double trace = DtD[0][0] + DtD[1][1] + DtD[2][2];
+  if( vnl_math_abs( det ) > 1.e-12 * trace * trace * trace )
+    {
+    for( i = 0; i < 3; i++ )
+      {
+      for( j = 0; j < 3; j++ )
+        {
+        inverse[i][j] /= det;
+        }
+      }
+    }
+  else
+    {
+    vnl_matrix<double> M( 3, 3 );
+    for( i = 0; i < 3; i++ )
+      {
+      for( j = 0; j < 3; j++ )
+        {
+        M( i, j ) = DtD[i][j];
+        }
+      }
+    vnl_symmetric_eigensystem<double> eig( M );
+    for( i = 0; i < 3; i++ )
+      {
+      for( j = 0; j < 3; j++ )
+        {
+        inverse[i][j] = 0.0;
+        }
+      }
+    for( unsigned int k = 0; k < 3; k++ )
+      {
+      if( eig.D( k, k ) > 0.0 )
+        {
+        for( i = 0; i < 3; i++ )
+          {
+          for( j = 0; j < 3; j++ )
+            {
+            inverse[i][j] += eig.V( i, k ) * eig.V( j, k ) / eig.D( k, k );
+            }
+          }
+        }
+      }
+    }
 
 // now get the first partials of each of these terms w.r.t. u and v
 
 // dN/du = (dN/du \dot T_1) T_1+ (dNdu dot T_2) T_2
 
   PointType dNdu;
-  dNdu[0] = ax[1];  dNdu[1] = ay[1];  dNdu[2] = az[1];
   PointType dNdv;
-  dNdv[0] = ax[2];  dNdv[1] = ay[2];  dNdv[2] = az[2];
-
-//  df_uvs = df_uvs * 1.e5; // scale up
-//  this->m_Area = sqrt( 1.0 + df_uvs[1] * df_uvs[1] + df_uvs[2] * df_uvs[2] );
+  for( i = 0; i < SurfaceDimension; i++ )
+    {
+    dNdu[i] = inverse[1][0] * DtN[0][i] + inverse[1][1] * DtN[1][i] + inverse[1][2] * DtN[2][i];
+    dNdv[i] = inverse[2][0] * DtN[0][i] + inverse[2][1] * DtN[1][i] + inverse[2][2] * DtN[2][i];
+    }
 
   float a = 0;
   float b = 0;
@@ -673,20 +713,23 @@ void  SurfaceImageCurvature<TSurface>
     c += dNdu[i] * this->m_Tangent2[i];
     d += dNdv[i] * this->m_Tangent2[i];
     }
-  W(0, 0) = a;
-  W(0, 1) = b;
-  W(1, 0) = c;
-  W(1, 1) = d;
 
-  // Compute estimated frame using eigensystem of D'*D
+  // Eigenvalues of the 2x2 Weingarten map [a b; c d], only their real parts
+  // are kept
+  const double halfTrace = 0.5 * ( a + d );
+  const double discriminant = halfTrace * halfTrace - ( a * d - b * c );
+  if( discriminant >= 0.0 )
     {
-    vnl_real_eigensystem eig(W);
-    vnl_diag_matrix<std::complex<double> > DD(eig.D.rows() ); //
-    this->m_Kappa1 = std::real(eig.D(1, 1) );
-    this->m_Kappa2 = std::real(eig.D(0, 0) );
-    this->m_MeanKappa = (this->m_Kappa1 + this->m_Kappa2) * 0.5;
-    this->m_GaussianKappa = (this->m_Kappa1 * this->m_Kappa2);
+    this->m_Kappa1 = halfTrace + std::sqrt( discriminant );
+    this->m_Kappa2 = halfTrace - std::sqrt( discriminant );
     }
+  else
+    {
+    this->m_Kappa1 = halfTrace;
+    this->m_Kappa2 = halfTrace;
+    }
+  this->m_MeanKappa = (this->m_Kappa1 + this->m_Kappa2) * 0.5;
+  this->m_GaussianKappa = (this->m_Kappa1 * this->m_Kappa2);
 }
 
 
@@ -695,7 +738,7 @@ template <typename TSurface>
 void  SurfaceImageCurvature<TSurface>
 ::WeingartenMapGradients()
 {
-  typename ImageType::Pointer image = this->GetInput();
+  ImageType *image = this->GetInput();
   if( !image )
     {
     return;
@@ -713,7 +756,7 @@ void  SurfaceImageCurvature<TSurface>
       {
       p = this->m_Origin + this->m_Tangent1 * ui + this->m_Tangent2 * vi +
         this->m_Normal * zi;
-      this->m_PointList.insert( this->m_PointList.begin(), p );
+      this->m_PointList.push_back( p );
       }
     }
   this->WeingartenMap();
@@ -1031,6 +1074,194 @@ void  SurfaceImageCurvature<TSurface>
     }
 }
 
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::GatherSurfaceNeighborhood( const Self *domain, unsigned long n, PointContainerType & points )
+{
+  if( this->m_UseGeodesicNeighborhood )
+    {
+    this->SetOrigin( domain->m_SurfacePoints[n] );
+    this->m_PointList.clear();
+    this->FindGeodesicNeighborhood();
+    points.insert( points.end(), this->m_PointList.begin(), this->m_PointList.end() );
+    return;
+    }
+
+  // Same neighborhood as FindEuclideanNeighborhood, visited in the reverse
+  // order so that the list, with the origin last, is identical.
+  ImageType *     image = this->GetInput();
+  const IndexType oindex = domain->m_SurfaceIndices[n];
+  const long      rad = static_cast<long>( this->m_NeighborhoodRadius );
+  IndexType       index;
+  for( long dz = rad; dz >= -rad; dz-- )
+    {
+    index[2] = oindex[2] + dz;
+    for( long dy = rad; dy >= -rad; dy-- )
+      {
+      index[1] = oindex[1] + dy;
+      for( long dx = rad; dx >= -rad; dx-- )
+        {
+        index[0] = oindex[0] + dx;
+        if( ( dx == 0 && dy == 0 && dz == 0 ) || !this->IsValidIndex( index ) ||
+            !this->IsValidSurface( image->GetPixel( index ), index ) )
+          {
+          continue;
+          }
+        const RealType dist = std::sqrt( static_cast<RealType>( dx * dx + dy * dy + dz * dz ) );
+        if( dist <= this->m_NeighborhoodRadius )
+          {
+          typename ImageType::PointType ipt;
+          this->m_FunctionImage->TransformIndexToPhysicalPoint( index, ipt );
+          PointType p;
+          for( unsigned int k = 0; k < ImageDimension; k++ )
+            {
+            p[k] = ipt[k];
+            }
+          points.push_back( p );
+          }
+        }
+      }
+    }
+  points.push_back( domain->m_SurfacePoints[n] );
+}
+
+template <typename TSurface>
+typename SurfaceImageCurvature<TSurface>::RealType
+SurfaceImageCurvature<TSurface>
+::ComputeFrameAtSurfacePoint( const Self *domain, unsigned long n, unsigned int which )
+{
+  const PointType & p = domain->m_SurfacePoints[n];
+  ImagePointType    pt;
+  for( unsigned int k = 0; k < ImageDimension; k++ )
+    {
+    pt[k] = p[k];
+    }
+  this->SetOrigin(p);
+  this->EstimateFrameFromGradient( pt );
+
+  if( !domain->m_NeighborhoodOffsets.empty() )
+    {
+    // assign reuses the capacity of the point list
+    typename PointContainerType::const_iterator first =
+      domain->m_NeighborhoodPoints.begin() + domain->m_NeighborhoodOffsets[n];
+    typename PointContainerType::const_iterator last =
+      domain->m_NeighborhoodPoints.begin() + domain->m_NeighborhoodOffsets[n + 1];
+    this->m_PointList.assign( first, last );
+    this->m_AveragePoint.fill( 0 );
+    for( ; first != last; ++first )
+      {
+      this->m_AveragePoint += *first;
+      }
+    if( !this->m_PointList.empty() )
+      {
+      this->m_AveragePoint /= static_cast<RealType>( this->m_PointList.size() );
+      }
+    else
+      {
+      this->m_AveragePoint = this->m_Origin;
+      }
+    }
+
+  RealType kpix = 0;
+  switch( which )
+    {
+    case ( 0 ):
+      {
+      this->ComputeJoshiFrame( this->m_Origin);
+      }
+      break;
+    case ( 1 ):
+      {
+      this->JainMeanAndGaussianCurvature( this->m_Origin);
+      }
+      break;
+    case ( 2 ):
+      {
+      this->ShimshoniFrame(this->m_Origin);
+      }
+      break;
+    case ( 3 ):
+      {
+      this->WeingartenMapGradients();
+      }
+      break;
+    case ( 4 ):
+      {
+      kpix = this->ComputeMeanEuclideanDistance();
+      }
+      break;
+    default:
+      {
+      this->WeingartenMapGradients();
+      }
+    }
+
+  float fval = this->m_MeanKappa;
+  kpix = this->m_kSign * fval; // sulci
+  if( vnl_math_isnan(kpix)  || vnl_math_isinf(kpix) )
+    {
+    this->m_Kappa1 = 0.0;
+    this->m_Kappa2 = 0.0;
+    this->m_MeanKappa = 0.0;
+    this->m_GaussianKappa = 0.0;
+    this->m_Area = 0.0;
+    kpix = 0.0;
+    }
+  if( which == 5 )
+    {
+    kpix = this->CharacterizeSurface();
+    }
+  if( which == 6 )
+    {
+    kpix = this->m_GaussianKappa;
+    }
+  if( which == 7 )
+    {
+    kpix = this->m_Area;
+    }
+  this->m_PointList.clear();
+  return kpix;
+}
+
+template <typename TSurface>
+ITK_THREAD_RETURN_TYPE
+SurfaceImageCurvature<TSurface>
+::FrameThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  FrameThreadStruct *str = static_cast<FrameThreadStruct *>( info->UserData );
+
+  const Self *        domain = str->Filter;
+  Self *              worker = str->Workers[info->ThreadID];
+  const unsigned long numberOfPoints = domain->m_SurfaceIndices.size();
+  const unsigned long first = numberOfPoints * info->ThreadID / info->NumberOfThreads;
+  const unsigned long last = numberOfPoints * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  if( str->GatherNeighborhoods )
+    {
+    PointContainerType &         points = str->ThreadPoints[info->ThreadID];
+    std::vector<unsigned long> & counts = str->ThreadCounts[info->ThreadID];
+    counts.reserve( last - first );
+    for( unsigned long n = first; n < last; n++ )
+      {
+      const unsigned long before = points.size();
+      worker->GatherSurfaceNeighborhood( domain, n, points );
+      counts.push_back( points.size() - before );
+      }
+    }
+  else
+    {
+    OutputImageType *functionImage = domain->m_FunctionImage;
+    for( unsigned long n = first; n < last; n++ )
+      {
+      functionImage->SetPixel( domain->m_SurfaceIndices[n],
+                               worker->ComputeFrameAtSurfacePoint( domain, n, str->Which ) );
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <typename TSurface>
 void  SurfaceImageCurvature<TSurface>
 ::ComputeFrameOverDomain(unsigned int which)
@@ -1044,27 +1275,19 @@ void  SurfaceImageCurvature<TSurface>
     if ( image->GetSpacing()[d] < this->m_MinSpacing )
       this->m_MinSpacing = image->GetSpacing()[d];
   IndexType index;
-  typename ImageType::RegionType requestedRegion;
   this->m_ImageSize = image->GetLargestPossibleRegion().GetSize();
   ImageIteratorType ti( image, image->GetLargestPossibleRegion() );
 
-  // std::exception();
 // Get Normals First!
   this->EstimateNormalsFromGradient();
 
-  unsigned int  ct = 1;
-  unsigned long ct2 = 0;
-  RealType      kpix = 0;
-
-  double thresh = 0.0;
-
+  // gather the surface voxels away from the image boundary
+  this->m_SurfaceIndices.clear();
+  this->m_SurfacePoints.clear();
   ti.GoToBegin();
   while( !ti.IsAtEnd()  )
     {
     index = ti.GetIndex();
-    typename ImageType::PointType pt;
-    image->TransformIndexToPhysicalPoint( index, pt );
-    kpix = 0.0;
     if(  // ti.Get() == this->m_SurfaceLabel &&
       this->IsValidSurface(ti.Get(), index) &&
       index[0] < this->m_ImageSize[0] - 2 * this->m_NeighborhoodRadius &&
@@ -1074,112 +1297,398 @@ void  SurfaceImageCurvature<TSurface>
       index[2] < this->m_ImageSize[2] - 2 * this->m_NeighborhoodRadius &&
       index[2] >  2 * this->m_NeighborhoodRadius ) //
       {
+      typename ImageType::PointType pt;
+      image->TransformIndexToPhysicalPoint( index, pt );
       PointType p;
       for( unsigned int k = 0; k < ImageDimension; k++ )
         {
         p[k] = pt[k];
         }
-      this->SetOrigin(p);
-      this->EstimateFrameFromGradient( pt );
-      this->FindNeighborhood();
-      switch( which )
+      this->m_SurfaceIndices.push_back( index );
+      this->m_SurfacePoints.push_back( p );
+      }
+    ++ti;
+    }
+  this->m_FunctionImage->FillBuffer( 0 );
+
+  // every thread works on its own copy of the frame estimation state
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  FrameThreadStruct  str;
+  str.Filter = this;
+  str.Which = which;
+  str.Workers.resize( numberOfThreads );
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    Pointer worker = Self::New();
+    worker->m_FunctionImage = this->m_FunctionImage;
+    worker->ProcessObject::SetNthInput( 0, image );
+    worker->m_ImageSize = this->m_ImageSize;
+    worker->m_GradientImage = this->m_GradientImage;
+    worker->m_Vinterp = this->m_Vinterp;
+    worker->m_SurfaceLabel = this->m_SurfaceLabel;
+    worker->m_NeighborhoodRadius = this->m_NeighborhoodRadius;
+    worker->m_UseLabel = this->m_UseLabel;
+    worker->m_kSign = this->m_kSign;
+    worker->m_Sigma = this->m_Sigma;
+    worker->m_Threshold = this->m_Threshold;
+    worker->m_MinSpacing = this->m_MinSpacing;
+    worker->m_UseGeodesicNeighborhood = this->m_UseGeodesicNeighborhood;
+    worker->m_ti2 = this->m_ti2;
+    str.Workers[n] = worker;
+    }
+
+  // the Weingarten map gradient methods (3, 5, 6 and 7) sample their own
+  // points, the others need the neighborhood of each surface voxel
+  this->m_NeighborhoodOffsets.clear();
+  this->m_NeighborhoodPoints.clear();
+  if( which <= 2 || which == 4 )
+    {
+    str.GatherNeighborhoods = true;
+    str.ThreadPoints.resize( numberOfThreads );
+    str.ThreadCounts.resize( numberOfThreads );
+    this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+    this->GetMultiThreader()->SetSingleMethod( Self::FrameThreaderCallback, &str );
+    this->GetMultiThreader()->SingleMethodExecute();
+
+    unsigned long totalPoints = 0;
+    for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+      {
+      totalPoints += str.ThreadPoints[n].size();
+      }
+    this->m_NeighborhoodPoints.reserve( totalPoints );
+    this->m_NeighborhoodOffsets.reserve( this->m_SurfaceIndices.size() + 1 );
+    this->m_NeighborhoodOffsets.push_back( 0 );
+    for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+      {
+      this->m_NeighborhoodPoints.insert( this->m_NeighborhoodPoints.end(),
+                                         str.ThreadPoints[n].begin(), str.ThreadPoints[n].end() );
+      PointContainerType().swap( str.ThreadPoints[n] );
+      for( unsigned long i = 0; i < str.ThreadCounts[n].size(); i++ )
         {
-        case ( 0 ):
-          {
-          this->ComputeJoshiFrame( this->m_Origin);
-          }
-          break;
-        case ( 1 ):
-          {
-          this->JainMeanAndGaussianCurvature( this->m_Origin);
-          }
-          break;
-        case ( 2 ):
-          {
-          this->ShimshoniFrame(this->m_Origin);
-          }
-          break;
-        case ( 3 ):
-          {
-          this->WeingartenMapGradients();
-          }
-          break;
-        case ( 4 ):
-          {
-          kpix = this->ComputeMeanEuclideanDistance();
-          }
-          break;
-        default:
-          {
-          this->WeingartenMapGradients();
-          }
+        this->m_NeighborhoodOffsets.push_back( this->m_NeighborhoodOffsets.back() + str.ThreadCounts[n][i] );
         }
+      }
+    }
 
-      //      this->PrintFrame();
+  str.GatherNeighborhoods = false;
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( Self::FrameThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
 
-      bool geterror = false;
-      if( geterror )
-        {
-        float error = 0.0;
-        float temp1 = this->ErrorEstimate(this->GetOrigin() );
-        float temp2 = this->ErrorEstimate(this->GetOrigin(), -1);
-        if( temp1 < temp2 )
-          {
-          error = temp1;
-          }
-        else
-          {
-          error = temp2;
-          this->SwitchNormalSign();
-//         this->ComputeWeightsAndDirectionalKappaAndAngles(this->GetOrigin());
-//         this->EstimateCurvature(this->m_A,this->m_B,this->m_B,this->m_C);
-//         this->EstimateCurvature();
-          }
-        // std::cout << " best error " << error << std::endl;
-        }
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::GatherOperatorRow( const IndexType & index, bool norm, std::vector<OffsetValueType> & columns,
+                     std::vector<RealType> & weights )
+{
+  PointType p;
+  for( unsigned int k = 0; k < ImageDimension; k++ )
+    {
+    p[k] = (RealType) index[k];
+    }
+  this->SetOrigin(p);
+  this->FindNeighborhood();
 
-      kpix = 0;
-      float fval = this->m_GaussianKappa;
-      fval = this->m_MeanKappa;
-//      if( fabs(fval) > 1 )
-//        {
-//        fval = 0;
-//        }
-      kpix = this->m_kSign * fval; // sulci
-      if( vnl_math_isnan(kpix)  || vnl_math_isinf(kpix) )
-        {
-        this->m_Kappa1 = 0.0;
-        this->m_Kappa2 = 0.0;
-        this->m_MeanKappa = 0.0;
-        this->m_GaussianKappa = 0.0;
-        this->m_Area = 0.0;
-        kpix = 0.0;
-        }
-      if( which == 5 )
-        {
-        kpix = this->CharacterizeSurface();
-        }
-      if( which == 6 )
+  // the weights of IntegrateFunctionOverNeighborhood
+  const unsigned long first = weights.size();
+  double              tw = 0;
+  for( unsigned int pp = 0; pp < this->m_PointList.size(); pp++ )
+    {
+    IndexType localindex;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      localindex[k] = (long) this->m_PointList[pp][k];
+      }
+    PointType dd = this->m_Origin - this->m_PointList[pp];
+    double    wi = dd.magnitude();
+    if( wi != 0.0 )
+      {
+      wi = 1. / wi;
+      }
+    tw += wi;
+    if( norm && wi == 0.0 )
+      {
+      continue;
+      }
+    columns.push_back( this->m_FunctionImage->ComputeOffset( localindex ) );
+    weights.push_back( norm ? wi : 1 );
+    }
+  if( norm && tw != 0 )
+    {
+    for( unsigned long j = first; j < weights.size(); j++ )
+      {
+      weights[j] /= tw;
+      }
+    }
+  this->m_PointList.clear();
+}
+
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::MultiplySmoothingOperator( const PixelType *input, PixelType *output, RealType *accumulator,
+                             RealType coefficient )
+{
+  OperatorThreadStruct str;
+  str.Filter = this;
+  str.AssembleRows = false;
+  str.Norm = false;
+  str.Input = input;
+  str.Output = output;
+  str.Accumulator = accumulator;
+  str.Coefficient = coefficient;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( Self::OperatorThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+template <typename TSurface>
+ITK_THREAD_RETURN_TYPE
+SurfaceImageCurvature<TSurface>
+::OperatorThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  OperatorThreadStruct *str = static_cast<OperatorThreadStruct *>( info->UserData );
+
+  const Self *        domain = str->Filter;
+  const unsigned long numberOfRows = domain->m_OperatorRows.size();
+  const unsigned long first = numberOfRows * info->ThreadID / info->NumberOfThreads;
+  const unsigned long last = numberOfRows * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  if( str->AssembleRows )
+    {
+    Self *                         worker = str->Workers[info->ThreadID];
+    std::vector<OffsetValueType> & columns = str->ThreadColumns[info->ThreadID];
+    std::vector<RealType> &        weights = str->ThreadWeights[info->ThreadID];
+    std::vector<unsigned long> &   counts = str->ThreadCounts[info->ThreadID];
+    counts.reserve( last - first );
+    for( unsigned long n = first; n < last; n++ )
+      {
+      const unsigned long before = columns.size();
+      worker->GatherOperatorRow( domain->m_FunctionImage->ComputeIndex( domain->m_OperatorRows[n] ),
+                                 str->Norm, columns, weights );
+      counts.push_back( columns.size() - before );
+      }
+    }
+  else if( first < last )
+    {
+    const OffsetValueType *rows = &domain->m_OperatorRows[0];
+    const unsigned long *  offsets = &domain->m_OperatorOffsets[0];
+    const OffsetValueType *columns = domain->m_OperatorColumns.empty() ? ITK_NULLPTR : &domain->m_OperatorColumns[0];
+    const RealType *       weights = domain->m_OperatorWeights.empty() ? ITK_NULLPTR : &domain->m_OperatorWeights[0];
+    for( unsigned long n = first; n < last; n++ )
+      {
+      double value = 0.0;
+      for( unsigned long j = offsets[n]; j < offsets[n + 1]; j++ )
         {
-        kpix = this->m_GaussianKappa;
+        value += weights[j] * str->Input[columns[j]];
         }
-      if( which == 7 )
+      str->Output[rows[n]] = static_cast<PixelType>( value );
+      if( str->Accumulator )
         {
-        kpix = this->m_Area;
+        str->Accumulator[n] += str->Coefficient * value;
         }
-      ct++;
-      this->m_PointList.clear();
       }
-    thresh += kpix;
-    float offset = 0;
-    if( which == 5 )
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::BuildSmoothingOperator(bool norm)
+{
+  ImageType *image = this->GetInput();
+  if( !image || !this->m_FunctionImage )
+    {
+    return;
+    }
+
+  typename ImageType::SizeType rad;
+  typename ImageType::SizeType rad2;
+  for( unsigned int t = 0; t < ImageDimension; t++ )
+    {
+    rad[t] = (unsigned long) (this->m_NeighborhoodRadius);
+    rad2[t] = 1;
+    }
+  this->m_ti.Initialize( rad, image, this->m_FunctionImage->GetLargestPossibleRegion() );
+  this->m_ti2.Initialize( rad2, image, this->m_FunctionImage->GetLargestPossibleRegion() );
+
+  // the surface voxels of IntegrateFunctionOverSurface, in the same order
+  this->m_OperatorRows.clear();
+  this->m_OperatorOffsets.clear();
+  this->m_OperatorColumns.clear();
+  this->m_OperatorWeights.clear();
+  ImageIteratorType ti( image, image->GetLargestPossibleRegion() );
+  for( ti.GoToBegin(); !ti.IsAtEnd(); ++ti )
+    {
+    const IndexType index = ti.GetIndex();
+    if( this->IsValidSurface(ti.Get(), index) &&
+        index[0] < this->m_ImageSize[0] - this->m_NeighborhoodRadius &&
+        index[0] >  this->m_NeighborhoodRadius &&
+        index[1] < this->m_ImageSize[1] - this->m_NeighborhoodRadius &&
+        index[1] >  this->m_NeighborhoodRadius &&
+        index[2] < this->m_ImageSize[2] - this->m_NeighborhoodRadius &&
+        index[2] >  this->m_NeighborhoodRadius )
       {
-      offset = 0;
+      this->m_OperatorRows.push_back( this->m_FunctionImage->ComputeOffset( index ) );
       }
-//    if (  ()  && ( )  ) kpix=0;
-    this->m_FunctionImage->SetPixel( index, offset + kpix );
-    ct2++;
-    ++ti;
+    }
+
+  // every thread searches the neighborhoods with its own copy of the state
+  const ThreadIdType   numberOfThreads = this->GetNumberOfThreads();
+  OperatorThreadStruct str;
+  str.Filter = this;
+  str.AssembleRows = true;
+  str.Norm = norm;
+  str.Input = ITK_NULLPTR;
+  str.Output = ITK_NULLPTR;
+  str.Accumulator = ITK_NULLPTR;
+  str.Coefficient = 0;
+  str.Workers.resize( numberOfThreads );
+  str.ThreadColumns.resize( numberOfThreads );
+  str.ThreadWeights.resize( numberOfThreads );
+  str.ThreadCounts.resize( numberOfThreads );
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    Pointer worker = Self::New();
+    worker->m_FunctionImage = this->m_FunctionImage;
+    worker->ProcessObject::SetNthInput( 0, image );
+    worker->m_ImageSize = this->m_ImageSize;
+    worker->m_SurfaceLabel = this->m_SurfaceLabel;
+    worker->m_NeighborhoodRadius = this->m_NeighborhoodRadius;
+    worker->m_UseLabel = this->m_UseLabel;
+    worker->m_Threshold = this->m_Threshold;
+    worker->m_UseGeodesicNeighborhood = this->m_UseGeodesicNeighborhood;
+    worker->m_ti = this->m_ti;
+    worker->m_ti2 = this->m_ti2;
+    str.Workers[n] = worker;
+    }
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( Self::OperatorThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  unsigned long numberOfEntries = 0;
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    numberOfEntries += str.ThreadColumns[n].size();
+    }
+  this->m_OperatorColumns.reserve( numberOfEntries );
+  this->m_OperatorWeights.reserve( numberOfEntries );
+  this->m_OperatorOffsets.reserve( this->m_OperatorRows.size() + 1 );
+  this->m_OperatorOffsets.push_back( 0 );
+  for( ThreadIdType n = 0; n < numberOfThreads; n++ )
+    {
+    this->m_OperatorColumns.insert( this->m_OperatorColumns.end(),
+                                    str.ThreadColumns[n].begin(), str.ThreadColumns[n].end() );
+    this->m_OperatorWeights.insert( this->m_OperatorWeights.end(),
+                                    str.ThreadWeights[n].begin(), str.ThreadWeights[n].end() );
+    std::vector<OffsetValueType>().swap( str.ThreadColumns[n] );
+    std::vector<RealType>().swap( str.ThreadWeights[n] );
+    for( unsigned long i = 0; i < str.ThreadCounts[n].size(); i++ )
+      {
+      this->m_OperatorOffsets.push_back( this->m_OperatorOffsets.back() + str.ThreadCounts[n][i] );
+      }
+    }
+}
+
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::ApplySmoothingOperator(unsigned int numberOfApplications)
+{
+  if( !this->m_FunctionImage || numberOfApplications == 0 )
+    {
+    return;
+    }
+  if( this->m_OperatorOffsets.empty() )
+    {
+    this->BuildSmoothingOperator( true );
+    }
+
+  // ping-pong between the function image and a copy that is zero off the rows
+  typename OutputImageType::Pointer tempimage = OutputImageType::New();
+  tempimage->CopyInformation( this->m_FunctionImage );
+  tempimage->SetRegions( this->m_FunctionImage->GetLargestPossibleRegion() );
+  tempimage->Allocate();
+  tempimage->FillBuffer( 0 );
+
+  PixelType *functionBuffer = this->m_FunctionImage->GetBufferPointer();
+  PixelType *tempBuffer = tempimage->GetBufferPointer();
+  this->MultiplySmoothingOperator( functionBuffer, tempBuffer, ITK_NULLPTR, 0 );
+  if( numberOfApplications > 1 )
+    {
+    this->m_FunctionImage->FillBuffer( 0 );
+    }
+  PixelType *input = tempBuffer;
+  PixelType *output = functionBuffer;
+  for( unsigned int i = 1; i < numberOfApplications; i++ )
+    {
+    this->MultiplySmoothingOperator( input, output, ITK_NULLPTR, 0 );
+    std::swap( input, output );
+    }
+  if( input != functionBuffer )
+    {
+    const unsigned long numberOfPixels =
+      this->m_FunctionImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    std::copy( input, input + numberOfPixels, functionBuffer );
+    }
+}
+
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::ApplyHeatKernel(RealType t)
+{
+  if( !this->m_FunctionImage || t <= 0 )
+    {
+    return;
+    }
+  if( this->m_OperatorOffsets.empty() )
+    {
+    this->BuildSmoothingOperator( true );
+    }
+
+  typename OutputImageType::Pointer tempimage = OutputImageType::New();
+  tempimage->CopyInformation( this->m_FunctionImage );
+  tempimage->SetRegions( this->m_FunctionImage->GetLargestPossibleRegion() );
+  tempimage->Allocate();
+  tempimage->FillBuffer( 0 );
+
+  PixelType *         functionBuffer = this->m_FunctionImage->GetBufferPointer();
+  PixelType *         tempBuffer = tempimage->GetBufferPointer();
+  const unsigned long numberOfRows = this->m_OperatorRows.size();
+
+  // the k = 0 term; the Poisson weights e^-t t^k/k! are summed until their
+  // remainder is negligible and the sum is rescaled by their total
+  std::vector<RealType> accumulator( numberOfRows );
+  double                coefficient = std::exp( -static_cast<double>( t ) );
+  double                totalWeight = coefficient;
+  for( unsigned long n = 0; n < numberOfRows; n++ )
+    {
+    accumulator[n] = coefficient * functionBuffer[this->m_OperatorRows[n]];
+    }
+
+  const unsigned int maximumNumberOfTerms =
+    static_cast<unsigned int>( t + 10.0 * std::sqrt( static_cast<double>( t ) ) + 10.0 );
+  RealType *         sum = accumulator.empty() ? ITK_NULLPTR : &accumulator[0];
+  PixelType *        input = functionBuffer;
+  PixelType *        output = tempBuffer;
+  for( unsigned int k = 1; k <= maximumNumberOfTerms && 1.0 - totalWeight > 1.e-6; k++ )
+    {
+    coefficient *= static_cast<double>( t ) / static_cast<double>( k );
+    totalWeight += coefficient;
+    this->MultiplySmoothingOperator( input, output, sum, coefficient );
+    if( k == 1 )
+      {
+      // the function image is the next output, it must be zero off the rows
+      this->m_FunctionImage->FillBuffer( 0 );
+      }
+    std::swap( input, output );
+    }
+
+  this->m_FunctionImage->FillBuffer( 0 );
+  for( unsigned long n = 0; n < numberOfRows; n++ )
+    {
+    functionBuffer[this->m_OperatorRows[n]] = static_cast<PixelType>( accumulator[n] / totalWeight );
     }
 }
 
@@ -20,6 +20,12 @@
 #define __itkTextureHistogram_h
 #include "itkNumericTraits.h"
 
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <utility>
+#include <vector>
+
 namespace itk
 {
 namespace Function
@@ -29,22 +35,37 @@ namespace Function
  *
  *
  */
+/*
+ * Histogram of a moving window for the first order statistics of the
+ * neighborhood of each pixel: mean, minimum, maximum, variance, sigma,
+ * skewness, kurtosis, entropy and median.  The power sums and the entropy
+ * sum are updated as pixels are added and removed, so that only the median
+ * needs to walk the histogram.
+ */
 template< class TInputPixel, class TOutputPixel >
 class TextureHistogram
 {
 public:
 
+  itkStaticConstMacro( NumberOfStatistics, unsigned int, 9 );
+
   TextureHistogram()
     {
       m_Count = 0;
+      m_Sum = 0.0;
+      m_Sum2 = 0.0;
+      m_Sum3 = 0.0;
+      m_Sum4 = 0.0;
+      m_SumOfCountLogCount = 0.0;
     }
 
   // ~TextureHistogram()  {} default is ok
 
   void AddPixel( const TInputPixel & p )
     {
-    m_Map[p]++;
+    const size_t c = m_Map[p]++;
     ++m_Count;
+    this->UpdateSums( p, 1.0, c );
     }
 
   void RemovePixel(const TInputPixel & p)
@@ -55,74 +76,42 @@ public:
 
     assert( it != m_Map.end() );
 
+    const size_t c = it->second;
     if ( --(it->second) == 0 )
       {
       m_Map.erase( it );
       }
     --m_Count;
+    this->UpdateSums( p, -1.0, c );
 
   }
 
   TOutputPixel GetValue(const TInputPixel &)
     {
       TOutputPixel out;
-      NumericTraits<TOutputPixel>::SetLength( out, 8 );
+      NumericTraits<TOutputPixel>::SetLength( out, NumberOfStatistics );
+
+      const double count = m_Count;
+      const double sum = m_Sum;
+      const double sum2 = m_Sum2;
+      const double sum3 = m_Sum3;
+      const double sum4 = m_Sum4;
 
-      double sum = 0.0;
-      double sum2 = 0.0;
-      double sum3 = 0.0;
-      double sum4 = 0.0;
-      const size_t count = m_Count;
-      //double median = 0.0;
+      // sum_x -p_x log p_x with p_x = c_x / count
+      const double entropy = std::log( count ) - m_SumOfCountLogCount / count;
 
-      double entropy = 0.0;
+      // the lower median for an even count
+      double median = m_Map.begin()->first;
       size_t curCount = 0;
       for ( typename MapType::iterator i = m_Map.begin(); i != m_Map.end(); ++i )
         {
-        double t = double(i->first)*double(i->second);
-        sum += t;
-        sum2 += ( t *= double(i->first) );
-        sum3 += ( t *= double(i->first) );
-        sum4 += ( t *= double(i->first) );
-
         curCount += i->second;
-
-        const double p_x = double( i->second ) / count;
-        entropy += -p_x*std::log( p_x );
-
-//       // this is wrong!
-//       if ( curCount == count / 2 )
-//         {
-//         median += i->first;
-//         medianIt = il
-//         // we have an even number so take the average
-//           if ( !(count % 2) )
-//             {
-//               median *= 0.5;
-//             }
-//         }
-
-      }
-
-//     curCount = 0;
-//     typename MapType::iterator fmedianIt = medianIt;
-//     typename MapType::iterator rmedianIt = medianIt;
-//     double mad = 0.0;
-
-//     while (curCount < count/2 )
-//     {
-//     if ( std::fabs( fmedianIt->first - median ) < std::fabs( rmedianIt->first - median ) )
-//       {
-//       curCount += fmedianIt->second;
-//       ++fmedianIt;
-//       }
-//     else
-//       {
-//       curCount += rmedianIt->second;
-//       --rmedianIt;
-//       }
-//     }
-
+        if ( 2 * curCount >= m_Count )
+          {
+          median = i->first;
+          break;
+          }
+        }
 
       const double icount = 1.0 / count;
       const double mean = sum * icount;
@@ -152,6 +141,7 @@ public:
     out[i++] = skewness;
     out[i++] = kurtosis;
     out[i++] = entropy;
+    out[i++] = median;
     return out;
   }
 
@@ -162,8 +152,199 @@ public:
 private:
   typedef typename std::map< TInputPixel, size_t > MapType;
 
+  static double CountLogCount( double c )
+  {
+    return ( c > 0.0 ) ? c * std::log( c ) : 0.0;
+  }
+
+  /** p was added (delta = 1) or removed (delta = -1); its count was
+   * oldCount before. */
+  void UpdateSums( const TInputPixel & p, double delta, size_t oldCount )
+  {
+    const double x = static_cast<double>( p );
+    double t = delta * x;
+    m_Sum += t;
+    m_Sum2 += ( t *= x );
+    m_Sum3 += ( t *= x );
+    m_Sum4 += ( t *= x );
+    m_SumOfCountLogCount += CountLogCount( static_cast<double>( oldCount ) + delta )
+      - CountLogCount( static_cast<double>( oldCount ) );
+  }
+
   MapType       m_Map;
   size_t        m_Count;
+  double        m_Sum;
+  double        m_Sum2;
+  double        m_Sum3;
+  double        m_Sum4;
+  double        m_SumOfCountLogCount;
+};
+
+/*
+ * Co-occurrence histogram of a moving window, for the Haralick features of
+ * the neighborhood of each pixel.  The input pixels hold the gray level bin
+ * of a pixel followed by the bins of its neighbors at each of the offsets
+ * (the numeric max of the component type for a neighbor outside the image
+ * or the mask).  Adding a pixel adds its pairs, symmetrically, to the
+ * co-occurrence matrix of each offset.  The sums the features need are
+ * updated with every change so that GetValue does not visit the matrices.
+ *
+ * The features, averaged over the offsets, are the energy, entropy, inverse
+ * difference moment, inertia, cluster shade and cluster prominence, as in
+ * HistogramToTextureFeaturesFilter.
+ */
+template< class TInputPixel, class TOutputPixel >
+class CooccurrenceTextureHistogram
+{
+public:
+
+  itkStaticConstMacro( NumberOfFeatures, unsigned int, 6 );
+
+  // default constructor, destructor and copies are ok
+
+  void AddPixel( const TInputPixel & p )
+    {
+    this->AddPairs( p, 1.0 );
+    }
+
+  void RemovePixel( const TInputPixel & p )
+    {
+    this->AddPairs( p, -1.0 );
+    }
+
+  TOutputPixel GetValue( const TInputPixel & )
+    {
+    TOutputPixel out;
+    NumericTraits<TOutputPixel>::SetLength( out, NumberOfFeatures );
+
+    double       features[NumberOfFeatures] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    unsigned int numberOfOffsets = 0;
+    for( size_t k = 0; k < m_Sums.size(); k++ )
+      {
+      const OffsetSums & sums = m_Sums[k];
+      if( sums.Count < 0.5 )
+        {
+        continue;
+        }
+      const double n = sums.Count;
+      const double mean = sums.SumOfI / n;
+      const double s1 = sums.SumOfS[0] / n;
+      const double s2 = sums.SumOfS[1] / n;
+      const double s3 = sums.SumOfS[2] / n;
+      const double s4 = sums.SumOfS[3] / n;
+
+      features[0] += sums.SumOfSquaredCounts / ( n * n );
+      features[1] += ( std::log( n ) - sums.SumOfCountLogCount / n ) / std::log( 2.0 );
+      features[2] += sums.InverseDifferenceMoment / n;
+      features[3] += sums.Inertia / n;
+      // E[(s - 2 mean)^3] and E[(s - 2 mean)^4] for s = i + j
+      features[4] += s3 - 6.0 * mean * s2 + 12.0 * mean * mean * s1 - 8.0 * mean * mean * mean;
+      features[5] += s4 - 8.0 * mean * s3 + 24.0 * mean * mean * s2 - 32.0 * mean * mean * mean * s1
+        + 16.0 * mean * mean * mean * mean;
+      numberOfOffsets++;
+      }
+    for( unsigned int i = 0; i < NumberOfFeatures; i++ )
+      {
+      out[i] = ( numberOfOffsets > 0 ) ? features[i] / numberOfOffsets : 0.0;
+      }
+    return out;
+    }
+
+  void AddBoundary(){}
+
+  void RemoveBoundary(){}
+
+private:
+  typedef typename NumericTraits<TInputPixel>::ValueType BinType;
+
+  struct OffsetSums
+    {
+    OffsetSums() :
+      Count( 0.0 ), SumOfSquaredCounts( 0.0 ), SumOfCountLogCount( 0.0 ),
+      InverseDifferenceMoment( 0.0 ), Inertia( 0.0 ), SumOfI( 0.0 )
+      {
+      SumOfS[0] = SumOfS[1] = SumOfS[2] = SumOfS[3] = 0.0;
+      }
+
+    double Count;
+    double SumOfSquaredCounts;
+    double SumOfCountLogCount;
+    double InverseDifferenceMoment;
+    double Inertia;
+    double SumOfI;
+    double SumOfS[4];
+    };
+
+  typedef std::pair< unsigned int, std::pair< BinType, BinType > > KeyType;
+  typedef std::map< KeyType, size_t >                              MapType;
+
+  static double CountLogCount( double c )
+  {
+    return ( c > 0.0 ) ? c * std::log( c ) : 0.0;
+  }
+
+  void AddPairs( const TInputPixel & p, double delta )
+  {
+    const unsigned int numberOfOffsets = NumericTraits<TInputPixel>::GetLength( p ) - 1;
+    if( m_Sums.size() < numberOfOffsets )
+      {
+      m_Sums.resize( numberOfOffsets );
+      }
+    const BinType outside = NumericTraits<BinType>::max();
+    if( p[0] == outside )
+      {
+      return;
+      }
+    for( unsigned int k = 0; k < numberOfOffsets; k++ )
+      {
+      if( p[k + 1] == outside )
+        {
+        continue;
+        }
+      this->AddEntry( k, p[0], p[k + 1], delta );
+      this->AddEntry( k, p[k + 1], p[0], delta );
+      }
+  }
+
+  void AddEntry( unsigned int k, BinType i, BinType j, double delta )
+  {
+    const KeyType key( k, std::make_pair( i, j ) );
+    typename MapType::iterator it = m_Map.find( key );
+    const double oldCount = ( it == m_Map.end() ) ? 0.0 : static_cast<double>( it->second );
+    const double newCount = oldCount + delta;
+    if( it == m_Map.end() )
+      {
+      assert( delta > 0 );
+      m_Map.insert( std::make_pair( key, size_t( 1 ) ) );
+      }
+    else if( newCount < 0.5 )
+      {
+      m_Map.erase( it );
+      }
+    else
+      {
+      it->second = static_cast<size_t>( newCount );
+      }
+
+    OffsetSums & sums = m_Sums[k];
+    const double d = static_cast<double>( i ) - static_cast<double>( j );
+    const double s = static_cast<double>( i ) + static_cast<double>( j );
+    sums.Count += delta;
+    sums.SumOfSquaredCounts += newCount * newCount - oldCount * oldCount;
+    sums.SumOfCountLogCount += CountLogCount( newCount ) - CountLogCount( oldCount );
+    sums.InverseDifferenceMoment += delta / ( 1.0 + d * d );
+    sums.Inertia += delta * d * d;
+    sums.SumOfI += delta * static_cast<double>( i );
+    double sk = delta;
+    for( unsigned int n = 0; n < 4; n++ )
+      {
+      sk *= s;
+      sums.SumOfS[n] += sk;
+      }
+  }
+
+  MapType                 m_Map;
+  std::vector<OffsetSums> m_Sums;
 };
 
 } // end namespace Function
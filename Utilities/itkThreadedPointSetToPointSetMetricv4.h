@@ -0,0 +1,128 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkThreadedPointSetToPointSetMetricv4_h
+#define __itkThreadedPointSetToPointSetMetricv4_h
+
+#include "itkMultiThreader.h"
+
+#include <map>
+#include <vector>
+
+namespace itk
+{
+/** \class ThreadedPointSetToPointSetMetricv4
+ *
+ * EuclideanDistancePointSetToPointSetMetricv4,
+ * ExpectationBasedPointSetToPointSetMetricv4 or
+ * JensenHavrdaCharvatTsallisPointSetToPointSetMetricv4 (the template
+ * parameter) whose correspondence searches run on all threads.
+ *
+ * The superclass evaluates the fixed points one after the other, each one a
+ * search in the locator of the moving points (or in the density of the
+ * moving points for JHCT).  Here, once the superclass has transformed the
+ * points and built its locators for the iteration, the local values and
+ * derivatives of all of the fixed points are computed on the threads of an
+ * itk::MultiThreader, each one a contiguous range of the points, and the
+ * loop of the superclass reads them back.  The locators are only searched,
+ * which the k-d trees allow from several threads, as in the legacy PSE
+ * metric.  The results are those of the superclass.
+ *
+ * The evaluations are skipped when neither the fixed nor the moving points
+ * moved since the previous iteration, as between the evaluations of a line
+ * search which come back to the same parameters.
+ *
+ * The local evaluations of these metrics do not depend on the point data,
+ * which is not read.
+ */
+template <typename TPointSetMetric>
+class ThreadedPointSetToPointSetMetricv4 : public TPointSetMetric
+{
+public:
+  /** Standard class typedefs. */
+  typedef ThreadedPointSetToPointSetMetricv4 Self;
+  typedef TPointSetMetric                    Superclass;
+  typedef SmartPointer<Self>                 Pointer;
+  typedef SmartPointer<const Self>           ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( ThreadedPointSetToPointSetMetricv4, PointSetToPointSetMetricv4 );
+
+  typedef typename Superclass::PointType           PointType;
+  typedef typename Superclass::PixelType           PixelType;
+  typedef typename Superclass::MeasureType         MeasureType;
+  typedef typename Superclass::LocalDerivativeType LocalDerivativeType;
+
+  virtual void InitializeForIteration() const ITK_OVERRIDE;
+
+  virtual MeasureType GetLocalNeighborhoodValue( const PointType &, const PixelType & pixel = 0 ) const ITK_OVERRIDE;
+
+  virtual void GetLocalNeighborhoodValueAndDerivative( const PointType &, MeasureType &, LocalDerivativeType &,
+                                                       const PixelType & pixel = 0 ) const ITK_OVERRIDE;
+
+protected:
+  ThreadedPointSetToPointSetMetricv4();
+  virtual ~ThreadedPointSetToPointSetMetricv4()
+  {
+  }
+
+private:
+  ThreadedPointSetToPointSetMetricv4( const Self & ); // purposely not implemented
+  void operator=( const Self & );                     // purposely not implemented
+
+  struct PointCompare
+    {
+    bool operator()( const PointType & a, const PointType & b ) const
+    {
+      for( unsigned int d = 0; d < PointType::PointDimension; d++ )
+        {
+        if( a[d] != b[d] )
+          {
+          return a[d] < b[d];
+          }
+        }
+      return false;
+    }
+    };
+
+  typedef std::map<PointType, SizeValueType, PointCompare> PointIndexMapType;
+
+  struct ThreadStruct
+    {
+    const Self *                   Metric;
+    const std::vector<PointType> * Points;
+    };
+
+  static ITK_THREAD_RETURN_TYPE EvaluateThreaderCallback( void *arg );
+
+  /** whether the points are those of the evaluation kept */
+  bool ArePointsCached( const std::vector<PointType> & fixedPoints,
+                        const std::vector<PointType> & movingPoints ) const;
+
+  mutable std::vector<PointType>           m_CachedFixedPoints;
+  mutable std::vector<PointType>           m_CachedMovingPoints;
+  mutable std::vector<MeasureType>         m_CachedValues;
+  mutable std::vector<LocalDerivativeType> m_CachedDerivatives;
+  mutable PointIndexMapType                m_CachedPointIndices;
+  mutable bool                             m_IsCacheValid;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkThreadedPointSetToPointSetMetricv4.hxx"
+#endif
+
+#endif
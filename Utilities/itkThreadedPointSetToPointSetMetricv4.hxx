@@ -0,0 +1,161 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkThreadedPointSetToPointSetMetricv4_hxx
+#define __itkThreadedPointSetToPointSetMetricv4_hxx
+
+#include "itkThreadedPointSetToPointSetMetricv4.h"
+
+#include <algorithm>
+
+namespace itk
+{
+template <typename TPointSetMetric>
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::ThreadedPointSetToPointSetMetricv4() :
+  m_IsCacheValid( false )
+{
+}
+
+template <typename TPointSetMetric>
+void
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::InitializeForIteration() const
+{
+  // the superclass may evaluate points itself while it sets up the iteration
+  this->m_IsCacheValid = false;
+
+  Superclass::InitializeForIteration();
+
+  typedef typename Superclass::FixedTransformedPointSetType::PointsContainerConstIterator  FixedIteratorType;
+  typedef typename Superclass::MovingTransformedPointSetType::PointsContainerConstIterator MovingIteratorType;
+
+  std::vector<PointType> fixedPoints;
+  fixedPoints.reserve( this->m_FixedTransformedPointSet->GetNumberOfPoints() );
+  for( FixedIteratorType It = this->m_FixedTransformedPointSet->GetPoints()->Begin();
+       It != this->m_FixedTransformedPointSet->GetPoints()->End(); ++It )
+    {
+    fixedPoints.push_back( It.Value() );
+    }
+  std::vector<PointType> movingPoints;
+  movingPoints.reserve( this->m_MovingTransformedPointSet->GetNumberOfPoints() );
+  for( MovingIteratorType It = this->m_MovingTransformedPointSet->GetPoints()->Begin();
+       It != this->m_MovingTransformedPointSet->GetPoints()->End(); ++It )
+    {
+    movingPoints.push_back( It.Value() );
+    }
+
+  if( this->ArePointsCached( fixedPoints, movingPoints ) )
+    {
+    this->m_IsCacheValid = true;
+    return;
+    }
+
+  const SizeValueType numberOfPoints = fixedPoints.size();
+  this->m_CachedValues.resize( numberOfPoints );
+  this->m_CachedDerivatives.resize( numberOfPoints );
+
+  ThreadStruct str;
+  str.Metric = this;
+  str.Points = &fixedPoints;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( std::max( std::min( static_cast<SizeValueType>(
+                                                      threader->GetNumberOfThreads() ), numberOfPoints ),
+                                          static_cast<SizeValueType>( 1 ) ) );
+  threader->SetSingleMethod( EvaluateThreaderCallback, &str );
+  threader->SingleMethodExecute();
+
+  this->m_CachedPointIndices.clear();
+  for( SizeValueType n = 0; n < numberOfPoints; n++ )
+    {
+    this->m_CachedPointIndices.insert( std::make_pair( fixedPoints[n], n ) );
+    }
+  this->m_CachedFixedPoints.swap( fixedPoints );
+  this->m_CachedMovingPoints.swap( movingPoints );
+  this->m_IsCacheValid = true;
+}
+
+template <typename TPointSetMetric>
+bool
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::ArePointsCached( const std::vector<PointType> & fixedPoints, const std::vector<PointType> & movingPoints ) const
+{
+  if( fixedPoints.size() != this->m_CachedFixedPoints.size()
+      || movingPoints.size() != this->m_CachedMovingPoints.size()
+      || this->m_CachedValues.size() != fixedPoints.size() )
+    {
+    return false;
+    }
+  return std::equal( fixedPoints.begin(), fixedPoints.end(), this->m_CachedFixedPoints.begin() )
+         && std::equal( movingPoints.begin(), movingPoints.end(), this->m_CachedMovingPoints.begin() );
+}
+
+template <typename TPointSetMetric>
+ITK_THREAD_RETURN_TYPE
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::EvaluateThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  ThreadStruct *                   str = static_cast<ThreadStruct *>( info->UserData );
+
+  const std::vector<PointType> & points = *str->Points;
+  const SizeValueType            first = points.size() * info->ThreadID / info->NumberOfThreads;
+  const SizeValueType            last = points.size() * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+
+  const PixelType pixel = NumericTraits<PixelType>::ZeroValue();
+  for( SizeValueType n = first; n < last; n++ )
+    {
+    str->Metric->Superclass::GetLocalNeighborhoodValueAndDerivative( points[n], str->Metric->m_CachedValues[n],
+                                                                     str->Metric->m_CachedDerivatives[n], pixel );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <typename TPointSetMetric>
+typename ThreadedPointSetToPointSetMetricv4<TPointSetMetric>::MeasureType
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::GetLocalNeighborhoodValue( const PointType & point, const PixelType & pixel ) const
+{
+  if( this->m_IsCacheValid )
+    {
+    typename PointIndexMapType::const_iterator it = this->m_CachedPointIndices.find( point );
+    if( it != this->m_CachedPointIndices.end() )
+      {
+      return this->m_CachedValues[it->second];
+      }
+    }
+  return Superclass::GetLocalNeighborhoodValue( point, pixel );
+}
+
+template <typename TPointSetMetric>
+void
+ThreadedPointSetToPointSetMetricv4<TPointSetMetric>
+::GetLocalNeighborhoodValueAndDerivative( const PointType & point, MeasureType & measure,
+                                          LocalDerivativeType & localDerivative, const PixelType & pixel ) const
+{
+  if( this->m_IsCacheValid )
+    {
+    typename PointIndexMapType::const_iterator it = this->m_CachedPointIndices.find( point );
+    if( it != this->m_CachedPointIndices.end() )
+      {
+      measure = this->m_CachedValues[it->second];
+      localDerivative = this->m_CachedDerivatives[it->second];
+      return;
+      }
+    }
+  Superclass::GetLocalNeighborhoodValueAndDerivative( point, measure, localDerivative, pixel );
+}
+} // end namespace itk
+
+#endif
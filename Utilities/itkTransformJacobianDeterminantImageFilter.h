@@ -0,0 +1,112 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkTransformJacobianDeterminantImageFilter_h
+#define __itkTransformJacobianDeterminantImageFilter_h
+
+#include "itkImageBase.h"
+#include "itkImageSource.h"
+#include "itkTransform.h"
+
+namespace itk
+{
+/** \class TransformJacobianDeterminantImageFilter
+ *
+ * The (log-)Jacobian determinant of the mapping of a transform, e.g. a
+ * composite transform, over the lattice of a reference image, without
+ * composing the transform into a displacement field.  The transform is
+ * evaluated once per voxel of each scanline of the output region and of its
+ * neighboring scanlines; the Jacobian is estimated with central differences
+ * of the mapped points, one-sided at the boundary of the lattice, which the
+ * gradient of a displacement field of the same lattice would give.
+ *
+ * With CalculateLogJacobian on, the determinants are clamped to
+ * MinimumJacobian before their log is taken.
+ */
+template <typename TOutputImage, typename TTransformPrecision = double>
+class TransformJacobianDeterminantImageFilter :
+  public ImageSource<TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef TransformJacobianDeterminantImageFilter Self;
+  typedef ImageSource<TOutputImage>               Superclass;
+  typedef SmartPointer<Self>                      Pointer;
+  typedef SmartPointer<const Self>                ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( TransformJacobianDeterminantImageFilter, ImageSource );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TOutputImage::ImageDimension );
+
+  typedef TOutputImage                                                  OutputImageType;
+  typedef typename OutputImageType::PixelType                           OutputPixelType;
+  typedef typename OutputImageType::RegionType                          OutputImageRegionType;
+  typedef ImageBase<ImageDimension>                                     ReferenceImageType;
+  typedef Transform<TTransformPrecision, ImageDimension, ImageDimension> TransformType;
+  typedef typename TransformType::InputPointType                        InputPointType;
+  typedef typename TransformType::OutputPointType                       OutputPointType;
+
+  /** The transform, applied to the points of the reference image lattice. */
+  itkSetConstObjectMacro( Transform, TransformType );
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** The image whose lattice the output has. */
+  itkSetConstObjectMacro( ReferenceImage, ReferenceImageType );
+  itkGetConstObjectMacro( ReferenceImage, ReferenceImageType );
+
+  itkSetMacro( CalculateLogJacobian, bool );
+  itkGetConstMacro( CalculateLogJacobian, bool );
+  itkBooleanMacro( CalculateLogJacobian );
+
+  itkSetMacro( MinimumJacobian, double );
+  itkGetConstMacro( MinimumJacobian, double );
+
+protected:
+  TransformJacobianDeterminantImageFilter();
+  virtual ~TransformJacobianDeterminantImageFilter()
+  {
+  }
+
+  virtual void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  virtual void ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                                     ThreadIdType threadId ) ITK_OVERRIDE;
+
+private:
+  TransformJacobianDeterminantImageFilter( const Self & ); // purposely not implemented
+  void operator=( const Self & );                          // purposely not implemented
+
+  /** Map the points of a scanline, from index[0] to index[0] + length - 1. */
+  void MapScanline( typename OutputImageType::IndexType index, SizeValueType length,
+                    OutputPointType *mappedPoints ) const;
+
+  typename TransformType::ConstPointer      m_Transform;
+  typename ReferenceImageType::ConstPointer m_ReferenceImage;
+  bool                                      m_CalculateLogJacobian;
+  double                                    m_MinimumJacobian;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkTransformJacobianDeterminantImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,207 @@
+/*=========================================================================
+
+  Program:   Advanced Normalization Tools
+
+  Copyright (c) ConsortiumOfANTS. All rights reserved.
+  See accompanying COPYING.txt or
+ https://github.com/stnava/ANTs/blob/master/ANTSCopyright.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+#ifndef __itkTransformJacobianDeterminantImageFilter_hxx
+#define __itkTransformJacobianDeterminantImageFilter_hxx
+
+#include "itkTransformJacobianDeterminantImageFilter.h"
+
+#include "itkImageLinearIteratorWithIndex.h"
+#include "itkProgressReporter.h"
+
+#include "vnl/vnl_det.h"
+#include "vnl/vnl_inverse.h"
+#include "vnl/vnl_matrix_fixed.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace itk
+{
+template <typename TOutputImage, typename TTransformPrecision>
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::TransformJacobianDeterminantImageFilter() :
+  m_Transform( ITK_NULLPTR ),
+  m_ReferenceImage( ITK_NULLPTR ),
+  m_CalculateLogJacobian( false ),
+  m_MinimumJacobian( 0.001 )
+{
+}
+
+template <typename TOutputImage, typename TTransformPrecision>
+void
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  if( !this->m_ReferenceImage )
+    {
+    itkExceptionMacro( << "The reference image is not set." );
+    }
+
+  OutputImageType *output = this->GetOutput();
+  output->SetOrigin( this->m_ReferenceImage->GetOrigin() );
+  output->SetSpacing( this->m_ReferenceImage->GetSpacing() );
+  output->SetDirection( this->m_ReferenceImage->GetDirection() );
+  output->SetLargestPossibleRegion( this->m_ReferenceImage->GetLargestPossibleRegion() );
+}
+
+template <typename TOutputImage, typename TTransformPrecision>
+void
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::BeforeThreadedGenerateData()
+{
+  if( !this->m_Transform )
+    {
+    itkExceptionMacro( << "The transform is not set." );
+    }
+}
+
+template <typename TOutputImage, typename TTransformPrecision>
+void
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::MapScanline( typename OutputImageType::IndexType index, SizeValueType length,
+               OutputPointType *mappedPoints ) const
+{
+  const OutputImageType *output = this->GetOutput();
+  for( SizeValueType i = 0; i < length; i++, index[0]++ )
+    {
+    InputPointType point;
+    output->TransformIndexToPhysicalPoint( index, point );
+    mappedPoints[i] = this->m_Transform->TransformPoint( point );
+    }
+}
+
+template <typename TOutputImage, typename TTransformPrecision>
+void
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId )
+{
+  typedef typename OutputImageType::IndexType                      IndexType;
+  typedef vnl_matrix_fixed<double, ImageDimension, ImageDimension> MatrixType;
+
+  OutputImageType *output = this->GetOutput();
+
+  const OutputImageRegionType & largestRegion = output->GetLargestPossibleRegion();
+  const IndexType               largestFirst = largestRegion.GetIndex();
+  IndexType                     largestLast;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    largestLast[d] = largestFirst[d] + static_cast<IndexValueType>( largestRegion.GetSize()[d] ) - 1;
+    }
+
+  // J = G M^-1 with G the derivatives along the index axes and M the
+  // derivatives of the lattice points, whose columns also stand in for the
+  // axes along which the lattice has a single point
+  MatrixType indexToPhysical;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      indexToPhysical( i, j ) = output->GetDirection()( i, j ) * output->GetSpacing()[j];
+      }
+    }
+  const MatrixType physicalToIndex = vnl_inverse( indexToPhysical );
+
+  // the scanline of the region, with one more point on each side where the
+  // lattice has it, and the scanlines before and after it along the other axes
+  const SizeValueType  length = outputRegionForThread.GetSize()[0];
+  const IndexValueType first = outputRegionForThread.GetIndex()[0];
+  const IndexValueType lower = std::max( first - 1, largestFirst[0] );
+  const IndexValueType upper = std::min( first + static_cast<IndexValueType>( length ), largestLast[0] );
+
+  std::vector<OutputPointType> centerLine( upper - lower + 1 );
+  std::vector<OutputPointType> previousLines( ( ImageDimension - 1 ) * length );
+  std::vector<OutputPointType> nextLines( ( ImageDimension - 1 ) * length );
+  std::vector<IndexValueType>  steps( ImageDimension, 0 );
+
+  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() / length );
+
+  ImageLinearIteratorWithIndex<OutputImageType> It( output, outputRegionForThread );
+  It.SetDirection( 0 );
+  for( It.GoToBegin(); !It.IsAtEnd(); It.NextLine() )
+    {
+    IndexType index = It.GetIndex();
+    index[0] = lower;
+    this->MapScanline( index, centerLine.size(), &centerLine[0] );
+    index[0] = first;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      IndexType previous = index;
+      IndexType next = index;
+      previous[d] = std::max( index[d] - 1, largestFirst[d] );
+      next[d] = std::min( index[d] + 1, largestLast[d] );
+      steps[d] = next[d] - previous[d];
+      if( steps[d] > 0 )
+        {
+        this->MapScanline( previous, length, &previousLines[( d - 1 ) * length] );
+        this->MapScanline( next, length, &nextLines[( d - 1 ) * length] );
+        }
+      }
+
+    for( SizeValueType i = 0; !It.IsAtEndOfLine(); ++It, i++ )
+      {
+      const IndexValueType x = first + static_cast<IndexValueType>( i );
+      const SizeValueType  center = static_cast<SizeValueType>( x - lower );
+      const SizeValueType  before = x > lower ? center - 1 : center;
+      const SizeValueType  after = x < upper ? center + 1 : center;
+
+      MatrixType indexJacobian;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        OutputPointType previousPoint;
+        OutputPointType nextPoint;
+        double          step;
+        if( d == 0 )
+          {
+          previousPoint = centerLine[before];
+          nextPoint = centerLine[after];
+          step = static_cast<double>( after - before );
+          }
+        else
+          {
+          previousPoint = previousLines[( d - 1 ) * length + i];
+          nextPoint = nextLines[( d - 1 ) * length + i];
+          step = static_cast<double>( steps[d] );
+          }
+        for( unsigned int r = 0; r < ImageDimension; r++ )
+          {
+          indexJacobian( r, d ) = step > 0.0 ? ( nextPoint[r] - previousPoint[r] ) / step : indexToPhysical( r, d );
+          }
+        }
+
+      double jacobian = vnl_det( MatrixType( indexJacobian * physicalToIndex ) );
+      if( this->m_CalculateLogJacobian )
+        {
+        jacobian = std::log( std::max( jacobian, this->m_MinimumJacobian ) );
+        }
+      It.Set( static_cast<OutputPixelType>( jacobian ) );
+      }
+    progress.CompletedPixel();
+    }
+}
+
+template <typename TOutputImage, typename TTransformPrecision>
+void
+TransformJacobianDeterminantImageFilter<TOutputImage, TTransformPrecision>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Calculate log Jacobian: " << this->m_CalculateLogJacobian << std::endl;
+  os << indent << "Minimum Jacobian: " << this->m_MinimumJacobian << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -22,6 +22,8 @@
 #include "itkImage.h"
 #include "itkNumericTraits.h"
 
+#include <vector>
+
 namespace itk
 {
 /** \class VarianceImageFilter
@@ -30,6 +32,9 @@ namespace itk
  * Computes an image where a given pixel is the variance value of the
  * the pixels in a neighborhood about the corresponding input pixel.
  *
+ * The neighborhood sums are computed separably with running windows, so the
+ * cost per pixel does not grow with the radius.
+ *
  * A variacne filter is one of the family of linear filters.
  *
  * \sa Image
@@ -106,6 +111,12 @@ protected:
                             ThreadIdType threadId) ITK_OVERRIDE;
 
 private:
+  /** Running window sums of width 2 radius + 1 of input, a buffer of the
+   * given size, along dimension.  The size along dimension shrinks by
+   * 2 radius. */
+  static void BoxSumAlongDimension(const std::vector< double > & input, std::vector< SizeValueType > & size,
+                                   unsigned int dimension, SizeValueType radius, std::vector< double > & output);
+
   VarianceImageFilter(const Self &); //purposely not implemented
   void operator=(const Self &);  //purposely not implemented
 };
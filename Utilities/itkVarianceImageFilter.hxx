@@ -19,13 +19,11 @@
 #define itkVarianceImageFilter_hxx
 #include "itkVarianceImageFilter.h"
 
-#include "itkConstNeighborhoodIterator.h"
-#include "itkNeighborhoodInnerProduct.h"
 #include "itkImageRegionIterator.h"
-#include "itkNeighborhoodAlgorithm.h"
-#include "itkOffset.h"
 #include "itkProgressReporter.h"
 
+#include <algorithm>
+
 namespace itk
 {
 template< typename TInputImage, typename TOutputImage >
@@ -36,65 +34,115 @@ VarianceImageFilter< TInputImage, TOutputImage >
 template< typename TInputImage, typename TOutputImage >
 void
 VarianceImageFilter< TInputImage, TOutputImage >
-::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
-                       ThreadIdType threadId)
+::BoxSumAlongDimension(const std::vector< double > & input, std::vector< SizeValueType > & size,
+                       unsigned int dimension, SizeValueType radius, std::vector< double > & output)
 {
-  unsigned int i;
-
-  ZeroFluxNeumannBoundaryCondition< InputImageType > nbc;
+  SizeValueType stride = 1;
+  for ( unsigned int d = 0; d < dimension; ++d )
+    {
+    stride *= size[d];
+    }
+  SizeValueType outer = 1;
+  for ( unsigned int d = dimension + 1; d < InputImageDimension; ++d )
+    {
+    outer *= size[d];
+    }
+  const SizeValueType length = size[dimension];
+  const SizeValueType width = 2 * radius + 1;
+  const SizeValueType outputLength = length - 2 * radius;
 
-  ConstNeighborhoodIterator< InputImageType > bit;
-  ImageRegionIterator< OutputImageType >      it;
+  output.resize( stride * outputLength * outer );
+  for ( SizeValueType o = 0; o < outer; ++o )
+    {
+    const double *in = &input[o * length * stride];
+    double *      out = &output[o * outputLength * stride];
+    for ( SizeValueType j = 0; j < stride; ++j )
+      {
+      double sum = 0.0;
+      for ( SizeValueType k = 0; k < width; ++k )
+        {
+        sum += in[k * stride + j];
+        }
+      out[j] = sum;
+      for ( SizeValueType k = 1; k < outputLength; ++k )
+        {
+        sum += in[( k + width - 1 ) * stride + j] - in[( k - 1 ) * stride + j];
+        out[k * stride + j] = sum;
+        }
+      }
+    }
+  size[dimension] = outputLength;
+}
 
-  // Allocate output
+template< typename TInputImage, typename TOutputImage >
+void
+VarianceImageFilter< TInputImage, TOutputImage >
+::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                       ThreadIdType threadId)
+{
+  // Box sums of the values and of their squares, separably: each dimension
+  // in turn is summed with a running window, so the cost per pixel does not
+  // depend on the radius.  Pixels outside the image take the value of the
+  // nearest pixel of the image (zero flux Neumann boundary).
   typename OutputImageType::Pointer output = this->GetOutput();
   typename  InputImageType::ConstPointer input  = this->GetInput();
 
-  // Find the data-set boundary "faces"
-  typename NeighborhoodAlgorithm::ImageBoundaryFacesCalculator< InputImageType >::FaceListType faceList;
-  NeighborhoodAlgorithm::ImageBoundaryFacesCalculator< InputImageType > bC;
-  faceList = bC( input, outputRegionForThread, this->GetRadius() );
-
-  typename NeighborhoodAlgorithm::ImageBoundaryFacesCalculator< InputImageType >::FaceListType::iterator fit;
-
-  // support progress methods/callbacks
-  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
-
-  InputRealType sum;
-  InputRealType sumOfSquares;
-
-  // Process each of the boundary faces.  These are N-d regions which border
-  // the edge of the buffer.
-  for ( fit = faceList.begin(); fit != faceList.end(); ++fit )
+  const InputSizeType              radius = this->GetRadius();
+  const InputImageRegionType &     largestRegion = input->GetLargestPossibleRegion();
+  typename InputImageType::IndexType start;
+  std::vector< SizeValueType >     size( InputImageDimension );
+  SizeValueType                    numberOfPaddedPixels = 1;
+  double                           num = 1.0;
+  for ( unsigned int d = 0; d < InputImageDimension; ++d )
     {
-    bit = ConstNeighborhoodIterator< InputImageType >(this->GetRadius(),
-                                                      input, *fit);
-    unsigned int neighborhoodSize = bit.Size();
-    it = ImageRegionIterator< OutputImageType >(output, *fit);
-    bit.OverrideBoundaryCondition(&nbc);
-    bit.GoToBegin();
+    start[d] = outputRegionForThread.GetIndex()[d] - static_cast< OffsetValueType >( radius[d] );
+    size[d] = outputRegionForThread.GetSize()[d] + 2 * radius[d];
+    numberOfPaddedPixels *= size[d];
+    num *= static_cast< double >( 2 * radius[d] + 1 );
+    }
 
-    while ( !bit.IsAtEnd() )
+  std::vector< double > sum( numberOfPaddedPixels );
+  std::vector< double > sumOfSquares( numberOfPaddedPixels );
+  for ( SizeValueType n = 0; n < numberOfPaddedPixels; ++n )
+    {
+    typename InputImageType::IndexType index;
+    SizeValueType                      rest = n;
+    for ( unsigned int d = 0; d < InputImageDimension; ++d )
       {
-      sum = NumericTraits< InputRealType >::ZeroValue();
-      sumOfSquares = NumericTraits< InputRealType >::ZeroValue();
+      const OffsetValueType first = largestRegion.GetIndex()[d];
+      const OffsetValueType last = first + static_cast< OffsetValueType >( largestRegion.GetSize()[d] ) - 1;
+      index[d] = std::min( std::max( start[d] + static_cast< OffsetValueType >( rest % size[d] ), first ), last );
+      rest /= size[d];
+      }
+    const double value = static_cast< double >( input->GetPixel( index ) );
+    sum[n] = value;
+    sumOfSquares[n] = value * value;
+    }
 
-      for ( i = 0; i < neighborhoodSize; ++i )
-        {
-        sum += static_cast< InputRealType >( bit.GetPixel(i) );
-        sumOfSquares += vnl_math_sqr( static_cast< InputRealType >( bit.GetPixel(i) ) );
-        }
+  std::vector< double > scratch;
+  for ( unsigned int d = 0; d < InputImageDimension; ++d )
+    {
+    std::vector< SizeValueType > squaresSize( size );
+    this->BoxSumAlongDimension( sum, size, d, radius[d], scratch );
+    sum.swap( scratch );
+    this->BoxSumAlongDimension( sumOfSquares, squaresSize, d, radius[d], scratch );
+    sumOfSquares.swap( scratch );
+    }
 
-      // get the variance value
-      const double num = static_cast< double >( neighborhoodSize );
-      OutputPixelType var = ( sumOfSquares - ( vnl_math_sqr( sum ) / num ) ) / ( num - 1.0 );
+  // support progress methods/callbacks
+  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
 
-      it.Set( var );
+  // the sums are now in the order of the output region
+  ImageRegionIterator< OutputImageType > it( output, outputRegionForThread );
+  SizeValueType                          n = 0;
+  for ( it.GoToBegin(); !it.IsAtEnd(); ++it, ++n )
+    {
+    // get the variance value
+    const OutputPixelType var = static_cast< OutputPixelType >(
+      ( sumOfSquares[n] - ( vnl_math_sqr( sum[n] ) / num ) ) / ( num - 1.0 ) );
 
-      ++bit;
-      ++it;
-      progress.CompletedPixel();
-      }
+    it.Set( var );
+    progress.CompletedPixel();
     }
 }
 } // end namespace itk
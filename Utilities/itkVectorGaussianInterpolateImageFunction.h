@@ -17,6 +17,9 @@
 #include "itkInterpolateImageFunction.h"
 #include "vnl/vnl_erf.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
+
+#include <vector>
+
 namespace itk
 {
 /** \class VectorGaussianInterpolateImageFunction
@@ -142,7 +145,6 @@ public:
     // The bound variables for x, y, z
     int i0[VDim], i1[VDim];
     // Compute the ERF difference arrays
-    //      std::cout << " index " << index << " VD " << VDim << std::endl;
     for( size_t d = 0; d < VDim; d++ )
       {
       if( index[d] <= 0 || index[d] >= this->m_ImageSize[d] - 1  || vnl_math_isnan(index[d]) ||
@@ -153,84 +155,121 @@ public:
       double *pdx = const_cast<double *>(dx[d].data_block() );
       double *pgx = grad ?  const_cast<double *>(gx[d].data_block() ) : ITK_NULLPTR;
       compute_erf_array(pdx, i0[d], i1[d], bb_start[d], nt[d], cut[d], index[d], sf[d], pgx);
+      if( i1[d] <= i0[d] )
+        {
+        return Vout;
+        }
+      }
+
+    // The weights are products of the erf differences along each axis, so
+    // the product over the slower axes is formed once per row of the region.
+    // All the components are summed in the same pass over the voxels.
+    const InputImageType *     image = this->GetInputImage();
+    const PixelType *          buffer = image->GetBufferPointer();
+    const OffsetValueType *    offsetTable = image->GetOffsetTable();
+    const IndexType            start = image->GetBufferedRegion().GetIndex();
+    const unsigned int         numberOfComponents = Vout.Size();
+
+    OutputType sum_me;
+    sum_me.Fill( 0.0 );
+    double     sum_m = 0.0;
+    OutputType dsum_me[VDim];
+    double     dsum_m[VDim];
+    for( size_t q = 0; q < VDim; q++ )
+      {
+      dsum_me[q].Fill( 0.0 );
+      dsum_m[q] = 0.0;
       }
-    // Get a pointer to the output value
-    // loop over vector length
-    for( unsigned int qq = 0; qq < Vout.Size(); qq++ )
+
+    int j[VDim];
+    for( size_t d = 0; d < VDim; d++ )
       {
-      double                         sum_me = 0.0, sum_m = 0.0;
-      vnl_vector_fixed<double, VDim> dsum_me(0.0), dsum_m(0.0), dw;
+      j[d] = i0[d];
+      }
+    const double *dx0 = dx[0].data_block();
+    const double *gx0 = gx[0].data_block();
 
-      // Loop over the voxels in the region identified
-      ImageRegion<VDim> region;
-      for( size_t d = 0; d < VDim; d++ )
+    bool done = false;
+    while( !done )
+      {
+      double          wRow = 1.0;
+      double          dwRow[VDim];
+      OffsetValueType rowOffset = -start[0];
+      for( size_t q = 0; q < VDim; q++ )
         {
-        region.SetIndex(d, i0[d]);
-        region.SetSize(d, i1[d] - i0[d]);
+        dwRow[q] = 1.0;
         }
-      for(
-        ImageRegionConstIteratorWithIndex<InputImageType> it(this->GetInputImage(), region);
-        !it.IsAtEnd(); ++it )
+      for( size_t d = 1; d < VDim; d++ )
         {
-        size_t j = it.GetIndex()[0];
-        double w = dx[0][j];
+        wRow *= dx[d][j[d]];
         if( grad )
           {
-          dw[0] = gx[0][j];
-          for( size_t d = 1; d < VDim; d++ )
+          for( size_t q = 0; q < VDim; q++ )
             {
-            dw[d] = dx[0][j];
+            dwRow[q] *= (d == q) ? gx[d][j[d]] : dx[d][j[d]];
             }
           }
-        for( size_t d = 1; d < VDim; d++ )
+        rowOffset += ( j[d] - start[d] ) * offsetTable[d];
+        }
+
+      const PixelType *row = buffer + rowOffset;
+      for( int i = i0[0]; i < i1[0]; i++ )
+        {
+        const double      w = wRow * dx0[i];
+        const PixelType & V = row[i];
+        for( unsigned int c = 0; c < numberOfComponents; c++ )
           {
-          j = it.GetIndex()[d];
-          w *= dx[d][j];
-          if( grad )
-            {
-            for( size_t q = 0; q < VDim; q++ )
-              {
-              dw[q] *= (d == q) ? gx[d][j] : dx[d][j];
-              }
-            }
+          sum_me[c] += V[c] * w;
           }
-
-        double V = it.Get()[qq];
-        sum_me += V * w;
         sum_m += w;
         if( grad )
           {
           for( size_t q = 0; q < VDim; q++ )
             {
-            dsum_me[q] += V * dw[q];
-            dsum_m[q] += dw[q];
+            const double dw = ( q == 0 ) ? dwRow[0] * gx0[i] : dwRow[q] * dx0[i];
+            for( unsigned int c = 0; c < numberOfComponents; c++ )
+              {
+              dsum_me[q][c] += V[c] * dw;
+              }
+            dsum_m[q] += dw;
             }
           }
         }
 
-      double rc = sum_me / sum_m;
+      // next row of the region
+      size_t d = 1;
+      while( d < VDim && ++j[d] >= i1[d] )
+        {
+        j[d] = i0[d];
+        d++;
+        }
+      done = ( d >= VDim );
+      }
+
+    for( unsigned int c = 0; c < numberOfComponents; c++ )
+      {
+      double rc = sum_me[c] / sum_m;
       if( grad )
         {
         for( size_t q = 0; q < VDim; q++ )
           {
-          grad[q] = (dsum_me[q] - rc * dsum_m[q]) / sum_m;
-          grad[q] /= -1.4142135623730951 * this->sigma[q];
+          grad[q][c] = (dsum_me[q][c] - rc * dsum_m[q]) / sum_m;
+          grad[q][c] /= -1.4142135623730951 * this->sigma[q];
           }
         }
       if( vnl_math_isnan(rc) )
         {
         rc = 0;
         }
-      Vout[qq] = rc;
+      Vout[c] = rc;
       }
-    //      std::cout << " gaussian " << std::endl;
 
-    // return sum_me / sum_m;
     return Vout;
   }
 
 protected:
-  VectorGaussianInterpolateImageFunction()
+  VectorGaussianInterpolateImageFunction() :
+    m_ErfTable( GetErfTable() )
   {
   }
 
@@ -246,6 +285,59 @@ private:
   VectorGaussianInterpolateImageFunction( const Self & ); // purposely not implemented
   void operator=( const Self & );                         // purposely not implemented
 
+  /** erf and its derivative 2/sqrt(pi) exp(-x^2) on [0, Maximum], for
+   * linear interpolation between samples 1/Resolution apart (the error of
+   * the interpolated erf is below 3e-8).  Beyond Maximum erf is 1 to double
+   * precision. */
+  struct ErfTableType
+    {
+    enum { Resolution = 2048, Maximum = 6 };
+
+    std::vector<double> Erf;
+    std::vector<double> Derivative;
+
+    ErfTableType()
+    {
+      const unsigned int size = Resolution * Maximum + 2;
+
+      Erf.resize( size );
+      Derivative.resize( size );
+      for( unsigned int i = 0; i < size; i++ )
+        {
+        const double x = static_cast<double>( i ) / Resolution;
+        Erf[i] = vnl_erf( x );
+        Derivative[i] = 1.128379167095513 * exp( -x * x );
+        }
+    }
+    };
+
+  static const ErfTableType & GetErfTable()
+  {
+    static const ErfTableType table;
+
+    return table;
+  }
+
+  /** the tabulated even or odd function at t */
+  static inline double LookUp( const std::vector<double> & table, double t, bool isOdd )
+  {
+    const double u = vnl_math_abs( t ) * ErfTableType::Resolution;
+
+    double value;
+    if( u >= ErfTableType::Resolution * ErfTableType::Maximum )
+      {
+      value = table.back();
+      }
+    else
+      {
+      const unsigned int k = static_cast<unsigned int>( u );
+      value = table[k] + ( u - k ) * ( table[k + 1] - table[k] );
+      }
+    return ( isOdd && t < 0 ) ? -value : value;
+  }
+
+  const ErfTableType & m_ErfTable;
+
   /** Number of neighbors used in the interpolation */
   static const unsigned long m_Neighbors;
   typename InputImageType::SizeType m_ImageSize;
@@ -281,17 +373,17 @@ private:
     double t = (b - p + k0) * sfac;
     //      std::cout << " t " << t  << " b " << b  << " p " << p  << " k0 " << k0  << " sfat " << sfac <<
     // std::endl;
-    double e_last = vnl_erf(t);
-    double g_last = gx_erf ? 1.128379167095513 * exp(-t * t) : 0.0;
+    double e_last = LookUp( m_ErfTable.Erf, t, true );
+    double g_last = gx_erf ? LookUp( m_ErfTable.Derivative, t, false ) : 0.0;
     for( int i = k0; i < k1; i++ )
       {
       t += sfac;
       //    std::cout << " t2 " << t << std::endl;
-      double e_now = vnl_erf(t);
+      double e_now = LookUp( m_ErfTable.Erf, t, true );
       dx_erf[i] = e_now - e_last;
       if( gx_erf )
         {
-        double g_now = 1.128379167095513 * exp(-t * t);
+        double g_now = LookUp( m_ErfTable.Derivative, t, false );
         gx_erf[i] = g_now - g_last;
         g_last = g_now;
         }
@@ -265,6 +265,11 @@ public:
 
   void ComposeAffineOnlySequence(const PointType & center_output, TransformTypePointer & affine_output);
 
+  /** Replace each run of consecutive affine transforms of the list by their
+      composition, so that a point goes through one affine transform per run.
+      The transforms pushed back are not modified. */
+  void CollapseAdjacentAffineTransforms();
+
   bool MultiInverseAffineOnlySinglePoint(const PointType & point1, PointType & point2);
 
   bool MultiTransformSinglePoint(const PointType & point1, PointType & point2);
@@ -484,6 +484,38 @@ WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTr
   return;
 }
 
+template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
+void
+WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
+::CollapseAdjacentAffineTransforms()
+{
+  typename TransformListType::iterator it = m_TransformList.begin();
+  while( it != m_TransformList.end() )
+    {
+    typename TransformListType::iterator next = it;
+    ++next;
+    if( it->first != EnumAffineType || next == m_TransformList.end() || next->first != EnumAffineType )
+      {
+      it = next;
+      continue;
+      }
+
+    // the points go through it first, then through next
+    TransformTypePointer aff = TransformTypePointer::ObjectType::New();
+    aff->SetCenter( it->second.aex.aff->GetCenter() );
+    aff->SetMatrix( it->second.aex.aff->GetMatrix() );
+    aff->SetOffset( it->second.aex.aff->GetOffset() );
+    while( next != m_TransformList.end() && next->first == EnumAffineType )
+      {
+      aff->Compose( next->second.aex.aff, false );
+      next = m_TransformList.erase( next );
+      }
+    it->second.aex.aff = aff;
+    it = next;
+    }
+  this->Modified();
+}
+
 template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
 bool
 WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
@@ -549,7 +581,9 @@ WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTr
       {
       case EnumAffineType:
         {
-        TransformTypePointer aff = it->second.aex.aff;
+        // raw pointers: a smart pointer copy per point and transform would
+        // contend on the reference counts across the threads
+        const TransformType *aff = it->second.aex.aff.GetPointer();
         point2 = aff->TransformPoint(point1);
         point1 = point2;
         isinside = true;
@@ -557,7 +591,7 @@ WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTr
         break;
       case EnumDisplacementFieldType:
         {
-        DisplacementFieldPointer fieldPtr = it->second.dex.field;
+        const DisplacementFieldType *fieldPtr = it->second.dex.field.GetPointer();
         if( bFirstDeformNoInterp && it == m_TransformList.begin() )
           {
           // use discrete coordinates
@@ -577,7 +611,7 @@ WarpImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTr
 
           isinside = fieldPtr->GetLargestPossibleRegion().IsInside( contind );
 
-          VectorInterpolatorPointer vinterp = it->second.dex.vinterp;
+          const DefaultVectorInterpolatorType *vinterp = it->second.dex.vinterp.GetPointer();
           typename DefaultVectorInterpolatorType::OutputType disp2;
           if( isinside )
             {
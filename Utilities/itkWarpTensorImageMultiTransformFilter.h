@@ -15,6 +15,7 @@
 #define ITKWarpTensorImageMultiTRANSFORMFILTER_H_
 
 #include "itkImageToImageFilter.h"
+#include "itkDeformationFieldGradientTensorImageFilter.h"
 #include "itkVectorInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkVectorLinearInterpolateImageFunction.h"
@@ -47,12 +48,20 @@ namespace itk
  * \f[ p_{in} = p_{out} + d \f]
  *
  * Typically the mapped position does not correspond to an integer pixel
- * position in the input image. Interpolation via an image function
- * is used to compute values at non-integer positions. The default
- * interpolation typed used is the LinearInterpolateImageFunction.
- * The user can specify a particular interpolation function via
- * SetInterpolator(). Note that the input interpolator must derive
- * from base class InterpolateImageFunction.
+ * position in the input image.  The tensors are interpolated linearly,
+ * component by component, or by nearest neighbor with
+ * UseNearestNeighborInterpolationOn().  For log-Euclidean interpolation
+ * the input holds the log tensors (e.g. read with ReadTensorImage and
+ * takelog) and the output is exponentiated afterwards.
+ *
+ * With a Reorientation other than NoReorientation the warped tensors are
+ * reoriented, by preservation of principal direction or finite strain,
+ * with the inverse of the Jacobian of the same transform chain.  The
+ * chain is then mapped once for all output voxels before the threaded
+ * pass, and the Jacobian is taken from that map by
+ * DeformationFieldGradientTensorImageFilter.  Reorienting log tensors is
+ * the same as reorienting the tensors, as the eigenvectors and the order
+ * of the eigenvalues are kept by the log.
  *
  * Position mapped to outside of the input image buffer are assigned
  * a edge padding value.
@@ -137,12 +146,20 @@ public:
 
   /** Interpolator typedef support. */
   typedef double                                                                    CoordRepType;
-  typedef VectorInterpolateImageFunction<InputImageType, CoordRepType>              InterpolatorType;
-  typedef typename InterpolatorType::Pointer                                        InterpolatorPointer;
-  typedef VectorLinearInterpolateImageFunction<InputImageType, CoordRepType>        DefaultInterpolatorType;
   typedef VectorLinearInterpolateImageFunction<DisplacementFieldType, CoordRepType> DefaultVectorInterpolatorType;
   typedef typename DefaultVectorInterpolatorType::Pointer                           VectorInterpolatorPointer;
 
+  /** The Jacobian of the transform chain. */
+  typedef DeformationFieldGradientTensorImageFilter<DisplacementFieldType, double> JacobianFilterType;
+  typedef typename JacobianFilterType::OutputImageType                            JacobianImageType;
+  typedef Image<unsigned char, itkGetStaticConstMacro(ImageDimension)>             InsideImageType;
+
+  /** The reorientation of the warped tensors. */
+  typedef enum _ReorientationType
+    {
+    NoReorientation = 0, PreservationOfPrincipalDirection, FiniteStrain
+    } ReorientationType;
+
   /** Point type */
   typedef Point<CoordRepType, itkGetStaticConstMacro(ImageDimension)> PointType;
 
@@ -166,11 +183,15 @@ public:
   typedef std::pair<SingleTransformType, VarTransformType> SingleTransformItemType;
   typedef std::list<SingleTransformItemType>               TransformListType;
 
-  /** Set the interpolator function. */
-  itkSetObjectMacro( Interpolator, InterpolatorType );
+  /** Interpolate by nearest neighbor instead of linearly. */
+  itkSetMacro( UseNearestNeighborInterpolation, bool );
+  itkGetConstMacro( UseNearestNeighborInterpolation, bool );
+  itkBooleanMacro( UseNearestNeighborInterpolation );
 
-  /** Get a pointer to the interpolator function. */
-  itkGetModifiableObjectMacro( Interpolator, InterpolatorType );
+  /** The reorientation by the Jacobian of the transform chain; none by
+   * default. */
+  itkSetMacro( Reorientation, ReorientationType );
+  itkGetConstMacro( Reorientation, ReorientationType );
 
   /** Set the output image spacing. */
   itkSetMacro(OutputSpacing, SpacingType);
@@ -198,6 +219,9 @@ public:
   // virtual void SetOutputSize( const double *values);
   itkGetConstReferenceMacro(OutputSize, SizeType);
 
+  /** Set the output origin, spacing, direction and size from image. */
+  virtual void SetOutputParametersFromImage( const ImageBase<itkGetStaticConstMacro(ImageDimension)> *image );
+
   /** Set the edge padding value */
   itkSetMacro( EdgePaddingValue, PixelType );
 
@@ -292,7 +316,22 @@ protected:
    * ThreadedGenerateData(). */
   void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread, ThreadIdType threadId );
 
-  InterpolatorPointer m_Interpolator;
+  /** The tensor of the input at point, false when point is outside. */
+  bool InterpolateTensor( const PointType & point, PixelType & value ) const;
+
+  /** Map the output voxels of region through the transform chain into
+   * m_FullWarp and m_InsideImage. */
+  void ComputeFullWarp( const OutputImageRegionType & region );
+
+  struct FullWarpThreadStruct
+    {
+    Self *Filter;
+    };
+
+  static ITK_THREAD_RETURN_TYPE FullWarpThreaderCallback( void *arg );
+
+  bool              m_UseNearestNeighborInterpolation;
+  ReorientationType m_Reorientation;
 
   PixelType         m_EdgePaddingValue;
   SpacingType       m_OutputSpacing;
@@ -301,6 +340,10 @@ protected:
   DirectionType     m_OutputDirection;
   TransformListType m_TransformList;
 
+  DisplacementFieldPointer             m_FullWarp;
+  typename InsideImageType::Pointer    m_InsideImage;
+  typename JacobianImageType::Pointer  m_JacobianImage;
+
   double m_SmoothScale;
 
   InputImagePointer m_CachedSmoothImage;
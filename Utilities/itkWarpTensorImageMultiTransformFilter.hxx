@@ -20,6 +20,8 @@
 #include "itkNumericTraits.h"
 #include "itkProgressReporter.h"
 #include "itkVectorLinearInterpolateImageFunction.h"
+#include "TensorFunctions.h"
+#include <cmath>
 #include <limits>
 
 namespace itk
@@ -43,10 +45,8 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
   Zero = Zero * 1.e-6;
   m_EdgePaddingValue = Zero;
 
-  // Setup default interpolator
-  typename DefaultInterpolatorType::Pointer interp = DefaultInterpolatorType::New();
-
-  m_Interpolator = static_cast<InterpolatorType *>( interp.GetPointer() );
+  m_UseNearestNeighborInterpolation = false;
+  m_Reorientation = NoReorientation;
 
   m_SmoothScale = -1;
 
@@ -104,7 +104,8 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
   os << indent << "EdgePaddingValue: "
      << static_cast<typename NumericTraits<PixelType>::PrintType>(m_EdgePaddingValue)
      << std::endl;
-  os << indent << "Interpolator: " << m_Interpolator.GetPointer() << std::endl;
+  os << indent << "UseNearestNeighborInterpolation: " << m_UseNearestNeighborInterpolation << std::endl;
+  os << indent << "Reorientation: " << m_Reorientation << std::endl;
 
   os << indent << "m_bFirstDeformNoInterp = " << m_bFirstDeformNoInterp << std::endl;
 }
@@ -139,30 +140,66 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
   this->SetOutputOrigin(p);
 }
 
+template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
+void
+WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
+::SetOutputParametersFromImage( const ImageBase<itkGetStaticConstMacro(ImageDimension)> *image )
+{
+  this->SetOutputOrigin( image->GetOrigin() );
+  this->SetOutputSpacing( image->GetSpacing() );
+  this->SetOutputDirection( image->GetDirection() );
+  this->SetOutputSize( image->GetLargestPossibleRegion().GetSize() );
+}
+
 /**
- * Setup state of filter before multi-threading.
- * InterpolatorType::SetInputImage is not thread-safe and hence
- * has to be setup before ThreadedGenerateData
+ * Setup state of filter before multi-threading: with reorientation, the
+ * map of the transform chain and its Jacobian over the whole output.
  */
 template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
 void
 WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
 ::BeforeThreadedGenerateData()
 {
-  if( !m_Interpolator )
+  if( m_CachedSmoothImage.IsNull() && (this->GetInput() ) )
     {
-    itkExceptionMacro(<< "Interpolator not set");
+    m_CachedSmoothImage = const_cast<InputImageType *>(this->GetInput() );
     }
 
-  // Connect input image to interpolator
-  // m_Interpolator->SetInputImage( this->GetInput() );
-
-  if( m_CachedSmoothImage.IsNull() && (this->GetInput() ) )
+  if( this->m_Reorientation == NoReorientation )
     {
-    m_CachedSmoothImage = const_cast<InputImageType *>(this->GetInput() );
+    return;
     }
 
-  m_Interpolator->SetInputImage( m_CachedSmoothImage );
+  // map the whole output once, so that the Jacobian of the chain can be
+  // taken from the map
+  OutputImagePointer outputPtr = this->GetOutput();
+
+  this->m_FullWarp = DisplacementFieldType::New();
+  this->m_FullWarp->CopyInformation( outputPtr );
+  this->m_FullWarp->SetRegions( outputPtr->GetRequestedRegion() );
+  this->m_FullWarp->Allocate();
+
+  this->m_InsideImage = InsideImageType::New();
+  this->m_InsideImage->CopyInformation( outputPtr );
+  this->m_InsideImage->SetRegions( outputPtr->GetRequestedRegion() );
+  this->m_InsideImage->Allocate();
+
+  FullWarpThreadStruct str;
+  str.Filter = this;
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->FullWarpThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  typename JacobianFilterType::Pointer jacobianFilter = JacobianFilterType::New();
+  jacobianFilter->SetInput( this->m_FullWarp );
+  jacobianFilter->SetCalculateJacobian( true );
+  jacobianFilter->SetUseImageSpacing( true );
+  jacobianFilter->SetOrder( 2 );
+  jacobianFilter->SetUseCenteredDifference( true );
+  jacobianFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
+  jacobianFilter->Update();
+  this->m_JacobianImage = jacobianFilter->GetOutput();
+  this->m_JacobianImage->DisconnectPipeline();
 }
 
 /**
@@ -173,8 +210,147 @@ void
 WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
 ::AfterThreadedGenerateData()
 {
-  // Disconnect input image from interpolator
-  m_Interpolator->SetInputImage( NULL );
+  this->m_FullWarp = ITK_NULLPTR;
+  this->m_InsideImage = ITK_NULLPTR;
+  this->m_JacobianImage = ITK_NULLPTR;
+}
+
+template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
+ITK_THREAD_RETURN_TYPE
+WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
+::FullWarpThreaderCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  FullWarpThreadStruct *           str = static_cast<FullWarpThreadStruct *>( info->UserData );
+
+  OutputImageRegionType splitRegion;
+  const ThreadIdType    total = str->Filter->SplitRequestedRegion( info->ThreadID, info->NumberOfThreads,
+                                                                   splitRegion );
+  if( info->ThreadID < total )
+    {
+    str->Filter->ComputeFullWarp( splitRegion );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
+void
+WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
+::ComputeFullWarp( const OutputImageRegionType & region )
+{
+  ImageRegionIteratorWithIndex<DisplacementFieldType> warpIt( this->m_FullWarp, region );
+  ImageRegionIterator<InsideImageType>                insideIt( this->m_InsideImage, region );
+
+  for( ; !warpIt.IsAtEnd(); ++warpIt, ++insideIt )
+    {
+    PointType point1, point2;
+    this->m_FullWarp->TransformIndexToPhysicalPoint( warpIt.GetIndex(), point1 );
+
+    const bool isinside = MultiTransformPoint( point1, point2, m_bFirstDeformNoInterp, warpIt.GetIndex() );
+
+    DisplacementType displacement;
+    displacement.Fill( 0 );
+    if( !IsOutOfNumericBoundary( point2 ) )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        displacement[d] = point2[d] - point1[d];
+        }
+      }
+    warpIt.Set( displacement );
+    insideIt.Set( isinside ? 1 : 0 );
+    }
+}
+
+template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
+bool
+WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementField, TTransform>
+::InterpolateTensor( const PointType & point, PixelType & value ) const
+{
+  const InputImageType *image = this->m_CachedSmoothImage.GetPointer();
+
+  ContinuousIndex<CoordRepType, ImageDimension> cindex;
+  image->TransformPhysicalPointToContinuousIndex( point, cindex );
+
+  const typename InputImageType::RegionType region = image->GetBufferedRegion();
+  OffsetValueType                           base[ImageDimension];
+  double                                    fraction[ImageDimension];
+  OffsetValueType                           strides[ImageDimension];
+  OffsetValueType                           stride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const OffsetValueType size = static_cast<OffsetValueType>( region.GetSize()[d] );
+    const double          x = cindex[d] - region.GetIndex()[d];
+    if( !( x >= -0.5 && x < size - 0.5 ) )
+      {
+      return false;
+      }
+    if( this->m_UseNearestNeighborInterpolation )
+      {
+      base[d] = std::min( static_cast<OffsetValueType>( std::floor( x + 0.5 ) ), size - 1 );
+      fraction[d] = 0.0;
+      }
+    else
+      {
+      base[d] = std::max( static_cast<OffsetValueType>( 0 ),
+                          std::min( static_cast<OffsetValueType>( std::floor( x ) ), size - 2 ) );
+      fraction[d] = std::max( 0.0, std::min( 1.0, x - base[d] ) );
+      }
+    strides[d] = stride;
+    stride *= size;
+    }
+
+  const PixelType *buffer = image->GetBufferPointer();
+  OffsetValueType  offset = 0;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    offset += base[d] * strides[d];
+    }
+  if( this->m_UseNearestNeighborInterpolation )
+    {
+    value = buffer[offset];
+    return true;
+    }
+
+  double sum[PixelType::Length];
+  for( unsigned int c = 0; c < PixelType::Length; c++ )
+    {
+    sum[c] = 0.0;
+    }
+  for( unsigned int corner = 0; corner < ( 1u << ImageDimension ); corner++ )
+    {
+    double          weight = 1.0;
+    OffsetValueType cornerOffset = offset;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( corner & ( 1u << d ) )
+        {
+        weight *= fraction[d];
+        if( region.GetSize()[d] > 1 )
+          {
+          cornerOffset += strides[d];
+          }
+        }
+      else
+        {
+        weight *= 1.0 - fraction[d];
+        }
+      }
+    if( weight == 0.0 )
+      {
+      continue;
+      }
+    const PixelType & pixel = buffer[cornerOffset];
+    for( unsigned int c = 0; c < PixelType::Length; c++ )
+      {
+      sum[c] += weight * pixel[c];
+      }
+    }
+  for( unsigned int c = 0; c < PixelType::Length; c++ )
+    {
+    value[c] = sum[c];
+    }
+  return true;
 }
 
 template <class TInputImage, class TOutputImage, class TDisplacementField, class TTransform>
@@ -300,18 +476,7 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
   const OutputImageRegionType& outputRegionForThread,
   ThreadIdType threadId )
 {
-  InputImageConstPointer inputPtr = this->GetInput();
-  OutputImagePointer     outputPtr = this->GetOutput();
-
-  // std::cout << "inputPtr->GetOrigin():" << inputPtr->GetOrigin() << std::endl;
-  // std::cout << "outputPtr->GetOrigin():" << outputPtr->GetOrigin() << std::endl;
-
-  // std::exception();
-
-  IndexType index;
-
-  index.Fill(0);
-  this->m_EdgePaddingValue = inputPtr->GetPixel(index);
+  OutputImagePointer outputPtr = this->GetOutput();
 
   // support progress methods/callbacks
   ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() );
@@ -319,6 +484,17 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
   // iterator for the output image
   ImageRegionIteratorWithIndex<OutputImageType> outputIt(outputPtr, outputRegionForThread);
 
+  const bool                                  reorient = ( this->m_Reorientation != NoReorientation );
+  ImageRegionConstIterator<DisplacementFieldType> warpIt;
+  ImageRegionConstIterator<InsideImageType>       insideIt;
+  ImageRegionConstIterator<JacobianImageType>     jacobianIt;
+  if( reorient )
+    {
+    warpIt = ImageRegionConstIterator<DisplacementFieldType>( this->m_FullWarp, outputRegionForThread );
+    insideIt = ImageRegionConstIterator<InsideImageType>( this->m_InsideImage, outputRegionForThread );
+    jacobianIt = ImageRegionConstIterator<JacobianImageType>( this->m_JacobianImage, outputRegionForThread );
+    }
+
   while( !outputIt.IsAtEnd() )
     {
     PointType point1, point2;
@@ -327,29 +503,55 @@ WarpTensorImageMultiTransformFilter<TInputImage, TOutputImage, TDisplacementFiel
     IndexType index = outputIt.GetIndex();
     outputPtr->TransformIndexToPhysicalPoint( index, point1 );
 
-    bool isinside = MultiTransformPoint(point1, point2, m_bFirstDeformNoInterp, index);
-
-    // std::cout << "point1:" << point1 << "  point2:" << point2 << " index:" << index << std::endl;
-    // std::exception();
+    bool isinside;
+    if( reorient )
+      {
+      const DisplacementType & displacement = warpIt.Get();
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        point2[d] = point1[d] + displacement[d];
+        }
+      isinside = ( insideIt.Get() != 0 );
+      }
+    else
+      {
+      isinside = MultiTransformPoint(point1, point2, m_bFirstDeformNoInterp, index);
+      }
 
     // warp the image
     // get the interpolated value
-    if( isinside && (m_Interpolator->IsInsideBuffer( point2 ) ) )
+    PixelType value;
+    if( isinside && this->InterpolateTensor( point2, value ) )
       {
-      PixelType value = static_cast<PixelType>(m_Interpolator->Evaluate(point2) );
+      if( reorient && IsRealTensor<PixelType>( value ) )
+        {
+        const Matrix<double, 3, 3> inverseJacobian =
+          InverseJacobianFromGradientTensor( jacobianIt.Get(), this->m_OutputDirection );
+        if( this->m_Reorientation == FiniteStrain )
+          {
+          value = FiniteStrainReorientation( value, inverseJacobian );
+          }
+        else
+          {
+          value = PreservationOfPrincipalDirectionReorientation( value, inverseJacobian );
+          }
+        }
       outputIt.Set( value );
       }
     else
       {
-      // std::cout << "OUTSIDE" << " isinside:" << isinside << " m_Interpolator->IsInsideBuffer( point2 ):" <<
-      // m_Interpolator->IsInsideBuffer( point2 ) <<  std::endl;
       outputIt.Set( m_EdgePaddingValue );
       }
 
     ++outputIt;
+    if( reorient )
+      {
+      ++warpIt;
+      ++insideIt;
+      ++jacobianIt;
+      }
+    progress.CompletedPixel();
     }
-
-  progress.CompletedPixel();
 }
 
 // template <class TInputImage,class TOutputImage,class TDisplacementField, class TTransform>
@@ -0,0 +1,121 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkWarpTimeSeriesImageFilter_h
+#define __itkWarpTimeSeriesImageFilter_h
+
+#include "itkImageToImageFilter.h"
+
+namespace itk
+{
+/** \class WarpTimeSeriesImageFilter
+ * \brief Warps every time point of an N-D time series with the same
+ * (N-1)-D warper.
+ *
+ * The warper (e.g. a WarpImageMultiTransformFilter) is set up once by the
+ * caller with its transforms, interpolator and output parameters.  The
+ * output of this filter is the output grid of the warper extended along
+ * the last (time) dimension of the input.
+ *
+ * The filter only asks its input for the time points of the requested
+ * output region, so it can be streamed along time, e.g. by an
+ * ImageFileWriter with several stream divisions.  Then only a slab of
+ * time points is held in memory at once.  Each time point is warped by
+ * the (multi-threaded) warper in turn.
+ *
+ * \ingroup GeometricTransform
+ * \ingroup Streamed
+ */
+template <class TInputImage, class TOutputImage, class TWarper>
+class WarpTimeSeriesImageFilter :
+  public         ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef WarpTimeSeriesImageFilter                     Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(WarpTimeSeriesImageFilter, ImageToImageFilter);
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TInputImage::ImageDimension);
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                              InputImageType;
+  typedef typename InputImageType::ConstPointer    InputImageConstPointer;
+  typedef typename InputImageType::RegionType      InputImageRegionType;
+  typedef TOutputImage                             OutputImageType;
+  typedef typename OutputImageType::Pointer        OutputImagePointer;
+  typedef typename OutputImageType::RegionType     OutputImageRegionType;
+
+  typedef TWarper                                  WarperType;
+  typedef typename WarperType::InputImageType      SliceImageType;
+  typedef typename WarperType::OutputImageType     WarpedSliceImageType;
+
+  /** Set/Get the warper applied to every time point. */
+  itkSetObjectMacro( Warper, WarperType );
+  itkGetModifiableObjectMacro( Warper, WarperType );
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  itkConceptMacro( SameDimensionCheck,
+                   ( Concept::SameDimension<TInputImage::ImageDimension, TOutputImage::ImageDimension> ) );
+  itkConceptMacro( SliceDimensionCheck,
+                   ( Concept::SameDimension<TInputImage::ImageDimension - 1, SliceImageType::ImageDimension> ) );
+#endif
+
+protected:
+  WarpTimeSeriesImageFilter();
+  ~WarpTimeSeriesImageFilter()
+  {
+  }
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  /** The output grid is the output grid of the warper times the time
+   * points of the input. */
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  /** Only the time points of the requested output region are needed, but
+   * each of them in full. */
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  /** Time points are warped whole, so the output region is enlarged to
+   * the full spatial extent. */
+  virtual void EnlargeOutputRequestedRegion( DataObject *output ) ITK_OVERRIDE;
+
+  void GenerateData() ITK_OVERRIDE;
+
+private:
+  WarpTimeSeriesImageFilter( const Self & ); // purposely not implemented
+  void operator=( const Self & );            // purposely not implemented
+
+  typename WarperType::Pointer m_Warper;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkWarpTimeSeriesImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkWarpTimeSeriesImageFilter_hxx
+#define __itkWarpTimeSeriesImageFilter_hxx
+
+#include "itkWarpTimeSeriesImageFilter.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+
+namespace itk
+{
+template <class TInputImage, class TOutputImage, class TWarper>
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::WarpTimeSeriesImageFilter() :
+  m_Warper( ITK_NULLPTR )
+{
+}
+
+template <class TInputImage, class TOutputImage, class TWarper>
+void
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  OutputImagePointer     outputPtr = this->GetOutput();
+  InputImageConstPointer inputPtr = this->GetInput();
+
+  if( !outputPtr || !inputPtr )
+    {
+    return;
+    }
+  if( this->m_Warper.IsNull() )
+    {
+    itkExceptionMacro( "The warper is not set." );
+    }
+
+  const unsigned int timeDimension = ImageDimension - 1;
+
+  const InputImageRegionType & inputRegion = inputPtr->GetLargestPossibleRegion();
+
+  OutputImageRegionType                     outputRegion;
+  typename OutputImageType::SpacingType     spacing;
+  typename OutputImageType::PointType       origin;
+  typename OutputImageType::DirectionType   direction;
+  direction.Fill( 0 );
+  for( unsigned int i = 0; i < timeDimension; i++ )
+    {
+    outputRegion.SetSize( i, this->m_Warper->GetOutputSize()[i] );
+    outputRegion.SetIndex( i, this->m_Warper->GetOutputStartIndex()[i] );
+    spacing[i] = this->m_Warper->GetOutputSpacing()[i];
+    origin[i] = this->m_Warper->GetOutputOrigin()[i];
+    for( unsigned int j = 0; j < timeDimension; j++ )
+      {
+      direction[i][j] = this->m_Warper->GetOutputDirection()[i][j];
+      }
+    }
+  outputRegion.SetSize( timeDimension, inputRegion.GetSize()[timeDimension] );
+  outputRegion.SetIndex( timeDimension, inputRegion.GetIndex()[timeDimension] );
+  spacing[timeDimension] = inputPtr->GetSpacing()[timeDimension];
+  origin[timeDimension] = inputPtr->GetOrigin()[timeDimension];
+  direction[timeDimension][timeDimension] = 1;
+
+  outputPtr->SetLargestPossibleRegion( outputRegion );
+  outputPtr->SetSpacing( spacing );
+  outputPtr->SetOrigin( origin );
+  outputPtr->SetDirection( direction );
+}
+
+template <class TInputImage, class TOutputImage, class TWarper>
+void
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  typename InputImageType::Pointer inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  OutputImagePointer               outputPtr = this->GetOutput();
+
+  if( !inputPtr || !outputPtr )
+    {
+    return;
+    }
+
+  const unsigned int timeDimension = ImageDimension - 1;
+
+  InputImageRegionType inputRegion = inputPtr->GetLargestPossibleRegion();
+  inputRegion.SetSize( timeDimension, outputPtr->GetRequestedRegion().GetSize()[timeDimension] );
+  inputRegion.SetIndex( timeDimension, outputPtr->GetRequestedRegion().GetIndex()[timeDimension] );
+  inputPtr->SetRequestedRegion( inputRegion );
+}
+
+template <class TInputImage, class TOutputImage, class TWarper>
+void
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::EnlargeOutputRequestedRegion( DataObject *output )
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+
+  OutputImageType *outputPtr = dynamic_cast<OutputImageType *>( output );
+  if( !outputPtr )
+    {
+    return;
+    }
+
+  const unsigned int timeDimension = ImageDimension - 1;
+
+  OutputImageRegionType outputRegion = outputPtr->GetLargestPossibleRegion();
+  outputRegion.SetSize( timeDimension, outputPtr->GetRequestedRegion().GetSize()[timeDimension] );
+  outputRegion.SetIndex( timeDimension, outputPtr->GetRequestedRegion().GetIndex()[timeDimension] );
+  outputPtr->SetRequestedRegion( outputRegion );
+}
+
+template <class TInputImage, class TOutputImage, class TWarper>
+void
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::GenerateData()
+{
+  this->AllocateOutputs();
+
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImagePointer     outputPtr = this->GetOutput();
+
+  const unsigned int timeDimension = ImageDimension - 1;
+
+  const OutputImageRegionType & outputRegion = outputPtr->GetRequestedRegion();
+  const InputImageRegionType &  inputRegion = inputPtr->GetRequestedRegion();
+
+  // geometry of a single time point of the input (upper-left block of the direction matrix)
+  typename SliceImageType::RegionType    sliceRegion;
+  typename SliceImageType::SpacingType   sliceSpacing;
+  typename SliceImageType::PointType     sliceOrigin;
+  typename SliceImageType::DirectionType sliceDirection;
+  for( unsigned int i = 0; i < timeDimension; i++ )
+    {
+    sliceRegion.SetSize( i, inputRegion.GetSize()[i] );
+    sliceRegion.SetIndex( i, inputRegion.GetIndex()[i] );
+    sliceSpacing[i] = inputPtr->GetSpacing()[i];
+    sliceOrigin[i] = inputPtr->GetOrigin()[i];
+    for( unsigned int j = 0; j < timeDimension; j++ )
+      {
+      sliceDirection[i][j] = inputPtr->GetDirection()[i][j];
+      }
+    }
+
+  const IndexValueType firstTimePoint = outputRegion.GetIndex()[timeDimension];
+  const SizeValueType  numberOfTimePoints = outputRegion.GetSize()[timeDimension];
+  for( SizeValueType n = 0; n < numberOfTimePoints; n++ )
+    {
+    const IndexValueType timePoint = firstTimePoint + static_cast<IndexValueType>( n );
+
+    typename SliceImageType::Pointer slice = SliceImageType::New();
+    slice->SetRegions( sliceRegion );
+    slice->SetSpacing( sliceSpacing );
+    slice->SetOrigin( sliceOrigin );
+    slice->SetDirection( sliceDirection );
+    slice->Allocate();
+
+    InputImageRegionType inputTimePointRegion = inputRegion;
+    inputTimePointRegion.SetSize( timeDimension, 1 );
+    inputTimePointRegion.SetIndex( timeDimension, timePoint );
+
+    ImageRegionConstIterator<InputImageType> ItI( inputPtr, inputTimePointRegion );
+    ImageRegionIterator<SliceImageType>      ItS( slice, sliceRegion );
+    for( ItI.GoToBegin(), ItS.GoToBegin(); !ItI.IsAtEnd(); ++ItI, ++ItS )
+      {
+      ItS.Set( ItI.Get() );
+      }
+
+    this->m_Warper->SetInput( slice );
+    this->m_Warper->Update();
+
+    const WarpedSliceImageType *warpedSlice = this->m_Warper->GetOutput();
+
+    OutputImageRegionType outputTimePointRegion = outputRegion;
+    outputTimePointRegion.SetSize( timeDimension, 1 );
+    outputTimePointRegion.SetIndex( timeDimension, timePoint );
+
+    ImageRegionConstIterator<WarpedSliceImageType> ItW( warpedSlice, warpedSlice->GetLargestPossibleRegion() );
+    ImageRegionIterator<OutputImageType>           ItO( outputPtr, outputTimePointRegion );
+    for( ItW.GoToBegin(), ItO.GoToBegin(); !ItO.IsAtEnd(); ++ItW, ++ItO )
+      {
+      ItO.Set( ItW.Get() );
+      }
+
+    this->UpdateProgress( static_cast<float>( n + 1 ) / static_cast<float>( numberOfTimePoints ) );
+    }
+
+  // do not keep the last time point alive in the warper
+  this->m_Warper->SetInput( ITK_NULLPTR );
+}
+
+template <class TInputImage, class TOutputImage, class TWarper>
+void
+WarpTimeSeriesImageFilter<TInputImage, TOutputImage, TWarper>
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Warper: " << this->m_Warper.GetPointer() << std::endl;
+}
+} // end namespace itk
+
+#endif
@@ -9,6 +9,15 @@
 #include "itkTransformFileWriter.h"
 
 #include "itkCompositeTransform.h"
+#include "itkMultiThreader.h"
+#include "itkantsTransformContainer.h"
+#include "itkBrickCachedVectorLinearInterpolateImageFunction.h"
+#include "antsObjectCache.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string>
+#include <vector>
 
 namespace itk
 {
@@ -20,6 +29,17 @@ ReadTransform(const std::string & filename,
               const bool useStaticCastForR = false) // This parameter changes to true by the programs that use R, so this code
                                                      // returns a different output for them.
 {
+  typedef typename itk::Transform<T, VImageDimension, VImageDimension> TransformType;
+
+  // in-memory transform, as for ReadImage:  the name is the address of a
+  // TransformType::Pointer held by the caller
+  if( filename.size() > 2 && filename.substr( 0, 2 ) == std::string( "0x" ) )
+    {
+    void* ptr;
+    sscanf( filename.c_str(), "%p", (void **)&ptr );
+    return *( static_cast<typename TransformType::Pointer *>( ptr ) );
+    }
+
   // We must explicitly check for file existance because failed reading is an acceptable
   // state for non-displacment feilds.
   if( !itksys::SystemTools::FileExists( filename.c_str() ) )
@@ -28,6 +48,19 @@ ReadTransform(const std::string & filename,
     return ITK_NULLPTR;
     }
 
+  typename TransformType::Pointer cached = ::ants::GetCachedTransform<TransformType>( filename );
+  if( cached.IsNotNull() )
+    {
+    return cached;
+    }
+
+  if( IsTransformContainerFile( filename ) )
+    {
+    typename TransformType::Pointer transform = ReadTransformContainer<T, VImageDimension>( filename );
+    ::ants::CacheTransform<TransformType>( filename, transform );
+    return transform;
+    }
+
   bool hasTransformBeenRead = false;
 
   typedef typename itk::DisplacementFieldTransform<T, VImageDimension>      DisplacementFieldTransformType;
@@ -60,7 +93,6 @@ ReadTransform(const std::string & filename,
       }
     }
 
-  typedef typename itk::Transform<T, VImageDimension, VImageDimension> TransformType;
   typename TransformType::Pointer transform;
   if( hasTransformBeenRead )
     {
@@ -124,6 +156,127 @@ ReadTransform(const std::string & filename,
        transform = static_cast<TransformType *>( listOfTransforms->front().GetPointer() );
        }
     }
+  ::ants::CacheTransform<TransformType>( filename, transform );
+  return transform;
+}
+
+template <class T, unsigned VImageDimension>
+struct ReadTransformsThreadStruct
+  {
+  const std::vector<std::string> *                                                     FileNames;
+  std::vector<typename itk::Transform<T, VImageDimension, VImageDimension>::Pointer> * Transforms;
+  };
+
+template <class T, unsigned VImageDimension>
+ITK_THREAD_RETURN_TYPE ReadTransformsThreaderCallback( void *arg )
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+  ReadTransformsThreadStruct<T, VImageDimension> *str =
+    static_cast<ReadTransformsThreadStruct<T, VImageDimension> *>( info->UserData );
+
+  // the first file was read before the threads were started
+  const unsigned long numberOfFiles = str->FileNames->size() - 1;
+  const unsigned long first = 1 + numberOfFiles * info->ThreadID / info->NumberOfThreads;
+  const unsigned long last = 1 + numberOfFiles * ( info->ThreadID + 1 ) / info->NumberOfThreads;
+  for( unsigned long n = first; n < last; n++ )
+    {
+    ( *str->Transforms )[n] = ReadTransform<T, VImageDimension>( ( *str->FileNames )[n] );
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/** ReadTransform of every file in filenames, spread over numberOfThreads
+ * threads (0 uses the ITK global default), for tools that read many small
+ * transforms such as the affines of a template building iteration.  The
+ * transforms that can't be read are NULL. */
+template <class T, unsigned VImageDimension>
+void
+ReadTransforms( const std::vector<std::string> & filenames,
+                std::vector<typename itk::Transform<T, VImageDimension, VImageDimension>::Pointer> & transforms,
+                unsigned int numberOfThreads = 0 )
+{
+  transforms.clear();
+  transforms.resize( filenames.size() );
+  if( filenames.empty() )
+    {
+    return;
+    }
+
+  // the first file is read here so that the transform and IO factories are
+  // registered before the threads use them
+  transforms[0] = ReadTransform<T, VImageDimension>( filenames[0] );
+  if( filenames.size() == 1 )
+    {
+    return;
+    }
+
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>( filenames.size() - 1 ) );
+
+  ReadTransformsThreadStruct<T, VImageDimension> str;
+  str.FileNames = &filenames;
+  str.Transforms = &transforms;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( ReadTransformsThreaderCallback<T, VImageDimension>, &str );
+  threader->SingleMethodExecute();
+}
+
+/** A displacement field transform for the field in filename that reads the
+ * field on demand, in bricks of brickSize^N voxels of which at most
+ * maximumNumberOfBricks are kept in memory, instead of reading all of it.
+ * Meant for warping points or a small region; returns NULL if filename is
+ * not an image. */
+template <class T, unsigned VImageDimension>
+typename itk::DisplacementFieldTransform<T, VImageDimension>::Pointer
+ReadBrickCachedDisplacementFieldTransform( const std::string & filename, unsigned int brickSize = 32,
+                                           unsigned int maximumNumberOfBricks = 64 )
+{
+  typedef typename itk::DisplacementFieldTransform<T, VImageDimension>   DisplacementFieldTransformType;
+  typedef typename DisplacementFieldTransformType::DisplacementFieldType DisplacementFieldType;
+  typedef itk::ImageFileReader<DisplacementFieldType>                    DisplacementFieldReaderType;
+  typedef itk::BrickCachedVectorLinearInterpolateImageFunction<DisplacementFieldType, T> InterpolatorType;
+
+  typename DisplacementFieldReaderType::Pointer fieldReader = DisplacementFieldReaderType::New();
+  fieldReader->SetFileName( filename.c_str() );
+  try
+    {
+    fieldReader->UpdateOutputInformation();
+    }
+  catch( ... )
+    {
+    return ITK_NULLPTR;
+    }
+
+  // only the geometry of the field is kept, the interpolator reads the voxels
+  const DisplacementFieldType *fileField = fieldReader->GetOutput();
+
+  typename DisplacementFieldType::SizeType bufferedSize;
+  bufferedSize.Fill( 1 );
+  typename DisplacementFieldType::RegionType bufferedRegion( fileField->GetLargestPossibleRegion().GetIndex(),
+                                                             bufferedSize );
+  typename DisplacementFieldType::PixelType zeroVector;
+  zeroVector.Fill( 0 );
+
+  typename DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+  field->CopyInformation( fileField );
+  field->SetBufferedRegion( bufferedRegion );
+  field->SetRequestedRegion( bufferedRegion );
+  field->Allocate();
+  field->FillBuffer( zeroVector );
+
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetFileName( filename );
+  interpolator->SetBrickSize( brickSize );
+  interpolator->SetMaximumNumberOfBricks( maximumNumberOfBricks );
+
+  typename DisplacementFieldTransformType::Pointer transform = DisplacementFieldTransformType::New();
+  transform->SetInterpolator( interpolator );
+  transform->SetDisplacementField( field );
   return transform;
 }
 
@@ -138,6 +291,21 @@ WriteTransform(typename itk::Transform<T, VImageDimension, VImageDimension>::Poi
   typedef typename itk::ImageFileWriter<DisplacementFieldType>              DisplacementFieldWriter;
   typedef itk::TransformFileWriterTemplate<T>                               TransformWriterType;
 
+  if( filename.size() > 2 && filename.substr( 0, 2 ) == std::string( "0x" ) )
+    {
+    void* ptr;
+    sscanf( filename.c_str(), "%p", (void **)&ptr );
+    *( static_cast<typename GenericTransformType::Pointer *>( ptr ) ) = xfrm;
+    return EXIT_SUCCESS;
+    }
+
+  ::ants::ObjectCache::Invalidate( filename );
+
+  if( IsTransformContainerFile( filename ) )
+    {
+    return WriteTransformContainer<T, VImageDimension>( xfrm, filename );
+    }
+
   DisplacementFieldTransformType *dispXfrm =
     dynamic_cast<DisplacementFieldTransformType *>(xfrm.GetPointer() );
 
@@ -231,6 +399,7 @@ WriteInverseTransform(typename itk::DisplacementFieldTransform<T, VImageDimensio
   typedef itk::TransformFileWriterTemplate<T>                               TransformWriterType;
   
   typename DisplacementFieldType::Pointer inverseDispField = xfrm->GetModifiableInverseDisplacementField();
+  ::ants::ObjectCache::Invalidate( filename );
   try
     {
       if(    filename.find(".xfm" ) == std::string::npos
@@ -0,0 +1,614 @@
+#ifndef itkantsTransformContainer_h
+#define itkantsTransformContainer_h
+
+#include "itkCompositeTransform.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkTransformFactoryBase.h"
+#include "antsTransformContainer.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+namespace ants
+{
+/**
+ * Single-file container for a transform or a composite transform stack.
+ *
+ *   "ANTSXFM\n", version, dimension, number of transforms, then per transform
+ *   - kind 0: ITK transform type name, parameters and fixed parameters
+ *   - kind 1: displacement field: flags (float16, deflated), index, size,
+ *     origin, spacing, direction, the byte size of each chunk, the chunks
+ *
+ * A displacement field is stored as one chunk per slice of its slowest
+ * dimension, so that ReadTransformContainerDisplacementFieldRegion can load
+ * a region of a field by reading only the slices it covers.  Other
+ * displacement field transforms (e.g. GaussianExponentialDiffeomorphic)
+ * are stored as their displacement field, as in the NIfTI path of
+ * WriteTransform.
+ */
+const char TransformContainerMagic[] = "ANTSXFM\n";
+const unsigned long TransformContainerVersion = 1;
+
+enum { TransformContainerParametricKind = 0, TransformContainerDisplacementFieldKind = 1 };
+enum { TransformContainerHalfPrecisionFlag = 1, TransformContainerCompressedFlag = 2 };
+
+inline bool IsTransformContainerFile( const std::string & filename )
+{
+  const std::string extension( ".antsxfm" );
+  return filename.size() > extension.size()
+         && filename.compare( filename.size() - extension.size(), extension.size(), extension ) == 0;
+}
+
+template <unsigned int VImageDimension>
+struct TransformContainerFieldHeader
+  {
+  bool                                HalfPrecision;
+  bool                                Compressed;
+  ImageRegion<VImageDimension>        Region;
+  Point<double, VImageDimension>      Origin;
+  Vector<double, VImageDimension>     Spacing;
+  Matrix<double, VImageDimension, VImageDimension> Direction;
+  std::vector<unsigned long long>     ChunkSizes;
+  std::streampos                      DataStart;
+
+  unsigned long GetValuesPerChunk() const
+  {
+    unsigned long numberOfPixels = 1;
+    for( unsigned int d = 0; d + 1 < VImageDimension; d++ )
+      {
+      numberOfPixels *= this->Region.GetSize()[d];
+      }
+    return numberOfPixels * VImageDimension;
+  }
+  };
+
+template <unsigned int VImageDimension>
+bool ReadTransformContainerFieldHeader( std::istream & is, TransformContainerFieldHeader<VImageDimension> & header )
+{
+  unsigned long flags;
+  if( !::ants::ReadTransformContainerUInt32( is, flags ) )
+    {
+    return false;
+    }
+  header.HalfPrecision = ( flags & TransformContainerHalfPrecisionFlag ) != 0;
+  header.Compressed = ( flags & TransformContainerCompressedFlag ) != 0;
+
+  unsigned long long value;
+  double             realValue;
+  for( unsigned int d = 0; d < VImageDimension; d++ )
+    {
+    if( !::ants::ReadTransformContainerUInt64( is, value ) )
+      {
+      return false;
+      }
+    // the index is stored two's complement
+    header.Region.SetIndex( d, static_cast<IndexValueType>( static_cast<long long>( value ) ) );
+    }
+  for( unsigned int d = 0; d < VImageDimension; d++ )
+    {
+    if( !::ants::ReadTransformContainerUInt64( is, value ) )
+      {
+      return false;
+      }
+    header.Region.SetSize( d, static_cast<SizeValueType>( value ) );
+    }
+  for( unsigned int d = 0; d < VImageDimension; d++ )
+    {
+    if( !::ants::ReadTransformContainerDouble( is, realValue ) )
+      {
+      return false;
+      }
+    header.Origin[d] = realValue;
+    }
+  for( unsigned int d = 0; d < VImageDimension; d++ )
+    {
+    if( !::ants::ReadTransformContainerDouble( is, realValue ) )
+      {
+      return false;
+      }
+    header.Spacing[d] = realValue;
+    }
+  for( unsigned int i = 0; i < VImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < VImageDimension; j++ )
+      {
+      if( !::ants::ReadTransformContainerDouble( is, realValue ) )
+        {
+        return false;
+        }
+      header.Direction[i][j] = realValue;
+      }
+    }
+
+  unsigned long long numberOfChunks;
+  if( !::ants::ReadTransformContainerUInt64( is, numberOfChunks )
+      || numberOfChunks != header.Region.GetSize()[VImageDimension - 1] )
+    {
+    return false;
+    }
+  header.ChunkSizes.resize( numberOfChunks );
+  for( unsigned long long n = 0; n < numberOfChunks; n++ )
+    {
+    if( !::ants::ReadTransformContainerUInt64( is, header.ChunkSizes[n] ) )
+      {
+      return false;
+      }
+    }
+  header.DataStart = is.tellg();
+  return true;
+}
+
+/** Decode the chunks [firstChunk, firstChunk + numberOfChunks) of a field. */
+template <unsigned int VImageDimension>
+bool ReadTransformContainerFieldChunks( std::istream & is, const TransformContainerFieldHeader<VImageDimension> & header,
+                                        unsigned long firstChunk, unsigned long numberOfChunks,
+                                        std::vector<float> & values )
+{
+  unsigned long long offset = 0;
+  for( unsigned long n = 0; n < firstChunk; n++ )
+    {
+    offset += header.ChunkSizes[n];
+    }
+  is.seekg( header.DataStart + static_cast<std::streamoff>( offset ) );
+
+  std::vector< ::ants::TransformContainerChunkType> chunks( numberOfChunks );
+  for( unsigned long n = 0; n < numberOfChunks; n++ )
+    {
+    chunks[n].resize( static_cast<size_t>( header.ChunkSizes[firstChunk + n] ) );
+    if( !chunks[n].empty() && !is.read( reinterpret_cast<char *>( &chunks[n][0] ), chunks[n].size() ) )
+      {
+      return false;
+      }
+    }
+
+  const unsigned long valuesPerChunk = header.GetValuesPerChunk();
+  values.resize( valuesPerChunk * numberOfChunks );
+  return values.empty()
+         || ::ants::DecodeTransformContainerChunks( chunks, valuesPerChunk, header.HalfPrecision, header.Compressed,
+                                                    &values[0] );
+}
+
+/** Position the stream after the chunks of the field. */
+template <unsigned int VImageDimension>
+void SkipTransformContainerFieldChunks( std::istream & is, const TransformContainerFieldHeader<VImageDimension> & header )
+{
+  unsigned long long offset = 0;
+  for( size_t n = 0; n < header.ChunkSizes.size(); n++ )
+    {
+    offset += header.ChunkSizes[n];
+    }
+  is.seekg( header.DataStart + static_cast<std::streamoff>( offset ) );
+}
+
+template <class T, unsigned int VImageDimension>
+typename itk::Transform<T, VImageDimension, VImageDimension>::Pointer
+ReadTransformContainerParametricTransform( std::istream & is )
+{
+  typedef itk::Transform<T, VImageDimension, VImageDimension> TransformType;
+
+  std::string name;
+  if( !::ants::ReadTransformContainerString( is, name ) )
+    {
+    return ITK_NULLPTR;
+    }
+  // convert the precision of the stored transform to the requested one
+  const std::string precision = sizeof( T ) == sizeof( float ) ? "_float_" : "_double_";
+  const char *      precisions[2] = { "_float_", "_double_" };
+  for( unsigned int p = 0; p < 2; p++ )
+    {
+    const std::string::size_type position = name.find( precisions[p] );
+    if( position != std::string::npos )
+      {
+      name.replace( position, std::string( precisions[p] ).size(), precision );
+      break;
+      }
+    }
+
+  itk::TransformFactoryBase::RegisterDefaultTransforms();
+  itk::LightObject::Pointer       object = itk::ObjectFactoryBase::CreateInstance( name.c_str() );
+  typename TransformType::Pointer transform = dynamic_cast<TransformType *>( object.GetPointer() );
+  if( transform.IsNull() )
+    {
+    std::cerr << "Could not create a transform of type " << name << std::endl;
+    return ITK_NULLPTR;
+    }
+
+  unsigned long long numberOfParameters;
+  double             value;
+  if( !::ants::ReadTransformContainerUInt64( is, numberOfParameters ) )
+    {
+    return ITK_NULLPTR;
+    }
+  typename TransformType::ParametersType parameters( static_cast<unsigned int>( numberOfParameters ) );
+  for( unsigned int n = 0; n < parameters.Size(); n++ )
+    {
+    if( !::ants::ReadTransformContainerDouble( is, value ) )
+      {
+      return ITK_NULLPTR;
+      }
+    parameters[n] = static_cast<typename TransformType::ParametersValueType>( value );
+    }
+  unsigned long long numberOfFixedParameters;
+  if( !::ants::ReadTransformContainerUInt64( is, numberOfFixedParameters ) )
+    {
+    return ITK_NULLPTR;
+    }
+  typename TransformType::FixedParametersType fixedParameters( static_cast<unsigned int>( numberOfFixedParameters ) );
+  for( unsigned int n = 0; n < fixedParameters.Size(); n++ )
+    {
+    if( !::ants::ReadTransformContainerDouble( is, value ) )
+      {
+      return ITK_NULLPTR;
+      }
+    fixedParameters[n] = value;
+    }
+
+  transform->SetFixedParameters( fixedParameters );
+  transform->SetParametersByValue( parameters );
+  return transform;
+}
+
+template <class T, unsigned int VImageDimension>
+typename itk::DisplacementFieldTransform<T, VImageDimension>::DisplacementFieldType::Pointer
+AllocateTransformContainerDisplacementField( const TransformContainerFieldHeader<VImageDimension> & header,
+                                             const ImageRegion<VImageDimension> & region )
+{
+  typedef typename itk::DisplacementFieldTransform<T, VImageDimension>::DisplacementFieldType DisplacementFieldType;
+
+  typename DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+  field->SetRegions( region );
+  field->SetOrigin( header.Origin );
+  field->SetSpacing( header.Spacing );
+  field->SetDirection( header.Direction );
+  field->Allocate();
+  return field;
+}
+
+/** Open filename and position the stream at the first transform. */
+inline bool OpenTransformContainer( std::ifstream & is, const std::string & filename, unsigned int dimension,
+                                    unsigned long & numberOfTransforms )
+{
+  is.open( filename.c_str(), std::ios::in | std::ios::binary );
+  char magic[sizeof( TransformContainerMagic ) - 1];
+  if( !is || !is.read( magic, sizeof( magic ) )
+      || std::string( magic, sizeof( magic ) ) != std::string( TransformContainerMagic ) )
+    {
+    std::cerr << filename << " is not a transform container." << std::endl;
+    return false;
+    }
+  unsigned long version;
+  unsigned long fileDimension;
+  if( !::ants::ReadTransformContainerUInt32( is, version ) || version != TransformContainerVersion
+      || !::ants::ReadTransformContainerUInt32( is, fileDimension ) || fileDimension != dimension
+      || !::ants::ReadTransformContainerUInt32( is, numberOfTransforms ) )
+    {
+    std::cerr << "Unsupported version or dimension of the transform container " << filename << std::endl;
+    return false;
+    }
+  return true;
+}
+
+template <class T, unsigned int VImageDimension>
+typename itk::Transform<T, VImageDimension, VImageDimension>::Pointer
+ReadTransformContainer( const std::string & filename )
+{
+  typedef itk::Transform<T, VImageDimension, VImageDimension>                   TransformType;
+  typedef itk::CompositeTransform<T, VImageDimension>                           CompositeTransformType;
+  typedef itk::DisplacementFieldTransform<T, VImageDimension>                   DisplacementFieldTransformType;
+  typedef typename DisplacementFieldTransformType::DisplacementFieldType        DisplacementFieldType;
+  typedef typename DisplacementFieldType::PixelType                             VectorType;
+
+  std::ifstream is;
+  unsigned long numberOfTransforms;
+  if( !OpenTransformContainer( is, filename, VImageDimension, numberOfTransforms ) )
+    {
+    return ITK_NULLPTR;
+    }
+
+  std::vector<typename TransformType::Pointer> transforms;
+  for( unsigned long i = 0; i < numberOfTransforms; i++ )
+    {
+    unsigned long kind;
+    if( !::ants::ReadTransformContainerUInt32( is, kind ) )
+      {
+      break;
+      }
+    typename TransformType::Pointer transform;
+    if( kind == TransformContainerParametricKind )
+      {
+      transform = ReadTransformContainerParametricTransform<T, VImageDimension>( is );
+      }
+    else if( kind == TransformContainerDisplacementFieldKind )
+      {
+      TransformContainerFieldHeader<VImageDimension> header;
+      std::vector<float>                             values;
+      if( ReadTransformContainerFieldHeader<VImageDimension>( is, header )
+          && ReadTransformContainerFieldChunks<VImageDimension>( is, header, 0, header.ChunkSizes.size(), values ) )
+        {
+        typename DisplacementFieldType::Pointer field =
+          AllocateTransformContainerDisplacementField<T, VImageDimension>( header, header.Region );
+        VectorType *         pixels = field->GetBufferPointer();
+        const unsigned long numberOfPixels = values.size() / VImageDimension;
+        for( unsigned long n = 0; n < numberOfPixels; n++ )
+          {
+          for( unsigned int d = 0; d < VImageDimension; d++ )
+            {
+            pixels[n][d] = static_cast<T>( values[n * VImageDimension + d] );
+            }
+          }
+        typename DisplacementFieldTransformType::Pointer displacementFieldTransform =
+          DisplacementFieldTransformType::New();
+        displacementFieldTransform->SetDisplacementField( field );
+        transform = displacementFieldTransform.GetPointer();
+        }
+      }
+    if( transform.IsNull() )
+      {
+      std::cerr << "Could not read transform " << i << " of " << filename << std::endl;
+      return ITK_NULLPTR;
+      }
+    transforms.push_back( transform );
+    }
+  if( transforms.size() != numberOfTransforms || transforms.empty() )
+    {
+    std::cerr << "Could not read " << filename << std::endl;
+    return ITK_NULLPTR;
+    }
+
+  if( transforms.size() == 1 )
+    {
+    return transforms[0];
+    }
+  typename CompositeTransformType::Pointer compositeTransform = CompositeTransformType::New();
+  for( size_t i = 0; i < transforms.size(); i++ )
+    {
+    compositeTransform->AddTransform( transforms[i] );
+    }
+  return compositeTransform.GetPointer();
+}
+
+/** Read only the given region of the displacement field stored as transform
+ * transformIndex of the container, reading just the slices the region
+ * covers.  The returned field keeps the index of the region. */
+template <class T, unsigned int VImageDimension>
+typename itk::DisplacementFieldTransform<T, VImageDimension>::DisplacementFieldType::Pointer
+ReadTransformContainerDisplacementFieldRegion( const std::string & filename, unsigned int transformIndex,
+                                               const ImageRegion<VImageDimension> & region )
+{
+  typedef itk::DisplacementFieldTransform<T, VImageDimension>            DisplacementFieldTransformType;
+  typedef typename DisplacementFieldTransformType::DisplacementFieldType DisplacementFieldType;
+  typedef typename DisplacementFieldType::PixelType                      VectorType;
+
+  std::ifstream is;
+  unsigned long numberOfTransforms;
+  if( !OpenTransformContainer( is, filename, VImageDimension, numberOfTransforms ) )
+    {
+    return ITK_NULLPTR;
+    }
+
+  for( unsigned long i = 0; i < numberOfTransforms && i <= transformIndex; i++ )
+    {
+    unsigned long kind;
+    if( !::ants::ReadTransformContainerUInt32( is, kind ) )
+      {
+      break;
+      }
+    if( kind == TransformContainerParametricKind )
+      {
+      if( ReadTransformContainerParametricTransform<T, VImageDimension>( is ).IsNull() || i == transformIndex )
+        {
+        break;
+        }
+      continue;
+      }
+
+    TransformContainerFieldHeader<VImageDimension> header;
+    if( kind != TransformContainerDisplacementFieldKind
+        || !ReadTransformContainerFieldHeader<VImageDimension>( is, header ) )
+      {
+      break;
+      }
+    if( i < transformIndex )
+      {
+      SkipTransformContainerFieldChunks<VImageDimension>( is, header );
+      continue;
+      }
+
+    if( !header.Region.IsInside( region ) )
+      {
+      std::cerr << "The region " << region << " is outside of the displacement field " << header.Region
+                << std::endl;
+      return ITK_NULLPTR;
+      }
+    const unsigned long firstChunk = region.GetIndex()[VImageDimension - 1]
+      - header.Region.GetIndex()[VImageDimension - 1];
+    std::vector<float> values;
+    if( !ReadTransformContainerFieldChunks<VImageDimension>( is, header, firstChunk,
+                                                             region.GetSize()[VImageDimension - 1], values ) )
+      {
+      break;
+      }
+
+    typename DisplacementFieldType::Pointer field =
+      AllocateTransformContainerDisplacementField<T, VImageDimension>( header, region );
+    ImageRegionIteratorWithIndex<DisplacementFieldType> It( field, region );
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+      const typename DisplacementFieldType::IndexType index = It.GetIndex();
+
+      unsigned long offset = index[VImageDimension - 1] - region.GetIndex()[VImageDimension - 1];
+      for( int d = VImageDimension - 2; d >= 0; d-- )
+        {
+        offset = offset * header.Region.GetSize()[d] + ( index[d] - header.Region.GetIndex()[d] );
+        }
+      VectorType vector;
+      for( unsigned int d = 0; d < VImageDimension; d++ )
+        {
+        vector[d] = static_cast<T>( values[offset * VImageDimension + d] );
+        }
+      It.Set( vector );
+      }
+    return field;
+    }
+
+  std::cerr << "Transform " << transformIndex << " of " << filename << " is not a displacement field." << std::endl;
+  return ITK_NULLPTR;
+}
+
+/** Store xfrm, or the transforms of a composite xfrm, in filename with the
+ * displacement fields in float32, or in float16 if halfPrecision. */
+template <class T, unsigned int VImageDimension>
+int
+WriteTransformContainer( const typename itk::Transform<T, VImageDimension, VImageDimension>::Pointer & xfrm,
+                         const std::string & filename, bool halfPrecision = false, bool compress = true )
+{
+  typedef itk::Transform<T, VImageDimension, VImageDimension>            TransformType;
+  typedef itk::CompositeTransform<T, VImageDimension>                    CompositeTransformType;
+  typedef itk::DisplacementFieldTransform<T, VImageDimension>            DisplacementFieldTransformType;
+  typedef typename DisplacementFieldTransformType::DisplacementFieldType DisplacementFieldType;
+  typedef typename DisplacementFieldType::PixelType                      VectorType;
+
+  std::vector<const TransformType *> transforms;
+  const CompositeTransformType *     compositeTransform =
+    dynamic_cast<const CompositeTransformType *>( xfrm.GetPointer() );
+  if( compositeTransform )
+    {
+    for( unsigned int n = 0; n < compositeTransform->GetNumberOfTransforms(); n++ )
+      {
+      transforms.push_back( compositeTransform->GetNthTransform( n ).GetPointer() );
+      }
+    }
+  else
+    {
+    transforms.push_back( xfrm.GetPointer() );
+    }
+
+  std::ofstream os( filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !os )
+    {
+    std::cerr << "Can't write transform file " << filename << std::endl;
+    return EXIT_FAILURE;
+    }
+  os.write( TransformContainerMagic, sizeof( TransformContainerMagic ) - 1 );
+  ::ants::WriteTransformContainerUInt32( os, TransformContainerVersion );
+  ::ants::WriteTransformContainerUInt32( os, VImageDimension );
+  ::ants::WriteTransformContainerUInt32( os, transforms.size() );
+
+  for( size_t i = 0; i < transforms.size(); i++ )
+    {
+    if( dynamic_cast<const CompositeTransformType *>( transforms[i] ) )
+      {
+      std::cerr << "Nested composite transforms can't be written to " << filename << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    const DisplacementFieldTransformType *displacementFieldTransform =
+      dynamic_cast<const DisplacementFieldTransformType *>( transforms[i] );
+    if( !displacementFieldTransform )
+      {
+      const typename TransformType::ParametersType &      parameters = transforms[i]->GetParameters();
+      const typename TransformType::FixedParametersType & fixedParameters = transforms[i]->GetFixedParameters();
+
+      ::ants::WriteTransformContainerUInt32( os, TransformContainerParametricKind );
+      ::ants::WriteTransformContainerString( os, transforms[i]->GetTransformTypeAsString() );
+      ::ants::WriteTransformContainerUInt64( os, parameters.Size() );
+      for( unsigned int n = 0; n < parameters.Size(); n++ )
+        {
+        ::ants::WriteTransformContainerDouble( os, static_cast<double>( parameters[n] ) );
+        }
+      ::ants::WriteTransformContainerUInt64( os, fixedParameters.Size() );
+      for( unsigned int n = 0; n < fixedParameters.Size(); n++ )
+        {
+        ::ants::WriteTransformContainerDouble( os, static_cast<double>( fixedParameters[n] ) );
+        }
+      continue;
+      }
+
+    const DisplacementFieldType *field = displacementFieldTransform->GetDisplacementField();
+    const ImageRegion<VImageDimension> region = field->GetLargestPossibleRegion();
+    if( field->GetBufferedRegion() != region )
+      {
+      std::cerr << "The displacement field of transform " << i << " is not fully buffered." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    ::ants::WriteTransformContainerUInt32( os, TransformContainerDisplacementFieldKind );
+    ::ants::WriteTransformContainerUInt32( os, ( halfPrecision ? TransformContainerHalfPrecisionFlag : 0 )
+                                           | ( compress ? TransformContainerCompressedFlag : 0 ) );
+    for( unsigned int d = 0; d < VImageDimension; d++ )
+      {
+      ::ants::WriteTransformContainerUInt64( os, static_cast<unsigned long long>(
+                                               static_cast<long long>( region.GetIndex()[d] ) ) );
+      }
+    for( unsigned int d = 0; d < VImageDimension; d++ )
+      {
+      ::ants::WriteTransformContainerUInt64( os, region.GetSize()[d] );
+      }
+    for( unsigned int d = 0; d < VImageDimension; d++ )
+      {
+      ::ants::WriteTransformContainerDouble( os, field->GetOrigin()[d] );
+      }
+    for( unsigned int d = 0; d < VImageDimension; d++ )
+      {
+      ::ants::WriteTransformContainerDouble( os, field->GetSpacing()[d] );
+      }
+    for( unsigned int r = 0; r < VImageDimension; r++ )
+      {
+      for( unsigned int c = 0; c < VImageDimension; c++ )
+        {
+        ::ants::WriteTransformContainerDouble( os, field->GetDirection()[r][c] );
+        }
+      }
+
+    const unsigned long numberOfPixels = region.GetNumberOfPixels();
+    const VectorType *  pixels = field->GetBufferPointer();
+    std::vector<float>  values( numberOfPixels * VImageDimension );
+    for( unsigned long n = 0; n < numberOfPixels; n++ )
+      {
+      for( unsigned int d = 0; d < VImageDimension; d++ )
+        {
+        values[n * VImageDimension + d] = static_cast<float>( pixels[n][d] );
+        }
+      }
+
+    const unsigned long numberOfChunks = region.GetSize()[VImageDimension - 1];
+    std::vector< ::ants::TransformContainerChunkType> chunks;
+    if( !::ants::EncodeTransformContainerChunks( values.empty() ? ITK_NULLPTR : &values[0],
+                                                 numberOfChunks > 0 ? values.size() / numberOfChunks : 0,
+                                                 numberOfChunks, halfPrecision, compress, chunks ) )
+      {
+      std::cerr << "Can't compress the displacement field of transform " << i << std::endl;
+      return EXIT_FAILURE;
+      }
+    ::ants::WriteTransformContainerUInt64( os, chunks.size() );
+    for( size_t n = 0; n < chunks.size(); n++ )
+      {
+      ::ants::WriteTransformContainerUInt64( os, chunks[n].size() );
+      }
+    for( size_t n = 0; n < chunks.size(); n++ )
+      {
+      if( !chunks[n].empty() )
+        {
+        os.write( reinterpret_cast<const char *>( &chunks[n][0] ), chunks[n].size() );
+        }
+      }
+    }
+
+  os.close();
+  if( os.fail() )
+    {
+    std::cerr << "Can't write transform file " << filename << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+} // end namespace ants
+} // end namespace itk
+
+#endif // itkantsTransformContainer_h